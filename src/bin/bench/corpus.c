@@ -0,0 +1,111 @@
+/*
+ * lwan - web server
+ * Copyright (c) 2024 L. A. F. Pereira <l@tia.mat.br>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "corpus.h"
+
+static int compare_names(const void *a, const void *b)
+{
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+static bool read_input(struct input *input, const char *path)
+{
+    FILE *f = fopen(path, "rb");
+    long len;
+
+    if (!f)
+        return false;
+    if (fseek(f, 0, SEEK_END) < 0 || (len = ftell(f)) < 0 ||
+        fseek(f, 0, SEEK_SET) < 0)
+        goto error;
+
+    input->data = malloc((size_t)len + 1);
+    if (!input->data)
+        goto error;
+    if (fread(input->data, 1, (size_t)len, f) != (size_t)len) {
+        free(input->data);
+        goto error;
+    }
+    input->data[len] = '\0';
+    input->len = (size_t)len;
+
+    fclose(f);
+    return true;
+
+error:
+    fclose(f);
+    return false;
+}
+
+void corpus_load(struct corpus *corpus, const char *dir, const char *kind)
+{
+    char prefix[64], path[PATH_MAX];
+    char **names = NULL;
+    size_t n_names = 0;
+    struct dirent *ent;
+    DIR *d = opendir(dir);
+
+    if (!d) {
+        fprintf(stderr, "Could not open corpus directory %s\n", dir);
+        exit(1);
+    }
+
+    snprintf(prefix, sizeof(prefix), "corpus-%s-", kind);
+    while ((ent = readdir(d))) {
+        if (strncmp(ent->d_name, prefix, strlen(prefix)))
+            continue;
+
+        char **new_names = realloc(names, (n_names + 1) * sizeof(*names));
+        if (!new_names || !(new_names[n_names] = strdup(ent->d_name))) {
+            fprintf(stderr, "Could not allocate memory\n");
+            exit(1);
+        }
+        names = new_names;
+        n_names++;
+    }
+    closedir(d);
+
+    if (!n_names) {
+        fprintf(stderr, "No %s inputs in %s\n", kind, dir);
+        exit(1);
+    }
+
+    qsort(names, n_names, sizeof(*names), compare_names);
+
+    corpus->inputs = calloc(n_names, sizeof(*corpus->inputs));
+    if (!corpus->inputs) {
+        fprintf(stderr, "Could not allocate memory\n");
+        exit(1);
+    }
+    for (size_t i = 0; i < n_names; i++) {
+        snprintf(path, sizeof(path), "%s/%s", dir, names[i]);
+        if (read_input(&corpus->inputs[corpus->n_inputs], path))
+            corpus->n_inputs++;
+        free(names[i]);
+    }
+    free(names);
+}
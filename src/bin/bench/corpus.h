@@ -0,0 +1,43 @@
+/*
+ * lwan - web server
+ * Copyright (c) 2024 L. A. F. Pereira <l@tia.mat.br>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#pragma once
+
+#include <stddef.h>
+
+struct input {
+    char *data; /* NUL-terminated */
+    size_t len;
+};
+
+struct corpus {
+    struct input *inputs;
+    size_t n_inputs;
+};
+
+/* Loads all files named "corpus-@kind-*" in @dir (as written by the
+ * fuzzers, or by save_to_corpus_for_fuzzing()), sorted by name so that
+ * runs are comparable.  Exits if there are none. */
+void corpus_load(struct corpus *corpus, const char *dir, const char *kind);
+
+static inline const struct input *corpus_pick(const struct corpus *corpus,
+                                              size_t i)
+{
+    return &corpus->inputs[i % corpus->n_inputs];
+}
@@ -0,0 +1,621 @@
+/*
+ * lwan - web server
+ * Copyright (c) 2024 L. A. F. Pereira <l@tia.mat.br>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+/* Microbenchmarks for the primitives the request path is built from, using
+ * the fuzzing corpora as inputs.  Each benchmark cycles through its inputs
+ * and reports the time and the number of input bytes per operation.
+ * Usage: microbench [-c corpus-dir] [-t seconds] [name...] */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "base64.h"
+#include "corpus.h"
+#include "hash.h"
+#include "int-to-str.h"
+#include "json.h"
+#include "lwan-private.h"
+#include "lwan-template.h"
+#include "lwan-trie.h"
+#include "patterns.h"
+#include "sha1.h"
+
+struct benchmark {
+    const char *name;
+    bool (*setup)(void);
+    /* Performs operation number @i, returning the number of bytes it
+     * processed. */
+    size_t (*run)(size_t i);
+    void (*teardown)(void);
+};
+
+static struct corpus requests, patterns, templates;
+
+/* Written to after each operation so the compiler can't drop them. */
+static volatile uintptr_t sink;
+
+/* Keys extracted from the request corpus: request paths and header names,
+ * which is what hash tables and tries are mostly looked up with. */
+static char **keys;
+static size_t n_keys;
+
+static void add_key(const char *key, size_t len)
+{
+    char **new_keys = realloc(keys, (n_keys + 1) * sizeof(*keys));
+
+    if (!new_keys || !(new_keys[n_keys] = strndup(key, len))) {
+        fprintf(stderr, "Could not allocate memory\n");
+        exit(1);
+    }
+    keys = new_keys;
+    n_keys++;
+}
+
+static void extract_keys(void)
+{
+    for (size_t i = 0; i < requests.n_inputs; i++) {
+        const char *line = requests.inputs[i].data;
+        const char *path = strchr(line, ' ');
+
+        if (path) {
+            size_t len = strcspn(path + 1, " ?\r\n");
+            if (len && path[1] == '/')
+                add_key(path + 1, len);
+        }
+
+        while ((line = strstr(line, "\r\n"))) {
+            line += 2;
+
+            size_t len = strcspn(line, ":\r\n");
+            if (len && line[len] == ':')
+                add_key(line, len);
+        }
+    }
+}
+
+static struct hash *hash;
+
+static bool hash_setup(void)
+{
+    hash = hash_str_new(NULL, NULL);
+    if (!hash)
+        return false;
+
+    for (size_t i = 0; i < n_keys; i++)
+        hash_add(hash, keys[i], keys[i]);
+    return true;
+}
+
+static size_t hash_run(size_t i)
+{
+    const char *key = keys[i % n_keys];
+
+    sink = (uintptr_t)hash_find(hash, key);
+    return strlen(key);
+}
+
+static void hash_teardown(void) { hash_unref(hash); }
+
+static struct lwan_trie trie;
+
+static bool trie_setup(void)
+{
+    if (!lwan_trie_init(&trie, NULL))
+        return false;
+
+    for (size_t i = 0; i < n_keys; i++) {
+        if (keys[i][0] == '/')
+            lwan_trie_add(&trie, keys[i], keys[i]);
+    }
+    return lwan_trie_compact(&trie);
+}
+
+static size_t trie_run(size_t i)
+{
+    const char *key = keys[i % n_keys];
+
+    sink = (uintptr_t)lwan_trie_lookup_prefix(&trie, key);
+    return strlen(key);
+}
+
+static void trie_teardown(void) { lwan_trie_destroy(&trie); }
+
+static struct lwan_strbuf strbuf;
+
+static bool strbuf_setup(void) { return lwan_strbuf_init(&strbuf); }
+
+/* Appends an input in chunks the size of a typical header line, as response
+ * headers and templates do. */
+static size_t strbuf_run(size_t i)
+{
+    const struct input *input = corpus_pick(&requests, i);
+
+    lwan_strbuf_reset(&strbuf);
+    for (size_t off = 0; off < input->len; off += 48) {
+        lwan_strbuf_append_str(&strbuf, input->data + off,
+                               LWAN_MIN((size_t)48, input->len - off));
+    }
+    sink = lwan_strbuf_get_length(&strbuf);
+    return input->len;
+}
+
+static size_t strbuf_printf_run(size_t i)
+{
+    lwan_strbuf_reset(&strbuf);
+    lwan_strbuf_append_printf(&strbuf, "Content-Length: %zu\r\n", i);
+    sink = lwan_strbuf_get_length(&strbuf);
+    return lwan_strbuf_get_length(&strbuf);
+}
+
+static void strbuf_teardown(void) { lwan_strbuf_free(&strbuf); }
+
+static size_t int_to_str_run(size_t i)
+{
+    char buffer[INT_TO_STR_BUFFER_SIZE];
+    size_t len;
+
+    /* Spread values over a wide range of lengths */
+    sink = (uintptr_t)int_to_string((ssize_t)(i * 2654435761u) >> (i & 31),
+                                    buffer, &len);
+    return len;
+}
+
+static size_t base64_encode_run(size_t i)
+{
+    const struct input *input = corpus_pick(&requests, i);
+    size_t len;
+    unsigned char *encoded =
+        base64_encode((const unsigned char *)input->data, input->len, &len);
+
+    sink = (uintptr_t)len;
+    free(encoded);
+    return input->len;
+}
+
+static struct corpus encoded_requests;
+
+static bool base64_decode_setup(void)
+{
+    encoded_requests.inputs =
+        calloc(requests.n_inputs, sizeof(*encoded_requests.inputs));
+    if (!encoded_requests.inputs)
+        return false;
+
+    for (size_t i = 0; i < requests.n_inputs; i++) {
+        struct input *input = &encoded_requests.inputs[i];
+
+        input->data = (char *)base64_encode(
+            (const unsigned char *)requests.inputs[i].data,
+            requests.inputs[i].len, &input->len);
+        if (!input->data)
+            return false;
+        encoded_requests.n_inputs++;
+    }
+    return true;
+}
+
+static size_t base64_decode_run(size_t i)
+{
+    const struct input *input = corpus_pick(&encoded_requests, i);
+    size_t len;
+    unsigned char *decoded =
+        base64_decode((const unsigned char *)input->data, input->len, &len);
+
+    sink = (uintptr_t)len;
+    free(decoded);
+    return input->len;
+}
+
+static void base64_decode_teardown(void)
+{
+    for (size_t i = 0; i < encoded_requests.n_inputs; i++)
+        free(encoded_requests.inputs[i].data);
+    free(encoded_requests.inputs);
+    encoded_requests = (struct corpus){};
+}
+
+static size_t sha1_run(size_t i)
+{
+    const struct input *input = corpus_pick(&requests, i);
+    unsigned char digest[20];
+    sha1_context ctx;
+
+    sha1_init(&ctx);
+    sha1_update(&ctx, (const unsigned char *)input->data, input->len);
+    sha1_finalize(&ctx, digest);
+    sink = digest[0];
+    return input->len;
+}
+
+static size_t patterns_run(size_t i)
+{
+    /* Same patterns as the ones used by the fuzzer */
+    static const char *const pats[] = {
+        "foo/(%d+)(%a)(%d+)",
+        "bar/(%d+)/test",
+        "lua/rewrite/(%d+)x(%d+)",
+    };
+    const struct input *input = corpus_pick(&patterns, i);
+    struct str_find sf[16];
+    const char *errmsg;
+
+    sink = (uintptr_t)str_find(input->data, pats[i % N_ELEMENTS(pats)], sf,
+                               N_ELEMENTS(sf), &errmsg);
+    return input->len;
+}
+
+/* Parsing modifies the buffer, so include the copy a read from the
+ * socket would have done. */
+static char request_buffer[32768];
+
+static size_t request_parse_run(size_t i)
+{
+    const struct input *input = corpus_pick(&requests, i);
+    size_t len = LWAN_MIN(input->len, sizeof(request_buffer) - 1);
+
+    memcpy(request_buffer, input->data, len);
+    request_buffer[len] = '\0';
+    sink = (uintptr_t)lwan_request_parse_buffer(request_buffer, len);
+    return len;
+}
+
+/* Each request in the corpus is wrapped in one of these to get JSON
+ * documents that are mostly made of (escaped) strings, like most request
+ * bodies are. */
+struct message {
+    const char *path;
+    const char *text;
+    int32_t length;
+    bool complete;
+};
+
+static const struct json_obj_descr message_descr[] = {
+    JSON_OBJ_DESCR_PRIM(struct message, path, JSON_TOK_STRING),
+    JSON_OBJ_DESCR_PRIM(struct message, text, JSON_TOK_STRING),
+    JSON_OBJ_DESCR_PRIM(struct message, length, JSON_TOK_NUMBER),
+    JSON_OBJ_DESCR_PRIM(struct message, complete, JSON_TOK_TRUE),
+};
+
+static struct message message_from_input(const struct input *input)
+{
+    return (struct message){
+        .path = "/api/v1/messages",
+        .text = input->data,
+        .length = (int32_t)input->len,
+        .complete = !!memmem(input->data, input->len, "\r\n\r\n", 4),
+    };
+}
+
+static int encode_message(const struct input *input)
+{
+    struct message msg = message_from_input(input);
+
+    lwan_strbuf_reset(&strbuf);
+    return json_obj_encode_strbuf(message_descr, N_ELEMENTS(message_descr),
+                                  &msg, &strbuf, false);
+}
+
+static size_t json_encode_run(size_t i)
+{
+    encode_message(corpus_pick(&requests, i));
+    sink = lwan_strbuf_get_length(&strbuf);
+    return lwan_strbuf_get_length(&strbuf);
+}
+
+static struct json_encoder *message_encoder;
+
+static bool json_encoder_setup(void)
+{
+    message_encoder =
+        json_obj_encoder_new(message_descr, N_ELEMENTS(message_descr));
+    return message_encoder && lwan_strbuf_init(&strbuf);
+}
+
+static size_t json_encoder_run(size_t i)
+{
+    struct message msg = message_from_input(corpus_pick(&requests, i));
+
+    lwan_strbuf_reset(&strbuf);
+    json_encoder_encode_strbuf(message_encoder, &msg, &strbuf);
+    sink = lwan_strbuf_get_length(&strbuf);
+    return lwan_strbuf_get_length(&strbuf);
+}
+
+static void json_encoder_teardown(void)
+{
+    json_encoder_free(message_encoder);
+    lwan_strbuf_free(&strbuf);
+}
+
+static struct corpus encoded_messages;
+
+static bool json_parse_setup(void)
+{
+    if (!lwan_strbuf_init(&strbuf))
+        return false;
+
+    encoded_messages.inputs =
+        calloc(requests.n_inputs, sizeof(*encoded_messages.inputs));
+    if (!encoded_messages.inputs)
+        return false;
+
+    for (size_t i = 0; i < requests.n_inputs; i++) {
+        struct input *input = &encoded_messages.inputs[i];
+
+        if (encode_message(&requests.inputs[i]) < 0)
+            return false;
+        input->len = lwan_strbuf_get_length(&strbuf);
+        input->data = strndup(lwan_strbuf_get_buffer(&strbuf), input->len);
+        if (!input->data)
+            return false;
+        encoded_messages.n_inputs++;
+    }
+    return true;
+}
+
+/* Decoding writes NUL terminators into the document, so this includes a
+ * copy, like request_parse does. */
+static size_t json_parse_run(size_t i)
+{
+    const struct input *input = corpus_pick(&encoded_messages, i);
+    size_t len = LWAN_MIN(input->len, sizeof(request_buffer) - 1);
+    struct message msg;
+
+    memcpy(request_buffer, input->data, len);
+    request_buffer[len] = '\0';
+    sink = (uintptr_t)json_obj_parse(request_buffer, len, message_descr,
+                                     N_ELEMENTS(message_descr), &msg);
+    return len;
+}
+
+static void json_parse_teardown(void)
+{
+    for (size_t i = 0; i < encoded_messages.n_inputs; i++)
+        free(encoded_messages.inputs[i].data);
+    free(encoded_messages.inputs);
+    encoded_messages = (struct corpus){};
+    lwan_strbuf_free(&strbuf);
+}
+
+/* Variables for the directory listing template in the corpus. */
+struct file_list {
+    const char *full_path;
+    const char *rel_path;
+    const char *readme;
+    struct {
+        coro_function_t generator;
+
+        const char *icon;
+        const char *icon_alt;
+        const char *name;
+        const char *type;
+
+        int size;
+        const char *unit;
+
+        const char *zebra_class;
+    } file_list;
+};
+
+static int file_list_generator(struct coro *coro, void *data)
+{
+    struct file_list *fl = data;
+
+    for (int i = 0; i < 16; i++) {
+        fl->file_list.icon = i & 1 ? "file" : "folder";
+        fl->file_list.icon_alt = i & 1 ? "FILE" : "DIR";
+        fl->file_list.name = "some-file-name.txt";
+        fl->file_list.type = "text/plain";
+        fl->file_list.size = i * 1024;
+        fl->file_list.unit = "KiB";
+        fl->file_list.zebra_class = i & 1 ? "odd" : "even";
+
+        if (coro_yield(coro, 1))
+            break;
+    }
+
+    return 0;
+}
+
+#undef TPL_STRUCT
+#define TPL_STRUCT struct file_list
+static const struct lwan_var_descriptor file_list_desc[] = {
+    TPL_VAR_STR_ESCAPE(full_path),
+    TPL_VAR_STR_ESCAPE(rel_path),
+    TPL_VAR_STR_ESCAPE(readme),
+    TPL_VAR_SEQUENCE(file_list,
+                     file_list_generator,
+                     ((const struct lwan_var_descriptor[]){
+                         TPL_VAR_STR(file_list.icon),
+                         TPL_VAR_STR(file_list.icon_alt),
+                         TPL_VAR_STR(file_list.name),
+                         TPL_VAR_STR(file_list.type),
+                         TPL_VAR_INT(file_list.size),
+                         TPL_VAR_STR(file_list.unit),
+                         TPL_VAR_STR(file_list.zebra_class),
+                         TPL_VAR_SENTINEL,
+                     })),
+    TPL_VAR_SENTINEL,
+};
+
+static size_t template_compile_run(size_t i)
+{
+    const struct input *input = corpus_pick(&templates, i);
+    struct lwan_tpl *tpl = lwan_tpl_compile_string_full(
+        input->data, file_list_desc, LWAN_TPL_FLAG_CONST_TEMPLATE);
+
+    sink = (uintptr_t)tpl;
+    if (tpl)
+        lwan_tpl_free(tpl);
+    return input->len;
+}
+
+static struct lwan_tpl *tpl;
+
+static bool template_apply_setup(void)
+{
+    tpl = lwan_tpl_compile_string_full(corpus_pick(&templates, 0)->data,
+                                       file_list_desc,
+                                       LWAN_TPL_FLAG_CONST_TEMPLATE);
+    return tpl && lwan_strbuf_init(&strbuf);
+}
+
+static size_t template_apply_run(size_t i __attribute__((unused)))
+{
+    struct file_list vars = {
+        .full_path = "/var/www/some/directory",
+        .rel_path = "some/directory",
+        .readme = "<not escaped & \"quoted\">",
+    };
+
+    lwan_strbuf_reset(&strbuf);
+    lwan_tpl_apply_with_buffer(tpl, &strbuf, &vars);
+    sink = lwan_strbuf_get_length(&strbuf);
+    return lwan_strbuf_get_length(&strbuf);
+}
+
+static void template_apply_teardown(void)
+{
+    lwan_tpl_free(tpl);
+    lwan_strbuf_free(&strbuf);
+}
+
+static const struct benchmark benchmarks[] = {
+    {"hash_find", hash_setup, hash_run, hash_teardown},
+    {"trie_lookup_prefix", trie_setup, trie_run, trie_teardown},
+    {"strbuf_append_str", strbuf_setup, strbuf_run, strbuf_teardown},
+    {"strbuf_append_printf", strbuf_setup, strbuf_printf_run, strbuf_teardown},
+    {"int_to_string", NULL, int_to_str_run, NULL},
+    {"base64_encode", NULL, base64_encode_run, NULL},
+    {"base64_decode", base64_decode_setup, base64_decode_run,
+     base64_decode_teardown},
+    {"sha1", NULL, sha1_run, NULL},
+    {"str_find", NULL, patterns_run, NULL},
+    {"request_parse", NULL, request_parse_run, NULL},
+    {"json_encode", strbuf_setup, json_encode_run, strbuf_teardown},
+    {"json_encoder", json_encoder_setup, json_encoder_run,
+     json_encoder_teardown},
+    {"json_parse", json_parse_setup, json_parse_run, json_parse_teardown},
+    {"template_compile", NULL, template_compile_run, NULL},
+    {"template_apply", template_apply_setup, template_apply_run,
+     template_apply_teardown},
+};
+
+static double elapsed_ns(const struct timespec *start, const struct timespec *end)
+{
+    return (double)(end->tv_sec - start->tv_sec) * 1e9 +
+           (double)(end->tv_nsec - start->tv_nsec);
+}
+
+/* Grows the number of iterations until a run takes at least @min_ns, then
+ * reports that run. */
+static void run_benchmark(const struct benchmark *b, double min_ns)
+{
+    size_t iterations = 100;
+
+    if (b->setup && !b->setup()) {
+        fprintf(stderr, "%s: setup failed\n", b->name);
+        exit(1);
+    }
+
+    while (true) {
+        struct timespec start, end;
+        size_t bytes = 0;
+
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for (size_t i = 0; i < iterations; i++)
+            bytes += b->run(i);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+
+        double ns = elapsed_ns(&start, &end);
+        if (ns >= min_ns) {
+            printf("%-22s %12zu %10.1f ns/op %10.1f bytes/op %10.1f MB/s\n",
+                   b->name, iterations, ns / (double)iterations,
+                   (double)bytes / (double)iterations,
+                   (double)bytes * 1e3 / ns);
+            break;
+        }
+
+        /* Aim a bit past the target, but don't grow too fast if the
+         * previous run was too short to be meaningful. */
+        double scale = ns > 0 ? 1.2 * min_ns / ns : 100;
+        iterations = (size_t)((double)iterations * LWAN_MIN(scale, 100.0)) + 1;
+    }
+
+    if (b->teardown)
+        b->teardown();
+}
+
+static bool selected(const char *name, int argc, char *argv[])
+{
+    if (argc == 0)
+        return true;
+
+    for (int i = 0; i < argc; i++) {
+        if (strstr(name, argv[i]))
+            return true;
+    }
+    return false;
+}
+
+int main(int argc, char *argv[])
+{
+    const char *corpus_dir = CORPUS_DIR;
+    double seconds = 0.5;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "c:t:")) != -1) {
+        switch (opt) {
+        case 'c':
+            corpus_dir = optarg;
+            break;
+        case 't':
+            seconds = atof(optarg);
+            if (seconds <= 0) {
+                fprintf(stderr, "Invalid time: %s\n", optarg);
+                return 1;
+            }
+            break;
+        default:
+            fprintf(stderr,
+                    "Usage: %s [-c corpus-dir] [-t seconds] [name...]\n",
+                    argv[0]);
+            return 1;
+        }
+    }
+
+    corpus_load(&requests, corpus_dir, "request");
+    corpus_load(&patterns, corpus_dir, "pattern");
+    corpus_load(&templates, corpus_dir, "template");
+    extract_keys();
+
+    printf("%zu requests, %zu patterns, %zu templates, %zu keys\n",
+           requests.n_inputs, patterns.n_inputs, templates.n_inputs, n_keys);
+
+    for (size_t i = 0; i < N_ELEMENTS(benchmarks); i++) {
+        if (selected(benchmarks[i].name, argc - optind, argv + optind))
+            run_benchmark(&benchmarks[i], seconds * 1e9);
+    }
+
+    return 0;
+}
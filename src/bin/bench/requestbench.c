@@ -0,0 +1,334 @@
+/*
+ * lwan - web server
+ * Copyright (c) 2024 L. A. F. Pereira <l@tia.mat.br>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+/* Replays a corpus of recorded requests (such as the ones written by
+ * save_to_corpus_for_fuzzing()) through the request parser alone, and then
+ * through lwan_process_request() with a small handler, on a single thread
+ * and without reading from or writing to any socket.  Reports requests per
+ * second on that core for both.
+ * Usage: requestbench [-c corpus-dir] [-t seconds] */
+
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "corpus.h"
+#include "lwan-private.h"
+
+struct replay {
+    struct lwan *lwan;
+    struct lwan_connection *conn;
+    struct coro_switcher switcher;
+    struct coro *coro;
+    int fd;
+
+    const struct input **inputs;
+    size_t n_inputs;
+    size_t next;
+
+    size_t processed;
+    size_t response_bytes;
+};
+
+LWAN_HANDLER(replay)
+{
+    const char *name = lwan_request_get_query_param(request, "name");
+    const char *host = lwan_request_get_header(request, "Host");
+
+    LWAN_NO_DISCARD(lwan_request_get_cookie(request, "session"));
+
+    response->mime_type = "text/plain";
+    lwan_strbuf_printf(response->buffer, "Hello, %s, from %s!",
+                       name ? name : "world", host ? host : "nowhere");
+
+    return HTTP_OK;
+}
+
+static void free_strbuf(void *data) { lwan_strbuf_free(data); }
+
+/* Follows every request in the buffer, so that it looks pipelined: this
+ * makes lwan_response() queue the response rather than sending it. */
+static const char pipelined_request[] = "GET / HTTP/1.1\r\n\r\n";
+
+/* Like process_request_coro(), but the request buffer is filled from the
+ * corpus rather than from a socket, and responses are queued and then
+ * dropped instead of being sent. */
+static int replay_coro(struct coro *coro, void *data)
+{
+    struct replay *r = data;
+    char *header_start[N_HEADER_START];
+    uint16_t header_index[N_HEADER_INDEX];
+    char request_buffer[DEFAULT_BUFFER_SIZE];
+    struct lwan_strbuf strbuf = LWAN_STRBUF_STATIC_INIT;
+    struct lwan_strbuf queued_responses = LWAN_STRBUF_STATIC_INIT;
+    struct lwan_proxy proxy;
+
+    coro_defer(coro, free_strbuf, &strbuf);
+    coro_defer(coro, free_strbuf, &queued_responses);
+
+    const size_t init_gen = coro_deferred_get_generation(coro);
+
+    while (true) {
+        const struct input *input = r->inputs[r->next++ % r->n_inputs];
+        struct lwan_value buffer = {
+            .value = request_buffer,
+            .len = input->len + sizeof(pipelined_request) - 1,
+        };
+
+        memcpy(request_buffer, input->data, input->len);
+        memcpy(request_buffer + input->len, pipelined_request,
+               sizeof(pipelined_request));
+
+        /* Pointing next_request at the beginning of the buffer makes
+         * read_request() take it as a pipelined request that has been read
+         * already. */
+        struct lwan_request_parser_helper helper = {
+            .buffer = &buffer,
+            .next_request = request_buffer,
+            .error_when_n_packets = lwan_calculate_n_packets(DEFAULT_BUFFER_SIZE),
+            .header_start = header_start,
+            .header_index = header_index,
+            .queued_responses = &queued_responses,
+        };
+        struct lwan_request request = {
+            .conn = r->conn,
+            .global_response_headers = &r->lwan->headers,
+            .fd = r->fd,
+            .response = {.buffer = &strbuf},
+            .proxy = &proxy,
+            .helper = &helper,
+        };
+
+        r->conn->flags = CONN_CORK;
+        lwan_process_request(r->lwan, &request);
+
+        r->response_bytes += lwan_strbuf_get_length(&queued_responses);
+        lwan_strbuf_reset(&queued_responses);
+        coro_deferred_run(coro, init_gen);
+        lwan_strbuf_reset_trim(&strbuf, 2048);
+
+        r->processed++;
+        coro_yield(coro, CONN_CORO_WANT_READ);
+    }
+
+    return 0;
+}
+
+/* Processes @count requests, recording in @aborted (if not NULL) which
+ * inputs made the coroutine abort: those with a body, as reading it fails,
+ * and those with a response that has to be sent right away (e.g. when the
+ * connection is going to be closed).  Returns how many did. */
+static size_t replay(struct replay *r, size_t count, bool *aborted)
+{
+    size_t n_aborted = 0;
+
+    for (size_t done = 0; done < count;) {
+        if (!r->coro) {
+            r->coro = coro_new(&r->switcher, replay_coro, r);
+            if (!r->coro) {
+                fprintf(stderr, "Could not create coroutine\n");
+                exit(1);
+            }
+            r->conn->coro = r->coro;
+        }
+
+        const size_t current = r->next;
+        const size_t processed = r->processed;
+
+        if (coro_resume(r->coro) == CONN_CORO_ABORT) {
+            coro_free(r->coro);
+            r->coro = NULL;
+            r->next = current + 1;
+
+            if (aborted)
+                aborted[current % r->n_inputs] = true;
+            n_aborted++;
+            done++;
+        } else if (r->processed != processed) {
+            done++;
+        }
+    }
+
+    return n_aborted;
+}
+
+static double now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec * 1e9 + (double)ts.tv_nsec;
+}
+
+static void report(const char *name, size_t requests, double ns)
+{
+    printf("%-8s %10zu requests %10.1f ns/request %12.0f requests/s/core\n",
+           name, requests, ns / (double)requests,
+           (double)requests * 1e9 / ns);
+}
+
+static void bench_parse(const struct replay *r, double min_ns)
+{
+    static char buffer[DEFAULT_BUFFER_SIZE];
+    size_t requests = 0;
+    double start = now_ns(), elapsed;
+
+    do {
+        for (size_t i = 0; i < r->n_inputs; i++) {
+            const struct input *input = r->inputs[i];
+
+            memcpy(buffer, input->data, input->len);
+            buffer[input->len] = '\0';
+            LWAN_NO_DISCARD(lwan_request_parse_buffer(buffer, input->len));
+        }
+        requests += r->n_inputs;
+    } while ((elapsed = now_ns() - start) < min_ns);
+
+    report("parse", requests, elapsed);
+}
+
+static void bench_process(struct replay *r, double min_ns)
+{
+    size_t requests = 0;
+    double start = now_ns(), elapsed;
+
+    r->next = 0;
+    r->response_bytes = 0;
+    do {
+        if (replay(r, r->n_inputs, NULL)) {
+            fprintf(stderr, "Request aborted after warm-up\n");
+            exit(1);
+        }
+        requests += r->n_inputs;
+    } while ((elapsed = now_ns() - start) < min_ns);
+
+    report("process", requests, elapsed);
+    printf("%zu response bytes/request\n", r->response_bytes / requests);
+}
+
+int main(int argc, char *argv[])
+{
+    const char *corpus_dir = CORPUS_DIR;
+    double seconds = 2;
+    struct corpus corpus = {};
+    char listener[64];
+    struct lwan l;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "c:t:")) != -1) {
+        switch (opt) {
+        case 'c':
+            corpus_dir = optarg;
+            break;
+        case 't':
+            seconds = atof(optarg);
+            if (seconds <= 0) {
+                fprintf(stderr, "Invalid time: %s\n", optarg);
+                return 1;
+            }
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-c corpus-dir] [-t seconds]\n",
+                    argv[0]);
+            return 1;
+        }
+    }
+
+    corpus_load(&corpus, corpus_dir, "request");
+
+    /* Worker threads are started, but nothing ever connects to this
+     * listener: all requests are processed on this thread. */
+    struct lwan_config config = *lwan_get_default_config();
+    snprintf(listener, sizeof(listener), "unix:@lwan-requestbench-%d",
+             (int)getpid());
+    config.listener = listener;
+    config.n_threads = 1;
+    config.quiet = true;
+
+    lwan_init_with_config(&l, &config);
+    lwan_set_url_map(&l, (const struct lwan_url_map[]){
+                             {.prefix = "/", .handler = LWAN_HANDLER_REF(replay)},
+                             {},
+                         });
+
+    struct replay r = {.lwan = &l, .fd = open("/dev/null", O_RDWR | O_CLOEXEC)};
+    if (r.fd < 0) {
+        perror("Could not open /dev/null");
+        return 1;
+    }
+    r.conn = &l.conns[r.fd];
+    r.conn->thread = &l.thread.threads[0];
+
+    /* Only complete requests that fit in the default request buffer
+     * (along with pipelined_request) can be replayed. */
+    r.inputs = calloc(corpus.n_inputs, sizeof(*r.inputs));
+    if (!r.inputs) {
+        fprintf(stderr, "Could not allocate memory\n");
+        return 1;
+    }
+    for (size_t i = 0; i < corpus.n_inputs; i++) {
+        const struct input *input = &corpus.inputs[i];
+
+        if (input->len + sizeof(pipelined_request) <= DEFAULT_BUFFER_SIZE &&
+            memmem(input->data, input->len, "\r\n\r\n", 4))
+            r.inputs[r.n_inputs++] = input;
+    }
+    if (!r.n_inputs) {
+        fprintf(stderr, "No usable requests in %s\n", corpus_dir);
+        return 1;
+    }
+
+    /* Warm up, and leave out requests that can't be processed without
+     * reading from or writing to the client. */
+    bool *aborted = calloc(r.n_inputs, sizeof(*aborted));
+    if (!aborted) {
+        fprintf(stderr, "Could not allocate memory\n");
+        return 1;
+    }
+    replay(&r, r.n_inputs, aborted);
+    size_t n_usable = 0;
+    for (size_t i = 0; i < r.n_inputs; i++) {
+        if (!aborted[i])
+            r.inputs[n_usable++] = r.inputs[i];
+    }
+    free(aborted);
+    r.n_inputs = n_usable;
+
+    printf("%zu requests in corpus, %zu replayed, %zu left out\n",
+           corpus.n_inputs, r.n_inputs, corpus.n_inputs - r.n_inputs);
+    if (!r.n_inputs)
+        return 1;
+
+    bench_parse(&r, seconds * 1e9 / 2);
+    bench_process(&r, seconds * 1e9 / 2);
+
+    /* lwan_shutdown() isn't called: the worker thread only notices it's
+     * being shut down when its listener becomes readable, and nothing ever
+     * connects to it. */
+    if (r.coro)
+        coro_free(r.coro);
+    close(r.fd);
+    free(r.inputs);
+
+    return 0;
+}
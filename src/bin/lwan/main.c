@@ -18,13 +18,18 @@
  */
 
 #define _GNU_SOURCE
+#include <errno.h>
 #include <getopt.h>
+#include <sched.h>
+#include <signal.h>
 #include <stdlib.h>
+#include <sys/wait.h>
 #include <unistd.h>
 #include <limits.h>
 
 #include "lwan-private.h"
 #include "lwan-mod-serve-files.h"
+#include "lwan-shm-cache.h"
 
 enum args {
     ARGS_FAILED,
@@ -32,6 +37,23 @@ enum args {
     ARGS_SERVE_FILES
 };
 
+/* Seconds to wait before replacing a worker process that crashed */
+#define RESPAWN_DELAY 1
+#define DEFAULT_SHARED_CACHE_MIB 64
+
+struct prefork {
+    unsigned int n_processes;
+    size_t shared_cache_mib;
+};
+
+/* Written by the signal handler of the supervisor, which forwards
+ * signals to the workers */
+static struct {
+    volatile pid_t pids[LWAN_SHM_CACHE_MAX_PROCESSES];
+    unsigned int n_processes;
+    volatile sig_atomic_t stopping;
+} workers;
+
 static void print_module_info(void)
 {
     const struct lwan_module_info *module;
@@ -79,6 +101,9 @@ print_build_time_configuration(void)
 #if defined(LWAN_HAVE_ZSTD)
     printf(" zstd");
 #endif
+#if defined(LWAN_HAVE_ISAL)
+    printf(" ISA-L");
+#endif
 
 #if defined(LWAN_HAVE_MBEDTLS)
     printf(" mbedTLS");
@@ -142,6 +167,7 @@ print_help(const char *argv0, const struct lwan_config *config)
 #endif
     printf("       [--config /path/to/config/file] [--user username]\n");
     printf("       [--chroot /path/to/chroot/directory]\n");
+    printf("       [--processes N] [--shared-cache-size MiB]\n");
     printf("\n");
 #if defined(LWAN_HAVE_MBEDTLS)
     printf("Serve files through HTTP or HTTPS.\n\n");
@@ -161,6 +187,13 @@ print_help(const char *argv0, const struct lwan_config *config)
     printf("  -c, --config     Path to config file path.\n");
     printf("  -u, --user       Username to drop privileges to (root required).\n");
     printf("  -C, --chroot     Chroot to path passed to --root (root required).\n");
+    printf("\n");
+    printf("  -p, --processes  Number of worker processes, each with its own\n");
+    printf("                   listeners and a share of the CPUs (default: 1).\n");
+    printf("  -S, --shared-cache-size\n");
+    printf("                   MiB of memory shared by worker processes to cache\n");
+    printf("                   responses, or 0 (default: %d).\n",
+           DEFAULT_SHARED_CACHE_MIB);
 #if defined(LWAN_HAVE_MBEDTLS)
     printf("\n");
     printf("  -P, --cert-path  Path to TLS certificate.\n");
@@ -198,7 +231,7 @@ print_help(const char *argv0, const struct lwan_config *config)
 
 static enum args
 parse_args(int argc, char *argv[], struct lwan_config *config, char *root,
-    struct lwan_straitjacket *sj)
+    struct lwan_straitjacket *sj, struct prefork *prefork)
 {
     static const struct option opts[] = {
         { .name = "root", .has_arg = 1, .val = 'r' },
@@ -207,6 +240,8 @@ parse_args(int argc, char *argv[], struct lwan_config *config, char *root,
         { .name = "config", .has_arg = 1, .val = 'c' },
         { .name = "chroot", .val = 'C' },
         { .name = "user", .val = 'u', .has_arg = 1 },
+        { .name = "processes", .val = 'p', .has_arg = 1 },
+        { .name = "shared-cache-size", .val = 'S', .has_arg = 1 },
 #if defined(LWAN_HAVE_MBEDTLS)
         { .name = "tls-listen", .val = 'L', .has_arg = 1 },
         { .name = "cert-path", .val = 'P', .has_arg = 1 },
@@ -217,7 +252,7 @@ parse_args(int argc, char *argv[], struct lwan_config *config, char *root,
     int c, optidx = 0;
     enum args result = ARGS_USE_CONFIG;
 
-    while ((c = getopt_long(argc, argv, "L:P:K:hr:l:c:u:C", opts, &optidx)) != -1) {
+    while ((c = getopt_long(argc, argv, "L:P:K:hr:l:c:u:Cp:S:", opts, &optidx)) != -1) {
         switch (c) {
 #if defined(LWAN_HAVE_MBEDTLS)
         case 'L':
@@ -245,6 +280,31 @@ parse_args(int argc, char *argv[], struct lwan_config *config, char *root,
             sj->chroot_path = root;
             break;
 
+        case 'p': {
+            long n = parse_long(optarg, -1);
+
+            if (n < 1 || n > LWAN_SHM_CACHE_MAX_PROCESSES) {
+                fprintf(stderr, "Number of processes must be between 1 and %d\n",
+                        LWAN_SHM_CACHE_MAX_PROCESSES);
+                return ARGS_FAILED;
+            }
+
+            prefork->n_processes = (unsigned int)n;
+            break;
+        }
+
+        case 'S': {
+            long mib = parse_long(optarg, -1);
+
+            if (mib < 0) {
+                fprintf(stderr, "Invalid shared cache size: %s\n", optarg);
+                return ARGS_FAILED;
+            }
+
+            prefork->shared_cache_mib = (size_t)mib;
+            break;
+        }
+
         case 'c':
             free(config->config_file_path);
             config->config_file_path = strdup(optarg);
@@ -283,12 +343,182 @@ parse_args(int argc, char *argv[], struct lwan_config *config, char *root,
     return result;
 }
 
+static void forward_signal(int signal_number)
+{
+    const int saved_errno = errno;
+
+    if (signal_number != SIGHUP)
+        workers.stopping = 1;
+
+    for (unsigned int i = 0; i < workers.n_processes; i++) {
+        if (workers.pids[i] > 0)
+            kill(workers.pids[i], signal_number);
+    }
+
+    errno = saved_errno;
+}
+
+/* Each worker gets the CPUs it's allowed to run on whose index, among
+ * those the supervisor could run on, leads to it; workers are spread
+ * over them if there are fewer CPUs than workers.  Sizing the thread pool
+ * after the affinity mask then gives each process its share. */
+static void restrict_to_cpu_share(unsigned int index, unsigned int n_processes)
+{
+#if defined(__linux__)
+    cpu_set_t allowed, share;
+    unsigned int n_allowed, nth = 0;
+
+    if (sched_getaffinity(0, sizeof(allowed), &allowed))
+        return;
+
+    n_allowed = (unsigned int)CPU_COUNT(&allowed);
+    if (!n_allowed)
+        return;
+
+    CPU_ZERO(&share);
+    for (unsigned int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (!CPU_ISSET(cpu, &allowed))
+            continue;
+
+        if (n_allowed >= n_processes ? nth % n_processes == index
+                                     : nth == index % n_allowed)
+            CPU_SET(cpu, &share);
+        nth++;
+    }
+
+    if (sched_setaffinity(0, sizeof(share), &share))
+        lwan_status_perror("Could not set CPU affinity of worker %u", index);
+#else
+    (void)index;
+    (void)n_processes;
+#endif
+}
+
+static pid_t spawn_worker(unsigned int index, unsigned int n_processes)
+{
+    pid_t pid = fork();
+
+    if (pid < 0) {
+        lwan_status_perror("Could not fork worker %u", index);
+    } else if (!pid) {
+        signal(SIGTERM, SIG_DFL);
+        signal(SIGINT, SIG_DFL);
+        signal(SIGHUP, SIG_DFL);
+
+        restrict_to_cpu_share(index, n_processes);
+        lwan_set_worker_processes(n_processes);
+        lwan_shm_cache_set_process(index);
+    } else {
+        workers.pids[index] = pid;
+
+        /* Might have missed a signal to stop in the meantime */
+        if (workers.stopping)
+            kill(pid, SIGTERM);
+    }
+
+    return pid;
+}
+
+/* Forks the worker processes, each of which initializes Lwan and creates
+ * its own listeners (with SO_REUSEPORT, so that the kernel balances
+ * connections among them), and returns in them.  The supervisor stays
+ * behind, forwarding signals to the workers, and replacing those that
+ * crash, until they've all exited. */
+static void prefork_workers(const struct prefork *prefork)
+{
+    const struct sigaction sa = {.sa_handler = forward_signal};
+    unsigned int alive = 0;
+    int status = EXIT_SUCCESS;
+
+    if (prefork->shared_cache_mib &&
+        !lwan_shm_cache_init(prefork->shared_cache_mib << 20))
+        lwan_status_critical("Could not create shared cache segment");
+
+    workers.n_processes = prefork->n_processes;
+
+    /* Without SA_RESTART, so that waitpid() is interrupted too */
+    sigaction(SIGTERM, &sa, NULL);
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGHUP, &sa, NULL);
+
+    for (unsigned int i = 0; i < prefork->n_processes; i++) {
+        pid_t pid = spawn_worker(i, prefork->n_processes);
+
+        if (!pid)
+            return;
+        if (pid < 0) {
+            forward_signal(SIGTERM);
+            break;
+        }
+        alive++;
+    }
+
+    lwan_status_info("Supervising %u worker processes", alive);
+
+    while (alive) {
+        unsigned int index;
+        int wstatus;
+        pid_t pid;
+
+        pid = waitpid(-1, &wstatus, 0);
+        if (pid < 0) {
+            if (errno == EINTR)
+                continue;
+            lwan_status_perror("Could not wait for worker processes");
+            break;
+        }
+
+        for (index = 0; index < workers.n_processes; index++) {
+            if (workers.pids[index] == pid)
+                break;
+        }
+        if (index == workers.n_processes)
+            continue;
+
+        workers.pids[index] = 0;
+        alive--;
+        lwan_shm_cache_forget_process(index);
+
+        if (workers.stopping)
+            continue;
+
+        /* Workers that exit on their own (e.g. because the configuration
+         * file has an error) would just do it again */
+        if (!WIFSIGNALED(wstatus)) {
+            lwan_status_error("Worker %u (PID %d) exited with status %d",
+                              index, pid, WEXITSTATUS(wstatus));
+            status = EXIT_FAILURE;
+            continue;
+        }
+
+        lwan_status_warning("Worker %u (PID %d) was killed by signal %d; "
+                            "replacing it in %ds",
+                            index, pid, WTERMSIG(wstatus), RESPAWN_DELAY);
+        sleep(RESPAWN_DELAY);
+        if (workers.stopping)
+            continue;
+
+        pid = spawn_worker(index, prefork->n_processes);
+        if (!pid)
+            return;
+        if (pid > 0)
+            alive++;
+    }
+
+    lwan_shm_cache_shutdown();
+    exit(status);
+}
+
 int
 main(int argc, char *argv[])
 {
     struct lwan l;
     struct lwan_config c;
     struct lwan_straitjacket sj = {};
+    struct prefork prefork = {
+        .n_processes = 1,
+        .shared_cache_mib = DEFAULT_SHARED_CACHE_MIB,
+    };
     char root_buf[PATH_MAX];
     char *root = root_buf;
     int ret = EXIT_SUCCESS;
@@ -299,7 +529,7 @@ main(int argc, char *argv[])
     c = *lwan_get_default_config();
     c.listener = strdup("*:8080");
 
-    switch (parse_args(argc, argv, &c, root, &sj)) {
+    switch (parse_args(argc, argv, &c, root, &sj, &prefork)) {
     case ARGS_SERVE_FILES:
         lwan_status_info("Serving files from %s", root);
 
@@ -307,6 +537,8 @@ main(int argc, char *argv[])
             root = "/";
         }
         lwan_straitjacket_enforce(&sj);
+        if (prefork.n_processes > 1)
+            prefork_workers(&prefork);
 
         lwan_init_with_config(&l, &c);
 
@@ -318,6 +550,9 @@ main(int argc, char *argv[])
         break;
     case ARGS_USE_CONFIG:
         lwan_straitjacket_enforce(&sj);
+        if (prefork.n_processes > 1)
+            prefork_workers(&prefork);
+
         if (c.config_file_path)
             lwan_init_with_config(&l, &c);
         else
@@ -18,6 +18,7 @@
  */
 
 #define _GNU_SOURCE
+#include <errno.h>
 #include <stdlib.h>
 #include <unistd.h>
 
@@ -80,6 +81,30 @@ LWAN_HANDLER(test_server_sent_event)
     return HTTP_OK;
 }
 
+LWAN_HANDLER(test_websocket_echo)
+{
+    enum lwan_http_status status = lwan_request_websocket_upgrade(request);
+
+    if (status != HTTP_SWITCHING_PROTOCOLS)
+        return status;
+
+    while (true) {
+        switch (lwan_response_websocket_read(request)) {
+        case ENOTCONN:
+        case ECONNRESET:
+            return HTTP_OK;
+
+        case EAGAIN:
+            lwan_request_await_read(request, request->fd);
+            break;
+
+        case 0:
+            lwan_response_websocket_write_text(request);
+            break;
+        }
+    }
+}
+
 LWAN_HANDLER(test_proxy)
 {
     struct lwan_key_value *headers = coro_malloc(request->conn->coro, sizeof(*headers) * 2);
@@ -155,6 +180,27 @@ LWAN_HANDLER(test_post_big)
     return HTTP_OK;
 }
 
+LWAN_HANDLER_FLAGS(test_post_stream, HANDLER_STREAMS_BODY_DATA)
+{
+    char buffer[1000];
+    size_t received = 0, sum = 0;
+    ssize_t r;
+
+    while ((r = lwan_request_read_body(request, buffer, sizeof(buffer))) > 0) {
+        for (ssize_t i = 0; i < r; i++)
+            sum += (size_t)buffer[i];
+        received += (size_t)r;
+    }
+    if (r < 0)
+        return (enum lwan_http_status)-r;
+
+    response->mime_type = "application/json";
+    lwan_strbuf_printf(response->buffer, "{\"received\": %zu, \"sum\": %zu}",
+                       received, sum);
+
+    return HTTP_OK;
+}
+
 LWAN_HANDLER(hello_world)
 {
     struct lwan_key_value *iter;
@@ -261,6 +307,44 @@ LWAN_HANDLER(custom_header)
     return HTTP_OK;
 }
 
+LWAN_HANDLER(cache_backend)
+{
+    static unsigned int counter;
+    const char *cache_control = lwan_request_get_query_param(request, "cc");
+    const char *vary = lwan_request_get_query_param(request, "vary");
+    const char *sleep_ms = lwan_request_get_query_param(request, "sleep");
+    const char *flavor = lwan_request_get_header(request, "X-Flavor");
+    struct lwan_key_value *headers;
+    size_t n_headers = 0;
+
+    headers = coro_malloc(request->conn->coro, 3 * sizeof(*headers));
+    if (!headers)
+        return HTTP_INTERNAL_ERROR;
+    if (cache_control) {
+        headers[n_headers++] = (struct lwan_key_value){
+            .key = "Cache-Control",
+            .value = (char *)cache_control,
+        };
+    }
+    if (vary) {
+        headers[n_headers++] = (struct lwan_key_value){
+            .key = "Vary",
+            .value = (char *)vary,
+        };
+    }
+    headers[n_headers] = (struct lwan_key_value){};
+    response->headers = headers;
+
+    if (sleep_ms)
+        lwan_request_sleep(request, (uint64_t)parse_long(sleep_ms, 0));
+
+    response->mime_type = "text/plain";
+    lwan_strbuf_printf(response->buffer, "Response #%u, flavor %s",
+                       __atomic_add_fetch(&counter, 1, __ATOMIC_SEQ_CST),
+                       flavor ? flavor : "none");
+    return HTTP_OK;
+}
+
 int
 main()
 {
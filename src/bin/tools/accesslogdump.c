@@ -0,0 +1,271 @@
+/*
+ * lwan - web server
+ * Copyright (c) 2024 L. A. F. Pereira <l@tia.mat.br>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+/* Decodes binary access logs (see lwan-access-log.h) to text or JSON. */
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "lwan-access-log.h"
+
+struct url_map_name {
+    uint32_t id;
+    char prefix[57];
+};
+
+static struct url_map_name *names;
+static size_t n_names;
+
+/* Difference between CLOCK_REALTIME and CLOCK_MONOTONIC, from the last
+ * header record */
+static int64_t realtime_offset_ns;
+static bool seen_header;
+
+static bool json;
+
+static void add_name(const struct lwan_access_log_record *record)
+{
+    struct url_map_name *name = NULL;
+
+    for (size_t i = 0; i < n_names; i++) {
+        if (names[i].id == record->url_map_id) {
+            name = &names[i];
+            break;
+        }
+    }
+
+    if (!name) {
+        struct url_map_name *new_names =
+            realloc(names, (n_names + 1) * sizeof(*names));
+
+        if (!new_names) {
+            fprintf(stderr, "Could not allocate memory for URL map names\n");
+            exit(1);
+        }
+
+        names = new_names;
+        name = &names[n_names++];
+        name->id = record->url_map_id;
+    }
+
+    memcpy(name->prefix, record->url_map.prefix, sizeof(record->url_map.prefix));
+    name->prefix[sizeof(record->url_map.prefix)] = '\0';
+}
+
+static const char *find_name(uint32_t id)
+{
+    for (size_t i = 0; i < n_names; i++) {
+        if (names[i].id == id)
+            return names[i].prefix;
+    }
+
+    return NULL;
+}
+
+static bool read_header(const struct lwan_access_log_record *record)
+{
+    if (memcmp(record->header.magic, LWAN_ACCESS_LOG_MAGIC,
+               sizeof(record->header.magic))) {
+        fprintf(stderr, "Not a lwan binary access log\n");
+        return false;
+    }
+
+    if (record->header.record_size != sizeof(*record)) {
+        if (__builtin_bswap32(record->header.record_size) == sizeof(*record))
+            fprintf(stderr, "Log was written on a machine with a different "
+                            "byte order\n");
+        else
+            fprintf(stderr, "Unexpected record size: %" PRIu32 "\n",
+                    record->header.record_size);
+        return false;
+    }
+
+    if (record->header.version != LWAN_ACCESS_LOG_VERSION) {
+        fprintf(stderr, "Unsupported access log version: %" PRIu32 "\n",
+                record->header.version);
+        return false;
+    }
+
+    realtime_offset_ns = (int64_t)(record->header.realtime_ns -
+                                   record->header.monotonic_ns);
+    seen_header = true;
+
+    return true;
+}
+
+static void format_time(char *buffer, size_t size, uint64_t monotonic_ns)
+{
+    const uint64_t ns = monotonic_ns + (uint64_t)realtime_offset_ns;
+    const time_t secs = (time_t)(ns / 1000000000ull);
+    struct tm tm;
+    size_t len;
+
+    gmtime_r(&secs, &tm);
+    len = strftime(buffer, size, "%Y-%m-%dT%H:%M:%S", &tm);
+    snprintf(buffer + len, size - len, ".%06" PRIu64 "Z",
+             (uint64_t)((ns % 1000000000ull) / 1000ull));
+}
+
+static void print_json_string(const char *str)
+{
+    putchar('"');
+
+    for (; *str; str++) {
+        const unsigned char c = (unsigned char)*str;
+
+        if (c == '"' || c == '\\')
+            printf("\\%c", c);
+        else if (c < 0x20)
+            printf("\\u%04x", c);
+        else
+            putchar(c);
+    }
+
+    putchar('"');
+}
+
+static void print_request(const struct lwan_access_log_record *record)
+{
+    const char *http_version =
+        record->flags & LWAN_ACCESS_LOG_HTTP_1_0 ? "1.0" : "1.1";
+    const char *url_map = find_name(record->url_map_id);
+    char method[sizeof(record->request.method) + 1];
+    char timestamp[64];
+
+    memcpy(method, record->request.method, sizeof(record->request.method));
+    method[sizeof(record->request.method)] = '\0';
+
+    format_time(timestamp, sizeof(timestamp), record->request.begin_ns);
+
+    if (json) {
+        printf("{\"time\":\"%s\",\"method\":", timestamp);
+        print_json_string(method);
+        printf(",\"url_map_id\":\"%08" PRIx32 "\"", record->url_map_id);
+        if (url_map) {
+            printf(",\"url_map\":");
+            print_json_string(url_map);
+        }
+        printf(",\"http_version\":\"%s\",\"status\":%" PRIu16
+               ",\"bytes_sent\":%" PRIu64 ",\"duration_ns\":%" PRIu64,
+               http_version, record->status, record->request.bytes_sent,
+               record->request.duration_ns);
+        if (record->request.request_id)
+            printf(",\"request_id\":\"%016" PRIx64 "\"",
+                   record->request.request_id);
+        printf("}\n");
+        return;
+    }
+
+    printf("%s %s ", timestamp, method);
+    if (url_map)
+        printf("%s", url_map);
+    else if (record->url_map_id)
+        printf("#%08" PRIx32, record->url_map_id);
+    else
+        printf("-");
+    printf(" HTTP/%s %" PRIu16 " %" PRIu64 " %" PRIu64 ".%03" PRIu64 "us ",
+           http_version, record->status, record->request.bytes_sent,
+           record->request.duration_ns / 1000,
+           record->request.duration_ns % 1000);
+    if (record->request.request_id)
+        printf("%016" PRIx64 "\n", record->request.request_id);
+    else
+        printf("-\n");
+}
+
+static int dump(FILE *file, const char *path)
+{
+    struct lwan_access_log_record record;
+    size_t n;
+
+    seen_header = false;
+
+    while ((n = fread(&record, 1, sizeof(record), file)) == sizeof(record)) {
+        switch (record.type) {
+        case LWAN_ACCESS_LOG_RECORD_HEADER:
+            if (!read_header(&record))
+                return 1;
+            break;
+        case LWAN_ACCESS_LOG_RECORD_URL_MAP:
+            add_name(&record);
+            break;
+        case LWAN_ACCESS_LOG_RECORD_REQUEST:
+            if (!seen_header) {
+                fprintf(stderr, "%s: Request record before header\n", path);
+                return 1;
+            }
+            print_request(&record);
+            break;
+        default:
+            fprintf(stderr, "%s: Unknown record type %d\n", path, record.type);
+            return 1;
+        }
+    }
+
+    if (ferror(file)) {
+        fprintf(stderr, "%s: Could not read: %s\n", path, strerror(errno));
+        return 1;
+    }
+    if (n)
+        fprintf(stderr, "%s: Ignoring truncated record at end of file\n", path);
+
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    int first_path = 1;
+    int r = 0;
+
+    if (argc > 1 && !strcmp(argv[1], "--json")) {
+        json = true;
+        first_path++;
+    }
+
+    if (argc > first_path && !strcmp(argv[first_path], "--help")) {
+        fprintf(stderr, "Usage: %s [--json] [/path/to/access.log ...]\n",
+                argv[0]);
+        return 1;
+    }
+
+    if (first_path == argc)
+        return dump(stdin, "stdin");
+
+    for (int arg = first_path; arg < argc; arg++) {
+        FILE *file = fopen(argv[arg], "rb");
+
+        if (!file) {
+            fprintf(stderr, "Could not open %s: %s\n", argv[arg],
+                    strerror(errno));
+            return 1;
+        }
+
+        r |= dump(file, argv[arg]);
+        fclose(file);
+    }
+
+    free(names);
+
+    return r;
+}
@@ -0,0 +1,89 @@
+/*
+ * lwan - web server
+ * Copyright (c) 2024 L. A. F. Pereira <l@tia.mat.br>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+/* Reads a configuration file and writes a snapshot of it that can be
+ * passed to anything that uses config_open(), including lwan itself. */
+
+#include <limits.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "lwan-config.h"
+#include "lwan-status.h"
+
+int main(int argc, char *argv[])
+{
+    char tmp_path[PATH_MAX];
+    struct config *config;
+    FILE *out;
+    bool written;
+
+    if (argc < 3) {
+        lwan_status_critical("Usage: %s /path/to/config/file.conf /path/to/snapshot",
+                             argv[0]);
+        return 1;
+    }
+
+    if (snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", argv[2]) >=
+        (int)sizeof(tmp_path)) {
+        lwan_status_critical("Path to snapshot is too long");
+        return 1;
+    }
+
+    config = config_open(argv[1]);
+    if (!config) {
+        lwan_status_critical_perror("Could not open configuration file %s",
+                                    argv[1]);
+        return 1;
+    }
+
+    out = fopen(tmp_path, "wbx");
+    if (!out) {
+        lwan_status_critical_perror("Could not create %s", tmp_path);
+        return 1;
+    }
+
+    written = config_write_snapshot(config, out);
+    if (fclose(out) < 0)
+        written = false;
+
+    if (!written) {
+        if (config_last_error(config)) {
+            lwan_status_error("Error while reading configuration file (line %d): %s",
+                              config_cur_line(config),
+                              config_last_error(config));
+        } else {
+            lwan_status_perror("Could not write snapshot");
+        }
+        unlink(tmp_path);
+        config_close(config);
+        return 1;
+    }
+
+    config_close(config);
+
+    if (rename(tmp_path, argv[2]) < 0) {
+        lwan_status_perror("Could not rename %s to %s", tmp_path, argv[2]);
+        unlink(tmp_path);
+        return 1;
+    }
+
+    return 0;
+}
@@ -19,6 +19,7 @@
 
 #include <assert.h>
 #include <ctype.h>
+#include <stdbool.h>
 #include <errno.h>
 #include <endian.h>
 #include <fcntl.h>
@@ -86,6 +87,114 @@ static int compare_ext(const void *a, const void *b)
     return strcasecmp(*exta, *extb);
 }
 
+/* Must be kept in sync with the mime_perfect_hash() function printed in
+ * main().  Both are bijections, so distinct keys always have distinct
+ * hashes, and different displacements will eventually place them in
+ * different slots. */
+static uint64_t mix(uint64_t x)
+{
+    x ^= x >> 30;
+    x *= 0xbf58476d1ce4e5b9ull;
+    x ^= x >> 27;
+    x *= 0x94d049bb133111ebull;
+    x ^= x >> 31;
+    return x;
+}
+
+static uint32_t map_0_to_n(uint32_t value, uint32_t n)
+{
+    return (uint32_t)(((uint64_t)value * (uint64_t)n) >> 32);
+}
+
+#define MAX_BUCKET_KEYS 32
+
+struct bucket {
+    uint32_t index;
+    uint32_t n_keys;
+    uint32_t keys[MAX_BUCKET_KEYS];
+};
+
+static int compare_bucket_size(const void *a, const void *b)
+{
+    const struct bucket *ba = a, *bb = b;
+
+    if (ba->n_keys != bb->n_keys)
+        return ba->n_keys < bb->n_keys ? 1 : -1;
+    return ba->index < bb->index ? -1 : ba->index > bb->index;
+}
+
+/* Finds a minimal perfect hash function for `keys` using the "hash,
+ * displace, and compress" method (Belazzougui, Botelho, Dietzfelbinger
+ * 2009): keys are split in buckets by the upper bits of their hash, and,
+ * starting with the largest buckets, a displacement is searched for each
+ * bucket so that all of its keys land in free slots.  slots[i] receives
+ * the index of the key in slot i. */
+static uint32_t *find_perfect_hash(const uint64_t *keys,
+                                   uint32_t n_keys,
+                                   uint32_t n_buckets,
+                                   uint32_t *slots)
+{
+    struct bucket *buckets = calloc(n_buckets, sizeof(*buckets));
+    uint32_t *displacements = calloc(n_buckets, sizeof(*displacements));
+    bool *taken = calloc(n_keys, sizeof(*taken));
+
+    if (!buckets || !displacements || !taken)
+        goto fail;
+
+    for (uint32_t i = 0; i < n_buckets; i++)
+        buckets[i].index = i;
+    for (uint32_t i = 0; i < n_keys; i++) {
+        struct bucket *b =
+            &buckets[map_0_to_n((uint32_t)(mix(keys[i]) >> 32), n_buckets)];
+
+        if (b->n_keys == MAX_BUCKET_KEYS)
+            goto fail;
+        b->keys[b->n_keys++] = i;
+    }
+    qsort(buckets, n_buckets, sizeof(*buckets), compare_bucket_size);
+
+    for (uint32_t i = 0; i < n_buckets && buckets[i].n_keys; i++) {
+        const struct bucket *b = &buckets[i];
+        uint32_t placed[MAX_BUCKET_KEYS];
+        uint32_t d;
+
+        for (d = 0; d < 1u << 24; d++) {
+            uint32_t k;
+
+            for (k = 0; k < b->n_keys; k++) {
+                const uint64_t h = mix(keys[b->keys[k]]);
+                const uint32_t slot = map_0_to_n((uint32_t)mix(h ^ d), n_keys);
+
+                if (taken[slot])
+                    break;
+                taken[slot] = true;
+                placed[k] = slot;
+            }
+            if (k == b->n_keys)
+                break;
+
+            while (k--)
+                taken[placed[k]] = false;
+        }
+        if (d == 1u << 24)
+            goto fail;
+
+        displacements[b->index] = d;
+        for (uint32_t k = 0; k < b->n_keys; k++)
+            slots[placed[k]] = b->keys[k];
+    }
+
+    free(buckets);
+    free(taken);
+    return displacements;
+
+fail:
+    free(buckets);
+    free(displacements);
+    free(taken);
+    return NULL;
+}
+
 static char *strend(char *str, char ch)
 {
     str = strchr(str, ch);
@@ -286,14 +395,15 @@ int main(int argc, char *argv[])
         exts[i] = key;
     qsort(exts, hash_get_count(ext_mime), sizeof(char *), compare_ext);
 
-    /* Generate uncompressed blob. */
-    output.ptr = malloc(output.capacity);
-    if (!output.ptr) {
-        fprintf(stderr, "Could not allocate temporary memory\n");
+    /* Extensions are looked up in upper case, so the same key might have
+     * been added more than once; only keep the first one in sorted order. */
+    uint64_t *keys = calloc(hash_get_count(ext_mime), sizeof(uint64_t));
+    uint32_t n_keys = 0;
+    if (!keys) {
+        fprintf(stderr, "Could not allocate key array\n");
         fclose(fp);
         return 1;
     }
-    ssize_t bin_index = -1;
     for (i = 0; i < hash_get_count(ext_mime); i++) {
         uint64_t ext_lower = 0;
 
@@ -306,17 +416,45 @@ int main(int argc, char *argv[])
         ext_lower &= ~0x2020202020202020ull;
         ext_lower = htobe64(ext_lower);
 
-        if (output_append_u64(&output, ext_lower) < 0) {
+        if (n_keys && keys[n_keys - 1] == ext_lower)
+            continue;
+
+        exts[n_keys] = exts[i];
+        keys[n_keys++] = ext_lower;
+    }
+
+    /* Entries in the blob are stored in the order given by the perfect
+     * hash function, so the hash of an extension is its index. */
+    const uint32_t n_buckets = n_keys / 4 ? n_keys / 4 : 1;
+    uint32_t *slots = calloc(n_keys, sizeof(uint32_t));
+    uint32_t *displacements =
+        slots ? find_perfect_hash(keys, n_keys, n_buckets, slots) : NULL;
+    if (!displacements) {
+        fprintf(stderr, "Could not find a perfect hash function\n");
+        fclose(fp);
+        return 1;
+    }
+
+    /* Generate uncompressed blob. */
+    output.ptr = malloc(output.capacity);
+    if (!output.ptr) {
+        fprintf(stderr, "Could not allocate temporary memory\n");
+        fclose(fp);
+        return 1;
+    }
+    ssize_t bin_index = -1;
+    for (i = 0; i < n_keys; i++) {
+        if (output_append_u64(&output, keys[slots[i]]) < 0) {
             fprintf(stderr, "Could not append to output\n");
             fclose(fp);
             return 1;
         }
 
-        if (bin_index < 0 && streq(exts[i], "bin"))
+        if (bin_index < 0 && streq(exts[slots[i]], "bin"))
             bin_index = (ssize_t)i;
     }
-    for (i = 0; i < hash_get_count(ext_mime); i++) {
-        if (output_append(&output, hash_find(ext_mime, exts[i])) < 0) {
+    for (i = 0; i < n_keys; i++) {
+        if (output_append(&output, hash_find(ext_mime, exts[slots[i]])) < 0) {
             fprintf(stderr, "Could not append to output\n");
             fclose(fp);
             return 1;
@@ -348,23 +486,51 @@ int main(int argc, char *argv[])
     printf("/* Compressed with zlib (deflate) */\n");
 #endif
 
-    unsigned int entries_floor = 1u << (31 - __builtin_clz(hash_get_count(ext_mime)));
-
     printf("#pragma once\n");
     printf("#define MIME_UNCOMPRESSED_LEN %zu\n", output.used);
     printf("#define MIME_COMPRESSED_LEN %lu\n", compressed_size);
-    printf("#define MIME_ENTRIES %d\n", hash_get_count(ext_mime));
-    printf("#define MIME_ENTRIES_FLOOR %d\n", entries_floor);
+    printf("#define MIME_ENTRIES %u\n", n_keys);
     printf("#define MIME_ENTRY_FALLBACK %ld\n", bin_index);
-    printf("#define MIME_EXT_FALLBACK \".%s\"\n", exts[bin_index]);
+    printf("#define MIME_EXT_FALLBACK \".%s\"\n", exts[slots[bin_index]]);
     printf("static const unsigned char mime_entries_compressed[] = {\n");
     for (i = 1; compressed_size; compressed_size--, i++)
         printf("0x%02x,%c", compressed[i - 1] & 0xff, " \n"[i % 13 == 0]);
     printf("};\n");
 
+    uint32_t max_displacement = 0;
+    for (i = 0; i < n_buckets; i++) {
+        if (displacements[i] > max_displacement)
+            max_displacement = displacements[i];
+    }
+    printf("static const %s mime_displacements[] = {\n",
+           max_displacement > UINT16_MAX ? "uint32_t" : "uint16_t");
+    for (i = 0; i < n_buckets; i++)
+        printf("%u,%c", displacements[i], " \n"[(i + 1) % 8 == 0]);
+    printf("};\n");
+
+    printf("static ALWAYS_INLINE uint64_t mime_mix(uint64_t x) {\n");
+    printf("    x ^= x >> 30;\n");
+    printf("    x *= 0xbf58476d1ce4e5b9ull;\n");
+    printf("    x ^= x >> 27;\n");
+    printf("    x *= 0x94d049bb133111ebull;\n");
+    printf("    x ^= x >> 31;\n");
+    printf("    return x;\n");
+    printf("}\n");
+    printf("static ALWAYS_INLINE uint32_t mime_perfect_hash(uint64_t key) {\n");
+    printf("    const uint64_t h = mime_mix(key);\n");
+    printf("    const uint32_t bucket = (uint32_t)(((h >> 32) * %uull) >> 32);\n",
+           n_buckets);
+    printf("    const uint64_t d = mime_displacements[bucket];\n");
+    printf("    return (uint32_t)(((uint64_t)(uint32_t)mime_mix(h ^ d) * %uull) >> 32);\n",
+           n_keys);
+    printf("}\n");
+
     free(compressed);
     free(output.ptr);
     free(exts);
+    free(keys);
+    free(slots);
+    free(displacements);
     hash_unref(ext_mime);
     fclose(fp);
 
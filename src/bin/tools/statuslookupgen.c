@@ -39,7 +39,7 @@ int main(void)
 #define N_KEYS ((int)(sizeof(keys) / sizeof(keys[0])))
 
     int best_rot = INT_MAX;
-    uint32_t best_mod = 64;
+    uint32_t best_mod = 128;
     uint32_t best_subtract = UINT_MAX;
 
     if (N_KEYS >= best_mod) {
@@ -50,17 +50,17 @@ int main(void)
     for (uint32_t subtract = 0; subtract < max_key; subtract++) {
         for (int rot = 0; rot < 32; rot++) {
             for (uint32_t mod = N_KEYS; mod < best_mod; mod++) {
-                uint64_t set = 0;
+                unsigned __int128 set = 0;
                 int set_bits = 0;
 
                 for (int key = 0; key < N_KEYS; key++) {
                     uint32_t k = map_0_to_n(
                         rotate((uint32_t)keys[key] - subtract, rot), mod);
 
-                    if (set & 1ull<<k)
+                    if (set & (unsigned __int128)1<<k)
                         break;
                     
-                    set |= 1ull<<k;
+                    set |= (unsigned __int128)1<<k;
                     set_bits++;
                 }
 
@@ -78,8 +78,17 @@ int main(void)
         return 1;
     }
 
-    uint64_t set_values = ~0ull;
+    /* Statuses Lwan doesn't know about, but that are still valid (e.g.
+     * forwarded by the proxy module), are sent with an empty reason
+     * phrase. */
+    printf("static const char unknown_http_statuses[][6] = {\n");
+    for (int code = 100; code < 600; code++)
+        printf("    \"%d \\0\",\n", code);
+    printf("};\n\n");
+
+    unsigned __int128 set_values = ~(unsigned __int128)0;
     printf("static ALWAYS_INLINE const char *lwan_lookup_http_status_impl(enum lwan_http_status status) {\n");
+    printf("    static const char invalid[] = \"999 Invalid\\0Invalid HTTP status code requested\";\n");
     printf("    static const char *table[] = {\n");
 
 #define PRINT_V(ignored1, key, short_desc, long_desc)                          \
@@ -87,7 +96,7 @@ int main(void)
         uint32_t k = map_0_to_n(                                               \
             rotate((uint32_t)key - (uint32_t)best_subtract, best_rot),         \
             best_mod);                                                         \
-        set_values &= ~(1ull << k);                                            \
+        set_values &= ~((unsigned __int128)1 << k);                            \
         printf("        [%d] = \"%d %s\\0%s\",\n", k, key, short_desc,         \
                long_desc);                                                     \
     } while (0);
@@ -96,20 +105,25 @@ int main(void)
 #undef PRINT_V
 
     for (uint32_t i = 0; i < best_mod; i++) {
-        if (set_values & 1ull<<i)
-            printf("        [%d] = \"999 Invalid\\0Invalid HTTP status code requested\",\n", i);
+        if (set_values & (unsigned __int128)1<<i)
+            printf("        [%d] = invalid,\n", i);
     }
 
     printf("    };\n");
 
+    printf("\n");
+    printf("    if ((uint32_t)status - 100 >= 500)\n");
+    printf("        return invalid;\n");
     printf("\n");
     printf("    const uint32_t k = (uint32_t)status - %d;\n", best_subtract);
     printf("    const uint32_t hash = (k << %d) | (k >> %d);\n", 32 - best_rot, best_rot);
     printf("    const char *ret = table[(uint32_t)(((uint64_t)hash * (uint64_t)%d) >> 32)];\n", best_mod);
-    printf("    assert((uint32_t)(ret[2] - '0') == ((uint32_t)status %% 10));\n");
-    printf("    assert((uint32_t)(ret[1] - '0') == ((uint32_t)(status / 10) %% 10));\n");
-    printf("    assert((uint32_t)(ret[0] - '0') == ((uint32_t)(status / 100) %% 10));\n");
-    printf("    return ret;\n");
+    printf("    if ((uint32_t)(ret[2] - '0') == ((uint32_t)status %% 10) &&\n");
+    printf("        (uint32_t)(ret[1] - '0') == ((uint32_t)(status / 10) %% 10) &&\n");
+    printf("        (uint32_t)(ret[0] - '0') == ((uint32_t)(status / 100) %% 10))\n");
+    printf("        return ret;\n");
+    printf("\n");
+    printf("    return unknown_http_statuses[(uint32_t)status - 100];\n");
 
     printf("}\n");
 }
@@ -24,6 +24,7 @@
 #include <sys/socket.h>/* socket() connect() SOCK_NONBLOCK sockaddr_storage */
 #include <sys/stat.h>  /* fstat() */
 #include <sys/time.h>  /* gettimeofday() */
+#include <time.h>      /* clock_gettime() */
 #include <errno.h>     /* errno EINTR EAGAIN EWOULDBLOCK EINPROGRESS EALREADY */
 #include <fcntl.h>     /* open() fcntl() pipe2() F_SETFL (O_* flags) */
 #include <inttypes.h>  /* PRIu64 PRId64 */
@@ -46,6 +47,12 @@
 #include <netinet/in.h>
 #include <sys/un.h>
 
+#ifdef WEIGHTTP_HAVE_MBEDTLS
+#include <mbedtls/ctr_drbg.h>
+#include <mbedtls/entropy.h>
+#include <mbedtls/ssl.h>
+#endif
+
 #ifndef MSG_FASTOPEN
 #define MSG_FASTOPEN 0
 #endif
@@ -131,6 +138,10 @@ show_help (void)
       "  -c num     concurrent clients      (default: 1)\n"
       "  -k         keep alive              (default: no)\n"
       "  -K num     num pipelined requests  (default: 1)\n"
+      "  -R rate    open loop: send rate requests/sec, regardless of how\n"
+      "             fast responses arrive      (default: closed loop)\n"
+      "  -W size    WebSocket echo: upgrade each connection, then send text\n"
+      "             messages of size bytes and wait for them to be echoed\n"
       "  -6         use ipv6                (default: no)\n"
       "  -i         use HTTP HEAD method    (default: GET)\n"
       "  -m method  use custom HTTP method  (default: GET)\n"
@@ -172,6 +183,14 @@ show_help (void)
 
 #define CLIENT_BUFFER_SIZE 32 * 1024
 
+/* Latencies are kept in a log-linear histogram, in microseconds: values
+ * below 32 have a bucket of their own, and each power of two above that is
+ * split in 16 buckets (so values are accurate to ~6%), up to 2^32 usec. */
+#define LATENCY_LINEAR_BUCKETS 32
+#define LATENCY_SUB_BUCKETS 16
+#define LATENCY_BUCKETS \
+  (LATENCY_LINEAR_BUCKETS + (32 - 5) * LATENCY_SUB_BUCKETS)
+
 
 struct Stats;
 typedef struct Stats Stats;
@@ -206,7 +225,8 @@ struct Client {
         PARSER_CONNECT,
         PARSER_START,
         PARSER_HEADER,
-        PARSER_BODY
+        PARSER_BODY,
+        PARSER_WS_HEADER
     } parser_state;
 
     uint32_t buffer_offset;  /* pos in buffer  (size of data in buffer) */
@@ -225,11 +245,26 @@ struct Client {
     int tcp_fastopen;
     int http_head;
     int so_bufsz;
+    int open_loop;
+    int websocket;           /* upgrade to WebSockets and send ws_frame */
+    int ws_switching;        /* got a 101 response; parsing its headers */
+    int ws_open;
 
     uint32_t request_size;
     const char *request;
+    uint32_t http_request_size;
+    const char *http_request;
+    uint32_t ws_frame_size;
+    const char *ws_frame;
+  #ifdef WEIGHTTP_HAVE_MBEDTLS
+    mbedtls_ssl_context *ssl;
+    int tls_ready;           /* handshake done */
+  #endif
     struct pollfd *pfd;
     Stats *stats;
+    Worker *worker;
+    uint64_t *latency;       /* histogram shared by clients in this worker */
+    uint64_t req_ts;         /* when the current request started, in usec */
     const struct addrinfo *raddr;
     const struct addrinfo *laddr;
     char buffer[CLIENT_BUFFER_SIZE];
@@ -238,6 +273,18 @@ struct Client {
 struct Worker {
     struct pollfd *pfds;
     Client *clients;
+    uint64_t *latency;
+    /* open loop: clients waiting for their next request to be due, and
+     * when that is, in nsec */
+    Client **idle;
+    int num_idle;
+    uint64_t next_send_ns;
+    uint64_t interval_ns;
+  #ifdef WEIGHTTP_HAVE_MBEDTLS
+    mbedtls_ssl_config tls_conf;
+    mbedtls_entropy_context entropy;
+    mbedtls_ctr_drbg_context ctr_drbg;
+  #endif
     Stats stats;
     struct addrinfo raddr;
     struct addrinfo laddr;
@@ -250,12 +297,13 @@ struct Worker_Config {
     int id;
     int num_clients;
     uint64_t num_requests;
+    uint64_t *latency;
     Stats stats;
     /* pad struct Worker_Config for cache line separation between threads.
      * Round up to 256 to avoid chance of false sharing between threads.
      * Alternatively, could memalign the allocation of struct Worker_Config
      * list to cache line size (e.g. 128 bytes) */
-    uint64_t padding[(256 - (1*sizeof(void *))
+    uint64_t padding[(256 - (2*sizeof(void *))
                           - (2*sizeof(int))
                           - (1*sizeof(uint64_t))
                           - sizeof(Stats))
@@ -269,6 +317,7 @@ struct Config {
     struct timeval ts_end;
 
     uint64_t req_count;
+    uint64_t rate;      /*(open loop requests/sec, or 0 for closed loop)*/
     int thread_count;
     int keep_alive;
     int concur_count;
@@ -278,6 +327,11 @@ struct Config {
     int so_bufsz;
 
     int quiet;
+    int tls;
+    char *tls_host;
+    uint32_t ws_message_size; /*(0 unless WebSocket echo mode)*/
+    uint32_t ws_frame_size;
+    char *ws_frame;
     uint32_t request_size;
     char *request;
     char buf[16384]; /*(used for simple 8k memaligned request buffer on stack)*/
@@ -292,6 +346,84 @@ struct Config {
 };
 
 
+#ifdef WEIGHTTP_HAVE_MBEDTLS
+
+static int
+client_tls_send (void * const ctx, const unsigned char * const buf,
+                 const size_t len)
+{
+    const Client * const restrict client = (const Client *)ctx;
+    ssize_t r;
+    do {
+        r = send(client->pfd->fd, buf, len, MSG_DONTWAIT | MSG_NOSIGNAL);
+    } while (__builtin_expect( (-1 == r), 0) && errno == EINTR);
+    if (r >= 0)
+        return (int)r;
+    return (errno == EAGAIN || errno == EWOULDBLOCK)
+      ? MBEDTLS_ERR_SSL_WANT_WRITE
+      : MBEDTLS_ERR_SSL_INTERNAL_ERROR;
+}
+
+
+static int
+client_tls_recv (void * const ctx, unsigned char * const buf, const size_t len)
+{
+    const Client * const restrict client = (const Client *)ctx;
+    ssize_t r;
+    do {
+        r = recv(client->pfd->fd, buf, len, MSG_DONTWAIT);
+    } while (__builtin_expect( (-1 == r), 0) && errno == EINTR);
+    if (r >= 0)
+        return (int)r;
+    return (errno == EAGAIN || errno == EWOULDBLOCK)
+      ? MBEDTLS_ERR_SSL_WANT_READ
+      : MBEDTLS_ERR_SSL_INTERNAL_ERROR;
+}
+
+
+__attribute_cold__
+__attribute_noinline__
+static void
+worker_tls_init (Worker * const restrict worker)
+{
+    static const char pers[] = "weighttp";
+
+    mbedtls_entropy_init(&worker->entropy);
+    mbedtls_ctr_drbg_init(&worker->ctr_drbg);
+    mbedtls_ssl_config_init(&worker->tls_conf);
+
+    if (0 != mbedtls_ctr_drbg_seed(&worker->ctr_drbg, mbedtls_entropy_func,
+                                   &worker->entropy,
+                                   (const unsigned char *)pers,
+                                   sizeof(pers) - 1)
+        || 0 != mbedtls_ssl_config_defaults(&worker->tls_conf,
+                                            MBEDTLS_SSL_IS_CLIENT,
+                                            MBEDTLS_SSL_TRANSPORT_STREAM,
+                                            MBEDTLS_SSL_PRESET_DEFAULT)) {
+        fprintf(stderr, "error: could not initialize TLS\n");
+        exit(1);
+    }
+
+    /*(benchmarking tool: certificates are not verified)*/
+    mbedtls_ssl_conf_authmode(&worker->tls_conf, MBEDTLS_SSL_VERIFY_NONE);
+    mbedtls_ssl_conf_rng(&worker->tls_conf, mbedtls_ctr_drbg_random,
+                         &worker->ctr_drbg);
+}
+
+
+__attribute_cold__
+__attribute_noinline__
+static void
+worker_tls_delete (Worker * const restrict worker)
+{
+    mbedtls_ssl_config_free(&worker->tls_conf);
+    mbedtls_ctr_drbg_free(&worker->ctr_drbg);
+    mbedtls_entropy_free(&worker->entropy);
+}
+
+#endif
+
+
 __attribute_cold__
 static void
 client_init (Worker * const restrict worker,
@@ -304,6 +436,9 @@ client_init (Worker * const restrict worker,
     client->parser_state = PARSER_CONNECT;
 
     client->stats = &worker->stats;
+    client->latency = worker->latency;
+    client->worker = worker;
+    client->open_loop = (0 != config->rate);
     client->raddr = &worker->raddr;
     client->laddr = config->laddrs.num > 0
                   ? config->laddrs.addrs[(i % config->laddrs.num)]
@@ -315,6 +450,24 @@ client_init (Worker * const restrict worker,
     client->so_bufsz         = config->so_bufsz;
     client->request_size     = config->request_size;
     client->request          = config->request;
+    client->http_request_size= config->request_size;
+    client->http_request     = config->request;
+    client->websocket        = (0 != config->ws_message_size);
+    client->ws_frame_size    = config->ws_frame_size;
+    client->ws_frame         = config->ws_frame;
+  #ifdef WEIGHTTP_HAVE_MBEDTLS
+    if (config->tls) {
+        client->ssl = (mbedtls_ssl_context *)calloc(1, sizeof(*client->ssl));
+        mbedtls_ssl_init(client->ssl);
+        if (0 != mbedtls_ssl_setup(client->ssl, &worker->tls_conf)
+            || 0 != mbedtls_ssl_set_hostname(client->ssl, config->tls_host)) {
+            fprintf(stderr, "error: could not set up TLS context\n");
+            exit(1);
+        }
+        mbedtls_ssl_set_bio(client->ssl, client,
+                            client_tls_send, client_tls_recv, NULL);
+    }
+  #endif
     /* future: might copy config->request to new allocation in Worker
      * so that all memory accesses during benchmark execution are to
      * independent, per-thread allocations */
@@ -325,8 +478,16 @@ __attribute_cold__
 static void
 client_delete (const Client * const restrict client)
 {
-    if (-1 != client->pfd->fd)
+    if (client->pfd->fd < -1) /*(idle in open loop)*/
+        close(~client->pfd->fd);
+    else if (-1 != client->pfd->fd)
         close(client->pfd->fd);
+  #ifdef WEIGHTTP_HAVE_MBEDTLS
+    if (client->ssl) {
+        mbedtls_ssl_free(client->ssl);
+        free(client->ssl);
+    }
+  #endif
 }
 
 
@@ -349,8 +510,18 @@ worker_init (Worker * const restrict worker,
              &config->raddr_storage, config->raddr.ai_addrlen);
     const int num_clients = wconf->num_clients;
     worker->stats.req_todo = wconf->num_requests;
+    worker->latency = wconf->latency;
     worker->pfds = (struct pollfd *)calloc(num_clients, sizeof(struct pollfd));
     worker->clients = (Client *)calloc(num_clients, sizeof(Client));
+  #ifdef WEIGHTTP_HAVE_MBEDTLS
+    if (config->tls)
+        worker_tls_init(worker);
+  #endif
+    if (config->rate) {
+        worker->idle = (Client **)calloc(num_clients, sizeof(Client *));
+        worker->interval_ns =
+          (uint64_t)1000000000 * config->thread_count / config->rate;
+    }
     for (int i = 0; i < num_clients; ++i)
         client_init(worker, wconf->config, i);
 }
@@ -378,6 +549,11 @@ worker_delete (Worker * const restrict worker,
     for (i = 0; i < num_clients; ++i)
         client_delete(worker->clients+i);
     free(worker->clients);
+    free(worker->idle);
+  #ifdef WEIGHTTP_HAVE_MBEDTLS
+    if (wconf->config->tls)
+        worker_tls_delete(worker);
+  #endif
     free(worker->pfds);
 }
 
@@ -416,6 +592,8 @@ wconfs_init (Config * const restrict config)
         wconfs[i].id = i;
         wconfs[i].num_clients = concur;
         wconfs[i].num_requests = reqs;
+        wconfs[i].latency =
+          (uint64_t *)calloc(LATENCY_BUCKETS, sizeof(uint64_t));
     }
 
     config->wconfs = wconfs;
@@ -427,10 +605,14 @@ __attribute_noinline__
 static void
 wconfs_delete (const Config * const restrict config)
 {
+    for (int i = 0; i < config->thread_count; ++i)
+        free(config->wconfs[i].latency);
     free(config->wconfs);
     if (config->request < config->buf
         || config->buf+sizeof(config->buf) <= config->request)
         free(config->request);
+    free(config->ws_frame);
+    free(config->tls_host);
 
     if (config->laddrs.num > 0) {
         for (int i = 0; i < config->laddrs.num; ++i)
@@ -440,24 +622,106 @@ wconfs_delete (const Config * const restrict config)
 }
 
 
+static uint64_t
+now_usec (void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + (uint64_t)ts.tv_nsec / 1000;
+}
+
+
+static uint32_t
+latency_bucket (const uint64_t usec)
+{
+    if (usec < LATENCY_LINEAR_BUCKETS)
+        return (uint32_t)usec;
+    if (usec >> 32)
+        return LATENCY_BUCKETS - 1;
+
+    const int msb = 63 - __builtin_clzll(usec);
+    return LATENCY_LINEAR_BUCKETS + (msb - 5) * LATENCY_SUB_BUCKETS
+         + ((usec >> (msb - 4)) & (LATENCY_SUB_BUCKETS - 1));
+}
+
+
+static uint64_t
+latency_bucket_value (const uint32_t bucket)
+{
+    if (bucket < LATENCY_LINEAR_BUCKETS)
+        return bucket;
+
+    const uint32_t octave = (bucket - LATENCY_LINEAR_BUCKETS) / LATENCY_SUB_BUCKETS;
+    const uint32_t sub = (bucket - LATENCY_LINEAR_BUCKETS) % LATENCY_SUB_BUCKETS;
+    const uint64_t lower = (uint64_t)(LATENCY_SUB_BUCKETS + sub) << (octave + 1);
+    /*(report the middle of the bucket)*/
+    return lower + ((uint64_t)1 << octave);
+}
+
+
+static void
+client_close (Client * const restrict client)
+{
+  #ifdef WEIGHTTP_HAVE_MBEDTLS
+    if (client->ssl) {
+        mbedtls_ssl_session_reset(client->ssl);
+        client->tls_ready = 0;
+    }
+  #endif
+    close(client->pfd->fd);
+    client->pfd->fd = -1;
+    client->pfd->events = 0;
+    /*client->pfd->revents = 0;*/
+    client->parser_state = PARSER_CONNECT;
+}
+
+
 __attribute_hot__
 static void
 client_reset (Client * const restrict client, const int success)
 {
     /* update worker stats */
     Stats * const restrict stats = client->stats;
+    const uint64_t now = now_usec();
 
     ++stats->req_done;
-    if (__builtin_expect( (0 != success), 1))
+    if (__builtin_expect( (0 != success), 1)) {
         ++stats->req_success;
+        /*(with pipelining, this is the time since the previous response)*/
+        ++client->latency[latency_bucket(now - client->req_ts)];
+    }
     else
         ++stats->req_failed;
 
+    if (client->open_loop) {
+        /* the next request is started by worker_send_due() when it is due,
+         * reusing the connection if kept alive */
+        client->revents = 0;
+        if (client->keepalive) {
+            /*(negative fds are ignored by poll() while the client is idle)*/
+            client->pfd->fd = ~client->pfd->fd;
+            client->pfd->events &= ~POLLOUT;
+            client->parser_state =
+              client->ws_open ? PARSER_WS_HEADER : PARSER_START;
+            client->keptalive = 1;
+            client->pipelined = 0;
+            client->parser_offset = 0;
+            client->buffer_offset = 0;
+        }
+        else
+            client_close(client);
+        if (stats->req_started < stats->req_todo)
+            client->worker->idle[client->worker->num_idle++] = client;
+        return;
+    }
+
     client->revents = (stats->req_started < stats->req_todo) ? POLLOUT : 0;
     if (client->revents && client->keepalive) {
         /*(assumes writable; will find out soon if not and register interest)*/
         ++stats->req_started;
-        client->parser_state = PARSER_START;
+        client->req_ts = now;
+        client->parser_state =
+          client->ws_open ? PARSER_WS_HEADER : PARSER_START;
         client->keptalive = 1;
         if (client->parser_offset == client->buffer_offset) {
             client->parser_offset = 0;
@@ -480,13 +744,8 @@ client_reset (Client * const restrict client, const int success)
         if (--client->pipelined && client->buffer_offset)
             client->revents |= POLLIN;
     }
-    else {
-        close(client->pfd->fd);
-        client->pfd->fd = -1;
-        client->pfd->events = 0;
-        /*client->pfd->revents = 0;*/
-        client->parser_state = PARSER_CONNECT;
-    }
+    else
+        client_close(client);
 }
 
 
@@ -540,6 +799,10 @@ client_connected (Client * const restrict client)
     client->keepalive = client->config_keepalive;
     client->keptalive = 0;
     /*client->success = 0;*/
+    client->request = client->http_request;
+    client->request_size = client->http_request_size;
+    client->ws_switching = 0;
+    client->ws_open = 0;
 }
 
 
@@ -552,7 +815,10 @@ client_connect (Client * const restrict client)
     int opt;
 
     if (-1 == fd) {
-        ++client->stats->req_started;
+        if (!client->open_loop) {/*(open loop: counted when it was due)*/
+            ++client->stats->req_started;
+            client->req_ts = now_usec();
+        }
 
         do {
             fd = socket(raddr->ai_family,raddr->ai_socktype,raddr->ai_protocol);
@@ -783,6 +1049,51 @@ client_parse (Client * const restrict client)
 
     switch (client->parser_state) {
 
+      case PARSER_WS_HEADER: {
+        /* echoed message: a frame from the server, which isn't masked */
+        const unsigned char * const restrict hdr =
+          (const unsigned char *)client->buffer + client->parser_offset;
+        const uint32_t avail = client->buffer_offset - client->parser_offset;
+        uint32_t hdr_len = 2;
+        uint64_t payload_len;
+
+        if (avail < 2)
+            return 1;
+        if ((hdr[0] & 0x0f) == 0x08) { /*(close frame)*/
+            client->keepalive = 0;
+            client_error(client);
+            return 0;
+        }
+        payload_len = hdr[1] & 0x7f;
+        if (126 == payload_len) {
+            hdr_len = 4;
+            if (avail < hdr_len)
+                return 1;
+            payload_len = (uint64_t)hdr[2] << 8 | hdr[3];
+        }
+        else if (127 == payload_len) {
+            hdr_len = 10;
+            if (avail < hdr_len)
+                return 1;
+            payload_len = 0;
+            for (int i = 2; i < 10; ++i)
+                payload_len = payload_len << 8 | hdr[i];
+        }
+        if (hdr[1] & 0x80) { /*(masked; not expected from a server)*/
+            client_error(client);
+            return 0;
+        }
+
+        client->stats->bytes_headers += hdr_len;
+        client->parser_offset += hdr_len;
+        ++client->stats->req_2xx;
+        client->http_status_success = 1;
+        client->chunked = 0;
+        client->content_length = (int64_t)payload_len;
+        client->parser_state = PARSER_BODY;
+        goto parse_body;
+      }
+
       case PARSER_START:
         /* look for HTTP/1.1 200 OK (though also accept HTTP/1.0 200)
          * Note: does not support 1xx intermediate messages */
@@ -805,6 +1116,15 @@ client_parse (Client * const restrict client)
         client->http_status_success = 1;
         switch (client->buffer[client->parser_offset + sizeof("HTTP/1.1 ")-1]
                 - '0') {
+          case 1:
+            /*(only 101 Switching Protocols, in WebSocket echo mode)*/
+            if (!client->websocket || client->ws_open) {
+                client_error(client);
+                return 0;
+            }
+            client->ws_switching = 1;
+            ++client->stats->req_2xx; /*(handshake counts as a request)*/
+            break;
           case 2:
             ++client->stats->req_2xx;
             break;
@@ -891,6 +1211,16 @@ client_parse (Client * const restrict client)
         /* body reached */
         client->stats->bytes_headers += 2;
         client->parser_offset += 2;
+        if (client->ws_switching) {
+            /* the handshake counts as a request; from now on, requests are
+             * messages sent to the server and responses are their echoes */
+            client->ws_switching = 0;
+            client->ws_open = 1;
+            client->request = client->ws_frame;
+            client->request_size = client->ws_frame_size;
+            client_reset(client, 1);
+            return 0; /*(trigger loop continue in caller)*/
+        }
         client->parser_state = PARSER_BODY;
         if (client->http_head)
             client->content_length = 0;
@@ -899,6 +1229,7 @@ client_parse (Client * const restrict client)
         /* fall through */
 
       case PARSER_BODY:
+      parse_body:
         /* consume and discard response body */
 
         if (client->chunked)
@@ -929,23 +1260,118 @@ client_parse (Client * const restrict client)
 }
 
 
+#ifdef WEIGHTTP_HAVE_MBEDTLS
+
+/* Returns 1 once the TLS handshake is done, 0 if it has to wait for the
+ * socket (with the poll events it waits for set), or -1 on error */
+static int
+client_tls_handshake (Client * const restrict client)
+{
+    if (client->tls_ready)
+        return 1;
+
+    const int r = mbedtls_ssl_handshake(client->ssl);
+    if (0 == r) {
+        client->tls_ready = 1;
+        return 1;
+    }
+
+    client->revents = 0;
+    if (MBEDTLS_ERR_SSL_WANT_READ == r) {
+        client->pfd->events = POLLIN;
+        return 0;
+    }
+    if (MBEDTLS_ERR_SSL_WANT_WRITE == r) {
+        client->pfd->events = POLLOUT;
+        return 0;
+    }
+
+    fprintf(stderr, "error: TLS handshake failed (%d)\n", r);
+    client->keepalive = 0;
+    client_error(client);
+    return -1;
+}
+
+#endif
+
+
+static ssize_t
+client_recv (Client * const restrict client, char * const buf,
+             const size_t len)
+{
+  #ifdef WEIGHTTP_HAVE_MBEDTLS
+    if (client->ssl) {
+        const int r = mbedtls_ssl_read(client->ssl, (unsigned char *)buf, len);
+        if (r >= 0)
+            return r;
+        if (MBEDTLS_ERR_SSL_PEER_CLOSE_NOTIFY == r)
+            return 0;
+        errno = (MBEDTLS_ERR_SSL_WANT_READ == r
+                 || MBEDTLS_ERR_SSL_WANT_WRITE == r) ? EAGAIN : EIO;
+        return -1;
+    }
+  #endif
+    ssize_t r;
+    do {
+        r = recv(client->pfd->fd, buf, len, MSG_DONTWAIT);
+    } while (__builtin_expect( (-1 == r), 0) && errno == EINTR);
+    return r;
+}
+
+
+static ssize_t
+client_send (Client * const restrict client, const char * const buf,
+             const size_t len)
+{
+  #ifdef WEIGHTTP_HAVE_MBEDTLS
+    if (client->ssl) {
+        const int r =
+          mbedtls_ssl_write(client->ssl, (const unsigned char *)buf, len);
+        if (r >= 0)
+            return r;
+        errno = (MBEDTLS_ERR_SSL_WANT_READ == r
+                 || MBEDTLS_ERR_SSL_WANT_WRITE == r) ? EAGAIN : EIO;
+        return -1;
+    }
+  #endif
+    ssize_t r;
+    do {
+        r = send(client->pfd->fd, buf, len, MSG_DONTWAIT | MSG_NOSIGNAL);
+    } while (__builtin_expect( (-1 == r), 0) && errno == EINTR);
+    return r;
+}
+
 
 static void
 client_revents (Client * const restrict client)
 {
+  #ifdef WEIGHTTP_HAVE_MBEDTLS
+    if (client->ssl && !client->tls_ready
+        && client->parser_state != PARSER_CONNECT
+        && (client->revents & (POLLIN|POLLOUT))) {
+        const int r = client_tls_handshake(client);
+        if (0 == r)
+            return;
+        if (1 == r)
+            client->revents = POLLOUT; /*(send request)*/
+    }
+  #endif
+
     while (client->revents & POLLIN) {
         /* parse pipelined responses */
         if (client->buffer_offset && !client_parse(client))
             continue;
 
-        ssize_t r;
-        do {
-            r = recv(client->pfd->fd, client->buffer+client->buffer_offset,
-                     sizeof(client->buffer) - client->buffer_offset - 1,
-                     MSG_DONTWAIT);
-        } while (__builtin_expect( (-1 == r), 0) && errno == EINTR);
+        const ssize_t r =
+          client_recv(client, client->buffer+client->buffer_offset,
+                      sizeof(client->buffer) - client->buffer_offset - 1);
         if (__builtin_expect( (r > 0), 1)) {
-            if (r < (ssize_t)(sizeof(client->buffer)-client->buffer_offset-1))
+            if (r < (ssize_t)(sizeof(client->buffer)-client->buffer_offset-1)
+              #ifdef WEIGHTTP_HAVE_MBEDTLS
+                /*(decrypted data might be buffered in the TLS context)*/
+                && (!client->ssl || 0==mbedtls_ssl_get_bytes_avail(client->ssl))
+              #endif
+               )
                 client->revents &= ~POLLIN;
             client->buffer[(client->buffer_offset += (uint32_t)r)] = '\0';
             client->stats->bytes_total += r;
@@ -1019,16 +1445,21 @@ client_revents (Client * const restrict client)
     }
 
     while (client->revents & POLLOUT) {
-        ssize_t r;
         if (client->parser_state == PARSER_CONNECT && !client_connect(client))
             continue;
+      #ifdef WEIGHTTP_HAVE_MBEDTLS
+        if (client->ssl && !client->tls_ready) {
+            const int hs = client_tls_handshake(client);
+            if (0 == hs)
+                break;
+            if (-1 == hs)
+                continue;
+        }
+      #endif
 
-        do {
-            r = send(client->pfd->fd,
-                     client->request+client->request_offset,
-                     client->request_size - client->request_offset,
-                     MSG_DONTWAIT | MSG_NOSIGNAL);
-        } while (__builtin_expect( (-1 == r), 0) && errno == EINTR);
+        const ssize_t r =
+          client_send(client, client->request+client->request_offset,
+                      client->request_size - client->request_offset);
         if (__builtin_expect( (r > 0), 1)) {
             if (client->request_size == (uint32_t)r
                 || client->request_size==(client->request_offset+=(uint32_t)r)){
@@ -1071,6 +1502,59 @@ client_revents (Client * const restrict client)
 
 
 
+/* Open loop: start the requests that are due on idle clients.  Each request
+ * is timed from when it was due rather than from when it was sent, so that
+ * time spent waiting for a client to become available (as it would happen
+ * to a real user if the server stalled) is included in its latency.
+ * Returns the time until the next request is due in nsec, or -1 if waiting
+ * for responses. */
+static int64_t
+worker_send_due (Worker * const restrict worker)
+{
+    Stats * const restrict stats = &worker->stats;
+    const uint64_t now_ns = now_usec() * 1000;
+
+    while (worker->num_idle && stats->req_started < stats->req_todo
+           && worker->next_send_ns <= now_ns) {
+        Client * const restrict client = worker->idle[--worker->num_idle];
+
+        ++stats->req_started;
+        client->req_ts = worker->next_send_ns / 1000;
+        worker->next_send_ns += worker->interval_ns;
+
+        if (client->pfd->fd < -1)
+            client->pfd->fd = ~client->pfd->fd;
+
+        client->revents = POLLOUT;
+        client_revents(client);
+    }
+
+    if (!worker->num_idle || stats->req_started >= stats->req_todo)
+        return -1;
+    if (worker->next_send_ns <= now_ns)
+        return 0;
+    return (int64_t)(worker->next_send_ns - now_ns);
+}
+
+
+static int
+worker_poll (Worker * const restrict worker, const int num_clients,
+             const int64_t timeout_ns)
+{
+    if (timeout_ns < 0)                      /*(infinite wait)*/
+        return poll(worker->pfds, (nfds_t)num_clients, -1);
+  #if defined(__linux__) || defined(__FreeBSD__)
+    /*(requests can be due more often than poll()'s 1ms resolution)*/
+    const struct timespec ts = { .tv_sec  = timeout_ns / 1000000000,
+                                 .tv_nsec = timeout_ns % 1000000000 };
+    return ppoll(worker->pfds, (nfds_t)num_clients, &ts, NULL);
+  #else
+    return poll(worker->pfds, (nfds_t)num_clients,
+                (int)((timeout_ns + 999999) / 1000000));
+  #endif
+}
+
+
 static void *
 worker_thread (void * const arg)
 {
@@ -1088,15 +1572,22 @@ worker_thread (void * const arg)
 
     /* start all clients */
     for (i = 0; i < num_clients; ++i) {
-        if (worker.stats.req_started < worker.stats.req_todo) {
+        if (wconf->config->rate)
+            worker.idle[worker.num_idle++] = worker.clients+i;
+        else if (worker.stats.req_started < worker.stats.req_todo) {
             worker.clients[i].revents = POLLOUT;
             client_revents(worker.clients+i);
         }
     }
+    worker.next_send_ns = now_usec() * 1000;
 
     while (worker.stats.req_done < worker.stats.req_todo) {
-        do {                                 /*(infinite wait)*/
-            nready = poll(worker.pfds, (nfds_t)num_clients, -1);
+        const int64_t timeout_ns =
+          wconf->config->rate ? worker_send_due(&worker) : -1;
+        if (worker.stats.req_done >= worker.stats.req_todo)
+            break;
+        do {
+            nready = worker_poll(&worker, num_clients, timeout_ns);
         } while (__builtin_expect( (-1 == nready), 0) && errno == EINTR);
         if (__builtin_expect( (-1 == nready), 0)) {
             /*(repurpose client_perror(); use client buffer for strerror_r())*/
@@ -1105,6 +1596,8 @@ worker_thread (void * const arg)
         }
 
         i = 0;
+        if (0 == nready)
+            continue;
         do {
             while (0 == worker.pfds[i].revents)
                 ++i;
@@ -1410,6 +1903,46 @@ config_base64_encode_pad (char * const restrict dst, const size_t dstsz,
 }
 
 
+/* Builds the text frame sent in WebSocket echo mode; frames sent by clients
+ * have to be masked (RFC6455 5.3), and the same mask is used for all */
+__attribute_cold__
+static void
+config_ws_frame (Config * const restrict config)
+{
+    static const unsigned char mask[4] = { 0x37, 0xfa, 0x21, 0x3d };
+    const uint32_t n = config->ws_message_size;
+    uint32_t hdr_len;
+    unsigned char *frame = (unsigned char *)malloc(14 + (size_t)n);
+    if (NULL == frame)
+        config_error("could not allocate WebSocket frame");
+
+    frame[0] = 0x81; /* FIN | text */
+    if (n < 126) {
+        frame[1] = 0x80 | (unsigned char)n;
+        hdr_len = 2;
+    }
+    else if (n <= UINT16_MAX) {
+        frame[1] = 0x80 | 126;
+        frame[2] = (unsigned char)(n >> 8);
+        frame[3] = (unsigned char)n;
+        hdr_len = 4;
+    }
+    else {
+        frame[1] = 0x80 | 127;
+        for (int i = 0; i < 8; ++i)
+            frame[2+i] = (unsigned char)((uint64_t)n >> (56 - 8*i));
+        hdr_len = 10;
+    }
+    memcpy(frame+hdr_len, mask, sizeof(mask));
+    hdr_len += (uint32_t)sizeof(mask);
+    for (uint32_t i = 0; i < n; ++i)
+        frame[hdr_len+i] = 'x' ^ mask[i & 3];
+
+    config->ws_frame = (char *)frame;
+    config->ws_frame_size = hdr_len + n;
+}
+
+
 __attribute_cold__
 static void
 config_request (Config * const restrict config,
@@ -1425,7 +1958,11 @@ config_request (Config * const restrict config,
     else if (0 == strncmp(uri, "https://", sizeof("https://")-1)) {
         uri += 8;
         port = default_port = 443;
-        config_error("no ssl support yet");
+      #ifdef WEIGHTTP_HAVE_MBEDTLS
+        config->tls = 1;
+      #else
+        config_error("built without TLS support (mbedTLS)");
+      #endif
     }
 
     /* XXX: note that this is not a fully proper URI parse */
@@ -1465,6 +2002,8 @@ config_request (Config * const restrict config,
 
     /* resolve hostname to sockaddr */
     config_raddr(config, host, port, params->use_ipv6);
+    if (config->tls)
+        config->tls_host = strdup(host); /*(for SNI)*/
 
     int idx_host = -1;
     int idx_user_agent = -1;
@@ -1515,7 +2054,21 @@ config_request (Config * const restrict config,
         config_error("request too large");
     offset += len;
 
-    if (!config->keep_alive) {
+    if (config->ws_message_size) {
+        /*(fixed key; the server's Sec-WebSocket-Accept is not verified)*/
+        static const char ws_upgrade[] =
+          "Connection: Upgrade\r\n"
+          "Upgrade: websocket\r\n"
+          "Sec-WebSocket-Version: 13\r\n"
+          "Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\n";
+        len = sizeof(ws_upgrade)-1;
+        if (len >= (int)sz - offset)
+            config_error("request too large");
+        memcpy(req+offset, ws_upgrade, len);
+        offset += len;
+        config_ws_frame(config);
+    }
+    else if (!config->keep_alive) {
         len = sizeof("Connection: close\r\n")-1;
         if (len >= (int)sz - offset)
             config_error("request too large");
@@ -1684,15 +2237,21 @@ weighttp_setup (Config * const restrict config, const int argc, char *argv[])
     config->keep_alive = 0;
     config->proxy = NULL;
     config->pipeline_max = 0;
+    config->rate = 0;
     config->tcp_fastopen = 0;
     config->http_head = 0;
     config->so_bufsz = 0;
     config->quiet = 0;
+    config->tls = 0;
+    config->tls_host = NULL;
+    config->ws_message_size = 0;
+    config->ws_frame_size = 0;
+    config->ws_frame = NULL;
 
     setlocale(LC_ALL, "C");
     signal(SIGPIPE, SIG_IGN);
 
-    const char * const optstr = ":hVikqdlr6Fm:n:t:c:b:p:u:A:B:C:H:K:P:T:X:";
+    const char * const optstr = ":hVikqdlr6Fm:n:t:c:b:p:u:A:B:C:H:K:P:R:T:W:X:";
     int opt;
     while (-1 != (opt = getopt(argc, argv, optstr))) {
         switch (opt) {
@@ -1726,9 +2285,22 @@ weighttp_setup (Config * const restrict config, const int argc, char *argv[])
           case 'P':
             params.proxy_authorization = optarg;
             break;
+          case 'R':
+            config->rate = strtoull(optarg, NULL, 10);
+            break;
           case 'T':
             params.body_content_type = optarg;
             break;
+          case 'W':
+            {
+                char *endptr;
+                unsigned long n = strtoul(optarg, &endptr, 10);
+                if (*endptr != '\0' || 0 == n || n > 16*1024*1024)
+                    config_error("invalid WebSocket message size: %s", optarg);
+                config->ws_message_size = (uint32_t)n;
+                config->keep_alive = 1;
+            }
+            break;
           case 'X':
             config->proxy = optarg;
             break;
@@ -1819,6 +2391,14 @@ weighttp_setup (Config * const restrict config, const int argc, char *argv[])
         config_error("thread_count > concur_count");
     if (config->pipeline_max < 1)
         config->pipeline_max = 1;
+    if (config->rate && config->pipeline_max > 1)
+        config_error("open loop (-R) can't be used with pipelining (-K)");
+    if (config->rate && config->rate < (uint64_t)config->thread_count)
+        config_error("rate has to be >= thread count");
+    if (config->ws_message_size && config->pipeline_max > 1)
+        config_error("WebSocket echo (-W) can't be used with pipelining (-K)");
+    if (config->ws_message_size && (params.body_filename || config->http_head))
+        config_error("WebSocket echo (-W) needs a GET request");
     if (NULL == params.method)
         params.method = config->http_head ? "HEAD" : "GET";
 
@@ -1864,7 +2444,8 @@ weighttp_setup (Config * const restrict config, const int argc, char *argv[])
 
     /* (see [RFC7413] 4.1.3. Client Cookie Handling) */
     if ((config->proxy && config->proxy[0] == '/')
-        || config->request_size > (params.use_ipv6 ? 1440 : 1460))
+        || config->request_size > (params.use_ipv6 ? 1440 : 1460)
+        || config->tls) /*(handshake has to happen before the request)*/
         config->tcp_fastopen = 0;
 }
 
@@ -1892,6 +2473,32 @@ weighttp_report (const Config * const restrict config)
         stats.req_5xx       += wstats->req_5xx;
     }
 
+    /* merge latency histograms */
+    uint64_t latency[LATENCY_BUCKETS];
+    memset(latency, 0, sizeof(latency));
+    for (int i = 0; i < config->thread_count; ++i) {
+        for (int b = 0; b < LATENCY_BUCKETS; ++b)
+            latency[b] += config->wconfs[i].latency[b];
+    }
+    static const struct { const char *name; uint64_t per_million; } pcts[] = {
+        { "p50", 500000 }, { "p90", 900000 }, { "p99", 990000 },
+        { "p99.9", 999000 }, { "max", 1000000 }
+    };
+    uint64_t pct_values[sizeof(pcts) / sizeof(pcts[0])];
+    for (size_t p = 0; p < sizeof(pcts) / sizeof(pcts[0]); ++p) {
+        const uint64_t rank =
+          (stats.req_success * pcts[p].per_million + 999999) / 1000000;
+        uint64_t seen = 0;
+        pct_values[p] = 0;
+        for (int b = 0; b < LATENCY_BUCKETS; ++b) {
+            seen += latency[b];
+            if (latency[b] && seen >= rank) {
+                pct_values[p] = latency_bucket_value((uint32_t)b);
+                break;
+            }
+        }
+    }
+
     /* report cumulative stats */
     struct timeval tdiff;
     tdiff.tv_sec  = config->ts_end.tv_sec  - config->ts_start.tv_sec;
@@ -1907,8 +2514,9 @@ weighttp_report (const Config * const restrict config)
     printf("{\n"
            "  \"reqs_per_sec\": %"PRIu64",\n"
            "  \"kBps_per_sec\": %"PRIu64",\n"
+           "  \"target_reqs_per_sec\": %"PRIu64",\n"
            "  \"secs_elapsed\": %01d.%06ld,\n",
-           rps, kbps, (int)tdiff.tv_sec, (long)tdiff.tv_usec);
+           rps, kbps, config->rate, (int)tdiff.tv_sec, (long)tdiff.tv_usec);
     printf("  \"request_counts\": {\n"
            "    \"started\": %"PRIu64",\n"
            "    \"retired\": %"PRIu64",\n"
@@ -1928,6 +2536,12 @@ weighttp_report (const Config * const restrict config)
            "    \"5xx\":  %"PRIu64"\n"
            "  },\n",
            stats.req_2xx, stats.req_3xx, stats.req_4xx, stats.req_5xx);
+    printf("  \"latency_usec\": {\n");
+    for (size_t p = 0; p < sizeof(pcts) / sizeof(pcts[0]); ++p) {
+        printf("    \"%s\": %"PRIu64"%s\n", pcts[p].name, pct_values[p],
+               p + 1 < sizeof(pcts) / sizeof(pcts[0]) ? "," : "");
+    }
+    printf("  },\n");
     printf("  \"traffic\": {\n"
            "    \"bytes_total\":   %12."PRIu64",\n"
            "    \"bytes_headers\": %12."PRIu64",\n"
@@ -1949,6 +2563,11 @@ weighttp_report (const Config * const restrict config)
            "%"PRIu64" 2xx, %"PRIu64" 3xx, %"PRIu64" 4xx, %"PRIu64" 5xx\n",
            stats.req_2xx, stats.req_3xx, stats.req_4xx, stats.req_5xx);
 
+    printf("latency:");
+    for (size_t p = 0; p < sizeof(pcts) / sizeof(pcts[0]); ++p)
+        printf(" %s %"PRIu64" usec", pcts[p].name, pct_values[p]);
+    printf("\n");
+
     printf("traffic: %"PRIu64" bytes total, %"PRIu64" bytes headers, "
            "%"PRIu64" bytes body\n", stats.bytes_total,
            stats.bytes_headers, stats.bytes_total - stats.bytes_headers);
@@ -46,9 +46,13 @@
 #cmakedefine LWAN_HAVE_STATFS
 #cmakedefine LWAN_HAVE_SO_ATTACH_REUSEPORT_CBPF
 #cmakedefine LWAN_HAVE_SO_INCOMING_CPU
+#cmakedefine LWAN_HAVE_IO_URING
 #cmakedefine LWAN_HAVE_SYSLOG
 #cmakedefine LWAN_HAVE_STPCPY
 #cmakedefine LWAN_HAVE_EVENTFD
+#cmakedefine LWAN_HAVE_COPY_FILE_RANGE
+#cmakedefine LWAN_HAVE_CLOSE_RANGE
+#cmakedefine LWAN_HAVE_MALLOC_TRIM
 
 /* Compiler builtins for specific CPU instruction support */
 #cmakedefine LWAN_HAVE_BUILTIN_CLZLL
@@ -67,12 +71,17 @@
 #cmakedefine LWAN_HAVE_LUA_JIT
 #cmakedefine LWAN_HAVE_BROTLI
 #cmakedefine LWAN_HAVE_ZSTD
+#cmakedefine LWAN_HAVE_ISAL
 #cmakedefine LWAN_HAVE_LIBUCONTEXT
 #cmakedefine LWAN_HAVE_MBEDTLS
+#cmakedefine LWAN_HAVE_LIBXCRYPT
 
 /* Valgrind support for coroutines */
 #cmakedefine LWAN_HAVE_VALGRIND
 
+/* USDT probes (SystemTap, bpftrace, etc.) */
+#cmakedefine LWAN_HAVE_SYS_SDT_H
+
 /* Sanitizer */
 #cmakedefine LWAN_HAVE_UNDEFINED_SANITIZER
 #cmakedefine LWAN_HAVE_ADDRESS_SANITIZER
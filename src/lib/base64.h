@@ -7,6 +7,8 @@ unsigned char *base64_encode(const unsigned char *src, size_t len,
 			      size_t *out_len);
 unsigned char *base64_decode(const unsigned char *src, size_t len,
                              size_t *out_len);
+unsigned char *base64_decode_validated(const unsigned char *src, size_t len,
+                                       size_t *out_len);
 
 bool base64_validate(const unsigned char *src, size_t len);
 
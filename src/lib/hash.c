@@ -35,48 +35,54 @@
 #include "lwan-private.h"
 #include "hash.h"
 
-struct hash_bucket {
-    void **keys;
-    void **values;
-    unsigned int *hashvals;
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+/* Open addressing hash table, laid out like Abseil's "Swiss tables": slots
+ * are split in groups of 16, and each slot has a control byte that's
+ * either EMPTY, DELETED, or the lower 7 bits of the hash value of the key
+ * in that slot.  A lookup probes whole groups at once, comparing all 16
+ * control bytes of a group against the key's tag (with a single SSE2
+ * comparison where available), so keys only have to be compared for the
+ * few slots whose tags match.  */
+
+#define GROUP_SIZE 16
+#define MIN_GROUPS 1
+
+#define CTRL_EMPTY 0x80
+#define CTRL_DELETED 0xfe
+
+enum hash_key_kind {
+    HASH_KEY_STR,
+    HASH_KEY_INT,
+    HASH_KEY_INT64,
+};
 
-    unsigned int used;
-    unsigned int total;
+struct hash_slot {
+    void *key;
+    void *value;
 };
 
 struct hash {
     unsigned int count;
-    unsigned int n_buckets_mask;
+    unsigned int n_deleted;
+    unsigned int n_groups_mask;
+
+    enum hash_key_kind kind;
 
-    unsigned (*hash_value)(const void *key);
-    int (*key_equal)(const void *k1, const void *k2);
     void (*free_value)(void *value);
     void (*free_key)(void *value);
 
-    struct hash_bucket *buckets;
+    /* Both arrays are in the same allocation, control bytes last */
+    struct hash_slot *slots;
+    uint8_t *ctrl;
 
     unsigned int refs;
 };
 
-struct hash_entry {
-    void **key;
-    void **value;
-    unsigned int *hashval;
-
-    /* Only set when adding a new entry if it was already in the
-     * hash table -- always 0/false otherwise. */
-    bool existing;
-};
-
-#define MIN_BUCKETS 64
-
-/* Due to rehashing heuristics, most hash tables won't have more than 4
- * entries in each bucket.  Use a conservative allocation threshold to
- * curb wasteful allocations */
-#define STEPS 4
-
-static_assert((MIN_BUCKETS & (MIN_BUCKETS - 1)) == 0,
-              "Bucket size is power of 2");
+static_assert((MIN_GROUPS & (MIN_GROUPS - 1)) == 0,
+              "Number of groups is power of 2");
 
 #define DEFAULT_FNV1A_64_SEED 0xcbf29ce484222325ull
 #define DEFAULT_FNV1A_32_SEED 0x811c9dc5u
@@ -90,39 +96,9 @@ uint32_t fnv1a_32_seed = DEFAULT_FNV1A_32_SEED;
         assert(fnv1a_32_seed != DEFAULT_FNV1A_32_SEED);                        \
     } while (0)
 
-static inline unsigned int hash_fnv1a_32(const void *keyptr);
-static inline unsigned int hash_int_32(const void *keyptr);
-static inline unsigned int hash_int_64(const void *keyptr);
-
-static unsigned (*hash_str)(const void *key) = hash_fnv1a_32;
-static unsigned (*hash_int)(const void *key) = hash_int_32;
-static unsigned (*hash_int64)(const void *key) = hash_int_64;
-
-static bool resize_bucket(struct hash_bucket *bucket, unsigned int new_size)
-{
-    void **new_keys;
-    void **new_values;
-    unsigned int *new_hashvals;
-
-    new_keys = reallocarray(bucket->keys, new_size, STEPS * sizeof(void *));
-    new_values = reallocarray(bucket->values, new_size, STEPS * sizeof(void *));
-    new_hashvals =
-        reallocarray(bucket->hashvals, new_size, STEPS * sizeof(unsigned int));
-
-    if (new_keys)
-        bucket->keys = new_keys;
-    if (new_values)
-        bucket->values = new_values;
-    if (new_hashvals)
-        bucket->hashvals = new_hashvals;
-
-    if (new_keys && new_values && new_hashvals) {
-        bucket->total = new_size * STEPS;
-        return true;
-    }
-
-    return false;
-}
+#if defined(LWAN_HAVE_BUILTIN_CPU_INIT) && defined(LWAN_HAVE_BUILTIN_IA32_CRC32)
+static bool use_crc32;
+#endif
 
 static inline unsigned int hash_fnv1a_32(const void *keyptr)
 {
@@ -227,44 +203,162 @@ __attribute__((constructor(65535))) static void initialize_fnv1a_seed(void)
     __builtin_cpu_init();
     if (__builtin_cpu_supports("sse4.2")) {
         lwan_status_debug("Using CRC32 instructions to calculate hashes");
-        hash_str = hash_str_crc32;
-        hash_int = hash_int_crc32;
-        hash_int64 = hash_int64_crc32;
+        use_crc32 = true;
     }
 #endif
 }
 
-static inline int hash_int_key_equal(const void *k1, const void *k2)
+/* The key type is known when the table is created, so, instead of calling
+ * the hashing and comparison functions through pointers, branch on it;
+ * this lets the compiler inline everything in the lookup path.  */
+static ALWAYS_INLINE unsigned int hash_key(const struct hash *hash,
+                                           const void *key)
 {
+#if defined(LWAN_HAVE_BUILTIN_CPU_INIT) && defined(LWAN_HAVE_BUILTIN_IA32_CRC32)
+    if (LIKELY(use_crc32)) {
+        switch (hash->kind) {
+        case HASH_KEY_STR:
+            return hash_str_crc32(key);
+        case HASH_KEY_INT:
+            return hash_int_crc32(key);
+        case HASH_KEY_INT64:
+            return hash_int64_crc32(key);
+        }
+    }
+#endif
+
+    switch (hash->kind) {
+    case HASH_KEY_STR:
+        return hash_fnv1a_32(key);
+    case HASH_KEY_INT:
+        return hash_int_32(key);
+    case HASH_KEY_INT64:
+    default:
+        return hash_int_64(key);
+    }
+}
+
+static ALWAYS_INLINE bool
+key_equal(const struct hash *hash, const void *k1, const void *k2)
+{
+    if (hash->kind == HASH_KEY_STR)
+        return streq(k1, k2);
+
     return k1 == k2;
 }
 
+static ALWAYS_INLINE uint8_t hash_tag(unsigned int hashval)
+{
+    return (uint8_t)(hashval & 0x7f);
+}
+
+static ALWAYS_INLINE unsigned int hash_first_group(const struct hash *hash,
+                                                   unsigned int hashval)
+{
+    return (hashval >> 7) & hash->n_groups_mask;
+}
+
+/* Groups are probed quadratically (using triangular numbers), which visits
+ * every group once since the number of groups is a power of 2.  */
+static ALWAYS_INLINE unsigned int
+hash_next_group(const struct hash *hash, unsigned int group, unsigned int *step)
+{
+    return (group + ++*step) & hash->n_groups_mask;
+}
+
+#if defined(__SSE2__)
+static ALWAYS_INLINE unsigned int group_match(const uint8_t *ctrl, uint8_t tag)
+{
+    const __m128i group = _mm_loadu_si128((const __m128i *)ctrl);
+
+    return (unsigned int)_mm_movemask_epi8(
+        _mm_cmpeq_epi8(group, _mm_set1_epi8((char)tag)));
+}
+
+static ALWAYS_INLINE unsigned int group_match_non_full(const uint8_t *ctrl)
+{
+    /* Both EMPTY and DELETED have the most significant bit set. */
+    return (unsigned int)_mm_movemask_epi8(
+        _mm_loadu_si128((const __m128i *)ctrl));
+}
+#else
+static ALWAYS_INLINE unsigned int group_match(const uint8_t *ctrl, uint8_t tag)
+{
+    unsigned int mask = 0;
+
+    for (unsigned int i = 0; i < GROUP_SIZE; i++)
+        mask |= (unsigned int)(ctrl[i] == tag) << i;
+
+    return mask;
+}
+
+static ALWAYS_INLINE unsigned int group_match_non_full(const uint8_t *ctrl)
+{
+    unsigned int mask = 0;
+
+    for (unsigned int i = 0; i < GROUP_SIZE; i++)
+        mask |= (unsigned int)(ctrl[i] >> 7) << i;
+
+    return mask;
+}
+#endif
+
+static ALWAYS_INLINE unsigned int group_match_empty(const uint8_t *ctrl)
+{
+    return group_match(ctrl, CTRL_EMPTY);
+}
+
 static void no_op(void *arg __attribute__((unused))) {}
 
-static struct hash *
-hash_internal_new(unsigned int (*hash_value)(const void *key),
-                  int (*key_equal)(const void *k1, const void *k2),
-                  void (*free_key)(void *value),
-                  void (*free_value)(void *value))
+static __attribute__((pure)) inline unsigned int
+hash_capacity(const struct hash *hash)
+{
+    return (hash->n_groups_mask + 1) * GROUP_SIZE;
+}
+
+static inline unsigned int max_load(unsigned int capacity)
+{
+    /* Up to 7/8 of the slots can be used (or deleted) before growing.  */
+    return capacity - capacity / 8;
+}
+
+static bool alloc_slots(struct hash *hash, unsigned int n_groups)
+{
+    const size_t capacity = (size_t)n_groups * GROUP_SIZE;
+    struct hash_slot *slots;
+
+    slots = malloc(capacity * (sizeof(struct hash_slot) + 1));
+    if (!slots)
+        return false;
+
+    hash->slots = slots;
+    hash->ctrl = (uint8_t *)(slots + capacity);
+    hash->n_groups_mask = n_groups - 1;
+    hash->n_deleted = 0;
+    memset(hash->ctrl, CTRL_EMPTY, capacity);
+
+    return true;
+}
+
+static struct hash *hash_internal_new(enum hash_key_kind kind,
+                                      void (*free_key)(void *value),
+                                      void (*free_value)(void *value))
 {
     struct hash *hash = malloc(sizeof(*hash));
 
     if (hash == NULL)
         return NULL;
 
-    hash->buckets = calloc(MIN_BUCKETS, sizeof(struct hash_bucket));
-    if (hash->buckets == NULL) {
+    if (!alloc_slots(hash, MIN_GROUPS)) {
         free(hash);
         return NULL;
     }
 
-    hash->hash_value = hash_value;
-    hash->key_equal = key_equal;
+    hash->kind = kind;
 
-    hash->free_value = free_value;
-    hash->free_key = free_key;
+    hash->free_value = free_value ? free_value : no_op;
+    hash->free_key = free_key ? free_key : no_op;
 
-    hash->n_buckets_mask = MIN_BUCKETS - 1;
     hash->count = 0;
 
     hash->refs = 1;
@@ -275,31 +369,19 @@ hash_internal_new(unsigned int (*hash_value)(const void *key),
 struct hash *hash_int_new(void (*free_key)(void *value),
                           void (*free_value)(void *value))
 {
-    return hash_internal_new(hash_int, hash_int_key_equal,
-                             free_key ? free_key : no_op,
-                             free_value ? free_value : no_op);
+    return hash_internal_new(HASH_KEY_INT, free_key, free_value);
 }
 
 struct hash *hash_int64_new(void (*free_key)(void *value),
                             void (*free_value)(void *value))
 {
-    return hash_internal_new(hash_int64, hash_int_key_equal,
-                             free_key ? free_key : no_op,
-                             free_value ? free_value : no_op);
+    return hash_internal_new(HASH_KEY_INT64, free_key, free_value);
 }
 
 struct hash *hash_str_new(void (*free_key)(void *value),
                           void (*free_value)(void *value))
 {
-    return hash_internal_new(
-        hash_str, (int (*)(const void *, const void *))streq,
-        free_key ? free_key : no_op, free_value ? free_value : no_op);
-}
-
-static __attribute__((pure)) inline unsigned int
-hash_n_buckets(const struct hash *hash)
-{
-    return hash->n_buckets_mask + 1;
+    return hash_internal_new(HASH_KEY_STR, free_key, free_value);
 }
 
 struct hash *hash_ref(struct hash *hash)
@@ -310,8 +392,6 @@ struct hash *hash_ref(struct hash *hash)
 
 void hash_unref(struct hash *hash)
 {
-    struct hash_bucket *bucket, *bucket_end;
-
     if (hash == NULL)
         return;
 
@@ -319,155 +399,131 @@ void hash_unref(struct hash *hash)
     if (hash->refs)
         return;
 
-    bucket = hash->buckets;
-    bucket_end = hash->buckets + hash_n_buckets(hash);
-    for (; bucket < bucket_end; bucket++) {
-        for (unsigned int entry = 0; entry < bucket->used; entry++) {
-            hash->free_value(bucket->values[entry]);
-            hash->free_key(bucket->keys[entry]);
-        }
-        free(bucket->keys);
-        free(bucket->values);
-        free(bucket->hashvals);
+    const unsigned int capacity = hash_capacity(hash);
+    for (unsigned int i = 0; i < capacity; i++) {
+        if (hash->ctrl[i] & 0x80)
+            continue;
+
+        hash->free_value(hash->slots[i].value);
+        hash->free_key(hash->slots[i].key);
     }
-    free(hash->buckets);
+    free(hash->slots);
     free(hash);
 }
 
-static struct hash_entry hash_add_entry_hashed(struct hash *hash,
-                                               const void *key,
-                                               unsigned int hashval)
+static ALWAYS_INLINE int hash_find_slot(const struct hash *hash,
+                                        const void *key,
+                                        unsigned int hashval)
 {
-    unsigned int pos = hashval & hash->n_buckets_mask;
-    struct hash_bucket *bucket = hash->buckets + pos;
-    unsigned int entry;
-    bool existing = false;
+    const uint8_t tag = hash_tag(hashval);
+    unsigned int group = hash_first_group(hash, hashval);
+    unsigned int step = 0;
 
-    if (bucket->used + 1 >= bucket->total) {
-        unsigned int new_bucket_total;
+    while (true) {
+        const uint8_t *ctrl = hash->ctrl + group * GROUP_SIZE;
 
-        if (__builtin_add_overflow(bucket->total, 1, &new_bucket_total))
-            return (struct hash_entry) {};
+        for (unsigned int m = group_match(ctrl, tag); m; m &= m - 1) {
+            const unsigned int slot =
+                group * GROUP_SIZE + (unsigned int)__builtin_ctz(m);
 
-        if (!resize_bucket(bucket, new_bucket_total))
-            return (struct hash_entry) {};
-    }
-
-    for (entry = 0; entry < bucket->used; entry++) {
-        if (hashval != bucket->hashvals[entry])
-            continue;
-        if (hash->key_equal(key, bucket->keys[entry])) {
-            existing = true;
-            goto done;
+            if (LIKELY(key_equal(hash, key, hash->slots[slot].key)))
+                return (int)slot;
         }
-    }
-
-    entry = bucket->used;
 
-    bucket->keys[entry] = NULL;
-    bucket->values[entry] = NULL;
-    bucket->hashvals[entry] = hashval;
-
-    bucket->used++;
-    hash->count++;
+        if (LIKELY(group_match_empty(ctrl)))
+            return -1;
 
-done:
-    return (struct hash_entry){
-        .key = &bucket->keys[entry],
-        .value = &bucket->values[entry],
-        .hashval = &bucket->hashvals[entry],
-        .existing = existing,
-    };
+        /* Tables are never full, so this will eventually find a group
+         * with an empty slot. */
+        group = hash_next_group(hash, group, &step);
+    }
 }
 
-static void rehash(struct hash *hash, unsigned int new_bucket_size)
+static unsigned int hash_find_non_full_slot(const struct hash *hash,
+                                            unsigned int hashval)
 {
-    struct hash_bucket *buckets = calloc(new_bucket_size, sizeof(*buckets));
-    const unsigned int n_buckets = hash_n_buckets(hash);
-    struct hash hash_copy = *hash;
+    unsigned int group = hash_first_group(hash, hashval);
+    unsigned int step = 0;
 
-    assert((new_bucket_size & (new_bucket_size - 1)) == 0);
-    assert(hash_n_buckets(hash) != new_bucket_size);
+    while (true) {
+        const unsigned int m =
+            group_match_non_full(hash->ctrl + group * GROUP_SIZE);
 
-    if (buckets == NULL)
-        return;
+        if (LIKELY(m))
+            return group * GROUP_SIZE + (unsigned int)__builtin_ctz(m);
 
-    hash_copy.count = 0;
-    hash_copy.n_buckets_mask = new_bucket_size - 1;
-    hash_copy.buckets = buckets;
-
-    struct hash_bucket *bucket;
-    struct hash_bucket *bucket_end = hash->buckets + n_buckets;
-    for (bucket = hash->buckets; bucket < bucket_end; bucket++) {
-        for (unsigned int old = 0; old < bucket->used; old++) {
-            struct hash_entry new =
-                hash_add_entry_hashed(&hash_copy,
-                                      bucket->keys[old],
-                                      bucket->hashvals[old]);
-            if (UNLIKELY(!new.key))
-                goto fail;
-
-            *new.key = bucket->keys[old];
-            *new.value = bucket->values[old];
-        }
+        group = hash_next_group(hash, group, &step);
     }
+}
 
-    /* Original table must remain untouched in the event resizing fails:
-     * previous loop may return early on allocation failure, so can't free
-     * bucket entry arrays there.  */
-    for (bucket = hash->buckets; bucket < bucket_end; bucket++) {
-        free(bucket->keys);
-        free(bucket->values);
-        free(bucket->hashvals);
-    }
-    free(hash->buckets);
+static bool rehash(struct hash *hash, unsigned int n_groups)
+{
+    struct hash_slot *old_slots = hash->slots;
+    const uint8_t *old_ctrl = hash->ctrl;
+    const unsigned int old_capacity = hash_capacity(hash);
 
-    hash->buckets = buckets;
-    hash->n_buckets_mask = new_bucket_size - 1;
+    assert((n_groups & (n_groups - 1)) == 0);
 
-    assert(hash_copy.count == hash->count);
+    /* Original table remains untouched if allocation fails. */
+    if (!alloc_slots(hash, n_groups))
+        return false;
 
-    return;
+    /* Keys are known to be unique, so just look for a free slot. */
+    for (unsigned int i = 0; i < old_capacity; i++) {
+        if (old_ctrl[i] & 0x80)
+            continue;
 
-fail:
-    for (bucket_end = bucket, bucket = hash->buckets; bucket < bucket_end;
-         bucket++) {
-        free(bucket->keys);
-        free(bucket->values);
-        free(bucket->hashvals);
+        const unsigned int hashval = hash_key(hash, old_slots[i].key);
+        const unsigned int slot = hash_find_non_full_slot(hash, hashval);
+
+        hash->ctrl[slot] = hash_tag(hashval);
+        hash->slots[slot] = old_slots[i];
     }
 
-    free(buckets);
+    free(old_slots);
+
+    return true;
 }
 
-static struct hash_entry hash_add_entry(struct hash *hash, const void *key)
+/* Returns the slot for `key`, either the one already holding it (in which
+ * case `existing` is set) or a free one that's been claimed for it; -1 if
+ * the table could not grow.  */
+static int hash_add_slot(struct hash *hash, const void *key, bool *existing)
 {
-    unsigned int hashval = hash->hash_value(key);
+    const unsigned int hashval = hash_key(hash, key);
+    int slot = hash_find_slot(hash, key, hashval);
 
-    return hash_add_entry_hashed(hash, key, hashval);
-}
+    if (slot >= 0) {
+        *existing = true;
+        return slot;
+    }
 
-static inline bool need_rehash_grow(const struct hash *hash)
-{
-    /* The heuristic to rehash and grow the number of buckets is if there's
-     * more than 16 entries per bucket on average.  This is the number of
-     * elements in the hashvals array that would fit in a single cache line. */
-    return hash->count > hash_n_buckets(hash) * 16;
-}
+    *existing = false;
 
-static inline bool need_rehash_shrink(const struct hash *hash)
-{
-    /* A hash table will be shrunk if, on average, more than 50% of its
-     * buckets are empty, but will never have less than MIN_BUCKETS buckets. */
-    const unsigned int n_buckets = hash_n_buckets(hash);
+    unsigned int free_slot = hash_find_non_full_slot(hash, hashval);
+    if (hash->ctrl[free_slot] == CTRL_EMPTY &&
+        hash->count + hash->n_deleted + 1 > max_load(hash_capacity(hash))) {
+        const unsigned int n_groups = hash->n_groups_mask + 1;
 
-    if (n_buckets <= MIN_BUCKETS)
-        return false;
+        /* If most of the used slots are tombstones, rehashing to a table
+         * of the same size is enough to reclaim them. */
+        if (!rehash(hash, hash->count + 1 > max_load(hash_capacity(hash)) / 2
+                              ? n_groups * 2
+                              : n_groups)) {
+            errno = ENOMEM;
+            return -1;
+        }
 
-    if (hash->count > n_buckets / 2)
-        return false;
+        free_slot = hash_find_non_full_slot(hash, hashval);
+    }
 
-    return true;
+    if (hash->ctrl[free_slot] == CTRL_DELETED)
+        hash->n_deleted--;
+    hash->ctrl[free_slot] = hash_tag(hashval);
+    hash->slots[free_slot] = (struct hash_slot){};
+    hash->count++;
+
+    return (int)free_slot;
 }
 
 /*
@@ -478,20 +534,17 @@ static inline bool need_rehash_shrink(const struct hash *hash)
  */
 int hash_add(struct hash *hash, const void *key, const void *value)
 {
-    struct hash_entry entry = hash_add_entry(hash, key);
+    bool existing;
+    int slot = hash_add_slot(hash, key, &existing);
 
-    if (!entry.key)
+    if (slot < 0)
         return -errno;
-    if (entry.existing) {
-        hash->free_key(*entry.key);
-        hash->free_value(*entry.value);
+    if (existing) {
+        hash->free_key(hash->slots[slot].key);
+        hash->free_value(hash->slots[slot].value);
     }
 
-    *entry.key = (void *)key;
-    *entry.value = (void *)value;
-
-    if (need_rehash_grow(hash))
-        rehash(hash, hash_n_buckets(hash) * 2);
+    hash->slots[slot] = (struct hash_slot){(void *)key, (void *)value};
 
     return 0;
 }
@@ -499,139 +552,96 @@ int hash_add(struct hash *hash, const void *key, const void *value)
 /* similar to hash_add(), but fails if key already exists */
 int hash_add_unique(struct hash *hash, const void *key, const void *value)
 {
-    struct hash_entry entry = hash_add_entry(hash, key);
+    bool existing;
+    int slot = hash_add_slot(hash, key, &existing);
 
-    if (!entry.key)
+    if (slot < 0)
         return -errno;
-    if (entry.existing)
+    if (existing)
         return -EEXIST;
 
-    *entry.key = (void *)key;
-    *entry.value = (void *)value;
-
-    if (need_rehash_grow(hash))
-        rehash(hash, hash_n_buckets(hash) * 2);
+    hash->slots[slot] = (struct hash_slot){(void *)key, (void *)value};
 
     return 0;
 }
 
-static inline struct hash_entry
-hash_find_entry(const struct hash *hash, const char *key, unsigned int hashval)
+void *hash_find(const struct hash *hash, const void *key)
 {
-    unsigned int pos = hashval & hash->n_buckets_mask;
-    const struct hash_bucket *bucket = hash->buckets + pos;
+    int slot = hash_find_slot(hash, key, hash_key(hash, key));
 
-    for (unsigned int entry = 0; entry < bucket->used; entry++) {
-        if (hashval != bucket->hashvals[entry])
-            continue;
-        if (hash->key_equal(key, bucket->keys[entry])) {
-            return (struct hash_entry){
-                .key = &bucket->keys[entry],
-                .value = &bucket->values[entry],
-                .hashval = &bucket->hashvals[entry],
-            };
-        }
-    }
-
-    return (struct hash_entry){};
+    return slot >= 0 ? hash->slots[slot].value : NULL;
 }
 
-void *hash_find(const struct hash *hash, const void *key)
+static inline bool need_rehash_shrink(const struct hash *hash)
 {
-    struct hash_entry entry =
-        hash_find_entry(hash, key, hash->hash_value(key));
+    /* A hash table will be shrunk if less than 1/4 of its slots are in use,
+     * but will never have less than MIN_GROUPS groups. */
+    if (hash->n_groups_mask + 1 <= MIN_GROUPS)
+        return false;
 
-    return entry.key ? *entry.value : NULL;
+    return hash->count < hash_capacity(hash) / 4;
 }
 
 int hash_del(struct hash *hash, const void *key)
 {
-    unsigned int hashval = hash->hash_value(key);
-    unsigned int pos = hashval & hash->n_buckets_mask;
-    struct hash_bucket *bucket = hash->buckets + pos;
+    int slot = hash_find_slot(hash, key, hash_key(hash, key));
 
-    struct hash_entry entry = hash_find_entry(hash, key, hashval);
-    if (entry.key == NULL)
+    if (slot < 0)
         return -ENOENT;
 
-    hash->free_value(*entry.value);
-    hash->free_key(*entry.key);
-
-    if (bucket->used > 1) {
-        /* Instead of compacting the bucket array by moving elements, just copy
-         * over the last element on top of the element being removed.  This
-         * changes the ordering inside the bucket array, but it's much more
-         * efficient, as it always has to copy exactly at most 1 element instead
-         * of potentially bucket->used elements. */
-        void *last_key = &bucket->keys[bucket->used - 1];
-
-        /* FIXME: Is comparing these pointers UB after calling free_key()? */
-        if (entry.key != last_key) {
-            *entry.key = last_key;
-            *entry.value = bucket->values[bucket->used - 1];
-            *entry.hashval = bucket->hashvals[bucket->used - 1];
-        }
-    }
-
-    bucket->used--;
-    hash->count--;
+    hash->free_value(hash->slots[slot].value);
+    hash->free_key(hash->slots[slot].key);
 
-    if (need_rehash_shrink(hash)) {
-        rehash(hash, hash_n_buckets(hash) / 2);
+    /* If the group still has an empty slot, no lookup has ever probed past
+     * it, so this slot can be marked as empty rather than as deleted. */
+    const uint8_t *group =
+        hash->ctrl + ((unsigned int)slot & ~(GROUP_SIZE - 1u));
+    if (group_match_empty(group)) {
+        hash->ctrl[slot] = CTRL_EMPTY;
     } else {
-        unsigned int steps_used = bucket->used / STEPS;
-        unsigned int steps_total = bucket->total / STEPS;
-
-        if (steps_used + 1 < steps_total) {
-            unsigned int new_total;
+        hash->ctrl[slot] = CTRL_DELETED;
+        hash->n_deleted++;
+    }
 
-            if (__builtin_add_overflow(steps_used, 1, &new_total))
-                return -EOVERFLOW;
+    hash->count--;
 
-            resize_bucket(bucket, new_total);
-        }
-    }
+    if (need_rehash_shrink(hash))
+        rehash(hash, (hash->n_groups_mask + 1) / 2);
 
     return 0;
 }
 
 unsigned int hash_get_count(const struct hash *hash) { return hash->count; }
 
+unsigned int hash_get_hashval(const struct hash *hash, const void *key)
+{
+    return hash_key(hash, key);
+}
+
 void hash_iter_init(const struct hash *hash, struct hash_iter *iter)
 {
     iter->hash = hash;
-    iter->bucket = 0;
-    iter->entry = -1;
+    iter->slot = -1;
 }
 
 bool hash_iter_next(struct hash_iter *iter,
                     const void **key,
                     const void **value)
 {
-    const struct hash_bucket *b = iter->hash->buckets + iter->bucket;
+    const struct hash *hash = iter->hash;
+    const unsigned int capacity = hash_capacity(hash);
 
-    iter->entry++;
-
-    if ((unsigned int)iter->entry >= b->used) {
-        unsigned int n_buckets = hash_n_buckets(iter->hash);
-
-        iter->entry = 0;
-
-        for (iter->bucket++; iter->bucket < n_buckets; iter->bucket++) {
-            b = iter->hash->buckets + iter->bucket;
+    for (iter->slot++; (unsigned int)iter->slot < capacity; iter->slot++) {
+        if (hash->ctrl[iter->slot] & 0x80)
+            continue;
 
-            if (b->used > 0)
-                break;
-        }
+        if (value != NULL)
+            *value = hash->slots[iter->slot].value;
+        if (key != NULL)
+            *key = hash->slots[iter->slot].key;
 
-        if (iter->bucket >= n_buckets)
-            return false;
+        return true;
     }
 
-    if (value != NULL)
-        *value = b->values[iter->entry];
-    if (key != NULL)
-        *key = b->keys[iter->entry];
-
-    return true;
+    return false;
 }
@@ -8,8 +8,7 @@ struct hash;
 
 struct hash_iter {
     const struct hash *hash;
-    unsigned int bucket;
-    int entry;
+    int slot;
 };
 
 struct hash *hash_int_new(void (*free_key)(void *value),
@@ -27,6 +26,7 @@ int hash_add_unique(struct hash *hash, const void *key, const void *value);
 int hash_del(struct hash *hash, const void *key);
 void *hash_find(const struct hash *hash, const void *key);
 unsigned int hash_get_count(const struct hash *hash);
+unsigned int hash_get_hashval(const struct hash *hash, const void *key);
 void hash_iter_init(const struct hash *hash, struct hash_iter *iter);
 bool hash_iter_next(struct hash_iter *iter,
                     const void **key,
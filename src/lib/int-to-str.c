@@ -19,6 +19,7 @@
  */
 
 #include <assert.h>
+#include <string.h>
 
 #include "lwan-private.h"
 
@@ -68,6 +69,74 @@ ALWAYS_INLINE char *uint_to_string(size_t value,
     return dst + next - 1;
 }
 
+ALWAYS_INLINE __attribute__((const)) size_t uint_string_length(size_t value)
+{
+    static const uint64_t powers_of_10[] = {
+        1ull,
+        10ull,
+        100ull,
+        1000ull,
+        10000ull,
+        100000ull,
+        1000000ull,
+        10000000ull,
+        100000000ull,
+        1000000000ull,
+        10000000000ull,
+        100000000000ull,
+        1000000000000ull,
+        10000000000000ull,
+        100000000000000ull,
+        1000000000000000ull,
+        10000000000000000ull,
+        100000000000000000ull,
+        1000000000000000000ull,
+        10000000000000000000ull,
+    };
+    const uint64_t v = (uint64_t)value | 1;
+    /* 1233 / 4096 is a bit over log10(2), so this is the number of digits
+     * of the smallest number with as many bits as value, minus one. */
+    const unsigned int bits = 64u - (unsigned int)__builtin_clzll(v);
+    const unsigned int guess = (bits * 1233u) >> 12;
+
+    return guess + (v >= powers_of_10[guess]);
+}
+
+ALWAYS_INLINE char *uint_to_string_append(size_t value, char *dst)
+{
+    char *end = dst + uint_string_length(value);
+    char *p = end;
+
+    while (value >= 100) {
+        const uint32_t i = (uint32_t)((value % 100) * 2);
+        value /= 100;
+        p -= 2;
+        memcpy(p, &digits[i], 2);
+    }
+    if (value < 10) {
+        *--p = (char)('0' + (uint32_t)value);
+    } else {
+        p -= 2;
+        memcpy(p, &digits[value * 2], 2);
+    }
+
+    assert(p == dst);
+    return end;
+}
+
+ALWAYS_INLINE char *uint_to_hex_string_append(size_t value, char *dst)
+{
+    static const char hex_digits[] = "0123456789abcdef";
+    const unsigned int bits =
+        64u - (unsigned int)__builtin_clzll((uint64_t)value | 1);
+    char *end = dst + (bits + 3) / 4;
+
+    for (char *p = end; p > dst; value >>= 4)
+        *--p = hex_digits[value & 15];
+
+    return end;
+}
+
 ALWAYS_INLINE char *int_to_string(ssize_t value,
                                   char dst[static INT_TO_STR_BUFFER_SIZE],
                                   size_t *length_out)
@@ -31,3 +31,11 @@ char *uint_to_string(size_t value,
                      size_t *len);
 
 const char *uint_to_string_2_digits(size_t value) __attribute__((pure));
+
+/* These write the digits of @value, without a NUL terminator, straight to
+ * @dst, returning a pointer past the last one.  @dst must have room for
+ * uint_string_length(@value) decimal digits, or for 2 * sizeof(size_t)
+ * hexadecimal digits.  */
+size_t uint_string_length(size_t value) __attribute__((const));
+char *uint_to_string_append(size_t value, char *dst);
+char *uint_to_hex_string_append(size_t value, char *dst);
@@ -15,6 +15,10 @@
 #include <stdlib.h>
 #include <string.h>
 
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
 #include "json.h"
 #include "lwan.h"
 #include "int-to-str.h"
@@ -116,11 +120,72 @@ static int peek(struct lexer *lexer)
     return chr;
 }
 
+/*
+ * Routines has_zero() and has_value() are from
+ * https://graphics.stanford.edu/~seander/bithacks.html#ZeroInWord
+ */
+static ALWAYS_INLINE uint64_t has_zero(uint64_t v)
+{
+    return (v - 0x0101010101010101UL) & ~v & 0x8080808080808080UL;
+}
+
+static ALWAYS_INLINE uint64_t has_value(uint64_t x, char n)
+{
+    return has_zero(x ^ (~0UL / 255 * (uint64_t)n));
+}
+
+/* Returns a pointer to the first quote, backslash, or NUL byte between
+ * @pos and @end, or @end if there's none.  Most of a string is usually made
+ * of bytes that don't need any attention from the lexer, so this looks at
+ * 16 (with SSE2) or 8 bytes at a time rather than going through next() for
+ * each of them.  */
+static ALWAYS_INLINE char *find_string_special(char *pos, const char *end)
+{
+#if defined(__SSE2__)
+    const __m128i quote = _mm_set1_epi8('"');
+    const __m128i backslash = _mm_set1_epi8('\\');
+    const __m128i zero = _mm_setzero_si128();
+
+    for (; end - pos >= 16; pos += 16) {
+        const __m128i chunk = _mm_loadu_si128((const __m128i *)pos);
+        const unsigned int mask = (unsigned int)_mm_movemask_epi8(
+            _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(chunk, quote),
+                                      _mm_cmpeq_epi8(chunk, backslash)),
+                         _mm_cmpeq_epi8(chunk, zero)));
+
+        if (mask)
+            return pos + __builtin_ctz(mask);
+    }
+#elif __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    for (; end - pos >= 8; pos += 8) {
+        uint64_t v;
+
+        memcpy(&v, pos, sizeof(v));
+
+        /* has_zero() might flag bytes after the first match, but never
+         * before it, so the lowest bit set points at the first match. */
+        const uint64_t mask =
+            has_value(v, '"') | has_value(v, '\\') | has_zero(v);
+        if (mask)
+            return pos + __builtin_ctzll(mask) / 8;
+    }
+#endif
+
+    for (; pos < end; pos++) {
+        if (*pos == '"' || *pos == '\\' || *pos == '\0')
+            break;
+    }
+
+    return pos;
+}
+
 static void *lexer_string(struct lexer *lexer)
 {
     ignore(lexer);
 
     while (true) {
+        lexer->pos = find_string_special(lexer->pos, lexer->end);
+
         int chr = next(lexer);
 
         if (UNLIKELY(chr == '\0')) {
@@ -614,20 +679,6 @@ int json_obj_parse(char *payload,
     return obj_parse(&obj, descr, descr_len, val);
 }
 
-/*
- * Routines has_zero() and has_value() are from
- * https://graphics.stanford.edu/~seander/bithacks.html#ZeroInWord
- */
-static ALWAYS_INLINE uint64_t has_zero(uint64_t v)
-{
-    return (v - 0x0101010101010101UL) & ~v & 0x8080808080808080UL;
-}
-
-static ALWAYS_INLINE uint64_t has_value(uint64_t x, char n)
-{
-    return has_zero(x ^ (~0UL / 255 * (uint64_t)n));
-}
-
 static char escape_as(char chr)
 {
     static const char escaped[] = {'"', '\\', 'b', 'f', 'n', 'r', 't', 't'};
@@ -916,6 +967,329 @@ static int append_bytes_to_buf(const char *bytes, size_t len, void *data)
     return 0;
 }
 
+static int append_bytes_to_strbuf(const char *bytes, size_t len, void *data)
+{
+    struct lwan_strbuf *buf = data;
+
+    return LIKELY(lwan_strbuf_append_str(buf, bytes, len)) ? 0 : -ENOMEM;
+}
+
+int json_obj_encode_strbuf(const struct json_obj_descr *descr,
+                           size_t descr_len,
+                           const void *val,
+                           struct lwan_strbuf *buf,
+                           bool escape_key)
+{
+    return json_obj_encode_full(descr, descr_len, val, append_bytes_to_strbuf,
+                                buf, escape_key);
+}
+
+int json_arr_encode_strbuf(const struct json_obj_descr *descr,
+                           const void *val,
+                           struct lwan_strbuf *buf,
+                           bool escape_key)
+{
+    return json_arr_encode_full(descr, val, append_bytes_to_strbuf, buf,
+                                escape_key);
+}
+
+/* A json_encoder is a descriptor array turned into a list of operations:
+ * everything that doesn't depend on the values being encoded (braces,
+ * brackets, commas, and quoted and escaped keys) is joined into literal
+ * runs when the encoder is created, so that encoding only has to format
+ * the values and copy these runs in between them.  */
+
+enum encoder_op_type {
+    ENCODER_OP_LITERAL,
+    ENCODER_OP_STRING,
+    ENCODER_OP_NUMBER,
+    ENCODER_OP_BOOL,
+    ENCODER_OP_ARRAY,
+    ENCODER_OP_DESCR,
+};
+
+struct encoder_op {
+    enum encoder_op_type type;
+
+    /* Offset of the value from the start of the struct being encoded, or
+     * of the literal run in the literals buffer. */
+    size_t offset;
+
+    union {
+        size_t literal_len;
+        struct {
+            struct json_encoder *element;
+            size_t count_offset;
+            ptrdiff_t element_size;
+        } array;
+        const struct json_obj_descr *descr;
+    };
+};
+
+DEFINE_ARRAY_TYPE(encoder_op_array, struct encoder_op)
+
+struct json_encoder {
+    struct encoder_op_array ops;
+    struct lwan_strbuf literals;
+};
+
+static struct json_encoder *encoder_new(void)
+{
+    struct json_encoder *encoder = malloc(sizeof(*encoder));
+
+    if (!encoder)
+        return NULL;
+
+    encoder_op_array_init(&encoder->ops);
+    if (!lwan_strbuf_init(&encoder->literals)) {
+        free(encoder);
+        return NULL;
+    }
+
+    return encoder;
+}
+
+void json_encoder_free(struct json_encoder *encoder)
+{
+    struct encoder_op *op;
+
+    if (!encoder)
+        return;
+
+    LWAN_ARRAY_FOREACH (&encoder->ops, op) {
+        if (op->type == ENCODER_OP_ARRAY)
+            json_encoder_free(op->array.element);
+    }
+
+    encoder_op_array_reset(&encoder->ops);
+    lwan_strbuf_free(&encoder->literals);
+    free(encoder);
+}
+
+static struct encoder_op *add_op(struct json_encoder *encoder,
+                                 enum encoder_op_type type,
+                                 size_t offset)
+{
+    struct encoder_op *op = encoder_op_array_append0(&encoder->ops);
+
+    if (op) {
+        op->type = type;
+        op->offset = offset;
+    }
+
+    return op;
+}
+
+static bool add_literal(struct json_encoder *encoder,
+                        const char *literal,
+                        size_t len)
+{
+    size_t n_ops = encoder->ops.base.elements;
+
+    if (n_ops) {
+        struct encoder_op *last =
+            &encoder_op_array_get_array(&encoder->ops)[n_ops - 1];
+
+        /* Literals are appended in order, so a run that's right before
+         * this one ends at the end of the buffer and can be extended. */
+        if (last->type == ENCODER_OP_LITERAL) {
+            last->literal_len += len;
+            return lwan_strbuf_append_str(&encoder->literals, literal, len);
+        }
+    }
+
+    struct encoder_op *op = add_op(encoder, ENCODER_OP_LITERAL,
+                                   lwan_strbuf_get_length(&encoder->literals));
+    if (!op)
+        return false;
+    op->literal_len = len;
+
+    return lwan_strbuf_append_str(&encoder->literals, literal, len);
+}
+
+static bool add_key(struct json_encoder *encoder,
+                    const struct json_obj_descr *descr)
+{
+    bool ok = add_literal(encoder, "\"", 1);
+
+    for (size_t i = 0; i < descr->field_name_len; i++) {
+        char escaped = escape_as(descr->field_name[i]);
+
+        if (escaped)
+            ok &= add_literal(encoder, (char[]){'\\', escaped}, 2);
+        else
+            ok &= add_literal(encoder, &descr->field_name[i], 1);
+    }
+
+    return ok & add_literal(encoder, "\":", 2);
+}
+
+static bool compile_value(struct json_encoder *encoder,
+                          const struct json_obj_descr *descr,
+                          size_t base);
+
+static bool compile_obj(struct json_encoder *encoder,
+                        const struct json_obj_descr *descr,
+                        size_t descr_len,
+                        size_t base)
+{
+    bool ok = add_literal(encoder, "{", 1);
+
+    for (size_t i = 0; i < descr_len; i++) {
+        if (i)
+            ok &= add_literal(encoder, ",", 1);
+        ok &= add_key(encoder, &descr[i]);
+        ok &= compile_value(encoder, &descr[i], base);
+    }
+
+    return ok & add_literal(encoder, "}", 1);
+}
+
+static bool compile_arr(struct json_encoder *encoder,
+                        const struct json_obj_descr *descr,
+                        size_t base)
+{
+    const struct json_obj_descr *elem_descr = descr->array.element_descr;
+    struct json_encoder *element;
+    struct encoder_op *op;
+    bool ok;
+
+    element = encoder_new();
+    if (!element)
+        return false;
+
+    /* Elements are encoded starting from their own address; as in
+     * arr_encode(), the offset in the element descriptor is the offset
+     * of the number of elements in the parent struct instead. */
+    if (elem_descr->type == JSON_TOK_OBJECT_START) {
+        ok = compile_obj(element, elem_descr->object.sub_descr,
+                         elem_descr->object.sub_descr_len, 0);
+    } else {
+        ok = compile_value(
+            element, &(struct json_obj_descr){.type = elem_descr->type}, 0);
+    }
+
+    op = add_op(encoder, ENCODER_OP_ARRAY, base + descr->offset);
+    if (!ok || !op) {
+        json_encoder_free(element);
+        return false;
+    }
+
+    op->array.element = element;
+    op->array.count_offset = base + elem_descr->offset;
+    op->array.element_size = get_elem_size(elem_descr);
+
+    return true;
+}
+
+static bool compile_value(struct json_encoder *encoder,
+                          const struct json_obj_descr *descr,
+                          size_t base)
+{
+    struct encoder_op *op;
+
+    switch (descr->type) {
+    case JSON_TOK_FALSE:
+    case JSON_TOK_TRUE:
+        return add_op(encoder, ENCODER_OP_BOOL, base + descr->offset);
+    case JSON_TOK_STRING:
+        return add_op(encoder, ENCODER_OP_STRING, base + descr->offset);
+    case JSON_TOK_NUMBER:
+        return add_op(encoder, ENCODER_OP_NUMBER, base + descr->offset);
+    case JSON_TOK_OBJECT_START:
+        /* Nested objects are flattened into the parent's list. */
+        return compile_obj(encoder, descr->object.sub_descr,
+                           descr->object.sub_descr_len, base + descr->offset);
+    case JSON_TOK_LIST_START:
+        if (descr->array.element_descr->type != JSON_TOK_LIST_START)
+            return compile_arr(encoder, descr, base);
+
+        /* Arrays of arrays are rare enough that they're left to encode(). */
+        op = add_op(encoder, ENCODER_OP_DESCR, base);
+        if (op)
+            op->descr = descr;
+        return op;
+    default:
+        return false;
+    }
+}
+
+struct json_encoder *json_obj_encoder_new(const struct json_obj_descr *descr,
+                                          size_t descr_len)
+{
+    struct json_encoder *encoder = encoder_new();
+
+    if (encoder && !compile_obj(encoder, descr, descr_len, 0)) {
+        json_encoder_free(encoder);
+        return NULL;
+    }
+
+    return encoder;
+}
+
+struct json_encoder *json_arr_encoder_new(const struct json_obj_descr *descr)
+{
+    struct json_encoder *encoder = encoder_new();
+
+    if (encoder && !compile_arr(encoder, descr, 0)) {
+        json_encoder_free(encoder);
+        return NULL;
+    }
+
+    return encoder;
+}
+
+int json_encoder_encode_strbuf(const struct json_encoder *encoder,
+                               const void *val,
+                               struct lwan_strbuf *buf)
+{
+    const char *literals = lwan_strbuf_get_buffer(&encoder->literals);
+    const struct encoder_op *ops = encoder->ops.base.base;
+    const size_t n_ops = encoder->ops.base.elements;
+    int ret = 0;
+
+    for (size_t i = 0; i < n_ops; i++) {
+        const struct encoder_op *op = &ops[i];
+        const void *field = (const char *)val + op->offset;
+
+        switch (op->type) {
+        case ENCODER_OP_LITERAL:
+            ret |= append_bytes_to_strbuf(literals + op->offset,
+                                          op->literal_len, buf);
+            break;
+        case ENCODER_OP_STRING:
+            ret |= str_encode((const char **)field, append_bytes_to_strbuf, buf);
+            break;
+        case ENCODER_OP_NUMBER:
+            ret |= num_encode(field, append_bytes_to_strbuf, buf);
+            break;
+        case ENCODER_OP_BOOL:
+            ret |= bool_encode(field, append_bytes_to_strbuf, buf);
+            break;
+        case ENCODER_OP_ARRAY: {
+            size_t n_elem =
+                *(const size_t *)((const char *)val + op->array.count_offset);
+
+            ret |= append_bytes_to_strbuf("[", 1, buf);
+            for (size_t elem = 0; elem < n_elem; elem++) {
+                if (elem)
+                    ret |= append_bytes_to_strbuf(",", 1, buf);
+                ret |= json_encoder_encode_strbuf(op->array.element, field,
+                                                  buf);
+                field = (const char *)field + op->array.element_size;
+            }
+            ret |= append_bytes_to_strbuf("]", 1, buf);
+            break;
+        }
+        case ENCODER_OP_DESCR:
+            ret |= encode(op->descr, field, append_bytes_to_strbuf, buf, true);
+            break;
+        }
+    }
+
+    return ret;
+}
+
 int json_obj_encode_buf(const struct json_obj_descr *descr,
                         size_t descr_len,
                         const void *val,
@@ -7,6 +7,7 @@
 #ifndef ZEPHYR_INCLUDE_DATA_JSON_H_
 #define ZEPHYR_INCLUDE_DATA_JSON_H_
 
+#include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <sys/types.h>
@@ -658,6 +659,103 @@ static inline int json_arr_encode(const struct json_obj_descr *descr,
     return json_arr_encode_full(descr, val, append_bytes, data, true);
 }
 
+struct lwan_strbuf;
+
+/**
+ * @brief Encodes an object, appending it to a string buffer
+ *
+ * @param descr Pointer to the descriptor array
+ *
+ * @param descr_len Number of elements in the descriptor array
+ *
+ * @param val Struct holding the values
+ *
+ * @param buf String buffer the JSON data is appended to
+ *
+ * @param escape_key Whether field names have to be escaped
+ *
+ * @return 0 if object has been successfully encoded. A negative value
+ * indicates an error.
+ */
+int json_obj_encode_strbuf(const struct json_obj_descr *descr,
+                           size_t descr_len,
+                           const void *val,
+                           struct lwan_strbuf *buf,
+                           bool escape_key);
+
+/**
+ * @brief Encodes an array, appending it to a string buffer
+ *
+ * @param descr Pointer to the descriptor array
+ *
+ * @param val Struct holding the values
+ *
+ * @param buf String buffer the JSON data is appended to
+ *
+ * @param escape_key Whether field names have to be escaped
+ *
+ * @return 0 if array has been successfully encoded. A negative value
+ * indicates an error.
+ */
+int json_arr_encode_strbuf(const struct json_obj_descr *descr,
+                           const void *val,
+                           struct lwan_strbuf *buf,
+                           bool escape_key);
+
+struct json_encoder;
+
+/**
+ * @brief Creates an encoder for objects described by a descriptor array
+ *
+ * Keys, braces, and commas are rendered (and escaped) once, when the
+ * encoder is created, so that encoding an object only formats its values.
+ * Objects are encoded with their fields in the order of the descriptor
+ * array.  The descriptors must outlive the encoder.
+ *
+ * @param descr Pointer to the descriptor array
+ *
+ * @param descr_len Number of elements in the descriptor array
+ *
+ * @return The encoder, or NULL on error.  Should be freed with
+ * json_encoder_free().
+ */
+struct json_encoder *json_obj_encoder_new(const struct json_obj_descr *descr,
+                                          size_t descr_len);
+
+/**
+ * @brief Creates an encoder for an array, like json_arr_encode() would
+ * encode it
+ *
+ * @param descr Pointer to the array descriptor
+ *
+ * @return The encoder, or NULL on error.  Should be freed with
+ * json_encoder_free().
+ */
+struct json_encoder *json_arr_encoder_new(const struct json_obj_descr *descr);
+
+/**
+ * @brief Frees an encoder created by json_obj_encoder_new() or
+ * json_arr_encoder_new()
+ */
+void json_encoder_free(struct json_encoder *encoder);
+
+/**
+ * @brief Encodes a value with an encoder, appending it to a string buffer
+ *
+ * @param encoder Encoder created by json_obj_encoder_new() or
+ * json_arr_encoder_new()
+ *
+ * @param val Struct holding the values
+ *
+ * @param buf String buffer the JSON data is appended to
+ *
+ * @return 0 if the value has been successfully encoded. A negative value
+ * indicates an error.
+ */
+int json_encoder_encode_strbuf(const struct json_encoder *encoder,
+                               const void *val,
+                               struct lwan_strbuf *buf);
+
 #ifdef __cplusplus
 }
 #endif
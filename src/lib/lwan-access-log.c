@@ -0,0 +1,952 @@
+/*
+ * lwan - web server
+ * Copyright (c) 2024 L. A. F. Pereira <l@tia.mat.br>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301,
+ * USA.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <syslog.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "lwan-private.h"
+
+#include "int-to-str.h"
+#include "lwan-access-log.h"
+
+/* Access log entries are formatted by the I/O threads, each into a ring
+ * of its own, and written out in batches by a separate thread.  Each ring
+ * has a single producer and a single consumer, so they don't need any
+ * locks; if the logging thread can't keep up, entries that don't fit are
+ * dropped (and counted) rather than making the I/O threads wait.  Entries
+ * are newline-terminated lines, so the ring is just a stream of bytes.
+ * Rings are emptied periodically, or as soon as one of them gets half
+ * full.
+ *
+ * Binary logs skip formatting altogether: I/O threads copy a fixed-size
+ * record into the ring, and the logging thread fills in the URL map ID
+ * and its name, which only has to be hashed once per URL map. */
+#define RING_SIZE (1u << 18)
+#define MAX_LINE_LENGTH 1024
+#define MAX_FORMAT_OPS 64
+
+/* How often rings are emptied, and how often a log file is checked for
+ * having been rotated. */
+#define FLUSH_INTERVAL_MS 100
+#define REOPEN_CHECK_INTERVAL_MS 1000
+
+#define DEFAULT_FORMAT "%h [%t] \"%r\" %s %D \"%{Referer}i\" \"%{User-Agent}i\""
+
+struct lwan_access_log_ring {
+    /* Only written to by the logging thread */
+    uint32_t read __attribute__((aligned(64)));
+
+    /* Only written to by the I/O thread that owns this ring */
+    uint32_t write __attribute__((aligned(64)));
+    uint64_t dropped;
+
+    char buffer[RING_SIZE] __attribute__((aligned(64)));
+};
+
+struct binary_entry {
+    struct lwan_access_log_record record;
+    const struct lwan_url_map *url_map;
+};
+
+enum format_op_type {
+    OP_LITERAL,
+    OP_REMOTE_ADDRESS,
+    OP_DATE,
+    OP_REQUEST_LINE,
+    OP_METHOD,
+    OP_URL,
+    OP_PROTOCOL,
+    OP_STATUS,
+    OP_ELAPSED_US,
+    OP_BYTES_SENT,
+    OP_REQUEST_ID,
+    OP_REQUEST_HEADER,
+};
+
+struct format_op {
+    enum format_op_type type;
+    /* Literal text or header name */
+    const char *str;
+    size_t len;
+};
+
+enum sink_type {
+    SINK_NONE,
+    SINK_FILE,
+    SINK_SYSLOG,
+    SINK_UDP,
+};
+
+static struct {
+    enum sink_type sink;
+    int fd;
+    char *path;
+    ino_t inode;
+    dev_t dev;
+
+    char *format;
+    struct format_op ops[MAX_FORMAT_OPS];
+    size_t n_ops;
+    bool binary;
+
+    /* URL maps whose names have been written to the current binary log.
+     * Kept by ID, as URL maps can be freed and replaced on reload. */
+    uint32_t named_url_map_ids[256];
+    unsigned int n_named_url_maps;
+
+    struct lwan_access_log_ring *rings[256];
+    unsigned int n_rings;
+    uint64_t dropped_reported;
+
+    pthread_t thread;
+    int wakeup_fd;
+    bool running;
+    /* Binary entries point to URL maps until written out; times all
+     * rings have been flushed, see lwan_access_log_caught_up() */
+    uint64_t flushes;
+
+    char batch[RING_SIZE] __attribute__((aligned(64)));
+} access_log = {
+    .sink = SINK_NONE,
+    .fd = -1,
+    .wakeup_fd = -1,
+};
+
+static bool compile_format(struct config *c, char *format)
+{
+    struct format_op *op = access_log.ops;
+    char *p = format;
+
+    while (*p) {
+        if (op == access_log.ops + MAX_FORMAT_OPS)
+            return config_error(c, "Access log format is too long");
+
+        if (*p != '%') {
+            char *end = strchrnul(p, '%');
+
+            *op++ = (struct format_op){
+                .type = OP_LITERAL,
+                .str = p,
+                .len = (size_t)(end - p),
+            };
+            p = end;
+            continue;
+        }
+
+        switch (*++p) {
+        case '%':
+            *op++ = (struct format_op){.type = OP_LITERAL, .str = "%", .len = 1};
+            break;
+        case 'h':
+            *op++ = (struct format_op){.type = OP_REMOTE_ADDRESS};
+            break;
+        case 't':
+            *op++ = (struct format_op){.type = OP_DATE};
+            break;
+        case 'r':
+            *op++ = (struct format_op){.type = OP_REQUEST_LINE};
+            break;
+        case 'm':
+            *op++ = (struct format_op){.type = OP_METHOD};
+            break;
+        case 'U':
+            *op++ = (struct format_op){.type = OP_URL};
+            break;
+        case 'H':
+            *op++ = (struct format_op){.type = OP_PROTOCOL};
+            break;
+        case 's':
+            *op++ = (struct format_op){.type = OP_STATUS};
+            break;
+        case 'D':
+            *op++ = (struct format_op){.type = OP_ELAPSED_US};
+            break;
+        case 'B':
+            *op++ = (struct format_op){.type = OP_BYTES_SENT};
+            break;
+        case 'L':
+            *op++ = (struct format_op){.type = OP_REQUEST_ID};
+            break;
+        case '{': {
+            char *name = p + 1;
+            char *end = strchr(name, '}');
+
+            if (!end || end[1] != 'i')
+                return config_error(c, "Expecting %%{Header-Name}i in "
+                                       "access log format");
+
+            *end = '\0';
+            *op++ = (struct format_op){
+                .type = OP_REQUEST_HEADER,
+                .str = name,
+                .len = (size_t)(end - name),
+            };
+            p = end + 1;
+            break;
+        }
+        default:
+            return config_error(c, "Unknown access log format specifier: %%%c",
+                                *p ? *p : ' ');
+        }
+
+        p++;
+    }
+
+    access_log.n_ops = (size_t)(op - access_log.ops);
+    return true;
+}
+
+static uint64_t timespec_to_ns(const struct timespec *ts)
+{
+    return (uint64_t)ts->tv_sec * 1000000000ull + (uint64_t)ts->tv_nsec;
+}
+
+static bool write_binary_header(int fd)
+{
+    struct lwan_access_log_record record = {
+        .type = LWAN_ACCESS_LOG_RECORD_HEADER,
+        .header = {
+            .magic = LWAN_ACCESS_LOG_MAGIC,
+            .record_size = sizeof(record),
+            .version = LWAN_ACCESS_LOG_VERSION,
+        },
+    };
+    struct timespec realtime, monotonic;
+
+    if (clock_gettime(CLOCK_REALTIME, &realtime) < 0 ||
+        clock_gettime(CLOCK_MONOTONIC, &monotonic) < 0)
+        return false;
+
+    record.header.realtime_ns = timespec_to_ns(&realtime);
+    record.header.monotonic_ns = timespec_to_ns(&monotonic);
+
+    /* Names have to be written again, as the file might be new. */
+    access_log.n_named_url_maps = 0;
+
+    return write(fd, &record, sizeof(record)) == (ssize_t)sizeof(record);
+}
+
+static bool open_file(void)
+{
+    struct stat st;
+    int fd;
+
+    fd = open(access_log.path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0640);
+    if (fd < 0)
+        return false;
+
+    if (fstat(fd, &st) < 0 ||
+        (access_log.binary && !write_binary_header(fd))) {
+        close(fd);
+        return false;
+    }
+
+    if (access_log.fd >= 0)
+        close(access_log.fd);
+    access_log.fd = fd;
+    access_log.inode = st.st_ino;
+    access_log.dev = st.st_dev;
+
+    return true;
+}
+
+/* Log files are usually rotated by renaming them and expecting whoever
+ * writes to them to create a new one with the old name. */
+static void reopen_file_if_rotated(void)
+{
+    struct stat st;
+
+    if (stat(access_log.path, &st) == 0 && st.st_ino == access_log.inode &&
+        st.st_dev == access_log.dev)
+        return;
+
+    if (!open_file())
+        lwan_status_perror("Could not reopen access log %s", access_log.path);
+}
+
+static bool open_udp(struct config *c, const char *target)
+{
+    struct addrinfo hints = {.ai_socktype = SOCK_DGRAM};
+    struct addrinfo *result, *rp;
+    char *host = strdupa(target);
+    char *port;
+    int ret;
+
+    if (*host == '[') {
+        char *end = strchr(++host, ']');
+
+        if (!end || end[1] != ':')
+            return config_error(c, "Expecting udp://[host]:port");
+
+        *end = '\0';
+        port = end + 2;
+    } else {
+        port = strrchr(host, ':');
+        if (!port)
+            return config_error(c, "Expecting udp://host:port");
+
+        *port++ = '\0';
+    }
+
+    ret = getaddrinfo(host, port, &hints, &result);
+    if (ret)
+        return config_error(c, "Could not resolve %s: %s", target,
+                            gai_strerror(ret));
+
+    for (rp = result; rp; rp = rp->ai_next) {
+        int fd = socket(rp->ai_family, rp->ai_socktype | SOCK_CLOEXEC |
+                                           SOCK_NONBLOCK, rp->ai_protocol);
+
+        if (fd < 0)
+            continue;
+        if (connect(fd, rp->ai_addr, rp->ai_addrlen) == 0) {
+            access_log.fd = fd;
+            break;
+        }
+        close(fd);
+    }
+
+    freeaddrinfo(result);
+
+    if (access_log.fd < 0)
+        return config_error(c, "Could not connect to %s", target);
+
+    return true;
+}
+
+static bool open_sink(struct config *c, const char *target)
+{
+    if (streq(target, "syslog")) {
+        /* LOG_NDELAY opens the socket right away, so it's still reachable
+         * if the straitjacket chroot()s later on. */
+        openlog("lwan", LOG_PID | LOG_NDELAY, LOG_DAEMON);
+        access_log.sink = SINK_SYSLOG;
+        return true;
+    }
+
+    if (!strncmp(target, "udp://", sizeof("udp://") - 1)) {
+        if (!open_udp(c, target + sizeof("udp://") - 1))
+            return false;
+        access_log.sink = SINK_UDP;
+        return true;
+    }
+
+    access_log.path = strdup(target);
+    if (!access_log.path)
+        return config_error(c, "Could not allocate memory for access log path");
+
+    if (!open_file())
+        return config_error(c, "Could not open access log %s: %s", target,
+                            strerror(errno));
+
+    access_log.sink = SINK_FILE;
+    return true;
+}
+
+void lwan_access_log_parse_config(struct config *c)
+{
+    const struct config_line *l;
+    char *target = NULL;
+    char *format = NULL;
+
+    if (access_log.sink != SINK_NONE) {
+        config_error(c, "Access log already set up");
+        return;
+    }
+
+    while ((l = config_read_line(c))) {
+        switch (l->type) {
+        case CONFIG_LINE_TYPE_LINE:
+            if (streq(l->key, "target")) {
+                target = strdupa(l->value);
+            } else if (streq(l->key, "format")) {
+                format = strdupa(l->value);
+            } else if (streq(l->key, "binary")) {
+                access_log.binary = parse_bool(l->value, false);
+            } else {
+                config_error(c, "Invalid key: %s", l->key);
+                return;
+            }
+            break;
+        case CONFIG_LINE_TYPE_SECTION:
+            config_error(c, "Access log accepts no sections");
+            return;
+        case CONFIG_LINE_TYPE_SECTION_END:
+            if (!target) {
+                config_error(c, "Access log target not specified");
+                return;
+            }
+
+            access_log.format = strdup(format ? format : DEFAULT_FORMAT);
+            if (!access_log.format) {
+                config_error(c, "Could not allocate memory for access log format");
+                return;
+            }
+            if (!compile_format(c, access_log.format))
+                return;
+
+            if (access_log.binary &&
+                (streq(target, "syslog") ||
+                 !strncmp(target, "udp://", sizeof("udp://") - 1))) {
+                config_error(c, "Binary access logs can only be written "
+                                "to files");
+                return;
+            }
+
+            open_sink(c, target);
+            return;
+        }
+    }
+
+    config_error(c, "Expecting section end while parsing access log");
+}
+
+struct lwan_access_log_ring *lwan_access_log_ring_new(void)
+{
+    struct lwan_access_log_ring *ring;
+
+    if (access_log.sink == SINK_NONE)
+        return NULL;
+
+    if (access_log.n_rings == N_ELEMENTS(access_log.rings))
+        lwan_status_critical("Too many access log rings");
+
+    ring = aligned_alloc(64, sizeof(*ring));
+    if (!ring)
+        lwan_status_critical_perror("Could not allocate access log ring");
+
+    ring->read = ring->write = 0;
+    ring->dropped = 0;
+
+    /* Rings are created before the logging thread starts, so there's no
+     * need to synchronize with it here. */
+    access_log.rings[access_log.n_rings++] = ring;
+
+    return ring;
+}
+
+static void write_lines_to_syslog(const char *batch, size_t len)
+{
+    while (len) {
+        const char *nl = memchr(batch, '\n', len);
+        const size_t line_len = (size_t)(nl - batch);
+
+        syslog(LOG_INFO, "%.*s", (int)line_len, batch);
+
+        batch += line_len + 1;
+        len -= line_len + 1;
+    }
+}
+
+/* Entries are packed into datagrams that fit a typical MTU, each holding
+ * only complete lines, so that collectors can split them on newlines. */
+#define MAX_DATAGRAM_SIZE 1472
+
+static void write_lines_to_udp(const char *batch, size_t len)
+{
+    struct mmsghdr msgs[64];
+    struct iovec iovs[N_ELEMENTS(msgs)];
+
+    while (len) {
+        unsigned int n_msgs = 0;
+
+        while (len && n_msgs < N_ELEMENTS(msgs)) {
+            size_t datagram_len = 0;
+
+            while (datagram_len < len) {
+                const char *nl = memchr(batch + datagram_len, '\n',
+                                        len - datagram_len);
+                const size_t line_len = (size_t)(nl - batch) + 1 - datagram_len;
+
+                if (datagram_len && datagram_len + line_len > MAX_DATAGRAM_SIZE)
+                    break;
+                datagram_len += line_len;
+            }
+
+            iovs[n_msgs] = (struct iovec){.iov_base = (char *)batch,
+                                          .iov_len = datagram_len};
+            msgs[n_msgs] = (struct mmsghdr){
+                .msg_hdr = {.msg_iov = &iovs[n_msgs], .msg_iovlen = 1},
+            };
+            n_msgs++;
+
+            batch += datagram_len;
+            len -= datagram_len;
+        }
+
+        /* Datagrams that can't be sent right away are lost, just like
+         * they could've been on the way to the collector. */
+        sendmmsg(access_log.fd, msgs, n_msgs, MSG_DONTWAIT);
+    }
+}
+
+static void write_batch(const char *batch, size_t len)
+{
+    switch (access_log.sink) {
+    case SINK_FILE:
+        while (len) {
+            ssize_t written = write(access_log.fd, batch, len);
+
+            if (written < 0) {
+                if (errno == EINTR)
+                    continue;
+                lwan_status_perror("Could not write to access log");
+                return;
+            }
+
+            batch += written;
+            len -= (size_t)written;
+        }
+        break;
+    case SINK_SYSLOG:
+        write_lines_to_syslog(batch, len);
+        break;
+    case SINK_UDP:
+        write_lines_to_udp(batch, len);
+        break;
+    case SINK_NONE:
+        break;
+    }
+}
+
+static bool is_url_map_named(uint32_t url_map_id)
+{
+    for (unsigned int i = 0; i < access_log.n_named_url_maps; i++) {
+        if (access_log.named_url_map_ids[i] == url_map_id)
+            return true;
+    }
+
+    if (access_log.n_named_url_maps < N_ELEMENTS(access_log.named_url_map_ids))
+        access_log.named_url_map_ids[access_log.n_named_url_maps++] = url_map_id;
+
+    return false;
+}
+
+static void write_binary_batch(const struct binary_entry *entries,
+                               size_t n_entries)
+{
+    struct lwan_access_log_record records[256];
+    const struct lwan_url_map *last_url_map = NULL;
+    uint32_t last_url_map_id = 0;
+    size_t n_records = 0;
+
+    for (size_t i = 0; i < n_entries; i++) {
+        const struct binary_entry *entry = &entries[i];
+
+        /* Leave room for the URL map name and the request itself */
+        if (n_records + 2 > N_ELEMENTS(records)) {
+            write_batch((const char *)records, n_records * sizeof(*records));
+            n_records = 0;
+        }
+
+        records[n_records] = entry->record;
+
+        if (entry->url_map) {
+            if (entry->url_map != last_url_map) {
+                last_url_map = entry->url_map;
+                last_url_map_id =
+                    lwan_access_log_url_map_id(last_url_map->prefix);
+
+                if (!is_url_map_named(last_url_map_id)) {
+                    struct lwan_access_log_record *name = &records[n_records];
+
+                    records[n_records + 1] = entry->record;
+                    *name = (struct lwan_access_log_record){
+                        .type = LWAN_ACCESS_LOG_RECORD_URL_MAP,
+                        .url_map_id = last_url_map_id,
+                    };
+                    strncpy(name->url_map.prefix, last_url_map->prefix,
+                            sizeof(name->url_map.prefix) - 1);
+                    n_records++;
+                }
+            }
+
+            records[n_records].url_map_id = last_url_map_id;
+        }
+
+        n_records++;
+    }
+
+    write_batch((const char *)records, n_records * sizeof(*records));
+}
+
+static void flush_ring(struct lwan_access_log_ring *ring)
+{
+    const uint32_t write = __atomic_load_n(&ring->write, __ATOMIC_ACQUIRE);
+    const uint32_t read = ring->read;
+    const uint32_t len = write - read;
+
+    if (!len)
+        return;
+
+    const uint32_t offset = read & (RING_SIZE - 1);
+    const uint32_t first = LWAN_MIN(len, RING_SIZE - offset);
+
+    memcpy(access_log.batch, ring->buffer + offset, first);
+    memcpy(access_log.batch + first, ring->buffer, len - first);
+
+    /* Space is given back before it's written out, so the I/O thread
+     * can keep on logging while this thread blocks on the sink. */
+    __atomic_store_n(&ring->read, write, __ATOMIC_RELEASE);
+
+    if (access_log.binary)
+        write_binary_batch((const struct binary_entry *)access_log.batch,
+                           len / sizeof(struct binary_entry));
+    else
+        write_batch(access_log.batch, len);
+}
+
+static void flush_rings(void)
+{
+    uint64_t dropped = 0;
+
+    for (unsigned int i = 0; i < access_log.n_rings; i++) {
+        flush_ring(access_log.rings[i]);
+        dropped += __atomic_load_n(&access_log.rings[i]->dropped,
+                                   __ATOMIC_RELAXED);
+    }
+
+    if (UNLIKELY(dropped != access_log.dropped_reported)) {
+        lwan_status_warning("%" PRIu64 " access log entries dropped so far",
+                            dropped);
+        access_log.dropped_reported = dropped;
+    }
+}
+
+static uint64_t monotonic_ms(void)
+{
+    struct timespec now;
+
+    if (UNLIKELY(clock_gettime(CLOCK_MONOTONIC, &now) < 0))
+        return 0;
+
+    return (uint64_t)now.tv_sec * 1000ull + (uint64_t)now.tv_nsec / 1000000ull;
+}
+
+static void *access_log_thread(void *data __attribute__((unused)))
+{
+    struct pollfd pfd = {.fd = access_log.wakeup_fd, .events = POLLIN};
+    uint64_t next_reopen_check_ms = monotonic_ms() + REOPEN_CHECK_INTERVAL_MS;
+
+    lwan_set_thread_name("accesslog");
+
+    while (ATOMIC_READ(access_log.running)) {
+        if (poll(&pfd, 1, FLUSH_INTERVAL_MS) > 0) {
+            eventfd_t value;
+
+            eventfd_read(access_log.wakeup_fd, &value);
+        }
+
+        if (access_log.sink == SINK_FILE) {
+            const uint64_t now_ms = monotonic_ms();
+
+            if (now_ms >= next_reopen_check_ms) {
+                reopen_file_if_rotated();
+                next_reopen_check_ms = now_ms + REOPEN_CHECK_INTERVAL_MS;
+            }
+        }
+
+        flush_rings();
+        __atomic_fetch_add(&access_log.flushes, 1, __ATOMIC_RELEASE);
+    }
+
+    return NULL;
+}
+
+bool lwan_access_log_caught_up(uint64_t *mark)
+{
+    const uint64_t flushes =
+        __atomic_load_n(&access_log.flushes, __ATOMIC_ACQUIRE);
+
+    /* Text logs are formatted by the I/O threads themselves */
+    if (access_log.sink == SINK_NONE || !access_log.binary)
+        return true;
+
+    /* A flush might be under way already, so wait for the one after it */
+    if (!*mark) {
+        *mark = flushes + 2;
+        return false;
+    }
+
+    return flushes >= *mark;
+}
+
+void lwan_access_log_init(void)
+{
+    if (access_log.sink == SINK_NONE)
+        return;
+
+    lwan_status_debug("Initializing access log thread");
+
+    access_log.wakeup_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (access_log.wakeup_fd < 0)
+        lwan_status_critical_perror("eventfd");
+
+    access_log.running = true;
+    if (pthread_create(&access_log.thread, NULL, access_log_thread, NULL))
+        lwan_status_critical_perror("pthread_create");
+}
+
+void lwan_access_log_shutdown(void)
+{
+    if (access_log.sink == SINK_NONE)
+        return;
+
+    lwan_status_debug("Shutting down access log thread");
+
+    ATOMIC_READ(access_log.running) = false;
+    eventfd_write(access_log.wakeup_fd, 1);
+    pthread_join(access_log.thread, NULL);
+    close(access_log.wakeup_fd);
+    access_log.wakeup_fd = -1;
+
+    /* I/O threads are gone by now, so whatever they've logged can be
+     * written out. */
+    flush_rings();
+
+    for (unsigned int i = 0; i < access_log.n_rings; i++)
+        free(access_log.rings[i]);
+    access_log.n_rings = 0;
+
+    if (access_log.sink == SINK_SYSLOG)
+        closelog();
+    else if (access_log.fd >= 0)
+        close(access_log.fd);
+
+    free(access_log.path);
+    free(access_log.format);
+    access_log.sink = SINK_NONE;
+    access_log.fd = -1;
+}
+
+struct line {
+    char *p;
+    char *end;
+};
+
+static void append(struct line *line, const char *str, size_t len)
+{
+    len = LWAN_MIN(len, (size_t)(line->end - line->p));
+    line->p = mempcpy(line->p, str, len);
+}
+
+static void append_strz(struct line *line, const char *str)
+{
+    append(line, str, strlen(str));
+}
+
+static void append_uint(struct line *line, size_t value)
+{
+    char buffer[INT_TO_STR_BUFFER_SIZE];
+    size_t len;
+    char *str = uint_to_string(value, buffer, &len);
+
+    append(line, str, len);
+}
+
+/* Strings coming from clients might contain quotes or newlines, which
+ * would make the log ambiguous, so those are escaped. */
+static void append_escaped(struct line *line, const char *str)
+{
+    static const char hex[] = "0123456789abcdef";
+
+    if (!str) {
+        append(line, "-", 1);
+        return;
+    }
+
+    for (; *str && line->p < line->end; str++) {
+        const unsigned char c = (unsigned char)*str;
+
+        if (c < 0x20 || c >= 0x7f || c == '"' || c == '\\') {
+            if (line->end - line->p < 4)
+                break;
+            *line->p++ = '\\';
+            *line->p++ = 'x';
+            *line->p++ = hex[c >> 4];
+            *line->p++ = hex[c & 0xf];
+        } else {
+            *line->p++ = (char)c;
+        }
+    }
+}
+
+static uint64_t elapsed_us(const struct timespec *begin)
+{
+    struct timespec now;
+
+    if (UNLIKELY(clock_gettime(CLOCK_MONOTONIC, &now) < 0))
+        return 0;
+
+    return (uint64_t)(now.tv_sec - begin->tv_sec) * 1000000ull +
+           (uint64_t)((now.tv_nsec - begin->tv_nsec) / 1000);
+}
+
+static void ring_put(struct lwan_access_log_ring *ring,
+                     const char *line,
+                     uint32_t len)
+{
+    const uint32_t read = __atomic_load_n(&ring->read, __ATOMIC_ACQUIRE);
+    const uint32_t write = ring->write;
+
+    if (UNLIKELY(write - read + len > RING_SIZE)) {
+        __atomic_add_fetch(&ring->dropped, 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    const uint32_t offset = write & (RING_SIZE - 1);
+    const uint32_t first = LWAN_MIN(len, RING_SIZE - offset);
+
+    memcpy(ring->buffer + offset, line, first);
+    memcpy(ring->buffer, line + first, len - first);
+
+    __atomic_store_n(&ring->write, write + len, __ATOMIC_RELEASE);
+
+    /* Only wake the logging thread up once per crossing, so that busy
+     * threads don't make a system call per request. */
+    if (UNLIKELY(write - read < RING_SIZE / 2 &&
+                 write + len - read >= RING_SIZE / 2))
+        eventfd_write(access_log.wakeup_fd, 1);
+}
+
+static void log_binary(struct lwan_request *request,
+                       enum lwan_http_status status,
+                       const struct lwan_url_map *url_map,
+                       const struct timespec *begin)
+{
+    const char *method = lwan_request_get_method_str(request);
+    struct binary_entry entry = {
+        .record = {
+            .type = LWAN_ACCESS_LOG_RECORD_REQUEST,
+            .flags = request->flags & REQUEST_IS_HTTP_1_0
+                         ? LWAN_ACCESS_LOG_HTTP_1_0
+                         : 0,
+            .status = (uint16_t)status,
+            .request = {
+                .begin_ns = timespec_to_ns(begin),
+                .bytes_sent = request->helper->bytes_sent,
+                /* Not generated here if nothing asked for it already */
+                .request_id = request->helper->request_id,
+            },
+        },
+        .url_map = url_map,
+    };
+    struct timespec now;
+
+    if (LIKELY(clock_gettime(CLOCK_MONOTONIC, &now) == 0))
+        entry.record.request.duration_ns =
+            timespec_to_ns(&now) - entry.record.request.begin_ns;
+
+    memcpy(entry.record.request.method, method,
+           LWAN_MIN(strlen(method), sizeof(entry.record.request.method)));
+
+    ring_put(request->conn->thread->access_log, (const char *)&entry,
+             sizeof(entry));
+}
+
+void lwan_access_log_request(struct lwan_request *request,
+                             enum lwan_http_status status,
+                             const struct lwan_url_map *url_map,
+                             const struct timespec *begin)
+{
+    char buffer[MAX_LINE_LENGTH];
+    char ip_buffer[INET6_ADDRSTRLEN];
+    /* Leave room for the newline */
+    struct line line = {.p = buffer, .end = buffer + sizeof(buffer) - 1};
+    const char *http_version =
+        request->flags & REQUEST_IS_HTTP_1_0 ? "HTTP/1.0" : "HTTP/1.1";
+
+    if (access_log.binary) {
+        log_binary(request, status, url_map, begin);
+        return;
+    }
+
+    for (size_t i = 0; i < access_log.n_ops; i++) {
+        const struct format_op *op = &access_log.ops[i];
+
+        switch (op->type) {
+        case OP_LITERAL:
+            append(&line, op->str, op->len);
+            break;
+        case OP_REMOTE_ADDRESS:
+            append_strz(&line, lwan_request_get_remote_address(request,
+                                                               ip_buffer)
+                                   ?: "-");
+            break;
+        case OP_DATE:
+            append_strz(&line, request->conn->thread->date.date);
+            break;
+        case OP_REQUEST_LINE:
+            append_strz(&line, lwan_request_get_method_str(request));
+            append(&line, " ", 1);
+            append_escaped(&line, request->original_url.value);
+            append(&line, " ", 1);
+            append_strz(&line, http_version);
+            break;
+        case OP_METHOD:
+            append_strz(&line, lwan_request_get_method_str(request));
+            break;
+        case OP_URL:
+            append_escaped(&line, request->original_url.value);
+            break;
+        case OP_PROTOCOL:
+            append_strz(&line, http_version);
+            break;
+        case OP_STATUS:
+            append_uint(&line, (size_t)status);
+            break;
+        case OP_ELAPSED_US:
+            append_uint(&line, (size_t)elapsed_us(begin));
+            break;
+        case OP_BYTES_SENT:
+            append_uint(&line, (size_t)request->helper->bytes_sent);
+            break;
+        case OP_REQUEST_ID: {
+            const uint64_t id = lwan_request_get_id(request);
+
+            for (int shift = 60; shift >= 0; shift -= 4)
+                append(&line, &"0123456789abcdef"[(id >> shift) & 0xf], 1);
+            break;
+        }
+        case OP_REQUEST_HEADER:
+            append_escaped(&line, lwan_request_get_header(request, op->str));
+            break;
+        }
+    }
+
+    *line.p++ = '\n';
+
+    ring_put(request->conn->thread->access_log, buffer,
+             (uint32_t)(line.p - buffer));
+}
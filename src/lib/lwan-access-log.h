@@ -0,0 +1,92 @@
+/*
+ * lwan - web server
+ * Copyright (c) 2024 L. A. F. Pereira <l@tia.mat.br>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301,
+ * USA.
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+/* Layout of binary access logs.  These are written in the byte order of
+ * the machine running lwan, and consist of fixed-size records: every file
+ * (and every time lwan starts appending to an existing file) begins with
+ * a header record; URL map records give names to the URL map IDs used by
+ * the request records that follow them.  Decoded by accesslogdump. */
+
+#define LWAN_ACCESS_LOG_MAGIC "LWANALOG"
+#define LWAN_ACCESS_LOG_VERSION 1
+
+enum lwan_access_log_record_type {
+    LWAN_ACCESS_LOG_RECORD_HEADER = 1,
+    LWAN_ACCESS_LOG_RECORD_URL_MAP = 2,
+    LWAN_ACCESS_LOG_RECORD_REQUEST = 3,
+};
+
+enum lwan_access_log_record_flags {
+    LWAN_ACCESS_LOG_HTTP_1_0 = 1 << 0,
+};
+
+struct lwan_access_log_record {
+    uint8_t type;
+    uint8_t flags;
+    uint16_t status;
+    uint32_t url_map_id;
+
+    union {
+        struct {
+            char magic[8];
+            /* Sizes of records, also telling apart the byte order */
+            uint32_t record_size;
+            uint32_t version;
+            /* Taken at the same instant, to convert request timestamps
+             * to wall clock time */
+            uint64_t realtime_ns;
+            uint64_t monotonic_ns;
+        } header;
+
+        struct {
+            /* NUL-padded, truncated if too long */
+            char prefix[56];
+        } url_map;
+
+        struct {
+            uint64_t begin_ns; /* CLOCK_MONOTONIC, after reading request */
+            uint64_t duration_ns;
+            uint64_t bytes_sent;
+            uint64_t request_id;
+            char method[8]; /* NUL-padded */
+        } request;
+    };
+};
+
+_Static_assert(sizeof(struct lwan_access_log_record) == 64,
+               "Access log records are 64 bytes long");
+
+/* FNV-1a, without the random seed used by hash tables, so that IDs are
+ * the same across runs. */
+static inline uint32_t lwan_access_log_url_map_id(const char *prefix)
+{
+    uint32_t hash = 2166136261u;
+
+    for (; *prefix; prefix++) {
+        hash ^= (uint32_t)(unsigned char)*prefix;
+        hash *= 16777619u;
+    }
+
+    return hash;
+}
@@ -17,40 +17,123 @@
  * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
  */
 
+#define _GNU_SOURCE
+
 #include <assert.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
 #include <pthread.h>
+#include <stdarg.h>
 #include <stdbool.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/eventfd.h>
 #include <time.h>
+#include <unistd.h>
 
 #include "lwan-private.h"
 
 #include "lwan-cache.h"
 #include "hash.h"
-
-#define GET_AND_REF_TRIES 5
+#include "lwan-trace.h"
+
+/* Statistics are sharded so that threads hitting the same cache don't
+ * bounce a cache line around just to count hits and misses.  Each thread
+ * is assigned a shard the first time it touches any cache; increments are
+ * atomic only so that counts are still correct if there are more threads
+ * than shards. */
+#define CACHE_STATS_SHARDS 32
+
+/* Entries are spread over this many hash tables, each with its own lock,
+ * so that lookups from different threads are unlikely to touch the same
+ * lock.  Shards are picked with the topmost bits of the hash value, as
+ * the lowest bits are used to pick a bucket inside each table. */
+#define CACHE_SHARD_BITS 4
+#define CACHE_SHARDS (1u << CACHE_SHARD_BITS)
+
+/* Entries are kept in a small timer wheel: each bucket holds the entries
+ * expiring within the same bucket_width seconds, which is picked so that
+ * the time to live spans half of the buckets.  The other half is slack
+ * for when the pruner runs late.  As the time to live is the same for
+ * every entry, each bucket is in insertion order, and the oldest bucket
+ * holds the oldest entries. */
+#define CACHE_EXPIRY_BUCKETS 64
+
+/* Hot keys are estimated with a count-min sketch that's only fed one in
+ * HOT_KEYS_SAMPLE_RATE lookups, and the HOT_KEYS_TOP_K keys with the
+ * highest estimates are remembered.  Counts are halved every
+ * HOT_KEYS_DECAY_PERIOD runs of the pruner (i.e. seconds), so that keys
+ * that used to be hot make room for the keys that are hot now. */
+#define HOT_KEYS_SKETCH_DEPTH 4
+#define HOT_KEYS_SKETCH_WIDTH 1024
+#define HOT_KEYS_TOP_K 64
+#define HOT_KEYS_SAMPLE_RATE 8
+#define HOT_KEYS_DECAY_PERIOD 60
 
 enum {
     /* Entry flags */
     FLOATING = 1 << 0,
     TEMPORARY = 1 << 1,
     FREE_KEY_ON_DESTROY = 1 << 2,
+    ACCESSED = 1 << 3,
+    INVALIDATED = 1 << 4,
+    /* In an expiry bucket, or in the list of invalidated entries; only
+     * changed with the queue lock held */
+    QUEUED = 1 << 5,
 
     /* Cache flags */
     SHUTTING_DOWN = 1 << 0,
     READ_ONLY = 1 << 1,
+    CREATE_ASYNC = 1 << 2,
+};
+
+struct cache_stats_shard {
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evicted;
+    uint64_t coalesced;
+} __attribute__((aligned(64)));
+
+struct hot_key {
+    char *key;
+    uint32_t count;
 };
 
+struct hot_keys {
+    uint32_t sketch[HOT_KEYS_SKETCH_DEPTH][HOT_KEYS_SKETCH_WIDTH];
+
+    /* Protects the top-K list; min_count can be read without it. */
+    pthread_mutex_t lock;
+    uint32_t min_count;
+    unsigned int n_top;
+    struct hot_key top[HOT_KEYS_TOP_K];
+
+    unsigned int decay_ticks;
+};
+
+struct cache_shard {
+    struct hash *table;
+    /* Keys whose entries are being created; see get_and_ref_entry(). */
+    struct hash *building;
+    pthread_mutex_t building_lock;
+    pthread_rwlock_t lock;
+} __attribute__((aligned(64)));
+
 struct cache {
-    struct {
-        struct hash *table;
-        pthread_rwlock_t lock;
-    } hash;
+    struct cache_stats_shard stats[CACHE_STATS_SHARDS];
+    struct cache_shard shards[CACHE_SHARDS];
 
     struct {
-        struct list_head list;
+        struct list_head buckets[CACHE_EXPIRY_BUCKETS];
+        /* Moved here by cache_invalidate(), so that the pruner doesn't
+         * have to look for them */
+        struct list_head invalidated;
+        time_t bucket_width;
+        /* Bucket (in units of bucket_width seconds) that might still have
+         * entries that didn't expire yet; older ones were emptied */
+        time_t oldest_tick;
         pthread_rwlock_t lock;
     } queue;
 
@@ -69,20 +152,76 @@ struct cache {
 
     struct {
         time_t time_to_live;
+        size_t max_cost;
     } settings;
 
     unsigned flags;
 
-#ifndef NDEBUG
+    /* Sum of the cost of all entries in the queue. */
+    size_t cost;
+
+    /* Only written to by the pruner job. */
     struct {
-        unsigned hits;
-        unsigned misses;
-        unsigned evicted;
-    } stats;
-#endif
+        uint64_t runs;
+        uint64_t last_duration_us;
+        uint64_t max_duration_us;
+    } pruner;
+
+    /* NULL unless cache_track_hot_keys() has been called. */
+    struct hot_keys *hot_keys;
+
+    char *name;
+    unsigned int id;
+    struct list_node caches;
+};
+
+static struct {
+    struct list_head list;
+    pthread_mutex_t lock;
+    unsigned int next_id;
+} caches = {
+    .list = {.n = {.next = &caches.list.n, .prev = &caches.list.n}},
+    .lock = PTHREAD_MUTEX_INITIALIZER,
 };
 
 static bool cache_pruner_job(void *data);
+static void cache_evict_over_budget(struct cache *cache);
+
+static ALWAYS_INLINE struct cache_stats_shard *
+cache_stats_shard(struct cache *cache)
+{
+    static unsigned int next_shard;
+    static __thread unsigned int shard = UINT_MAX;
+
+    if (UNLIKELY(shard == UINT_MAX))
+        shard = ATOMIC_INC(next_shard) % CACHE_STATS_SHARDS;
+
+    return &cache->stats[shard];
+}
+
+#define CACHE_STATS_ADD(cache_, counter_, value_)                              \
+    __atomic_fetch_add(&cache_stats_shard(cache_)->counter_, (value_),         \
+                       __ATOMIC_RELAXED)
+#define CACHE_STATS_INC(cache_, counter_) CACHE_STATS_ADD(cache_, counter_, 1)
+
+#define CACHE_HIT(cache_, key_)                                                \
+    do {                                                                       \
+        CACHE_STATS_INC(cache_, hits);                                         \
+        LWAN_TRACE(cache__hit, (cache_)->name, key_);                          \
+    } while (0)
+#define CACHE_MISS(cache_, key_)                                               \
+    do {                                                                       \
+        CACHE_STATS_INC(cache_, misses);                                       \
+        LWAN_TRACE(cache__miss, (cache_)->name, key_);                         \
+    } while (0)
+
+static ALWAYS_INLINE struct cache_shard *cache_shard(struct cache *cache,
+                                                     const void *key)
+{
+    unsigned int hashval = hash_get_hashval(cache->shards[0].table, key);
+
+    return &cache->shards[hashval >> (32 - CACHE_SHARD_BITS)];
+}
 
 static ALWAYS_INLINE void *identity_key_copy(const void *key)
 {
@@ -110,27 +249,50 @@ struct cache *cache_create_full(cache_create_entry_cb create_entry_cb,
                                 time_t time_to_live)
 {
     struct cache *cache;
+    struct timespec now;
+    unsigned int shard;
 
     assert(create_entry_cb);
     assert(destroy_entry_cb);
     assert(time_to_live > 0);
 
-    cache = calloc(1, sizeof(*cache));
+    cache = lwan_aligned_alloc(sizeof(*cache), 64);
     if (!cache)
         return NULL;
+    memset(cache, 0, sizeof(*cache));
+
+    for (shard = 0; shard < CACHE_SHARDS; shard++) {
+        struct cache_shard *s = &cache->shards[shard];
+
+        /* Keys are owned by the entries, and freed once they're evicted:
+         * invalidated entries are removed from the table before they're
+         * removed from the queue. */
+        s->table = hash_create_func(NULL, NULL);
+        if (!s->table)
+            goto error_no_shard;
+
+        s->building = hash_create_func(NULL, NULL);
+        if (!s->building) {
+            hash_unref(s->table);
+            goto error_no_shard;
+        }
 
-    if (hash_create_func == hash_str_new) {
-        cache->hash.table = hash_create_func(free, NULL);
-    } else {
-        cache->hash.table = hash_create_func(NULL, NULL);
+        if (pthread_rwlock_init(&s->lock, NULL)) {
+            hash_unref(s->building);
+            hash_unref(s->table);
+            goto error_no_shard;
+        }
+
+        if (pthread_mutex_init(&s->building_lock, NULL)) {
+            pthread_rwlock_destroy(&s->lock);
+            hash_unref(s->building);
+            hash_unref(s->table);
+            goto error_no_shard;
+        }
     }
-    if (!cache->hash.table)
-        goto error_no_hash;
 
-    if (pthread_rwlock_init(&cache->hash.lock, NULL))
-        goto error_no_hash_lock;
     if (pthread_rwlock_init(&cache->queue.lock, NULL))
-        goto error_no_queue_lock;
+        goto error_no_shard;
 
     cache->cb.create_entry = create_entry_cb;
     cache->cb.destroy_entry = destroy_entry_cb;
@@ -146,17 +308,36 @@ struct cache *cache_create_full(cache_create_entry_cb create_entry_cb,
 
     cache->settings.time_to_live = time_to_live;
 
-    list_head_init(&cache->queue.list);
-
-    lwan_job_add(cache_pruner_job, cache);
+    for (size_t i = 0; i < CACHE_EXPIRY_BUCKETS; i++)
+        list_head_init(&cache->queue.buckets[i]);
+    list_head_init(&cache->queue.invalidated);
+    cache->queue.bucket_width =
+        LWAN_MAX((time_to_live + CACHE_EXPIRY_BUCKETS / 2 - 1) /
+                     (CACHE_EXPIRY_BUCKETS / 2),
+                 (time_t)1);
+    if (UNLIKELY(clock_gettime(monotonic_clock_id, &now) < 0))
+        lwan_status_critical("clock_gettime");
+    cache->queue.oldest_tick = now.tv_sec / cache->queue.bucket_width;
+
+    pthread_mutex_lock(&caches.lock);
+    cache->id = caches.next_id++;
+    list_add_tail(&caches.list, &cache->caches);
+    pthread_mutex_unlock(&caches.lock);
+
+    /* Entries expire with a granularity of one second, so look for them
+     * every second, regardless of whether the last run found any. */
+    lwan_job_add_full(cache_pruner_job, cache, "cache_pruner",
+                      LWAN_JOB_PRIORITY_NORMAL, 1000, 1000);
 
     return cache;
 
-error_no_queue_lock:
-    pthread_rwlock_destroy(&cache->hash.lock);
-error_no_hash_lock:
-    hash_unref(cache->hash.table);
-error_no_hash:
+error_no_shard:
+    while (shard--) {
+        pthread_mutex_destroy(&cache->shards[shard].building_lock);
+        pthread_rwlock_destroy(&cache->shards[shard].lock);
+        hash_unref(cache->shards[shard].building);
+        hash_unref(cache->shards[shard].table);
+    }
     free(cache);
 
     return NULL;
@@ -171,31 +352,643 @@ struct cache *cache_create(cache_create_entry_cb create_entry_cb,
                              cb_context, time_to_live);
 }
 
+void cache_set_name(struct cache *cache, const char *fmt, ...)
+{
+    va_list ap;
+    char *name;
+
+    va_start(ap, fmt);
+    if (vasprintf(&name, fmt, ap) < 0)
+        name = NULL;
+    va_end(ap);
+
+    pthread_mutex_lock(&caches.lock);
+    free(cache->name);
+    cache->name = name;
+    pthread_mutex_unlock(&caches.lock);
+}
+
+void cache_set_max_cost(struct cache *cache, size_t max_cost)
+{
+    cache->settings.max_cost = max_cost;
+}
+
+static void cache_get_stats(struct cache *cache, struct cache_stats *stats)
+{
+    *stats = (struct cache_stats){
+        .name = cache->name ? cache->name : "unnamed",
+        .id = cache->id,
+        .cost = ATOMIC_READ(cache->cost),
+        .max_cost = cache->settings.max_cost,
+        .pruner_runs = ATOMIC_READ(cache->pruner.runs),
+        .pruner_last_duration_us = ATOMIC_READ(cache->pruner.last_duration_us),
+        .pruner_max_duration_us = ATOMIC_READ(cache->pruner.max_duration_us),
+    };
+
+    for (size_t i = 0; i < CACHE_STATS_SHARDS; i++) {
+        stats->hits += __atomic_load_n(&cache->stats[i].hits, __ATOMIC_RELAXED);
+        stats->misses +=
+            __atomic_load_n(&cache->stats[i].misses, __ATOMIC_RELAXED);
+        stats->evicted +=
+            __atomic_load_n(&cache->stats[i].evicted, __ATOMIC_RELAXED);
+        stats->coalesced +=
+            __atomic_load_n(&cache->stats[i].coalesced, __ATOMIC_RELAXED);
+    }
+
+    for (size_t i = 0; i < CACHE_SHARDS; i++) {
+        struct cache_shard *shard = &cache->shards[i];
+
+        if (cache->flags & READ_ONLY) {
+            stats->entries += hash_get_count(shard->table);
+        } else if (!pthread_rwlock_rdlock(&shard->lock)) {
+            stats->entries += hash_get_count(shard->table);
+            pthread_rwlock_unlock(&shard->lock);
+        }
+    }
+}
+
+void cache_foreach_stats(void (*cb)(const struct cache_stats *stats,
+                                    void *data),
+                         void *data)
+{
+    struct cache *cache;
+
+    pthread_mutex_lock(&caches.lock);
+    list_for_each(&caches.list, cache, caches) {
+        struct cache_stats stats;
+
+        cache_get_stats(cache, &stats);
+        cb(&stats, data);
+    }
+    pthread_mutex_unlock(&caches.lock);
+}
+
+static void hot_keys_free(struct hot_keys *hk)
+{
+    if (!hk)
+        return;
+
+    for (unsigned int i = 0; i < hk->n_top; i++)
+        free(hk->top[i].key);
+    pthread_mutex_destroy(&hk->lock);
+    free(hk);
+}
+
+void cache_track_hot_keys(struct cache *cache)
+{
+    struct hot_keys *hk;
+
+    /* Keys are saved as strings */
+    assert(cache->key.copy == str_key_copy);
+
+    if (cache->hot_keys)
+        return;
+
+    hk = calloc(1, sizeof(*hk));
+    if (!hk)
+        return;
+
+    pthread_mutex_init(&hk->lock, NULL);
+    cache->hot_keys = hk;
+}
+
+/* Must be called with hk->lock held. */
+static void hot_keys_update_min_count(struct hot_keys *hk)
+{
+    uint32_t min_count = UINT32_MAX;
+
+    if (hk->n_top < HOT_KEYS_TOP_K) {
+        min_count = 0;
+    } else {
+        for (unsigned int i = 0; i < hk->n_top; i++)
+            min_count = LWAN_MIN(min_count, hk->top[i].count);
+    }
+
+    __atomic_store_n(&hk->min_count, min_count, __ATOMIC_RELAXED);
+}
+
+static void hot_keys_track(struct hot_keys *hk, const char *key)
+{
+    static __thread unsigned int lookups;
+    uint32_t estimate = UINT32_MAX;
+    uint64_t hash;
+
+    if (++lookups % HOT_KEYS_SAMPLE_RATE)
+        return;
+
+    /* Each row is indexed by a different combination of two halves of the
+     * same hash (Kirsch & Mitzenmacher), rather than by its own hash. */
+    hash = fnv1a_64(key, strlen(key));
+    for (uint32_t row = 0; row < HOT_KEYS_SKETCH_DEPTH; row++) {
+        uint32_t col = ((uint32_t)hash + row * (uint32_t)(hash >> 32)) %
+                       HOT_KEYS_SKETCH_WIDTH;
+        uint32_t count = __atomic_add_fetch(&hk->sketch[row][col], 1,
+                                            __ATOMIC_RELAXED);
+
+        estimate = LWAN_MIN(estimate, count);
+    }
+
+    if (estimate <= ATOMIC_READ(hk->min_count))
+        return;
+
+    /* This is only an estimate anyway, so don't wait for other threads */
+    if (pthread_mutex_trylock(&hk->lock))
+        return;
+
+    unsigned int i, victim = 0;
+    for (i = 0; i < hk->n_top; i++) {
+        if (streq(hk->top[i].key, key))
+            break;
+        if (hk->top[i].count < hk->top[victim].count)
+            victim = i;
+    }
+
+    if (i < hk->n_top) {
+        hk->top[i].count = estimate;
+    } else {
+        char *key_copy = strdup(key);
+
+        if (key_copy) {
+            if (hk->n_top < HOT_KEYS_TOP_K) {
+                victim = hk->n_top++;
+            } else {
+                free(hk->top[victim].key);
+            }
+            hk->top[victim].key = key_copy;
+            hk->top[victim].count = estimate;
+        }
+    }
+
+    hot_keys_update_min_count(hk);
+    pthread_mutex_unlock(&hk->lock);
+}
+
+static void hot_keys_decay(struct hot_keys *hk)
+{
+    if (++hk->decay_ticks % HOT_KEYS_DECAY_PERIOD)
+        return;
+
+    /* Racing with hot_keys_track() might lose a few increments, which is
+     * fine for an estimate. */
+    for (uint32_t row = 0; row < HOT_KEYS_SKETCH_DEPTH; row++) {
+        for (uint32_t col = 0; col < HOT_KEYS_SKETCH_WIDTH; col++) {
+            uint32_t *counter = &hk->sketch[row][col];
+
+            __atomic_store_n(counter,
+                             __atomic_load_n(counter, __ATOMIC_RELAXED) / 2,
+                             __ATOMIC_RELAXED);
+        }
+    }
+
+    pthread_mutex_lock(&hk->lock);
+    for (unsigned int i = 0; i < hk->n_top; i++)
+        hk->top[i].count /= 2;
+    hot_keys_update_min_count(hk);
+    pthread_mutex_unlock(&hk->lock);
+}
+
+static int hot_keys_compare(const void *a, const void *b)
+{
+    const struct hot_key *ka = a, *kb = b;
+
+    return (ka->count < kb->count) - (ka->count > kb->count);
+}
+
+/* Cache names and keys are separated by a tab, one key per line; names
+ * and keys that can't be written like this are skipped. */
+static bool can_save_as_hot_key(const char *str)
+{
+    return *str && !strpbrk(str, "\t\n");
+}
+
+bool cache_hot_keys_save(const char *path)
+{
+    char tmp_path[PATH_MAX];
+    struct cache *cache;
+    FILE *f;
+    int fd;
+
+    if (snprintf(tmp_path, sizeof(tmp_path), "%s.XXXXXX", path) >=
+        (int)sizeof(tmp_path))
+        return false;
+
+    /* Written to a temporary file first, so that a crash while saving
+     * doesn't leave a truncated file behind. */
+    fd = mkostemp(tmp_path, O_CLOEXEC);
+    if (fd < 0) {
+        lwan_status_perror("Could not create %s", tmp_path);
+        return false;
+    }
+
+    f = fdopen(fd, "w");
+    if (!f) {
+        close(fd);
+        unlink(tmp_path);
+        return false;
+    }
+
+    pthread_mutex_lock(&caches.lock);
+    list_for_each(&caches.list, cache, caches) {
+        struct hot_keys *hk = cache->hot_keys;
+        struct hot_key keys[HOT_KEYS_TOP_K];
+
+        if (!hk || !cache->name || !can_save_as_hot_key(cache->name))
+            continue;
+
+        pthread_mutex_lock(&hk->lock);
+        memcpy(keys, hk->top, hk->n_top * sizeof(keys[0]));
+
+        /* Hottest keys first, so they're the first ones to be prewarmed */
+        qsort(keys, hk->n_top, sizeof(keys[0]), hot_keys_compare);
+
+        for (unsigned int i = 0; i < hk->n_top; i++) {
+            if (can_save_as_hot_key(keys[i].key))
+                fprintf(f, "%s\t%s\n", cache->name, keys[i].key);
+        }
+        pthread_mutex_unlock(&hk->lock);
+    }
+    pthread_mutex_unlock(&caches.lock);
+
+    if (fclose(f) || rename(tmp_path, path) < 0) {
+        lwan_status_perror("Could not save hot keys to %s", path);
+        unlink(tmp_path);
+        return false;
+    }
+
+    return true;
+}
+
+static void hot_keys_prewarm_task(void *data)
+{
+    char *path = data;
+    unsigned int prewarmed = 0;
+    size_t line_size = 0;
+    char *line = NULL;
+    ssize_t len;
+    FILE *f;
+
+    f = fopen(path, "re");
+    if (!f) {
+        if (errno != ENOENT)
+            lwan_status_perror("Could not open hot keys file %s", path);
+        free(path);
+        return;
+    }
+
+    /* Holding the lock keeps caches from being destroyed (e.g. because the
+     * configuration is being reloaded) while they're being prewarmed. */
+    pthread_mutex_lock(&caches.lock);
+    while ((len = getline(&line, &line_size, f)) > 0) {
+        struct cache *cache;
+        char *key;
+
+        if (line[len - 1] == '\n')
+            line[len - 1] = '\0';
+
+        key = strchr(line, '\t');
+        if (!key)
+            continue;
+        *key++ = '\0';
+
+        list_for_each(&caches.list, cache, caches) {
+            struct cache_entry *entry;
+            int error;
+
+            if (!cache->hot_keys || (cache->flags & READ_ONLY) ||
+                !cache->name || !streq(cache->name, line))
+                continue;
+
+            entry = cache_get_and_ref_entry(cache, key, &error);
+            if (entry) {
+                cache_entry_unref(cache, entry);
+                prewarmed++;
+            }
+        }
+    }
+    pthread_mutex_unlock(&caches.lock);
+
+    lwan_status_debug("Prewarmed %u cache entries from %s", prewarmed, path);
+
+    free(line);
+    fclose(f);
+    free(path);
+}
+
+void cache_hot_keys_prewarm(const char *path)
+{
+    char *path_copy = strdup(path);
+
+    if (!path_copy)
+        return;
+
+    if (!lwan_job_run_task(hot_keys_prewarm_task, path_copy)) {
+        lwan_status_warning("Could not prewarm caches from %s", path);
+        free(path_copy);
+    }
+}
+
 void cache_destroy(struct cache *cache)
 {
     assert(cache);
 
+    pthread_mutex_lock(&caches.lock);
+    list_del(&cache->caches);
+    pthread_mutex_unlock(&caches.lock);
+
 #ifndef NDEBUG
-    lwan_status_debug("Cache stats: %d hits, %d misses, %d evictions",
-                      cache->stats.hits, cache->stats.misses,
-                      cache->stats.evicted);
+    struct cache_stats stats;
+    cache_get_stats(cache, &stats);
+    lwan_status_debug("Cache stats: %" PRIu64 " hits, %" PRIu64
+                      " misses, %" PRIu64 " evictions",
+                      stats.hits, stats.misses, stats.evicted);
 #endif
 
     lwan_job_del(cache_pruner_job, cache);
     cache->flags |= SHUTTING_DOWN;
     cache_pruner_job(cache);
-    pthread_rwlock_destroy(&cache->hash.lock);
+    for (size_t i = 0; i < CACHE_SHARDS; i++) {
+        pthread_mutex_destroy(&cache->shards[i].building_lock);
+        pthread_rwlock_destroy(&cache->shards[i].lock);
+        hash_unref(cache->shards[i].building);
+        hash_unref(cache->shards[i].table);
+    }
     pthread_rwlock_destroy(&cache->queue.lock);
-    hash_unref(cache->hash.table);
+    hot_keys_free(cache->hot_keys);
+    free(cache->name);
     free(cache);
 }
 
-struct cache_entry *cache_get_and_ref_entry_with_ctx(struct cache *cache,
-                                            const void *key, void *create_ctx,
-                                            int *error)
+static ALWAYS_INLINE struct list_head *expiry_bucket(struct cache *cache,
+                                                     time_t tick)
+{
+    return &cache->queue.buckets[(size_t)tick % CACHE_EXPIRY_BUCKETS];
+}
+
+/* Must be called with the queue lock held. */
+static void queue_entry(struct cache *cache, struct cache_entry *entry)
+{
+    time_t tick = entry->time_to_expire / cache->queue.bucket_width;
+
+    /* If the pruner fell so far behind that the wheel would wrap around,
+     * expire the entry a bit early rather than mixing up its bucket with
+     * one that expires later */
+    tick = LWAN_MIN(tick, cache->queue.oldest_tick + CACHE_EXPIRY_BUCKETS - 1);
+    tick = LWAN_MAX(tick, cache->queue.oldest_tick);
+
+    list_add_tail(expiry_bucket(cache, tick), &entry->entries);
+    ATOMIC_OP(&entry->flags, or, QUEUED);
+}
+
+/* Must be called with the queue lock held. */
+static void take_entry(struct list_head *victims, struct cache_entry *entry)
+{
+    list_del(&entry->entries);
+    ATOMIC_OP(&entry->flags, and, ~QUEUED);
+    list_add_tail(victims, &entry->entries);
+}
+
+/* Must be called with the queue lock held. */
+static size_t take_invalidated(struct cache *cache, struct list_head *victims)
 {
+    struct cache_entry *node, *next;
+    size_t cost = 0;
+
+    list_for_each_safe(&cache->queue.invalidated, node, next, entries) {
+        take_entry(victims, node);
+        cost += node->cost;
+    }
+
+    return cost;
+}
+
+/* Adds an entry created by whoever registered key_copy in the building
+ * table, waking up any waiters.  Takes ownership of key_copy, and returns
+ * entry with a reference held (or NULL if entry is NULL). */
+static struct cache_entry *publish_entry(struct cache *cache,
+                                         struct cache_shard *shard,
+                                         char *key_copy,
+                                         struct cache_entry *entry,
+                                         int *error)
+{
+    /* Waiters will only be able to make progress once the key is removed
+     * from the building table, so block here if necessary.  Since the key
+     * is removed with the hash table lock held, waiters will either find
+     * the entry in the hash table, or know that creating it failed. */
+    if (UNLIKELY(pthread_rwlock_wrlock(&shard->lock)))
+        lwan_status_critical_perror("pthread_rwlock_wrlock");
+
+    pthread_mutex_lock(&shard->building_lock);
+    hash_del(shard->building, key_copy);
+    pthread_mutex_unlock(&shard->building_lock);
+
+    if (UNLIKELY(!entry)) {
+        pthread_rwlock_unlock(&shard->lock);
+
+        *error = ECANCELED;
+        cache->key.free(key_copy);
+        return NULL;
+    }
+
+    *entry = (struct cache_entry){
+        .key = key_copy,
+        .refs = 1,
+        .cost = cache->settings.max_cost ? LWAN_MAX(entry->cost, (size_t)1) : 1,
+    };
+
+    if (!hash_add_unique(shard->table, entry->key, entry)) {
+        struct timespec now;
+
+        if (UNLIKELY(clock_gettime(monotonic_clock_id, &now) < 0))
+            lwan_status_critical("clock_gettime");
+
+        entry->time_to_expire = now.tv_sec + cache->settings.time_to_live;
+
+        if (LIKELY(!pthread_rwlock_wrlock(&cache->queue.lock))) {
+            queue_entry(cache, entry);
+            ATOMIC_AAF(&cache->cost, entry->cost);
+            pthread_rwlock_unlock(&cache->queue.lock);
+        } else {
+            entry->flags = TEMPORARY | FREE_KEY_ON_DESTROY;
+
+            /* Ensure item is removed from the hash table; otherwise,
+             * another thread could potentially get another reference
+             * to this entry and cause an invalid memory access. */
+            hash_del(shard->table, entry->key);
+        }
+    } else {
+        /* There was an error inside the hash table: return a TEMPORARY
+         * entry, as above. */
+        entry->flags = TEMPORARY | FREE_KEY_ON_DESTROY;
+    }
+
+    pthread_rwlock_unlock(&shard->lock);
+
+    if (cache->settings.max_cost &&
+        ATOMIC_READ(cache->cost) > cache->settings.max_cost)
+        cache_evict_over_budget(cache);
+
+    return entry;
+}
+
+/* Creating an entry might take a while (e.g. compressing a large file),
+ * so, for caches where this is enabled with cache_make_async(), creation
+ * is performed by a task thread while the coroutine awaits on an eventfd.
+ * If the coroutine is destroyed before the task is finished (e.g. the
+ * client hung up), the task publishes the entry by itself, so that any
+ * waiters for that key are woken up. */
+enum { ASYNC_PENDING, ASYNC_DONE, ASYNC_ABANDONED };
+
+struct async_create {
+    struct cache *cache;
+    struct cache_shard *shard;
+    char *key;
+    struct cache_entry *entry;
+    int efd;
+    int refs;
+    int state;
+    bool consumed;
+};
+
+static void async_create_unref(struct async_create *ac)
+{
+    if (ATOMIC_DEC(ac->refs))
+        return;
+
+    close(ac->efd);
+    free(ac);
+}
+
+static void async_create_publish_and_unref(struct async_create *ac)
+{
+    struct cache_entry *entry;
+    int error;
+
+    entry = publish_entry(ac->cache, ac->shard, ac->key, ac->entry, &error);
+    if (entry)
+        cache_entry_unref(ac->cache, entry);
+}
+
+static void async_create_task(void *data)
+{
+    struct async_create *ac = data;
+
+    ac->entry = ac->cache->cb.create_entry(ac->key, ac->cache->cb.context, NULL);
+
+    if (__sync_bool_compare_and_swap(&ac->state, ASYNC_PENDING, ASYNC_DONE)) {
+        if (UNLIKELY(eventfd_write(ac->efd, 1) < 0))
+            lwan_status_perror("eventfd_write");
+    } else {
+        async_create_publish_and_unref(ac);
+    }
+
+    async_create_unref(ac);
+}
+
+static void async_create_abandon(void *data)
+{
+    struct async_create *ac = data;
+
+    if (!__sync_bool_compare_and_swap(&ac->state, ASYNC_PENDING,
+                                      ASYNC_ABANDONED)) {
+        /* The task is done, but the coroutine didn't get the chance to
+         * publish the entry. */
+        if (!ac->consumed)
+            async_create_publish_and_unref(ac);
+    }
+
+    async_create_unref(ac);
+}
+
+static bool create_entry_async(struct cache *cache,
+                               struct lwan_request *request,
+                               struct cache_shard *shard,
+                               char *key_copy,
+                               struct cache_entry **entry,
+                               int *error)
+{
+    struct async_create *ac;
+    eventfd_t value;
+    int efd;
+
+    efd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (UNLIKELY(efd < 0))
+        return false;
+
+    ac = malloc(sizeof(*ac));
+    if (UNLIKELY(!ac)) {
+        close(efd);
+        return false;
+    }
+
+    *ac = (struct async_create){
+        .cache = cache,
+        .shard = shard,
+        .key = key_copy,
+        .efd = efd,
+        .refs = 2,
+        .state = ASYNC_PENDING,
+    };
+
+    /* Deferred callbacks are executed in reverse order, so this is called
+     * after the eventfd is no longer being watched by this thread. */
+    if (UNLIKELY(coro_defer(request->conn->coro, async_create_abandon, ac) <
+                 0)) {
+        close(efd);
+        free(ac);
+        return false;
+    }
+
+    if (UNLIKELY(!lwan_job_run_task(async_create_task, ac))) {
+        /* Let the deferred callback just close the eventfd. */
+        ac->state = ASYNC_DONE;
+        ac->consumed = true;
+        ac->refs--;
+        return false;
+    }
+
+    if (UNLIKELY(lwan_request_await_read(request, efd) < 0)) {
+        /* The task will publish the entry once it's done. */
+        *entry = NULL;
+        *error = ECANCELED;
+        return true;
+    }
+
+    if (UNLIKELY(eventfd_read(efd, &value) < 0))
+        lwan_status_perror("eventfd_read");
+
+    ac->consumed = true;
+    *entry = publish_entry(cache, shard, key_copy, ac->entry, error);
+    return true;
+}
+
+static void abandon_building_entry(void *data1, void *data2)
+{
+    struct cache *cache = data1;
+    char *key = data2;
+    int error;
+
+    publish_entry(cache, cache_shard(cache, key), key, NULL, &error);
+}
+
+static ALWAYS_INLINE void ref_entry_locked(struct cache *cache,
+                                           struct cache_entry *entry)
+{
+    ATOMIC_INC(entry->refs);
+    if (cache->settings.max_cost && !(entry->flags & ACCESSED))
+        ATOMIC_OP(&entry->flags, or, ACCESSED);
+}
+
+static struct cache_entry *get_and_ref_entry(struct cache *cache,
+                                             struct lwan_request *request,
+                                             const void *key,
+                                             void *create_ctx,
+                                             bool can_wait,
+                                             int *error)
+{
+    struct cache_shard *shard;
     struct cache_entry *entry;
     char *key_copy;
+    bool building;
 
     assert(cache);
     assert(error);
@@ -203,101 +996,141 @@ struct cache_entry *cache_get_and_ref_entry_with_ctx(struct cache *cache,
 
     *error = 0;
 
+    shard = cache_shard(cache, key);
+
+    if (cache->hot_keys)
+        hot_keys_track(cache->hot_keys, key);
+
     if (cache->flags & READ_ONLY) {
-        entry = hash_find(cache->hash.table, key);
-#ifndef NDEBUG
+        entry = hash_find(shard->table, key);
         if (LIKELY(entry))
-            ATOMIC_INC(cache->stats.hits);
+            CACHE_HIT(cache, key);
         else
-            ATOMIC_INC(cache->stats.misses);
-#endif
+            CACHE_MISS(cache, key);
         return entry;
     }
 
     /* If the lock can't be obtained, return an error to allow, for instance,
      * yielding from the coroutine and trying to obtain the lock at a later
      * time. */
-    if (UNLIKELY(pthread_rwlock_tryrdlock(&cache->hash.lock) == EBUSY)) {
+    if (UNLIKELY(pthread_rwlock_tryrdlock(&shard->lock) == EBUSY)) {
         *error = EWOULDBLOCK;
         return NULL;
     }
-    entry = hash_find(cache->hash.table, key);
+    entry = hash_find(shard->table, key);
     if (LIKELY(entry)) {
-        ATOMIC_INC(entry->refs);
-        pthread_rwlock_unlock(&cache->hash.lock);
-#ifndef NDEBUG
-        ATOMIC_INC(cache->stats.hits);
-#endif
+        ref_entry_locked(cache, entry);
+        pthread_rwlock_unlock(&shard->lock);
+        CACHE_HIT(cache, key);
         return entry;
     }
-
-    /* No need to keep the hash table lock locked while the item is being created. */
-    pthread_rwlock_unlock(&cache->hash.lock);
-
-#ifndef NDEBUG
-    ATOMIC_INC(cache->stats.misses);
-#endif
+    pthread_rwlock_unlock(&shard->lock);
+
+    /* Only one caller gets to create an entry for a given key; the key is
+     * added to the shard's "building" table until the entry is in the
+     * cache.  Callers that can wait are told to try again later, and the
+     * others create a temporary entry just for themselves.  (The building
+     * lock is always taken after the hash table lock, except here, where
+     * the hash table lock is only tried.) */
+    pthread_mutex_lock(&shard->building_lock);
+    if (hash_find(shard->building, key)) {
+        pthread_mutex_unlock(&shard->building_lock);
+        if (can_wait) {
+            *error = EINPROGRESS;
+            return NULL;
+        }
+        building = false;
+    } else {
+        /* Whoever was creating this entry might have finished in the
+         * meantime. */
+        if (UNLIKELY(pthread_rwlock_tryrdlock(&shard->lock) == EBUSY)) {
+            pthread_mutex_unlock(&shard->building_lock);
+            *error = EWOULDBLOCK;
+            return NULL;
+        }
+        entry = hash_find(shard->table, key);
+        if (entry) {
+            ref_entry_locked(cache, entry);
+            pthread_rwlock_unlock(&shard->lock);
+            pthread_mutex_unlock(&shard->building_lock);
+            CACHE_HIT(cache, key);
+            return entry;
+        }
+        pthread_rwlock_unlock(&shard->lock);
+        building = true;
+    }
 
     key_copy = cache->key.copy(key);
     if (UNLIKELY(!key_copy)) {
         if (cache->key.copy != identity_key_copy) {
+            if (building)
+                pthread_mutex_unlock(&shard->building_lock);
             *error = ENOMEM;
             return NULL;
         }
     }
 
-    entry = cache->cb.create_entry(key, cache->cb.context, create_ctx);
-    if (UNLIKELY(!entry)) {
-        *error = ECANCELED;
-        cache->key.free(key_copy);
-        return NULL;
+    if (building) {
+        building = !hash_add_unique(shard->building, key_copy, shard);
+        pthread_mutex_unlock(&shard->building_lock);
     }
 
-    *entry = (struct cache_entry) { .key =  key_copy, .refs = 1 };
+    CACHE_MISS(cache, key);
 
-    if (pthread_rwlock_trywrlock(&cache->hash.lock) == EBUSY) {
-        /* Couldn't obtain hash write lock: instead of waiting, just return
-         * the recently-created item as a temporary item.  Might result in
-         * items not being added to the cache, though, so this might be
-         * changed back to pthread_rwlock_wrlock() again someday if this
-         * proves to be a problem.  */
-        entry->flags = TEMPORARY | FREE_KEY_ON_DESTROY;
-        return entry;
-    }
+    if (building && request && (cache->flags & CREATE_ASYNC) && !create_ctx) {
+        struct cache_entry *async_entry;
 
-    if (!hash_add_unique(cache->hash.table, entry->key, entry)) {
-        struct timespec now;
-
-        if (UNLIKELY(clock_gettime(monotonic_clock_id, &now) < 0))
-            lwan_status_critical("clock_gettime");
-
-        entry->time_to_expire = now.tv_sec + cache->settings.time_to_live;
+        if (create_entry_async(cache, request, shard, key_copy, &async_entry,
+                               error))
+            return async_entry;
+    }
 
-        if (LIKELY(!pthread_rwlock_wrlock(&cache->queue.lock))) {
-            list_add_tail(&cache->queue.list, &entry->entries);
-            pthread_rwlock_unlock(&cache->queue.lock);
-        } else {
-            /* Key is freed when this entry is removed from the hash
-             * table below. */
-            entry->flags = TEMPORARY;
+    /* No need to keep the hash table lock locked while the item is being
+     * created.  The callback might yield (e.g. the response cache runs
+     * request handlers), and the coroutine might never be resumed if the
+     * client goes away, so make sure waiters aren't left hanging. */
+    coro_deferred abandon = -1;
+    if (building && request) {
+        abandon = coro_defer2(request->conn->coro, abandon_building_entry,
+                              cache, key_copy);
+        if (UNLIKELY(abandon < 0)) {
+            publish_entry(cache, shard, key_copy, NULL, error);
+            *error = ENOMEM;
+            return NULL;
+        }
+    }
+    entry = cache->cb.create_entry(key, cache->cb.context, create_ctx);
+    if (abandon >= 0)
+        coro_defer_disarm(request->conn->coro, abandon);
 
-            /* Ensure item is removed from the hash table; otherwise,
-             * another thread could potentially get another reference
-             * to this entry and cause an invalid memory access. */
-            hash_del(cache->hash.table, entry->key);
+    if (!building) {
+        if (UNLIKELY(!entry)) {
+            *error = ECANCELED;
+            cache->key.free(key_copy);
+            return NULL;
         }
-    } else {
-        /* Either there's another item with the same key (-EEXIST), or
-         * there was an error inside the hash table. In either case,
-         * just return a TEMPORARY entry so that it is destroyed the first
-         * time someone unrefs this entry. TEMPORARY entries are pretty much
-         * like FLOATING entries, but unreffing them do not use atomic
-         * operations. */
-        entry->flags = TEMPORARY | FREE_KEY_ON_DESTROY;
+
+        /* Either someone else is creating this entry, or the key couldn't
+         * be added to the building table; just return a TEMPORARY entry so
+         * that it is destroyed the first time someone unrefs this entry.
+         * TEMPORARY entries are pretty much like FLOATING entries, but
+         * unreffing them do not use atomic operations. */
+        *entry = (struct cache_entry){
+            .key = key_copy,
+            .refs = 1,
+            .flags = TEMPORARY | FREE_KEY_ON_DESTROY,
+        };
+        return entry;
     }
 
-    pthread_rwlock_unlock(&cache->hash.lock);
-    return entry;
+    return publish_entry(cache, shard, key_copy, entry, error);
+}
+
+struct cache_entry *cache_get_and_ref_entry_with_ctx(struct cache *cache,
+                                            const void *key, void *create_ctx,
+                                            int *error)
+{
+    return get_and_ref_entry(cache, NULL, key, create_ctx, false, error);
 }
 
 ALWAYS_INLINE struct cache_entry *
@@ -338,13 +1171,166 @@ void cache_entry_unref(struct cache *cache, struct cache_entry *entry)
     }
 }
 
+static void cache_evict_entry(struct cache *cache, struct cache_entry *node)
+{
+    struct cache_shard *shard = cache_shard(cache, node->key);
+
+    if (UNLIKELY(pthread_rwlock_wrlock(&shard->lock))) {
+        lwan_status_perror("pthread_rwlock_wrlock");
+        return;
+    }
+
+    /* Entries that have been invalidated are no longer in the table, and
+     * another entry with the same key might be there already. */
+    if (!(node->flags & INVALIDATED))
+        hash_del(shard->table, node->key);
+
+    if (UNLIKELY(pthread_rwlock_unlock(&shard->lock)))
+        lwan_status_perror("pthread_rwlock_unlock");
+
+    cache->key.free(node->key);
+
+    ATOMIC_SAF(&cache->cost, node->cost);
+    CACHE_STATS_INC(cache, evicted);
+
+    if (ATOMIC_INC(node->refs) == 1) {
+        /* If the refcount was 0, and turned 1 after the increment, it means the item can
+         * be destroyed here. */
+        cache->cb.destroy_entry(node, cache->cb.context);
+    } else {
+        /* If not, some other thread had references to this object. */
+        ATOMIC_OP(&node->flags, or, FLOATING);
+        /* If in the time between the ref check above and setting the floating flag the
+         * thread holding the reference drops it, if our reference is 0 after dropping it,
+         * the pruner thread was the last thread holding the reference to this entry, so
+         * it's safe to destroy it at this point. */
+        if (!ATOMIC_DEC(node->refs))
+            cache->cb.destroy_entry(node, cache->cb.context);
+    }
+}
+
+/* Called by the thread that made the cache go over its budget.  The expiry
+ * buckets, oldest first, are used as the CLOCK ring: entries that have been
+ * looked up since the hand last went through them get a second chance, and
+ * the others are evicted until the cache is within its budget again.
+ * Invalidated entries go first, as they can't be looked up anymore. */
+static void cache_evict_over_budget(struct cache *cache)
+{
+    struct cache_entry *node, *next;
+    struct list_head victims;
+    size_t cost;
+
+    /* Either the pruner or another thread is already taking care of it. */
+    if (pthread_rwlock_trywrlock(&cache->queue.lock))
+        return;
+
+    list_head_init(&victims);
+    cost = ATOMIC_READ(cache->cost);
+    cost -= LWAN_MIN(take_invalidated(cache, &victims), cost);
+
+    for (int hand = 0; hand < 2 && cost > cache->settings.max_cost; hand++) {
+        for (time_t i = 0; i < CACHE_EXPIRY_BUCKETS; i++) {
+            struct list_head *bucket =
+                expiry_bucket(cache, cache->queue.oldest_tick + i);
+
+            list_for_each_safe(bucket, node, next, entries) {
+                if (cost <= cache->settings.max_cost)
+                    goto out;
+
+                if (node->flags & ACCESSED) {
+                    ATOMIC_OP(&node->flags, and, ~ACCESSED);
+                    continue;
+                }
+
+                take_entry(&victims, node);
+                cost -= node->cost;
+            }
+        }
+    }
+
+out:
+    if (UNLIKELY(pthread_rwlock_unlock(&cache->queue.lock)))
+        lwan_status_perror("pthread_rwlock_unlock");
+
+    list_for_each_safe(&victims, node, next, entries)
+        cache_evict_entry(cache, node);
+}
+
+/* Unlike cache_evict_over_budget(), entries don't get a second chance:
+ * the oldest ones go first, as they're the closest to expiring anyway. */
+static size_t cache_shrink(struct cache *cache, unsigned int percent)
+{
+    struct cache_entry *node, *next;
+    struct list_head victims;
+    size_t cost, target, evicted = 0;
+
+    if (cache->flags & READ_ONLY)
+        return 0;
+
+    if (UNLIKELY(pthread_rwlock_wrlock(&cache->queue.lock))) {
+        lwan_status_perror("pthread_rwlock_wrlock");
+        return 0;
+    }
+
+    list_head_init(&victims);
+    cost = ATOMIC_READ(cache->cost);
+    target = cost - cost * percent / 100;
+    cost -= LWAN_MIN(take_invalidated(cache, &victims), cost);
+
+    for (time_t i = 0; i < CACHE_EXPIRY_BUCKETS && cost > target; i++) {
+        struct list_head *bucket =
+            expiry_bucket(cache, cache->queue.oldest_tick + i);
+
+        list_for_each_safe(bucket, node, next, entries) {
+            if (cost <= target)
+                break;
+
+            take_entry(&victims, node);
+            cost -= node->cost;
+        }
+    }
+
+    if (UNLIKELY(pthread_rwlock_unlock(&cache->queue.lock)))
+        lwan_status_perror("pthread_rwlock_unlock");
+
+    list_for_each_safe(&victims, node, next, entries) {
+        cache_evict_entry(cache, node);
+        evicted++;
+    }
+
+    return evicted;
+}
+
+size_t cache_shrink_all(unsigned int percent)
+{
+    struct cache *cache;
+    size_t evicted = 0;
+
+    assert(percent <= 100);
+
+    pthread_mutex_lock(&caches.lock);
+    list_for_each(&caches.list, cache, caches)
+        evicted += cache_shrink(cache, percent);
+    pthread_mutex_unlock(&caches.lock);
+
+    return evicted;
+}
+
+/* Only what has expired is looked at: buckets older than the current one
+ * are emptied wholesale, and the current one only up to its first entry
+ * that didn't expire yet.  Entries are moved out with the queue lock held,
+ * which takes time proportional to the number of entries being evicted,
+ * and are evicted after it's released, so inserts aren't blocked while
+ * entries are destroyed. */
 static bool cache_pruner_job(void *data)
 {
     struct cache *cache = data;
     struct cache_entry *node, *next;
     struct timespec now;
     bool shutting_down = cache->flags & SHUTTING_DOWN;
-    struct list_head queue;
+    struct list_head victims;
+    struct timespec start;
+    time_t now_tick;
     unsigned int evicted = 0;
 
     /* This job might start execution as we mark ourselves as read-only,
@@ -352,88 +1338,106 @@ static bool cache_pruner_job(void *data)
     if (cache->flags & READ_ONLY)
         return true;
 
-    if (UNLIKELY(pthread_rwlock_trywrlock(&cache->queue.lock) == EBUSY))
-        return false;
+    if (cache->hot_keys && !shutting_down)
+        hot_keys_decay(cache->hot_keys);
 
-    /* If the queue is empty, there's nothing to do; unlock/return*/
-    if (list_empty(&cache->queue.list)) {
-        if (UNLIKELY(pthread_rwlock_unlock(&cache->queue.lock)))
-            lwan_status_perror("pthread_rwlock_unlock");
+    if (UNLIKELY(clock_gettime(monotonic_clock_id, &start) < 0)) {
+        lwan_status_perror("clock_gettime");
         return false;
     }
 
-    /* There are things to do; work on a local queue so the lock doesn't
-     * need to be held while items are being pruned. */
-    list_head_init(&queue);
-    list_append_list(&queue, &cache->queue.list);
-    list_head_init(&cache->queue.list);
+    if (UNLIKELY(pthread_rwlock_trywrlock(&cache->queue.lock) == EBUSY))
+        return false;
 
-    if (UNLIKELY(pthread_rwlock_unlock(&cache->queue.lock))) {
-        lwan_status_perror("pthread_rwlock_unlock");
-        goto end;
-    }
+    list_head_init(&victims);
+    take_invalidated(cache, &victims);
 
-    if (UNLIKELY(clock_gettime(monotonic_clock_id, &now) < 0)) {
-        lwan_status_perror("clock_gettime");
-        goto end;
+    now_tick = start.tv_sec / cache->queue.bucket_width;
+    if (UNLIKELY(shutting_down))
+        now_tick = cache->queue.oldest_tick + CACHE_EXPIRY_BUCKETS + 1;
+
+    /* Every entry in the buckets before the current one has expired */
+    for (time_t i = 0; i < CACHE_EXPIRY_BUCKETS &&
+                       cache->queue.oldest_tick + i < now_tick;
+         i++) {
+        struct list_head *bucket =
+            expiry_bucket(cache, cache->queue.oldest_tick + i);
+
+        list_for_each_safe(bucket, node, next, entries)
+            take_entry(&victims, node);
+    }
+    if (now_tick > cache->queue.oldest_tick)
+        cache->queue.oldest_tick = now_tick;
+
+    if (LIKELY(!shutting_down)) {
+        list_for_each_safe(expiry_bucket(cache, now_tick), node, next,
+                           entries) {
+            if (start.tv_sec < node->time_to_expire)
+                break;
+            take_entry(&victims, node);
+        }
     }
 
-    list_for_each_safe(&queue, node, next, entries) {
-        char *key = node->key;
+    if (UNLIKELY(pthread_rwlock_unlock(&cache->queue.lock)))
+        lwan_status_perror("pthread_rwlock_unlock");
 
-        if (now.tv_sec < node->time_to_expire && LIKELY(!shutting_down))
-            break;
+    list_for_each_safe(&victims, node, next, entries) {
+        cache_evict_entry(cache, node);
+        evicted++;
+    }
 
-        list_del(&node->entries);
+    if (LIKELY(clock_gettime(monotonic_clock_id, &now) >= 0)) {
+        uint64_t duration_us =
+            (uint64_t)((now.tv_sec - start.tv_sec) * 1000000 +
+                       (now.tv_nsec - start.tv_nsec) / 1000);
 
-        if (UNLIKELY(pthread_rwlock_wrlock(&cache->hash.lock))) {
-            lwan_status_perror("pthread_rwlock_wrlock");
-            continue;
-        }
+        cache->pruner.last_duration_us = duration_us;
+        if (duration_us > cache->pruner.max_duration_us)
+            cache->pruner.max_duration_us = duration_us;
+    }
+    cache->pruner.runs++;
 
-        hash_del(cache->hash.table, key);
+    return evicted;
+}
 
-        if (UNLIKELY(pthread_rwlock_unlock(&cache->hash.lock)))
-            lwan_status_perror("pthread_rwlock_unlock");
+/* Removes the entry for key from the cache, if there's one, so that the
+ * next lookup creates it again.  Callers holding references to it can
+ * keep using it; the entry itself is destroyed by the pruner job, during
+ * its next run, once these references are dropped. */
+bool cache_invalidate(struct cache *cache, const void *key)
+{
+    struct cache_shard *shard;
+    struct cache_entry *entry;
 
-        if (ATOMIC_INC(node->refs) == 1) {
-            /* If the refcount was 0, and turned 1 after the increment, it means the item can
-             * be destroyed here. */
-            cache->cb.destroy_entry(node, cache->cb.context);
-        } else {
-            /* If not, some other thread had references to this object. */
-            ATOMIC_OP(&node->flags, or, FLOATING);
-            /* If in the time between the ref check above and setting the floating flag the
-             * thread holding the reference drops it, if our reference is 0 after dropping it,
-             * the pruner thread was the last thread holding the reference to this entry, so
-             * it's safe to destroy it at this point. */
-            if (!ATOMIC_DEC(node->refs))
-                cache->cb.destroy_entry(node, cache->cb.context);
-        }
+    if (cache->flags & READ_ONLY)
+        return false;
 
-        evicted++;
+    shard = cache_shard(cache, key);
+
+    if (UNLIKELY(pthread_rwlock_wrlock(&shard->lock))) {
+        lwan_status_perror("pthread_rwlock_wrlock");
+        return false;
     }
 
-    /* If local queue has been entirely processed, there's no need to
-     * append items in the cache queue to it; just update statistics and
-     * return */
-    if (list_empty(&queue))
-        goto end;
+    entry = hash_find(shard->table, key);
+    if (entry) {
+        hash_del(shard->table, key);
+        ATOMIC_OP(&entry->flags, or, INVALIDATED);
 
-    /* Prepend local, unprocessed queue, to the cache queue. Since the cache
-     * item TTL is constant, items created later will be destroyed later. */
-    if (LIKELY(!pthread_rwlock_wrlock(&cache->queue.lock))) {
-        list_prepend_list(&cache->queue.list, &queue);
-        pthread_rwlock_unlock(&cache->queue.lock);
-    } else {
-        lwan_status_perror("pthread_rwlock_wrlock");
+        /* Unless it's being evicted already */
+        if (LIKELY(!pthread_rwlock_wrlock(&cache->queue.lock))) {
+            if (entry->flags & QUEUED) {
+                list_del(&entry->entries);
+                list_add_tail(&cache->queue.invalidated, &entry->entries);
+            }
+            pthread_rwlock_unlock(&cache->queue.lock);
+        }
     }
 
-end:
-#ifndef NDEBUG
-    ATOMIC_AAF(&cache->stats.evicted, evicted);
-#endif
-    return evicted;
+    if (UNLIKELY(pthread_rwlock_unlock(&shard->lock)))
+        lwan_status_perror("pthread_rwlock_unlock");
+
+    return entry != NULL;
 }
 
 static void cache_entry_unref_defer(void *data1, void *data2)
@@ -441,19 +1445,23 @@ static void cache_entry_unref_defer(void *data1, void *data2)
     cache_entry_unref((struct cache *)data1, (struct cache_entry *)data2);
 }
 
-struct cache_entry *cache_coro_get_and_ref_entry_with_ctx(struct cache *cache,
-                                                          struct coro *coro,
-                                                          const void *key,
-                                                          void *create_ctx)
+static struct cache_entry *coro_get_and_ref_entry(struct cache *cache,
+                                                  struct coro *coro,
+                                                  struct lwan_request *request,
+                                                  const void *key,
+                                                  void *create_ctx)
 {
     /* If a cache is read-only, cache_get_and_ref_entry() should be
      * used directly. */
     assert(!(cache->flags & READ_ONLY));
 
-    for (int tries = GET_AND_REF_TRIES; tries; tries--) {
+    bool waited = false;
+    uint64_t wait_ms = 1;
+
+    while (true) {
         int error;
         struct cache_entry *ce =
-            cache_get_and_ref_entry_with_ctx(cache, key, create_ctx, &error);
+            get_and_ref_entry(cache, request, key, create_ctx, true, &error);
 
         if (LIKELY(ce)) {
             /*
@@ -465,25 +1473,82 @@ struct cache_entry *cache_coro_get_and_ref_entry_with_ctx(struct cache *cache,
             return ce;
         }
 
-        if (error != EWOULDBLOCK)
+        if (error == EINPROGRESS) {
+            /* Another coroutine is creating this entry: wait for it to
+             * finish, however long it takes, instead of creating it again. */
+            if (!waited) {
+                CACHE_STATS_INC(cache, coalesced);
+                waited = true;
+            }
+
+            /* Creating an entry might take a while if it involves, for
+             * instance, a network filesystem, so sleep rather than keep
+             * this thread busy resuming this coroutine until it's done. */
+            if (request) {
+                lwan_request_sleep(request, wait_ms);
+                wait_ms = LWAN_MIN(wait_ms * 2, (uint64_t)8);
+                continue;
+            }
+        } else if (error != EWOULDBLOCK) {
             break;
+        }
 
-        /* If the cache would block while reading its hash table, yield and
-         * try again.   (This yields "want-write" because otherwise this
-         * worker thread might never be resumed again; it's not always that
-         * a socket can be read from, but you can always write to it.)  */
+        /* If the cache would block while reading its hash table, or if
+         * the entry is being created, yield and try again.  Locks are only
+         * held for short periods of time, but the thread holding one might
+         * have been preempted, so there's no limit on the number of
+         * retries: giving up would fail a request for something that's
+         * about to be available.  (This yields "want-write" because
+         * otherwise this worker thread might never be resumed again; it's
+         * not always that a socket can be read from, but you can always
+         * write to it.)  */
         coro_yield(coro, CONN_CORO_WANT_WRITE);
+        if (request)
+            lwan_request_check_deadline(request);
     }
 
     return NULL;
 }
 
+struct cache_entry *cache_coro_get_and_ref_entry_with_ctx(struct cache *cache,
+                                                          struct coro *coro,
+                                                          const void *key,
+                                                          void *create_ctx)
+{
+    return coro_get_and_ref_entry(cache, coro, NULL, key, create_ctx);
+}
+
 ALWAYS_INLINE struct cache_entry *cache_coro_get_and_ref_entry(
     struct cache *cache, struct coro *coro, const void *key)
 {
     return cache_coro_get_and_ref_entry_with_ctx(cache, coro, key, NULL);
 }
 
+struct cache_entry *
+cache_request_get_and_ref_entry_with_ctx(struct cache *cache,
+                                         struct lwan_request *request,
+                                         const void *key,
+                                         void *create_ctx)
+{
+    return coro_get_and_ref_entry(cache, request->conn->coro, request, key,
+                                  create_ctx);
+}
+
+ALWAYS_INLINE struct cache_entry *cache_request_get_and_ref_entry(
+    struct cache *cache, struct lwan_request *request, const void *key)
+{
+    return cache_request_get_and_ref_entry_with_ctx(cache, request, key, NULL);
+}
+
+void cache_make_async(struct cache *cache)
+{
+    /* Keys must be copied, as the task creating an entry might outlive
+     * the request that needed it. */
+    assert(cache->key.copy != identity_key_copy);
+
+    cache->flags |= CREATE_ASYNC;
+}
+
 void cache_make_read_only(struct cache *cache)
 {
     cache->flags |= READ_ONLY;
@@ -19,6 +19,9 @@
 
 #pragma once
 
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <time.h>
 
 #include "list.h"
@@ -30,6 +33,10 @@ struct cache_entry {
   int refs;
   unsigned flags;
   time_t time_to_expire;
+  /* Set by the create_entry callback if the cache has a budget (see
+   * cache_set_max_cost()); can be in any unit, as long as it's the same
+   * unit used for the budget.  */
+  size_t cost;
 };
 
 typedef struct cache_entry *(*cache_create_entry_cb)(const void *key,
@@ -40,6 +47,7 @@ typedef void (*cache_destroy_entry_cb)(struct cache_entry *entry,
 typedef struct hash *(*hash_create_func_cb)(void (*)(void *), void (*)(void *));
 
 struct cache;
+struct lwan_request;
 
 struct cache *cache_create(cache_create_entry_cb create_entry_cb,
       cache_destroy_entry_cb destroy_entry_cb,
@@ -60,6 +68,58 @@ struct cache_entry *cache_coro_get_and_ref_entry(struct cache *cache,
       struct coro *coro, const void *key);
 struct cache_entry *cache_coro_get_and_ref_entry_with_ctx(struct cache *cache,
       struct coro *coro, const void *key, void *create_ctx);
+struct cache_entry *cache_request_get_and_ref_entry(struct cache *cache,
+      struct lwan_request *request, const void *key);
+struct cache_entry *cache_request_get_and_ref_entry_with_ctx(struct cache *cache,
+      struct lwan_request *request, const void *key, void *create_ctx);
 void cache_entry_unref(struct cache *cache, struct cache_entry *entry);
+bool cache_invalidate(struct cache *cache, const void *key);
 
 void cache_make_read_only(struct cache *cache);
+
+/* Entries are created by a task thread, for lookups that go through
+ * cache_request_get_and_ref_entry() without a create_ctx, while the
+ * request awaits.  Only for caches with string keys. */
+void cache_make_async(struct cache *cache);
+
+/* Keeps an estimate of the most frequently looked up keys, so that they
+ * can be saved with cache_hot_keys_save() when Lwan shuts down, and the
+ * cache prewarmed with them by cache_hot_keys_prewarm() the next time it
+ * starts.  Caches are told apart by their names, so these should be the
+ * same across restarts.  Only for caches with string keys whose entries
+ * can be created without a create_ctx. */
+void cache_track_hot_keys(struct cache *cache);
+bool cache_hot_keys_save(const char *path);
+/* Creates entries for the keys saved in @path, in a task thread, for
+ * caches that exist at this point.  Done in the order they were saved,
+ * the hottest ones first. */
+void cache_hot_keys_prewarm(const char *path);
+
+/* Evicts the oldest entries of every cache until they're down @percent of
+ * their cost (or number of entries, for caches without a budget), e.g.
+ * when memory is running low.  Returns the number of evicted entries. */
+size_t cache_shrink_all(unsigned int percent);
+
+struct cache_stats {
+    const char *name;
+    unsigned int id;
+
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evicted;
+    uint64_t coalesced;
+    uint64_t entries;
+    uint64_t cost;
+    uint64_t max_cost;
+
+    uint64_t pruner_runs;
+    uint64_t pruner_last_duration_us;
+    uint64_t pruner_max_duration_us;
+};
+
+void cache_set_name(struct cache *cache, const char *fmt, ...)
+    __attribute__((format(printf, 2, 3)));
+void cache_set_max_cost(struct cache *cache, size_t max_cost);
+void cache_foreach_stats(void (*cb)(const struct cache_stats *stats,
+                                    void *data),
+                         void *data);
@@ -0,0 +1,202 @@
+/*
+ * lwan - web server
+ * Copyright (c) 2024 L. A. F. Pereira <l@tia.mat.br>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301,
+ * USA.
+ */
+
+/*
+ * The number of online CPUs says little about how much CPU time Lwan can
+ * actually get when running in a container: the cpuset of its cgroup might
+ * only let it run on some of them, and cpu.max (in this cgroup or in any of
+ * its ancestors) might only give it a fraction of their time.  Sizing the
+ * worker pool after the number of online CPUs then just gets the workers
+ * throttled.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "lwan-private.h"
+
+/* Deeper hierarchies are rare; only the innermost levels are checked */
+#define MAX_CGROUP_DEPTH 16
+
+static struct {
+    /* cpu.max of this cgroup and of its ancestors; opened when Lwan starts,
+     * as they might be out of reach after chrooting. */
+    int cpu_max_fds[MAX_CGROUP_DEPTH];
+    size_t n_cpu_max_fds;
+} quota;
+
+/* Opens @name in the cgroup Lwan is in, and then in each of its ancestors,
+ * up to @max_fds of them.  Only the unified (v2) hierarchy is supported.
+ * Returns the number of files that were opened. */
+static size_t
+open_cgroup_files(const char *name, int fds[], size_t max_fds)
+{
+    /* Hybrid setups mount the unified hierarchy elsewhere */
+    static const char *roots[] = {"/sys/fs/cgroup", "/sys/fs/cgroup/unified"};
+    char path[PATH_MAX];
+    size_t line_size = 0;
+    char *line = NULL;
+    size_t n_fds = 0;
+    ssize_t len;
+    FILE *f;
+
+    f = fopen("/proc/self/cgroup", "re");
+    if (!f)
+        return 0;
+
+    while ((len = getline(&line, &line_size, f)) > 0) {
+        if (strncmp(line, "0::", 3))
+            continue;
+
+        if (line[len - 1] == '\n')
+            line[len - 1] = '\0';
+
+        char *cgroup = line + 3;
+        const char *root = NULL;
+
+        for (size_t i = 0; i < N_ELEMENTS(roots); i++) {
+            if (snprintf(path, sizeof(path), "%s%s", roots[i], cgroup) <
+                    (int)sizeof(path) &&
+                !access(path, F_OK)) {
+                root = roots[i];
+                break;
+            }
+        }
+        if (!root)
+            break;
+
+        /* Controllers might not be enabled at every level, so levels
+         * without @name are skipped rather than ending the walk */
+        while (n_fds < max_fds) {
+            if (snprintf(path, sizeof(path), "%s%s/%s", root, cgroup, name) <
+                (int)sizeof(path)) {
+                int fd = open(path, O_RDONLY | O_CLOEXEC);
+
+                if (fd >= 0)
+                    fds[n_fds++] = fd;
+            }
+
+            char *parent = strrchr(cgroup, '/');
+            if (!parent || parent == cgroup)
+                break;
+            *parent = '\0';
+        }
+        break;
+    }
+
+    free(line);
+    fclose(f);
+    return n_fds;
+}
+
+int lwan_cgroup_open_file(const char *name)
+{
+    int fd;
+
+    return open_cgroup_files(name, &fd, 1) ? fd : -1;
+}
+
+/* Returns the number of CPUs worth of time allowed by cpu.max ("$MAX
+ * $PERIOD", where $MAX might be "max"), rounded up, or UINT_MAX if it
+ * doesn't limit anything. */
+static unsigned int read_cpu_max(int fd)
+{
+    char buffer[64];
+    unsigned long long max, period;
+    ssize_t r;
+
+    do {
+        r = pread(fd, buffer, sizeof(buffer) - 1, 0);
+    } while (r < 0 && errno == EINTR);
+    if (r <= 0)
+        return UINT_MAX;
+    buffer[r] = '\0';
+
+    if (sscanf(buffer, "%llu %llu", &max, &period) != 2 || !period)
+        return UINT_MAX;
+
+    return (unsigned int)LWAN_MIN((max + period - 1) / period,
+                                  (unsigned long long)UINT_MAX);
+}
+
+static unsigned int get_usable_cpus(unsigned int online_cpus)
+{
+    unsigned int usable = online_cpus;
+    cpu_set_t set;
+
+    /* The cpuset of the cgroup is reflected in the affinity mask */
+    if (!sched_getaffinity(0, sizeof(set), &set))
+        usable = LWAN_MIN(usable, (unsigned int)CPU_COUNT(&set));
+
+    for (size_t i = 0; i < quota.n_cpu_max_fds; i++)
+        usable = LWAN_MIN(usable, read_cpu_max(quota.cpu_max_fds[i]));
+
+    return LWAN_MAX(usable, 1u);
+}
+
+static bool cpu_quota_job(void *data)
+{
+    struct lwan *l = data;
+    const unsigned int usable = get_usable_cpus(l->online_cpus);
+
+    if (usable == ATOMIC_READ(l->usable_cpus))
+        return false;
+
+    /* Workers can't be added or removed while running, but whatever is
+     * sized after the CPU time available (e.g. the compression level)
+     * follows the new quota */
+    lwan_status_info("CPU quota changed: %u CPUs usable (was %u); "
+                     "%u threads are serving requests",
+                     usable, l->usable_cpus, l->thread.shared_count);
+    __atomic_store_n(&l->usable_cpus, usable, __ATOMIC_RELAXED);
+
+    return true;
+}
+
+void lwan_cpu_quota_init(struct lwan *l)
+{
+    quota.n_cpu_max_fds = open_cgroup_files("cpu.max", quota.cpu_max_fds,
+                                            N_ELEMENTS(quota.cpu_max_fds));
+
+    l->usable_cpus = get_usable_cpus(l->online_cpus);
+    if (l->usable_cpus < l->online_cpus) {
+        lwan_status_debug("%u of %u online CPUs are usable by this cgroup",
+                          l->usable_cpus, l->online_cpus);
+    }
+
+    lwan_job_add_full(cpu_quota_job, l, "cpu_quota", LWAN_JOB_PRIORITY_LOW,
+                      5000, 30000);
+}
+
+void lwan_cpu_quota_shutdown(struct lwan *l)
+{
+    lwan_job_del(cpu_quota_job, l);
+
+    for (size_t i = 0; i < quota.n_cpu_max_fds; i++)
+        close(quota.cpu_max_fds[i]);
+    quota.n_cpu_max_fds = 0;
+}
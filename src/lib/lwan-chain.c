@@ -0,0 +1,119 @@
+/*
+ * lwan - web server
+ * Copyright (c) 2024 L. A. F. Pereira <l@tia.mat.br>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+
+#define _GNU_SOURCE
+#include <assert.h>
+
+#include "lwan-private.h"
+#include "lwan-chain.h"
+
+void lwan_chain_init(struct lwan_chain *chain, struct lwan_strbuf *buffer)
+{
+    *chain = (struct lwan_chain){.buffer = buffer};
+    lwan_chain_segment_array_init(&chain->segments);
+}
+
+void lwan_chain_reset(struct lwan_chain *chain)
+{
+    lwan_chain_segment_array_reset(&chain->segments);
+    chain->buffer_mark = lwan_strbuf_get_length(chain->buffer);
+    chain->borrowed_len = 0;
+}
+
+void lwan_chain_free(struct lwan_chain *chain)
+{
+    lwan_chain_segment_array_reset(&chain->segments);
+}
+
+static bool append_segment(struct lwan_chain *chain,
+                           const char *base,
+                           size_t offset,
+                           size_t len)
+{
+    struct lwan_chain_segment *segment =
+        lwan_chain_segment_array_append(&chain->segments);
+
+    if (UNLIKELY(!segment))
+        return false;
+
+    *segment =
+        (struct lwan_chain_segment){.base = base, .offset = offset, .len = len};
+    return true;
+}
+
+bool lwan_chain_append_borrowed(struct lwan_chain *chain,
+                                const void *data,
+                                size_t len)
+{
+    const size_t buffer_len = lwan_strbuf_get_length(chain->buffer);
+
+    if (!len)
+        return true;
+
+    assert(buffer_len >= chain->buffer_mark);
+    if (buffer_len > chain->buffer_mark) {
+        if (UNLIKELY(!append_segment(chain, NULL, chain->buffer_mark,
+                                     buffer_len - chain->buffer_mark)))
+            return false;
+        chain->buffer_mark = buffer_len;
+    }
+
+    if (UNLIKELY(!append_segment(chain, data, 0, len)))
+        return false;
+
+    chain->borrowed_len += len;
+    return true;
+}
+
+int lwan_chain_fill_iovec(const struct lwan_chain *chain,
+                          size_t *cursor,
+                          struct iovec *iov,
+                          int iov_count)
+{
+    const struct lwan_chain_segment *segments =
+        (const struct lwan_chain_segment *)chain->segments.base.base;
+    const size_t n_segments = chain->segments.base.elements;
+    char *buffer = lwan_strbuf_get_buffer(chain->buffer);
+    int filled = 0;
+
+    for (; *cursor < n_segments && filled < iov_count; (*cursor)++) {
+        const struct lwan_chain_segment *segment = &segments[*cursor];
+
+        iov[filled++] = (struct iovec){
+            .iov_base = (void *)(segment->base ? segment->base
+                                               : buffer + segment->offset),
+            .iov_len = segment->len,
+        };
+    }
+
+    if (*cursor == n_segments && filled < iov_count) {
+        const size_t buffer_len = lwan_strbuf_get_length(chain->buffer);
+
+        if (buffer_len > chain->buffer_mark) {
+            iov[filled++] = (struct iovec){
+                .iov_base = buffer + chain->buffer_mark,
+                .iov_len = buffer_len - chain->buffer_mark,
+            };
+        }
+        (*cursor)++;
+    }
+
+    return filled;
+}
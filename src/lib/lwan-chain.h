@@ -0,0 +1,77 @@
+/*
+ * lwan - web server
+ * Copyright (c) 2024 L. A. F. Pereira <l@tia.mat.br>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/uio.h>
+
+#include "lwan-array.h"
+#include "lwan-strbuf.h"
+
+/* A response body made of borrowed slices of memory interleaved with the
+ * contents of a strbuf.  Borrowed slices aren't copied: they're sent
+ * straight from where they are, so they must stay valid (and unchanged)
+ * until the response has been written.  Anything appended to the strbuf
+ * goes into the body in the same order it was appended relative to the
+ * borrowed slices; the strbuf must not be reset or truncated while the
+ * chain is in use, but it can grow.  */
+
+struct lwan_chain_segment {
+    /* NULL means "at offset in the strbuf" */
+    const char *base;
+    size_t offset;
+    size_t len;
+};
+
+DEFINE_ARRAY_TYPE_INLINEFIRST(lwan_chain_segment_array,
+                              struct lwan_chain_segment)
+
+struct lwan_chain {
+    struct lwan_strbuf *buffer;
+    struct lwan_chain_segment_array segments;
+
+    /* Bytes of the strbuf before this offset are already in a segment */
+    size_t buffer_mark;
+    size_t borrowed_len;
+};
+
+void lwan_chain_init(struct lwan_chain *chain, struct lwan_strbuf *buffer);
+void lwan_chain_reset(struct lwan_chain *chain);
+void lwan_chain_free(struct lwan_chain *chain);
+
+bool lwan_chain_append_borrowed(struct lwan_chain *chain,
+                                const void *data,
+                                size_t len);
+
+/* Fills up to iov_count elements of iov with the contents of the chain,
+ * starting at *cursor (which should be 0 initially), and updates *cursor.
+ * Returns the number of elements filled; 0 once everything has been
+ * returned. */
+int lwan_chain_fill_iovec(const struct lwan_chain *chain,
+                          size_t *cursor,
+                          struct iovec *iov,
+                          int iov_count);
+
+static inline size_t lwan_chain_get_length(const struct lwan_chain *chain)
+{
+    return chain->borrowed_len + lwan_strbuf_get_length(chain->buffer);
+}
@@ -0,0 +1,817 @@
+/*
+ * lwan - web server
+ * Copyright (c) 2024 L. A. F. Pereira <l@tia.mat.br>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301,
+ * USA.
+ */
+
+#define _GNU_SOURCE
+#include <inttypes.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <time.h>
+#include <zlib.h>
+
+#if defined(LWAN_HAVE_BROTLI)
+#include <brotli/encode.h>
+#endif
+
+#if defined(LWAN_HAVE_ZSTD)
+#include <zstd.h>
+#endif
+
+#if defined(LWAN_HAVE_ISAL)
+#include <isa-l/igzip_lib.h>
+#endif
+
+#include "lwan-private.h"
+
+/* Responses smaller than this would go out in a single packet anyway, so
+ * the time it'd take to compress them isn't worth it. */
+#define MIN_COMPRESSED_RESPONSE_SIZE 1024
+
+/* Compression levels are picked depending on how busy the CPUs available
+ * to this process were during the last second: the busier they are, the
+ * faster (and less effective) compression becomes.  */
+enum compression_load {
+    LOAD_LOW,
+    LOAD_MEDIUM,
+    LOAD_HIGH,
+    N_LOADS,
+};
+
+static const char *const encoding_names[] = {
+    [LWAN_ENCODING_DEFLATE] = "deflate",
+    [LWAN_ENCODING_GZIP] = "gzip",
+    [LWAN_ENCODING_BROTLI] = "br",
+    [LWAN_ENCODING_ZSTD] = "zstd",
+};
+
+static const int zlib_levels[N_LOADS] = {6, 3, 1};
+#if defined(LWAN_HAVE_BROTLI)
+static const int brotli_levels[N_LOADS] = {5, 3, 1};
+#endif
+#if defined(LWAN_HAVE_ZSTD)
+static const int zstd_levels[N_LOADS] = {6, 3, 1};
+#endif
+
+static enum compression_load current_load = LOAD_LOW;
+
+static const int *const load_levels[] = {
+    [LWAN_ENCODING_DEFLATE] = zlib_levels,
+    [LWAN_ENCODING_GZIP] = zlib_levels,
+#if defined(LWAN_HAVE_BROTLI)
+    [LWAN_ENCODING_BROTLI] = brotli_levels,
+#endif
+#if defined(LWAN_HAVE_ZSTD)
+    [LWAN_ENCODING_ZSTD] = zstd_levels,
+#endif
+};
+
+struct lwan_response_compressor;
+
+/* Each encoding is implemented by a backend, picked when Lwan is built
+ * (e.g. deflate and gzip use ISA-L rather than zlib if it's available).
+ * Responses compressed as a whole, streams, and files compressed by
+ * serve_files all go through the same backends. */
+struct compressor_backend {
+    const char *name;
+
+    /* @level is as understood by the library behind the backend.
+     * @size_hint is the size of the whole input, or 0 for streams. */
+    bool (*init)(struct lwan_response_compressor *c,
+                 int level,
+                 size_t size_hint);
+    bool (*feed)(struct lwan_response_compressor *c,
+                 const char *in,
+                 size_t len,
+                 bool finish);
+    void (*free)(struct lwan_response_compressor *c);
+};
+
+struct lwan_response_compressor {
+    const struct compressor_backend *backend;
+    enum lwan_encoding encoding;
+    union {
+        z_stream zlib;
+#if defined(LWAN_HAVE_ISAL)
+        struct isal_zstream *isal;
+#endif
+#if defined(LWAN_HAVE_BROTLI)
+        BrotliEncoderState *brotli;
+#endif
+#if defined(LWAN_HAVE_ZSTD)
+        ZSTD_CCtx *zstd;
+#endif
+    };
+    struct lwan_strbuf out;
+};
+
+static uint64_t timeval_to_us(const struct timeval *tv)
+{
+    return (uint64_t)tv->tv_sec * 1000000ull + (uint64_t)tv->tv_usec;
+}
+
+static bool sample_load(void *data)
+{
+    static uint64_t last_cpu_us, last_wall_us;
+    const struct lwan *l = data;
+    struct timespec now;
+    struct rusage usage;
+
+    if (UNLIKELY(getrusage(RUSAGE_SELF, &usage) < 0))
+        return false;
+    if (UNLIKELY(clock_gettime(monotonic_clock_id, &now) < 0))
+        return false;
+
+    const uint64_t cpu_us =
+        timeval_to_us(&usage.ru_utime) + timeval_to_us(&usage.ru_stime);
+    const uint64_t wall_us =
+        (uint64_t)now.tv_sec * 1000000ull + (uint64_t)now.tv_nsec / 1000;
+
+    if (last_wall_us && wall_us > last_wall_us) {
+        const uint64_t available_us =
+            (wall_us - last_wall_us) * LWAN_MAX(ATOMIC_READ(l->usable_cpus), 1u);
+        const uint64_t busy_pct = (cpu_us - last_cpu_us) * 100 / available_us;
+        enum compression_load load;
+
+        if (busy_pct >= 85)
+            load = LOAD_HIGH;
+        else if (busy_pct >= 50)
+            load = LOAD_MEDIUM;
+        else
+            load = LOAD_LOW;
+
+        if (load != ATOMIC_READ(current_load)) {
+            lwan_status_debug("CPU usage at %" PRIu64 "%%, compressing "
+                              "responses at level %d",
+                              busy_pct, zlib_levels[load]);
+            ATOMIC_READ(current_load) = load;
+        }
+    }
+
+    last_cpu_us = cpu_us;
+    last_wall_us = wall_us;
+
+    return false;
+}
+
+static bool has_header(const struct lwan_key_value *headers, const char *key)
+{
+    if (!headers)
+        return false;
+
+    for (; headers->key; headers++) {
+        if (strcaseequal_neutral(headers->key, key))
+            return true;
+    }
+
+    return false;
+}
+
+/* Returns false if the response can't be compressed at all; otherwise,
+ * *encoding is set to the encoding it should be compressed with, which
+ * might still be LWAN_ENCODING_IDENTITY if the client doesn't accept any. */
+static bool pick_encoding(struct lwan_request *request,
+                          const struct lwan_key_value *headers,
+                          enum lwan_encoding *encoding)
+{
+    const char *mime_type = request->response.mime_type;
+
+    if (!(request->flags & RESPONSE_COMPRESS))
+        return false;
+    if (!mime_type || !lwan_is_compressible_mime_type(mime_type))
+        return false;
+    /* Handlers compressing (or sending parts of) their own responses
+     * know better. */
+    if (has_header(headers, "Content-Encoding") ||
+        has_header(headers, "Content-Range"))
+        return false;
+
+    const enum lwan_request_flags accept =
+        lwan_request_get_accept_encoding(request);
+
+#if defined(LWAN_HAVE_ZSTD)
+    if (accept & REQUEST_ACCEPT_ZSTD) {
+        *encoding = LWAN_ENCODING_ZSTD;
+        return true;
+    }
+#endif
+#if defined(LWAN_HAVE_BROTLI)
+    if (accept & REQUEST_ACCEPT_BROTLI) {
+        *encoding = LWAN_ENCODING_BROTLI;
+        return true;
+    }
+#endif
+    if (accept & REQUEST_ACCEPT_DEFLATE)
+        *encoding = LWAN_ENCODING_DEFLATE;
+    else if (accept & REQUEST_ACCEPT_GZIP)
+        *encoding = LWAN_ENCODING_GZIP;
+    else
+        *encoding = LWAN_ENCODING_IDENTITY;
+
+    return true;
+}
+
+/* Appends Content-Encoding (unless @encoding is LWAN_ENCODING_IDENTITY) and
+ * Vary to @headers.  The new array lives as long as the coroutine. */
+static const struct lwan_key_value *
+add_encoding_headers(struct lwan_request *request,
+                     const struct lwan_key_value *headers,
+                     enum lwan_encoding encoding)
+{
+    struct lwan_key_value *new_headers;
+    size_t n_headers = 0;
+
+    const bool add_vary = !has_header(headers, "Vary");
+    if (!add_vary && encoding == LWAN_ENCODING_IDENTITY)
+        return headers;
+
+    if (headers) {
+        while (headers[n_headers].key)
+            n_headers++;
+    }
+
+    new_headers =
+        coro_malloc(request->conn->coro, (n_headers + 3) * sizeof(*headers));
+    if (UNLIKELY(!new_headers))
+        return NULL;
+
+    if (n_headers)
+        memcpy(new_headers, headers, n_headers * sizeof(*headers));
+    if (encoding != LWAN_ENCODING_IDENTITY) {
+        new_headers[n_headers++] = (struct lwan_key_value){
+            .key = "Content-Encoding",
+            .value = (char *)encoding_names[encoding],
+        };
+    }
+    if (add_vary) {
+        new_headers[n_headers++] = (struct lwan_key_value){
+            .key = "Vary",
+            .value = "Accept-Encoding",
+        };
+    }
+    new_headers[n_headers] = (struct lwan_key_value){};
+
+    return new_headers;
+}
+
+/* Reserves @size bytes at the end of the output buffer; once they're
+ * written to, give_back_output() returns the ones that weren't used. */
+static char *reserve_output(struct lwan_response_compressor *c, size_t size)
+{
+    return lwan_strbuf_extend_unsafe(&c->out, size);
+}
+
+static void give_back_output(struct lwan_response_compressor *c, size_t unused)
+{
+    c->out.used -= unused;
+}
+
+static bool zlib_init(struct lwan_response_compressor *c,
+                      int level,
+                      size_t size_hint __attribute__((unused)))
+{
+    c->zlib = (z_stream){};
+
+    /* 16 has to be added to the window bits to get a gzip wrapper rather
+     * than a zlib one. */
+    return deflateInit2(&c->zlib, level, Z_DEFLATED,
+                        c->encoding == LWAN_ENCODING_GZIP ? MAX_WBITS + 16
+                                                          : MAX_WBITS,
+                        8, Z_DEFAULT_STRATEGY) == Z_OK;
+}
+
+static bool zlib_feed(struct lwan_response_compressor *c,
+                      const char *in,
+                      size_t len,
+                      bool finish)
+{
+    z_stream *stream = &c->zlib;
+
+    if (UNLIKELY(len > UINT_MAX))
+        return false;
+
+    stream->next_in = (Bytef *)in;
+    stream->avail_in = (uInt)len;
+    while (true) {
+        const size_t chunk = deflateBound(stream, stream->avail_in) + 16;
+        char *out = reserve_output(c, chunk);
+
+        if (UNLIKELY(!out))
+            return false;
+
+        stream->next_out = (Bytef *)out;
+        stream->avail_out = (uInt)chunk;
+
+        int ret = deflate(stream, finish ? Z_FINISH : Z_SYNC_FLUSH);
+        give_back_output(c, stream->avail_out);
+
+        if (ret == Z_STREAM_END)
+            return true;
+        if (UNLIKELY(ret != Z_OK && ret != Z_BUF_ERROR))
+            return false;
+        if (!finish && stream->avail_out)
+            return true;
+    }
+}
+
+static void zlib_free(struct lwan_response_compressor *c)
+{
+    deflateEnd(&c->zlib);
+}
+
+static const struct compressor_backend zlib_backend = {
+    .name = "zlib",
+    .init = zlib_init,
+    .feed = zlib_feed,
+    .free = zlib_free,
+};
+
+#if defined(LWAN_HAVE_ISAL)
+/* igzip has far fewer levels than zlib: level 1 compresses about as well
+ * as zlib's level 1 in a fraction of the time, and level 3 gets close to
+ * zlib's default level.  The bigger the level, the bigger the buffer it
+ * needs for its hash tables. */
+static const uint32_t isal_level_buf_sizes[] = {
+    [1] = ISAL_DEF_LVL1_DEFAULT,
+    [2] = ISAL_DEF_LVL2_DEFAULT,
+    [3] = ISAL_DEF_LVL3_DEFAULT,
+};
+
+static uint32_t isal_level(int zlib_level)
+{
+    if (zlib_level == Z_DEFAULT_COMPRESSION)
+        zlib_level = 6;
+
+    if (zlib_level <= 2)
+        return 1;
+    if (zlib_level <= 5)
+        return LWAN_MIN(2, ISAL_DEF_MAX_LEVEL);
+    return LWAN_MIN(3, ISAL_DEF_MAX_LEVEL);
+}
+
+static bool isal_init(struct lwan_response_compressor *c,
+                      int level,
+                      size_t size_hint __attribute__((unused)))
+{
+    const uint32_t isal_lvl = isal_level(level);
+    const uint32_t level_buf_size = isal_level_buf_sizes[isal_lvl];
+    struct isal_zstream *stream;
+
+    /* The stream carries its own history buffer, so it's far too large to
+     * live in the compressor (or in a coroutine stack), and it's allocated
+     * together with the level buffer. */
+    stream = malloc(sizeof(*stream) + level_buf_size);
+    if (UNLIKELY(!stream))
+        return false;
+
+    isal_deflate_init(stream);
+    stream->level = isal_lvl;
+    stream->level_buf = (uint8_t *)(stream + 1);
+    stream->level_buf_size = level_buf_size;
+    stream->gzip_flag =
+        c->encoding == LWAN_ENCODING_GZIP ? IGZIP_GZIP : IGZIP_ZLIB;
+
+    c->isal = stream;
+    return true;
+}
+
+static bool isal_feed(struct lwan_response_compressor *c,
+                      const char *in,
+                      size_t len,
+                      bool finish)
+{
+    struct isal_zstream *stream = c->isal;
+
+    if (UNLIKELY(len > UINT32_MAX))
+        return false;
+
+    stream->next_in = (uint8_t *)in;
+    stream->avail_in = (uint32_t)len;
+    stream->end_of_stream = finish;
+    stream->flush = finish ? NO_FLUSH : SYNC_FLUSH;
+    while (true) {
+        const size_t chunk =
+            LWAN_MIN(compressBound(stream->avail_in) + ISAL_DEF_MAX_HDR_SIZE,
+                     (size_t)UINT32_MAX);
+        char *out = reserve_output(c, chunk);
+
+        if (UNLIKELY(!out))
+            return false;
+
+        stream->next_out = (uint8_t *)out;
+        stream->avail_out = (uint32_t)chunk;
+
+        int ret = isal_deflate(stream);
+        give_back_output(c, stream->avail_out);
+
+        if (UNLIKELY(ret != COMP_OK))
+            return false;
+        if (finish) {
+            if (stream->internal_state.state == ZSTATE_END)
+                return true;
+        } else if (!stream->avail_in && stream->avail_out) {
+            return true;
+        }
+    }
+}
+
+static void isal_free(struct lwan_response_compressor *c)
+{
+    free(c->isal);
+}
+
+static const struct compressor_backend isal_backend = {
+    .name = "ISA-L",
+    .init = isal_init,
+    .feed = isal_feed,
+    .free = isal_free,
+};
+#endif
+
+#if defined(LWAN_HAVE_BROTLI)
+static bool brotli_init(struct lwan_response_compressor *c,
+                        int level,
+                        size_t size_hint)
+{
+    uint32_t lgwin;
+
+    c->brotli = BrotliEncoderCreateInstance(NULL, NULL, NULL);
+    if (UNLIKELY(!c->brotli))
+        return false;
+
+    if (size_hint) {
+        /* No point in a window larger than the whole input. */
+        for (lgwin = BROTLI_MIN_WINDOW_BITS;
+             lgwin < BROTLI_DEFAULT_WINDOW && ((size_t)1 << lgwin) < size_hint;
+             lgwin++)
+            ;
+        BrotliEncoderSetParameter(c->brotli, BROTLI_PARAM_SIZE_HINT,
+                                  (uint32_t)LWAN_MIN(size_hint, UINT32_MAX));
+    } else {
+        /* The default window would take a few megabytes per stream. */
+        lgwin = 18;
+    }
+
+    BrotliEncoderSetParameter(c->brotli, BROTLI_PARAM_QUALITY, (uint32_t)level);
+    BrotliEncoderSetParameter(c->brotli, BROTLI_PARAM_MODE, BROTLI_MODE_TEXT);
+    BrotliEncoderSetParameter(c->brotli, BROTLI_PARAM_LGWIN, lgwin);
+
+    return true;
+}
+
+static bool brotli_feed(struct lwan_response_compressor *c,
+                        const char *in,
+                        size_t len,
+                        bool finish)
+{
+    const BrotliEncoderOperation op =
+        finish ? BROTLI_OPERATION_FINISH : BROTLI_OPERATION_FLUSH;
+    const uint8_t *next_in = (const uint8_t *)in;
+    size_t avail_in = len;
+
+    do {
+        const size_t chunk =
+            LWAN_MAX(BrotliEncoderMaxCompressedSize(avail_in), (size_t)4096);
+        uint8_t *next_out = (uint8_t *)reserve_output(c, chunk);
+        size_t avail_out = chunk;
+
+        if (UNLIKELY(!next_out))
+            return false;
+
+        bool ok = BrotliEncoderCompressStream(c->brotli, op, &avail_in,
+                                              &next_in, &avail_out, &next_out,
+                                              NULL);
+        give_back_output(c, avail_out);
+
+        if (UNLIKELY(!ok))
+            return false;
+    } while (avail_in || BrotliEncoderHasMoreOutput(c->brotli) ||
+             (finish && !BrotliEncoderIsFinished(c->brotli)));
+
+    return true;
+}
+
+static void brotli_free(struct lwan_response_compressor *c)
+{
+    BrotliEncoderDestroyInstance(c->brotli);
+}
+
+static const struct compressor_backend brotli_backend = {
+    .name = "brotli",
+    .init = brotli_init,
+    .feed = brotli_feed,
+    .free = brotli_free,
+};
+#endif
+
+#if defined(LWAN_HAVE_ZSTD)
+static bool zstd_init(struct lwan_response_compressor *c,
+                      int level,
+                      size_t size_hint)
+{
+    c->zstd = ZSTD_createCCtx();
+    if (UNLIKELY(!c->zstd))
+        return false;
+
+    ZSTD_CCtx_setParameter(c->zstd, ZSTD_c_compressionLevel, level);
+    /* Also gets the size written to the frame header. */
+    if (size_hint)
+        ZSTD_CCtx_setPledgedSrcSize(c->zstd, size_hint);
+
+    return true;
+}
+
+static bool zstd_feed(struct lwan_response_compressor *c,
+                      const char *in,
+                      size_t len,
+                      bool finish)
+{
+    ZSTD_inBuffer input = {.src = in, .size = len};
+    size_t remaining;
+
+    do {
+        const size_t chunk = ZSTD_compressBound(len - input.pos) + 32;
+        ZSTD_outBuffer output = {.dst = reserve_output(c, chunk),
+                                 .size = chunk};
+
+        if (UNLIKELY(!output.dst))
+            return false;
+
+        remaining = ZSTD_compressStream2(c->zstd, &output, &input,
+                                         finish ? ZSTD_e_end : ZSTD_e_flush);
+        give_back_output(c, chunk - output.pos);
+
+        if (UNLIKELY(ZSTD_isError(remaining)))
+            return false;
+    } while (remaining);
+
+    return true;
+}
+
+static void zstd_free(struct lwan_response_compressor *c)
+{
+    ZSTD_freeCCtx(c->zstd);
+}
+
+static const struct compressor_backend zstd_backend = {
+    .name = "zstd",
+    .init = zstd_init,
+    .feed = zstd_feed,
+    .free = zstd_free,
+};
+#endif
+
+static const struct compressor_backend *const backends[] = {
+#if defined(LWAN_HAVE_ISAL)
+    [LWAN_ENCODING_DEFLATE] = &isal_backend,
+    [LWAN_ENCODING_GZIP] = &isal_backend,
+#else
+    [LWAN_ENCODING_DEFLATE] = &zlib_backend,
+    [LWAN_ENCODING_GZIP] = &zlib_backend,
+#endif
+#if defined(LWAN_HAVE_BROTLI)
+    [LWAN_ENCODING_BROTLI] = &brotli_backend,
+#endif
+#if defined(LWAN_HAVE_ZSTD)
+    [LWAN_ENCODING_ZSTD] = &zstd_backend,
+#endif
+};
+
+static bool compressor_init(struct lwan_response_compressor *c,
+                            enum lwan_encoding encoding,
+                            int level,
+                            size_t size_hint)
+{
+    if (UNLIKELY((size_t)encoding >= N_ELEMENTS(backends) ||
+                 !backends[encoding]))
+        return false;
+
+    c->backend = backends[encoding];
+    c->encoding = encoding;
+    if (UNLIKELY(!c->backend->init(c, level, size_hint)))
+        return false;
+
+    lwan_strbuf_init(&c->out);
+    return true;
+}
+
+static void compressor_free(void *data)
+{
+    struct lwan_response_compressor *c = data;
+
+    c->backend->free(c);
+    lwan_strbuf_free(&c->out);
+}
+
+static struct lwan_response_compressor *
+compressor_new(struct lwan_request *request,
+               enum lwan_encoding encoding,
+               size_t size_hint)
+{
+    const enum compression_load load = ATOMIC_READ(current_load);
+    struct lwan_response_compressor *c;
+
+    c = coro_malloc(request->conn->coro, sizeof(*c));
+    if (UNLIKELY(!c))
+        return NULL;
+
+    if (UNLIKELY(!compressor_init(c, encoding, load_levels[encoding][load],
+                                  size_hint)))
+        return NULL;
+
+    if (UNLIKELY(coro_defer(request->conn->coro, compressor_free, c) < 0)) {
+        compressor_free(c);
+        return NULL;
+    }
+
+    return c;
+}
+
+/* Compresses @len bytes from @in, appending them to c->out.  The output
+ * is flushed, so that everything that has been fed to the compressor so
+ * far can be decompressed from it; if @finish is set, the stream is
+ * also ended.  */
+static inline bool compressor_feed(struct lwan_response_compressor *c,
+                                   const char *in,
+                                   size_t len,
+                                   bool finish)
+{
+    return c->backend->feed(c, in, len, finish);
+}
+
+bool lwan_compress_value(enum lwan_encoding encoding,
+                         int level,
+                         const struct lwan_value *in,
+                         struct lwan_value *out)
+{
+    struct lwan_response_compressor c;
+    bool ret = false;
+
+    *out = (struct lwan_value){};
+
+    if (UNLIKELY(!compressor_init(&c, encoding, level, in->len)))
+        return false;
+
+    if (LIKELY(compressor_feed(&c, in->value, in->len, true))) {
+        const size_t len = lwan_strbuf_get_length(&c.out);
+
+        out->value = malloc(len);
+        if (LIKELY(out->value)) {
+            memcpy(out->value, lwan_strbuf_get_buffer(&c.out), len);
+            out->len = len;
+            ret = true;
+        }
+    }
+
+    compressor_free(&c);
+    return ret;
+}
+
+void lwan_compress_init(struct lwan *l)
+{
+    if (!l->config.compress_responses)
+        return;
+
+    lwan_status_debug("Initializing response compression (deflate and gzip "
+                      "with %s)",
+                      backends[LWAN_ENCODING_DEFLATE]->name);
+
+    lwan_job_add_full(sample_load, l, "compress_load",
+                      LWAN_JOB_PRIORITY_LOW, 1000, 1000);
+}
+
+void lwan_compress_shutdown(struct lwan *l)
+{
+    if (!l->config.compress_responses)
+        return;
+
+    lwan_job_del(sample_load, l);
+}
+
+static ALWAYS_INLINE bool is_compression_worthy(size_t compressed_sz,
+                                                size_t uncompressed_sz)
+{
+    static const size_t encoding_header_size =
+        sizeof("\r\nContent-Encoding: deflate") - 1;
+
+    return compressed_sz + encoding_header_size < uncompressed_sz;
+}
+
+void lwan_response_compress(struct lwan_request *request)
+{
+    struct lwan_response *response = &request->response;
+    const size_t len = lwan_strbuf_get_length(response->buffer);
+    const struct lwan_key_value *headers;
+    struct lwan_response_compressor *c;
+    struct lwan_chain *chain;
+    enum lwan_encoding encoding;
+
+    if (response->chain || len < MIN_COMPRESSED_RESPONSE_SIZE)
+        return;
+    if (!pick_encoding(request, response->headers, &encoding))
+        return;
+
+    if (encoding == LWAN_ENCODING_IDENTITY)
+        goto uncompressed;
+
+    c = compressor_new(request, encoding, len);
+    if (UNLIKELY(!c))
+        goto uncompressed;
+    if (UNLIKELY(!compressor_feed(c, lwan_strbuf_get_buffer(response->buffer),
+                                  len, true)))
+        goto uncompressed;
+    if (!is_compression_worthy(lwan_strbuf_get_length(&c->out), len))
+        goto uncompressed;
+
+    headers = add_encoding_headers(request, response->headers, encoding);
+    if (UNLIKELY(!headers))
+        return;
+    chain = lwan_response_get_chain(request);
+    if (UNLIKELY(!chain))
+        return;
+
+    /* The chain borrows the compressed body; since the strbuf it was
+     * initialized with is empty by now, it's the only thing it'll send. */
+    lwan_strbuf_reset(response->buffer);
+    if (UNLIKELY(!lwan_chain_append_borrowed(
+            chain, lwan_strbuf_get_buffer(&c->out),
+            lwan_strbuf_get_length(&c->out))))
+        coro_yield(request->conn->coro, CONN_CORO_ABORT);
+
+    response->headers = headers;
+    return;
+
+uncompressed:
+    /* Caches still need to know that the response depends on
+     * Accept-Encoding. */
+    headers = add_encoding_headers(request, response->headers,
+                                   LWAN_ENCODING_IDENTITY);
+    if (LIKELY(headers))
+        response->headers = headers;
+}
+
+const struct lwan_key_value *
+lwan_response_compress_stream(struct lwan_request *request,
+                              const struct lwan_key_value *headers)
+{
+    const struct lwan_key_value *new_headers;
+    enum lwan_encoding encoding;
+
+    if (!pick_encoding(request, headers, &encoding))
+        return headers;
+
+    if (encoding != LWAN_ENCODING_IDENTITY) {
+        struct lwan_response_compressor *c =
+            compressor_new(request, encoding, 0);
+
+        if (UNLIKELY(!c))
+            encoding = LWAN_ENCODING_IDENTITY;
+        else
+            request->helper->compressor = c;
+    }
+
+    new_headers = add_encoding_headers(request, headers, encoding);
+    if (UNLIKELY(!new_headers)) {
+        request->helper->compressor = NULL;
+        return headers;
+    }
+
+    return new_headers;
+}
+
+bool lwan_response_compress_chunk(struct lwan_request *request,
+                                  const char *in,
+                                  size_t len,
+                                  struct lwan_value *out)
+{
+    struct lwan_response_compressor *c = request->helper->compressor;
+
+    lwan_strbuf_reset(&c->out);
+
+    /* An empty chunk ends the response, so it also ends the stream. */
+    if (UNLIKELY(!compressor_feed(c, in, len, !len)))
+        return false;
+
+    *out = (struct lwan_value){
+        .value = lwan_strbuf_get_buffer(&c->out),
+        .len = lwan_strbuf_get_length(&c->out),
+    };
+    return true;
+}
@@ -24,6 +24,7 @@
 #include <fcntl.h>
 #include <stdarg.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -872,6 +873,112 @@ static const struct config_line *parser_next(struct parser *parser)
     }
 }
 
+/* Snapshots are configuration files that have been read already, with
+ * constants and environment variables substituted, stored as a sequence
+ * of records that don't need a lexer or a parser to be read back.  They
+ * are tied to the build that wrote them: there's no attempt at being
+ * portable, other than refusing to read files with another magic. */
+#define SNAPSHOT_MAGIC "LWANCFG\x01"
+#define SNAPSHOT_MAGIC_LEN (sizeof(SNAPSHOT_MAGIC) - 1)
+
+struct snapshot_record {
+    uint32_t line;
+    uint32_t key_len;
+    uint32_t value_len;
+    uint32_t type;
+    /* Followed by key_len + 1 bytes of the key, and value_len + 1 bytes
+     * of the value, both NUL-terminated */
+};
+
+static void *parse_snapshot(struct parser *parser)
+{
+    struct lexer *lexer = &parser->lexer;
+    struct config *config = config_from_parser(parser);
+    struct snapshot_record record;
+    struct config_line line;
+    size_t len;
+
+    if (lexer->pos == lexer->end) {
+        if (config->opened_brackets)
+            return PARSER_ERROR(parser, "EOF while looking for a close bracket");
+        return NULL;
+    }
+
+    if (remaining(lexer) < sizeof(record))
+        return PARSER_ERROR(parser, "Truncated snapshot");
+    memcpy(&record, lexer->pos, sizeof(record));
+
+    len = (size_t)record.key_len + (size_t)record.value_len + 2;
+    if (remaining(lexer) - sizeof(record) < len)
+        return PARSER_ERROR(parser, "Truncated snapshot");
+
+    /* Lines are handed out in a buffer that can be modified, as they are
+     * when reading text files. */
+    if (!lwan_strbuf_append_str(&parser->strbuf, lexer->pos + sizeof(record),
+                                len))
+        return INTERNAL_ERROR(parser, "could not copy line from snapshot");
+
+    switch (record.type) {
+    case CONFIG_LINE_TYPE_LINE:
+        break;
+    case CONFIG_LINE_TYPE_SECTION:
+        config->opened_brackets++;
+        break;
+    case CONFIG_LINE_TYPE_SECTION_END:
+        if (!config->opened_brackets)
+            return PARSER_ERROR(parser, "Section closed before it opened");
+        config->opened_brackets--;
+        break;
+    default:
+        return PARSER_ERROR(parser, "Unknown line type in snapshot");
+    }
+
+    line = (struct config_line){
+        .type = (enum config_line_type)record.type,
+        .key = lwan_strbuf_get_buffer(&parser->strbuf),
+    };
+    line.value = line.key + record.key_len + 1;
+    if (record.type == CONFIG_LINE_TYPE_SECTION_END)
+        line.key = line.value = NULL;
+
+    lexer->pos += sizeof(record) + len;
+    lexer->cur_line = (int)record.line;
+
+    if (!config_ring_buffer_try_put(&parser->items, &line))
+        return INTERNAL_ERROR(parser, "could not store line in ring buffer");
+
+    return parse_snapshot;
+}
+
+bool config_write_snapshot(struct config *conf, FILE *out)
+{
+    const struct config_line *line;
+
+    if (fwrite(SNAPSHOT_MAGIC, SNAPSHOT_MAGIC_LEN, 1, out) != 1)
+        return false;
+
+    while ((line = config_read_line(conf))) {
+        const char *key = line->key ? line->key : "";
+        const char *value = line->value ? line->value : "";
+        struct snapshot_record record = {
+            .line = (uint32_t)config_cur_line(conf),
+            .key_len = (uint32_t)strlen(key),
+            .value_len = (uint32_t)strlen(value),
+            .type = (uint32_t)line->type,
+        };
+
+        if (line->type == CONFIG_LINE_TYPE_SECTION_END)
+            key = value = "";
+
+        if (fwrite(&record, sizeof(record), 1, out) != 1 ||
+            fwrite(key, record.key_len + 1, 1, out) != 1 ||
+            fwrite(value, record.value_len + 1, 1, out) != 1)
+            return false;
+    }
+
+    return !config_last_error(conf);
+}
+
 static struct config *
 config_open_path(const char *path, void **data, size_t *size)
 {
@@ -942,7 +1049,18 @@ struct config *config_open(const char *path)
     size_t len;
 
     config = config_open_path(path, &data, &len);
-    return config ? config_init_data(config, data, len) : NULL;
+    if (!config)
+        return NULL;
+
+    if (len >= SNAPSHOT_MAGIC_LEN &&
+        !memcmp(data, SNAPSHOT_MAGIC, SNAPSHOT_MAGIC_LEN)) {
+        config_init_data(config, (char *)data + SNAPSHOT_MAGIC_LEN,
+                         len - SNAPSHOT_MAGIC_LEN);
+        config->parser.state = parse_snapshot;
+        return config;
+    }
+
+    return config_init_data(config, data, len);
 }
 
 #if defined(FUZZING_BUILD_MODE_UNSAFE_FOR_PRODUCTION)
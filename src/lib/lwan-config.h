@@ -63,6 +63,10 @@ struct config *config_isolate_section(struct config *current_conf,
                                       const struct config_line *current_line);
 bool config_skip_section(struct config *conf, const struct config_line *line);
 
+/* Writes what's left to be read from @conf as a snapshot, which can be
+ * opened with config_open() much faster than the file it came from. */
+bool config_write_snapshot(struct config *conf, FILE *out);
+
 bool parse_bool(const char *value, bool default_value);
 long parse_long(const char *value, long default_value);
 long long parse_long_long(const char *value, long long default_value);
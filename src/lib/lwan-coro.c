@@ -62,7 +62,16 @@ void __asan_unpoison_memory_region(void const volatile *addr, size_t size);
 
 #define CORO_STACK_SIZE ((MIN_CORO_STACK_SIZE + (size_t)PAGE_SIZE) & ~((size_t)PAGE_SIZE))
 
-#define CORO_BUMP_PTR_ALLOC_SIZE 1024
+/* coro_malloc() carves allocations up to CORO_ARENA_MAX_ALLOC bytes from
+ * a list of chunks owned by the coroutine.  The first chunk takes a page,
+ * with each following chunk doubling in size up to CORO_ARENA_MAX_CHUNK;
+ * allocations larger than that get a chunk of their own.  Chunks are kept
+ * when the coroutine is reset, or when the arena is rewound between
+ * requests, so a reused coroutine doesn't have to go through malloc() at
+ * all for these allocations; coro_malloc_trim() lets go of those that
+ * aren't needed anymore. */
+#define CORO_ARENA_MAX_ALLOC ((size_t)262144)
+#define CORO_ARENA_MAX_CHUNK ((size_t)65536)
 
 #if (!defined(NDEBUG) && defined(MAP_STACK)) || defined(__OpenBSD__)
 /* As an exploit mitigation, OpenBSD requires any stacks to be allocated via
@@ -102,9 +111,24 @@ struct coro_defer {
 
 DEFINE_ARRAY_TYPE_INLINEFIRST(coro_defer_array, struct coro_defer)
 
+struct coro_arena_chunk {
+    struct coro_arena_chunk *next;
+
+    /* State of the arena right before this chunk became the current one,
+     * restored by the deferred callback armed at that time. */
+    struct coro_arena_chunk *restore_chunk;
+    size_t restore_remaining;
+    size_t restore_in_use;
+
+    size_t size;
+    unsigned char data[] __attribute__((aligned(sizeof(void *))));
+};
+
 struct coro {
     struct coro_switcher *switcher;
     coro_context context;
+    /* Only used while the coroutine is in a coro_pool. */
+    struct coro *next_free;
     struct coro_defer_array defer;
 
     int64_t yield_value;
@@ -114,8 +138,20 @@ struct coro {
          * enabled during configuration time.  See coro_malloc_bump_ptr() for details. */
         void *ptr;
         size_t remaining;
+
+        struct coro_arena_chunk *first;
+        struct coro_arena_chunk *last;
+        struct coro_arena_chunk *current;
+        unsigned int n_chunks;
+
+        /* Bytes handed out by coro_malloc_bump_ptr(), and the most handed
+         * out since the last call to coro_malloc_take_high_water().  */
+        size_t in_use;
+        size_t high_water;
     } bump_ptr_alloc;
 
+    struct coro_usage usage;
+
 #if defined(INSTRUMENT_FOR_VALGRIND)
     unsigned int vg_stack_id;
 #endif
@@ -270,9 +306,15 @@ void coro_reset(struct coro *coro, coro_function_t func, void *data)
 {
     unsigned char *stack = coro->stack;
 
+    /* Running all deferred callbacks rewinds the arena to its start, so
+     * there's nothing to free here: the chunks are all reused.  */
     coro_deferred_run(coro, 0);
     coro_defer_array_reset(&coro->defer);
+    assert(!coro->bump_ptr_alloc.current);
     coro->bump_ptr_alloc.remaining = 0;
+    coro->bump_ptr_alloc.in_use = 0;
+    coro->bump_ptr_alloc.high_water = 0;
+    coro->usage = (struct coro_usage){};
 
 #if defined(__x86_64__)
     /* coro_entry_point() for x86-64 has 3 arguments, but RDX isn't
@@ -320,18 +362,26 @@ coro_new(struct coro_switcher *switcher, coro_function_t function, void *data)
     struct coro *coro;
 
 #if defined(ALLOCATE_STACK_WITH_MMAP)
-    void *stack = mmap(NULL, CORO_STACK_SIZE, PROT_READ | PROT_WRITE,
-                       MAP_STACK | MAP_ANON | MAP_PRIVATE, -1, 0);
+    /* The lowest page is a guard page, so that stack overflows crash
+     * right away instead of corrupting whatever is mapped below.  */
+    unsigned char *stack = mmap(NULL, CORO_STACK_SIZE + PAGE_SIZE,
+                                PROT_READ | PROT_WRITE,
+                                MAP_STACK | MAP_ANON | MAP_PRIVATE, -1, 0);
     if (UNLIKELY(stack == MAP_FAILED))
         return NULL;
 
+    if (UNLIKELY(mprotect(stack, PAGE_SIZE, PROT_NONE) < 0)) {
+        munmap(stack, CORO_STACK_SIZE + PAGE_SIZE);
+        return NULL;
+    }
+
     coro = lwan_aligned_alloc(sizeof(*coro), 64);
     if (UNLIKELY(!coro)) {
-        munmap(stack, CORO_STACK_SIZE);
+        munmap(stack, CORO_STACK_SIZE + PAGE_SIZE);
         return NULL;
     }
 
-    coro->stack = stack;
+    coro->stack = stack + PAGE_SIZE;
 #else
     coro = lwan_aligned_alloc(sizeof(struct coro) + CORO_STACK_SIZE, 64);
 
@@ -340,6 +390,10 @@ coro_new(struct coro_switcher *switcher, coro_function_t function, void *data)
 #endif
 
     coro_defer_array_init(&coro->defer);
+    coro->bump_ptr_alloc.first = NULL;
+    coro->bump_ptr_alloc.last = NULL;
+    coro->bump_ptr_alloc.current = NULL;
+    coro->bump_ptr_alloc.n_chunks = 0;
 
     coro->switcher = switcher;
     coro_reset(coro, function, data);
@@ -380,30 +434,145 @@ inline int64_t coro_yield(struct coro *coro, int64_t value)
     assert(coro);
 
     coro->yield_value = value;
+    coro->usage.yields++;
     coro_swapcontext(&coro->context, &coro->switcher->caller);
 
     return coro->yield_value;
 }
 
+const struct coro_usage *coro_get_usage(const struct coro *coro)
+{
+    return &coro->usage;
+}
+
+void coro_account_resumed(struct coro *coro, uint64_t cycles)
+{
+    coro->usage.resumed_at = cycles;
+}
+
+void coro_account_yielded(struct coro *coro, uint64_t cycles)
+{
+    coro->usage.cycles += cycles - coro->usage.resumed_at;
+}
+
+/* Whether the caller is running on the stack of this coroutine, rather
+ * than on the stack of a coroutine resumed from it.  Only in the former
+ * case can it yield with this coroutine.  */
+bool coro_is_running_on_stack(const struct coro *coro)
+{
+    const unsigned char *frame = __builtin_frame_address(0);
+
+    return frame >= coro->stack && frame < coro->stack + CORO_STACK_SIZE;
+}
+
+static void free_arena_chunks(struct coro *coro,
+                              struct coro_arena_chunk *chunk)
+{
+    while (chunk) {
+        struct coro_arena_chunk *next = chunk->next;
+
+#if defined(INSTRUMENT_FOR_VALGRIND)
+        VALGRIND_MAKE_MEM_UNDEFINED(chunk->data, chunk->size);
+#endif
+#if defined(INSTRUMENT_FOR_ASAN)
+        __asan_unpoison_memory_region(chunk->data, chunk->size);
+#endif
+
+        free(chunk);
+        coro->bump_ptr_alloc.n_chunks--;
+        chunk = next;
+    }
+}
+
 void coro_free(struct coro *coro)
 {
     assert(coro);
 
     coro_deferred_run(coro, 0);
     coro_defer_array_reset(&coro->defer);
+    free_arena_chunks(coro, coro->bump_ptr_alloc.first);
 
 #if defined(INSTRUMENT_FOR_VALGRIND)
     VALGRIND_STACK_DEREGISTER(coro->vg_stack_id);
 #endif
 
 #if defined(ALLOCATE_STACK_WITH_MMAP)
-    int result = munmap(coro->stack, CORO_STACK_SIZE);
+    int result = munmap(coro->stack - PAGE_SIZE, CORO_STACK_SIZE + PAGE_SIZE);
     assert(result == 0);  /* only fails if addr, len are invalid */
 #endif
 
     free(coro);
 }
 
+void coro_pool_init(struct coro_pool *pool, unsigned int max_free)
+{
+    *pool = (struct coro_pool){.max_free = max_free};
+}
+
+void coro_pool_shutdown(struct coro_pool *pool)
+{
+    while (pool->free_list) {
+        struct coro *coro = pool->free_list;
+
+        pool->free_list = coro->next_free;
+        coro_free(coro);
+    }
+
+    pool->n_free = 0;
+}
+
+struct coro *coro_pool_new(struct coro_pool *pool,
+                           struct coro_switcher *switcher,
+                           coro_function_t function,
+                           void *data)
+{
+    struct coro *coro = pool->free_list;
+
+    if (!coro)
+        return coro_new(switcher, function, data);
+
+    pool->free_list = coro->next_free;
+    pool->n_free--;
+
+#if defined(INSTRUMENT_FOR_ASAN)
+    /* A coroutine that was freed while suspended leaves the redzones of
+     * the frames that were live in its stack poisoned. */
+    __asan_unpoison_memory_region(coro->stack, CORO_STACK_SIZE);
+#endif
+
+    coro->switcher = switcher;
+    coro_reset(coro, function, data);
+
+    return coro;
+}
+
+void coro_pool_free(struct coro_pool *pool, struct coro *coro)
+{
+    assert(coro);
+
+    if (pool->n_free >= pool->max_free) {
+        coro_free(coro);
+        return;
+    }
+
+    /* Run deferred callbacks now, rather than when the coroutine is
+     * reused, as they might be holding resources. */
+    coro_deferred_run(coro, 0);
+    coro_defer_array_reset(&coro->defer);
+
+    /* Don't let a request that needed a lot of memory make an idle
+     * coroutine hold on to it; the first chunk is enough for most.  */
+    if (coro->bump_ptr_alloc.first) {
+        free_arena_chunks(coro, coro->bump_ptr_alloc.first->next);
+        coro->bump_ptr_alloc.first->next = NULL;
+        coro->bump_ptr_alloc.last = coro->bump_ptr_alloc.first;
+    }
+
+    coro->next_free = pool->free_list;
+    pool->free_list = coro;
+    pool->n_free++;
+}
+
 static void disarmed_defer(void *data __attribute__((unused)))
 {
 }
@@ -492,8 +661,11 @@ void *coro_malloc_full(struct coro *coro,
                        void (*destroy_func)(void *data))
 {
     void *ptr = malloc(size);
-    if (LIKELY(ptr))
+    if (LIKELY(ptr)) {
         coro_defer(coro, destroy_func, ptr);
+        coro->usage.heap_allocs++;
+        coro->usage.heap_bytes += size;
+    }
 
     return ptr;
 }
@@ -524,6 +696,13 @@ static inline void *coro_malloc_bump_ptr(struct coro *coro, size_t aligned_size)
     coro->bump_ptr_alloc.remaining -= aligned_size;
     coro->bump_ptr_alloc.ptr = (char *)ptr + aligned_size;
 
+    coro->bump_ptr_alloc.in_use += aligned_size;
+    if (coro->bump_ptr_alloc.in_use > coro->bump_ptr_alloc.high_water)
+        coro->bump_ptr_alloc.high_water = coro->bump_ptr_alloc.in_use;
+
+    coro->usage.arena_allocs++;
+    coro->usage.arena_bytes += aligned_size;
+
     /* This instrumentation is desirable to find buffer overflows, but it's not
      * cheap. Enable it only in debug builds (for Valgrind) or when using
      * address sanitizer (always the case when fuzz-testing on OSS-Fuzz). See:
@@ -552,34 +731,95 @@ static inline void *coro_malloc_bump_ptr(struct coro *coro, size_t aligned_size)
     coro_malloc_bump_ptr(coro_, aligned_size_)
 #endif
 
-static void free_bump_ptr(void *arg1, void *arg2)
+static void restore_arena(void *arg1, void *arg2)
 {
     struct coro *coro = arg1;
+    struct coro_arena_chunk *chunk = arg2;
+    struct coro_arena_chunk *current = chunk->restore_chunk;
+
+    /* Every chunk after the current one is considered free, so this
+     * releases everything allocated since @chunk was picked in O(1).  */
+    coro->bump_ptr_alloc.current = current;
+    coro->bump_ptr_alloc.remaining = chunk->restore_remaining;
+    coro->bump_ptr_alloc.ptr =
+        current ? current->data + current->size - chunk->restore_remaining
+                : NULL;
+    coro->bump_ptr_alloc.in_use = chunk->restore_in_use;
+}
+
+static struct coro_arena_chunk *new_arena_chunk(struct coro *coro,
+                                                size_t aligned_size)
+{
+    size_t size = (size_t)PAGE_SIZE << LWAN_MIN(coro->bump_ptr_alloc.n_chunks, 4u);
+    struct coro_arena_chunk *chunk;
+
+    size = LWAN_MIN(size, CORO_ARENA_MAX_CHUNK) - sizeof(*chunk);
+    if (UNLIKELY(size < aligned_size))
+        size = aligned_size;
+
+    chunk = malloc(sizeof(*chunk) + size);
+    if (UNLIKELY(!chunk))
+        return NULL;
+
+    chunk->next = NULL;
+    chunk->size = size;
 
-#if defined(INSTRUMENT_FOR_VALGRIND)
-    VALGRIND_MAKE_MEM_UNDEFINED(arg2, CORO_BUMP_PTR_ALLOC_SIZE);
-#endif
 #if defined(INSTRUMENT_FOR_ASAN)
-    __asan_unpoison_memory_region(arg2, CORO_BUMP_PTR_ALLOC_SIZE);
+    __asan_poison_memory_region(chunk->data, size);
+#endif
+#if defined(INSTRUMENT_FOR_VALGRIND)
+    VALGRIND_MAKE_MEM_NOACCESS(chunk->data, size);
 #endif
 
-    /* Instead of checking if bump_ptr_alloc.ptr is part of the allocation
-     * with base in arg2, just zero out the arena for this coroutine to
-     * prevent coro_malloc() from carving up this and any other
-     * (potentially) freed arenas.  */
-    coro->bump_ptr_alloc.remaining = 0;
+    if (coro->bump_ptr_alloc.last)
+        coro->bump_ptr_alloc.last->next = chunk;
+    else
+        coro->bump_ptr_alloc.first = chunk;
+    coro->bump_ptr_alloc.last = chunk;
+    coro->bump_ptr_alloc.n_chunks++;
+
+    return chunk;
+}
+
+static bool next_arena_chunk(struct coro *coro, size_t aligned_size)
+{
+    struct coro_arena_chunk *current = coro->bump_ptr_alloc.current;
+    struct coro_arena_chunk *chunk =
+        current ? current->next : coro->bump_ptr_alloc.first;
+
+    /* Chunks that are too small for this allocation are skipped; they'll
+     * be used again once the arena is rewound past them.  */
+    while (chunk && chunk->size < aligned_size)
+        chunk = chunk->next;
+
+    if (!chunk) {
+        chunk = new_arena_chunk(coro, aligned_size);
+        if (UNLIKELY(!chunk))
+            return false;
+    }
+
+    if (UNLIKELY(coro_defer2(coro, restore_arena, coro, chunk) < 0))
+        return false;
+
+    chunk->restore_chunk = current;
+    chunk->restore_remaining = coro->bump_ptr_alloc.remaining;
+    chunk->restore_in_use = coro->bump_ptr_alloc.in_use;
+
+    coro->bump_ptr_alloc.current = chunk;
+    coro->bump_ptr_alloc.ptr = chunk->data;
+    coro->bump_ptr_alloc.remaining = chunk->size;
 
-    return free(arg2);
+    return true;
 }
 
 void *coro_malloc(struct coro *coro, size_t size)
 {
-    /* The bump pointer allocator can't be in the generic coro_malloc_full()
-     * since destroy_funcs are supposed to free the memory. In this function, we
-     * guarantee that the destroy_func is free(), so that if an allocation goes
-     * through the bump pointer allocator, there's nothing that needs to be done
-     * to free the memory (other than freeing the whole bump pointer arena with
-     * the defer call below).  */
+    /* The arena can't be in the generic coro_malloc_full() since
+     * destroy_funcs are supposed to free the memory. In this function, we
+     * guarantee that the destroy_func is free(), so that if an allocation
+     * goes through the arena, there's nothing that needs to be done to
+     * free the memory (other than rewinding the arena with the defer armed
+     * by next_arena_chunk()).  */
 
     const size_t aligned_size =
         (size + sizeof(void *) - 1ul) & ~(sizeof(void *) - 1ul);
@@ -587,32 +827,50 @@ void *coro_malloc(struct coro *coro, size_t size)
     if (LIKELY(coro->bump_ptr_alloc.remaining >= aligned_size))
         return CORO_MALLOC_BUMP_PTR(coro, aligned_size, size);
 
-    /* This will allocate as many "bump pointer arenas" as necessary; the
-     * old ones will be freed automatically as each allocations coro_defers
-     * the free() call.   Just don't bother allocating an arena larger than
-     * CORO_BUMP_PTR_ALLOC.  */
-    if (LIKELY(aligned_size <= CORO_BUMP_PTR_ALLOC_SIZE)) {
-        coro->bump_ptr_alloc.ptr = malloc(CORO_BUMP_PTR_ALLOC_SIZE);
-        if (UNLIKELY(!coro->bump_ptr_alloc.ptr))
+    if (LIKELY(aligned_size <= CORO_ARENA_MAX_ALLOC)) {
+        if (UNLIKELY(!next_arena_chunk(coro, aligned_size)))
             return NULL;
 
-        coro->bump_ptr_alloc.remaining = CORO_BUMP_PTR_ALLOC_SIZE;
+        return CORO_MALLOC_BUMP_PTR(coro, aligned_size, size);
+    }
 
-#if defined(INSTRUMENT_FOR_ASAN)
-        __asan_poison_memory_region(coro->bump_ptr_alloc.ptr,
-                                    CORO_BUMP_PTR_ALLOC_SIZE);
-#endif
-#if defined(INSTRUMENT_FOR_VALGRIND)
-        VALGRIND_MAKE_MEM_NOACCESS(coro->bump_ptr_alloc.ptr,
-                                   CORO_BUMP_PTR_ALLOC_SIZE);
-#endif
+    return coro_malloc_full(coro, size, free);
+}
+
+size_t coro_malloc_take_high_water(struct coro *coro)
+{
+    size_t high_water = coro->bump_ptr_alloc.high_water;
 
-        coro_defer2(coro, free_bump_ptr, coro, coro->bump_ptr_alloc.ptr);
+    coro->bump_ptr_alloc.high_water = coro->bump_ptr_alloc.in_use;
 
-        return CORO_MALLOC_BUMP_PTR(coro, aligned_size, size);
+    return high_water;
+}
+
+void coro_malloc_trim(struct coro *coro, size_t keep)
+{
+    struct coro_arena_chunk *last = coro->bump_ptr_alloc.current;
+    size_t retained = 0;
+
+    /* Chunks up to the current one are being used; the first one is
+     * always kept, as in coro_pool_free() */
+    if (!last)
+        last = coro->bump_ptr_alloc.first;
+    if (!last)
+        return;
+
+    for (struct coro_arena_chunk *chunk = coro->bump_ptr_alloc.first;
+         chunk != last; chunk = chunk->next)
+        retained += chunk->size;
+    retained += last->size;
+
+    while (last->next && retained < keep) {
+        last = last->next;
+        retained += last->size;
     }
 
-    return coro_malloc_full(coro, size, free);
+    free_arena_chunks(coro, last->next);
+    last->next = NULL;
+    coro->bump_ptr_alloc.last = last;
 }
 
 char *coro_strndup(struct coro *coro, const char *str, size_t max_len)
@@ -634,18 +892,31 @@ char *coro_strdup(struct coro *coro, const char *str)
 char *coro_printf(struct coro *coro, const char *fmt, ...)
 {
     va_list values;
+    char buffer[128];
+    char *str;
     int len;
-    char *tmp_str;
 
+    /* Most strings fit in the buffer, and are copied to the arena from
+     * there; others are formatted again once there's room for them. */
     va_start(values, fmt);
-    len = vasprintf(&tmp_str, fmt, values);
+    len = vsnprintf(buffer, sizeof(buffer), fmt, values);
     va_end(values);
 
     if (UNLIKELY(len < 0))
         return NULL;
 
-    coro_defer(coro, free, tmp_str);
-    return tmp_str;
+    if ((size_t)len < sizeof(buffer))
+        return coro_memdup(coro, buffer, (size_t)len + 1);
+
+    str = coro_malloc(coro, (size_t)len + 1);
+    if (UNLIKELY(!str))
+        return NULL;
+
+    va_start(values, fmt);
+    vsnprintf(str, (size_t)len + 1, fmt, values);
+    va_end(values);
+
+    return str;
 }
 
 void *coro_memdup(struct coro *coro, const void *src, size_t len)
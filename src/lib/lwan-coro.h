@@ -20,6 +20,7 @@
 
 #pragma once
 
+#include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
 
@@ -37,6 +38,19 @@ typedef libucontext_ucontext_t coro_context;
 struct coro;
 typedef ssize_t coro_deferred;
 
+/* What a coroutine has used since it was created or reset.  Allocations
+ * and yields are always counted; cycles only if whoever resumes the
+ * coroutine calls coro_account_resumed() and coro_account_yielded(). */
+struct coro_usage {
+    uint64_t cycles;
+    uint64_t yields;
+    uint64_t arena_allocs, arena_bytes; /* From the coroutine arena */
+    uint64_t heap_allocs, heap_bytes;   /* Through malloc() */
+
+    /* Cycle count when the coroutine was last resumed */
+    uint64_t resumed_at;
+};
+
 typedef int (*coro_function_t)(struct coro *coro, void *data);
 
 struct coro_switcher {
@@ -47,12 +61,35 @@ struct coro *
 coro_new(struct coro_switcher *switcher, coro_function_t function, void *data);
 void coro_free(struct coro *coro);
 
+/* Keeps up to `max_free` freed coroutines (and their stacks) around, so
+ * that they can be reused without going through the allocator.  A pool
+ * must only be used by a single thread. */
+struct coro_pool {
+    struct coro *free_list;
+    unsigned int n_free;
+    unsigned int max_free;
+};
+
+void coro_pool_init(struct coro_pool *pool, unsigned int max_free);
+void coro_pool_shutdown(struct coro_pool *pool);
+struct coro *coro_pool_new(struct coro_pool *pool,
+                           struct coro_switcher *switcher,
+                           coro_function_t function,
+                           void *data);
+void coro_pool_free(struct coro_pool *pool, struct coro *coro);
+
 void coro_reset(struct coro *coro, coro_function_t func, void *data);
 
 int64_t coro_resume(struct coro *coro);
 int64_t coro_resume_value(struct coro *coro, int64_t value);
 int64_t coro_yield(struct coro *coro, int64_t value);
 
+bool coro_is_running_on_stack(const struct coro *coro);
+
+const struct coro_usage *coro_get_usage(const struct coro *coro);
+void coro_account_resumed(struct coro *coro, uint64_t cycles);
+void coro_account_yielded(struct coro *coro, uint64_t cycles);
+
 coro_deferred coro_defer(struct coro *coro, void (*func)(void *data), void *data);
 coro_deferred coro_defer2(struct coro *coro,
                           void (*func)(void *data1, void *data2),
@@ -69,6 +106,12 @@ void *coro_malloc_full(struct coro *coro,
                        size_t size,
                        void (*destroy_func)(void *data))
     __attribute__((malloc));
+/* Returns the most bytes coro_malloc() had handed out from the coroutine
+ * arena at once since the previous call (or since the coroutine started.) */
+size_t coro_malloc_take_high_water(struct coro *coro);
+/* Frees the arena chunks that aren't being used, once the ones kept add up
+ * to at least @keep bytes. */
+void coro_malloc_trim(struct coro *coro, size_t keep);
 char *coro_strdup(struct coro *coro, const char *str);
 char *coro_strndup(struct coro *coro, const char *str, size_t len);
 char *coro_printf(struct coro *coro, const char *fmt, ...)
@@ -1,10 +1,4 @@
 /*
- * This code has been automatically generated by gentables.py from
- * the table provided in RFC7541.  Do not modify!
- *
- * This is being included here so we can fuzz-test the decoder in
- * oss-fuzz before we go forward with the HTTP/2 implementation.
- *
  * lwan - web server
  * Copyright (c) 2022 L. A. F. Pereira <l@tia.mat.br>
  *
@@ -24,8 +18,6 @@
  * USA.
  */
 
-#if defined(FUZZING_BUILD_MODE_UNSAFE_FOR_PRODUCTION)
-
 #include <assert.h>
 #include <endian.h>
 #include <stdbool.h>
@@ -34,10 +26,341 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include "lwan-private.h"
 #include "ringbuffer.h"
 
-#define LIKELY(x) x
-#define UNLIKELY(x) x
+/* The code for each symbol (RFC7541, Appendix B), right-aligned; 256 is
+ * EOS.  Printed by gentables.py. */
+static const struct h2_huffman_symbol_code {
+    uint32_t code;
+    uint8_t num_bits;
+} symbol_codes[257] = {
+    {0x1ff8, 13}, {0x7fffd8, 23}, {0xfffffe2, 28}, {0xfffffe3, 28},
+    {0xfffffe4, 28}, {0xfffffe5, 28}, {0xfffffe6, 28}, {0xfffffe7, 28},
+    {0xfffffe8, 28}, {0xffffea, 24}, {0x3ffffffc, 30}, {0xfffffe9, 28},
+    {0xfffffea, 28}, {0x3ffffffd, 30}, {0xfffffeb, 28}, {0xfffffec, 28},
+    {0xfffffed, 28}, {0xfffffee, 28}, {0xfffffef, 28}, {0xffffff0, 28},
+    {0xffffff1, 28}, {0xffffff2, 28}, {0x3ffffffe, 30}, {0xffffff3, 28},
+    {0xffffff4, 28}, {0xffffff5, 28}, {0xffffff6, 28}, {0xffffff7, 28},
+    {0xffffff8, 28}, {0xffffff9, 28}, {0xffffffa, 28}, {0xffffffb, 28},
+    {0x14, 6}, {0x3f8, 10}, {0x3f9, 10}, {0xffa, 12}, {0x1ff9, 13}, {0x15, 6},
+    {0xf8, 8}, {0x7fa, 11}, {0x3fa, 10}, {0x3fb, 10}, {0xf9, 8}, {0x7fb, 11},
+    {0xfa, 8}, {0x16, 6}, {0x17, 6}, {0x18, 6}, {0x0, 5}, {0x1, 5}, {0x2, 5},
+    {0x19, 6}, {0x1a, 6}, {0x1b, 6}, {0x1c, 6}, {0x1d, 6}, {0x1e, 6}, {0x1f, 6},
+    {0x5c, 7}, {0xfb, 8}, {0x7ffc, 15}, {0x20, 6}, {0xffb, 12}, {0x3fc, 10},
+    {0x1ffa, 13}, {0x21, 6}, {0x5d, 7}, {0x5e, 7}, {0x5f, 7}, {0x60, 7},
+    {0x61, 7}, {0x62, 7}, {0x63, 7}, {0x64, 7}, {0x65, 7}, {0x66, 7}, {0x67, 7},
+    {0x68, 7}, {0x69, 7}, {0x6a, 7}, {0x6b, 7}, {0x6c, 7}, {0x6d, 7}, {0x6e, 7},
+    {0x6f, 7}, {0x70, 7}, {0x71, 7}, {0x72, 7}, {0xfc, 8}, {0x73, 7}, {0xfd, 8},
+    {0x1ffb, 13}, {0x7fff0, 19}, {0x1ffc, 13}, {0x3ffc, 14}, {0x22, 6},
+    {0x7ffd, 15}, {0x3, 5}, {0x23, 6}, {0x4, 5}, {0x24, 6}, {0x5, 5}, {0x25, 6},
+    {0x26, 6}, {0x27, 6}, {0x6, 5}, {0x74, 7}, {0x75, 7}, {0x28, 6}, {0x29, 6},
+    {0x2a, 6}, {0x7, 5}, {0x2b, 6}, {0x76, 7}, {0x2c, 6}, {0x8, 5}, {0x9, 5},
+    {0x2d, 6}, {0x77, 7}, {0x78, 7}, {0x79, 7}, {0x7a, 7}, {0x7b, 7},
+    {0x7ffe, 15}, {0x7fc, 11}, {0x3ffd, 14}, {0x1ffd, 13}, {0xffffffc, 28},
+    {0xfffe6, 20}, {0x3fffd2, 22}, {0xfffe7, 20}, {0xfffe8, 20}, {0x3fffd3, 22},
+    {0x3fffd4, 22}, {0x3fffd5, 22}, {0x7fffd9, 23}, {0x3fffd6, 22},
+    {0x7fffda, 23}, {0x7fffdb, 23}, {0x7fffdc, 23}, {0x7fffdd, 23},
+    {0x7fffde, 23}, {0xffffeb, 24}, {0x7fffdf, 23}, {0xffffec, 24},
+    {0xffffed, 24}, {0x3fffd7, 22}, {0x7fffe0, 23}, {0xffffee, 24},
+    {0x7fffe1, 23}, {0x7fffe2, 23}, {0x7fffe3, 23}, {0x7fffe4, 23},
+    {0x1fffdc, 21}, {0x3fffd8, 22}, {0x7fffe5, 23}, {0x3fffd9, 22},
+    {0x7fffe6, 23}, {0x7fffe7, 23}, {0xffffef, 24}, {0x3fffda, 22},
+    {0x1fffdd, 21}, {0xfffe9, 20}, {0x3fffdb, 22}, {0x3fffdc, 22},
+    {0x7fffe8, 23}, {0x7fffe9, 23}, {0x1fffde, 21}, {0x7fffea, 23},
+    {0x3fffdd, 22}, {0x3fffde, 22}, {0xfffff0, 24}, {0x1fffdf, 21},
+    {0x3fffdf, 22}, {0x7fffeb, 23}, {0x7fffec, 23}, {0x1fffe0, 21},
+    {0x1fffe1, 21}, {0x3fffe0, 22}, {0x1fffe2, 21}, {0x7fffed, 23},
+    {0x3fffe1, 22}, {0x7fffee, 23}, {0x7fffef, 23}, {0xfffea, 20},
+    {0x3fffe2, 22}, {0x3fffe3, 22}, {0x3fffe4, 22}, {0x7ffff0, 23},
+    {0x3fffe5, 22}, {0x3fffe6, 22}, {0x7ffff1, 23}, {0x3ffffe0, 26},
+    {0x3ffffe1, 26}, {0xfffeb, 20}, {0x7fff1, 19}, {0x3fffe7, 22},
+    {0x7ffff2, 23}, {0x3fffe8, 22}, {0x1ffffec, 25}, {0x3ffffe2, 26},
+    {0x3ffffe3, 26}, {0x3ffffe4, 26}, {0x7ffffde, 27}, {0x7ffffdf, 27},
+    {0x3ffffe5, 26}, {0xfffff1, 24}, {0x1ffffed, 25}, {0x7fff2, 19},
+    {0x1fffe3, 21}, {0x3ffffe6, 26}, {0x7ffffe0, 27}, {0x7ffffe1, 27},
+    {0x3ffffe7, 26}, {0x7ffffe2, 27}, {0xfffff2, 24}, {0x1fffe4, 21},
+    {0x1fffe5, 21}, {0x3ffffe8, 26}, {0x3ffffe9, 26}, {0xffffffd, 28},
+    {0x7ffffe3, 27}, {0x7ffffe4, 27}, {0x7ffffe5, 27}, {0xfffec, 20},
+    {0xfffff3, 24}, {0xfffed, 20}, {0x1fffe6, 21}, {0x3fffe9, 22},
+    {0x1fffe7, 21}, {0x1fffe8, 21}, {0x7ffff3, 23}, {0x3fffea, 22},
+    {0x3fffeb, 22}, {0x1ffffee, 25}, {0x1ffffef, 25}, {0xfffff4, 24},
+    {0xfffff5, 24}, {0x3ffffea, 26}, {0x7ffff4, 23}, {0x3ffffeb, 26},
+    {0x7ffffe6, 27}, {0x3ffffec, 26}, {0x3ffffed, 26}, {0x7ffffe7, 27},
+    {0x7ffffe8, 27}, {0x7ffffe9, 27}, {0x7ffffea, 27}, {0x7ffffeb, 27},
+    {0xffffffe, 28}, {0x7ffffec, 27}, {0x7ffffed, 27}, {0x7ffffee, 27},
+    {0x7ffffef, 27}, {0x7fffff0, 27}, {0x3ffffee, 26}, {0x3fffffff, 30},
+};
+
+/*
+ * Codes are canonical: sorted by length, codes of the same length are
+ * consecutive, and sorted by symbol.  Any code can then be decoded by
+ * finding out how long it is, comparing the next bits to the first code of
+ * each length, and indexing a list of symbols sorted by code.
+ */
+static struct {
+    /* Indexed by code length; left-aligned in 32 bits.  Limits are 64-bit
+     * wide, as the one for the last length doesn't fit in 32. */
+    uint64_t limit[31];
+    uint32_t first_code[31];
+    uint16_t first_index[31];
+    uint16_t symbols[257];
+} canonical;
+
+/*
+ * Most symbols in header values have short codes (5 to 8 bits long for
+ * letters, digits, and common punctuation), so the next FAST_BITS bits of
+ * input index a table with all symbols -- up to two of them -- whose codes
+ * fit there.  Longer codes go through the canonical decoder instead.
+ */
+#define FAST_BITS 12
+
+struct h2_huffman_pair {
+    uint8_t symbol[2];
+    /* 0 if there's no symbol */
+    uint8_t num_bits[2];
+};
+
+static struct h2_huffman_pair fast_table[1 << FAST_BITS];
+
+/* Returns the symbol whose code @bits (left-aligned) starts with, or -1 if
+ * it's longer than @max_bits. */
+static int decode_canonical(uint32_t bits, int max_bits, int *num_bits)
+{
+    for (int len = 5; len <= max_bits; len++) {
+        if (bits < canonical.limit[len]) {
+            const uint32_t offset =
+                (bits - canonical.first_code[len]) >> (32 - len);
+
+            *num_bits = len;
+            return canonical.symbols[canonical.first_index[len] + offset];
+        }
+    }
+
+    return -1;
+}
+
+__attribute__((constructor)) static void build_huffman_tables(void)
+{
+    uint16_t count[31] = {};
+    uint32_t code = 0;
+    uint16_t index = 0;
+
+    for (int symbol = 0; symbol < 257; symbol++)
+        count[symbol_codes[symbol].num_bits]++;
+
+    for (int len = 1; len <= 30; len++) {
+        canonical.first_code[len] = code << (32 - len);
+        canonical.first_index[len] = index;
+        canonical.limit[len] = (uint64_t)(code + count[len]) << (32 - len);
+
+        code = (code + count[len]) << 1;
+        index = (uint16_t)(index + count[len]);
+        count[len] = 0;
+    }
+
+    for (int symbol = 0; symbol < 257; symbol++) {
+        const int len = symbol_codes[symbol].num_bits;
+
+        canonical.symbols[canonical.first_index[len] + count[len]++] =
+            (uint16_t)symbol;
+    }
+
+    for (uint32_t i = 0; i < N_ELEMENTS(fast_table); i++) {
+        struct h2_huffman_pair *pair = &fast_table[i];
+        uint32_t bits = i << (32 - FAST_BITS);
+        int left = FAST_BITS;
+
+        *pair = (struct h2_huffman_pair){};
+
+        for (int n = 0; n < 2; n++) {
+            int len;
+            int symbol = decode_canonical(bits, left, &len);
+
+            /* EOS is 30 bits long, so it's never in this table */
+            if (symbol < 0)
+                break;
+
+            pair->symbol[n] = (uint8_t)symbol;
+            pair->num_bits[n] = (uint8_t)len;
+            bits <<= len;
+            left -= len;
+        }
+    }
+}
+
+struct huffman_bits {
+    const uint8_t *bitptr;
+    const uint8_t *bitend;
+    /* Left-aligned; bits past bitcount are zero */
+    uint64_t bitbuf;
+    int bitcount;
+};
+
+static ALWAYS_INLINE void refill_bits(struct huffman_bits *reader)
+{
+    if (reader->bitend - reader->bitptr >= 8) {
+        uint64_t v;
+
+        memcpy(&v, reader->bitptr, 8);
+        reader->bitbuf |= be64toh(v) >> reader->bitcount;
+        reader->bitptr += (63 - reader->bitcount) >> 3;
+        reader->bitcount |= 56;
+    } else {
+        /* Close to the end of the input: refill one byte at a time, so
+         * that nothing past it is read. */
+        while (reader->bitcount <= 56 && reader->bitptr < reader->bitend) {
+            reader->bitbuf |= (uint64_t)*reader->bitptr++
+                              << (56 - reader->bitcount);
+            reader->bitcount += 8;
+        }
+    }
+}
+
+static ALWAYS_INLINE void consume_bits(struct huffman_bits *reader, int count)
+{
+    reader->bitbuf <<= count;
+    reader->bitcount -= count;
+}
+
+ssize_t lwan_h2_huffman_decode(const uint8_t *input,
+                               size_t input_len,
+                               char *output,
+                               size_t output_len)
+{
+    struct huffman_bits reader = {
+        .bitptr = input,
+        .bitend = input + input_len,
+    };
+    const char *output_end = output + output_len;
+    char *out = output;
+
+    while (true) {
+        /* Enough for the longest code, or a couple of lookups */
+        if (reader.bitcount < 32) {
+            refill_bits(&reader);
+            if (reader.bitcount < FAST_BITS)
+                break;
+        }
+
+        const struct h2_huffman_pair *pair =
+            &fast_table[reader.bitbuf >> (64 - FAST_BITS)];
+
+        if (LIKELY(pair->num_bits[0])) {
+            if (UNLIKELY(output_end - out < 2)) {
+                /* Might only have room for one of them */
+                if (out == output_end)
+                    return -1;
+                *out++ = (char)pair->symbol[0];
+                consume_bits(&reader, pair->num_bits[0]);
+                continue;
+            }
+
+            /* Writing the second symbol even if there's none is cheaper
+             * than checking; it's overwritten by the next one */
+            out[0] = (char)pair->symbol[0];
+            out[1] = (char)pair->symbol[1];
+            out += 1 + !!pair->num_bits[1];
+            consume_bits(&reader, pair->num_bits[0] + pair->num_bits[1]);
+        } else {
+            int len;
+            const int symbol = decode_canonical(
+                (uint32_t)(reader.bitbuf >> 32), reader.bitcount, &len);
+
+            /* EOS can't appear in a string literal (RFC7541 §5.2) */
+            if (UNLIKELY(symbol < 0 || symbol == 256))
+                return -1;
+            if (UNLIKELY(out == output_end))
+                return -1;
+
+            *out++ = (char)symbol;
+            consume_bits(&reader, len);
+        }
+    }
+
+    /* Less than FAST_BITS bits left: codes shorter than that, and then
+     * padding, which has to be shorter than a byte and a prefix of EOS (all
+     * ones). */
+    while (reader.bitcount) {
+        const struct h2_huffman_pair *pair =
+            &fast_table[reader.bitbuf >> (64 - FAST_BITS)];
+
+        if (!pair->num_bits[0] || pair->num_bits[0] > reader.bitcount)
+            break;
+        if (UNLIKELY(out == output_end))
+            return -1;
+
+        *out++ = (char)pair->symbol[0];
+        consume_bits(&reader, pair->num_bits[0]);
+    }
+
+    if (reader.bitcount) {
+        const uint64_t padding = reader.bitbuf >> (64 - reader.bitcount);
+
+        if (reader.bitcount > 7 || padding != (1u << reader.bitcount) - 1)
+            return -1;
+    }
+
+    return out - output;
+}
+
+size_t lwan_h2_huffman_encoded_len(const char *input, size_t input_len)
+{
+    size_t num_bits = 0;
+
+    for (size_t i = 0; i < input_len; i++)
+        num_bits += symbol_codes[(uint8_t)input[i]].num_bits;
+
+    return (num_bits + 7) / 8;
+}
+
+static inline void write32be(void *ptr, uint32_t v)
+{
+    v = htobe32(v);
+    memcpy(ptr, &v, 4);
+}
+
+size_t lwan_h2_huffman_encode(const char *input, size_t input_len, uint8_t *output)
+{
+    uint8_t *out = output;
+    uint64_t bitbuf = 0;
+    int bitcount = 0;
+
+    /* Codes are at most 30 bits long, so bitbuf never holds more than 61
+     * pending bits; they're written out 32 at a time */
+    for (size_t i = 0; i < input_len; i++) {
+        const struct h2_huffman_symbol_code *sc =
+            &symbol_codes[(uint8_t)input[i]];
+
+        bitbuf = bitbuf << sc->num_bits | sc->code;
+        bitcount += sc->num_bits;
+
+        if (bitcount >= 32) {
+            bitcount -= 32;
+            write32be(out, (uint32_t)(bitbuf >> bitcount));
+            out += 4;
+        }
+    }
+
+    /* Pads with the most significant bits of EOS (all ones) */
+    if (bitcount & 7) {
+        const int padding = 8 - (bitcount & 7);
+
+        bitbuf = bitbuf << padding | ((1u << padding) - 1);
+        bitcount += padding;
+    }
+    while (bitcount) {
+        bitcount -= 8;
+        *out++ = (uint8_t)(bitbuf >> bitcount);
+    }
+
+    return (size_t)(out - output);
+}
+
+#if defined(FUZZING_BUILD_MODE_UNSAFE_FOR_PRODUCTION)
+/* The previous decoder, which follows the code tree up to a byte at a time
+ * with tables generated by gentables.py.  Only kept for the fuzzer to
+ * cross-check both. */
 
 static inline uint64_t read64be(const void *ptr)
 {
@@ -270,6 +593,7 @@ static inline const struct h2_huffman_code *next_level2(uint8_t peeked_byte)
 
 struct bit_reader {
     const uint8_t *bitptr;
+    const uint8_t *bitend;
     uint64_t bitbuf;
     int64_t total_bitcount;
     int bitcount;
@@ -278,24 +602,21 @@ struct bit_reader {
 static inline uint8_t peek_byte(struct bit_reader *reader)
 {
     if (reader->bitcount < 8) {
-        if (reader->total_bitcount >= 64) {
+        if (reader->bitend - reader->bitptr >= 8) {
             reader->bitbuf |= read64be(reader->bitptr) >> reader->bitcount;
-            reader->bitptr +=
-                (63 - reader->bitcount + (reader->bitcount & 1)) >> 3;
+            reader->bitptr += (63 - reader->bitcount) >> 3;
             reader->bitcount |= 56;
-        } else if (reader->total_bitcount >= 32) {
-            reader->bitbuf |= read32be(reader->bitptr) >> reader->bitcount;
-            reader->bitptr +=
-                (31 - reader->bitcount + (reader->bitcount & 1)) >> 3;
-            reader->bitcount |= 24;
         } else {
-            reader->bitbuf |= *reader->bitptr >> reader->bitcount;
-            reader->bitptr +=
-                (7 - reader->bitcount + (reader->bitcount & 1)) >> 3;
-            reader->bitcount |= 8;
+            /* Close to the end of the input: refill one byte at a time, so
+             * that nothing past it is read. */
+            while (reader->bitcount <= 56 && reader->bitptr < reader->bitend) {
+                reader->bitbuf |= (uint64_t)*reader->bitptr++
+                                  << (56 - reader->bitcount);
+                reader->bitcount += 8;
+            }
         }
     }
-    return reader->bitbuf >> 56;
+    return (uint8_t)(reader->bitbuf >> 56);
 }
 
 static inline bool consume(struct bit_reader *reader, int count)
@@ -304,7 +625,7 @@ static inline bool consume(struct bit_reader *reader, int count)
     reader->bitbuf <<= count;
     reader->bitcount -= count;
     reader->total_bitcount -= count;
-    return reader->total_bitcount > 0;
+    return reader->total_bitcount >= 0;
 }
 
 DEFINE_RING_BUFFER_TYPE(uint8_ring_buffer, uint8_t, 64)
@@ -314,28 +635,32 @@ struct lwan_h2_huffman_decoder {
     struct uint8_ring_buffer buffer;
 };
 
-void lwan_h2_huffman_init(struct lwan_h2_huffman_decoder *huff,
-                          const uint8_t *input,
-                          size_t input_len)
+static void lwan_h2_huffman_init(struct lwan_h2_huffman_decoder *huff,
+                                 const uint8_t *input,
+                                 size_t input_len)
 {
     huff->bit_reader = (struct bit_reader){
         .bitptr = input,
+        .bitend = input + input_len,
         .total_bitcount = (int64_t)input_len * 8,
     };
     uint8_ring_buffer_init(&huff->buffer);
 }
 
-ssize_t lwan_h2_huffman_next(struct lwan_h2_huffman_decoder *huff)
+static ssize_t lwan_h2_huffman_next(struct lwan_h2_huffman_decoder *huff)
 {
     struct bit_reader *reader = &huff->bit_reader;
     struct uint8_ring_buffer *buffer = &huff->buffer;
 
     while (reader->total_bitcount > 7) {
+        /* Checked before anything is consumed, so that decoding can resume
+         * from a code boundary in the next call. */
+        if (uint8_ring_buffer_full(buffer))
+            goto done;
+
         uint8_t peeked_byte = peek_byte(reader);
         if (LIKELY(level0[peeked_byte].num_bits)) {
-            if (!uint8_ring_buffer_try_put_copy(buffer,
-                                                level0[peeked_byte].symbol))
-                goto done;
+            uint8_ring_buffer_put_copy(buffer, level0[peeked_byte].symbol);
             consume(reader, level0[peeked_byte].num_bits);
             assert(reader->total_bitcount >= 0);
             continue;
@@ -347,9 +672,7 @@ ssize_t lwan_h2_huffman_next(struct lwan_h2_huffman_decoder *huff)
         const struct h2_huffman_code *level1 = next_level0(peeked_byte);
         peeked_byte = peek_byte(reader);
         if (level1[peeked_byte].num_bits) {
-            if (!uint8_ring_buffer_try_put_copy(buffer,
-                                                level1[peeked_byte].symbol))
-                goto done;
+            uint8_ring_buffer_put_copy(buffer, level1[peeked_byte].symbol);
             if (!consume(reader, level1[peeked_byte].num_bits))
                 return -1;
             continue;
@@ -361,9 +684,7 @@ ssize_t lwan_h2_huffman_next(struct lwan_h2_huffman_decoder *huff)
         const struct h2_huffman_code *level2 = next_level1(peeked_byte);
         peeked_byte = peek_byte(reader);
         if (level2[peeked_byte].num_bits) {
-            if (!uint8_ring_buffer_try_put_copy(buffer,
-                                                level2[peeked_byte].symbol))
-                goto done;
+            uint8_ring_buffer_put_copy(buffer, level2[peeked_byte].symbol);
             if (!consume(reader, level2[peeked_byte].num_bits))
                 return -1;
             continue;
@@ -376,13 +697,11 @@ ssize_t lwan_h2_huffman_next(struct lwan_h2_huffman_decoder *huff)
         if (LIKELY(level3)) {
             peeked_byte = peek_byte(reader);
             if (level3[peeked_byte].num_bits < 0) {
-                /* EOS found */
-                goto done;
+                /* EOS can't appear in a string literal (RFC7541 §5.2) */
+                return -1;
             }
             if (LIKELY(level3[peeked_byte].num_bits)) {
-                if (!uint8_ring_buffer_try_put_copy(buffer,
-                                                    level3[peeked_byte].symbol))
-                    goto done;
+                uint8_ring_buffer_put_copy(buffer, level3[peeked_byte].symbol);
                 if (!consume(reader, level3[peeked_byte].num_bits))
                     return -1;
                 continue;
@@ -392,8 +711,9 @@ ssize_t lwan_h2_huffman_next(struct lwan_h2_huffman_decoder *huff)
         return -1;
     }
 
-    /* FIXME: ensure we're not promoting types unnecessarily here */
-    if (reader->total_bitcount) {
+    while (reader->total_bitcount) {
+        /* Less than a byte left: either codes shorter than that, or
+         * padding, which has to be a prefix of EOS (all ones). */
         const uint8_t peeked_byte = peek_byte(reader);
         const uint8_t eos_prefix =
             (uint8_t)(((1u << reader->total_bitcount) - 1u)
@@ -402,26 +722,27 @@ ssize_t lwan_h2_huffman_next(struct lwan_h2_huffman_decoder *huff)
         if ((peeked_byte & eos_prefix) == eos_prefix)
             goto done;
 
-        if (level0[peeked_byte].num_bits == (int8_t)reader->total_bitcount) {
-            uint8_ring_buffer_try_put_copy(buffer, level0[peeked_byte].symbol);
-            goto done;
-        }
+        if (!level0[peeked_byte].num_bits ||
+            level0[peeked_byte].num_bits > reader->total_bitcount)
+            return -1;
 
-        /* If we get here, then the remaining bits are either:
-         *  - Not a prefix of EOS
-         *  - Incomplete sequence
-         *  - Has overlong padding
-         */
-        return -1;
+        if (uint8_ring_buffer_full(buffer))
+            goto done;
+        uint8_ring_buffer_put_copy(buffer, level0[peeked_byte].symbol);
+        consume(reader, level0[peeked_byte].num_bits);
     }
 
 done:
     return (ssize_t)uint8_ring_buffer_size(buffer);
 }
 
-bool lwan_h2_huffman_decode_for_fuzzing(const uint8_t *input, size_t input_len)
+static ssize_t bitwise_huffman_decode(const uint8_t *input,
+                                      size_t input_len,
+                                      char *output,
+                                      size_t output_len)
 {
     struct lwan_h2_huffman_decoder decoder;
+    size_t total_decoded = 0;
 
     lwan_h2_huffman_init(&decoder, input, input_len);
 
@@ -429,11 +750,61 @@ bool lwan_h2_huffman_decode_for_fuzzing(const uint8_t *input, size_t input_len)
         ssize_t n_decoded = lwan_h2_huffman_next(&decoder);
 
         if (UNLIKELY(n_decoded < 0))
-            return false;
+            return -1;
+        if (UNLIKELY((size_t)n_decoded > output_len - total_decoded))
+            return -1;
+
+        for (ssize_t i = 0; i < n_decoded; i++)
+            output[total_decoded++] = (char)uint8_ring_buffer_get(&decoder.buffer);
+
         if (n_decoded < 64)
-            return true;
+            return (ssize_t)total_decoded;
 
         uint8_ring_buffer_init(&decoder.buffer);
     }
 }
+
+bool lwan_h2_huffman_decode_for_fuzzing(const uint8_t *input, size_t input_len)
+{
+    const size_t max_len = input_len * 8 / 5 + 1;
+    char *expected = malloc(max_len);
+    char *decoded = malloc(max_len);
+    uint8_t *encoded = NULL;
+    ssize_t expected_len, decoded_len;
+    bool ok = false;
+
+    if (!expected || !decoded)
+        goto out;
+
+    expected_len = bitwise_huffman_decode(input, input_len, expected, max_len);
+    decoded_len = lwan_h2_huffman_decode(input, input_len, decoded, max_len);
+    if (expected_len != decoded_len)
+        __builtin_trap();
+    if (decoded_len < 0)
+        goto out;
+    if (memcmp(expected, decoded, (size_t)decoded_len))
+        __builtin_trap();
+
+    /* Padding is shorter than a byte and all ones, so valid input is
+     * exactly what the encoder would have produced for what it decodes to */
+    size_t encoded_len =
+        lwan_h2_huffman_encoded_len(decoded, (size_t)decoded_len);
+    if (encoded_len != input_len)
+        __builtin_trap();
+    encoded = malloc(encoded_len + 1);
+    if (!encoded)
+        goto out;
+    if (lwan_h2_huffman_encode(decoded, (size_t)decoded_len, encoded) !=
+            encoded_len ||
+        memcmp(encoded, input, input_len))
+        __builtin_trap();
+
+    ok = true;
+
+out:
+    free(encoded);
+    free(expected);
+    free(decoded);
+    return ok;
+}
 #endif
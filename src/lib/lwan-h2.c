@@ -0,0 +1,2236 @@
+/*
+ * lwan - web server
+ * Copyright (c) 2024 L. A. F. Pereira <l@tia.mat.br>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301,
+ * USA.
+ */
+
+/* HTTP/2 (RFC9113), with HPACK (RFC7541) header compression.
+ *
+ * A HTTP/2 connection is served by the same coroutine that would serve a
+ * HTTP/1.1 connection.  Frames are read until a stream has been fully
+ * received; the stream is then converted to a HTTP/1.1 request, which goes
+ * through lwan_process_request() like any other request, and whatever the
+ * handler writes is converted back to HEADERS and DATA frames.  This way,
+ * handlers and modules don't have to know anything about HTTP/2.
+ *
+ * Streams are served one at a time, in the order they're completed by the
+ * client, each with its own generation of coroutine defers (like pipelined
+ * HTTP/1.1 requests); frames that arrive while a handler is blocked on
+ * flow control are still processed, so other streams can be received in
+ * the mean time. */
+
+#define _GNU_SOURCE
+#include <assert.h>
+#include <endian.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "list.h"
+#include "lwan-private.h"
+#include "lwan-io-wrappers.h"
+
+#define FRAME_HEADER_SIZE 9
+
+/* We never change the maximum frame size or the HPACK table size from
+ * their defaults, so these are also the values the client expects. */
+#define MAX_FRAME_SIZE 16384u
+#define HPACK_TABLE_SIZE 4096u
+#define MAX_CONCURRENT_STREAMS 100
+#define RECV_WINDOW_SIZE (1 << 20)
+
+#define DEFAULT_WINDOW_SIZE 65535
+#define MAX_WINDOW_SIZE 0x7fffffff
+
+#define MAX_HEADER_BLOCK_SIZE (1 << 16)
+#define MAX_RESPONSE_HEAD_SIZE (1 << 16)
+#define INPUT_BUFFER_SIZE (2 * (FRAME_HEADER_SIZE + MAX_FRAME_SIZE))
+#define FILE_BUFFER_SIZE MAX_FRAME_SIZE
+
+/* DATA payloads at least this large are sent straight from the buffers
+ * given by the handler, rather than being copied to the output buffer,
+ * which is flushed whenever it grows past OUTPUT_FLUSH_SIZE. */
+#define ZERO_COPY_THRESHOLD 4096
+#define OUTPUT_FLUSH_SIZE 16384
+
+/* Each entry takes at least 32 bytes of the table size (RFC7541 §4.1). */
+#define HPACK_ENTRY_OVERHEAD 32
+#define HPACK_MAX_ENTRIES (HPACK_TABLE_SIZE / HPACK_ENTRY_OVERHEAD)
+
+enum h2_frame_type {
+    FRAME_DATA = 0x0,
+    FRAME_HEADERS = 0x1,
+    FRAME_PRIORITY = 0x2,
+    FRAME_RST_STREAM = 0x3,
+    FRAME_SETTINGS = 0x4,
+    FRAME_PUSH_PROMISE = 0x5,
+    FRAME_PING = 0x6,
+    FRAME_GOAWAY = 0x7,
+    FRAME_WINDOW_UPDATE = 0x8,
+    FRAME_CONTINUATION = 0x9,
+};
+
+enum h2_frame_flags {
+    FLAG_END_STREAM = 0x1,
+    FLAG_ACK = 0x1,
+    FLAG_END_HEADERS = 0x4,
+    FLAG_PADDED = 0x8,
+    FLAG_PRIORITY = 0x20,
+};
+
+enum h2_settings {
+    SETTINGS_HEADER_TABLE_SIZE = 0x1,
+    SETTINGS_ENABLE_PUSH = 0x2,
+    SETTINGS_MAX_CONCURRENT_STREAMS = 0x3,
+    SETTINGS_INITIAL_WINDOW_SIZE = 0x4,
+    SETTINGS_MAX_FRAME_SIZE = 0x5,
+    SETTINGS_MAX_HEADER_LIST_SIZE = 0x6,
+};
+
+enum h2_error {
+    H2_NO_ERROR = 0x0,
+    H2_PROTOCOL_ERROR = 0x1,
+    H2_INTERNAL_ERROR = 0x2,
+    H2_FLOW_CONTROL_ERROR = 0x3,
+    H2_STREAM_CLOSED = 0x5,
+    H2_FRAME_SIZE_ERROR = 0x6,
+    H2_REFUSED_STREAM = 0x7,
+    H2_COMPRESSION_ERROR = 0x9,
+    H2_ENHANCE_YOUR_CALM = 0xb,
+};
+
+struct hpack_string {
+    const char *value;
+    size_t len;
+};
+
+struct hpack_entry {
+    char *name; /* Name and value share the same allocation */
+    char *value;
+    size_t name_len, value_len;
+};
+
+struct hpack_table {
+    struct hpack_entry entries[HPACK_MAX_ENTRIES];
+    unsigned int newest;
+    unsigned int n_entries;
+    size_t size, max_size;
+};
+
+enum stream_output_state {
+    OUTPUT_HEAD,
+    OUTPUT_LENGTH,
+    OUTPUT_UNTIL_END,
+    OUTPUT_CHUNK_SIZE,
+    OUTPUT_CHUNK_DATA,
+    OUTPUT_CHUNK_CRLF,
+    OUTPUT_DONE,
+};
+
+struct lwan_h2_stream {
+    struct list_node stream_list;
+    struct h2_connection *h2;
+
+    uint32_t id;
+    int64_t send_window;
+    size_t recv_unacked;
+
+    struct lwan_strbuf head; /* Request converted to HTTP/1.1 */
+    struct lwan_strbuf body;
+    size_t body_len;
+    size_t max_body_len;
+
+    enum stream_output_state output_state;
+    size_t output_remaining;
+
+    bool ready;       /* Request can be given to a handler */
+    bool end_stream;  /* Client won't send anything else */
+    bool reset;       /* Stream has been reset by either side */
+    bool is_head;
+    bool needs_content_length;
+};
+
+struct h2_connection {
+    struct lwan_connection *conn;
+    struct lwan *lwan;
+    int fd;
+    enum lwan_request_flags request_flags;
+
+    struct list_head streams; /* In the order they were opened */
+    unsigned int n_streams;
+    uint32_t last_stream_id;
+    struct lwan_h2_stream *current; /* Stream being served */
+
+    /* HEADERS/CONTINUATION sequence being received */
+    struct lwan_strbuf header_block;
+    uint32_t header_block_stream_id;
+    bool header_block_end_stream;
+    bool expecting_continuation;
+
+    bool received_settings;
+    bool goaway;
+
+    struct hpack_table decoder_table;
+    struct hpack_table encoder_table;
+    size_t pending_encoder_table_size;
+    bool encoder_table_size_changed;
+
+    /* Scratch space for HPACK strings and the requests being converted */
+    struct lwan_strbuf name_buffer, value_buffer;
+    struct lwan_strbuf path, authority, headers, cookies;
+
+    struct lwan_strbuf response_head;
+    struct lwan_strbuf encoded_headers;
+    struct lwan_strbuf response_buffer;
+
+    int64_t send_window;
+    int64_t peer_initial_window;
+    size_t peer_max_frame_size;
+    size_t recv_unacked;
+
+    char *request_buffer;
+    size_t request_buffer_size;
+    char *file_buffer;
+
+    struct lwan_strbuf output;
+
+    size_t input_offset, input_len;
+    uint8_t input[INPUT_BUFFER_SIZE];
+};
+
+static const char client_preface[] = "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n";
+
+static const struct {
+    const char *name;
+    const char *value;
+} static_table[] = {
+    {":authority", ""},
+    {":method", "GET"},
+    {":method", "POST"},
+    {":path", "/"},
+    {":path", "/index.html"},
+    {":scheme", "http"},
+    {":scheme", "https"},
+    {":status", "200"},
+    {":status", "204"},
+    {":status", "206"},
+    {":status", "304"},
+    {":status", "400"},
+    {":status", "404"},
+    {":status", "500"},
+    {"accept-charset", ""},
+    {"accept-encoding", "gzip, deflate"},
+    {"accept-language", ""},
+    {"accept-ranges", ""},
+    {"accept", ""},
+    {"access-control-allow-origin", ""},
+    {"age", ""},
+    {"allow", ""},
+    {"authorization", ""},
+    {"cache-control", ""},
+    {"content-disposition", ""},
+    {"content-encoding", ""},
+    {"content-language", ""},
+    {"content-length", ""},
+    {"content-location", ""},
+    {"content-range", ""},
+    {"content-type", ""},
+    {"cookie", ""},
+    {"date", ""},
+    {"etag", ""},
+    {"expect", ""},
+    {"expires", ""},
+    {"from", ""},
+    {"host", ""},
+    {"if-match", ""},
+    {"if-modified-since", ""},
+    {"if-none-match", ""},
+    {"if-range", ""},
+    {"if-unmodified-since", ""},
+    {"last-modified", ""},
+    {"link", ""},
+    {"location", ""},
+    {"max-forwards", ""},
+    {"proxy-authenticate", ""},
+    {"proxy-authorization", ""},
+    {"range", ""},
+    {"referer", ""},
+    {"refresh", ""},
+    {"retry-after", ""},
+    {"server", ""},
+    {"set-cookie", ""},
+    {"strict-transport-security", ""},
+    {"transfer-encoding", ""},
+    {"user-agent", ""},
+    {"vary", ""},
+    {"via", ""},
+    {"www-authenticate", ""},
+};
+
+static inline uint32_t read32be(const uint8_t *ptr)
+{
+    uint32_t v;
+    memcpy(&v, ptr, sizeof(v));
+    return be32toh(v);
+}
+
+static inline void write32be(uint8_t *ptr, uint32_t v)
+{
+    v = htobe32(v);
+    memcpy(ptr, &v, sizeof(v));
+}
+
+static inline bool string_is(const struct hpack_string *str, const char *s)
+{
+    const size_t len = strlen(s);
+    return str->len == len && !memcmp(str->value, s, len);
+}
+
+static void abort_connection(struct h2_connection *h2)
+{
+    /* This never returns, but isn't marked as such (nor followed by
+     * __builtin_unreachable()): calls to noreturn functions are
+     * instrumented by ASan in a way that doesn't work well with the
+     * coroutine stacks. */
+    coro_yield(h2->conn->coro, CONN_CORO_ABORT);
+}
+
+/* Output */
+
+static void write_iov(struct h2_connection *h2, struct iovec *iov, int iov_count)
+{
+    int curr_iov = 0;
+
+    while (curr_iov < iov_count) {
+        struct msghdr hdr = {
+            .msg_iov = iov + curr_iov,
+            .msg_iovlen = (size_t)(iov_count - curr_iov),
+        };
+        ssize_t written = sendmsg(h2->fd, &hdr, 0);
+
+        if (UNLIKELY(written < 0)) {
+            switch (errno) {
+            case EAGAIN:
+                coro_yield(h2->conn->coro, CONN_CORO_WANT_WRITE);
+                /* fallthrough */
+            case EINTR:
+                continue;
+            default:
+                abort_connection(h2);
+            }
+        }
+
+        h2->conn->thread->stats.bytes_sent += (uint64_t)written;
+
+        while (curr_iov < iov_count &&
+               written >= (ssize_t)iov[curr_iov].iov_len) {
+            written -= (ssize_t)iov[curr_iov].iov_len;
+            curr_iov++;
+        }
+        if (curr_iov < iov_count) {
+            iov[curr_iov].iov_base = (char *)iov[curr_iov].iov_base + written;
+            iov[curr_iov].iov_len -= (size_t)written;
+        }
+    }
+}
+
+static void flush_output_with(struct h2_connection *h2,
+                              const void *data,
+                              size_t len)
+{
+    struct iovec iov[] = {
+        {.iov_base = lwan_strbuf_get_buffer(&h2->output),
+         .iov_len = lwan_strbuf_get_length(&h2->output)},
+        {.iov_base = (void *)data, .iov_len = len},
+    };
+
+    write_iov(h2, iov, len ? 2 : 1);
+    lwan_strbuf_reset_trim(&h2->output, 4 * OUTPUT_FLUSH_SIZE);
+}
+
+static void flush_output(struct h2_connection *h2)
+{
+    if (lwan_strbuf_get_length(&h2->output))
+        flush_output_with(h2, NULL, 0);
+}
+
+static void append_output(struct h2_connection *h2, const void *data, size_t len)
+{
+    if (UNLIKELY(!lwan_strbuf_append_str(&h2->output, data, len)))
+        abort_connection(h2);
+}
+
+static void append_frame_header(struct h2_connection *h2,
+                                size_t len,
+                                enum h2_frame_type type,
+                                uint8_t flags,
+                                uint32_t stream_id)
+{
+    uint8_t header[FRAME_HEADER_SIZE] = {
+        (uint8_t)(len >> 16), (uint8_t)(len >> 8), (uint8_t)len,
+        (uint8_t)type, flags,
+    };
+
+    assert(len < (1 << 24));
+    write32be(header + 5, stream_id & 0x7fffffff);
+    append_output(h2, header, sizeof(header));
+}
+
+static void send_rst_stream(struct h2_connection *h2,
+                            uint32_t stream_id,
+                            enum h2_error error)
+{
+    uint8_t payload[4];
+
+    write32be(payload, error);
+    append_frame_header(h2, sizeof(payload), FRAME_RST_STREAM, 0, stream_id);
+    append_output(h2, payload, sizeof(payload));
+}
+
+static void send_window_update(struct h2_connection *h2,
+                               uint32_t stream_id,
+                               size_t increment)
+{
+    uint8_t payload[4];
+
+    write32be(payload, (uint32_t)increment);
+    append_frame_header(h2, sizeof(payload), FRAME_WINDOW_UPDATE, 0,
+                        stream_id);
+    append_output(h2, payload, sizeof(payload));
+}
+
+static void connection_error(struct h2_connection *h2, enum h2_error error)
+{
+    uint8_t payload[8];
+
+    lwan_status_debug("Closing HTTP/2 connection with error %d", error);
+
+    write32be(payload, h2->last_stream_id);
+    write32be(payload + 4, error);
+    append_frame_header(h2, sizeof(payload), FRAME_GOAWAY, 0, 0);
+    append_output(h2, payload, sizeof(payload));
+    flush_output(h2);
+
+    abort_connection(h2);
+}
+
+/* Streams */
+
+static struct lwan_h2_stream *find_stream(struct h2_connection *h2,
+                                          uint32_t id)
+{
+    struct lwan_h2_stream *stream;
+
+    list_for_each (&h2->streams, stream, stream_list) {
+        if (stream->id == id)
+            return stream;
+    }
+
+    return NULL;
+}
+
+static struct lwan_h2_stream *new_stream(struct h2_connection *h2,
+                                         uint32_t id)
+{
+    struct lwan_h2_stream *stream = malloc(sizeof(*stream));
+
+    if (UNLIKELY(!stream))
+        return NULL;
+
+    *stream = (struct lwan_h2_stream){
+        .h2 = h2,
+        .id = id,
+        .send_window = h2->peer_initial_window,
+    };
+    lwan_strbuf_init(&stream->head);
+    lwan_strbuf_init(&stream->body);
+
+    list_add_tail(&h2->streams, &stream->stream_list);
+    h2->n_streams++;
+
+    return stream;
+}
+
+static void destroy_stream(struct h2_connection *h2,
+                           struct lwan_h2_stream *stream)
+{
+    assert(stream != h2->current);
+
+    list_del(&stream->stream_list);
+    h2->n_streams--;
+
+    lwan_strbuf_free(&stream->head);
+    lwan_strbuf_free(&stream->body);
+    free(stream);
+}
+
+static void reset_stream(struct h2_connection *h2,
+                         struct lwan_h2_stream *stream,
+                         enum h2_error error)
+{
+    if (!stream->reset) {
+        send_rst_stream(h2, stream->id, error);
+        stream->reset = true;
+    }
+
+    /* The stream being served is destroyed once its handler returns. */
+    if (stream != h2->current)
+        destroy_stream(h2, stream);
+}
+
+/* HPACK */
+
+static struct hpack_entry *hpack_table_get(struct hpack_table *table,
+                                           size_t index)
+{
+    /* Index 0 is the newest entry. */
+    return &table->entries[(table->newest + HPACK_MAX_ENTRIES - index) %
+                           HPACK_MAX_ENTRIES];
+}
+
+static size_t hpack_entry_size(const struct hpack_entry *entry)
+{
+    return entry->name_len + entry->value_len + HPACK_ENTRY_OVERHEAD;
+}
+
+static void hpack_table_evict(struct hpack_table *table)
+{
+    struct hpack_entry *oldest = hpack_table_get(table, table->n_entries - 1);
+
+    table->size -= hpack_entry_size(oldest);
+    table->n_entries--;
+    free(oldest->name);
+}
+
+static void hpack_table_set_max_size(struct hpack_table *table,
+                                     size_t max_size)
+{
+    while (table->size > max_size)
+        hpack_table_evict(table);
+    table->max_size = max_size;
+}
+
+static void hpack_table_free(struct hpack_table *table)
+{
+    while (table->n_entries)
+        hpack_table_evict(table);
+}
+
+static bool hpack_table_add(struct hpack_table *table,
+                            const struct hpack_string *name,
+                            const struct hpack_string *value)
+{
+    const size_t size = name->len + value->len + HPACK_ENTRY_OVERHEAD;
+
+    if (size > table->max_size) {
+        /* Entries larger than the table empty it and aren't added
+         * (RFC7541 §4.4). */
+        while (table->n_entries)
+            hpack_table_evict(table);
+        return true;
+    }
+
+    /* The name might be referring to an entry that will be evicted, so
+     * copy it before making room for the new entry. */
+    char *storage = malloc(name->len + value->len + 1);
+    if (UNLIKELY(!storage))
+        return false;
+    memcpy(storage, name->value, name->len);
+    memcpy(storage + name->len, value->value, value->len);
+
+    while (table->size + size > table->max_size)
+        hpack_table_evict(table);
+
+    table->newest = (table->newest + 1) % HPACK_MAX_ENTRIES;
+    table->entries[table->newest] = (struct hpack_entry){
+        .name = storage,
+        .name_len = name->len,
+        .value = storage + name->len,
+        .value_len = value->len,
+    };
+    table->n_entries++;
+    table->size += size;
+
+    assert(table->n_entries <= HPACK_MAX_ENTRIES);
+
+    return true;
+}
+
+static bool hpack_lookup(struct h2_connection *h2,
+                         size_t index,
+                         struct hpack_string *name,
+                         struct hpack_string *value)
+{
+    if (UNLIKELY(!index))
+        return false;
+
+    if (index <= N_ELEMENTS(static_table)) {
+        *name = (struct hpack_string){
+            .value = static_table[index - 1].name,
+            .len = strlen(static_table[index - 1].name),
+        };
+        if (value) {
+            *value = (struct hpack_string){
+                .value = static_table[index - 1].value,
+                .len = strlen(static_table[index - 1].value),
+            };
+        }
+        return true;
+    }
+
+    index -= N_ELEMENTS(static_table) + 1;
+    if (UNLIKELY(index >= h2->decoder_table.n_entries))
+        return false;
+
+    const struct hpack_entry *entry =
+        hpack_table_get(&h2->decoder_table, index);
+    *name = (struct hpack_string){.value = entry->name, .len = entry->name_len};
+    if (value) {
+        *value = (struct hpack_string){.value = entry->value,
+                                       .len = entry->value_len};
+    }
+    return true;
+}
+
+static bool hpack_decode_int(const uint8_t **p,
+                             const uint8_t *end,
+                             int prefix_bits,
+                             size_t *value)
+{
+    const size_t max_prefix = (1u << prefix_bits) - 1;
+
+    if (UNLIKELY(*p >= end))
+        return false;
+
+    size_t v = *(*p)++ & max_prefix;
+    if (v < max_prefix) {
+        *value = v;
+        return true;
+    }
+
+    /* Anything over 28 bits would be way over any limit we have. */
+    for (unsigned int shift = 0; *p < end && shift <= 21; shift += 7) {
+        const uint8_t byte = *(*p)++;
+
+        v += (size_t)(byte & 0x7f) << shift;
+        if (!(byte & 0x80)) {
+            *value = v;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+static bool hpack_decode_string(const uint8_t **p,
+                                const uint8_t *end,
+                                struct lwan_strbuf *buffer,
+                                struct hpack_string *str)
+{
+    size_t len;
+
+    if (UNLIKELY(*p >= end))
+        return false;
+
+    const bool huffman = **p & 0x80;
+    if (UNLIKELY(!hpack_decode_int(p, end, 7, &len)))
+        return false;
+    if (UNLIKELY(len > (size_t)(end - *p)))
+        return false;
+
+    if (huffman) {
+        /* The shortest Huffman code is 5 bits long. */
+        const size_t max_len = len * 8 / 5 + 1;
+
+        lwan_strbuf_reset(buffer);
+        if (UNLIKELY(!lwan_strbuf_grow_to(buffer, max_len)))
+            return false;
+
+        ssize_t decoded = lwan_h2_huffman_decode(
+            *p, len, lwan_strbuf_get_buffer(buffer), max_len);
+        if (UNLIKELY(decoded < 0))
+            return false;
+
+        *str = (struct hpack_string){.value = lwan_strbuf_get_buffer(buffer),
+                                     .len = (size_t)decoded};
+    } else {
+        *str = (struct hpack_string){.value = (const char *)*p, .len = len};
+    }
+
+    *p += len;
+    return true;
+}
+
+typedef void (*hpack_header_cb)(void *data,
+                                const struct hpack_string *name,
+                                const struct hpack_string *value);
+
+static bool hpack_decode_block(struct h2_connection *h2,
+                               const uint8_t *p,
+                               const uint8_t *end,
+                               hpack_header_cb cb,
+                               void *data)
+{
+    bool can_update_table_size = true;
+
+    while (p < end) {
+        struct hpack_string name, value;
+        const uint8_t first_byte = *p;
+        size_t index;
+
+        if (first_byte & 0x80) {
+            /* Indexed header field (§6.1) */
+            if (UNLIKELY(!hpack_decode_int(&p, end, 7, &index)))
+                return false;
+            if (UNLIKELY(!hpack_lookup(h2, index, &name, &value)))
+                return false;
+
+            cb(data, &name, &value);
+            can_update_table_size = false;
+            continue;
+        }
+
+        if ((first_byte & 0xe0) == 0x20) {
+            /* Dynamic table size update (§6.3); only allowed at the
+             * beginning of a header block. */
+            size_t max_size;
+
+            if (UNLIKELY(!can_update_table_size))
+                return false;
+            if (UNLIKELY(!hpack_decode_int(&p, end, 5, &max_size)))
+                return false;
+            if (UNLIKELY(max_size > HPACK_TABLE_SIZE))
+                return false;
+
+            hpack_table_set_max_size(&h2->decoder_table, max_size);
+            continue;
+        }
+
+        /* Literal header field with incremental indexing (§6.2.1),
+         * without indexing (§6.2.2), or never indexed (§6.2.3) */
+        const bool add_to_table = (first_byte & 0xc0) == 0x40;
+
+        if (UNLIKELY(!hpack_decode_int(&p, end, add_to_table ? 6 : 4, &index)))
+            return false;
+        if (index) {
+            if (UNLIKELY(!hpack_lookup(h2, index, &name, NULL)))
+                return false;
+        } else if (UNLIKELY(!hpack_decode_string(&p, end, &h2->name_buffer,
+                                                 &name))) {
+            return false;
+        }
+        if (UNLIKELY(!hpack_decode_string(&p, end, &h2->value_buffer, &value)))
+            return false;
+
+        cb(data, &name, &value);
+
+        if (add_to_table &&
+            UNLIKELY(!hpack_table_add(&h2->decoder_table, &name, &value)))
+            return false;
+
+        can_update_table_size = false;
+    }
+
+    return true;
+}
+
+static void hpack_encode_int(struct h2_connection *h2,
+                             uint8_t first_byte,
+                             int prefix_bits,
+                             size_t value)
+{
+    const size_t max_prefix = (1u << prefix_bits) - 1;
+    uint8_t buffer[16];
+    size_t len = 0;
+
+    if (value < max_prefix) {
+        buffer[len++] = (uint8_t)(first_byte | value);
+    } else {
+        buffer[len++] = (uint8_t)(first_byte | max_prefix);
+        for (value -= max_prefix; value >= 0x80; value >>= 7)
+            buffer[len++] = (uint8_t)((value & 0x7f) | 0x80);
+        buffer[len++] = (uint8_t)value;
+    }
+
+    if (UNLIKELY(!lwan_strbuf_append_str(&h2->encoded_headers,
+                                         (const char *)buffer, len)))
+        abort_connection(h2);
+}
+
+static void hpack_encode_string(struct h2_connection *h2,
+                                const struct hpack_string *str)
+{
+    /* Huffman-encoded only if that makes them shorter, which is usually
+     * the case for header values made of letters and digits. */
+    const size_t huffman_len =
+        lwan_h2_huffman_encoded_len(str->value, str->len);
+
+    if (huffman_len < str->len) {
+        hpack_encode_int(h2, 0x80, 7, huffman_len);
+
+        char *out = lwan_strbuf_extend_unsafe(&h2->encoded_headers,
+                                              huffman_len);
+        if (UNLIKELY(!out)) {
+            abort_connection(h2);
+            return;
+        }
+
+        lwan_h2_huffman_encode(str->value, str->len, (uint8_t *)out);
+        return;
+    }
+
+    hpack_encode_int(h2, 0x00, 7, str->len);
+    if (UNLIKELY(!lwan_strbuf_append_str(&h2->encoded_headers, str->value,
+                                         str->len)))
+        abort_connection(h2);
+}
+
+static size_t hpack_static_name_index(const struct hpack_string *name)
+{
+    /* Pseudo-headers are encoded separately. */
+    for (size_t i = 15; i <= N_ELEMENTS(static_table); i++) {
+        if (string_is(name, static_table[i - 1].name))
+            return i;
+    }
+    return 0;
+}
+
+static size_t hpack_dynamic_index(struct hpack_table *table,
+                                  const struct hpack_string *name,
+                                  const struct hpack_string *value)
+{
+    for (size_t i = 0; i < table->n_entries; i++) {
+        const struct hpack_entry *entry = hpack_table_get(table, i);
+
+        if (entry->name_len == name->len && entry->value_len == value->len &&
+            !memcmp(entry->name, name->value, name->len) &&
+            !memcmp(entry->value, value->value, value->len))
+            return N_ELEMENTS(static_table) + 1 + i;
+    }
+    return 0;
+}
+
+static bool should_index_response_header(const struct hpack_string *name,
+                                         const struct hpack_string *value)
+{
+    /* Only headers that are likely to be repeated, with the same value,
+     * in other responses in this connection are worth an entry in the
+     * dynamic table.  Things like dates and lengths are not. */
+    static const char *indexable[] = {
+        "server",
+        "content-type",
+        "content-encoding",
+        "cache-control",
+        "vary",
+        "accept-ranges",
+        "strict-transport-security",
+        "access-control-allow-origin",
+        "access-control-allow-methods",
+        "access-control-allow-credentials",
+        "access-control-allow-headers",
+        "x-powered-by",
+    };
+
+    if (value->len > 128)
+        return false;
+
+    for (size_t i = 0; i < N_ELEMENTS(indexable); i++) {
+        if (string_is(name, indexable[i]))
+            return true;
+    }
+    return false;
+}
+
+static void hpack_encode_header(struct h2_connection *h2,
+                                const struct hpack_string *name,
+                                const struct hpack_string *value)
+{
+    const size_t name_index = hpack_static_name_index(name);
+
+    if (should_index_response_header(name, value)) {
+        size_t index = hpack_dynamic_index(&h2->encoder_table, name, value);
+
+        if (index) {
+            hpack_encode_int(h2, 0x80, 7, index);
+            return;
+        }
+
+        hpack_encode_int(h2, 0x40, 6, name_index);
+        if (!name_index)
+            hpack_encode_string(h2, name);
+        hpack_encode_string(h2, value);
+
+        /* The client is adding this to its table, so ours can't get out
+         * of sync. */
+        if (UNLIKELY(!hpack_table_add(&h2->encoder_table, name, value)))
+            abort_connection(h2);
+        return;
+    }
+
+    hpack_encode_int(h2, 0x00, 4, name_index);
+    if (!name_index)
+        hpack_encode_string(h2, name);
+    hpack_encode_string(h2, value);
+}
+
+static void hpack_encode_status(struct h2_connection *h2, unsigned int status)
+{
+    char status_str[3] = {
+        (char)('0' + status / 100),
+        (char)('0' + status / 10 % 10),
+        (char)('0' + status % 10),
+    };
+
+    switch (status) {
+    case 200:
+        return hpack_encode_int(h2, 0x80, 7, 8);
+    case 204:
+        return hpack_encode_int(h2, 0x80, 7, 9);
+    case 206:
+        return hpack_encode_int(h2, 0x80, 7, 10);
+    case 304:
+        return hpack_encode_int(h2, 0x80, 7, 11);
+    case 400:
+        return hpack_encode_int(h2, 0x80, 7, 12);
+    case 404:
+        return hpack_encode_int(h2, 0x80, 7, 13);
+    case 500:
+        return hpack_encode_int(h2, 0x80, 7, 14);
+    }
+
+    hpack_encode_int(h2, 0x00, 4, 8);
+    hpack_encode_string(
+        h2, &(struct hpack_string){.value = status_str, .len = 3});
+}
+
+static void hpack_begin_block(struct h2_connection *h2)
+{
+    lwan_strbuf_reset(&h2->encoded_headers);
+
+    if (h2->encoder_table_size_changed) {
+        hpack_encode_int(h2, 0x20, 5, h2->pending_encoder_table_size);
+        hpack_table_set_max_size(&h2->encoder_table,
+                                 h2->pending_encoder_table_size);
+        h2->encoder_table_size_changed = false;
+    }
+}
+
+/* Responses */
+
+static void send_header_block(struct h2_connection *h2,
+                              struct lwan_h2_stream *stream,
+                              bool end_stream)
+{
+    const char *block = lwan_strbuf_get_buffer(&h2->encoded_headers);
+    size_t len = lwan_strbuf_get_length(&h2->encoded_headers);
+    enum h2_frame_type type = FRAME_HEADERS;
+    uint8_t flags = end_stream ? FLAG_END_STREAM : 0;
+
+    while (true) {
+        const size_t frame_len = LWAN_MIN(len, h2->peer_max_frame_size);
+
+        if (frame_len == len)
+            flags |= FLAG_END_HEADERS;
+
+        append_frame_header(h2, frame_len, type, flags, stream->id);
+        append_output(h2, block, frame_len);
+
+        if (frame_len == len)
+            break;
+
+        block += frame_len;
+        len -= frame_len;
+        type = FRAME_CONTINUATION;
+        flags = 0;
+    }
+
+    if (end_stream)
+        stream->output_state = OUTPUT_DONE;
+}
+
+static void send_status_only(struct h2_connection *h2,
+                             struct lwan_h2_stream *stream,
+                             unsigned int status)
+{
+    hpack_begin_block(h2);
+    hpack_encode_status(h2, status);
+    send_header_block(h2, stream, true);
+}
+
+static void process_frame(struct h2_connection *h2);
+
+static void send_data(struct h2_connection *h2,
+                      struct lwan_h2_stream *stream,
+                      const char *data,
+                      size_t len,
+                      bool end_stream)
+{
+    if (!len && !end_stream)
+        return;
+
+    do {
+        if (stream->reset)
+            return;
+
+        const int64_t window = LWAN_MIN(h2->send_window, stream->send_window);
+        if (len && window <= 0) {
+            /* Wait for WINDOW_UPDATE frames, while still processing
+             * everything else the client is sending. */
+            flush_output(h2);
+            process_frame(h2);
+            continue;
+        }
+
+        const size_t frame_len =
+            LWAN_MIN(LWAN_MIN(len, (size_t)LWAN_MAX(window, 0)),
+                     h2->peer_max_frame_size);
+        const bool last = end_stream && frame_len == len;
+
+        append_frame_header(h2, frame_len, FRAME_DATA,
+                            last ? FLAG_END_STREAM : 0, stream->id);
+        if (frame_len >= ZERO_COPY_THRESHOLD) {
+            flush_output_with(h2, data, frame_len);
+        } else {
+            append_output(h2, data, frame_len);
+            if (lwan_strbuf_get_length(&h2->output) >= OUTPUT_FLUSH_SIZE)
+                flush_output(h2);
+        }
+
+        h2->send_window -= (int64_t)frame_len;
+        stream->send_window -= (int64_t)frame_len;
+        data += frame_len;
+        len -= frame_len;
+    } while (len);
+
+    if (end_stream)
+        stream->output_state = OUTPUT_DONE;
+}
+
+static bool is_hop_by_hop_header(const struct hpack_string *name)
+{
+    return string_is(name, "connection") || string_is(name, "keep-alive") ||
+           string_is(name, "proxy-connection") ||
+           string_is(name, "transfer-encoding") || string_is(name, "upgrade");
+}
+
+static bool parse_content_length(const char *value, size_t len, size_t *out)
+{
+    size_t v = 0;
+
+    if (!len)
+        return false;
+
+    for (size_t i = 0; i < len; i++) {
+        if (value[i] < '0' || value[i] > '9')
+            return false;
+        if (__builtin_mul_overflow(v, 10, &v) ||
+            __builtin_add_overflow(v, (size_t)(value[i] - '0'), &v))
+            return false;
+    }
+
+    *out = v;
+    return true;
+}
+
+static void send_response_head(struct h2_connection *h2,
+                               struct lwan_h2_stream *stream,
+                               const char *head,
+                               size_t head_len)
+{
+    const char *end = head + head_len - 2; /* Ignore final CRLF */
+    bool chunked = false, has_content_length = false;
+    size_t content_length = 0;
+
+    if (UNLIKELY(head_len < sizeof("HTTP/1.1 200\r\n\r\n") - 1 ||
+                 strncmp(head, "HTTP/1.", 7) || head[8] != ' ' ||
+                 !lwan_char_isdigit(head[9]) || !lwan_char_isdigit(head[10]) ||
+                 !lwan_char_isdigit(head[11]))) {
+        reset_stream(h2, stream, H2_INTERNAL_ERROR);
+        return;
+    }
+
+    const unsigned int status = (unsigned int)(head[9] - '0') * 100 +
+                                (unsigned int)(head[10] - '0') * 10 +
+                                (unsigned int)(head[11] - '0');
+    if (status < 200) {
+        /* Interim responses, such as "100 Continue", aren't useful here. */
+        return;
+    }
+
+    hpack_begin_block(h2);
+    hpack_encode_status(h2, status);
+
+    const char *line = memchr(head, '\n', head_len);
+    for (line = line ? line + 1 : end; line < end;) {
+        const char *eol = memchr(line, '\r', (size_t)(end - line));
+        if (!eol)
+            break;
+
+        const char *colon = memchr(line, ':', (size_t)(eol - line));
+        char name_buf[256];
+
+        if (colon && (size_t)(colon - line) < sizeof(name_buf)) {
+            struct hpack_string name = {.value = name_buf,
+                                        .len = (size_t)(colon - line)};
+            struct hpack_string value;
+            const char *v = colon + 1;
+
+            for (size_t i = 0; i < name.len; i++)
+                name_buf[i] = (char)(line[i] | 0x20 * (line[i] >= 'A' && line[i] <= 'Z'));
+            while (v < eol && *v == ' ')
+                v++;
+            value = (struct hpack_string){.value = v, .len = (size_t)(eol - v)};
+
+            if (is_hop_by_hop_header(&name)) {
+                if (string_is(&name, "transfer-encoding") &&
+                    memmem(value.value, value.len, "chunked", 7))
+                    chunked = true;
+            } else {
+                if (string_is(&name, "content-length")) {
+                    has_content_length = parse_content_length(
+                        value.value, value.len, &content_length);
+                }
+                hpack_encode_header(h2, &name, &value);
+            }
+        }
+
+        line = eol + 2;
+    }
+
+    if (stream->is_head || status == 204 || status == 304 ||
+        (!chunked && has_content_length && !content_length)) {
+        send_header_block(h2, stream, true);
+        return;
+    }
+
+    send_header_block(h2, stream, false);
+
+    if (chunked) {
+        stream->output_state = OUTPUT_CHUNK_SIZE;
+        stream->output_remaining = 0;
+    } else if (has_content_length) {
+        stream->output_state = OUTPUT_LENGTH;
+        stream->output_remaining = content_length;
+    } else {
+        stream->output_state = OUTPUT_UNTIL_END;
+    }
+}
+
+static void stream_output(struct lwan_h2_stream *stream,
+                          const char *data,
+                          size_t len)
+{
+    struct h2_connection *h2 = stream->h2;
+
+    while (len && !stream->reset) {
+        size_t n;
+
+        switch (stream->output_state) {
+        case OUTPUT_HEAD: {
+            const size_t prev_len = lwan_strbuf_get_length(&h2->response_head);
+
+            if (UNLIKELY(prev_len + len > MAX_RESPONSE_HEAD_SIZE)) {
+                reset_stream(h2, stream, H2_INTERNAL_ERROR);
+                return;
+            }
+            if (UNLIKELY(!lwan_strbuf_append_str(&h2->response_head, data, len)))
+                abort_connection(h2);
+
+            const char *head = lwan_strbuf_get_buffer(&h2->response_head);
+            const size_t search_from = prev_len > 3 ? prev_len - 3 : 0;
+            const char *crlfcrlf =
+                memmem(head + search_from, prev_len + len - search_from,
+                       "\r\n\r\n", 4);
+            if (!crlfcrlf)
+                return;
+
+            const size_t head_len = (size_t)(crlfcrlf - head) + 4;
+            send_response_head(h2, stream, head, head_len);
+            lwan_strbuf_reset(&h2->response_head);
+
+            n = head_len - prev_len;
+            break;
+        }
+
+        case OUTPUT_LENGTH:
+            n = LWAN_MIN(len, stream->output_remaining);
+            stream->output_remaining -= n;
+            send_data(h2, stream, data, n, !stream->output_remaining);
+            break;
+
+        case OUTPUT_UNTIL_END:
+            n = len;
+            send_data(h2, stream, data, n, false);
+            break;
+
+        case OUTPUT_CHUNK_SIZE:
+            /* Chunk extensions are never generated by Lwan, and bytes
+             * other than hex digits are ignored until the end of line. */
+            for (n = 0; n < len && data[n] != '\n'; n++) {
+                const char c = data[n];
+
+                if (c >= '0' && c <= '9')
+                    stream->output_remaining = stream->output_remaining * 16 + (size_t)(c - '0');
+                else if ((c | 0x20) >= 'a' && (c | 0x20) <= 'f')
+                    stream->output_remaining = stream->output_remaining * 16 + (size_t)((c | 0x20) - 'a' + 10);
+            }
+            if (n == len)
+                break;
+
+            n++; /* Include the '\n' */
+            if (stream->output_remaining) {
+                stream->output_state = OUTPUT_CHUNK_DATA;
+            } else {
+                /* Last chunk; anything after it (trailers and the final
+                 * CRLF) is ignored. */
+                send_data(h2, stream, NULL, 0, true);
+            }
+            break;
+
+        case OUTPUT_CHUNK_DATA:
+            n = LWAN_MIN(len, stream->output_remaining);
+            stream->output_remaining -= n;
+            send_data(h2, stream, data, n, false);
+            if (!stream->output_remaining) {
+                stream->output_state = OUTPUT_CHUNK_CRLF;
+                stream->output_remaining = 2;
+            }
+            break;
+
+        case OUTPUT_CHUNK_CRLF:
+            n = LWAN_MIN(len, stream->output_remaining);
+            stream->output_remaining -= n;
+            if (!stream->output_remaining)
+                stream->output_state = OUTPUT_CHUNK_SIZE;
+            break;
+
+        case OUTPUT_DONE:
+        default:
+            return;
+        }
+
+        data += n;
+        len -= n;
+    }
+}
+
+static bool has_ready_stream(const struct h2_connection *h2)
+{
+    const struct lwan_h2_stream *stream;
+
+    list_for_each (&h2->streams, stream, stream_list) {
+        if (stream->ready && stream != h2->current)
+            return true;
+    }
+
+    return false;
+}
+
+static void flush_stream_output(struct lwan_h2_stream *stream)
+{
+    struct h2_connection *h2 = stream->h2;
+
+    /* Responses to streams that are waiting to be served are sent in the
+     * same system call as this one, like responses to pipelined requests
+     * with HTTP/1.1. */
+    if (stream->output_state == OUTPUT_DONE && has_ready_stream(h2))
+        return;
+
+    flush_output(h2);
+}
+
+ssize_t lwan_h2_stream_writev(struct lwan_request *request,
+                              struct iovec *iov,
+                              int iov_count)
+{
+    struct lwan_h2_stream *stream = request->helper->h2_stream;
+    ssize_t total_written = 0;
+
+    for (int i = 0; i < iov_count; i++) {
+        stream_output(stream, iov[i].iov_base, iov[i].iov_len);
+        total_written += (ssize_t)iov[i].iov_len;
+    }
+
+    flush_stream_output(stream);
+    request->helper->bytes_sent += (uint64_t)total_written;
+    return total_written;
+}
+
+ssize_t lwan_h2_stream_send(struct lwan_request *request,
+                            const void *buf,
+                            size_t count,
+                            int flags)
+{
+    struct lwan_h2_stream *stream = request->helper->h2_stream;
+
+    stream_output(stream, buf, count);
+    if (!(flags & MSG_MORE))
+        flush_stream_output(stream);
+
+    request->helper->bytes_sent += count;
+    return (ssize_t)count;
+}
+
+static char *get_file_buffer(struct h2_connection *h2)
+{
+    if (!h2->file_buffer) {
+        h2->file_buffer = malloc(FILE_BUFFER_SIZE);
+        if (UNLIKELY(!h2->file_buffer))
+            abort_connection(h2);
+    }
+
+    return h2->file_buffer;
+}
+
+int lwan_h2_stream_sendfile(struct lwan_request *request,
+                            int in_fd,
+                            off_t offset,
+                            size_t count,
+                            const char *header,
+                            size_t header_len)
+{
+    struct lwan_h2_stream *stream = request->helper->h2_stream;
+    char *buffer = get_file_buffer(stream->h2);
+
+    /* Data has to be framed, so there's no zero-copy path here. */
+    stream_output(stream, header, header_len);
+
+    while (count) {
+        ssize_t r = pread(in_fd, buffer, LWAN_MIN(count, FILE_BUFFER_SIZE),
+                          offset);
+
+        if (UNLIKELY(r < 0)) {
+            if (errno == EINTR || errno == EAGAIN)
+                continue;
+            return -errno;
+        }
+        if (UNLIKELY(!r))
+            return -EIO;
+
+        stream_output(stream, buffer, (size_t)r);
+        request->helper->bytes_sent += (uint64_t)r;
+        count -= (size_t)r;
+        offset += r;
+    }
+
+    flush_stream_output(stream);
+    request->helper->bytes_sent += header_len;
+    return 0;
+}
+
+int lwan_h2_stream_splice(struct lwan_request *request,
+                          int in_fd,
+                          size_t count)
+{
+    struct lwan_h2_stream *stream = request->helper->h2_stream;
+    char *buffer = get_file_buffer(stream->h2);
+
+    while (count) {
+        const size_t to_read = LWAN_MIN(count, FILE_BUFFER_SIZE);
+        ssize_t r = lwan_recv_fd(request, in_fd, buffer, to_read, 0);
+
+        if (UNLIKELY(r < 0))
+            return (int)r;
+
+        stream_output(stream, buffer, (size_t)r);
+        request->helper->bytes_sent += (uint64_t)r;
+        count -= (size_t)r;
+    }
+
+    return 0;
+}
+
+struct lwan_value lwan_h2_stream_get_body(const struct lwan_h2_stream *stream)
+{
+    return (struct lwan_value){
+        .value = lwan_strbuf_get_buffer(&stream->body),
+        .len = lwan_strbuf_get_length(&stream->body),
+    };
+}
+
+/* Requests */
+
+struct request_builder {
+    struct h2_connection *h2;
+    char method[16];
+    size_t method_len;
+    bool has_path;
+    bool has_scheme;
+    bool has_authority;
+    bool in_regular_headers;
+    bool malformed;
+};
+
+static bool is_valid_field_value(const struct hpack_string *value)
+{
+    for (size_t i = 0; i < value->len; i++) {
+        switch (value->value[i]) {
+        case '\0':
+        case '\r':
+        case '\n':
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool is_valid_pseudo_value(const struct hpack_string *value)
+{
+    /* These end up in the request line, so no spaces are allowed. */
+    if (!value->len)
+        return false;
+    for (size_t i = 0; i < value->len; i++) {
+        if ((unsigned char)value->value[i] <= ' ' ||
+            (unsigned char)value->value[i] == 0x7f)
+            return false;
+    }
+    return true;
+}
+
+static bool is_valid_field_name(const struct hpack_string *name)
+{
+    /* Lowercase "tchar"s from RFC9110 §5.6.2. */
+    if (!name->len)
+        return false;
+    for (size_t i = 0; i < name->len; i++) {
+        const char c = name->value[i];
+
+        if ((c >= 'a' && c <= 'z') || (c >= '0' && c <= '9'))
+            continue;
+        if (!memchr("!#$%&'*+-.^_`|~", c, 15))
+            return false;
+    }
+    return true;
+}
+
+static bool builder_set(struct request_builder *builder,
+                        struct lwan_strbuf *buf,
+                        const struct hpack_string *value)
+{
+    if (UNLIKELY(!lwan_strbuf_set(buf, value->value, value->len)))
+        abort_connection(builder->h2);
+    return true;
+}
+
+static void build_pseudo_header(struct request_builder *builder,
+                                const struct hpack_string *name,
+                                const struct hpack_string *value)
+{
+    struct h2_connection *h2 = builder->h2;
+
+    if (builder->in_regular_headers || !is_valid_pseudo_value(value))
+        goto malformed;
+
+    if (string_is(name, ":method")) {
+        if (builder->method_len || value->len >= sizeof(builder->method))
+            goto malformed;
+        memcpy(builder->method, value->value, value->len);
+        builder->method_len = value->len;
+    } else if (string_is(name, ":path")) {
+        if (builder->has_path)
+            goto malformed;
+        builder->has_path = builder_set(builder, &h2->path, value);
+    } else if (string_is(name, ":authority")) {
+        if (builder->has_authority)
+            goto malformed;
+        builder->has_authority = builder_set(builder, &h2->authority, value);
+    } else if (string_is(name, ":scheme")) {
+        if (builder->has_scheme)
+            goto malformed;
+        builder->has_scheme = true;
+    } else {
+        goto malformed;
+    }
+
+    return;
+
+malformed:
+    builder->malformed = true;
+}
+
+static void build_request(void *data,
+                          const struct hpack_string *name,
+                          const struct hpack_string *value)
+{
+    struct request_builder *builder = data;
+    struct h2_connection *h2 = builder->h2;
+
+    if (builder->malformed)
+        return;
+    if (!is_valid_field_value(value))
+        goto malformed;
+
+    if (name->len && name->value[0] == ':')
+        return build_pseudo_header(builder, name, value);
+
+    builder->in_regular_headers = true;
+
+    if (!is_valid_field_name(name) || is_hop_by_hop_header(name))
+        goto malformed;
+
+    if (string_is(name, "te")) {
+        if (!string_is(value, "trailers"))
+            goto malformed;
+        return;
+    }
+    if (string_is(name, "content-length")) {
+        /* Recalculated from the DATA frames. */
+        return;
+    }
+    if (string_is(name, "host")) {
+        if (!builder->has_authority && is_valid_pseudo_value(value))
+            builder->has_authority = builder_set(builder, &h2->authority, value);
+        return;
+    }
+    if (string_is(name, "cookie")) {
+        /* Cookies may be split in multiple fields (RFC9113 §8.2.3). */
+        if (lwan_strbuf_get_length(&h2->cookies) &&
+            UNLIKELY(!lwan_strbuf_append_str(&h2->cookies, "; ", 2)))
+            abort_connection(h2);
+        if (UNLIKELY(!lwan_strbuf_append_str(&h2->cookies, value->value,
+                                             value->len)))
+            abort_connection(h2);
+        return;
+    }
+
+    if (UNLIKELY(!lwan_strbuf_append_printf(&h2->headers, "%.*s: %.*s\r\n",
+                                            (int)name->len, name->value,
+                                            (int)value->len, value->value)))
+        abort_connection(h2);
+    return;
+
+malformed:
+    builder->malformed = true;
+}
+
+static void discard_header(void *data __attribute__((unused)),
+                           const struct hpack_string *name __attribute__((unused)),
+                           const struct hpack_string *value __attribute__((unused)))
+{
+}
+
+static bool method_is(const struct request_builder *builder, const char *method)
+{
+    return string_is(&(struct hpack_string){.value = builder->method,
+                                            .len = builder->method_len},
+                     method);
+}
+
+static bool convert_request(struct h2_connection *h2,
+                            struct lwan_h2_stream *stream,
+                            const struct request_builder *builder)
+{
+    const struct lwan_config *config = &h2->lwan->config;
+    struct lwan_strbuf *head = &stream->head;
+
+    if (builder->malformed || !builder->method_len || !builder->has_path ||
+        !builder->has_scheme)
+        return false;
+
+    bool ok = lwan_strbuf_append_printf(
+        head, "%.*s %s HTTP/1.1\r\n", (int)builder->method_len,
+        builder->method, lwan_strbuf_get_buffer(&h2->path));
+    if (builder->has_authority) {
+        ok &= lwan_strbuf_append_printf(head, "Host: %s\r\n",
+                                        lwan_strbuf_get_buffer(&h2->authority));
+    }
+    ok &= lwan_strbuf_append_str(head, lwan_strbuf_get_buffer(&h2->headers),
+                                 lwan_strbuf_get_length(&h2->headers));
+    if (lwan_strbuf_get_length(&h2->cookies)) {
+        ok &= lwan_strbuf_append_printf(head, "Cookie: %s\r\n",
+                                        lwan_strbuf_get_buffer(&h2->cookies));
+    }
+    if (UNLIKELY(!ok))
+        abort_connection(h2);
+
+    stream->is_head = method_is(builder, "HEAD");
+    stream->needs_content_length =
+        !method_is(builder, "GET") && !stream->is_head;
+    stream->max_body_len = method_is(builder, "PUT")
+                               ? config->max_put_data_size
+                               : config->max_post_data_size;
+
+    return true;
+}
+
+static void finish_request(struct h2_connection *h2,
+                           struct lwan_h2_stream *stream)
+{
+    bool ok = true;
+
+    if (stream->body_len || stream->needs_content_length) {
+        ok = lwan_strbuf_append_printf(&stream->head, "Content-Length: %zu\r\n",
+                                       stream->body_len);
+    }
+    ok &= lwan_strbuf_append_str(&stream->head, "\r\n", 2);
+    if (UNLIKELY(!ok))
+        abort_connection(h2);
+
+    stream->ready = true;
+}
+
+/* Frames */
+
+static void fill_input(struct h2_connection *h2, size_t want)
+{
+    assert(want <= INPUT_BUFFER_SIZE);
+
+    if (h2->input_len - h2->input_offset >= want)
+        return;
+
+    h2->input_len -= h2->input_offset;
+    memmove(h2->input, h2->input + h2->input_offset, h2->input_len);
+    h2->input_offset = 0;
+
+    while (h2->input_len < want) {
+        ssize_t r = recv(h2->fd, h2->input + h2->input_len,
+                         INPUT_BUFFER_SIZE - h2->input_len, 0);
+
+        if (r > 0) {
+            h2->input_len += (size_t)r;
+            continue;
+        }
+        if (r < 0) {
+            switch (errno) {
+            case EAGAIN:
+                flush_output(h2);
+                coro_yield(h2->conn->coro, CONN_CORO_WANT_READ);
+                /* fallthrough */
+            case EINTR:
+                continue;
+            }
+        }
+
+        /* Client shut down the connection, or an unrecoverable error. */
+        abort_connection(h2);
+    }
+}
+
+static bool strip_padding(uint8_t flags, const uint8_t **p, const uint8_t **end)
+{
+    if (!(flags & FLAG_PADDED))
+        return true;
+    if (*p == *end)
+        return false;
+
+    const uint8_t pad_len = *(*p)++;
+    if (pad_len > *end - *p)
+        return false;
+
+    *end -= pad_len;
+    return true;
+}
+
+static void process_header_block(struct h2_connection *h2)
+{
+    const uint32_t id = h2->header_block_stream_id;
+    struct lwan_h2_stream *stream = find_stream(h2, id);
+    struct request_builder builder = {.h2 = h2};
+
+    const uint8_t *block =
+        (const uint8_t *)lwan_strbuf_get_buffer(&h2->header_block);
+    const uint8_t *block_end = block + lwan_strbuf_get_length(&h2->header_block);
+
+    if (stream || id <= h2->last_stream_id || !(id & 1) || h2->goaway ||
+        h2->n_streams >= MAX_CONCURRENT_STREAMS) {
+        /* Header blocks have to be decoded even if they're not going to be
+         * used, as they might change the dynamic table. */
+        if (UNLIKELY(!hpack_decode_block(h2, block, block_end, discard_header,
+                                         NULL)))
+            connection_error(h2, H2_COMPRESSION_ERROR);
+
+        if (stream) {
+            /* Trailers: only allowed to end the stream. */
+            if (stream->end_stream) {
+                reset_stream(h2, stream, H2_STREAM_CLOSED);
+            } else if (!h2->header_block_end_stream) {
+                reset_stream(h2, stream, H2_PROTOCOL_ERROR);
+            } else {
+                stream->end_stream = true;
+                if (!stream->ready)
+                    finish_request(h2, stream);
+            }
+            return;
+        }
+
+        if (id <= h2->last_stream_id || !(id & 1))
+            connection_error(h2, H2_PROTOCOL_ERROR);
+
+        h2->last_stream_id = id;
+        send_rst_stream(h2, id, H2_REFUSED_STREAM);
+        return;
+    }
+
+    h2->last_stream_id = id;
+
+    stream = new_stream(h2, id);
+    if (UNLIKELY(!stream))
+        abort_connection(h2);
+
+    lwan_strbuf_reset(&h2->path);
+    lwan_strbuf_reset(&h2->authority);
+    lwan_strbuf_reset(&h2->headers);
+    lwan_strbuf_reset(&h2->cookies);
+
+    if (UNLIKELY(!hpack_decode_block(h2, block, block_end, build_request,
+                                     &builder)))
+        connection_error(h2, H2_COMPRESSION_ERROR);
+
+    if (!convert_request(h2, stream, &builder)) {
+        reset_stream(h2, stream, H2_PROTOCOL_ERROR);
+        return;
+    }
+
+    if (h2->header_block_end_stream) {
+        stream->end_stream = true;
+        finish_request(h2, stream);
+    }
+}
+
+static void process_headers(struct h2_connection *h2,
+                            uint8_t flags,
+                            uint32_t stream_id,
+                            const uint8_t *p,
+                            const uint8_t *end)
+{
+    if (UNLIKELY(!stream_id))
+        connection_error(h2, H2_PROTOCOL_ERROR);
+    if (UNLIKELY(!strip_padding(flags, &p, &end)))
+        connection_error(h2, H2_PROTOCOL_ERROR);
+    if (flags & FLAG_PRIORITY) {
+        /* Prioritization is deprecated (RFC9113 §5.3.2) and ignored. */
+        if (UNLIKELY(end - p < 5))
+            connection_error(h2, H2_FRAME_SIZE_ERROR);
+        p += 5;
+    }
+
+    if (UNLIKELY(!lwan_strbuf_set(&h2->header_block, (const char *)p,
+                                  (size_t)(end - p))))
+        abort_connection(h2);
+
+    h2->header_block_stream_id = stream_id;
+    h2->header_block_end_stream = flags & FLAG_END_STREAM;
+
+    if (flags & FLAG_END_HEADERS)
+        process_header_block(h2);
+    else
+        h2->expecting_continuation = true;
+}
+
+static void process_continuation(struct h2_connection *h2,
+                                 uint8_t flags,
+                                 uint32_t stream_id,
+                                 const uint8_t *p,
+                                 const uint8_t *end)
+{
+    if (UNLIKELY(!h2->expecting_continuation ||
+                 stream_id != h2->header_block_stream_id))
+        connection_error(h2, H2_PROTOCOL_ERROR);
+    if (UNLIKELY(lwan_strbuf_get_length(&h2->header_block) +
+                     (size_t)(end - p) > MAX_HEADER_BLOCK_SIZE))
+        connection_error(h2, H2_ENHANCE_YOUR_CALM);
+
+    if (UNLIKELY(!lwan_strbuf_append_str(&h2->header_block, (const char *)p,
+                                         (size_t)(end - p))))
+        abort_connection(h2);
+
+    if (flags & FLAG_END_HEADERS) {
+        h2->expecting_continuation = false;
+        process_header_block(h2);
+    }
+}
+
+static void process_data(struct h2_connection *h2,
+                         uint8_t flags,
+                         uint32_t stream_id,
+                         const uint8_t *p,
+                         const uint8_t *end)
+{
+    const size_t frame_len = (size_t)(end - p);
+    struct lwan_h2_stream *stream;
+
+    if (UNLIKELY(!stream_id))
+        connection_error(h2, H2_PROTOCOL_ERROR);
+    if (UNLIKELY(!strip_padding(flags, &p, &end)))
+        connection_error(h2, H2_PROTOCOL_ERROR);
+
+    /* The whole frame, including padding, counts towards flow control. */
+    h2->recv_unacked += frame_len;
+    if (h2->recv_unacked >= RECV_WINDOW_SIZE / 2) {
+        send_window_update(h2, 0, h2->recv_unacked);
+        h2->recv_unacked = 0;
+    }
+
+    stream = find_stream(h2, stream_id);
+    if (!stream) {
+        if (UNLIKELY(stream_id > h2->last_stream_id))
+            connection_error(h2, H2_PROTOCOL_ERROR);
+        /* Stream has been closed already; ignore. */
+        return;
+    }
+    if (UNLIKELY(stream->end_stream)) {
+        reset_stream(h2, stream, H2_STREAM_CLOSED);
+        return;
+    }
+
+    if (!stream->ready) {
+        const size_t len = (size_t)(end - p);
+
+        if (stream->body_len + len >= stream->max_body_len) {
+            /* Let the request go through lwan_process_request() anyway,
+             * with a Content-Length that's over the limit, so that the
+             * usual error response is sent. */
+            stream->body_len += len;
+            lwan_strbuf_free(&stream->body);
+            lwan_strbuf_init(&stream->body);
+            finish_request(h2, stream);
+        } else {
+            if (UNLIKELY(!lwan_strbuf_append_str(&stream->body,
+                                                 (const char *)p, len)))
+                abort_connection(h2);
+            stream->body_len += len;
+
+            stream->recv_unacked += frame_len;
+            if (stream->recv_unacked >= RECV_WINDOW_SIZE / 2 &&
+                !(flags & FLAG_END_STREAM)) {
+                send_window_update(h2, stream->id, stream->recv_unacked);
+                stream->recv_unacked = 0;
+            }
+        }
+    }
+
+    if (flags & FLAG_END_STREAM) {
+        stream->end_stream = true;
+        if (!stream->ready)
+            finish_request(h2, stream);
+    }
+}
+
+static void process_settings(struct h2_connection *h2,
+                             uint8_t flags,
+                             uint32_t stream_id,
+                             const uint8_t *p,
+                             const uint8_t *end)
+{
+    if (UNLIKELY(stream_id))
+        connection_error(h2, H2_PROTOCOL_ERROR);
+
+    if (flags & FLAG_ACK) {
+        if (UNLIKELY(p != end))
+            connection_error(h2, H2_FRAME_SIZE_ERROR);
+        return;
+    }
+
+    if (UNLIKELY((end - p) % 6))
+        connection_error(h2, H2_FRAME_SIZE_ERROR);
+
+    for (; p < end; p += 6) {
+        const uint16_t id = (uint16_t)(p[0] << 8 | p[1]);
+        const uint32_t value = read32be(p + 2);
+
+        switch (id) {
+        case SETTINGS_HEADER_TABLE_SIZE:
+            /* Maximum size for the table used to encode responses; we
+             * have to acknowledge it in the next header block. */
+            h2->pending_encoder_table_size = LWAN_MIN(value, HPACK_TABLE_SIZE);
+            h2->encoder_table_size_changed = true;
+            break;
+
+        case SETTINGS_ENABLE_PUSH:
+            if (UNLIKELY(value > 1))
+                connection_error(h2, H2_PROTOCOL_ERROR);
+            break;
+
+        case SETTINGS_INITIAL_WINDOW_SIZE: {
+            struct lwan_h2_stream *stream;
+            const int64_t delta = (int64_t)value - h2->peer_initial_window;
+
+            if (UNLIKELY(value > MAX_WINDOW_SIZE))
+                connection_error(h2, H2_FLOW_CONTROL_ERROR);
+
+            list_for_each (&h2->streams, stream, stream_list) {
+                stream->send_window += delta;
+                if (UNLIKELY(stream->send_window > MAX_WINDOW_SIZE))
+                    connection_error(h2, H2_FLOW_CONTROL_ERROR);
+            }
+            h2->peer_initial_window = value;
+            break;
+        }
+
+        case SETTINGS_MAX_FRAME_SIZE:
+            if (UNLIKELY(value < MAX_FRAME_SIZE || value > (1 << 24) - 1))
+                connection_error(h2, H2_PROTOCOL_ERROR);
+            h2->peer_max_frame_size = value;
+            break;
+        }
+    }
+
+    append_frame_header(h2, 0, FRAME_SETTINGS, FLAG_ACK, 0);
+    h2->received_settings = true;
+}
+
+static void process_window_update(struct h2_connection *h2,
+                                  uint32_t stream_id,
+                                  const uint8_t *p,
+                                  const uint8_t *end)
+{
+    if (UNLIKELY(end - p != 4))
+        connection_error(h2, H2_FRAME_SIZE_ERROR);
+
+    const uint32_t increment = read32be(p) & 0x7fffffff;
+
+    if (!stream_id) {
+        if (UNLIKELY(!increment))
+            connection_error(h2, H2_PROTOCOL_ERROR);
+        h2->send_window += increment;
+        if (UNLIKELY(h2->send_window > MAX_WINDOW_SIZE))
+            connection_error(h2, H2_FLOW_CONTROL_ERROR);
+        return;
+    }
+
+    struct lwan_h2_stream *stream = find_stream(h2, stream_id);
+    if (!stream) {
+        if (UNLIKELY(stream_id > h2->last_stream_id))
+            connection_error(h2, H2_PROTOCOL_ERROR);
+        return;
+    }
+
+    if (UNLIKELY(!increment)) {
+        reset_stream(h2, stream, H2_PROTOCOL_ERROR);
+        return;
+    }
+
+    stream->send_window += increment;
+    if (UNLIKELY(stream->send_window > MAX_WINDOW_SIZE))
+        reset_stream(h2, stream, H2_FLOW_CONTROL_ERROR);
+}
+
+static void process_rst_stream(struct h2_connection *h2,
+                               uint32_t stream_id,
+                               const uint8_t *p,
+                               const uint8_t *end)
+{
+    if (UNLIKELY(end - p != 4))
+        connection_error(h2, H2_FRAME_SIZE_ERROR);
+    if (UNLIKELY(!stream_id || stream_id > h2->last_stream_id))
+        connection_error(h2, H2_PROTOCOL_ERROR);
+
+    struct lwan_h2_stream *stream = find_stream(h2, stream_id);
+    if (stream) {
+        /* No need to send a RST_STREAM frame back. */
+        stream->reset = true;
+        reset_stream(h2, stream, H2_NO_ERROR);
+    }
+}
+
+static void process_ping(struct h2_connection *h2,
+                         uint8_t flags,
+                         uint32_t stream_id,
+                         const uint8_t *p,
+                         const uint8_t *end)
+{
+    if (UNLIKELY(end - p != 8))
+        connection_error(h2, H2_FRAME_SIZE_ERROR);
+    if (UNLIKELY(stream_id))
+        connection_error(h2, H2_PROTOCOL_ERROR);
+
+    if (!(flags & FLAG_ACK)) {
+        append_frame_header(h2, 8, FRAME_PING, FLAG_ACK, 0);
+        append_output(h2, p, 8);
+    }
+}
+
+static void process_frame(struct h2_connection *h2)
+{
+    fill_input(h2, FRAME_HEADER_SIZE);
+
+    const uint8_t *header = h2->input + h2->input_offset;
+    const size_t len = (size_t)(header[0] << 16 | header[1] << 8 | header[2]);
+    const uint8_t type = header[3];
+    const uint8_t flags = header[4];
+    const uint32_t stream_id = read32be(header + 5) & 0x7fffffff;
+
+    if (UNLIKELY(len > MAX_FRAME_SIZE))
+        connection_error(h2, H2_FRAME_SIZE_ERROR);
+
+    fill_input(h2, FRAME_HEADER_SIZE + len);
+
+    /* Payload stays valid until the next call to fill_input(), which
+     * won't happen while processing this frame. */
+    const uint8_t *payload = h2->input + h2->input_offset + FRAME_HEADER_SIZE;
+    const uint8_t *end = payload + len;
+    h2->input_offset += FRAME_HEADER_SIZE + len;
+
+    if (UNLIKELY(!h2->received_settings && type != FRAME_SETTINGS))
+        connection_error(h2, H2_PROTOCOL_ERROR);
+    if (UNLIKELY(h2->expecting_continuation && type != FRAME_CONTINUATION))
+        connection_error(h2, H2_PROTOCOL_ERROR);
+
+    switch (type) {
+    case FRAME_DATA:
+        return process_data(h2, flags, stream_id, payload, end);
+    case FRAME_HEADERS:
+        return process_headers(h2, flags, stream_id, payload, end);
+    case FRAME_CONTINUATION:
+        return process_continuation(h2, flags, stream_id, payload, end);
+    case FRAME_SETTINGS:
+        return process_settings(h2, flags, stream_id, payload, end);
+    case FRAME_WINDOW_UPDATE:
+        return process_window_update(h2, stream_id, payload, end);
+    case FRAME_RST_STREAM:
+        return process_rst_stream(h2, stream_id, payload, end);
+    case FRAME_PING:
+        return process_ping(h2, flags, stream_id, payload, end);
+    case FRAME_GOAWAY:
+        if (UNLIKELY(stream_id))
+            connection_error(h2, H2_PROTOCOL_ERROR);
+        h2->goaway = true;
+        return;
+    case FRAME_PRIORITY:
+        if (UNLIKELY(!stream_id))
+            connection_error(h2, H2_PROTOCOL_ERROR);
+        return;
+    case FRAME_PUSH_PROMISE:
+        connection_error(h2, H2_PROTOCOL_ERROR);
+    default:
+        /* Unknown frame types must be ignored. */
+        return;
+    }
+}
+
+/* Connection */
+
+static void serve_stream(struct h2_connection *h2, struct lwan_h2_stream *stream)
+{
+    char *header_start[N_HEADER_START];
+    uint16_t header_index[N_HEADER_INDEX];
+    struct lwan_connection *conn = h2->conn;
+    struct coro *coro = conn->coro;
+    const size_t head_len = lwan_strbuf_get_length(&stream->head);
+    struct lwan_value buffer = {.value = h2->request_buffer, .len = head_len};
+    struct lwan_proxy proxy;
+
+    h2->current = stream;
+
+    if (UNLIKELY(head_len >= h2->request_buffer_size)) {
+        /* 431 Request Header Fields Too Large */
+        send_status_only(h2, stream, 431);
+        goto done;
+    }
+
+    /* lwan_process_request() will find a complete request in the buffer,
+     * so it won't try reading anything from the socket. */
+    memcpy(h2->request_buffer, lwan_strbuf_get_buffer(&stream->head), head_len);
+
+    struct lwan_request_parser_helper helper = {
+        .buffer = &buffer,
+        .next_request = buffer.value,
+        .error_when_n_packets = lwan_calculate_n_packets(head_len),
+        .header_start = header_start,
+        .header_index = header_index,
+        .h2_stream = stream,
+    };
+    struct lwan_request request = {.conn = conn,
+                                   .global_response_headers = &h2->lwan->headers,
+                                   .fd = h2->fd,
+                                   .response = {.buffer = &h2->response_buffer},
+                                   .flags = h2->request_flags,
+                                   .proxy = &proxy,
+                                   .helper = &helper};
+    const size_t generation = coro_deferred_get_generation(coro);
+
+    lwan_process_request(h2->lwan, &request);
+    conn->thread->stats.requests++;
+
+    coro_deferred_run(coro, generation);
+    lwan_strbuf_reset_trim(&h2->response_buffer, 2048);
+    lwan_strbuf_reset_trim(&h2->response_head, 2048);
+
+    /* Handlers may decide to close the connection (e.g. after an error),
+     * but other streams shouldn't be affected by that. */
+    conn->flags |= CONN_IS_KEEP_ALIVE;
+
+    if (stream->reset)
+        goto done;
+
+    switch (stream->output_state) {
+    case OUTPUT_DONE:
+        break;
+    case OUTPUT_UNTIL_END:
+        send_data(h2, stream, NULL, 0, true);
+        break;
+    default:
+        /* Handler didn't send a complete response. */
+        send_rst_stream(h2, stream->id, H2_INTERNAL_ERROR);
+        stream->reset = true;
+    }
+
+done:
+    if (!stream->end_stream && !stream->reset) {
+        /* Request body was too large; tell the client to stop sending it
+         * (RFC9113 §8.1). */
+        send_rst_stream(h2, stream->id, H2_NO_ERROR);
+    }
+
+    h2->current = NULL;
+    destroy_stream(h2, stream);
+}
+
+static struct lwan_h2_stream *next_ready_stream(struct h2_connection *h2)
+{
+    struct lwan_h2_stream *stream;
+
+    list_for_each (&h2->streams, stream, stream_list) {
+        if (stream->ready)
+            return stream;
+    }
+
+    return NULL;
+}
+
+static void free_h2_connection(void *data)
+{
+    struct h2_connection *h2 = data;
+
+    while (!list_empty(&h2->streams)) {
+        struct lwan_h2_stream *stream =
+            list_top(&h2->streams, struct lwan_h2_stream, stream_list);
+
+        h2->current = NULL;
+        destroy_stream(h2, stream);
+    }
+
+    hpack_table_free(&h2->decoder_table);
+    hpack_table_free(&h2->encoder_table);
+
+    lwan_strbuf_free(&h2->header_block);
+    lwan_strbuf_free(&h2->name_buffer);
+    lwan_strbuf_free(&h2->value_buffer);
+    lwan_strbuf_free(&h2->path);
+    lwan_strbuf_free(&h2->authority);
+    lwan_strbuf_free(&h2->headers);
+    lwan_strbuf_free(&h2->cookies);
+    lwan_strbuf_free(&h2->response_head);
+    lwan_strbuf_free(&h2->encoded_headers);
+    lwan_strbuf_free(&h2->response_buffer);
+    lwan_strbuf_free(&h2->output);
+
+    free(h2->file_buffer);
+}
+
+bool lwan_h2_is_preface(const char *buffer, size_t len)
+{
+    /* Only the part up to the first empty line is looked at, as that
+     * might be all that has been read by read_request(). */
+    static const size_t request_line_len = sizeof("PRI * HTTP/2.0\r\n\r\n") - 1;
+
+    return len >= request_line_len &&
+           !memcmp(buffer, client_preface, request_line_len);
+}
+
+void lwan_h2_serve(struct lwan_connection *conn,
+                   enum lwan_request_flags flags,
+                   const char *preread,
+                   size_t preread_len)
+{
+    struct coro *coro = conn->coro;
+    struct lwan *lwan = conn->thread->lwan;
+    struct h2_connection *h2 = coro_malloc(coro, sizeof(*h2));
+
+    if (UNLIKELY(!h2))
+        goto abort;
+
+    *h2 = (struct h2_connection){
+        .conn = conn,
+        .lwan = lwan,
+        .fd = lwan_connection_get_fd(lwan, conn),
+        .request_flags = flags & ~REQUEST_ALLOW_PROXY_REQS,
+        .decoder_table = {.max_size = HPACK_TABLE_SIZE},
+        .encoder_table = {.max_size = HPACK_TABLE_SIZE},
+        .send_window = DEFAULT_WINDOW_SIZE,
+        .peer_initial_window = DEFAULT_WINDOW_SIZE,
+        .peer_max_frame_size = MAX_FRAME_SIZE,
+        .request_buffer_size =
+            LWAN_MAX(lwan->config.request_buffer_size,
+                     (size_t)DEFAULT_BUFFER_SIZE),
+    };
+    list_head_init(&h2->streams);
+    lwan_strbuf_init(&h2->header_block);
+    lwan_strbuf_init(&h2->name_buffer);
+    lwan_strbuf_init(&h2->value_buffer);
+    lwan_strbuf_init(&h2->path);
+    lwan_strbuf_init(&h2->authority);
+    lwan_strbuf_init(&h2->headers);
+    lwan_strbuf_init(&h2->cookies);
+    lwan_strbuf_init(&h2->response_head);
+    lwan_strbuf_init(&h2->encoded_headers);
+    lwan_strbuf_init(&h2->response_buffer);
+    lwan_strbuf_init(&h2->output);
+
+    if (UNLIKELY(coro_defer(coro, free_h2_connection, h2) < 0)) {
+        free_h2_connection(h2);
+        goto abort;
+    }
+
+    h2->request_buffer = coro_malloc(coro, h2->request_buffer_size);
+    if (UNLIKELY(!h2->request_buffer))
+        goto abort;
+
+    assert(preread_len <= INPUT_BUFFER_SIZE);
+    memcpy(h2->input, preread, preread_len);
+    h2->input_len = preread_len;
+
+    fill_input(h2, sizeof(client_preface) - 1);
+    if (UNLIKELY(memcmp(h2->input, client_preface, sizeof(client_preface) - 1)))
+        goto abort;
+    h2->input_offset = sizeof(client_preface) - 1;
+
+    uint8_t settings[3 * 6] = {
+        0, SETTINGS_MAX_CONCURRENT_STREAMS, 0, 0, 0, 0,
+        0, SETTINGS_INITIAL_WINDOW_SIZE, 0, 0, 0, 0,
+        0, SETTINGS_MAX_HEADER_LIST_SIZE, 0, 0, 0, 0,
+    };
+    write32be(settings + 2, MAX_CONCURRENT_STREAMS);
+    write32be(settings + 8, RECV_WINDOW_SIZE);
+    write32be(settings + 14, (uint32_t)h2->request_buffer_size);
+    append_frame_header(h2, sizeof(settings), FRAME_SETTINGS, 0, 0);
+    append_output(h2, settings, sizeof(settings));
+    send_window_update(h2, 0, RECV_WINDOW_SIZE - DEFAULT_WINDOW_SIZE);
+
+    while (true) {
+        struct lwan_h2_stream *stream = next_ready_stream(h2);
+
+        if (stream) {
+            serve_stream(h2, stream);
+            continue;
+        }
+
+        if (h2->goaway && !h2->n_streams)
+            break;
+
+        process_frame(h2);
+    }
+
+    flush_output(h2);
+
+abort:
+    coro_yield(coro, CONN_CORO_ABORT);
+    __builtin_unreachable();
+}
@@ -22,9 +22,17 @@
 #include <stdbool.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
 
-#include "base64.h"
 #include "lwan-private.h"
+
+#if defined(LWAN_HAVE_LIBXCRYPT)
+#include <crypt.h>
+#endif
+
+#include "base64.h"
+#include "sha1.h"
 #include "lwan-cache.h"
 #include "lwan-config.h"
 #include "lwan-http-authorize.h"
@@ -34,7 +42,34 @@ struct realm_password_file_t {
     struct hash *entries;
 };
 
+/* Entries exist for credentials that have been checked against a password
+ * hash, whether they matched or not, so that the (purposefully slow) hashing
+ * function only runs once for them while they're cached.  */
+struct verified_credential_t {
+    struct cache_entry base;
+    bool verified;
+};
+
+struct credential {
+    struct lwan_request *request;
+    const char *password;
+    const char *hash;
+};
+
+/* Hashing is done by a task thread, as it would otherwise stall every
+ * other connection handled by the thread of the request.  This is shared
+ * with the task until both are done with it, as the request might be gone
+ * by the time it finishes.  */
+struct verification {
+    char *password;
+    char *hash;
+    int efd;
+    int refs;
+    bool verified;
+};
+
 static struct cache *realm_password_cache = NULL;
+static struct cache *verified_credential_cache = NULL;
 
 static void zero_and_free(void *str)
 {
@@ -130,17 +165,206 @@ static void destroy_realm_file(struct cache_entry *entry,
     free(rpf);
 }
 
+/* Passwords in the format used by crypt(3), e.g. "$2b$..." for bcrypt or
+ * "$y$..." for yescrypt, are hashes. */
+static bool is_password_hash(const char *password)
+{
+    return password[0] == '$';
+}
+
+static bool equal_in_constant_time(const char *a, const char *b)
+{
+    const size_t len = strlen(a);
+    unsigned char diff = 0;
+
+    if (len != strlen(b))
+        return false;
+
+    for (size_t i = 0; i < len; i++)
+        diff |= (unsigned char)(a[i] ^ b[i]);
+
+    return diff == 0;
+}
+
+#if defined(LWAN_HAVE_LIBXCRYPT)
+static void verification_unref(void *data)
+{
+    struct verification *v = data;
+
+    if (ATOMIC_DEC(v->refs))
+        return;
+
+    close(v->efd);
+    zero_and_free(v->password);
+    free(v->hash);
+    free(v);
+}
+
+static void verification_task(void *data)
+{
+    struct verification *v = data;
+    /* This is too large to be in the stack. */
+    struct crypt_data *cd = calloc(1, sizeof(*cd));
+
+    if (LIKELY(cd)) {
+        const char *hash = crypt_rn(v->password, v->hash, cd, (int)sizeof(*cd));
+
+        v->verified = hash && hash[0] != '*' &&
+                      equal_in_constant_time(hash, v->hash);
+
+        lwan_always_bzero(cd, sizeof(*cd));
+        free(cd);
+    }
+
+    if (UNLIKELY(eventfd_write(v->efd, 1) < 0))
+        lwan_status_perror("eventfd_write");
+
+    verification_unref(v);
+}
+
+static bool verify_in_task(const struct credential *credential, bool *verified)
+{
+    struct coro *coro = credential->request->conn->coro;
+    struct verification *v;
+    eventfd_t value;
+
+    v = calloc(1, sizeof(*v));
+    if (UNLIKELY(!v))
+        return false;
+
+    v->efd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (UNLIKELY(v->efd < 0)) {
+        free(v);
+        return false;
+    }
+
+    v->password = strdup(credential->password);
+    v->hash = strdup(credential->hash);
+    v->refs = 2;
+
+    /* Deferred callbacks are executed in reverse order, so this is called
+     * after the eventfd is no longer being watched by this thread. */
+    if (UNLIKELY(coro_defer(coro, verification_unref, v) < 0)) {
+        v->refs = 1;
+        verification_unref(v);
+        return false;
+    }
+
+    if (UNLIKELY(!v->password || !v->hash))
+        return false;
+
+    if (UNLIKELY(!lwan_job_run_task(verification_task, v))) {
+        v->refs--;
+        return false;
+    }
+
+    if (UNLIKELY(lwan_request_await_read(credential->request, v->efd) < 0))
+        return false;
+
+    if (UNLIKELY(eventfd_read(v->efd, &value) < 0))
+        lwan_status_perror("eventfd_read");
+
+    *verified = v->verified;
+    return true;
+}
+#endif
+
+static struct cache_entry *
+create_verified_credential(const void *key __attribute__((unused)),
+                           void *context __attribute__((unused)),
+                           void *create_ctx)
+{
+#if defined(LWAN_HAVE_LIBXCRYPT)
+    const struct credential *credential = create_ctx;
+    struct verified_credential_t *vc;
+    bool verified;
+
+    /* Failures are cached as well, so that retrying a wrong password
+     * doesn't cost another run of the hashing function. */
+    if (!verify_in_task(credential, &verified))
+        return NULL;
+
+    vc = malloc(sizeof(*vc));
+    if (LIKELY(vc))
+        vc->verified = verified;
+    return (struct cache_entry *)vc;
+#else
+    lwan_status_warning("Password hashes in password files aren't supported "
+                        "in this build, as libxcrypt wasn't available");
+    return NULL;
+#endif
+}
+
+static void destroy_verified_credential(struct cache_entry *entry,
+                                        void *context __attribute__((unused)))
+{
+    free(entry);
+}
+
 bool lwan_http_authorize_init(void)
 {
     realm_password_cache =
         cache_create(create_realm_file, destroy_realm_file, NULL, 60);
+    if (!realm_password_cache)
+        return false;
 
-    return !!realm_password_cache;
+    verified_credential_cache = cache_create(
+        create_verified_credential, destroy_verified_credential, NULL, 60);
+    if (!verified_credential_cache) {
+        cache_destroy(realm_password_cache);
+        return false;
+    }
+
+    cache_set_name(realm_password_cache, "authorization");
+    cache_set_name(verified_credential_cache, "verified credentials");
+    return true;
+}
+
+void lwan_http_authorize_shutdown(void)
+{
+    cache_destroy(verified_credential_cache);
+    cache_destroy(realm_password_cache);
 }
 
-void lwan_http_authorize_shutdown(void) { cache_destroy(realm_password_cache); }
+/* Verified credentials are keyed by a digest of the password hash and the
+ * Authorization header value, so that changing the hash in the password
+ * file invalidates them, and the header isn't kept around in memory. */
+static bool verify_password_hash(struct lwan_request *request,
+                                 const char *header,
+                                 size_t header_len,
+                                 const char *password,
+                                 const char *hash)
+{
+    struct credential credential = {
+        .request = request,
+        .password = password,
+        .hash = hash,
+    };
+    struct verified_credential_t *vc;
+    unsigned char digest[20];
+    char key[2 * sizeof(digest) + 1];
+    sha1_context ctx;
+
+    sha1_init(&ctx);
+    sha1_update(&ctx, (const unsigned char *)hash, strlen(hash) + 1);
+    sha1_update(&ctx, (const unsigned char *)header, header_len);
+    sha1_finalize(&ctx, digest);
+
+    for (size_t i = 0; i < sizeof(digest); i++) {
+        static const char hex_digits[] = "0123456789abcdef";
+
+        key[2 * i] = hex_digits[digest[i] >> 4];
+        key[2 * i + 1] = hex_digits[digest[i] & 15];
+    }
+    key[2 * sizeof(digest)] = '\0';
 
-static bool authorize(struct coro *coro,
+    vc = (struct verified_credential_t *)
+        cache_request_get_and_ref_entry_with_ctx(verified_credential_cache,
+                                                 request, key, &credential);
+    return vc && vc->verified;
+}
+
+static bool authorize(struct lwan_request *request,
                       const char *header,
                       size_t header_len,
                       const char *password_file)
@@ -154,7 +378,7 @@ static bool authorize(struct coro *coro,
     bool password_ok = false;
 
     rpf = (struct realm_password_file_t *)cache_coro_get_and_ref_entry(
-        realm_password_cache, coro, password_file);
+        realm_password_cache, request->conn->coro, password_file);
     if (UNLIKELY(!rpf))
         return false;
 
@@ -170,10 +394,18 @@ static bool authorize(struct coro *coro,
     password = colon + 1;
 
     looked_password = hash_find(rpf->entries, decoded);
-    if (looked_password)
+    if (!looked_password)
+        goto out;
+
+    if (is_password_hash(looked_password)) {
+        password_ok = verify_password_hash(request, header, header_len,
+                                           password, looked_password);
+    } else {
         password_ok = streq(password, looked_password);
+    }
 
 out:
+    lwan_always_bzero(decoded, decoded_len);
     free(decoded);
     return password_ok;
 }
@@ -191,7 +423,7 @@ bool lwan_http_authorize(struct lwan_request *request,
         const char *header = authorization + basic_len;
         size_t header_len = strlen(authorization) - basic_len;
 
-        if (authorize(request->conn->coro, header, header_len, password_file))
+        if (authorize(request, header, header_len, password_file))
             return true;
     }
 
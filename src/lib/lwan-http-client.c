@@ -0,0 +1,1076 @@
+/*
+ * lwan - web server
+ * Copyright (c) 2024 L. A. F. Pereira <l@tia.mat.br>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "lwan-private.h"
+
+#include "lwan-http-client.h"
+#include "lwan-resolver.h"
+
+#define MAX_IDLE_CONNECTIONS_PER_THREAD 16
+
+/* Response heads must fit in this buffer; it's also the maximum amount
+ * of data read from a connection at once. */
+#define CLIENT_BUFFER_SIZE 16384
+
+struct client_pool {
+    int idle_fds[MAX_IDLE_CONNECTIONS_PER_THREAD];
+    unsigned int n_idle;
+};
+
+struct client_pools {
+    size_t n_pools;
+    struct client_pool pools[];
+};
+
+struct lwan_http_client_endpoint {
+    union {
+        struct sockaddr_un un_addr;
+        struct sockaddr_in in_addr;
+        struct sockaddr_in6 in6_addr;
+        struct sockaddr_storage sock_addr;
+    };
+    socklen_t addr_size;
+    int addr_family;
+
+    /* If the address has a host name rather than a numeric address, it's
+     * resolved whenever a new connection is made, without blocking the
+     * thread, rather than only once when the endpoint is created.  */
+    char *host_name;
+    uint16_t port;
+
+    /* Used as the Host header */
+    char *address;
+
+    /* One per I/O thread; allocated by the first request */
+    struct client_pools *pools;
+};
+
+enum client_state {
+    CLIENT_NEW,
+    CLIENT_SENDING,
+    CLIENT_STREAMING_BODY,
+    CLIENT_READING_HEAD,
+    CLIENT_READING_BODY,
+    CLIENT_DONE,
+    CLIENT_FAILED,
+};
+
+enum body_framing {
+    BODY_NONE,
+    BODY_CONTENT_LENGTH,
+    BODY_CHUNKED,
+    BODY_UNTIL_EOF,
+};
+
+struct lwan_http_client {
+    struct lwan_request *request;
+    struct lwan_http_client_endpoint *endpoint;
+    struct client_pool *pool;
+    struct lwan_thread *thread;
+    unsigned int timeout_ms;
+    int fd;
+
+    enum client_state state;
+    int error;
+    bool keep_alive;
+    bool head_request;
+    bool streaming_body;
+
+    /* Request being sent: the head (or a chunk) and the body */
+    struct lwan_strbuf out;
+    size_t out_offset;
+    struct lwan_value body;
+    size_t body_offset;
+
+    struct {
+        char *data;
+        size_t len;
+        size_t offset;
+    } in;
+
+    int status;
+    struct lwan_key_value *headers;
+    size_t n_headers;
+
+    enum body_framing framing;
+    /* Bytes left in the body, for BODY_CONTENT_LENGTH, or in the current
+     * chunk, for BODY_CHUNKED */
+    size_t body_remaining;
+    bool chunk_needs_crlf;
+};
+
+struct lwan_http_client_endpoint *
+lwan_http_client_endpoint_new(const char *address)
+{
+    struct lwan_http_client_endpoint *endpoint = calloc(1, sizeof(*endpoint));
+
+    if (!endpoint)
+        return NULL;
+
+    endpoint->address = strdup(address);
+    if (!endpoint->address)
+        goto error;
+
+    if (*address == '/') {
+        if (strlen(address) >= sizeof(endpoint->un_addr.sun_path)) {
+            lwan_status_error("HTTP client: `%s` is too long for a "
+                              "sockaddr_un",
+                              address);
+            goto error;
+        }
+
+        endpoint->addr_family = AF_UNIX;
+        endpoint->un_addr = (struct sockaddr_un){.sun_family = AF_UNIX};
+        endpoint->addr_size = sizeof(endpoint->un_addr);
+        memcpy(endpoint->un_addr.sun_path, address, strlen(address) + 1);
+        return endpoint;
+    }
+
+    char *address_copy = strdupa(address);
+    char *node, *port;
+    sa_family_t family = lwan_socket_parse_address(address_copy, &node, &port);
+    if (family == AF_MAX) {
+        lwan_status_error("HTTP client: Could not parse '%s' as "
+                          "'address:port'",
+                          address);
+        goto error;
+    }
+
+    const struct addrinfo hints = {
+        .ai_family = family,
+        .ai_socktype = SOCK_STREAM,
+        .ai_flags = AI_NUMERICHOST | AI_NUMERICSERV,
+    };
+    struct addrinfo *addrs;
+    int ret = getaddrinfo(node, port, &hints, &addrs);
+    if (ret == EAI_NONAME) {
+        int port_number = parse_int(port, -1);
+        if (port_number <= 0 || port_number > 65535) {
+            lwan_status_error("HTTP client: Invalid port in '%s'", address);
+            goto error;
+        }
+
+        endpoint->host_name = strdup(node);
+        if (!endpoint->host_name)
+            goto error;
+        endpoint->port = (uint16_t)port_number;
+        endpoint->addr_family = family;
+        return endpoint;
+    }
+    if (ret) {
+        lwan_status_error("HTTP client: Could not parse '%s': %s", address,
+                          gai_strerror(ret));
+        goto error;
+    }
+
+    endpoint->addr_family = addrs->ai_family;
+    endpoint->addr_size = addrs->ai_addrlen;
+    memcpy(&endpoint->sock_addr, addrs->ai_addr, addrs->ai_addrlen);
+    freeaddrinfo(addrs);
+
+    return endpoint;
+
+error:
+    free(endpoint->host_name);
+    free(endpoint->address);
+    free(endpoint);
+    return NULL;
+}
+
+void lwan_http_client_endpoint_free(struct lwan_http_client_endpoint *endpoint)
+{
+    if (!endpoint)
+        return;
+
+    if (endpoint->pools) {
+        for (size_t i = 0; i < endpoint->pools->n_pools; i++) {
+            const struct client_pool *pool = &endpoint->pools->pools[i];
+
+            for (unsigned int fd = 0; fd < pool->n_idle; fd++)
+                close(pool->idle_fds[fd]);
+        }
+        free(endpoint->pools);
+    }
+
+    free(endpoint->host_name);
+    free(endpoint->address);
+    free(endpoint);
+}
+
+static struct client_pool *get_pool(struct lwan_http_client_endpoint *endpoint,
+                                    struct lwan_request *request)
+{
+    const struct lwan *lwan = request->conn->thread->lwan;
+    struct client_pools *pools =
+        __atomic_load_n(&endpoint->pools, __ATOMIC_ACQUIRE);
+
+    if (UNLIKELY(!pools)) {
+        const size_t n_pools = lwan->thread.count;
+        struct client_pools *new_pools = calloc(
+            1, sizeof(*new_pools) + n_pools * sizeof(struct client_pool));
+
+        if (!new_pools)
+            return NULL;
+
+        new_pools->n_pools = n_pools;
+        if (__atomic_compare_exchange_n(&endpoint->pools, &pools, new_pools,
+                                        false, __ATOMIC_ACQ_REL,
+                                        __ATOMIC_ACQUIRE)) {
+            pools = new_pools;
+        } else {
+            free(new_pools);
+        }
+    }
+
+    return &pools->pools[request->conn->thread - lwan->thread.threads];
+}
+
+static int take_idle_connection(struct client_pool *pool)
+{
+    while (pool && pool->n_idle) {
+        int fd = pool->idle_fds[--pool->n_idle];
+        char byte;
+
+        /* Servers close idle connections after a while, so make sure
+         * there's nothing to read (not even EOF) before reusing one.  */
+        if (recv(fd, &byte, 1, MSG_PEEK | MSG_DONTWAIT) < 0 && errno == EAGAIN)
+            return fd;
+
+        close(fd);
+    }
+
+    return -1;
+}
+
+static void release_client(void *data)
+{
+    struct lwan_http_client *client = data;
+    struct client_pool *pool = client->pool;
+
+    /* This runs after the defers registered by lwan_request_await_*(), so
+     * the connection isn't borrowed by this coroutine anymore.  Data
+     * past the response means the server doesn't speak HTTP/1.1 properly,
+     * so these connections aren't reused either.  */
+    if (client->state == CLIENT_DONE && client->keep_alive &&
+        client->in.offset == client->in.len && pool &&
+        pool->n_idle < MAX_IDLE_CONNECTIONS_PER_THREAD) {
+        lwan_thread_unwatch_open_fd(client->thread, client->fd);
+        pool->idle_fds[pool->n_idle++] = client->fd;
+        return;
+    }
+
+    close(client->fd);
+}
+
+static void free_strbuf(void *data)
+{
+    lwan_strbuf_free(data);
+}
+
+struct lwan_http_client *
+lwan_http_client_new(struct lwan_request *request,
+                     struct lwan_http_client_endpoint *endpoint,
+                     unsigned int timeout_ms)
+{
+    struct coro *coro = request->conn->coro;
+    struct lwan_http_client *client = coro_malloc(coro, sizeof(*client));
+
+    if (!client)
+        return NULL;
+
+    *client = (struct lwan_http_client){
+        .request = request,
+        .endpoint = endpoint,
+        .thread = request->conn->thread,
+        .timeout_ms = timeout_ms,
+        .fd = -1,
+        .state = CLIENT_NEW,
+    };
+
+    lwan_strbuf_init(&client->out);
+    coro_defer(coro, free_strbuf, &client->out);
+
+    return client;
+}
+
+static void client_fail(struct lwan_http_client *client, int error)
+{
+    client->state = CLIENT_FAILED;
+    client->error = error;
+    client->keep_alive = false;
+}
+
+static bool is_managed_header(const char *name)
+{
+    return strcaseequal_neutral(name, "Content-Length") ||
+           strcaseequal_neutral(name, "Transfer-Encoding") ||
+           strcaseequal_neutral(name, "Connection");
+}
+
+static bool build_request_head(struct lwan_http_client *client,
+                               const char *method,
+                               const char *path,
+                               const struct lwan_key_value *headers,
+                               const struct lwan_value *body)
+{
+    struct lwan_strbuf *out = &client->out;
+    bool has_host = false;
+
+    if (!lwan_strbuf_printf(out, "%s %s HTTP/1.1\r\n", method, path))
+        return false;
+
+    for (; headers && headers->key; headers++) {
+        if (is_managed_header(headers->key))
+            continue;
+        if (strcaseequal_neutral(headers->key, "Host"))
+            has_host = true;
+
+        if (!lwan_strbuf_append_printf(out, "%s: %s\r\n", headers->key,
+                                       headers->value))
+            return false;
+    }
+
+    if (!has_host && !lwan_strbuf_append_printf(out, "Host: %s\r\n",
+                                                client->endpoint->address))
+        return false;
+
+    if (client->streaming_body) {
+        if (!lwan_strbuf_append_strz(out, "Transfer-Encoding: chunked\r\n"))
+            return false;
+    } else if (body) {
+        if (!lwan_strbuf_append_printf(out, "Content-Length: %zu\r\n",
+                                       body->len))
+            return false;
+    }
+
+    return lwan_strbuf_append_strz(out, "\r\n");
+}
+
+static bool client_connect(struct lwan_http_client *client)
+{
+    struct lwan_http_client_endpoint *endpoint = client->endpoint;
+    struct lwan_request *request = client->request;
+
+    client->pool = get_pool(endpoint, request);
+    client->fd = take_idle_connection(client->pool);
+    if (client->fd < 0) {
+        struct sockaddr_storage resolved;
+        const struct sockaddr *addr = (struct sockaddr *)&endpoint->sock_addr;
+        socklen_t addr_size = endpoint->addr_size;
+
+        if (endpoint->host_name) {
+            int ret = lwan_request_resolve(request, endpoint->host_name,
+                                           endpoint->port,
+                                           endpoint->addr_family, &resolved,
+                                           &addr_size);
+            if (ret < 0) {
+                errno = -ret;
+                return false;
+            }
+            addr = (struct sockaddr *)&resolved;
+        }
+
+        client->fd = socket(addr->sa_family,
+                            SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (client->fd < 0)
+            return false;
+
+        /* Requests are usually written at once, and chunks of streamed
+         * bodies shouldn't wait for the ACK of the previous one */
+        if (endpoint->addr_family != AF_UNIX)
+            setsockopt(client->fd, IPPROTO_TCP, TCP_NODELAY, (int[]){1},
+                       sizeof(int));
+
+        /* Finishing the connection is left for the first write, which
+         * fails with EAGAIN until then. */
+        if (connect(client->fd, addr, addr_size) < 0 &&
+            errno != EINPROGRESS) {
+            int saved_errno = errno;
+
+            close(client->fd);
+            client->fd = -1;
+            errno = saved_errno;
+            return false;
+        }
+    }
+
+    coro_defer(request->conn->coro, release_client, client);
+    return true;
+}
+
+/* Returns 1 if everything has been written, 0 if the socket isn't ready
+ * for writing, or -errno. */
+static int client_write_pending(struct lwan_http_client *client)
+{
+    while (true) {
+        const bool has_out =
+            client->out_offset < lwan_strbuf_get_length(&client->out);
+        struct iovec vec[2];
+        int n_vec = 0;
+
+        if (has_out) {
+            vec[n_vec++] = (struct iovec){
+                .iov_base =
+                    lwan_strbuf_get_buffer(&client->out) + client->out_offset,
+                .iov_len =
+                    lwan_strbuf_get_length(&client->out) - client->out_offset,
+            };
+        }
+        if (client->body_offset < client->body.len) {
+            vec[n_vec++] = (struct iovec){
+                .iov_base = client->body.value + client->body_offset,
+                .iov_len = client->body.len - client->body_offset,
+            };
+        }
+        if (!n_vec) {
+            lwan_strbuf_reset(&client->out);
+            client->out_offset = 0;
+            client->body = (struct lwan_value){};
+            client->body_offset = 0;
+            return 1;
+        }
+
+        struct msghdr msg = {.msg_iov = vec, .msg_iovlen = (size_t)n_vec};
+        ssize_t written = sendmsg(client->fd, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (written < 0) {
+            switch (errno) {
+            case EINTR:
+                continue;
+            case EAGAIN:
+                return 0;
+            default:
+                return -errno;
+            }
+        }
+
+        size_t w = (size_t)written;
+        if (has_out) {
+            const size_t len = LWAN_MIN(w, vec[0].iov_len);
+
+            client->out_offset += len;
+            w -= len;
+        }
+        client->body_offset += w;
+    }
+}
+
+static int client_await(struct lwan_http_client *client,
+                        enum lwan_connection_coro_yield events)
+{
+    const struct lwan_await_fd fd = {.fd = client->fd, .events = events};
+    int r = lwan_request_await_any_of(client->request, &fd, 1,
+                                      client->timeout_ms);
+
+    return r < 0 ? r : 0;
+}
+
+static bool client_flush(struct lwan_http_client *client)
+{
+    while (true) {
+        int r = client_write_pending(client);
+
+        if (r > 0)
+            return true;
+        if (!r)
+            r = client_await(client, CONN_CORO_WANT_WRITE);
+        if (r < 0) {
+            client_fail(client, r);
+            return false;
+        }
+    }
+}
+
+static bool client_start(struct lwan_http_client *client,
+                         const char *method,
+                         const char *path,
+                         const struct lwan_key_value *headers,
+                         const struct lwan_value *body)
+{
+    if (client->state != CLIENT_NEW) {
+        client_fail(client, -EALREADY);
+        return false;
+    }
+
+    client->head_request = streq(method, "HEAD");
+
+    if (!build_request_head(client, method, path, headers, body)) {
+        client_fail(client, -ENOMEM);
+        return false;
+    }
+    if (!client_connect(client)) {
+        client_fail(client, -errno);
+        return false;
+    }
+    if (body)
+        client->body = *body;
+
+    client->state = CLIENT_SENDING;
+    return true;
+}
+
+bool lwan_http_client_send(struct lwan_http_client *client,
+                           const char *method,
+                           const char *path,
+                           const struct lwan_key_value *headers,
+                           const struct lwan_value *body)
+{
+    if (!client_start(client, method, path, headers, body))
+        return false;
+
+    /* Most of the time, the request fits in the socket buffer, so this
+     * won't have to be done while waiting for the response.  */
+    int r = client_write_pending(client);
+    if (r < 0) {
+        client_fail(client, r);
+        return false;
+    }
+    if (r > 0)
+        client->state = CLIENT_READING_HEAD;
+
+    return true;
+}
+
+bool lwan_http_client_send_head(struct lwan_http_client *client,
+                                const char *method,
+                                const char *path,
+                                const struct lwan_key_value *headers)
+{
+    client->streaming_body = true;
+
+    if (!client_start(client, method, path, headers, NULL))
+        return false;
+    if (!client_flush(client))
+        return false;
+
+    client->state = CLIENT_STREAMING_BODY;
+    return true;
+}
+
+bool lwan_http_client_send_chunk(struct lwan_http_client *client,
+                                 const void *data,
+                                 size_t len)
+{
+    if (client->state != CLIENT_STREAMING_BODY)
+        return false;
+
+    bool built = len ? lwan_strbuf_printf(&client->out, "%zx\r\n", len) &&
+                           lwan_strbuf_append_str(&client->out, data, len) &&
+                           lwan_strbuf_append_strz(&client->out, "\r\n")
+                     : lwan_strbuf_setz(&client->out, "0\r\n\r\n");
+    if (!built) {
+        client_fail(client, -ENOMEM);
+        return false;
+    }
+    if (!client_flush(client))
+        return false;
+
+    if (!len)
+        client->state = CLIENT_READING_HEAD;
+    return true;
+}
+
+static bool parse_header(struct lwan_http_client *client,
+                         struct lwan_key_value *header,
+                         char *begin,
+                         char *end)
+{
+    char *colon = memchr(begin, ':', (size_t)(end - begin));
+    char *value;
+
+    if (!colon)
+        return false;
+
+    *colon = '\0';
+    *(end - 2) = '\0';
+    for (value = colon + 1; *value == ' ' || *value == '\t'; value++)
+        ;
+
+    *header = (struct lwan_key_value){.key = begin, .value = value};
+
+    if (strcaseequal_neutral(begin, "Content-Length")) {
+        char *endptr;
+
+        errno = 0;
+        client->body_remaining = strtoull(value, &endptr, 10);
+        if (errno || endptr == value)
+            return false;
+        if (client->framing == BODY_UNTIL_EOF)
+            client->framing = BODY_CONTENT_LENGTH;
+    } else if (strcaseequal_neutral(begin, "Transfer-Encoding")) {
+        /* Chunked has to be the last encoding, and takes precedence over
+         * Content-Length */
+        if (strcasestr(value, "chunked")) {
+            client->framing = BODY_CHUNKED;
+            client->body_remaining = 0;
+        }
+    } else if (strcaseequal_neutral(begin, "Connection")) {
+        if (strcasestr(value, "close"))
+            client->keep_alive = false;
+    }
+
+    return true;
+}
+
+/* Returns 1 if a final response head has been parsed, 0 if it's an
+ * interim (1xx) response, or -errno. */
+static int parse_response_head(struct lwan_http_client *client,
+                               char *end_of_head)
+{
+    struct coro *coro = client->request->conn->coro;
+    char *header_start[N_HEADER_START];
+
+    /* The buffer is reused for the body, so keep a copy of the head. */
+    const size_t head_len = (size_t)(end_of_head - client->in.data) + 4;
+    char *head = coro_memdup(coro, client->in.data, head_len);
+    if (!head)
+        return -ENOMEM;
+    client->in.offset = head_len;
+
+    /* "HTTP/1.x NNN" */
+    if (head_len < 12 || strncmp(head, "HTTP/1.", 7) || head[8] != ' ' ||
+        !lwan_char_isdigit(head[9]) || !lwan_char_isdigit(head[10]) ||
+        !lwan_char_isdigit(head[11]))
+        return -EPROTO;
+
+    client->status =
+        (head[9] - '0') * 100 + (head[10] - '0') * 10 + (head[11] - '0');
+    if (client->status < 200)
+        return 0;
+
+    client->framing = BODY_UNTIL_EOF;
+    client->keep_alive = head[7] == '1';
+
+    /* lwan_find_headers() expects to start right before the first
+     * header, at the \n ending the status line.  */
+    char *status_line_end = memchr(head, '\n', head_len);
+    struct lwan_value header_buffer = {
+        .value = status_line_end,
+        .len = head_len - (size_t)(status_line_end - head),
+    };
+    char *ignored;
+    ssize_t n_headers = lwan_find_headers(header_start, &header_buffer, &ignored);
+    if (n_headers < 0)
+        return -EPROTO;
+
+    client->headers =
+        coro_malloc(coro, (size_t)n_headers * sizeof(*client->headers));
+    if (n_headers && !client->headers)
+        return -ENOMEM;
+    client->n_headers = (size_t)n_headers;
+
+    for (ssize_t i = 0; i < n_headers; i++) {
+        if (!parse_header(client, &client->headers[i], header_start[i],
+                          header_start[i + 1]))
+            return -EPROTO;
+    }
+
+    if (client->head_request || client->status == 204 ||
+        client->status == 304)
+        client->framing = BODY_NONE;
+    if (client->framing == BODY_UNTIL_EOF)
+        client->keep_alive = false;
+
+    if (client->framing == BODY_NONE ||
+        (client->framing == BODY_CONTENT_LENGTH && !client->body_remaining))
+        client->state = CLIENT_DONE;
+    else
+        client->state = CLIENT_READING_BODY;
+
+    return 1;
+}
+
+static void compact_buffer(struct lwan_http_client *client)
+{
+    if (client->in.offset) {
+        client->in.len -= client->in.offset;
+        memmove(client->in.data, client->in.data + client->in.offset,
+                client->in.len);
+        client->in.offset = 0;
+    }
+}
+
+/* Returns the number of bytes read (0 on EOF), -EAGAIN, or -errno. */
+static ssize_t client_recv(struct lwan_http_client *client)
+{
+    if (UNLIKELY(!client->in.data)) {
+        client->in.data =
+            coro_malloc(client->request->conn->coro, CLIENT_BUFFER_SIZE);
+        if (!client->in.data)
+            return -ENOMEM;
+    }
+
+    compact_buffer(client);
+    if (UNLIKELY(client->in.len == CLIENT_BUFFER_SIZE))
+        return -ENOBUFS;
+
+    while (true) {
+        ssize_t r = recv(client->fd, client->in.data + client->in.len,
+                         CLIENT_BUFFER_SIZE - client->in.len, MSG_DONTWAIT);
+
+        if (r >= 0) {
+            client->in.len += (size_t)r;
+            return r;
+        }
+        if (errno != EINTR)
+            return -errno;
+    }
+}
+
+/* Returns 1 if the response head has been read, 0 if the socket isn't
+ * ready for reading, or -errno. */
+static int client_read_head(struct lwan_http_client *client)
+{
+    while (true) {
+        char *data = client->in.data + client->in.offset;
+        const size_t pending = client->in.len - client->in.offset;
+        char *end_of_head;
+
+        if (data && (end_of_head = memmem(data, pending, "\r\n\r\n", 4))) {
+            int r = parse_response_head(client, end_of_head);
+
+            if (r)
+                return r;
+            continue;
+        }
+
+        ssize_t r = client_recv(client);
+        if (r == -EAGAIN)
+            return 0;
+        if (r == 0)
+            return -ECONNRESET;
+        if (r < 0)
+            return (int)r;
+    }
+}
+
+/* Advances the request as much as possible without blocking.  Returns the
+ * events to wait for, or CONN_CORO_YIELD if there's nothing left to do
+ * until the response body is read. */
+static enum lwan_connection_coro_yield
+client_progress(struct lwan_http_client *client)
+{
+    int r;
+
+    switch (client->state) {
+    case CLIENT_SENDING:
+        r = client_write_pending(client);
+        if (!r)
+            return CONN_CORO_WANT_WRITE;
+        if (r < 0)
+            break;
+        client->state = CLIENT_READING_HEAD;
+        /* Fallthrough */
+
+    case CLIENT_READING_HEAD:
+        r = client_read_head(client);
+        if (!r)
+            return CONN_CORO_WANT_READ;
+        if (r < 0)
+            break;
+        return CONN_CORO_YIELD;
+
+    case CLIENT_NEW:
+    case CLIENT_STREAMING_BODY:
+        r = -EINVAL;
+        break;
+
+    default:
+        return CONN_CORO_YIELD;
+    }
+
+    client_fail(client, r);
+    return CONN_CORO_YIELD;
+}
+
+size_t lwan_http_client_await_responses(struct lwan_http_client *clients[],
+                                        size_t n_clients)
+{
+    struct lwan_await_fd *fds;
+    struct lwan_http_client **waiting;
+    size_t n_failed = 0;
+
+    if (!n_clients)
+        return 0;
+
+    struct coro *coro = clients[0]->request->conn->coro;
+    fds = coro_malloc(coro, n_clients * sizeof(*fds));
+    waiting = coro_malloc(coro, n_clients * sizeof(*waiting));
+    if (!fds || !waiting) {
+        for (size_t i = 0; i < n_clients; i++) {
+            if (clients[i]->state < CLIENT_READING_BODY)
+                client_fail(clients[i], -ENOMEM);
+        }
+        return n_clients;
+    }
+
+    while (true) {
+        unsigned int timeout_ms = 0;
+        size_t n_waiting = 0;
+
+        for (size_t i = 0; i < n_clients; i++) {
+            struct lwan_http_client *client = clients[i];
+            enum lwan_connection_coro_yield events = client_progress(client);
+
+            if (events == CONN_CORO_YIELD)
+                continue;
+
+            fds[n_waiting] = (struct lwan_await_fd){
+                .fd = client->fd,
+                .events = events,
+            };
+            waiting[n_waiting++] = client;
+
+            if (client->timeout_ms &&
+                (!timeout_ms || client->timeout_ms < timeout_ms))
+                timeout_ms = client->timeout_ms;
+        }
+
+        if (!n_waiting)
+            break;
+
+        int r = lwan_request_await_any_of(clients[0]->request, fds, n_waiting,
+                                          timeout_ms);
+        if (r >= 0)
+            continue;
+
+        /* Only the clients with the shortest timeout give up; others
+         * will be awaited again */
+        for (size_t i = 0; i < n_waiting; i++) {
+            if (r != -ETIMEDOUT || waiting[i]->timeout_ms == timeout_ms)
+                client_fail(waiting[i], r);
+        }
+    }
+
+    for (size_t i = 0; i < n_clients; i++) {
+        if (clients[i]->state == CLIENT_FAILED)
+            n_failed++;
+    }
+
+    return n_failed;
+}
+
+int lwan_http_client_get_status(struct lwan_http_client *client)
+{
+    if (client->state < CLIENT_READING_BODY)
+        lwan_http_client_await_responses(&client, 1);
+
+    if (client->state == CLIENT_FAILED && !client->status)
+        return client->error;
+
+    return client->status;
+}
+
+const char *lwan_http_client_get_header(const struct lwan_http_client *client,
+                                        const char *name)
+{
+    for (size_t i = 0; i < client->n_headers; i++) {
+        if (strcaseequal_neutral(client->headers[i].key, name))
+            return client->headers[i].value;
+    }
+
+    return NULL;
+}
+
+/* Returns the number of bytes read (0 on EOF), or -errno. */
+static ssize_t client_fill(struct lwan_http_client *client)
+{
+    while (true) {
+        ssize_t r = client_recv(client);
+
+        if (r != -EAGAIN)
+            return r;
+
+        int awaited = client_await(client, CONN_CORO_WANT_READ);
+        if (awaited < 0)
+            return awaited;
+    }
+}
+
+static inline size_t pending(const struct lwan_http_client *client)
+{
+    return client->in.len - client->in.offset;
+}
+
+static char *client_read_line(struct lwan_http_client *client, ssize_t *error)
+{
+    char *crlf;
+
+    while (!(crlf = memmem(client->in.data + client->in.offset,
+                           pending(client), "\r\n", 2))) {
+        ssize_t r = client_fill(client);
+
+        if (r <= 0) {
+            *error = r ? r : -ECONNRESET;
+            return NULL;
+        }
+    }
+
+    char *line = client->in.data + client->in.offset;
+    *crlf = '\0';
+    client->in.offset = (size_t)(crlf - client->in.data) + 2;
+    return line;
+}
+
+/* Reads the next chunk size, and the trailers after the last chunk.
+ * Returns 1 if there's a chunk to read, 0 at the end of the body, or
+ * -errno. */
+static ssize_t next_chunk(struct lwan_http_client *client)
+{
+    ssize_t error = 0;
+    char *line;
+
+    if (client->chunk_needs_crlf) {
+        line = client_read_line(client, &error);
+        if (!line)
+            return error;
+        if (*line)
+            return -EPROTO;
+        client->chunk_needs_crlf = false;
+    }
+
+    line = client_read_line(client, &error);
+    if (!line)
+        return error;
+
+    char *endptr;
+    errno = 0;
+    client->body_remaining = strtoull(line, &endptr, 16);
+    if (errno || endptr == line)
+        return -EPROTO;
+
+    if (client->body_remaining) {
+        client->chunk_needs_crlf = true;
+        return 1;
+    }
+
+    /* Trailers, if any, are dropped */
+    while ((line = client_read_line(client, &error))) {
+        if (!*line)
+            return 0;
+    }
+    return error;
+}
+
+ssize_t lwan_http_client_read_body(struct lwan_http_client *client,
+                                   void *buffer,
+                                   size_t len)
+{
+    ssize_t r;
+
+    if (client->state < CLIENT_READING_BODY) {
+        r = lwan_http_client_get_status(client);
+        if (r < 0)
+            return r;
+    }
+
+    if (client->state == CLIENT_FAILED)
+        return client->error;
+    if (client->state == CLIENT_DONE || !len)
+        return 0;
+
+    switch (client->framing) {
+    case BODY_NONE:
+        client->state = CLIENT_DONE;
+        return 0;
+
+    case BODY_CHUNKED:
+        if (!client->body_remaining) {
+            r = next_chunk(client);
+            if (r <= 0)
+                goto out;
+        }
+        /* Fallthrough */
+
+    case BODY_CONTENT_LENGTH:
+        if (!pending(client)) {
+            r = client_fill(client);
+            if (r <= 0) {
+                if (!r)
+                    r = -ECONNRESET;
+                goto out;
+            }
+        }
+        len = LWAN_MIN(len, LWAN_MIN(pending(client), client->body_remaining));
+        client->body_remaining -= len;
+        break;
+
+    case BODY_UNTIL_EOF:
+        if (!pending(client)) {
+            r = client_fill(client);
+            if (r <= 0)
+                goto out;
+        }
+        len = LWAN_MIN(len, pending(client));
+        break;
+    }
+
+    memcpy(buffer, client->in.data + client->in.offset, len);
+    client->in.offset += len;
+
+    if (client->framing == BODY_CONTENT_LENGTH && !client->body_remaining)
+        client->state = CLIENT_DONE;
+
+    return (ssize_t)len;
+
+out:
+    if (r < 0)
+        client_fail(client, (int)r);
+    else
+        client->state = CLIENT_DONE;
+    return r;
+}
+
+bool lwan_http_client_read_body_all(struct lwan_http_client *client,
+                                    struct lwan_strbuf *strbuf,
+                                    size_t max_len)
+{
+    size_t total = 0;
+
+    while (true) {
+        char buffer[4096];
+        ssize_t r = lwan_http_client_read_body(client, buffer, sizeof(buffer));
+
+        if (r == 0)
+            return true;
+        if (r < 0)
+            return false;
+
+        total += (size_t)r;
+        if (total > max_len) {
+            client_fail(client, -EFBIG);
+            return false;
+        }
+        if (!lwan_strbuf_append_str(strbuf, buffer, (size_t)r)) {
+            client_fail(client, -ENOMEM);
+            return false;
+        }
+    }
+}
@@ -0,0 +1,103 @@
+/*
+ * lwan - web server
+ * Copyright (c) 2024 L. A. F. Pereira <l@tia.mat.br>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#pragma once
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+#include "lwan.h"
+
+/* Outbound HTTP/1.1 client for request handlers.
+ *
+ * Endpoints with a numeric address are parsed once, when they're created
+ * (usually while a handler or module is being initialized); host names are
+ * resolved with lwan_request_resolve() whenever a new connection is made.
+ * Endpoints keep a pool of idle keep-alive connections per I/O thread.  Clients are allocated in the
+ * coroutine of the request using them, and perform a single request each;
+ * their connection goes back to the pool once the request is done with
+ * them, if the response has been read in full.
+ *
+ * Several requests can be in flight at once: send them with
+ * lwan_http_client_send() on different clients, then wait for all of
+ * their responses with lwan_http_client_await_responses().  Timeouts are
+ * for inactivity: a client fails with -ETIMEDOUT if it can't make any
+ * progress for that long. */
+
+struct lwan_http_client_endpoint;
+struct lwan_http_client;
+
+/* @address is either "host:port" or a path to a UNIX domain socket */
+struct lwan_http_client_endpoint *
+lwan_http_client_endpoint_new(const char *address);
+void lwan_http_client_endpoint_free(struct lwan_http_client_endpoint *endpoint);
+
+struct lwan_http_client *
+lwan_http_client_new(struct lwan_request *request,
+                     struct lwan_http_client_endpoint *endpoint,
+                     unsigned int timeout_ms);
+
+/* @headers is terminated by an element with a NULL key, and might be NULL.
+ * Host and Content-Length are added, if not present.  @body, if not NULL,
+ * must stay valid until the response head has been read.  No I/O is
+ * performed here other than trying to write the request right away; the
+ * rest is done while waiting for responses. */
+bool lwan_http_client_send(struct lwan_http_client *client,
+                           const char *method,
+                           const char *path,
+                           const struct lwan_key_value *headers,
+                           const struct lwan_value *body);
+
+/* Same as above, but the request body is sent afterwards, with
+ * lwan_http_client_send_chunk(), using the chunked transfer encoding.
+ * A chunk with no data ends the body. */
+bool lwan_http_client_send_head(struct lwan_http_client *client,
+                                const char *method,
+                                const char *path,
+                                const struct lwan_key_value *headers);
+bool lwan_http_client_send_chunk(struct lwan_http_client *client,
+                                 const void *data,
+                                 size_t len);
+
+/* Waits until the response heads of all clients have been read, or until
+ * they failed.  Returns the number of clients that failed. */
+size_t lwan_http_client_await_responses(struct lwan_http_client *clients[],
+                                        size_t n_clients);
+
+/* Status code of the response, or -errno if the request failed.  Waits
+ * for the response head if it hasn't been read yet. */
+int lwan_http_client_get_status(struct lwan_http_client *client);
+const char *lwan_http_client_get_header(const struct lwan_http_client *client,
+                                        const char *name);
+
+/* Reads up to @len bytes of the response body, decoding it if it's
+ * chunked.  Returns 0 after the whole body has been read, or -errno. */
+ssize_t lwan_http_client_read_body(struct lwan_http_client *client,
+                                   void *buffer,
+                                   size_t len);
+/* Appends the whole response body to @strbuf, failing if it's larger than
+ * @max_len bytes. */
+bool lwan_http_client_read_body_all(struct lwan_http_client *client,
+                                    struct lwan_strbuf *strbuf,
+                                    size_t max_len);
+
+#if defined(__cplusplus)
+}
+#endif
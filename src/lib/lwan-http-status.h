@@ -3,10 +3,16 @@
 #define FOR_EACH_HTTP_STATUS(X)                                                                                                             \
     X(SWITCHING_PROTOCOLS, 101, "Switching protocols", "Protocol is switching over from HTTP")                                              \
     X(OK, 200, "OK", "Success")                                                                                                             \
+    X(CREATED, 201, "Created", "The request succeeded and a new resource was created")                                                      \
+    X(ACCEPTED, 202, "Accepted", "The request has been accepted for processing")                                                            \
+    X(NO_CONTENT, 204, "No content", "The request succeeded and there is no content to send")                                               \
     X(PARTIAL_CONTENT, 206, "Partial content", "Delivering part of requested resource")                                                     \
     X(MOVED_PERMANENTLY, 301, "Moved permanently", "This content has moved to another place")                                               \
+    X(FOUND, 302, "Found", "This content can be found at a different location")                                                             \
+    X(SEE_OTHER, 303, "See other", "The response to this request can be found at a different location")                                     \
     X(NOT_MODIFIED, 304, "Not modified", "The content has not changed since previous request")                                              \
     X(TEMPORARY_REDIRECT, 307, "Temporary Redirect", "This content can be temporarily found at a different location")                       \
+    X(PERMANENT_REDIRECT, 308, "Permanent redirect", "This content has permanently moved to a different location")                          \
     X(BAD_REQUEST, 400, "Bad request", "The client has issued a bad request")                                                               \
     X(NOT_AUTHORIZED, 401, "Not authorized", "Client has no authorization to access this resource")                                         \
     X(FORBIDDEN, 403, "Forbidden", "Access to this resource has been denied")                                                               \
@@ -14,12 +20,18 @@
     X(NOT_ALLOWED, 405, "Not allowed", "The requested method is not allowed by this server")                                                \
     X(NOT_ACCEPTABLE, 406, "Not acceptable", "No suitable accepted-encoding header provided")                                               \
     X(TIMEOUT, 408, "Request timeout", "Client did not produce a request within expected timeframe")                                        \
+    X(CONFLICT, 409, "Conflict", "The request conflicts with the current state of the resource")                                            \
+    X(GONE, 410, "Gone", "The requested resource is no longer available on this server")                                                    \
+    X(PRECONDITION_FAILED, 412, "Precondition failed", "A condition in the request headers did not hold for this resource")                 \
     X(TOO_LARGE, 413, "Request too large", "The request entity is too large")                                                               \
     X(RANGE_UNSATISFIABLE, 416, "Requested range unsatisfiable", "The server can't supply the requested portion of the requested resource") \
     X(I_AM_A_TEAPOT, 418, "I'm a teapot", "Client requested to brew coffee but device is a teapot")                                         \
     X(CLIENT_TOO_HIGH, 420, "Client too high", "Client is too high to make a request")                                                      \
     X(UNPROCESSABLE_CONTENT, 422, "Unprocessable content", "Request was understood by the server but it can't process the instructions")    \
+    X(TOO_MANY_REQUESTS, 429, "Too many requests", "The client has sent too many requests in a given amount of time")                       \
     X(INTERNAL_ERROR, 500, "Internal server error", "The server encountered an internal error that couldn't be recovered from")             \
     X(NOT_IMPLEMENTED, 501, "Not implemented", "Server lacks the ability to fulfil the request")                                            \
+    X(BAD_GATEWAY, 502, "Bad gateway", "The server received an invalid response from an upstream server")                                   \
     X(UNAVAILABLE, 503, "Service unavailable", "The server is either overloaded or down for maintenance")                                   \
+    X(GATEWAY_TIMEOUT, 504, "Gateway timeout", "The server did not receive a timely response from an upstream server")                      \
     X(SERVER_TOO_HIGH, 520, "Server too high", "The server is too high to answer the request")
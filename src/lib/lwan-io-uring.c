@@ -0,0 +1,923 @@
+/*
+ * lwan - web server
+ * Copyright (c) 2024 L. A. F. Pereira <l@tia.mat.br>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#define _GNU_SOURCE
+#include <assert.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <linux/io_uring.h>
+
+#include "lwan-private.h"
+#include "lwan-io-uring.h"
+
+/* Each file descriptor known to a ring has one byte of state: the events
+ * it's interested in, whether it's registered (i.e. EPOLL_CTL_ADD has been
+ * called without a matching EPOLL_CTL_DEL) and whether there's a poll
+ * request in flight.  A 3-bit generation number is also kept there and is
+ * stored in the low bits of the user_data of every poll request; whenever a
+ * file descriptor is removed, the generation is bumped, so completions of
+ * polls that were in flight when the file descriptor was closed (and,
+ * possibly, reused for another connection) are ignored.  Generation 0 is
+ * never used for polls: it's the tag for requests whose completion we don't
+ * care about (removals, updates, and closes). */
+enum {
+    POLL_STATE_IN = 1 << 0,
+    POLL_STATE_OUT = 1 << 1,
+    POLL_STATE_RDHUP = 1 << 2,
+    POLL_STATE_EVENTS_MASK = POLL_STATE_IN | POLL_STATE_OUT | POLL_STATE_RDHUP,
+
+    POLL_STATE_GEN_SHIFT = 3,
+    POLL_STATE_GEN_MASK = 7 << POLL_STATE_GEN_SHIFT,
+
+    POLL_STATE_REGISTERED = 1 << 6,
+    POLL_STATE_ARMED = 1 << 7,
+};
+
+#define USER_DATA_TAG_MASK ((uint64_t)31)
+#define USER_DATA_ACCEPT_TAG ((uint64_t)8)
+#define USER_DATA_IO_TAG ((uint64_t)16)
+
+/* Reads and writes queued by lwan_io_uring_queue_io(), at most one per file
+ * descriptor.  Their completions are tagged with the generation of the file
+ * descriptor, like polls are; if it's removed while one is still queued, the
+ * request is turned into a no-op instead, as its buffer belongs to a
+ * coroutine that's about to go away. */
+enum {
+    IO_STATE_IDLE,
+    IO_STATE_QUEUED,
+    IO_STATE_DONE,
+};
+
+struct lwan_io_uring_io {
+    unsigned int sqe; /* Position in the submission queue */
+    int res;
+    uint8_t state;
+};
+
+/* Listening sockets use multishot accept requests: every completion is a
+ * new file descriptor, which is queued here until the worker thread gets
+ * to handle the listener event.  If the kernel doesn't support multishot
+ * accept, the listener falls back to being polled like everything else,
+ * and connections are accepted with accept4(). */
+struct lwan_io_uring_listener {
+    struct lwan_connection *conn;
+    int fd;
+
+    int *accepted;
+    unsigned int n_accepted;
+    unsigned int pos;
+
+    bool needs_rearm;
+    bool has_accepted;
+    bool use_poll;
+    bool stopped;
+};
+
+struct lwan_io_uring {
+    int fd;
+
+    struct {
+        unsigned int *head;
+        unsigned int *tail;
+        unsigned int mask;
+        unsigned int entries;
+        unsigned int local_tail;
+        struct io_uring_sqe *sqes;
+    } sq;
+
+    struct {
+        unsigned int *head;
+        unsigned int *tail;
+        unsigned int mask;
+        struct io_uring_cqe *cqes;
+    } cq;
+
+    void *rings;
+    size_t rings_size;
+    size_t sqes_size;
+
+    struct lwan_connection *conns;
+    uint8_t *poll_state;
+    struct lwan_io_uring_io *io;
+    unsigned int n_poll_state;
+
+    /* Connections that had a completion reaped by the last call to
+     * lwan_io_uring_wait(); they're rearmed (if they're still registered)
+     * right before the next submission, after the event loop had the
+     * chance to change their interest or remove them. */
+    struct lwan_connection **rearm;
+    unsigned int n_rearm;
+    unsigned int max_rearm;
+
+    struct lwan_io_uring_listener listeners[2];
+    unsigned int n_listeners;
+};
+
+static inline int
+sys_io_uring_setup(unsigned int entries, struct io_uring_params *params)
+{
+    return (int)syscall(__NR_io_uring_setup, entries, params);
+}
+
+static inline int sys_io_uring_enter(int fd,
+                                     unsigned int to_submit,
+                                     unsigned int min_complete,
+                                     unsigned int flags,
+                                     const void *arg,
+                                     size_t arg_size)
+{
+    return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete,
+                        flags, arg, arg_size);
+}
+
+static int setup_ring(unsigned int entries, struct io_uring_params *params)
+{
+    static const unsigned int flags[] = {
+#if defined(IORING_SETUP_COOP_TASKRUN) && defined(IORING_SETUP_SUBMIT_ALL)
+        IORING_SETUP_COOP_TASKRUN | IORING_SETUP_SUBMIT_ALL,
+#endif
+        0,
+    };
+
+    for (size_t i = 0; i < N_ELEMENTS(flags); i++) {
+        *params = (struct io_uring_params){.flags = flags[i]};
+
+        int fd = sys_io_uring_setup(entries, params);
+        if (fd >= 0 || errno != EINVAL)
+            return fd;
+    }
+
+    return -1;
+}
+
+struct lwan_io_uring *lwan_io_uring_new(const struct lwan *l,
+                                        unsigned int entries)
+{
+    const unsigned int required_features =
+        IORING_FEAT_SINGLE_MMAP | IORING_FEAT_NODROP | IORING_FEAT_EXT_ARG;
+    struct io_uring_params params;
+    struct lwan_io_uring *ring;
+
+    ring = calloc(1, sizeof(*ring));
+    if (!ring)
+        return NULL;
+
+    ring->fd = setup_ring(entries, &params);
+    if (ring->fd < 0) {
+        lwan_status_perror("Could not create io_uring");
+        goto free_ring;
+    }
+
+    if ((params.features & required_features) != required_features) {
+        lwan_status_warning("Kernel lacks required io_uring features");
+        goto close_fd;
+    }
+
+    ring->rings_size =
+        LWAN_MAX(params.sq_off.array + params.sq_entries * sizeof(unsigned int),
+                 params.cq_off.cqes +
+                     params.cq_entries * sizeof(struct io_uring_cqe));
+    ring->rings = mmap(NULL, ring->rings_size, PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    if (ring->rings == MAP_FAILED) {
+        lwan_status_perror("Could not map io_uring rings");
+        goto close_fd;
+    }
+
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sq.sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->sq.sqes == MAP_FAILED) {
+        lwan_status_perror("Could not map io_uring submission queue entries");
+        goto unmap_rings;
+    }
+
+    char *rings = ring->rings;
+
+    ring->sq.head = (unsigned int *)(rings + params.sq_off.head);
+    ring->sq.tail = (unsigned int *)(rings + params.sq_off.tail);
+    ring->sq.mask = *(unsigned int *)(rings + params.sq_off.ring_mask);
+    ring->sq.entries = params.sq_entries;
+    ring->sq.local_tail = *ring->sq.tail;
+
+    /* Submission queue entries are always used in order, so the
+     * indirection array is set up once as an identity mapping. */
+    unsigned int *sq_array = (unsigned int *)(rings + params.sq_off.array);
+    for (unsigned int i = 0; i < params.sq_entries; i++)
+        sq_array[i] = i;
+
+    ring->cq.head = (unsigned int *)(rings + params.cq_off.head);
+    ring->cq.tail = (unsigned int *)(rings + params.cq_off.tail);
+    ring->cq.mask = *(unsigned int *)(rings + params.cq_off.ring_mask);
+    ring->cq.cqes = (struct io_uring_cqe *)(rings + params.cq_off.cqes);
+
+    ring->conns = l->conns;
+    ring->n_poll_state = l->thread.max_fd * l->thread.count;
+    ring->poll_state = calloc(ring->n_poll_state, sizeof(uint8_t));
+    if (!ring->poll_state)
+        goto unmap_sqes;
+
+    ring->io = calloc(ring->n_poll_state, sizeof(*ring->io));
+    if (!ring->io)
+        goto free_poll_state;
+
+    ring->max_rearm = entries;
+    ring->rearm = calloc(entries, sizeof(*ring->rearm));
+    if (!ring->rearm)
+        goto free_io;
+
+    return ring;
+
+free_io:
+    free(ring->io);
+free_poll_state:
+    free(ring->poll_state);
+unmap_sqes:
+    munmap(ring->sq.sqes, ring->sqes_size);
+unmap_rings:
+    munmap(ring->rings, ring->rings_size);
+close_fd:
+    close(ring->fd);
+free_ring:
+    free(ring);
+    return NULL;
+}
+
+void lwan_io_uring_close(struct lwan_io_uring *ring)
+{
+    int fd = ring->fd;
+
+    ring->fd = -1;
+    close(fd);
+}
+
+void lwan_io_uring_free(struct lwan_io_uring *ring)
+{
+    if (!ring)
+        return;
+
+    if (ring->fd >= 0)
+        close(ring->fd);
+
+    munmap(ring->sq.sqes, ring->sqes_size);
+    munmap(ring->rings, ring->rings_size);
+    free(ring->poll_state);
+    free(ring->io);
+    free(ring->rearm);
+    for (unsigned int i = 0; i < ring->n_listeners; i++)
+        free(ring->listeners[i].accepted);
+    free(ring);
+}
+
+static inline unsigned int pending_submissions(const struct lwan_io_uring *ring)
+{
+    return ring->sq.local_tail - __atomic_load_n(ring->sq.head, __ATOMIC_ACQUIRE);
+}
+
+static int submit(struct lwan_io_uring *ring,
+                  unsigned int min_complete,
+                  int timeout)
+{
+    struct __kernel_timespec ts = {
+        .tv_sec = timeout / 1000,
+        .tv_nsec = (timeout % 1000) * 1000000,
+    };
+    struct io_uring_getevents_arg arg = {
+        .ts = timeout < 0 ? 0 : (uint64_t)(uintptr_t)&ts,
+    };
+    unsigned int flags = 0;
+
+    __atomic_store_n(ring->sq.tail, ring->sq.local_tail, __ATOMIC_RELEASE);
+
+    if (min_complete)
+        flags |= IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG;
+
+    int r = sys_io_uring_enter(ring->fd, pending_submissions(ring),
+                               min_complete, flags, &arg, sizeof(arg));
+    if (LIKELY(r >= 0))
+        return 0;
+
+    switch (errno) {
+    case ETIME:
+    case EINTR:
+    case EAGAIN:
+    case EBUSY:
+        /* Timed out, interrupted by a signal, or the kernel is still
+         * flushing overflown completions: either way, whatever is in
+         * the completion queue can be reaped. */
+        return 0;
+    default:
+        return -1;
+    }
+}
+
+static struct io_uring_sqe *get_sqe(struct lwan_io_uring *ring)
+{
+    if (UNLIKELY(pending_submissions(ring) >= ring->sq.entries)) {
+        if (submit(ring, 0, 0) < 0)
+            return NULL;
+        if (pending_submissions(ring) >= ring->sq.entries) {
+            errno = EBUSY;
+            return NULL;
+        }
+    }
+
+    struct io_uring_sqe *sqe =
+        &ring->sq.sqes[ring->sq.local_tail++ & ring->sq.mask];
+    memset(sqe, 0, sizeof(*sqe));
+    return sqe;
+}
+
+static inline unsigned int poll_state_gen(uint8_t state)
+{
+    return (state & POLL_STATE_GEN_MASK) >> POLL_STATE_GEN_SHIFT;
+}
+
+static inline uint8_t poll_state_next_gen(uint8_t state)
+{
+    unsigned int gen = poll_state_gen(state) % 7 + 1;
+    return (uint8_t)(gen << POLL_STATE_GEN_SHIFT);
+}
+
+static inline uint8_t poll_state_from_epoll_events(uint32_t events)
+{
+    uint8_t state = 0;
+
+    if (events & EPOLLIN)
+        state |= POLL_STATE_IN;
+    if (events & EPOLLOUT)
+        state |= POLL_STATE_OUT;
+    if (events & EPOLLRDHUP)
+        state |= POLL_STATE_RDHUP;
+
+    return state;
+}
+
+static inline uint32_t poll_state_to_epoll_events(uint8_t state)
+{
+    uint32_t events = EPOLLERR | EPOLLHUP;
+
+    if (state & POLL_STATE_IN)
+        events |= EPOLLIN;
+    if (state & POLL_STATE_OUT)
+        events |= EPOLLOUT;
+    if (state & POLL_STATE_RDHUP)
+        events |= EPOLLRDHUP;
+
+    return events;
+}
+
+static inline uint64_t poll_user_data(const struct lwan_connection *conn,
+                                      uint8_t state)
+{
+    return (uint64_t)(uintptr_t)conn | poll_state_gen(state);
+}
+
+static int queue_poll_add(struct lwan_io_uring *ring,
+                          struct lwan_connection *conn,
+                          int fd)
+{
+    struct io_uring_sqe *sqe = get_sqe(ring);
+    uint8_t *state = &ring->poll_state[fd];
+
+    if (UNLIKELY(!sqe))
+        return -1;
+
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fd;
+    sqe->poll32_events = poll_state_to_epoll_events(*state);
+    sqe->user_data = poll_user_data(conn, *state);
+
+    *state |= POLL_STATE_ARMED;
+    return 0;
+}
+
+static int queue_poll_remove(struct lwan_io_uring *ring,
+                             const struct lwan_connection *conn,
+                             uint8_t state,
+                             bool update_events)
+{
+    struct io_uring_sqe *sqe = get_sqe(ring);
+
+    if (UNLIKELY(!sqe))
+        return -1;
+
+    sqe->opcode = IORING_OP_POLL_REMOVE;
+    sqe->fd = -1;
+    sqe->addr = poll_user_data(conn, state);
+    if (update_events) {
+        sqe->len = IORING_POLL_UPDATE_EVENTS;
+        sqe->poll32_events = poll_state_to_epoll_events(state);
+    }
+    sqe->user_data = 0;
+
+    return 0;
+}
+
+static void cancel_io(struct lwan_io_uring *ring, int fd)
+{
+    struct lwan_io_uring_io *io = &ring->io[fd];
+
+    if (io->state != IO_STATE_QUEUED)
+        return;
+
+    /* If it hasn't been submitted yet, the kernel must never see it; if it
+     * has, it's done already (see lwan_io_uring_queue_io()), and its
+     * completion will be ignored as the generation is about to change. */
+    if (ring->sq.local_tail - io->sqe <= pending_submissions(ring)) {
+        struct io_uring_sqe *sqe = &ring->sq.sqes[io->sqe & ring->sq.mask];
+
+        memset(sqe, 0, sizeof(*sqe));
+        sqe->opcode = IORING_OP_NOP;
+    }
+
+    io->res = -ECANCELED;
+    io->state = IO_STATE_DONE;
+}
+
+int lwan_io_uring_ctl(struct lwan_io_uring *ring,
+                      int op,
+                      int fd,
+                      const struct epoll_event *event)
+{
+    struct lwan_connection *conn;
+    uint8_t *state;
+
+    if (UNLIKELY(fd < 0 || (unsigned int)fd >= ring->n_poll_state)) {
+        errno = EBADF;
+        return -1;
+    }
+
+    conn = &ring->conns[fd];
+    state = &ring->poll_state[fd];
+
+    switch (op) {
+    case EPOLL_CTL_ADD:
+        assert(event->data.ptr == conn);
+
+        if (UNLIKELY(*state & POLL_STATE_REGISTERED)) {
+            errno = EEXIST;
+            return -1;
+        }
+
+        *state = poll_state_next_gen(*state) | POLL_STATE_REGISTERED |
+                 poll_state_from_epoll_events(event->events);
+        if (UNLIKELY(queue_poll_add(ring, conn, fd) < 0)) {
+            *state &= (uint8_t)~POLL_STATE_REGISTERED;
+            return -1;
+        }
+        return 0;
+
+    case EPOLL_CTL_MOD:
+        assert(event->data.ptr == conn);
+
+        if (UNLIKELY(!(*state & POLL_STATE_REGISTERED))) {
+            errno = ENOENT;
+            return -1;
+        }
+
+        *state = (uint8_t)((*state & ~POLL_STATE_EVENTS_MASK) |
+                           poll_state_from_epoll_events(event->events));
+
+        /* If there's no poll in flight, this connection had a completion
+         * reaped in this iteration of the event loop and will be rearmed
+         * with the new interest before the next submission. */
+        if (*state & POLL_STATE_ARMED)
+            return queue_poll_remove(ring, conn, *state, true);
+        return 0;
+
+    case EPOLL_CTL_DEL:
+        if (UNLIKELY(!(*state & POLL_STATE_REGISTERED))) {
+            errno = ENOENT;
+            return -1;
+        }
+
+        cancel_io(ring, fd);
+
+        if (*state & POLL_STATE_ARMED) {
+            /* Failing to queue the removal isn't fatal: the generation
+             * number is bumped anyway so its completion is ignored. */
+            (void)queue_poll_remove(ring, conn, *state, false);
+        }
+
+        *state = poll_state_next_gen(*state);
+        return 0;
+
+    default:
+        errno = EINVAL;
+        return -1;
+    }
+}
+
+int lwan_io_uring_close_fd(struct lwan_io_uring *ring, int fd)
+{
+    struct io_uring_sqe *sqe = get_sqe(ring);
+
+    if (UNLIKELY(!sqe))
+        return -1;
+
+    sqe->opcode = IORING_OP_CLOSE;
+    sqe->fd = fd;
+    sqe->user_data = 0;
+
+    return 0;
+}
+
+int lwan_io_uring_queue_io(struct lwan_io_uring *ring,
+                           int fd,
+                           enum lwan_io_uring_op op,
+                           void *ptr,
+                           size_t len,
+                           int flags)
+{
+    struct io_uring_sqe *sqe;
+    uint8_t state;
+
+    if (UNLIKELY(fd < 0 || (unsigned int)fd >= ring->n_poll_state)) {
+        errno = EBADF;
+        return -1;
+    }
+
+    /* Completions are told apart by the generation of the file descriptor,
+     * which is only meaningful while it's registered. */
+    state = ring->poll_state[fd];
+    if (UNLIKELY(!(state & POLL_STATE_REGISTERED))) {
+        errno = ENOENT;
+        return -1;
+    }
+
+    assert(ring->io[fd].state != IO_STATE_QUEUED);
+
+    sqe = get_sqe(ring);
+    if (UNLIKELY(!sqe))
+        return -1;
+
+    switch (op) {
+    case LWAN_IO_URING_RECV:
+        sqe->opcode = IORING_OP_RECV;
+        sqe->len = (uint32_t)LWAN_MIN(len, (size_t)INT_MAX);
+        break;
+    case LWAN_IO_URING_SEND:
+        sqe->opcode = IORING_OP_SEND;
+        sqe->len = (uint32_t)LWAN_MIN(len, (size_t)INT_MAX);
+        break;
+    case LWAN_IO_URING_SENDMSG:
+        sqe->opcode = IORING_OP_SENDMSG;
+        sqe->len = 1;
+        break;
+    }
+
+    sqe->fd = fd;
+    sqe->addr = (uint64_t)(uintptr_t)ptr;
+    /* Never wait for the socket to be ready: fail with EAGAIN instead, like
+     * the system calls do on non-blocking sockets.  This way, requests are
+     * done by the time the submission returns, and won't use the buffers of
+     * a coroutine after its connection has been closed. */
+    sqe->msg_flags = (uint32_t)(flags | MSG_DONTWAIT);
+    sqe->user_data = (uint64_t)(uintptr_t)&ring->conns[fd] | USER_DATA_IO_TAG |
+                     poll_state_gen(state);
+
+    ring->io[fd] = (struct lwan_io_uring_io){
+        .sqe = ring->sq.local_tail - 1,
+        .state = IO_STATE_QUEUED,
+    };
+
+    return 0;
+}
+
+bool lwan_io_uring_take_io_result(struct lwan_io_uring *ring, int fd, int *res)
+{
+    struct lwan_io_uring_io *io = &ring->io[fd];
+
+    if (io->state != IO_STATE_DONE)
+        return false;
+
+    *res = io->res;
+    io->state = IO_STATE_IDLE;
+    return true;
+}
+
+static int queue_accept(struct lwan_io_uring *ring,
+                        struct lwan_io_uring_listener *listener)
+{
+    struct io_uring_sqe *sqe = get_sqe(ring);
+
+    if (UNLIKELY(!sqe))
+        return -1;
+
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = listener->fd;
+    sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->user_data = (uint64_t)(uintptr_t)listener->conn | USER_DATA_ACCEPT_TAG;
+
+    listener->needs_rearm = false;
+    return 0;
+}
+
+int lwan_io_uring_watch_listener(struct lwan_io_uring *ring,
+                                 int fd,
+                                 struct lwan_connection *conn)
+{
+    struct lwan_io_uring_listener *listener;
+
+    if (UNLIKELY(ring->n_listeners == N_ELEMENTS(ring->listeners))) {
+        errno = ENOSPC;
+        return -1;
+    }
+
+    listener = &ring->listeners[ring->n_listeners];
+    *listener = (struct lwan_io_uring_listener){
+        .conn = conn,
+        .fd = fd,
+        .accepted = calloc(ring->max_rearm, sizeof(int)),
+    };
+    if (UNLIKELY(!listener->accepted))
+        return -1;
+
+    if (UNLIKELY(queue_accept(ring, listener) < 0)) {
+        free(listener->accepted);
+        return -1;
+    }
+
+    ring->n_listeners++;
+    return 0;
+}
+
+static struct lwan_io_uring_listener *
+find_listener(struct lwan_io_uring *ring, const struct lwan_connection *conn)
+{
+    for (unsigned int i = 0; i < ring->n_listeners; i++) {
+        if (ring->listeners[i].conn == conn)
+            return &ring->listeners[i];
+    }
+
+    return NULL;
+}
+
+int lwan_io_uring_accept(struct lwan_io_uring *ring,
+                         const struct lwan_connection *conn)
+{
+    struct lwan_io_uring_listener *listener = find_listener(ring, conn);
+
+    if (UNLIKELY(!listener)) {
+        errno = EBADF;
+        return -1;
+    }
+
+    if (UNLIKELY(listener->use_poll))
+        return accept4(listener->fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+
+    if (listener->pos == listener->n_accepted) {
+        listener->pos = listener->n_accepted = 0;
+        errno = EAGAIN;
+        return -1;
+    }
+
+    int fd = listener->accepted[listener->pos++];
+    if (UNLIKELY(fd < 0)) {
+        errno = -fd;
+        return -1;
+    }
+
+    return fd;
+}
+
+int lwan_io_uring_unwatch_listener(struct lwan_io_uring *ring,
+                                   const struct lwan_connection *conn)
+{
+    struct lwan_io_uring_listener *listener = find_listener(ring, conn);
+    struct io_uring_sqe *sqe;
+
+    if (UNLIKELY(!listener)) {
+        errno = EBADF;
+        return -1;
+    }
+
+    listener->stopped = true;
+    listener->needs_rearm = false;
+
+    if (listener->use_poll)
+        return lwan_io_uring_ctl(ring, EPOLL_CTL_DEL, listener->fd, NULL);
+
+    sqe = get_sqe(ring);
+    if (UNLIKELY(!sqe))
+        return -1;
+
+    /* Connections accepted before the cancellation is processed are still
+     * handed out by lwan_io_uring_accept(). */
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->addr = (uint64_t)(uintptr_t)conn | USER_DATA_ACCEPT_TAG;
+    sqe->user_data = 0;
+
+    return 0;
+}
+
+static void reap_accept(struct lwan_io_uring *ring,
+                        struct lwan_io_uring_listener *listener,
+                        const struct io_uring_cqe *cqe)
+{
+    int res = cqe->res;
+
+    if (!(cqe->flags & IORING_CQE_F_MORE)) {
+        if (res == -EINVAL && !listener->has_accepted) {
+            /* Most likely a kernel older than 5.19; poll the listener
+             * instead.  */
+            struct epoll_event event = {.events = EPOLLIN,
+                                        .data.ptr = listener->conn};
+
+            lwan_status_debug("Multishot accept not supported, polling "
+                              "listener %d instead", listener->fd);
+            listener->use_poll = true;
+            if (lwan_io_uring_ctl(ring, EPOLL_CTL_ADD, listener->fd, &event) < 0)
+                lwan_status_perror("Could not poll listener %d", listener->fd);
+            return;
+        }
+
+        if (listener->stopped) {
+            /* Cancelled by lwan_io_uring_unwatch_listener(); not an error
+             * the worker thread should see. */
+            if (res == -ECANCELED)
+                return;
+        } else if (res == -ECANCELED) {
+            res = -EBADF;
+        } else if (res != -EBADF) {
+            listener->needs_rearm = true;
+        }
+    }
+
+    if (res >= 0)
+        listener->has_accepted = true;
+    listener->accepted[listener->n_accepted++] = res;
+}
+
+static void rearm_reaped(struct lwan_io_uring *ring)
+{
+    for (unsigned int i = 0; i < ring->n_rearm; i++) {
+        struct lwan_connection *conn = ring->rearm[i];
+        int fd = (int)(conn - ring->conns);
+        uint8_t state = ring->poll_state[fd];
+
+        if ((state & (POLL_STATE_REGISTERED | POLL_STATE_ARMED)) !=
+            POLL_STATE_REGISTERED)
+            continue;
+
+        if (UNLIKELY(queue_poll_add(ring, conn, fd) < 0)) {
+            lwan_status_perror("Could not rearm poll for file descriptor %d",
+                               fd);
+        }
+    }
+
+    ring->n_rearm = 0;
+
+    for (unsigned int i = 0; i < ring->n_listeners; i++) {
+        struct lwan_io_uring_listener *listener = &ring->listeners[i];
+
+        if (listener->needs_rearm && UNLIKELY(queue_accept(ring, listener) < 0))
+            lwan_status_perror("Could not accept on listener %d", listener->fd);
+    }
+}
+
+int lwan_io_uring_wait(struct lwan_io_uring *ring,
+                       struct epoll_event *events,
+                       int max_events,
+                       int timeout)
+{
+    unsigned int head = *ring->cq.head;
+    unsigned int tail;
+    int n_events = 0;
+
+    if (UNLIKELY(ring->fd < 0)) {
+        errno = EBADF;
+        return -1;
+    }
+
+    if ((unsigned int)max_events > ring->max_rearm)
+        max_events = (int)ring->max_rearm;
+
+    /* Leave room for an event for each listener that has connections
+     * waiting to be accepted. */
+    const int max_poll_events = max_events - (int)ring->n_listeners;
+
+    rearm_reaped(ring);
+
+    tail = __atomic_load_n(ring->cq.tail, __ATOMIC_ACQUIRE);
+    if (head == tail) {
+        if (UNLIKELY(submit(ring, 1, timeout) < 0))
+            return -1;
+    } else if (pending_submissions(ring)) {
+        if (UNLIKELY(submit(ring, 0, 0) < 0))
+            return -1;
+    }
+
+    tail = __atomic_load_n(ring->cq.tail, __ATOMIC_ACQUIRE);
+    for (; head != tail && n_events < max_poll_events; head++) {
+        const struct io_uring_cqe *cqe = &ring->cq.cqes[head & ring->cq.mask];
+        const uint64_t tag = cqe->user_data & USER_DATA_TAG_MASK;
+
+        if (!tag)
+            continue;
+
+        struct lwan_connection *conn =
+            (struct lwan_connection *)(uintptr_t)(cqe->user_data &
+                                                  ~USER_DATA_TAG_MASK);
+
+        if (tag == USER_DATA_ACCEPT_TAG) {
+            struct lwan_io_uring_listener *listener = find_listener(ring, conn);
+
+            assert(listener);
+            if (UNLIKELY(listener->n_accepted == ring->max_rearm))
+                break;
+
+            reap_accept(ring, listener, cqe);
+            continue;
+        }
+
+        if (tag & USER_DATA_IO_TAG) {
+            int fd = (int)(conn - ring->conns);
+            uint8_t state = ring->poll_state[fd];
+            struct lwan_io_uring_io *io = &ring->io[fd];
+
+            if (!(state & POLL_STATE_REGISTERED) ||
+                poll_state_gen(state) != (tag & ~USER_DATA_IO_TAG) ||
+                io->state != IO_STATE_QUEUED)
+                continue; /* Stale completion */
+
+            io->res = cqe->res;
+            io->state = IO_STATE_DONE;
+
+            /* Wakes up the coroutine waiting for it, regardless of the
+             * events its connection is interested in. */
+            events[n_events++] = (struct epoll_event){
+                .events = EPOLLIN,
+                .data.ptr = conn,
+            };
+            continue;
+        }
+
+        int fd = (int)(conn - ring->conns);
+        uint8_t *state = &ring->poll_state[fd];
+
+        if (!(*state & POLL_STATE_REGISTERED) || poll_state_gen(*state) != tag)
+            continue; /* Stale completion */
+
+        *state &= (uint8_t)~POLL_STATE_ARMED;
+        ring->rearm[ring->n_rearm++] = conn;
+
+        uint32_t revents;
+        if (UNLIKELY(cqe->res < 0)) {
+            revents = EPOLLERR | EPOLLHUP;
+        } else {
+            /* The interest might have changed after this poll completed,
+             * but before the completion was reaped: filter out events that
+             * nobody is waiting for anymore. */
+            revents = (uint32_t)cqe->res & poll_state_to_epoll_events(*state);
+            if (!revents)
+                continue;
+        }
+
+        events[n_events++] = (struct epoll_event){
+            .events = revents,
+            .data.ptr = conn,
+        };
+    }
+
+    __atomic_store_n(ring->cq.head, head, __ATOMIC_RELEASE);
+
+    for (unsigned int i = 0; i < ring->n_listeners; i++) {
+        struct lwan_io_uring_listener *listener = &ring->listeners[i];
+
+        if (listener->pos < listener->n_accepted) {
+            events[n_events++] = (struct epoll_event){
+                .events = EPOLLIN,
+                .data.ptr = listener->conn,
+            };
+        }
+    }
+
+    return n_events;
+}
@@ -0,0 +1,115 @@
+/*
+ * lwan - web server
+ * Copyright (c) 2024 L. A. F. Pereira <l@tia.mat.br>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/epoll.h>
+#include <sys/types.h>
+
+struct lwan;
+struct lwan_connection;
+struct lwan_io_uring;
+struct lwan_request;
+
+enum lwan_io_uring_op {
+    LWAN_IO_URING_RECV,
+    LWAN_IO_URING_SEND,
+    LWAN_IO_URING_SENDMSG,
+};
+
+/* Readiness notification on top of io_uring, mimicking the subset of the
+ * epoll API used by the worker threads.  Interest changes are queued in the
+ * submission ring and are only handed to the kernel by the next call to
+ * lwan_io_uring_wait(), together with the request for completions, so a
+ * whole batch of registrations costs a single system call.
+ *
+ * Reads and writes on client sockets can also be queued, with
+ * lwan_io_uring_queue_io(), to be submitted with everything else; once
+ * they're done, an event for the connection is returned, and the result can
+ * be retrieved with lwan_io_uring_take_io_result().  (The I/O wrappers do
+ * this through lwan_request_ring_io(), waiting for the completion instead of
+ * readiness.)  As the ring of a thread can't be used by any other,
+ * connections are kept in the thread that accepted them.
+ *
+ * Unlike epoll, polls hold a reference to the file: the owner thread must
+ * call lwan_io_uring_ctl(EPOLL_CTL_DEL) before closing a file descriptor.
+ * Also, events are only valid if data.ptr is aligned to 32 bytes, as the
+ * low bits are used to tell stale completions apart.
+ *
+ * Listening sockets are handled differently: new connections are accepted
+ * by the kernel as they arrive, and are retrieved with
+ * lwan_io_uring_accept() (which behaves like accept4()) once an event for
+ * the listener is returned. */
+
+struct lwan_io_uring *lwan_io_uring_new(const struct lwan *l,
+                                        unsigned int entries);
+void lwan_io_uring_free(struct lwan_io_uring *ring);
+void lwan_io_uring_close(struct lwan_io_uring *ring);
+
+int lwan_io_uring_ctl(struct lwan_io_uring *ring,
+                      int op,
+                      int fd,
+                      const struct epoll_event *event);
+int lwan_io_uring_watch_listener(struct lwan_io_uring *ring,
+                                 int fd,
+                                 struct lwan_connection *conn);
+int lwan_io_uring_accept(struct lwan_io_uring *ring,
+                         const struct lwan_connection *conn);
+/* Stops accepting connections on a listener; connections that have been
+ * accepted already are still returned by lwan_io_uring_accept(). */
+int lwan_io_uring_unwatch_listener(struct lwan_io_uring *ring,
+                                   const struct lwan_connection *conn);
+
+/* Queues a close(2), performed along with the next submission; until then,
+ * the file descriptor number can't be reused.  Polls should have been
+ * removed beforehand. */
+int lwan_io_uring_close_fd(struct lwan_io_uring *ring, int fd);
+
+int lwan_io_uring_wait(struct lwan_io_uring *ring,
+                       struct epoll_event *events,
+                       int max_events,
+                       int timeout);
+
+/* Queues a recv(), send() or sendmsg() (in which case @ptr points to a
+ * struct msghdr and @len is ignored) on a registered file descriptor.  At
+ * most one can be queued per file descriptor, and its buffers must be valid
+ * until its result has been taken.  These never wait for the socket to be
+ * ready, completing with -EAGAIN instead. */
+int lwan_io_uring_queue_io(struct lwan_io_uring *ring,
+                           int fd,
+                           enum lwan_io_uring_op op,
+                           void *ptr,
+                           size_t len,
+                           int flags);
+/* Returns false if the request queued for @fd hasn't completed yet;
+ * otherwise, stores its result (a negative errno code on failure) in @res. */
+bool lwan_io_uring_take_io_result(struct lwan_io_uring *ring, int fd, int *res);
+
+/* Performs @op on the client socket of @request through the ring of its
+ * thread, yielding until it's done.  Returns false, without doing anything,
+ * if it can't be done that way (no ring, TLS, etc.); otherwise, @ret is set
+ * to what the corresponding system call would have returned. */
+bool lwan_request_ring_io(struct lwan_request *request,
+                          enum lwan_io_uring_op op,
+                          void *ptr,
+                          size_t len,
+                          int flags,
+                          ssize_t *ret);
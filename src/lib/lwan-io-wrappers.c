@@ -18,9 +18,14 @@
  * USA.
  */
 
+#define _GNU_SOURCE
 #include <assert.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <string.h>
+#include <sys/mman.h>
 #include <sys/sendfile.h>
 #include <sys/socket.h>
 #include <sys/types.h>
@@ -29,12 +34,100 @@
 #include "lwan-io-wrappers.h"
 #include "lwan-private.h"
 
+#if defined(LWAN_HAVE_IO_URING)
+#include "lwan-io-uring.h"
+#endif
+
 static const int MAX_FAILED_TRIES = 5;
 
-ssize_t lwan_writev_fd(struct lwan_request *request,
+static ALWAYS_INLINE void
+count_bytes_sent(struct lwan_request *request, int fd, ssize_t written)
+{
+    /* Only account for data sent to the client; the wrappers are also
+     * used to talk to e.g. FastCGI backends. */
+    if (fd == request->fd) {
+        request->conn->thread->stats.bytes_sent += (uint64_t)written;
+        request->conn->thread->stats.writes++;
+        request->helper->bytes_sent += (uint64_t)written;
+    }
+}
+
+/* Responses are assembled so that the kernel is only told to send what's
+ * pending once per response: headers and bodies that fit in memory go in
+ * the same write, MSG_MORE (or TCP_CORK, see lwan_cork()) holds back the
+ * headers when a sendfile() follows, and the last write of a response is
+ * the only one without it.  Compared with the number of responses, this
+ * shows whether that's the case. */
+static ALWAYS_INLINE void count_push(struct lwan_request *request, int fd)
+{
+    if (fd == request->fd && !request->helper->corked)
+        request->conn->thread->stats.pushes++;
+}
+
+/* Reads and writes on the client socket are submitted through the ring of
+ * the thread when it's using io_uring, waiting for their completion rather
+ * than for the socket to be ready (see lwan_request_ring_io()); anything
+ * else, e.g. FastCGI backends, uses the system calls directly.  Either way,
+ * these return what the system calls would. */
+static ALWAYS_INLINE ssize_t socket_sendmsg(struct lwan_request *request,
+                                            int fd,
+                                            struct msghdr *hdr,
+                                            int flags)
+{
+#if defined(LWAN_HAVE_IO_URING)
+    ssize_t r;
+
+    if (fd == request->fd &&
+        lwan_request_ring_io(request, LWAN_IO_URING_SENDMSG, hdr, 0, flags, &r))
+        return r;
+#endif
+    return sendmsg(fd, hdr, flags);
+}
+
+static ALWAYS_INLINE ssize_t socket_send(struct lwan_request *request,
+                                         int fd,
+                                         const void *buf,
+                                         size_t count,
+                                         int flags)
+{
+#if defined(LWAN_HAVE_IO_URING)
+    ssize_t r;
+
+    if (fd == request->fd &&
+        lwan_request_ring_io(request, LWAN_IO_URING_SEND, (void *)buf, count,
+                             flags, &r))
+        return r;
+#endif
+    return send(fd, buf, count, flags);
+}
+
+ssize_t lwan_socket_recv(struct lwan_request *request,
+                         int fd,
+                         void *buf,
+                         size_t count,
+                         int flags)
+{
+#if defined(LWAN_HAVE_IO_URING)
+    ssize_t r;
+
+    if (fd == request->fd &&
+        lwan_request_ring_io(request, LWAN_IO_URING_RECV, buf, count, flags,
+                             &r))
+        return r;
+#endif
+    return recv(fd, buf, count, flags);
+}
+
+static ssize_t send_fd(struct lwan_request *request,
                        int fd,
-                       struct iovec *iov,
-                       int iov_count)
+                       const void *buf,
+                       size_t count,
+                       int flags);
+
+static ssize_t writev_fd(struct lwan_request *request,
+                         int fd,
+                         struct iovec *iov,
+                         int iov_count)
 {
     ssize_t total_written = 0;
     int curr_iov = 0;
@@ -46,15 +139,15 @@ ssize_t lwan_writev_fd(struct lwan_request *request,
 
         if (remaining_len == 1) {
             const struct iovec *vec = &iov[curr_iov];
-            return lwan_send_fd(request, fd, vec->iov_base, vec->iov_len,
-                                flags);
+            ssize_t r = send_fd(request, fd, vec->iov_base, vec->iov_len, flags);
+            return r < 0 ? r : total_written + r;
         }
 
         struct msghdr hdr = {
             .msg_iov = iov + curr_iov,
             .msg_iovlen = (size_t)remaining_len,
         };
-        written = sendmsg(fd, &hdr, flags);
+        written = socket_sendmsg(request, fd, &hdr, flags);
 
         if (UNLIKELY(written < 0)) {
             /* FIXME: Consider short writes as another try as well? */
@@ -71,6 +164,12 @@ ssize_t lwan_writev_fd(struct lwan_request *request,
             return total_written;
         } else {
             total_written += written;
+            count_bytes_sent(request, fd, written);
+
+            /* Short writes are expected once the unsent data reaches
+             * TCP_NOTSENT_LOWAT; as long as the client is reading, they
+             * aren't failures */
+            tries = MAX_FAILED_TRIES;
 
             while (curr_iov < iov_count &&
                    written >= (ssize_t)iov[curr_iov].iov_len) {
@@ -78,19 +177,158 @@ ssize_t lwan_writev_fd(struct lwan_request *request,
                 curr_iov++;
             }
 
-            if (curr_iov == iov_count)
+            if (curr_iov == iov_count) {
+                if (!(flags & MSG_MORE))
+                    count_push(request, fd);
                 return total_written;
+            }
 
             iov[curr_iov].iov_base = (char *)iov[curr_iov].iov_base + written;
             iov[curr_iov].iov_len -= (size_t)written;
         }
 
-        lwan_request_await_read(request, fd);
+        lwan_request_await_write(request, fd);
     }
 
     return -ETIMEDOUT;
 }
 
+/* Requests that came in a HTTP/2 stream have their responses framed by
+ * lwan-h2.c, rather than being written directly to the socket. */
+static ALWAYS_INLINE bool is_h2_stream(const struct lwan_request *request,
+                                       int fd)
+{
+    return UNLIKELY(request->helper->h2_stream != NULL) && fd == request->fd;
+}
+
+/* Responses to pipelined requests may be queued by lwan_response() while
+ * the next request has been read already.  They're sent, in the same
+ * system call, with whatever is sent to the client next, or when the
+ * pipeline drains. */
+static ALWAYS_INLINE struct lwan_strbuf *
+queued_responses(const struct lwan_request *request, int fd)
+{
+    struct lwan_strbuf *queued = request->helper->queued_responses;
+
+    if (LIKELY(!queued || fd != request->fd ||
+               !lwan_strbuf_get_length(queued)))
+        return NULL;
+
+    return queued;
+}
+
+static ssize_t writev_after_queued(struct lwan_request *request,
+                                   int fd,
+                                   struct lwan_strbuf *queued,
+                                   struct iovec *iov,
+                                   int iov_count)
+{
+    const size_t queued_len = lwan_strbuf_get_length(queued);
+    struct iovec vec[4] = {
+        {.iov_base = lwan_strbuf_get_buffer(queued), .iov_len = queued_len},
+    };
+    ssize_t r;
+
+    if (iov_count < (int)N_ELEMENTS(vec)) {
+        if (iov_count)
+            memcpy(&vec[1], iov, (size_t)iov_count * sizeof(*iov));
+        r = writev_fd(request, fd, vec, iov_count + 1);
+    } else {
+        r = writev_fd(request, fd, vec, 1);
+        if (LIKELY(r >= 0))
+            r = writev_fd(request, fd, iov, iov_count) +
+                (ssize_t)queued_len;
+    }
+
+    lwan_strbuf_reset(queued);
+
+    if (UNLIKELY(r < 0))
+        return r;
+
+    /* Queued responses were accounted for by the requests that queued
+     * them. */
+    request->helper->bytes_sent -=
+        LWAN_MIN((uint64_t)queued_len, request->helper->bytes_sent);
+    return r > (ssize_t)queued_len ? r - (ssize_t)queued_len : 0;
+}
+
+static ALWAYS_INLINE ssize_t flush_queued_responses(struct lwan_request *request,
+                                                    int fd)
+{
+    struct lwan_strbuf *queued = queued_responses(request, fd);
+
+    if (LIKELY(!queued))
+        return 0;
+
+    return writev_after_queued(request, fd, queued, NULL, 0);
+}
+
+int lwan_flush_queued_responses(struct lwan_request *request)
+{
+    return (int)flush_queued_responses(request, request->fd);
+}
+
+void lwan_cork(struct lwan_request *request)
+{
+#if defined(__linux__)
+    if (request->helper->corked || is_h2_stream(request, request->fd))
+        return;
+
+    /* Fails on e.g. Unix sockets, where it wouldn't make a difference */
+    if (!setsockopt(request->fd, SOL_TCP, TCP_CORK, (int[]){1}, sizeof(int)))
+        request->helper->corked = true;
+#else
+    (void)request;
+#endif
+}
+
+void lwan_uncork(struct lwan_request *request)
+{
+#if defined(__linux__)
+    if (!request->helper->corked)
+        return;
+
+    setsockopt(request->fd, SOL_TCP, TCP_CORK, (int[]){0}, sizeof(int));
+    request->helper->corked = false;
+    count_push(request, request->fd);
+#else
+    (void)request;
+#endif
+}
+
+ssize_t lwan_writev_fd(struct lwan_request *request,
+                       int fd,
+                       struct iovec *iov,
+                       int iov_count)
+{
+    struct lwan_strbuf *queued = queued_responses(request, fd);
+
+    if (is_h2_stream(request, fd))
+        return lwan_h2_stream_writev(request, iov, iov_count);
+    if (queued)
+        return writev_after_queued(request, fd, queued, iov, iov_count);
+
+    return writev_fd(request, fd, iov, iov_count);
+}
+
+ssize_t lwan_send_fd(struct lwan_request *request,
+                     int fd,
+                     const void *buf,
+                     size_t count,
+                     int flags)
+{
+    struct lwan_strbuf *queued = queued_responses(request, fd);
+
+    if (is_h2_stream(request, fd))
+        return lwan_h2_stream_send(request, buf, count, flags);
+    if (queued) {
+        struct iovec vec = {.iov_base = (void *)buf, .iov_len = count};
+        return writev_after_queued(request, fd, queued, &vec, 1);
+    }
+
+    return send_fd(request, fd, buf, count, flags);
+}
+
 ssize_t lwan_readv_fd(struct lwan_request *request,
                       int fd,
                       struct iovec *iov,
@@ -98,6 +336,10 @@ ssize_t lwan_readv_fd(struct lwan_request *request,
 {
     ssize_t total_bytes_read = 0;
     int curr_iov = 0;
+    ssize_t r = flush_queued_responses(request, fd);
+
+    if (UNLIKELY(r < 0))
+        return r;
 
     for (int tries = MAX_FAILED_TRIES; tries;) {
         const int remaining_len = (int)(iov_count - curr_iov);
@@ -148,11 +390,47 @@ ssize_t lwan_readv_fd(struct lwan_request *request,
     return -ETIMEDOUT;
 }
 
-ssize_t lwan_send_fd(struct lwan_request *request,
-                     int fd,
-                     const void *buf,
-                     size_t count,
-                     int flags)
+ssize_t lwan_readv_some_fd(struct lwan_request *request,
+                           int fd,
+                           struct iovec *iov,
+                           int iov_count)
+{
+    ssize_t r = flush_queued_responses(request, fd);
+
+    if (UNLIKELY(r < 0))
+        return r;
+
+    for (int tries = MAX_FAILED_TRIES; tries;) {
+        struct msghdr hdr = {
+            .msg_iov = iov,
+            .msg_iovlen = (size_t)iov_count,
+        };
+        ssize_t bytes_read = recvmsg(fd, &hdr, 0);
+
+        if (LIKELY(bytes_read >= 0))
+            return bytes_read;
+
+        tries--;
+
+        switch (errno) {
+        case EAGAIN:
+        case EINTR:
+            break;
+        default:
+            return -errno;
+        }
+
+        lwan_request_await_read(request, fd);
+    }
+
+    return -ETIMEDOUT;
+}
+
+static ssize_t send_fd(struct lwan_request *request,
+                       int fd,
+                       const void *buf,
+                       size_t count,
+                       int flags)
 {
     size_t to_send = count;
 
@@ -160,7 +438,7 @@ ssize_t lwan_send_fd(struct lwan_request *request,
         flags |= MSG_MORE;
 
     for (int tries = MAX_FAILED_TRIES; tries;) {
-        ssize_t written = send(fd, buf, to_send, flags);
+        ssize_t written = socket_send(request, fd, buf, to_send, flags);
         if (UNLIKELY(written < 0)) {
             tries--;
 
@@ -172,10 +450,15 @@ ssize_t lwan_send_fd(struct lwan_request *request,
                 return -errno;
             }
         } else {
+            count_bytes_sent(request, fd, written);
             to_send -= (size_t)written;
-            if (!to_send)
+            if (!to_send) {
+                if (!(flags & MSG_MORE))
+                    count_push(request, fd);
                 return (ssize_t)count;
+            }
             buf = (char *)buf + written;
+            tries = MAX_FAILED_TRIES;
         }
 
         lwan_request_await_write(request, fd);
@@ -188,9 +471,13 @@ ssize_t
 lwan_recv_fd(struct lwan_request *request, int fd, void *buf, size_t count, int flags)
 {
     size_t to_recv = count;
+    ssize_t r = flush_queued_responses(request, fd);
+
+    if (UNLIKELY(r < 0))
+        return r;
 
     for (int tries = MAX_FAILED_TRIES; tries;) {
-        ssize_t recvd = recv(fd, buf, to_recv, flags);
+        ssize_t recvd = lwan_socket_recv(request, fd, buf, to_recv, flags);
         if (UNLIKELY(recvd < 0)) {
             tries--;
 
@@ -216,6 +503,53 @@ lwan_recv_fd(struct lwan_request *request, int fd, void *buf, size_t count, int
     return -ETIMEDOUT;
 }
 
+bool lwan_connect_fd(struct lwan_request *request,
+                     int sock_fd,
+                     const struct sockaddr *sockaddr,
+                     socklen_t socklen)
+{
+    if (LIKELY(!connect(sock_fd, sockaddr, socklen)))
+        return true;
+
+    /* Since socket has been created in non-blocking mode, connection
+     * might not be completed immediately.  Depending on the socket type,
+     * connect() might return EAGAIN or EINPROGRESS.  */
+    if (errno != EAGAIN && errno != EINPROGRESS)
+        return false;
+
+    /* If we get any of the above errors, try checking for socket error
+     * codes and loop until we get no errors.  We await for writing here
+     * because that's what the Linux man page for connect(2) says we should
+     * do in this case.  */
+    for (int try = 0; try < 10; try++) {
+        socklen_t sockerrnolen = (socklen_t)sizeof(int);
+        int sockerrno;
+
+        lwan_request_await_write(request, sock_fd);
+
+        if (getsockopt(sock_fd, SOL_SOCKET, SO_ERROR, &sockerrno,
+                       &sockerrnolen) < 0) {
+            break;
+        }
+
+        switch (sockerrno) {
+        case EISCONN:
+        case 0:
+            return true;
+
+        case EAGAIN:
+        case EINPROGRESS:
+        case EINTR:
+            continue;
+
+        default:
+            return false;
+        }
+    }
+
+    return false;
+}
+
 #if defined(__linux__)
 int lwan_sendfile_fd(struct lwan_request *request,
                      int out_fd,
@@ -239,13 +573,20 @@ int lwan_sendfile_fd(struct lwan_request *request,
      */
     size_t chunk_size = LWAN_MIN(count, (1ul << 21) - header_len);
     size_t to_be_written = count;
+    off_t readahead_end = offset + (off_t)chunk_size;
     ssize_t r;
 
+    if (is_h2_stream(request, out_fd)) {
+        return lwan_h2_stream_sendfile(request, in_fd, offset, count, header,
+                                       header_len);
+    }
+
     assert(header_len < (1ul << 21));
 
-    r = lwan_send_fd(request, out_fd, header, header_len, MSG_MORE);
-    if (r < 0)
-        return (int)r;
+    /* Empty files have nothing to hold the headers back for */
+    r = lwan_send_fd(request, out_fd, header, header_len, count ? MSG_MORE : 0);
+    if (r < 0 || !count)
+        return (int)LWAN_MIN(r, 0);
 
     while (true) {
         ssize_t written = sendfile(out_fd, in_fd, &offset, chunk_size);
@@ -258,17 +599,79 @@ int lwan_sendfile_fd(struct lwan_request *request,
                 return -errno;
             }
         } else {
+            count_bytes_sent(request, out_fd, written);
             to_be_written -= (size_t)written;
-            if (!to_be_written)
+            if (!to_be_written) {
+                count_push(request, out_fd);
                 return 0;
+            }
 
             chunk_size = LWAN_MIN(to_be_written, 1ul << 21);
-            lwan_readahead_queue(in_fd, offset, chunk_size);
+
+            /* TCP_NOTSENT_LOWAT keeps each call short of a whole chunk,
+             * so only read ahead once what was queued has been sent */
+            if (offset >= readahead_end) {
+                lwan_readahead_queue(in_fd, offset, chunk_size);
+                readahead_end = offset + (off_t)chunk_size;
+            }
         }
 
         lwan_request_await_write(request, out_fd);
     }
 }
+
+int lwan_splice_fd(struct lwan_request *request,
+                   int out_fd,
+                   int in_fd,
+                   const int pipe_fds[static 2],
+                   size_t count)
+{
+    /* Data is moved from in_fd to out_fd through a pipe, so it never
+     * reaches userspace.  The pipe is drained as soon as anything is in
+     * it, so it doesn't have to be as large as count.  */
+    const unsigned int flags = SPLICE_F_MOVE | SPLICE_F_NONBLOCK;
+    size_t in_pipe = 0;
+    ssize_t r = flush_queued_responses(request, out_fd);
+
+    if (UNLIKELY(r < 0))
+        return (int)r;
+    if (is_h2_stream(request, out_fd))
+        return lwan_h2_stream_splice(request, in_fd, count);
+
+    while (count || in_pipe) {
+        if (count) {
+            r = splice(in_fd, NULL, pipe_fds[1], NULL, count, flags);
+            if (r > 0) {
+                count -= (size_t)r;
+                in_pipe += (size_t)r;
+            } else if (UNLIKELY(!r)) {
+                return -ECONNRESET;
+            } else if (errno != EAGAIN && errno != EINTR) {
+                return -errno;
+            } else if (!in_pipe) {
+                lwan_request_await_read(request, in_fd);
+                continue;
+            }
+        }
+
+        if (in_pipe) {
+            r = splice(pipe_fds[0], NULL, out_fd, NULL, in_pipe,
+                       flags | SPLICE_F_MORE);
+            if (r > 0) {
+                count_bytes_sent(request, out_fd, r);
+                in_pipe -= (size_t)r;
+            } else if (UNLIKELY(!r)) {
+                return -ECONNRESET;
+            } else if (errno != EAGAIN && errno != EINTR) {
+                return -errno;
+            } else {
+                lwan_request_await_write(request, out_fd);
+            }
+        }
+    }
+
+    return 0;
+}
 #elif defined(__FreeBSD__) || defined(__APPLE__)
 int lwan_sendfile_fd(struct lwan_request *request,
                      int out_fd,
@@ -278,11 +681,17 @@ int lwan_sendfile_fd(struct lwan_request *request,
                      const char *header,
                      size_t header_len)
 {
-    struct sf_hdtr headers = {.headers =
-                                  (struct iovec[]){{.iov_base = (void *)header,
-                                                    .iov_len = header_len}},
-                              .hdr_cnt = 1};
-    off_t sbytes = (off_t)count;
+    struct iovec header_iov = {.iov_base = (void *)header,
+                               .iov_len = header_len};
+    struct sf_hdtr headers = {.headers = &header_iov, .hdr_cnt = 1};
+    ssize_t r = flush_queued_responses(request, out_fd);
+
+    if (UNLIKELY(r < 0))
+        return (int)r;
+    if (is_h2_stream(request, out_fd)) {
+        return lwan_h2_stream_sendfile(request, in_fd, offset, count, header,
+                                       header_len);
+    }
 
     if (!count) {
         /* FreeBSD's sendfile() won't send the headers when count is 0. Why? */
@@ -291,27 +700,50 @@ int lwan_sendfile_fd(struct lwan_request *request,
     }
 
     while (true) {
-        int r;
+        /* Headers go in the same call as the file contents while there's
+         * anything left of them to send. */
+        struct sf_hdtr *hdtr = header_iov.iov_len ? &headers : NULL;
+        off_t sbytes = 0;
 
 #ifdef __APPLE__
-        r = sendfile(in_fd, out_fd, offset, &sbytes, &headers, 0);
+        sbytes = (off_t)count;
+        r = sendfile(in_fd, out_fd, offset, &sbytes, hdtr, 0);
 #else
-        r = sendfile(in_fd, out_fd, offset, count, &headers, &sbytes,
-                     SF_MNOWAIT);
+        r = sendfile(in_fd, out_fd, offset, count, hdtr, &sbytes, SF_MNOWAIT);
 #endif
         if (UNLIKELY(r < 0)) {
             switch (errno) {
             case EAGAIN:
             case EBUSY:
             case EINTR:
+                /* sbytes has whatever was sent before being interrupted */
                 break;
             default:
                 return -errno;
             }
-        } else {
-            count -= (size_t)sbytes;
-            if (!count)
+        }
+
+        if (sbytes > 0) {
+            /* sbytes includes the headers, which are sent first */
+            size_t sent = (size_t)sbytes;
+
+            count_bytes_sent(request, out_fd, (ssize_t)sbytes);
+
+            if (sent < header_iov.iov_len) {
+                header_iov.iov_base = (char *)header_iov.iov_base + sent;
+                header_iov.iov_len -= sent;
+                sent = 0;
+            } else {
+                sent -= header_iov.iov_len;
+                header_iov.iov_len = 0;
+            }
+
+            offset += (off_t)sent;
+            count -= sent;
+            if (!count) {
+                count_push(request, out_fd);
                 return 0;
+            }
         }
 
         lwan_request_await_write(request, out_fd);
@@ -354,6 +786,45 @@ static ssize_t try_pread_file(struct lwan_request *request,
     return -ETIMEDOUT;
 }
 
+/* Files are sent straight from windows of their page cache mapping, rather
+ * than being copied into a buffer first.  Windows are a multiple of the
+ * largest TLS record (and of the page size), so each write fills whole
+ * records if the connection is encrypted.  */
+#define TLS_RECORD_SIZE (1u << 14)
+#define MMAP_WINDOW_SIZE (64 * TLS_RECORD_SIZE)
+
+static int send_mapped_file(struct lwan_request *request,
+                            int out_fd,
+                            int in_fd,
+                            off_t *offset,
+                            size_t *count)
+{
+    const off_t page_mask = (off_t)sysconf(_SC_PAGESIZE) - 1;
+
+    while (*count) {
+        const off_t map_offset = *offset & ~page_mask;
+        const size_t skew = (size_t)(*offset - map_offset);
+        const size_t len = LWAN_MIN(*count, (size_t)MMAP_WINDOW_SIZE);
+        char *map = mmap(NULL, skew + len, PROT_READ, MAP_SHARED, in_fd,
+                         map_offset);
+        ssize_t r;
+
+        if (map == MAP_FAILED)
+            return -errno;
+
+        r = lwan_send_fd(request, out_fd, map + skew, len,
+                         *count > len ? MSG_MORE : 0);
+        munmap(map, skew + len);
+        if (UNLIKELY(r < 0))
+            return (int)r;
+
+        *offset += (off_t)len;
+        *count -= len;
+    }
+
+    return 0;
+}
+
 int lwan_sendfile_fd(struct lwan_request *request,
                      int out_fd,
                      int in_fd,
@@ -366,11 +837,21 @@ int lwan_sendfile_fd(struct lwan_request *request,
     unsigned int blocks_sent = 0;
     ssize_t r;
 
-    r = lwan_send_fd(request, out_fd, header, header_len, MSG_MORE);
+    if (is_h2_stream(request, out_fd)) {
+        return lwan_h2_stream_sendfile(request, in_fd, offset, count, header,
+                                       header_len);
+    }
+
+    r = lwan_send_fd(request, out_fd, header, header_len, count ? MSG_MORE : 0);
     if (UNLIKELY(r < 0)) {
         return (int)r;
     }
 
+    /* Only files that can't be mapped (e.g. pipes) are read into a buffer */
+    r = send_mapped_file(request, out_fd, in_fd, &offset, &count);
+    if (r != -ENODEV && r != -EACCES && r != -EINVAL)
+        return (int)r;
+
     while (count) {
         r = try_pread_file(request, in_fd, buffer,
                            LWAN_MIN(count, sizeof(buffer)), offset);
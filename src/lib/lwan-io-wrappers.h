@@ -49,6 +49,41 @@ ssize_t lwan_readv_fd(struct lwan_request *request,
                       int fd,
                       struct iovec *iov,
                       int iov_count);
+/* Like lwan_readv_fd(), but returns as soon as anything has been read (or
+ * 0 if the peer has closed the connection), so callers can process data
+ * while the rest of it is still arriving.  */
+ssize_t lwan_readv_some_fd(struct lwan_request *request,
+                           int fd,
+                           struct iovec *iov,
+                           int iov_count);
+int lwan_flush_queued_responses(struct lwan_request *request);
+
+/* Holds back everything written to the client until lwan_uncork() is
+ * called, so that responses written by several calls (e.g. a sendfile()
+ * for each part of a multipart response) are sent in as few segments as
+ * possible.  Only needed when MSG_MORE can't be used for all writes but
+ * the last one.  */
+void lwan_cork(struct lwan_request *request);
+void lwan_uncork(struct lwan_request *request);
+
+/* Connects a non-blocking socket, awaiting for the connection to be
+ * established if necessary.  */
+bool lwan_connect_fd(struct lwan_request *request,
+                     int sock_fd,
+                     const struct sockaddr *sockaddr,
+                     socklen_t socklen);
+
+#if defined(__linux__)
+/* Moves count bytes from in_fd to out_fd with splice(), using a pipe
+ * created by the caller with O_NONBLOCK.  The pipe is empty on return,
+ * unless an error occurred.  The caller is expected to send more data
+ * right after this (SPLICE_F_MORE is used).  */
+int lwan_splice_fd(struct lwan_request *request,
+                   int out_fd,
+                   int in_fd,
+                   const int pipe_fds[static 2],
+                   size_t count);
+#endif
 
 static inline ssize_t
 lwan_writev(struct lwan_request *request, struct iovec *iov, int iovcnt)
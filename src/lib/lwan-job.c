@@ -20,129 +20,374 @@
 #define _GNU_SOURCE
 #include <assert.h>
 #include <errno.h>
-#include <ioprio.h>
 #include <pthread.h>
-#include <sched.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdlib.h>
-#include <sys/time.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "lwan-private.h"
 #include "lwan-status.h"
 #include "list.h"
 
+/* Jobs are periodic callbacks, called by one of the worker threads
+ * whenever their deadline is due, until they're removed.  The callback
+ * returns true if it had work to do; in that case, the job is scheduled
+ * again after its minimum interval, otherwise the interval is doubled,
+ * up to its maximum interval.  The job thread only keeps track of these
+ * deadlines, sleeping until the earliest one, and hands jobs that are due
+ * to the workers.
+ *
+ * Workers are also used to run tasks: one-shot callbacks that are
+ * executed as soon as a worker is available, meant to offload work that
+ * would otherwise block an I/O thread.  Tasks are always run before jobs,
+ * and jobs are run in priority order. */
+#define MAX_WORKER_THREADS 4
+
+#define DEFAULT_MIN_INTERVAL_MS 1000
+#define DEFAULT_MAX_INTERVAL_MS 16000
+
+struct task {
+    struct list_node tasks;
+    void (*cb)(void *data);
+    void *data;
+    bool allocated;
+};
+
 struct job {
     struct list_node jobs;
     bool (*cb)(void *data);
     void *data;
+
+    struct task task;
+
+    enum lwan_job_priority priority;
+    bool in_flight;
+
+    uint64_t min_interval_us;
+    uint64_t max_interval_us;
+    uint64_t interval_us;
+    uint64_t deadline_us;
+
+    struct lwan_job_stats stats;
 };
 
 static pthread_t self;
 static pthread_mutex_t queue_mutex = PTHREAD_MUTEX_INITIALIZER;
 static bool running = false;
 static struct list_head jobs;
+static unsigned int next_job_id;
+
+/* Signaled whenever the list of jobs changes, or a job finishes running,
+ * so the job thread can recalculate the next deadline.  Uses the monotonic
+ * clock, so it's initialized in lwan_job_thread_init(). */
+static pthread_cond_t job_wait_cond;
+/* Signaled whenever a job finishes running, for lwan_job_del(). */
+static pthread_cond_t job_done_cond = PTHREAD_COND_INITIALIZER;
+
+static struct {
+    pthread_t threads[MAX_WORKER_THREADS];
+    unsigned int n_threads;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    struct list_head lists[LWAN_JOB_PRIORITY_TASK + 1];
+    bool running;
+} tasks = {
+    .mutex = PTHREAD_MUTEX_INITIALIZER,
+    .cond = PTHREAD_COND_INITIALIZER,
+};
+
+static uint64_t now_us(void)
+{
+    struct timespec now;
 
-static pthread_mutex_t job_wait_mutex = PTHREAD_MUTEX_INITIALIZER;
-static pthread_cond_t job_wait_cond = PTHREAD_COND_INITIALIZER;
+    if (UNLIKELY(clock_gettime(CLOCK_MONOTONIC, &now) < 0))
+        lwan_status_critical_perror("clock_gettime");
 
-static void
-timedwait(bool had_job)
+    return (uint64_t)now.tv_sec * 1000000 + (uint64_t)now.tv_nsec / 1000;
+}
+
+static void *task_thread(void *data __attribute__((unused)))
 {
-    static int secs = 1;
-    struct timeval now;
+    lwan_set_thread_name("task");
 
-    if (had_job)
-        secs = 1;
-    else if (secs <= 15)
-        secs++;
+    pthread_mutex_lock(&tasks.mutex);
+    while (true) {
+        struct task *task = NULL;
 
-    gettimeofday(&now, NULL);
+        for (int prio = LWAN_JOB_PRIORITY_TASK; prio >= 0; prio--) {
+            task = list_pop(&tasks.lists[prio], struct task, tasks);
+            if (task)
+                break;
+        }
 
-    struct timespec rgtp = { now.tv_sec + secs, now.tv_usec * 1000 };
-    pthread_cond_timedwait(&job_wait_cond, &job_wait_mutex, &rgtp);
+        if (!task) {
+            /* Pending tasks are still executed when shutting down, as
+             * their callers might be waiting for them. */
+            if (!tasks.running)
+                break;
+
+            pthread_cond_wait(&tasks.cond, &tasks.mutex);
+            continue;
+        }
+
+        pthread_mutex_unlock(&tasks.mutex);
+        if (task->allocated) {
+            task->cb(task->data);
+            free(task);
+        } else {
+            /* Tasks embedded in jobs might be freed as soon as they're
+             * run, so they can't be touched afterwards. */
+            task->cb(task->data);
+        }
+        pthread_mutex_lock(&tasks.mutex);
+    }
+    pthread_mutex_unlock(&tasks.mutex);
+
+    return NULL;
 }
 
-void lwan_job_thread_main_loop(void)
+static void task_threads_init(void)
+{
+    long n_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+    for (size_t i = 0; i < N_ELEMENTS(tasks.lists); i++)
+        list_head_init(&tasks.lists[i]);
+    tasks.running = true;
+
+    for (long i = 0;
+         i < LWAN_MAX(1l, LWAN_MIN(n_cpus, (long)MAX_WORKER_THREADS)); i++) {
+        int r = pthread_create(&tasks.threads[i], NULL, task_thread, NULL);
+
+        if (r) {
+            errno = r;
+            lwan_status_perror("Could not create task thread");
+            break;
+        }
+
+        tasks.n_threads++;
+    }
+
+    lwan_status_debug("Started %u task threads", tasks.n_threads);
+}
+
+static void task_threads_shutdown(void)
+{
+    pthread_mutex_lock(&tasks.mutex);
+    tasks.running = false;
+    pthread_cond_broadcast(&tasks.cond);
+    pthread_mutex_unlock(&tasks.mutex);
+
+    for (unsigned int i = 0; i < tasks.n_threads; i++) {
+        int r = pthread_join(tasks.threads[i], NULL);
+
+        if (r) {
+            errno = r;
+            lwan_status_perror("pthread_join");
+        }
+    }
+
+    tasks.n_threads = 0;
+}
+
+static bool queue_task(struct task *task, enum lwan_job_priority priority)
+{
+    pthread_mutex_lock(&tasks.mutex);
+    if (UNLIKELY(!tasks.running || !tasks.n_threads)) {
+        pthread_mutex_unlock(&tasks.mutex);
+        return false;
+    }
+    list_add_tail(&tasks.lists[priority], &task->tasks);
+    pthread_cond_signal(&tasks.cond);
+    pthread_mutex_unlock(&tasks.mutex);
+
+    return true;
+}
+
+bool lwan_job_run_task(void (*cb)(void *data), void *data)
+{
+    struct task *task;
+
+    assert(cb);
+
+    task = malloc(sizeof(*task));
+    if (UNLIKELY(!task))
+        return false;
+
+    task->cb = cb;
+    task->data = data;
+    task->allocated = true;
+
+    if (UNLIKELY(!queue_task(task, LWAN_JOB_PRIORITY_TASK))) {
+        free(task);
+        return false;
+    }
+
+    return true;
+}
+
+static void job_task(void *data)
+{
+    struct job *job = data;
+    uint64_t start = now_us();
+    bool had_work = job->cb(job->data);
+    uint64_t end = now_us();
+    uint64_t latency = start > job->deadline_us ? start - job->deadline_us : 0;
+
+    pthread_mutex_lock(&queue_mutex);
+
+    job->stats.runs++;
+    if (had_work)
+        job->stats.productive_runs++;
+    job->stats.latency_total_us += latency;
+    job->stats.latency_max_us = LWAN_MAX(job->stats.latency_max_us, latency);
+    job->stats.duration_total_us += end - start;
+    job->stats.duration_max_us =
+        LWAN_MAX(job->stats.duration_max_us, end - start);
+
+    if (had_work) {
+        job->interval_us = job->min_interval_us;
+    } else {
+        job->interval_us =
+            LWAN_MIN(job->interval_us * 2, job->max_interval_us);
+    }
+    job->deadline_us = end + job->interval_us;
+    job->in_flight = false;
+
+    pthread_cond_broadcast(&job_done_cond);
+    pthread_cond_signal(&job_wait_cond);
+
+    pthread_mutex_unlock(&queue_mutex);
+}
+
+static void wait_until(uint64_t deadline_us)
 {
-    /* Idle priority for the calling thread.   Magic value of `7` obtained from
-     * sample program in linux/Documentation/block/ioprio.txt.  This is a no-op
-     * on anything but Linux.  */
-    ioprio_set(IOPRIO_WHO_PROCESS, 0, IOPRIO_PRIO_VALUE(IOPRIO_CLASS_IDLE, 7));
+    struct timespec ts;
 
+    if (deadline_us == UINT64_MAX) {
+        pthread_cond_wait(&job_wait_cond, &queue_mutex);
+        return;
+    }
+
+    ts.tv_sec = (time_t)(deadline_us / 1000000);
+    ts.tv_nsec = (long)(deadline_us % 1000000) * 1000;
+    pthread_cond_timedwait(&job_wait_cond, &queue_mutex, &ts);
+}
+
+void lwan_job_thread_main_loop(void)
+{
     lwan_set_thread_name("job");
 
-    if (pthread_mutex_lock(&job_wait_mutex))
-        lwan_status_critical("Could not lock job wait mutex");
-    
+    if (pthread_mutex_lock(&queue_mutex))
+        lwan_status_critical("Could not lock job queue mutex");
+
     while (running) {
-        bool had_job = false;
+        uint64_t next_deadline = UINT64_MAX;
+        uint64_t now = now_us();
+        struct job *job;
 
-        if (LIKELY(!pthread_mutex_lock(&queue_mutex))) {
-            struct job *job;
+        list_for_each(&jobs, job, jobs) {
+            if (job->in_flight)
+                continue;
 
-            list_for_each(&jobs, job, jobs)
-                had_job |= job->cb(job->data);
+            if (job->deadline_us > now) {
+                next_deadline = LWAN_MIN(next_deadline, job->deadline_us);
+                continue;
+            }
 
-            pthread_mutex_unlock(&queue_mutex);
+            job->in_flight = true;
+            if (UNLIKELY(!queue_task(&job->task, job->priority))) {
+                /* No workers (e.g. shutting down): run it right here. */
+                pthread_mutex_unlock(&queue_mutex);
+                job_task(job);
+                pthread_mutex_lock(&queue_mutex);
+
+                /* The list might have changed while it was unlocked. */
+                next_deadline = 0;
+                break;
+            }
         }
 
-        timedwait(had_job);
+        if (next_deadline)
+            wait_until(next_deadline);
     }
 
-    if (pthread_mutex_unlock(&job_wait_mutex))
-        lwan_status_critical("Could not lock job wait mutex");
+    if (pthread_mutex_unlock(&queue_mutex))
+        lwan_status_critical("Could not unlock job queue mutex");
 }
 
 void lwan_job_thread_init(void)
 {
+    pthread_condattr_t attr;
+
     assert(!running);
 
-    lwan_status_debug("Initializing low priority job thread");
+    lwan_status_debug("Initializing job thread");
+
+    if (pthread_condattr_init(&attr) ||
+        pthread_condattr_setclock(&attr, CLOCK_MONOTONIC) ||
+        pthread_cond_init(&job_wait_cond, &attr))
+        lwan_status_critical("Could not initialize job wait condition");
+    pthread_condattr_destroy(&attr);
 
     list_head_init(&jobs);
+    task_threads_init();
 
     self = pthread_self();
     running = true;
+}
 
-#ifdef SCHED_IDLE
-    struct sched_param sched_param = {
-        .sched_priority = 0
-    };
-    if (pthread_setschedparam(self, SCHED_IDLE, &sched_param) < 0)
-        lwan_status_perror("pthread_setschedparam");
-#endif  /* SCHED_IDLE */
+/* Makes lwan_job_thread_main_loop() return; can be called from a job. */
+void lwan_job_thread_stop(void)
+{
+    if (UNLIKELY(pthread_mutex_lock(&queue_mutex)))
+        return;
+    running = false;
+    pthread_cond_signal(&job_wait_cond);
+    pthread_mutex_unlock(&queue_mutex);
 }
 
 void lwan_job_thread_shutdown(void)
 {
+    struct job *node, *next;
+    int r;
+
     lwan_status_debug("Shutting down job thread");
 
-    if (LIKELY(!pthread_mutex_lock(&queue_mutex))) {
-        struct job *node, *next;
-        int r;
-
-        list_for_each_safe(&jobs, node, next, jobs) {
-            list_del(&node->jobs);
-            free(node);
-        }
-        running = false;
-
-        pthread_cond_signal(&job_wait_cond);
+    if (UNLIKELY(pthread_mutex_lock(&queue_mutex)))
+        return;
+    running = false;
+    pthread_cond_signal(&job_wait_cond);
+    pthread_mutex_unlock(&queue_mutex);
 
+    if (!pthread_equal(self, pthread_self())) {
         r = pthread_join(self, NULL);
         if (r) {
             errno = r;
             lwan_status_perror("pthread_join");
         }
+    }
 
-        pthread_mutex_unlock(&queue_mutex);
+    /* Runs whatever tasks and jobs have been queued in the meantime. */
+    task_threads_shutdown();
+
+    list_for_each_safe(&jobs, node, next, jobs) {
+        list_del(&node->jobs);
+        free(node);
     }
 }
 
-void lwan_job_add(bool (*cb)(void *data), void *data)
+void lwan_job_add_full(bool (*cb)(void *data),
+                       void *data,
+                       const char *name,
+                       enum lwan_job_priority priority,
+                       unsigned int min_interval_ms,
+                       unsigned int max_interval_ms)
 {
     assert(cb);
+    assert(priority < LWAN_JOB_PRIORITY_TASK);
+    assert(min_interval_ms > 0 && min_interval_ms <= max_interval_ms);
 
     struct job *job = calloc(1, sizeof(*job));
     if (!job)
@@ -150,9 +395,18 @@ void lwan_job_add(bool (*cb)(void *data), void *data)
 
     job->cb = cb;
     job->data = data;
+    job->task = (struct task){.cb = job_task, .data = job};
+    job->priority = priority;
+    job->min_interval_us = (uint64_t)min_interval_ms * 1000;
+    job->max_interval_us = (uint64_t)max_interval_ms * 1000;
+    job->interval_us = job->min_interval_us;
+    job->deadline_us = now_us() + job->interval_us;
+    job->stats.name = name;
 
     if (LIKELY(!pthread_mutex_lock(&queue_mutex))) {
-        list_add(&jobs, &job->jobs);
+        job->stats.id = next_job_id++;
+        list_add_tail(&jobs, &job->jobs);
+        pthread_cond_signal(&job_wait_cond);
         pthread_mutex_unlock(&queue_mutex);
     } else {
         lwan_status_warning("Couldn't lock job mutex");
@@ -160,6 +414,12 @@ void lwan_job_add(bool (*cb)(void *data), void *data)
     }
 }
 
+void lwan_job_add(bool (*cb)(void *data), void *data)
+{
+    lwan_job_add_full(cb, data, "job", LWAN_JOB_PRIORITY_LOW,
+                      DEFAULT_MIN_INTERVAL_MS, DEFAULT_MAX_INTERVAL_MS);
+}
+
 void lwan_job_del(bool (*cb)(void *data), void *data)
 {
     struct job *node, *next;
@@ -167,12 +427,34 @@ void lwan_job_del(bool (*cb)(void *data), void *data)
     assert(cb);
 
     if (LIKELY(!pthread_mutex_lock(&queue_mutex))) {
+    again:
         list_for_each_safe(&jobs, node, next, jobs) {
             if (cb == node->cb && data == node->data) {
+                /* Whoever's removing a job usually frees its data right
+                 * after, so wait for it if it's running. */
+                if (node->in_flight) {
+                    pthread_cond_wait(&job_done_cond, &queue_mutex);
+                    goto again;
+                }
+
                 list_del(&node->jobs);
                 free(node);
             }
         }
+        pthread_cond_signal(&job_wait_cond);
+        pthread_mutex_unlock(&queue_mutex);
+    }
+}
+
+void lwan_job_foreach_stats(void (*cb)(const struct lwan_job_stats *stats,
+                                       void *data),
+                            void *data)
+{
+    struct job *job;
+
+    if (LIKELY(!pthread_mutex_lock(&queue_mutex))) {
+        list_for_each(&jobs, job, jobs)
+            cb(&job->stats, data);
         pthread_mutex_unlock(&queue_mutex);
     }
 }
@@ -0,0 +1,1151 @@
+/*
+ * lwan - web server
+ * Copyright (c) 2024 L. A. F. Pereira <l@tia.mat.br>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#define _GNU_SOURCE
+#include <assert.h>
+#include <errno.h>
+#include <limits.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "lwan-private.h"
+
+#include "int-to-str.h"
+#include "lwan-kv-client.h"
+#include "lwan-resolver.h"
+
+/* Commands sent but not replied to yet, per connection */
+#define MAX_IN_FLIGHT 256
+
+/* Replies larger than this are considered a protocol error */
+#define MAX_REPLY_SIZE (16u << 20)
+
+#define READ_CHUNK_SIZE 16384
+
+/* Arrays in Redis replies can be nested, but not this deep */
+#define MAX_REPLY_DEPTH 16
+
+/* Lives in the stack of the coroutine waiting for the reply.  It's taken
+ * off the connection and filled in by the event loop; the reply is copied
+ * to memory allocated in the coroutine. */
+struct kv_waiter {
+    struct lwan_connection *conn;
+    char *reply;
+    size_t reply_len;
+    int error;
+    bool done;
+};
+
+struct kv_conn {
+    struct lwan_kv_endpoint *endpoint;
+    struct lwan_thread *thread;
+    int fd;
+
+    /* Set while EPOLLOUT is in the interest set, i.e. there's something
+     * in the output buffer that hasn't been written yet */
+    bool flushing;
+
+    struct lwan_strbuf out;
+    size_t out_offset;
+
+    struct {
+        char *data;
+        size_t len;
+        size_t capacity;
+    } in;
+
+    /* Replies arrive in the same order the commands have been sent.
+     * Waiters that went away leave a NULL behind, so that their replies
+     * are still consumed.  Positions are free-running. */
+    struct kv_waiter *in_flight[MAX_IN_FLIGHT];
+    unsigned int head, tail;
+};
+
+struct kv_conns {
+    size_t n_conns;
+    struct kv_conn conns[];
+};
+
+struct lwan_kv_endpoint {
+    union {
+        struct sockaddr_un un_addr;
+        struct sockaddr_in in_addr;
+        struct sockaddr_in6 in6_addr;
+        struct sockaddr_storage sock_addr;
+    };
+    socklen_t addr_size;
+    int addr_family;
+
+    /* Resolved whenever a new connection is made; see the HTTP client */
+    char *host_name;
+    uint16_t port;
+
+    enum lwan_kv_protocol protocol;
+    unsigned int timeout_ms;
+
+    /* One per I/O thread; allocated by the first request */
+    struct kv_conns *conns;
+};
+
+/* Both the command (or the command line, for memcached) and the data
+ * block are sent as is; for Redis, arguments are sent as an array of bulk
+ * strings. */
+struct kv_command {
+    size_t argc;
+    const struct lwan_value *argv;
+
+    const char *line;
+    const struct lwan_value *data;
+};
+
+struct lwan_kv_endpoint *lwan_kv_endpoint_new(const char *address,
+                                              enum lwan_kv_protocol protocol,
+                                              unsigned int timeout_ms)
+{
+    struct lwan_kv_endpoint *endpoint = calloc(1, sizeof(*endpoint));
+
+    if (!endpoint)
+        return NULL;
+
+    endpoint->protocol = protocol;
+    endpoint->timeout_ms = timeout_ms;
+
+    if (*address == '/') {
+        if (strlen(address) >= sizeof(endpoint->un_addr.sun_path)) {
+            lwan_status_error("KV client: `%s` is too long for a sockaddr_un",
+                              address);
+            goto error;
+        }
+
+        endpoint->addr_family = AF_UNIX;
+        endpoint->un_addr = (struct sockaddr_un){.sun_family = AF_UNIX};
+        endpoint->addr_size = sizeof(endpoint->un_addr);
+        memcpy(endpoint->un_addr.sun_path, address, strlen(address) + 1);
+        return endpoint;
+    }
+
+    char *address_copy = strdupa(address);
+    char *node, *port;
+    sa_family_t family = lwan_socket_parse_address(address_copy, &node, &port);
+    if (family == AF_MAX) {
+        lwan_status_error("KV client: Could not parse '%s' as 'address:port'",
+                          address);
+        goto error;
+    }
+
+    const struct addrinfo hints = {
+        .ai_family = family,
+        .ai_socktype = SOCK_STREAM,
+        .ai_flags = AI_NUMERICHOST | AI_NUMERICSERV,
+    };
+    struct addrinfo *addrs;
+    int ret = getaddrinfo(node, port, &hints, &addrs);
+    if (ret == EAI_NONAME) {
+        int port_number = parse_int(port, -1);
+        if (port_number <= 0 || port_number > 65535) {
+            lwan_status_error("KV client: Invalid port in '%s'", address);
+            goto error;
+        }
+
+        endpoint->host_name = strdup(node);
+        if (!endpoint->host_name)
+            goto error;
+        endpoint->port = (uint16_t)port_number;
+        endpoint->addr_family = family;
+        return endpoint;
+    }
+    if (ret) {
+        lwan_status_error("KV client: Could not parse '%s': %s", address,
+                          gai_strerror(ret));
+        goto error;
+    }
+
+    endpoint->addr_family = addrs->ai_family;
+    endpoint->addr_size = addrs->ai_addrlen;
+    memcpy(&endpoint->sock_addr, addrs->ai_addr, addrs->ai_addrlen);
+    freeaddrinfo(addrs);
+
+    return endpoint;
+
+error:
+    free(endpoint->host_name);
+    free(endpoint);
+    return NULL;
+}
+
+static void kv_conn_close(struct kv_conn *kv)
+{
+    if (kv->fd < 0)
+        return;
+
+    if (kv->thread)
+        lwan_thread_del_fd_watcher(kv->thread, kv->fd);
+    close(kv->fd);
+    kv->fd = -1;
+    kv->flushing = false;
+}
+
+static void free_conns(struct kv_conns *conns)
+{
+    for (size_t i = 0; i < conns->n_conns; i++) {
+        struct kv_conn *kv = &conns->conns[i];
+
+        /* Coroutines waiting for replies are gone by now */
+        for (unsigned int pos = kv->head; pos != kv->tail; pos++)
+            assert(!kv->in_flight[pos % MAX_IN_FLIGHT]);
+
+        kv_conn_close(kv);
+        lwan_strbuf_free(&kv->out);
+        free(kv->in.data);
+    }
+
+    free(conns);
+}
+
+void lwan_kv_endpoint_free(struct lwan_kv_endpoint *endpoint)
+{
+    if (!endpoint)
+        return;
+
+    if (endpoint->conns)
+        free_conns(endpoint->conns);
+
+    free(endpoint->host_name);
+    free(endpoint);
+}
+
+enum lwan_kv_protocol
+lwan_kv_endpoint_get_protocol(const struct lwan_kv_endpoint *endpoint)
+{
+    return endpoint->protocol;
+}
+
+static struct kv_conn *get_conn(struct lwan_kv_endpoint *endpoint,
+                                struct lwan_request *request)
+{
+    const struct lwan *lwan = request->conn->thread->lwan;
+    struct kv_conns *conns = __atomic_load_n(&endpoint->conns, __ATOMIC_ACQUIRE);
+
+    if (UNLIKELY(!conns)) {
+        const size_t n_conns = lwan->thread.count;
+        struct kv_conns *new_conns =
+            calloc(1, sizeof(*new_conns) + n_conns * sizeof(struct kv_conn));
+
+        if (!new_conns)
+            return NULL;
+
+        new_conns->n_conns = n_conns;
+        for (size_t i = 0; i < n_conns; i++) {
+            new_conns->conns[i].endpoint = endpoint;
+            new_conns->conns[i].thread = &lwan->thread.threads[i];
+            new_conns->conns[i].fd = -1;
+            lwan_strbuf_init(&new_conns->conns[i].out);
+        }
+
+        if (__atomic_compare_exchange_n(&endpoint->conns, &conns, new_conns,
+                                        false, __ATOMIC_ACQ_REL,
+                                        __ATOMIC_ACQUIRE)) {
+            conns = new_conns;
+        } else {
+            free_conns(new_conns);
+        }
+    }
+
+    return &conns->conns[request->conn->thread - lwan->thread.threads];
+}
+
+static void complete_waiter(struct kv_waiter *waiter,
+                            int error,
+                            const char *reply,
+                            size_t reply_len)
+{
+    if (!error) {
+        waiter->reply = coro_memdup(waiter->conn->coro, reply, reply_len);
+        if (UNLIKELY(!waiter->reply))
+            error = -ENOMEM;
+        waiter->reply_len = reply_len;
+    }
+
+    waiter->error = error;
+    waiter->done = true;
+    lwan_thread_wake_conn(waiter->conn);
+}
+
+/* Closes the connection, failing every command in flight; the next command
+ * will connect again. */
+static void kv_conn_fail(struct kv_conn *kv, int error)
+{
+    kv_conn_close(kv);
+
+    lwan_strbuf_reset(&kv->out);
+    kv->out_offset = 0;
+    kv->in.len = 0;
+
+    while (kv->head != kv->tail) {
+        struct kv_waiter *waiter = kv->in_flight[kv->head++ % MAX_IN_FLIGHT];
+
+        if (waiter)
+            complete_waiter(waiter, error, NULL, 0);
+    }
+}
+
+static int kv_conn_flush(struct kv_conn *kv)
+{
+    const size_t len = lwan_strbuf_get_length(&kv->out);
+
+    while (kv->out_offset < len) {
+        ssize_t written =
+            send(kv->fd, lwan_strbuf_get_buffer(&kv->out) + kv->out_offset,
+                 len - kv->out_offset, MSG_NOSIGNAL | MSG_DONTWAIT);
+
+        if (written < 0) {
+            switch (errno) {
+            case EINTR:
+                continue;
+            case EAGAIN:
+                return 0;
+            default:
+                return -errno;
+            }
+        }
+
+        kv->out_offset += (size_t)written;
+    }
+
+    lwan_strbuf_reset(&kv->out);
+    kv->out_offset = 0;
+
+    if (kv->flushing) {
+        kv->flushing = false;
+        return lwan_thread_mod_fd_watcher(kv->thread, kv->fd, EPOLLIN);
+    }
+
+    return 0;
+}
+
+/* Commands aren't written right away: the connection waits to be writable
+ * first, which, most of the time, happens on the next iteration of the
+ * event loop.  By then, every coroutine that ran in this iteration had
+ * the chance to add its own commands, and they're all sent at once. */
+static int kv_conn_schedule_flush(struct kv_conn *kv)
+{
+    if (kv->flushing)
+        return 0;
+
+    int r = lwan_thread_mod_fd_watcher(kv->thread, kv->fd, EPOLLIN | EPOLLOUT);
+    if (LIKELY(!r))
+        kv->flushing = true;
+
+    return r;
+}
+
+static bool parse_decimal(const char *s, const char *end, long long *out)
+{
+    bool negative = false;
+    long long value = 0;
+
+    if (s < end && *s == '-') {
+        negative = true;
+        s++;
+    }
+    if (s == end)
+        return false;
+
+    for (; s < end; s++) {
+        if (!lwan_char_isdigit(*s))
+            return false;
+        if (__builtin_mul_overflow(value, 10, &value) ||
+            __builtin_add_overflow(value, *s - '0', &value))
+            return false;
+    }
+
+    *out = negative ? -value : value;
+    return true;
+}
+
+/* Finds the line starting at @buf, returning the position of the CR of
+ * its terminating CRLF, NULL if it's incomplete, or @end if it's
+ * malformed. */
+static const char *find_eol(const char *buf, const char *end)
+{
+    const char *lf = memchr(buf, '\n', (size_t)(end - buf));
+
+    if (!lf)
+        return NULL;
+    if (lf == buf || lf[-1] != '\r')
+        return end;
+
+    return lf - 1;
+}
+
+/* Both return the length of the reply at the beginning of @buf, 0 if it
+ * hasn't been received in full yet, or -EPROTO. */
+static ssize_t resp_reply_len(const char *buf, size_t len)
+{
+    const char *const end = buf + len;
+    const char *pos = buf;
+    long long pending = 1;
+
+    while (pending--) {
+        const char *eol = find_eol(pos, end);
+        long long n;
+
+        if (!eol)
+            return 0;
+        if (eol == end)
+            return -EPROTO;
+
+        switch (*pos) {
+        case '+':
+        case '-':
+            pos = eol + 2;
+            break;
+        case ':':
+            if (!parse_decimal(pos + 1, eol, &n))
+                return -EPROTO;
+            pos = eol + 2;
+            break;
+        case '$':
+            if (!parse_decimal(pos + 1, eol, &n) || n < -1 ||
+                n > MAX_REPLY_SIZE)
+                return -EPROTO;
+            pos = eol + 2;
+            if (n >= 0) {
+                if ((size_t)(end - pos) < (size_t)n + 2)
+                    return 0;
+                if (pos[n] != '\r' || pos[n + 1] != '\n')
+                    return -EPROTO;
+                pos += n + 2;
+            }
+            break;
+        case '*':
+            if (!parse_decimal(pos + 1, eol, &n) || n < -1 ||
+                n > MAX_REPLY_SIZE)
+                return -EPROTO;
+            if (n > 0)
+                pending += n;
+            pos = eol + 2;
+            break;
+        default:
+            return -EPROTO;
+        }
+    }
+
+    return pos - buf;
+}
+
+static bool has_prefix(const char *line, const char *eol, const char *prefix)
+{
+    const size_t len = strlen(prefix);
+
+    return (size_t)(eol - line) >= len && !memcmp(line, prefix, len);
+}
+
+/* "VALUE <key> <flags> <bytes> [<cas unique>]" */
+static bool memcached_value_len(const char *line, const char *eol, size_t *len)
+{
+    const char *token = line;
+    long long n;
+
+    for (int i = 0; i < 3; i++) {
+        token = memchr(token, ' ', (size_t)(eol - token));
+        if (!token)
+            return false;
+        token++;
+    }
+
+    const char *token_end = memchr(token, ' ', (size_t)(eol - token));
+    if (!token_end)
+        token_end = eol;
+
+    if (!parse_decimal(token, token_end, &n) || n < 0 || n > MAX_REPLY_SIZE)
+        return false;
+
+    *len = (size_t)n;
+    return true;
+}
+
+static ssize_t memcached_reply_len(const char *buf, size_t len)
+{
+    const char *const end = buf + len;
+    const char *pos = buf;
+    bool multi_line = false;
+
+    while (true) {
+        const char *eol = find_eol(pos, end);
+        size_t value_len;
+
+        if (!eol)
+            return 0;
+        if (eol == end)
+            return -EPROTO;
+
+        /* Retrievals and statistics span multiple lines, and end with an
+         * "END" line; everything else is a single line. */
+        if (eol - pos == 3 && !memcmp(pos, "END", 3))
+            return eol + 2 - buf;
+
+        if (has_prefix(pos, eol, "VALUE ")) {
+            if (!memcached_value_len(pos, eol, &value_len))
+                return -EPROTO;
+            pos = eol + 2;
+            if ((size_t)(end - pos) < value_len + 2)
+                return 0;
+            if (pos[value_len] != '\r' || pos[value_len + 1] != '\n')
+                return -EPROTO;
+            pos += value_len + 2;
+        } else if (has_prefix(pos, eol, "STAT ")) {
+            pos = eol + 2;
+        } else if (multi_line) {
+            return -EPROTO;
+        } else {
+            return eol + 2 - buf;
+        }
+
+        multi_line = true;
+    }
+}
+
+static void kv_conn_read_replies(struct kv_conn *kv)
+{
+    ssize_t (*const reply_len)(const char *buf, size_t len) =
+        kv->endpoint->protocol == LWAN_KV_REDIS ? resp_reply_len
+                                                : memcached_reply_len;
+
+    while (true) {
+        if (kv->in.capacity - kv->in.len < READ_CHUNK_SIZE) {
+            size_t capacity = LWAN_MAX(kv->in.capacity * 2,
+                                       kv->in.len + READ_CHUNK_SIZE);
+            char *data = realloc(kv->in.data, capacity);
+
+            if (!data) {
+                kv_conn_fail(kv, -ENOMEM);
+                return;
+            }
+            kv->in.data = data;
+            kv->in.capacity = capacity;
+        }
+
+        const size_t room = kv->in.capacity - kv->in.len;
+        ssize_t n = recv(kv->fd, kv->in.data + kv->in.len, room, MSG_DONTWAIT);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno != EAGAIN)
+                kv_conn_fail(kv, -errno);
+            return;
+        }
+        if (!n) {
+            /* Servers might close idle connections as well */
+            kv_conn_fail(kv, -ECONNRESET);
+            return;
+        }
+
+        kv->in.len += (size_t)n;
+
+        size_t pos = 0;
+        while (kv->head != kv->tail) {
+            ssize_t len = reply_len(kv->in.data + pos, kv->in.len - pos);
+
+            if (!len)
+                break;
+            if (len < 0) {
+                kv_conn_fail(kv, -EPROTO);
+                return;
+            }
+
+            struct kv_waiter *waiter = kv->in_flight[kv->head++ % MAX_IN_FLIGHT];
+            if (waiter)
+                complete_waiter(waiter, 0, kv->in.data + pos, (size_t)len);
+            pos += (size_t)len;
+        }
+
+        kv->in.len -= pos;
+        memmove(kv->in.data, kv->in.data + pos, kv->in.len);
+
+        if (kv->in.len && kv->head == kv->tail) {
+            /* Nothing has been asked for this */
+            kv_conn_fail(kv, -EPROTO);
+            return;
+        }
+        if (kv->in.len > MAX_REPLY_SIZE) {
+            kv_conn_fail(kv, -EFBIG);
+            return;
+        }
+
+        if ((size_t)n < room)
+            return;
+    }
+}
+
+static void kv_conn_handle_events(void *data, uint32_t events)
+{
+    struct kv_conn *kv = data;
+
+    if (UNLIKELY(!events)) {
+        /* The thread is being shut down */
+        kv->thread = NULL;
+        kv_conn_close(kv);
+        return;
+    }
+
+    if (events & EPOLLOUT) {
+        int r = kv_conn_flush(kv);
+
+        if (r < 0) {
+            kv_conn_fail(kv, r);
+            return;
+        }
+    }
+
+    if (events & (EPOLLIN | EPOLLERR | EPOLLHUP))
+        kv_conn_read_replies(kv);
+}
+
+static int kv_conn_connect(struct lwan_request *request, struct kv_conn *kv)
+{
+    struct lwan_kv_endpoint *endpoint = kv->endpoint;
+    struct sockaddr_storage resolved;
+    const struct sockaddr *addr = (struct sockaddr *)&endpoint->sock_addr;
+    socklen_t addr_size = endpoint->addr_size;
+    int fd, r;
+
+    if (endpoint->host_name) {
+        r = lwan_request_resolve(request, endpoint->host_name, endpoint->port,
+                                 endpoint->addr_family, &resolved, &addr_size);
+        if (r < 0)
+            return r;
+
+        /* Another coroutine might have connected in the meantime */
+        if (kv->fd >= 0)
+            return 0;
+
+        addr = (struct sockaddr *)&resolved;
+    }
+
+    fd = socket(addr->sa_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+        return -errno;
+
+    if (addr->sa_family != AF_UNIX)
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, (int[]){1}, sizeof(int));
+
+    /* Whatever is queued is written once the connection is established */
+    if (connect(fd, addr, addr_size) < 0 && errno != EINPROGRESS) {
+        r = -errno;
+        close(fd);
+        return r;
+    }
+
+    r = lwan_thread_add_fd_watcher(kv->thread, fd, EPOLLIN,
+                                   kv_conn_handle_events, kv);
+    if (r < 0) {
+        close(fd);
+        return r;
+    }
+
+    kv->fd = fd;
+    return 0;
+}
+
+static bool append_command(struct lwan_strbuf *out,
+                           enum lwan_kv_protocol protocol,
+                           const struct kv_command *command)
+{
+    if (protocol == LWAN_KV_REDIS) {
+        if (!lwan_strbuf_append_printf(out, "*%zu\r\n", command->argc))
+            return false;
+
+        for (size_t i = 0; i < command->argc; i++) {
+            const struct lwan_value *arg = &command->argv[i];
+
+            if (!lwan_strbuf_append_printf(out, "$%zu\r\n", arg->len) ||
+                !lwan_strbuf_append_str(out, arg->value, arg->len) ||
+                !lwan_strbuf_append_strz(out, "\r\n"))
+                return false;
+        }
+
+        return true;
+    }
+
+    if (!lwan_strbuf_append_strz(out, command->line) ||
+        !lwan_strbuf_append_strz(out, "\r\n"))
+        return false;
+    if (command->data &&
+        (!lwan_strbuf_append_str(out, command->data->value,
+                                 command->data->len) ||
+         !lwan_strbuf_append_strz(out, "\r\n")))
+        return false;
+
+    return true;
+}
+
+static void abandon_waiter(void *data1, void *data2)
+{
+    struct kv_conn *kv = data1;
+    struct kv_waiter *waiter = data2;
+
+    /* The coroutine is going away before the reply arrived; it's still
+     * going to be read, but not copied anywhere. */
+    if (waiter->done)
+        return;
+
+    for (unsigned int i = kv->head; i != kv->tail; i++) {
+        if (kv->in_flight[i % MAX_IN_FLIGHT] == waiter) {
+            kv->in_flight[i % MAX_IN_FLIGHT] = NULL;
+            return;
+        }
+    }
+}
+
+static void remove_timeout(void *data1, void *data2)
+{
+    /* No-op if the timeout has already expired */
+    timeouts_del(data1, data2);
+}
+
+static void wait_for_reply(struct lwan_request *request,
+                           struct kv_conn *kv,
+                           struct kv_waiter *waiter)
+{
+    struct lwan_connection *conn = request->conn;
+    const unsigned int timeout_ms = kv->endpoint->timeout_ms;
+    coro_deferred timeout_defer = -1;
+    coro_deferred defer = coro_defer2(conn->coro, abandon_waiter, kv, waiter);
+
+    if (timeout_ms) {
+        struct timeouts *wheel = conn->thread->wheel;
+        struct timespec now;
+
+        /* Same as lwan_request_await_any_of(): when the timeout expires,
+         * the connection is resumed as if it were writable. */
+        if (UNLIKELY(clock_gettime(monotonic_clock_id, &now) < 0))
+            lwan_status_critical("Could not get monotonic time");
+        timeouts_update(wheel, (timeout_t)(now.tv_sec * 1000 +
+                                           now.tv_nsec / 1000000));
+
+        request->timeout = (struct timeout){};
+        timeouts_add(wheel, &request->timeout, timeout_ms);
+        timeout_defer =
+            coro_defer2(conn->coro, remove_timeout, wheel, &request->timeout);
+    }
+
+    for (bool keep_events = true; !waiter->done; keep_events = false) {
+        lwan_thread_park_conn(request, keep_events);
+
+        if (!waiter->done && timeout_ms && !request->timeout.pending) {
+            /* Replies come in order, so everything behind this one would
+             * have to wait as well.  This coroutine is already running, so
+             * it's taken off the connection rather than woken up. */
+            abandon_waiter(kv, waiter);
+            kv_conn_fail(kv, -ETIMEDOUT);
+            waiter->error = -ETIMEDOUT;
+            break;
+        }
+    }
+
+    if (timeout_defer >= 0)
+        coro_defer_fire_and_disarm(conn->coro, timeout_defer);
+    coro_defer_disarm(conn->coro, defer);
+}
+
+static int kv_call(struct lwan_request *request,
+                   struct lwan_kv_endpoint *endpoint,
+                   const struct kv_command *command,
+                   struct lwan_value *reply)
+{
+    struct kv_conn *kv = get_conn(endpoint, request);
+    int r;
+
+    if (UNLIKELY(!kv))
+        return -ENOMEM;
+
+    if (kv->fd < 0) {
+        r = kv_conn_connect(request, kv);
+        if (r < 0)
+            return r;
+    }
+
+    if (UNLIKELY(kv->tail - kv->head == MAX_IN_FLIGHT))
+        return -EBUSY;
+
+    /* A command that's been partially added to the output buffer can't
+     * be taken out of it, so the connection has to go. */
+    if (UNLIKELY(!append_command(&kv->out, endpoint->protocol, command))) {
+        kv_conn_fail(kv, -ENOMEM);
+        return -ENOMEM;
+    }
+
+    r = kv_conn_schedule_flush(kv);
+    if (UNLIKELY(r < 0)) {
+        kv_conn_fail(kv, r);
+        return r;
+    }
+
+    struct kv_waiter waiter = {.conn = request->conn};
+    kv->in_flight[kv->tail++ % MAX_IN_FLIGHT] = &waiter;
+
+    wait_for_reply(request, kv, &waiter);
+    if (waiter.error)
+        return waiter.error;
+
+    *reply = (struct lwan_value){.value = waiter.reply, .len = waiter.reply_len};
+    return 0;
+}
+
+static int resp_decode(struct coro *coro,
+                       const char **pos,
+                       const char *end,
+                       struct lwan_kv_reply *reply,
+                       int depth)
+{
+    const char *eol = find_eol(*pos, end);
+    const char *line = *pos + 1;
+    long long n;
+
+    if (!eol || eol == end)
+        return -EPROTO;
+
+    *pos = eol + 2;
+
+    switch (line[-1]) {
+    case '+':
+    case '-':
+        reply->type =
+            line[-1] == '+' ? LWAN_KV_REPLY_STATUS : LWAN_KV_REPLY_ERROR;
+        reply->string.len = (size_t)(eol - line);
+        reply->string.value = coro_strndup(coro, line, reply->string.len);
+        return reply->string.value ? 0 : -ENOMEM;
+
+    case ':':
+        if (!parse_decimal(line, eol, &n))
+            return -EPROTO;
+        reply->type = LWAN_KV_REPLY_INTEGER;
+        reply->integer = n;
+        return 0;
+
+    case '$':
+        if (!parse_decimal(line, eol, &n))
+            return -EPROTO;
+        if (n < 0) {
+            reply->type = LWAN_KV_REPLY_NIL;
+            return 0;
+        }
+        if (end - *pos < n + 2)
+            return -EPROTO;
+        reply->type = LWAN_KV_REPLY_STRING;
+        reply->string.len = (size_t)n;
+        reply->string.value = coro_strndup(coro, *pos, (size_t)n);
+        *pos += n + 2;
+        return reply->string.value ? 0 : -ENOMEM;
+
+    case '*':
+        if (!parse_decimal(line, eol, &n))
+            return -EPROTO;
+        if (n < 0) {
+            reply->type = LWAN_KV_REPLY_NIL;
+            return 0;
+        }
+        if (depth == MAX_REPLY_DEPTH)
+            return -EPROTO;
+
+        reply->type = LWAN_KV_REPLY_ARRAY;
+        reply->array.n_elements = (size_t)n;
+        reply->array.elements =
+            coro_malloc(coro, (size_t)n * sizeof(*reply->array.elements));
+        if (n && !reply->array.elements)
+            return -ENOMEM;
+
+        for (long long i = 0; i < n; i++) {
+            int r = resp_decode(coro, pos, end, &reply->array.elements[i],
+                                depth + 1);
+            if (r < 0)
+                return r;
+        }
+        return 0;
+
+    default:
+        return -EPROTO;
+    }
+}
+
+static int redis_call(struct lwan_request *request,
+                      struct lwan_kv_endpoint *endpoint,
+                      size_t argc,
+                      const struct lwan_value argv[],
+                      struct lwan_kv_reply *reply)
+{
+    const struct kv_command command = {.argc = argc, .argv = argv};
+    struct lwan_value raw;
+    int r;
+
+    r = kv_call(request, endpoint, &command, &raw);
+    if (r < 0)
+        return r;
+
+    const char *pos = raw.value;
+    return resp_decode(request->conn->coro, &pos, raw.value + raw.len, reply, 0);
+}
+
+int lwan_kv_redis_command(struct lwan_request *request,
+                          struct lwan_kv_endpoint *endpoint,
+                          size_t argc,
+                          const struct lwan_value argv[],
+                          struct lwan_kv_reply **reply)
+{
+    if (endpoint->protocol != LWAN_KV_REDIS || !argc)
+        return -EINVAL;
+
+    *reply = coro_malloc(request->conn->coro, sizeof(**reply));
+    if (!*reply)
+        return -ENOMEM;
+
+    return redis_call(request, endpoint, argc, argv, *reply);
+}
+
+#define VALUE_STR(s)                                                           \
+    (struct lwan_value) { .value = (char *)(s), .len = strlen(s) }
+
+/* Keys are sent as is in the command line */
+static bool is_memcached_key(const char *key)
+{
+    size_t len = 0;
+
+    for (; key[len]; len++) {
+        if ((unsigned char)key[len] <= ' ' || key[len] == 0x7f)
+            return false;
+    }
+
+    return len && len <= 250;
+}
+
+static bool memcached_reply_is(const struct lwan_value *reply,
+                               const char *expected)
+{
+    const size_t len = strlen(expected);
+
+    return reply->len == len + 2 && !memcmp(reply->value, expected, len);
+}
+
+static int memcached_call(struct lwan_request *request,
+                          struct lwan_kv_endpoint *endpoint,
+                          const struct lwan_value *data,
+                          struct lwan_value *reply,
+                          const char *fmt,
+                          ...) __attribute__((format(printf, 5, 6)));
+
+static int memcached_call(struct lwan_request *request,
+                          struct lwan_kv_endpoint *endpoint,
+                          const struct lwan_value *data,
+                          struct lwan_value *reply,
+                          const char *fmt,
+                          ...)
+{
+    /* Keys are at most 250 bytes long, so this is plenty */
+    char line[384];
+    va_list ap;
+    int len;
+
+    va_start(ap, fmt);
+    len = vsnprintf(line, sizeof(line), fmt, ap);
+    va_end(ap);
+
+    if (len < 0 || (size_t)len >= sizeof(line))
+        return -EINVAL;
+
+    const struct kv_command command = {.line = line, .data = data};
+    return kv_call(request, endpoint, &command, reply);
+}
+
+int lwan_kv_get(struct lwan_request *request,
+                struct lwan_kv_endpoint *endpoint,
+                const char *key,
+                struct lwan_value *value)
+{
+    struct coro *coro = request->conn->coro;
+    int r;
+
+    if (endpoint->protocol == LWAN_KV_REDIS) {
+        const struct lwan_value argv[] = {VALUE_STR("GET"), VALUE_STR(key)};
+        struct lwan_kv_reply reply;
+
+        r = redis_call(request, endpoint, N_ELEMENTS(argv), argv, &reply);
+        if (r < 0)
+            return r;
+        if (reply.type == LWAN_KV_REPLY_NIL)
+            return -ENOENT;
+        if (reply.type != LWAN_KV_REPLY_STRING)
+            return -EPROTO;
+
+        *value = reply.string;
+        return 0;
+    }
+
+    struct lwan_value reply;
+
+    if (!is_memcached_key(key))
+        return -EINVAL;
+
+    r = memcached_call(request, endpoint, NULL, &reply, "get %s", key);
+    if (r < 0)
+        return r;
+    if (memcached_reply_is(&reply, "END"))
+        return -ENOENT;
+
+    const char *end = reply.value + reply.len;
+    const char *eol = find_eol(reply.value, end);
+    size_t len;
+    if (!eol || eol == end || !has_prefix(reply.value, eol, "VALUE ") ||
+        !memcached_value_len(reply.value, eol, &len))
+        return -EPROTO;
+
+    value->len = len;
+    value->value = coro_strndup(coro, eol + 2, len);
+    return value->value ? 0 : -ENOMEM;
+}
+
+int lwan_kv_set(struct lwan_request *request,
+                struct lwan_kv_endpoint *endpoint,
+                const char *key,
+                const struct lwan_value *value,
+                unsigned int ttl)
+{
+    int r;
+
+    if (endpoint->protocol == LWAN_KV_REDIS) {
+        char ttl_buf[INT_TO_STR_BUFFER_SIZE];
+        size_t ttl_len;
+        char *ttl_str = uint_to_string(ttl, ttl_buf, &ttl_len);
+        const struct lwan_value argv[] = {
+            VALUE_STR("SET"),
+            VALUE_STR(key),
+            *value,
+            VALUE_STR("EX"),
+            {.value = ttl_str, .len = ttl_len},
+        };
+        struct lwan_kv_reply reply;
+
+        r = redis_call(request, endpoint, ttl ? 5 : 3, argv, &reply);
+        if (r < 0)
+            return r;
+
+        return reply.type == LWAN_KV_REPLY_STATUS ? 0 : -EPROTO;
+    }
+
+    struct lwan_value reply;
+
+    if (!is_memcached_key(key))
+        return -EINVAL;
+
+    r = memcached_call(request, endpoint, value, &reply, "set %s 0 %u %zu",
+                       key, ttl, value->len);
+    if (r < 0)
+        return r;
+
+    return memcached_reply_is(&reply, "STORED") ? 0 : -EPROTO;
+}
+
+int lwan_kv_delete(struct lwan_request *request,
+                   struct lwan_kv_endpoint *endpoint,
+                   const char *key)
+{
+    int r;
+
+    if (endpoint->protocol == LWAN_KV_REDIS) {
+        const struct lwan_value argv[] = {VALUE_STR("DEL"), VALUE_STR(key)};
+        struct lwan_kv_reply reply;
+
+        r = redis_call(request, endpoint, N_ELEMENTS(argv), argv, &reply);
+        if (r < 0)
+            return r;
+        if (reply.type != LWAN_KV_REPLY_INTEGER)
+            return -EPROTO;
+
+        return reply.integer ? 0 : -ENOENT;
+    }
+
+    struct lwan_value reply;
+
+    if (!is_memcached_key(key))
+        return -EINVAL;
+
+    r = memcached_call(request, endpoint, NULL, &reply, "delete %s", key);
+    if (r < 0)
+        return r;
+    if (memcached_reply_is(&reply, "DELETED"))
+        return 0;
+
+    return memcached_reply_is(&reply, "NOT_FOUND") ? -ENOENT : -EPROTO;
+}
+
+int lwan_kv_incr(struct lwan_request *request,
+                 struct lwan_kv_endpoint *endpoint,
+                 const char *key,
+                 long long delta,
+                 long long *result)
+{
+    int r;
+
+    if (endpoint->protocol == LWAN_KV_REDIS) {
+        char delta_str[3 * sizeof(long long) + 2];
+        const int delta_len =
+            snprintf(delta_str, sizeof(delta_str), "%lld", delta);
+        const struct lwan_value argv[] = {
+            VALUE_STR("INCRBY"),
+            VALUE_STR(key),
+            {.value = delta_str, .len = (size_t)delta_len},
+        };
+        struct lwan_kv_reply reply;
+
+        r = redis_call(request, endpoint, N_ELEMENTS(argv), argv, &reply);
+        if (r < 0)
+            return r;
+        if (reply.type != LWAN_KV_REPLY_INTEGER)
+            return -EPROTO;
+
+        *result = reply.integer;
+        return 0;
+    }
+
+    struct lwan_value reply;
+
+    if (!is_memcached_key(key) || delta == LLONG_MIN)
+        return -EINVAL;
+
+    r = memcached_call(request, endpoint, NULL, &reply, "%s %s %lld",
+                       delta < 0 ? "decr" : "incr", key,
+                       delta < 0 ? -delta : delta);
+    if (r < 0)
+        return r;
+    if (memcached_reply_is(&reply, "NOT_FOUND"))
+        return -ENOENT;
+
+    return parse_decimal(reply.value, reply.value + reply.len - 2, result)
+               ? 0
+               : -EPROTO;
+}
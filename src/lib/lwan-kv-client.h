@@ -0,0 +1,118 @@
+/*
+ * lwan - web server
+ * Copyright (c) 2024 L. A. F. Pereira <l@tia.mat.br>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#pragma once
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+#include "lwan.h"
+
+/* Client for key-value stores speaking the Redis (RESP2) or the memcached
+ * text protocol, for request handlers.
+ *
+ * Each I/O thread has a single connection to every endpoint, shared by all
+ * of its coroutines: commands are pipelined, and commands issued by
+ * coroutines running in the same iteration of the event loop are sent
+ * with a single write.  The connection is driven by the event loop rather
+ * than by any coroutine; coroutines waiting for a reply are parked until
+ * it arrives.  Connections are made (and host names resolved) when the
+ * first command is issued, and again after a failure.
+ *
+ * If a reply takes longer than the timeout of the endpoint, the server is
+ * presumed to be stuck: the connection is closed, and every command in
+ * flight fails with -ETIMEDOUT. */
+
+enum lwan_kv_protocol {
+    LWAN_KV_REDIS,
+    LWAN_KV_MEMCACHED,
+};
+
+enum lwan_kv_reply_type {
+    LWAN_KV_REPLY_STRING,
+    LWAN_KV_REPLY_STATUS,
+    LWAN_KV_REPLY_ERROR,
+    LWAN_KV_REPLY_INTEGER,
+    LWAN_KV_REPLY_NIL,
+    LWAN_KV_REPLY_ARRAY,
+};
+
+struct lwan_kv_reply {
+    enum lwan_kv_reply_type type;
+    union {
+        /* STRING, STATUS and ERROR; NUL-terminated */
+        struct lwan_value string;
+        long long integer;
+        struct {
+            struct lwan_kv_reply *elements;
+            size_t n_elements;
+        } array;
+    };
+};
+
+struct lwan_kv_endpoint;
+
+/* @address is either "host:port" or a path to a UNIX domain socket.
+ * @timeout_ms is 0 to wait for replies for as long as the request is
+ * allowed to live.  Endpoints must be freed either after the I/O threads
+ * have been shut down, or by the only thread that has used them. */
+struct lwan_kv_endpoint *lwan_kv_endpoint_new(const char *address,
+                                              enum lwan_kv_protocol protocol,
+                                              unsigned int timeout_ms);
+void lwan_kv_endpoint_free(struct lwan_kv_endpoint *endpoint);
+enum lwan_kv_protocol
+lwan_kv_endpoint_get_protocol(const struct lwan_kv_endpoint *endpoint);
+
+/* These work with both protocols, and return 0 or -errno: -ENOENT if the
+ * key doesn't exist, -EINVAL if it can't be used as a key, -EPROTO if the
+ * server didn't like the command.  Values are allocated in the coroutine
+ * of the request.  memcached doesn't increment keys that don't exist yet;
+ * Redis does, starting from 0. */
+int lwan_kv_get(struct lwan_request *request,
+                struct lwan_kv_endpoint *endpoint,
+                const char *key,
+                struct lwan_value *value);
+/* @ttl is in seconds; 0 for values that never expire */
+int lwan_kv_set(struct lwan_request *request,
+                struct lwan_kv_endpoint *endpoint,
+                const char *key,
+                const struct lwan_value *value,
+                unsigned int ttl);
+int lwan_kv_delete(struct lwan_request *request,
+                   struct lwan_kv_endpoint *endpoint,
+                   const char *key);
+int lwan_kv_incr(struct lwan_request *request,
+                 struct lwan_kv_endpoint *endpoint,
+                 const char *key,
+                 long long delta,
+                 long long *result);
+
+/* Sends an arbitrary command to a Redis endpoint.  Error replies are not
+ * failures: they're returned as LWAN_KV_REPLY_ERROR.  The reply is
+ * allocated in the coroutine of the request. */
+int lwan_kv_redis_command(struct lwan_request *request,
+                          struct lwan_kv_endpoint *endpoint,
+                          size_t argc,
+                          const struct lwan_value argv[],
+                          struct lwan_kv_reply **reply);
+
+#if defined(__cplusplus)
+}
+#endif
@@ -0,0 +1,341 @@
+/*
+ * lwan - web server
+ * Copyright (c) 2024 L. A. F. Pereira <l@tia.mat.br>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301,
+ * USA.
+ */
+
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "lwan-private.h"
+
+/* Latencies are kept in log-linear histograms: values below 16 get a
+ * bucket each, and every power of two above that is split in 16 buckets,
+ * so quantiles are off by at most ~6%.  Each I/O thread has its own
+ * histograms (one per URL map, in microseconds, and two for the event
+ * loop, in nanoseconds), updated without any synchronization; they're
+ * only added up when scraped.  So are the totals of what requests handled
+ * by each URL map have used. */
+#define SUB_BUCKET_BITS 4
+#define SUB_BUCKETS (1u << SUB_BUCKET_BITS)
+#define MAX_EXPONENT 40 /* ~12 days in microseconds, ~18 minutes in ns */
+#define N_BUCKETS (SUB_BUCKETS + (MAX_EXPONENT - SUB_BUCKET_BITS) * SUB_BUCKETS)
+
+struct lwan_latency_histogram {
+    uint64_t count;
+    uint64_t sum;
+    uint64_t buckets[N_BUCKETS];
+};
+
+struct url_map_stats {
+    struct lwan_latency_histogram latency;
+    struct lwan_url_map_usage usage;
+};
+
+struct lwan_thread_latency {
+    /* Indexed by lwan_url_map::latency_id, allocated on first use */
+    struct url_map_stats *url_maps[LWAN_LATENCY_MAX_URL_MAPS];
+
+    /* From epoll readiness until a coroutine is resumed */
+    struct lwan_latency_histogram scheduling_delay;
+    /* How long coroutines run until they yield */
+    struct lwan_latency_histogram resume_duration;
+};
+
+bool lwan_latency_enabled;
+
+/* URL maps are identified by their prefix, so that a map that is
+ * replaced (e.g. by lwan_set_url_map()) keeps its histograms.  Entries
+ * are never removed, so readers only need to look at the count. */
+static struct {
+    pthread_mutex_t lock;
+    char *prefixes[LWAN_LATENCY_MAX_URL_MAPS];
+    unsigned int count;
+} url_maps = {.lock = PTHREAD_MUTEX_INITIALIZER};
+
+unsigned int lwan_latency_url_map_id(const char *prefix)
+{
+    unsigned int id;
+
+    pthread_mutex_lock(&url_maps.lock);
+
+    for (id = 0; id < url_maps.count; id++) {
+        if (streq(url_maps.prefixes[id], prefix))
+            goto out;
+    }
+
+    if (url_maps.count == LWAN_LATENCY_MAX_URL_MAPS) {
+        lwan_status_warning("Not keeping latency histograms for %s: too "
+                            "many URL maps",
+                            prefix);
+        id = LWAN_LATENCY_UNTRACKED;
+        goto out;
+    }
+
+    url_maps.prefixes[id] = strdup(prefix);
+    if (!url_maps.prefixes[id]) {
+        id = LWAN_LATENCY_UNTRACKED;
+        goto out;
+    }
+
+    __atomic_store_n(&url_maps.count, id + 1, __ATOMIC_RELEASE);
+
+out:
+    pthread_mutex_unlock(&url_maps.lock);
+    return id;
+}
+
+void lwan_latency_enable(void)
+{
+    lwan_latency_enabled = true;
+}
+
+void lwan_latency_thread_init(struct lwan_thread *t)
+{
+    t->latency = calloc(1, sizeof(*t->latency));
+    if (!t->latency)
+        lwan_status_critical_perror("Could not allocate latency histograms");
+}
+
+void lwan_latency_thread_shutdown(struct lwan_thread *t)
+{
+    if (!t->latency)
+        return;
+
+    for (unsigned int i = 0; i < LWAN_LATENCY_MAX_URL_MAPS; i++)
+        free(t->latency->url_maps[i]);
+    free(t->latency);
+    t->latency = NULL;
+}
+
+static unsigned int bucket_index(uint64_t us)
+{
+    unsigned int exponent;
+
+    if (us < SUB_BUCKETS)
+        return (unsigned int)us;
+
+    exponent = 63u - (unsigned int)__builtin_clzll(us);
+    if (UNLIKELY(exponent >= MAX_EXPONENT))
+        return N_BUCKETS - 1;
+
+    return SUB_BUCKETS + (exponent - SUB_BUCKET_BITS) * SUB_BUCKETS +
+           (unsigned int)((us >> (exponent - SUB_BUCKET_BITS)) &
+                          (SUB_BUCKETS - 1));
+}
+
+static uint64_t bucket_upper_bound(unsigned int index)
+{
+    unsigned int shift;
+
+    if (index < SUB_BUCKETS)
+        return index;
+
+    index -= SUB_BUCKETS;
+    shift = index / SUB_BUCKETS;
+
+    return ((uint64_t)(SUB_BUCKETS + index % SUB_BUCKETS + 1) << shift) - 1;
+}
+
+static ALWAYS_INLINE void
+histogram_record(struct lwan_latency_histogram *histogram, uint64_t value)
+{
+    histogram->sum += value;
+    histogram->buckets[bucket_index(value)]++;
+}
+
+void lwan_latency_usage_snapshot(const struct coro *coro,
+                                 struct lwan_url_map_usage *usage)
+{
+    const struct coro_usage *coro_usage = coro_get_usage(coro);
+
+    /* Cycles are added up when the coroutine yields, so the ones since it
+     * has been resumed (this is called from within it) aren't there yet */
+    *usage = (struct lwan_url_map_usage){
+        .cycles = coro_usage->cycles +
+                  (lwan_read_cycle_counter() - coro_usage->resumed_at),
+        .yields = coro_usage->yields,
+        .arena_allocs = coro_usage->arena_allocs,
+        .arena_bytes = coro_usage->arena_bytes,
+        .heap_allocs = coro_usage->heap_allocs,
+        .heap_bytes = coro_usage->heap_bytes,
+    };
+}
+
+void lwan_latency_record(struct lwan_thread *t,
+                         unsigned int url_map_id,
+                         uint64_t us,
+                         const struct coro *coro,
+                         const struct lwan_url_map_usage *begin)
+{
+    struct lwan_url_map_usage now;
+    struct url_map_stats *stats;
+
+    if (UNLIKELY(url_map_id >= LWAN_LATENCY_MAX_URL_MAPS))
+        return;
+
+    stats = t->latency->url_maps[url_map_id];
+    if (UNLIKELY(!stats)) {
+        /* Only URL maps that have been requested from this thread get a
+         * histogram. */
+        stats = calloc(1, sizeof(*stats));
+        if (UNLIKELY(!stats))
+            return;
+
+        __atomic_store_n(&t->latency->url_maps[url_map_id], stats,
+                         __ATOMIC_RELEASE);
+    }
+
+    histogram_record(&stats->latency, us);
+
+    lwan_latency_usage_snapshot(coro, &now);
+    stats->usage.cycles += now.cycles - begin->cycles;
+    stats->usage.yields += now.yields - begin->yields;
+    stats->usage.arena_allocs += now.arena_allocs - begin->arena_allocs;
+    stats->usage.arena_bytes += now.arena_bytes - begin->arena_bytes;
+    stats->usage.heap_allocs += now.heap_allocs - begin->heap_allocs;
+    stats->usage.heap_bytes += now.heap_bytes - begin->heap_bytes;
+}
+
+void lwan_latency_record_resume(struct lwan_thread *t,
+                                uint64_t scheduling_delay_ns,
+                                uint64_t resume_duration_ns)
+{
+    histogram_record(&t->latency->scheduling_delay, scheduling_delay_ns);
+    histogram_record(&t->latency->resume_duration, resume_duration_ns);
+}
+
+static uint64_t quantile(const struct lwan_latency_histogram *histogram,
+                         double q)
+{
+    /* Rank of the sample, rounding up */
+    const uint64_t rank = (uint64_t)((double)histogram->count * q + 0.999999);
+    uint64_t seen = 0;
+
+    for (unsigned int i = 0; i < N_BUCKETS; i++) {
+        seen += histogram->buckets[i];
+        if (seen >= rank)
+            return bucket_upper_bound(i);
+    }
+
+    return bucket_upper_bound(N_BUCKETS - 1);
+}
+
+static void histogram_merge(struct lwan_latency_histogram *merged,
+                            const struct lwan_latency_histogram *histogram)
+{
+    /* Histograms are written to without synchronization by the threads
+     * owning them, so the total count is taken from the buckets
+     * themselves to stay consistent with them. */
+    for (unsigned int i = 0; i < N_BUCKETS; i++) {
+        const uint64_t n =
+            __atomic_load_n(&histogram->buckets[i], __ATOMIC_RELAXED);
+
+        merged->buckets[i] += n;
+        merged->count += n;
+    }
+
+    merged->sum += __atomic_load_n(&histogram->sum, __ATOMIC_RELAXED);
+}
+
+static void usage_merge(struct lwan_url_map_usage *merged,
+                        const struct lwan_url_map_usage *usage)
+{
+    merged->cycles += __atomic_load_n(&usage->cycles, __ATOMIC_RELAXED);
+    merged->yields += __atomic_load_n(&usage->yields, __ATOMIC_RELAXED);
+    merged->arena_allocs +=
+        __atomic_load_n(&usage->arena_allocs, __ATOMIC_RELAXED);
+    merged->arena_bytes +=
+        __atomic_load_n(&usage->arena_bytes, __ATOMIC_RELAXED);
+    merged->heap_allocs +=
+        __atomic_load_n(&usage->heap_allocs, __ATOMIC_RELAXED);
+    merged->heap_bytes += __atomic_load_n(&usage->heap_bytes, __ATOMIC_RELAXED);
+}
+
+static void summarize(struct lwan_latency_summary *summary,
+                      const struct lwan_latency_histogram *histogram)
+{
+    summary->count = histogram->count;
+    summary->sum = histogram->sum;
+    summary->p50 = quantile(histogram, 0.5);
+    summary->p90 = quantile(histogram, 0.9);
+    summary->p99 = quantile(histogram, 0.99);
+    summary->p999 = quantile(histogram, 0.999);
+}
+
+void lwan_latency_foreach_summary(
+    const struct lwan *l,
+    void (*cb)(const struct lwan_latency_summary *summary, void *data),
+    void *data)
+{
+    const unsigned int count =
+        __atomic_load_n(&url_maps.count, __ATOMIC_ACQUIRE);
+    struct lwan_latency_histogram *merged = malloc(sizeof(*merged));
+
+    if (UNLIKELY(!merged))
+        return;
+
+    for (unsigned int id = 0; id < count; id++) {
+        struct lwan_latency_summary summary = {
+            .prefix = url_maps.prefixes[id],
+        };
+
+        memset(merged, 0, sizeof(*merged));
+
+        for (unsigned int t = 0; t < l->thread.count; t++) {
+            const struct url_map_stats *stats = __atomic_load_n(
+                &l->thread.threads[t].latency->url_maps[id], __ATOMIC_ACQUIRE);
+
+            if (stats) {
+                histogram_merge(merged, &stats->latency);
+                usage_merge(&summary.usage, &stats->usage);
+            }
+        }
+
+        if (!merged->count)
+            continue;
+
+        summarize(&summary, merged);
+        cb(&summary, data);
+    }
+
+    free(merged);
+}
+
+void lwan_latency_thread_summaries(const struct lwan_thread *t,
+                                   struct lwan_latency_summary *scheduling_delay,
+                                   struct lwan_latency_summary *resume_duration)
+{
+    struct lwan_latency_histogram *merged = calloc(1, sizeof(*merged));
+
+    *scheduling_delay = (struct lwan_latency_summary){};
+    *resume_duration = (struct lwan_latency_summary){};
+
+    if (UNLIKELY(!merged))
+        return;
+
+    histogram_merge(merged, &t->latency->scheduling_delay);
+    summarize(scheduling_delay, merged);
+
+    memset(merged, 0, sizeof(*merged));
+    histogram_merge(merged, &t->latency->resume_duration);
+    summarize(resume_duration, merged);
+
+    free(merged);
+}
@@ -20,22 +20,123 @@
 
 #define _GNU_SOURCE
 #include <errno.h>
+#include <limits.h>
 #include <ctype.h>
 #include <lauxlib.h>
 #include <lualib.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <pthread.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
 
 #include "lwan-private.h"
 
+#include "lwan-config.h"
+#include "lwan-kv-client.h"
 #include "lwan-lua.h"
+#include "lwan-resolver.h"
+#include "lwan-shared-dict.h"
 
 #if defined(LWAN_HAVE_LUA_JIT)
 #define luaL_reg luaL_Reg
 #endif
 
 static const char *request_metatable_name = "Lwan.Request";
+static const char *string_view_metatable_name = "Lwan.StringView";
+static const char *tcp_socket_metatable_name = "Lwan.TCPSocket";
+
+/* String views point straight into request memory (headers, parameters,
+ * body), so getting one doesn't copy or intern anything.  They're only
+ * valid while the request is being handled.  */
+struct lwan_lua_string_view {
+    const char *value;
+    size_t len;
+};
+
+static void push_string_view(lua_State *L, const char *value, size_t len)
+{
+    struct lwan_lua_string_view *view = lua_newuserdata(L, sizeof(*view));
+
+    *view = (struct lwan_lua_string_view){.value = value ? value : "", .len = len};
+    luaL_getmetatable(L, string_view_metatable_name);
+    lua_setmetatable(L, -2);
+}
+
+static int string_view_len(lua_State *L)
+{
+    const struct lwan_lua_string_view *view =
+        luaL_checkudata(L, 1, string_view_metatable_name);
+
+    lua_pushinteger(L, (lua_Integer)view->len);
+    return 1;
+}
+
+static int string_view_tostring(lua_State *L)
+{
+    const struct lwan_lua_string_view *view =
+        luaL_checkudata(L, 1, string_view_metatable_name);
+
+    lua_pushlstring(L, view->value, view->len);
+    return 1;
+}
+
+/* Same semantics as string.sub(), but only the substring is copied */
+static int string_view_sub(lua_State *L)
+{
+    const struct lwan_lua_string_view *view =
+        luaL_checkudata(L, 1, string_view_metatable_name);
+    const lua_Integer len = (lua_Integer)view->len;
+    lua_Integer start = luaL_optinteger(L, 2, 1);
+    lua_Integer end = luaL_optinteger(L, 3, -1);
+
+    if (start < 0)
+        start += len + 1;
+    if (end < 0)
+        end += len + 1;
+    if (start < 1)
+        start = 1;
+    if (end > len)
+        end = len;
+
+    if (start > end)
+        lua_pushlstring(L, "", 0);
+    else
+        lua_pushlstring(L, view->value + start - 1, (size_t)(end - start + 1));
+    return 1;
+}
+
+static int string_view_equals(lua_State *L)
+{
+    const struct lwan_lua_string_view *view =
+        luaL_checkudata(L, 1, string_view_metatable_name);
+    size_t len;
+    const char *str = luaL_checklstring(L, 2, &len);
+
+    lua_pushboolean(L, len == view->len && !memcmp(str, view->value, len));
+    return 1;
+}
+
+static void register_string_view(lua_State *L)
+{
+    static const struct luaL_Reg methods[] = {
+        {"__len", string_view_len},
+        {"__tostring", string_view_tostring},
+        {"len", string_view_len},
+        {"sub", string_view_sub},
+        {"equals", string_view_equals},
+        {},
+    };
+
+    luaL_newmetatable(L, string_view_metatable_name);
+    luaL_register(L, NULL, methods);
+    lua_pushvalue(L, -1);
+    lua_setfield(L, -2, "__index");
+    lua_pop(L, 1);
+}
 
 ALWAYS_INLINE struct lwan_request *lwan_lua_get_request_from_userdata(lua_State *L)
 {
@@ -121,6 +222,84 @@ LWAN_LUA_METHOD(set_response)
     return 0;
 }
 
+static void unref_response_buffer(void *data1, void *data2)
+{
+    luaL_unref((lua_State *)data1, LUA_REGISTRYINDEX, (int)(intptr_t)data2);
+}
+
+/* Like set_response(), but the string isn't copied: a reference to it is
+ * held until the request has been handled, so it stays alive (and, as Lua
+ * doesn't move objects around, at the same address) until it's sent.  */
+LWAN_LUA_METHOD(set_response_buffer)
+{
+    size_t response_str_len;
+    const char *response_str;
+
+    if (lua_isuserdata(L, -1)) {
+        const struct lwan_lua_string_view *view =
+            luaL_checkudata(L, -1, string_view_metatable_name);
+
+        /* Views already point to memory that outlives the handler */
+        lwan_strbuf_set_static(request->response.buffer, view->value,
+                               view->len);
+        return 0;
+    }
+
+    response_str = luaL_checklstring(L, -1, &response_str_len);
+    lwan_strbuf_set_static(request->response.buffer, response_str,
+                           response_str_len);
+
+    lua_pushvalue(L, -1);
+    int ref = luaL_ref(L, LUA_REGISTRYINDEX);
+    coro_defer2(request->conn->coro, unref_response_buffer, L,
+                (void *)(intptr_t)ref);
+
+    return 0;
+}
+
+static int request_param_view_getter(
+    lua_State *L,
+    struct lwan_request *request,
+    const char *(*getter)(struct lwan_request *req, const char *key))
+{
+    const char *key_str = lua_tostring(L, -1);
+    const char *value = getter(request, key_str);
+
+    if (!value)
+        lua_pushnil(L);
+    else
+        push_string_view(L, value, strlen(value));
+
+    return 1;
+}
+
+LWAN_LUA_METHOD(header_view)
+{
+    return request_param_view_getter(L, request, lwan_request_get_header);
+}
+
+LWAN_LUA_METHOD(query_param_view)
+{
+    return request_param_view_getter(L, request, lwan_request_get_query_param);
+}
+
+LWAN_LUA_METHOD(post_param_view)
+{
+    return request_param_view_getter(L, request, lwan_request_get_post_param);
+}
+
+LWAN_LUA_METHOD(cookie_view)
+{
+    return request_param_view_getter(L, request, lwan_request_get_cookie);
+}
+
+LWAN_LUA_METHOD(body_view)
+{
+    push_string_view(L, request->helper->body_data.value,
+                     request->helper->body_data.len);
+    return 1;
+}
+
 static int request_param_getter(lua_State *L,
                                 struct lwan_request *request,
                                 const char *(*getter)(struct lwan_request *req,
@@ -144,6 +323,23 @@ LWAN_LUA_METHOD(remote_address)
     return 1;
 }
 
+LWAN_LUA_METHOD(peer_credentials)
+{
+    pid_t pid;
+    uid_t uid;
+    gid_t gid;
+
+    if (!lwan_request_get_peer_credentials(request, &pid, &uid, &gid)) {
+        lua_pushnil(L);
+        return 1;
+    }
+
+    lua_pushinteger(L, pid);
+    lua_pushinteger(L, uid);
+    lua_pushinteger(L, gid);
+    return 3;
+}
+
 LWAN_LUA_METHOD(header)
 {
     return request_param_getter(L, request, lwan_request_get_header);
@@ -377,6 +573,402 @@ LWAN_LUA_METHOD(sleep)
     return 0;
 }
 
+static int push_await_result(lua_State *L, int r)
+{
+    if (r < 0) {
+        lua_pushnil(L);
+        lua_pushstring(L, r == -ETIMEDOUT ? "timeout" : strerror(-r));
+        return 2;
+    }
+
+    lua_pushboolean(L, true);
+    return 1;
+}
+
+static int await_fd(lua_State *L,
+                    struct lwan_request *request,
+                    enum lwan_connection_coro_yield events)
+{
+    lua_Integer fd = luaL_checkinteger(L, 2);
+    lua_Integer timeout_ms = luaL_optinteger(L, 3, 0);
+
+    if (fd < 0 || fd > INT_MAX)
+        return luaL_argerror(L, 2, "invalid file descriptor");
+    if (timeout_ms < 0)
+        return luaL_argerror(L, 3, "invalid timeout");
+
+    const struct lwan_await_fd await = {.fd = (int)fd, .events = events};
+    return push_await_result(
+        L, lwan_request_await_any_of(request, &await, 1, (uint64_t)timeout_ms));
+}
+
+LWAN_LUA_METHOD(await_read)
+{
+    return await_fd(L, request, CONN_CORO_WANT_READ);
+}
+
+LWAN_LUA_METHOD(await_write)
+{
+    return await_fd(L, request, CONN_CORO_WANT_WRITE);
+}
+
+/* Sockets belong to the request that connected them, and are closed when
+ * it's done; the userdata seen by scripts only points to them, and is
+ * detached from the socket whenever either goes away first. */
+struct tcp_socket {
+    struct lwan_request *request;
+    struct tcp_socket **owner;
+    uint64_t timeout_ms;
+    int fd;
+
+    /* Received, but not consumed yet */
+    size_t head, tail;
+    char buffer[4096];
+};
+
+static void tcp_socket_close(struct tcp_socket *sock)
+{
+    if (sock->fd >= 0) {
+        close(sock->fd);
+        sock->fd = -1;
+    }
+}
+
+static void tcp_socket_release(void *data)
+{
+    struct tcp_socket *sock = data;
+
+    if (sock->owner)
+        *sock->owner = NULL;
+    tcp_socket_close(sock);
+}
+
+static struct tcp_socket *check_tcp_socket(lua_State *L)
+{
+    struct tcp_socket **sock = luaL_checkudata(L, 1, tcp_socket_metatable_name);
+
+    if (!*sock)
+        luaL_error(L, "socket used after its request has been handled");
+
+    return *sock;
+}
+
+static int push_tcp_socket_error(lua_State *L, int error)
+{
+    lua_pushnil(L);
+    if (!error)
+        lua_pushliteral(L, "closed");
+    else if (error == -ETIMEDOUT)
+        lua_pushliteral(L, "timeout");
+    else
+        lua_pushstring(L, strerror(-error));
+    return 2;
+}
+
+static int tcp_socket_await(struct tcp_socket *sock,
+                            enum lwan_connection_coro_yield events)
+{
+    const struct lwan_await_fd await = {.fd = sock->fd, .events = events};
+    int r = lwan_request_await_any_of(sock->request, &await, 1,
+                                      sock->timeout_ms);
+
+    return r < 0 ? r : 0;
+}
+
+/* Only called once everything that has been buffered has been consumed.
+ * Returns the number of bytes received, 0 if the peer has closed the
+ * connection, or -errno. */
+static ssize_t tcp_socket_fill(struct tcp_socket *sock)
+{
+    sock->head = sock->tail = 0;
+
+    if (sock->fd < 0)
+        return -EBADF;
+
+    while (true) {
+        ssize_t n = recv(sock->fd, sock->buffer, sizeof(sock->buffer),
+                         MSG_DONTWAIT);
+
+        if (n >= 0) {
+            sock->tail = (size_t)n;
+            return n;
+        }
+
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            int r = tcp_socket_await(sock, CONN_CORO_WANT_READ);
+            if (r < 0)
+                return r;
+        } else if (errno != EINTR) {
+            return -errno;
+        }
+    }
+}
+
+LWAN_LUA_METHOD(connect)
+{
+    const char *address = luaL_checkstring(L, 2);
+    lua_Integer timeout_ms = luaL_optinteger(L, 3, 0);
+    struct sockaddr_storage addr;
+    socklen_t addr_len;
+    int fd, r;
+
+    if (timeout_ms < 0)
+        return luaL_argerror(L, 3, "invalid timeout");
+
+    if (*address == '/') {
+        struct sockaddr_un *un_addr = (struct sockaddr_un *)&addr;
+
+        if (strlen(address) >= sizeof(un_addr->sun_path))
+            return luaL_argerror(L, 2, "path too long");
+
+        *un_addr = (struct sockaddr_un){.sun_family = AF_UNIX};
+        memcpy(un_addr->sun_path, address, strlen(address) + 1);
+        addr_len = sizeof(*un_addr);
+    } else {
+        char *address_copy = coro_strdup(request->conn->coro, address);
+        char *node, *port;
+        sa_family_t family;
+        int port_number;
+
+        if (!address_copy)
+            return push_tcp_socket_error(L, -ENOMEM);
+
+        family = lwan_socket_parse_address(address_copy, &node, &port);
+        if (family == AF_MAX)
+            return luaL_argerror(L, 2, "expecting `address:port`");
+
+        port_number = parse_int(port, -1);
+        if (port_number <= 0 || port_number > 65535)
+            return luaL_argerror(L, 2, "invalid port");
+
+        r = lwan_request_resolve(request, node, (uint16_t)port_number, family,
+                                 &addr, &addr_len);
+        if (r < 0)
+            return push_tcp_socket_error(L, r);
+    }
+
+    struct tcp_socket *sock = coro_malloc(request->conn->coro, sizeof(*sock));
+    if (!sock)
+        return push_tcp_socket_error(L, -ENOMEM);
+
+    fd = socket(addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+        return push_tcp_socket_error(L, -errno);
+
+    *sock = (struct tcp_socket){
+        .request = request,
+        .timeout_ms = (uint64_t)timeout_ms,
+        .fd = fd,
+    };
+    if (coro_defer(request->conn->coro, tcp_socket_release, sock) < 0) {
+        close(fd);
+        return push_tcp_socket_error(L, -ENOMEM);
+    }
+
+    if (addr.ss_family != AF_UNIX)
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, (int[]){1}, sizeof(int));
+
+    if (connect(fd, (struct sockaddr *)&addr, addr_len) < 0) {
+        if (errno != EINPROGRESS)
+            return push_tcp_socket_error(L, -errno);
+
+        r = tcp_socket_await(sock, CONN_CORO_WANT_WRITE);
+        if (r < 0)
+            return push_tcp_socket_error(L, r);
+
+        socklen_t len = sizeof(r);
+        if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &r, &len) < 0)
+            return push_tcp_socket_error(L, -errno);
+        if (r)
+            return push_tcp_socket_error(L, -r);
+    }
+
+    struct tcp_socket **ud = lua_newuserdata(L, sizeof(*ud));
+    *ud = sock;
+    sock->owner = ud;
+    luaL_getmetatable(L, tcp_socket_metatable_name);
+    lua_setmetatable(L, -2);
+    return 1;
+}
+
+static int tcp_socket_send(lua_State *L)
+{
+    struct tcp_socket *sock = check_tcp_socket(L);
+    size_t len, sent = 0;
+    const char *data = luaL_checklstring(L, 2, &len);
+    int r = 0;
+
+    if (sock->fd < 0)
+        goto error;
+
+    while (sent < len) {
+        ssize_t n = send(sock->fd, data + sent, len - sent,
+                         MSG_NOSIGNAL | MSG_DONTWAIT);
+
+        if (n >= 0) {
+            sent += (size_t)n;
+            continue;
+        }
+
+        switch (errno) {
+        case EINTR:
+            break;
+        case EAGAIN:
+            r = tcp_socket_await(sock, CONN_CORO_WANT_WRITE);
+            if (r < 0)
+                goto error;
+            break;
+        case EPIPE:
+        case ECONNRESET:
+            r = 0;
+            goto error;
+        default:
+            r = -errno;
+            goto error;
+        }
+    }
+
+    lua_pushinteger(L, (lua_Integer)sent);
+    return 1;
+
+error:
+    /* Like LuaSocket, also returns how much has been sent */
+    push_tcp_socket_error(L, r);
+    lua_pushinteger(L, (lua_Integer)sent);
+    return 3;
+}
+
+/* Receives either a number of bytes, a line ("*l", without the line
+ * terminator), or everything until the peer closes the connection
+ * ("*a").  Whatever has been received when an error happens is returned
+ * as a third value. */
+static int tcp_socket_receive(lua_State *L)
+{
+    struct tcp_socket *sock = check_tcp_socket(L);
+    lua_Integer wanted = -1;
+    bool line = false;
+    luaL_Buffer b;
+    ssize_t r;
+
+    if (lua_type(L, 2) == LUA_TNUMBER) {
+        wanted = lua_tointeger(L, 2);
+        if (wanted < 0)
+            return luaL_argerror(L, 2, "invalid number of bytes");
+    } else {
+        const char *pattern = luaL_optstring(L, 2, "*l");
+
+        if (!strcmp(pattern, "*l"))
+            line = true;
+        else if (strcmp(pattern, "*a"))
+            return luaL_argerror(L, 2, "invalid pattern");
+    }
+
+    luaL_buffinit(L, &b);
+
+    while (true) {
+        const char *avail = sock->buffer + sock->head;
+        size_t len = sock->tail - sock->head;
+
+        if (line) {
+            const char *lf = memchr(avail, '\n', len);
+            size_t used = lf ? (size_t)(lf - avail) : len;
+
+            for (size_t i = 0; i < used; i++) {
+                /* CRs are ignored, as LuaSocket does */
+                if (avail[i] != '\r')
+                    luaL_addchar(&b, avail[i]);
+            }
+
+            if (lf) {
+                sock->head += used + 1;
+                break;
+            }
+            sock->head += used;
+        } else if (wanted >= 0) {
+            size_t used = LWAN_MIN(len, (size_t)wanted);
+
+            luaL_addlstring(&b, avail, used);
+            sock->head += used;
+            wanted -= (lua_Integer)used;
+
+            if (!wanted)
+                break;
+        } else {
+            luaL_addlstring(&b, avail, len);
+            sock->head += len;
+        }
+
+        r = tcp_socket_fill(sock);
+        if (r <= 0) {
+            if (!r && !line && wanted < 0)
+                break;
+
+            luaL_pushresult(&b);
+            push_tcp_socket_error(L, (int)r);
+            lua_pushvalue(L, -3);
+            return 3;
+        }
+    }
+
+    luaL_pushresult(&b);
+    return 1;
+}
+
+static int tcp_socket_settimeout(lua_State *L)
+{
+    struct tcp_socket *sock = check_tcp_socket(L);
+    lua_Integer timeout_ms = luaL_checkinteger(L, 2);
+
+    if (timeout_ms < 0)
+        return luaL_argerror(L, 2, "invalid timeout");
+
+    sock->timeout_ms = (uint64_t)timeout_ms;
+    return 0;
+}
+
+static int tcp_socket_getfd(lua_State *L)
+{
+    lua_pushinteger(L, check_tcp_socket(L)->fd);
+    return 1;
+}
+
+static int tcp_socket_lua_close(lua_State *L)
+{
+    tcp_socket_close(check_tcp_socket(L));
+    return 0;
+}
+
+static int tcp_socket_gc(lua_State *L)
+{
+    struct tcp_socket **sock = luaL_checkudata(L, 1, tcp_socket_metatable_name);
+
+    if (*sock) {
+        (*sock)->owner = NULL;
+        tcp_socket_close(*sock);
+    }
+
+    return 0;
+}
+
+static void register_tcp_socket(lua_State *L)
+{
+    static const struct luaL_Reg methods[] = {
+        {"send", tcp_socket_send},
+        {"receive", tcp_socket_receive},
+        {"settimeout", tcp_socket_settimeout},
+        {"getfd", tcp_socket_getfd},
+        {"close", tcp_socket_lua_close},
+        {"__gc", tcp_socket_gc},
+        {},
+    };
+
+    luaL_newmetatable(L, tcp_socket_metatable_name);
+    luaL_register(L, NULL, methods);
+    lua_pushvalue(L, -1);
+    lua_setfield(L, -2, "__index");
+    lua_pop(L, 1);
+}
+
 LWAN_LUA_METHOD(request_id)
 {
     lua_pushfstring(L, "%016lx", lwan_request_get_id(request));
@@ -422,6 +1014,373 @@ static int luaopen_log(lua_State *L)
     return 0;
 }
 
+static const char *kv_metatable_name = "Lwan.KV";
+
+/* Endpoints are created by scripts (usually once, when the script is
+ * loaded), and belong to the state that created them: as states are only
+ * used by one I/O thread, so are their connections. */
+static struct lwan_kv_endpoint *check_kv(lua_State *L)
+{
+    struct lwan_kv_endpoint **endpoint =
+        luaL_checkudata(L, 1, kv_metatable_name);
+
+    return *endpoint;
+}
+
+static struct lwan_request *check_kv_request(lua_State *L)
+{
+    struct lwan_request **r = luaL_checkudata(L, 2, request_metatable_name);
+
+    return *r;
+}
+
+static int push_kv_error(lua_State *L, int error)
+{
+    lua_pushnil(L);
+    lua_pushstring(L, strerror(-error));
+    return 2;
+}
+
+static int kv_new(lua_State *L, enum lwan_kv_protocol protocol)
+{
+    const char *address = luaL_checkstring(L, 1);
+    lua_Integer timeout_ms = luaL_optinteger(L, 2, 0);
+    struct lwan_kv_endpoint **endpoint;
+
+    if (timeout_ms < 0 || timeout_ms > UINT_MAX)
+        return luaL_argerror(L, 2, "invalid timeout");
+
+    endpoint = lua_newuserdata(L, sizeof(*endpoint));
+    *endpoint =
+        lwan_kv_endpoint_new(address, protocol, (unsigned int)timeout_ms);
+    if (!*endpoint)
+        return luaL_error(L, "could not create KV endpoint for %s", address);
+
+    luaL_getmetatable(L, kv_metatable_name);
+    lua_setmetatable(L, -2);
+    return 1;
+}
+
+static int kv_new_redis(lua_State *L)
+{
+    return kv_new(L, LWAN_KV_REDIS);
+}
+
+static int kv_new_memcached(lua_State *L)
+{
+    return kv_new(L, LWAN_KV_MEMCACHED);
+}
+
+static int kv_gc(lua_State *L)
+{
+    struct lwan_kv_endpoint **endpoint =
+        luaL_checkudata(L, 1, kv_metatable_name);
+
+    lwan_kv_endpoint_free(*endpoint);
+    *endpoint = NULL;
+    return 0;
+}
+
+static int kv_get(lua_State *L)
+{
+    struct lwan_kv_endpoint *endpoint = check_kv(L);
+    struct lwan_request *request = check_kv_request(L);
+    const char *key = luaL_checkstring(L, 3);
+    struct lwan_value value;
+    int r = lwan_kv_get(request, endpoint, key, &value);
+
+    if (r == -ENOENT) {
+        lua_pushnil(L);
+        return 1;
+    }
+    if (r < 0)
+        return push_kv_error(L, r);
+
+    lua_pushlstring(L, value.value, value.len);
+    return 1;
+}
+
+static int kv_set(lua_State *L)
+{
+    struct lwan_kv_endpoint *endpoint = check_kv(L);
+    struct lwan_request *request = check_kv_request(L);
+    const char *key = luaL_checkstring(L, 3);
+    struct lwan_value value;
+    lua_Integer ttl = luaL_optinteger(L, 5, 0);
+    int r;
+
+    value.value = (char *)luaL_checklstring(L, 4, &value.len);
+    if (ttl < 0 || ttl > UINT_MAX)
+        return luaL_argerror(L, 5, "invalid TTL");
+
+    r = lwan_kv_set(request, endpoint, key, &value, (unsigned int)ttl);
+    if (r < 0)
+        return push_kv_error(L, r);
+
+    lua_pushboolean(L, true);
+    return 1;
+}
+
+static int kv_delete(lua_State *L)
+{
+    struct lwan_kv_endpoint *endpoint = check_kv(L);
+    struct lwan_request *request = check_kv_request(L);
+    const char *key = luaL_checkstring(L, 3);
+    int r = lwan_kv_delete(request, endpoint, key);
+
+    if (r < 0 && r != -ENOENT)
+        return push_kv_error(L, r);
+
+    lua_pushboolean(L, r == 0);
+    return 1;
+}
+
+static int kv_incr(lua_State *L)
+{
+    struct lwan_kv_endpoint *endpoint = check_kv(L);
+    struct lwan_request *request = check_kv_request(L);
+    const char *key = luaL_checkstring(L, 3);
+    lua_Integer delta = luaL_optinteger(L, 4, 1);
+    long long result;
+    int r = lwan_kv_incr(request, endpoint, key, delta, &result);
+
+    if (r < 0)
+        return push_kv_error(L, r);
+
+    lua_pushinteger(L, (lua_Integer)result);
+    return 1;
+}
+
+static void push_kv_reply(lua_State *L, const struct lwan_kv_reply *reply)
+{
+    switch (reply->type) {
+    case LWAN_KV_REPLY_STRING:
+    case LWAN_KV_REPLY_STATUS:
+    case LWAN_KV_REPLY_ERROR:
+        lua_pushlstring(L, reply->string.value, reply->string.len);
+        break;
+    case LWAN_KV_REPLY_INTEGER:
+        lua_pushinteger(L, (lua_Integer)reply->integer);
+        break;
+    case LWAN_KV_REPLY_NIL:
+        lua_pushnil(L);
+        break;
+    case LWAN_KV_REPLY_ARRAY:
+        lua_createtable(L, (int)reply->array.n_elements, 0);
+        for (size_t i = 0; i < reply->array.n_elements; i++) {
+            /* Nested arrays are at most a few levels deep */
+            luaL_checkstack(L, 2, "KV reply is too deep");
+            push_kv_reply(L, &reply->array.elements[i]);
+            lua_rawseti(L, -2, (int)i + 1);
+        }
+        break;
+    }
+}
+
+static int kv_command(lua_State *L)
+{
+    struct lwan_kv_endpoint *endpoint = check_kv(L);
+    struct lwan_request *request = check_kv_request(L);
+    const int argc = lua_gettop(L) - 2;
+    struct lwan_value *argv;
+    struct lwan_kv_reply *reply;
+    int r;
+
+    if (lwan_kv_endpoint_get_protocol(endpoint) != LWAN_KV_REDIS)
+        return luaL_error(L, "commands can only be sent to Redis endpoints");
+    if (argc < 1)
+        return luaL_error(L, "no command has been given");
+
+    argv = coro_malloc(request->conn->coro, (size_t)argc * sizeof(*argv));
+    if (!argv)
+        return push_kv_error(L, -ENOMEM);
+    for (int i = 0; i < argc; i++)
+        argv[i].value = (char *)luaL_checklstring(L, i + 3, &argv[i].len);
+
+    r = lwan_kv_redis_command(request, endpoint, (size_t)argc, argv, &reply);
+    if (r < 0)
+        return push_kv_error(L, r);
+
+    if (reply->type == LWAN_KV_REPLY_ERROR) {
+        lua_pushnil(L);
+        lua_pushlstring(L, reply->string.value, reply->string.len);
+        return 2;
+    }
+
+    push_kv_reply(L, reply);
+    return 1;
+}
+
+static int luaopen_kv(lua_State *L)
+{
+    static const struct luaL_Reg functions[] = {
+        {"redis", kv_new_redis},
+        {"memcached", kv_new_memcached},
+        {},
+    };
+    static const struct luaL_Reg methods[] = {
+        {"__gc", kv_gc},
+        {"get", kv_get},
+        {"set", kv_set},
+        {"delete", kv_delete},
+        {"incr", kv_incr},
+        {"command", kv_command},
+        {},
+    };
+
+    luaL_newmetatable(L, kv_metatable_name);
+    luaL_register(L, NULL, methods);
+    lua_pushvalue(L, -1);
+    lua_setfield(L, -2, "__index");
+    lua_pop(L, 1);
+
+    luaL_register(L, "Lwan.kv", functions);
+    lua_pop(L, 1);
+
+    return 0;
+}
+
+static const char *shared_dict_metatable_name = "Lwan.SharedDict";
+
+static struct lwan_shared_dict *check_shared_dict(lua_State *L)
+{
+    struct lwan_shared_dict **dict =
+        luaL_checkudata(L, 1, shared_dict_metatable_name);
+
+    return *dict;
+}
+
+/* Keys are C strings in the dictionary */
+static const char *check_shared_dict_key(lua_State *L)
+{
+    size_t len;
+    const char *key = luaL_checklstring(L, 2, &len);
+
+    if (strlen(key) != len)
+        luaL_argerror(L, 2, "keys can't contain NUL characters");
+
+    return key;
+}
+
+static int shared_dict_new(lua_State *L)
+{
+    const char *name = luaL_checkstring(L, 1);
+    lua_Integer max_entries = luaL_optinteger(L, 2, 1024);
+    struct lwan_shared_dict **dict;
+
+    if (max_entries < 1)
+        return luaL_argerror(L, 2, "must be positive");
+
+    dict = lua_newuserdata(L, sizeof(*dict));
+    *dict = lwan_shared_dict_get(name, (size_t)max_entries);
+    if (!*dict)
+        return luaL_error(L, "could not create shared dictionary %s", name);
+
+    luaL_getmetatable(L, shared_dict_metatable_name);
+    lua_setmetatable(L, -2);
+    return 1;
+}
+
+static int shared_dict_get(lua_State *L)
+{
+    struct lwan_shared_dict *dict = check_shared_dict(L);
+    const char *key = check_shared_dict_key(L);
+    struct lwan_strbuf value;
+    int r;
+
+    lwan_strbuf_init(&value);
+    r = lwan_shared_dict_lookup(dict, key, &value);
+    if (!r) {
+        lua_pushlstring(L, lwan_strbuf_get_buffer(&value),
+                        lwan_strbuf_get_length(&value));
+    } else {
+        lua_pushnil(L);
+    }
+    lwan_strbuf_free(&value);
+
+    return 1;
+}
+
+static int shared_dict_set(lua_State *L)
+{
+    struct lwan_shared_dict *dict = check_shared_dict(L);
+    const char *key = check_shared_dict_key(L);
+    size_t value_len;
+    const char *value = luaL_checklstring(L, 3, &value_len);
+    lua_Integer ttl = luaL_optinteger(L, 4, 0);
+    int r;
+
+    if (ttl < 0 || ttl > UINT_MAX)
+        return luaL_argerror(L, 4, "invalid TTL");
+
+    r = lwan_shared_dict_set(dict, key, value, value_len, (unsigned int)ttl);
+    if (r < 0) {
+        lua_pushnil(L);
+        lua_pushstring(L, strerror(-r));
+        return 2;
+    }
+
+    lua_pushboolean(L, true);
+    return 1;
+}
+
+static int shared_dict_delete(lua_State *L)
+{
+    struct lwan_shared_dict *dict = check_shared_dict(L);
+    const char *key = check_shared_dict_key(L);
+
+    lua_pushboolean(L, lwan_shared_dict_delete(dict, key) == 0);
+    return 1;
+}
+
+static int shared_dict_incr(lua_State *L)
+{
+    struct lwan_shared_dict *dict = check_shared_dict(L);
+    const char *key = check_shared_dict_key(L);
+    lua_Integer delta = luaL_optinteger(L, 3, 1);
+    lua_Integer ttl = luaL_optinteger(L, 4, 0);
+    long long result;
+    int r;
+
+    if (ttl < 0 || ttl > UINT_MAX)
+        return luaL_argerror(L, 4, "invalid TTL");
+
+    r = lwan_shared_dict_incr(dict, key, delta, (unsigned int)ttl, &result);
+    if (r < 0) {
+        lua_pushnil(L);
+        lua_pushstring(L, strerror(-r));
+        return 2;
+    }
+
+    lua_pushinteger(L, (lua_Integer)result);
+    return 1;
+}
+
+static int luaopen_shared_dict(lua_State *L)
+{
+    static const struct luaL_Reg methods[] = {
+        {"get", shared_dict_get},
+        {"set", shared_dict_set},
+        {"delete", shared_dict_delete},
+        {"incr", shared_dict_incr},
+        {},
+    };
+
+    luaL_newmetatable(L, shared_dict_metatable_name);
+    luaL_register(L, NULL, methods);
+    lua_pushvalue(L, -1);
+    lua_setfield(L, -2, "__index");
+    lua_pop(L, 1);
+
+    /* The Lwan table has been created by luaopen_log() */
+    lua_getglobal(L, "Lwan");
+    lua_pushcfunction(L, shared_dict_new);
+    lua_setfield(L, -2, "shared");
+    lua_pop(L, 1);
+
+    return 0;
+}
+
 DEFINE_ARRAY_TYPE(lwan_lua_method_array, luaL_reg)
 static struct lwan_lua_method_array lua_methods;
 
@@ -456,7 +1415,128 @@ const char *lwan_lua_state_last_error(lua_State *L)
     return lua_tostring(L, -1);
 }
 
-lua_State *lwan_lua_create_state(const char *script_file, const char *script)
+#if defined(LWAN_HAVE_LUA_JIT)
+/* Calls made through the C API marshal arguments and results through the
+ * Lua stack, which stops LuaJIT from compiling traces through them.  The
+ * "lwan.ffi" module exposes the same request functions through the FFI,
+ * as calls to function pointers, which the JIT compiler turns into direct
+ * calls.  Pointers are used instead of resolving symbols through ffi.C so
+ * that this works even if the executable doesn't export them.
+ *
+ * The declaration in lua_ffi_source must be kept in sync with this
+ * struct. */
+struct lwan_lua_ffi_api {
+    const char *(*header)(struct lwan_request *request, const char *key);
+    const char *(*query_param)(struct lwan_request *request, const char *key);
+    const char *(*post_param)(struct lwan_request *request, const char *key);
+    const char *(*cookie)(struct lwan_request *request, const char *key);
+    const char *(*host)(struct lwan_request *request);
+    size_t (*path)(struct lwan_request *request, const char **value);
+    size_t (*body)(struct lwan_request *request, const char **value);
+    void (*set_response)(struct lwan_request *request,
+                         const char *value,
+                         size_t len);
+};
+
+static const char *ffi_header(struct lwan_request *request, const char *key)
+{
+    return lwan_request_get_header(request, key);
+}
+
+static size_t ffi_path(struct lwan_request *request, const char **value)
+{
+    *value = request->url.value;
+    return request->url.len;
+}
+
+static size_t ffi_body(struct lwan_request *request, const char **value)
+{
+    *value = request->helper->body_data.value;
+    return request->helper->body_data.len;
+}
+
+static void
+ffi_set_response(struct lwan_request *request, const char *value, size_t len)
+{
+    lwan_strbuf_set(request->response.buffer, value, len);
+}
+
+static const struct lwan_lua_ffi_api lua_ffi_api = {
+    .header = ffi_header,
+    .query_param = lwan_request_get_query_param,
+    .post_param = lwan_request_get_post_param,
+    .cookie = lwan_request_get_cookie,
+    .host = lwan_request_get_host,
+    .path = ffi_path,
+    .body = ffi_body,
+    .set_response = ffi_set_response,
+};
+
+static const char lua_ffi_source[] =
+    "local ffi = require 'ffi'\n"
+    "ffi.cdef[[\n"
+    "struct lwan_request;\n"
+    "struct lwan_lua_ffi_api {\n"
+    "  const char *(*header)(struct lwan_request *, const char *);\n"
+    "  const char *(*query_param)(struct lwan_request *, const char *);\n"
+    "  const char *(*post_param)(struct lwan_request *, const char *);\n"
+    "  const char *(*cookie)(struct lwan_request *, const char *);\n"
+    "  const char *(*host)(struct lwan_request *);\n"
+    "  size_t (*path)(struct lwan_request *, const char **);\n"
+    "  size_t (*body)(struct lwan_request *, const char **);\n"
+    "  void (*set_response)(struct lwan_request *, const char *, size_t);\n"
+    "};\n"
+    "]]\n"
+    "local api = ffi.cast('const struct lwan_lua_ffi_api *', ...)\n"
+    "local request_pp = ffi.typeof('struct lwan_request **')\n"
+    "local value_p = ffi.new('const char *[1]')\n"
+    "local M = {}\n"
+    "local function str(v) if v ~= nil then return ffi.string(v) end end\n"
+    /* Userdata is converted to the address of its payload, which holds the
+     * pointer to the request (see lwan_lua_state_push_request()) */
+    "function M.request(req) return ffi.cast(request_pp, req)[0] end\n"
+    "function M.header(r, key) return str(api.header(r, key)) end\n"
+    "function M.query_param(r, key) return str(api.query_param(r, key)) end\n"
+    "function M.post_param(r, key) return str(api.post_param(r, key)) end\n"
+    "function M.cookie(r, key) return str(api.cookie(r, key)) end\n"
+    "function M.host(r) return str(api.host(r)) end\n"
+    "function M.path(r)\n"
+    "  local len = api.path(r, value_p)\n"
+    "  return ffi.string(value_p[0], len)\n"
+    "end\n"
+    "function M.body(r)\n"
+    "  local len = api.body(r, value_p)\n"
+    "  if len == 0 then return '' end\n"
+    "  return ffi.string(value_p[0], len)\n"
+    "end\n"
+    "function M.set_response(r, s) api.set_response(r, s, #s) end\n"
+    "return M\n";
+
+static void register_ffi_module(lua_State *L)
+{
+    if (luaL_loadbuffer(L, lua_ffi_source, sizeof(lua_ffi_source) - 1,
+                        "=lwan.ffi") != 0)
+        goto error;
+
+    lua_pushlightuserdata(L, (void *)&lua_ffi_api);
+    if (lua_pcall(L, 1, 1, 0) != 0)
+        goto error;
+
+    /* Make it available with require "lwan.ffi" */
+    lua_getglobal(L, "package");
+    lua_getfield(L, -1, "loaded");
+    lua_pushvalue(L, -3);
+    lua_setfield(L, -2, "lwan.ffi");
+    lua_pop(L, 3);
+    return;
+
+error:
+    lwan_status_debug("Couldn't load lwan.ffi module: %s", lua_tostring(L, -1));
+    lua_pop(L, 1);
+}
+#endif
+
+static lua_State *create_base_state(void)
 {
     lua_State *L;
 
@@ -466,11 +1546,29 @@ lua_State *lwan_lua_create_state(const char *script_file, const char *script)
 
     luaL_openlibs(L);
     luaopen_log(L);
+    luaopen_kv(L);
+    luaopen_shared_dict(L);
 
     luaL_newmetatable(L, request_metatable_name);
     luaL_register(L, NULL, lwan_lua_method_array_get_array(&lua_methods));
     lua_setfield(L, -1, "__index");
 
+    register_string_view(L);
+    register_tcp_socket(L);
+#if defined(LWAN_HAVE_LUA_JIT)
+    register_ffi_module(L);
+#endif
+
+    return L;
+}
+
+lua_State *lwan_lua_create_state(const char *script_file, const char *script)
+{
+    lua_State *L = create_base_state();
+
+    if (UNLIKELY(!L))
+        return NULL;
+
     if (script_file) {
         if (UNLIKELY(luaL_dofile(L, script_file) != 0)) {
             lwan_status_error("Error opening Lua script %s: %s", script_file,
@@ -495,6 +1593,67 @@ close_lua_state:
     return NULL;
 }
 
+static int append_bytecode(lua_State *L __attribute__((unused)),
+                           const void *p,
+                           size_t sz,
+                           void *ud)
+{
+    return lwan_strbuf_append_str(ud, p, sz) ? 0 : 1;
+}
+
+bool lwan_lua_compile_script(const char *script_file,
+                             const char *script,
+                             struct lwan_strbuf *bytecode)
+{
+    lua_State *L = luaL_newstate();
+    bool ret = false;
+    int r;
+
+    if (UNLIKELY(!L))
+        return false;
+
+    if (script_file) {
+        r = luaL_loadfile(L, script_file);
+    } else if (script) {
+        r = luaL_loadbuffer(L, script, strlen(script), "=script");
+    } else {
+        lwan_status_error("Either file or inline script has to be provided");
+        goto out;
+    }
+    if (UNLIKELY(r != 0)) {
+        lwan_status_error("Error compiling Lua script %s: %s",
+                          script_file ? script_file : "", lua_tostring(L, -1));
+        goto out;
+    }
+
+    lwan_strbuf_reset(bytecode);
+    ret = lua_dump(L, append_bytecode, bytecode) == 0;
+
+out:
+    lua_close(L);
+    return ret;
+}
+
+lua_State *lwan_lua_create_state_from_bytecode(const struct lwan_strbuf *bytecode)
+{
+    lua_State *L = create_base_state();
+
+    if (UNLIKELY(!L))
+        return NULL;
+
+    if (UNLIKELY(luaL_loadbuffer(L, lwan_strbuf_get_buffer(bytecode),
+                                 lwan_strbuf_get_length(bytecode),
+                                 "=script") != 0 ||
+                 lua_pcall(L, 0, 0, 0) != 0)) {
+        lwan_status_error("Error evaluating Lua script: %s",
+                          lua_tostring(L, -1));
+        lua_close(L);
+        return NULL;
+    }
+
+    return L;
+}
+
 void lwan_lua_state_push_request(lua_State *L, struct lwan_request *request)
 {
     struct lwan_request **userdata =
@@ -22,6 +22,7 @@
 #include <lua.h>
 
 struct lwan_request;
+struct lwan_strbuf;
 
 struct lwan_lua_method_info {
     const char *name;
@@ -47,6 +48,10 @@ struct lwan_lua_method_info {
 
 const char *lwan_lua_state_last_error(lua_State *L);
 lua_State *lwan_lua_create_state(const char *script_file, const char *script);
+bool lwan_lua_compile_script(const char *script_file,
+                             const char *script,
+                             struct lwan_strbuf *bytecode);
+lua_State *lwan_lua_create_state_from_bytecode(const struct lwan_strbuf *bytecode);
 
 void lwan_lua_state_push_request(lua_State *L, struct lwan_request *request);
 
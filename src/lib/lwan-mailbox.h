@@ -0,0 +1,246 @@
+/*
+ * lwan - web server
+ * Copyright (c) 2024 L. A. F. Pereira <l@tia.mat.br>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301,
+ * USA.
+ */
+
+/*
+ * Lock-free mailboxes to pass messages between threads: fixed-size rings,
+ * like the ones in ringbuffer.h, but safe to use from a producer thread
+ * and a consumer thread at the same time (SPSC), or from any number of
+ * producer threads and a single consumer (MPSC).  The MPSC mailbox is the
+ * bounded queue described by Dmitry Vyukov:
+ * https://www.1024cores.net/home/lock-free-algorithms/queues/bounded-mpmc-queue
+ *
+ * Consumers that would rather sleep than poll a mailbox can pair it with
+ * a doorbell: producers only make a system call to ring it if the
+ * consumer is actually waiting.
+ */
+
+#pragma once
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdalign.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <unistd.h>
+
+#if defined(LWAN_HAVE_EVENTFD)
+#include <sys/eventfd.h>
+#endif
+
+/* Keeps what's written by producers and by the consumer in different
+ * cache lines. */
+#define LWAN_MAILBOX_ALIGN 64
+
+#define DEFINE_SPSC_MAILBOX_TYPE(type_name_, element_type_, size_)             \
+    static_assert((size_) && !((size_) & ((size_)-1)),                         \
+                  "size is a power of two");                                   \
+                                                                               \
+    struct type_name_ {                                                        \
+        alignas(LWAN_MAILBOX_ALIGN) uint32_t write;                            \
+        alignas(LWAN_MAILBOX_ALIGN) uint32_t read;                             \
+        element_type_ array[size_];                                            \
+    };                                                                         \
+                                                                               \
+    __attribute__((unused)) static inline void type_name_##_init(              \
+        struct type_name_ *mb)                                                 \
+    {                                                                          \
+        mb->write = mb->read = 0;                                              \
+    }                                                                          \
+                                                                               \
+    __attribute__((unused)) static inline bool type_name_##_empty(             \
+        const struct type_name_ *mb)                                           \
+    {                                                                          \
+        return __atomic_load_n(&mb->write, __ATOMIC_ACQUIRE) ==                \
+               __atomic_load_n(&mb->read, __ATOMIC_RELAXED);                   \
+    }                                                                          \
+                                                                               \
+    /* Only called by the producer thread */                                   \
+    __attribute__((unused)) static inline bool type_name_##_try_put(           \
+        struct type_name_ *mb, const element_type_ *e)                         \
+    {                                                                          \
+        const uint32_t write = mb->write;                                      \
+                                                                               \
+        if (write - __atomic_load_n(&mb->read, __ATOMIC_ACQUIRE) == (size_))   \
+            return false;                                                      \
+                                                                               \
+        mb->array[write & ((size_)-1)] = *e;                                   \
+        __atomic_store_n(&mb->write, write + 1, __ATOMIC_RELEASE);             \
+        return true;                                                           \
+    }                                                                          \
+                                                                               \
+    /* Only called by the consumer thread */                                   \
+    __attribute__((unused)) static inline bool type_name_##_try_get(           \
+        struct type_name_ *mb, element_type_ *e)                               \
+    {                                                                          \
+        const uint32_t read = mb->read;                                        \
+                                                                               \
+        if (read == __atomic_load_n(&mb->write, __ATOMIC_ACQUIRE))             \
+            return false;                                                      \
+                                                                               \
+        *e = mb->array[read & ((size_)-1)];                                    \
+        __atomic_store_n(&mb->read, read + 1, __ATOMIC_RELEASE);               \
+        return true;                                                           \
+    }
+
+#define DEFINE_MPSC_MAILBOX_TYPE(type_name_, element_type_, size_)             \
+    static_assert((size_) && !((size_) & ((size_)-1)),                         \
+                  "size is a power of two");                                   \
+                                                                               \
+    struct type_name_ {                                                        \
+        alignas(LWAN_MAILBOX_ALIGN) uint32_t write;                            \
+        alignas(LWAN_MAILBOX_ALIGN) uint32_t read;                             \
+        struct {                                                               \
+            /* A slot can be written to when its sequence number is the same   \
+             * as the write position, and read from when it's one past the     \
+             * read position. */                                               \
+            uint32_t seq;                                                      \
+            element_type_ value;                                               \
+        } slots[size_];                                                        \
+    };                                                                         \
+                                                                               \
+    __attribute__((unused)) static inline void type_name_##_init(              \
+        struct type_name_ *mb)                                                 \
+    {                                                                          \
+        mb->write = mb->read = 0;                                              \
+        for (uint32_t i = 0; i < (size_); i++)                                 \
+            mb->slots[i].seq = i;                                              \
+    }                                                                          \
+                                                                               \
+    /* Only called by the consumer thread */                                   \
+    __attribute__((unused)) static inline bool type_name_##_empty(             \
+        const struct type_name_ *mb)                                           \
+    {                                                                          \
+        const uint32_t read = mb->read;                                        \
+        const uint32_t seq = __atomic_load_n(                                  \
+            &mb->slots[read & ((size_)-1)].seq, __ATOMIC_ACQUIRE);             \
+                                                                               \
+        return (int32_t)(seq - (read + 1)) < 0;                                \
+    }                                                                          \
+                                                                               \
+    __attribute__((unused)) static inline bool type_name_##_try_put(           \
+        struct type_name_ *mb, const element_type_ *e)                         \
+    {                                                                          \
+        uint32_t write = __atomic_load_n(&mb->write, __ATOMIC_RELAXED);        \
+                                                                               \
+        while (true) {                                                         \
+            const uint32_t seq = __atomic_load_n(                              \
+                &mb->slots[write & ((size_)-1)].seq, __ATOMIC_ACQUIRE);        \
+            const int32_t diff = (int32_t)(seq - write);                       \
+                                                                               \
+            if (!diff) {                                                       \
+                if (__atomic_compare_exchange_n(&mb->write, &write, write + 1, \
+                                                true, __ATOMIC_RELAXED,        \
+                                                __ATOMIC_RELAXED))             \
+                    break;                                                     \
+            } else if (diff < 0) {                                             \
+                return false;                                                  \
+            } else {                                                           \
+                write = __atomic_load_n(&mb->write, __ATOMIC_RELAXED);         \
+            }                                                                  \
+        }                                                                      \
+                                                                               \
+        mb->slots[write & ((size_)-1)].value = *e;                             \
+        __atomic_store_n(&mb->slots[write & ((size_)-1)].seq, write + 1,       \
+                         __ATOMIC_RELEASE);                                    \
+        return true;                                                           \
+    }                                                                          \
+                                                                               \
+    /* Only called by the consumer thread */                                   \
+    __attribute__((unused)) static inline bool type_name_##_try_get(           \
+        struct type_name_ *mb, element_type_ *e)                               \
+    {                                                                          \
+        const uint32_t read = mb->read;                                        \
+                                                                               \
+        if (type_name_##_empty(mb))                                            \
+            return false;                                                      \
+                                                                               \
+        *e = mb->slots[read & ((size_)-1)].value;                              \
+        __atomic_store_n(&mb->slots[read & ((size_)-1)].seq, read + (size_),   \
+                         __ATOMIC_RELEASE);                                    \
+        mb->read = read + 1;                                                   \
+        return true;                                                           \
+    }
+
+struct lwan_mailbox_doorbell {
+    int fd[2];
+    bool waiting;
+};
+
+static inline bool
+lwan_mailbox_doorbell_init(struct lwan_mailbox_doorbell *doorbell)
+{
+    doorbell->waiting = false;
+
+#if defined(LWAN_HAVE_EVENTFD)
+    doorbell->fd[0] = doorbell->fd[1] = eventfd(0, EFD_CLOEXEC);
+    return doorbell->fd[0] >= 0;
+#else
+    if (pipe2(doorbell->fd, O_CLOEXEC) < 0)
+        return false;
+    /* Ringing must not block if nobody's been answering */
+    return fcntl(doorbell->fd[1], F_SETFL, O_NONBLOCK) == 0;
+#endif
+}
+
+static inline void
+lwan_mailbox_doorbell_close(struct lwan_mailbox_doorbell *doorbell)
+{
+    close(doorbell->fd[0]);
+    if (doorbell->fd[1] != doorbell->fd[0])
+        close(doorbell->fd[1]);
+    doorbell->fd[0] = doorbell->fd[1] = -1;
+}
+
+/* Called by producers after putting something in the mailbox. */
+static inline void
+lwan_mailbox_doorbell_ring(struct lwan_mailbox_doorbell *doorbell)
+{
+    /* Pairs with the fence in lwan_mailbox_doorbell_wait(): either the
+     * consumer sees what has just been put in the mailbox, or this sees
+     * that the consumer is waiting. */
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (!__atomic_load_n(&doorbell->waiting, __ATOMIC_RELAXED))
+        return;
+
+    while (write(doorbell->fd[1], &(uint64_t){1}, sizeof(uint64_t)) < 0 &&
+           errno == EINTR)
+        ;
+}
+
+/* Called by the consumer once @is_empty(@mailbox) is true; returns after
+ * the doorbell rang, or right away if something arrived in the meantime. */
+static inline void
+lwan_mailbox_doorbell_wait(struct lwan_mailbox_doorbell *doorbell,
+                           bool (*is_empty)(const void *mailbox),
+                           const void *mailbox)
+{
+    uint64_t value;
+
+    __atomic_store_n(&doorbell->waiting, true, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+    if (is_empty(mailbox)) {
+        while (read(doorbell->fd[0], &value, sizeof(value)) < 0 &&
+               errno == EINTR)
+            ;
+    }
+
+    __atomic_store_n(&doorbell->waiting, false, __ATOMIC_RELAXED);
+}
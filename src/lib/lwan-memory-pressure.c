@@ -0,0 +1,209 @@
+/*
+ * lwan - web server
+ * Copyright (c) 2024 L. A. F. Pereira <l@tia.mat.br>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301,
+ * USA.
+ */
+
+/*
+ * Caches only shrink as their entries expire, or once they're over their
+ * budget, so a process running with a memory limit (e.g. in a container)
+ * can keep growing until the OOM killer gets to it.  This job watches
+ * for signs that memory is running low -- the pressure stall information
+ * for memory, and the cgroup reaching its memory.high or memory.max
+ * limits -- and evicts the oldest cache entries, handing memory back to
+ * the system, before it comes to that.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#if defined(LWAN_HAVE_MALLOC_TRIM)
+#include <malloc.h>
+#endif
+
+#include "lwan-private.h"
+#include "lwan-cache.h"
+
+/* Percentage of time, over the last 10 seconds, in which some task was
+ * stalled waiting for memory. */
+#define PSI_MILD 5.0
+#define PSI_SEVERE 20.0
+
+static struct {
+    /* Opened when Lwan starts, as they might be out of reach after
+     * chrooting. */
+    int psi_fd;
+    int events_fd;
+
+    uint64_t high_events;
+    uint64_t max_events;
+} pressure = {.psi_fd = -1, .events_fd = -1};
+
+static ssize_t read_from_start(int fd, char *buffer, size_t size)
+{
+    ssize_t r;
+
+    do {
+        r = pread(fd, buffer, size - 1, 0);
+    } while (r < 0 && errno == EINTR);
+
+    if (r >= 0)
+        buffer[r] = '\0';
+
+    return r;
+}
+
+static double read_psi_avg10(void)
+{
+    char buffer[256];
+    const char *avg10;
+
+    if (pressure.psi_fd < 0)
+        return 0.0;
+
+    if (read_from_start(pressure.psi_fd, buffer, sizeof(buffer)) <= 0)
+        return 0.0;
+
+    /* "some avg10=0.00 avg60=0.00 avg300=0.00 total=0" */
+    avg10 = strstr(buffer, "some avg10=");
+    if (!avg10)
+        return 0.0;
+
+    return strtod(avg10 + sizeof("some avg10=") - 1, NULL);
+}
+
+static uint64_t parse_event_count(const char *events, const char *name)
+{
+    const size_t len = strlen(name);
+
+    for (const char *line = events; line; line = strchr(line, '\n')) {
+        if (*line == '\n')
+            line++;
+        if (!strncmp(line, name, len) && line[len] == ' ')
+            return strtoull(line + len + 1, NULL, 10);
+    }
+
+    return 0;
+}
+
+/* Tells whether the cgroup went over memory.high (and was throttled) or
+ * memory.max (and had to reclaim memory, maybe failing to) since the last
+ * time this was called. */
+static void read_cgroup_events(bool *high, bool *max)
+{
+    char buffer[512];
+    uint64_t count;
+
+    *high = *max = false;
+
+    if (pressure.events_fd < 0)
+        return;
+
+    if (read_from_start(pressure.events_fd, buffer, sizeof(buffer)) <= 0)
+        return;
+
+    count = parse_event_count(buffer, "high");
+    *high = count > pressure.high_events;
+    pressure.high_events = count;
+
+    count = parse_event_count(buffer, "max");
+    *max = count > pressure.max_events;
+    pressure.max_events = count;
+}
+
+static unsigned int shrink_percent(void)
+{
+    double avg10 = read_psi_avg10();
+    bool high, max;
+
+    read_cgroup_events(&high, &max);
+
+    if (max)
+        return 50;
+    if (high || avg10 >= PSI_SEVERE)
+        return 25;
+    if (avg10 >= PSI_MILD)
+        return 10;
+    return 0;
+}
+
+static bool memory_pressure_job(void *data __attribute__((unused)))
+{
+    unsigned int percent = shrink_percent();
+    size_t evicted;
+
+    if (!percent)
+        return false;
+
+    evicted = cache_shrink_all(percent);
+
+#if defined(LWAN_HAVE_MALLOC_TRIM)
+    /* Freed entries go back to the allocator, which would otherwise hold
+     * on to most of that memory */
+    malloc_trim(0);
+#endif
+
+    lwan_status_info("Memory is running low: evicted %zu cache entries "
+                     "(%u%% of each cache)",
+                     evicted, percent);
+
+    /* Keeps checking often until the pressure is gone */
+    return true;
+}
+
+void lwan_memory_pressure_init(void)
+{
+    char buffer[512];
+
+    pressure.psi_fd = open("/proc/pressure/memory", O_RDONLY | O_CLOEXEC);
+    pressure.events_fd = lwan_cgroup_open_file("memory.events");
+
+    if (pressure.psi_fd < 0 && pressure.events_fd < 0) {
+        lwan_status_debug("No memory pressure information available");
+        return;
+    }
+
+    /* Only events that happen from now on count */
+    if (pressure.events_fd >= 0 &&
+        read_from_start(pressure.events_fd, buffer, sizeof(buffer)) > 0) {
+        pressure.high_events = parse_event_count(buffer, "high");
+        pressure.max_events = parse_event_count(buffer, "max");
+    }
+
+    lwan_job_add_full(memory_pressure_job, NULL, "memory_pressure",
+                      LWAN_JOB_PRIORITY_HIGH, 500, 5000);
+}
+
+void lwan_memory_pressure_shutdown(void)
+{
+    lwan_job_del(memory_pressure_job, NULL);
+
+    if (pressure.psi_fd >= 0) {
+        close(pressure.psi_fd);
+        pressure.psi_fd = -1;
+    }
+    if (pressure.events_fd >= 0) {
+        close(pressure.events_fd);
+        pressure.events_fd = -1;
+    }
+}
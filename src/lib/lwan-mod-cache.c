@@ -0,0 +1,1252 @@
+/*
+ * lwan - web server
+ * Copyright (c) 2024 L. A. F. Pereira <l@tia.mat.br>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+/* Response cache.  GET requests are handled by another URL map, and
+ * whole responses are kept in a cache keyed by the URL and whatever they
+ * vary on; the cache coalesces concurrent misses, so a handler runs only
+ * once for a given key no matter how many requests arrive while it does.
+ *
+ * Each cache entry is a slot pointing to an immutable, reference counted
+ * response.  Once a response isn't fresh anymore, the first request to
+ * notice runs the handler again and replaces it; other requests keep
+ * getting the stale response meanwhile, for as long as it's allowed to
+ * be served stale.  Responses that can't be cached are remembered for a
+ * while as well, so that requests for them go straight to the handler
+ * instead of queueing behind each other waiting for an entry.
+ *
+ * Nodes in a cluster can share the work of filling their caches: keys
+ * are assigned to one of them (the owner) by consistent hashing, and the
+ * other nodes ask the owner for a response, over HTTP, before running the
+ * handler themselves.  Owners handle requests from peers like any other,
+ * except that they never ask another node in turn.  If the owner doesn't
+ * answer, it's left alone for a while, and handlers run locally
+ * meanwhile.
+ *
+ * When Lwan runs as multiple processes, responses are also published to
+ * the shared memory segment, and the other processes look there before
+ * running the handler (or asking a peer).  Their slots then point to the
+ * body in the segment rather than copying it. */
+
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+
+#include "lwan-private.h"
+
+#include "lwan-cache.h"
+#include "lwan-http-client.h"
+#include "lwan-mod-cache.h"
+#include "lwan-shm-cache.h"
+
+/* Seconds to remember that a response couldn't be cached */
+#define PASS_FOR 1
+
+/* Points each peer gets in the ring; the more, the more evenly keys are
+ * spread among peers */
+#define PEER_RING_POINTS 160
+/* Seconds to stop asking a peer for responses once it failed to answer */
+#define PEER_RETRY_AFTER 5
+/* Sent with requests to owners, so that they don't ask another peer */
+#define PEER_HEADER "X-Lwan-Cache-Peer"
+
+struct response {
+    int refs;
+    size_t size;
+    enum lwan_http_status status;
+    time_t stored_at;
+    time_t fresh_until;
+    time_t stale_until;
+
+    const char *mime_type;
+    const struct lwan_key_value *headers;
+    const char *body;
+    size_t body_len;
+
+    /* Set if the body is in the shared memory segment */
+    struct lwan_shm_cache_value shared;
+
+    char data[];
+};
+
+/* How responses are laid out in the shared memory segment, followed by
+ * the names and values of the headers, the MIME type (all NUL-terminated),
+ * and the body. */
+struct shared_response {
+    int64_t stored_at;
+    int64_t fresh_until;
+    int64_t stale_until;
+    uint32_t status;
+    uint32_t n_headers;
+    uint32_t strings_len;
+};
+
+struct slot {
+    struct cache_entry base;
+
+    pthread_mutex_t lock;
+    struct response *response; /* NULL if it couldn't be cached */
+    time_t pass_until;
+    bool revalidating;
+};
+
+struct peer {
+    char *address;
+    /* NULL for this node */
+    struct lwan_http_client_endpoint *endpoint;
+    time_t down_until;
+};
+
+struct ring_point {
+    uint64_t hash;
+    size_t peer;
+};
+
+struct cache_priv {
+    struct cache *cache;
+
+    /* Keys in the shared memory segment start with it, so that caches
+     * for different prefixes don't mix */
+    char *prefix;
+    size_t prefix_len;
+
+    /* Set if there are peers (this node being one of them); the ring is
+     * sorted by hash */
+    struct peer *peers;
+    size_t n_peers;
+    struct ring_point *ring;
+    size_t n_ring;
+    unsigned int peer_timeout;
+    size_t max_body_len;
+
+    char *pass_to;
+    size_t pass_to_len;
+
+    time_t cache_for;
+    time_t stale_for;
+    time_t max_age;
+
+    char **vary;
+    size_t n_vary;
+    bool vary_query;
+    bool vary_encoding;
+};
+
+struct miss {
+    struct lwan_request *request;
+    enum lwan_http_status status;
+    bool handled;
+};
+
+static time_t now_seconds(void)
+{
+    struct timespec now;
+
+    if (UNLIKELY(clock_gettime(monotonic_clock_id, &now) < 0))
+        return 0;
+
+    return now.tv_sec;
+}
+
+static void response_unref(struct response *response)
+{
+    if (response && !ATOMIC_DEC(response->refs)) {
+        if (response->shared.value)
+            lwan_shm_cache_release(&response->shared);
+        free(response);
+    }
+}
+
+static void response_unref_defer(void *data) { response_unref(data); }
+
+/* Returns the next item in a comma-separated list, or NULL at its end. */
+static const char *next_token(const char **list, size_t *len)
+{
+    const char *p = *list + strspn(*list, " \t,");
+    const char *end;
+
+    if (!*p)
+        return NULL;
+
+    end = p + strcspn(p, ",");
+    *list = end;
+    while (end > p && (end[-1] == ' ' || end[-1] == '\t'))
+        end--;
+    *len = (size_t)(end - p);
+
+    return p;
+}
+
+static bool token_is(const char *token, size_t len, const char *name)
+{
+    return len == strlen(name) && !strncasecmp(token, name, len);
+}
+
+static bool token_value(const char *token,
+                        size_t len,
+                        const char *name,
+                        time_t *value)
+{
+    const size_t name_len = strlen(name);
+    char *end;
+    long v;
+
+    if (len <= name_len + 1 || token[name_len] != '=' ||
+        strncasecmp(token, name, name_len))
+        return false;
+
+    v = strtol(token + name_len + 1, &end, 10);
+    if (end != token + len || v < 0)
+        return false;
+
+    *value = (time_t)v;
+    return true;
+}
+
+static bool parse_cache_control(const char *value,
+                                time_t *fresh_for,
+                                time_t *stale_for)
+{
+    bool has_s_maxage = false;
+    const char *token;
+    time_t v;
+    size_t len;
+
+    while ((token = next_token(&value, &len))) {
+        if (token_is(token, len, "no-store") ||
+            token_is(token, len, "no-cache") ||
+            token_is(token, len, "private"))
+            return false;
+
+        if (token_value(token, len, "s-maxage", &v)) {
+            *fresh_for = v;
+            has_s_maxage = true;
+        } else if (!has_s_maxage && token_value(token, len, "max-age", &v)) {
+            *fresh_for = v;
+        } else if (token_value(token, len, "stale-while-revalidate", &v)) {
+            *stale_for = v;
+        }
+    }
+
+    return true;
+}
+
+/* Responses can only be cached if what they vary on is part of the key. */
+static bool vary_is_covered(const struct cache_priv *priv, const char *value)
+{
+    const char *token;
+    size_t len;
+
+    while ((token = next_token(&value, &len))) {
+        bool covered =
+            priv->vary_encoding && token_is(token, len, "Accept-Encoding");
+
+        for (size_t i = 0; !covered && i < priv->n_vary; i++)
+            covered = token_is(token, len, priv->vary[i]);
+
+        if (!covered)
+            return false;
+    }
+
+    return true;
+}
+
+/* @age is how many seconds ago the response was stored by whoever
+ * produced it, if it came from a peer. */
+static struct response *build_response(const struct cache_priv *priv,
+                                       enum lwan_http_status status,
+                                       const char *mime_type,
+                                       const struct lwan_key_value *headers_in,
+                                       const char *body,
+                                       size_t body_len,
+                                       time_t age)
+{
+    time_t fresh_for = priv->cache_for;
+    time_t stale_for = priv->stale_for;
+    size_t n_headers = 0;
+    size_t size;
+
+    size = sizeof(struct response) + strlen(mime_type) + 1 + body_len;
+
+    for (const struct lwan_key_value *h = headers_in; h && h->key; h++) {
+        if (!h->value)
+            continue;
+
+        if (!strcasecmp(h->key, "Set-Cookie"))
+            return NULL;
+        if (!strcasecmp(h->key, "Cache-Control") &&
+            !parse_cache_control(h->value, &fresh_for, &stale_for))
+            return NULL;
+        if (!strcasecmp(h->key, "Vary") && !vary_is_covered(priv, h->value))
+            return NULL;
+
+        size += sizeof(*h) + strlen(h->key) + strlen(h->value) + 2;
+        n_headers++;
+    }
+
+    fresh_for = LWAN_MIN(fresh_for, priv->max_age);
+    stale_for = LWAN_MIN(stale_for, priv->max_age);
+
+    /* Whatever freshness the peer gave the response started counting
+     * when it stored it */
+    if (age >= fresh_for) {
+        stale_for = LWAN_MAX(stale_for - (age - fresh_for), (time_t)0);
+        fresh_for = 0;
+    } else {
+        fresh_for -= age;
+    }
+    if (!fresh_for && !stale_for)
+        return NULL;
+
+    /* Plus the terminator */
+    size += sizeof(struct lwan_key_value);
+
+    struct response *response = malloc(size);
+    if (UNLIKELY(!response))
+        return NULL;
+
+    struct lwan_key_value *headers = (struct lwan_key_value *)response->data;
+    char *p = (char *)(headers + n_headers + 1);
+    const time_t now = now_seconds();
+
+    *response = (struct response){
+        .refs = 1,
+        .size = size,
+        .status = status,
+        .stored_at = now - age,
+        .fresh_until = now + fresh_for,
+        .stale_until = now + fresh_for + stale_for,
+        .headers = headers,
+        .body_len = body_len,
+    };
+
+    for (const struct lwan_key_value *h = headers_in; h && h->key; h++) {
+        if (!h->value)
+            continue;
+
+        headers->key = p;
+        p = stpcpy(p, h->key) + 1;
+        headers->value = p;
+        p = stpcpy(p, h->value) + 1;
+        headers++;
+    }
+    *headers = (struct lwan_key_value){};
+
+    response->mime_type = p;
+    p = stpcpy(p, mime_type) + 1;
+
+    response->body = p;
+    memcpy(p, body, body_len);
+
+    return response;
+}
+
+static struct response *capture_response(const struct cache_priv *priv,
+                                         struct lwan_request *request,
+                                         enum lwan_http_status status)
+{
+    const struct lwan_response *r = &request->response;
+
+    if (status != HTTP_OK || r->chain ||
+        (request->flags & (RESPONSE_STREAM | RESPONSE_CHUNKED_ENCODING |
+                           RESPONSE_SENT_HEADERS)))
+        return NULL;
+
+    return build_response(priv, status, r->mime_type ? r->mime_type : "",
+                          r->headers, lwan_strbuf_get_buffer(r->buffer),
+                          lwan_strbuf_get_length(r->buffer), 0);
+}
+
+static enum lwan_http_status serve_response(struct lwan_request *request,
+                                            struct response *response)
+{
+    if (UNLIKELY(coro_defer(request->conn->coro, response_unref_defer,
+                            response) < 0)) {
+        response_unref(response);
+        return HTTP_INTERNAL_ERROR;
+    }
+
+    if (UNLIKELY(!lwan_strbuf_set_static(request->response.buffer,
+                                         response->body, response->body_len)))
+        return HTTP_INTERNAL_ERROR;
+
+    request->response.mime_type =
+        *response->mime_type ? response->mime_type : NULL;
+    request->response.headers = response->headers;
+
+    /* Peers asking for a response are told how old it is, so that they
+     * don't keep it fresh for longer than this node would */
+    if (lwan_request_get_header(request, PEER_HEADER)) {
+        struct coro *coro = request->conn->coro;
+        struct lwan_key_value *headers;
+        size_t n_headers = 0;
+
+        while (response->headers[n_headers].key)
+            n_headers++;
+
+        headers = coro_malloc(coro, (n_headers + 2) * sizeof(*headers));
+        if (UNLIKELY(!headers))
+            return HTTP_INTERNAL_ERROR;
+
+        memcpy(headers, response->headers, n_headers * sizeof(*headers));
+        headers[n_headers] = (struct lwan_key_value){
+            .key = "Age",
+            .value = coro_printf(coro, "%lld",
+                                 (long long)(now_seconds() -
+                                             response->stored_at)),
+        };
+        headers[n_headers + 1] = (struct lwan_key_value){};
+
+        request->response.headers = headers;
+    }
+
+    return response->status;
+}
+
+static enum lwan_http_status pass(struct lwan_request *request,
+                                  const struct cache_priv *priv)
+{
+    const size_t len = priv->pass_to_len + 1 + request->url.len;
+    char *url = coro_malloc(request->conn->coro, len + 1);
+
+    if (UNLIKELY(!url))
+        return HTTP_INTERNAL_ERROR;
+
+    memcpy(url, priv->pass_to, priv->pass_to_len);
+    url[priv->pass_to_len] = '/';
+    memcpy(url + priv->pass_to_len + 1, request->url.value, request->url.len);
+    url[len] = '\0';
+
+    return lwan_request_pass_to(request, url, len);
+}
+
+/* Every node must agree on who owns a key, so this can't be seeded like
+ * the hash functions used by hash tables are. */
+static uint64_t ring_hash(const char *data, size_t len)
+{
+    uint64_t hash = 0xcbf29ce484222325ull;
+
+    while (len--)
+        hash = (hash ^ (unsigned char)*data++) * 0x100000001b3ull;
+
+    /* FNV-1a alone doesn't spread similar keys apart enough */
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdull;
+    hash ^= hash >> 33;
+    hash *= 0xc4ceb9fe1a85ec53ull;
+    hash ^= hash >> 33;
+
+    return hash;
+}
+
+static struct peer *key_owner(const struct cache_priv *priv, const char *key)
+{
+    const uint64_t hash = ring_hash(key, strlen(key));
+    size_t lo = 0, hi = priv->n_ring;
+
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+
+        if (priv->ring[mid].hash < hash)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    return &priv->peers[priv->ring[lo == priv->n_ring ? 0 : lo].peer];
+}
+
+static bool append_encoded_path(struct lwan_strbuf *strbuf,
+                                const struct lwan_value *url)
+{
+    /* The URL has been decoded by the request parser, so encode it
+     * again, leaving alone characters that are valid in a path. */
+    static const char hex_digits[] = "0123456789ABCDEF";
+
+    for (size_t i = 0; i < url->len; i++) {
+        const unsigned char c = (unsigned char)url->value[i];
+
+        if (lwan_char_isalnum((char)c) || strchr("-._~!$&'()*+,;=:@/", c)) {
+            if (!lwan_strbuf_append_char(strbuf, (char)c))
+                return false;
+        } else {
+            const char encoded[] = {'%', hex_digits[c >> 4],
+                                    hex_digits[c & 15]};
+
+            if (!lwan_strbuf_append_str(strbuf, encoded, sizeof(encoded)))
+                return false;
+        }
+    }
+
+    return true;
+}
+
+static char *build_peer_path(struct lwan_request *request)
+{
+    const struct lwan_value *qs = &request->helper->query_string;
+    char buffer[1024];
+    struct lwan_strbuf path;
+    bool ok;
+
+    lwan_strbuf_init_with_fixed_buffer(&path, buffer, sizeof(buffer));
+
+    ok = append_encoded_path(&path, &request->original_url);
+    if (ok && qs->len) {
+        ok = lwan_strbuf_append_char(&path, '?') &&
+             lwan_strbuf_append_str(&path, qs->value, qs->len);
+    }
+    if (!ok)
+        return NULL;
+
+    return coro_strndup(request->conn->coro, lwan_strbuf_get_buffer(&path),
+                        lwan_strbuf_get_length(&path));
+}
+
+static void free_strbuf(void *data) { lwan_strbuf_free(data); }
+
+/* Headers handlers set that are worth keeping; others (e.g. Date, Server,
+ * or Expires) are added by whoever serves the response. */
+static const char *peer_response_headers[] = {
+    "Cache-Control", "Content-Disposition", "Content-Encoding",
+    "Content-Language", "ETag", "Last-Modified", "Link", "Vary",
+};
+
+/* Asks the owner of @key for a response, unless that's this node.
+ * Returns NULL if the handler should run here instead. */
+static struct response *fetch_from_peer(const struct cache_priv *priv,
+                                        struct lwan_request *request,
+                                        const char *key)
+{
+    struct lwan_key_value headers[N_ELEMENTS(peer_response_headers) + 1];
+    struct coro *coro = request->conn->coro;
+    struct lwan_key_value *request_headers;
+    struct lwan_http_client *client;
+    struct lwan_strbuf *body;
+    const char *mime_type;
+    struct peer *owner;
+    size_t n_headers = 0;
+    char *path;
+    int status;
+
+    if (!priv->peers || lwan_request_get_header(request, PEER_HEADER))
+        return NULL;
+
+    owner = key_owner(priv, key);
+    if (!owner->endpoint || now_seconds() < ATOMIC_READ(owner->down_until))
+        return NULL;
+
+    path = build_peer_path(request);
+    if (UNLIKELY(!path))
+        return NULL;
+
+    /* What responses vary on goes along, so that the owner builds the
+     * same key */
+    request_headers = coro_malloc(
+        coro, (priv->n_vary + 4) * sizeof(*request_headers));
+    if (UNLIKELY(!request_headers))
+        return NULL;
+    request_headers[n_headers++] =
+        (struct lwan_key_value){.key = PEER_HEADER, .value = "1"};
+    if (lwan_request_get_host(request)) {
+        request_headers[n_headers++] = (struct lwan_key_value){
+            .key = "Host", .value = (char *)lwan_request_get_host(request)};
+    }
+    if (lwan_request_get_header(request, "Accept-Encoding")) {
+        request_headers[n_headers++] = (struct lwan_key_value){
+            .key = "Accept-Encoding",
+            .value = (char *)lwan_request_get_header(request, "Accept-Encoding"),
+        };
+    }
+    for (size_t i = 0; i < priv->n_vary; i++) {
+        const char *value = lwan_request_get_header(request, priv->vary[i]);
+
+        if (value) {
+            request_headers[n_headers++] = (struct lwan_key_value){
+                .key = priv->vary[i], .value = (char *)value};
+        }
+    }
+    request_headers[n_headers] = (struct lwan_key_value){};
+
+    client = lwan_http_client_new(request, owner->endpoint, priv->peer_timeout);
+    if (UNLIKELY(!client))
+        return NULL;
+
+    if (!lwan_http_client_send(client, "GET", path, request_headers, NULL))
+        goto peer_failed;
+
+    status = lwan_http_client_get_status(client);
+    if (status < 0)
+        goto peer_failed;
+    /* Anything else is left to the handler here; it'll be cached by the
+     * owner if it can be, and not asked for again until then. */
+    if (status != HTTP_OK || lwan_http_client_get_header(client, "Set-Cookie"))
+        return NULL;
+
+    body = coro_malloc(coro, sizeof(*body));
+    if (UNLIKELY(!body || !lwan_strbuf_init(body)))
+        return NULL;
+    if (UNLIKELY(coro_defer(coro, free_strbuf, body) < 0)) {
+        lwan_strbuf_free(body);
+        return NULL;
+    }
+    if (!lwan_http_client_read_body_all(client, body, priv->max_body_len))
+        return NULL;
+
+    n_headers = 0;
+    for (size_t i = 0; i < N_ELEMENTS(peer_response_headers); i++) {
+        const char *value =
+            lwan_http_client_get_header(client, peer_response_headers[i]);
+
+        if (value) {
+            headers[n_headers++] = (struct lwan_key_value){
+                .key = (char *)peer_response_headers[i],
+                .value = (char *)value,
+            };
+        }
+    }
+    headers[n_headers] = (struct lwan_key_value){};
+
+    mime_type = lwan_http_client_get_header(client, "Content-Type");
+
+    return build_response(
+        priv, HTTP_OK, mime_type ? mime_type : "", headers,
+        lwan_strbuf_get_buffer(body), lwan_strbuf_get_length(body),
+        (time_t)parse_long(lwan_http_client_get_header(client, "Age"), 0));
+
+peer_failed:
+    lwan_status_warning("Cache: peer %s did not answer; handling requests "
+                        "it owns here for %ds",
+                        owner->address, PEER_RETRY_AFTER);
+    __atomic_store_n(&owner->down_until, now_seconds() + PEER_RETRY_AFTER,
+                     __ATOMIC_RELAXED);
+    return NULL;
+}
+
+static void slot_set(struct slot *slot, struct response *response)
+{
+    struct response *old;
+
+    pthread_mutex_lock(&slot->lock);
+    old = slot->response;
+    slot->response = response;
+    if (!response)
+        slot->pass_until = now_seconds() + PASS_FOR;
+    pthread_mutex_unlock(&slot->lock);
+
+    response_unref(old);
+}
+
+static char *build_shared_key(struct lwan_request *request,
+                              const struct cache_priv *priv,
+                              const char *key,
+                              size_t *len)
+{
+    const size_t key_len = strlen(key);
+    char *shared_key;
+
+    *len = priv->prefix_len + 1 + key_len;
+    shared_key = coro_malloc(request->conn->coro, *len);
+    if (LIKELY(shared_key)) {
+        memcpy(shared_key, priv->prefix, priv->prefix_len + 1);
+        memcpy(shared_key + priv->prefix_len + 1, key, key_len);
+    }
+
+    return shared_key;
+}
+
+/* Looks for a fresh response in the shared memory segment, published by
+ * another process.  Only the headers are copied; the body stays in the
+ * segment for as long as the response is referenced. */
+static struct response *fetch_from_shared(const struct cache_priv *priv,
+                                          struct lwan_request *request,
+                                          const char *key)
+{
+    struct lwan_shm_cache_value value;
+    struct shared_response shared;
+    struct lwan_key_value *headers;
+    struct response *response;
+    const char *strings, *end;
+    char *shared_key, *p;
+    size_t len;
+
+    if (!lwan_shm_cache_enabled())
+        return NULL;
+
+    shared_key = build_shared_key(request, priv, key, &len);
+    if (UNLIKELY(!shared_key))
+        return NULL;
+    if (!lwan_shm_cache_get(shared_key, len, &value))
+        return NULL;
+
+    /* Values aren't aligned in the segment */
+    memcpy(&shared, value.value, sizeof(shared));
+    strings = (const char *)value.value + sizeof(shared);
+
+    /* Stale responses are revalidated by whoever gets to it first */
+    if (now_seconds() >= shared.fresh_until || value.len < sizeof(shared) ||
+        !shared.strings_len || shared.strings_len > value.len - sizeof(shared) ||
+        strings[shared.strings_len - 1] != '\0')
+        goto not_found;
+
+    len = sizeof(*response) + (shared.n_headers + 1) * sizeof(*headers) +
+          shared.strings_len;
+    response = malloc(len);
+    if (UNLIKELY(!response))
+        goto not_found;
+
+    headers = (struct lwan_key_value *)response->data;
+    p = (char *)(headers + shared.n_headers + 1);
+    end = p + shared.strings_len;
+    memcpy(p, strings, shared.strings_len);
+
+    *response = (struct response){
+        .refs = 1,
+        .size = len,
+        .status = (enum lwan_http_status)shared.status,
+        .stored_at = (time_t)shared.stored_at,
+        .fresh_until = (time_t)shared.fresh_until,
+        .stale_until = (time_t)shared.stale_until,
+        .headers = headers,
+        .body = strings + shared.strings_len,
+        .body_len = value.len - sizeof(shared) - shared.strings_len,
+        .shared = value,
+    };
+
+    for (uint32_t i = 0; i < shared.n_headers; i++) {
+        if (p == end)
+            goto malformed;
+        headers->key = p;
+        p += strlen(p) + 1;
+        if (p == end)
+            goto malformed;
+        headers->value = p;
+        p += strlen(p) + 1;
+        headers++;
+    }
+    *headers = (struct lwan_key_value){};
+
+    if (p == end)
+        goto malformed;
+    response->mime_type = p;
+
+    return response;
+
+malformed:
+    free(response);
+not_found:
+    lwan_shm_cache_release(&value);
+    return NULL;
+}
+
+/* Lets the other processes use a response that was just stored here. */
+static void share_response(const struct cache_priv *priv,
+                           struct lwan_request *request,
+                           const char *key,
+                           const struct response *response)
+{
+    const char *strings;
+    char *shared_key;
+    size_t n_headers = 0;
+    size_t len;
+
+    if (!lwan_shm_cache_enabled() || response->shared.value)
+        return;
+
+    shared_key = build_shared_key(request, priv, key, &len);
+    if (UNLIKELY(!shared_key))
+        return;
+
+    /* Header names and values, and the MIME type, are right after the
+     * headers array (see build_response()) */
+    while (response->headers[n_headers].key)
+        n_headers++;
+    strings = (const char *)(response->headers + n_headers + 1);
+
+    struct shared_response shared = {
+        .stored_at = (int64_t)response->stored_at,
+        .fresh_until = (int64_t)response->fresh_until,
+        .stale_until = (int64_t)response->stale_until,
+        .status = (uint32_t)response->status,
+        .n_headers = (uint32_t)n_headers,
+        .strings_len = (uint32_t)(response->body - strings),
+    };
+    struct iovec iov[] = {
+        {.iov_base = &shared, .iov_len = sizeof(shared)},
+        {.iov_base = (void *)strings, .iov_len = shared.strings_len},
+        {.iov_base = (void *)response->body, .iov_len = response->body_len},
+    };
+
+    lwan_shm_cache_putv(shared_key, len, iov, (int)N_ELEMENTS(iov),
+                        response->stale_until);
+}
+
+/* Fills @slot with a response from another process or from the owner of
+ * @key, if that's another node, or from the handler otherwise.  Only for
+ * GET requests. */
+static enum lwan_http_status fill_slot(const struct cache_priv *priv,
+                                       struct slot *slot,
+                                       struct lwan_request *request,
+                                       const char *key)
+{
+    struct response *response = fetch_from_shared(priv, request, key);
+    enum lwan_http_status status;
+
+    if (!response) {
+        response = fetch_from_peer(priv, request, key);
+        if (response)
+            share_response(priv, request, key, response);
+    }
+
+    if (response) {
+        ATOMIC_INC(response->refs);
+        slot_set(slot, response);
+        return serve_response(request, response);
+    }
+
+    status = pass(request, priv);
+    response = capture_response(priv, request, status);
+    if (response)
+        share_response(priv, request, key, response);
+    slot_set(slot, response);
+    return status;
+}
+
+static struct response *slot_get_response(struct slot *slot,
+                                          time_t *pass_until)
+{
+    struct response *response;
+
+    pthread_mutex_lock(&slot->lock);
+    response = slot->response;
+    if (response)
+        ATOMIC_INC(response->refs);
+    *pass_until = slot->pass_until;
+    pthread_mutex_unlock(&slot->lock);
+
+    return response;
+}
+
+static void end_revalidation(void *data)
+{
+    struct slot *slot = data;
+
+    pthread_mutex_lock(&slot->lock);
+    slot->revalidating = false;
+    pthread_mutex_unlock(&slot->lock);
+}
+
+static bool begin_revalidation(struct lwan_request *request, struct slot *slot)
+{
+    bool began = false;
+
+    pthread_mutex_lock(&slot->lock);
+    if (!slot->revalidating) {
+        /* The handler might yield, and the coroutine might never be
+         * resumed, so whoever revalidates a slot lets go of it when the
+         * request is over, one way or another.  (This is deferred after
+         * the slot is referenced, so it's called before it's unrefd.) */
+        if (LIKELY(coro_defer(request->conn->coro, end_revalidation, slot) >=
+                   0)) {
+            slot->revalidating = true;
+            began = true;
+        }
+    }
+    pthread_mutex_unlock(&slot->lock);
+
+    return began;
+}
+
+static struct cache_entry *
+create_slot(const void *key, void *context, void *data)
+{
+    const struct cache_priv *priv = context;
+    struct miss *miss = data;
+    struct slot *slot;
+
+    if (UNLIKELY(!miss))
+        return NULL;
+
+    miss->handled = true;
+
+    /* Handlers might not bother with the body for HEAD requests, so only
+     * responses to GET requests are kept. */
+    if (lwan_request_get_method(miss->request) != REQUEST_METHOD_GET) {
+        miss->status = pass(miss->request, priv);
+        return NULL;
+    }
+
+    slot = malloc(sizeof(*slot));
+    if (UNLIKELY(!slot)) {
+        miss->status = pass(miss->request, priv);
+        return NULL;
+    }
+
+    pthread_mutex_init(&slot->lock, NULL);
+    slot->response = NULL;
+    slot->revalidating = false;
+    miss->status = fill_slot(priv, slot, miss->request, key);
+    slot->base.cost = slot->response ? slot->response->size : sizeof(*slot);
+
+    return &slot->base;
+}
+
+static void destroy_slot(struct cache_entry *entry,
+                         void *context __attribute__((unused)))
+{
+    struct slot *slot = (struct slot *)entry;
+
+    response_unref(slot->response);
+    pthread_mutex_destroy(&slot->lock);
+    free(slot);
+}
+
+/* Returns NULL if the key doesn't fit, in which case the request isn't
+ * cached. */
+static char *build_key(struct lwan_request *request,
+                       const struct cache_priv *priv)
+{
+    char buffer[1024];
+    struct lwan_strbuf key;
+    bool ok;
+
+    lwan_strbuf_init_with_fixed_buffer(&key, buffer, sizeof(buffer));
+
+    ok = lwan_strbuf_append_str(&key, request->url.value, request->url.len);
+    if (priv->vary_query) {
+        const struct lwan_value *qs = &request->helper->query_string;
+
+        ok = ok && lwan_strbuf_append_char(&key, '?') &&
+             lwan_strbuf_append_str(&key, qs->value, qs->len);
+    }
+    if (priv->vary_encoding) {
+        ok = ok && lwan_strbuf_append_char(&key, '\n') &&
+             lwan_strbuf_append_char(
+                 &key, (char)('a' + ((lwan_request_get_accept_encoding(request) &
+                                     REQUEST_ACCEPT_MASK) >> 4)));
+    }
+    /* Newlines can't be in header values, so they separate them.  Missing
+     * headers aren't the same as empty ones. */
+    for (size_t i = 0; ok && i < priv->n_vary; i++) {
+        const char *value = lwan_request_get_header(request, priv->vary[i]);
+
+        ok = lwan_strbuf_append_char(&key, '\n');
+        if (ok && value) {
+            ok = lwan_strbuf_append_char(&key, ':') &&
+                 lwan_strbuf_append_strz(&key, value);
+        }
+    }
+
+    if (!ok)
+        return NULL;
+
+    return coro_strndup(request->conn->coro, lwan_strbuf_get_buffer(&key),
+                        lwan_strbuf_get_length(&key));
+}
+
+static enum lwan_http_status
+response_cache_handle_request(struct lwan_request *request,
+                     struct lwan_response *response __attribute__((unused)),
+                     void *instance)
+{
+    struct cache_priv *priv = instance;
+    enum lwan_request_flags method = lwan_request_get_method(request);
+    struct response *cached;
+    struct slot *slot;
+    time_t pass_until;
+    char *key;
+
+    if (method != REQUEST_METHOD_GET && method != REQUEST_METHOD_HEAD)
+        return pass(request, priv);
+
+    /* Shared caches don't store responses to authorized requests. */
+    if (lwan_request_get_header(request, "Authorization"))
+        return pass(request, priv);
+
+    key = build_key(request, priv);
+    if (UNLIKELY(!key))
+        return pass(request, priv);
+
+    for (int tries = 0; tries < 2; tries++) {
+        struct miss miss = {.request = request};
+        time_t now;
+
+        slot = (struct slot *)cache_request_get_and_ref_entry_with_ctx(
+            priv->cache, request, key, &miss);
+        if (miss.handled)
+            return miss.status;
+        if (UNLIKELY(!slot))
+            break;
+
+        now = now_seconds();
+        cached = slot_get_response(slot, &pass_until);
+
+        if (!cached) {
+            if (now < pass_until || !begin_revalidation(request, slot))
+                break;
+
+            if (method == REQUEST_METHOD_GET)
+                return fill_slot(priv, slot, request, key);
+            return pass(request, priv);
+        }
+
+        if (now < cached->fresh_until)
+            return serve_response(request, cached);
+
+        if (now < cached->stale_until) {
+            if (!begin_revalidation(request, slot))
+                return serve_response(request, cached);
+
+            response_unref(cached);
+
+            if (method == REQUEST_METHOD_GET)
+                return fill_slot(priv, slot, request, key);
+            return pass(request, priv);
+        }
+
+        /* Too old to be served at all: get rid of it, and wait for
+         * whoever gets to create the entry again. */
+        response_unref(cached);
+        cache_invalidate(priv->cache, key);
+    }
+
+    return pass(request, priv);
+}
+
+static void response_cache_destroy(void *data)
+{
+    struct cache_priv *priv = data;
+
+    if (!priv)
+        return;
+
+    if (priv->cache)
+        cache_destroy(priv->cache);
+    for (size_t i = 0; i < priv->n_peers; i++) {
+        lwan_http_client_endpoint_free(priv->peers[i].endpoint);
+        free(priv->peers[i].address);
+    }
+    free(priv->peers);
+    free(priv->ring);
+    for (size_t i = 0; i < priv->n_vary; i++)
+        free(priv->vary[i]);
+    free(priv->vary);
+    free(priv->pass_to);
+    free(priv->prefix);
+    free(priv);
+}
+
+static bool parse_vary(struct cache_priv *priv, const char *vary)
+{
+    const char *token;
+    const char *p;
+    size_t len;
+
+    if (!vary)
+        return true;
+
+    for (p = vary; next_token(&p, &len);)
+        priv->n_vary++;
+
+    priv->vary = calloc(priv->n_vary, sizeof(*priv->vary));
+    if (!priv->vary)
+        return false;
+
+    p = vary;
+    for (size_t i = 0; (token = next_token(&p, &len)); i++) {
+        priv->vary[i] = strndup(token, len);
+        if (!priv->vary[i])
+            return false;
+    }
+
+    return true;
+}
+
+static int compare_ring_points(const void *a, const void *b)
+{
+    const struct ring_point *pa = a, *pb = b;
+
+    if (pa->hash < pb->hash)
+        return -1;
+    return pa->hash > pb->hash;
+}
+
+static bool parse_peers(struct cache_priv *priv,
+                        const char *peers,
+                        const char *self)
+{
+    bool found_self = false;
+    const char *token;
+    const char *p;
+    size_t len;
+
+    if (!peers)
+        return true;
+
+    if (!self) {
+        lwan_status_error("Cache: `peer_self` is needed with `peers`");
+        return false;
+    }
+
+    for (p = peers; next_token(&p, &len);)
+        priv->n_peers++;
+
+    priv->peers = calloc(priv->n_peers, sizeof(*priv->peers));
+    priv->n_ring = priv->n_peers * PEER_RING_POINTS;
+    priv->ring = calloc(priv->n_ring, sizeof(*priv->ring));
+    if (!priv->peers || !priv->ring)
+        return false;
+
+    p = peers;
+    for (size_t i = 0; (token = next_token(&p, &len)); i++) {
+        struct peer *peer = &priv->peers[i];
+
+        peer->address = strndup(token, len);
+        if (!peer->address)
+            return false;
+
+        /* Points depend only on the address, so that nodes agree on them
+         * no matter the order peers are listed in */
+        for (size_t j = 0; j < PEER_RING_POINTS; j++) {
+            char point[256];
+            int point_len =
+                snprintf(point, sizeof(point), "%s#%zu", peer->address, j);
+
+            priv->ring[i * PEER_RING_POINTS + j] = (struct ring_point){
+                .hash = ring_hash(point, (size_t)point_len),
+                .peer = i,
+            };
+        }
+
+        if (streq(peer->address, self)) {
+            found_self = true;
+            continue;
+        }
+
+        peer->endpoint = lwan_http_client_endpoint_new(peer->address);
+        if (!peer->endpoint) {
+            lwan_status_error("Cache: could not parse peer address %s",
+                              peer->address);
+            return false;
+        }
+    }
+
+    if (!found_self) {
+        lwan_status_error("Cache: `peer_self` (%s) isn't one of the `peers`",
+                          self);
+        return false;
+    }
+
+    qsort(priv->ring, priv->n_ring, sizeof(*priv->ring), compare_ring_points);
+
+    return true;
+}
+
+static void *response_cache_create(const char *prefix, void *instance)
+{
+    struct lwan_cache_settings *settings = instance;
+    struct cache_priv *priv;
+
+    if (!settings->pass_to || *settings->pass_to != '/') {
+        lwan_status_error("Cache: `pass_to` must be an absolute path");
+        return NULL;
+    }
+
+    priv = calloc(1, sizeof(*priv));
+    if (!priv)
+        return NULL;
+
+    priv->prefix = strdup(prefix);
+    if (!priv->prefix)
+        goto error;
+    priv->prefix_len = strlen(priv->prefix);
+
+    priv->cache_for = (time_t)settings->cache_for;
+    priv->stale_for = (time_t)settings->stale_for;
+    priv->max_age = (time_t)settings->max_age;
+    priv->vary_query = settings->vary_query;
+    priv->vary_encoding = settings->vary_encoding;
+
+    if (!parse_vary(priv, settings->vary)) {
+        lwan_status_error("Cache: could not parse `vary`");
+        goto error;
+    }
+
+    if (!parse_peers(priv, settings->peers, settings->peer_self))
+        goto error;
+    priv->peer_timeout = settings->peer_timeout;
+    priv->max_body_len = settings->cache_max_size;
+
+    priv->pass_to = strdup(settings->pass_to);
+    if (!priv->pass_to)
+        goto error;
+    priv->pass_to_len = strlen(priv->pass_to);
+    while (priv->pass_to_len && priv->pass_to[priv->pass_to_len - 1] == '/')
+        priv->pass_to[--priv->pass_to_len] = '\0';
+
+    /* Slots are forgotten, whatever is in them, once they couldn't
+     * possibly hold anything that could be served anymore. */
+    priv->cache = cache_create(create_slot, destroy_slot, priv,
+                               2 * LWAN_MAX(priv->max_age, (time_t)PASS_FOR));
+    if (!priv->cache)
+        goto error;
+    cache_set_name(priv->cache, "cache %s", prefix);
+    cache_set_max_cost(priv->cache, settings->cache_max_size);
+
+    return priv;
+
+error:
+    response_cache_destroy(priv);
+    return NULL;
+}
+
+static void *response_cache_create_from_hash(const char *prefix,
+                                             const struct hash *hash)
+{
+    struct lwan_cache_settings settings = {
+        .pass_to = hash_find(hash, "pass_to"),
+        .cache_for = parse_time_period(hash_find(hash, "cache_for"),
+                                       RESPONSE_CACHE_CACHE_FOR),
+        .stale_for = parse_time_period(hash_find(hash, "stale_for"), 0),
+        .max_age = parse_time_period(hash_find(hash, "max_age"),
+                                     RESPONSE_CACHE_MAX_AGE),
+        .vary = hash_find(hash, "vary"),
+        .cache_max_size = (size_t)parse_long(hash_find(hash, "cache_max_size"),
+                                             RESPONSE_CACHE_MAX_SIZE),
+        .vary_query = parse_bool(hash_find(hash, "vary_query"), true),
+        .vary_encoding = parse_bool(hash_find(hash, "vary_encoding"), true),
+        .peers = hash_find(hash, "peers"),
+        .peer_self = hash_find(hash, "peer_self"),
+        .peer_timeout = (unsigned int)parse_long(
+            hash_find(hash, "peer_timeout"), RESPONSE_CACHE_PEER_TIMEOUT),
+    };
+
+    return response_cache_create(prefix, &settings);
+}
+
+static const struct lwan_module module = {
+    .create = response_cache_create,
+    .create_from_hash = response_cache_create_from_hash,
+    .destroy = response_cache_destroy,
+    .handle_request = response_cache_handle_request,
+};
+
+LWAN_REGISTER_MODULE(cache, &module);
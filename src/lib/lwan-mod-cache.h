@@ -0,0 +1,76 @@
+/*
+ * lwan - web server
+ * Copyright (c) 2024 L. A. F. Pereira <l@tia.mat.br>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#pragma once
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+#include "lwan.h"
+
+#define RESPONSE_CACHE_CACHE_FOR 1
+#define RESPONSE_CACHE_MAX_AGE 60
+#define RESPONSE_CACHE_MAX_SIZE (16 * 1024 * 1024)
+#define RESPONSE_CACHE_PEER_TIMEOUT 500
+
+struct lwan_cache_settings {
+    /* Requests are handled by the URL map for this URL, followed by
+     * whatever comes after the prefix of this module */
+    const char *pass_to;
+    /* Seconds responses without a max-age are fresh for */
+    unsigned int cache_for;
+    /* Seconds responses are served stale, while being revalidated, if
+     * they don't have a stale-while-revalidate directive */
+    unsigned int stale_for;
+    /* Upper bound for both of the above, whatever responses say */
+    unsigned int max_age;
+    /* Comma-separated list of request headers responses vary on */
+    const char *vary;
+    /* Approximate number of bytes used by cached responses */
+    size_t cache_max_size;
+    /* Comma-separated list of "host:port" addresses of every node in the
+     * cluster, including this one, given by `peer_self`; the same on every
+     * node.  NULL if responses aren't shared */
+    const char *peers;
+    const char *peer_self;
+    /* Milliseconds to wait for a peer to answer */
+    unsigned int peer_timeout;
+    bool vary_query;
+    bool vary_encoding;
+};
+
+LWAN_MODULE_FORWARD_DECL(cache);
+
+#define RESPONSE_CACHE(pass_to_)                                               \
+    .module = LWAN_MODULE_REF(cache),                                          \
+    .args = ((struct lwan_cache_settings[]){{                                  \
+        .pass_to = pass_to_,                                                   \
+        .cache_for = RESPONSE_CACHE_CACHE_FOR,                                 \
+        .max_age = RESPONSE_CACHE_MAX_AGE,                                     \
+        .cache_max_size = RESPONSE_CACHE_MAX_SIZE,                             \
+        .peer_timeout = RESPONSE_CACHE_PEER_TIMEOUT,                           \
+        .vary_query = true,                                                    \
+        .vary_encoding = true,                                                 \
+    }}),                                                                       \
+    .flags = (enum lwan_handler_flags)0
+
+#if defined(__cplusplus)
+}
+#endif
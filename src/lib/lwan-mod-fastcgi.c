@@ -31,6 +31,7 @@
 #include <fcntl.h>
 #include <limits.h>
 #include <netinet/in.h>
+#include <pthread.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/socket.h>
@@ -43,6 +44,7 @@
 
 #include "int-to-str.h"
 #include "realpathat.h"
+#include "list.h"
 #include "lwan-cache.h"
 #include "lwan-io-wrappers.h"
 #include "lwan-mod-fastcgi.h"
@@ -50,7 +52,6 @@
 
 #define FASTCGI_ROLE_RESPONDER 1
 
-/* FIXME: use this to pool connections later? */
 #define FASTCGI_FLAGS_KEEP_CONN 1
 
 #define FASTCGI_TYPE_BEGIN_REQUEST 1
@@ -60,7 +61,18 @@
 #define FASTCGI_TYPE_STDOUT 6
 #define FASTCGI_TYPE_STDERR 7
 
-struct private_data {
+/* Connections to the FastCGI server are kept open after a request has
+ * been fully answered, and are reused by the next requests handled by the
+ * same thread.  */
+#define MAX_IDLE_CONNECTIONS_PER_THREAD 16
+
+/* Backends that fail (can't be connected to, or drop requests) aren't
+ * picked again until they've been left alone for a while; this doubles
+ * with each consecutive failure. */
+#define MIN_BACKOFF_MS 250
+#define MAX_BACKOFF_MS 30000
+
+struct backend {
     union {
         struct sockaddr_un un_addr;
         struct sockaddr_in in_addr;
@@ -70,12 +82,66 @@ struct private_data {
     sa_family_t addr_family;
     socklen_t addr_size;
 
+    /* As written in the configuration file */
+    char *address;
+
+    /* Shared between all I/O threads, so these are only accessed with
+     * atomic builtins.  */
+    unsigned int requests_in_flight;
+    unsigned int consecutive_failures;
+    uint64_t retry_after_us;
+
+    uint64_t requests;
+    uint64_t failures;
+    uint64_t latency_us;
+};
+
+struct connection_pool {
+    int idle_fds[MAX_IDLE_CONNECTIONS_PER_THREAD];
+    unsigned int n_idle;
+};
+
+struct connection_pools {
+    size_t n_pools;
+    struct connection_pool pools[];
+};
+
+struct backend_connection {
+    struct backend *backend;
+    struct connection_pool *pool;
+    struct lwan_thread *thread;
+    uint64_t start_us;
+    int fd;
+    bool reusable;
+};
+
+struct private_data {
+    struct backend *backends;
+    size_t n_backends;
+    unsigned int next_backend;
+
+    /* In the list of instances whose backends are reported by
+     * lwan_fastcgi_foreach_backend_stats() */
+    struct list_node instances;
+    char *prefix;
+
     struct cache *script_name_cache;
 
     struct lwan_value default_index;
 
     char *script_path;
     int script_path_fd;
+
+    /* One per (thread, backend) pair; allocated by the first request */
+    struct connection_pools *pools;
+};
+
+static struct {
+    pthread_mutex_t lock;
+    struct list_head list;
+} instances = {
+    .list = {.n = {.next = &instances.list.n, .prev = &instances.list.n}},
+    .lock = PTHREAD_MUTEX_INITIALIZER,
 };
 
 struct record {
@@ -108,6 +174,10 @@ struct script_name_cache_entry {
     struct cache_entry base;
     char *script_name;
     char *script_filename;
+
+    /* Parameters that are the same for every request to this script,
+     * already encoded; sent before the ones built for each request. */
+    struct lwan_value params;
 };
 
 static void close_fd(void *data)
@@ -117,6 +187,247 @@ static void close_fd(void *data)
     close(fd);
 }
 
+static uint64_t now_us(void)
+{
+    struct timespec now;
+
+    /* Requests often take less than a tick of the coarse clock, so the
+     * latency would be mostly zero with it */
+    if (UNLIKELY(clock_gettime(CLOCK_MONOTONIC, &now) < 0))
+        return 0;
+
+    return (uint64_t)now.tv_sec * 1000000 + (uint64_t)now.tv_nsec / 1000;
+}
+
+static struct connection_pool *get_connection_pools(struct private_data *pd,
+                                                    struct lwan_request *request)
+{
+    const struct lwan *lwan = request->conn->thread->lwan;
+    struct connection_pools *pools =
+        __atomic_load_n(&pd->pools, __ATOMIC_ACQUIRE);
+
+    if (UNLIKELY(!pools)) {
+        const size_t n_pools = lwan->thread.count * pd->n_backends;
+        struct connection_pools *new_pools = calloc(
+            1, sizeof(*new_pools) + n_pools * sizeof(struct connection_pool));
+
+        if (!new_pools)
+            return NULL;
+
+        new_pools->n_pools = n_pools;
+        if (__atomic_compare_exchange_n(&pd->pools, &pools, new_pools, false,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            pools = new_pools;
+        } else {
+            free(new_pools);
+        }
+    }
+
+    const size_t thread_index =
+        (size_t)(request->conn->thread - lwan->thread.threads);
+    return &pools->pools[thread_index * pd->n_backends];
+}
+
+static int take_idle_connection(struct connection_pool *pool)
+{
+    while (pool && pool->n_idle) {
+        int fd = pool->idle_fds[--pool->n_idle];
+        char byte;
+
+        /* The server might have closed this connection while it was idle
+         * (e.g. PHP-FPM does that after pm.max_requests).  */
+        if (recv(fd, &byte, 1, MSG_PEEK | MSG_DONTWAIT) < 0 && errno == EAGAIN)
+            return fd;
+
+        close(fd);
+    }
+
+    return -1;
+}
+
+static void release_backend_connection(void *data)
+{
+    struct backend_connection *conn = data;
+    struct connection_pool *pool = conn->pool;
+
+    __atomic_sub_fetch(&conn->backend->requests_in_flight, 1,
+                       __ATOMIC_RELAXED);
+
+    /* This runs after the defers registered by lwan_request_await_*(),
+     * so the connection isn't borrowed by this coroutine anymore.  */
+    if (conn->reusable && pool &&
+        pool->n_idle < MAX_IDLE_CONNECTIONS_PER_THREAD) {
+        lwan_thread_unwatch_open_fd(conn->thread, conn->fd);
+        pool->idle_fds[pool->n_idle++] = conn->fd;
+        return;
+    }
+
+    close(conn->fd);
+}
+
+static void backend_failed(struct backend *backend)
+{
+    const unsigned int failures = __atomic_add_fetch(
+        &backend->consecutive_failures, 1, __ATOMIC_RELAXED);
+    const uint64_t backoff_ms =
+        LWAN_MIN((uint64_t)MIN_BACKOFF_MS << LWAN_MIN(failures - 1, 16u),
+                 (uint64_t)MAX_BACKOFF_MS);
+
+    __atomic_store_n(&backend->retry_after_us, now_us() + backoff_ms * 1000,
+                     __ATOMIC_RELAXED);
+    __atomic_add_fetch(&backend->failures, 1, __ATOMIC_RELAXED);
+
+    if (failures == 1)
+        lwan_status_warning("FastCGI: backend %s failed", backend->address);
+}
+
+static void backend_succeeded(struct backend *backend, uint64_t start_us)
+{
+    if (__atomic_exchange_n(&backend->consecutive_failures, 0,
+                            __ATOMIC_RELAXED)) {
+        __atomic_store_n(&backend->retry_after_us, 0, __ATOMIC_RELAXED);
+        lwan_status_info("FastCGI: backend %s is healthy again",
+                         backend->address);
+    }
+
+    __atomic_add_fetch(&backend->requests, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&backend->latency_us, now_us() - start_us,
+                       __ATOMIC_RELAXED);
+}
+
+/* Picks the backend with the fewest requests in flight, out of the ones
+ * that aren't backing off after a failure. */
+static size_t pick_backend(struct private_data *pd)
+{
+    const size_t n = pd->n_backends;
+    const size_t start =
+        __atomic_fetch_add(&pd->next_backend, 1, __ATOMIC_RELAXED) % n;
+    const uint64_t now = now_us();
+    unsigned int least_in_flight = UINT_MAX;
+    uint64_t earliest_retry = UINT64_MAX;
+    size_t picked = SIZE_MAX;
+    size_t retry_first = start;
+
+    for (size_t i = 0; i < n; i++) {
+        const size_t index = (start + i) % n;
+        const struct backend *backend = &pd->backends[index];
+        const uint64_t retry_after =
+            __atomic_load_n(&backend->retry_after_us, __ATOMIC_RELAXED);
+
+        if (retry_after > now) {
+            if (retry_after < earliest_retry) {
+                earliest_retry = retry_after;
+                retry_first = index;
+            }
+            continue;
+        }
+
+        /* Starting from a different index every time spreads ties evenly */
+        const unsigned int in_flight =
+            __atomic_load_n(&backend->requests_in_flight, __ATOMIC_RELAXED);
+        if (in_flight < least_in_flight) {
+            least_in_flight = in_flight;
+            picked = index;
+        }
+    }
+
+    /* If every backend is backing off, try the one that would be tried
+     * first anyway: there's nothing better to do.  */
+    return picked == SIZE_MAX ? retry_first : picked;
+}
+
+static struct backend_connection *
+connect_to_backend(struct lwan_request *request,
+                   struct private_data *pd,
+                   struct connection_pool *pools,
+                   size_t index)
+{
+    struct backend *backend = &pd->backends[index];
+    struct connection_pool *pool = pools ? &pools[index] : NULL;
+    struct backend_connection *conn;
+    int fd;
+
+    fd = take_idle_connection(pool);
+    const bool connected = fd >= 0;
+    if (!connected) {
+        fd = socket(backend->addr_family,
+                    SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (fd < 0)
+            return NULL;
+    }
+
+    conn = coro_malloc(request->conn->coro, sizeof(*conn));
+    if (UNLIKELY(!conn)) {
+        close(fd);
+        return NULL;
+    }
+    *conn = (struct backend_connection){
+        .backend = backend,
+        .pool = pool,
+        .thread = request->conn->thread,
+        .start_us = now_us(),
+        .fd = fd,
+    };
+    __atomic_add_fetch(&backend->requests_in_flight, 1, __ATOMIC_RELAXED);
+    coro_defer(request->conn->coro, release_backend_connection, conn);
+
+    if (!connected &&
+        !lwan_connect_fd(request, fd, (struct sockaddr *)&backend->sock_addr,
+                         backend->addr_size)) {
+        backend_failed(backend);
+        return NULL;
+    }
+
+    return conn;
+}
+
+void lwan_fastcgi_foreach_backend_stats(
+    void (*cb)(const struct lwan_fastcgi_backend_stats *stats, void *data),
+    void *data)
+{
+    const uint64_t now = now_us();
+    struct private_data *pd;
+
+    pthread_mutex_lock(&instances.lock);
+    list_for_each (&instances.list, pd, instances) {
+        for (size_t i = 0; i < pd->n_backends; i++) {
+            const struct backend *backend = &pd->backends[i];
+            const struct lwan_fastcgi_backend_stats stats = {
+                .url_map = pd->prefix,
+                .address = backend->address,
+                .requests =
+                    __atomic_load_n(&backend->requests, __ATOMIC_RELAXED),
+                .failures =
+                    __atomic_load_n(&backend->failures, __ATOMIC_RELAXED),
+                .latency_us =
+                    __atomic_load_n(&backend->latency_us, __ATOMIC_RELAXED),
+                .requests_in_flight = __atomic_load_n(
+                    &backend->requests_in_flight, __ATOMIC_RELAXED),
+                .backing_off = __atomic_load_n(&backend->retry_after_us,
+                                               __ATOMIC_RELAXED) > now,
+            };
+
+            cb(&stats, data);
+        }
+    }
+    pthread_mutex_unlock(&instances.lock);
+}
+
+static void close_connection_pools(struct connection_pools *pools)
+{
+    if (!pools)
+        return;
+
+    for (size_t i = 0; i < pools->n_pools; i++) {
+        struct connection_pool *pool = &pools->pools[i];
+
+        for (unsigned int j = 0; j < pool->n_idle; j++)
+            close(pool->idle_fds[j]);
+    }
+
+    free(pools);
+}
+
 static void add_param_len(struct lwan_strbuf *strbuf,
                           const char *key,
                           size_t len_key,
@@ -161,6 +472,38 @@ add_int_param(struct lwan_strbuf *strbuf, const char *key, ssize_t value)
     return add_param_len(strbuf, key, strlen(key), p, len);
 }
 
+static bool encode_constant_params(const struct private_data *pd,
+                                   struct script_name_cache_entry *entry)
+{
+    struct lwan_strbuf strbuf;
+
+    if (!lwan_strbuf_init(&strbuf))
+        return false;
+
+    /* Very compliant. Much CGI. Wow. */
+    add_param(&strbuf, "GATEWAY_INTERFACE", "CGI/1.1");
+    add_param(&strbuf, "SERVER_SOFTWARE", "Lwan");
+
+    /* FIXME: Should we support PATH_INFO?  This is pretty shady. See
+     * e.g. https://httpd.apache.org/docs/2.4/mod/core.html#acceptpathinfo  */
+    add_param(&strbuf, "PATH_INFO", "");
+
+    add_param(&strbuf, "DOCUMENT_ROOT", pd->script_path);
+    add_param(&strbuf, "SCRIPT_NAME", entry->script_name);
+    add_param(&strbuf, "SCRIPT_FILENAME", entry->script_filename);
+
+    entry->params.len = lwan_strbuf_get_length(&strbuf);
+    entry->params.value = malloc(entry->params.len);
+    if (entry->params.value) {
+        memcpy(entry->params.value, lwan_strbuf_get_buffer(&strbuf),
+               entry->params.len);
+    }
+
+    lwan_strbuf_free(&strbuf);
+
+    return entry->params.value != NULL;
+}
+
 static struct cache_entry *
 create_script_name(const void *keyptr, void *context, void *create_contex)
 {
@@ -196,6 +539,9 @@ create_script_name(const void *keyptr, void *context, void *create_contex)
     if (strncmp(entry->script_filename, pd->script_path, strlen(pd->script_path)))
         goto free_script_filename;
 
+    if (!encode_constant_params(pd, entry))
+        goto free_script_filename;
+
     return &entry->base;
 
 free_script_filename:
@@ -213,28 +559,12 @@ static void destroy_script_name(struct cache_entry *entry, void *context)
     struct script_name_cache_entry *snce =
         (struct script_name_cache_entry *)entry;
 
+    free(snce->params.value);
     free(snce->script_name);
     free(snce->script_filename);
     free(snce);
 }
 
-static enum lwan_http_status add_script_paths(const struct private_data *pd,
-                                              struct lwan_request *request,
-                                              struct lwan_response *response)
-{
-    struct script_name_cache_entry *snce =
-        (struct script_name_cache_entry *)cache_coro_get_and_ref_entry(
-            pd->script_name_cache, request->conn->coro, &request->url);
-
-    if (snce) {
-        add_param(response->buffer, "SCRIPT_NAME", snce->script_name);
-        add_param(response->buffer, "SCRIPT_FILENAME", snce->script_filename);
-        return HTTP_OK;
-    }
-
-    return HTTP_NOT_FOUND;
-}
-
 static void add_header_to_strbuf(const char *header,
                                  size_t header_len,
                                  const char *value,
@@ -245,6 +575,20 @@ static void add_header_to_strbuf(const char *header,
     return add_param_len(strbuf, header, header_len, value, value_len);
 }
 
+static void add_untraced_header_to_strbuf(const char *header,
+                                          size_t header_len,
+                                          const char *value,
+                                          size_t value_len,
+                                          void *user_data)
+{
+    /* Replaced with the traceparent for the call to the backend */
+    if (header_len == sizeof("HTTP_TRACEPARENT") - 1 &&
+        !memcmp(header, "HTTP_TRACEPARENT", header_len))
+        return;
+
+    add_header_to_strbuf(header, header_len, value, value_len, user_data);
+}
+
 static bool fill_addr_and_port(const struct lwan_request *r,
                                struct lwan_strbuf *strbuf)
 {
@@ -301,31 +645,23 @@ static bool fill_addr_and_port(const struct lwan_request *r,
     return true;
 }
 
-static enum lwan_http_status add_params(const struct private_data *pd,
-                                        struct lwan_request *request,
+static enum lwan_http_status add_params(struct lwan_request *request,
                                         struct lwan_response *response)
 {
     const struct lwan_request_parser_helper *request_helper = request->helper;
     struct lwan_strbuf *strbuf = response->buffer;
 
-    /* Very compliant. Much CGI. Wow. */
-    add_param(strbuf, "GATEWAY_INTERFACE", "CGI/1.1");
-
+    /* Parameters that don't depend on the request are in the entry for
+     * the script; see encode_constant_params(). */
     if (!fill_addr_and_port(request, strbuf))
         return HTTP_INTERNAL_ERROR;
 
-    add_param(strbuf, "SERVER_SOFTWARE", "Lwan");
     add_param(strbuf, "SERVER_PROTOCOL",
               request->flags & REQUEST_IS_HTTP_1_0 ? "HTTP/1.0" : "HTTP/1.1");
 
     add_param(strbuf, "REQUEST_METHOD", lwan_request_get_method_str(request));
 
-    /* FIXME: Should we support PATH_INFO?  This is pretty shady. See
-     * e.g. https://httpd.apache.org/docs/2.4/mod/core.html#acceptpathinfo  */
-    add_param(strbuf, "PATH_INFO", "");
-
     add_param(strbuf, "DOCUMENT_URI", request->original_url.value);
-    add_param(strbuf, "DOCUMENT_ROOT", pd->script_path);
 
     const char *query_string = request_helper->query_string.value;
     if (query_string) {
@@ -347,15 +683,105 @@ static enum lwan_http_status add_params(const struct private_data *pd,
         add_param(strbuf, "REQUEST_URI", request->original_url.value);
     }
 
-    lwan_request_foreach_header_for_cgi(request, add_header_to_strbuf, strbuf);
+    if (UNLIKELY(request->helper->trace != NULL)) {
+        char traceparent[LWAN_TRACEPARENT_SIZE];
+
+        lwan_tracing_get_traceparent(request, traceparent);
+        add_param(strbuf, "HTTP_TRACEPARENT", traceparent);
+
+        lwan_request_foreach_header_for_cgi(
+            request, add_untraced_header_to_strbuf, strbuf);
+    } else {
+        lwan_request_foreach_header_for_cgi(request, add_header_to_strbuf,
+                                            strbuf);
+    }
 
     return HTTP_OK;
 }
 
-static bool
-handle_stdout(struct lwan_request *request, const struct record *record, int fd)
+static bool discard_padding(struct lwan_request *request,
+                            const struct record *record,
+                            int fd)
+{
+    if (record->len_padding) {
+        char padding[256];
+        if (lwan_recv_fd(request, fd, padding, (size_t)record->len_padding,
+                         MSG_TRUNC) < 0) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+#if defined(__linux__)
+/* Once the response headers have been sent, the contents of STDOUT
+ * records at least this large are spliced from the FastCGI socket to the
+ * client socket as a chunk, without being copied to userspace. */
+#define MIN_SPLICED_STDOUT_SIZE 4096
+
+static bool try_splicing_stdout(struct lwan_request *request,
+                                const struct record *record,
+                                int fd,
+                                int pipe_fds[static 2])
+{
+    const size_t len = record->len_content;
+    char chunk_size[2 * sizeof(size_t) + 2];
+
+    if (len < MIN_SPLICED_STDOUT_SIZE ||
+        !(request->flags & RESPONSE_CHUNKED_ENCODING) ||
+        lwan_strbuf_get_length(request->response.buffer))
+        return false;
+
+    if (pipe_fds[0] < 0) {
+        if (pipe2(pipe_fds, O_NONBLOCK | O_CLOEXEC) < 0) {
+            /* Don't try again for this request */
+            pipe_fds[0] = pipe_fds[1] = INT_MAX;
+            return false;
+        }
+
+        coro_defer(request->conn->coro, close_fd,
+                   (void *)(intptr_t)pipe_fds[0]);
+        coro_defer(request->conn->coro, close_fd,
+                   (void *)(intptr_t)pipe_fds[1]);
+    } else if (pipe_fds[0] == INT_MAX) {
+        return false;
+    }
+
+    char *p = uint_to_hex_string_append(len, chunk_size);
+    *p++ = '\r';
+    *p++ = '\n';
+
+    /* Smaller chunks that came before this one go out first */
+    lwan_response_flush_chunks(request);
+    lwan_send(request, chunk_size, (size_t)(p - chunk_size), MSG_MORE);
+
+    if (lwan_splice_fd(request, request->fd, fd, pipe_fds, len) < 0) {
+        /* Part of a chunk might have been sent already */
+        coro_yield(request->conn->coro, CONN_CORO_ABORT);
+        __builtin_unreachable();
+    }
+
+    lwan_send(request, "\r\n", 2, 0);
+
+    return true;
+}
+#endif
+
+static bool handle_stdout(struct lwan_request *request,
+                          const struct record *record,
+                          int fd,
+                          int pipe_fds[static 2])
 {
     size_t to_read = record->len_content;
+
+#if defined(__linux__)
+    if (try_splicing_stdout(request, record, fd, pipe_fds))
+        return discard_padding(request, record, fd);
+#else
+    (void)pipe_fds;
+#endif
+
     char *buffer = lwan_strbuf_extend_unsafe(request->response.buffer, to_read);
 
     if (!buffer)
@@ -371,15 +797,7 @@ handle_stdout(struct lwan_request *request, const struct record *record, int fd)
         buffer += r;
     }
 
-    if (record->len_padding) {
-        char padding[256];
-        if (lwan_recv_fd(request, fd, padding, (size_t)record->len_padding,
-                         MSG_TRUNC) < 0) {
-            return false;
-        }
-    }
-
-    return true;
+    return discard_padding(request, record, fd);
 }
 
 static bool
@@ -409,12 +827,24 @@ handle_stderr(struct lwan_request *request, const struct record *record, int fd)
 
     coro_defer_fire_and_disarm(request->conn->coro, buffer_free_defer);
 
-    if (record->len_padding) {
-        char padding[256];
-        if (lwan_recv_fd(request, fd, padding, (size_t)record->len_padding,
-                         MSG_TRUNC) < 0) {
+    return discard_padding(request, record, fd);
+}
+
+static bool
+skip_record(struct lwan_request *request, const struct record *record, int fd)
+{
+    char buffer[256];
+    size_t to_read = (size_t)record->len_content + (size_t)record->len_padding;
+
+    while (to_read) {
+        ssize_t r;
+
+        r = lwan_recv_fd(request, fd, buffer, LWAN_MIN(sizeof(buffer), to_read),
+                         MSG_TRUNC);
+        if (r < 0)
             return false;
-        }
+
+        to_read -= (size_t)r;
     }
 
     return true;
@@ -424,9 +854,6 @@ static bool discard_unknown_record(struct lwan_request *request,
                                    const struct record *record,
                                    int fd)
 {
-    char buffer[256];
-    size_t to_read = (size_t)record->len_content + (size_t)record->len_padding;
-
     if (record->type > 11) {
         /* Per the spec, 11 is the maximum (unknown type), so anything
          * above it is unspecified. */
@@ -436,20 +863,10 @@ static bool discard_unknown_record(struct lwan_request *request,
     }
 
     lwan_status_debug("Discarding record of type %d (%zu bytes incl. padding)",
-                      record->type, to_read);
-
-    while (to_read) {
-        ssize_t r;
+                      record->type,
+                      (size_t)record->len_content + (size_t)record->len_padding);
 
-        r = lwan_recv_fd(request, fd, buffer, LWAN_MIN(sizeof(buffer), to_read),
-                         MSG_TRUNC);
-        if (r < 0)
-            return false;
-
-        to_read -= (size_t)r;
-    }
-
-    return true;
+    return skip_record(request, record, fd);
 }
 
 DEFINE_ARRAY_TYPE_INLINEFIRST(header_array, struct lwan_key_value)
@@ -472,7 +889,7 @@ try_initiating_chunked_response(struct lwan_request *request)
 
     struct lwan_response *response = &request->response;
     char *header_start[N_HEADER_START];
-    char *next_request;
+    char *next_request = NULL;
     enum lwan_http_status status_code = HTTP_OK;
     struct lwan_value buffer = {
         .value = lwan_strbuf_get_buffer(response->buffer),
@@ -550,7 +967,8 @@ try_initiating_chunked_response(struct lwan_request *request)
 
     coro_defer_fire_and_disarm(request->conn->coro, additional_headers_reset);
 
-    char *chunk_start = header_start[n_headers];
+    /* The body starts after the empty line ending the headers */
+    char *chunk_start = next_request ? next_request : header_start[n_headers];
     size_t chunk_len = buffer.len - (size_t)(chunk_start - buffer.value);
 
     if (chunk_len) {
@@ -634,17 +1052,21 @@ static enum lwan_http_status send_request(struct private_data *pd,
                                           struct lwan_response *response,
                                           int fcgi_fd)
 {
+    struct script_name_cache_entry *snce;
     enum lwan_http_status status;
+    size_t params_len;
 
-    status = add_params(pd, request, response);
-    if (status != HTTP_OK)
-        return status;
+    snce = (struct script_name_cache_entry *)cache_coro_get_and_ref_entry(
+        pd->script_name_cache, request->conn->coro, &request->url);
+    if (!snce)
+        return HTTP_NOT_FOUND;
 
-    status = add_script_paths(pd, request, response);
+    status = add_params(request, response);
     if (status != HTTP_OK)
         return status;
 
-    if (UNLIKELY(lwan_strbuf_get_length(response->buffer) > 0xffffu)) {
+    params_len = snce->params.len + lwan_strbuf_get_length(response->buffer);
+    if (UNLIKELY(params_len > 0xffffu)) {
         /* Should not happen because DEFAULT_BUFFER_SIZE is a lot smaller
          * than 65535, but check anyway.  (If anything, we could send multiple
          * PARAMS records, but that's very unlikely to happen anyway until
@@ -674,16 +1096,21 @@ static enum lwan_http_status send_request(struct private_data *pd,
                                   .id = htons(1),
                                   .len_content = htons((uint16_t)sizeof(
                                       struct begin_request_body))},
-                .begin_request_body = {.role = htons(FASTCGI_ROLE_RESPONDER)},
+                .begin_request_body = {.role = htons(FASTCGI_ROLE_RESPONDER),
+                                       .flags = FASTCGI_FLAGS_KEEP_CONN},
                 .begin_params = {.version = 1,
                                  .type = FASTCGI_TYPE_PARAMS,
                                  .id = htons(1),
-                                 .len_content =
-                                     htons((uint16_t)lwan_strbuf_get_length(
-                                         response->buffer))}},
+                                 .len_content = htons((uint16_t)params_len)}},
         .iov_len = sizeof(struct request_header),
     };
 
+    iovec = iovec_array_append(&iovec_array);
+    if (UNLIKELY(!iovec))
+        return HTTP_INTERNAL_ERROR;
+    *iovec = (struct iovec){.iov_base = snce->params.value,
+                            .iov_len = snce->params.len};
+
     iovec = iovec_array_append(&iovec_array);
     if (UNLIKELY(!iovec))
         return HTTP_INTERNAL_ERROR;
@@ -718,7 +1145,7 @@ static enum lwan_http_status send_request(struct private_data *pd,
 
     if (lwan_writev_fd(request, fcgi_fd, iovec_array_get_array(&iovec_array),
                        (int)iovec_array_len(&iovec_array)) < 0) {
-        return HTTP_INTERNAL_ERROR;
+        return HTTP_UNAVAILABLE;
     }
     iovec_array_reset(&iovec_array);
     record_array_reset(&record_array);
@@ -728,76 +1155,20 @@ static enum lwan_http_status send_request(struct private_data *pd,
     return HTTP_OK;
 }
 
-static bool try_connect(struct lwan_request *request,
-                        int sock_fd,
-                        struct sockaddr *sockaddr,
-                        socklen_t socklen)
-{
-    if (LIKELY(!connect(sock_fd, sockaddr, socklen)))
-        return true;
-
-    /* Since socket has been created in non-blocking mode, connection
-     * might not be completed immediately.  Depending on the socket type,
-     * connect() might return EAGAIN or EINPROGRESS.  */
-    if (errno != EAGAIN && errno != EINPROGRESS)
-        return false;
-
-    /* If we get any of the above errors, try checking for socket error
-     * codes and loop until we get no errors.  We await for writing here
-     * because that's what the Linux man page for connect(2) says we should
-     * do in this case.  */
-    for (int try = 0; try < 10; try++) {
-        socklen_t sockerrnolen = (socklen_t)sizeof(int);
-        int sockerrno;
-
-        lwan_request_await_write(request, sock_fd);
-
-        if (getsockopt(sock_fd, SOL_SOCKET, SO_ERROR, &sockerrno,
-                       &sockerrnolen) < 0) {
-            break;
-        }
-
-        switch (sockerrno) {
-        case EISCONN:
-        case 0:
-            return true;
-
-        case EAGAIN:
-        case EINPROGRESS:
-        case EINTR:
-            continue;
-
-        default:
-            return false;
-        }
-    }
-
-    return false;
-}
-
 static enum lwan_http_status
-fastcgi_handle_request(struct lwan_request *request,
-                       struct lwan_response *response,
-                       void *instance)
+fastcgi_request(struct private_data *pd,
+                struct lwan_request *request,
+                struct lwan_response *response,
+                struct backend_connection *backend)
 {
-    struct private_data *pd = instance;
+    const int fcgi_fd = backend->fd;
     enum lwan_http_status status;
     int remaining_tries_for_chunked = 10;
-    int fcgi_fd;
-
-    fcgi_fd =
-        socket(pd->addr_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
-    if (fcgi_fd < 0)
-        return HTTP_INTERNAL_ERROR;
-
-    coro_defer(request->conn->coro, close_fd, (void *)(intptr_t)fcgi_fd);
-
-    if (!try_connect(request, fcgi_fd, (struct sockaddr *)&pd->sock_addr,
-                     pd->addr_size)) {
-        return HTTP_UNAVAILABLE;
-    }
+    int pipe_fds[2] = {-1, -1};
 
     status = send_request(pd, request, response, fcgi_fd);
+    if (status == HTTP_UNAVAILABLE)
+        backend_failed(backend->backend);
     if (status != HTTP_OK)
         return status;
 
@@ -812,8 +1183,10 @@ fastcgi_handle_request(struct lwan_request *request,
         ssize_t r;
 
         r = lwan_recv_fd(request, fcgi_fd, &record, sizeof(record), 0);
-        if (r < 0)
+        if (r < 0) {
+            backend_failed(backend->backend);
             return HTTP_UNAVAILABLE;
+        }
         if (r != (ssize_t)sizeof(record))
             return HTTP_INTERNAL_ERROR;
 
@@ -822,7 +1195,7 @@ fastcgi_handle_request(struct lwan_request *request,
 
         switch (record.type) {
         case FASTCGI_TYPE_STDOUT:
-            if (!handle_stdout(request, &record, fcgi_fd))
+            if (!handle_stdout(request, &record, fcgi_fd, pipe_fds))
                 return HTTP_INTERNAL_ERROR;
 
             /* Fallthrough */
@@ -848,8 +1221,14 @@ fastcgi_handle_request(struct lwan_request *request,
                     return status;
             }
 
-            if (record.type == FASTCGI_TYPE_END_REQUEST)
+            if (record.type == FASTCGI_TYPE_END_REQUEST) {
+                /* Nothing else will be sent by the server for this
+                 * request, so the connection can be reused once the
+                 * body of this record has been consumed. */
+                backend->reusable = skip_record(request, &record, fcgi_fd);
+                backend_succeeded(backend->backend, backend->start_us);
                 return HTTP_OK;
+            }
 
             break;
 
@@ -868,154 +1247,245 @@ fastcgi_handle_request(struct lwan_request *request,
     __builtin_unreachable();
 }
 
-static void *fastcgi_create(const char *prefix __attribute__((unused)),
-                            void *user_settings)
+static enum lwan_http_status
+traced_fastcgi_request(struct private_data *pd,
+                       struct lwan_request *request,
+                       struct lwan_response *response,
+                       struct backend_connection *backend)
 {
-    struct lwan_fastcgi_settings *settings = user_settings;
-    struct private_data *pd;
-
-    if (!settings->address) {
-        lwan_status_error("FastCGI: `address` not specified");
-        return NULL;
-    }
-    if (!settings->script_path) {
-        lwan_status_error("FastCGI: `script_path` not specified");
-        return NULL;
-    }
-
-    if (!settings->default_index)
-        settings->default_index = "index.php";
+    struct lwan_trace_span span;
+    enum lwan_http_status status;
 
-    pd = malloc(sizeof(*pd));
-    if (!pd) {
-        lwan_status_perror("FastCGI: Could not allocate memory for module");
-        return NULL;
-    }
+    if (LIKELY(request->helper->trace == NULL))
+        return fastcgi_request(pd, request, response, backend);
 
-    pd->script_name_cache =
-        cache_create(create_script_name, destroy_script_name, pd, 60);
-    if (!pd->script_name_cache) {
-        lwan_status_error("FastCGI: could not create cache for script_name");
-        goto free_pd;
-    }
+    lwan_tracing_span_begin(request, &span);
+    status = fastcgi_request(pd, request, response, backend);
+    lwan_tracing_span_end(request, &span, LWAN_SPAN_FASTCGI,
+                          backend->backend->address, status);
 
-    pd->default_index = (struct lwan_value){
-        .value = strdup(settings->default_index),
-        .len = strlen(settings->default_index),
-    };
-    if (!pd->default_index.value) {
-        lwan_status_error("FastCGI: could not copy default_address for module");
-        goto destroy_cache;
-    }
+    return status;
+}
 
-    pd->script_path = realpath(settings->script_path, NULL);
-    if (!pd->script_path) {
-        lwan_status_perror("FastCGI: `script_path` of '%s' is invalid",
-                           settings->script_path);
-        goto free_default_index;
+static enum lwan_http_status
+fastcgi_handle_request(struct lwan_request *request,
+                       struct lwan_response *response,
+                       void *instance)
+{
+    struct private_data *pd = instance;
+    struct connection_pool *pools = get_connection_pools(pd, request);
+    const size_t first = pick_backend(pd);
+
+    /* Only failures to connect move on to the next backend, as nothing
+     * has been sent to it yet. */
+    for (size_t i = 0; i < pd->n_backends; i++) {
+        const size_t index = (first + i) % pd->n_backends;
+        struct backend_connection *conn =
+            connect_to_backend(request, pd, pools, index);
+
+        if (conn)
+            return traced_fastcgi_request(pd, request, response, conn);
     }
 
-    pd->script_path_fd = open(pd->script_path, O_PATH | O_DIRECTORY | O_CLOEXEC);
-    if (pd->script_path_fd < 0) {
-        lwan_status_perror("FastCGI: Could not open `script_path` at '%s'",
-                           pd->script_path);
-        goto free_script_path;
-    }
+    return HTTP_UNAVAILABLE;
+}
 
-    if (*settings->address == '/') {
+static bool parse_backend(struct backend *backend, const char *address)
+{
+    if (*address == '/') {
         struct stat st;
 
-        if (stat(settings->address, &st) < 0) {
-            lwan_status_perror("FastCGI: `address` not found: %s",
-                               settings->address);
-            goto close_script_path_fd;
+        if (stat(address, &st) < 0) {
+            lwan_status_perror("FastCGI: `address` not found: %s", address);
+            return false;
         }
 
-        if (!(st.st_mode & S_IFSOCK)) {
+        if (!S_ISSOCK(st.st_mode)) {
             lwan_status_error("FastCGI: `address` is not a socket: %s",
-                              settings->address);
-            goto close_script_path_fd;
+                              address);
+            return false;
         }
 
-        if (strlen(settings->address) >= sizeof(pd->un_addr.sun_path)) {
+        if (strlen(address) >= sizeof(backend->un_addr.sun_path)) {
             lwan_status_error(
                 "FastCGI: `address` is too long for a sockaddr_un: %s",
-                settings->address);
-            goto close_script_path_fd;
+                address);
+            return false;
         }
 
-        pd->addr_family = AF_UNIX;
-        pd->un_addr = (struct sockaddr_un){.sun_family = AF_UNIX};
-        pd->addr_size = sizeof(pd->un_addr);
-        memcpy(pd->un_addr.sun_path, settings->address,
-               strlen(settings->address) + 1);
-        return pd;
+        backend->addr_family = AF_UNIX;
+        backend->un_addr = (struct sockaddr_un){.sun_family = AF_UNIX};
+        backend->addr_size = sizeof(backend->un_addr);
+        memcpy(backend->un_addr.sun_path, address, strlen(address) + 1);
+        return true;
     }
 
-    char *node, *port, *address_copy;
+    char *address_copy = strdupa(address);
+    char *node, *port;
 
-    address_copy = strdup(settings->address);
-    if (!address_copy)
-        goto free_address_copy;
-
-    pd->addr_family = lwan_socket_parse_address(address_copy, &node, &port);
+    backend->addr_family = lwan_socket_parse_address(address_copy, &node, &port);
 
     int int_port = parse_int(port, -1);
     if (int_port < 0 || int_port > 0xffff) {
         lwan_status_error("FastCGI: Port %d is not in valid range [0-65535]",
                           int_port);
-        goto free_address_copy;
+        return false;
     }
 
-    switch (pd->addr_family) {
+    switch (backend->addr_family) {
     case AF_MAX:
         lwan_status_error("FastCGI: Could not parse '%s' as 'address:port'",
-                          settings->address);
-        goto free_address_copy;
+                          address);
+        return false;
 
     case AF_INET: {
         struct in_addr in_addr;
 
-        if (inet_pton(AF_INET, node, &in_addr) < 0) {
-            lwan_status_perror("FastCGI: Could not parse IPv4 address '%s'",
-                               node);
-            goto free_address_copy;
+        if (inet_pton(AF_INET, node, &in_addr) <= 0) {
+            lwan_status_error("FastCGI: Could not parse IPv4 address '%s'",
+                              node);
+            return false;
         }
 
-        pd->in_addr =
+        backend->in_addr =
             (struct sockaddr_in){.sin_family = AF_INET,
                                  .sin_addr = in_addr,
                                  .sin_port = htons((uint16_t)int_port)};
-        pd->addr_size = sizeof(in_addr);
-        free(address_copy);
-        return pd;
+        backend->addr_size = sizeof(backend->in_addr);
+        return true;
     }
 
     case AF_INET6: {
         struct in6_addr in6_addr;
 
-        if (inet_pton(AF_INET6, node, &in6_addr) < 0) {
-            lwan_status_perror("FastCGI: Could not parse IPv6 address '%s'",
-                               node);
-            goto free_address_copy;
+        if (inet_pton(AF_INET6, node, &in6_addr) <= 0) {
+            lwan_status_error("FastCGI: Could not parse IPv6 address '%s'",
+                              node);
+            return false;
         }
 
-        pd->in6_addr =
+        backend->in6_addr =
             (struct sockaddr_in6){.sin6_family = AF_INET6,
                                   .sin6_addr = in6_addr,
                                   .sin6_port = htons((uint16_t)int_port)};
-        pd->addr_size = sizeof(in6_addr);
-        free(address_copy);
-        return pd;
+        backend->addr_size = sizeof(backend->in6_addr);
+        return true;
     }
     }
 
     lwan_status_error("FastCGI: Address '%s' isn't a valid Unix Domain Socket, IPv4, or IPv6 address",
-                      settings->address);
+                      address);
+    return false;
+}
 
-free_address_copy:
-    free(address_copy);
-close_script_path_fd:
+static bool parse_backends(struct private_data *pd, const char *addresses)
+{
+    char *copy = strdupa(addresses), *saveptr;
+
+    for (char *address = strtok_r(copy, " ,", &saveptr); address;
+         address = strtok_r(NULL, " ,", &saveptr)) {
+        struct backend *new_backends = reallocarray(
+            pd->backends, pd->n_backends + 1, sizeof(*pd->backends));
+        if (!new_backends)
+            return false;
+        pd->backends = new_backends;
+
+        struct backend *backend = &pd->backends[pd->n_backends];
+        *backend = (struct backend){};
+        if (!parse_backend(backend, address))
+            return false;
+
+        backend->address = strdup(address);
+        if (!backend->address)
+            return false;
+
+        pd->n_backends++;
+    }
+
+    if (!pd->n_backends) {
+        lwan_status_error("FastCGI: `address` is empty");
+        return false;
+    }
+
+    return true;
+}
+
+static void free_backends(struct private_data *pd)
+{
+    for (size_t i = 0; i < pd->n_backends; i++)
+        free(pd->backends[i].address);
+    free(pd->backends);
+}
+
+static void *fastcgi_create(const char *prefix, void *user_settings)
+{
+    struct lwan_fastcgi_settings *settings = user_settings;
+    struct private_data *pd;
+
+    if (!settings->address) {
+        lwan_status_error("FastCGI: `address` not specified");
+        return NULL;
+    }
+    if (!settings->script_path) {
+        lwan_status_error("FastCGI: `script_path` not specified");
+        return NULL;
+    }
+
+    if (!settings->default_index)
+        settings->default_index = "index.php";
+
+    pd = calloc(1, sizeof(*pd));
+    if (!pd) {
+        lwan_status_perror("FastCGI: Could not allocate memory for module");
+        return NULL;
+    }
+
+    pd->script_name_cache =
+        cache_create(create_script_name, destroy_script_name, pd, 60);
+    if (!pd->script_name_cache) {
+        lwan_status_error("FastCGI: could not create cache for script_name");
+        goto free_pd;
+    }
+    cache_set_name(pd->script_name_cache, "fastcgi %s", settings->address);
+
+    pd->default_index = (struct lwan_value){
+        .value = strdup(settings->default_index),
+        .len = strlen(settings->default_index),
+    };
+    if (!pd->default_index.value) {
+        lwan_status_error("FastCGI: could not copy default_address for module");
+        goto destroy_cache;
+    }
+
+    pd->script_path = realpath(settings->script_path, NULL);
+    if (!pd->script_path) {
+        lwan_status_perror("FastCGI: `script_path` of '%s' is invalid",
+                           settings->script_path);
+        goto free_default_index;
+    }
+
+    pd->script_path_fd = open(pd->script_path, O_PATH | O_DIRECTORY | O_CLOEXEC);
+    if (pd->script_path_fd < 0) {
+        lwan_status_perror("FastCGI: Could not open `script_path` at '%s'",
+                           pd->script_path);
+        goto free_script_path;
+    }
+
+    if (!parse_backends(pd, settings->address))
+        goto free_backends;
+
+    pd->prefix = strdup(prefix ? prefix : "");
+    if (!pd->prefix)
+        goto free_backends;
+
+    pthread_mutex_lock(&instances.lock);
+    list_add_tail(&instances.list, &pd->instances);
+    pthread_mutex_unlock(&instances.lock);
+
+    return pd;
+
+free_backends:
+    free_backends(pd);
     close(pd->script_path_fd);
 free_script_path:
     free(pd->script_path);
@@ -1032,6 +1502,13 @@ static void fastcgi_destroy(void *instance)
 {
     struct private_data *pd = instance;
 
+    pthread_mutex_lock(&instances.lock);
+    list_del(&pd->instances);
+    pthread_mutex_unlock(&instances.lock);
+
+    close_connection_pools(pd->pools);
+    free_backends(pd);
+    free(pd->prefix);
     cache_destroy(pd->script_name_cache);
     free(pd->default_index.value);
     close(pd->script_path_fd);
@@ -34,6 +34,25 @@ struct lwan_fastcgi_settings {
 
 LWAN_MODULE_FORWARD_DECL(fastcgi);
 
+struct lwan_fastcgi_backend_stats {
+    /* Prefix of the URL map using the backend */
+    const char *url_map;
+    const char *address;
+
+    uint64_t requests;
+    uint64_t failures;
+    /* Sum of the time taken by each request that was fully answered, from
+     * connecting to the backend until the end of its response */
+    uint64_t latency_us;
+    uint64_t requests_in_flight;
+    /* Whether it's not being picked because of recent failures */
+    uint64_t backing_off;
+};
+
+void lwan_fastcgi_foreach_backend_stats(
+    void (*cb)(const struct lwan_fastcgi_backend_stats *stats, void *data),
+    void *data);
+
 #define FASTCGI(socket_path_, script_path_, default_index_)                    \
     .module = LWAN_MODULE_REF(fastcgi),                                        \
     .args = ((struct lwan_fastcgi_settings[]){{                                \
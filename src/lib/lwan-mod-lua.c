@@ -25,6 +25,7 @@
 #include <pthread.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
 #include "lwan-private.h"
 
@@ -40,6 +41,16 @@ struct lwan_lua_priv {
     char *script;
     pthread_key_t cache_key;
     unsigned cache_period;
+    bool never_expire;
+
+    /* The script is compiled only once; states are created from this */
+    struct lwan_strbuf bytecode;
+
+    /* States created on startup, handed to worker threads as they need
+     * them, so the first requests don't have to wait for one to load. */
+    pthread_mutex_t warm_states_lock;
+    lua_State **warm_states;
+    unsigned int n_warm_states;
 };
 
 struct lwan_lua_state {
@@ -47,6 +58,18 @@ struct lwan_lua_state {
     lua_State *L;
 };
 
+static lua_State *take_or_create_state(struct lwan_lua_priv *priv)
+{
+    lua_State *L = NULL;
+
+    pthread_mutex_lock(&priv->warm_states_lock);
+    if (priv->n_warm_states)
+        L = priv->warm_states[--priv->n_warm_states];
+    pthread_mutex_unlock(&priv->warm_states_lock);
+
+    return L ? L : lwan_lua_create_state_from_bytecode(&priv->bytecode);
+}
+
 static struct cache_entry *state_create(const void *key __attribute__((unused)),
                                         void *cache_ctx,
                                         void *create_ctx __attribute__((unused)))
@@ -57,7 +80,7 @@ static struct cache_entry *state_create(const void *key __attribute__((unused)),
     if (UNLIKELY(!state))
         return NULL;
 
-    state->L = lwan_lua_create_state(priv->script_file, priv->script);
+    state->L = take_or_create_state(priv);
     if (LIKELY(state->L))
         return (struct cache_entry *)state;
 
@@ -84,6 +107,8 @@ static struct cache *get_or_create_cache(struct lwan_lua_priv *priv)
             cache_create(state_create, state_destroy, priv, priv->cache_period);
         if (UNLIKELY(!cache))
             lwan_status_error("Could not create cache");
+        else
+            cache_set_name(cache, "lua");
         /* FIXME: This cache instance leaks: store it somewhere and
          * free it on module shutdown */
         pthread_setspecific(priv->cache_key, cache);
@@ -92,6 +117,44 @@ static struct cache *get_or_create_cache(struct lwan_lua_priv *priv)
     return cache;
 }
 
+static void close_thread_state(void *data)
+{
+    lua_close((lua_State *)data);
+}
+
+/* States that never expire are kept per thread as long as it lives, instead
+ * of going through a cache. */
+static lua_State *get_thread_state(struct lwan_lua_priv *priv)
+{
+    lua_State *L = pthread_getspecific(priv->cache_key);
+
+    if (UNLIKELY(!L)) {
+        L = take_or_create_state(priv);
+        if (UNLIKELY(!L))
+            return NULL;
+
+        pthread_setspecific(priv->cache_key, L);
+    }
+
+    return L;
+}
+
+static lua_State *get_state(struct lwan_lua_priv *priv,
+                            struct lwan_request *request)
+{
+    if (priv->never_expire)
+        return get_thread_state(priv);
+
+    struct cache *cache = get_or_create_cache(priv);
+    if (UNLIKELY(!cache))
+        return NULL;
+
+    struct lwan_lua_state *state =
+        (struct lwan_lua_state *)cache_coro_get_and_ref_entry(
+            cache, request->conn->coro, "");
+    return LIKELY(state) ? state->L : NULL;
+}
+
 static void unref_thread(void *data1, void *data2)
 {
     lua_State *L = data1;
@@ -185,17 +248,11 @@ static enum lwan_http_status lua_handle_request(struct lwan_request *request,
 {
     struct lwan_lua_priv *priv = instance;
 
-    struct cache *cache = get_or_create_cache(priv);
-    if (UNLIKELY(!cache))
-        return HTTP_INTERNAL_ERROR;
-
-    struct lwan_lua_state *state =
-        (struct lwan_lua_state *)cache_coro_get_and_ref_entry(
-            cache, request->conn->coro, "");
+    lua_State *state = get_state(priv, request);
     if (UNLIKELY(!state))
         return HTTP_NOT_FOUND;
 
-    lua_State *L = push_newthread(state->L, request->conn->coro);
+    lua_State *L = push_newthread(state, request->conn->coro);
     if (UNLIKELY(!L))
         return HTTP_INTERNAL_ERROR;
 
@@ -209,6 +266,7 @@ static enum lwan_http_status lua_handle_request(struct lwan_request *request,
         switch (lua_resume(L, n_arguments)) {
         case LUA_YIELD:
             coro_yield(request->conn->coro, CONN_CORO_YIELD);
+            lwan_response_flush_due_chunks(request);
             n_arguments = 0;
             break;
         case 0:
@@ -230,6 +288,31 @@ static enum lwan_http_status lua_handle_request(struct lwan_request *request,
     }
 }
 
+static void warm_states(struct lwan_lua_priv *priv, unsigned int n_states)
+{
+    if (!n_states) {
+        /* One for each worker thread, assuming their default number */
+        long n_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        n_states = n_cpus > 1 ? (unsigned int)n_cpus : 2;
+    }
+
+    priv->warm_states = calloc(n_states, sizeof(*priv->warm_states));
+    if (UNLIKELY(!priv->warm_states)) {
+        lwan_status_warning("Could not allocate pool of Lua states");
+        return;
+    }
+
+    for (; priv->n_warm_states < n_states; priv->n_warm_states++) {
+        lua_State *L = lwan_lua_create_state_from_bytecode(&priv->bytecode);
+        if (UNLIKELY(!L))
+            break;
+
+        priv->warm_states[priv->n_warm_states] = L;
+    }
+
+    lwan_status_debug("Preloaded %u Lua states", priv->n_warm_states);
+}
+
 static void *lua_create(const char *prefix __attribute__((unused)), void *data)
 {
     struct lwan_lua_settings *settings = data;
@@ -265,15 +348,28 @@ static void *lua_create(const char *prefix __attribute__((unused)), void *data)
         goto error;
     }
 
-    if (pthread_key_create(&priv->cache_key, NULL)) {
-        lwan_status_perror("pthread_key_create");
+    priv->cache_period = settings->cache_period;
+    priv->never_expire = settings->never_expire;
+
+    if (!lwan_strbuf_init(&priv->bytecode))
         goto error;
+    if (!lwan_lua_compile_script(priv->script_file, priv->script,
+                                 &priv->bytecode))
+        goto error_free_bytecode;
+
+    if (pthread_key_create(&priv->cache_key,
+                           priv->never_expire ? close_thread_state : NULL)) {
+        lwan_status_perror("pthread_key_create");
+        goto error_free_bytecode;
     }
 
-    priv->cache_period = settings->cache_period;
+    pthread_mutex_init(&priv->warm_states_lock, NULL);
+    warm_states(priv, settings->preload_states);
 
     return priv;
 
+error_free_bytecode:
+    lwan_strbuf_free(&priv->bytecode);
 error:
     free(priv->script_file);
     free(priv->default_type);
@@ -289,6 +385,13 @@ static void lua_destroy(void *instance)
 
     if (priv) {
         pthread_key_delete(priv->cache_key);
+
+        for (unsigned int i = 0; i < priv->n_warm_states; i++)
+            lua_close(priv->warm_states[i]);
+        free(priv->warm_states);
+        pthread_mutex_destroy(&priv->warm_states_lock);
+        lwan_strbuf_free(&priv->bytecode);
+
         free(priv->default_type);
         free(priv->script_file);
         free(priv->script);
@@ -302,6 +405,9 @@ static void *lua_create_from_hash(const char *prefix, const struct hash *hash)
         .default_type = hash_find(hash, "default_type"),
         .script_file = hash_find(hash, "script_file"),
         .cache_period = parse_time_period(hash_find(hash, "cache_period"), 15),
+        .never_expire = parse_bool(hash_find(hash, "never_expire"), false),
+        .preload_states =
+            (unsigned int)LWAN_MAX(parse_int(hash_find(hash, "preload_states"), 0), 0),
         .script = hash_find(hash, "script")
     };
 
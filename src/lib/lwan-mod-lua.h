@@ -26,6 +26,11 @@ struct lwan_lua_settings {
     const char *script_file;
     const char *script;
     unsigned int cache_period;
+    /* Keep one state per thread for as long as it runs, ignoring
+     * cache_period. */
+    bool never_expire;
+    /* States loaded on startup; 0 loads one per online CPU. */
+    unsigned int preload_states;
 };
 
 LWAN_MODULE_FORWARD_DECL(lua);
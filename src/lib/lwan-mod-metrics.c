@@ -0,0 +1,473 @@
+/*
+ * lwan - web server
+ * Copyright (c) 2024 L. A. F. Pereira <l@tia.mat.br>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301,
+ * USA.
+ */
+
+#include <inttypes.h>
+#include <stddef.h>
+#include <stdlib.h>
+
+#include "lwan-private.h"
+#include "int-to-str.h"
+#include "lwan-cache.h"
+#include "lwan-mod-fastcgi.h"
+#include "lwan-mod-metrics.h"
+
+static const struct metric {
+    const char *name;
+    const char *type;
+    const char *help;
+    size_t offset;
+} metrics[] = {
+#define METRIC(name_, type_, field_, help_)                                    \
+    {                                                                          \
+        .name = "lwan_thread_" name_, .type = type_, .help = help_,            \
+        .offset = offsetof(struct lwan_thread_stats, field_),                  \
+    }
+    METRIC("accepted_connections_total", "counter", accepted,
+           "Connections accepted by the thread"),
+    METRIC("accept_wakeups_total", "counter", accept_wakeups,
+           "Times the thread woke up to accept connections"),
+    METRIC("requests_total", "counter", requests,
+           "Requests processed by the thread"),
+    METRIC("sent_bytes_total", "counter", bytes_sent,
+           "Bytes sent to clients by the thread"),
+    METRIC("writes_total", "counter", writes,
+           "System calls that sent data to clients"),
+    METRIC("pushes_total", "counter", pushes,
+           "Writes that let the kernel send everything pending to a client "
+           "right away; ideally one per response"),
+    METRIC("websocket_pongs_total", "counter", ws_pongs,
+           "Websocket keep-alive pings answered by clients"),
+    METRIC("websocket_pong_rtt_microseconds_total", "counter", ws_pong_rtt_us,
+           "Sum of the round-trip times of answered websocket keep-alive "
+           "pings"),
+    METRIC("wakeups_total", "counter", wakeups,
+           "Times the thread woke up to process events"),
+    METRIC("events_total", "counter", events,
+           "Events processed by the thread"),
+    METRIC("coroutines", "gauge", coros,
+           "Live coroutines, and entries in the keep-alive timeout queue"),
+    METRIC("cached_coroutines", "gauge", coros_cached,
+           "Coroutines of closed connections kept for reuse"),
+    METRIC("arena_high_water_bytes", "gauge", arena_high_water,
+           "Most coroutine arena memory used by a single request"),
+    METRIC("migrated_connections_total", "counter", migrated,
+           "Idle keep-alive connections handed over to less busy threads"),
+    METRIC("shed_connections_total", "counter", shed,
+           "New connections turned away because their thread was overloaded"),
+    METRIC("cancelled_requests_total", "counter", cancelled,
+           "Requests cancelled because their URL map deadline had passed"),
+    METRIC("overloaded", "gauge", overloaded,
+           "Whether the thread is turning new connections away"),
+#undef METRIC
+};
+
+static const struct metric cache_metrics[] = {
+#define METRIC(name_, type_, field_, help_)                                    \
+    {                                                                          \
+        .name = "lwan_cache_" name_, .type = type_, .help = help_,             \
+        .offset = offsetof(struct cache_stats, field_),                        \
+    }
+    METRIC("hits_total", "counter", hits, "Lookups that found an entry"),
+    METRIC("misses_total", "counter", misses,
+           "Lookups that had to create an entry"),
+    METRIC("coalesced_total", "counter", coalesced,
+           "Lookups that waited for another lookup to create the entry"),
+    METRIC("evictions_total", "counter", evicted,
+           "Entries evicted because they expired or the cache was full"),
+    METRIC("entries", "gauge", entries, "Entries currently in the cache"),
+    METRIC("cost", "gauge", cost,
+           "Sum of the cost of all entries currently in the cache"),
+    METRIC("max_cost", "gauge", max_cost,
+           "Budget for the cost of entries in the cache, or 0 if unbounded"),
+    METRIC("pruner_runs_total", "counter", pruner_runs,
+           "Times the pruner went through the cache"),
+    METRIC("pruner_last_duration_microseconds", "gauge",
+           pruner_last_duration_us, "Duration of the last pruner run"),
+    METRIC("pruner_max_duration_microseconds", "gauge", pruner_max_duration_us,
+           "Duration of the slowest pruner run"),
+#undef METRIC
+};
+
+static const struct metric job_metrics[] = {
+#define METRIC(name_, type_, field_, help_)                                    \
+    {                                                                          \
+        .name = "lwan_job_" name_, .type = type_, .help = help_,               \
+        .offset = offsetof(struct lwan_job_stats, field_),                     \
+    }
+    METRIC("runs_total", "counter", runs, "Times the job has been run"),
+    METRIC("productive_runs_total", "counter", productive_runs,
+           "Times the job has been run and had work to do"),
+    METRIC("latency_microseconds_total", "counter", latency_total_us,
+           "Sum of the delays between the job deadlines and its runs"),
+    METRIC("latency_max_microseconds", "gauge", latency_max_us,
+           "Longest delay between a job deadline and its run"),
+    METRIC("duration_microseconds_total", "counter", duration_total_us,
+           "Sum of the duration of all runs of the job"),
+    METRIC("duration_max_microseconds", "gauge", duration_max_us,
+           "Duration of the slowest run of the job"),
+#undef METRIC
+};
+
+static const struct metric fastcgi_metrics[] = {
+#define METRIC(name_, type_, field_, help_)                                    \
+    {                                                                          \
+        .name = "lwan_fastcgi_backend_" name_, .type = type_, .help = help_,   \
+        .offset = offsetof(struct lwan_fastcgi_backend_stats, field_),         \
+    }
+    METRIC("requests_total", "counter", requests,
+           "Requests fully answered by the backend"),
+    METRIC("failures_total", "counter", failures,
+           "Requests the backend couldn't be connected to, or didn't answer"),
+    METRIC("latency_microseconds_total", "counter", latency_us,
+           "Sum of the time taken by the backend to answer requests"),
+    METRIC("requests_in_flight", "gauge", requests_in_flight,
+           "Requests currently being handled by the backend"),
+    METRIC("backing_off", "gauge", backing_off,
+           "Whether the backend isn't being picked after failing"),
+#undef METRIC
+};
+
+static const struct metric latency_metric = {
+    .name = "lwan_request_duration_microseconds",
+    .type = "summary",
+    .help = "Time taken to handle requests, per URL map, from when they're "
+            "read until the response has been sent",
+};
+
+static const struct metric url_map_usage_metrics[] = {
+#define METRIC(name_, field_, help_)                                           \
+    {                                                                          \
+        .name = "lwan_url_map_" name_, .type = "counter", .help = help_,       \
+        .offset = offsetof(struct lwan_latency_summary, usage.field_),         \
+    }
+    METRIC("cycles_total", cycles,
+           "CPU cycles spent running coroutines while handling requests "
+           "(TSC ticks on x86, virtual counter ticks on ARM)"),
+    METRIC("yields_total", yields,
+           "Times coroutines yielded, e.g. to wait for I/O, while handling "
+           "requests"),
+    METRIC("arena_allocations_total", arena_allocs,
+           "Allocations made from the coroutine arena while handling "
+           "requests"),
+    METRIC("arena_allocated_bytes_total", arena_bytes,
+           "Bytes allocated from the coroutine arena while handling "
+           "requests"),
+    METRIC("heap_allocations_total", heap_allocs,
+           "Coroutine allocations that went through malloc() while handling "
+           "requests, e.g. because they were too large for the arena"),
+    METRIC("heap_allocated_bytes_total", heap_bytes,
+           "Bytes of coroutine allocations that went through malloc() while "
+           "handling requests"),
+#undef METRIC
+};
+
+/* In the same order as lwan_latency_thread_summaries() fills them */
+static const struct metric thread_latency_metrics[] = {
+    {
+        .name = "lwan_thread_scheduling_delay_nanoseconds",
+        .type = "summary",
+        .help = "Time between a connection becoming ready and its coroutine "
+                "being resumed by the thread",
+    },
+    {
+        .name = "lwan_thread_resume_duration_nanoseconds",
+        .type = "summary",
+        .help = "Time coroutines ran for each time they were resumed by the "
+                "thread",
+    },
+};
+
+struct labeled_metric_ctx {
+    struct lwan_strbuf *buffer;
+    const struct metric *metric;
+};
+
+static void append_label_value(struct lwan_strbuf *buffer, const char *value)
+{
+    for (; *value; value++) {
+        switch (*value) {
+        case '\\':
+            lwan_strbuf_append_str(buffer, "\\\\", 2);
+            break;
+        case '"':
+            lwan_strbuf_append_str(buffer, "\\\"", 2);
+            break;
+        case '\n':
+            lwan_strbuf_append_str(buffer, "\\n", 2);
+            break;
+        default:
+            lwan_strbuf_append_char(buffer, *value);
+        }
+    }
+}
+
+static void append_cache_metric(const struct cache_stats *stats, void *data)
+{
+    const struct labeled_metric_ctx *ctx = data;
+    uint64_t value =
+        *(const uint64_t *)((const char *)stats + ctx->metric->offset);
+
+    lwan_strbuf_append_printf(ctx->buffer, "%s{cache=\"", ctx->metric->name);
+    append_label_value(ctx->buffer, stats->name);
+    lwan_strbuf_append_printf(ctx->buffer, "\",id=\"%u\"} %" PRIu64 "\n",
+                              stats->id, value);
+}
+
+static void append_job_metric(const struct lwan_job_stats *stats, void *data)
+{
+    const struct labeled_metric_ctx *ctx = data;
+    uint64_t value =
+        *(const uint64_t *)((const char *)stats + ctx->metric->offset);
+
+    lwan_strbuf_append_printf(ctx->buffer, "%s{job=\"", ctx->metric->name);
+    append_label_value(ctx->buffer, stats->name);
+    lwan_strbuf_append_printf(ctx->buffer, "\",id=\"%u\"} %" PRIu64 "\n",
+                              stats->id, value);
+}
+
+static void append_fastcgi_metric(const struct lwan_fastcgi_backend_stats *stats,
+                                  void *data)
+{
+    const struct labeled_metric_ctx *ctx = data;
+    uint64_t value =
+        *(const uint64_t *)((const char *)stats + ctx->metric->offset);
+
+    lwan_strbuf_append_printf(ctx->buffer, "%s{url_map=\"", ctx->metric->name);
+    append_label_value(ctx->buffer, stats->url_map);
+    lwan_strbuf_append_str(ctx->buffer, "\",backend=\"", 11);
+    append_label_value(ctx->buffer, stats->address);
+    lwan_strbuf_append_printf(ctx->buffer, "\"} %" PRIu64 "\n", value);
+}
+
+static void append_metric_header(struct lwan_strbuf *buffer,
+                                 const struct metric *metric)
+{
+    lwan_strbuf_append_printf(buffer, "# HELP %s %s.\n# TYPE %s %s\n",
+                              metric->name, metric->help, metric->name,
+                              metric->type);
+}
+
+static void append_summary(struct lwan_strbuf *buffer,
+                           const char *name,
+                           const char *label,
+                           const char *label_value,
+                           const struct lwan_latency_summary *summary)
+{
+    static const struct {
+        const char *name;
+        size_t offset;
+    } quantiles[] = {
+        {"0.5", offsetof(struct lwan_latency_summary, p50)},
+        {"0.9", offsetof(struct lwan_latency_summary, p90)},
+        {"0.99", offsetof(struct lwan_latency_summary, p99)},
+        {"0.999", offsetof(struct lwan_latency_summary, p999)},
+    };
+
+    for (size_t i = 0; i < N_ELEMENTS(quantiles); i++) {
+        uint64_t value = *(const uint64_t *)((const char *)summary +
+                                             quantiles[i].offset);
+
+        lwan_strbuf_append_printf(buffer, "%s{%s=\"", name, label);
+        append_label_value(buffer, label_value);
+        if (summary->count) {
+            lwan_strbuf_append_printf(buffer,
+                                      "\",quantile=\"%s\"} %" PRIu64 "\n",
+                                      quantiles[i].name, value);
+        } else {
+            /* Quantiles of an empty summary are undefined */
+            lwan_strbuf_append_printf(buffer, "\",quantile=\"%s\"} NaN\n",
+                                      quantiles[i].name);
+        }
+    }
+
+    lwan_strbuf_append_printf(buffer, "%s_sum{%s=\"", name, label);
+    append_label_value(buffer, label_value);
+    lwan_strbuf_append_printf(buffer, "\"} %" PRIu64 "\n", summary->sum);
+
+    lwan_strbuf_append_printf(buffer, "%s_count{%s=\"", name, label);
+    append_label_value(buffer, label_value);
+    lwan_strbuf_append_printf(buffer, "\"} %" PRIu64 "\n", summary->count);
+}
+
+struct url_map_summaries {
+    struct lwan_strbuf *buffer;
+    struct lwan_latency_summary *summaries;
+    size_t count;
+};
+
+static void append_url_map_latency(const struct lwan_latency_summary *summary,
+                                   void *data)
+{
+    struct url_map_summaries *ctx = data;
+
+    append_summary(ctx->buffer, latency_metric.name, "url_map",
+                   summary->prefix, summary);
+
+    /* Kept for the usage metrics, so histograms are only merged once */
+    if (ctx->summaries && ctx->count < LWAN_LATENCY_MAX_URL_MAPS)
+        ctx->summaries[ctx->count++] = *summary;
+}
+
+static void append_url_map_metrics(struct lwan_strbuf *buffer,
+                                   const struct lwan *l)
+{
+    struct url_map_summaries ctx = {
+        .buffer = buffer,
+        .summaries = calloc(LWAN_LATENCY_MAX_URL_MAPS, sizeof(*ctx.summaries)),
+    };
+
+    append_metric_header(buffer, &latency_metric);
+    lwan_latency_foreach_summary(l, append_url_map_latency, &ctx);
+
+    for (size_t i = 0; i < N_ELEMENTS(url_map_usage_metrics); i++) {
+        const struct metric *metric = &url_map_usage_metrics[i];
+
+        append_metric_header(buffer, metric);
+
+        for (size_t s = 0; s < ctx.count; s++) {
+            uint64_t value = *(const uint64_t *)((const char *)&ctx.summaries[s] +
+                                                 metric->offset);
+
+            lwan_strbuf_append_printf(buffer, "%s{url_map=\"", metric->name);
+            append_label_value(buffer, ctx.summaries[s].prefix);
+            lwan_strbuf_append_printf(buffer, "\"} %" PRIu64 "\n", value);
+        }
+    }
+
+    free(ctx.summaries);
+}
+
+static void append_thread_latencies(struct lwan_strbuf *buffer,
+                                    const struct lwan *l)
+{
+    struct lwan_latency_summary *summaries =
+        calloc(2 * (size_t)l->thread.count, sizeof(*summaries));
+
+    if (UNLIKELY(!summaries))
+        return;
+
+    for (unsigned int t = 0; t < l->thread.count; t++) {
+        lwan_latency_thread_summaries(&l->thread.threads[t], &summaries[2 * t],
+                                      &summaries[2 * t + 1]);
+    }
+
+    for (size_t i = 0; i < N_ELEMENTS(thread_latency_metrics); i++) {
+        append_metric_header(buffer, &thread_latency_metrics[i]);
+
+        for (unsigned int t = 0; t < l->thread.count; t++) {
+            char thread[INT_TO_STR_BUFFER_SIZE];
+            size_t len;
+
+            append_summary(buffer, thread_latency_metrics[i].name, "thread",
+                           uint_to_string(t, thread, &len),
+                           &summaries[2 * t + i]);
+        }
+    }
+
+    free(summaries);
+}
+
+static enum lwan_http_status
+metrics_handle_request(struct lwan_request *request,
+                       struct lwan_response *response,
+                       void *instance __attribute__((unused)))
+{
+    const struct lwan *l = request->conn->thread->lwan;
+
+    for (size_t i = 0; i < N_ELEMENTS(metrics); i++) {
+        const struct metric *metric = &metrics[i];
+
+        append_metric_header(response->buffer, metric);
+
+        for (unsigned int t = 0; t < l->thread.count; t++) {
+            const char *stats = (const char *)&l->thread.threads[t].stats;
+            /* Counters are written to by the thread owning them without
+             * any synchronization; a relaxed load is sufficient here. */
+            uint64_t value = __atomic_load_n(
+                (const uint64_t *)(stats + metric->offset), __ATOMIC_RELAXED);
+
+            lwan_strbuf_append_printf(response->buffer,
+                                      "%s{thread=\"%u\"} %" PRIu64 "\n",
+                                      metric->name, t, value);
+        }
+    }
+
+    for (size_t i = 0; i < N_ELEMENTS(cache_metrics); i++) {
+        struct labeled_metric_ctx ctx = {
+            .buffer = response->buffer,
+            .metric = &cache_metrics[i],
+        };
+
+        append_metric_header(response->buffer, ctx.metric);
+        cache_foreach_stats(append_cache_metric, &ctx);
+    }
+
+    for (size_t i = 0; i < N_ELEMENTS(job_metrics); i++) {
+        struct labeled_metric_ctx ctx = {
+            .buffer = response->buffer,
+            .metric = &job_metrics[i],
+        };
+
+        append_metric_header(response->buffer, ctx.metric);
+        lwan_job_foreach_stats(append_job_metric, &ctx);
+    }
+
+    for (size_t i = 0; i < N_ELEMENTS(fastcgi_metrics); i++) {
+        struct labeled_metric_ctx ctx = {
+            .buffer = response->buffer,
+            .metric = &fastcgi_metrics[i],
+        };
+
+        append_metric_header(response->buffer, ctx.metric);
+        lwan_fastcgi_foreach_backend_stats(append_fastcgi_metric, &ctx);
+    }
+
+    append_url_map_metrics(response->buffer, l);
+
+    append_thread_latencies(response->buffer, l);
+
+    response->mime_type = "text/plain; version=0.0.4; charset=utf-8";
+    return HTTP_OK;
+}
+
+static void *metrics_create(const char *prefix __attribute__((unused)),
+                            void *instance __attribute__((unused)))
+{
+    /* Latencies are only measured if there's something to scrape them. */
+    lwan_latency_enable();
+
+    /* There's nothing to configure, but a non-NULL instance is expected. */
+    return (void *)metrics;
+}
+
+static void *metrics_create_from_hash(const char *prefix,
+                                      const struct hash *hash
+                                      __attribute__((unused)))
+{
+    return metrics_create(prefix, NULL);
+}
+
+static const struct lwan_module module = {
+    .create = metrics_create,
+    .create_from_hash = metrics_create_from_hash,
+    .handle_request = metrics_handle_request,
+};
+
+LWAN_REGISTER_MODULE(metrics, &module);
@@ -0,0 +1,1232 @@
+/*
+ * lwan - web server
+ * Copyright (c) 2024 L. A. F. Pereira <l@tia.mat.br>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+/* Reverse HTTP proxy.  Requests are forwarded to one of the configured
+ * upstream servers, chosen either in a round-robin fashion or by the
+ * number of requests in flight, and their responses are streamed back to
+ * the client as they arrive.  Connections to upstreams are kept alive and
+ * reused by requests handled by the same thread; if health checks are
+ * enabled, upstreams that can't be reached are skipped until a health
+ * check, performed periodically by a background job, or a new connection
+ * succeeds again. */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <limits.h>
+#include <netdb.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "lwan-private.h"
+
+#include "lwan-io-wrappers.h"
+#include "lwan-mod-proxy.h"
+#include "lwan-strbuf.h"
+
+#define MAX_IDLE_CONNECTIONS_PER_THREAD 16
+
+/* Response headers must fit in this buffer; it's also the maximum amount
+ * of data read from an upstream at once. */
+#define RESPONSE_BUFFER_SIZE 16384
+
+#define HEALTH_CHECK_TIMEOUT_MS 1000
+
+enum balance {
+    BALANCE_ROUND_ROBIN,
+    BALANCE_LEAST_CONNECTIONS,
+};
+
+struct upstream {
+    union {
+        struct sockaddr_un un_addr;
+        struct sockaddr_in in_addr;
+        struct sockaddr_in6 in6_addr;
+        struct sockaddr_storage sock_addr;
+    };
+    socklen_t addr_size;
+    int addr_family;
+
+    /* As written in the configuration file; used as the Host header in
+     * health checks. */
+    char *address;
+
+    /* Shared between all I/O threads and the health checker, so these are
+     * only accessed with atomic builtins.  */
+    unsigned int requests_in_flight;
+    bool healthy;
+};
+
+struct upstream_pool {
+    int idle_fds[MAX_IDLE_CONNECTIONS_PER_THREAD];
+    unsigned int n_idle;
+};
+
+struct upstream_pools {
+    size_t n_pools;
+    struct upstream_pool pools[];
+};
+
+struct private_data {
+    struct upstream *upstreams;
+    size_t n_upstreams;
+
+    enum balance balance;
+    unsigned int next_upstream;
+
+    char *health_check_path;
+    /* Without health checks, nothing would ever bring an unhealthy
+     * upstream back, so they're only marked as such if these are on. */
+    bool health_checks;
+
+    /* One per (thread, upstream) pair; allocated by the first request */
+    struct upstream_pools *pools;
+};
+
+struct upstream_conn {
+    struct upstream *upstream;
+    struct upstream_pool *pool;
+    struct lwan_thread *thread;
+    int fd;
+    bool pooled;
+    bool reusable;
+    /* Set if this was a pooled connection that the upstream closed before
+     * answering, so the request can be sent again on a new one. */
+    bool retry;
+};
+
+struct upstream_buffer {
+    char *data;
+    size_t len;
+    size_t offset;
+};
+
+enum body_framing {
+    BODY_NONE,
+    BODY_CONTENT_LENGTH,
+    BODY_CHUNKED,
+    BODY_UNTIL_EOF,
+};
+
+DEFINE_ARRAY_TYPE_INLINEFIRST(header_array, struct lwan_key_value)
+
+static struct upstream_pool *get_pools(struct private_data *pd,
+                                       struct lwan_request *request)
+{
+    const struct lwan *lwan = request->conn->thread->lwan;
+    struct upstream_pools *pools =
+        __atomic_load_n(&pd->pools, __ATOMIC_ACQUIRE);
+
+    if (UNLIKELY(!pools)) {
+        const size_t n_pools = lwan->thread.count * pd->n_upstreams;
+        struct upstream_pools *new_pools = calloc(
+            1, sizeof(*new_pools) + n_pools * sizeof(struct upstream_pool));
+
+        if (!new_pools)
+            return NULL;
+
+        new_pools->n_pools = n_pools;
+        if (__atomic_compare_exchange_n(&pd->pools, &pools, new_pools, false,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            pools = new_pools;
+        } else {
+            free(new_pools);
+        }
+    }
+
+    const size_t thread_index =
+        (size_t)(request->conn->thread - lwan->thread.threads);
+    return &pools->pools[thread_index * pd->n_upstreams];
+}
+
+static int take_idle_connection(struct upstream_pool *pool)
+{
+    while (pool && pool->n_idle) {
+        int fd = pool->idle_fds[--pool->n_idle];
+        char byte;
+
+        /* Upstreams close idle connections after a while, so make sure
+         * there's nothing to read (not even EOF) before reusing one.  */
+        if (recv(fd, &byte, 1, MSG_PEEK | MSG_DONTWAIT) < 0 && errno == EAGAIN)
+            return fd;
+
+        close(fd);
+    }
+
+    return -1;
+}
+
+static void release_upstream_conn(void *data)
+{
+    struct upstream_conn *conn = data;
+    struct upstream_pool *pool = conn->pool;
+
+    __atomic_sub_fetch(&conn->upstream->requests_in_flight, 1,
+                       __ATOMIC_RELAXED);
+
+    /* This runs after the defers registered by lwan_request_await_*(),
+     * so the connection isn't borrowed by this coroutine anymore.  */
+    if (conn->reusable && pool &&
+        pool->n_idle < MAX_IDLE_CONNECTIONS_PER_THREAD) {
+        lwan_thread_unwatch_open_fd(conn->thread, conn->fd);
+        pool->idle_fds[pool->n_idle++] = conn->fd;
+        return;
+    }
+
+    close(conn->fd);
+}
+
+static void set_upstream_health(struct upstream *upstream, bool healthy)
+{
+    if (__atomic_exchange_n(&upstream->healthy, healthy, __ATOMIC_RELAXED) ==
+        healthy)
+        return;
+
+    if (healthy)
+        lwan_status_info("Proxy: upstream %s is healthy again",
+                         upstream->address);
+    else
+        lwan_status_warning("Proxy: upstream %s is unhealthy",
+                            upstream->address);
+}
+
+static size_t pick_upstream(struct private_data *pd)
+{
+    const size_t n = pd->n_upstreams;
+    const size_t start =
+        __atomic_fetch_add(&pd->next_upstream, 1, __ATOMIC_RELAXED) % n;
+    unsigned int least_in_flight = UINT_MAX;
+    size_t picked = start;
+
+    for (size_t i = 0; i < n; i++) {
+        const size_t index = (start + i) % n;
+        const struct upstream *upstream = &pd->upstreams[index];
+
+        if (!__atomic_load_n(&upstream->healthy, __ATOMIC_RELAXED))
+            continue;
+
+        if (pd->balance == BALANCE_ROUND_ROBIN)
+            return index;
+
+        /* Starting from the round-robin index spreads ties evenly */
+        const unsigned int in_flight =
+            __atomic_load_n(&upstream->requests_in_flight, __ATOMIC_RELAXED);
+        if (in_flight < least_in_flight) {
+            least_in_flight = in_flight;
+            picked = index;
+        }
+    }
+
+    /* If no upstream is healthy, try them anyway: health checks might lag
+     * behind, and there's nothing better to do.  */
+    return picked;
+}
+
+static struct upstream_conn *connect_to_upstream(struct lwan_request *request,
+                                                 struct private_data *pd,
+                                                 struct upstream_pool *pools,
+                                                 size_t index,
+                                                 bool reuse_idle)
+{
+    struct upstream *upstream = &pd->upstreams[index];
+    struct upstream_pool *pool = pools ? &pools[index] : NULL;
+    struct upstream_conn *conn;
+    int fd;
+
+    fd = reuse_idle ? take_idle_connection(pool) : -1;
+    const bool pooled = fd >= 0;
+    if (!pooled) {
+        fd = socket(upstream->addr_family,
+                    SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (fd < 0)
+            return NULL;
+    }
+
+    conn = coro_malloc(request->conn->coro, sizeof(*conn));
+    if (UNLIKELY(!conn)) {
+        close(fd);
+        return NULL;
+    }
+    *conn = (struct upstream_conn){
+        .upstream = upstream,
+        .pool = pool,
+        .thread = request->conn->thread,
+        .fd = fd,
+        .pooled = pooled,
+    };
+    __atomic_add_fetch(&upstream->requests_in_flight, 1, __ATOMIC_RELAXED);
+    coro_defer(request->conn->coro, release_upstream_conn, conn);
+
+    if (!pooled) {
+        if (!lwan_connect_fd(request, fd,
+                             (struct sockaddr *)&upstream->sock_addr,
+                             upstream->addr_size)) {
+            if (pd->health_checks)
+                set_upstream_health(upstream, false);
+            return NULL;
+        }
+
+        /* Might have been tried while unhealthy; no need to wait for the
+         * next health check if it's reachable again.  */
+        set_upstream_health(upstream, true);
+    }
+
+    return conn;
+}
+
+static bool is_hop_by_hop_header(const char *name, size_t len)
+{
+    /* Content-Length and Expect are also here, as the request body has
+     * already been read by the time the request is forwarded, and the
+     * length is sent by append_request_body_headers(). */
+    static const struct lwan_value headers[] = {
+#define HEADER(name_) {.value = name_, .len = sizeof(name_) - 1}
+        HEADER("Connection"),        HEADER("Keep-Alive"),
+        HEADER("Proxy-Connection"),  HEADER("Proxy-Authorization"),
+        HEADER("TE"),                HEADER("Trailer"),
+        HEADER("Transfer-Encoding"), HEADER("Upgrade"),
+        HEADER("Content-Length"),    HEADER("Expect"),
+#undef HEADER
+    };
+
+    for (size_t i = 0; i < N_ELEMENTS(headers); i++) {
+        if (len == headers[i].len &&
+            strcaseequal_neutral_len(name, headers[i].value, len))
+            return true;
+    }
+
+    return false;
+}
+
+struct request_headers_state {
+    struct lwan_strbuf *strbuf;
+    struct lwan_value forwarded_for;
+    bool has_host;
+    /* Set if this request is being traced, and so gets a traceparent
+     * header of its own */
+    bool replace_traceparent;
+    bool ok;
+};
+
+static void append_request_header(const char *name,
+                                  size_t name_len,
+                                  const char *value,
+                                  size_t value_len,
+                                  void *user_data)
+{
+    struct request_headers_state *state = user_data;
+
+    if (is_hop_by_hop_header(name, name_len))
+        return;
+
+    if (name_len == sizeof("X-Forwarded-For") - 1 &&
+        strcaseequal_neutral_len(name, "X-Forwarded-For", name_len)) {
+        /* Appended to, rather than forwarded as is */
+        state->forwarded_for =
+            (struct lwan_value){.value = (char *)value, .len = value_len};
+        return;
+    }
+
+    if (name_len == sizeof("Host") - 1 &&
+        strcaseequal_neutral_len(name, "Host", name_len))
+        state->has_host = true;
+
+    if (state->replace_traceparent && name_len == sizeof("traceparent") - 1 &&
+        strcaseequal_neutral_len(name, "traceparent", name_len))
+        return;
+
+    state->ok &= lwan_strbuf_append_str(state->strbuf, name, name_len);
+    state->ok &= lwan_strbuf_append_str(state->strbuf, ": ", 2);
+    state->ok &= lwan_strbuf_append_str(state->strbuf, value, value_len);
+    state->ok &= lwan_strbuf_append_str(state->strbuf, "\r\n", 2);
+}
+
+static bool append_encoded_path(struct lwan_strbuf *strbuf,
+                                const struct lwan_value *url)
+{
+    /* The URL has been decoded by the request parser, so encode it
+     * again, leaving alone characters that are valid in a path. */
+    static const char hex_digits[] = "0123456789ABCDEF";
+
+    if (!lwan_strbuf_append_char(strbuf, '/'))
+        return false;
+
+    for (size_t i = 0; i < url->len; i++) {
+        const unsigned char c = (unsigned char)url->value[i];
+
+        if (lwan_char_isalnum((char)c) || strchr("-._~!$&'()*+,;=:@/", c)) {
+            if (!lwan_strbuf_append_char(strbuf, (char)c))
+                return false;
+        } else {
+            const char encoded[] = {'%', hex_digits[c >> 4],
+                                    hex_digits[c & 15]};
+
+            if (!lwan_strbuf_append_str(strbuf, encoded, sizeof(encoded)))
+                return false;
+        }
+    }
+
+    return true;
+}
+
+static bool build_request_head(struct lwan_request *request,
+                               struct lwan_strbuf *strbuf,
+                               const struct upstream *upstream,
+                               const struct lwan_value *body)
+{
+    const struct lwan_value *query_string = &request->helper->query_string;
+    char remote_addr_buf[INET6_ADDRSTRLEN];
+    const char *remote_addr;
+    struct request_headers_state state = {
+        .strbuf = strbuf,
+        .replace_traceparent = request->helper->trace != NULL,
+        .ok = true,
+    };
+
+    if (!lwan_strbuf_append_strz(strbuf, lwan_request_get_method_str(request)))
+        return false;
+    if (!lwan_strbuf_append_char(strbuf, ' '))
+        return false;
+    if (!append_encoded_path(strbuf, &request->url))
+        return false;
+    if (query_string->len &&
+        !lwan_strbuf_append_printf(strbuf, "?%.*s", (int)query_string->len,
+                                   query_string->value))
+        return false;
+    if (!lwan_strbuf_append_strz(strbuf, " HTTP/1.1\r\n"))
+        return false;
+
+    lwan_request_foreach_header(request, append_request_header, &state);
+    if (!state.ok)
+        return false;
+
+    if (!state.has_host &&
+        !lwan_strbuf_append_printf(strbuf, "Host: %s\r\n", upstream->address))
+        return false;
+
+    if (state.replace_traceparent) {
+        char traceparent[LWAN_TRACEPARENT_SIZE];
+
+        lwan_tracing_get_traceparent(request, traceparent);
+        if (!lwan_strbuf_append_printf(strbuf, "traceparent: %s\r\n",
+                                       traceparent))
+            return false;
+    }
+
+    remote_addr = lwan_request_get_remote_address(request, remote_addr_buf);
+    if (remote_addr) {
+        bool appended =
+            state.forwarded_for.len
+                ? lwan_strbuf_append_printf(strbuf,
+                                            "X-Forwarded-For: %.*s, %s\r\n",
+                                            (int)state.forwarded_for.len,
+                                            state.forwarded_for.value,
+                                            remote_addr)
+                : lwan_strbuf_append_printf(
+                      strbuf, "X-Forwarded-For: %s\r\n", remote_addr);
+        if (!appended)
+            return false;
+    }
+
+    if (body && body->len &&
+        !lwan_strbuf_append_printf(strbuf, "Content-Length: %zu\r\n",
+                                   body->len))
+        return false;
+
+    return lwan_strbuf_append_strz(strbuf, "\r\n");
+}
+
+static bool send_request(struct lwan_request *request,
+                         const struct upstream_conn *conn)
+{
+    struct lwan_strbuf *strbuf = request->response.buffer;
+    const struct lwan_value *body = lwan_request_get_request_body(request);
+    bool sent = false;
+
+    /* The response buffer is empty at this point, so borrow it to build
+     * the request head. */
+    if (build_request_head(request, strbuf, conn->upstream, body)) {
+        struct iovec vec[] = {
+            {.iov_base = lwan_strbuf_get_buffer(strbuf),
+             .iov_len = lwan_strbuf_get_length(strbuf)},
+            {.iov_base = body ? body->value : NULL,
+             .iov_len = body ? body->len : 0},
+        };
+
+        sent = lwan_writev_fd(request, conn->fd, vec,
+                              vec[1].iov_len ? 2 : 1) >= 0;
+    }
+
+    lwan_strbuf_reset(strbuf);
+    return sent;
+}
+
+static ssize_t fill_buffer(struct lwan_request *request,
+                           const struct upstream_conn *conn,
+                           struct upstream_buffer *buf)
+{
+    if (buf->offset) {
+        buf->len -= buf->offset;
+        memmove(buf->data, buf->data + buf->offset, buf->len);
+        buf->offset = 0;
+    }
+
+    if (UNLIKELY(buf->len == RESPONSE_BUFFER_SIZE))
+        return -ENOBUFS;
+
+    for (int tries = 5; tries;) {
+        ssize_t r = recv(conn->fd, buf->data + buf->len,
+                         RESPONSE_BUFFER_SIZE - buf->len, 0);
+
+        if (r >= 0) {
+            buf->len += (size_t)r;
+            return r;
+        }
+
+        switch (errno) {
+        case EAGAIN:
+            tries--;
+            /* Fallthrough */
+        case EINTR:
+            break;
+        default:
+            return -errno;
+        }
+
+        /* If the upstream hung up, recv() will tell on the next try */
+        lwan_request_await_read(request, conn->fd);
+    }
+
+    return -ETIMEDOUT;
+}
+
+static inline size_t pending(const struct upstream_buffer *buf)
+{
+    return buf->len - buf->offset;
+}
+
+static bool is_idempotent(const struct lwan_request *request)
+{
+    switch (lwan_request_get_method(request)) {
+    case REQUEST_METHOD_GET:
+    case REQUEST_METHOD_HEAD:
+    case REQUEST_METHOD_OPTIONS:
+    case REQUEST_METHOD_PUT:
+    case REQUEST_METHOD_DELETE:
+        return true;
+    default:
+        return false;
+    }
+}
+
+/* Returns the status code in a "HTTP/1.x NNN" status line, or -1.  */
+static int parse_status_line(const char *head, size_t head_len)
+{
+    if (head_len < 12 || strncmp(head, "HTTP/1.", 7) || head[8] != ' ' ||
+        !lwan_char_isdigit(head[9]) || !lwan_char_isdigit(head[10]) ||
+        !lwan_char_isdigit(head[11]))
+        return -1;
+
+    return (head[9] - '0') * 100 + (head[10] - '0') * 10 + (head[11] - '0');
+}
+
+struct response_head {
+    enum lwan_http_status status;
+    enum body_framing framing;
+    size_t content_length;
+    char *content_length_value;
+    bool keep_alive;
+};
+
+static bool parse_header(struct lwan_request *request,
+                         struct response_head *head,
+                         struct header_array *headers,
+                         char *begin,
+                         char *end)
+{
+    char *colon = memchr(begin, ':', (size_t)(end - begin));
+    char *value;
+
+    if (!colon)
+        return false;
+
+    *colon = '\0';
+    *(end - 2) = '\0';
+    for (value = colon + 1; *value == ' ' || *value == '\t'; value++)
+        ;
+
+    const size_t name_len = (size_t)(colon - begin);
+    if (name_len == sizeof("Content-Type") - 1 &&
+        strcaseequal_neutral(begin, "Content-Type")) {
+        request->response.mime_type = value;
+        return true;
+    }
+    if (name_len == sizeof("Content-Length") - 1 &&
+        strcaseequal_neutral(begin, "Content-Length")) {
+        char *endptr;
+
+        errno = 0;
+        head->content_length = strtoull(value, &endptr, 10);
+        if (errno || endptr == value)
+            return false;
+        head->content_length_value = value;
+        if (head->framing == BODY_UNTIL_EOF)
+            head->framing = BODY_CONTENT_LENGTH;
+        return true;
+    }
+    if (name_len == sizeof("Transfer-Encoding") - 1 &&
+        strcaseequal_neutral(begin, "Transfer-Encoding")) {
+        /* Chunked has to be the last encoding, and takes precedence over
+         * Content-Length */
+        if (strcasestr(value, "chunked"))
+            head->framing = BODY_CHUNKED;
+        return true;
+    }
+    if (name_len == sizeof("Connection") - 1 &&
+        strcaseequal_neutral(begin, "Connection")) {
+        if (strcasestr(value, "close"))
+            head->keep_alive = false;
+        return true;
+    }
+    if (is_hop_by_hop_header(begin, name_len))
+        return true;
+
+    struct lwan_key_value *header = header_array_append(headers);
+    if (!header)
+        return false;
+    *header = (struct lwan_key_value){.key = begin, .value = value};
+    return true;
+}
+
+static void reset_header_array(void *data)
+{
+    header_array_reset(data);
+}
+
+/* Returns HTTP_OK if the head was parsed and the body starts at
+ * buf->offset.  */
+static enum lwan_http_status read_response_head(struct lwan_request *request,
+                                                struct upstream_conn *conn,
+                                                struct upstream_buffer *buf,
+                                                struct response_head *head,
+                                                struct header_array *headers)
+{
+    char *header_start[N_HEADER_START];
+    char *end_of_head;
+    bool got_interim = false;
+    size_t head_len;
+    int code;
+
+    while (true) {
+        while (!(end_of_head = memmem(buf->data, buf->len, "\r\n\r\n", 4))) {
+            ssize_t r = fill_buffer(request, conn, buf);
+
+            if (r <= 0) {
+                /* The upstream closed a pooled connection right before we
+                 * reused it.  Unless the request has side effects, it can
+                 * be sent again.  */
+                conn->retry = !buf->len && !got_interim && conn->pooled &&
+                              is_idempotent(request);
+                return HTTP_BAD_GATEWAY;
+            }
+        }
+
+        head_len = (size_t)(end_of_head - buf->data) + 4;
+        code = parse_status_line(buf->data, head_len);
+        if (code < 100 || code > 599)
+            return HTTP_BAD_GATEWAY;
+        if (code >= 200)
+            break;
+
+        /* Upgrade headers aren't forwarded, so there's nothing to switch
+         * to; other 1xx responses (e.g. 100 Continue or 103 Early Hints)
+         * are interim, and are followed by the final response.  */
+        if (code == 101)
+            return HTTP_BAD_GATEWAY;
+        got_interim = true;
+        buf->len -= head_len;
+        memmove(buf->data, buf->data + head_len, buf->len);
+    }
+
+    /* Headers are going to be sent after the body, for buffered responses,
+     * and the read buffer is reused for the body, so keep a copy. */
+    char *head_copy = coro_memdup(request->conn->coro, buf->data, head_len);
+    if (!head_copy)
+        return HTTP_INTERNAL_ERROR;
+    buf->offset = head_len;
+
+    *head = (struct response_head){
+        /* Passed along as is, even if Lwan doesn't know about it */
+        .status = (enum lwan_http_status)code,
+        .framing = BODY_UNTIL_EOF,
+        .keep_alive = head_copy[7] == '1',
+    };
+
+    /* lwan_find_headers() expects to start right before the first
+     * header, at the \n ending the status line.  */
+    char *status_line_end = memchr(head_copy, '\n', head_len);
+    struct lwan_value header_buffer = {
+        .value = status_line_end,
+        .len = head_len - (size_t)(status_line_end - head_copy),
+    };
+    char *ignored;
+    ssize_t n_headers = lwan_find_headers(header_start, &header_buffer, &ignored);
+    if (n_headers < 0)
+        return HTTP_BAD_GATEWAY;
+
+    for (ssize_t i = 0; i < n_headers; i++) {
+        if (!parse_header(request, head, headers, header_start[i],
+                          header_start[i + 1]))
+            return HTTP_BAD_GATEWAY;
+    }
+
+    if (lwan_request_get_method(request) == REQUEST_METHOD_HEAD ||
+        code == 204 || code == 304)
+        head->framing = BODY_NONE;
+
+    return HTTP_OK;
+}
+
+static bool forward_body(struct lwan_request *request,
+                         bool streaming,
+                         const char *data,
+                         size_t len)
+{
+    if (streaming) {
+        struct lwan_strbuf chunk;
+
+        lwan_strbuf_init(&chunk);
+        lwan_strbuf_set_static(&chunk, data, len);
+        lwan_response_send_chunk_full(request, &chunk);
+        return true;
+    }
+
+    return lwan_strbuf_append_str(request->response.buffer, data, len);
+}
+
+static bool forward_body_bytes(struct lwan_request *request,
+                               struct upstream_conn *conn,
+                               struct upstream_buffer *buf,
+                               bool streaming,
+                               size_t to_forward)
+{
+    while (to_forward) {
+        if (!pending(buf) && fill_buffer(request, conn, buf) <= 0)
+            return false;
+
+        const size_t len = LWAN_MIN(pending(buf), to_forward);
+        if (!forward_body(request, streaming, buf->data + buf->offset, len))
+            return false;
+
+        buf->offset += len;
+        to_forward -= len;
+    }
+
+    return true;
+}
+
+static char *read_line(struct lwan_request *request,
+                       struct upstream_conn *conn,
+                       struct upstream_buffer *buf)
+{
+    char *crlf;
+
+    while (!(crlf = memmem(buf->data + buf->offset, pending(buf), "\r\n", 2))) {
+        if (fill_buffer(request, conn, buf) <= 0)
+            return NULL;
+    }
+
+    char *line = buf->data + buf->offset;
+    *crlf = '\0';
+    buf->offset = (size_t)(crlf - buf->data) + 2;
+    return line;
+}
+
+static bool forward_chunked_body(struct lwan_request *request,
+                                 struct upstream_conn *conn,
+                                 struct upstream_buffer *buf,
+                                 bool streaming)
+{
+    while (true) {
+        char *line = read_line(request, conn, buf);
+        char *endptr;
+
+        if (!line)
+            return false;
+
+        errno = 0;
+        size_t chunk_size = strtoull(line, &endptr, 16);
+        if (errno || endptr == line)
+            return false;
+
+        if (!chunk_size)
+            break;
+
+        if (!forward_body_bytes(request, conn, buf, streaming, chunk_size))
+            return false;
+
+        line = read_line(request, conn, buf);
+        if (!line || *line)
+            return false;
+    }
+
+    /* Trailers, if any, are dropped */
+    while (true) {
+        char *line = read_line(request, conn, buf);
+
+        if (!line)
+            return false;
+        if (!*line)
+            return true;
+    }
+}
+
+static bool forward_until_eof(struct lwan_request *request,
+                              struct upstream_conn *conn,
+                              struct upstream_buffer *buf,
+                              bool streaming)
+{
+    while (true) {
+        if (pending(buf)) {
+            if (!forward_body(request, streaming, buf->data + buf->offset,
+                              pending(buf)))
+                return false;
+            buf->offset = buf->len;
+        }
+
+        ssize_t r = fill_buffer(request, conn, buf);
+        if (r == 0)
+            return true;
+        if (r < 0)
+            return false;
+    }
+}
+
+static enum lwan_http_status proxy_request(struct lwan_request *request,
+                                           struct upstream_conn *conn)
+{
+    struct lwan_response *response = &request->response;
+    struct upstream_buffer buf = {
+        .data = coro_malloc(request->conn->coro, RESPONSE_BUFFER_SIZE),
+    };
+    struct response_head head;
+    struct header_array *headers;
+    enum lwan_http_status status;
+    bool forwarded = false;
+
+    if (UNLIKELY(!buf.data))
+        return HTTP_INTERNAL_ERROR;
+
+    if (!send_request(request, conn)) {
+        conn->retry = conn->pooled && is_idempotent(request);
+        return HTTP_BAD_GATEWAY;
+    }
+
+    /* Headers are sent by lwan_response() for buffered responses, after
+     * this function returns.  */
+    headers = coro_malloc(request->conn->coro, sizeof(*headers));
+    if (UNLIKELY(!headers))
+        return HTTP_INTERNAL_ERROR;
+    header_array_init(headers);
+    coro_defer(request->conn->coro, reset_header_array, headers);
+
+    status = read_response_head(request, conn, &buf, &head, headers);
+    if (status != HTTP_OK)
+        return status;
+
+    if (lwan_request_get_method(request) == REQUEST_METHOD_HEAD &&
+        head.content_length_value) {
+        /* There's no body to count, so pass the upstream length along */
+        struct lwan_key_value *content_length = header_array_append(headers);
+        if (!content_length)
+            return HTTP_INTERNAL_ERROR;
+        *content_length = (struct lwan_key_value){
+            .key = "Content-Length",
+            .value = head.content_length_value,
+        };
+        request->flags |= RESPONSE_NO_CONTENT_LENGTH;
+    }
+
+    struct lwan_key_value *terminator = header_array_append(headers);
+    if (!terminator)
+        return HTTP_INTERNAL_ERROR;
+    *terminator = (struct lwan_key_value){};
+    response->headers = header_array_get_array(headers);
+    request->flags |= RESPONSE_UPSTREAM_HEADERS;
+
+    if (!response->mime_type)
+        response->mime_type = "application/octet-stream";
+
+    /* Small responses, which arrived in full with the headers, are sent
+     * with a Content-Length like any other response, and so are responses
+     * to HTTP/1.0 clients, which can't receive chunked responses.
+     * Everything else is streamed to the client as it arrives.  */
+    const bool streaming =
+        !(request->flags & REQUEST_IS_HTTP_1_0) &&
+        !(head.framing == BODY_NONE ||
+          (head.framing == BODY_CONTENT_LENGTH &&
+           head.content_length <= pending(&buf)));
+
+    if (streaming &&
+        !lwan_response_set_chunked_full(request, head.status, response->headers))
+        return HTTP_INTERNAL_ERROR;
+
+    switch (head.framing) {
+    case BODY_NONE:
+        forwarded = true;
+        break;
+    case BODY_CONTENT_LENGTH:
+        forwarded = forward_body_bytes(request, conn, &buf, streaming,
+                                       head.content_length);
+        break;
+    case BODY_CHUNKED:
+        forwarded = forward_chunked_body(request, conn, &buf, streaming);
+        break;
+    case BODY_UNTIL_EOF:
+        forwarded = forward_until_eof(request, conn, &buf, streaming);
+        head.keep_alive = false;
+        break;
+    }
+
+    if (!forwarded) {
+        if (streaming) {
+            /* Headers have been sent already; all that can be done is
+             * closing the connection so the client knows the response
+             * is incomplete.  */
+            coro_yield(request->conn->coro, CONN_CORO_ABORT);
+            __builtin_unreachable();
+        }
+
+        lwan_strbuf_reset(response->buffer);
+        response->mime_type = NULL;
+        response->headers = NULL;
+        request->flags &= ~RESPONSE_UPSTREAM_HEADERS;
+        return HTTP_BAD_GATEWAY;
+    }
+
+    conn->reusable = head.keep_alive && !pending(&buf);
+    return head.status;
+}
+
+static enum lwan_http_status traced_proxy_request(struct lwan_request *request,
+                                                  struct upstream_conn *conn)
+{
+    struct lwan_trace_span span;
+    enum lwan_http_status status;
+
+    if (LIKELY(request->helper->trace == NULL))
+        return proxy_request(request, conn);
+
+    lwan_tracing_span_begin(request, &span);
+    status = proxy_request(request, conn);
+    lwan_tracing_span_end(request, &span, LWAN_SPAN_PROXY,
+                          conn->upstream->address, status);
+
+    return status;
+}
+
+static enum lwan_http_status
+proxy_handle_request(struct lwan_request *request,
+                     struct lwan_response *response __attribute__((unused)),
+                     void *instance)
+{
+    struct private_data *pd = instance;
+    struct upstream_pool *pools = get_pools(pd, request);
+    const size_t first = pick_upstream(pd);
+
+    /* Only failures to connect, or to reuse a pooled connection, move on
+     * to the next upstream, as nothing has been processed by it yet. */
+    for (size_t i = 0; i < pd->n_upstreams; i++) {
+        const size_t index = (first + i) % pd->n_upstreams;
+        struct upstream_conn *conn;
+        enum lwan_http_status status;
+
+        conn = connect_to_upstream(request, pd, pools, index, true);
+        if (!conn)
+            continue;
+
+        status = traced_proxy_request(request, conn);
+        if (conn->retry) {
+            /* Try the same upstream again, with a new connection */
+            conn = connect_to_upstream(request, pd, pools, index, false);
+            if (!conn)
+                continue;
+            status = traced_proxy_request(request, conn);
+        }
+
+        return status;
+    }
+
+    return HTTP_UNAVAILABLE;
+}
+
+static bool check_upstream(const struct private_data *pd,
+                           const struct upstream *upstream)
+{
+    const struct timeval timeout = {
+        .tv_sec = HEALTH_CHECK_TIMEOUT_MS / 1000,
+        .tv_usec = (HEALTH_CHECK_TIMEOUT_MS % 1000) * 1000,
+    };
+    char response[sizeof("HTTP/1.1 200")];
+    bool healthy = false;
+    int fd;
+
+    fd = socket(upstream->addr_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+        return false;
+
+    if (setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)) < 0)
+        goto out;
+    if (setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout)) < 0)
+        goto out;
+
+    if (connect(fd, (const struct sockaddr *)&upstream->sock_addr,
+                upstream->addr_size) < 0)
+        goto out;
+
+    if (!pd->health_check_path) {
+        healthy = true;
+        goto out;
+    }
+
+    char request[512];
+    int len = snprintf(request, sizeof(request),
+                       "GET %s HTTP/1.1\r\n"
+                       "Host: %s\r\n"
+                       "Connection: close\r\n"
+                       "\r\n",
+                       pd->health_check_path, upstream->address);
+    if (len < 0 || len >= (int)sizeof(request))
+        goto out;
+    if (send(fd, request, (size_t)len, MSG_NOSIGNAL) != len)
+        goto out;
+
+    size_t received = 0;
+    while (received < sizeof(response) - 1) {
+        ssize_t r = recv(fd, response + received,
+                         sizeof(response) - 1 - received, 0);
+        if (r <= 0)
+            goto out;
+        received += (size_t)r;
+    }
+
+    /* Any 2xx or 3xx response is fine */
+    healthy = !strncmp(response, "HTTP/1.", 7) &&
+              (response[9] == '2' || response[9] == '3');
+
+out:
+    close(fd);
+    return healthy;
+}
+
+static bool health_check_job(void *data)
+{
+    struct private_data *pd = data;
+    bool found_unhealthy = false;
+
+    for (size_t i = 0; i < pd->n_upstreams; i++) {
+        struct upstream *upstream = &pd->upstreams[i];
+        bool healthy = check_upstream(pd, upstream);
+
+        set_upstream_health(upstream, healthy);
+        found_unhealthy |= !healthy;
+    }
+
+    /* While some upstream is down, keep checking at the minimum interval
+     * so it's put back in rotation as soon as possible. */
+    return found_unhealthy;
+}
+
+static bool parse_upstream(struct upstream *upstream, const char *address)
+{
+    if (*address == '/') {
+        if (strlen(address) >= sizeof(upstream->un_addr.sun_path)) {
+            lwan_status_error("Proxy: `%s` is too long for a sockaddr_un",
+                              address);
+            return false;
+        }
+
+        upstream->addr_family = AF_UNIX;
+        upstream->un_addr = (struct sockaddr_un){.sun_family = AF_UNIX};
+        upstream->addr_size = sizeof(upstream->un_addr);
+        memcpy(upstream->un_addr.sun_path, address, strlen(address) + 1);
+        return true;
+    }
+
+    char *address_copy = strdupa(address);
+    char *node, *port;
+    sa_family_t family = lwan_socket_parse_address(address_copy, &node, &port);
+    if (family == AF_MAX) {
+        lwan_status_error("Proxy: Could not parse '%s' as 'address:port'",
+                          address);
+        return false;
+    }
+
+    const struct addrinfo hints = {
+        .ai_family = family,
+        .ai_socktype = SOCK_STREAM,
+        .ai_flags = AI_NUMERICSERV,
+    };
+    struct addrinfo *addrs;
+    int ret = getaddrinfo(node, port, &hints, &addrs);
+    if (ret) {
+        lwan_status_error("Proxy: Could not resolve '%s': %s", address,
+                          gai_strerror(ret));
+        return false;
+    }
+
+    /* Only the first address is used; list others as separate upstreams
+     * to balance between them. */
+    upstream->addr_family = addrs->ai_family;
+    upstream->addr_size = addrs->ai_addrlen;
+    memcpy(&upstream->sock_addr, addrs->ai_addr, addrs->ai_addrlen);
+    freeaddrinfo(addrs);
+
+    return true;
+}
+
+static void proxy_destroy(void *instance)
+{
+    struct private_data *pd = instance;
+
+    lwan_job_del(health_check_job, pd);
+
+    if (pd->pools) {
+        for (size_t i = 0; i < pd->pools->n_pools; i++) {
+            const struct upstream_pool *pool = &pd->pools->pools[i];
+
+            for (unsigned int j = 0; j < pool->n_idle; j++)
+                close(pool->idle_fds[j]);
+        }
+        free(pd->pools);
+    }
+
+    for (size_t i = 0; i < pd->n_upstreams; i++)
+        free(pd->upstreams[i].address);
+    free(pd->upstreams);
+    free(pd->health_check_path);
+    free(pd);
+}
+
+static void *proxy_create(const char *prefix __attribute__((unused)),
+                          void *user_settings)
+{
+    struct lwan_proxy_settings *settings = user_settings;
+    struct private_data *pd;
+    char *upstreams, *saveptr;
+
+    if (!settings->upstreams) {
+        lwan_status_error("Proxy: `upstreams` not specified");
+        return NULL;
+    }
+
+    pd = calloc(1, sizeof(*pd));
+    if (!pd) {
+        lwan_status_perror("Proxy: Could not allocate memory for module");
+        return NULL;
+    }
+
+    if (!settings->balance || streq(settings->balance, "round_robin")) {
+        pd->balance = BALANCE_ROUND_ROBIN;
+    } else if (streq(settings->balance, "least_connections")) {
+        pd->balance = BALANCE_LEAST_CONNECTIONS;
+    } else {
+        lwan_status_error("Proxy: Unknown balancing method: %s",
+                          settings->balance);
+        goto error;
+    }
+
+    if (settings->health_check) {
+        pd->health_check_path = strdup(settings->health_check);
+        if (!pd->health_check_path)
+            goto error;
+    }
+
+    upstreams = strdupa(settings->upstreams);
+    for (char *address = strtok_r(upstreams, " ,", &saveptr); address;
+         address = strtok_r(NULL, " ,", &saveptr)) {
+        struct upstream *new_upstreams =
+            reallocarray(pd->upstreams, pd->n_upstreams + 1,
+                         sizeof(*pd->upstreams));
+        if (!new_upstreams)
+            goto error;
+        pd->upstreams = new_upstreams;
+
+        struct upstream *upstream = &pd->upstreams[pd->n_upstreams];
+        *upstream = (struct upstream){.healthy = true};
+        if (!parse_upstream(upstream, address))
+            goto error;
+
+        upstream->address = strdup(address);
+        if (!upstream->address)
+            goto error;
+
+        pd->n_upstreams++;
+    }
+
+    if (!pd->n_upstreams) {
+        lwan_status_error("Proxy: `upstreams` is empty");
+        goto error;
+    }
+
+    if (settings->health_check_interval) {
+        pd->health_checks = true;
+
+        const unsigned int interval_ms = settings->health_check_interval * 1000;
+
+        lwan_job_add_full(health_check_job, pd, "proxy_health_check",
+                          LWAN_JOB_PRIORITY_LOW, interval_ms, interval_ms * 4);
+    }
+
+    return pd;
+
+error:
+    proxy_destroy(pd);
+    return NULL;
+}
+
+static void *proxy_create_from_hash(const char *prefix,
+                                    const struct hash *hash)
+{
+    const char *interval = hash_find(hash, "health_check_interval");
+    struct lwan_proxy_settings settings = {
+        .upstreams = hash_find(hash, "upstreams"),
+        .balance = hash_find(hash, "balance"),
+        .health_check = hash_find(hash, "health_check"),
+        /* parse_time_period() treats 0 as the default */
+        .health_check_interval = interval && parse_long(interval, -1) == 0
+                                     ? 0
+                                     : parse_time_period(interval, 5),
+    };
+    return proxy_create(prefix, &settings);
+}
+
+static const struct lwan_module module = {
+    .create = proxy_create,
+    .create_from_hash = proxy_create_from_hash,
+    .destroy = proxy_destroy,
+    .handle_request = proxy_handle_request,
+    .flags = HANDLER_EXPECTS_BODY_DATA,
+};
+
+LWAN_REGISTER_MODULE(proxy, &module);
@@ -0,0 +1,50 @@
+/*
+ * lwan - web server
+ * Copyright (c) 2024 L. A. F. Pereira <l@tia.mat.br>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+
+#pragma once
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+#include "lwan.h"
+
+struct lwan_proxy_settings {
+    /* Space- or comma-separated list of addresses */
+    const char *upstreams;
+    /* "round_robin" (default) or "least_connections" */
+    const char *balance;
+    /* If set, health checks GET this path rather than only connecting */
+    const char *health_check;
+    unsigned int health_check_interval;
+};
+
+LWAN_MODULE_FORWARD_DECL(proxy);
+
+#define PROXY(upstreams_)                                                      \
+    .module = LWAN_MODULE_REF(proxy),                                          \
+    .args = ((struct lwan_proxy_settings[]){{                                  \
+        .upstreams = upstreams_,                                               \
+    }}),                                                                       \
+    .flags = (enum lwan_handler_flags)0
+
+#if defined(__cplusplus)
+}
+#endif
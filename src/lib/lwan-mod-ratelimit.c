@@ -0,0 +1,561 @@
+/*
+ * lwan - web server
+ * Copyright (c) 2024 L. A. F. Pereira <l@tia.mat.br>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+/* Token bucket rate limiting.  Requests are told apart by a key (the
+ * remote address, a header, or a cookie); each key has a bucket that's
+ * refilled at a constant rate, and requests that find it empty get a 429
+ * response.  Others are handed over to another URL map.
+ *
+ * Buckets are kept in shards, one per I/O thread (give or take), so that
+ * requests only ever lock the shard of the thread handling them, which
+ * nobody else uses but a background job.  That job periodically adds up
+ * what every shard consumed from each key since it last ran, and takes
+ * from each bucket what has been consumed by the other shards: limits
+ * are thus global, but only approximately so, as clients with requests
+ * handled by many threads can exceed them until the next merge. */
+
+#define _GNU_SOURCE
+#include <math.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "lwan-private.h"
+
+#include "hash.h"
+#include "int-to-str.h"
+#include "list.h"
+#include "lwan-mod-ratelimit.h"
+
+#define MERGE_INTERVAL_MS 100
+#define DEFAULT_MAX_KEYS 65536
+
+enum key_source {
+    KEY_REMOTE_ADDRESS,
+    KEY_HEADER,
+    KEY_COOKIE,
+};
+
+struct bucket {
+    double tokens;
+    uint64_t updated_ns;
+
+    /* Requests allowed by this shard since the last merge, and how many
+     * of these were counted by the merge in progress. */
+    unsigned int consumed;
+    unsigned int merged;
+
+    struct list_node lru;
+
+    char key[];
+};
+
+/* Requests allowed for a key by all shards, while merging */
+struct total {
+    unsigned int consumed;
+    char key[];
+};
+
+struct shard {
+    pthread_mutex_t lock;
+    struct hash *buckets;
+    /* Least recently used buckets first */
+    struct list_head lru;
+} __attribute__((aligned(64)));
+
+struct ratelimit_priv {
+    double tokens_per_ns;
+    double burst;
+    /* Buckets that have been full for this long are forgotten */
+    uint64_t idle_ns;
+
+    enum key_source key_source;
+    char *key_name;
+
+    char *pass_to;
+    size_t pass_to_len;
+
+    unsigned int max_keys;
+
+    unsigned int n_shards; /* Power of two */
+    struct shard *shards;
+};
+
+static uint64_t monotonic_ns(void)
+{
+    struct timespec now;
+
+    if (UNLIKELY(clock_gettime(monotonic_clock_id, &now) < 0))
+        return 0;
+
+    return (uint64_t)now.tv_sec * 1000000000ull + (uint64_t)now.tv_nsec;
+}
+
+static void refill(const struct ratelimit_priv *priv,
+                   struct bucket *bucket,
+                   uint64_t now)
+{
+    if (now > bucket->updated_ns) {
+        bucket->tokens =
+            fmin(priv->burst,
+                 bucket->tokens +
+                     (double)(now - bucket->updated_ns) * priv->tokens_per_ns);
+        bucket->updated_ns = now;
+    }
+}
+
+static const char *get_key(struct lwan_request *request,
+                           const struct ratelimit_priv *priv,
+                           char buffer[static INET6_ADDRSTRLEN])
+{
+    const char *key = NULL;
+
+    switch (priv->key_source) {
+    case KEY_HEADER:
+        key = lwan_request_get_header(request, priv->key_name);
+        break;
+    case KEY_COOKIE:
+        key = lwan_request_get_cookie(request, priv->key_name);
+        break;
+    case KEY_REMOTE_ADDRESS:
+        break;
+    }
+
+    /* Requests without the header or cookie are told apart by their
+     * origin, rather than all sharing the same bucket. */
+    return key ? key : lwan_request_get_remote_address(request, buffer);
+}
+
+static struct shard *get_shard(const struct ratelimit_priv *priv,
+                               const struct lwan_request *request)
+{
+    const struct lwan_thread *t = request->conn->thread;
+    const size_t index = (size_t)(t - t->lwan->thread.threads);
+
+    return &priv->shards[index & (priv->n_shards - 1)];
+}
+
+static unsigned int seconds_until(const struct ratelimit_priv *priv,
+                                  const struct bucket *bucket,
+                                  double tokens)
+{
+    const unsigned int seconds = (unsigned int)ceil(
+        (tokens - bucket->tokens) / priv->tokens_per_ns / 1e9);
+
+    return seconds ? seconds : 1;
+}
+
+/* Makes room for another bucket in a full shard by forgetting the least
+ * recently used one, if it's full again: it'd be recreated just like that,
+ * so nobody gets more tokens than they should.  Otherwise, every key in
+ * this shard has been used recently enough to still be limited, and
+ * letting new ones through would let anybody able to vary their key (e.g.
+ * by cycling through IPv6 addresses) get past the limiter.  Returns 0 if
+ * a bucket was forgotten, or how many seconds until one could be. */
+static unsigned int evict_stalest(const struct ratelimit_priv *priv,
+                                  struct shard *shard,
+                                  uint64_t now)
+{
+    struct bucket *bucket = list_top(&shard->lru, struct bucket, lru);
+
+    if (UNLIKELY(!bucket))
+        return 1;
+
+    refill(priv, bucket, now);
+    if (bucket->tokens < priv->burst)
+        return seconds_until(priv, bucket, priv->burst);
+    /* What it consumed hasn't been taken from other shards yet */
+    if (bucket->consumed)
+        return 1;
+
+    list_del_from(&shard->lru, &bucket->lru);
+    hash_del(shard->buckets, bucket->key);
+    return 0;
+}
+
+/* Returns 0 if the request can go ahead, or how many seconds until it
+ * could have. */
+static unsigned int take_token(struct ratelimit_priv *priv,
+                               struct shard *shard,
+                               const char *key)
+{
+    const uint64_t now = monotonic_ns();
+    unsigned int retry_after = 0;
+    struct bucket *bucket;
+
+    pthread_mutex_lock(&shard->lock);
+
+    bucket = hash_find(shard->buckets, key);
+    if (UNLIKELY(!bucket)) {
+        size_t key_len = strlen(key);
+
+        if (hash_get_count(shard->buckets) >= priv->max_keys) {
+            retry_after = evict_stalest(priv, shard, now);
+            if (retry_after)
+                goto out;
+        }
+
+        bucket = malloc(sizeof(*bucket) + key_len + 1);
+        if (UNLIKELY(!bucket))
+            goto out;
+
+        *bucket = (struct bucket){.tokens = priv->burst, .updated_ns = now};
+        memcpy(bucket->key, key, key_len + 1);
+
+        if (UNLIKELY(hash_add_unique(shard->buckets, bucket->key, bucket))) {
+            free(bucket);
+            goto out;
+        }
+    } else {
+        refill(priv, bucket, now);
+        list_del_from(&shard->lru, &bucket->lru);
+    }
+    list_add_tail(&shard->lru, &bucket->lru);
+
+    if (LIKELY(bucket->tokens >= 1.0)) {
+        bucket->tokens -= 1.0;
+        bucket->consumed++;
+    } else {
+        retry_after = seconds_until(priv, bucket, 1.0);
+    }
+
+out:
+    pthread_mutex_unlock(&shard->lock);
+    return retry_after;
+}
+
+static enum lwan_http_status
+ratelimit_handle_request(struct lwan_request *request,
+                         struct lwan_response *response,
+                         void *instance)
+{
+    struct ratelimit_priv *priv = instance;
+    char buffer[INET6_ADDRSTRLEN];
+    const char *key = get_key(request, priv, buffer);
+    unsigned int retry_after;
+
+    if (UNLIKELY(!key))
+        return HTTP_INTERNAL_ERROR;
+
+    retry_after = take_token(priv, get_shard(priv, request), key);
+    if (UNLIKELY(retry_after)) {
+        char *value = coro_malloc(request->conn->coro, INT_TO_STR_BUFFER_SIZE);
+        struct lwan_key_value *headers;
+        size_t len;
+
+        if (UNLIKELY(!value))
+            return HTTP_INTERNAL_ERROR;
+
+        headers = coro_malloc(request->conn->coro, 2 * sizeof(*headers));
+        if (UNLIKELY(!headers))
+            return HTTP_INTERNAL_ERROR;
+
+        headers[0] = (struct lwan_key_value){
+            .key = "Retry-After",
+            .value = uint_to_string(retry_after, value, &len),
+        };
+        headers[1] = (struct lwan_key_value){};
+        response->headers = headers;
+
+        return HTTP_TOO_MANY_REQUESTS;
+    }
+
+    char *url = coro_malloc(request->conn->coro,
+                            priv->pass_to_len + request->url.len + 1);
+    if (UNLIKELY(!url))
+        return HTTP_INTERNAL_ERROR;
+
+    memcpy(url, priv->pass_to, priv->pass_to_len);
+    memcpy(url + priv->pass_to_len, request->url.value, request->url.len);
+    url[priv->pass_to_len + request->url.len] = '\0';
+
+    request->url.value = url;
+    request->url.len = priv->pass_to_len + request->url.len;
+    request->original_url = request->url;
+    request->flags |= RESPONSE_URL_REWRITTEN;
+
+    return HTTP_OK;
+}
+
+static bool merge_job(void *data)
+{
+    struct ratelimit_priv *priv = data;
+    /* Keys are stored in the totals themselves */
+    struct hash *totals = hash_str_new(NULL, free);
+    bool consumed_anything = false;
+    const uint64_t now = monotonic_ns();
+
+    if (UNLIKELY(!totals))
+        return false;
+
+    /* First, add up what each shard consumed from each key... */
+    for (unsigned int i = 0; i < priv->n_shards; i++) {
+        struct shard *shard = &priv->shards[i];
+        struct hash_iter iter;
+        const void *value;
+
+        pthread_mutex_lock(&shard->lock);
+
+        hash_iter_init(shard->buckets, &iter);
+        while (hash_iter_next(&iter, NULL, &value)) {
+            struct bucket *bucket = (struct bucket *)value;
+            struct total *total;
+
+            bucket->merged = bucket->consumed;
+            bucket->consumed = 0;
+            if (!bucket->merged)
+                continue;
+
+            consumed_anything = true;
+
+            total = hash_find(totals, bucket->key);
+            if (!total) {
+                const size_t key_len = strlen(bucket->key);
+
+                total = malloc(sizeof(*total) + key_len + 1);
+                if (UNLIKELY(!total))
+                    continue;
+
+                total->consumed = 0;
+                memcpy(total->key, bucket->key, key_len + 1);
+                if (UNLIKELY(hash_add_unique(totals, total->key, total))) {
+                    free(total);
+                    continue;
+                }
+            }
+            total->consumed += bucket->merged;
+        }
+
+        pthread_mutex_unlock(&shard->lock);
+    }
+
+    /* ...then take what the other shards consumed from every bucket, and
+     * forget about buckets that have been full for a while. */
+    for (unsigned int i = 0; i < priv->n_shards; i++) {
+        struct shard *shard = &priv->shards[i];
+        struct hash_iter iter;
+        const void *value;
+        struct bucket **idle = NULL;
+        size_t n_idle = 0, idle_capacity = 0;
+
+        pthread_mutex_lock(&shard->lock);
+
+        hash_iter_init(shard->buckets, &iter);
+        while (hash_iter_next(&iter, NULL, &value)) {
+            struct bucket *bucket = (struct bucket *)value;
+            const struct total *total = hash_find(totals, bucket->key);
+
+            refill(priv, bucket, now);
+
+            if (total && total->consumed > bucket->merged) {
+                bucket->tokens =
+                    fmax(0.0, bucket->tokens -
+                                  (double)(total->consumed - bucket->merged));
+            }
+
+            if (bucket->tokens < priv->burst || bucket->consumed ||
+                now - bucket->updated_ns < priv->idle_ns) {
+                continue;
+            }
+
+            if (n_idle == idle_capacity) {
+                size_t new_capacity = idle_capacity ? idle_capacity * 2 : 16;
+                struct bucket **new_idle =
+                    realloc(idle, new_capacity * sizeof(*idle));
+
+                if (UNLIKELY(!new_idle))
+                    continue;
+
+                idle = new_idle;
+                idle_capacity = new_capacity;
+            }
+            idle[n_idle++] = bucket;
+        }
+
+        /* The hash table might be rehashed when items are removed, so
+         * this can't be done while iterating over it. */
+        for (size_t j = 0; j < n_idle; j++) {
+            list_del_from(&shard->lru, &idle[j]->lru);
+            hash_del(shard->buckets, idle[j]->key);
+        }
+
+        pthread_mutex_unlock(&shard->lock);
+
+        free(idle);
+    }
+
+    hash_unref(totals);
+
+    return consumed_anything;
+}
+
+static unsigned int n_shards_for_cpus(void)
+{
+    long n_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    unsigned int n_shards = 1;
+
+    while (n_cpus > 0 && n_shards < (unsigned int)n_cpus && n_shards < 256)
+        n_shards <<= 1;
+
+    return n_shards;
+}
+
+static void ratelimit_destroy(void *data)
+{
+    struct ratelimit_priv *priv = data;
+
+    if (!priv)
+        return;
+
+    lwan_job_del(merge_job, priv);
+
+    if (priv->shards) {
+        for (unsigned int i = 0; i < priv->n_shards; i++) {
+            if (priv->shards[i].buckets)
+                hash_unref(priv->shards[i].buckets);
+            pthread_mutex_destroy(&priv->shards[i].lock);
+        }
+        free(priv->shards);
+    }
+
+    free(priv->key_name);
+    free(priv->pass_to);
+    free(priv);
+}
+
+static bool parse_key(struct ratelimit_priv *priv, const char *key)
+{
+    if (!key || streq(key, "remote_address")) {
+        priv->key_source = KEY_REMOTE_ADDRESS;
+        return true;
+    }
+
+    if (!strncmp(key, "header:", sizeof("header:") - 1)) {
+        priv->key_source = KEY_HEADER;
+        key += sizeof("header:") - 1;
+    } else if (!strncmp(key, "cookie:", sizeof("cookie:") - 1)) {
+        priv->key_source = KEY_COOKIE;
+        key += sizeof("cookie:") - 1;
+    } else {
+        lwan_status_error("Rate limit: unknown key `%s`", key);
+        return false;
+    }
+
+    if (!*key) {
+        lwan_status_error("Rate limit: key name can't be empty");
+        return false;
+    }
+
+    priv->key_name = strdup(key);
+    return priv->key_name != NULL;
+}
+
+static void *ratelimit_create(const char *prefix __attribute__((unused)),
+                              void *instance)
+{
+    struct lwan_ratelimit_settings *settings = instance;
+    struct ratelimit_priv *priv;
+    unsigned int burst;
+
+    if (!settings->rate || !settings->period) {
+        lwan_status_error("Rate limit: `rate` and `period` must be positive");
+        return NULL;
+    }
+    if (!settings->pass_to || *settings->pass_to != '/') {
+        lwan_status_error("Rate limit: `pass_to` must be an absolute path");
+        return NULL;
+    }
+
+    priv = calloc(1, sizeof(*priv));
+    if (!priv)
+        return NULL;
+
+    burst = settings->burst ? settings->burst : settings->rate;
+
+    priv->tokens_per_ns =
+        (double)settings->rate / ((double)settings->period * 1e9);
+    priv->burst = (double)burst;
+    /* Twice the time it takes to fill an empty bucket */
+    priv->idle_ns = (uint64_t)(2.0 * priv->burst / priv->tokens_per_ns);
+    priv->max_keys = settings->max_keys ? settings->max_keys : DEFAULT_MAX_KEYS;
+
+    if (!parse_key(priv, settings->key))
+        goto error;
+
+    priv->pass_to = strdup(settings->pass_to);
+    if (!priv->pass_to)
+        goto error;
+    priv->pass_to_len = strlen(priv->pass_to);
+    /* The URL after the prefix already starts with a slash */
+    while (priv->pass_to_len && priv->pass_to[priv->pass_to_len - 1] == '/')
+        priv->pass_to[--priv->pass_to_len] = '\0';
+
+    priv->n_shards = n_shards_for_cpus();
+    priv->shards = calloc(priv->n_shards, sizeof(*priv->shards));
+    if (!priv->shards)
+        goto error;
+
+    for (unsigned int i = 0; i < priv->n_shards; i++) {
+        pthread_mutex_init(&priv->shards[i].lock, NULL);
+        list_head_init(&priv->shards[i].lru);
+
+        /* Keys are stored in the buckets themselves */
+        priv->shards[i].buckets = hash_str_new(NULL, free);
+        if (!priv->shards[i].buckets)
+            goto error;
+    }
+
+    lwan_job_add_full(merge_job, priv, "ratelimit_merge",
+                      LWAN_JOB_PRIORITY_NORMAL, MERGE_INTERVAL_MS,
+                      MERGE_INTERVAL_MS * 10);
+
+    return priv;
+
+error:
+    ratelimit_destroy(priv);
+    return NULL;
+}
+
+static void *ratelimit_create_from_hash(const char *prefix,
+                                        const struct hash *hash)
+{
+    struct lwan_ratelimit_settings settings = {
+        .rate = (unsigned int)parse_long(hash_find(hash, "rate"), 0),
+        .period = parse_time_period(hash_find(hash, "period"), 1),
+        .burst = (unsigned int)parse_long(hash_find(hash, "burst"), 0),
+        .key = hash_find(hash, "key"),
+        .pass_to = hash_find(hash, "pass_to"),
+        .max_keys = (unsigned int)parse_long(hash_find(hash, "max_keys"),
+                                             DEFAULT_MAX_KEYS),
+    };
+
+    return ratelimit_create(prefix, &settings);
+}
+
+static const struct lwan_module module = {
+    .create = ratelimit_create,
+    .create_from_hash = ratelimit_create_from_hash,
+    .destroy = ratelimit_destroy,
+    .handle_request = ratelimit_handle_request,
+    .flags = HANDLER_CAN_REWRITE_URL,
+};
+
+LWAN_REGISTER_MODULE(ratelimit, &module);
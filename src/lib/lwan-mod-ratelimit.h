@@ -0,0 +1,57 @@
+/*
+ * lwan - web server
+ * Copyright (c) 2024 L. A. F. Pereira <l@tia.mat.br>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#pragma once
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+#include "lwan.h"
+
+struct lwan_ratelimit_settings {
+    /* Requests allowed per key, on average, every `period` seconds */
+    unsigned int rate;
+    unsigned int period;
+    /* Requests that can be made in a row; defaults to `rate` */
+    unsigned int burst;
+    /* "remote_address" (default), "header:<name>", or "cookie:<name>" */
+    const char *key;
+    /* Requests that aren't limited are rewritten to this URL, followed
+     * by whatever comes after the prefix of this module */
+    const char *pass_to;
+    /* Keys tracked by each thread; others aren't limited.  Defaults to
+     * 65536. */
+    unsigned int max_keys;
+};
+
+LWAN_MODULE_FORWARD_DECL(ratelimit);
+
+#define RATELIMIT(rate_, period_, pass_to_)                                    \
+    .module = LWAN_MODULE_REF(ratelimit),                                      \
+    .args = ((struct lwan_ratelimit_settings[]){{                              \
+        .rate = rate_,                                                         \
+        .period = period_,                                                     \
+        .pass_to = pass_to_,                                                   \
+    }}),                                                                       \
+    .flags = (enum lwan_handler_flags)0
+
+#if defined(__cplusplus)
+}
+#endif
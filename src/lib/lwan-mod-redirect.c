@@ -18,49 +18,155 @@
  * USA.
  */
 
+#include <ctype.h>
 #include <stdlib.h>
 #include <string.h>
 
 #include "lwan-private.h"
 #include "lwan-mod-redirect.h"
 
+struct redirect_target {
+    const char *to;
+    enum lwan_http_status code;
+};
+
 struct redirect_priv {
     char *to;
     enum lwan_http_status code;
+
+    /* Exact paths to redirect, read from the map file.  Keys and targets
+     * point into the contents of the file, which are kept around as a
+     * single buffer rather than as one allocation per entry. */
+    struct hash *map;
+    struct redirect_target *targets;
+    struct lwan_strbuf map_contents;
+    bool map_loaded;
 };
 
+static enum lwan_http_status parse_http_code(const char *code,
+                                             enum lwan_http_status fallback)
+{
+    const char *known;
+    int as_int;
+
+    if (!code)
+        return fallback;
+
+    as_int = parse_int(code, 999);
+    if (as_int == 999)
+        return fallback;
+
+    /* Unknown, but otherwise valid, codes have an empty reason phrase */
+    known = lwan_http_status_as_string_with_code((enum lwan_http_status)as_int);
+    if (!strncmp(known, "999", 3) || known[4] == '\0')
+        return fallback;
+
+    return (enum lwan_http_status)as_int;
+}
+
 static enum lwan_http_status
 redirect_handle_request(struct lwan_request *request,
                         struct lwan_response *response,
                         void *instance)
 {
     struct redirect_priv *priv = instance;
-    struct lwan_key_value headers[] = {{"Location", priv->to}, {}};
+    struct redirect_target target = {.to = priv->to, .code = priv->code};
+
+    if (priv->map) {
+        const struct redirect_target *found =
+            hash_find(priv->map, request->original_url.value);
+
+        if (found)
+            target = *found;
+        else if (!priv->to)
+            return HTTP_NOT_FOUND;
+    }
+    if (UNLIKELY(!target.to))
+        return HTTP_INTERNAL_ERROR;
+
+    struct lwan_key_value headers[] = {{"Location", (char *)target.to}, {}};
 
     response->headers =
         coro_memdup(request->conn->coro, headers, sizeof(headers));
 
-    return response->headers ? priv->code : HTTP_INTERNAL_ERROR;
+    return response->headers ? target.code : HTTP_INTERNAL_ERROR;
 }
 
-static void *redirect_create(const char *prefix __attribute__((unused)),
-                             void *instance)
+static char *next_field(char **cursor)
 {
-    struct lwan_redirect_settings *settings = instance;
-    struct redirect_priv *priv = malloc(sizeof(*priv));
+    char *field = *cursor;
 
-    if (!priv)
+    while (*field == ' ' || *field == '\t')
+        field++;
+    if (!*field)
         return NULL;
 
-    priv->to = strdup(settings->to);
-    if (!priv->to) {
-        free(priv);
-        return NULL;
+    char *end = field;
+    while (*end && !isspace((unsigned char)*end))
+        end++;
+    if (*end)
+        *end++ = '\0';
+
+    *cursor = end;
+    return field;
+}
+
+/* Each line of the map file has a path, the location to redirect it to,
+ * and, optionally, the HTTP code to use for that redirect, separated by
+ * whitespace.  Empty lines and lines starting with '#' are ignored. */
+static bool load_map(struct redirect_priv *priv, const char *path)
+{
+    size_t n_lines = 1;
+    char *contents;
+
+    if (!lwan_strbuf_init_from_file(&priv->map_contents, path)) {
+        lwan_status_perror("Could not read redirect map from %s", path);
+        return false;
+    }
+    priv->map_loaded = true;
+
+    contents = lwan_strbuf_get_buffer(&priv->map_contents);
+    for (char *p = contents; (p = strchr(p, '\n')); p++)
+        n_lines++;
+
+    priv->targets = calloc(n_lines, sizeof(*priv->targets));
+    priv->map = hash_str_new(NULL, NULL);
+    if (!priv->targets || !priv->map)
+        return false;
+
+    size_t n_targets = 0;
+    unsigned int line_number = 0;
+    for (char *line = contents, *next; line; line = next) {
+        next = strchr(line, '\n');
+        if (next)
+            *next++ = '\0';
+        line_number++;
+
+        char *from = next_field(&line);
+        if (!from || *from == '#')
+            continue;
+
+        char *to = next_field(&line);
+        if (!to) {
+            lwan_status_error("%s:%u: no location to redirect %s to", path,
+                              line_number, from);
+            return false;
+        }
+
+        struct redirect_target *target = &priv->targets[n_targets++];
+        target->to = to;
+        target->code = parse_http_code(next_field(&line), priv->code);
+
+        if (hash_add_unique(priv->map, from, target) < 0) {
+            lwan_status_error("%s:%u: %s is redirected more than once", path,
+                              line_number, from);
+            return false;
+        }
     }
 
-    priv->code = settings->code;
+    lwan_status_debug("Loaded %zu redirects from %s", n_targets, path);
 
-    return priv;
+    return true;
 }
 
 static void redirect_destroy(void *data)
@@ -68,29 +174,41 @@ static void redirect_destroy(void *data)
     struct redirect_priv *priv = data;
 
     if (priv) {
+        if (priv->map)
+            hash_unref(priv->map);
+        if (priv->map_loaded)
+            lwan_strbuf_free(&priv->map_contents);
+        free(priv->targets);
         free(priv->to);
         free(priv);
     }
 }
 
-static enum lwan_http_status parse_http_code(const char *code,
-                                             enum lwan_http_status fallback)
+static void *redirect_create(const char *prefix __attribute__((unused)),
+                             void *instance)
 {
-    const char *known;
-    int as_int;
+    struct lwan_redirect_settings *settings = instance;
+    struct redirect_priv *priv = calloc(1, sizeof(*priv));
 
-    if (!code)
-        return fallback;
+    if (!priv)
+        return NULL;
 
-    as_int = parse_int(code, 999);
-    if (as_int == 999)
-        return fallback;
+    priv->code = settings->code;
 
-    known = lwan_http_status_as_string_with_code((enum lwan_http_status)as_int);
-    if (!strncmp(known, "999", 3))
-        return fallback;
+    if (settings->to) {
+        priv->to = strdup(settings->to);
+        if (!priv->to)
+            goto error;
+    }
 
-    return (enum lwan_http_status)as_int;
+    if (settings->map && !load_map(priv, settings->map))
+        goto error;
+
+    return priv;
+
+error:
+    redirect_destroy(priv);
+    return NULL;
 }
 
 static void *redirect_create_from_hash(const char *prefix,
@@ -98,6 +216,7 @@ static void *redirect_create_from_hash(const char *prefix,
 {
     struct lwan_redirect_settings settings = {
         .to = hash_find(hash, "to"),
+        .map = hash_find(hash, "map"),
         .code =
             parse_http_code(hash_find(hash, "code"), HTTP_MOVED_PERMANENTLY),
     };
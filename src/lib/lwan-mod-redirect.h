@@ -25,6 +25,10 @@
 struct lwan_redirect_settings {
     char *to;
     enum lwan_http_status code;
+
+    /* File mapping exact paths to locations (and, optionally, codes); see
+     * the README for its format */
+    char *map;
 };
 
 LWAN_MODULE_FORWARD_DECL(redirect)
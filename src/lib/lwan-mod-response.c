@@ -18,34 +18,243 @@
  * USA.
  */
 
+#define _GNU_SOURCE
 #include <stdlib.h>
 #include <string.h>
 
 #include "lwan-private.h"
+#include "lwan-config.h"
+#include "lwan-io-wrappers.h"
 #include "lwan-mod-response.h"
 
+/* Pre-rendered responses depend on the HTTP version, and on whether the
+ * Connection header has to be sent (and which one); everything else is
+ * the same for every request. */
+#define N_PRERENDERED_VARIANTS 6
+
+struct prerendered {
+    enum lwan_http_status code;
+    size_t len;
+    size_t headers_len;
+    /* Where the Date header value goes, or 0 if there's no Date header */
+    size_t date_offset;
+    char bytes[];
+};
+
+struct response_priv {
+    enum lwan_http_status code;
+    char *mime_type;
+    char *body;
+    size_t body_len;
+    bool prerender;
+    bool no_date_header;
+
+    /* Rendered on first use, as the global response headers aren't known
+     * until then */
+    struct prerendered *variants[N_PRERENDERED_VARIANTS];
+};
+
+static size_t variant_index(const struct lwan_request *request)
+{
+    size_t index = (request->flags & REQUEST_IS_HTTP_1_0) ? 3 : 0;
+
+    if (request->conn->flags & CONN_SENT_CONNECTION_HEADER)
+        return index;
+    return index + ((request->conn->flags & CONN_IS_KEEP_ALIVE) ? 1 : 2);
+}
+
+static struct prerendered *render_variant(struct lwan_request *request,
+                                          const struct response_priv *priv)
+{
+    static const char date_header[] = "\r\nDate: ";
+    const enum lwan_request_flags saved_flags = request->flags;
+    char headers[DEFAULT_HEADERS_SIZE];
+    struct prerendered *variant;
+    size_t headers_len;
+
+    /* Headers are rendered the same way as for any other response, minus
+     * Expires, which would have to be patched in as well */
+    request->response.mime_type = priv->mime_type;
+    request->flags |= RESPONSE_NO_EXPIRES;
+    lwan_strbuf_set_static(request->response.buffer, priv->body,
+                           priv->body_len);
+    headers_len = lwan_prepare_response_header(request, priv->code, headers,
+                                               sizeof(headers));
+    request->flags = saved_flags;
+    lwan_strbuf_reset(request->response.buffer);
+    if (UNLIKELY(!headers_len))
+        return NULL;
+
+    char *date = memmem(headers, headers_len, date_header,
+                        sizeof(date_header) - 1);
+    if (UNLIKELY(!date))
+        return NULL;
+    if (priv->no_date_header) {
+        const size_t line_len = sizeof(date_header) - 1 + 29;
+
+        memmove(date, date + line_len,
+                headers_len - (size_t)(date - headers) - line_len);
+        headers_len -= line_len;
+    }
+
+    variant = malloc(sizeof(*variant) + headers_len + priv->body_len);
+    if (UNLIKELY(!variant))
+        return NULL;
+
+    variant->code = priv->code;
+    variant->len = headers_len + priv->body_len;
+    variant->headers_len = headers_len;
+    variant->date_offset = priv->no_date_header
+                               ? 0
+                               : (size_t)(date - headers) +
+                                     sizeof(date_header) - 1;
+    memcpy(mempcpy(variant->bytes, headers, headers_len), priv->body,
+           priv->body_len);
+
+    return variant;
+}
+
+static struct prerendered *get_variant(struct lwan_request *request,
+                                       struct response_priv *priv)
+{
+    struct prerendered **slot = &priv->variants[variant_index(request)];
+    struct prerendered *variant = __atomic_load_n(slot, __ATOMIC_ACQUIRE);
+    struct prerendered *expected = NULL;
+
+    if (LIKELY(variant))
+        return variant;
+
+    variant = render_variant(request, priv);
+    if (UNLIKELY(!variant))
+        return NULL;
+
+    /* Another thread might have rendered the same variant meanwhile */
+    if (!__atomic_compare_exchange_n(slot, &expected, variant, false,
+                                     __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        free(variant);
+        return expected;
+    }
+
+    return variant;
+}
+
+static enum lwan_http_status send_prerendered(struct lwan_request *request,
+                                              void *data)
+{
+    const struct prerendered *variant = data;
+    const size_t len = lwan_request_get_method(request) == REQUEST_METHOD_HEAD
+                           ? variant->headers_len
+                           : variant->len;
+    const int flags = (request->conn->flags & CONN_CORK) ? MSG_MORE : 0;
+    char buffer[DEFAULT_HEADERS_SIZE];
+
+    if (variant->date_offset && len <= sizeof(buffer)) {
+        memcpy(buffer, variant->bytes, len);
+        memcpy(buffer + variant->date_offset, request->conn->thread->date.date,
+               29);
+        lwan_send(request, buffer, len, flags);
+    } else if (variant->date_offset) {
+        struct iovec vec[] = {
+            {.iov_base = (void *)variant->bytes,
+             .iov_len = variant->date_offset},
+            {.iov_base = request->conn->thread->date.date, .iov_len = 29},
+            {.iov_base = (void *)(variant->bytes + variant->date_offset + 29),
+             .iov_len = len - variant->date_offset - 29},
+        };
+        lwan_writev(request, vec, N_ELEMENTS(vec));
+    } else {
+        lwan_send(request, variant->bytes, len, flags);
+    }
+
+    if (variant_index(request) % 3)
+        request->conn->flags |= CONN_SENT_CONNECTION_HEADER;
+
+    return variant->code;
+}
+
 static enum lwan_http_status
-response_handle_request(struct lwan_request *request __attribute__((unused)),
-                        struct lwan_response *response __attribute__((unused)),
+response_handle_request(struct lwan_request *request,
+                        struct lwan_response *response,
                         void *instance)
 {
-    return (enum lwan_http_status)(intptr_t)instance;
+    struct response_priv *priv = instance;
+
+    if (!priv->body)
+        return priv->code;
+
+    /* Headers that depend on the request, and HTTP/2 streams, go through
+     * the usual path */
+    if (priv->prerender && !request->helper->h2_stream &&
+        !(request->flags & (RESPONSE_INCLUDE_REQUEST_ID | REQUEST_ALLOW_CORS |
+                            REQUEST_WANTS_HSTS_HEADER))) {
+        struct prerendered *variant = get_variant(request, priv);
+
+        if (LIKELY(variant)) {
+            response->stream.callback = send_prerendered;
+            response->stream.data = variant;
+            request->flags |= RESPONSE_STREAM;
+            return priv->code;
+        }
+    }
+
+    response->mime_type = priv->mime_type;
+    lwan_strbuf_set_static(response->buffer, priv->body, priv->body_len);
+    return priv->code;
+}
+
+static void response_destroy(void *instance)
+{
+    struct response_priv *priv = instance;
+
+    if (!priv)
+        return;
+
+    for (size_t i = 0; i < N_PRERENDERED_VARIANTS; i++)
+        free(priv->variants[i]);
+    free(priv->mime_type);
+    free(priv->body);
+    free(priv);
 }
 
 static void *response_create(const char *prefix __attribute__((unused)),
                              void *instance)
 {
     struct lwan_response_settings *settings = instance;
+    struct response_priv *priv;
 
     const char *valid_code =
         lwan_http_status_as_string_with_code(settings->code);
-    if (!strncmp(valid_code, "999 ", 4)) {
+    if (!strncmp(valid_code, "999 ", 4) || valid_code[4] == '\0') {
         lwan_status_error("Code %d isn't a known HTTP status code",
                           settings->code);
         return NULL;
     }
 
-    return (void *)(uintptr_t)settings->code;
+    if (settings->prerender && !settings->body) {
+        lwan_status_error("Only responses with a `body` can be pre-rendered");
+        return NULL;
+    }
+
+    priv = calloc(1, sizeof(*priv));
+    if (!priv)
+        return NULL;
+
+    priv->code = settings->code;
+    priv->prerender = settings->prerender;
+    priv->no_date_header = settings->no_date_header;
+
+    if (settings->body) {
+        priv->body = strdup(settings->body);
+        priv->mime_type = strdup(settings->mime_type ? settings->mime_type
+                                                     : "text/plain");
+        if (!priv->body || !priv->mime_type) {
+            response_destroy(priv);
+            return NULL;
+        }
+        priv->body_len = strlen(priv->body);
+    }
+
+    return priv;
 }
 
 static void *response_create_from_hash(const char *prefix,
@@ -66,6 +275,10 @@ static void *response_create_from_hash(const char *prefix,
 
     struct lwan_response_settings settings = {
         .code = (enum lwan_http_status)code_as_int,
+        .body = hash_find(hash, "body"),
+        .mime_type = hash_find(hash, "mime_type"),
+        .prerender = parse_bool(hash_find(hash, "prerender"), false),
+        .no_date_header = !parse_bool(hash_find(hash, "date_header"), true),
     };
     return response_create(prefix, &settings);
 }
@@ -73,6 +286,7 @@ static void *response_create_from_hash(const char *prefix,
 static const struct lwan_module module = {
     .create = response_create,
     .create_from_hash = response_create_from_hash,
+    .destroy = response_destroy,
     .handle_request = response_handle_request,
 };
 
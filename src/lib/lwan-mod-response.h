@@ -23,6 +23,15 @@
 
 struct lwan_response_settings {
   enum lwan_http_status code;
+
+  /* If not set, the default response for code is generated */
+  const char *body;
+  const char *mime_type;
+
+  /* Renders the whole response once, so that each request only takes a
+   * single send() */
+  bool prerender;
+  bool no_date_header;
 };
 
 LWAN_MODULE_FORWARD_DECL(response)
@@ -29,6 +29,7 @@
 
 #include "patterns.h"
 #include "lwan-array.h"
+#include "lwan-cache.h"
 #include "lwan-mod-rewrite.h"
 #include "lwan-strbuf.h"
 
@@ -107,13 +108,69 @@ struct pattern {
         enum lwan_request_flags request_flags;
         /* FIXME: Use pahole to find alignment holes? */
     } condition;
+    struct {
+        /* Next pattern requiring the same literal, or -1 */
+        int next;
+        /* Literal has to be found at the start of the URL */
+        bool anchored;
+    } literal;
     enum pattern_flag flags;
 };
 
 DEFINE_ARRAY_TYPE(pattern_array, struct pattern)
 
+/* Longest literal (or anchored prefix) that's looked for in each pattern.
+ * Longer literals are truncated, which is fine as any piece of a literal
+ * has to be there if the whole literal is.  */
+#define LITERAL_MAX 64
+
+/* Node of an Aho-Corasick automaton that finds, in a single pass over the
+ * URL, which patterns have their literal present in it.  This is used as a
+ * prefilter so that str_find() -- which interprets the pattern from
+ * scratch every time -- is only called for patterns that could match.  */
+struct literal_node {
+    uint32_t first_child;
+    uint32_t next_sibling;
+    uint32_t fail;
+    /* Closest node in the failure chain that ends the literal of at least
+     * one pattern, or 0 */
+    uint32_t dict;
+    /* First pattern with this literal, or -1 */
+    int first_pattern;
+    unsigned char depth;
+    unsigned char c;
+};
+
+DEFINE_ARRAY_TYPE(literal_node_array, struct literal_node)
+
 struct private_data {
     struct pattern_array patterns;
+
+    struct literal_node_array literals;
+    uint32_t root_next[256];
+    /* Bitmap of patterns that have no literal to look for */
+    uint64_t *without_literal;
+    size_t n_words;
+
+    /* Maps a URL to the outcome of the patterns that only depend on it;
+     * NULL if the decision cache is disabled.  */
+    struct cache *decisions;
+    char *prefix;
+};
+
+struct rewrite_decision {
+    struct cache_entry base;
+    /* PATTERN_HANDLE_REDIRECT, PATTERN_HANDLE_REWRITE, or 0 if no pattern
+     * matched */
+    enum pattern_flag action;
+    char target[];
+};
+
+struct decision_ctx {
+    struct lwan_request *request;
+    const uint64_t *candidates;
+    /* First pattern that couldn't be taken into account while deciding */
+    size_t next;
 };
 
 static enum lwan_http_status module_redirect_to(struct lwan_request *request,
@@ -470,56 +527,259 @@ static bool condition_matches(struct lwan_request *request,
     return true;
 }
 
-static enum lwan_http_status
-rewrite_handle_request(struct lwan_request *request,
-                       struct lwan_response *response __attribute__((unused)),
-                       void *instance)
+static bool apply_pattern(struct lwan_request *request,
+                          const struct pattern *p,
+                          enum lwan_http_status *status)
 {
-    struct private_data *pd = instance;
     const char *url = request->url.value;
+    struct str_find sf[MAXCAPTURES];
     char final_url[PATH_MAX];
-    struct pattern *p;
+    const char *expanded = NULL;
+    const char *errmsg;
+    int captures;
 
-    LWAN_ARRAY_FOREACH(&pd->patterns, p) {
-        struct str_find sf[MAXCAPTURES];
-        const char *expanded = NULL;
+    captures = str_find(url, p->pattern, sf, MAXCAPTURES, &errmsg);
+    if (captures <= 0)
+        return false;
+
+    if (!condition_matches(request, p, sf, captures, final_url))
+        return false;
+
+    switch (p->flags & PATTERN_EXPAND_MASK) {
+#ifdef LWAN_HAVE_LUA
+    case PATTERN_EXPAND_LUA:
+        expanded = expand_lua(request, p, url, final_url, sf, captures);
+        break;
+#endif
+    case PATTERN_EXPAND_LWAN:
+        expanded = expand(p, url, final_url, sf, captures);
+        break;
+    }
+
+    if (LIKELY(expanded)) {
+        switch (p->flags & PATTERN_HANDLE_MASK) {
+        case PATTERN_HANDLE_REDIRECT:
+            *status = module_redirect_to(request, expanded);
+            return true;
+        case PATTERN_HANDLE_REWRITE:
+            *status = module_rewrite_as(request, expanded);
+            return true;
+        }
+    }
+
+    *status = HTTP_INTERNAL_ERROR;
+    return true;
+}
+
+static ALWAYS_INLINE uint32_t literal_child(const struct literal_node *nodes,
+                                            uint32_t node,
+                                            unsigned char c)
+{
+    for (uint32_t child = nodes[node].first_child; child;
+         child = nodes[child].next_sibling) {
+        if (nodes[child].c == c)
+            return child;
+    }
+
+    return 0;
+}
+
+static void find_candidates(const struct private_data *pd,
+                            const struct lwan_value *url,
+                            uint64_t *candidates)
+{
+    const struct literal_node *nodes =
+        literal_node_array_get_array((struct literal_node_array *)&pd->literals);
+    const struct pattern *patterns =
+        pattern_array_get_array((struct pattern_array *)&pd->patterns);
+    uint32_t state = 0;
+
+    memcpy(candidates, pd->without_literal, pd->n_words * sizeof(uint64_t));
+
+    for (size_t i = 0; i < url->len; i++) {
+        const unsigned char c = (unsigned char)url->value[i];
+        uint32_t next = 0;
+
+        while (state && !(next = literal_child(nodes, state, c)))
+            state = nodes[state].fail;
+        state = state ? next : pd->root_next[c];
+
+        uint32_t out = nodes[state].first_pattern >= 0 ? state : nodes[state].dict;
+        for (; out; out = nodes[out].dict) {
+            for (int idx = nodes[out].first_pattern; idx >= 0;
+                 idx = patterns[idx].literal.next) {
+                if (patterns[idx].literal.anchored && nodes[out].depth != i + 1)
+                    continue;
+
+                candidates[idx / 64] |= 1ull << (idx % 64);
+            }
+        }
+    }
+}
+
+/* Index of the first pattern, starting at `from`, that has to be tried;
+ * -1 if there are none left.  Without a candidate bitmap, every pattern
+ * has to be tried.  */
+static ssize_t next_candidate(const struct private_data *pd,
+                              const uint64_t *candidates,
+                              size_t from)
+{
+    if (!candidates) {
+        const size_t len = pattern_array_len((struct pattern_array *)&pd->patterns);
+
+        return from < len ? (ssize_t)from : -1;
+    }
+
+    for (size_t word = from / 64; word < pd->n_words; word++) {
+        uint64_t bits = candidates[word];
+
+        if (word == from / 64)
+            bits &= ~0ull << (from % 64);
+        if (bits)
+            return (ssize_t)(word * 64 + (size_t)__builtin_ctzll(bits));
+    }
+
+    return -1;
+}
+
+/* Patterns whose outcome is solely determined by the URL can have it
+ * cached: back references only look at the captures, but every other
+ * condition looks at the request, and so can Lua scripts.  */
+static ALWAYS_INLINE bool pattern_depends_only_on_path(const struct pattern *p)
+{
+    if ((p->flags & PATTERN_EXPAND_MASK) != PATTERN_EXPAND_LWAN)
+        return false;
+
+    return !(p->flags &
+             (PATTERN_COND_MASK & ~(unsigned int)PATTERN_COND_BACKREF));
+}
+
+static struct cache_entry *
+create_decision(const void *key, void *context, void *create_ctx)
+{
+    const struct private_data *pd = context;
+    struct decision_ctx *ctx = create_ctx;
+    const struct pattern *patterns =
+        pattern_array_get_array((struct pattern_array *)&pd->patterns);
+    const char *url = key;
+    struct str_find sf[MAXCAPTURES];
+    char final_url[PATH_MAX];
+    const char *expanded = "";
+    enum pattern_flag action = 0;
+    struct rewrite_decision *decision;
+    ssize_t idx;
+
+    for (idx = next_candidate(pd, ctx->candidates, 0); idx >= 0;
+         idx = next_candidate(pd, ctx->candidates, (size_t)idx + 1)) {
+        const struct pattern *p = &patterns[idx];
         const char *errmsg;
         int captures;
 
+        if (!pattern_depends_only_on_path(p))
+            goto not_cacheable;
+
         captures = str_find(url, p->pattern, sf, MAXCAPTURES, &errmsg);
         if (captures <= 0)
             continue;
 
-        if (!condition_matches(request, p, sf, captures, final_url))
+        if (!condition_matches(ctx->request, p, sf, captures, final_url))
             continue;
 
-        switch (p->flags & PATTERN_EXPAND_MASK) {
-#ifdef LWAN_HAVE_LUA
-        case PATTERN_EXPAND_LUA:
-            expanded = expand_lua(request, p, url, final_url, sf, captures);
-            break;
-#endif
-        case PATTERN_EXPAND_LWAN:
-            expanded = expand(p, url, final_url, sf, captures);
-            break;
-        }
+        /* Let the uncached path deal with (and report) errors.  */
+        expanded = expand(p, url, final_url, sf, captures);
+        if (UNLIKELY(!expanded))
+            goto not_cacheable;
 
-        if (LIKELY(expanded)) {
-            switch (p->flags & PATTERN_HANDLE_MASK) {
-            case PATTERN_HANDLE_REDIRECT:
-                return module_redirect_to(request, expanded);
-            case PATTERN_HANDLE_REWRITE:
-                return module_rewrite_as(request, expanded);
-            }
+        action = p->flags & PATTERN_HANDLE_MASK;
+        break;
+    }
+
+    const size_t len = strlen(expanded);
+    decision = malloc(sizeof(*decision) + len + 1);
+    if (UNLIKELY(!decision))
+        return NULL;
+
+    /* The budget set with cache_max_entries is in number of entries.  */
+    decision->base.cost = 1;
+    decision->action = action;
+    memcpy(decision->target, expanded, len + 1);
+
+    return (struct cache_entry *)decision;
+
+not_cacheable:
+    ctx->next = (size_t)idx;
+    return NULL;
+}
+
+static void destroy_decision(struct cache_entry *entry,
+                             void *context __attribute__((unused)))
+{
+    free(entry);
+}
+
+static enum lwan_http_status
+apply_decision(struct lwan_request *request,
+               const struct rewrite_decision *decision)
+{
+    switch (decision->action) {
+    case PATTERN_HANDLE_REDIRECT:
+        return module_redirect_to(request, decision->target);
+    case PATTERN_HANDLE_REWRITE:
+        return module_rewrite_as(request, decision->target);
+    default:
+        return HTTP_NOT_FOUND;
+    }
+}
+
+static enum lwan_http_status
+rewrite_handle_request(struct lwan_request *request,
+                       struct lwan_response *response __attribute__((unused)),
+                       void *instance)
+{
+    struct private_data *pd = instance;
+    uint64_t *candidates = NULL;
+    enum lwan_http_status status;
+    struct pattern *p;
+    size_t from = 0;
+
+    if (pd->n_words) {
+        candidates =
+            coro_malloc(request->conn->coro, pd->n_words * sizeof(uint64_t));
+        if (UNLIKELY(!candidates))
+            return HTTP_INTERNAL_ERROR;
+
+        find_candidates(pd, &request->url, candidates);
+    }
+
+    if (pd->decisions) {
+        struct decision_ctx ctx = {.request = request, .candidates = candidates};
+        struct cache_entry *entry;
+        int error;
+
+        entry = cache_get_and_ref_entry_with_ctx(
+            pd->decisions, request->url.value, &ctx, &error);
+        if (LIKELY(entry)) {
+            status = apply_decision(request, (struct rewrite_decision *)entry);
+            cache_entry_unref(pd->decisions, entry);
+            return status;
         }
 
-        return HTTP_INTERNAL_ERROR;
+        /* Patterns before ctx.next have already been ruled out.  */
+        from = ctx.next;
+    }
+
+    /* Patterns are still tried in the order they were declared.  */
+    p = pattern_array_get_array(&pd->patterns);
+    for (ssize_t idx = next_candidate(pd, candidates, from); idx >= 0;
+         idx = next_candidate(pd, candidates, (size_t)idx + 1)) {
+        if (apply_pattern(request, &p[idx], &status))
+            return status;
     }
 
     return HTTP_NOT_FOUND;
 }
 
-static void *rewrite_create(const char *prefix __attribute__((unused)),
+static void *rewrite_create(const char *prefix,
                             void *instance __attribute__((unused)))
 {
     struct private_data *pd = malloc(sizeof(*pd));
@@ -527,7 +787,18 @@ static void *rewrite_create(const char *prefix __attribute__((unused)),
     if (!pd)
         return NULL;
 
+    pd->prefix = strdup(prefix);
+    if (!pd->prefix) {
+        free(pd);
+        return NULL;
+    }
+
     pattern_array_init(&pd->patterns);
+    literal_node_array_init(&pd->literals);
+    memset(pd->root_next, 0, sizeof(pd->root_next));
+    pd->without_literal = NULL;
+    pd->n_words = 0;
+    pd->decisions = NULL;
 
     return pd;
 }
@@ -537,6 +808,9 @@ static void rewrite_destroy(void *instance)
     struct private_data *pd = instance;
     struct pattern *iter;
 
+    if (pd->decisions)
+        cache_destroy(pd->decisions);
+
     LWAN_ARRAY_FOREACH(&pd->patterns, iter) {
         free(iter->pattern);
         free(iter->expand_pattern);
@@ -574,6 +848,9 @@ static void rewrite_destroy(void *instance)
     }
 
     pattern_array_reset(&pd->patterns);
+    literal_node_array_reset(&pd->literals);
+    free(pd->without_literal);
+    free(pd->prefix);
     free(pd);
 }
 
@@ -956,15 +1233,326 @@ out_no_free:
     return false;
 }
 
+/* Returns a pointer past the end of the set starting at @p (which points
+ * right after the opening bracket), just like classEnd() in Lua.  */
+static const char *skip_set(const char *p)
+{
+    if (*p == '^')
+        p++;
+
+    do {
+        if (*p == '\0')
+            return NULL;
+        if (*p++ == '%' && *p != '\0')
+            p++;
+    } while (*p != ']');
+
+    return p + 1;
+}
+
+static bool is_quantifier(char c)
+{
+    return c == '*' || c == '+' || c == '-' || c == '?';
+}
+
+struct literal_runs {
+    char run[LITERAL_MAX];
+    size_t run_len;
+
+    char best[LITERAL_MAX];
+    size_t best_len;
+
+    char prefix[LITERAL_MAX];
+    size_t prefix_len;
+    bool in_prefix;
+};
+
+static void end_run(struct literal_runs *runs)
+{
+    if (runs->in_prefix) {
+        memcpy(runs->prefix, runs->run, runs->run_len);
+        runs->prefix_len = runs->run_len;
+        runs->in_prefix = false;
+    }
+
+    if (runs->run_len > runs->best_len) {
+        memcpy(runs->best, runs->run, runs->run_len);
+        runs->best_len = runs->run_len;
+    }
+
+    runs->run_len = 0;
+}
+
+static void append_to_run(struct literal_runs *runs, char c)
+{
+    if (runs->run_len == LITERAL_MAX)
+        end_run(runs);
+
+    runs->run[runs->run_len++] = c;
+}
+
+/* Finds a literal that has to be present in any string matched by
+ * @pattern: either a prefix (if the pattern is anchored), or the longest
+ * run of characters that aren't special and aren't optional.  Returns 0
+ * if there's nothing to look for (or if the pattern is malformed, in
+ * which case str_find() will complain about it.)  */
+static size_t find_required_literal(const char *pattern,
+                                    char literal[static LITERAL_MAX],
+                                    bool *anchored)
+{
+    struct literal_runs runs = {.in_prefix = *pattern == '^'};
+    const char *p = pattern + runs.in_prefix;
+
+    while (*p) {
+        const char *next;
+        int c;
+
+        switch (*p) {
+        case '(':
+        case ')':
+            /* Captures don't consume any characters.  */
+            p++;
+            continue;
+        case '$':
+            if (p[1] == '\0')
+                goto out;
+            c = '$';
+            next = p + 1;
+            break;
+        case '.':
+            c = -1;
+            next = p + 1;
+            break;
+        case '[':
+            c = -1;
+            next = skip_set(p + 1);
+            if (!next)
+                return 0;
+            break;
+        case '%':
+            if (p[1] == '\0')
+                return 0;
+
+            if (p[1] == 'b') {
+                /* %bxy can't be followed by a quantifier.  */
+                if (!p[2] || !p[3])
+                    return 0;
+                c = -2;
+                next = p + 4;
+            } else if (p[1] == 'f') {
+                if (p[2] != '[')
+                    return 0;
+                c = -2;
+                next = skip_set(p + 3);
+                if (!next)
+                    return 0;
+            } else if (isdigit((unsigned char)p[1])) {
+                /* Back references can't be followed by a quantifier.  */
+                c = -2;
+                next = p + 2;
+            } else if (isalpha((unsigned char)p[1])) {
+                c = -1;
+                next = p + 2;
+            } else {
+                c = (unsigned char)p[1];
+                next = p + 2;
+            }
+            break;
+        default:
+            c = (unsigned char)*p;
+            next = p + 1;
+        }
+
+        if (c >= 0 && !is_quantifier(*next)) {
+            append_to_run(&runs, (char)c);
+            p = next;
+        } else if (c >= 0 && *next == '+') {
+            /* At least one `c` is there, but it might be followed by
+             * more, so it both ends a run and starts a new one. */
+            append_to_run(&runs, (char)c);
+            end_run(&runs);
+            append_to_run(&runs, (char)c);
+            p = next + 1;
+        } else {
+            end_run(&runs);
+            p = (c != -2 && is_quantifier(*next)) ? next + 1 : next;
+        }
+    }
+
+out:
+    end_run(&runs);
+
+    if (*pattern == '^' && runs.prefix_len && runs.prefix_len >= runs.best_len) {
+        *anchored = true;
+        memcpy(literal, runs.prefix, runs.prefix_len);
+        return runs.prefix_len;
+    }
+
+    *anchored = false;
+    memcpy(literal, runs.best, runs.best_len);
+    return runs.best_len;
+}
+
+static bool add_literal(struct private_data *pd,
+                        int idx,
+                        const char *literal,
+                        size_t len)
+{
+    struct literal_node *nodes = literal_node_array_get_array(&pd->literals);
+    uint32_t node = 0;
+
+    for (size_t i = 0; i < len; i++) {
+        const unsigned char c = (unsigned char)literal[i];
+        uint32_t child = literal_child(nodes, node, c);
+
+        if (!child) {
+            struct literal_node *new_node =
+                literal_node_array_append(&pd->literals);
+            if (!new_node)
+                return false;
+
+            nodes = literal_node_array_get_array(&pd->literals);
+            child = (uint32_t)literal_node_array_get_elem_index(&pd->literals,
+                                                                 new_node);
+            *new_node = (struct literal_node){
+                .next_sibling = nodes[node].first_child,
+                .first_pattern = -1,
+                .depth = (unsigned char)(i + 1),
+                .c = c,
+            };
+            nodes[node].first_child = child;
+        }
+
+        node = child;
+    }
+
+    struct pattern *pattern = pattern_array_get_elem(&pd->patterns, (size_t)idx);
+    pattern->literal.next = nodes[node].first_pattern;
+    nodes[node].first_pattern = idx;
+
+    return true;
+}
+
+static bool link_literals(struct private_data *pd)
+{
+    const size_t n_nodes = literal_node_array_len(&pd->literals);
+    struct literal_node *nodes = literal_node_array_get_array(&pd->literals);
+    uint32_t *queue = calloc(n_nodes, sizeof(*queue));
+    size_t head = 0, tail = 0;
+
+    if (!queue)
+        return false;
+
+    /* Failure links are computed breadth-first, as they always point
+     * to shallower nodes.  */
+    for (uint32_t child = nodes[0].first_child; child;
+         child = nodes[child].next_sibling) {
+        pd->root_next[nodes[child].c] = child;
+        queue[tail++] = child;
+    }
+
+    while (head < tail) {
+        uint32_t node = queue[head++];
+
+        for (uint32_t child = nodes[node].first_child; child;
+             child = nodes[child].next_sibling) {
+            uint32_t fail = nodes[node].fail;
+            uint32_t target;
+
+            while (!(target = literal_child(nodes, fail, nodes[child].c)) && fail)
+                fail = nodes[fail].fail;
+
+            nodes[child].fail = target;
+            nodes[child].dict = nodes[target].first_pattern >= 0
+                                    ? target
+                                    : nodes[target].dict;
+            queue[tail++] = child;
+        }
+    }
+
+    free(queue);
+    return true;
+}
+
+static bool compile_literals(struct private_data *pd)
+{
+    const size_t n_patterns = pattern_array_len(&pd->patterns);
+    struct literal_node *root;
+    bool has_literal = false;
+
+    if (!n_patterns)
+        return true;
+
+    pd->n_words = (n_patterns + 63) / 64;
+    pd->without_literal = calloc(pd->n_words, sizeof(uint64_t));
+    if (!pd->without_literal)
+        return false;
+
+    root = literal_node_array_append(&pd->literals);
+    if (!root)
+        return false;
+    *root = (struct literal_node){.first_pattern = -1};
+
+    for (size_t i = 0; i < n_patterns; i++) {
+        struct pattern *pattern = pattern_array_get_elem(&pd->patterns, i);
+        char literal[LITERAL_MAX];
+        size_t len =
+            find_required_literal(pattern->pattern, literal,
+                                  &pattern->literal.anchored);
+
+        pattern->literal.next = -1;
+
+        if (!len) {
+            pd->without_literal[i / 64] |= 1ull << (i % 64);
+            continue;
+        }
+
+        if (!add_literal(pd, (int)i, literal, len))
+            return false;
+        has_literal = true;
+    }
+
+    if (!has_literal) {
+        /* Nothing to gain from going through the automaton.  */
+        free(pd->without_literal);
+        pd->without_literal = NULL;
+        pd->n_words = 0;
+        return true;
+    }
+
+    return link_literals(pd);
+}
+
+static bool has_path_only_patterns(struct private_data *pd)
+{
+    struct pattern *p;
+
+    LWAN_ARRAY_FOREACH(&pd->patterns, p) {
+        if (pattern_depends_only_on_path(p))
+            return true;
+    }
+
+    return false;
+}
+
 static bool rewrite_parse_conf(void *instance, struct config *config)
 {
     struct private_data *pd = instance;
     const struct config_line *line;
+    unsigned int cache_for = 0;
+    unsigned int cache_max_entries = 4096;
 
     while ((line = config_read_line(config))) {
         switch (line->type) {
         case CONFIG_LINE_TYPE_LINE:
-            config_error(config, "Unknown option: %s", line->key);
+            if (streq(line->key, "cache_for")) {
+                cache_for = parse_time_period(line->value, 0);
+            } else if (streq(line->key, "cache_max_entries")) {
+                cache_max_entries =
+                    (unsigned int)parse_int(line->value, 4096);
+            } else {
+                config_error(config, "Unknown option: %s", line->key);
+            }
             break;
         case CONFIG_LINE_TYPE_SECTION:
             if (streq(line->key, "pattern")) {
@@ -978,7 +1566,35 @@ static bool rewrite_parse_conf(void *instance, struct config *config)
         }
     }
 
-    return !config_last_error(config);
+    if (config_last_error(config))
+        return false;
+
+    if (!compile_literals(pd)) {
+        config_error(config, "Could not compile patterns");
+        return false;
+    }
+
+    if (cache_for) {
+        if (!has_path_only_patterns(pd)) {
+            lwan_status_warning("No rewrite rule for %s depends only on the "
+                                "request path; not caching decisions",
+                                pd->prefix);
+            return true;
+        }
+
+        pd->decisions = cache_create(create_decision, destroy_decision, pd,
+                                     (time_t)cache_for);
+        if (!pd->decisions) {
+            config_error(config, "Could not create decision cache");
+            return false;
+        }
+
+        cache_set_name(pd->decisions, "rewrite %s", pd->prefix);
+        if (cache_max_entries)
+            cache_set_max_cost(pd->decisions, cache_max_entries);
+    }
+
+    return true;
 }
 
 static const struct lwan_module module = {
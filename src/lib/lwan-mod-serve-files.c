@@ -22,11 +22,19 @@
 #include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <inttypes.h>
 #include <limits.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
+#if defined(__linux__)
+#include <linux/magic.h>
+#include <sys/inotify.h>
+#include <sys/vfs.h>
+#endif
+#include <unistd.h>
 #include <zlib.h>
 
 #include "lwan-private.h"
@@ -46,10 +54,6 @@
 #include <brotli/encode.h>
 #endif
 
-#if defined(LWAN_HAVE_ZSTD)
-#include <zstd.h>
-#endif
-
 static const struct lwan_key_value deflate_compression_hdr[] = {
     {"Content-Encoding", "deflate"}, {}
 };
@@ -67,14 +71,35 @@ static const struct lwan_key_value zstd_compression_hdr[] = {
 };
 #endif
 
+/* Sent with images that have variants in other formats */
+static const struct lwan_key_value vary_accept_hdr = {"Vary", "Accept"};
+
 static const int open_mode = O_RDONLY | O_NONBLOCK | O_CLOEXEC;
 
+/* Cost, in bytes, charged to the cache for each file descriptor kept open
+ * by an entry.  This is a rough estimate of the kernel memory needed to
+ * keep a file open, and ensures that entries served with sendfile() are
+ * bounded by the cache budget as well.  */
+static const size_t open_file_cost = 4096;
+
+/* Files smaller than this are mmapped and compressed in memory when
+ * cached; larger files are sent with sendfile(), which never copies their
+ * contents to or from userspace.  (This is also why mmapped files are sent
+ * with a plain writev(): at these sizes, pinning pages for MSG_ZEROCOPY and
+ * reaping its completions costs more than copying.) */
+static const off_t mmap_size_threshold = 16384;
+
 struct file_cache_entry;
+struct precompress;
+struct watcher;
+struct archive;
 
 enum serve_files_priv_flags {
     SERVE_FILES_SERVE_PRECOMPRESSED = 1 << 0,
     SERVE_FILES_AUTO_INDEX = 1 << 1,
     SERVE_FILES_AUTO_INDEX_README = 1 << 2,
+    SERVE_FILES_POPULATE = 1 << 3,
+    SERVE_FILES_HUGE_PAGES = 1 << 4,
 };
 
 struct serve_files_priv {
@@ -90,8 +115,29 @@ struct serve_files_priv {
     char *prefix;
 
     struct lwan_tpl *directory_list_tpl;
+    size_t dir_page_size;
 
     size_t read_ahead;
+
+    /* Bytes of file contents locked in memory, and how many can be */
+    size_t locked_size;
+    size_t lock_max_size;
+
+    /* Directory with compressed copies written by the precompressor, or
+     * -1 if none */
+    int precompressed_fd;
+    struct precompress *precompress;
+
+    /* Invalidates cache entries as files under root_path change, or
+     * NULL if not enabled */
+    struct watcher *watcher;
+
+    /* Archive files are served from instead of root_path, or NULL */
+    struct archive *archive;
+
+    /* Path relative to root_path -> Link header value sent in a 103 Early
+     * Hints response before the file, or NULL if there's no manifest */
+    struct hash *early_hints;
 };
 
 struct cache_funcs {
@@ -113,6 +159,8 @@ struct mmap_cache_data {
 #if defined(LWAN_HAVE_ZSTD)
     struct lwan_value zstd;
 #endif
+    /* Set if uncompressed has been decompressed from an archive */
+    bool inflated;
 };
 
 struct sendfile_cache_data {
@@ -120,14 +168,34 @@ struct sendfile_cache_data {
         int fd;
         size_t size;
     } compressed, uncompressed;
+    /* Mapping of the uncompressed file, only kept to lock its pages in
+     * memory */
+    void *locked;
+};
+
+struct dir_entry {
+    const char *name;
+    /* NULL for directories */
+    const char *mime_type;
+    off_t size;
 };
 
 struct dir_list_cache_data {
+    /* First page of the listing, as rendered by the template */
     struct lwan_strbuf rendered;
     struct lwan_value deflated;
 #if defined(LWAN_HAVE_BROTLI)
     struct lwan_value brotli;
 #endif
+
+    /* Snapshot of the directory, sorted by name, that every page (and
+     * every format) is rendered from; names point into @names */
+    struct dir_entry *entries;
+    size_t n_entries;
+    struct lwan_strbuf names;
+
+    char *rel_path;
+    const struct serve_files_priv *priv;
 };
 
 struct redir_cache_data {
@@ -142,9 +210,26 @@ struct file_cache_entry {
         time_t integer;
     } last_modified;
 
+    /* Weak form of the ETag (W/"..."); the strong form starts at
+     * etag + 2.  Empty if the entry doesn't have one. */
+    char etag[64];
+
     const char *mime_type;
     const struct cache_funcs *funcs;
 
+    /* Bytes counted against lock_max_size; unlocked when unmapped */
+    size_t locked_size;
+
+    /* Owned by serve_files_priv::early_hints; NULL if there are none */
+    const char *early_hints;
+
+    /* Encodings (REQUEST_ACCEPT_*) that weren't compressed because no
+     * client had asked for them lately; see encoding_wanted() */
+    unsigned int skipped_encodings;
+
+    /* Set for PNG and JPEG images with pre-generated variants */
+    struct image_variants *images;
+
     union {
         struct mmap_cache_data mmap_cache_data;
         struct sendfile_cache_data sendfile_cache_data;
@@ -153,10 +238,42 @@ struct file_cache_entry {
     };
 };
 
+/* Pre-generated copies of PNG and JPEG images in formats that are usually
+ * smaller ($FILE.avif and $FILE.webp, next to $FILE), served to clients
+ * that accept them.  Which ones exist is found out once per entry.  */
+struct image_variant {
+    int fd;
+    size_t size;
+    const char *mime_type;
+    /* Strong form; the ETag of the original image, with the format
+     * appended */
+    char etag[80];
+};
+
+static const struct {
+    const char *suffix;
+    const char *mime_type;
+} image_formats[] = {
+    {".avif", "image/avif"},
+    {".webp", "image/webp"},
+};
+
+struct image_variants {
+    struct image_variant variants[N_ELEMENTS(image_formats)];
+    size_t n_variants;
+};
+
 struct file_list {
     const char *full_path;
     const char *rel_path;
     const char *readme;
+    /* Cursor for the page after this one (already URL-encoded), or NULL
+     * if this is the last one */
+    const char *next_page;
+
+    const struct dir_entry *entries;
+    size_t n_entries;
+
     struct {
         coro_function_t generator;
 
@@ -207,6 +324,13 @@ static void redir_free(struct file_cache_entry *ce);
 static enum lwan_http_status redir_serve(struct lwan_request *request,
                                          void *data);
 
+static void archive_free(struct file_cache_entry *ce);
+
+static const struct cache_funcs archive_funcs = {
+    .free = archive_free,
+    .serve = mmap_serve,
+};
+
 static const struct cache_funcs mmap_funcs = {
     .init = mmap_init,
     .free = mmap_free,
@@ -237,6 +361,7 @@ static const struct lwan_var_descriptor file_list_desc[] = {
     TPL_VAR_STR_ESCAPE(full_path),
     TPL_VAR_STR_ESCAPE(rel_path),
     TPL_VAR_STR_ESCAPE(readme),
+    TPL_VAR_STR(next_page),
     TPL_VAR_SEQUENCE(file_list,
                      directory_list_generator,
                      ((const struct lwan_var_descriptor[]){
@@ -257,66 +382,43 @@ static int directory_list_generator(struct coro *coro, void *data)
 {
     static const char *zebra_classes[] = {"odd", "even"};
     struct file_list *fl = data;
-    struct dirent *entry;
-    int zebra_class = 0;
-    DIR *dir;
-    int fd;
-
-    dir = opendir(fl->full_path);
-    if (!dir)
-        return 0;
-
-    fd = dirfd(dir);
-    if (fd < 0)
-        goto out;
-
-    while ((entry = readdir(dir))) {
-        struct stat st;
-
-        if (entry->d_name[0] == '.')
-            continue;
 
-        if (fstatat(fd, entry->d_name, &st, 0) < 0)
-            continue;
+    for (size_t i = 0; i < fl->n_entries; i++) {
+        const struct dir_entry *entry = &fl->entries[i];
 
-        if (S_ISDIR(st.st_mode)) {
+        if (!entry->mime_type) {
             fl->file_list.icon = "folder";
             fl->file_list.icon_alt = "DIR";
             fl->file_list.type = "directory";
             fl->file_list.slash_if_dir = "/";
-        } else if (S_ISREG(st.st_mode)) {
+        } else {
             fl->file_list.icon = "file";
             fl->file_list.icon_alt = "FILE";
-            fl->file_list.type =
-                lwan_determine_mime_type_for_file_name(entry->d_name);
+            fl->file_list.type = entry->mime_type;
             fl->file_list.slash_if_dir = "";
-        } else {
-            continue;
         }
 
-        if (st.st_size < 1024) {
-            fl->file_list.size = (int)st.st_size;
+        if (entry->size < 1024) {
+            fl->file_list.size = (int)entry->size;
             fl->file_list.unit = "B";
-        } else if (st.st_size < 1024 * 1024) {
-            fl->file_list.size = (int)(st.st_size / 1024);
+        } else if (entry->size < 1024 * 1024) {
+            fl->file_list.size = (int)(entry->size / 1024);
             fl->file_list.unit = "KiB";
-        } else if (st.st_size < 1024 * 1024 * 1024) {
-            fl->file_list.size = (int)(st.st_size / (1024 * 1024));
+        } else if (entry->size < 1024 * 1024 * 1024) {
+            fl->file_list.size = (int)(entry->size / (1024 * 1024));
             fl->file_list.unit = "MiB";
         } else {
-            fl->file_list.size = (int)(st.st_size / (1024 * 1024 * 1024));
+            fl->file_list.size = (int)(entry->size / (1024 * 1024 * 1024));
             fl->file_list.unit = "GiB";
         }
 
-        fl->file_list.name = entry->d_name;
-        fl->file_list.zebra_class = zebra_classes[zebra_class++ % 2];
+        fl->file_list.name = entry->name;
+        fl->file_list.zebra_class = zebra_classes[i % 2];
 
         if (coro_yield(coro, 1))
             break;
     }
 
-out:
-    closedir(dir);
     return 0;
 }
 
@@ -329,39 +431,18 @@ static ALWAYS_INLINE bool is_compression_worthy(const size_t compressed_sz,
     return ((compressed_sz + deflated_header_size) < uncompressed_sz);
 }
 
-static void realloc_if_needed(struct lwan_value *value, size_t bound)
-{
-    if (bound > value->len) {
-        char *tmp = realloc(value->value, value->len);
-
-        if (tmp)
-            value->value = tmp;
-    }
-}
-
 static void deflate_value(const struct lwan_value *uncompressed,
                           struct lwan_value *compressed)
 {
-    const unsigned long bound = compressBound(uncompressed->len);
-
-    compressed->len = bound;
-
-    if (UNLIKELY(!(compressed->value = malloc(bound))))
-        goto error_zero_out;
-
-    if (UNLIKELY(compress((Bytef *)compressed->value, &compressed->len,
-                          (Bytef *)uncompressed->value,
-                          uncompressed->len) != Z_OK))
-        goto error_free_compressed;
-
-    if (is_compression_worthy(compressed->len, uncompressed->len))
-        return realloc_if_needed(compressed, bound);
+    if (UNLIKELY(!lwan_compress_value(LWAN_ENCODING_DEFLATE,
+                                      Z_DEFAULT_COMPRESSION, uncompressed,
+                                      compressed)))
+        return;
 
-error_free_compressed:
-    free(compressed->value);
-    compressed->value = NULL;
-error_zero_out:
-    compressed->len = 0;
+    if (!is_compression_worthy(compressed->len, uncompressed->len)) {
+        free(compressed->value);
+        *compressed = (struct lwan_value){};
+    }
 }
 
 #if defined(LWAN_HAVE_BROTLI)
@@ -369,31 +450,17 @@ static void brotli_value(const struct lwan_value *uncompressed,
                          struct lwan_value *brotli,
                          const struct lwan_value *deflated)
 {
-    const unsigned long bound =
-        BrotliEncoderMaxCompressedSize(uncompressed->len);
-
-    brotli->len = bound;
-
-    if (UNLIKELY(!(brotli->value = malloc(bound))))
-        goto error_zero_out;
-
-    if (UNLIKELY(
-            BrotliEncoderCompress(BROTLI_DEFAULT_QUALITY, BROTLI_DEFAULT_WINDOW,
-                                  BROTLI_DEFAULT_MODE, uncompressed->len,
-                                  (uint8_t *)uncompressed->value, &brotli->len,
-                                  (uint8_t *)brotli->value) != BROTLI_TRUE))
-        goto error_free_compressed;
+    if (UNLIKELY(!lwan_compress_value(LWAN_ENCODING_BROTLI,
+                                      BROTLI_DEFAULT_QUALITY, uncompressed,
+                                      brotli)))
+        return;
 
     /* is_compression_worthy() is already called for deflate-compressed data,
      * so only consider brotli-compressed data if it's worth it WRT deflate */
-    if (LIKELY(brotli->len < deflated->len))
-        return realloc_if_needed(brotli, bound);
-
-error_free_compressed:
-    free(brotli->value);
-    brotli->value = NULL;
-error_zero_out:
-    brotli->len = 0;
+    if (UNLIKELY(brotli->len >= deflated->len)) {
+        free(brotli->value);
+        *brotli = (struct lwan_value){};
+    }
 }
 #endif
 
@@ -402,28 +469,16 @@ static void zstd_value(const struct lwan_value *uncompressed,
                        struct lwan_value *zstd,
                        const struct lwan_value *deflated)
 {
-    const size_t bound = ZSTD_compressBound(uncompressed->len);
-
-    zstd->len = bound;
-
-    if (UNLIKELY(!(zstd->value = malloc(zstd->len))))
-        goto error_zero_out;
-
-    zstd->len = ZSTD_compress(zstd->value, zstd->len, uncompressed->value,
-                              uncompressed->len, 1);
-    if (UNLIKELY(ZSTD_isError(zstd->len)))
-        goto error_free_compressed;
+    if (UNLIKELY(!lwan_compress_value(LWAN_ENCODING_ZSTD, 1, uncompressed,
+                                      zstd)))
+        return;
 
     /* is_compression_worthy() is already called for deflate-compressed data,
      * so only consider zstd-compressed data if it's worth it WRT deflate */
-    if (LIKELY(zstd->len < deflated->len))
-        return realloc_if_needed(zstd, bound);
-
-error_free_compressed:
-    free(zstd->value);
-    zstd->value = NULL;
-error_zero_out:
-    zstd->len = 0;
+    if (UNLIKELY(zstd->len >= deflated->len)) {
+        free(zstd->value);
+        *zstd = (struct lwan_value){};
+    }
 }
 #endif
 
@@ -440,21 +495,16 @@ static inline bool is_world_readable(mode_t mode)
     return (mode & world_readable) == world_readable;
 }
 
-static int try_open_compressed(const char *relpath,
-                               const struct serve_files_priv *priv,
-                               const struct stat *uncompressed,
-                               size_t *compressed_sz)
+static int try_open_compressed_at(int dir_fd,
+                                  const char *gzpath,
+                                  const struct serve_files_priv *priv,
+                                  const struct stat *uncompressed,
+                                  size_t *compressed_sz)
 {
-    char gzpath[PATH_MAX];
     struct stat st;
     int ret, fd;
 
-    /* Try to serve a compressed file using sendfile() if $FILENAME.gz exists */
-    ret = snprintf(gzpath, PATH_MAX, "%s.gz", relpath);
-    if (UNLIKELY(ret < 0 || ret >= PATH_MAX))
-        goto out;
-
-    fd = openat(priv->root_fd, gzpath, open_mode);
+    fd = openat(dir_fd, gzpath, open_mode);
     if (UNLIKELY(fd < 0))
         goto out;
 
@@ -484,6 +534,102 @@ out:
     return -ENOENT;
 }
 
+static int try_open_compressed(const char *relpath,
+                               const struct serve_files_priv *priv,
+                               const struct stat *uncompressed,
+                               size_t *compressed_sz)
+{
+    char gzpath[PATH_MAX];
+    int ret, fd;
+
+    /* Try to serve a compressed file using sendfile() if $FILENAME.gz
+     * exists, either next to the file or in the precompressor directory */
+    ret = snprintf(gzpath, PATH_MAX, "%s.gz", relpath);
+    if (UNLIKELY(ret < 0 || ret >= PATH_MAX)) {
+        *compressed_sz = 0;
+        return -ENOENT;
+    }
+
+    fd = try_open_compressed_at(priv->root_fd, gzpath, priv, uncompressed,
+                                compressed_sz);
+    if (fd < 0 && priv->precompressed_fd >= 0) {
+        fd = try_open_compressed_at(priv->precompressed_fd, gzpath, priv,
+                                    uncompressed, compressed_sz);
+    }
+
+    return fd;
+}
+
+static bool is_image_with_variants(const char *mime_type)
+{
+    return streq(mime_type, "image/png") || streq(mime_type, "image/jpeg");
+}
+
+/* Variants are only served if they're newer and smaller than the image,
+ * just like precompressed files are. */
+static void find_image_variants(struct file_cache_entry *ce,
+                                const struct serve_files_priv *priv,
+                                const char *relpath,
+                                const struct stat *st)
+{
+    struct image_variants *images = NULL;
+
+    if (!(priv->flags & SERVE_FILES_SERVE_PRECOMPRESSED) || !ce->etag[0] ||
+        !is_image_with_variants(ce->mime_type))
+        return;
+
+    for (size_t i = 0; i < N_ELEMENTS(image_formats); i++) {
+        char path[PATH_MAX];
+        size_t size;
+        int ret, fd;
+
+        ret = snprintf(path, PATH_MAX, "%s%s", relpath,
+                       image_formats[i].suffix);
+        if (UNLIKELY(ret < 0 || ret >= PATH_MAX))
+            continue;
+
+        fd = try_open_compressed_at(priv->root_fd, path, priv, st, &size);
+        if (fd < 0)
+            continue;
+
+        if (!images) {
+            images = malloc(sizeof(*images));
+            if (UNLIKELY(!images)) {
+                close(fd);
+                return;
+            }
+            images->n_variants = 0;
+        }
+
+        struct image_variant *variant =
+            &images->variants[images->n_variants++];
+        const char *etag = ce->etag + 2;
+
+        *variant = (struct image_variant){
+            .fd = fd,
+            .size = size,
+            .mime_type = image_formats[i].mime_type,
+        };
+        /* "tag" becomes "tag.avif" */
+        snprintf(variant->etag, sizeof(variant->etag), "%.*s%s\"",
+                 (int)strlen(etag) - 1, etag, image_formats[i].suffix);
+
+        ce->base.cost += open_file_cost;
+    }
+
+    ce->images = images;
+}
+
+static void free_image_variants(struct image_variants *images)
+{
+    if (!images)
+        return;
+
+    for (size_t i = 0; i < images->n_variants; i++)
+        close(images->variants[i].fd);
+    free(images);
+}
+
 static bool mmap_fd(const struct serve_files_priv *priv,
                     int fd,
                     const size_t size,
@@ -494,7 +640,13 @@ static bool mmap_fd(const struct serve_files_priv *priv,
     if (UNLIKELY(fd < 0))
         goto fail;
 
-    ptr = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+    int flags = MAP_SHARED;
+#if defined(MAP_POPULATE)
+    if (priv->flags & SERVE_FILES_POPULATE)
+        flags |= MAP_POPULATE;
+#endif
+
+    ptr = mmap(NULL, size, PROT_READ, flags, fd, 0);
     close(fd);
     if (UNLIKELY(ptr == MAP_FAILED))
         goto fail;
@@ -507,6 +659,180 @@ fail:
     return false;
 }
 
+/* Up to lock_max_size bytes of files are locked in memory as they're
+ * cached, so that neither page faults while writing mmapped files nor
+ * sendfile() ever have to wait for the disk.  */
+static bool lock_pages(struct serve_files_priv *priv,
+                       struct file_cache_entry *ce,
+                       void *ptr,
+                       size_t size)
+{
+    if (ATOMIC_AAF(&priv->locked_size, size) > priv->lock_max_size ||
+        mlock(ptr, size) < 0) {
+        ATOMIC_SAF(&priv->locked_size, size);
+        return false;
+    }
+
+    ce->locked_size = size;
+    return true;
+}
+
+static void *map_and_lock_file(struct serve_files_priv *priv,
+                               struct file_cache_entry *ce,
+                               int fd,
+                               size_t size)
+{
+    void *ptr;
+
+    if (size > priv->lock_max_size - ATOMIC_READ(priv->locked_size))
+        return NULL;
+
+    ptr = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+    if (ptr == MAP_FAILED)
+        return NULL;
+
+#if defined(__linux__) && defined(MADV_HUGEPAGE)
+    /* Only files on tmpfs can be backed by huge pages.  This has to be
+     * done before the pages are faulted in by mlock(). */
+    if (priv->flags & SERVE_FILES_HUGE_PAGES) {
+        struct statfs sfs;
+
+        if (!fstatfs(fd, &sfs) && sfs.f_type == TMPFS_MAGIC)
+            madvise(ptr, size, MADV_HUGEPAGE);
+    }
+#endif
+
+    if (!lock_pages(priv, ce, ptr, size)) {
+        munmap(ptr, size);
+        return NULL;
+    }
+
+    return ptr;
+}
+
+/* Files larger than this are identified by inode, size, and modification
+ * time rather than by their contents, as hashing them whenever their cache
+ * entry is created would take too long.  */
+static const size_t etag_max_hashed_size = 64 * 1024 * 1024;
+
+static void set_content_etag(struct file_cache_entry *ce,
+                             const void *contents,
+                             size_t size)
+{
+    /* zlib is already a dependency, and CRC32 and Adler-32 combined are
+     * good enough to tell different versions of the same file apart. */
+    uLong crc = crc32(0, Z_NULL, 0);
+    uLong adler = adler32(0, Z_NULL, 0);
+    const Bytef *ptr = contents;
+
+    for (size_t left = size; left;) {
+        const uInt len = (uInt)LWAN_MIN(left, (size_t)UINT_MAX);
+
+        crc = crc32(crc, ptr, len);
+        adler = adler32(adler, ptr, len);
+        ptr += len;
+        left -= len;
+    }
+
+    snprintf(ce->etag, sizeof(ce->etag), "W/\"%08lx%08lx-%zx\"", crc, adler,
+             size);
+}
+
+static void set_stat_etag(struct file_cache_entry *ce, const struct stat *st)
+{
+    snprintf(ce->etag, sizeof(ce->etag), "W/\"%jx-%jx-%jx\"",
+             (uintmax_t)st->st_ino, (uintmax_t)st->st_size,
+             (uintmax_t)st->st_mtime);
+}
+
+/* Nearly every client accepts deflate, but fewer accept brotli or zstd,
+ * so these are only compressed if clients asked for them in the last few
+ * minutes.  This is tracked for all instances, as it's a property of the
+ * clients rather than of the files being served.  Entries are rebuilt
+ * often enough (and as soon as a client wants a skipped encoding) that
+ * variants nobody uses go away by themselves. */
+#define ENCODING_WANTED_WINDOW 300
+static time_t brotli_wanted_at, zstd_wanted_at;
+
+static time_t *encoding_wanted_at(enum lwan_request_flags encoding)
+{
+    return encoding == REQUEST_ACCEPT_BROTLI ? &brotli_wanted_at
+                                             : &zstd_wanted_at;
+}
+
+static time_t monotonic_seconds(void)
+{
+    struct timespec now;
+
+    if (UNLIKELY(clock_gettime(monotonic_clock_id, &now) < 0))
+        return 0;
+
+    return now.tv_sec;
+}
+
+static void note_encoding_wanted(enum lwan_request_flags encoding)
+{
+    time_t *wanted_at = encoding_wanted_at(encoding);
+    const time_t now = monotonic_seconds();
+
+    /* Written at most once a second, so threads don't keep bouncing this
+     * cache line around. */
+    if (__atomic_load_n(wanted_at, __ATOMIC_RELAXED) != now)
+        __atomic_store_n(wanted_at, now, __ATOMIC_RELAXED);
+}
+
+static void note_encodings_wanted(struct lwan_request *request)
+{
+    const enum lwan_request_flags accepted =
+        lwan_request_get_accept_encoding(request);
+
+    if (accepted & REQUEST_ACCEPT_BROTLI)
+        note_encoding_wanted(REQUEST_ACCEPT_BROTLI);
+    if (accepted & REQUEST_ACCEPT_ZSTD)
+        note_encoding_wanted(REQUEST_ACCEPT_ZSTD);
+}
+
+#if defined(LWAN_HAVE_BROTLI) || defined(LWAN_HAVE_ZSTD)
+static bool encoding_wanted(struct file_cache_entry *ce,
+                            enum lwan_request_flags encoding)
+{
+    const time_t wanted_at =
+        __atomic_load_n(encoding_wanted_at(encoding), __ATOMIC_RELAXED);
+
+    if (wanted_at && monotonic_seconds() - wanted_at < ENCODING_WANTED_WINDOW)
+        return true;
+
+    ce->skipped_encodings |= (unsigned int)encoding;
+    return false;
+}
+#endif
+
+/* Returns the number of bytes used by the compressed copies. */
+static size_t compress_mmap_data(struct file_cache_entry *ce)
+{
+    struct mmap_cache_data *md = &ce->mmap_cache_data;
+    size_t size;
+
+    deflate_value(&md->uncompressed, &md->deflated);
+    size = md->deflated.len;
+#if defined(LWAN_HAVE_BROTLI)
+    if (encoding_wanted(ce, REQUEST_ACCEPT_BROTLI))
+        brotli_value(&md->uncompressed, &md->brotli, &md->deflated);
+    else
+        md->brotli = (struct lwan_value){};
+    size += md->brotli.len;
+#endif
+#if defined(LWAN_HAVE_ZSTD)
+    if (encoding_wanted(ce, REQUEST_ACCEPT_ZSTD))
+        zstd_value(&md->uncompressed, &md->zstd, &md->deflated);
+    else
+        md->zstd = (struct lwan_value){};
+    size += md->zstd.len;
+#endif
+
+    return size;
+}
+
 static bool mmap_init(struct file_cache_entry *ce,
                       struct serve_files_priv *priv,
                       const char *full_path,
@@ -521,7 +847,9 @@ static bool mmap_init(struct file_cache_entry *ce,
         return false;
     if (!mmap_fd(priv, file_fd, (size_t)st->st_size, &md->uncompressed))
         return false;
-    lwan_madvise_queue(md->uncompressed.value, md->uncompressed.len);
+    if (!priv->lock_max_size ||
+        !lock_pages(priv, ce, md->uncompressed.value, md->uncompressed.len))
+        lwan_madvise_queue(md->uncompressed.value, md->uncompressed.len);
 
     if (LIKELY(priv->flags & SERVE_FILES_SERVE_PRECOMPRESSED)) {
         size_t compressed_size;
@@ -533,17 +861,16 @@ static bool mmap_init(struct file_cache_entry *ce,
     }
 
     md->uncompressed.len = (size_t)st->st_size;
-    deflate_value(&md->uncompressed, &md->deflated);
-#if defined(LWAN_HAVE_BROTLI)
-    brotli_value(&md->uncompressed, &md->brotli, &md->deflated);
-#endif
-#if defined(LWAN_HAVE_ZSTD)
-    zstd_value(&md->uncompressed, &md->zstd, &md->deflated);
-#endif
+    set_content_etag(ce, md->uncompressed.value, md->uncompressed.len);
+
+    ce->base.cost = sizeof(*ce) + md->uncompressed.len + md->gzip.len +
+                    compress_mmap_data(ce);
 
     ce->mime_type =
         lwan_determine_mime_type_for_file_name(full_path + priv->root_path_len);
 
+    find_image_variants(ce, priv, path, st);
+
     return true;
 }
 
@@ -567,6 +894,7 @@ static bool sendfile_init(struct file_cache_entry *ce,
              * store errno as the file descriptor.  */
             sd->uncompressed.fd = sd->compressed.fd = -errno;
             sd->compressed.size = sd->uncompressed.size = 0;
+            ce->base.cost = sizeof(*ce);
 
             return true;
         }
@@ -587,7 +915,37 @@ static bool sendfile_init(struct file_cache_entry *ce,
     }
 
     sd->uncompressed.size = (size_t)st->st_size;
-    try_readahead(priv, sd->uncompressed.fd, sd->uncompressed.size);
+
+    sd->locked = NULL;
+    if (priv->lock_max_size) {
+        sd->locked = map_and_lock_file(priv, ce, sd->uncompressed.fd,
+                                       sd->uncompressed.size);
+    }
+
+    if (sd->locked && sd->uncompressed.size <= etag_max_hashed_size) {
+        set_content_etag(ce, sd->locked, sd->uncompressed.size);
+    } else if (sd->locked) {
+        set_stat_etag(ce, st);
+    } else if (sd->uncompressed.size <= etag_max_hashed_size) {
+        void *contents = mmap(NULL, sd->uncompressed.size, PROT_READ,
+                              MAP_PRIVATE, sd->uncompressed.fd, 0);
+
+        if (contents != MAP_FAILED) {
+            set_content_etag(ce, contents, sd->uncompressed.size);
+            munmap(contents, sd->uncompressed.size);
+        } else {
+            set_stat_etag(ce, st);
+        }
+    } else {
+        set_stat_etag(ce, st);
+        try_readahead(priv, sd->uncompressed.fd, sd->uncompressed.size);
+    }
+
+    ce->base.cost = sizeof(*ce) + open_file_cost + ce->locked_size;
+    if (sd->compressed.fd >= 0)
+        ce->base.cost += open_file_cost;
+
+    find_image_variants(ce, priv, relpath, st);
 
     return true;
 }
@@ -637,60 +995,306 @@ static const char *dirlist_find_readme(struct lwan_strbuf *readme,
     return NULL;
 }
 
-static bool dirlist_init(struct file_cache_entry *ce,
-                         struct serve_files_priv *priv,
-                         const char *full_path,
-                         struct stat *st __attribute__((unused)))
+#if defined(SYS_getdents64)
+struct linux_dirent64 {
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+/* Appends the names of the entries in @dir_fd to @names, each terminated
+ * by a NUL byte.  Entries are read straight into a buffer, many at a time,
+ * rather than one readdir() call at a time. */
+static bool read_dir_names(int dir_fd, struct lwan_strbuf *names,
+                           size_t *n_names)
 {
-    struct dir_list_cache_data *dd = &ce->dir_list_cache_data;
-    struct lwan_strbuf readme;
+    const size_t buffer_size = 32 * 1024;
+    char *buffer = malloc(buffer_size);
     bool ret = false;
 
-    if (!lwan_strbuf_init(&readme))
+    if (!buffer)
         return false;
-    if (!lwan_strbuf_init(&dd->rendered))
-        goto out_free_readme;
 
-    struct file_list vars = {
-        .full_path = full_path,
-        .rel_path = get_rel_path(full_path, priv),
-        .readme = dirlist_find_readme(&readme, priv, full_path),
-    };
+    while (true) {
+        long r = syscall(SYS_getdents64, dir_fd, buffer, buffer_size);
 
-    if (!lwan_tpl_apply_with_buffer(priv->directory_list_tpl, &dd->rendered,
-                                    &vars))
-        goto out_free_rendered;
+        if (r == 0) {
+            ret = true;
+            break;
+        }
+        if (r < 0) {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
 
-    ce->mime_type = "text/html";
+        for (long off = 0; off < r;) {
+            const struct linux_dirent64 *d =
+                (const struct linux_dirent64 *)(buffer + off);
 
-    struct lwan_value rendered = {
-        .value = lwan_strbuf_get_buffer(&dd->rendered),
-        .len = lwan_strbuf_get_length(&dd->rendered),
-    };
-    deflate_value(&rendered, &dd->deflated);
-#if defined(LWAN_HAVE_BROTLI)
-    brotli_value(&rendered, &dd->brotli, &dd->deflated);
-#endif
+            off += d->d_reclen;
 
-    ret = true;
-    goto out_free_readme;
+            if (d->d_name[0] == '.')
+                continue;
+            if (!lwan_strbuf_append_str(names, d->d_name, strlen(d->d_name) + 1))
+                goto out;
+            (*n_names)++;
+        }
+    }
 
-out_free_rendered:
-    lwan_strbuf_free(&dd->rendered);
-out_free_readme:
-    lwan_strbuf_free(&readme);
+out:
+    free(buffer);
+    return ret;
+}
+#else
+static bool read_dir_names(int dir_fd, struct lwan_strbuf *names,
+                           size_t *n_names)
+{
+    struct dirent *entry;
+    bool ret = true;
+    DIR *dir;
+    int fd;
+
+    fd = dup(dir_fd);
+    if (fd < 0)
+        return false;
+
+    dir = fdopendir(fd);
+    if (!dir) {
+        close(fd);
+        return false;
+    }
+
+    while ((entry = readdir(dir))) {
+        if (entry->d_name[0] == '.')
+            continue;
+        if (!lwan_strbuf_append_str(names, entry->d_name,
+                                    strlen(entry->d_name) + 1)) {
+            ret = false;
+            break;
+        }
+        (*n_names)++;
+    }
+
+    closedir(dir);
+    return ret;
+}
+#endif
+
+static int dir_entry_cmp(const void *a, const void *b)
+{
+    const struct dir_entry *ea = a;
+    const struct dir_entry *eb = b;
+
+    return strcmp(ea->name, eb->name);
+}
+
+/* Reads the whole directory once, so that listing it, page after page and
+ * in any format, never has to go through it again while it's cached.
+ * Dotfiles and anything that isn't a regular file or a directory are left
+ * out, as before. */
+static bool dirlist_read_snapshot(struct dir_list_cache_data *dd,
+                                  const char *full_path)
+{
+    size_t n_names = 0;
+    const char *name;
+    int fd;
+
+    fd = open(full_path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0)
+        return false;
+
+    if (!read_dir_names(fd, &dd->names, &n_names))
+        goto out_close;
+
+    dd->n_entries = 0;
+    dd->entries = calloc(LWAN_MAX(n_names, (size_t)1), sizeof(*dd->entries));
+    if (!dd->entries)
+        goto out_close;
+
+    /* The buffer with the names won't move anymore */
+    name = lwan_strbuf_get_buffer(&dd->names);
+    for (size_t i = 0; i < n_names; i++, name += strlen(name) + 1) {
+        struct stat st;
+
+        if (fstatat(fd, name, &st, 0) < 0)
+            continue;
+
+        if (S_ISDIR(st.st_mode)) {
+            dd->entries[dd->n_entries].mime_type = NULL;
+        } else if (S_ISREG(st.st_mode)) {
+            dd->entries[dd->n_entries].mime_type =
+                lwan_determine_mime_type_for_file_name(name);
+        } else {
+            continue;
+        }
+
+        dd->entries[dd->n_entries].name = name;
+        dd->entries[dd->n_entries].size = st.st_size;
+        dd->n_entries++;
+    }
+
+    qsort(dd->entries, dd->n_entries, sizeof(*dd->entries), dir_entry_cmp);
+
+    close(fd);
+    return true;
+
+out_close:
+    close(fd);
+    return false;
+}
+
+/* Cursors are the name of the last entry of the previous page, so that
+ * they still point to the right place after the directory changes */
+static void append_cursor(struct lwan_strbuf *buf, const char *name)
+{
+    static const char hex_digits[] = "0123456789ABCDEF";
+
+    for (const char *p = name; *p; p++) {
+        const unsigned char c = (unsigned char)*p;
+
+        if (lwan_char_isalnum((char)c) || c == '-' || c == '.' || c == '_' || c == '~') {
+            lwan_strbuf_append_char(buf, (char)c);
+        } else {
+            lwan_strbuf_append_char(buf, '%');
+            lwan_strbuf_append_char(buf, hex_digits[c >> 4]);
+            lwan_strbuf_append_char(buf, hex_digits[c & 15]);
+        }
+    }
+}
+
+/* Index of the first entry after @cursor */
+static size_t dirlist_find_cursor(const struct dir_list_cache_data *dd,
+                                  const char *cursor)
+{
+    size_t lo = 0, hi = dd->n_entries;
+
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+
+        if (strcmp(dd->entries[mid].name, cursor) <= 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    return lo;
+}
+
+static bool dirlist_render_page(const struct dir_list_cache_data *dd,
+                                struct lwan_strbuf *buf,
+                                const char *full_path,
+                                const char *readme,
+                                size_t first,
+                                size_t count)
+{
+    struct lwan_strbuf next_page;
+    bool ret;
+
+    if (!lwan_strbuf_init(&next_page))
+        return false;
+
+    if (first + count < dd->n_entries)
+        append_cursor(&next_page, dd->entries[first + count - 1].name);
+
+    struct file_list vars = {
+        .full_path = full_path,
+        .rel_path = dd->rel_path,
+        .readme = readme,
+        .next_page = lwan_strbuf_get_length(&next_page)
+                         ? lwan_strbuf_get_buffer(&next_page)
+                         : NULL,
+        .entries = dd->entries + first,
+        .n_entries = count,
+    };
+
+    ret = lwan_tpl_apply_with_buffer(dd->priv->directory_list_tpl, buf, &vars);
+
+    lwan_strbuf_free(&next_page);
     return ret;
 }
 
+static bool dirlist_init(struct file_cache_entry *ce,
+                         struct serve_files_priv *priv,
+                         const char *full_path,
+                         struct stat *st __attribute__((unused)))
+{
+    struct dir_list_cache_data *dd = &ce->dir_list_cache_data;
+    struct lwan_strbuf readme;
+
+    dd->priv = priv;
+    dd->entries = NULL;
+    dd->rel_path = strdup(get_rel_path(full_path, priv));
+    if (!dd->rel_path)
+        return false;
+
+    if (!lwan_strbuf_init(&dd->names))
+        goto out_free_rel_path;
+    if (!dirlist_read_snapshot(dd, full_path))
+        goto out_free_snapshot;
+
+    if (!lwan_strbuf_init(&readme))
+        goto out_free_snapshot;
+    if (!lwan_strbuf_init(&dd->rendered))
+        goto out_free_readme;
+
+    if (!dirlist_render_page(dd, &dd->rendered, full_path,
+                             dirlist_find_readme(&readme, priv, full_path), 0,
+                             LWAN_MIN(dd->n_entries, priv->dir_page_size)))
+        goto out_free_rendered;
+
+    ce->mime_type = "text/html";
+
+    struct lwan_value rendered = {
+        .value = lwan_strbuf_get_buffer(&dd->rendered),
+        .len = lwan_strbuf_get_length(&dd->rendered),
+    };
+    deflate_value(&rendered, &dd->deflated);
+#if defined(LWAN_HAVE_BROTLI)
+    if (encoding_wanted(ce, REQUEST_ACCEPT_BROTLI))
+        brotli_value(&rendered, &dd->brotli, &dd->deflated);
+    else
+        dd->brotli = (struct lwan_value){};
+#endif
+
+    ce->base.cost = sizeof(*ce) + rendered.len + dd->deflated.len +
+                    dd->n_entries * sizeof(*dd->entries) +
+                    lwan_strbuf_get_length(&dd->names);
+#if defined(LWAN_HAVE_BROTLI)
+    ce->base.cost += dd->brotli.len;
+#endif
+
+    lwan_strbuf_free(&readme);
+    return true;
+
+out_free_rendered:
+    lwan_strbuf_free(&dd->rendered);
+out_free_readme:
+    lwan_strbuf_free(&readme);
+out_free_snapshot:
+    free(dd->entries);
+    lwan_strbuf_free(&dd->names);
+out_free_rel_path:
+    free(dd->rel_path);
+    return false;
+}
+
 static bool redir_init(struct file_cache_entry *ce,
                        struct serve_files_priv *priv,
                        const char *full_path,
                        struct stat *st __attribute__((unused)))
 {
     struct redir_cache_data *rd = &ce->redir_cache_data;
+    int len = asprintf(&rd->redir_to, "%s%s/", priv->prefix,
+                       get_rel_path(full_path, priv));
 
-    return asprintf(&rd->redir_to, "%s%s/", priv->prefix,
-                    get_rel_path(full_path, priv)) >= 0;
+    if (len < 0)
+        return false;
+
+    ce->base.cost = sizeof(*ce) + (size_t)len;
+    return true;
 }
 
 static const struct cache_funcs *get_funcs(struct serve_files_priv *priv,
@@ -758,7 +1362,7 @@ static const struct cache_funcs *get_funcs(struct serve_files_priv *priv,
 
     /* It's not a directory: choose the fastest way to serve the file
      * judging by its size. */
-    if (st->st_size < 16384)
+    if (st->st_size < mmap_size_threshold)
         return &mmap_funcs;
 
     return &sendfile_funcs;
@@ -776,6 +1380,11 @@ create_cache_entry_from_funcs(struct serve_files_priv *priv,
     if (UNLIKELY(!fce))
         return NULL;
 
+    fce->etag[0] = '\0';
+    fce->locked_size = 0;
+    fce->early_hints = NULL;
+    fce->skipped_encodings = 0;
+    fce->images = NULL;
     if (LIKELY(funcs->init(fce, priv, full_path, st))) {
         fce->funcs = funcs;
         return fce;
@@ -789,118 +1398,1467 @@ create_cache_entry_from_funcs(struct serve_files_priv *priv,
     return create_cache_entry_from_funcs(priv, full_path, st, &sendfile_funcs);
 }
 
-static void destroy_cache_entry(struct cache_entry *entry,
-                                void *context __attribute__((unused)))
+static void destroy_cache_entry(struct cache_entry *entry, void *context)
 {
     struct file_cache_entry *fce = (struct file_cache_entry *)entry;
+    struct serve_files_priv *priv = context;
 
     fce->funcs->free(fce);
+    free_image_variants(fce->images);
+    if (fce->locked_size)
+        ATOMIC_SAF(&priv->locked_size, fce->locked_size);
     free(fce);
 }
 
-static struct cache_entry *create_cache_entry(const void *key,
-                                              void *cache_ctx,
-                                              void *create_ctx
-                                              __attribute__((unused)))
+/* Instead of a directory, files can be served from a ZIP archive, which
+ * is mapped in memory once, and indexed when the module is created, so
+ * that serving files from it doesn't involve the filesystem at all.
+ * Members can be either stored or deflated; deflated members are served
+ * as gzip-encoded content without being compressed again, and
+ * decompressed only for clients that don't accept it.  ZIP64 archives
+ * and encrypted members aren't supported. */
+#define ZIP_END_RECORD_SIGNATURE 0x06054b50
+#define ZIP_CENTRAL_HEADER_SIGNATURE 0x02014b50
+#define ZIP_LOCAL_HEADER_SIGNATURE 0x04034b50
+#define ZIP_END_RECORD_SIZE 22
+#define ZIP_CENTRAL_HEADER_SIZE 46
+#define ZIP_LOCAL_HEADER_SIZE 30
+
+struct archive_member {
+    const char *data;
+    size_t size;
+    size_t uncompressed_size;
+    time_t mtime;
+    uint32_t crc32;
+    bool deflated;
+    bool is_dir;
+};
+
+struct archive {
+    struct lwan_value map;
+    /* Member name -> struct archive_member; directories are implied by
+     * the names of the members under them, and end with a slash. */
+    struct hash *members;
+};
+
+static ALWAYS_INLINE uint16_t read_le16(const char *p)
 {
-    struct serve_files_priv *priv = cache_ctx;
-    struct file_cache_entry *fce;
-    struct stat st;
-    const struct cache_funcs *funcs;
-    char full_path[PATH_MAX];
+    uint16_t v;
+    memcpy(&v, p, sizeof(v));
+    return le16toh(v);
+}
 
-    if (UNLIKELY(
-            !realpathat2(priv->root_fd, priv->root_path, key, full_path, &st)))
-        return NULL;
+static ALWAYS_INLINE uint32_t read_le32(const char *p)
+{
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return le32toh(v);
+}
 
-    if (UNLIKELY(!is_world_readable(st.st_mode)))
-        return NULL;
+static time_t dos_time_to_time(uint16_t date, uint16_t time)
+{
+    struct tm tm = {
+        .tm_year = ((date >> 9) & 0x7f) + 80,
+        .tm_mon = ((date >> 5) & 0x0f) - 1,
+        .tm_mday = date & 0x1f,
+        .tm_hour = (time >> 11) & 0x1f,
+        .tm_min = (time >> 5) & 0x3f,
+        .tm_sec = (time & 0x1f) * 2,
+    };
 
-    if (UNLIKELY(strncmp(full_path, priv->root_path, priv->root_path_len)))
-        return NULL;
+    /* DOS timestamps have no time zone; assume UTC. */
+    return timegm(&tm);
+}
 
-    funcs = get_funcs(priv, key, full_path, &st);
-    if (UNLIKELY(!funcs))
-        return NULL;
+static bool archive_add_member(struct archive *archive,
+                               const char *name,
+                               size_t name_len,
+                               const struct archive_member *member)
+{
+    struct archive_member *copy;
+    char *key;
 
-    fce = create_cache_entry_from_funcs(priv, full_path, &st, funcs);
-    if (UNLIKELY(!fce))
-        return NULL;
+    /* Add the directories leading to this member, so that requests for
+     * them can be redirected or served their index file. */
+    for (size_t i = 0; i + 1 < name_len; i++) {
+        if (name[i] != '/')
+            continue;
 
-    if (UNLIKELY(lwan_format_rfc_time(st.st_mtime, fce->last_modified.string) <
-                 0)) {
-        destroy_cache_entry((struct cache_entry *)fce, NULL);
-        return NULL;
+        key = strndup(name, i + 1);
+        if (!key)
+            return false;
+
+        if (hash_find(archive->members, key)) {
+            free(key);
+            continue;
+        }
+
+        copy = calloc(1, sizeof(*copy));
+        if (!copy || hash_add_unique(archive->members, key, copy)) {
+            free(copy);
+            free(key);
+            return false;
+        }
+        copy->is_dir = true;
     }
-    fce->last_modified.integer = st.st_mtime;
 
-    return (struct cache_entry *)fce;
-}
+    if (!name_len || name[name_len - 1] == '/')
+        return true;
 
-static void mmap_free(struct file_cache_entry *fce)
-{
-    struct mmap_cache_data *md = &fce->mmap_cache_data;
+    key = strndup(name, name_len);
+    copy = malloc(sizeof(*copy));
+    if (!key || !copy) {
+        free(key);
+        free(copy);
+        return false;
+    }
 
-    munmap(md->uncompressed.value, md->uncompressed.len);
-    if (md->gzip.value)
-        munmap(md->gzip.value, md->gzip.len);
-    free(md->deflated.value);
-#if defined(LWAN_HAVE_BROTLI)
-    free(md->brotli.value);
-#endif
-#if defined(LWAN_HAVE_ZSTD)
-    free(md->zstd.value);
-#endif
+    *copy = *member;
+
+    /* Archives with duplicate names are allowed; the first member wins. */
+    if (hash_add_unique(archive->members, key, copy)) {
+        free(key);
+        free(copy);
+    }
+
+    return true;
 }
 
-static void sendfile_free(struct file_cache_entry *fce)
+static bool archive_index(struct archive *archive)
 {
-    struct sendfile_cache_data *sd = &fce->sendfile_cache_data;
+    const char *map = archive->map.value;
+    const size_t len = archive->map.len;
+    const char *end_record = NULL;
+    uint32_t cd_offset, cd_size;
+    uint16_t n_entries;
 
-    if (sd->compressed.fd >= 0)
-        close(sd->compressed.fd);
-    if (sd->uncompressed.fd >= 0)
-        close(sd->uncompressed.fd);
+    if (len < ZIP_END_RECORD_SIZE)
+        return false;
+
+    /* The end record is followed by a comment of up to 64KiB. */
+    for (size_t off = len - ZIP_END_RECORD_SIZE;; off--) {
+        if (read_le32(map + off) == ZIP_END_RECORD_SIGNATURE) {
+            end_record = map + off;
+            break;
+        }
+        if (!off || len - off > ZIP_END_RECORD_SIZE + 65535)
+            return false;
+    }
+
+    n_entries = read_le16(end_record + 10);
+    cd_size = read_le32(end_record + 12);
+    cd_offset = read_le32(end_record + 16);
+    if ((size_t)cd_offset + cd_size > (size_t)(end_record - map))
+        return false;
+
+    for (const char *p = map + cd_offset, *cd_end = p + cd_size; n_entries;
+         n_entries--) {
+        if (p + ZIP_CENTRAL_HEADER_SIZE > cd_end ||
+            read_le32(p) != ZIP_CENTRAL_HEADER_SIGNATURE)
+            return false;
+
+        const uint16_t flags = read_le16(p + 8);
+        const uint16_t method = read_le16(p + 10);
+        const uint32_t compressed_size = read_le32(p + 20);
+        const uint32_t uncompressed_size = read_le32(p + 24);
+        const uint16_t name_len = read_le16(p + 28);
+        const size_t header_len = ZIP_CENTRAL_HEADER_SIZE + (size_t)name_len +
+                                  read_le16(p + 30) + read_le16(p + 32);
+        const uint32_t local_offset = read_le32(p + 42);
+        const char *header = p;
+        const char *name = p + ZIP_CENTRAL_HEADER_SIZE;
+
+        if (p + header_len > cd_end)
+            return false;
+        p += header_len;
+
+        /* Members are only looked up by name, so names don't need to be
+         * sanitized; encrypted members, and members compressed with
+         * something other than deflate, are skipped, though. */
+        if ((flags & 1) || (method != 0 && method != 8))
+            continue;
+
+        const char *local = map + local_offset;
+        if ((size_t)local_offset + ZIP_LOCAL_HEADER_SIZE > len ||
+            read_le32(local) != ZIP_LOCAL_HEADER_SIGNATURE)
+            return false;
+
+        const size_t data_offset = (size_t)local_offset +
+                                   ZIP_LOCAL_HEADER_SIZE +
+                                   read_le16(local + 26) +
+                                   read_le16(local + 28);
+        if (data_offset + compressed_size > len)
+            return false;
+        if (method == 0 && compressed_size != uncompressed_size)
+            return false;
+
+        const struct archive_member member = {
+            .data = map + data_offset,
+            .size = compressed_size,
+            .uncompressed_size = uncompressed_size,
+            .mtime = dos_time_to_time(read_le16(header + 14),
+                                      read_le16(header + 12)),
+            .crc32 = read_le32(header + 16),
+            .deflated = method == 8,
+        };
+        if (!archive_add_member(archive, name, name_len, &member))
+            return false;
+    }
+
+    return true;
 }
 
-static void dirlist_free(struct file_cache_entry *fce)
+static struct archive *archive_open(const char *path, bool populate)
 {
-    struct dir_list_cache_data *dd = &fce->dir_list_cache_data;
+    struct archive *archive;
+    struct stat st;
+    int flags = MAP_SHARED;
+    void *ptr;
+    int fd;
 
-    lwan_strbuf_free(&dd->rendered);
-    free(dd->deflated.value);
-#if defined(LWAN_HAVE_BROTLI)
-    free(dd->brotli.value);
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        lwan_status_perror("Could not open archive \"%s\"", path);
+        return NULL;
+    }
+
+    if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode) || !st.st_size) {
+        lwan_status_error("\"%s\" is not a valid archive", path);
+        close(fd);
+        return NULL;
+    }
+
+#if defined(MAP_POPULATE)
+    if (populate)
+        flags |= MAP_POPULATE;
 #endif
+    ptr = mmap(NULL, (size_t)st.st_size, PROT_READ, flags, fd, 0);
+    close(fd);
+    if (ptr == MAP_FAILED) {
+        lwan_status_perror("Could not map archive \"%s\"", path);
+        return NULL;
+    }
+
+    archive = malloc(sizeof(*archive));
+    if (!archive)
+        goto out_unmap;
+
+    archive->map = (struct lwan_value){.value = ptr,
+                                       .len = (size_t)st.st_size};
+    archive->members = hash_str_new(free, free);
+    if (!archive->members)
+        goto out_free;
+
+    if (!archive_index(archive)) {
+        lwan_status_error("Could not read the index of archive \"%s\"", path);
+        goto out_hash;
+    }
+
+    lwan_status_debug("Archive \"%s\" has %u files and directories", path,
+                      hash_get_count(archive->members));
+    return archive;
+
+out_hash:
+    hash_unref(archive->members);
+out_free:
+    free(archive);
+out_unmap:
+    munmap(ptr, (size_t)st.st_size);
+    return NULL;
 }
 
-static void redir_free(struct file_cache_entry *fce)
+static void archive_close(struct archive *archive)
 {
-    struct redir_cache_data *rd = &fce->redir_cache_data;
+    hash_unref(archive->members);
+    munmap(archive->map.value, archive->map.len);
+    free(archive);
+}
 
-    free(rd->redir_to);
+static bool inflate_member(const struct archive_member *member,
+                           struct lwan_value *uncompressed)
+{
+    z_stream zs = {
+        .next_in = (Bytef *)member->data,
+        .avail_in = (uInt)member->size,
+    };
+    char *buffer;
+    int r;
+
+    buffer = malloc(LWAN_MAX(member->uncompressed_size, (size_t)1));
+    if (!buffer)
+        return false;
+
+    /* Negative window bits: raw deflate stream, without zlib headers. */
+    if (inflateInit2(&zs, -15) != Z_OK)
+        goto out_free;
+
+    zs.next_out = (Bytef *)buffer;
+    zs.avail_out = (uInt)member->uncompressed_size;
+    r = inflate(&zs, Z_FINISH);
+    inflateEnd(&zs);
+
+    if (r != Z_STREAM_END || zs.total_out != member->uncompressed_size)
+        goto out_free;
+    if (crc32(0, (Bytef *)buffer, (uInt)zs.total_out) != member->crc32)
+        goto out_free;
+
+    *uncompressed = (struct lwan_value){.value = buffer,
+                                        .len = member->uncompressed_size};
+    return true;
+
+out_free:
+    free(buffer);
+    return false;
 }
 
-static char *get_real_root_path(const char *root_path)
+/* A gzip stream is just a deflate stream with a header, and the CRC-32 and
+ * size of the uncompressed data as a trailer, which the archive has. */
+static void gzip_from_member(const struct archive_member *member,
+                             struct lwan_value *gzip)
 {
-    char path_buf[PATH_MAX];
-    char *path;
+    static const unsigned char header[] = {0x1f, 0x8b, 8, 0, 0, 0, 0, 0, 0, 3};
+    const uint32_t trailer[] = {htole32(member->crc32),
+                                htole32((uint32_t)member->uncompressed_size)};
+    char *buffer;
 
-    path = realpath(root_path, path_buf);
-    if (!path)
-        return NULL;
+    *gzip = (struct lwan_value){};
 
-    char *last_slash = strrchr(path, '/');
+    if (!is_compression_worthy(member->size + sizeof(header) + sizeof(trailer),
+                               member->uncompressed_size))
+        return;
+
+    buffer = malloc(sizeof(header) + member->size + sizeof(trailer));
+    if (!buffer)
+        return;
+
+    memcpy(buffer, header, sizeof(header));
+    memcpy(buffer + sizeof(header), member->data, member->size);
+    memcpy(buffer + sizeof(header) + member->size, trailer, sizeof(trailer));
+
+    *gzip = (struct lwan_value){
+        .value = buffer,
+        .len = sizeof(header) + member->size + sizeof(trailer),
+    };
+}
+
+static bool archive_init(struct file_cache_entry *ce,
+                         const struct archive_member *member,
+                         const char *name)
+{
+    struct mmap_cache_data *md = &ce->mmap_cache_data;
+
+    md->inflated = member->deflated;
+    if (member->deflated) {
+        if (!inflate_member(member, &md->uncompressed))
+            return false;
+        gzip_from_member(member, &md->gzip);
+    } else {
+        md->uncompressed = (struct lwan_value){.value = (char *)member->data,
+                                               .len = member->size};
+        md->gzip = (struct lwan_value){};
+    }
+
+    ce->base.cost = sizeof(*ce) + md->gzip.len + compress_mmap_data(ce);
+    if (member->deflated)
+        ce->base.cost += md->uncompressed.len;
+
+    snprintf(ce->etag, sizeof(ce->etag), "W/\"%08" PRIx32 "-%zx\"",
+             member->crc32, member->uncompressed_size);
+    ce->mime_type = lwan_determine_mime_type_for_file_name(name);
+
+    return true;
+}
+
+static void archive_free(struct file_cache_entry *fce)
+{
+    struct mmap_cache_data *md = &fce->mmap_cache_data;
+
+    /* Stored members point straight into the archive. */
+    if (md->inflated)
+        free(md->uncompressed.value);
+    free(md->gzip.value);
+    free(md->deflated.value);
+#if defined(LWAN_HAVE_BROTLI)
+    free(md->brotli.value);
+#endif
+#if defined(LWAN_HAVE_ZSTD)
+    free(md->zstd.value);
+#endif
+}
+
+static struct file_cache_entry *archive_create_entry(struct serve_files_priv *priv,
+                                                     const char *key)
+{
+    const struct archive_member *member;
+    struct file_cache_entry *fce;
+    char path[PATH_MAX];
+    size_t key_len = strlen(key);
+
+    if (key_len && key[key_len - 1] != '/') {
+        member = hash_find(priv->archive->members, key);
+        if (!member) {
+            /* Redirect /path to /path/ if it's a directory, as it's done
+             * when serving files from directories. */
+            if (snprintf(path, sizeof(path), "%s/", key) >= (int)sizeof(path))
+                return NULL;
+            member = hash_find(priv->archive->members, path);
+            if (!member)
+                return NULL;
+
+            fce = calloc(1, sizeof(*fce));
+            if (!fce)
+                return NULL;
+
+            size_t prefix_len = strlen(priv->prefix);
+            const char *sep =
+                prefix_len && priv->prefix[prefix_len - 1] == '/' ? "" : "/";
+            int len = asprintf(&fce->redir_cache_data.redir_to, "%s%s%s/",
+                               priv->prefix, sep, key);
+            if (len < 0) {
+                free(fce);
+                return NULL;
+            }
+
+            fce->funcs = &redir_funcs;
+            fce->base.cost = sizeof(*fce) + (size_t)len;
+            return fce;
+        }
+    } else {
+        /* Directories are served their index file; auto indexing isn't
+         * supported for archives. */
+        if (snprintf(path, sizeof(path), "%s%s", key, priv->index_html) >=
+            (int)sizeof(path))
+            return NULL;
+        key = path;
+        member = hash_find(priv->archive->members, key);
+        if (!member)
+            return NULL;
+    }
+
+    if (member->is_dir)
+        return NULL;
+
+    fce = malloc(sizeof(*fce));
+    if (!fce)
+        return NULL;
+
+    fce->locked_size = 0;
+    fce->skipped_encodings = 0;
+    fce->images = NULL;
+    if (!archive_init(fce, member, key)) {
+        free(fce);
+        return NULL;
+    }
+    fce->funcs = &archive_funcs;
+    fce->early_hints =
+        priv->early_hints ? hash_find(priv->early_hints, key) : NULL;
+
+    if (UNLIKELY(lwan_format_rfc_time(member->mtime,
+                                      fce->last_modified.string) < 0)) {
+        destroy_cache_entry((struct cache_entry *)fce, priv);
+        return NULL;
+    }
+    fce->last_modified.integer = member->mtime;
+
+    return fce;
+}
+
+static bool resolve_path(struct serve_files_priv *priv,
+                         const char *key,
+                         char *full_path,
+                         struct stat *st);
+
+static struct cache_entry *create_cache_entry(const void *key,
+                                              void *cache_ctx,
+                                              void *create_ctx
+                                              __attribute__((unused)))
+{
+    struct serve_files_priv *priv = cache_ctx;
+    struct file_cache_entry *fce;
+    struct stat st;
+    const struct cache_funcs *funcs;
+    char full_path[PATH_MAX];
+
+    if (priv->archive)
+        return (struct cache_entry *)archive_create_entry(priv, key);
+
+    if (UNLIKELY(!resolve_path(priv, key, full_path, &st)))
+        return NULL;
+
+    if (UNLIKELY(!is_world_readable(st.st_mode)))
+        return NULL;
+
+    if (UNLIKELY(strncmp(full_path, priv->root_path, priv->root_path_len)))
+        return NULL;
+
+    funcs = get_funcs(priv, key, full_path, &st);
+    if (UNLIKELY(!funcs))
+        return NULL;
+
+    fce = create_cache_entry_from_funcs(priv, full_path, &st, funcs);
+    if (UNLIKELY(!fce))
+        return NULL;
+
+    if (priv->early_hints &&
+        (fce->funcs == &mmap_funcs || fce->funcs == &sendfile_funcs)) {
+        const char *rel_path = full_path + priv->root_path_len;
+
+        while (*rel_path == '/')
+            rel_path++;
+        fce->early_hints = hash_find(priv->early_hints, rel_path);
+    }
+
+    if (UNLIKELY(lwan_format_rfc_time(st.st_mtime, fce->last_modified.string) <
+                 0)) {
+        destroy_cache_entry((struct cache_entry *)fce, priv);
+        return NULL;
+    }
+    fce->last_modified.integer = st.st_mtime;
+
+    return (struct cache_entry *)fce;
+}
+
+static void mmap_free(struct file_cache_entry *fce)
+{
+    struct mmap_cache_data *md = &fce->mmap_cache_data;
+
+    munmap(md->uncompressed.value, md->uncompressed.len);
+    if (md->gzip.value)
+        munmap(md->gzip.value, md->gzip.len);
+    free(md->deflated.value);
+#if defined(LWAN_HAVE_BROTLI)
+    free(md->brotli.value);
+#endif
+#if defined(LWAN_HAVE_ZSTD)
+    free(md->zstd.value);
+#endif
+}
+
+static void sendfile_free(struct file_cache_entry *fce)
+{
+    struct sendfile_cache_data *sd = &fce->sendfile_cache_data;
+
+    if (sd->compressed.fd >= 0)
+        close(sd->compressed.fd);
+    if (sd->uncompressed.fd >= 0)
+        close(sd->uncompressed.fd);
+    if (sd->locked)
+        munmap(sd->locked, sd->uncompressed.size);
+}
+
+static void dirlist_free(struct file_cache_entry *fce)
+{
+    struct dir_list_cache_data *dd = &fce->dir_list_cache_data;
+
+    lwan_strbuf_free(&dd->rendered);
+    free(dd->deflated.value);
+#if defined(LWAN_HAVE_BROTLI)
+    free(dd->brotli.value);
+#endif
+    free(dd->entries);
+    lwan_strbuf_free(&dd->names);
+    free(dd->rel_path);
+}
+
+static void redir_free(struct file_cache_entry *fce)
+{
+    struct redir_cache_data *rd = &fce->redir_cache_data;
+
+    free(rd->redir_to);
+}
+
+static char *get_real_root_path(const char *root_path)
+{
+    char path_buf[PATH_MAX];
+    char *path;
+
+    path = realpath(root_path, path_buf);
+    if (!path)
+        return NULL;
+
+    char *last_slash = strrchr(path, '/');
     if (!last_slash)
         return NULL;
 
-    if (*(last_slash + 1) == '\0')
-        return strdup(path);
+    if (*(last_slash + 1) == '\0')
+        return strdup(path);
+
+    char *ret;
+    if (asprintf(&ret, "%s/", path))
+        return ret;
+
+    return NULL;
+}
+
+/* The precompressor walks the root directory in a low priority job, a
+ * few files at a time, so that the first request for a file doesn't pay
+ * for compressing it.  Small files are added to the cache, which
+ * compresses them in memory; larger files, which would otherwise only be
+ * compressed if a .gz file had been placed next to them, are compressed
+ * with gzip into a separate directory, which is kept across restarts. */
+#define PRECOMPRESS_FILES_PER_RUN 16
+#define PRECOMPRESS_PROGRESS_EVERY 1024
+
+struct precompress_dir {
+    struct list_node dirs;
+    char relpath[];
+};
+
+struct precompress {
+    struct list_head dirs;
+
+    DIR *dir;
+    struct precompress_dir *current;
+
+    size_t files;
+    size_t cached;
+    size_t written;
+    size_t bytes_in, bytes_out;
+};
+
+static bool precompress_push_dir(struct precompress *pc, const char *relpath)
+{
+    size_t len = strlen(relpath);
+    struct precompress_dir *pd = malloc(sizeof(*pd) + len + 1);
+
+    if (UNLIKELY(!pd))
+        return false;
+
+    memcpy(pd->relpath, relpath, len + 1);
+    list_add_tail(&pc->dirs, &pd->dirs);
+    return true;
+}
+
+static void make_parent_dirs(int dir_fd, const char *relpath)
+{
+    char path[PATH_MAX];
+
+    for (const char *p = strchr(relpath, '/'); p; p = strchr(p + 1, '/')) {
+        size_t len = (size_t)(p - relpath);
+
+        memcpy(path, relpath, len);
+        path[len] = '\0';
+
+        if (mkdirat(dir_fd, path, 0755) < 0 && errno != EEXIST)
+            return;
+    }
+}
+
+static bool gzip_to_fd(const struct lwan_value *uncompressed,
+                       int out_fd,
+                       size_t *written)
+{
+    unsigned char buffer[16384];
+    z_stream zs = {};
+    bool ret = false;
+    int r;
+
+    /* 31 = 15 bits for the window, plus 16 to write a gzip header. */
+    if (deflateInit2(&zs, Z_BEST_COMPRESSION, Z_DEFLATED, 31, 8,
+                     Z_DEFAULT_STRATEGY) != Z_OK)
+        return false;
+
+    zs.next_in = (Bytef *)uncompressed->value;
+    zs.avail_in = (uInt)uncompressed->len;
+    *written = 0;
+
+    do {
+        zs.next_out = buffer;
+        zs.avail_out = sizeof(buffer);
+
+        r = deflate(&zs, Z_FINISH);
+        if (r == Z_STREAM_ERROR)
+            goto out;
+
+        size_t len = sizeof(buffer) - zs.avail_out;
+        if (write(out_fd, buffer, len) != (ssize_t)len)
+            goto out;
+        *written += len;
+    } while (r != Z_STREAM_END);
+
+    ret = true;
+
+out:
+    deflateEnd(&zs);
+    return ret;
+}
+
+static void precompress_file(struct serve_files_priv *priv,
+                             struct precompress *pc,
+                             const char *relpath,
+                             const struct stat *st)
+{
+    char gzpath[PATH_MAX], tmppath[PATH_MAX];
+    struct lwan_value uncompressed;
+    struct stat gz_st;
+    size_t written;
+    int in_fd, out_fd;
+
+    if (snprintf(gzpath, sizeof(gzpath), "%s.gz", relpath) >=
+        (int)sizeof(gzpath))
+        return;
+    if (snprintf(tmppath, sizeof(tmppath), "%s.gz.tmp", relpath) >=
+        (int)sizeof(tmppath))
+        return;
+
+    /* Already compressed by someone else, or in a previous run. */
+    if (!fstatat(priv->root_fd, gzpath, &gz_st, 0) ||
+        (!fstatat(priv->precompressed_fd, gzpath, &gz_st, 0) &&
+         gz_st.st_mtime >= st->st_mtime))
+        return;
+
+    in_fd = openat(priv->root_fd, relpath, open_mode);
+    if (in_fd < 0)
+        return;
+    if (!mmap_fd(priv, in_fd, (size_t)st->st_size, &uncompressed))
+        return;
+
+    make_parent_dirs(priv->precompressed_fd, relpath);
+
+    out_fd = openat(priv->precompressed_fd, tmppath,
+                    O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (out_fd < 0) {
+        lwan_status_perror("Could not create %s", tmppath);
+        goto out_unmap;
+    }
+
+    if (gzip_to_fd(&uncompressed, out_fd, &written) &&
+        is_compression_worthy(written, uncompressed.len) &&
+        !renameat(priv->precompressed_fd, tmppath, priv->precompressed_fd,
+                  gzpath)) {
+        pc->written++;
+        pc->bytes_in += uncompressed.len;
+        pc->bytes_out += written;
+    } else {
+        unlinkat(priv->precompressed_fd, tmppath, 0);
+    }
+
+    close(out_fd);
+
+out_unmap:
+    munmap(uncompressed.value, uncompressed.len);
+}
+
+static void precompress_entry(struct serve_files_priv *priv,
+                              struct precompress *pc,
+                              const char *name)
+{
+    char relpath[PATH_MAX];
+    struct stat st;
+    size_t len;
+
+    if (name[0] == '.')
+        return;
+
+    if (snprintf(relpath, sizeof(relpath), "%s%s", pc->current->relpath,
+                 name) >= (int)sizeof(relpath))
+        return;
+
+    if (fstatat(priv->root_fd, relpath, &st, AT_SYMLINK_NOFOLLOW) < 0)
+        return;
+    if (!is_world_readable(st.st_mode))
+        return;
+
+    if (S_ISDIR(st.st_mode)) {
+        len = strlen(relpath);
+        if (len + 1 < sizeof(relpath)) {
+            relpath[len] = '/';
+            relpath[len + 1] = '\0';
+            precompress_push_dir(pc, relpath);
+        }
+        return;
+    }
+
+    if (!S_ISREG(st.st_mode))
+        return;
+
+    /* Don't compress the compressed files. */
+    len = strlen(name);
+    if (len > 3 && streq(name + len - 3, ".gz"))
+        return;
+
+    pc->files++;
+
+    if (st.st_size < mmap_size_threshold) {
+        struct cache_entry *ce;
+        int error;
+
+        ce = cache_get_and_ref_entry(priv->cache, relpath, &error);
+        if (ce) {
+            cache_entry_unref(priv->cache, ce);
+            pc->cached++;
+        }
+    } else if (priv->precompressed_fd >= 0 &&
+               lwan_is_compressible_mime_type(
+                   lwan_determine_mime_type_for_file_name(relpath))) {
+        precompress_file(priv, pc, relpath, &st);
+    }
+
+    if (!(pc->files % PRECOMPRESS_PROGRESS_EVERY)) {
+        lwan_status_info("Precompressing %s: %zu files so far",
+                         priv->root_path, pc->files);
+    }
+}
+
+static bool precompress_open_next_dir(struct serve_files_priv *priv,
+                                      struct precompress *pc)
+{
+    while ((pc->current = list_pop(&pc->dirs, struct precompress_dir, dirs))) {
+        const char *path = pc->current->relpath[0] ? pc->current->relpath : ".";
+        int fd = openat(priv->root_fd, path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+
+        if (fd >= 0) {
+            pc->dir = fdopendir(fd);
+            if (pc->dir)
+                return true;
+            close(fd);
+        }
+
+        free(pc->current);
+    }
+
+    return false;
+}
+
+static void precompress_free(struct precompress *pc)
+{
+    struct precompress_dir *pd;
+
+    while ((pd = list_pop(&pc->dirs, struct precompress_dir, dirs)))
+        free(pd);
+
+    if (pc->dir)
+        closedir(pc->dir);
+    free(pc->current);
+    free(pc);
+}
+
+static bool precompress_job(void *data)
+{
+    struct serve_files_priv *priv = data;
+    struct precompress *pc = priv->precompress;
+
+    if (!pc)
+        return false;
+
+    for (int i = 0; i < PRECOMPRESS_FILES_PER_RUN;) {
+        struct dirent *entry;
+
+        if (!pc->dir && !precompress_open_next_dir(priv, pc)) {
+            lwan_status_info("Precompressed %s: %zu files, %zu cached, "
+                             "%zu written (%zu bytes into %zu bytes)",
+                             priv->root_path, pc->files, pc->cached,
+                             pc->written, pc->bytes_in, pc->bytes_out);
+
+            /* Jobs can't remove themselves, so this job will keep being
+             * called, doing nothing, until the module is destroyed. */
+            precompress_free(pc);
+            priv->precompress = NULL;
+            return false;
+        }
+
+        entry = readdir(pc->dir);
+        if (!entry) {
+            closedir(pc->dir);
+            pc->dir = NULL;
+            free(pc->current);
+            pc->current = NULL;
+            continue;
+        }
+
+        precompress_entry(priv, pc, entry->d_name);
+        i++;
+    }
+
+    return true;
+}
+
+static bool precompress_init(struct serve_files_priv *priv,
+                             const struct lwan_serve_files_settings *settings)
+{
+    if (settings->precompress_path) {
+        if (mkdir(settings->precompress_path, 0755) < 0 && errno != EEXIST) {
+            lwan_status_perror("Could not create directory \"%s\"",
+                               settings->precompress_path);
+            return false;
+        }
+
+        priv->precompressed_fd = open(settings->precompress_path,
+                                      O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (priv->precompressed_fd < 0) {
+            lwan_status_perror("Could not open directory \"%s\"",
+                               settings->precompress_path);
+            return false;
+        }
+
+        /* Not much point in having compressed files if they're not served. */
+        priv->flags |= SERVE_FILES_SERVE_PRECOMPRESSED;
+    }
+
+    if (!settings->precompress)
+        return true;
+
+    priv->precompress = calloc(1, sizeof(*priv->precompress));
+    if (!priv->precompress)
+        return false;
+
+    list_head_init(&priv->precompress->dirs);
+    if (!precompress_push_dir(priv->precompress, "")) {
+        free(priv->precompress);
+        priv->precompress = NULL;
+        return false;
+    }
+
+    lwan_job_add_full(precompress_job, priv, "serve_files_precompress",
+                      LWAN_JOB_PRIORITY_LOW, 1, 16000);
+    return true;
+}
+
+static void precompress_shutdown(struct serve_files_priv *priv)
+{
+    /* The job might still be registered even if it's finished. */
+    lwan_job_del(precompress_job, priv);
+    if (priv->precompress)
+        precompress_free(priv->precompress);
+
+    if (priv->precompressed_fd >= 0)
+        close(priv->precompressed_fd);
+}
+
+#if defined(__linux__)
+/* The watcher keeps an inotify watch on every directory under root_path,
+ * and is polled by a job, which invalidates the cache entries for the
+ * files that changed, and for the listings of the directories they're in.
+ * Entries are looked up by the path in the request, so only the canonical
+ * path to a file is invalidated; entries created through other paths (e.g.
+ * symlinks) expire as usual. */
+#define WATCHER_EVENTS                                                         \
+    (IN_ATTRIB | IN_CLOSE_WRITE | IN_CREATE | IN_DELETE | IN_MOVED_FROM |      \
+     IN_MOVED_TO | IN_ONLYDIR)
+
+struct watcher {
+    int fd;
+    /* Watch descriptor -> path of the directory, relative to root_path,
+     * either empty or ending with a slash, as in cache keys */
+    struct hash *dirs;
+
+    /* Path of a directory, as above -> struct dir_handle.  Written to by
+     * task threads creating cache entries, and by the watcher job. */
+    struct hash *handles;
+    pthread_rwlock_t handles_lock;
+};
+
+/* While directories are being watched, paths to files are resolved from
+ * an open handle to the directory they're in, if there's one, so that
+ * finding out that the components leading to it are neither symlinks nor
+ * missing doesn't take going through each one of them again.  Handles are
+ * only kept for directories whose canonical path is the one used to reach
+ * them, and are closed whenever anything happens to any of the directories
+ * leading to them. */
+#define DIR_HANDLES_MAX 1024
+
+struct dir_handle {
+    int fd;
+    /* Full path, ending with a slash, as expected by realpathat2() */
+    char path[];
+};
+
+static void dir_handle_free(void *data)
+{
+    struct dir_handle *handle = data;
+
+    close(handle->fd);
+    free(handle);
+}
+
+/* Only paths without empty, "." or ".." components can be looked up
+ * through a handle, as they're the only ones that can't leave the
+ * directory they seem to be in. */
+static bool is_plain_path(const char *path)
+{
+    for (const char *p = path; *p;) {
+        const char *end = strchrnul(p, '/');
+        const size_t len = (size_t)(end - p);
+
+        if (!len || (len == 1 && p[0] == '.') ||
+            (len == 2 && p[0] == '.' && p[1] == '.'))
+            return false;
+
+        if (!*end)
+            break;
+        p = end + 1;
+    }
+
+    return true;
+}
+
+static void add_dir_handle(struct serve_files_priv *priv,
+                           const char *dir,
+                           size_t dir_len)
+{
+    struct watcher *watcher = priv->watcher;
+    struct dir_handle *handle;
+    struct stat st;
+    char *key;
+    int fd;
+
+    if (hash_get_count(watcher->handles) >= DIR_HANDLES_MAX)
+        return;
+
+    fd = openat(priv->root_fd, dir, O_PATH | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    if (fd < 0)
+        return;
+    if (fstat(fd, &st) < 0 || !S_ISDIR(st.st_mode))
+        goto out_close;
+
+    handle = malloc(sizeof(*handle) + priv->root_path_len + dir_len + 1);
+    if (!handle)
+        goto out_close;
+    key = strndup(dir, dir_len);
+    if (!key)
+        goto out_free_handle;
+
+    handle->fd = fd;
+    memcpy(handle->path, priv->root_path, priv->root_path_len);
+    memcpy(handle->path + priv->root_path_len, dir, dir_len + 1);
+
+    pthread_rwlock_wrlock(&watcher->handles_lock);
+    if (hash_add_unique(watcher->handles, key, handle)) {
+        pthread_rwlock_unlock(&watcher->handles_lock);
+        free(key);
+        dir_handle_free(handle);
+        return;
+    }
+    pthread_rwlock_unlock(&watcher->handles_lock);
+    return;
+
+out_free_handle:
+    free(handle);
+out_close:
+    close(fd);
+}
+
+static bool resolve_path(struct serve_files_priv *priv,
+                         const char *key,
+                         char *full_path,
+                         struct stat *st)
+{
+    struct watcher *watcher = priv->watcher;
+    const char *base;
+    char dir[PATH_MAX];
+    size_t dir_len;
+
+    if (!watcher || !(base = strrchr(key, '/')) || !is_plain_path(key))
+        return realpathat2(priv->root_fd, priv->root_path, key, full_path, st);
+
+    dir_len = (size_t)(base - key) + 1;
+    if (dir_len >= sizeof(dir))
+        return false;
+    memcpy(dir, key, dir_len);
+    dir[dir_len] = '\0';
+
+    pthread_rwlock_rdlock(&watcher->handles_lock);
+    const struct dir_handle *handle = hash_find(watcher->handles, dir);
+    if (handle) {
+        bool found =
+            realpathat2(handle->fd, (char *)handle->path, base + 1, full_path, st);
+
+        pthread_rwlock_unlock(&watcher->handles_lock);
+        return found;
+    }
+    pthread_rwlock_unlock(&watcher->handles_lock);
+
+    if (!realpathat2(priv->root_fd, priv->root_path, key, full_path, st))
+        return false;
+
+    /* If no symlinks were followed, the canonical path is the same one
+     * that was asked for, and the directory can be reached directly. */
+    if (!strncmp(full_path + priv->root_path_len, dir, dir_len) &&
+        !strcmp(full_path + priv->root_path_len + dir_len, base + 1))
+        add_dir_handle(priv, dir, dir_len);
+
+    return true;
+}
+
+/* Closes handles for prefix and all the directories under it. */
+static void close_dir_handles(struct serve_files_priv *priv,
+                              const char *prefix)
+{
+    struct watcher *watcher = priv->watcher;
+    const size_t prefix_len = strlen(prefix);
+    const char *to_delete[64];
+    size_t n_to_delete;
+
+    pthread_rwlock_wrlock(&watcher->handles_lock);
+    do {
+        struct hash_iter iter;
+        const void *key;
+
+        n_to_delete = 0;
+        hash_iter_init(watcher->handles, &iter);
+        while (n_to_delete < N_ELEMENTS(to_delete) &&
+               hash_iter_next(&iter, &key, NULL)) {
+            if (!strncmp(key, prefix, prefix_len))
+                to_delete[n_to_delete++] = key;
+        }
+
+        for (size_t i = 0; i < n_to_delete; i++)
+            hash_del(watcher->handles, to_delete[i]);
+    } while (n_to_delete == N_ELEMENTS(to_delete));
+    pthread_rwlock_unlock(&watcher->handles_lock);
+}
+
+static void watcher_add_tree(struct serve_files_priv *priv,
+                             const char *relpath)
+{
+    struct watcher *watcher = priv->watcher;
+    char path[PATH_MAX];
+    struct dirent *entry;
+    char *relpath_copy;
+    DIR *dir;
+    int wd, fd;
+
+    if (snprintf(path, sizeof(path), "%s/%s", priv->root_path, relpath) >=
+        (int)sizeof(path))
+        return;
+
+    wd = inotify_add_watch(watcher->fd, path, WATCHER_EVENTS);
+    if (wd < 0) {
+        if (errno == ENOSPC) {
+            lwan_status_warning("Can't watch \"%s\": too many watches "
+                                "(see fs.inotify.max_user_watches)",
+                                path);
+        }
+        return;
+    }
+
+    /* Watching the same directory again (e.g. after it has been moved)
+     * returns the same descriptor, so this replaces the old path. */
+    relpath_copy = strdup(relpath);
+    if (UNLIKELY(!relpath_copy) ||
+        hash_add(watcher->dirs, (void *)(intptr_t)wd, relpath_copy)) {
+        free(relpath_copy);
+        inotify_rm_watch(watcher->fd, wd);
+        return;
+    }
+
+    fd = openat(priv->root_fd, relpath[0] ? relpath : ".",
+                O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0)
+        return;
+    dir = fdopendir(fd);
+    if (!dir) {
+        close(fd);
+        return;
+    }
+
+    while ((entry = readdir(dir))) {
+        if (entry->d_name[0] == '.' || entry->d_type != DT_DIR)
+            continue;
+
+        if (snprintf(path, sizeof(path), "%s%s/", relpath, entry->d_name) <
+            (int)sizeof(path))
+            watcher_add_tree(priv, path);
+    }
+
+    closedir(dir);
+}
+
+static void watcher_invalidate(struct serve_files_priv *priv,
+                               const char *dir_relpath,
+                               const struct inotify_event *event)
+{
+    char key[PATH_MAX];
+    size_t dir_len = strlen(dir_relpath);
+    int len;
+
+    /* The directory listing (or index file), with and without the
+     * trailing slash.  The root directory is the empty key. */
+    cache_invalidate(priv->cache, dir_relpath);
+    if (dir_len) {
+        memcpy(key, dir_relpath, dir_len - 1);
+        key[dir_len - 1] = '\0';
+        cache_invalidate(priv->cache, key);
+    }
+
+    if (!event->len)
+        return;
+
+    len = snprintf(key, sizeof(key), "%s%s", dir_relpath, event->name);
+    if (len < 0 || len + 1 >= (int)sizeof(key))
+        return;
+    cache_invalidate(priv->cache, key);
+
+    /* Entries for images know which variants they have */
+    for (size_t i = 0; i < N_ELEMENTS(image_formats); i++) {
+        const size_t suffix_len = strlen(image_formats[i].suffix);
+
+        if ((size_t)len > suffix_len &&
+            streq(key + len - suffix_len, image_formats[i].suffix)) {
+            char original[PATH_MAX];
+
+            memcpy(original, key, (size_t)len - suffix_len);
+            original[(size_t)len - suffix_len] = '\0';
+            cache_invalidate(priv->cache, original);
+        }
+    }
+
+    if (event->mask & IN_ISDIR) {
+        key[len] = '/';
+        key[len + 1] = '\0';
+        cache_invalidate(priv->cache, key);
+        close_dir_handles(priv, key);
+
+        if (event->mask & (IN_CREATE | IN_MOVED_TO))
+            watcher_add_tree(priv, key);
+    }
+}
+
+static bool watcher_job(void *data)
+{
+    struct serve_files_priv *priv = data;
+    struct watcher *watcher = priv->watcher;
+    char buffer[4096]
+        __attribute__((aligned(__alignof__(struct inotify_event))));
+    bool had_events = false;
+
+    while (true) {
+        ssize_t r = read(watcher->fd, buffer, sizeof(buffer));
+
+        if (r <= 0) {
+            if (r < 0 && errno == EINTR)
+                continue;
+            return had_events;
+        }
+
+        for (char *p = buffer; p < buffer + r;) {
+            const struct inotify_event *event = (void *)p;
+            const char *dir_relpath =
+                hash_find(watcher->dirs, (void *)(intptr_t)event->wd);
+
+            p += sizeof(*event) + event->len;
+
+            if (event->mask & IN_Q_OVERFLOW) {
+                lwan_status_warning("Events for %s were lost; some files "
+                                    "might be served from the cache until "
+                                    "they expire",
+                                    priv->root_path);
+                close_dir_handles(priv, "");
+                continue;
+            }
+            if (!dir_relpath)
+                continue;
+
+            if (event->mask & IN_IGNORED) {
+                /* The directory has been removed. */
+                close_dir_handles(priv, dir_relpath);
+                hash_del(watcher->dirs, (void *)(intptr_t)event->wd);
+                continue;
+            }
+
+            watcher_invalidate(priv, dir_relpath, event);
+        }
+
+        had_events = true;
+    }
+}
+
+static bool watcher_init(struct serve_files_priv *priv)
+{
+    struct watcher *watcher = malloc(sizeof(*watcher));
+
+    if (!watcher)
+        return false;
+
+    watcher->fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (watcher->fd < 0) {
+        lwan_status_perror("inotify_init1");
+        free(watcher);
+        return false;
+    }
+
+    watcher->dirs = hash_int_new(NULL, free);
+    if (!watcher->dirs)
+        goto out_close;
+
+    watcher->handles = hash_str_new(free, dir_handle_free);
+    if (!watcher->handles)
+        goto out_free_dirs;
+
+    if (pthread_rwlock_init(&watcher->handles_lock, NULL))
+        goto out_free_handles;
+
+    priv->watcher = watcher;
+    watcher_add_tree(priv, "");
+
+    lwan_status_info("Watching %u directories under %s for changes",
+                     hash_get_count(watcher->dirs), priv->root_path);
+
+    lwan_job_add_full(watcher_job, priv, "serve_files_watcher",
+                      LWAN_JOB_PRIORITY_NORMAL, 100, 1000);
+    return true;
+
+out_free_handles:
+    hash_unref(watcher->handles);
+out_free_dirs:
+    hash_unref(watcher->dirs);
+out_close:
+    close(watcher->fd);
+    free(watcher);
+    return false;
+}
+
+static void watcher_shutdown(struct serve_files_priv *priv)
+{
+    if (!priv->watcher)
+        return;
+
+    lwan_job_del(watcher_job, priv);
+    hash_unref(priv->watcher->handles);
+    pthread_rwlock_destroy(&priv->watcher->handles_lock);
+    hash_unref(priv->watcher->dirs);
+    close(priv->watcher->fd);
+    free(priv->watcher);
+    priv->watcher = NULL;
+}
+#else
+static bool watcher_init(struct serve_files_priv *priv)
+{
+    lwan_status_error("Watching %s for changes isn't supported in this "
+                      "platform",
+                      priv->root_path);
+    return false;
+}
+
+static void watcher_shutdown(struct serve_files_priv *priv
+                             __attribute__((unused)))
+{
+}
+
+static bool resolve_path(struct serve_files_priv *priv,
+                         const char *key,
+                         char *full_path,
+                         struct stat *st)
+{
+    return realpathat2(priv->root_fd, priv->root_path, key, full_path, st);
+}
+#endif
+
+/* The manifest uses the same format as configuration files, with one line
+ * per file, relative to the root path:
+ *
+ *     index.html = </style.css>; rel=preload; as=style
+ */
+static struct hash *load_early_hints(const char *path)
+{
+    struct hash *hints = hash_str_new(free, free);
+    const struct config_line *l;
+    struct config *f;
+
+    if (!hints)
+        return NULL;
+
+    f = config_open(path);
+    if (!f) {
+        lwan_status_perror("Could not open early hints manifest \"%s\"", path);
+        goto out_hash;
+    }
+
+    while ((l = config_read_line(f))) {
+        switch (l->type) {
+        case CONFIG_LINE_TYPE_LINE: {
+            char *file = strdup(l->key);
+            char *links = strdup(l->value);
+
+            if (!file || !links || hash_add_unique(hints, file, links)) {
+                free(file);
+                free(links);
+                config_error(f, "Could not add early hints for \"%s\"",
+                             l->key);
+            }
+            break;
+        }
+        default:
+            config_error(f, "Expected file = Link header value");
+            break;
+        }
+    }
+
+    if (config_last_error(f)) {
+        lwan_status_error("Error on early hints manifest \"%s\", line %d: %s",
+                          path, config_cur_line(f), config_last_error(f));
+        config_close(f);
+        goto out_hash;
+    }
+
+    config_close(f);
+    return hints;
+
+out_hash:
+    hash_unref(hints);
+    return NULL;
+}
+
+static void *
+serve_files_create_from_archive(const char *prefix,
+                                const struct lwan_serve_files_settings *settings)
+{
+    struct serve_files_priv *priv;
+
+    if (settings->precompress || settings->watch) {
+        lwan_status_error("precompress and watch can't be used with archives");
+        return NULL;
+    }
+
+    priv = calloc(1, sizeof(*priv));
+    if (!priv) {
+        lwan_status_perror("calloc");
+        return NULL;
+    }
+    priv->root_fd = -1;
+    priv->precompressed_fd = -1;
+
+    priv->archive = archive_open(settings->archive, settings->populate);
+    if (!priv->archive)
+        goto out_archive;
+
+    priv->root_path = strdup(settings->archive);
+    priv->prefix = strdup(prefix);
+    if (!priv->root_path || !priv->prefix)
+        goto out_strdup;
+    priv->root_path_len = strlen(priv->root_path);
+    priv->index_html =
+        settings->index_html ? settings->index_html : "index.html";
+
+    if (settings->early_hints) {
+        priv->early_hints = load_early_hints(settings->early_hints);
+        if (!priv->early_hints)
+            goto out_strdup;
+    }
+
+    /* Nothing in the archive changes, so entries could be kept forever;
+     * cache_for still applies to the decompressed copies, though. */
+    priv->cache = cache_create(create_cache_entry, destroy_cache_entry, priv,
+                               settings->cache_for);
+    if (!priv->cache) {
+        lwan_status_error("Couldn't create cache");
+        goto out_strdup;
+    }
+    cache_set_name(priv->cache, "serve_files archive %s", settings->archive);
+    cache_set_max_cost(priv->cache, settings->cache_max_size);
+    cache_make_async(priv->cache);
+    cache_track_hot_keys(priv->cache);
 
-    char *ret;
-    if (asprintf(&ret, "%s/", path))
-        return ret;
+    return priv;
 
+out_strdup:
+    if (priv->early_hints)
+        hash_unref(priv->early_hints);
+    free(priv->root_path);
+    free(priv->prefix);
+    archive_close(priv->archive);
+out_archive:
+    free(priv);
     return NULL;
 }
 
@@ -911,6 +2869,9 @@ static void *serve_files_create(const char *prefix, void *args)
     char *canonical_root;
     int root_fd;
 
+    if (settings->archive)
+        return serve_files_create_from_archive(prefix, settings);
+
     if (!settings->root_path) {
         lwan_status_error("root_path not specified");
         return NULL;
@@ -929,11 +2890,12 @@ static void *serve_files_create(const char *prefix, void *args)
         goto out_open;
     }
 
-    priv = malloc(sizeof(*priv));
+    priv = calloc(1, sizeof(*priv));
     if (!priv) {
-        lwan_status_perror("malloc");
+        lwan_status_perror("calloc");
         goto out_malloc;
     }
+    priv->precompressed_fd = -1;
 
     priv->cache = cache_create(create_cache_entry, destroy_cache_entry, priv,
                                settings->cache_for);
@@ -941,6 +2903,10 @@ static void *serve_files_create(const char *prefix, void *args)
         lwan_status_error("Couldn't create cache");
         goto out_cache_create;
     }
+    cache_set_name(priv->cache, "serve_files %s", canonical_root);
+    cache_set_max_cost(priv->cache, settings->cache_max_size);
+    cache_make_async(priv->cache);
+    cache_track_hot_keys(priv->cache);
 
     if (settings->directory_list_template) {
         priv->directory_list_tpl = lwan_tpl_compile_file(
@@ -962,6 +2928,12 @@ static void *serve_files_create(const char *prefix, void *args)
         goto out_tpl_prefix_copy;
     }
 
+    if (settings->early_hints) {
+        priv->early_hints = load_early_hints(settings->early_hints);
+        if (!priv->early_hints)
+            goto out_watcher;
+    }
+
     priv->root_path = canonical_root;
     priv->root_path_len = strlen(canonical_root);
     priv->root_fd = root_fd;
@@ -969,6 +2941,8 @@ static void *serve_files_create(const char *prefix, void *args)
         settings->index_html ? settings->index_html : "index.html";
 
     priv->read_ahead = settings->read_ahead;
+    priv->dir_page_size = LWAN_MAX(settings->directory_list_page_size, (size_t)1);
+    priv->lock_max_size = settings->lock_max_size;
 
     if (settings->serve_precompressed_files)
         priv->flags |= SERVE_FILES_SERVE_PRECOMPRESSED;
@@ -976,10 +2950,32 @@ static void *serve_files_create(const char *prefix, void *args)
         priv->flags |= SERVE_FILES_AUTO_INDEX;
     if (settings->auto_index_readme)
         priv->flags |= SERVE_FILES_AUTO_INDEX_README;
+    if (settings->populate)
+        priv->flags |= SERVE_FILES_POPULATE;
+    if (settings->huge_pages)
+        priv->flags |= SERVE_FILES_HUGE_PAGES;
+
+    if (settings->watch && !watcher_init(priv)) {
+        lwan_status_error("Could not watch %s for changes", canonical_root);
+        goto out_watcher;
+    }
+
+    if (!precompress_init(priv, settings)) {
+        lwan_status_error("Could not initialize precompression");
+        goto out_precompress;
+    }
 
     return priv;
 
+out_precompress:
+    precompress_shutdown(priv);
+    watcher_shutdown(priv);
+out_watcher:
+    if (priv->early_hints)
+        hash_unref(priv->early_hints);
+    free(priv->prefix);
 out_tpl_prefix_copy:
+    lwan_tpl_free(priv->directory_list_tpl);
 out_tpl_compile:
     cache_destroy(priv->cache);
 out_cache_create:
@@ -997,17 +2993,31 @@ static void *serve_files_create_from_hash(const char *prefix,
 {
     struct lwan_serve_files_settings settings = {
         .root_path = hash_find(hash, "path"),
+        .archive = hash_find(hash, "archive"),
         .index_html = hash_find(hash, "index_path"),
+        .early_hints = hash_find(hash, "early_hints"),
         .serve_precompressed_files =
             parse_bool(hash_find(hash, "serve_precompressed_files"), true),
         .auto_index = parse_bool(hash_find(hash, "auto_index"), true),
         .directory_list_template = hash_find(hash, "directory_list_template"),
+        .directory_list_page_size = (size_t)parse_long(
+            hash_find(hash, "directory_list_page_size"),
+            SERVE_FILES_DIRECTORY_LIST_PAGE_SIZE),
         .read_ahead = (size_t)parse_long(hash_find(hash, "read_ahead"),
                                          SERVE_FILES_READ_AHEAD_BYTES),
         .auto_index_readme =
             parse_bool(hash_find(hash, "auto_index_readme"), true),
         .cache_for = (time_t)parse_time_period(hash_find(hash, "cache_for"),
                                                SERVE_FILES_CACHE_FOR),
+        .cache_max_size = (size_t)parse_long(hash_find(hash, "cache_max_size"),
+                                             SERVE_FILES_CACHE_MAX_SIZE),
+        .precompress = parse_bool(hash_find(hash, "precompress"), false),
+        .precompress_path = hash_find(hash, "precompress_path"),
+        .watch = parse_bool(hash_find(hash, "watch"), false),
+        .populate = parse_bool(hash_find(hash, "populate"), false),
+        .huge_pages = parse_bool(hash_find(hash, "huge_pages"), false),
+        .lock_max_size =
+            (size_t)parse_long(hash_find(hash, "lock_max_size"), 0),
     };
 
     return serve_files_create(prefix, &settings);
@@ -1022,9 +3032,16 @@ static void serve_files_destroy(void *data)
         return;
     }
 
+    precompress_shutdown(priv);
+    watcher_shutdown(priv);
     lwan_tpl_free(priv->directory_list_tpl);
     cache_destroy(priv->cache);
-    close(priv->root_fd);
+    if (priv->archive)
+        archive_close(priv->archive);
+    if (priv->early_hints)
+        hash_unref(priv->early_hints);
+    if (priv->root_fd >= 0)
+        close(priv->root_fd);
     free(priv->root_path);
     free(priv->prefix);
     free(priv);
@@ -1039,16 +3056,105 @@ static ALWAYS_INLINE bool client_has_fresh_content(struct lwan_request *request,
     return LIKELY(!r) ? mtime <= header : false;
 }
 
+/* Compressed representations are different from the file contents, so
+ * they get the weak form of the ETag. */
+static const char *etag_value(const struct file_cache_entry *fce,
+                              const struct lwan_key_value *compression_hdr)
+{
+    return compression_hdr ? fce->etag : fce->etag + 2;
+}
+
+static const struct lwan_key_value *
+response_headers(struct lwan_request *request,
+                 const struct file_cache_entry *fce,
+                 const struct lwan_key_value *compression_hdr,
+                 const char *content_range)
+{
+    struct lwan_key_value *headers;
+    size_t n_headers = 0;
+
+    if (!fce->etag[0] && !content_range)
+        return compression_hdr;
+
+    headers = coro_malloc(request->conn->coro, 5 * sizeof(*headers));
+    if (UNLIKELY(!headers))
+        return compression_hdr;
+
+    if (compression_hdr)
+        headers[n_headers++] = *compression_hdr;
+    if (fce->etag[0]) {
+        headers[n_headers++] = (struct lwan_key_value){
+            .key = "ETag",
+            .value = (char *)etag_value(fce, compression_hdr),
+        };
+    }
+    if (content_range) {
+        headers[n_headers++] = (struct lwan_key_value){
+            .key = "Content-Range",
+            .value = (char *)content_range,
+        };
+    }
+    if (fce->images)
+        headers[n_headers++] = vary_accept_hdr;
+    headers[n_headers] = (struct lwan_key_value){};
+
+    return headers;
+}
+
+/* If-None-Match uses the weak comparison function (RFC9110 §13.1.2), so
+ * W/ prefixes are ignored; If-Match uses the strong one, where a weak tag
+ * never matches.  Either way, @etag is the strong form. */
+static bool etag_matches_cmp(const char *header, const char *etag, bool strong)
+{
+    const size_t etag_len = strlen(etag);
+
+    for (const char *p = header; p; p = strchr(p, ',')) {
+        while (*p == ',' || *p == ' ' || *p == '\t')
+            p++;
+
+        if (*p == '*')
+            return true;
+        if (p[0] == 'W' && p[1] == '/') {
+            if (strong)
+                continue;
+            p += 2;
+        }
+
+        if (!strncmp(p, etag, etag_len)) {
+            switch (p[etag_len]) {
+            case '\0':
+            case ',':
+            case ' ':
+            case '\t':
+                return true;
+            }
+        }
+    }
+
+    return false;
+}
+
+static inline bool etag_matches(const char *if_none_match, const char *etag)
+{
+    return etag_matches_cmp(if_none_match, etag, false);
+}
+
+static inline bool etag_matches_strong(const char *if_match, const char *etag)
+{
+    return etag_matches_cmp(if_match, etag, true);
+}
+
 static size_t prepare_headers(struct lwan_request *request,
                               enum lwan_http_status return_status,
                               struct file_cache_entry *fce,
                               size_t size,
                               const struct lwan_key_value *user_hdr,
+                              const char *content_range,
                               char header_buf[static DEFAULT_HEADERS_SIZE])
 {
     char content_length[INT_TO_STR_BUFFER_SIZE];
     size_t discard;
-    struct lwan_key_value additional_headers[4] = {
+    struct lwan_key_value additional_headers[7] = {
         {
             .key = "Last-Modified",
             .value = fce->last_modified.string,
@@ -1058,15 +3164,61 @@ static size_t prepare_headers(struct lwan_request *request,
             .value = uint_to_string(size, content_length, &discard),
         },
     };
+    size_t n_headers = 2;
 
+    if (fce->etag[0]) {
+        additional_headers[n_headers++] = (struct lwan_key_value){
+            .key = "ETag",
+            .value = (char *)etag_value(fce, user_hdr),
+        };
+    }
+    if (content_range) {
+        additional_headers[n_headers++] = (struct lwan_key_value){
+            .key = "Content-Range",
+            .value = (char *)content_range,
+        };
+    }
+    if (fce->images)
+        additional_headers[n_headers++] = vary_accept_hdr;
     if (user_hdr)
-        additional_headers[2] = *user_hdr;
+        additional_headers[n_headers] = *user_hdr;
 
     return lwan_prepare_response_header_full(request, return_status, header_buf,
                                              DEFAULT_HEADERS_SIZE,
                                              additional_headers);
 }
 
+/* Ranges in requests include their last byte; *to is set to the offset
+ * right after it. */
+static enum lwan_http_status
+check_range(off_t f, off_t t, off_t size, off_t *from, off_t *to)
+{
+    /* f < 0: the last t bytes of the file, or all of it if it's smaller
+     * than that (RFC9110 §14.1.2). */
+    if (f < 0) {
+        if (UNLIKELY(t <= 0 || !size))
+            return HTTP_RANGE_UNSATISFIABLE;
+
+        *from = size - LWAN_MIN(t, size);
+        *to = size;
+        return HTTP_PARTIAL_CONTENT;
+    }
+
+    if (UNLIKELY(f > t && t >= 0))
+        return HTTP_RANGE_UNSATISFIABLE;
+
+    /* Range starts beyond the size of the file */
+    if (UNLIKELY(f >= size))
+        return HTTP_RANGE_UNSATISFIABLE;
+
+    /* t < 0: ranges from f to the file size; ranges ending beyond the
+     * file size are cut short (RFC9110 §14.1.2). */
+    *to = (t < 0 || t >= size) ? size : t + 1;
+    *from = f;
+
+    return HTTP_PARTIAL_CONTENT;
+}
+
 static enum lwan_http_status
 compute_range(struct lwan_request *request, off_t *from, off_t *to, off_t size)
 {
@@ -1081,26 +3233,20 @@ compute_range(struct lwan_request *request, off_t *from, off_t *to, off_t size)
         return HTTP_OK;
     }
 
-    /* To must be greater than From; it doesn't make any sense to be
-     * equal, either. */
-    if (UNLIKELY(f >= t && t >= 0))
-        return HTTP_RANGE_UNSATISFIABLE;
-
-    /* Range goes beyond the size of the file */
-    if (UNLIKELY(f >= size || t >= size))
-        return HTTP_RANGE_UNSATISFIABLE;
-
-    /* t < 0: ranges from f to the file size */
-    if (t < 0) {
-        *to = size;
-    } else {
-        if (UNLIKELY(__builtin_sub_overflow(t, f, to)))
-            return HTTP_RANGE_UNSATISFIABLE;
-    }
+    return check_range(f, t, size, from, to);
+}
 
-    *from = f;
+static const char *content_range(struct lwan_request *request,
+                                 enum lwan_http_status status,
+                                 off_t from,
+                                 off_t to,
+                                 off_t size)
+{
+    if (status != HTTP_PARTIAL_CONTENT)
+        return NULL;
 
-    return HTTP_PARTIAL_CONTENT;
+    return coro_printf(request->conn->coro, "bytes %jd-%jd/%jd",
+                       (intmax_t)from, (intmax_t)(to - 1), (intmax_t)size);
 }
 
 static inline bool accepts_encoding(struct lwan_request *request,
@@ -1109,6 +3255,109 @@ static inline bool accepts_encoding(struct lwan_request *request,
     return lwan_request_get_accept_encoding(request) & encoding;
 }
 
+static enum lwan_http_status open_error_status(int fd)
+{
+    switch (-fd) {
+    case EACCES:
+        return HTTP_FORBIDDEN;
+    case EMFILE:
+    case ENFILE:
+        return HTTP_UNAVAILABLE;
+    default:
+        return HTTP_INTERNAL_ERROR;
+    }
+}
+
+#define MAX_BYTERANGES 16
+
+/* Serves a multipart/byteranges response, with each of the parts sent with
+ * sendfile() and preceded by its headers.  Returns HTTP_OK if the ranges
+ * can't be served this way, so that the whole file is sent instead. */
+static enum lwan_http_status
+sendfile_serve_byteranges(struct lwan_request *request,
+                          struct file_cache_entry *fce,
+                          struct lwan_range *ranges,
+                          size_t n_ranges)
+{
+    const struct sendfile_cache_data *sd = &fce->sendfile_cache_data;
+    const off_t file_size = (off_t)sd->uncompressed.size;
+    const int fd = sd->uncompressed.fd;
+    char part_headers_buf[4096];
+    size_t part_headers_end[MAX_BYTERANGES + 1];
+    struct lwan_strbuf part_headers;
+    char boundary[17], content_type[64];
+    char headers[DEFAULT_HEADERS_SIZE];
+    size_t header_len, body_len = 0, n_parts = 0;
+    const char *part_headers_ptr;
+
+    if (UNLIKELY(fd < 0))
+        return open_error_status(fd);
+
+    snprintf(boundary, sizeof(boundary), "%016" PRIx64, lwan_random_uint64());
+
+    lwan_strbuf_init_with_fixed_buffer(&part_headers, part_headers_buf,
+                                       sizeof(part_headers_buf));
+
+    /* Ranges that can't be satisfied are left out; the request is only
+     * rejected if none of them can (RFC9110 §15.5.17). */
+    for (size_t i = 0; i < n_ranges; i++) {
+        off_t from, to;
+
+        if (check_range(ranges[i].from, ranges[i].to, file_size, &from, &to) !=
+            HTTP_PARTIAL_CONTENT)
+            continue;
+
+        ranges[n_parts] = (struct lwan_range){.from = from, .to = to};
+        body_len += (size_t)(to - from);
+
+        if (!lwan_strbuf_append_printf(
+                &part_headers,
+                "%s--%s\r\nContent-Type: %s\r\n"
+                "Content-Range: bytes %jd-%jd/%jd\r\n\r\n",
+                n_parts ? "\r\n" : "", boundary, fce->mime_type,
+                (intmax_t)from, (intmax_t)(to - 1), (intmax_t)file_size))
+            return HTTP_OK;
+        part_headers_end[n_parts++] = lwan_strbuf_get_length(&part_headers);
+    }
+    if (UNLIKELY(!n_parts))
+        return HTTP_RANGE_UNSATISFIABLE;
+    n_ranges = n_parts;
+    if (!lwan_strbuf_append_printf(&part_headers, "\r\n--%s--\r\n", boundary))
+        return HTTP_OK;
+    part_headers_end[n_ranges] = lwan_strbuf_get_length(&part_headers);
+    body_len += part_headers_end[n_ranges];
+
+    snprintf(content_type, sizeof(content_type),
+             "multipart/byteranges; boundary=%s", boundary);
+    request->response.mime_type = content_type;
+    header_len = prepare_headers(request, HTTP_PARTIAL_CONTENT, fce, body_len,
+                                 NULL, NULL, headers);
+    request->response.mime_type = fce->mime_type;
+    if (UNLIKELY(!header_len))
+        return HTTP_INTERNAL_ERROR;
+
+    if (lwan_request_get_method(request) == REQUEST_METHOD_HEAD) {
+        lwan_send(request, headers, header_len, 0);
+        return HTTP_PARTIAL_CONTENT;
+    }
+
+    part_headers_ptr = lwan_strbuf_get_buffer(&part_headers);
+    /* Each sendfile() would otherwise push its part out on its own */
+    lwan_cork(request);
+    lwan_send(request, headers, header_len, MSG_MORE);
+    for (size_t i = 0, start = 0; i < n_ranges; i++) {
+        lwan_sendfile(request, fd, ranges[i].from,
+                      (size_t)(ranges[i].to - ranges[i].from),
+                      part_headers_ptr + start, part_headers_end[i] - start);
+        start = part_headers_end[i];
+    }
+    lwan_send(request, part_headers_ptr + part_headers_end[n_ranges - 1],
+              part_headers_end[n_ranges] - part_headers_end[n_ranges - 1], 0);
+    lwan_uncork(request);
+
+    return HTTP_PARTIAL_CONTENT;
+}
+
 static enum lwan_http_status sendfile_serve(struct lwan_request *request,
                                             void *data)
 {
@@ -1132,6 +3381,17 @@ static enum lwan_http_status sendfile_serve(struct lwan_request *request,
 
         return_status = HTTP_OK;
     } else {
+        struct lwan_range ranges[MAX_BYTERANGES];
+        ssize_t n_ranges =
+            lwan_request_get_ranges(request, ranges, N_ELEMENTS(ranges));
+
+        if (UNLIKELY(n_ranges > 1)) {
+            return_status = sendfile_serve_byteranges(request, fce, ranges,
+                                                      (size_t)n_ranges);
+            if (return_status != HTTP_OK)
+                return return_status;
+        }
+
         return_status =
             compute_range(request, &from, &to, (off_t)sd->uncompressed.size);
         if (UNLIKELY(return_status == HTTP_RANGE_UNSATISFIABLE))
@@ -1141,27 +3401,21 @@ static enum lwan_http_status sendfile_serve(struct lwan_request *request,
         fd = sd->uncompressed.fd;
         size = (size_t)(to - from);
     }
-    if (UNLIKELY(fd < 0)) {
-        switch (-fd) {
-        case EACCES:
-            return HTTP_FORBIDDEN;
-        case EMFILE:
-        case ENFILE:
-            return HTTP_UNAVAILABLE;
-        default:
-            return HTTP_INTERNAL_ERROR;
-        }
-    }
+    if (UNLIKELY(fd < 0))
+        return open_error_status(fd);
 
-    header_len = prepare_headers(request, return_status, fce, size,
-                                 compression_hdr, headers);
+    header_len = prepare_headers(
+        request, return_status, fce, size, compression_hdr,
+        content_range(request, return_status, from, to,
+                      (off_t)sd->uncompressed.size),
+        headers);
     if (UNLIKELY(!header_len))
         return HTTP_INTERNAL_ERROR;
 
     if (lwan_request_get_method(request) == REQUEST_METHOD_HEAD) {
         lwan_send(request, headers, header_len, 0);
     } else {
-        lwan_sendfile(request, fd, from, (size_t)to, headers, header_len);
+        lwan_sendfile(request, fd, from, size, headers, header_len);
     }
 
     return return_status;
@@ -1253,7 +3507,8 @@ static enum lwan_http_status mmap_serve(struct lwan_request *request,
 
     if (compression_hdr)
         return serve_value_ok(request, fce->mime_type, to_serve,
-                              compression_hdr);
+                              response_headers(request, fce, compression_hdr,
+                                               NULL));
 
     off_t from, to;
     enum lwan_http_status status =
@@ -1261,35 +3516,64 @@ static enum lwan_http_status mmap_serve(struct lwan_request *request,
     if (status != HTTP_OK && status != HTTP_PARTIAL_CONTENT)
         return status;
 
-    return serve_buffer(request, fce->mime_type, (char *)to_serve->value + from,
-                        (size_t)(to - from), NULL, status);
+    return serve_buffer(
+        request, fce->mime_type, (char *)to_serve->value + from,
+        (size_t)(to - from),
+        response_headers(request, fce, NULL,
+                         content_range(request, status, from, to,
+                                       (off_t)to_serve->len)),
+        status);
 }
 
-static enum lwan_http_status dirlist_serve(struct lwan_request *request,
-                                           void *data)
+static void append_json_string(struct lwan_strbuf *buf, const char *str)
 {
-    struct file_cache_entry *fce = data;
-    struct dir_list_cache_data *dd = &fce->dir_list_cache_data;
-    const char *icon = lwan_request_get_query_param(request, "icon");
+    static const char hex_digits[] = "0123456789ABCDEF";
+    const char *run = str;
 
-    if (!icon) {
-#if defined(LWAN_HAVE_BROTLI)
-        if (dd->brotli.len && accepts_encoding(request, REQUEST_ACCEPT_BROTLI)) {
-            return serve_value_ok(request, fce->mime_type, &dd->brotli,
-                                  br_compression_hdr);
-        }
-#endif
+    lwan_strbuf_append_char(buf, '"');
+    for (const char *p = str; *p; p++) {
+        const unsigned char c = (unsigned char)*p;
 
-        if (dd->deflated.len && accepts_encoding(request, REQUEST_ACCEPT_DEFLATE)) {
-            return serve_value_ok(request, fce->mime_type, &dd->deflated,
-                                  deflate_compression_hdr);
+        if (c >= 0x20 && c != '"' && c != '\\')
+            continue;
+
+        lwan_strbuf_append_str(buf, run, (size_t)(p - run));
+        run = p + 1;
+
+        if (c == '"' || c == '\\') {
+            lwan_strbuf_append_char(buf, '\\');
+            lwan_strbuf_append_char(buf, (char)c);
+        } else {
+            lwan_strbuf_append_str(buf, "\\u00", 4);
+            lwan_strbuf_append_char(buf, hex_digits[c >> 4]);
+            lwan_strbuf_append_char(buf, hex_digits[c & 15]);
         }
+    }
+    lwan_strbuf_append_strz(buf, run);
+    lwan_strbuf_append_char(buf, '"');
+}
 
-        return serve_buffer(
-            request, fce->mime_type, lwan_strbuf_get_buffer(&dd->rendered),
-            lwan_strbuf_get_length(&dd->rendered), NULL, HTTP_OK);
+static void append_json_dir_entry(struct lwan_strbuf *buf,
+                                  const struct dir_entry *entry)
+{
+    lwan_strbuf_append_strz(buf, "{\"name\":");
+    append_json_string(buf, entry->name);
+
+    if (entry->mime_type) {
+        lwan_strbuf_append_strz(buf, ",\"type\":\"file\",\"mime_type\":");
+        append_json_string(buf, entry->mime_type);
+        lwan_strbuf_append_printf(buf, ",\"size\":%lld}",
+                                  (long long)entry->size);
+    } else {
+        lwan_strbuf_append_strz(buf, ",\"type\":\"directory\"}");
     }
+}
+
+enum dirlist_format { DIRLIST_HTML, DIRLIST_JSON, DIRLIST_NDJSON };
 
+static enum lwan_http_status dirlist_serve_icon(struct lwan_request *request,
+                                                const char *icon)
+{
     STRING_SWITCH (icon) {
     case STR4_INT('b', 'a', 'c', 'k'):
         return serve_value_ok(request, "image/gif", &back_gif_value, NULL);
@@ -1304,6 +3588,147 @@ static enum lwan_http_status dirlist_serve(struct lwan_request *request,
     return HTTP_NOT_FOUND;
 }
 
+/* Serves a page of the listing other than the one that's kept rendered,
+ * or the listing in another format.  Pages start after the entry named by
+ * the "cursor" query parameter, and have up to "limit" entries (but no
+ * more than directory_list_page_size); the cursor for the next page, if
+ * any, is in a Link header (and in the "next" field of JSON listings). */
+static enum lwan_http_status dirlist_serve_page(struct lwan_request *request,
+                                                struct file_cache_entry *fce,
+                                                enum dirlist_format format,
+                                                const char *cursor)
+{
+    struct dir_list_cache_data *dd = &fce->dir_list_cache_data;
+    struct lwan_strbuf *buf = request->response.buffer;
+    const size_t page_size = dd->priv->dir_page_size;
+    const char *limit_param = lwan_request_get_query_param(request, "limit");
+    size_t first = cursor ? dirlist_find_cursor(dd, cursor) : 0;
+    size_t count = page_size;
+    const char *next = NULL;
+
+    if (limit_param) {
+        long limit = parse_long(limit_param, (long)page_size);
+
+        if (limit < 1)
+            return HTTP_BAD_REQUEST;
+        count = LWAN_MIN((size_t)limit, page_size);
+    }
+    count = LWAN_MIN(count, dd->n_entries - first);
+
+    if (first + count < dd->n_entries)
+        next = dd->entries[first + count - 1].name;
+
+    switch (format) {
+    case DIRLIST_HTML:
+        /* The README is only shown in the first page */
+        if (!dirlist_render_page(dd, buf, NULL, NULL, first, count))
+            return HTTP_INTERNAL_ERROR;
+        request->response.mime_type = "text/html";
+        break;
+
+    case DIRLIST_JSON:
+        lwan_strbuf_append_strz(buf, "{\"path\":");
+        append_json_string(buf, dd->rel_path);
+        lwan_strbuf_append_strz(buf, ",\"entries\":[");
+        for (size_t i = first; i < first + count; i++) {
+            if (i != first)
+                lwan_strbuf_append_char(buf, ',');
+            append_json_dir_entry(buf, &dd->entries[i]);
+        }
+        lwan_strbuf_append_strz(buf, "],\"next\":");
+        if (next)
+            append_json_string(buf, next);
+        else
+            lwan_strbuf_append_strz(buf, "null");
+        lwan_strbuf_append_char(buf, '}');
+        request->response.mime_type = "application/json";
+        break;
+
+    case DIRLIST_NDJSON:
+        for (size_t i = first; i < first + count; i++) {
+            append_json_dir_entry(buf, &dd->entries[i]);
+            lwan_strbuf_append_char(buf, '\n');
+        }
+        request->response.mime_type = "application/x-ndjson";
+        break;
+    }
+
+    if (next) {
+        static const char *format_params[] = {
+            [DIRLIST_HTML] = "",
+            [DIRLIST_JSON] = "format=json&",
+            [DIRLIST_NDJSON] = "format=ndjson&",
+        };
+        struct lwan_strbuf link;
+        struct lwan_key_value *headers;
+
+        if (!lwan_strbuf_init(&link))
+            return HTTP_INTERNAL_ERROR;
+        lwan_strbuf_append_printf(&link, "<?%scursor=", format_params[format]);
+        append_cursor(&link, next);
+        lwan_strbuf_append_strz(&link, ">; rel=\"next\"");
+
+        headers = coro_malloc(request->conn->coro, 2 * sizeof(*headers));
+        if (headers) {
+            headers[0].key = "Link";
+            headers[0].value =
+                coro_strndup(request->conn->coro, lwan_strbuf_get_buffer(&link),
+                             lwan_strbuf_get_length(&link));
+            headers[1] = (struct lwan_key_value){};
+        }
+        lwan_strbuf_free(&link);
+
+        if (!headers || !headers[0].value)
+            return HTTP_INTERNAL_ERROR;
+        request->response.headers = headers;
+    }
+
+    return HTTP_OK;
+}
+
+static enum lwan_http_status dirlist_serve(struct lwan_request *request,
+                                           void *data)
+{
+    struct file_cache_entry *fce = data;
+    struct dir_list_cache_data *dd = &fce->dir_list_cache_data;
+    const char *icon = lwan_request_get_query_param(request, "icon");
+    const char *format = lwan_request_get_query_param(request, "format");
+    const char *cursor = lwan_request_get_query_param(request, "cursor");
+    enum dirlist_format fmt = DIRLIST_HTML;
+
+    if (icon)
+        return dirlist_serve_icon(request, icon);
+
+    if (format) {
+        if (streq(format, "json"))
+            fmt = DIRLIST_JSON;
+        else if (streq(format, "ndjson"))
+            fmt = DIRLIST_NDJSON;
+        else if (!streq(format, "html"))
+            return HTTP_BAD_REQUEST;
+    }
+
+    if (fmt != DIRLIST_HTML || cursor ||
+        lwan_request_get_query_param(request, "limit"))
+        return dirlist_serve_page(request, fce, fmt, cursor);
+
+#if defined(LWAN_HAVE_BROTLI)
+    if (dd->brotli.len && accepts_encoding(request, REQUEST_ACCEPT_BROTLI)) {
+        return serve_value_ok(request, fce->mime_type, &dd->brotli,
+                              br_compression_hdr);
+    }
+#endif
+
+    if (dd->deflated.len && accepts_encoding(request, REQUEST_ACCEPT_DEFLATE)) {
+        return serve_value_ok(request, fce->mime_type, &dd->deflated,
+                              deflate_compression_hdr);
+    }
+
+    return serve_buffer(request, fce->mime_type,
+                        lwan_strbuf_get_buffer(&dd->rendered),
+                        lwan_strbuf_get_length(&dd->rendered), NULL, HTTP_OK);
+}
+
 static enum lwan_http_status redir_serve(struct lwan_request *request,
                                          void *data)
 {
@@ -1320,23 +3745,214 @@ static enum lwan_http_status redir_serve(struct lwan_request *request,
                                      : HTTP_INTERNAL_ERROR;
 }
 
+/* Whether @accept lists @type without a zero quality value.  Wildcards
+ * don't count: browsers accept any image type with them, whether they can
+ * decode a particular format or not. */
+static bool accepts_media_type(const char *accept, const char *type)
+{
+    const size_t type_len = strlen(type);
+
+    for (const char *p = accept; p; p = strchr(p, ',')) {
+        while (*p == ',' || *p == ' ' || *p == '\t')
+            p++;
+
+        if (strncasecmp(p, type, type_len))
+            continue;
+
+        p += type_len;
+        while (*p == ' ' || *p == '\t')
+            p++;
+        if (*p == ',' || *p == '\0')
+            return true;
+        if (*p != ';')
+            continue;
+
+        const char *end = strchr(p, ',');
+        const char *q = strstr(p, "q=");
+        if (!q || (end && q > end))
+            return true;
+        return strtod(q + 2, NULL) > 0;
+    }
+
+    return false;
+}
+
+static const struct image_variant *
+pick_image_variant(struct lwan_request *request,
+                   const struct image_variants *images)
+{
+    const char *accept = lwan_request_get_header(request, "Accept");
+    const struct image_variant *best = NULL;
+
+    if (!accept)
+        return NULL;
+
+    for (size_t i = 0; i < images->n_variants; i++) {
+        const struct image_variant *variant = &images->variants[i];
+
+        if ((!best || variant->size < best->size) &&
+            accepts_media_type(accept, variant->mime_type))
+            best = variant;
+    }
+
+    return best;
+}
+
+static enum lwan_http_status image_variant_serve(struct lwan_request *request,
+                                                 void *data)
+{
+    const struct file_cache_entry *fce = data;
+    const struct image_variant *variant =
+        pick_image_variant(request, fce->images);
+    char content_length[INT_TO_STR_BUFFER_SIZE];
+    char headers[DEFAULT_HEADERS_SIZE];
+    enum lwan_http_status status;
+    size_t header_len, discard;
+    const char *range;
+    off_t from, to;
+
+    if (UNLIKELY(!variant))
+        return HTTP_INTERNAL_ERROR;
+
+    status = compute_range(request, &from, &to, (off_t)variant->size);
+    if (UNLIKELY(status == HTTP_RANGE_UNSATISFIABLE))
+        return HTTP_RANGE_UNSATISFIABLE;
+
+    const size_t size = (size_t)(to - from);
+    range = content_range(request, status, from, to, (off_t)variant->size);
+    struct lwan_key_value additional_headers[] = {
+        {"Last-Modified", (char *)fce->last_modified.string},
+        {"Content-Length", uint_to_string(size, content_length, &discard)},
+        {"ETag", (char *)variant->etag},
+        vary_accept_hdr,
+        {range ? "Content-Range" : NULL, (char *)range},
+        {},
+    };
+
+    request->response.mime_type = variant->mime_type;
+    header_len = lwan_prepare_response_header_full(
+        request, status, headers, DEFAULT_HEADERS_SIZE, additional_headers);
+    if (UNLIKELY(!header_len))
+        return HTTP_INTERNAL_ERROR;
+
+    if (lwan_request_get_method(request) == REQUEST_METHOD_HEAD) {
+        lwan_send(request, headers, header_len, 0);
+    } else {
+        lwan_sendfile(request, variant->fd, from, size, headers, header_len);
+    }
+
+    return status;
+}
+
+static enum lwan_http_status not_modified(struct lwan_request *request,
+                                          const struct file_cache_entry *fce,
+                                          const struct image_variant *image)
+{
+    /* Setting a MIME type keeps lwan_response() from sending the error
+     * page as the body. */
+    request->flags |= RESPONSE_NO_CONTENT_LENGTH;
+
+    if (image) {
+        const struct lwan_key_value headers[] = {
+            {"ETag", (char *)image->etag},
+            vary_accept_hdr,
+            {},
+        };
+
+        request->response.mime_type = image->mime_type;
+        request->response.headers =
+            coro_memdup(request->conn->coro, headers, sizeof(headers));
+    } else {
+        request->response.mime_type = fce->mime_type;
+        request->response.headers = response_headers(request, fce, NULL, NULL);
+    }
+
+    return HTTP_NOT_MODIFIED;
+}
+
+/* A client wants an encoding that was skipped when this entry was built:
+ * it's served whatever is there this time, and the entry is built again
+ * (with that encoding, now that it's wanted) for the next request. */
+static void rebuild_if_encoding_wanted(struct serve_files_priv *priv,
+                                       struct lwan_request *request,
+                                       struct file_cache_entry *fce)
+{
+    unsigned int skipped = fce->skipped_encodings;
+    unsigned int wanted =
+        (unsigned int)lwan_request_get_accept_encoding(request) & skipped;
+
+    if (!wanted)
+        return;
+
+    /* Only one of the requests noticing this gets to invalidate it. */
+    if (__atomic_compare_exchange_n(&fce->skipped_encodings, &skipped, 0,
+                                    false, __ATOMIC_RELAXED,
+                                    __ATOMIC_RELAXED))
+        cache_invalidate(priv->cache, fce->base.key);
+}
+
 static enum lwan_http_status
 serve_files_handle_request(struct lwan_request *request,
                            struct lwan_response *response,
                            void *instance)
 {
     struct serve_files_priv *priv = instance;
+    const struct image_variant *image = NULL;
     struct file_cache_entry *fce;
     struct cache_entry *ce;
 
-    ce = cache_coro_get_and_ref_entry(priv->cache, request->conn->coro,
-                                      request->url.value);
+    /* Before looking the file up, so that an entry created by this
+     * request already has the encodings it accepts. */
+    note_encodings_wanted(request);
+
+    ce = cache_request_get_and_ref_entry(priv->cache, request,
+                                         request->url.value);
     if (UNLIKELY(!ce))
         return HTTP_NOT_FOUND;
 
     fce = (struct file_cache_entry *)ce;
-    if (client_has_fresh_content(request, fce->last_modified.integer))
-        return HTTP_NOT_MODIFIED;
+
+    if (UNLIKELY(fce->skipped_encodings))
+        rebuild_if_encoding_wanted(priv, request, fce);
+    if (UNLIKELY(fce->images != NULL))
+        image = pick_image_variant(request, fce->images);
+
+    const char *etag = image ? image->etag : fce->etag[0] ? fce->etag + 2 : NULL;
+
+    /* If-Match is evaluated first (RFC9110 §13.2.2); without an ETag to
+     * compare against, only "*" can match. */
+    const char *if_match = lwan_request_get_header(request, "If-Match");
+    if (if_match) {
+        if (!etag_matches_strong(if_match, etag ? etag : "*"))
+            return HTTP_PRECONDITION_FAILED;
+    }
+
+    /* If-Modified-Since is ignored if If-None-Match is present, so a file
+     * that has been touched without changing is still fresh. */
+    const char *if_none_match = lwan_request_get_header(request, "If-None-Match");
+    if (if_none_match) {
+        if (etag && etag_matches(if_none_match, etag))
+            return not_modified(request, fce, image);
+    } else if (client_has_fresh_content(request, fce->last_modified.integer)) {
+        return not_modified(request, fce, image);
+    }
+
+    if (fce->early_hints &&
+        lwan_request_get_method(request) != REQUEST_METHOD_HEAD) {
+        lwan_response_send_early_hints(
+            request,
+            (struct lwan_key_value[]){{"Link", (char *)fce->early_hints}, {}});
+    }
+
+    if (image) {
+        response->mime_type = image->mime_type;
+        response->stream.callback = image_variant_serve;
+        response->stream.data = fce;
+
+        request->flags |= RESPONSE_STREAM;
+
+        return HTTP_OK;
+    }
 
     if (fce->funcs->serve == sendfile_serve) {
         response->mime_type = fce->mime_type;
@@ -27,16 +27,28 @@ extern "C" {
 
 #define SERVE_FILES_READ_AHEAD_BYTES (128 * 1024)
 #define SERVE_FILES_CACHE_FOR 5
+#define SERVE_FILES_CACHE_MAX_SIZE (64 * 1024 * 1024)
+#define SERVE_FILES_DIRECTORY_LIST_PAGE_SIZE 1000
 
 struct lwan_serve_files_settings {
   const char *root_path;
   const char *index_html;
   const char *directory_list_template;
+  const char *precompress_path;
+  const char *archive;
+  const char *early_hints;
   size_t read_ahead;
+  size_t directory_list_page_size;
   time_t cache_for;
+  size_t cache_max_size;
+  size_t lock_max_size;
   bool serve_precompressed_files;
   bool auto_index;
   bool auto_index_readme;
+  bool precompress;
+  bool watch;
+  bool populate;
+  bool huge_pages;
 };
 
 LWAN_MODULE_FORWARD_DECL(serve_files);
@@ -49,9 +61,19 @@ LWAN_MODULE_FORWARD_DECL(serve_files);
     .index_html = index_html_, \
     .serve_precompressed_files = serve_precompressed_files_, \
     .directory_list_template = NULL, \
+    .directory_list_page_size = SERVE_FILES_DIRECTORY_LIST_PAGE_SIZE, \
     .auto_index = true, \
     .auto_index_readme = true, \
     .cache_for = SERVE_FILES_CACHE_FOR, \
+    .cache_max_size = SERVE_FILES_CACHE_MAX_SIZE, \
+    .precompress = false, \
+    .precompress_path = NULL, \
+    .archive = NULL, \
+    .early_hints = NULL, \
+    .watch = false, \
+    .populate = false, \
+    .huge_pages = false, \
+    .lock_max_size = 0, \
   }}), \
   .flags = (enum lwan_handler_flags)0
 
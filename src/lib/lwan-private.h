@@ -25,29 +25,123 @@
 #include "lwan.h"
 
 #define N_HEADER_START 64
+#define N_HEADER_INDEX (N_HEADER_START * 2)
 #define DEFAULT_BUFFER_SIZE 4096
 #define DEFAULT_HEADERS_SIZE 2048
 
+enum lwan_body_stream_state {
+    BODY_STREAM_NONE,
+    BODY_STREAM_BUFFERED,   /* Whole body is in memory already */
+    BODY_STREAM_DATA,       /* Body with a Content-Length */
+    BODY_STREAM_CHUNK_SIZE, /* Chunked body: expecting a chunk size line */
+    BODY_STREAM_CHUNK_DATA,
+    BODY_STREAM_CHUNK_END,  /* Chunked body: expecting CRLF after a chunk */
+    BODY_STREAM_TRAILERS,
+    BODY_STREAM_DONE,
+    BODY_STREAM_FAILED,
+};
+
+/* Request headers are first read into DEFAULT_BUFFER_SIZE bytes in the
+ * coroutine stack.  If they don't fit, they're moved to buffers of twice
+ * the size, taken from the same per-thread pool used by strbufs, until
+ * max_size bytes (request_buffer_size in the configuration) are reached. */
+struct lwan_request_buffer {
+    struct lwan_value value; /* value.len is how much has been read */
+    char *stack;
+    size_t size;
+    size_t max_size;
+};
+
+void lwan_request_buffer_shrink(struct lwan_request_buffer *buffer);
+
+/* State only needed by requests that stream their bodies or that have been
+ * upgraded to WebSockets.  It's allocated by lwan_request_get_streams() the
+ * first time it's needed, so that it's not cleared for every request. */
+struct lwan_request_streams {
+    struct { /* Messages read and written piecewise over WebSockets */
+        uint64_t frame_remaining; /* Payload left to read in this frame */
+        uint64_t frame_offset;    /* Payload read so far in this frame */
+        char mask[4];
+        bool in_frame, last_frame;
+        bool reading, read_compressed;
+        bool writing, write_compressed;
+    } websocket;
+
+    struct { /* Request body read piecewise; see lwan_request_read_body() */
+        struct lwan_value pending; /* Received but not handed out yet */
+        char *line_buffer;         /* Chunk sizes and trailers are read here */
+        uint64_t remaining;        /* Left in the body or in this chunk */
+        uint64_t max_size;         /* Left before the body is too large */
+        enum lwan_body_stream_state state;
+        bool keep_alive, expect_continue;
+    } body_stream;
+};
+
 struct lwan_request_parser_helper {
+    /* Fields used while reading and parsing every request, and while
+     * sending every response, come first; see the static_assert() below. */
     struct lwan_value *buffer; /* The whole request buffer */
+    struct lwan_request_buffer *request_buffer; /* Set if buffer can grow */
     char *next_request;        /* For pipelined requests */
 
+    char **header_start;   /* Headers: n: start, n+1: end */
+    size_t n_header_start; /* len(header_start) */
+    uint16_t *header_index; /* N_HEADER_INDEX entries */
+
+    struct lwan_strbuf *queued_responses; /* Responses to pipelined requests */
+    uint64_t request_id; /* Request ID for debugging purposes */
+
     struct lwan_value accept_encoding; /* Accept-Encoding: */
+    struct lwan_value connection; /* Connection: */
+    struct lwan_value host; /* Host: */
+
+    uint64_t bytes_sent; /* Response bytes sent to the client, or queued */
+
+    struct lwan_h2_stream *h2_stream; /* Set if this request came in a
+                                       * HTTP/2 stream */
 
     struct lwan_value query_string; /* Stuff after ? and before # */
 
+    time_t error_when_time;   /* Time to abort request read */
+    int error_when_n_packets; /* Max. number of packets */
+    int urls_rewritten;       /* Times URLs have been rewritten */
+    bool header_index_built;
+    bool corked; /* See lwan_cork() */
+
+    /* Fields below are only used by some requests. */
+    struct lwan_request_streams *streams; /* See lwan_request_get_streams() */
+
+    struct lwan_response_compressor *compressor; /* Set if a chunked
+                                                  * response is being
+                                                  * compressed */
+
+    struct lwan_chunk_buffer *chunk_buffer; /* Set once small chunks of a
+                                             * chunked response are
+                                             * being coalesced */
+
+    struct lwan_trace *trace; /* Set if this request is being traced */
+
+    struct lwan_request_phases *phases; /* Set if slow requests are being
+                                         * logged */
+
+    uint64_t deadline; /* When the handler has to be done by, in the
+                        * milliseconds of the timer wheel; 0 if there's
+                        * no deadline.  See lwan_request_set_deadline() */
+
+    struct lwan_websocket_deflate *ws_deflate; /* Set if permessage-deflate
+                                                * has been negotiated */
+    uint32_t ws_pong_rtt_us; /* Of the last keep-alive ping */
+
     struct lwan_value body_data;      /* Request body for POST and PUT */
+    struct file_backed_buffer *body_file; /* Set if body_data is in a
+                                           * temporary file */
     struct lwan_value content_type;   /* Content-Type: for POST and PUT */
     struct lwan_value content_length; /* Content-Length: */
 
-    struct lwan_value connection; /* Connection: */
-
-    struct lwan_value host; /* Host: */
-
     struct lwan_key_value_array cookies, query_params, post_params;
-
-    char **header_start;   /* Headers: n: start, n+1: end */
-    size_t n_header_start; /* len(header_start) */
+    /* Built on the first lookup into large arrays; see value_lookup() */
+    struct lwan_key_value_index *cookies_index, *query_params_index,
+        *post_params_index;
 
     struct { /* If-Modified-Since: */
         struct lwan_value raw;
@@ -58,14 +152,100 @@ struct lwan_request_parser_helper {
         struct lwan_value raw;
         off_t from, to;
     } range;
+};
 
-    uint64_t request_id; /* Request ID for debugging purposes */
+#if defined(__x86_64__)
+static_assert(offsetof(struct lwan_request_parser_helper, h2_stream) +
+                      sizeof(void *) <=
+                  128,
+              "Fields used by every request fit in two cache lines");
+#endif
 
-    time_t error_when_time;   /* Time to abort request read */
-    int error_when_n_packets; /* Max. number of packets */
-    int urls_rewritten;       /* Times URLs have been rewritten */
+struct lwan_request_streams *
+lwan_request_get_streams(struct lwan_request *request);
+
+/* Where the time went while serving a request, for slow requests to be
+ * logged with a breakdown; see `slow_request_threshold`.  Awaiting file
+ * descriptors happens while in other phases (mostly the handler), so it
+ * overlaps with them.  */
+enum lwan_request_phase {
+    REQUEST_PHASE_READ,
+    REQUEST_PHASE_BODY,
+    REQUEST_PHASE_REWRITE,
+    REQUEST_PHASE_HANDLER,
+    REQUEST_PHASE_SEND,
+    REQUEST_PHASE_AWAIT,
+    N_REQUEST_PHASES,
+};
+
+struct lwan_request_phases {
+    uint64_t began; /* When the current phase began */
+    uint64_t ns[N_REQUEST_PHASES];
 };
 
+static inline uint64_t lwan_request_phase_clock(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ull + (uint64_t)now.tv_nsec;
+}
+
+static inline void lwan_request_phase_begin(struct lwan_request *request)
+{
+    struct lwan_request_phases *phases = request->helper->phases;
+
+    if (UNLIKELY(phases != NULL))
+        phases->began = lwan_request_phase_clock();
+}
+
+static inline void lwan_request_phase_end(struct lwan_request *request,
+                                          enum lwan_request_phase phase)
+{
+    struct lwan_request_phases *phases = request->helper->phases;
+
+    if (UNLIKELY(phases != NULL)) {
+        const uint64_t now = lwan_request_phase_clock();
+
+        phases->ns[phase] += now - phases->began;
+        phases->began = now;
+    }
+}
+
+/* Awaiting doesn't end the phase it happens in, so it's timed on its own */
+static inline uint64_t lwan_request_await_began(struct lwan_request *request)
+{
+    return UNLIKELY(request->helper->phases != NULL)
+               ? lwan_request_phase_clock()
+               : 0;
+}
+
+static inline void lwan_request_await_ended(struct lwan_request *request,
+                                            uint64_t began)
+{
+    struct lwan_request_phases *phases = request->helper->phases;
+
+    if (UNLIKELY(phases != NULL))
+        phases->ns[REQUEST_PHASE_AWAIT] += lwan_request_phase_clock() - began;
+}
+
+/* Requests served by URL maps with a deadline are cancelled at the first
+ * await point (lwan_request_await_*(), lwan_request_sleep(), and waiting
+ * for a cache entry) after it has passed: they get a 503 response if
+ * nothing has been sent yet, and the coroutine is aborted. */
+void lwan_request_set_deadline(struct lwan_request *request, unsigned int ms);
+void lwan_request_cancel(struct lwan_request *request)
+    __attribute__((noreturn));
+uint64_t lwan_request_clamp_to_deadline(struct lwan_request *request,
+                                        uint64_t ms);
+bool lwan_request_deadline_passed(const struct lwan_request *request);
+
+static inline void lwan_request_check_deadline(struct lwan_request *request)
+{
+    if (UNLIKELY(request->helper->deadline != 0) &&
+        lwan_request_deadline_passed(request))
+        lwan_request_cancel(request);
+}
 
 #define LWAN_CONCAT(a_, b_) a_ ## b_
 #define LWAN_TMP_ID_DETAIL(n_) LWAN_CONCAT(lwan_tmp_id, n_)
@@ -87,25 +267,284 @@ void lwan_set_thread_name(const char *name);
 void lwan_response_init(struct lwan *l);
 void lwan_response_shutdown(struct lwan *l);
 
+/* Sockets for every thread serving a listener are in the same SO_REUSEPORT
+ * group; `first_fd` is the first one created for that listener, or -1. */
 int lwan_create_listen_socket(const struct lwan *l,
-                              bool print_listening_msg,
+                              const char *listener,
+                              const struct lwan_listener_options *options,
+                              int first_fd,
                               bool is_https);
 
 void lwan_thread_init(struct lwan *l);
 void lwan_thread_shutdown(struct lwan *l);
+void lwan_thread_unwatch_fd(struct lwan_thread *t, int fd);
+void lwan_thread_unwatch_open_fd(struct lwan_thread *t, int fd);
+void lwan_thread_close_fds(struct lwan_thread *t, int fds[], size_t n_fds);
+
+/* Used by lwan-sync.c: parking yields until the connection is woken up,
+ * but might also return spuriously.  Waking up works from any thread. */
+void lwan_thread_park_conn(struct lwan_request *request, bool keep_events);
+void lwan_thread_wake_conn(struct lwan_connection *conn);
+
+/* Used by lwan-kv-client.c: file descriptors shared by every coroutine of
+ * a thread, whose events are handled by a callback in the event loop.
+ * These must only be called from the thread @t.  Watchers still around
+ * when the thread is shut down get a last callback, with no events; the
+ * file descriptor is theirs to close, and @t is gone after that. */
+typedef void (*lwan_thread_fd_watcher_cb)(void *data, uint32_t events);
+int lwan_thread_add_fd_watcher(struct lwan_thread *t,
+                               int fd,
+                               uint32_t events,
+                               lwan_thread_fd_watcher_cb cb,
+                               void *data);
+int lwan_thread_mod_fd_watcher(struct lwan_thread *t, int fd, uint32_t events);
+void lwan_thread_del_fd_watcher(struct lwan_thread *t, int fd);
 
 void lwan_status_init(struct lwan *l);
 void lwan_status_shutdown(struct lwan *l);
 
+enum lwan_job_priority {
+    LWAN_JOB_PRIORITY_LOW,
+    LWAN_JOB_PRIORITY_NORMAL,
+    LWAN_JOB_PRIORITY_HIGH,
+    /* Used by lwan_job_run_task(); not valid for periodic jobs. */
+    LWAN_JOB_PRIORITY_TASK,
+};
+
+struct lwan_job_stats {
+    const char *name;
+    unsigned int id;
+
+    uint64_t runs;
+    uint64_t productive_runs;
+    /* How long after its deadline a job started running */
+    uint64_t latency_total_us;
+    uint64_t latency_max_us;
+    uint64_t duration_total_us;
+    uint64_t duration_max_us;
+};
+
 void lwan_job_thread_init(void);
 void lwan_job_thread_main_loop(void);
+void lwan_job_thread_stop(void);
 void lwan_job_thread_shutdown(void);
 void lwan_job_add(bool (*cb)(void *data), void *data);
+void lwan_job_add_full(bool (*cb)(void *data),
+                       void *data,
+                       const char *name,
+                       enum lwan_job_priority priority,
+                       unsigned int min_interval_ms,
+                       unsigned int max_interval_ms);
 void lwan_job_del(bool (*cb)(void *data), void *data);
+bool lwan_job_run_task(void (*cb)(void *data), void *data);
+void lwan_job_foreach_stats(void (*cb)(const struct lwan_job_stats *stats,
+                                       void *data),
+                            void *data);
+
+void lwan_upgrade_init(struct lwan *l);
+void lwan_upgrade_main_loop(struct lwan *l);
+void lwan_upgrade_shutdown(void);
+int lwan_upgrade_take_listener(bool tls);
+int lwan_upgrade_get_drain_fd(void);
 
 void lwan_tables_init(void);
 void lwan_tables_shutdown(void);
 
+void lwan_resolver_init(void);
+void lwan_resolver_shutdown(void);
+void lwan_shared_dict_shutdown(void);
+
+void lwan_memory_pressure_init(void);
+void lwan_memory_pressure_shutdown(void);
+
+int lwan_cgroup_open_file(const char *name);
+void lwan_cpu_quota_init(struct lwan *l);
+void lwan_cpu_quota_shutdown(struct lwan *l);
+
+void lwan_set_worker_processes(unsigned int n_processes);
+bool lwan_is_compressible_mime_type(const char *mime_type);
+
+void lwan_access_log_parse_config(struct config *c);
+void lwan_access_log_init(void);
+void lwan_access_log_shutdown(void);
+struct lwan_access_log_ring *lwan_access_log_ring_new(void);
+/* Returns true once every request logged before the first call with
+ * `*mark` set to 0 has been written out. */
+bool lwan_access_log_caught_up(uint64_t *mark);
+void lwan_access_log_request(struct lwan_request *request,
+                             enum lwan_http_status status,
+                             const struct lwan_url_map *url_map,
+                             const struct timespec *begin);
+
+/* Spans are recorded only if request->helper->trace is set, which happens
+ * for sampled requests once lwan_tracing_begin() has been called. */
+enum lwan_trace_span_name {
+    LWAN_SPAN_REQUEST,
+    LWAN_SPAN_PARSE,
+    LWAN_SPAN_HANDLER,
+    LWAN_SPAN_SEND,
+    LWAN_SPAN_PROXY,
+    LWAN_SPAN_FASTCGI,
+};
+
+struct lwan_trace_span {
+    uint64_t id;
+    uint64_t parent_id;
+    uint64_t begin_ns;
+};
+
+/* "00-" trace ID "-" parent ID "-" flags, and the terminating NUL */
+#define LWAN_TRACEPARENT_SIZE 56
+
+void lwan_tracing_parse_config(struct config *c);
+void lwan_tracing_init(void);
+void lwan_tracing_shutdown(void);
+struct lwan_trace_ring *lwan_tracing_ring_new(void);
+void lwan_tracing_begin(struct lwan_request *request,
+                        const struct timespec *begin,
+                        enum lwan_http_status parse_status);
+void lwan_tracing_end(struct lwan_request *request,
+                      enum lwan_http_status status);
+/* Spans begun after this one, and before it ends, are its children. */
+void lwan_tracing_span_begin(struct lwan_request *request,
+                             struct lwan_trace_span *span);
+void lwan_tracing_span_end(struct lwan_request *request,
+                           const struct lwan_trace_span *span,
+                           enum lwan_trace_span_name name,
+                           const char *detail,
+                           enum lwan_http_status status);
+/* For calls made to other services from within the innermost span. */
+void lwan_tracing_get_traceparent(const struct lwan_request *request,
+                                  char buffer[static LWAN_TRACEPARENT_SIZE]);
+
+#define LWAN_LATENCY_MAX_URL_MAPS 256
+#define LWAN_LATENCY_UNTRACKED UINT_MAX
+
+/* What requests handled by a URL map have used, from when they've been
+ * read until their responses have been sent.  Cycles are counted with the
+ * TSC on x86, the virtual counter on ARM, and in nanoseconds elsewhere. */
+struct lwan_url_map_usage {
+    uint64_t cycles;
+    uint64_t yields;
+    uint64_t arena_allocs, arena_bytes;
+    uint64_t heap_allocs, heap_bytes;
+};
+
+struct lwan_latency_summary {
+    const char *prefix;
+    uint64_t count;
+    uint64_t sum;
+    uint64_t p50, p90, p99, p999;
+    struct lwan_url_map_usage usage; /* Totals; only for URL maps */
+};
+
+static ALWAYS_INLINE uint64_t lwan_read_cycle_counter(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    return __builtin_ia32_rdtsc();
+#elif defined(__aarch64__)
+    uint64_t ticks;
+
+    __asm__ __volatile__("mrs %0, cntvct_el0" : "=r"(ticks));
+    return ticks;
+#else
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ull + (uint64_t)now.tv_nsec;
+#endif
+}
+
+extern bool lwan_latency_enabled;
+
+void lwan_latency_enable(void);
+unsigned int lwan_latency_url_map_id(const char *prefix);
+void lwan_latency_thread_init(struct lwan_thread *t);
+void lwan_latency_thread_shutdown(struct lwan_thread *t);
+/* Takes what the coroutine handling a request has used so far. */
+void lwan_latency_usage_snapshot(const struct coro *coro,
+                                 struct lwan_url_map_usage *usage);
+void lwan_latency_record(struct lwan_thread *t,
+                         unsigned int url_map_id,
+                         uint64_t us,
+                         const struct coro *coro,
+                         const struct lwan_url_map_usage *begin);
+void lwan_latency_record_resume(struct lwan_thread *t,
+                                uint64_t scheduling_delay_ns,
+                                uint64_t resume_duration_ns);
+void lwan_latency_foreach_summary(
+    const struct lwan *l,
+    void (*cb)(const struct lwan_latency_summary *summary, void *data),
+    void *data);
+void lwan_latency_thread_summaries(const struct lwan_thread *t,
+                                   struct lwan_latency_summary *scheduling_delay,
+                                   struct lwan_latency_summary *resume_duration);
+
+enum lwan_encoding {
+    LWAN_ENCODING_IDENTITY,
+    LWAN_ENCODING_DEFLATE,
+    LWAN_ENCODING_GZIP,
+    LWAN_ENCODING_BROTLI,
+    LWAN_ENCODING_ZSTD,
+};
+
+void lwan_compress_init(struct lwan *l);
+void lwan_compress_shutdown(struct lwan *l);
+void lwan_response_compress(struct lwan_request *request);
+const struct lwan_key_value *
+lwan_response_compress_stream(struct lwan_request *request,
+                              const struct lwan_key_value *headers);
+bool lwan_response_compress_chunk(struct lwan_request *request,
+                                  const char *in,
+                                  size_t len,
+                                  struct lwan_value *out);
+/* Compresses @in, as a whole, at @level (as understood by the library
+ * behind @encoding: zlib levels for deflate and gzip, even if ISA-L is
+ * used, brotli qualities, and zstd levels) into a buffer allocated with
+ * malloc(). */
+bool lwan_compress_value(enum lwan_encoding encoding,
+                         int level,
+                         const struct lwan_value *in,
+                         struct lwan_value *out);
+
+/* Set in the flags of timeouts that belong to a struct lwan_chunk_timer,
+ * rather than to a request, in the timer wheel of a thread. */
+#define TIMEOUT_FLUSH_CHUNKS 0x100
+
+/* Armed while coalesced chunks are waiting to be sent, so that they're not
+ * held back for longer than the latency watermark once the handler goes
+ * quiet; when it goes off, the connection is resumed, and the chunks are
+ * sent the next time the handler waits for the client. */
+struct lwan_chunk_timer {
+    struct timeout timeout;
+    struct lwan_request *request;
+};
+
+bool lwan_response_flush_chunk_buffer(struct lwan_request *request);
+bool lwan_response_chunks_are_due(const struct lwan_request *request);
+
+/* Sends chunks that have been coalesced (see send_chunk()), if any; called
+ * before a handler waits for anything, and before anything is written to
+ * the client without going through lwan_response_send_chunk().  Returns
+ * true if something was sent.  */
+static ALWAYS_INLINE bool
+lwan_response_flush_chunks(struct lwan_request *request)
+{
+    if (request->helper->chunk_buffer)
+        return lwan_response_flush_chunk_buffer(request);
+    return false;
+}
+
+/* Like lwan_response_flush_chunks(), but only if the latency watermark
+ * has been reached; used where the handler waits for the client, which
+ * wouldn't flush otherwise. */
+static ALWAYS_INLINE void
+lwan_response_flush_due_chunks(struct lwan_request *request)
+{
+    if (request->helper->chunk_buffer && lwan_response_chunks_are_due(request))
+        lwan_response_flush_chunk_buffer(request);
+}
+
 void lwan_readahead_init(void);
 void lwan_readahead_shutdown(void);
 void lwan_readahead_queue(int fd, off_t off, size_t size);
@@ -113,8 +552,65 @@ void lwan_madvise_queue(void *addr, size_t size);
 
 char *lwan_strbuf_extend_unsafe(struct lwan_strbuf *s, size_t by);
 bool lwan_strbuf_has_grow_buffer_failed_flag(const struct lwan_strbuf *s);
+size_t lwan_strbuf_get_allocated_size(const struct lwan_strbuf *s);
+void lwan_strbuf_pool_drain(void);
+char *lwan_strbuf_pool_alloc(size_t size);
+void lwan_strbuf_pool_free(char *buffer, size_t size);
+
+struct lwan_pubsub_waker;
+struct lwan_pubsub_waker *lwan_pubsub_waker_new(void);
+void lwan_pubsub_waker_free(struct lwan_pubsub_waker *waker);
+int lwan_pubsub_waker_get_fd(const struct lwan_pubsub_waker *waker);
+void lwan_pubsub_waker_deliver(struct lwan_pubsub_waker *waker,
+                               bool (*resume)(int fd, void *data),
+                               void *data);
 
 void lwan_process_request(struct lwan *l, struct lwan_request *request);
+
+/* HTTP/2 connections are handled by lwan_h2_serve(), which takes over the
+ * connection coroutine and never returns.  Each stream is converted to a
+ * HTTP/1.1 request and goes through lwan_process_request(); responses are
+ * converted back to frames by the I/O wrappers below, which are used
+ * instead of the socket ones when request->helper->h2_stream is set. */
+void lwan_h2_serve(struct lwan_connection *conn,
+                   enum lwan_request_flags flags,
+                   const char *preread,
+                   size_t preread_len);
+bool lwan_h2_is_preface(const char *buffer, size_t len);
+ssize_t lwan_h2_stream_writev(struct lwan_request *request,
+                              struct iovec *iov,
+                              int iov_count);
+ssize_t lwan_h2_stream_send(struct lwan_request *request,
+                            const void *buf,
+                            size_t count,
+                            int flags);
+int lwan_h2_stream_sendfile(struct lwan_request *request,
+                            int in_fd,
+                            off_t offset,
+                            size_t count,
+                            const char *header,
+                            size_t header_len);
+int lwan_h2_stream_splice(struct lwan_request *request,
+                          int in_fd,
+                          size_t count);
+struct lwan_value lwan_h2_stream_get_body(const struct lwan_h2_stream *stream);
+
+/* recv(), done through the ring of the thread if it's using io_uring and
+ * @fd is the client socket of @request; see lwan-io-wrappers.c. */
+ssize_t lwan_socket_recv(struct lwan_request *request,
+                         int fd,
+                         void *buf,
+                         size_t count,
+                         int flags);
+
+ssize_t lwan_h2_huffman_decode(const uint8_t *input,
+                               size_t input_len,
+                               char *output,
+                               size_t output_len);
+/* @output must have room for lwan_h2_huffman_encoded_len() bytes */
+size_t lwan_h2_huffman_encoded_len(const char *input, size_t input_len);
+size_t lwan_h2_huffman_encode(const char *input, size_t input_len, uint8_t *output);
+
 size_t lwan_prepare_response_header_full(struct lwan_request *request,
      enum lwan_http_status status, char headers[],
      size_t headers_buf_size, const struct lwan_key_value *additional_headers);
@@ -177,13 +673,25 @@ struct lwan_tls_context {
     mbedtls_entropy_context entropy;
 
     mbedtls_ctr_drbg_context ctr_drbg;
+
+    struct lwan_tls_sessions *sessions;
+    struct lwan_tls_handshake_pool *handshake_pool;
 };
+
+void lwan_tls_sessions_init(struct lwan *l);
+void lwan_tls_sessions_shutdown(struct lwan *l);
 #endif
 
 #ifdef LWAN_HAVE_LUA
 #include <lua.h>
 
 lua_State *lwan_lua_create_state(const char *script_file, const char *script);
+/* Loading and compiling a script is done once with the former, so that
+ * states are then created from its bytecode with the latter. */
+bool lwan_lua_compile_script(const char *script_file,
+                             const char *script,
+                             struct lwan_strbuf *bytecode);
+lua_State *lwan_lua_create_state_from_bytecode(const struct lwan_strbuf *bytecode);
 void lwan_lua_state_push_request(lua_State *L, struct lwan_request *request);
 const char *lwan_lua_state_last_error(lua_State *L);
 #endif
@@ -276,6 +784,22 @@ uint64_t lwan_request_get_id(struct lwan_request *request);
 
 ssize_t lwan_find_headers(char **header_start, struct lwan_value *buffer,
                           char **next_request);
+/* Same as lwan_find_headers(), but never uses vector instructions. */
+ssize_t lwan_find_headers_portable(char **header_start,
+                                   struct lwan_value *buffer,
+                                   char **next_request);
+
+/* Parses the request line and headers in @buffer (which must be
+ * NUL-terminated at @len, and is modified) like a request read from a
+ * client would be, without processing it.  Used by the microbenchmarks. */
+enum lwan_http_status lwan_request_parse_buffer(char *buffer, size_t len);
+
+/* Handles @request with whatever URL map @url (which must outlive the
+ * request) belongs to, as if it had been requested instead, but leaves
+ * sending the response to the caller.  For modules wrapping others. */
+enum lwan_http_status lwan_request_pass_to(struct lwan_request *request,
+                                           char *url,
+                                           size_t len);
 
 sa_family_t lwan_socket_parse_address(char *listener, char **node, char **port);
 
@@ -286,5 +810,17 @@ void lwan_request_foreach_header_for_cgi(struct lwan_request *request,
                                                     size_t value_len,
                                                     void *user_data),
                                          void *user_data);
+void lwan_request_foreach_header(struct lwan_request *request,
+                                 void (*cb)(const char *header_name,
+                                            size_t header_len,
+                                            const char *value,
+                                            size_t value_len,
+                                            void *user_data),
+                                 void *user_data);
 
 bool lwan_send_websocket_ping_for_tq(struct lwan_connection *conn);
+bool lwan_websocket_negotiate_deflate(
+    struct lwan_request *request,
+    const struct lwan_websocket_options *options,
+    char *response,
+    size_t response_len);
@@ -33,10 +33,28 @@
 #include "list.h"
 #include "ringbuffer.h"
 #include "lwan-private.h"
+#include "lwan-pubsub.h"
 
 struct lwan_pubsub_topic {
     struct list_head subscribers;
     pthread_rwlock_t lock;
+
+    /* Fan-out topics (see lwan_pubsub_new_fanout_topic()) keep the last
+     * messages in a ring shared by all subscribers, which only keep a
+     * cursor into it.  The ring holds one reference to each message in it;
+     * head is the sequence number of the next message to be published. */
+    struct lwan_pubsub_msg **ring;
+    uint64_t ring_mask;
+    uint64_t head;
+
+    /* Maximum number of messages waiting in each subscriber queue, and what
+     * to do when a queue is full; 0 means unbounded.  Set with
+     * lwan_pubsub_set_queue_limit(). */
+    size_t max_queued;
+    enum lwan_pubsub_overflow overflow;
+
+    /* Updated atomically. */
+    struct lwan_pubsub_topic_stats stats;
 };
 
 struct lwan_pubsub_msg {
@@ -51,12 +69,40 @@ struct lwan_pubsub_msg_ref {
     struct lwan_pubsub_msg_ref_ring ring;
 };
 
+/* Subscribers created by a worker thread are notified through that
+ * thread's waker: publishing then only marks them as pending, and the
+ * eventfd of the waker is written to once per batch, regardless of how
+ * many of its subscribers got messages.  The worker then resumes the
+ * coroutines awaiting on each pending subscriber directly (see
+ * lwan_pubsub_waker_deliver()). */
+struct lwan_pubsub_waker {
+    pthread_mutex_t lock;
+    struct list_head pending;
+    int fd;
+};
+
+static __thread struct lwan_pubsub_waker *thread_waker;
+
 struct lwan_pubsub_subscriber {
     struct list_node subscriber;
 
     pthread_mutex_t lock;
     struct list_head msg_refs;
 
+    /* Protected by waker->lock. */
+    struct lwan_pubsub_waker *waker;
+    struct list_node pending;
+    bool is_pending;
+
+    struct lwan_pubsub_topic *topic;
+
+    /* Only used by subscribers of fan-out topics. */
+    uint64_t cursor;
+
+    /* Both protected by the subscriber lock. */
+    size_t n_queued;
+    bool disconnected;
+
     int event_fd[2];
 };
 
@@ -92,6 +138,84 @@ static bool lwan_pubsub_queue_put(struct lwan_pubsub_subscriber *sub,
     return true;
 }
 
+static struct lwan_pubsub_msg *
+lwan_pubsub_queue_get(struct lwan_pubsub_subscriber *sub);
+
+static void lwan_pubsub_queue_flush(struct lwan_pubsub_subscriber *sub,
+                                    uint64_t *counter)
+{
+    struct lwan_pubsub_msg *iter;
+
+    while ((iter = lwan_pubsub_queue_get(sub))) {
+        lwan_pubsub_msg_done(iter);
+        ATOMIC_DEC(sub->topic->stats.queued);
+        if (counter)
+            ATOMIC_INC(*counter);
+    }
+
+    sub->n_queued = 0;
+}
+
+/* Must be called with the subscriber lock held.  Returns true if the
+ * subscriber has to be notified. */
+static bool lwan_pubsub_queue_put_bounded(struct lwan_pubsub_subscriber *sub,
+                                          struct lwan_pubsub_msg *msg)
+{
+    struct lwan_pubsub_topic *topic = sub->topic;
+
+    if (sub->disconnected)
+        return false;
+
+    if (topic->max_queued && sub->n_queued >= topic->max_queued) {
+        switch (topic->overflow) {
+        case LWAN_PUBSUB_DROP_NEWEST:
+            ATOMIC_INC(topic->stats.dropped);
+            return false;
+
+        case LWAN_PUBSUB_DROP_OLDEST: {
+            struct lwan_pubsub_msg *oldest = lwan_pubsub_queue_get(sub);
+
+            lwan_pubsub_msg_done(oldest);
+            sub->n_queued--;
+            ATOMIC_DEC(topic->stats.queued);
+            ATOMIC_INC(topic->stats.dropped);
+
+            /* The length of the queue doesn't change, so whatever
+             * notifications are pending are still accurate. */
+            if (UNLIKELY(!lwan_pubsub_queue_put(sub, msg)))
+                goto enqueue_failed;
+            ATOMIC_INC(msg->refcount);
+            sub->n_queued++;
+            ATOMIC_INC(topic->stats.queued);
+            return false;
+        }
+
+        case LWAN_PUBSUB_DISCONNECT:
+            lwan_pubsub_queue_flush(sub, &topic->stats.dropped);
+            sub->disconnected = true;
+            ATOMIC_INC(topic->stats.disconnected);
+            ATOMIC_INC(topic->stats.dropped);
+
+            /* Wake the subscriber up so it notices; see
+             * lwan_pubsub_is_disconnected(). */
+            return true;
+        }
+    }
+
+    if (UNLIKELY(!lwan_pubsub_queue_put(sub, msg)))
+        goto enqueue_failed;
+
+    ATOMIC_INC(msg->refcount);
+    sub->n_queued++;
+    ATOMIC_INC(topic->stats.queued);
+    return true;
+
+enqueue_failed:
+    lwan_status_warning("Couldn't enqueue message, dropping");
+    ATOMIC_INC(topic->stats.dropped);
+    return false;
+}
+
 static struct lwan_pubsub_msg *
 lwan_pubsub_queue_get(struct lwan_pubsub_subscriber *sub)
 {
@@ -158,6 +282,14 @@ struct lwan_pubsub_topic *lwan_pubsub_new_topic(void)
     return topic;
 }
 
+void lwan_pubsub_msg_done(struct lwan_pubsub_msg *msg)
+{
+    if (!ATOMIC_DEC(msg->refcount)) {
+        free(msg->value.value);
+        free(msg);
+    }
+}
+
 void lwan_pubsub_free_topic(struct lwan_pubsub_topic *topic)
 {
     struct lwan_pubsub_subscriber *iter, *next;
@@ -169,15 +301,210 @@ void lwan_pubsub_free_topic(struct lwan_pubsub_topic *topic)
 
     pthread_rwlock_destroy(&topic->lock);
 
+    if (topic->ring) {
+        for (uint64_t i = 0; i <= topic->ring_mask; i++) {
+            if (topic->ring[i])
+                lwan_pubsub_msg_done(topic->ring[i]);
+        }
+        free(topic->ring);
+    }
+
     free(topic);
 }
 
-void lwan_pubsub_msg_done(struct lwan_pubsub_msg *msg)
+struct lwan_pubsub_topic *lwan_pubsub_new_fanout_topic(size_t ring_size)
 {
-    if (!ATOMIC_DEC(msg->refcount)) {
-        free(msg->value.value);
-        free(msg);
+    struct lwan_pubsub_topic *topic;
+
+    if (ring_size < 2)
+        ring_size = 2;
+    ring_size = lwan_nextpow2(ring_size - 1);
+
+    topic = lwan_pubsub_new_topic();
+    if (!topic)
+        return NULL;
+
+    topic->ring = calloc(ring_size, sizeof(*topic->ring));
+    if (!topic->ring) {
+        lwan_pubsub_free_topic(topic);
+        return NULL;
+    }
+
+    topic->ring_mask = ring_size - 1;
+
+    return topic;
+}
+
+static void write_notification(struct lwan_pubsub_subscriber *sub)
+{
+    while (true) {
+        ssize_t written =
+            write(sub->event_fd[1], &(uint64_t){1}, sizeof(uint64_t));
+
+        if (LIKELY(written == (ssize_t)sizeof(uint64_t)))
+            break;
+
+        if (UNLIKELY(written < 0)) {
+            if (errno == EINTR)
+                continue;
+            /* A full pipe or a saturated counter will still wake the
+             * subscriber up, so nothing is lost here. */
+            if (errno != EAGAIN)
+                lwan_status_perror("write to eventfd failed, ignoring");
+            break;
+        }
+    }
+}
+
+static void notify_subscriber(struct lwan_pubsub_subscriber *sub)
+{
+    if (sub->event_fd[1] < 0)
+        return;
+
+#if defined(LWAN_HAVE_EVENTFD)
+    if (sub->waker) {
+        struct lwan_pubsub_waker *waker = sub->waker;
+        bool needs_wakeup = false;
+
+        pthread_mutex_lock(&waker->lock);
+        if (!sub->is_pending) {
+            /* If something is pending already, the worker has been woken
+             * up and hasn't picked up the pending list yet. */
+            needs_wakeup = list_empty(&waker->pending);
+            list_add_tail(&waker->pending, &sub->pending);
+            sub->is_pending = true;
+        }
+        pthread_mutex_unlock(&waker->lock);
+
+        if (needs_wakeup && UNLIKELY(eventfd_write(waker->fd, 1) < 0))
+            lwan_status_perror("write to waker eventfd failed, ignoring");
+
+        return;
+    }
+#endif
+
+    write_notification(sub);
+}
+
+#if defined(LWAN_HAVE_EVENTFD)
+struct lwan_pubsub_waker *lwan_pubsub_waker_new(void)
+{
+    struct lwan_pubsub_waker *waker = malloc(sizeof(*waker));
+
+    if (!waker)
+        return NULL;
+
+    waker->fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (waker->fd < 0) {
+        free(waker);
+        return NULL;
+    }
+
+    pthread_mutex_init(&waker->lock, NULL);
+    list_head_init(&waker->pending);
+
+    thread_waker = waker;
+
+    return waker;
+}
+
+void lwan_pubsub_waker_free(struct lwan_pubsub_waker *waker)
+{
+    if (thread_waker == waker)
+        thread_waker = NULL;
+
+    pthread_mutex_destroy(&waker->lock);
+    close(waker->fd);
+    free(waker);
+}
+
+int lwan_pubsub_waker_get_fd(const struct lwan_pubsub_waker *waker)
+{
+    return waker->fd;
+}
+
+void lwan_pubsub_waker_deliver(struct lwan_pubsub_waker *waker,
+                               bool (*resume)(int fd, void *data),
+                               void *data)
+{
+    struct lwan_pubsub_subscriber *sub;
+    struct list_head batch;
+    eventfd_t ignored;
+
+    /* Reset the eventfd before taking the pending list: anything that
+     * becomes pending afterwards will cause another wakeup. */
+    LWAN_NO_DISCARD(eventfd_read(waker->fd, &ignored));
+
+    list_head_init(&batch);
+    pthread_mutex_lock(&waker->lock);
+    list_append_list(&batch, &waker->pending);
+
+    /* Subscribers are taken one at a time, with the lock held, as resumed
+     * coroutines can unsubscribe others in the batch. */
+    while ((sub = list_pop(&batch, struct lwan_pubsub_subscriber, pending))) {
+        const int fd = sub->event_fd[0];
+
+        sub->is_pending = false;
+        pthread_mutex_unlock(&waker->lock);
+
+        /* Subscribers that aren't awaiting right now (or are waiting in
+         * another thread) get a regular notification, so that the next
+         * await returns immediately. */
+        if (!resume(fd, data))
+            write_notification(sub);
+
+        pthread_mutex_lock(&waker->lock);
     }
+    pthread_mutex_unlock(&waker->lock);
+}
+#else
+/* Without eventfd, subscribers are always notified individually. */
+struct lwan_pubsub_waker *lwan_pubsub_waker_new(void) { return NULL; }
+
+void lwan_pubsub_waker_free(struct lwan_pubsub_waker *waker) { (void)waker; }
+
+int lwan_pubsub_waker_get_fd(const struct lwan_pubsub_waker *waker)
+{
+    (void)waker;
+    return -1;
+}
+
+void lwan_pubsub_waker_deliver(struct lwan_pubsub_waker *waker,
+                               bool (*resume)(int fd, void *data),
+                               void *data)
+{
+    (void)waker;
+    (void)resume;
+    (void)data;
+}
+#endif
+
+static bool lwan_pubsub_publish_fanout(struct lwan_pubsub_topic *topic,
+                                       struct lwan_pubsub_msg *msg)
+{
+    struct lwan_pubsub_subscriber *sub;
+    struct lwan_pubsub_msg *evicted;
+
+    /* Publishing is a single append to the shared ring, regardless of
+     * the number of subscribers; the reference the message was created
+     * with is handed over to the ring. */
+    ATOMIC_INC(topic->stats.published);
+
+    pthread_rwlock_wrlock(&topic->lock);
+    evicted = topic->ring[topic->head & topic->ring_mask];
+    topic->ring[topic->head & topic->ring_mask] = msg;
+    topic->head++;
+    pthread_rwlock_unlock(&topic->lock);
+
+    if (evicted)
+        lwan_pubsub_msg_done(evicted);
+
+    pthread_rwlock_rdlock(&topic->lock);
+    list_for_each (&topic->subscribers, sub, subscriber)
+        notify_subscriber(sub);
+    pthread_rwlock_unlock(&topic->lock);
+
+    return true;
 }
 
 static bool lwan_pubsub_publish_value(struct lwan_pubsub_topic *topic,
@@ -195,35 +522,22 @@ static bool lwan_pubsub_publish_value(struct lwan_pubsub_topic *topic,
     msg->refcount = 1;
     msg->value = value;
 
+    if (topic->ring)
+        return lwan_pubsub_publish_fanout(topic, msg);
+
+    ATOMIC_INC(topic->stats.published);
+
     pthread_rwlock_rdlock(&topic->lock);
     list_for_each (&topic->subscribers, sub, subscriber) {
-        ATOMIC_INC(msg->refcount);
+        bool notify;
 
         /* FIXME: use trylock and a local queue to try again? */
         pthread_mutex_lock(&sub->lock);
-        if (!lwan_pubsub_queue_put(sub, msg)) {
-            lwan_status_warning("Couldn't enqueue message, dropping");
-            ATOMIC_DEC(msg->refcount);
-        }
+        notify = lwan_pubsub_queue_put_bounded(sub, msg);
         pthread_mutex_unlock(&sub->lock);
 
-        if (sub->event_fd[1] < 0) {
-            continue;
-        }
-        while (true) {
-            ssize_t written =
-                write(sub->event_fd[1], &(uint64_t){1}, sizeof(uint64_t));
-
-            if (LIKELY(written == (ssize_t)sizeof(uint64_t)))
-                break;
-
-            if (UNLIKELY(written < 0)) {
-                if (errno == EINTR || errno == EAGAIN)
-                    continue;
-                lwan_status_perror("write to eventfd failed, ignoring");
-                break;
-            }
-        }
+        if (notify)
+            notify_subscriber(sub);
     }
     pthread_rwlock_unlock(&topic->lock);
 
@@ -270,8 +584,9 @@ bool lwan_pubsub_publishf(struct lwan_pubsub_topic *topic,
     return lwan_pubsub_publish_value(topic, value);
 }
 
-struct lwan_pubsub_subscriber *
-lwan_pubsub_subscribe(struct lwan_pubsub_topic *topic)
+static struct lwan_pubsub_subscriber *
+lwan_pubsub_subscribe_internal(struct lwan_pubsub_topic *topic,
+                               const uint64_t *since)
 {
     struct lwan_pubsub_subscriber *sub = calloc(1, sizeof(*sub));
 
@@ -284,24 +599,112 @@ lwan_pubsub_subscribe(struct lwan_pubsub_topic *topic)
     pthread_mutex_init(&sub->lock, NULL);
     lwan_pubsub_queue_init(sub);
 
+    sub->waker = thread_waker;
+    sub->topic = topic;
+
     pthread_rwlock_wrlock(&topic->lock);
     list_add(&topic->subscribers, &sub->subscriber);
+    /* Subscribers of fan-out topics only see messages published after
+     * they joined, unless they asked for the ones still in the ring. */
+    sub->cursor = topic->head;
+    if (since && topic->ring && *since < topic->head) {
+        const uint64_t ring_size = topic->ring_mask + 1;
+        const uint64_t oldest =
+            topic->head > ring_size ? topic->head - ring_size : 0;
+
+        sub->cursor = LWAN_MAX(*since, oldest);
+    }
+    topic->stats.subscribers++;
     pthread_rwlock_unlock(&topic->lock);
 
     return sub;
 }
 
+struct lwan_pubsub_subscriber *
+lwan_pubsub_subscribe(struct lwan_pubsub_topic *topic)
+{
+    return lwan_pubsub_subscribe_internal(topic, NULL);
+}
+
+struct lwan_pubsub_subscriber *
+lwan_pubsub_subscribe_since(struct lwan_pubsub_topic *topic, uint64_t seq)
+{
+    return lwan_pubsub_subscribe_internal(topic, &seq);
+}
+
+static struct lwan_pubsub_msg *
+lwan_pubsub_consume_fanout(struct lwan_pubsub_subscriber *sub)
+{
+    struct lwan_pubsub_topic *topic = sub->topic;
+    struct lwan_pubsub_msg *msg = NULL;
+
+    pthread_rwlock_rdlock(&topic->lock);
+    if (sub->cursor != topic->head) {
+        /* A subscriber that fell behind by more than the size of the ring
+         * skips over the messages that were overwritten in the meantime. */
+        if (topic->head - sub->cursor > topic->ring_mask + 1) {
+            const uint64_t oldest = topic->head - topic->ring_mask - 1;
+
+            ATOMIC_AAF(&topic->stats.dropped, oldest - sub->cursor);
+            sub->cursor = oldest;
+        }
+
+        msg = topic->ring[sub->cursor & topic->ring_mask];
+        ATOMIC_INC(msg->refcount);
+        sub->cursor++;
+    }
+    pthread_rwlock_unlock(&topic->lock);
+
+    if (msg)
+        ATOMIC_INC(topic->stats.delivered);
+
+    return msg;
+}
+
+static void drain_notification_fd(struct lwan_pubsub_subscriber *sub)
+{
+    uint64_t discard;
+
+    while (read(sub->event_fd[0], &discard, sizeof(discard)) > 0)
+        ;
+}
+
 struct lwan_pubsub_msg *lwan_pubsub_consume(struct lwan_pubsub_subscriber *sub)
 {
     struct lwan_pubsub_msg *msg;
 
+    if (sub->topic->ring) {
+        /* Notifications for fan-out subscribers don't count messages, as
+         * some of them might be skipped.  Reset the notification before
+         * looking at the ring one last time, so that anything published
+         * afterwards wakes the subscriber up again. */
+        msg = lwan_pubsub_consume_fanout(sub);
+        if (!msg && sub->event_fd[0] >= 0) {
+            drain_notification_fd(sub);
+            msg = lwan_pubsub_consume_fanout(sub);
+        }
+
+        return msg;
+    }
+
     pthread_mutex_lock(&sub->lock);
     msg = lwan_pubsub_queue_get(sub);
+    if (msg)
+        sub->n_queued--;
     pthread_mutex_unlock(&sub->lock);
 
-    if (msg && sub->event_fd[0] >= 0) {
-        uint64_t discard;
-        LWAN_NO_DISCARD(read(sub->event_fd[0], &discard, sizeof(uint64_t)));
+    if (msg) {
+        ATOMIC_DEC(sub->topic->stats.queued);
+        ATOMIC_INC(sub->topic->stats.delivered);
+
+        if (sub->event_fd[0] >= 0) {
+            uint64_t discard;
+            LWAN_NO_DISCARD(
+                read(sub->event_fd[0], &discard, sizeof(uint64_t)));
+        }
+    } else if (sub->disconnected && sub->event_fd[0] >= 0) {
+        /* Nothing else is going to be queued for this subscriber. */
+        drain_notification_fd(sub);
     }
 
     return msg;
@@ -311,17 +714,24 @@ static void lwan_pubsub_unsubscribe_internal(struct lwan_pubsub_topic *topic,
                                              struct lwan_pubsub_subscriber *sub,
                                              bool take_topic_lock)
 {
-    struct lwan_pubsub_msg *iter;
-
     if (take_topic_lock)
         pthread_rwlock_wrlock(&topic->lock);
     list_del(&sub->subscriber);
+    topic->stats.subscribers--;
     if (take_topic_lock)
         pthread_rwlock_unlock(&topic->lock);
 
+    if (sub->waker) {
+        pthread_mutex_lock(&sub->waker->lock);
+        if (sub->is_pending)
+            list_del(&sub->pending);
+        pthread_mutex_unlock(&sub->waker->lock);
+    }
+
+    /* Fan-out subscribers hold no references besides the ones returned by
+     * lwan_pubsub_consume(), so their queues are always empty. */
     pthread_mutex_lock(&sub->lock);
-    while ((iter = lwan_pubsub_queue_get(sub)))
-        lwan_pubsub_msg_done(iter);
+    lwan_pubsub_queue_flush(sub, NULL);
     pthread_mutex_unlock(&sub->lock);
 
     pthread_mutex_destroy(&sub->lock);
@@ -336,6 +746,42 @@ static void lwan_pubsub_unsubscribe_internal(struct lwan_pubsub_topic *topic,
     free(sub);
 }
 
+void lwan_pubsub_set_queue_limit(struct lwan_pubsub_topic *topic,
+                                 size_t max_queued,
+                                 enum lwan_pubsub_overflow overflow)
+{
+    pthread_rwlock_wrlock(&topic->lock);
+    topic->max_queued = max_queued;
+    topic->overflow = overflow;
+    pthread_rwlock_unlock(&topic->lock);
+}
+
+bool lwan_pubsub_is_disconnected(struct lwan_pubsub_subscriber *sub)
+{
+    bool disconnected;
+
+    pthread_mutex_lock(&sub->lock);
+    disconnected = sub->disconnected;
+    pthread_mutex_unlock(&sub->lock);
+
+    return disconnected;
+}
+
+void lwan_pubsub_get_stats(struct lwan_pubsub_topic *topic,
+                           struct lwan_pubsub_topic_stats *stats)
+{
+    pthread_rwlock_rdlock(&topic->lock);
+    *stats = (struct lwan_pubsub_topic_stats){
+        .published = ATOMIC_READ(topic->stats.published),
+        .delivered = ATOMIC_READ(topic->stats.delivered),
+        .dropped = ATOMIC_READ(topic->stats.dropped),
+        .disconnected = ATOMIC_READ(topic->stats.disconnected),
+        .queued = ATOMIC_READ(topic->stats.queued),
+        .subscribers = topic->stats.subscribers,
+    };
+    pthread_rwlock_unlock(&topic->lock);
+}
+
 void lwan_pubsub_unsubscribe(struct lwan_pubsub_topic *topic,
                              struct lwan_pubsub_subscriber *sub)
 {
@@ -351,7 +797,8 @@ int lwan_pubsub_get_notification_fd(struct lwan_pubsub_subscriber *sub)
 {
     if (sub->event_fd[0] < 0) {
 #if defined(LWAN_HAVE_EVENTFD)
-        int efd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK | EFD_SEMAPHORE);
+        int efd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK |
+                                 (sub->topic->ring ? 0 : EFD_SEMAPHORE));
         if (efd < 0) {
             return -1;
         }
@@ -26,7 +26,32 @@ struct lwan_pubsub_topic;
 struct lwan_pubsub_msg;
 struct lwan_pubsub_subscriber;
 
+enum lwan_pubsub_overflow {
+    /* Make room for the new message by dropping the oldest one queued. */
+    LWAN_PUBSUB_DROP_OLDEST,
+    /* Keep the queue as is and drop the new message. */
+    LWAN_PUBSUB_DROP_NEWEST,
+    /* Drop everything queued and stop queueing for this subscriber; it's
+     * woken up and lwan_pubsub_is_disconnected() returns true. */
+    LWAN_PUBSUB_DISCONNECT,
+};
+
+struct lwan_pubsub_topic_stats {
+    uint64_t published;
+    uint64_t delivered;
+    uint64_t dropped;
+    uint64_t disconnected;
+    /* Messages currently waiting in subscriber queues. */
+    uint64_t queued;
+    unsigned int subscribers;
+};
+
 struct lwan_pubsub_topic *lwan_pubsub_new_topic(void);
+/* Messages published to a fan-out topic are stored once, in a ring shared
+ * by all subscribers, so publishing doesn't depend on how many of them
+ * there are.  Subscribers that fall behind by more than @ring_size messages
+ * (rounded up to a power of two) skip the ones that were overwritten. */
+struct lwan_pubsub_topic *lwan_pubsub_new_fanout_topic(size_t ring_size);
 void lwan_pubsub_free_topic(struct lwan_pubsub_topic *topic);
 
 bool lwan_pubsub_publish(struct lwan_pubsub_topic *topic,
@@ -36,8 +61,24 @@ bool lwan_pubsub_publishf(struct lwan_pubsub_topic *topic,
                           const char *format,
                           ...) __attribute__((format(printf, 2, 3)));
 
+/* Bounds the queue of each subscriber of @topic to @max_queued messages
+ * (0, the default, means unbounded).  Fan-out topics are bounded by the
+ * size of their ring instead, and always drop the oldest messages. */
+void lwan_pubsub_set_queue_limit(struct lwan_pubsub_topic *topic,
+                                 size_t max_queued,
+                                 enum lwan_pubsub_overflow overflow);
+void lwan_pubsub_get_stats(struct lwan_pubsub_topic *topic,
+                           struct lwan_pubsub_topic_stats *stats);
+
 struct lwan_pubsub_subscriber *
 lwan_pubsub_subscribe(struct lwan_pubsub_topic *topic);
+/* Messages published to a fan-out topic are numbered from 0, in the order
+ * they're published.  Subscribers created with this start with message
+ * @seq, or with the oldest one still in the ring if it's been overwritten
+ * already.  For other topics, this is the same as lwan_pubsub_subscribe(). */
+struct lwan_pubsub_subscriber *
+lwan_pubsub_subscribe_since(struct lwan_pubsub_topic *topic, uint64_t seq);
+bool lwan_pubsub_is_disconnected(struct lwan_pubsub_subscriber *sub);
 void lwan_pubsub_unsubscribe(struct lwan_pubsub_topic *topic,
                              struct lwan_pubsub_subscriber *sub);
 
@@ -20,20 +20,25 @@
 
 #define _GNU_SOURCE
 #include <errno.h>
+#include <fcntl.h>
 #include <unistd.h>
 #include <pthread.h>
-#include <fcntl.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
 #include <ioprio.h>
 #include <sys/mman.h>
 
-#include "lwan-private.h"
-
-#if defined(__linux__) && defined(O_DIRECT) && O_DIRECT
-#define PIPE_DIRECT_FLAG O_DIRECT
-#else
-#define PIPE_DIRECT_FLAG 0
+#if defined(LWAN_HAVE_IO_URING)
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
 #endif
 
+#include "hash.h"
+#include "lwan-private.h"
+#include "lwan-mailbox.h"
+
 enum readahead_cmd {
     READAHEAD,
     MADVISE,
@@ -53,9 +58,41 @@ struct lwan_readahead_cmd {
             size_t length;
         } madvise;
     };
-} __attribute__((packed));
+};
 
-static int readahead_pipe_fd[2] = {-1, -1};
+/* Commands are queued by every I/O thread, and only consumed by the
+ * readahead thread, which sleeps on the doorbell when there's nothing to
+ * do; queueing a command is then usually just a few atomic operations. */
+DEFINE_MPSC_MAILBOX_TYPE(readahead_mailbox, struct lwan_readahead_cmd, 1024)
+
+/* Requests for the same range are usually queued over and over (e.g. every
+ * time a popular file is served), so there's a table of recently queued
+ * hints: if one with the same key has been queued within the current epoch
+ * (of about 4 seconds), it's not queued again.  Collisions only mean that a
+ * hint might be queued twice, or, with a negligible probability, dropped. */
+#define RECENT_HINTS_BITS 12
+#define RECENT_HINTS_EPOCH_SHIFT 2
+
+/* Commands are handled in batches of up to this many, which, if io_uring
+ * is available, are submitted with a single system call. */
+#define BATCH_SIZE 64
+
+/* Files that are being read sequentially (as in, chunk after chunk by
+ * lwan_sendfile()) have their readahead window doubled every time the
+ * next chunk is requested, up to this many bytes past the chunk. */
+#define MAX_SEQUENTIAL_WINDOW (8ul << 20)
+#define N_STREAMS 64
+
+struct stream {
+    int fd;
+    off_t next;
+    off_t ahead;
+    size_t window;
+};
+
+static struct readahead_mailbox mailbox;
+static uint64_t recent_hints[1 << RECENT_HINTS_BITS];
+static struct lwan_mailbox_doorbell doorbell = {.fd = {-1, -1}};
 static pthread_t readahead_self;
 static long page_size = PAGE_SIZE;
 
@@ -69,65 +106,343 @@ __attribute__((constructor)) static void get_page_size(void)
 }
 #endif
 
+static bool queue_cmd(const struct lwan_readahead_cmd *cmd)
+{
+    if (!readahead_mailbox_try_put(&mailbox, cmd))
+        return false;
+
+    lwan_mailbox_doorbell_ring(&doorbell);
+    return true;
+}
+
+struct recent_hint {
+    uint64_t *slot;
+    uint64_t tag;
+};
+
+static bool
+queued_recently(struct recent_hint *hint, uint64_t a, uint64_t b, uint64_t c)
+{
+    struct timespec now;
+
+    if (UNLIKELY(clock_gettime(CLOCK_MONOTONIC_COARSE, &now) < 0))
+        now.tv_sec = 0;
+
+    const uint64_t key[] = {a, b, c,
+                            (uint64_t)now.tv_sec >> RECENT_HINTS_EPOCH_SHIFT};
+    /* 0 is the value of unused slots, so it's never a valid tag */
+    hint->tag = fnv1a_64(key, sizeof(key)) | 1;
+    hint->slot = &recent_hints[hint->tag >> (64 - RECENT_HINTS_BITS)];
+
+    return __atomic_load_n(hint->slot, __ATOMIC_RELAXED) == hint->tag;
+}
+
+static void queue_hint(const struct lwan_readahead_cmd *cmd,
+                       const struct recent_hint *hint)
+{
+    /* Hints are just hints.  Failing to queue is not an error, but they're
+     * only remembered if they have been queued. */
+    if (queue_cmd(cmd))
+        __atomic_store_n(hint->slot, hint->tag, __ATOMIC_RELAXED);
+}
+
 void lwan_readahead_shutdown(void)
 {
     struct lwan_readahead_cmd cmd = {
         .cmd = SHUTDOWN,
     };
 
-    if (readahead_pipe_fd[0] == readahead_pipe_fd[1] &&
-        readahead_pipe_fd[0] == -1)
+    if (doorbell.fd[0] < 0)
         return;
 
     lwan_status_debug("Shutting down readahead thread");
 
-#pragma GCC diagnostic push
-#pragma GCC diagnostic ignored "-Wunused-result"
-    write(readahead_pipe_fd[1], &cmd, sizeof(cmd));
-#pragma GCC diagnostic pop
+    /* Unlike the hints, this one can't be dropped if the mailbox is full */
+    while (!queue_cmd(&cmd))
+        sched_yield();
     pthread_join(readahead_self, NULL);
 
-    close(readahead_pipe_fd[0]);
-    close(readahead_pipe_fd[1]);
-    readahead_pipe_fd[0] = readahead_pipe_fd[1] = -1;
+    lwan_mailbox_doorbell_close(&doorbell);
 }
 
 void lwan_readahead_queue(int fd, off_t off, size_t size)
 {
+    struct recent_hint hint;
+
     if (size < (size_t)page_size)
         return;
+    if (queued_recently(&hint, (uint64_t)fd, (uint64_t)off, size))
+        return;
 
     struct lwan_readahead_cmd cmd = {
         .readahead = {.size = size, .fd = fd, .off = off},
         .cmd = READAHEAD,
     };
 
-    /* Readahead is just a hint.  Failing to write is not an error. */
-#pragma GCC diagnostic push
-#pragma GCC diagnostic ignored "-Wunused-result"
-    write(readahead_pipe_fd[1], &cmd, sizeof(cmd));
-#pragma GCC diagnostic pop
+    queue_hint(&cmd, &hint);
 }
 
 void lwan_madvise_queue(void *addr, size_t length)
 {
+    struct recent_hint hint;
+
     if (length < (size_t)page_size)
         return;
+    if (queued_recently(&hint, (uint64_t)(uintptr_t)addr, length, UINT64_MAX))
+        return;
 
     struct lwan_readahead_cmd cmd = {
         .madvise = {.addr = addr, .length = length},
         .cmd = MADVISE,
     };
 
-    /* Madvise is just a hint.  Failing to write is not an error. */
-#pragma GCC diagnostic push
-#pragma GCC diagnostic ignored "-Wunused-result"
-    write(readahead_pipe_fd[1], &cmd, sizeof(cmd));
-#pragma GCC diagnostic pop
+    queue_hint(&cmd, &hint);
+}
+
+static bool mailbox_is_empty(const void *mb)
+{
+    return readahead_mailbox_empty(mb);
+}
+
+#if defined(LWAN_HAVE_IO_URING)
+/* A small ring private to the readahead thread, used only to submit
+ * advice in bulk; completions are waited for before the next batch, so
+ * the completion queue never overflows. */
+struct advice_ring {
+    int fd;
+    unsigned int *sq_tail;
+    unsigned int sq_mask;
+    unsigned int *cq_head;
+    unsigned int *cq_tail;
+    struct io_uring_sqe *sqes;
+    void *rings;
+    size_t rings_size;
+    size_t sqes_size;
+    unsigned int pending;
+};
+
+static bool ring_supports_advice(int fd)
+{
+    const size_t probe_size =
+        sizeof(struct io_uring_probe) +
+        (IORING_OP_MADVISE + 1) * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe *probe = calloc(1, probe_size);
+    bool supported = false;
+
+    if (!probe)
+        return false;
+
+    if (syscall(__NR_io_uring_register, fd, IORING_REGISTER_PROBE, probe,
+                IORING_OP_MADVISE + 1) == 0 &&
+        probe->last_op >= IORING_OP_MADVISE) {
+        supported =
+            (probe->ops[IORING_OP_FADVISE].flags & IO_URING_OP_SUPPORTED) &&
+            (probe->ops[IORING_OP_MADVISE].flags & IO_URING_OP_SUPPORTED);
+    }
+
+    free(probe);
+    return supported;
+}
+
+static bool advice_ring_init(struct advice_ring *ring)
+{
+    struct io_uring_params params = {};
+
+    ring->fd = (int)syscall(__NR_io_uring_setup, BATCH_SIZE, &params);
+    if (ring->fd < 0)
+        return false;
+
+    if (!(params.features & IORING_FEAT_SINGLE_MMAP) ||
+        !ring_supports_advice(ring->fd))
+        goto close_fd;
+
+    ring->rings_size =
+        LWAN_MAX(params.sq_off.array + params.sq_entries * sizeof(unsigned int),
+                 params.cq_off.cqes +
+                     params.cq_entries * sizeof(struct io_uring_cqe));
+    ring->rings = mmap(NULL, ring->rings_size, PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    if (ring->rings == MAP_FAILED)
+        goto close_fd;
+
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED)
+        goto unmap_rings;
+
+    char *rings = ring->rings;
+    unsigned int *sq_array = (unsigned int *)(rings + params.sq_off.array);
+    for (unsigned int i = 0; i < params.sq_entries; i++)
+        sq_array[i] = i;
+
+    ring->sq_tail = (unsigned int *)(rings + params.sq_off.tail);
+    ring->sq_mask = *(unsigned int *)(rings + params.sq_off.ring_mask);
+    ring->cq_head = (unsigned int *)(rings + params.cq_off.head);
+    ring->cq_tail = (unsigned int *)(rings + params.cq_off.tail);
+    ring->pending = 0;
+
+    return true;
+
+unmap_rings:
+    munmap(ring->rings, ring->rings_size);
+close_fd:
+    close(ring->fd);
+    ring->fd = -1;
+    return false;
+}
+
+static void advice_ring_free(struct advice_ring *ring)
+{
+    if (ring->fd < 0)
+        return;
+
+    munmap(ring->sqes, ring->sqes_size);
+    munmap(ring->rings, ring->rings_size);
+    close(ring->fd);
+}
+
+/* Advice given with io_uring has a 32-bit length */
+static inline uint32_t advice_len(size_t len)
+{
+    return (uint32_t)LWAN_MIN(len, UINT32_MAX & ~(size_t)(page_size - 1));
+}
+
+static struct io_uring_sqe *advice_ring_get_sqe(struct advice_ring *ring)
+{
+    const unsigned int tail = *ring->sq_tail + ring->pending++;
+    struct io_uring_sqe *sqe = &ring->sqes[tail & ring->sq_mask];
+
+    memset(sqe, 0, sizeof(*sqe));
+    return sqe;
+}
+
+/* Whatever can't be submitted is simply dropped: they're only hints. */
+static void advice_ring_submit(struct advice_ring *ring)
+{
+    const unsigned int n = ring->pending;
+
+    if (!n)
+        return;
+
+    ring->pending = 0;
+    __atomic_store_n(ring->sq_tail, *ring->sq_tail + n, __ATOMIC_RELEASE);
+
+    int r;
+    do {
+        r = (int)syscall(__NR_io_uring_enter, ring->fd, n, n,
+                         IORING_ENTER_GETEVENTS, NULL, 0);
+    } while (r < 0 && errno == EINTR);
+
+    if (UNLIKELY(r < 0)) {
+        lwan_status_perror("Could not submit readahead hints, not using "
+                           "io_uring for them anymore");
+        advice_ring_free(ring);
+        ring->fd = -1;
+        return;
+    }
+
+    /* Results aren't interesting, so the completions are just skipped. */
+    __atomic_store_n(ring->cq_head,
+                     __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE),
+                     __ATOMIC_RELEASE);
+}
+#else
+struct advice_ring {
+    int fd;
+};
+
+static bool advice_ring_init(struct advice_ring *ring)
+{
+    ring->fd = -1;
+    return false;
+}
+
+static void advice_ring_free(struct advice_ring *ring
+                             __attribute__((unused)))
+{
+}
+
+static void advice_ring_submit(struct advice_ring *ring
+                               __attribute__((unused)))
+{
+}
+#endif
+
+static void
+advise_range(struct advice_ring *ring, int fd, off_t off, size_t size)
+{
+#if defined(LWAN_HAVE_IO_URING)
+    if (ring->fd >= 0) {
+        struct io_uring_sqe *sqe = advice_ring_get_sqe(ring);
+
+        sqe->opcode = IORING_OP_FADVISE;
+        sqe->fd = fd;
+        sqe->off = (uint64_t)off;
+        sqe->len = advice_len(size);
+        sqe->fadvise_advice = POSIX_FADV_WILLNEED;
+        return;
+    }
+#endif
+
+    readahead(fd, off, size);
+}
+
+static void advise_memory(struct advice_ring *ring, void *addr, size_t length)
+{
+#if defined(LWAN_HAVE_IO_URING)
+    if (ring->fd >= 0) {
+        struct io_uring_sqe *sqe = advice_ring_get_sqe(ring);
+
+        sqe->opcode = IORING_OP_MADVISE;
+        sqe->fd = -1;
+        sqe->addr = (uint64_t)(uintptr_t)addr;
+        sqe->len = advice_len(length);
+        sqe->fadvise_advice = MADV_WILLNEED;
+        return;
+    }
+#endif
+
+    madvise(addr, length, MADV_WILLNEED);
+}
+
+static void readahead_stream(struct advice_ring *ring,
+                             struct stream streams[static N_STREAMS],
+                             int fd,
+                             off_t off,
+                             size_t size)
+{
+    struct stream *stream = &streams[(unsigned int)fd % N_STREAMS];
+    const off_t end = off + (off_t)size;
+
+    if (stream->fd == fd && stream->next == off) {
+        /* The previous chunk of this file has just been sent: keep ahead of
+         * the reader, and don't ask for what's been asked for already. */
+        if (stream->window)
+            stream->window =
+                LWAN_MIN(stream->window * 2, MAX_SEQUENTIAL_WINDOW);
+        else
+            stream->window = LWAN_MIN(size, MAX_SEQUENTIAL_WINDOW);
+    } else {
+        *stream = (struct stream){.fd = fd, .ahead = off};
+    }
+
+    const off_t start = LWAN_MAX(off, stream->ahead);
+    const off_t stop = end + (off_t)stream->window;
+
+    stream->next = end;
+    stream->ahead = stop;
+
+    if (stop > start)
+        advise_range(ring, fd, start, (size_t)(stop - start));
 }
 
 static void *lwan_readahead_loop(void *data __attribute__((unused)))
 {
+    struct stream streams[N_STREAMS];
+    struct advice_ring ring = {};
+    bool shutdown = false;
+
     /* Idle priority for the calling thread.   Magic value of `7` obtained from
      * sample program in linux/Documentation/block/ioprio.txt.  This is a no-op
      * on anything but Linux.  */
@@ -135,85 +450,62 @@ static void *lwan_readahead_loop(void *data __attribute__((unused)))
 
     lwan_set_thread_name("readahead");
 
-    while (true) {
-        struct lwan_readahead_cmd cmd[16];
-        ssize_t n_bytes = read(readahead_pipe_fd[0], cmd, sizeof(cmd));
-        ssize_t cmds;
-
-        if (UNLIKELY(n_bytes < 0)) {
-            if (errno == EAGAIN || errno == EINTR)
-                continue;
-            lwan_status_perror("Ignoring error while reading from pipe (%d)",
-                               readahead_pipe_fd[0]);
-            continue;
-#if PIPE_DIRECT_FLAG
-        } else if (UNLIKELY(n_bytes % (ssize_t)sizeof(cmd[0]))) {
-            lwan_status_warning("Ignoring readahead packet read of %zd bytes",
-                                n_bytes);
-            continue;
-#endif
-        }
+    for (int i = 0; i < N_STREAMS; i++)
+        streams[i] = (struct stream){.fd = -1};
+
+    if (advice_ring_init(&ring))
+        lwan_status_debug("Readahead hints will be submitted with io_uring");
+
+    while (!shutdown) {
+        struct lwan_readahead_cmd cmd;
+        int n_cmds = 0;
 
-        cmds = n_bytes / (ssize_t)sizeof(struct lwan_readahead_cmd);
-        for (ssize_t i = 0; i < cmds; i++) {
-            switch (cmd[i].cmd) {
+        while (n_cmds < BATCH_SIZE &&
+               readahead_mailbox_try_get(&mailbox, &cmd)) {
+            n_cmds++;
+
+            switch (cmd.cmd) {
             case READAHEAD:
-                readahead(cmd[i].readahead.fd, cmd[i].readahead.off,
-                          cmd[i].readahead.size);
+                readahead_stream(&ring, streams, cmd.readahead.fd,
+                                 cmd.readahead.off, cmd.readahead.size);
                 break;
             case MADVISE:
-                madvise(cmd[i].madvise.addr, cmd[i].madvise.length,
-                        MADV_WILLNEED);
-
-                if (cmd[i].madvise.length >= 10 * 1024) {
-                    /* On Linux, SO_ZEROCOPY is only useful to transmit
-                     * 10kB or more because it uses page pinning (what
-                     * mlock(2) does!), so consider the same threshold
-                     * here.  */
-                    mlock(cmd[i].madvise.addr, cmd[i].madvise.length);
-                }
-
+                advise_memory(&ring, cmd.madvise.addr, cmd.madvise.length);
                 break;
             case SHUTDOWN:
-                goto out;
+                shutdown = true;
+                goto submit;
             }
         }
+
+    submit:
+        advice_ring_submit(&ring);
+
+        if (!n_cmds)
+            lwan_mailbox_doorbell_wait(&doorbell, mailbox_is_empty, &mailbox);
     }
 
-out:
+    advice_ring_free(&ring);
     return NULL;
 }
 
 void lwan_readahead_init(void)
 {
-    int flags;
-
-    if (readahead_pipe_fd[0] != readahead_pipe_fd[1])
+    if (doorbell.fd[0] >= 0)
         return;
 
     lwan_status_debug("Initializing low priority readahead thread");
 
-    if (pipe2(readahead_pipe_fd, O_CLOEXEC | PIPE_DIRECT_FLAG) < 0) {
-        lwan_status_warning("Could not create pipe for readahead queue");
-        goto disable_readahead;
-    }
+    readahead_mailbox_init(&mailbox);
 
-    /* Only write side should be non-blocking. */
-    flags = fcntl(readahead_pipe_fd[1], F_GETFL);
-    if (flags < 0) {
-        lwan_status_warning(
-            "Could not get flags for readahead pipe write side");
-        goto disable_readahead_close_pipe;
-    }
-    if (fcntl(readahead_pipe_fd[1], F_SETFL, flags | O_NONBLOCK) < 0) {
-        lwan_status_warning(
-            "Could not set readahead write side to be no-blocking");
-        goto disable_readahead_close_pipe;
+    if (!lwan_mailbox_doorbell_init(&doorbell)) {
+        lwan_status_warning("Could not create doorbell for readahead queue");
+        goto disable_readahead;
     }
 
     if (pthread_create(&readahead_self, NULL, lwan_readahead_loop, NULL)) {
         lwan_status_warning("Could not create low-priority readahead thread");
-        goto disable_readahead_close_pipe;
+        goto disable_readahead_close_doorbell;
     }
 
 #ifdef SCHED_IDLE
@@ -225,19 +517,13 @@ void lwan_readahead_init(void)
 
     return;
 
-disable_readahead_close_pipe:
-    close(readahead_pipe_fd[0]);
-    close(readahead_pipe_fd[1]);
+disable_readahead_close_doorbell:
+    lwan_mailbox_doorbell_close(&doorbell);
 
 disable_readahead:
-    /* Set these to -1 just to ensure that even if the page_size check inside
-     * the enqueuing functions fail, we don't write stuff to a file descriptor
-     * that's not the readahead queue. */
-    readahead_pipe_fd[0] = readahead_pipe_fd[1] = -1;
-
-    /* If page_size is 0, then the enqueuing functions won't write to the pipe.
-     * This way, we don't need to introduce new checks there for
-     * this corner case of not being able to create/set up the pipe. */
+    /* If page_size is 0, then the enqueuing functions won't queue anything.
+     * This way, we don't need to introduce new checks there for this corner
+     * case of not being able to set up the readahead thread. */
     page_size = 0;
 
     lwan_status_warning("Readahead thread has been disabled");
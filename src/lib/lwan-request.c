@@ -37,13 +37,21 @@
 #include <sys/vfs.h>
 #include <unistd.h>
 
+#if defined(__x86_64__)
+#include <immintrin.h>
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
 #include "lwan-private.h"
 
 #include "base64.h"
+#include "hash.h"
 #include "list.h"
 #include "lwan-config.h"
 #include "lwan-http-authorize.h"
 #include "lwan-io-wrappers.h"
+#include "lwan-trace.h"
 #include "sha1.h"
 
 #define HEADER_VALUE_SEPARATOR_LEN (sizeof(": ") - 1)
@@ -266,153 +274,395 @@ static ALWAYS_INLINE char *identify_http_method(struct lwan_request *request,
     return NULL;
 }
 
-/* has_zero() routines stolen from the Bit Twiddling Hacks page */
-static ALWAYS_INLINE uint64_t has_zero64(uint64_t v)
-{
-    return (v - 0x0101010101010101ull) & ~v & 0x8080808080808080ull;
-}
+/* Some of the parsing routines below look for any of a small set of bytes
+ * in a buffer.  Where vector instructions are known to be available, they
+ * look at a block of up to 64 bytes at a time, keeping a bitmask with the
+ * position of every interesting byte in the block, so that a block
+ * containing more than one of them is only read once.  The remainder of
+ * the buffer is looked at one byte at a time, as reading past its end
+ * isn't allowed. */
+struct block_scanner {
+    char *block;
+    uint64_t mask;
+    bool tail;
+};
 
-static ALWAYS_INLINE uint32_t has_zero32(uint64_t v)
+static ALWAYS_INLINE char *
+find_scalar(char *p, const char *end, bool (*matches)(char c))
 {
-    return (v - 0x01010101u) & ~v & 0x80808080u;
+    for (; p < end; p++) {
+        if (matches(*p))
+            return p;
+    }
+    return NULL;
 }
 
-static char *find_pct_or_plus(const char *input)
+static ALWAYS_INLINE char *find_in_blocks(struct block_scanner *scanner,
+                                          char *from,
+                                          const char *end,
+                                          uint64_t (*block_mask)(const char *p),
+                                          const ptrdiff_t block_size,
+                                          const int bits_per_byte,
+                                          bool (*matches)(char c))
 {
-    const uint64_t mask_plus64 = '+' * 0x0101010101010101ull;
-    const uint64_t mask_pct64 = '%' * 0x0101010101010101ull;
-    const uint32_t mask_plus32 = '+' * 0x01010101u;
-    const uint32_t mask_pct32 = '%' * 0x01010101u;
-    char *str = (char *)input;
+    if (scanner->tail)
+        return find_scalar(from, end, matches);
 
-    while (true) {
-        uint64_t v = string_as_uint64(str);
-        uint64_t has_plus = has_zero64(v ^ mask_plus64);
-        uint64_t has_pct = has_zero64(v ^ mask_pct64);
-        uint64_t has_zero = has_zero64(v);
-        uint64_t m = LWAN_MAX(has_plus, has_pct);
-
-        if (has_zero && LWAN_MAX(has_zero, m) == has_zero) {
-            if (__builtin_ctzll(has_zero) / 8 < 4)
-                goto check_small;
-            goto check_at_least_four;
-        }
+    if (scanner->block && from - scanner->block < block_size) {
+        /* Ignore whatever has been looked at already. */
+        uint64_t mask =
+            scanner->mask & (~0ull << ((from - scanner->block) * bits_per_byte));
 
-        if (m) {
-            return str + __builtin_ctzll(m) / 8;
-        }
+        if (mask)
+            return scanner->block + __builtin_ctzll(mask) / bits_per_byte;
 
-        str += 8;
+        scanner->block += block_size;
+    } else {
+        scanner->block = from;
     }
 
-check_at_least_four: {
-    uint32_t v = string_as_uint32(str);
-    uint32_t has_plus = has_zero32(v ^ mask_plus32);
-    uint32_t has_pct = has_zero32(v ^ mask_pct32);
-    uint32_t has_zero = has_zero32(v);
-    uint32_t m = LWAN_MAX(has_plus, has_pct);
+    for (; end - scanner->block >= block_size; scanner->block += block_size) {
+        scanner->mask = block_mask(scanner->block);
 
-    if (has_zero && LWAN_MAX(has_zero, m) == has_zero) {
-        return NULL;
+        if (scanner->mask) {
+            return scanner->block +
+                   __builtin_ctzll(scanner->mask) / bits_per_byte;
+        }
     }
 
-    if (m) {
-        return str + __builtin_ctz(m) / 8;
-    }
+    scanner->tail = true;
+    return find_scalar(scanner->block, end, matches);
+}
 
-    str += 4;
+/* Bytes that have to be looked at while decoding urlencoded strings: the
+ * escape characters, the separators, and the terminator.  */
+static ALWAYS_INLINE bool is_urlencoded_special(char c)
+{
+    static const bool special[256] = {
+        ['\0'] = true, ['%'] = true, ['+'] = true, ['&'] = true, ['='] = true,
+    };
+
+    return special[(unsigned char)c];
+}
+
+/* Unlike the has_zero() routine from the Bit Twiddling Hacks page, this
+ * doesn't flag bytes after a zero byte, so the whole mask can be used. */
+static ALWAYS_INLINE uint64_t zero_bytes64(uint64_t v)
+{
+    const uint64_t low_bits = 0x7f7f7f7f7f7f7f7full;
+
+    return ~(((v & low_bits) + low_bits) | v | low_bits);
+}
+
+static ALWAYS_INLINE uint64_t block_mask_urlencoded_swar(const char *p)
+{
+    const uint64_t v = string_as_uint64(p);
+
+    return zero_bytes64(v) | zero_bytes64(v ^ ('%' * 0x0101010101010101ull)) |
+           zero_bytes64(v ^ ('+' * 0x0101010101010101ull)) |
+           zero_bytes64(v ^ ('&' * 0x0101010101010101ull)) |
+           zero_bytes64(v ^ ('=' * 0x0101010101010101ull));
+}
+
+static ALWAYS_INLINE char *
+find_urlencoded_swar(struct block_scanner *scanner, char *from, const char *end)
+{
+    return find_in_blocks(scanner, from, end, block_mask_urlencoded_swar, 8, 8,
+                          is_urlencoded_special);
 }
 
-check_small:
-    while (*str) {
-        if (*str == '%' || *str == '+')
-            return str;
-        str++;
+#if defined(__x86_64__)
+static ALWAYS_INLINE uint64_t block_mask_urlencoded_sse2(const char *p)
+{
+    uint64_t mask = 0;
+
+    for (int i = 0; i < 4; i++) {
+        __m128i block = _mm_loadu_si128((const __m128i *)(p + i * 16));
+        __m128i eq = _mm_cmpeq_epi8(block, _mm_setzero_si128());
+
+        eq = _mm_or_si128(eq, _mm_cmpeq_epi8(block, _mm_set1_epi8('%')));
+        eq = _mm_or_si128(eq, _mm_cmpeq_epi8(block, _mm_set1_epi8('+')));
+        eq = _mm_or_si128(eq, _mm_cmpeq_epi8(block, _mm_set1_epi8('&')));
+        eq = _mm_or_si128(eq, _mm_cmpeq_epi8(block, _mm_set1_epi8('=')));
+
+        mask |= (uint64_t)(uint16_t)_mm_movemask_epi8(eq) << (i * 16);
     }
 
-    return NULL;
+    return mask;
 }
 
-__attribute__((nonnull(1))) static ssize_t url_decode(char *str)
+static ALWAYS_INLINE char *
+find_urlencoded_sse2(struct block_scanner *scanner, char *from, const char *end)
 {
-    static const unsigned char tbl1[256] = {
-        [0 ... 255] = 255, ['0'] = 0 << 4,  ['1'] = 1 << 4,  ['2'] = 2 << 4,
-        ['3'] = 3 << 4,    ['4'] = 4 << 4,  ['5'] = 5 << 4,  ['6'] = 6 << 4,
-        ['7'] = 7 << 4,    ['8'] = 8 << 4,  ['9'] = 9 << 4,  ['a'] = 10 << 4,
-        ['b'] = 11 << 4,   ['c'] = 12 << 4, ['d'] = 13 << 4, ['e'] = 14 << 4,
-        ['f'] = 15 << 4,   ['A'] = 10 << 4, ['B'] = 11 << 4, ['C'] = 12 << 4,
-        ['D'] = 13 << 4,   ['E'] = 14 << 4, ['F'] = 15 << 4,
-    };
-    static const char tbl2[256] = {
+    return find_in_blocks(scanner, from, end, block_mask_urlencoded_sse2, 64,
+                          1, is_urlencoded_special);
+}
+
+#if defined(LWAN_HAVE_BUILTIN_CPU_INIT)
+__attribute__((target("avx2"))) static ALWAYS_INLINE uint32_t
+half_block_mask_urlencoded_avx2(const char *p)
+{
+    __m256i block = _mm256_loadu_si256((const __m256i *)p);
+    __m256i eq = _mm256_cmpeq_epi8(block, _mm256_setzero_si256());
+
+    eq = _mm256_or_si256(eq, _mm256_cmpeq_epi8(block, _mm256_set1_epi8('%')));
+    eq = _mm256_or_si256(eq, _mm256_cmpeq_epi8(block, _mm256_set1_epi8('+')));
+    eq = _mm256_or_si256(eq, _mm256_cmpeq_epi8(block, _mm256_set1_epi8('&')));
+    eq = _mm256_or_si256(eq, _mm256_cmpeq_epi8(block, _mm256_set1_epi8('=')));
+
+    return (uint32_t)_mm256_movemask_epi8(eq);
+}
+
+__attribute__((target("avx2"))) static ALWAYS_INLINE uint64_t
+block_mask_urlencoded_avx2(const char *p)
+{
+    return (uint64_t)half_block_mask_urlencoded_avx2(p + 32) << 32 |
+           half_block_mask_urlencoded_avx2(p);
+}
+
+__attribute__((target("avx2"))) static ALWAYS_INLINE char *
+find_urlencoded_avx2(struct block_scanner *scanner, char *from, const char *end)
+{
+    return find_in_blocks(scanner, from, end, block_mask_urlencoded_avx2, 64,
+                          1, is_urlencoded_special);
+}
+#endif
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+static ALWAYS_INLINE uint64_t block_mask_urlencoded_neon(const char *p)
+{
+    uint8x16_t block = vld1q_u8((const uint8_t *)p);
+    uint8x16_t eq = vceqzq_u8(block);
+
+    eq = vorrq_u8(eq, vceqq_u8(block, vdupq_n_u8('%')));
+    eq = vorrq_u8(eq, vceqq_u8(block, vdupq_n_u8('+')));
+    eq = vorrq_u8(eq, vceqq_u8(block, vdupq_n_u8('&')));
+    eq = vorrq_u8(eq, vceqq_u8(block, vdupq_n_u8('=')));
+
+    return vget_lane_u64(
+        vreinterpret_u64_u8(vshrn_n_u16(vreinterpretq_u16_u8(eq), 4)), 0);
+}
+
+static ALWAYS_INLINE char *
+find_urlencoded_neon(struct block_scanner *scanner, char *from, const char *end)
+{
+    return find_in_blocks(scanner, from, end, block_mask_urlencoded_neon, 16,
+                          4, is_urlencoded_special);
+}
+#endif
+
+static ALWAYS_INLINE int decode_hex_escape(const char *p)
+{
+    static const signed char tbl[256] = {
         [0 ... 255] = -1, ['0'] = 0,  ['1'] = 1,  ['2'] = 2,  ['3'] = 3,
         ['4'] = 4,        ['5'] = 5,  ['6'] = 6,  ['7'] = 7,  ['8'] = 8,
         ['9'] = 9,        ['a'] = 10, ['b'] = 11, ['c'] = 12, ['d'] = 13,
         ['e'] = 14,       ['f'] = 15, ['A'] = 10, ['B'] = 11, ['C'] = 12,
         ['D'] = 13,       ['E'] = 14, ['F'] = 15,
     };
-    const char *inptr = str;
-    char *outptr = str;
+    const int high = tbl[(unsigned char)p[0]];
+    const int low = tbl[(unsigned char)p[1]];
+
+    if (UNLIKELY((high | low) < 0))
+        return -1;
+
+    return high << 4 | low;
+}
+
+static ALWAYS_INLINE char *skip_key_value_separators(char *p, const char *end)
+{
+    while (p < end && (*p == ' ' || *p == '&'))
+        p++;
+    return p;
+}
+
+/* The key/value arrays of a request are carved from the arena of its
+ * coroutine, with room for a pair per separator (plus one), which is as
+ * many as there can be.  They're then rewound along with everything else
+ * at the end of the request, rather than being grown and freed for every
+ * request in a connection. */
+static bool init_key_value_array(struct lwan_request *request,
+                                 struct lwan_key_value_array *array,
+                                 const struct lwan_value *value,
+                                 char separator)
+{
+    const char *p = value->value;
+    const char *end = p + value->len;
+    size_t n_pairs = 1;
+
+    while ((p = memchr(p, separator, (size_t)(end - p)))) {
+        n_pairs++;
+        p++;
+    }
+
+    array->base.base =
+        coro_malloc(request->conn->coro, n_pairs * sizeof(struct lwan_key_value));
+    array->base.elements = 0;
+
+    return array->base.base != NULL;
+}
+
+static ALWAYS_INLINE struct lwan_key_value *
+append_to_key_value_array(struct lwan_key_value_array *array)
+{
+    struct lwan_key_value *base = array->base.base;
+
+    return &base[array->base.elements++];
+}
+
+static bool append_key_value(struct lwan_key_value_array *array,
+                             char *key,
+                             const char *key_end,
+                             char *value)
+{
+    struct lwan_key_value *kv;
+
+    /* Disallow empty keys, but allow empty values */
+    if (UNLIKELY(key == key_end))
+        return false;
+
+    kv = append_to_key_value_array(array);
+
+    kv->key = key;
+    kv->value = value ? value : "";
+
+    return true;
+}
+
+/* Decodes the urlencoded string between str and end in place, in a single
+ * pass, stopping at the first NUL byte.  If array isn't NULL, the string
+ * is also split into the key/value pairs that are appended to it, as the
+ * separators are found.  Returns the length of the decoded string, or -1
+ * if it has invalid escape sequences (or %00, which would truncate it). */
+static ALWAYS_INLINE ssize_t
+url_decode_with(char *str,
+                const char *end,
+                struct lwan_key_value_array *array,
+                char *(*find_special)(struct block_scanner *scanner,
+                                      char *from,
+                                      const char *end))
+{
+    struct block_scanner scanner = {};
+    char *inptr = array ? skip_key_value_separators(str, end) : str;
+    char *outptr = inptr;
+    char *key = inptr;
+    char *value = NULL;
+
+    while (true) {
+        char *p = find_special(&scanner, inptr, end);
+
+        if (!p)
+            p = (char *)end;
+
+        if (outptr != inptr)
+            outptr = mempmove(outptr, inptr, (size_t)(p - inptr));
+        else
+            outptr = p;
+
+        if (p == end || *p == '\0')
+            break;
 
-    for (char *p = find_pct_or_plus(inptr); p; p = find_pct_or_plus(inptr)) {
-        const ptrdiff_t diff = p - inptr;
-        if (diff)
-            outptr = mempmove(outptr, inptr, (size_t)diff);
+        inptr = p + 1;
 
-        if (*p == '+') {
+        switch (*p) {
+        case '+':
             *outptr++ = ' ';
-            inptr = p + 1;
-            continue;
-        }
+            break;
 
-        const char first = (char)tbl1[(unsigned char)p[1]];
-        const char second = tbl2[(unsigned char)p[2]];
-        const char decoded = first | second;
-        if (UNLIKELY(decoded <= 0)) {
-            /* This shouldn't happen in normal circumstances, but if %00 is
-             * found in the encoded string, bail here. */
-            if (decoded == '\0')
+        case '%': {
+            if (UNLIKELY(end - p < 3))
                 return -1;
 
-            /* OR-ing both lookups will yield a negative number if either
-             * encoded character is not a valid hex digit; check it here so
-             * that other valid-but-negative bytes (e.g.  0xff) are still
-             * written to outptr. */
-            if (first == -1) {
-                /* tbl1 is shifted so a valid nibble might be negative;
-                 * check for all the bits here instead.  */
+            const int decoded = decode_hex_escape(p + 1);
+            if (UNLIKELY(decoded <= 0))
                 return -1;
+
+            *outptr++ = (char)decoded;
+            inptr = p + 3;
+            break;
+        }
+
+        case '=':
+            if (array && !value) {
+                *outptr++ = '\0';
+                value = outptr;
+            } else {
+                *outptr++ = '=';
             }
-            if (second < 0) {
-                /* tbl2 isn't shifted so we can check for the sign bit only. */
-                return -1;
+            break;
+
+        case '&':
+            if (!array) {
+                *outptr++ = '&';
+                break;
             }
-        }
 
-        *outptr++ = decoded;
-        inptr = p + 3;
+            *outptr = '\0';
+            if (UNLIKELY(!append_key_value(array, key,
+                                           value ? value - 1 : outptr, value)))
+                return -1;
+
+            inptr = skip_key_value_separators(inptr, end);
+            key = outptr = outptr + 1;
+            value = NULL;
+            break;
+        }
     }
 
-    if (inptr > outptr) {
-        outptr = stpcpy(outptr, inptr);
-        return (ssize_t)(outptr - str);
+    /* If nothing has been decoded, str is already terminated; don't write
+     * to end, as it might belong to a pipelined request. */
+    if (outptr != end)
+        *outptr = '\0';
+
+    if (array && (outptr != key || value)) {
+        if (UNLIKELY(!append_key_value(array, key, value ? value - 1 : outptr,
+                                       value)))
+            return -1;
     }
 
-    return (ssize_t)strlen(str);
+    return (ssize_t)(outptr - str);
 }
 
-static int key_value_compare(const void *a, const void *b)
+#if defined(__x86_64__)
+static ssize_t url_decode_sse2(char *str,
+                               const char *end,
+                               struct lwan_key_value_array *array)
 {
-    return strcmp(((const struct lwan_key_value *)a)->key,
-                  ((const struct lwan_key_value *)b)->key);
+    return url_decode_with(str, end, array, find_urlencoded_sse2);
 }
 
-static void
-reset_key_value_array(void *data)
+#if defined(LWAN_HAVE_BUILTIN_CPU_INIT)
+__attribute__((target("avx2"))) static ssize_t
+url_decode_avx2(char *str, const char *end, struct lwan_key_value_array *array)
 {
-    struct lwan_key_value_array *array = data;
-
-    lwan_key_value_array_reset(array);
+    return url_decode_with(str, end, array, find_urlencoded_avx2);
+}
+#endif
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+static ssize_t url_decode_neon(char *str,
+                               const char *end,
+                               struct lwan_key_value_array *array)
+{
+    return url_decode_with(str, end, array, find_urlencoded_neon);
+}
+#else
+static ssize_t url_decode_portable(char *str,
+                                   const char *end,
+                                   struct lwan_key_value_array *array)
+{
+    return url_decode_with(str, end, array, find_urlencoded_swar);
 }
+#endif
+
+static ssize_t (*url_decode)(char *str,
+                             const char *end,
+                             struct lwan_key_value_array *array) =
+#if defined(__x86_64__)
+    url_decode_sse2;
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+    url_decode_neon;
+#else
+    url_decode_portable;
+#endif
 
 static void parse_key_values(struct lwan_request *request,
                              struct lwan_value *helper_value,
@@ -423,13 +673,12 @@ static void parse_key_values(struct lwan_request *request,
     struct lwan_key_value *kv;
     char *ptr = helper_value->value;
     const char *end = helper_value->value + helper_value->len;
-    coro_deferred reset_defer;
 
     if (!helper_value->len)
         return;
 
-    lwan_key_value_array_init(array);
-    reset_defer = coro_defer(request->conn->coro, reset_key_value_array, array);
+    if (UNLIKELY(!init_key_value_array(request, array, helper_value, separator)))
+        goto error;
 
     do {
         char *key, *value;
@@ -455,20 +704,15 @@ static void parse_key_values(struct lwan_request *request,
             goto error;
         }
 
-        kv = lwan_key_value_array_append(array);
-        if (UNLIKELY(!kv))
-            goto error;
-
+        kv = append_to_key_value_array(array);
         kv->key = key;
         kv->value = value;
     } while (ptr);
 
-    lwan_key_value_array_sort(array, key_value_compare);
-
     return;
 
 error:
-    coro_defer_fire_and_disarm(request->conn->coro, reset_defer);
+    lwan_key_value_array_init(array);
 }
 
 static ssize_t
@@ -490,12 +734,25 @@ static void parse_cookies(struct lwan_request *request)
                      identity_decode, ';');
 }
 
+static void parse_urlencoded(struct lwan_request *request,
+                             struct lwan_value *helper_value,
+                             struct lwan_key_value_array *array)
+{
+    const char *end = helper_value->value + helper_value->len;
+
+    if (!helper_value->len)
+        return;
+
+    if (UNLIKELY(!init_key_value_array(request, array, helper_value, '&') ||
+                 url_decode(helper_value->value, end, array) < 0))
+        lwan_key_value_array_init(array);
+}
+
 static void parse_query_string(struct lwan_request *request)
 {
     struct lwan_request_parser_helper *helper = request->helper;
 
-    parse_key_values(request, &helper->query_string, &helper->query_params,
-                     url_decode, '&');
+    parse_urlencoded(request, &helper->query_string, &helper->query_params);
 }
 
 static void parse_form_data(struct lwan_request *request)
@@ -509,8 +766,7 @@ static void parse_form_data(struct lwan_request *request)
                          sizeof(content_type) - 1)))
         return;
 
-    parse_key_values(request, &helper->body_data, &helper->post_params,
-                     url_decode, '&');
+    parse_urlencoded(request, &helper->body_data, &helper->post_params);
 }
 
 static void find_query_string(struct lwan_request *request, const char *space)
@@ -598,17 +854,95 @@ __attribute__((noinline)) static void set_header_value(
         set_header_value(&(helper->dest), end, p, header_len);                 \
     } while (0)
 
-static ALWAYS_INLINE ssize_t find_headers(char **header_start,
-                                          struct lwan_value *request_buffer,
-                                          char **next_request)
+/* Header lines are short (usually under 64 bytes), so most of the time
+ * spent by memchr() looking for their terminators is in the call itself
+ * and in its setup.  Where vector instructions are known to be available,
+ * find_headers() uses a block scanner instead, so that a block spanning
+ * more than one line is only read once. */
+static ALWAYS_INLINE bool is_cr(char c) { return c == '\r'; }
+
+static ALWAYS_INLINE char *find_cr_memchr(struct block_scanner *scanner
+                                          __attribute__((unused)),
+                                          char *from,
+                                          const char *end)
+{
+    return memchr(from, '\r', (size_t)(end - from));
+}
+
+#if defined(__x86_64__)
+static ALWAYS_INLINE uint64_t block_mask_sse2(const char *p)
+{
+    const __m128i cr = _mm_set1_epi8('\r');
+    uint64_t mask = 0;
+
+    for (int i = 0; i < 4; i++) {
+        __m128i block = _mm_loadu_si128((const __m128i *)(p + i * 16));
+        mask |= (uint64_t)(uint16_t)_mm_movemask_epi8(_mm_cmpeq_epi8(block, cr))
+                << (i * 16);
+    }
+
+    return mask;
+}
+
+static ALWAYS_INLINE char *
+find_cr_sse2(struct block_scanner *scanner, char *from, const char *end)
+{
+    return find_in_blocks(scanner, from, end, block_mask_sse2, 64, 1, is_cr);
+}
+
+#if defined(LWAN_HAVE_BUILTIN_CPU_INIT)
+__attribute__((target("avx2"))) static ALWAYS_INLINE uint64_t
+block_mask_avx2(const char *p)
+{
+    const __m256i cr = _mm256_set1_epi8('\r');
+    __m256i lo = _mm256_loadu_si256((const __m256i *)p);
+    __m256i hi = _mm256_loadu_si256((const __m256i *)(p + 32));
+    uint32_t mask_lo = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(lo, cr));
+    uint32_t mask_hi = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(hi, cr));
+
+    return (uint64_t)mask_hi << 32 | mask_lo;
+}
+
+__attribute__((target("avx2"))) static ALWAYS_INLINE char *
+find_cr_avx2(struct block_scanner *scanner, char *from, const char *end)
+{
+    return find_in_blocks(scanner, from, end, block_mask_avx2, 64, 1, is_cr);
+}
+#endif
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+static ALWAYS_INLINE uint64_t block_mask_neon(const char *p)
+{
+    uint8x16_t eq = vceqq_u8(vld1q_u8((const uint8_t *)p), vdupq_n_u8('\r'));
+
+    /* There's no movemask equivalent, so narrow each byte of the
+     * comparison result to 4 bits instead. */
+    return vget_lane_u64(
+        vreinterpret_u64_u8(vshrn_n_u16(vreinterpretq_u16_u8(eq), 4)), 0);
+}
+
+static ALWAYS_INLINE char *
+find_cr_neon(struct block_scanner *scanner, char *from, const char *end)
+{
+    return find_in_blocks(scanner, from, end, block_mask_neon, 16, 4, is_cr);
+}
+#endif
+
+static ALWAYS_INLINE ssize_t
+find_headers_with(char **header_start,
+                  struct lwan_value *request_buffer,
+                  char **next_request,
+                  char *(*find_cr)(struct block_scanner *scanner,
+                                   char *from,
+                                   const char *end))
 {
     char *buffer = request_buffer->value;
     char *buffer_end = buffer + request_buffer->len;
+    struct block_scanner scanner = {};
     ssize_t n_headers = 0;
     char *next_header;
 
     for (char *next_chr = buffer + 1;;) {
-        next_header = memchr(next_chr, '\r', (size_t)(buffer_end - next_chr));
+        next_header = find_cr(&scanner, next_chr, buffer_end);
 
         if (UNLIKELY(!next_header))
             return -1;
@@ -644,6 +978,117 @@ out:
     return n_headers;
 }
 
+ssize_t lwan_find_headers_portable(char **header_start,
+                                   struct lwan_value *buffer,
+                                   char **next_request)
+{
+    return find_headers_with(header_start, buffer, next_request,
+                             find_cr_memchr);
+}
+
+#if defined(__x86_64__)
+static ssize_t find_headers_sse2(char **header_start,
+                                 struct lwan_value *buffer,
+                                 char **next_request)
+{
+    return find_headers_with(header_start, buffer, next_request,
+                             find_cr_sse2);
+}
+
+#if defined(LWAN_HAVE_BUILTIN_CPU_INIT)
+__attribute__((target("avx2"))) static ssize_t
+find_headers_avx2(char **header_start,
+                  struct lwan_value *buffer,
+                  char **next_request)
+{
+    return find_headers_with(header_start, buffer, next_request,
+                             find_cr_avx2);
+}
+#endif
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+static ssize_t find_headers_neon(char **header_start,
+                                 struct lwan_value *buffer,
+                                 char **next_request)
+{
+    return find_headers_with(header_start, buffer, next_request,
+                             find_cr_neon);
+}
+#endif
+
+static ssize_t (*find_headers)(char **header_start,
+                               struct lwan_value *buffer,
+                               char **next_request) =
+#if defined(__x86_64__)
+    find_headers_sse2;
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+    find_headers_neon;
+#else
+    lwan_find_headers_portable;
+#endif
+
+#if defined(__x86_64__) && defined(LWAN_HAVE_BUILTIN_CPU_INIT)
+__attribute__((constructor)) static void select_vector_routines(void)
+{
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        find_headers = find_headers_avx2;
+        url_decode = url_decode_avx2;
+    }
+}
+#endif
+
+/* The first 4 bytes (in lower case) of each header name parse_headers()
+ * looks for hash to a different slot of this table, so finding out if a
+ * header is one of them takes a multiplication, a load, and a single
+ * comparison, rather than a tree of comparisons.  The multiplier works in
+ * both byte orders; the known_headers self-test checks for collisions. */
+#define KNOWN_HEADER_HASH(word) ((uint32_t)((word) * 0xe6f3u) >> 29)
+
+enum known_header_id {
+    HEADER_UNKNOWN,
+    HEADER_ACCEPT,
+    HEADER_CONNECTION,
+    HEADER_CONTENT,
+    HEADER_IF_MODIFIED_SINCE,
+    HEADER_HOST,
+    HEADER_RANGE,
+};
+
+struct known_header {
+    uint32_t word;
+    uint8_t header;
+};
+
+#define KNOWN_HEADER(a, b, c, d, id)                                           \
+    [KNOWN_HEADER_HASH(STR4_INT_L(a, b, c, d))] = {STR4_INT_L(a, b, c, d), id}
+
+static const struct known_header known_headers[8] = {
+    KNOWN_HEADER('A', 'c', 'c', 'e', HEADER_ACCEPT),
+    KNOWN_HEADER('C', 'o', 'n', 'n', HEADER_CONNECTION),
+    KNOWN_HEADER('C', 'o', 'n', 't', HEADER_CONTENT),
+    KNOWN_HEADER('I', 'f', '-', 'M', HEADER_IF_MODIFIED_SINCE),
+    KNOWN_HEADER('H', 'o', 's', 't', HEADER_HOST),
+    KNOWN_HEADER('R', 'a', 'n', 'g', HEADER_RANGE),
+};
+
+#undef KNOWN_HEADER
+
+LWAN_SELF_TEST(known_headers)
+{
+    static const char *names[] = {"Accept-Encoding", "Connection",
+                                  "Content-Type",    "If-Modified-Since",
+                                  "Host",            "Range"};
+
+    for (size_t i = 0; i < N_ELEMENTS(names); i++) {
+        const uint32_t word = LOWER4(string_as_uint32(names[i]));
+        const struct known_header *known __attribute__((unused)) =
+            &known_headers[KNOWN_HEADER_HASH(word)];
+
+        assert(known->word == word);
+        assert(known->header == i + 1);
+    }
+}
+
 static bool parse_headers(struct lwan_request_parser_helper *helper,
                           char *buffer)
 {
@@ -664,8 +1109,15 @@ static bool parse_headers(struct lwan_request_parser_helper *helper,
         char *p = header_start[i];
         char *end = header_start[i + 1] - HEADER_TERMINATOR_LEN;
 
-        STRING_SWITCH_L (p) {
-        case STR4_INT_L('A', 'c', 'c', 'e'):
+        const uint32_t word = LOWER4(string_as_uint32(p));
+        const struct known_header *known =
+            &known_headers[KNOWN_HEADER_HASH(word)];
+
+        if (known->word != word)
+            continue;
+
+        switch (known->header) {
+        case HEADER_ACCEPT:
             p += HEADER_LENGTH("Accept");
 
             STRING_SWITCH_L (p) {
@@ -674,10 +1126,10 @@ static bool parse_headers(struct lwan_request_parser_helper *helper,
                 break;
             }
             break;
-        case STR4_INT_L('C', 'o', 'n', 'n'):
+        case HEADER_CONNECTION:
             SET_HEADER_VALUE(connection, "Connection");
             break;
-        case STR4_INT_L('C', 'o', 'n', 't'):
+        case HEADER_CONTENT:
             p += HEADER_LENGTH("Content");
 
             STRING_SWITCH_L (p) {
@@ -689,19 +1141,22 @@ static bool parse_headers(struct lwan_request_parser_helper *helper,
                 break;
             }
             break;
-        case STR4_INT_L('I', 'f', '-', 'M'):
+        case HEADER_IF_MODIFIED_SINCE:
             SET_HEADER_VALUE(if_modified_since.raw, "If-Modified-Since");
             break;
-        case STR4_INT_L('H', 'o', 's', 't'):
+        case HEADER_HOST:
             SET_HEADER_VALUE(host, "Host");
             break;
-        case STR4_INT_L('R', 'a', 'n', 'g'):
+        case HEADER_RANGE:
             SET_HEADER_VALUE(range.raw, "Range");
             break;
+        case HEADER_UNKNOWN:
+            break;
         }
     }
 
     helper->n_header_start = (size_t)n_headers;
+    helper->header_index_built = false;
     return true;
 }
 #undef HEADER_LENGTH
@@ -751,47 +1206,62 @@ parse_off_without_sign(const char *ptr, char **end, off_t *off)
     return true;
 }
 
-static void
-parse_range(struct lwan_request_parser_helper *helper)
+/* Parses a single range in a "Range: bytes=..." header, up to either the
+ * end of the header or the comma separating it from the next range.
+ * Suffix ranges ("-N", the last N bytes) have *from set to -1 and *to set
+ * to N, as the size of the resource isn't known here. */
+static bool parse_range_spec(const char *range, char **end, off_t *from, off_t *to)
+{
+    if (*range == '-') {
+        *from = -1;
+
+        return parse_off_without_sign(range + 1, end, to);
+    }
+
+    if (lwan_char_isdigit(*range)) {
+        if (!parse_off_without_sign(range, end, from))
+            return false;
+        if (**end != '-')
+            return false;
+
+        range = *end + 1;
+        if (*range == '\0' || *range == ',') {
+            *end = (char *)range;
+            *to = -1;
+            return true;
+        }
+
+        return parse_off_without_sign(range, end, to);
+    }
+
+    return false;
+}
+
+static char *range_value(struct lwan_request_parser_helper *helper)
 {
     if (UNLIKELY(helper->range.raw.len <= (sizeof("bytes=") - 1)))
-        return;
+        return NULL;
 
     char *range = helper->range.raw.value;
     if (UNLIKELY(strncmp(range, "bytes=", sizeof("bytes=") - 1)))
-        return;
+        return NULL;
+
+    return range + sizeof("bytes=") - 1;
+}
+
+static void
+parse_range(struct lwan_request_parser_helper *helper)
+{
+    char *range = range_value(helper);
 
-    range += sizeof("bytes=") - 1;
+    if (UNLIKELY(!range))
+        return;
 
     off_t from, to;
     char *end;
 
-    if (*range == '-') {
-        from = 0;
-
-        if (!parse_off_without_sign(range + 1, &end, &to))
-            goto invalid_range;
-        if (*end != '\0')
-            goto invalid_range;
-    } else if (lwan_char_isdigit(*range)) {
-        if (!parse_off_without_sign(range, &end, &from))
-            goto invalid_range;
-        if (*end != '-')
-            goto invalid_range;
-
-        range = end + 1;
-        if (*range == '\0') {
-            to = -1;
-        } else {
-            if (!parse_off_without_sign(range, &end, &to))
-                goto invalid_range;
-            if (*end != '\0')
-                goto invalid_range;
-        }
-    } else {
-invalid_range:
+    if (!parse_range_spec(range, &end, &from, &to) || *end != '\0')
         to = from = -1;
-    }
 
     helper->range.from = from;
     helper->range.to = to;
@@ -884,6 +1354,10 @@ out:
             conn->flags |= CONN_SENT_CONNECTION_HEADER;
     }
 
+    /* Listeners have been handed over to another process */
+    if (UNLIKELY(conn->thread->draining))
+        has_keep_alive = false;
+
     if (has_keep_alive) {
         conn->flags |= CONN_IS_KEEP_ALIVE;
     } else {
@@ -933,24 +1407,62 @@ try_another_file_name:
 }
 #endif
 
-static enum lwan_http_status client_read(
-    struct lwan_request *request,
-    struct lwan_value *buffer,
-    const size_t want_to_read,
-    enum lwan_read_finalizer (*finalizer)(const struct lwan_value *buffer,
-                                          size_t want_to_read,
-                                          const struct lwan_request *request,
-                                          int n_packets))
+static size_t request_buffer_limit(const struct lwan_request_buffer *buffer)
 {
-    struct lwan_request_parser_helper *helper = request->helper;
-    int n_packets = 0;
-
-    if (helper->next_request) {
-        const size_t next_request_len =
-            (size_t)(helper->next_request - buffer->value);
-        size_t new_len;
+    return LWAN_MIN(buffer->size, buffer->max_size) - 1 /* -1 for NUL byte */;
+}
 
-        if (__builtin_sub_overflow(buffer->len, next_request_len, &new_len)) {
+static enum lwan_http_status
+grow_request_buffer(struct lwan_request_buffer *buffer)
+{
+    if (buffer->size >= buffer->max_size)
+        return HTTP_TOO_LARGE;
+
+    const size_t new_size = buffer->size * 2;
+    char *new_value = lwan_strbuf_pool_alloc(new_size);
+    if (UNLIKELY(!new_value))
+        return HTTP_UNAVAILABLE;
+
+    memcpy(new_value, buffer->value.value, buffer->value.len);
+    if (buffer->value.value != buffer->stack)
+        lwan_strbuf_pool_free(buffer->value.value, buffer->size);
+
+    buffer->value.value = new_value;
+    buffer->size = new_size;
+
+    return HTTP_OK;
+}
+
+void lwan_request_buffer_shrink(struct lwan_request_buffer *buffer)
+{
+    if (buffer->value.value == buffer->stack)
+        return;
+
+    lwan_strbuf_pool_free(buffer->value.value, buffer->size);
+
+    buffer->value = (struct lwan_value){.value = buffer->stack};
+    buffer->size = DEFAULT_BUFFER_SIZE;
+}
+
+static enum lwan_http_status client_read(
+    struct lwan_request *request,
+    struct lwan_value *buffer,
+    struct lwan_request_buffer *growable,
+    size_t want_to_read,
+    enum lwan_read_finalizer (*finalizer)(const struct lwan_value *buffer,
+                                          size_t want_to_read,
+                                          const struct lwan_request *request,
+                                          int n_packets))
+{
+    struct lwan_request_parser_helper *helper = request->helper;
+    int n_packets = 0;
+
+    if (helper->next_request) {
+        const size_t next_request_len =
+            (size_t)(helper->next_request - buffer->value);
+        size_t new_len;
+
+        if (__builtin_sub_overflow(buffer->len, next_request_len, &new_len)) {
             helper->next_request = NULL;
         } else if (new_len) {
             /* FIXME: This memmove() could be eventually removed if a better
@@ -966,10 +1478,27 @@ static enum lwan_http_status client_read(
     for (buffer->len = 0;; n_packets++) {
         size_t to_read = (size_t)(want_to_read - buffer->len);
 
-        if (UNLIKELY(to_read == 0))
-            return HTTP_TOO_LARGE;
+        if (UNLIKELY(to_read == 0)) {
+            if (!growable)
+                return HTTP_TOO_LARGE;
+
+            /* Only the headers are read into a growable buffer, and nothing
+             * points inside it until they're parsed. */
+            enum lwan_http_status status = grow_request_buffer(growable);
+            if (UNLIKELY(status != HTTP_OK))
+                return status;
+
+            want_to_read = request_buffer_limit(growable);
+            to_read = (size_t)(want_to_read - buffer->len);
+        }
+
+        /* The client might be waiting for the responses to the requests
+         * it has pipelined before sending anything else. */
+        if (UNLIKELY(lwan_flush_queued_responses(request) < 0))
+            break;
 
-        ssize_t n = recv(request->fd, buffer->value + buffer->len, to_read, 0);
+        ssize_t n = lwan_socket_recv(request, request->fd,
+                                     buffer->value + buffer->len, to_read, 0);
         if (UNLIKELY(n <= 0)) {
             if (n < 0) {
                 switch (errno) {
@@ -1077,8 +1606,11 @@ read_request_finalizer(const struct lwan_value *buffer,
 static ALWAYS_INLINE enum lwan_http_status
 read_request(struct lwan_request *request)
 {
-    return client_read(request, request->helper->buffer,
-                       DEFAULT_BUFFER_SIZE - 1 /* -1 for NUL byte */,
+    struct lwan_request_buffer *growable = request->helper->request_buffer;
+
+    return client_read(request, request->helper->buffer, growable,
+                       growable ? request_buffer_limit(growable)
+                                : DEFAULT_BUFFER_SIZE - 1 /* -1 for NUL byte */,
                        read_request_finalizer);
 }
 
@@ -1193,9 +1725,11 @@ static int create_temp_file(void)
         return -ENOENT;
 
 #if defined(O_TMPFILE)
+    /* No O_EXCL, so that handlers can link the file into place with
+     * lwan_request_link_body(). */
     int fd = open(temp_dir,
-                  O_TMPFILE | O_CREAT | O_RDWR | O_EXCL | O_CLOEXEC |
-                      O_NOFOLLOW | O_NOATIME,
+                  O_TMPFILE | O_CREAT | O_RDWR | O_CLOEXEC | O_NOFOLLOW |
+                      O_NOATIME,
                   S_IRUSR | S_IWUSR);
     if (LIKELY(fd >= 0))
         return fd;
@@ -1215,9 +1749,27 @@ static int create_temp_file(void)
     return ret;
 }
 
+static bool expects_100_continue(struct lwan_request *request)
+{
+    if (request->flags & REQUEST_IS_HTTP_1_0)
+        return false;
+
+    /* §8.2.3 https://www.w3.org/Protocols/rfc2616/rfc2616-sec8.html */
+    const char *expect = lwan_request_get_header(request, "Expect");
+    return expect && strncmp(expect, "100-", 4) == 0;
+}
+
+static void send_100_continue(struct lwan_request *request)
+{
+    static const char continue_header[] = "HTTP/1.1 100 Continue\r\n\r\n";
+
+    lwan_send(request, continue_header, sizeof(continue_header) - 1, 0);
+}
+
 struct file_backed_buffer {
     void *ptr;
     size_t size;
+    int fd;
 };
 
 static void
@@ -1225,27 +1777,18 @@ free_body_buffer(void *data)
 {
     struct file_backed_buffer *buf = data;
 
-    munmap(buf->ptr, buf->size);
+    if (buf->ptr)
+        munmap(buf->ptr, buf->size);
+    close(buf->fd);
     free(buf);
 }
 
-static void*
-alloc_body_buffer(struct coro *coro, size_t size, bool allow_file)
+static struct file_backed_buffer *
+create_body_file(struct lwan_request *request, size_t size)
 {
     struct file_backed_buffer *buf;
-    void *ptr = (void *)MAP_FAILED;
     int fd;
 
-    if (LIKELY(size < body_buffer_temp_file_thresh)) {
-        ptr = coro_malloc(coro, size);
-
-        if (LIKELY(ptr))
-            return ptr;
-    }
-
-    if (UNLIKELY(!allow_file))
-        return NULL;
-
     fd = create_temp_file();
     if (UNLIKELY(fd < 0))
         return NULL;
@@ -1255,27 +1798,166 @@ alloc_body_buffer(struct coro *coro, size_t size, bool allow_file)
         return NULL;
     }
 
+    buf = coro_malloc_full(request->conn->coro, sizeof(*buf), free_body_buffer);
+    if (UNLIKELY(!buf)) {
+        close(fd);
+        return NULL;
+    }
+
+    buf->ptr = NULL;
+    buf->size = size;
+    buf->fd = fd;
+
+    /* The file is kept open until the request is done, so handlers can get
+     * to it with lwan_request_get_body_fd(). */
+    request->helper->body_file = buf;
+
+    return buf;
+}
+
+static bool map_body_file(struct file_backed_buffer *buf)
+{
+    void *ptr = (void *)MAP_FAILED;
+
     if (MAP_HUGETLB) {
-        ptr = mmap(NULL, size, PROT_READ | PROT_WRITE,
-                   MAP_SHARED | MAP_HUGETLB, fd, 0);
+        ptr = mmap(NULL, buf->size, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_HUGETLB, buf->fd, 0);
+    }
+    if (UNLIKELY(ptr == MAP_FAILED)) {
+        ptr = mmap(NULL, buf->size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                   buf->fd, 0);
     }
     if (UNLIKELY(ptr == MAP_FAILED))
-        ptr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
-    close(fd);
-    if (UNLIKELY(ptr == MAP_FAILED))
+        return false;
+
+    buf->ptr = ptr;
+    return true;
+}
+
+static void*
+alloc_body_buffer(struct lwan_request *request, size_t size, bool allow_file)
+{
+    struct file_backed_buffer *buf;
+
+    if (LIKELY(size < body_buffer_temp_file_thresh)) {
+        void *ptr = coro_malloc(request->conn->coro, size);
+
+        if (LIKELY(ptr))
+            return ptr;
+    }
+
+    if (UNLIKELY(!allow_file))
         return NULL;
 
-    buf = coro_malloc_full(coro, sizeof(*buf), free_body_buffer);
-    if (UNLIKELY(!buf)) {
-        munmap(ptr, size);
+    buf = create_body_file(request, size);
+    if (UNLIKELY(!buf))
         return NULL;
+
+    return map_body_file(buf) ? buf->ptr : NULL;
+}
+
+#if defined(__linux__)
+static void close_fd(void *data)
+{
+    int fd = (int)(intptr_t)data;
+
+    close(fd);
+}
+
+static enum lwan_http_status
+splice_body_to_file(struct lwan_request *request,
+                    int fd,
+                    const int pipe_fds[static 2],
+                    off_t offset,
+                    size_t count)
+{
+    const unsigned int flags = SPLICE_F_MOVE | SPLICE_F_NONBLOCK;
+    size_t in_pipe = 0;
+    ssize_t r;
+
+    while (count || in_pipe) {
+        if (count) {
+            r = splice(request->fd, NULL, pipe_fds[1], NULL, count, flags);
+            if (r > 0) {
+                count -= (size_t)r;
+                in_pipe += (size_t)r;
+            } else if (UNLIKELY(!r || (errno != EAGAIN && errno != EINTR))) {
+                coro_yield(request->conn->coro, CONN_CORO_ABORT);
+                __builtin_unreachable();
+            } else if (!in_pipe) {
+                /* See body_data_finalizer(). */
+                if (UNLIKELY(time(NULL) > request->helper->error_when_time))
+                    return HTTP_TIMEOUT;
+
+                lwan_request_await_read(request, request->fd);
+                continue;
+            }
+        }
+
+        if (in_pipe) {
+            r = splice(pipe_fds[0], NULL, fd, &offset, in_pipe, SPLICE_F_MOVE);
+            if (r > 0)
+                in_pipe -= (size_t)r;
+            else if (r < 0 && errno == EINTR)
+                continue;
+            else
+                return HTTP_INTERNAL_ERROR;
+        }
     }
 
-    buf->ptr = ptr;
-    buf->size = size;
-    return ptr;
+    return HTTP_OK;
 }
 
+static int splice_body_data(struct lwan_request *request,
+                            size_t total,
+                            size_t have)
+{
+    const struct lwan_config *config = &request->conn->thread->lwan->config;
+    struct lwan_request_parser_helper *helper = request->helper;
+    struct file_backed_buffer *buf;
+    enum lwan_http_status status;
+    int pipe_fds[2];
+
+    /* The extra byte is there for the same reason it's allocated in
+     * read_body_data(); lwan_request_link_body() drops it. */
+    buf = create_body_file(request, total + 1);
+    if (UNLIKELY(!buf))
+        return -HTTP_INTERNAL_ERROR;
+
+    if (expects_100_continue(request))
+        send_100_continue(request);
+
+    if (have) {
+        /* Part of the body came in with the request headers. */
+        if (UNLIKELY(pwrite(buf->fd, helper->next_request, have, 0) !=
+                     (ssize_t)have))
+            return -HTTP_INTERNAL_ERROR;
+    }
+    helper->next_request = NULL;
+
+    if (UNLIKELY(pipe2(pipe_fds, O_NONBLOCK | O_CLOEXEC) < 0))
+        return -HTTP_INTERNAL_ERROR;
+    coro_defer(request->conn->coro, close_fd, (void *)(intptr_t)pipe_fds[0]);
+    coro_defer(request->conn->coro, close_fd, (void *)(intptr_t)pipe_fds[1]);
+
+    helper->error_when_time = time(NULL) + config->keep_alive_timeout;
+
+    status = splice_body_to_file(request, buf->fd, pipe_fds, (off_t)have,
+                                 total - have);
+    if (UNLIKELY(status != HTTP_OK))
+        return (int)status;
+
+    /* Mapping the file doesn't read it, so handlers that only want to
+     * store the body never touch it.  */
+    if (UNLIKELY(!map_body_file(buf)))
+        return -HTTP_INTERNAL_ERROR;
+
+    helper->body_data.value = buf->ptr;
+    helper->body_data.len = total;
+    return HTTP_OK;
+}
+#endif
+
 static enum lwan_http_status
 get_remaining_body_data_length(struct lwan_request *request,
                                const size_t max_size,
@@ -1349,21 +2031,27 @@ static int read_body_data(struct lwan_request *request)
     if (status != HTTP_PARTIAL_CONTENT)
         return -(int)status;
 
-    new_buffer =
-        alloc_body_buffer(request->conn->coro, total + 1, allow_temp_file);
-    if (UNLIKELY(!new_buffer))
-        return -HTTP_INTERNAL_ERROR;
+    if (helper->h2_stream) {
+        /* Whole body has been received already with DATA frames. */
+        helper->body_data = lwan_h2_stream_get_body(helper->h2_stream);
+        return HTTP_OK;
+    }
 
-    if (!(request->flags & REQUEST_IS_HTTP_1_0)) {
-        /* §8.2.3 https://www.w3.org/Protocols/rfc2616/rfc2616-sec8.html */
-        const char *expect = lwan_request_get_header(request, "Expect");
+#if defined(__linux__)
+    /* Large bodies are spliced from the socket into the temporary file
+     * instead of going through userspace.  TLS connections are read the
+     * usual way, as not every record is necessarily application data. */
+    if (allow_temp_file && total + 1 >= body_buffer_temp_file_thresh &&
+        !(request->conn->flags & CONN_TLS))
+        return splice_body_data(request, total, have);
+#endif
 
-        if (expect && strncmp(expect, "100-", 4) == 0) {
-            static const char continue_header[] = "HTTP/1.1 100 Continue\r\n\r\n";
+    new_buffer = alloc_body_buffer(request, total + 1, allow_temp_file);
+    if (UNLIKELY(!new_buffer))
+        return -HTTP_INTERNAL_ERROR;
 
-            lwan_send(request, continue_header, sizeof(continue_header) - 1, 0);
-        }
-    }
+    if (expects_100_continue(request))
+        send_100_continue(request);
 
     helper->body_data.value = new_buffer;
     helper->body_data.len = total;
@@ -1377,7 +2065,382 @@ static int read_body_data(struct lwan_request *request)
     helper->error_when_n_packets = lwan_calculate_n_packets(total);
 
     struct lwan_value buffer = {.value = new_buffer, .len = total};
-    return (int)client_read(request, &buffer, total, body_data_finalizer);
+    return (int)client_read(request, &buffer, NULL, total, body_data_finalizer);
+}
+
+#define BODY_STREAM_LINE_BUFFER_SIZE 1024
+
+struct lwan_request_streams *
+lwan_request_get_streams(struct lwan_request *request)
+{
+    struct lwan_request_parser_helper *helper = request->helper;
+
+    if (LIKELY(helper->streams))
+        return helper->streams;
+
+    helper->streams = coro_malloc(request->conn->coro, sizeof(*helper->streams));
+    if (LIKELY(helper->streams))
+        memset(helper->streams, 0, sizeof(*helper->streams));
+
+    return helper->streams;
+}
+
+static int prepare_body_stream(struct lwan_request *request)
+{
+    const struct lwan_config *config = &request->conn->thread->lwan->config;
+    struct lwan_request_parser_helper *helper = request->helper;
+    struct lwan_request_streams *streams;
+    const char *transfer_encoding;
+    size_t max_data_size;
+
+    switch (lwan_request_get_method(request)) {
+    case REQUEST_METHOD_POST:
+        max_data_size = config->max_post_data_size;
+        break;
+    case REQUEST_METHOD_PUT:
+        max_data_size = config->max_put_data_size;
+        break;
+    default:
+        return -HTTP_NOT_ALLOWED;
+    }
+
+    streams = lwan_request_get_streams(request);
+    if (UNLIKELY(!streams))
+        return HTTP_UNAVAILABLE;
+
+    if (helper->h2_stream) {
+        /* Whole body has been received already with DATA frames. */
+        streams->body_stream.pending = lwan_h2_stream_get_body(helper->h2_stream);
+        streams->body_stream.state = BODY_STREAM_BUFFERED;
+        return HTTP_OK;
+    }
+
+    transfer_encoding = lwan_request_get_header(request, "Transfer-Encoding");
+    if (transfer_encoding) {
+        /* Having both is a common way to smuggle requests past proxies
+         * that disagree about which one to use. */
+        if (UNLIKELY(helper->content_length.value != NULL))
+            return -HTTP_BAD_REQUEST;
+        if (UNLIKELY(!strcaseequal_neutral(transfer_encoding, "chunked")))
+            return -HTTP_NOT_IMPLEMENTED;
+
+        streams->body_stream.state = BODY_STREAM_CHUNK_SIZE;
+    } else {
+        long long parsed_size;
+
+        if (UNLIKELY(!helper->content_length.value))
+            return -HTTP_BAD_REQUEST;
+
+        parsed_size = parse_long_long(helper->content_length.value, -1);
+        if (UNLIKELY(parsed_size < 0))
+            return -HTTP_BAD_REQUEST;
+        if (UNLIKELY((size_t)parsed_size >= max_data_size))
+            return -HTTP_TOO_LARGE;
+
+        if (!parsed_size) {
+            streams->body_stream.state = BODY_STREAM_DONE;
+            return HTTP_OK;
+        }
+
+        streams->body_stream.state = BODY_STREAM_DATA;
+        streams->body_stream.remaining = (uint64_t)parsed_size;
+    }
+
+    streams->body_stream.max_size = max_data_size;
+    streams->body_stream.expect_continue = expects_100_continue(request);
+
+    /* Part of the body might have been read with the request already.
+     * Until the whole body has been read, whatever comes after it can't be
+     * treated as a pipelined request, and the connection can't be reused
+     * either if the handler doesn't read the body until the end. */
+    if (helper->next_request) {
+        const char *buffer_end = helper->buffer->value + helper->buffer->len;
+
+        streams->body_stream.pending = (struct lwan_value){
+            .value = helper->next_request,
+            .len = (size_t)(buffer_end - helper->next_request),
+        };
+        helper->next_request = NULL;
+    }
+    streams->body_stream.keep_alive = request->conn->flags & CONN_IS_KEEP_ALIVE;
+    request->conn->flags &= ~CONN_IS_KEEP_ALIVE;
+
+    return HTTP_OK;
+}
+
+static void finish_body_stream(struct lwan_request *request)
+{
+    struct lwan_request_parser_helper *helper = request->helper;
+    struct lwan_request_streams *streams = helper->streams;
+    struct lwan_value *pending = &streams->body_stream.pending;
+
+    streams->body_stream.state = BODY_STREAM_DONE;
+
+    if (!streams->body_stream.line_buffer) {
+        /* Anything left is still in the request buffer and belongs to the
+         * next pipelined request. */
+        helper->next_request = pending->len ? pending->value : NULL;
+    } else if (pending->len) {
+        /* Can't hand whatever has been read past the end of the body back
+         * to the request buffer, so close the connection instead. */
+        return;
+    }
+
+    if (streams->body_stream.keep_alive)
+        request->conn->flags |= CONN_IS_KEEP_ALIVE;
+}
+
+static size_t body_stream_recv(struct lwan_request *request,
+                               void *buf,
+                               size_t len)
+{
+    struct iovec vec = {.iov_base = buf, .iov_len = len};
+    ssize_t r = lwan_readv_some_fd(request, request->fd, &vec, 1);
+
+    if (UNLIKELY(r <= 0)) {
+        /* Peer closed the connection or an error happened: there's
+         * nobody to respond to anymore. */
+        coro_yield(request->conn->coro, CONN_CORO_ABORT);
+        __builtin_unreachable();
+    }
+
+    return (size_t)r;
+}
+
+static int body_stream_read_line(struct lwan_request *request,
+                                 struct lwan_value *line)
+{
+    struct lwan_request_parser_helper *helper = request->helper;
+    struct lwan_request_streams *streams = helper->streams;
+    struct lwan_value *pending = &streams->body_stream.pending;
+    char *line_buffer = streams->body_stream.line_buffer;
+
+    while (true) {
+        char *lf = pending->len ? memchr(pending->value, '\n', pending->len)
+                                : NULL;
+
+        if (lf) {
+            if (UNLIKELY(lf == pending->value || lf[-1] != '\r'))
+                return -HTTP_BAD_REQUEST;
+
+            line->value = pending->value;
+            line->len = (size_t)(lf - 1 - pending->value);
+
+            pending->len -= (size_t)(lf + 1 - pending->value);
+            pending->value = lf + 1;
+            return 0;
+        }
+
+        if (UNLIKELY(pending->len >= BODY_STREAM_LINE_BUFFER_SIZE))
+            return -HTTP_BAD_REQUEST;
+
+        if (!line_buffer) {
+            line_buffer =
+                coro_malloc(request->conn->coro, BODY_STREAM_LINE_BUFFER_SIZE);
+            if (UNLIKELY(!line_buffer))
+                return -HTTP_INTERNAL_ERROR;
+
+            streams->body_stream.line_buffer = line_buffer;
+        }
+
+        if (pending->value != line_buffer) {
+            if (pending->len)
+                memmove(line_buffer, pending->value, pending->len);
+            pending->value = line_buffer;
+        }
+
+        pending->len +=
+            body_stream_recv(request, line_buffer + pending->len,
+                             BODY_STREAM_LINE_BUFFER_SIZE - pending->len);
+    }
+}
+
+static int parse_chunk_size(const struct lwan_value *line, uint64_t *size)
+{
+    uint64_t value = 0;
+    size_t i;
+
+    for (i = 0; i < line->len; i++) {
+        const char c = line->value[i];
+        unsigned int digit;
+
+        if (c >= '0' && c <= '9')
+            digit = (unsigned int)(c - '0');
+        else if ((c | 0x20) >= 'a' && (c | 0x20) <= 'f')
+            digit = (unsigned int)((c | 0x20) - 'a' + 10);
+        else
+            break;
+
+        if (UNLIKELY(value >> 60 != 0))
+            return -HTTP_TOO_LARGE;
+        value = value << 4 | digit;
+    }
+
+    if (UNLIKELY(!i))
+        return -HTTP_BAD_REQUEST;
+
+    /* Chunk extensions are ignored. */
+    if (i < line->len && line->value[i] != ';' && line->value[i] != ' ' &&
+        line->value[i] != '\t')
+        return -HTTP_BAD_REQUEST;
+
+    *size = value;
+    return 0;
+}
+
+static size_t
+body_stream_read_data(struct lwan_request *request, void *buf, size_t len)
+{
+    struct lwan_request_parser_helper *helper = request->helper;
+    struct lwan_request_streams *streams = helper->streams;
+    struct lwan_value *pending = &streams->body_stream.pending;
+    size_t n;
+
+    len = (size_t)LWAN_MIN((uint64_t)len, streams->body_stream.remaining);
+
+    if (pending->len) {
+        n = LWAN_MIN(len, pending->len);
+        memcpy(buf, pending->value, n);
+        pending->value += n;
+        pending->len -= n;
+    } else {
+        /* Nothing is buffered, so read straight into the caller's buffer.
+         * Nothing is read from the socket until the handler asks for more,
+         * so a slow handler makes TCP flow control slow the client down. */
+        n = body_stream_recv(request, buf, len);
+    }
+
+    helper->streams->body_stream.remaining -= n;
+    return n;
+}
+
+static int body_stream_read_chunk_header(struct lwan_request *request)
+{
+    struct lwan_request_parser_helper *helper = request->helper;
+    struct lwan_request_streams *streams = helper->streams;
+    struct lwan_value line;
+    uint64_t size;
+    int r;
+
+    while (true) {
+        switch (streams->body_stream.state) {
+        case BODY_STREAM_CHUNK_END:
+            r = body_stream_read_line(request, &line);
+            if (UNLIKELY(r < 0))
+                return r;
+            if (UNLIKELY(line.len != 0))
+                return -HTTP_BAD_REQUEST;
+
+            streams->body_stream.state = BODY_STREAM_CHUNK_SIZE;
+            break;
+
+        case BODY_STREAM_CHUNK_SIZE:
+            r = body_stream_read_line(request, &line);
+            if (UNLIKELY(r < 0))
+                return r;
+            r = parse_chunk_size(&line, &size);
+            if (UNLIKELY(r < 0))
+                return r;
+
+            if (!size) {
+                streams->body_stream.state = BODY_STREAM_TRAILERS;
+                break;
+            }
+
+            if (UNLIKELY(size >= streams->body_stream.max_size))
+                return -HTTP_TOO_LARGE;
+            streams->body_stream.max_size -= size;
+
+            streams->body_stream.remaining = size;
+            streams->body_stream.state = BODY_STREAM_CHUNK_DATA;
+            return 0;
+
+        case BODY_STREAM_TRAILERS:
+            /* Trailer fields are ignored as well. */
+            r = body_stream_read_line(request, &line);
+            if (UNLIKELY(r < 0))
+                return r;
+            if (!line.len) {
+                finish_body_stream(request);
+                return 0;
+            }
+            break;
+
+        default:
+            return 0;
+        }
+    }
+}
+
+ssize_t
+lwan_request_read_body(struct lwan_request *request, void *buf, size_t len)
+{
+    struct lwan_request_parser_helper *helper = request->helper;
+    struct lwan_request_streams *streams;
+    struct lwan_value *pending;
+    size_t n;
+    int r;
+
+    if (UNLIKELY(!len))
+        return -HTTP_INTERNAL_ERROR;
+
+    streams = lwan_request_get_streams(request);
+    if (UNLIKELY(!streams))
+        return -HTTP_UNAVAILABLE;
+    pending = &streams->body_stream.pending;
+
+    if (streams->body_stream.expect_continue) {
+        /* Only ask for the body when the handler is ready for it. */
+        streams->body_stream.expect_continue = false;
+        send_100_continue(request);
+    }
+
+    switch (streams->body_stream.state) {
+    case BODY_STREAM_NONE:
+        /* Handler doesn't stream the body, so it has been read already. */
+        streams->body_stream.pending = helper->body_data;
+        streams->body_stream.state = BODY_STREAM_BUFFERED;
+        /* fallthrough */
+    case BODY_STREAM_BUFFERED:
+        n = LWAN_MIN(len, pending->len);
+        if (n) {
+            memcpy(buf, pending->value, n);
+            pending->value += n;
+            pending->len -= n;
+        }
+        return (ssize_t)n;
+
+    case BODY_STREAM_DATA:
+        n = body_stream_read_data(request, buf, len);
+        if (!streams->body_stream.remaining)
+            finish_body_stream(request);
+        return (ssize_t)n;
+
+    case BODY_STREAM_CHUNK_SIZE:
+    case BODY_STREAM_CHUNK_END:
+    case BODY_STREAM_TRAILERS:
+        r = body_stream_read_chunk_header(request);
+        if (UNLIKELY(r < 0)) {
+            streams->body_stream.state = BODY_STREAM_FAILED;
+            return r;
+        }
+        if (streams->body_stream.state == BODY_STREAM_DONE)
+            return 0;
+        /* fallthrough */
+    case BODY_STREAM_CHUNK_DATA:
+        n = body_stream_read_data(request, buf, len);
+        if (!streams->body_stream.remaining)
+            streams->body_stream.state = BODY_STREAM_CHUNK_END;
+        return (ssize_t)n;
+
+    case BODY_STREAM_DONE:
+        return 0;
+
+    case BODY_STREAM_FAILED:
+        return -HTTP_BAD_REQUEST;
+    }
+
+    __builtin_unreachable();
 }
 
 static char *
@@ -1423,7 +2486,8 @@ static enum lwan_http_status parse_http_request(struct lwan_request *request)
     if (UNLIKELY(!parse_headers(helper, buffer)))
         return HTTP_BAD_REQUEST;
 
-    ssize_t decoded_len = url_decode(request->url.value);
+    ssize_t decoded_len = url_decode(
+        request->url.value, request->url.value + request->url.len, NULL);
     if (UNLIKELY(decoded_len < 0))
         return HTTP_BAD_REQUEST;
     request->original_url.len = request->url.len = (size_t)decoded_len;
@@ -1500,9 +2564,11 @@ prepare_websocket_handshake(struct lwan_request *request, char **encoded)
 }
 
 enum lwan_http_status
-lwan_request_websocket_upgrade(struct lwan_request *request)
+lwan_request_websocket_upgrade_full(struct lwan_request *request,
+                                    const struct lwan_websocket_options *options)
 {
     char header_buf[DEFAULT_HEADERS_SIZE];
+    char extensions[128];
     size_t header_buf_len;
     char *encoded;
 
@@ -1510,6 +2576,11 @@ lwan_request_websocket_upgrade(struct lwan_request *request)
     if (r != HTTP_SWITCHING_PROTOCOLS)
         return r;
 
+    bool has_extensions =
+        options && options->permessage_deflate &&
+        lwan_websocket_negotiate_deflate(request, options, extensions,
+                                         sizeof(extensions));
+
     request->flags |= RESPONSE_NO_CONTENT_LENGTH;
     header_buf_len = lwan_prepare_response_header_full(
         request, HTTP_SWITCHING_PROTOCOLS, header_buf, sizeof(header_buf),
@@ -1517,6 +2588,8 @@ lwan_request_websocket_upgrade(struct lwan_request *request)
             /* Connection: Upgrade is implicit if conn->flags & CONN_IS_UPGRADE */
             {.key = "Sec-WebSocket-Accept", .value = encoded},
             {.key = "Upgrade", .value = "websocket"},
+            {.key = has_extensions ? "Sec-WebSocket-Extensions" : NULL,
+             .value = extensions},
             {},
         });
     free(encoded);
@@ -1529,6 +2602,12 @@ lwan_request_websocket_upgrade(struct lwan_request *request)
     return HTTP_SWITCHING_PROTOCOLS;
 }
 
+enum lwan_http_status
+lwan_request_websocket_upgrade(struct lwan_request *request)
+{
+    return lwan_request_websocket_upgrade_full(request, NULL);
+}
+
 static inline bool request_has_body(const struct lwan_request *request)
 {
     /* 3rd bit set in method: request method has body. See lwan.h,
@@ -1542,7 +2621,11 @@ maybe_read_body_data(const struct lwan_url_map *url_map,
 {
     int status = 0;
 
-    if (url_map->flags & HANDLER_EXPECTS_BODY_DATA) {
+    if (url_map->flags & HANDLER_STREAMS_BODY_DATA) {
+        status = prepare_body_stream(request);
+        if (status > 0)
+            return (enum lwan_http_status)status;
+    } else if (url_map->flags & HANDLER_EXPECTS_BODY_DATA) {
         status = read_body_data(request);
         if (status > 0)
             return (enum lwan_http_status)status;
@@ -1565,6 +2648,9 @@ maybe_read_body_data(const struct lwan_url_map *url_map,
 static enum lwan_http_status prepare_for_response(const struct lwan_url_map *url_map,
                                                   struct lwan_request *request)
 {
+    if (UNLIKELY(url_map->deadline))
+        lwan_request_set_deadline(request, url_map->deadline);
+
     request->url.value += url_map->prefix_len;
     request->url.len -= url_map->prefix_len;
     while (*request->url.value == '/' && request->url.len > 0) {
@@ -1577,8 +2663,15 @@ static enum lwan_http_status prepare_for_response(const struct lwan_url_map *url
             return HTTP_NOT_AUTHORIZED;
     }
 
-    if (UNLIKELY(request_has_body(request)))
-        return maybe_read_body_data(url_map, request);
+    if (UNLIKELY(request_has_body(request))) {
+        enum lwan_http_status status;
+
+        lwan_request_phase_begin(request);
+        status = maybe_read_body_data(url_map, request);
+        lwan_request_phase_end(request, REQUEST_PHASE_BODY);
+
+        return status;
+    }
 
     return HTTP_OK;
 }
@@ -1665,15 +2758,146 @@ static double elapsed_time_ms(const struct timespec then)
 }
 #endif
 
+static void release_url_map_trie(void *data)
+{
+    unsigned int *refs = data;
+
+    __atomic_fetch_sub(refs, 1, __ATOMIC_RELEASE);
+}
+
+/* The URL map trie is replaced when the configuration is reloaded (see
+ * reload_config_job() in lwan.c), so requests count themselves in their
+ * thread's slot for the current epoch before loading the trie, and keep
+ * that reference until they're done.  The reloading side publishes the
+ * new trie before flipping the epoch, so once it sees the counts for the
+ * previous epoch drop to zero, nobody can be using the old trie anymore. */
+static struct lwan_trie *acquire_url_map_trie(struct lwan *l,
+                                              struct lwan_request *request)
+{
+    const unsigned int epoch =
+        __atomic_load_n(&l->url_map_epoch, __ATOMIC_SEQ_CST);
+    unsigned int *refs = &request->conn->thread->url_map_refs[epoch & 1];
+
+    __atomic_fetch_add(refs, 1, __ATOMIC_SEQ_CST);
+    if (UNLIKELY(coro_defer(request->conn->coro, release_url_map_trie, refs) <
+                 0)) {
+        release_url_map_trie(refs);
+        return NULL;
+    }
+
+    return __atomic_load_n(&l->url_map_trie, __ATOMIC_SEQ_CST);
+}
+
+enum lwan_http_status lwan_request_pass_to(struct lwan_request *request,
+                                           char *url,
+                                           size_t len)
+{
+    struct lwan_request_parser_helper *helper = request->helper;
+    const struct lwan_url_map *url_map;
+    struct lwan_trie *url_map_trie;
+    enum lwan_http_status status;
+
+    url_map_trie = acquire_url_map_trie(request->conn->thread->lwan, request);
+    if (UNLIKELY(!url_map_trie))
+        return HTTP_INTERNAL_ERROR;
+
+    request->url.value = url;
+    request->url.len = len;
+
+    while (true) {
+        /* Shares the budget with rewrites, so that a module passing
+         * requests to itself doesn't recurse forever. */
+        if (UNLIKELY(++helper->urls_rewritten > 4))
+            return HTTP_INTERNAL_ERROR;
+
+        url_map = lwan_trie_lookup_prefix(url_map_trie, request->url.value);
+        if (UNLIKELY(!url_map))
+            return HTTP_NOT_FOUND;
+
+        status = prepare_for_response(url_map, request);
+        if (UNLIKELY(status != HTTP_OK))
+            return status;
+
+        status = url_map->handler(request, &request->response, url_map->data);
+        if (!(url_map->flags & HANDLER_CAN_REWRITE_URL) ||
+            !(request->flags & RESPONSE_URL_REWRITTEN))
+            return status;
+
+        request->flags &= ~RESPONSE_URL_REWRITTEN;
+        find_query_string(request, request->url.value + request->url.len);
+    }
+}
+
+static inline double ns_to_ms(uint64_t ns)
+{
+    return (double)ns / 1e6;
+}
+
+/* Time not accounted for by any phase (e.g. parsing the request, or
+ * looking up its handler) is logged as "other".  */
+static void log_slow_request(struct lwan_request *request,
+                             enum lwan_http_status status,
+                             uint64_t began,
+                             uint64_t threshold_ns)
+{
+    const struct lwan_request_phases *phases = request->helper->phases;
+    const uint64_t total = lwan_request_phase_clock() - began;
+    uint64_t accounted = 0;
+
+    /* Responses to pipelined requests might still be flushed, and await
+     * for that, once this function returns */
+    request->helper->phases = NULL;
+
+    if (LIKELY(total < threshold_ns))
+        return;
+
+    for (int i = 0; i < REQUEST_PHASE_AWAIT; i++)
+        accounted += phases->ns[i];
+
+    lwan_status_warning(
+        "Slow request %016" PRIx64 " \"%s %s\" %d took %.3fms: read %.3fms, "
+        "body %.3fms, rewrite %.3fms, handler %.3fms, send %.3fms, "
+        "other %.3fms; awaiting file descriptors %.3fms",
+        lwan_request_get_id(request), lwan_request_get_method_str(request),
+        request->original_url.value ? request->original_url.value : "",
+        status, ns_to_ms(total), ns_to_ms(phases->ns[REQUEST_PHASE_READ]),
+        ns_to_ms(phases->ns[REQUEST_PHASE_BODY]),
+        ns_to_ms(phases->ns[REQUEST_PHASE_REWRITE]),
+        ns_to_ms(phases->ns[REQUEST_PHASE_HANDLER]),
+        ns_to_ms(phases->ns[REQUEST_PHASE_SEND]),
+        ns_to_ms(total > accounted ? total - accounted : 0),
+        ns_to_ms(phases->ns[REQUEST_PHASE_AWAIT]));
+}
+
 void lwan_process_request(struct lwan *l, struct lwan_request *request)
 {
     enum lwan_http_status status;
-    struct lwan_url_map *url_map;
+    struct lwan_url_map *url_map = NULL;
+    struct lwan_trie *url_map_trie;
+    struct lwan_trace_span span;
+    struct lwan_url_map_usage usage;
+    struct lwan_request_phases phases;
+    struct timespec begin_time;
+    uint64_t phases_began = 0;
+
+    if (UNLIKELY(l->config.slow_request_threshold)) {
+        phases_began = lwan_request_phase_clock();
+        phases = (struct lwan_request_phases){.began = phases_began};
+        request->helper->phases = &phases;
+    }
 
 #ifndef NDEBUG
     struct timespec request_read_begin_time = current_precise_monotonic_timespec();
 #endif
     status = read_request(request);
+    lwan_request_phase_end(request, REQUEST_PHASE_READ);
+
+    if (UNLIKELY(request->conn->thread->access_log != NULL ||
+                 request->conn->thread->tracing != NULL ||
+                 lwan_latency_enabled))
+        clock_gettime(CLOCK_MONOTONIC, &begin_time);
+    if (UNLIKELY(lwan_latency_enabled))
+        lwan_latency_usage_snapshot(request->conn->coro, &usage);
 
 #ifndef NDEBUG
     double time_to_read_request = elapsed_time_ms(request_read_begin_time);
@@ -1689,16 +2913,40 @@ void lwan_process_request(struct lwan *l, struct lwan_request *request)
          * in the pipeline, this seems like the safer thing to do.  */
         request->conn->flags &= ~CONN_IS_KEEP_ALIVE;
         lwan_default_response(request, status);
+        request->helper->phases = NULL;
         /* Let process_request_coro() gracefully close the connection. */
         return;
     }
 
+    if (l->config.allow_http2 && !request->helper->h2_stream &&
+        UNLIKELY(lwan_h2_is_preface(request->helper->buffer->value,
+                                    request->helper->buffer->len))) {
+        /* HTTP/2 with prior knowledge (RFC9113 §3.3): the connection
+         * preface looks like a HTTP/1.x request, so it's been read by
+         * read_request() already.  */
+        lwan_h2_serve(request->conn, request->flags,
+                      request->helper->buffer->value,
+                      request->helper->buffer->len);
+        __builtin_unreachable();
+    }
+
     status = parse_http_request(request);
+    if (UNLIKELY(request->conn->thread->tracing != NULL))
+        lwan_tracing_begin(request, &begin_time, status);
     if (UNLIKELY(status != HTTP_OK))
         goto log_and_return;
 
+    LWAN_TRACE(request__parsed, request->fd,
+               lwan_request_get_method_str(request), request->url.value);
+
+    url_map_trie = acquire_url_map_trie(l, request);
+    if (UNLIKELY(!url_map_trie)) {
+        status = HTTP_INTERNAL_ERROR;
+        goto log_and_return;
+    }
+
 lookup_again:
-    url_map = lwan_trie_lookup_prefix(&l->url_map_trie, request->url.value);
+    url_map = lwan_trie_lookup_prefix(url_map_trie, request->url.value);
     if (UNLIKELY(!url_map)) {
         status = HTTP_NOT_FOUND;
         goto log_and_return;
@@ -1708,46 +2956,163 @@ lookup_again:
     if (UNLIKELY(status != HTTP_OK))
         goto log_and_return;
 
+    LWAN_TRACE(handler__start, request->fd, url_map->prefix);
+    if (UNLIKELY(request->helper->trace != NULL))
+        lwan_tracing_span_begin(request, &span);
+    lwan_request_phase_begin(request);
     status = url_map->handler(request, &request->response, url_map->data);
+    lwan_request_phase_end(request, REQUEST_PHASE_HANDLER);
+    if (UNLIKELY(request->helper->trace != NULL)) {
+        lwan_tracing_span_end(request, &span, LWAN_SPAN_HANDLER,
+                              url_map->prefix, status);
+    }
+    LWAN_TRACE(handler__end, request->fd, url_map->prefix, (int)status);
     if (UNLIKELY(url_map->flags & HANDLER_CAN_REWRITE_URL)) {
         if (request->flags & RESPONSE_URL_REWRITTEN) {
-            if (LIKELY(handle_rewrite(request)))
+            bool rewritten;
+
+            lwan_request_phase_begin(request);
+            rewritten = handle_rewrite(request);
+            lwan_request_phase_end(request, REQUEST_PHASE_REWRITE);
+
+            if (LIKELY(rewritten))
                 goto lookup_again;
+
+            if (UNLIKELY(request->helper->phases != NULL)) {
+                log_slow_request(request, HTTP_INTERNAL_ERROR, phases_began,
+                                 l->config.slow_request_threshold * 1000000ull);
+            }
             return;
         }
     }
 
 log_and_return:
-    lwan_response(request, status);
+    lwan_request_phase_begin(request);
+    if (UNLIKELY(request->helper->trace != NULL)) {
+        lwan_tracing_span_begin(request, &span);
+        lwan_response(request, status);
+        lwan_tracing_span_end(request, &span, LWAN_SPAN_SEND, NULL, 0);
+        lwan_tracing_end(request, status);
+    } else {
+        lwan_response(request, status);
+    }
+    lwan_request_phase_end(request, REQUEST_PHASE_SEND);
+
+    if (UNLIKELY(request->conn->thread->access_log != NULL))
+        lwan_access_log_request(request, status, url_map, &begin_time);
+
+    if (UNLIKELY(lwan_latency_enabled) && url_map) {
+        struct timespec now;
+
+        if (LIKELY(clock_gettime(CLOCK_MONOTONIC, &now) == 0)) {
+            lwan_latency_record(
+                request->conn->thread, url_map->latency_id,
+                (uint64_t)(now.tv_sec - begin_time.tv_sec) * 1000000ull +
+                    (uint64_t)((now.tv_nsec - begin_time.tv_nsec) / 1000),
+                request->conn->coro, &usage);
+        }
+    }
+
+    if (UNLIKELY(request->helper->phases != NULL)) {
+        log_slow_request(request, status, phases_began,
+                         l->config.slow_request_threshold * 1000000ull);
+    }
 
     log_request(request, status, time_to_read_request, elapsed_time_ms(request_begin_time));
 }
 
-static inline void *value_lookup(const struct lwan_key_value_array *array,
-                                 const char *key)
+/* Handlers usually look up one or two keys out of however many came with
+ * the request, so arrays are kept in the order they were parsed rather than
+ * sorted.  Small arrays are searched linearly; larger ones get an index
+ * (built on the first lookup, and allocated in the coroutine) mapping the
+ * hash of each key to its position in the array. */
+#define KEY_VALUE_LINEAR_SEARCH_MAX 16
+
+struct lwan_key_value_index {
+    uint32_t mask;
+    /* Position in the array plus one; 0 marks empty slots */
+    uint32_t slots[];
+};
+
+static uint32_t key_hash(const char *key)
 {
-    /* Based on https://orlp.net/blog/bitwise-binary-search/ */
-    const struct lwan_array *la = (const struct lwan_array *)array;
+    return fnv1a_32(key, strlen(key));
+}
 
-    if (LIKELY(la->elements)) {
-#if __SIZEOF_SIZE_T__ == 8
-        const size_t floor = 1ull << (64 - __builtin_clzll(la->elements));
-#else
-        const size_t floor = 1u << (32 - __builtin_clz(la->elements));
-#endif
-        struct lwan_value *base = (struct lwan_value *)la->base;
-        struct lwan_key_value k = {.key = (char *)key};
-        int64_t b = key_value_compare(&k, &base[la->elements / 2]) > 0
-                        ? (int64_t)(la->elements - floor)
-                        : -1;
-
-        for (uint64_t bit = floor >> 1; bit != 0; bit >>= 1) {
-            if (key_value_compare(&k, &base[b + (int64_t)bit]) > 0)
-                b += (int64_t)bit;
+static struct lwan_key_value_index *
+build_key_value_index(struct lwan_request *request,
+                      const struct lwan_key_value *base,
+                      size_t n_elements)
+{
+    /* Kept at most half full, so probe sequences stay short */
+    const size_t n_slots = lwan_nextpow2(n_elements * 2);
+    struct lwan_key_value_index *index;
+
+    if (UNLIKELY(n_elements >= UINT32_MAX / 2))
+        return NULL;
+
+    index = coro_malloc(request->conn->coro,
+                        sizeof(*index) + n_slots * sizeof(index->slots[0]));
+    if (UNLIKELY(!index))
+        return NULL;
+
+    index->mask = (uint32_t)(n_slots - 1);
+    memset(index->slots, 0, n_slots * sizeof(index->slots[0]));
+
+    for (size_t i = 0; i < n_elements; i++) {
+        uint32_t slot = key_hash(base[i].key) & index->mask;
+
+        while (index->slots[slot]) {
+            /* Only the first occurrence of a key is ever found */
+            if (streq(base[index->slots[slot] - 1].key, base[i].key))
+                goto next_element;
+            slot = (slot + 1) & index->mask;
         }
+        index->slots[slot] = (uint32_t)(i + 1);
+
+    next_element:;
+    }
+
+    return index;
+}
+
+static const char *value_lookup_linear(const struct lwan_key_value *base,
+                                       size_t n_elements,
+                                       const char *key)
+{
+    for (size_t i = 0; i < n_elements; i++) {
+        if (base[i].key[0] == key[0] && streq(base[i].key, key))
+            return base[i].value;
+    }
+
+    return NULL;
+}
+
+static const char *value_lookup(struct lwan_request *request,
+                                const struct lwan_key_value_array *array,
+                                struct lwan_key_value_index **index_ptr,
+                                const char *key)
+{
+    const struct lwan_array *la = (const struct lwan_array *)array;
+    const struct lwan_key_value *base = la->base;
+    struct lwan_key_value_index *index = *index_ptr;
 
-        if (!key_value_compare(&k, &base[b + 1]))
-            return base[b + 1].value;
+    if (la->elements <= KEY_VALUE_LINEAR_SEARCH_MAX)
+        return value_lookup_linear(base, la->elements, key);
+
+    if (!index) {
+        index = build_key_value_index(request, base, la->elements);
+        if (UNLIKELY(!index))
+            return value_lookup_linear(base, la->elements, key);
+        *index_ptr = index;
+    }
+
+    for (uint32_t slot = key_hash(key) & index->mask; index->slots[slot];
+         slot = (slot + 1) & index->mask) {
+        const struct lwan_key_value *kv = &base[index->slots[slot] - 1];
+
+        if (streq(kv->key, key))
+            return kv->value;
     }
 
     return NULL;
@@ -1756,43 +3121,112 @@ static inline void *value_lookup(const struct lwan_key_value_array *array,
 const char *lwan_request_get_query_param(struct lwan_request *request,
                                          const char *key)
 {
-    return value_lookup(lwan_request_get_query_params(request), key);
+    return value_lookup(request, lwan_request_get_query_params(request),
+                        &request->helper->query_params_index, key);
 }
 
 const char *lwan_request_get_post_param(struct lwan_request *request,
                                         const char *key)
 {
-    return value_lookup(lwan_request_get_post_params(request), key);
+    return value_lookup(request, lwan_request_get_post_params(request),
+                        &request->helper->post_params_index, key);
 }
 
 const char *lwan_request_get_cookie(struct lwan_request *request,
                                     const char *key)
 {
-    return value_lookup(lwan_request_get_cookies(request), key);
+    return value_lookup(request, lwan_request_get_cookies(request),
+                        &request->helper->cookies_index, key);
+}
+
+/* lwan_request_get_header() looks headers up in a small open addressing
+ * hash table, keyed by their names, that is only built on the first
+ * lookup: requests that only need the headers picked up by parse_headers()
+ * don't pay for it.  Each entry has the index of a header in
+ * header_start plus one (zero marks an empty slot) in its lower byte, and
+ * bits from the hash of its name in the upper byte, so that most
+ * collisions are told apart without comparing the names. */
+static_assert(N_HEADER_START <= 255, "header indices fit in a byte");
+static_assert((N_HEADER_INDEX & (N_HEADER_INDEX - 1)) == 0,
+              "header index size is a power of 2");
+static_assert(N_HEADER_INDEX > N_HEADER_START,
+              "header index always has an empty slot");
+
+/* FNV-1a; case is folded so that names that only differ in case, as far
+ * as strcaseequal_neutral_len() is concerned, hash the same. */
+#define HEADER_NAME_HASH_INIT 2166136261u
+
+static ALWAYS_INLINE uint32_t header_name_hash_step(uint32_t hash, char c)
+{
+    return (hash ^ ((unsigned char)c | 0x20)) * 16777619u;
+}
+
+static void build_header_index(struct lwan_request_parser_helper *helper)
+{
+    uint16_t *index = helper->header_index;
+
+    memset(index, 0, N_HEADER_INDEX * sizeof(*index));
+
+    for (size_t i = 0; i < helper->n_header_start; i++) {
+        const char *p = helper->header_start[i];
+        const char *end = helper->header_start[i + 1] - HEADER_TERMINATOR_LEN;
+        uint32_t hash = HEADER_NAME_HASH_INIT;
+
+        for (; p < end && *p != ':'; p++)
+            hash = header_name_hash_step(hash, *p);
+
+        if (UNLIKELY((size_t)(end - p) < HEADER_VALUE_SEPARATOR_LEN ||
+                     p[1] != ' '))
+            continue;
+
+        size_t slot = hash & (N_HEADER_INDEX - 1);
+
+        /* Headers are inserted in order, so if a header is repeated, the
+         * first one is found first.  */
+        while (index[slot])
+            slot = (slot + 1) & (N_HEADER_INDEX - 1);
+        index[slot] = (uint16_t)((hash >> 24) << 8 | (i + 1));
+    }
+
+    helper->header_index_built = true;
 }
 
 const char *lwan_request_get_header(struct lwan_request *request,
                                     const char *header)
 {
-    const struct lwan_request_parser_helper *helper = request->helper;
+    struct lwan_request_parser_helper *helper = request->helper;
     const size_t header_len = strlen(header);
     const size_t header_len_with_separator =
         header_len + HEADER_VALUE_SEPARATOR_LEN;
+    const uint16_t *index = helper->header_index;
 
     assert(strchr(header, ':') == NULL);
 
-    for (size_t i = 0; i < helper->n_header_start; i++) {
+    if (!helper->header_index_built)
+        build_header_index(helper);
+
+    uint32_t hash = HEADER_NAME_HASH_INIT;
+    for (size_t i = 0; i < header_len; i++)
+        hash = header_name_hash_step(hash, header[i]);
+
+    const uint16_t tag = (uint16_t)((hash >> 24) << 8);
+
+    for (size_t slot = hash & (N_HEADER_INDEX - 1); index[slot];
+         slot = (slot + 1) & (N_HEADER_INDEX - 1)) {
+        if ((index[slot] & 0xff00) != tag)
+            continue;
+
+        const size_t i = (index[slot] & 0xff) - 1u;
         const char *start = helper->header_start[i];
         char *end = helper->header_start[i + 1] - HEADER_TERMINATOR_LEN;
 
         if (UNLIKELY((size_t)(end - start) < header_len_with_separator))
             continue;
-        STRING_SWITCH_SMALL (start + header_len) {
-        case STR2_INT(':', ' '):
-            if (strcaseequal_neutral_len(start, header, header_len)) {
-                *end = '\0';
-                return start + header_len_with_separator;
-            }
+        if (start[header_len] != ':')
+            continue;
+        if (strcaseequal_neutral_len(start, header, header_len)) {
+            *end = '\0';
+            return start + header_len_with_separator;
         }
     }
 
@@ -1837,6 +3271,14 @@ lwan_request_get_remote_address_and_port(const struct lwan_request *request,
         }
     }
 
+    if (sock_addr->ss_family == AF_UNIX) {
+        static const char unix_socket[] = "*unix*";
+
+        static_assert(sizeof(unix_socket) <= INET6_ADDRSTRLEN,
+                      "Enough space for Unix socket placeholder");
+        return memcpy(buffer, unix_socket, sizeof(unix_socket));
+    }
+
     if (sock_addr->ss_family == AF_INET) {
         struct sockaddr_in *sin = (struct sockaddr_in *)sock_addr;
         *port = ntohs(sin->sin_port);
@@ -1848,6 +3290,34 @@ lwan_request_get_remote_address_and_port(const struct lwan_request *request,
     return inet_ntop(AF_INET6, &sin6->sin6_addr, buffer, INET6_ADDRSTRLEN);
 }
 
+bool lwan_request_get_peer_credentials(const struct lwan_request *request,
+                                       pid_t *pid,
+                                       uid_t *uid,
+                                       gid_t *gid)
+{
+    struct sockaddr_storage addr;
+    socklen_t addr_len = sizeof(addr);
+    struct ucred cred;
+    socklen_t cred_len = sizeof(cred);
+
+    if (getsockname(request->fd, (struct sockaddr *)&addr, &addr_len) < 0 ||
+        addr.ss_family != AF_UNIX)
+        return false;
+
+    if (getsockopt(request->fd, SOL_SOCKET, SO_PEERCRED, &cred, &cred_len) <
+        0)
+        return false;
+
+    if (pid)
+        *pid = cred.pid;
+    if (uid)
+        *uid = cred.uid;
+    if (gid)
+        *gid = cred.gid;
+
+    return true;
+}
+
 const char *
 lwan_request_get_remote_address(const struct lwan_request *request,
                                 char buffer[static INET6_ADDRSTRLEN])
@@ -1886,6 +3356,11 @@ void lwan_request_sleep(struct lwan_request *request, uint64_t ms)
         lwan_status_critical("Could not get monotonic time");
     timeouts_update(wheel, (timeout_t)(now.tv_sec * 1000 + now.tv_nsec / 1000000));
 
+    lwan_response_flush_chunks(request);
+
+    /* Wakes up early if the deadline comes first, only to be cancelled */
+    ms = lwan_request_clamp_to_deadline(request, ms);
+
     request->timeout = (struct timeout) {};
     timeouts_add(wheel, &request->timeout, ms);
 
@@ -1898,6 +3373,8 @@ void lwan_request_sleep(struct lwan_request *request, uint64_t ms)
 
     if (defer > 0)
         coro_defer_fire_and_disarm(conn->coro, defer);
+
+    lwan_request_check_deadline(request);
 }
 
 ALWAYS_INLINE int
@@ -1919,6 +3396,36 @@ lwan_request_get_range(struct lwan_request *request, off_t *from, off_t *to)
     return -ENOENT;
 }
 
+ssize_t lwan_request_get_ranges(struct lwan_request *request,
+                                struct lwan_range ranges[],
+                                size_t max_ranges)
+{
+    char *range = range_value(request->helper);
+    size_t n_ranges = 0;
+
+    if (!range)
+        return -ENOENT;
+
+    while (true) {
+        char *end;
+
+        if (UNLIKELY(n_ranges == max_ranges))
+            return -E2BIG;
+        if (!parse_range_spec(range, &end, &ranges[n_ranges].from,
+                              &ranges[n_ranges].to))
+            return -EINVAL;
+        n_ranges++;
+
+        if (*end == '\0')
+            return (ssize_t)n_ranges;
+        if (*end != ',')
+            return -EINVAL;
+
+        for (range = end + 1; *range == ' ' || *range == '\t'; range++)
+            ;
+    }
+}
+
 ALWAYS_INLINE int
 lwan_request_get_if_modified_since(struct lwan_request *request, time_t *value)
 {
@@ -1943,6 +3450,79 @@ lwan_request_get_request_body(struct lwan_request *request)
     return &request->helper->body_data;
 }
 
+int lwan_request_get_body_fd(struct lwan_request *request)
+{
+    const struct file_backed_buffer *buf = request->helper->body_file;
+
+    return buf ? buf->fd : -ENOENT;
+}
+
+static int copy_body_file(int fd, size_t len, int dirfd, const char *path)
+{
+#if defined(LWAN_HAVE_COPY_FILE_RANGE)
+    int out_fd = openat(dirfd, path, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC,
+                        S_IRUSR | S_IWUSR);
+    loff_t offset = 0;
+
+    if (out_fd < 0)
+        return -errno;
+
+    while (len) {
+        ssize_t r = copy_file_range(fd, &offset, out_fd, NULL, len, 0);
+
+        if (UNLIKELY(r <= 0)) {
+            int error = r < 0 ? errno : EIO;
+
+            close(out_fd);
+            unlinkat(dirfd, path, 0);
+            return -error;
+        }
+
+        len -= (size_t)r;
+    }
+
+    return close(out_fd) < 0 ? -errno : 0;
+#else
+    return -EXDEV;
+#endif
+}
+
+int lwan_request_link_body(struct lwan_request *request,
+                           int dirfd,
+                           const char *path)
+{
+    const struct file_backed_buffer *buf = request->helper->body_file;
+    const size_t len = request->helper->body_data.len;
+    char proc_path[sizeof("/proc/self/fd/") + 3 * sizeof(int)];
+
+    if (!buf)
+        return -ENOENT;
+
+    /* Drop the NUL byte after the body. */
+    if (UNLIKELY(ftruncate(buf->fd, (off_t)len) < 0))
+        return -errno;
+
+    /* Linking a file opened with O_TMPFILE by its descriptor requires
+     * CAP_DAC_READ_SEARCH; without it, try through /proc, which might not
+     * be available in a chroot. */
+    if (!linkat(buf->fd, "", dirfd, path, AT_EMPTY_PATH))
+        return 0;
+    if (errno == EEXIST)
+        return -EEXIST;
+
+    snprintf(proc_path, sizeof(proc_path), "/proc/self/fd/%d", buf->fd);
+    if (!linkat(AT_FDCWD, proc_path, dirfd, path, AT_SYMLINK_FOLLOW))
+        return 0;
+    if (errno == EEXIST)
+        return -EEXIST;
+
+    /* The file isn't linkable (e.g. O_TMPFILE isn't supported and it was
+     * unlinked right after being created) or the destination is in another
+     * filesystem: copy it instead, letting the filesystem share blocks if
+     * it can. */
+    return copy_body_file(buf->fd, len, dirfd, path);
+}
+
 ALWAYS_INLINE const struct lwan_value *
 lwan_request_get_content_type(struct lwan_request *request)
 {
@@ -1993,6 +3573,23 @@ lwan_request_get_accept_encoding(struct lwan_request *request)
     return request->flags & REQUEST_ACCEPT_MASK;
 }
 
+enum lwan_http_status lwan_request_parse_buffer(char *buffer, size_t len)
+{
+    char *header_start[N_HEADER_START];
+    uint16_t header_index[N_HEADER_INDEX];
+    struct lwan_request_parser_helper helper = {
+        .buffer = &(struct lwan_value){.value = buffer, .len = len},
+        .header_start = header_start,
+        .header_index = header_index,
+        .error_when_n_packets = 2,
+    };
+    static struct lwan_thread thread;
+    struct lwan_connection conn = {.thread = &thread};
+    struct lwan_request request = {.helper = &helper, .conn = &conn};
+
+    return parse_http_request(&request);
+}
+
 #ifdef FUZZING_BUILD_MODE_UNSAFE_FOR_PRODUCTION
 static int useless_coro_for_fuzzing(struct coro *c __attribute__((unused)),
                                     void *data __attribute__((unused)))
@@ -2012,6 +3609,7 @@ __attribute__((used)) int fuzz_parse_http_request(const uint8_t *data,
     static struct coro_switcher switcher;
     static struct coro *coro;
     static char *header_start[N_HEADER_START];
+    static uint16_t header_index[N_HEADER_INDEX];
     static char data_copy[32767] = {0};
 
     if (length > sizeof(data_copy))
@@ -2028,6 +3626,7 @@ __attribute__((used)) int fuzz_parse_http_request(const uint8_t *data,
     struct lwan_request_parser_helper helper = {
         .buffer = &(struct lwan_value){.value = data_copy, .len = length},
         .header_start = header_start,
+        .header_index = header_index,
         .error_when_n_packets = 2,
     };
     struct lwan_connection conn = {.coro = coro};
@@ -2144,3 +3743,37 @@ void lwan_request_foreach_header_for_cgi(struct lwan_request *request,
            (size_t)value_len, user_data);
     }
 }
+
+void lwan_request_foreach_header(struct lwan_request *request,
+                                 void (*cb)(const char *header_name,
+                                            size_t header_len,
+                                            const char *value,
+                                            size_t value_len,
+                                            void *user_data),
+                                 void *user_data)
+{
+    struct lwan_request_parser_helper *helper = request->helper;
+    char **header_start = helper->header_start;
+    size_t n_header_start = helper->n_header_start;
+
+    /* Same as above, but with the header names as sent by the client.
+     * Values might have been NUL-terminated by the parser, so use the
+     * lengths rather than relying on the CRLF being there.  */
+    for (size_t i = 0; i < n_header_start; i++) {
+        const char *header = header_start[i];
+        const char *next_header = header_start[i + 1];
+        const char *colon = memchr(header, ':', (size_t)(next_header - header));
+
+        if (!colon)
+            continue;
+
+        const ptrdiff_t header_len = colon - header;
+        const ptrdiff_t value_len = next_header - colon - 4;
+
+        if (header_len <= 0 || value_len < 0)
+            continue;
+
+        cb(header, (size_t)header_len, colon + 2, (size_t)value_len,
+           user_data);
+    }
+}
@@ -0,0 +1,832 @@
+/*
+ * lwan - web server
+ * Copyright (c) 2024 L. A. F. Pereira <l@tia.mat.br>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#define _GNU_SOURCE
+#include <arpa/inet.h>
+#include <ctype.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "lwan-private.h"
+
+#include "hash.h"
+#include "lwan-cache.h"
+#include "lwan-resolver.h"
+
+#define MAX_NAME_SERVERS 3
+#define MAX_ADDRS_PER_NAME 8
+
+/* Answers with a larger TTL are refreshed after this many seconds anyway,
+ * which is also how long the cache itself keeps entries around. */
+#define MAX_TTL 3600
+/* How long names that don't exist (or that have no address of the
+ * requested family) are remembered; failures to get an answer at all are
+ * only remembered for a little while, so that a burst of requests doesn't
+ * wait for the same unresponsive servers over and over. */
+#define NEGATIVE_TTL 30
+#define FAILURE_TTL 2
+
+/* Same defaults as the resolver in the C library; both can be changed
+ * with "options timeout:n attempts:n" in /etc/resolv.conf. */
+#define DEFAULT_TIMEOUT_MS 5000
+#define DEFAULT_ATTEMPTS 2
+
+/* Without EDNS, answers larger than this are truncated by the server */
+#define DNS_PACKET_SIZE 512
+#define DNS_HEADER_SIZE 12
+
+#define DNS_FLAG_QR 0x8000
+#define DNS_FLAG_RD 0x0100
+#define DNS_RCODE_MASK 0x000f
+#define DNS_RCODE_NXDOMAIN 3
+
+#define DNS_TYPE_A 1
+#define DNS_TYPE_CNAME 5
+#define DNS_TYPE_AAAA 28
+#define DNS_CLASS_IN 1
+
+struct resolved_addr {
+    int family;
+    union {
+        struct in_addr in;
+        struct in6_addr in6;
+    };
+};
+
+struct resolved_name {
+    size_t n_addrs;
+    struct resolved_addr addrs[MAX_ADDRS_PER_NAME];
+};
+
+struct resolver_entry {
+    struct cache_entry base;
+    struct resolved_name name;
+    time_t expires;
+    int error;
+    unsigned int next;
+};
+
+struct name_server {
+    struct sockaddr_storage addr;
+    socklen_t addr_len;
+};
+
+struct query {
+    uint16_t qtype;
+    uint16_t id;
+    /* One socket for each of AF_INET and AF_INET6 name servers; created
+     * when first needed, and reconnected to each server that's tried. */
+    int fds[2];
+    bool sent;
+    bool answered;
+    int error;
+};
+
+enum {
+    RESPONSE_IGNORED = 1,
+};
+
+static struct {
+    struct name_server servers[MAX_NAME_SERVERS];
+    size_t n_servers;
+    unsigned int timeout_ms;
+    unsigned int attempts;
+} resolv_conf;
+
+static struct hash *hosts;
+static struct cache *resolver_cache;
+
+static void parse_resolv_conf_options(char *options)
+{
+    char *saveptr;
+
+    for (char *option = strtok_r(options, " \t", &saveptr); option;
+         option = strtok_r(NULL, " \t", &saveptr)) {
+        if (!strncmp(option, "timeout:", sizeof("timeout:") - 1)) {
+            int secs = parse_int(option + sizeof("timeout:") - 1, -1);
+            if (secs > 0 && secs <= 30)
+                resolv_conf.timeout_ms = (unsigned int)secs * 1000;
+        } else if (!strncmp(option, "attempts:", sizeof("attempts:") - 1)) {
+            int attempts = parse_int(option + sizeof("attempts:") - 1, -1);
+            if (attempts > 0 && attempts <= 5)
+                resolv_conf.attempts = (unsigned int)attempts;
+        }
+    }
+}
+
+static bool add_name_server(const char *address)
+{
+    struct name_server *server = &resolv_conf.servers[resolv_conf.n_servers];
+    struct sockaddr_in *sin = (struct sockaddr_in *)&server->addr;
+    struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *)&server->addr;
+
+    if (resolv_conf.n_servers == MAX_NAME_SERVERS)
+        return false;
+
+    memset(server, 0, sizeof(*server));
+    if (inet_pton(AF_INET, address, &sin->sin_addr) == 1) {
+        sin->sin_family = AF_INET;
+        sin->sin_port = htons(53);
+        server->addr_len = sizeof(*sin);
+    } else if (inet_pton(AF_INET6, address, &sin6->sin6_addr) == 1) {
+        sin6->sin6_family = AF_INET6;
+        sin6->sin6_port = htons(53);
+        server->addr_len = sizeof(*sin6);
+    } else {
+        /* Includes link-local addresses with a scope, which aren't
+         * supported. */
+        lwan_status_warning("Ignoring name server %s", address);
+        return false;
+    }
+
+    resolv_conf.n_servers++;
+    return true;
+}
+
+static char *strip_comment(char *line)
+{
+    line[strcspn(line, "#;\n")] = '\0';
+    return line;
+}
+
+static void parse_resolv_conf(void)
+{
+    char line[512];
+    FILE *f;
+
+    resolv_conf.timeout_ms = DEFAULT_TIMEOUT_MS;
+    resolv_conf.attempts = DEFAULT_ATTEMPTS;
+
+    f = fopen("/etc/resolv.conf", "re");
+    if (f) {
+        while (fgets(line, sizeof(line), f)) {
+            char *saveptr;
+            char *keyword = strtok_r(strip_comment(line), " \t", &saveptr);
+
+            if (!keyword)
+                continue;
+
+            if (streq(keyword, "nameserver")) {
+                char *address = strtok_r(NULL, " \t", &saveptr);
+                if (address)
+                    add_name_server(address);
+            } else if (streq(keyword, "options")) {
+                parse_resolv_conf_options(saveptr);
+            }
+        }
+
+        fclose(f);
+    }
+
+    if (!resolv_conf.n_servers)
+        add_name_server("127.0.0.1");
+}
+
+static void lowercase_name(char *name)
+{
+    for (; *name; name++)
+        *name = (char)tolower((unsigned char)*name);
+}
+
+static void add_host(const char *address, char *name)
+{
+    struct resolved_addr addr;
+
+    if (inet_pton(AF_INET, address, &addr.in) == 1)
+        addr.family = AF_INET;
+    else if (inet_pton(AF_INET6, address, &addr.in6) == 1)
+        addr.family = AF_INET6;
+    else
+        return;
+
+    lowercase_name(name);
+
+    struct resolved_name *resolved = hash_find(hosts, name);
+    if (!resolved) {
+        char *key = strdup(name);
+        if (!key)
+            return;
+
+        resolved = calloc(1, sizeof(*resolved));
+        if (!resolved) {
+            free(key);
+            return;
+        }
+
+        if (hash_add_unique(hosts, key, resolved) < 0) {
+            free(key);
+            free(resolved);
+            return;
+        }
+    }
+
+    if (resolved->n_addrs < MAX_ADDRS_PER_NAME)
+        resolved->addrs[resolved->n_addrs++] = addr;
+}
+
+static void parse_hosts(void)
+{
+    char line[1024];
+    FILE *f;
+
+    hosts = hash_str_new(free, free);
+    if (!hosts)
+        lwan_status_critical("Could not allocate hosts table");
+
+    f = fopen("/etc/hosts", "re");
+    if (!f)
+        return;
+
+    while (fgets(line, sizeof(line), f)) {
+        char *saveptr;
+        char *address = strtok_r(strip_comment(line), " \t", &saveptr);
+
+        if (!address)
+            continue;
+
+        for (char *name = strtok_r(NULL, " \t", &saveptr); name;
+             name = strtok_r(NULL, " \t", &saveptr)) {
+            add_host(address, name);
+        }
+    }
+
+    fclose(f);
+}
+
+static ALWAYS_INLINE uint16_t read_u16(const uint8_t *p)
+{
+    return (uint16_t)(p[0] << 8 | p[1]);
+}
+
+static ALWAYS_INLINE uint32_t read_u32(const uint8_t *p)
+{
+    return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 |
+           (uint32_t)p[3];
+}
+
+static ALWAYS_INLINE void write_u16(uint8_t *p, uint16_t v)
+{
+    p[0] = (uint8_t)(v >> 8);
+    p[1] = (uint8_t)v;
+}
+
+static ssize_t build_query(uint8_t buffer[static DNS_PACKET_SIZE],
+                           const struct query *query,
+                           const char *name)
+{
+    uint8_t *p = buffer + DNS_HEADER_SIZE;
+
+    memset(buffer, 0, DNS_HEADER_SIZE);
+    write_u16(buffer, query->id);
+    write_u16(buffer + 2, DNS_FLAG_RD);
+    write_u16(buffer + 4, 1);
+
+    while (*name) {
+        const char *dot = strchr(name, '.');
+        size_t label_len = dot ? (size_t)(dot - name) : strlen(name);
+
+        if (!label_len || label_len > 63)
+            return -EINVAL;
+
+        *p++ = (uint8_t)label_len;
+        memcpy(p, name, label_len);
+        p += label_len;
+
+        name += label_len;
+        if (*name == '.')
+            name++;
+    }
+    *p++ = 0;
+
+    write_u16(p, query->qtype);
+    write_u16(p + 2, DNS_CLASS_IN);
+    p += 4;
+
+    return p - buffer;
+}
+
+static bool skip_name(const uint8_t *packet, size_t len, size_t *offset)
+{
+    size_t off = *offset;
+
+    while (off < len) {
+        const uint8_t label_len = packet[off];
+
+        if ((label_len & 0xc0) == 0xc0) {
+            /* Compression pointers end the name */
+            if (off + 2 > len)
+                return false;
+            *offset = off + 2;
+            return true;
+        }
+        if (label_len & 0xc0)
+            return false;
+
+        off++;
+        if (!label_len) {
+            *offset = off;
+            return true;
+        }
+        off += label_len;
+    }
+
+    return false;
+}
+
+static void add_resolved_addr(struct resolved_name *resolved,
+                              int family,
+                              const uint8_t *rdata)
+{
+    struct resolved_addr *addr;
+
+    if (resolved->n_addrs == MAX_ADDRS_PER_NAME)
+        return;
+
+    addr = &resolved->addrs[resolved->n_addrs++];
+    addr->family = family;
+    if (family == AF_INET)
+        memcpy(&addr->in, rdata, sizeof(addr->in));
+    else
+        memcpy(&addr->in6, rdata, sizeof(addr->in6));
+}
+
+/* Returns 0 if the answer has been parsed (even if it has no addresses),
+ * -ENOENT if the name doesn't exist, -EIO if the server couldn't answer and
+ * the next one should be tried, or RESPONSE_IGNORED if the packet isn't an
+ * answer to this query. */
+static int parse_response(const uint8_t *packet,
+                          size_t len,
+                          const struct query *query,
+                          struct resolved_name *resolved,
+                          uint32_t *ttl)
+{
+    size_t off = DNS_HEADER_SIZE;
+
+    if (len < DNS_HEADER_SIZE || read_u16(packet) != query->id)
+        return RESPONSE_IGNORED;
+
+    const uint16_t flags = read_u16(packet + 2);
+    if (!(flags & DNS_FLAG_QR) || read_u16(packet + 4) != 1)
+        return RESPONSE_IGNORED;
+
+    if (!skip_name(packet, len, &off) || off + 4 > len ||
+        read_u16(packet + off) != query->qtype) {
+        return RESPONSE_IGNORED;
+    }
+    off += 4;
+
+    switch (flags & DNS_RCODE_MASK) {
+    case 0:
+        break;
+    case DNS_RCODE_NXDOMAIN:
+        return -ENOENT;
+    default:
+        return -EIO;
+    }
+
+    /* If the answer has been truncated (TC bit set), whatever records made
+     * it are used rather than retrying with TCP: a handful of addresses is
+     * all that's needed to connect somewhere. */
+    for (uint16_t answers = read_u16(packet + 6); answers; answers--) {
+        if (!skip_name(packet, len, &off) || off + 10 > len)
+            break;
+
+        const uint16_t type = read_u16(packet + off);
+        const uint16_t class = read_u16(packet + off + 2);
+        const uint32_t record_ttl = read_u32(packet + off + 4);
+        const uint16_t rdlength = read_u16(packet + off + 8);
+
+        off += 10;
+        if (off + rdlength > len)
+            break;
+
+        if (class == DNS_CLASS_IN) {
+            if (type == DNS_TYPE_A && query->qtype == DNS_TYPE_A &&
+                rdlength == sizeof(struct in_addr)) {
+                add_resolved_addr(resolved, AF_INET, packet + off);
+                *ttl = LWAN_MIN(*ttl, record_ttl);
+            } else if (type == DNS_TYPE_AAAA && query->qtype == DNS_TYPE_AAAA &&
+                       rdlength == sizeof(struct in6_addr)) {
+                add_resolved_addr(resolved, AF_INET6, packet + off);
+                *ttl = LWAN_MIN(*ttl, record_ttl);
+            } else if (type == DNS_TYPE_CNAME) {
+                /* The addresses are only valid for as long as the alias */
+                *ttl = LWAN_MIN(*ttl, record_ttl);
+            }
+        }
+
+        off += rdlength;
+    }
+
+    return 0;
+}
+
+static void close_query_fd(void *data)
+{
+    close((int)(intptr_t)data);
+}
+
+static int send_query(struct lwan_request *request,
+                      struct query *query,
+                      const struct name_server *server,
+                      const char *name)
+{
+    const size_t fd_index = server->addr.ss_family == AF_INET6;
+    uint8_t packet[DNS_PACKET_SIZE];
+    ssize_t len;
+
+    if (query->fds[fd_index] < 0) {
+        int fd = socket(server->addr.ss_family,
+                        SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (fd < 0)
+            return -errno;
+
+        /* Awaited file descriptors can only be closed after the coroutine
+         * stops awaiting them, which happens when it finishes: defer this
+         * now, so it runs after that. */
+        coro_defer(request->conn->coro, close_query_fd, (void *)(intptr_t)fd);
+        query->fds[fd_index] = fd;
+    }
+
+    /* Connecting the socket makes the kernel drop datagrams not coming
+     * from the server being asked, including late answers from the ones
+     * that have been tried before. */
+    if (connect(query->fds[fd_index], (const struct sockaddr *)&server->addr,
+                server->addr_len) < 0)
+        return -errno;
+
+    query->id = (uint16_t)lwan_random_uint64();
+    len = build_query(packet, query, name);
+    if (len < 0)
+        return (int)len;
+
+    if (send(query->fds[fd_index], packet, (size_t)len, MSG_NOSIGNAL) < 0)
+        return -errno;
+
+    return 0;
+}
+
+static void drain_query_fds(const struct query *query)
+{
+    uint8_t packet[DNS_PACKET_SIZE];
+
+    /* Nothing should be left, but duplicated answers would otherwise keep
+     * waking up this coroutine until the request is done. */
+    for (size_t i = 0; i < N_ELEMENTS(query->fds); i++) {
+        if (query->fds[i] >= 0) {
+            while (recv(query->fds[i], packet, sizeof(packet), MSG_DONTWAIT) >= 0)
+                ;
+        }
+    }
+}
+
+static int await_answers(struct lwan_request *request,
+                         struct query queries[],
+                         size_t n_queries,
+                         const struct name_server *server,
+                         struct resolved_name *resolved,
+                         uint32_t *ttl)
+{
+    const size_t fd_index = server->addr.ss_family == AF_INET6;
+    struct lwan_await_fd fds[2];
+    struct query *awaiting[2];
+    uint8_t packet[DNS_PACKET_SIZE];
+
+    while (true) {
+        size_t n_fds = 0;
+
+        for (size_t i = 0; i < n_queries; i++) {
+            if (queries[i].sent && !queries[i].answered) {
+                fds[n_fds] = (struct lwan_await_fd){
+                    .fd = queries[i].fds[fd_index],
+                    .events = CONN_CORO_WANT_READ,
+                };
+                awaiting[n_fds] = &queries[i];
+                n_fds++;
+            }
+        }
+        if (!n_fds)
+            return 0;
+
+        int ready = lwan_request_await_any_of(request, fds, n_fds,
+                                              resolv_conf.timeout_ms);
+        if (ready < 0)
+            return ready;
+
+        struct query *query = awaiting[ready];
+        ssize_t len = recv(fds[ready].fd, packet, sizeof(packet), MSG_DONTWAIT);
+        if (len < 0) {
+            if (errno == EAGAIN || errno == EINTR)
+                continue;
+
+            /* Usually ECONNREFUSED: nothing is listening there */
+            query->sent = false;
+            continue;
+        }
+
+        int ret = parse_response(packet, (size_t)len, query, resolved, ttl);
+        if (ret == RESPONSE_IGNORED)
+            continue;
+
+        if (ret == -EIO) {
+            query->sent = false;
+        } else {
+            query->answered = true;
+            query->error = ret;
+        }
+    }
+}
+
+static int query_name_servers(struct lwan_request *request,
+                              const char *name,
+                              int family,
+                              struct resolved_name *resolved,
+                              uint32_t *ttl)
+{
+    struct query queries[2];
+    size_t n_queries = 0;
+    int error = -ETIMEDOUT;
+
+    if (family != AF_INET6) {
+        queries[n_queries++] =
+            (struct query){.qtype = DNS_TYPE_A, .fds = {-1, -1}};
+    }
+    if (family != AF_INET) {
+        queries[n_queries++] =
+            (struct query){.qtype = DNS_TYPE_AAAA, .fds = {-1, -1}};
+    }
+
+    *ttl = MAX_TTL;
+    resolved->n_addrs = 0;
+
+    for (unsigned int attempt = 0; attempt < resolv_conf.attempts; attempt++) {
+        for (size_t s = 0; s < resolv_conf.n_servers; s++) {
+            const struct name_server *server = &resolv_conf.servers[s];
+            bool pending = false;
+
+            for (size_t i = 0; i < n_queries; i++) {
+                if (queries[i].answered)
+                    continue;
+
+                int ret = send_query(request, &queries[i], server, name);
+                if (ret == -EINVAL)
+                    return ret;
+
+                queries[i].sent = ret == 0;
+                if (ret < 0)
+                    error = ret;
+                pending |= queries[i].sent;
+            }
+            if (!pending)
+                continue;
+
+            int ret =
+                await_answers(request, queries, n_queries, server, resolved, ttl);
+            if (ret < 0)
+                error = ret;
+
+            bool all_answered = true;
+            for (size_t i = 0; i < n_queries; i++) {
+                drain_query_fds(&queries[i]);
+                all_answered &= queries[i].answered;
+            }
+            if (all_answered)
+                goto answered;
+        }
+    }
+
+    /* Use the addresses that came through, if any (e.g. the name server
+     * answered for A but the AAAA query timed out). */
+    if (resolved->n_addrs)
+        return 0;
+    *ttl = FAILURE_TTL;
+    return error;
+
+answered:
+    if (resolved->n_addrs)
+        return 0;
+
+    *ttl = NEGATIVE_TTL;
+    for (size_t i = 0; i < n_queries; i++) {
+        if (queries[i].error != -ENOENT)
+            return -ENODATA;
+    }
+    return -ENOENT;
+}
+
+static struct cache_entry *
+create_entry(const void *key, void *context, void *create_ctx)
+{
+    struct lwan_request *request = create_ctx;
+    const char *name = (const char *)key + 1;
+    struct resolver_entry *entry;
+    struct timespec now;
+    uint32_t ttl;
+    int family;
+
+    switch (*(const char *)key) {
+    case '4':
+        family = AF_INET;
+        break;
+    case '6':
+        family = AF_INET6;
+        break;
+    default:
+        family = AF_UNSPEC;
+    }
+
+    entry = malloc(sizeof(*entry));
+    if (!entry)
+        return NULL;
+
+    entry->error = query_name_servers(request, name, family, &entry->name, &ttl);
+    entry->next = 0;
+
+    if (UNLIKELY(clock_gettime(monotonic_clock_id, &now) < 0))
+        lwan_status_critical("Could not get monotonic time");
+    entry->expires = now.tv_sec + LWAN_MAX(ttl, 1u);
+
+    return &entry->base;
+}
+
+static void destroy_entry(struct cache_entry *entry, void *context)
+{
+    free(entry);
+}
+
+static bool name_has_family(const struct resolved_name *resolved,
+                            size_t index,
+                            int family)
+{
+    return family == AF_UNSPEC || resolved->addrs[index].family == family;
+}
+
+static int fill_addr(const struct resolved_name *resolved,
+                     unsigned int rotation,
+                     uint16_t port,
+                     int family,
+                     struct sockaddr_storage *addr,
+                     socklen_t *addr_len)
+{
+    size_t n_matching = 0;
+
+    for (size_t i = 0; i < resolved->n_addrs; i++)
+        n_matching += name_has_family(resolved, i, family);
+    if (!n_matching)
+        return -ENODATA;
+
+    rotation %= (unsigned int)n_matching;
+    for (size_t i = 0; i < resolved->n_addrs; i++) {
+        if (!name_has_family(resolved, i, family))
+            continue;
+        if (rotation--)
+            continue;
+
+        const struct resolved_addr *picked = &resolved->addrs[i];
+        memset(addr, 0, sizeof(*addr));
+        if (picked->family == AF_INET) {
+            struct sockaddr_in *sin = (struct sockaddr_in *)addr;
+
+            sin->sin_family = AF_INET;
+            sin->sin_port = htons(port);
+            sin->sin_addr = picked->in;
+            *addr_len = sizeof(*sin);
+        } else {
+            struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *)addr;
+
+            sin6->sin6_family = AF_INET6;
+            sin6->sin6_port = htons(port);
+            sin6->sin6_addr = picked->in6;
+            *addr_len = sizeof(*sin6);
+        }
+        return 0;
+    }
+
+    __builtin_unreachable();
+}
+
+static bool resolve_numeric(const char *name,
+                            int family,
+                            struct resolved_name *resolved)
+{
+    struct resolved_addr *addr = &resolved->addrs[0];
+
+    if (family != AF_INET6 && inet_pton(AF_INET, name, &addr->in) == 1) {
+        addr->family = AF_INET;
+    } else if (family != AF_INET && inet_pton(AF_INET6, name, &addr->in6) == 1) {
+        addr->family = AF_INET6;
+    } else {
+        return false;
+    }
+
+    resolved->n_addrs = 1;
+    return true;
+}
+
+int lwan_request_resolve(struct lwan_request *request,
+                         const char *name,
+                         uint16_t port,
+                         int family,
+                         struct sockaddr_storage *addr,
+                         socklen_t *addr_len)
+{
+    struct resolved_name numeric;
+    char key[256 + 1];
+    size_t name_len;
+
+    if (family != AF_UNSPEC && family != AF_INET && family != AF_INET6)
+        return -EAFNOSUPPORT;
+
+    if (resolve_numeric(name, family, &numeric))
+        return fill_addr(&numeric, 0, port, family, addr, addr_len);
+
+    name_len = strlen(name);
+    if (name_len && name[name_len - 1] == '.')
+        name_len--;
+    if (!name_len || name_len > 253)
+        return -EINVAL;
+
+    key[0] = family == AF_INET ? '4' : family == AF_INET6 ? '6' : '0';
+    memcpy(key + 1, name, name_len);
+    key[name_len + 1] = '\0';
+    lowercase_name(key + 1);
+
+    const struct resolved_name *host = hash_find(hosts, key + 1);
+    if (host) {
+        int ret = fill_addr(host, 0, port, family, addr, addr_len);
+        if (ret != -ENODATA)
+            return ret;
+    }
+
+    struct resolver_entry *entry;
+    for (int tries = 0; tries < 2; tries++) {
+        struct timespec now;
+
+        entry = (struct resolver_entry *)cache_request_get_and_ref_entry_with_ctx(
+            resolver_cache, request, key, request);
+        if (UNLIKELY(!entry))
+            return -ENOMEM;
+
+        if (UNLIKELY(clock_gettime(monotonic_clock_id, &now) < 0))
+            lwan_status_critical("Could not get monotonic time");
+        if (LIKELY(now.tv_sec < entry->expires))
+            break;
+
+        /* The answer is older than its TTL (the reference to this entry is
+         * dropped when the request is done with it) */
+        cache_invalidate(resolver_cache, key);
+    }
+
+    if (entry->error)
+        return entry->error;
+
+    return fill_addr(&entry->name,
+                     __atomic_fetch_add(&entry->next, 1, __ATOMIC_RELAXED),
+                     port, family, addr, addr_len);
+}
+
+void lwan_resolver_init(void)
+{
+    lwan_status_debug("Initializing resolver");
+
+    parse_resolv_conf();
+    parse_hosts();
+
+    resolver_cache = cache_create_full(create_entry, destroy_entry,
+                                       hash_str_new, NULL, MAX_TTL);
+    if (!resolver_cache)
+        lwan_status_critical("Could not create resolver cache");
+    cache_set_name(resolver_cache, "resolver");
+}
+
+void lwan_resolver_shutdown(void)
+{
+    lwan_status_debug("Shutting down resolver");
+
+    cache_destroy(resolver_cache);
+    resolver_cache = NULL;
+
+    hash_unref(hosts);
+    hosts = NULL;
+}
@@ -0,0 +1,52 @@
+/*
+ * lwan - web server
+ * Copyright (c) 2024 L. A. F. Pereira <l@tia.mat.br>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#pragma once
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+#include <sys/socket.h>
+
+#include "lwan.h"
+
+/* Resolves host names from request handlers without blocking the I/O
+ * thread: queries are sent over UDP to the name servers listed in
+ * /etc/resolv.conf, and the coroutine of the request awaits the answers
+ * alongside every other connection handled by that thread.  /etc/hosts is
+ * consulted first, and answers are cached for as long as their TTL says
+ * (failures are cached for a short while as well).  Numeric addresses are
+ * parsed without any lookup. */
+
+/* @family is AF_INET, AF_INET6, or AF_UNSPEC for either; if a name has
+ * more than one address, subsequent calls rotate through them.  Returns 0,
+ * or -ENOENT if the name doesn't exist, -ENODATA if it has no address of
+ * the requested family, -ETIMEDOUT if no name server answered, or another
+ * negative errno value. */
+int lwan_request_resolve(struct lwan_request *request,
+                         const char *name,
+                         uint16_t port,
+                         int family,
+                         struct sockaddr_storage *addr,
+                         socklen_t *addr_len);
+
+#if defined(__cplusplus)
+}
+#endif
@@ -29,6 +29,7 @@
 #include "lwan-private.h"
 
 #include "int-to-str.h"
+#include "lwan-cache.h"
 #include "lwan-io-wrappers.h"
 #include "lwan-template.h"
 
@@ -41,6 +42,48 @@ struct error_template {
     const char *long_message;
 };
 
+/* The error template doesn't change once Lwan is running, and the default
+ * response only depends on the status, so the page for each known status
+ * is rendered only once, when Lwan starts. */
+static struct lwan_value default_responses[HTTP_CLASS__SERVER_ERROR + 100];
+
+static void render_default_response(enum lwan_http_status status)
+{
+    struct lwan_strbuf buffer;
+
+    if (UNLIKELY(!lwan_strbuf_init(&buffer)))
+        return;
+
+    if (LIKELY(lwan_tpl_apply_with_buffer(
+            error_template, &buffer,
+            &(struct error_template){
+                .short_message = lwan_http_status_as_string(status),
+                .long_message = lwan_http_status_as_descriptive_string(status),
+            }))) {
+        const size_t len = lwan_strbuf_get_length(&buffer);
+        char *value = malloc(len);
+
+        if (LIKELY(value)) {
+            default_responses[status] = (struct lwan_value){
+                .value = memcpy(value, lwan_strbuf_get_buffer(&buffer), len),
+                .len = len,
+            };
+        }
+    }
+
+    lwan_strbuf_free(&buffer);
+}
+
+static const struct lwan_value *
+get_default_response(enum lwan_http_status status)
+{
+    if (LIKELY((size_t)status < N_ELEMENTS(default_responses) &&
+               default_responses[status].value))
+        return &default_responses[status];
+
+    return NULL;
+}
+
 void lwan_response_init(struct lwan *l)
 {
 #undef TPL_STRUCT
@@ -63,13 +106,25 @@ void lwan_response_init(struct lwan *l)
 
     if (UNLIKELY(!error_template))
         lwan_status_critical_perror("lwan_tpl_compile_string");
+
+#define RENDER_DEFAULT_RESPONSE(id, code, short, long)                         \
+    render_default_response(HTTP_##id);
+    FOR_EACH_HTTP_STATUS(RENDER_DEFAULT_RESPONSE)
+#undef RENDER_DEFAULT_RESPONSE
 }
 
 void lwan_response_shutdown(struct lwan *l __attribute__((unused)))
 {
     lwan_status_debug("Shutting down response");
+
+    for (size_t i = 0; i < N_ELEMENTS(default_responses); i++) {
+        free(default_responses[i].value);
+        default_responses[i] = (struct lwan_value){};
+    }
+
     assert(error_template);
     lwan_tpl_free(error_template);
+    error_template = NULL;
 }
 
 static inline bool has_response_body(enum lwan_request_flags method,
@@ -79,6 +134,133 @@ static inline bool has_response_body(enum lwan_request_flags method,
     return (method & 1 << 0) || status != HTTP_NOT_MODIFIED;
 }
 
+/* Responses to pipelined requests are queued, rather than sent right
+ * away, while the next request is already in the buffer; the queue is
+ * sent in the same system call as the response that follows it (see
+ * lwan_writev_fd()), once it has grown past this size, or once the
+ * pipeline drains. */
+#define MAX_QUEUED_RESPONSES_SIZE 16384
+
+static bool has_pipelined_request(const struct lwan_request *request)
+{
+    const struct lwan_request_parser_helper *helper = request->helper;
+    const char *next = helper->next_request;
+    const char *end = helper->buffer->value + helper->buffer->len;
+
+    if (!next || next >= end)
+        return false;
+
+    return memmem(next, (size_t)(end - next), "\r\n\r\n", 4) != NULL;
+}
+
+static bool queue_response(struct lwan_request *request,
+                           const char *headers,
+                           size_t header_len,
+                           const char *body,
+                           size_t body_len)
+{
+    struct lwan_strbuf *queued = request->helper->queued_responses;
+
+    if (!(request->conn->flags & CONN_CORK) || !queued)
+        return false;
+    if (lwan_strbuf_get_length(queued) + header_len + body_len >
+        MAX_QUEUED_RESPONSES_SIZE)
+        return false;
+
+    /* Grow first, so that a partial response is never queued. */
+    if (UNLIKELY(!lwan_strbuf_grow_by(queued, header_len + body_len)))
+        return false;
+
+    lwan_strbuf_append_str(queued, headers, header_len);
+    lwan_strbuf_append_str(queued, body, body_len);
+    request->helper->bytes_sent += header_len + body_len;
+    return true;
+}
+
+static void free_chain(void *data)
+{
+    lwan_chain_free(data);
+}
+
+struct lwan_chain *lwan_response_get_chain(struct lwan_request *request)
+{
+    struct lwan_response *response = &request->response;
+
+    if (!response->chain) {
+        struct lwan_chain *chain =
+            coro_malloc(request->conn->coro, sizeof(*chain));
+
+        if (UNLIKELY(!chain))
+            return NULL;
+
+        lwan_chain_init(chain, response->buffer);
+        if (UNLIKELY(coro_defer(request->conn->coro, free_chain, chain) < 0))
+            return NULL;
+
+        response->chain = chain;
+    }
+
+    return response->chain;
+}
+
+static void unref_cache_entry(void *data1, void *data2)
+{
+    cache_entry_unref((struct cache *)data1, (struct cache_entry *)data2);
+}
+
+bool lwan_response_chain_append_cache_entry(struct lwan_request *request,
+                                            struct cache *cache,
+                                            struct cache_entry *entry,
+                                            const void *data,
+                                            size_t len)
+{
+    struct lwan_chain *chain = lwan_response_get_chain(request);
+
+    /* The reference to the entry is dropped once the request has been
+     * handled, after the response has been written. */
+    if (UNLIKELY(coro_defer2(request->conn->coro, unref_cache_entry, cache,
+                             entry) < 0)) {
+        cache_entry_unref(cache, entry);
+        return false;
+    }
+
+    return chain && lwan_chain_append_borrowed(chain, data, len);
+}
+
+static ALWAYS_INLINE size_t
+response_body_length(const struct lwan_response *response)
+{
+    if (response->chain)
+        return lwan_chain_get_length(response->chain);
+    return lwan_strbuf_get_length(response->buffer);
+}
+
+static void send_chain(struct lwan_request *request,
+                       char *headers,
+                       size_t header_len)
+{
+    const struct lwan_chain *chain = request->response.chain;
+    struct iovec vec[32];
+    size_t cursor = 0;
+    int n_vec;
+
+    vec[0] = (struct iovec){.iov_base = headers, .iov_len = header_len};
+    n_vec = 1 + lwan_chain_fill_iovec(chain, &cursor, vec + 1,
+                                      (int)N_ELEMENTS(vec) - 1);
+
+    /* Long chains take more than one writev(), and each would otherwise
+     * push whatever it wrote out on its own */
+    if (n_vec == (int)N_ELEMENTS(vec))
+        lwan_cork(request);
+
+    while (n_vec) {
+        lwan_writev(request, vec, n_vec);
+        n_vec = lwan_chain_fill_iovec(chain, &cursor, vec, (int)N_ELEMENTS(vec));
+    }
+
+    lwan_uncork(request);
+}
+
 void lwan_response(struct lwan_request *request, enum lwan_http_status status)
 {
     const struct lwan_response *response = &request->response;
@@ -102,6 +284,14 @@ void lwan_response(struct lwan_request *request, enum lwan_http_status status)
         return lwan_default_response(request, status);
     }
 
+    /* Only use MSG_MORE (and queue responses) if something is going to be
+     * sent right after this response. */
+    if (has_pipelined_request(request) &&
+        (request->conn->flags & CONN_IS_KEEP_ALIVE))
+        request->conn->flags |= CONN_CORK;
+    else
+        request->conn->flags &= ~CONN_CORK;
+
     if (request->flags & RESPONSE_STREAM) {
         if (LIKELY(response->stream.callback)) {
             status = response->stream.callback(request, response->stream.data);
@@ -117,16 +307,28 @@ void lwan_response(struct lwan_request *request, enum lwan_http_status status)
         return;
     }
 
+    if ((request->flags & RESPONSE_COMPRESS) && status != HTTP_NO_CONTENT &&
+        status != HTTP_PARTIAL_CONTENT && status != HTTP_NOT_MODIFIED)
+        lwan_response_compress(request);
+
     size_t header_len =
         lwan_prepare_response_header(request, status, headers, sizeof(headers));
     if (UNLIKELY(!header_len))
         return lwan_default_response(request, HTTP_INTERNAL_ERROR);
 
-    if (!has_response_body(lwan_request_get_method(request), status))
+    if (!has_response_body(lwan_request_get_method(request), status)) {
+        if (queue_response(request, headers, header_len, "", 0))
+            return;
         return (void)lwan_send(request, headers, header_len, 0);
+    }
+
+    if (response->chain)
+        return send_chain(request, headers, header_len);
 
     char *resp_buf = lwan_strbuf_get_buffer(response->buffer);
     const size_t resp_len = lwan_strbuf_get_length(response->buffer);
+    if (queue_response(request, headers, header_len, resp_buf, resp_len))
+        return;
     if (sizeof(headers) - header_len > resp_len) {
         /* writev() has to allocate, copy, and validate the response vector,
          * so use send() for responses small enough to fit the headers
@@ -146,6 +348,13 @@ void lwan_response(struct lwan_request *request, enum lwan_http_status status)
 void lwan_fill_default_response(struct lwan_strbuf *buffer,
                                 enum lwan_http_status status)
 {
+    const struct lwan_value *rendered = get_default_response(status);
+
+    if (LIKELY(rendered)) {
+        lwan_strbuf_set(buffer, rendered->value, rendered->len);
+        return;
+    }
+
     lwan_tpl_apply_with_buffer(
         error_template, buffer,
         &(struct error_template){
@@ -158,8 +367,19 @@ void lwan_default_response(struct lwan_request *request,
                            enum lwan_http_status status)
 {
     request->response.mime_type = "text/html";
+    /* Whatever was in the chain isn't part of the error page */
+    request->response.chain = NULL;
+
+    const struct lwan_value *rendered = get_default_response(status);
+    if (LIKELY(rendered)) {
+        /* Sent along with headers from a template, so there's nothing left
+         * to render */
+        lwan_strbuf_set_static(request->response.buffer, rendered->value,
+                               rendered->len);
+    } else {
+        lwan_fill_default_response(request->response.buffer, status);
+    }
 
-    lwan_fill_default_response(request->response.buffer, status);
     lwan_response(request, status);
 }
 
@@ -189,10 +409,9 @@ void lwan_default_response(struct lwan_request *request,
 
 #define APPEND_UINT(value_)                                                    \
     do {                                                                       \
-        size_t len;                                                            \
-        char *tmp = uint_to_string((value_), buffer, &len);                    \
-        RETURN_0_ON_OVERFLOW(len);                                             \
-        APPEND_STRING_LEN(tmp, len);                                           \
+        const size_t value = (value_);                                         \
+        RETURN_0_ON_OVERFLOW(uint_string_length(value));                       \
+        p_headers = uint_to_string_append(value, p_headers);                   \
     } while (0)
 
 #define APPEND_CONSTANT(const_str_)                                            \
@@ -212,6 +431,158 @@ has_uncommon_response_headers(enum lwan_request_flags v)
                 RESPONSE_CHUNKED_ENCODING | REQUEST_WANTS_HSTS_HEADER);
 }
 
+/* Responses without additional headers are mostly the same for a given
+ * status, mime type and connection state: their headers are rendered once
+ * per thread, and only the Date, Expires and Content-Length values are
+ * patched in afterwards. */
+#define HEADER_TEMPLATE_SIZE 256
+#define N_HEADER_TEMPLATES 32
+
+enum header_template_key {
+    TEMPLATE_VALID = 1 << 16,
+    TEMPLATE_HTTP_1_0 = 1 << 17,
+    TEMPLATE_CONNECTION_KEEP_ALIVE = 1 << 18,
+    TEMPLATE_CONNECTION_CLOSE = 1 << 19,
+    TEMPLATE_CONTENT_TYPE = 1 << 20,
+    TEMPLATE_EXPIRES = 1 << 21,
+    TEMPLATE_CONTENT_LENGTH = 1 << 22,
+};
+
+struct header_template {
+    uint32_t key;
+    uint16_t len;
+    uint16_t mime_type_len;
+    uint8_t date_offset;
+    uint8_t mime_type_offset;
+    uint8_t expires_offset;
+    char headers[HEADER_TEMPLATE_SIZE];
+};
+
+static __thread struct header_template header_templates[N_HEADER_TEMPLATES];
+
+static bool render_header_template(struct header_template *tpl,
+                                   uint32_t key,
+                                   enum lwan_http_status status,
+                                   const char *mime_type,
+                                   size_t mime_type_len)
+{
+    static const char placeholder_date[] = "Thu, 01 Jan 1970 00:00:00 GMT";
+    char *p_headers = tpl->headers;
+    char *p_headers_end = tpl->headers + sizeof(tpl->headers);
+
+    tpl->key = 0;
+
+    if (key & TEMPLATE_HTTP_1_0)
+        APPEND_CONSTANT("HTTP/1.0 ");
+    else
+        APPEND_CONSTANT("HTTP/1.1 ");
+    APPEND_STRING(lwan_http_status_as_string_with_code(status));
+
+    APPEND_CONSTANT("\r\nDate: ");
+    tpl->date_offset = (uint8_t)(p_headers - tpl->headers);
+    APPEND_CONSTANT(placeholder_date);
+
+    if (key & TEMPLATE_CONNECTION_KEEP_ALIVE)
+        APPEND_CONSTANT("\r\nConnection: keep-alive");
+    else if (key & TEMPLATE_CONNECTION_CLOSE)
+        APPEND_CONSTANT("\r\nConnection: close");
+
+    if (key & TEMPLATE_CONTENT_TYPE) {
+        APPEND_CONSTANT("\r\nContent-Type: ");
+        tpl->mime_type_offset = (uint8_t)(p_headers - tpl->headers);
+        APPEND_STRING_LEN(mime_type, mime_type_len);
+    }
+
+    if (key & TEMPLATE_EXPIRES) {
+        APPEND_CONSTANT("\r\nExpires: ");
+        tpl->expires_offset = (uint8_t)(p_headers - tpl->headers);
+        APPEND_CONSTANT(placeholder_date);
+    }
+
+    if (key & TEMPLATE_CONTENT_LENGTH)
+        APPEND_CONSTANT("\r\nContent-Length: ");
+
+    tpl->len = (uint16_t)(p_headers - tpl->headers);
+    tpl->mime_type_len = (uint16_t)mime_type_len;
+    tpl->key = key;
+
+    return true;
+}
+
+static const struct header_template *
+get_header_template(struct lwan_request *request, enum lwan_http_status status)
+{
+    const enum lwan_request_flags request_flags = request->flags;
+    const enum lwan_connection_flags conn_flags = request->conn->flags;
+    const char *mime_type = request->response.mime_type;
+    size_t mime_type_len = 0;
+    uint32_t key = TEMPLATE_VALID | (uint32_t)status;
+
+    if (request_flags & REQUEST_IS_HTTP_1_0)
+        key |= TEMPLATE_HTTP_1_0;
+    if (!(conn_flags & CONN_SENT_CONNECTION_HEADER)) {
+        key |= (conn_flags & CONN_IS_KEEP_ALIVE) ? TEMPLATE_CONNECTION_KEEP_ALIVE
+                                                 : TEMPLATE_CONNECTION_CLOSE;
+    }
+    if (LIKELY(mime_type)) {
+        key |= TEMPLATE_CONTENT_TYPE;
+        mime_type_len = strlen(mime_type);
+    }
+    if (!(request_flags & (RESPONSE_NO_EXPIRES | REQUEST_HAS_QUERY_STRING)))
+        key |= TEMPLATE_EXPIRES;
+    if (flags_has_content_length(request_flags))
+        key |= TEMPLATE_CONTENT_LENGTH;
+
+    /* Mime types are usually string literals or entries in the mime type
+     * table, so their address is good enough to pick a slot; the template
+     * is still checked against its contents, as the same address could be
+     * reused for a different string. */
+    uintptr_t hash = (uintptr_t)mime_type;
+    hash = (hash >> 4) ^ (hash >> 12) ^ key ^ (key >> 16);
+    struct header_template *tpl =
+        &header_templates[hash & (N_HEADER_TEMPLATES - 1)];
+
+    if (LIKELY(tpl->key == key && tpl->mime_type_len == mime_type_len &&
+               (!mime_type_len ||
+                !memcmp(tpl->headers + tpl->mime_type_offset, mime_type,
+                        mime_type_len))))
+        return tpl;
+
+    return render_header_template(tpl, key, status, mime_type, mime_type_len)
+               ? tpl
+               : NULL;
+}
+
+static size_t
+prepare_response_header_from_template(struct lwan_request *request,
+                                      enum lwan_http_status status,
+                                      char headers[],
+                                      size_t headers_buf_size)
+{
+    const struct header_template *tpl = get_header_template(request, status);
+    const struct lwan_value *global_headers = request->global_response_headers;
+    const struct lwan_thread *thread = request->conn->thread;
+    char *p_headers = headers;
+    char *p_headers_end = headers + headers_buf_size;
+
+    if (UNLIKELY(!tpl))
+        return 0;
+
+    APPEND_STRING_LEN(tpl->headers, tpl->len);
+    memcpy(headers + tpl->date_offset, thread->date.date, 29);
+    if (tpl->key & TEMPLATE_EXPIRES)
+        memcpy(headers + tpl->expires_offset, thread->date.expires, 29);
+    if (tpl->key & TEMPLATE_CONTENT_LENGTH)
+        APPEND_UINT(response_body_length(&request->response));
+    APPEND_STRING_LEN(global_headers->value, global_headers->len);
+
+    if (tpl->key &
+        (TEMPLATE_CONNECTION_KEEP_ALIVE | TEMPLATE_CONNECTION_CLOSE))
+        request->conn->flags |= CONN_SENT_CONNECTION_HEADER;
+
+    return (size_t)(p_headers - headers);
+}
+
 size_t lwan_prepare_response_header_full(
     struct lwan_request *request,
     enum lwan_http_status status,
@@ -224,13 +595,21 @@ size_t lwan_prepare_response_header_full(
 
     char *p_headers;
     char *p_headers_end = headers + headers_buf_size;
-    char buffer[INT_TO_STR_BUFFER_SIZE];
     const enum lwan_request_flags request_flags = request->flags;
     const enum lwan_connection_flags conn_flags = request->conn->flags;
     bool expires_override = !!(request->flags & (RESPONSE_NO_EXPIRES | REQUEST_HAS_QUERY_STRING));
 
     assert(request->global_response_headers);
 
+    if (LIKELY((!additional_headers || !additional_headers->key) &&
+               !has_uncommon_response_headers(request_flags) &&
+               !(conn_flags & CONN_IS_UPGRADE))) {
+        size_t len = prepare_response_header_from_template(
+            request, status, headers, headers_buf_size);
+        if (LIKELY(len))
+            return len;
+    }
+
     p_headers = headers;
 
     if (UNLIKELY(request_flags & REQUEST_IS_HTTP_1_0))
@@ -242,7 +621,8 @@ size_t lwan_prepare_response_header_full(
     if (LIKELY(!additional_headers))
         goto skip_additional_headers;
 
-    if (LIKELY((status < HTTP_CLASS__CLIENT_ERROR))) {
+    if (LIKELY((status < HTTP_CLASS__CLIENT_ERROR)) ||
+        UNLIKELY(request_flags & RESPONSE_UPSTREAM_HEADERS)) {
         const struct lwan_key_value *header;
         bool date_override = false;
 
@@ -283,6 +663,17 @@ size_t lwan_prepare_response_header_full(
                 break;
             }
         }
+    } else if (UNLIKELY(status == HTTP_TOO_MANY_REQUESTS ||
+                        status == HTTP_UNAVAILABLE)) {
+        const struct lwan_key_value *header;
+
+        for (header = additional_headers; header->key; header++) {
+            if (streq(header->key, "Retry-After")) {
+                APPEND_CONSTANT("\r\nRetry-After: ");
+                APPEND_STRING(header->value);
+                break;
+            }
+        }
     }
 
 skip_additional_headers:
@@ -315,7 +706,7 @@ skip_date_header:
     const bool has_content_length = flags_has_content_length(request_flags);
     if (LIKELY(has_content_length)) {
         APPEND_CONSTANT("\r\nContent-Length: ");
-        APPEND_UINT(lwan_strbuf_get_length(request->response.buffer));
+        APPEND_UINT(response_body_length(&request->response));
     }
     if (UNLIKELY(has_uncommon_response_headers(request_flags))) {
         if (request_flags & REQUEST_ALLOW_CORS) {
@@ -365,6 +756,42 @@ ALWAYS_INLINE size_t lwan_prepare_response_header(struct lwan_request *request,
         request, status, headers, headers_buf_size, request->response.headers);
 }
 
+bool lwan_response_send_early_hints(struct lwan_request *request,
+                                    const struct lwan_key_value *headers)
+{
+    static const char status_line[] = "HTTP/1.1 103 Early Hints\r\n";
+    char buffer[DEFAULT_HEADERS_SIZE];
+    char *p = mempcpy(buffer, status_line, sizeof(status_line) - 1);
+    const char *end = buffer + sizeof(buffer);
+
+    /* Informational responses don't exist in HTTP/1.0, and the HTTP/2
+     * implementation only sends final responses. */
+    if (request->flags & (RESPONSE_SENT_HEADERS | REQUEST_IS_HTTP_1_0))
+        return false;
+    if (request->helper->h2_stream)
+        return false;
+
+    for (const struct lwan_key_value *kv = headers; kv && kv->key; kv++) {
+        const size_t key_len = strlen(kv->key);
+        const size_t value_len = strlen(kv->value);
+
+        /* ": ", "\r\n", and the final "\r\n" */
+        if (UNLIKELY(key_len + value_len + 6 > (size_t)(end - p)))
+            return false;
+
+        p = mempcpy(p, kv->key, key_len);
+        p = mempcpy(p, ": ", 2);
+        p = mempcpy(p, kv->value, value_len);
+        p = mempcpy(p, "\r\n", 2);
+    }
+    p = mempcpy(p, "\r\n", 2);
+
+    /* Not corked: the point is for the client to get these while the
+     * final response is still being prepared. */
+    lwan_send(request, buffer, (size_t)(p - buffer), 0);
+    return true;
+}
+
 bool lwan_response_set_chunked_full(struct lwan_request *request,
                                     enum lwan_http_status status,
                                     const struct lwan_key_value *additional_headers)
@@ -376,6 +803,9 @@ bool lwan_response_set_chunked_full(struct lwan_request *request,
         return false;
 
     request->flags |= RESPONSE_CHUNKED_ENCODING;
+    if (request->flags & RESPONSE_COMPRESS)
+        additional_headers =
+            lwan_response_compress_stream(request, additional_headers);
     buffer_len = lwan_prepare_response_header_full(request, status, buffer,
                                                    DEFAULT_BUFFER_SIZE,
                                                    additional_headers);
@@ -395,6 +825,179 @@ inline bool lwan_response_set_chunked(struct lwan_request *request,
                                           request->response.headers);
 }
 
+/* Handlers that emit lots of small chunks (e.g. rows of a CSV file, or
+ * whatever a FastCGI backend happens to write) would otherwise cost a
+ * system call per chunk; chunks up to MAX_COALESCED_CHUNK_SIZE bytes are
+ * framed into this buffer instead.  It's sent once it fills up, once its
+ * oldest chunk has been waiting for CHUNK_BUFFER_MAX_LATENCY_MS (see
+ * struct lwan_chunk_timer), with the next chunk that's too large to be
+ * coalesced, with the last chunk, or before the handler waits for anything
+ * else (see lwan_response_flush_chunks()). */
+#define CHUNK_BUFFER_SIZE 16384
+#define MAX_COALESCED_CHUNK_SIZE (CHUNK_BUFFER_SIZE / 4)
+#define CHUNK_BUFFER_MAX_LATENCY_MS 10
+
+struct lwan_chunk_buffer {
+    struct lwan_chunk_timer timer;
+    size_t len;
+    char data[CHUNK_BUFFER_SIZE];
+};
+
+static timeout_t now_ms(void)
+{
+    struct timespec now;
+
+    if (UNLIKELY(clock_gettime(monotonic_clock_id, &now) < 0))
+        lwan_status_critical("Could not get monotonic time");
+
+    return (timeout_t)(now.tv_sec * 1000 + now.tv_nsec / 1000000);
+}
+
+static void arm_chunk_timer(struct lwan_request *request,
+                            struct lwan_chunk_buffer *cb)
+{
+    struct timeouts *wheel = request->conn->thread->wheel;
+
+    /* See lwan_request_sleep() for why the wheel is updated here. */
+    timeouts_update(wheel, now_ms());
+
+    cb->timer.timeout = (struct timeout){.flags = TIMEOUT_FLUSH_CHUNKS};
+    timeouts_add(wheel, &cb->timer.timeout, CHUNK_BUFFER_MAX_LATENCY_MS);
+}
+
+static void disarm_chunk_timer(void *data)
+{
+    struct lwan_chunk_buffer *cb = data;
+
+    /* No-op if it's not pending */
+    timeouts_del(cb->timer.request->conn->thread->wheel, &cb->timer.timeout);
+}
+
+bool lwan_response_chunks_are_due(const struct lwan_request *request)
+{
+    const struct lwan_chunk_buffer *cb = request->helper->chunk_buffer;
+
+    if (!cb->len)
+        return false;
+
+    /* Expired timeouts are only taken off the wheel by the thread, once
+     * this coroutine yields */
+    return !cb->timer.timeout.pending || now_ms() >= cb->timer.timeout.expires;
+}
+
+bool lwan_response_flush_chunk_buffer(struct lwan_request *request)
+{
+    struct lwan_chunk_buffer *cb = request->helper->chunk_buffer;
+    const size_t len = cb->len;
+
+    if (!len)
+        return false;
+
+    /* Emptied before it's sent, as sending might wait for the socket to
+     * be writable, which would try to flush it again */
+    cb->len = 0;
+    disarm_chunk_timer(cb);
+    lwan_send(request, cb->data, len, 0);
+    return true;
+}
+
+static ALWAYS_INLINE char *frame_chunk_size(size_t len, char *buffer)
+{
+    char *p = uint_to_hex_string_append(len, buffer);
+
+    *p++ = '\r';
+    *p++ = '\n';
+    return p;
+}
+
+static bool coalesce_chunk(struct lwan_request *request,
+                           const char *buffer,
+                           size_t buffer_len)
+{
+    struct lwan_chunk_buffer *cb = request->helper->chunk_buffer;
+    const size_t framed_len = 2 * sizeof(size_t) + 2 + buffer_len + 2;
+
+    if (framed_len > MAX_COALESCED_CHUNK_SIZE)
+        return false;
+
+    if (!cb) {
+        cb = coro_malloc(request->conn->coro, sizeof(*cb));
+        if (UNLIKELY(!cb))
+            return false;
+
+        cb->len = 0;
+        cb->timer = (struct lwan_chunk_timer){.request = request};
+        if (UNLIKELY(coro_defer(request->conn->coro, disarm_chunk_timer,
+                                cb) < 0))
+            return false;
+        request->helper->chunk_buffer = cb;
+    }
+
+    if (cb->len + framed_len > CHUNK_BUFFER_SIZE)
+        lwan_response_flush_chunk_buffer(request);
+
+    if (!cb->len)
+        arm_chunk_timer(request, cb);
+
+    char *p = frame_chunk_size(buffer_len, cb->data + cb->len);
+    p = mempcpy(p, buffer, buffer_len);
+    p = mempcpy(p, "\r\n", 2);
+    cb->len = (size_t)(p - cb->data);
+
+    /* A handler that keeps producing chunks without ever yielding is
+     * caught here, as the timer only goes off once it yields. */
+    if (lwan_response_chunks_are_due(request))
+        lwan_response_flush_chunk_buffer(request);
+
+    return true;
+}
+
+static void send_chunk(struct lwan_request *request,
+                       char *buffer,
+                       size_t buffer_len)
+{
+    struct lwan_chunk_buffer *cb = request->helper->chunk_buffer;
+    char chunk_size[2 * sizeof(size_t) + 2];
+
+    if (coalesce_chunk(request, buffer, buffer_len))
+        return;
+
+    struct iovec chunk_vec[] = {
+        {.iov_base = cb ? cb->data : NULL, .iov_len = cb ? cb->len : 0},
+        {.iov_base = chunk_size,
+         .iov_len = (size_t)(frame_chunk_size(buffer_len, chunk_size) -
+                             chunk_size)},
+        {.iov_base = buffer, .iov_len = buffer_len},
+        {.iov_base = "\r\n", .iov_len = 2},
+    };
+
+    /* Whatever has been coalesced so far goes out first, in the same
+     * system call */
+    if (cb && cb->len) {
+        cb->len = 0;
+        disarm_chunk_timer(cb);
+        lwan_writev(request, chunk_vec, N_ELEMENTS(chunk_vec));
+    } else {
+        lwan_writev(request, chunk_vec + 1, N_ELEMENTS(chunk_vec) - 1);
+    }
+}
+
+static void send_last_chunk(struct lwan_request *request)
+{
+    static const char last_chunk[] = "0\r\n\r\n";
+    struct lwan_chunk_buffer *cb = request->helper->chunk_buffer;
+
+    if (cb && cb->len + sizeof(last_chunk) - 1 <= CHUNK_BUFFER_SIZE) {
+        memcpy(cb->data + cb->len, last_chunk, sizeof(last_chunk) - 1);
+        cb->len += sizeof(last_chunk) - 1;
+        lwan_response_flush_chunk_buffer(request);
+        return;
+    }
+
+    lwan_response_flush_chunks(request);
+    lwan_send(request, last_chunk, sizeof(last_chunk) - 1, 0);
+}
+
 void lwan_response_send_chunk_full(struct lwan_request *request,
                                    struct lwan_strbuf *strbuf)
 {
@@ -404,30 +1007,32 @@ void lwan_response_send_chunk_full(struct lwan_request *request,
     }
 
     size_t buffer_len = lwan_strbuf_get_length(strbuf);
-    if (UNLIKELY(!buffer_len)) {
-        static const char last_chunk[] = "0\r\n\r\n";
-        lwan_send(request, last_chunk, sizeof(last_chunk) - 1, 0);
-        return;
-    }
 
-    char chunk_size[3 * sizeof(size_t) + 2];
-    int converted_len =
-        snprintf(chunk_size, sizeof(chunk_size), "%zx\r\n", buffer_len);
-    if (UNLIKELY(converted_len < 0 ||
-                 (size_t)converted_len >= sizeof(chunk_size))) {
-        coro_yield(request->conn->coro, CONN_CORO_ABORT);
-        __builtin_unreachable();
-    }
-    size_t chunk_size_len = (size_t)converted_len;
+    if (request->helper->compressor) {
+        struct lwan_value compressed;
 
-    struct iovec chunk_vec[] = {
-        {.iov_base = chunk_size, .iov_len = chunk_size_len},
-        {.iov_base = lwan_strbuf_get_buffer(strbuf), .iov_len = buffer_len},
-        {.iov_base = "\r\n", .iov_len = 2},
-    };
+        /* Compressing the last, empty chunk ends the compressed stream,
+         * which then goes out before the last chunk itself. */
+        if (UNLIKELY(!lwan_response_compress_chunk(
+                request, lwan_strbuf_get_buffer(strbuf), buffer_len,
+                &compressed))) {
+            coro_yield(request->conn->coro, CONN_CORO_ABORT);
+            __builtin_unreachable();
+        }
+        if (compressed.len)
+            send_chunk(request, compressed.value, compressed.len);
+        if (buffer_len) {
+            lwan_strbuf_reset(strbuf);
+            return;
+        }
+    }
 
-    lwan_writev(request, chunk_vec, N_ELEMENTS(chunk_vec));
+    if (UNLIKELY(!buffer_len)) {
+        send_last_chunk(request);
+        return;
+    }
 
+    send_chunk(request, lwan_strbuf_get_buffer(strbuf), buffer_len);
     lwan_strbuf_reset(strbuf);
 }
 
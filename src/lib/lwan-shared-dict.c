@@ -0,0 +1,357 @@
+/*
+ * lwan - web server
+ * Copyright (c) 2024 L. A. F. Pereira <l@tia.mat.br>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301,
+ * USA.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "hash.h"
+#include "lwan-private.h"
+#include "lwan-shared-dict.h"
+
+/* Must match the number of bits used by get_shard() */
+#define N_SHARDS 16
+
+struct entry {
+    /* In seconds of the coarse monotonic clock; 0 if it never expires */
+    time_t expires;
+    size_t len;
+    char value[];
+};
+
+struct shard {
+    pthread_mutex_t lock;
+    struct hash *entries;
+} __attribute__((aligned(64)));
+
+struct lwan_shared_dict {
+    size_t max_entries_per_shard;
+    struct shard shards[N_SHARDS];
+};
+
+static pthread_mutex_t dicts_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct hash *dicts;
+
+static time_t now_seconds(void)
+{
+    struct timespec now;
+
+    if (UNLIKELY(clock_gettime(CLOCK_MONOTONIC_COARSE, &now) < 0))
+        lwan_status_critical_perror("clock_gettime");
+
+    return now.tv_sec;
+}
+
+static time_t expiration(unsigned int ttl)
+{
+    return ttl ? now_seconds() + (time_t)ttl : 0;
+}
+
+static bool is_expired(const struct entry *entry, time_t now)
+{
+    return entry->expires && entry->expires <= now;
+}
+
+static void dict_free(void *data)
+{
+    struct lwan_shared_dict *dict = data;
+
+    for (size_t i = 0; i < N_SHARDS; i++) {
+        hash_unref(dict->shards[i].entries);
+        pthread_mutex_destroy(&dict->shards[i].lock);
+    }
+
+    free(dict);
+}
+
+static struct lwan_shared_dict *dict_new(size_t max_entries)
+{
+    struct lwan_shared_dict *dict = aligned_alloc(64, sizeof(*dict));
+
+    if (!dict)
+        return NULL;
+
+    /* Keys are spread evenly over the shards, so each one gets its share
+     * of the entries */
+    dict->max_entries_per_shard =
+        LWAN_MAX((max_entries + N_SHARDS - 1) / N_SHARDS, (size_t)1);
+
+    for (size_t i = 0; i < N_SHARDS; i++) {
+        dict->shards[i].entries = hash_str_new(free, free);
+        if (!dict->shards[i].entries) {
+            while (i--) {
+                hash_unref(dict->shards[i].entries);
+                pthread_mutex_destroy(&dict->shards[i].lock);
+            }
+            free(dict);
+            return NULL;
+        }
+        pthread_mutex_init(&dict->shards[i].lock, NULL);
+    }
+
+    return dict;
+}
+
+struct lwan_shared_dict *lwan_shared_dict_get(const char *name,
+                                              size_t max_entries)
+{
+    struct lwan_shared_dict *dict = NULL;
+
+    pthread_mutex_lock(&dicts_lock);
+
+    if (!dicts) {
+        dicts = hash_str_new(free, dict_free);
+        if (!dicts)
+            goto out;
+    }
+
+    dict = hash_find(dicts, name);
+    if (dict)
+        goto out;
+
+    dict = dict_new(max_entries);
+    if (!dict)
+        goto out;
+
+    char *name_copy = strdup(name);
+    if (!name_copy || hash_add_unique(dicts, name_copy, dict) < 0) {
+        free(name_copy);
+        dict_free(dict);
+        dict = NULL;
+    }
+
+out:
+    pthread_mutex_unlock(&dicts_lock);
+    return dict;
+}
+
+void lwan_shared_dict_shutdown(void)
+{
+    pthread_mutex_lock(&dicts_lock);
+    hash_unref(dicts);
+    dicts = NULL;
+    pthread_mutex_unlock(&dicts_lock);
+}
+
+static struct shard *get_shard(struct lwan_shared_dict *dict, const char *key)
+{
+    /* Uses a hash other than the one used by the hash tables, so keys that
+     * end up in the same shard don't collide more often within it.  FNV-1a
+     * doesn't mix the top bits that well for short keys, so they're mixed
+     * again (Fibonacci hashing) before picking one. */
+    const uint64_t hash = fnv1a_64(key, strlen(key)) * 0x9e3779b97f4a7c15ull;
+
+    return &dict->shards[hash >> 60];
+}
+
+/* Must be called with the lock of @shard held.  Expired entries are
+ * returned as if they didn't exist, and removed on the way. */
+static struct entry *
+find_entry(struct shard *shard, const char *key, time_t now)
+{
+    struct entry *entry = hash_find(shard->entries, key);
+
+    if (entry && is_expired(entry, now)) {
+        hash_del(shard->entries, key);
+        return NULL;
+    }
+
+    return entry;
+}
+
+static void purge_expired(struct shard *shard, time_t now)
+{
+    const unsigned int count = hash_get_count(shard->entries);
+    const char **keys = calloc(count, sizeof(*keys));
+    struct hash_iter iter;
+    const void *key, *value;
+    unsigned int n_keys = 0;
+
+    if (!keys)
+        return;
+
+    /* Entries can't be removed while iterating */
+    hash_iter_init(shard->entries, &iter);
+    while (n_keys < count && hash_iter_next(&iter, &key, &value)) {
+        if (is_expired(value, now))
+            keys[n_keys++] = key;
+    }
+
+    for (unsigned int i = 0; i < n_keys; i++)
+        hash_del(shard->entries, keys[i]);
+
+    free(keys);
+}
+
+/* Must be called with the lock of @shard held. */
+static int store_entry(struct lwan_shared_dict *dict,
+                       struct shard *shard,
+                       const char *key,
+                       const char *value,
+                       size_t value_len,
+                       time_t expires,
+                       time_t now)
+{
+    if (!hash_find(shard->entries, key) &&
+        hash_get_count(shard->entries) >= dict->max_entries_per_shard) {
+        purge_expired(shard, now);
+        if (hash_get_count(shard->entries) >= dict->max_entries_per_shard)
+            return -ENOSPC;
+    }
+
+    struct entry *entry = malloc(sizeof(*entry) + value_len + 1);
+    if (!entry)
+        return -ENOMEM;
+
+    char *key_copy = strdup(key);
+    if (!key_copy) {
+        free(entry);
+        return -ENOMEM;
+    }
+
+    entry->expires = expires;
+    entry->len = value_len;
+    memcpy(entry->value, value, value_len);
+    entry->value[value_len] = '\0';
+
+    int r = hash_add(shard->entries, key_copy, entry);
+    if (r < 0) {
+        free(key_copy);
+        free(entry);
+    }
+
+    return r;
+}
+
+int lwan_shared_dict_lookup(struct lwan_shared_dict *dict,
+                            const char *key,
+                            struct lwan_strbuf *value)
+{
+    struct shard *shard = get_shard(dict, key);
+    struct entry *entry;
+    int r = -ENOENT;
+
+    pthread_mutex_lock(&shard->lock);
+    entry = find_entry(shard, key, now_seconds());
+    if (entry) {
+        r = lwan_strbuf_append_str(value, entry->value, entry->len) ? 0
+                                                                    : -ENOMEM;
+    }
+    pthread_mutex_unlock(&shard->lock);
+
+    return r;
+}
+
+int lwan_shared_dict_set(struct lwan_shared_dict *dict,
+                         const char *key,
+                         const char *value,
+                         size_t value_len,
+                         unsigned int ttl)
+{
+    struct shard *shard = get_shard(dict, key);
+    int r;
+
+    pthread_mutex_lock(&shard->lock);
+    r = store_entry(dict, shard, key, value, value_len, expiration(ttl),
+                    now_seconds());
+    pthread_mutex_unlock(&shard->lock);
+
+    return r;
+}
+
+int lwan_shared_dict_delete(struct lwan_shared_dict *dict, const char *key)
+{
+    struct shard *shard = get_shard(dict, key);
+    int r = -ENOENT;
+
+    pthread_mutex_lock(&shard->lock);
+    if (find_entry(shard, key, now_seconds()))
+        r = hash_del(shard->entries, key);
+    pthread_mutex_unlock(&shard->lock);
+
+    return r;
+}
+
+static bool parse_number(const struct entry *entry, long long *number)
+{
+    char *end;
+
+    if (!entry->len)
+        return false;
+
+    errno = 0;
+    *number = strtoll(entry->value, &end, 10);
+    return !errno && *end == '\0';
+}
+
+int lwan_shared_dict_incr(struct lwan_shared_dict *dict,
+                          const char *key,
+                          long long delta,
+                          unsigned int ttl,
+                          long long *result)
+{
+    struct shard *shard = get_shard(dict, key);
+    const time_t now = now_seconds();
+    long long number = 0;
+    time_t expires;
+    struct entry *entry;
+    int r;
+
+    pthread_mutex_lock(&shard->lock);
+
+    entry = find_entry(shard, key, now);
+    if (entry) {
+        if (!parse_number(entry, &number)) {
+            r = -EINVAL;
+            goto out;
+        }
+        expires = entry->expires;
+    } else {
+        expires = ttl ? now + (time_t)ttl : 0;
+    }
+
+    if (__builtin_add_overflow(number, delta, &number)) {
+        r = -ERANGE;
+        goto out;
+    }
+
+    char buffer[3 * sizeof(long long) + 2];
+    int len = snprintf(buffer, sizeof(buffer), "%lld", number);
+
+    /* Counters are usually replaced in place, without allocating */
+    if (entry && entry->len >= (size_t)len) {
+        memcpy(entry->value, buffer, (size_t)len + 1);
+        entry->len = (size_t)len;
+        r = 0;
+    } else {
+        r = store_entry(dict, shard, key, buffer, (size_t)len, expires, now);
+    }
+
+    if (!r)
+        *result = number;
+
+out:
+    pthread_mutex_unlock(&shard->lock);
+    return r;
+}
@@ -0,0 +1,71 @@
+/*
+ * lwan - web server
+ * Copyright (c) 2024 L. A. F. Pereira <l@tia.mat.br>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301,
+ * USA.
+ */
+
+#pragma once
+
+#include "lwan.h"
+
+/* Named dictionaries shared by every thread (and, in particular, by every
+ * Lua state), to keep things like counters or feature flags without a
+ * round trip to an external store.  Keys are NUL-terminated strings; values
+ * are arbitrary strings, optionally expiring after a number of seconds.
+ *
+ * A dictionary holds at most the number of entries it's been created with:
+ * once it's full, expired entries are purged, and storing new keys fails
+ * with -ENOSPC if that's not enough.  Entries are spread over a number of
+ * shards, each with its own lock, so threads rarely contend for one.
+ *
+ * Dictionaries live until Lwan is shut down. */
+
+struct lwan_shared_dict;
+
+/* Returns the dictionary called @name, creating it with room for
+ * @max_entries if it doesn't exist yet; @max_entries is ignored
+ * otherwise.  Returns NULL on failure. */
+struct lwan_shared_dict *lwan_shared_dict_get(const char *name,
+                                              size_t max_entries);
+
+/* Appends the value of @key to @value.  Returns 0, or -ENOENT if there's
+ * no such key (or if it has expired), or -ENOMEM. */
+int lwan_shared_dict_lookup(struct lwan_shared_dict *dict,
+                            const char *key,
+                            struct lwan_strbuf *value);
+
+/* @ttl is in seconds; 0 for values that never expire.  Returns 0,
+ * -ENOSPC if the dictionary is full, or -ENOMEM. */
+int lwan_shared_dict_set(struct lwan_shared_dict *dict,
+                         const char *key,
+                         const char *value,
+                         size_t value_len,
+                         unsigned int ttl);
+
+/* Returns 0, or -ENOENT if there's no such key. */
+int lwan_shared_dict_delete(struct lwan_shared_dict *dict, const char *key);
+
+/* Atomically adds @delta to the number stored in @key.  Keys that don't
+ * exist start at 0, and expire after @ttl seconds (if not 0); the time to
+ * live of existing keys isn't changed, which makes this suitable for
+ * fixed-window counters.  Returns 0, -EINVAL if the value isn't a number,
+ * -ERANGE on overflow, -ENOSPC if the dictionary is full, or -ENOMEM. */
+int lwan_shared_dict_incr(struct lwan_shared_dict *dict,
+                          const char *key,
+                          long long delta,
+                          unsigned int ttl,
+                          long long *result);
@@ -0,0 +1,500 @@
+/*
+ * lwan - web server
+ * Copyright (c) 2024 L. A. F. Pereira <l@tia.mat.br>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301,
+ * USA.
+ */
+
+#define _GNU_SOURCE
+#include <assert.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "lwan-private.h"
+#include "lwan-shm-cache.h"
+
+/* Every block is a multiple of this, so that there's always room for a
+ * padding block between the last one and the end of the ring */
+#define BLOCK_ALIGN 64
+/* Slots a key can be in, starting from the one its hash points to */
+#define MAX_PROBES 8
+/* Values are expected to be around this large, on average */
+#define BYTES_PER_SLOT 4096
+/* Marks the space at the end of the ring that was too small for a block */
+#define PADDING UINT32_MAX
+
+struct block {
+    /* Including this header; padding blocks only set these two */
+    uint64_t size;
+    uint32_t slot;
+
+    uint32_t generation;
+    uint64_t hash;
+    int64_t expires;
+    uint32_t key_len;
+    uint32_t value_len;
+    uint16_t refs[LWAN_SHM_CACHE_MAX_PROCESSES];
+
+    /* Key, then value */
+    char data[];
+};
+
+static_assert(offsetof(struct block, generation) <= BLOCK_ALIGN,
+              "Padding blocks fit in the smallest block");
+
+struct slot {
+    /* 0 if the slot is free */
+    uint64_t hash;
+    uint64_t block;
+    uint32_t generation;
+};
+
+struct segment {
+    pthread_mutex_t lock;
+    bool broken;
+
+    uint32_t n_slots;
+    uint32_t generation;
+
+    uint64_t blocks_offset;
+    uint64_t ring_size;
+    /* Blocks from the tail to the head (wrapping around) are in use; the
+     * number of bytes they take tells an empty ring from a full one. */
+    uint64_t head;
+    uint64_t tail;
+    uint64_t used;
+
+    struct slot slots[];
+};
+
+static struct segment *segment;
+static size_t segment_size;
+static unsigned int process_index;
+
+static inline struct block *block_at(uint64_t offset)
+{
+    return (struct block *)((char *)segment + segment->blocks_offset + offset);
+}
+
+static inline uint64_t align_block(uint64_t size)
+{
+    return (size + BLOCK_ALIGN - 1) & ~(uint64_t)(BLOCK_ALIGN - 1);
+}
+
+/* hash.c seeds its hash functions differently in every process, so FNV-1a
+ * is used as is; 0 is kept for free slots. */
+static uint64_t key_hash(const char *key, size_t len)
+{
+    uint64_t hash = 0xcbf29ce484222325ull;
+
+    for (size_t i = 0; i < len; i++) {
+        hash ^= (unsigned char)key[i];
+        hash *= 0x100000001b3ull;
+    }
+
+    return hash ? hash : 1;
+}
+
+static time_t now_seconds(void)
+{
+    struct timespec now;
+
+    if (UNLIKELY(clock_gettime(monotonic_clock_id, &now) < 0))
+        return 0;
+
+    return now.tv_sec;
+}
+
+bool lwan_shm_cache_init(size_t size)
+{
+    pthread_mutexattr_t attr;
+    size_t n_slots, header;
+    void *mem;
+
+    assert(!segment);
+
+    n_slots = LWAN_MAX(size / BYTES_PER_SLOT, (size_t)MAX_PROBES);
+    header = align_block(sizeof(struct segment) + n_slots * sizeof(struct slot));
+    if (n_slots > UINT32_MAX || size < header + 16 * BLOCK_ALIGN) {
+        lwan_status_error("Shared cache: %zu bytes is too small or too large",
+                          size);
+        return false;
+    }
+
+    mem = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS,
+               -1, 0);
+    if (mem == MAP_FAILED) {
+        lwan_status_perror("Shared cache: could not map %zu bytes", size);
+        return false;
+    }
+
+    segment = mem;
+    segment_size = size;
+    segment->n_slots = (uint32_t)n_slots;
+    segment->blocks_offset = header;
+    segment->ring_size = (size - header) & ~(uint64_t)(BLOCK_ALIGN - 1);
+
+    /* Robust, so that a worker crashing while holding it doesn't take
+     * every other worker down with it */
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    if (pthread_mutex_init(&segment->lock, &attr)) {
+        pthread_mutexattr_destroy(&attr);
+        lwan_status_error("Shared cache: could not create lock");
+        lwan_shm_cache_shutdown();
+        return false;
+    }
+    pthread_mutexattr_destroy(&attr);
+
+    lwan_status_debug("Shared cache: %" PRIu64 " bytes for values, %zu slots",
+                      segment->ring_size, n_slots);
+
+    return true;
+}
+
+void lwan_shm_cache_shutdown(void)
+{
+    if (!segment)
+        return;
+
+    munmap(segment, segment_size);
+    segment = NULL;
+}
+
+void lwan_shm_cache_set_process(unsigned int index)
+{
+    assert(index < LWAN_SHM_CACHE_MAX_PROCESSES);
+    process_index = index;
+}
+
+bool lwan_shm_cache_enabled(void) { return segment != NULL; }
+
+/* Walks the ring from the tail, which has to lead exactly to the head. */
+static bool ring_is_consistent(void)
+{
+    uint64_t offset = segment->tail;
+    uint64_t left = segment->used;
+
+    if (left > segment->ring_size || offset >= segment->ring_size ||
+        segment->head >= segment->ring_size)
+        return false;
+
+    while (left) {
+        const struct block *block = block_at(offset);
+
+        if (!block->size || block->size % BLOCK_ALIGN ||
+            block->size > left || offset + block->size > segment->ring_size)
+            return false;
+
+        left -= block->size;
+        offset = (offset + block->size) % segment->ring_size;
+    }
+
+    return offset == segment->head;
+}
+
+static bool lock_segment(void)
+{
+    int r = pthread_mutex_lock(&segment->lock);
+
+    if (UNLIKELY(r == EOWNERDEAD)) {
+        /* Whatever the process that died was doing might only be half
+         * done; values being copied in aren't reachable until they're
+         * complete, but the ring itself has to be checked */
+        pthread_mutex_consistent(&segment->lock);
+
+        if (!segment->broken && !ring_is_consistent()) {
+            lwan_status_warning("Shared cache: a worker died while changing "
+                                "it; not using it anymore");
+            segment->broken = true;
+        }
+    } else if (UNLIKELY(r != 0)) {
+        return false;
+    }
+
+    if (UNLIKELY(segment->broken)) {
+        pthread_mutex_unlock(&segment->lock);
+        return false;
+    }
+
+    return true;
+}
+
+static void unlock_segment(void) { pthread_mutex_unlock(&segment->lock); }
+
+void lwan_shm_cache_forget_process(unsigned int index)
+{
+    uint64_t offset, left;
+
+    if (!segment || !lock_segment())
+        return;
+
+    offset = segment->tail;
+    for (left = segment->used; left;) {
+        struct block *block = block_at(offset);
+
+        if (block->slot != PADDING)
+            __atomic_store_n(&block->refs[index], 0, __ATOMIC_RELAXED);
+
+        left -= block->size;
+        offset = (offset + block->size) % segment->ring_size;
+    }
+
+    unlock_segment();
+}
+
+static bool block_is_referenced(const struct block *block)
+{
+    for (size_t i = 0; i < N_ELEMENTS(block->refs); i++) {
+        if (ATOMIC_READ(block->refs[i]))
+            return true;
+    }
+    return false;
+}
+
+/* Frees the oldest block, unless it's still being used by someone. */
+static bool evict_tail(void)
+{
+    struct block *block = block_at(segment->tail);
+
+    if (block->slot != PADDING) {
+        struct slot *slot = &segment->slots[block->slot];
+
+        if (block_is_referenced(block))
+            return false;
+
+        if (slot->block == segment->tail &&
+            slot->generation == block->generation)
+            slot->hash = 0;
+    }
+
+    segment->used -= block->size;
+    segment->tail = (segment->tail + block->size) % segment->ring_size;
+
+    return true;
+}
+
+/* Returns the offset of @size contiguous bytes at the head of the ring,
+ * evicting the oldest blocks to make room as needed, or -1 if some of them
+ * are still being used. */
+static int64_t alloc_block(uint64_t size)
+{
+    const uint64_t ring_size = segment->ring_size;
+
+    while (true) {
+        uint64_t head = segment->head;
+        uint64_t room;
+
+        if (!segment->used) {
+            segment->head = segment->tail = head = 0;
+            room = ring_size;
+        } else if (head == segment->tail) {
+            room = 0;
+        } else if (head > segment->tail) {
+            room = ring_size - head;
+        } else {
+            room = segment->tail - head;
+        }
+
+        if (room >= size) {
+            segment->head = (head + size) % ring_size;
+            segment->used += size;
+            return (int64_t)head;
+        }
+
+        if (head > segment->tail) {
+            /* Blocks don't wrap around: whatever is left at the end of the
+             * ring is skipped */
+            struct block *padding = block_at(head);
+
+            padding->size = ring_size - head;
+            padding->slot = PADDING;
+            segment->used += padding->size;
+            segment->head = 0;
+            continue;
+        }
+
+        if (!evict_tail())
+            return -1;
+    }
+}
+
+static bool block_has_key(const struct block *block,
+                          uint64_t hash,
+                          const char *key,
+                          size_t key_len)
+{
+    return block->hash == hash && block->key_len == key_len &&
+           !memcmp(block->data, key, key_len);
+}
+
+/* Picks the slot for @key: the one it's already in, if any, or a free
+ * one, or the one with the value that expires the soonest. */
+static uint32_t pick_slot(uint64_t hash,
+                          const char *key,
+                          size_t key_len,
+                          time_t now)
+{
+    uint32_t best = (uint32_t)(hash % segment->n_slots);
+    int64_t best_expires = INT64_MAX;
+
+    for (uint32_t probe = 0; probe < MAX_PROBES; probe++) {
+        const uint32_t index = (uint32_t)((hash + probe) % segment->n_slots);
+        const struct slot *slot = &segment->slots[index];
+        const struct block *block;
+
+        if (!slot->hash)
+            return index;
+
+        block = block_at(slot->block);
+        if (slot->hash == hash && block_has_key(block, hash, key, key_len))
+            return index;
+        if (block->expires <= now)
+            return index;
+
+        if (block->expires < best_expires) {
+            best_expires = block->expires;
+            best = index;
+        }
+    }
+
+    return best;
+}
+
+bool lwan_shm_cache_putv(const char *key,
+                         size_t key_len,
+                         const struct iovec *iov,
+                         int iovcnt,
+                         time_t expires)
+{
+    size_t value_len = 0;
+    struct block *block;
+    uint32_t slot_index;
+    uint64_t size, hash;
+    int64_t offset;
+    char *p;
+
+    if (!segment)
+        return false;
+
+    for (int i = 0; i < iovcnt; i++)
+        value_len += iov[i].iov_len;
+    if (key_len > UINT32_MAX || value_len > UINT32_MAX)
+        return false;
+
+    /* A single value isn't allowed to push most others out */
+    size = align_block(sizeof(*block) + key_len + value_len);
+    if (size > segment->ring_size / 4)
+        return false;
+
+    hash = key_hash(key, key_len);
+
+    if (!lock_segment())
+        return false;
+
+    slot_index = pick_slot(hash, key, key_len, now_seconds());
+
+    offset = alloc_block(size);
+    if (offset < 0) {
+        unlock_segment();
+        return false;
+    }
+
+    block = block_at((uint64_t)offset);
+    *block = (struct block){
+        .size = size,
+        .slot = slot_index,
+        .generation = ++segment->generation,
+        .hash = hash,
+        .expires = (int64_t)expires,
+        .key_len = (uint32_t)key_len,
+        .value_len = (uint32_t)value_len,
+    };
+    p = mempcpy(block->data, key, key_len);
+    for (int i = 0; i < iovcnt; i++)
+        p = mempcpy(p, iov[i].iov_base, iov[i].iov_len);
+
+    /* Only reachable once it's complete; whatever this slot pointed to
+     * before is left for eviction to get rid of */
+    segment->slots[slot_index] = (struct slot){
+        .hash = hash,
+        .block = (uint64_t)offset,
+        .generation = block->generation,
+    };
+
+    unlock_segment();
+
+    return true;
+}
+
+bool lwan_shm_cache_get(const char *key,
+                        size_t key_len,
+                        struct lwan_shm_cache_value *value)
+{
+    const time_t now = now_seconds();
+    bool found = false;
+    uint64_t hash;
+
+    if (!segment)
+        return false;
+
+    hash = key_hash(key, key_len);
+
+    if (!lock_segment())
+        return false;
+
+    for (uint32_t probe = 0; probe < MAX_PROBES; probe++) {
+        const uint32_t index = (uint32_t)((hash + probe) % segment->n_slots);
+        const struct slot *slot = &segment->slots[index];
+        struct block *block;
+
+        if (slot->hash != hash)
+            continue;
+
+        block = block_at(slot->block);
+        if (!block_has_key(block, hash, key, key_len))
+            continue;
+
+        if (block->expires > now &&
+            ATOMIC_READ(block->refs[process_index]) < UINT16_MAX) {
+            /* References are only taken with the lock held, so that a
+             * block can't be taken while it's being evicted */
+            ATOMIC_INC(block->refs[process_index]);
+
+            *value = (struct lwan_shm_cache_value){
+                .value = block->data + key_len,
+                .len = block->value_len,
+                .block = slot->block,
+            };
+            found = true;
+        }
+        break;
+    }
+
+    unlock_segment();
+
+    return found;
+}
+
+void lwan_shm_cache_release(const struct lwan_shm_cache_value *value)
+{
+    ATOMIC_DEC(block_at(value->block)->refs[process_index]);
+}
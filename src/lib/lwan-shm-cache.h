@@ -0,0 +1,77 @@
+/*
+ * lwan - web server
+ * Copyright (c) 2024 L. A. F. Pereira <l@tia.mat.br>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301,
+ * USA.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <time.h>
+
+/* A segment of shared memory, created before forking worker processes
+ * (see the --processes command line option), where they can keep values
+ * for each other.  It's only made of offsets and sizes, never pointers, so
+ * it doesn't matter where it's mapped.
+ *
+ * Values are stored in a ring: the oldest ones are overwritten once it's
+ * full, unless a process is still using them.  Each process counts its own
+ * references to a value, so that whatever a worker that crashed was using
+ * can be let go of by the supervisor.
+ *
+ * Without a segment (i.e. with a single process), nothing is ever found,
+ * and nothing is stored. */
+
+#define LWAN_SHM_CACHE_MAX_PROCESSES 64
+
+struct lwan_shm_cache_value {
+    const void *value;
+    size_t len;
+    /* Opaque to users */
+    uint64_t block;
+};
+
+/* Maps a segment of @size bytes.  Must be called before forking. */
+bool lwan_shm_cache_init(size_t size);
+void lwan_shm_cache_shutdown(void);
+
+/* Each worker process is told its index (less than
+ * LWAN_SHM_CACHE_MAX_PROCESSES) right after being forked.  Once it's gone,
+ * the supervisor drops all of its references. */
+void lwan_shm_cache_set_process(unsigned int index);
+void lwan_shm_cache_forget_process(unsigned int index);
+
+bool lwan_shm_cache_enabled(void);
+
+/* Stores the concatenation of @iov under @key, replacing whatever was
+ * there, until @expires (in seconds of monotonic_clock_id, which is the
+ * same for every process).  Returns false if it doesn't fit. */
+bool lwan_shm_cache_putv(const char *key,
+                         size_t key_len,
+                         const struct iovec *iov,
+                         int iovcnt,
+                         time_t expires);
+
+/* Fills @value if @key is in the segment and hasn't expired; it stays
+ * valid until it's released. */
+bool lwan_shm_cache_get(const char *key,
+                        size_t key_len,
+                        struct lwan_shm_cache_value *value);
+void lwan_shm_cache_release(const struct lwan_shm_cache_value *value);
@@ -25,11 +25,14 @@
 #include <netdb.h>
 #include <netinet/tcp.h>
 #include <pthread.h>
+#include <stddef.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/resource.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/un.h>
 #include <unistd.h>
 
 #include "lwan-private.h"
@@ -85,9 +88,13 @@ static void init_backlog_size(void)
         backlog_size = SOMAXCONN;
 }
 
-static int get_backlog_size(void)
+static int get_backlog_size(const struct lwan_listener_options *options)
 {
     static pthread_once_t backlog_size_once = PTHREAD_ONCE_INIT;
+
+    if (options->backlog)
+        return (int)LWAN_MIN(options->backlog, (unsigned int)INT_MAX);
+
     pthread_once(&backlog_size_once, init_backlog_size);
     return backlog_size;
 }
@@ -172,10 +179,11 @@ sa_family_t lwan_socket_parse_address(char *listener, char **node, char **port)
 
 static int listen_addrinfo(int fd,
                            const struct addrinfo *addr,
+                           const struct lwan_listener_options *options,
                            bool print_listening_msg,
                            bool is_https)
 {
-    if (listen(fd, get_backlog_size()) < 0)
+    if (listen(fd, get_backlog_size(options)) < 0)
         lwan_status_critical_perror("listen");
 
     if (print_listening_msg) {
@@ -213,6 +221,7 @@ static int listen_addrinfo(int fd,
     } while (0)
 
 static int bind_and_listen_addrinfos(const struct addrinfo *addrs,
+                                     const struct lwan_listener_options *options,
                                      bool print_listening_msg,
                                      bool is_https)
 {
@@ -232,7 +241,8 @@ static int bind_and_listen_addrinfos(const struct addrinfo *addrs,
 #endif
 
         if (!bind(fd, addr->ai_addr, addr->ai_addrlen))
-            return listen_addrinfo(fd, addr, print_listening_msg, is_https);
+            return listen_addrinfo(fd, addr, options, print_listening_msg,
+                                   is_https);
 
         close(fd);
     }
@@ -240,32 +250,132 @@ static int bind_and_listen_addrinfos(const struct addrinfo *addrs,
     lwan_status_critical("Could not bind socket");
 }
 
-static int set_socket_options(const struct lwan *l, int fd)
+static bool is_unix_socket(int fd)
 {
+    struct sockaddr_storage addr;
+    socklen_t len = sizeof(addr);
+
+    return !getsockname(fd, (struct sockaddr *)&addr, &len) &&
+           addr.ss_family == AF_UNIX;
+}
+
+static int set_socket_options(const struct lwan *l,
+                              const struct lwan_listener_options *options,
+                              int fd)
+{
+    const int defer_accept = options->defer_accept < 0
+                                 ? (int)l->config.keep_alive_timeout
+                                 : options->defer_accept;
+
     SET_SOCKET_OPTION(SOL_SOCKET, SO_LINGER,
                       (&(struct linger){.l_onoff = 1, .l_linger = 1}));
 
+    if (is_unix_socket(fd))
+        return fd;
+
 #ifdef __linux__
 
 #ifndef TCP_FASTOPEN
 #define TCP_FASTOPEN 23
+#endif
+#ifndef SO_BUSY_POLL
+#define SO_BUSY_POLL 46
+#endif
+#ifndef SO_PREFER_BUSY_POLL
+#define SO_PREFER_BUSY_POLL 69
+#endif
+#ifndef TCP_NOTSENT_LOWAT
+#define TCP_NOTSENT_LOWAT 25
 #endif
 
     SET_SOCKET_OPTION_MAY_FAIL(SOL_SOCKET, SO_REUSEADDR, (int[]){1});
     SET_SOCKET_OPTION_MAY_FAIL(SOL_TCP, TCP_NODELAY, (int[]){1});
-    SET_SOCKET_OPTION_MAY_FAIL(SOL_TCP, TCP_FASTOPEN, (int[]){5});
+    SET_SOCKET_OPTION_MAY_FAIL(SOL_TCP, TCP_FASTOPEN,
+                               (int[]){(int)options->fastopen_queue});
     SET_SOCKET_OPTION_MAY_FAIL(SOL_TCP, TCP_QUICKACK, (int[]){0});
     SET_SOCKET_OPTION_MAY_FAIL(SOL_TCP, TCP_DEFER_ACCEPT,
-                               (int[]){(int)l->config.keep_alive_timeout});
+                               (int[]){defer_accept});
+
+    /* Accepted sockets inherit these from the listening socket */
+    if (options->busy_poll) {
+        SET_SOCKET_OPTION_MAY_FAIL(SOL_SOCKET, SO_BUSY_POLL,
+                                   (int[]){(int)options->busy_poll});
+    }
+    if (options->prefer_busy_poll) {
+        SET_SOCKET_OPTION_MAY_FAIL(SOL_SOCKET, SO_PREFER_BUSY_POLL, (int[]){1});
+    }
+    /* Sockets are only reported as writable, and writes only queue more
+     * data, while less than this is waiting to be sent.  Large responses
+     * are then written as the connection drains, instead of sitting in
+     * the kernel, so memory used by each connection follows its
+     * bandwidth-delay product rather than the size of the send buffer. */
+    if (options->notsent_lowat) {
+        SET_SOCKET_OPTION_MAY_FAIL(SOL_TCP, TCP_NOTSENT_LOWAT,
+                                   (int[]){(int)options->notsent_lowat});
+    }
 
     if (is_reno_supported())
         setsockopt(fd, IPPROTO_TCP, TCP_CONGESTION, "reno", 4);
+#else
+    (void)defer_accept;
 #endif
 
     return fd;
 }
 
+static int setup_unix_socket(const struct lwan *l,
+                             const struct lwan_listener_options *options,
+                             int first_fd,
+                             bool is_https,
+                             const char *path)
+{
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    socklen_t addr_len = sizeof(addr);
+    const bool abstract = path[0] == '@';
+    struct stat st;
+    int fd;
+
+    /* Unix sockets can't be bound more than once, so all threads accept
+     * from the same socket */
+    if (first_fd >= 0) {
+        fd = fcntl(first_fd, F_DUPFD_CLOEXEC, 0);
+        if (fd < 0)
+            lwan_status_critical_perror("Could not duplicate listener");
+        return fd;
+    }
+
+    if (strlen(path) >= sizeof(addr.sun_path))
+        lwan_status_critical("Unix socket path is too long: %s", path);
+    strcpy(addr.sun_path, path);
+
+    if (abstract) {
+        /* Names in the abstract namespace start with a NUL byte, and
+         * aren't NUL-terminated; they go away with the socket. */
+        addr.sun_path[0] = '\0';
+        addr_len = (socklen_t)(offsetof(struct sockaddr_un, sun_path) +
+                               strlen(path));
+    } else if (!lstat(path, &st) && S_ISSOCK(st.st_mode)) {
+        /* Left behind by a previous process */
+        unlink(path);
+    }
+
+    fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+    if (fd < 0)
+        lwan_status_critical_perror("socket");
+
+    if (bind(fd, (struct sockaddr *)&addr, addr_len) < 0)
+        lwan_status_critical_perror("Could not bind to %s", path);
+    if (listen(fd, get_backlog_size(options)) < 0)
+        lwan_status_critical_perror("listen");
+
+    lwan_status_info("Listening on http%s+unix://%s", is_https ? "s" : "",
+                     path);
+
+    return set_socket_options(l, options, fd);
+}
+
 static int setup_socket_normally(const struct lwan *l,
+                                 const struct lwan_listener_options *options,
                                  bool print_listening_msg,
                                  bool is_https,
                                  const char *listener_from_config)
@@ -276,7 +386,7 @@ static int setup_socket_normally(const struct lwan *l,
 
     if (family == AF_MAX) {
         lwan_status_critical("Could not parse listener: %s",
-                             l->config.listener);
+                             listener_from_config);
     }
 
     struct addrinfo *addrs;
@@ -288,27 +398,41 @@ static int setup_socket_normally(const struct lwan *l,
     if (ret)
         lwan_status_critical("getaddrinfo: %s", gai_strerror(ret));
 
-    int fd = bind_and_listen_addrinfos(addrs, print_listening_msg, is_https);
+    int fd = bind_and_listen_addrinfos(addrs, options, print_listening_msg,
+                                       is_https);
     freeaddrinfo(addrs);
-    return set_socket_options(l, fd);
+    return set_socket_options(l, options, fd);
 }
 
-static int from_systemd_socket(const struct lwan *l, int fd)
+static int from_systemd_socket(const struct lwan *l,
+                               const struct lwan_listener_options *options,
+                               int fd)
 {
-    if (!sd_is_socket_inet(fd, AF_UNSPEC, SOCK_STREAM, 1, 0)) {
+    if (sd_is_socket_inet(fd, AF_UNSPEC, SOCK_STREAM, 1, 0) <= 0 &&
+        !is_unix_socket(fd)) {
         lwan_status_critical("Passed file descriptor is not a "
-                             "listening TCP socket");
+                             "listening TCP or Unix socket");
     }
 
-    return set_socket_options(l, set_socket_flags(fd));
+    return set_socket_options(l, options, set_socket_flags(fd));
 }
 
 int lwan_create_listen_socket(const struct lwan *l,
-                              bool print_listening_msg,
+                              const char *listener,
+                              const struct lwan_listener_options *options,
+                              int first_fd,
                               bool is_https)
 {
-    const char *listener =
-        is_https ? l->config.tls_listener : l->config.listener;
+    const bool print_listening_msg = first_fd < 0;
+    int inherited_fd = lwan_upgrade_take_listener(is_https);
+
+    if (inherited_fd >= 0) {
+        if (print_listening_msg) {
+            lwan_status_info("Using %s listener inherited from previous "
+                             "process", is_https ? "HTTPS" : "HTTP");
+        }
+        return set_socket_options(l, options, set_socket_flags(inherited_fd));
+    }
 
     if (!strncmp(listener, "systemd:", sizeof("systemd:") - 1)) {
         char **names = NULL;
@@ -344,7 +468,7 @@ int lwan_create_listen_socket(const struct lwan *l,
                 "No socket named `%s' has been passed from systemd", listener);
         }
 
-        return from_systemd_socket(l, fd);
+        return from_systemd_socket(l, options, fd);
     }
 
     if (streq(listener, "systemd")) {
@@ -368,10 +492,16 @@ int lwan_create_listen_socket(const struct lwan *l,
                 n);
         }
 
-        return from_systemd_socket(l, SD_LISTEN_FDS_START);
+        return from_systemd_socket(l, options, SD_LISTEN_FDS_START);
+    }
+
+    if (!strncmp(listener, "unix:", sizeof("unix:") - 1)) {
+        return setup_unix_socket(l, options, first_fd, is_https,
+                                 listener + sizeof("unix:") - 1);
     }
 
-    return setup_socket_normally(l, print_listening_msg, is_https, listener);
+    return setup_socket_normally(l, options, print_listening_msg, is_https,
+                                 listener);
 }
 
 #undef SET_SOCKET_OPTION
@@ -0,0 +1,283 @@
+/*
+ * lwan - web server
+ * Copyright (c) 2024 L. A. F. Pereira <l@tia.mat.br>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301,
+ * USA.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+
+#include "lwan-private.h"
+#include "lwan-config.h"
+#include "lwan-io-wrappers.h"
+#include "lwan-pubsub.h"
+#include "lwan-sse.h"
+
+/* Events queued for a connection are written with a single writev() */
+#define MAX_EVENTS_PER_WRITE 16
+
+struct lwan_sse_topic {
+    /* A fan-out topic: its ring is the replay buffer, and the sequence
+     * number of each message in it is the ID of the event. */
+    struct lwan_pubsub_topic *pubsub;
+
+    /* Serializes broadcasts, so that events are published in the order
+     * their IDs were given out. */
+    pthread_mutex_t lock;
+    uint64_t next_id;
+};
+
+struct lwan_sse_topic *lwan_sse_topic_new(size_t replay_size)
+{
+    struct lwan_sse_topic *topic = malloc(sizeof(*topic));
+
+    if (!topic)
+        return NULL;
+
+    topic->pubsub = lwan_pubsub_new_fanout_topic(replay_size);
+    if (!topic->pubsub) {
+        free(topic);
+        return NULL;
+    }
+
+    pthread_mutex_init(&topic->lock, NULL);
+    topic->next_id = 0;
+
+    return topic;
+}
+
+void lwan_sse_topic_free(struct lwan_sse_topic *topic)
+{
+    if (!topic)
+        return;
+
+    lwan_pubsub_free_topic(topic->pubsub);
+    pthread_mutex_destroy(&topic->lock);
+    free(topic);
+}
+
+static bool serialize_event(struct lwan_strbuf *buf,
+                            uint64_t id,
+                            const char *event,
+                            const char *data,
+                            size_t data_len)
+{
+    const char *end = data + data_len;
+
+    if (!lwan_strbuf_append_printf(buf, "id: %" PRIu64 "\n", id))
+        return false;
+
+    if (event) {
+        if (!lwan_strbuf_append_strz(buf, "event: ") ||
+            !lwan_strbuf_append_strz(buf, event) ||
+            !lwan_strbuf_append_char(buf, '\n'))
+            return false;
+    }
+
+    /* Each line of the payload needs its own field, or the client would
+     * take a line break as the end of the event */
+    do {
+        const char *eol = memchr(data, '\n', (size_t)(end - data));
+        const char *line_end = eol ? eol : end;
+
+        if (!lwan_strbuf_append_str(buf, "data: ", 6) ||
+            !lwan_strbuf_append_str(buf, data, (size_t)(line_end - data)) ||
+            !lwan_strbuf_append_char(buf, '\n'))
+            return false;
+
+        data = eol ? eol + 1 : end;
+    } while (data < end);
+
+    return lwan_strbuf_append_char(buf, '\n');
+}
+
+bool lwan_sse_broadcast(struct lwan_sse_topic *topic,
+                        const char *event,
+                        const char *data,
+                        size_t data_len)
+{
+    struct lwan_strbuf buf;
+    bool published = false;
+
+    if (event && strpbrk(event, "\r\n"))
+        return false;
+
+    if (!lwan_strbuf_init(&buf))
+        return false;
+
+    pthread_mutex_lock(&topic->lock);
+    if (serialize_event(&buf, topic->next_id, event, data, data_len)) {
+        published = lwan_pubsub_publish(topic->pubsub,
+                                        lwan_strbuf_get_buffer(&buf),
+                                        lwan_strbuf_get_length(&buf));
+        if (published)
+            topic->next_id++;
+    }
+    pthread_mutex_unlock(&topic->lock);
+
+    lwan_strbuf_free(&buf);
+
+    return published;
+}
+
+static struct lwan_pubsub_subscriber *
+subscribe(struct lwan_request *request, struct lwan_sse_topic *topic)
+{
+    const char *last_event_id =
+        lwan_request_get_header(request, "Last-Event-ID");
+
+    if (last_event_id) {
+        long long id = parse_long_long(last_event_id, -1);
+
+        /* IDs from before a restart are newer than anything in the ring,
+         * and get nothing replayed */
+        if (id >= 0)
+            return lwan_pubsub_subscribe_since(topic->pubsub, (uint64_t)id + 1);
+    }
+
+    return lwan_pubsub_subscribe(topic->pubsub);
+}
+
+static void unsubscribe(void *data1, void *data2)
+{
+    lwan_pubsub_unsubscribe(data1, data2);
+}
+
+struct event_batch {
+    struct lwan_pubsub_msg *msgs[MAX_EVENTS_PER_WRITE];
+    int n_msgs;
+};
+
+static void release_batch(void *data)
+{
+    struct event_batch *batch = data;
+
+    for (int i = 0; i < batch->n_msgs; i++)
+        lwan_pubsub_msg_done(batch->msgs[i]);
+    batch->n_msgs = 0;
+}
+
+static void send_pending_events(struct lwan_request *request,
+                                struct lwan_pubsub_subscriber *sub)
+{
+    struct event_batch batch = {.n_msgs = 0};
+    struct iovec vec[MAX_EVENTS_PER_WRITE];
+    /* Writing can abort the coroutine, so references are dropped by a
+     * deferred callback in that case */
+    coro_deferred defer = coro_defer(request->conn->coro, release_batch, &batch);
+
+    if (UNLIKELY(defer < 0)) {
+        coro_yield(request->conn->coro, CONN_CORO_ABORT);
+        __builtin_unreachable();
+    }
+
+    while (true) {
+        struct lwan_pubsub_msg *msg = lwan_pubsub_consume(sub);
+
+        if (msg) {
+            const struct lwan_value *value = lwan_pubsub_msg_value(msg);
+
+            vec[batch.n_msgs] = (struct iovec){
+                .iov_base = value->value,
+                .iov_len = value->len,
+            };
+            batch.msgs[batch.n_msgs++] = msg;
+
+            if (batch.n_msgs < MAX_EVENTS_PER_WRITE)
+                continue;
+        }
+
+        if (batch.n_msgs) {
+            lwan_writev(request, vec, batch.n_msgs);
+            release_batch(&batch);
+        }
+
+        if (!msg)
+            break;
+    }
+
+    coro_defer_disarm(request->conn->coro, defer);
+}
+
+static bool client_is_gone(struct lwan_request *request)
+{
+    char buffer[64];
+
+    /* Clients don't send anything on an event stream, other than maybe
+     * pipelined requests that will never be served; all that matters is
+     * whether the connection has been closed */
+    while (true) {
+        ssize_t r = recv(request->fd, buffer, sizeof(buffer), MSG_DONTWAIT);
+
+        if (r > 0)
+            continue;
+        if (r == 0)
+            return true;
+        if (errno == EINTR)
+            continue;
+        return errno != EAGAIN;
+    }
+}
+
+enum lwan_http_status lwan_sse_serve(struct lwan_request *request,
+                                     struct lwan_sse_topic *topic)
+{
+    struct lwan_pubsub_subscriber *sub;
+    int sub_fd;
+
+    sub = subscribe(request, topic);
+    if (!sub)
+        return HTTP_INTERNAL_ERROR;
+
+    if (coro_defer2(request->conn->coro, unsubscribe, topic->pubsub, sub) < 0) {
+        lwan_pubsub_unsubscribe(topic->pubsub, sub);
+        return HTTP_INTERNAL_ERROR;
+    }
+
+    sub_fd = lwan_pubsub_get_notification_fd(sub);
+    if (sub_fd < 0)
+        return HTTP_INTERNAL_ERROR;
+
+    if (!(request->flags & RESPONSE_SENT_HEADERS)) {
+        if (!lwan_response_set_event_stream(request, HTTP_OK))
+            return HTTP_INTERNAL_ERROR;
+    }
+
+    /* Events being replayed are already in the ring, so they're sent
+     * right away rather than waiting for the next broadcast */
+    send_pending_events(request, sub);
+
+    while (true) {
+        int fd = lwan_request_awaitv_any(request, request->fd,
+                                         CONN_CORO_WANT_READ, sub_fd,
+                                         CONN_CORO_WANT_READ, -1);
+
+        if (fd == sub_fd) {
+            send_pending_events(request, sub);
+        } else if (fd < 0 || client_is_gone(request)) {
+            break;
+        }
+    }
+
+    coro_yield(request->conn->coro, CONN_CORO_ABORT);
+    __builtin_unreachable();
+}
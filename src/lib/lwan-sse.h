@@ -0,0 +1,67 @@
+/*
+ * lwan - web server
+ * Copyright (c) 2024 L. A. F. Pereira <l@tia.mat.br>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301,
+ * USA.
+ */
+
+#pragma once
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+#include "lwan.h"
+
+/* Server-sent events broadcast to every client subscribed to a topic.
+ *
+ * Events are serialized once, when they're broadcast, into a buffer shared
+ * by all subscribers; each connection then only writes that buffer, no
+ * matter how many clients there are.  Every event gets an ID, and the last
+ * events are kept in a ring: clients reconnecting with a Last-Event-ID
+ * header get the events they've missed, as long as they're still there.
+ * Clients that fall behind by more than the size of the ring skip the
+ * events that were overwritten.
+ *
+ * Topics must outlive the connections subscribed to them. */
+
+struct lwan_sse_topic;
+
+/* Keeps the last @replay_size events (rounded up to a power of two) for
+ * clients to catch up with.  Returns NULL on failure. */
+struct lwan_sse_topic *lwan_sse_topic_new(size_t replay_size);
+void lwan_sse_topic_free(struct lwan_sse_topic *topic);
+
+/* Sends an event to every client subscribed to @topic.  @event is the
+ * event type, or NULL for the default ("message"); @data can have multiple
+ * lines.  Safe to call from any thread.  Returns false if the event
+ * couldn't be serialized, or if @event has line breaks. */
+bool lwan_sse_broadcast(struct lwan_sse_topic *topic,
+                        const char *event,
+                        const char *data,
+                        size_t data_len);
+
+/* Turns @request into an event stream (sending the response headers if they
+ * haven't been sent yet) subscribed to @topic, replaying events as
+ * requested by the Last-Event-ID header.  Only returns if the client
+ * couldn't be subscribed; the coroutine is aborted once the client
+ * disconnects. */
+enum lwan_http_status lwan_sse_serve(struct lwan_request *request,
+                                     struct lwan_sse_topic *topic);
+
+#if defined(__cplusplus)
+}
+#endif
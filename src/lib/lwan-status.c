@@ -142,6 +142,19 @@ static inline char *strerror_thunk_r(int error_number, char *buffer, size_t len)
 }
 
 #ifndef NDEBUG
+#if !defined(FUZZING_BUILD_MODE_UNSAFE_FOR_PRODUCTION)
+static __thread long cached_tid;
+
+/* Otherwise, processes forked from a thread that had it cached would
+ * keep printing the ID of the thread in their parent */
+static void forget_cached_tid(void) { cached_tid = 0; }
+
+__attribute__((constructor)) static void register_fork_handler(void)
+{
+    pthread_atfork(NULL, NULL, forget_cached_tid);
+}
+#endif
+
 static long gettid_cached(void)
 {
 #if defined(FUZZING_BUILD_MODE_UNSAFE_FOR_PRODUCTION)
@@ -149,12 +162,10 @@ static long gettid_cached(void)
      * https://bugs.chromium.org/p/oss-fuzz/issues/detail?id=15216 */
     return gettid();
 #else
-    static __thread long tid;
-
-    if (!tid)
-        tid = gettid();
+    if (!cached_tid)
+        cached_tid = gettid();
 
-    return tid;
+    return cached_tid;
 #endif
 }
 
@@ -41,6 +41,116 @@ bool lwan_strbuf_has_grow_buffer_failed_flag(const struct lwan_strbuf *s)
     return s->flags & GROW_BUFFER_FAILED;
 }
 
+size_t lwan_strbuf_get_allocated_size(const struct lwan_strbuf *s)
+{
+    return (s->flags & BUFFER_MALLOCD) ? s->capacity : 0;
+}
+
+/* Buffers with capacities between 2^POOL_MIN_SHIFT and 2^POOL_MAX_SHIFT
+ * bytes aren't returned to malloc() when a strbuf stops using them; they're
+ * kept in per-thread free lists, one per power-of-two size class, so that
+ * the next response that grows as large can reuse them.  Each thread keeps
+ * at most POOL_MAX_RETAINED bytes around. */
+#define POOL_MIN_SHIFT 12
+#define POOL_MAX_SHIFT 20
+#define POOL_N_CLASSES (POOL_MAX_SHIFT - POOL_MIN_SHIFT + 1)
+#define POOL_MAX_RETAINED ((size_t)4 << 20)
+
+struct pooled_buffer {
+    struct pooled_buffer *next;
+};
+
+static __thread struct {
+    struct pooled_buffer *free_list[POOL_N_CLASSES];
+    size_t retained;
+} pool;
+
+static ALWAYS_INLINE int pool_class(size_t capacity)
+{
+    const int shift = (int)(sizeof(unsigned long) * CHAR_BIT) - 1 -
+                      __builtin_clzl((unsigned long)capacity);
+
+    if (shift < POOL_MIN_SHIFT || shift > POOL_MAX_SHIFT)
+        return -1;
+
+    return shift - POOL_MIN_SHIFT;
+}
+
+static char *pool_take(size_t aligned_size)
+{
+    const int class = pool_class(aligned_size);
+
+    if (class >= 0) {
+        struct pooled_buffer *buffer = pool.free_list[class];
+
+        if (buffer) {
+            pool.free_list[class] = buffer->next;
+            pool.retained -= aligned_size;
+            return (char *)buffer;
+        }
+    }
+
+    return NULL;
+}
+
+static char *buffer_alloc(size_t aligned_size)
+{
+    char *buffer = pool_take(aligned_size);
+
+    return buffer ? buffer : malloc(aligned_size);
+}
+
+static void buffer_free(char *buffer, size_t capacity)
+{
+    const int class = pool_class(capacity);
+
+    if (class >= 0) {
+        const size_t class_size = (size_t)1 << (class + POOL_MIN_SHIFT);
+
+        /* Capacities are usually powers of two already, but rounding down
+         * to a size class keeps this correct even if they aren't. */
+        if (pool.retained + class_size <= POOL_MAX_RETAINED) {
+            struct pooled_buffer *pooled = (struct pooled_buffer *)buffer;
+
+            pooled->next = pool.free_list[class];
+            pool.free_list[class] = pooled;
+            pool.retained += class_size;
+            return;
+        }
+    }
+
+    free(buffer);
+}
+
+void lwan_strbuf_pool_drain(void)
+{
+    for (int class = 0; class < POOL_N_CLASSES; class++) {
+        struct pooled_buffer *buffer = pool.free_list[class];
+
+        while (buffer) {
+            struct pooled_buffer *next = buffer->next;
+
+            free(buffer);
+            buffer = next;
+        }
+
+        pool.free_list[class] = NULL;
+    }
+
+    pool.retained = 0;
+}
+
+char *lwan_strbuf_pool_alloc(size_t size)
+{
+    assert(size && !(size & (size - 1)));
+    return buffer_alloc(size);
+}
+
+void lwan_strbuf_pool_free(char *buffer, size_t size)
+{
+    buffer_free(buffer, size);
+}
+
 static inline size_t align_size(size_t unaligned_size)
 {
     const size_t aligned_size = lwan_nextpow2(unaligned_size);
@@ -66,7 +176,7 @@ bool grow_buffer_if_needed_internal(struct lwan_strbuf *s, size_t size)
         if (UNLIKELY(!aligned_size))
             return false;
 
-        char *buffer = malloc(aligned_size);
+        char *buffer = buffer_alloc(aligned_size);
         if (UNLIKELY(!buffer))
             return false;
 
@@ -90,13 +200,16 @@ bool grow_buffer_if_needed_internal(struct lwan_strbuf *s, size_t size)
         if (s->used == 0) {
             /* Avoid memcpy() inside realloc() if we were not using the
              * allocated buffer at this point.  */
-            buffer = malloc(aligned_size);
+            buffer = buffer_alloc(aligned_size);
 
             if (UNLIKELY(!buffer))
                 return false;
 
-            free(s->buffer);
+            buffer_free(s->buffer, s->capacity);
             buffer[0] = '\0';
+        } else if ((buffer = pool_take(aligned_size))) {
+            memcpy(buffer, s->buffer, s->used + 1);
+            buffer_free(s->buffer, s->capacity);
         } else {
             buffer = realloc(s->buffer, aligned_size);
 
@@ -223,7 +336,7 @@ void lwan_strbuf_free(struct lwan_strbuf *s)
         return;
     if (s->flags & BUFFER_MALLOCD) {
         assert(!(s->flags & BUFFER_FIXED));
-        free(s->buffer);
+        buffer_free(s->buffer, s->capacity);
     }
     if (s->flags & STRBUF_MALLOCD)
         free(s);
@@ -261,7 +374,7 @@ bool lwan_strbuf_append_str(struct lwan_strbuf *s1, const char *s2, size_t sz)
 bool lwan_strbuf_set_static(struct lwan_strbuf *s1, const char *s2, size_t sz)
 {
     if (s1->flags & BUFFER_MALLOCD)
-        free(s1->buffer);
+        buffer_free(s1->buffer, s1->capacity);
 
     s1->buffer = (char *)s2;
     s1->used = s1->capacity = sz;
@@ -364,7 +477,7 @@ void lwan_strbuf_reset(struct lwan_strbuf *s)
 void lwan_strbuf_reset_trim(struct lwan_strbuf *s, size_t trim_thresh)
 {
     if (s->flags & BUFFER_MALLOCD && s->capacity > trim_thresh) {
-        free(s->buffer);
+        buffer_free(s->buffer, s->capacity);
         s->flags &= ~BUFFER_MALLOCD;
     }
 
@@ -0,0 +1,354 @@
+/*
+ * lwan - web server
+ * Copyright (c) 2024 L. A. F. Pereira <l@tia.mat.br>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301,
+ * USA.
+ */
+
+#define _GNU_SOURCE
+#include <assert.h>
+#include <pthread.h>
+#include <stdlib.h>
+
+#include "list.h"
+#include "lwan-private.h"
+#include "lwan-sync.h"
+
+/* Lives in the stack of the coroutine that's waiting.  Wakers take it off
+ * the queue and set `woken` with the lock of the primitive held, so it
+ * must not be touched after that lock is released. */
+struct waiter {
+    struct list_node node;
+    struct lwan_connection *conn;
+    pthread_mutex_t *lock;
+    struct list_head *queue;
+    bool woken;
+};
+
+struct lwan_mutex {
+    pthread_mutex_t lock;
+    struct list_head waiters;
+    bool locked;
+};
+
+struct lwan_wait_group {
+    pthread_mutex_t lock;
+    struct list_head waiters;
+    unsigned int count;
+};
+
+struct lwan_chan {
+    pthread_mutex_t lock;
+    struct list_head senders;
+    struct list_head receivers;
+    size_t head;
+    size_t count;
+    size_t capacity;
+    bool closed;
+    void *values[];
+};
+
+/* Must be called with the lock of the primitive held. */
+static void wake_one(struct list_head *queue)
+{
+    struct waiter *waiter = list_pop(queue, struct waiter, node);
+
+    if (waiter) {
+        struct lwan_connection *conn = waiter->conn;
+
+        __atomic_store_n(&waiter->woken, true, __ATOMIC_RELEASE);
+        lwan_thread_wake_conn(conn);
+    }
+}
+
+static void wake_all(struct list_head *queue)
+{
+    while (!list_empty(queue))
+        wake_one(queue);
+}
+
+static void abandon_wait(void *data)
+{
+    struct waiter *waiter = data;
+
+    /* The coroutine is going away while waiting (e.g. the connection has
+     * been closed).  If it had already been woken up, whatever it was woken
+     * up for (e.g. the mutex being available) is passed on to the next
+     * waiter, as this one won't make use of it. */
+    pthread_mutex_lock(waiter->lock);
+    if (waiter->woken)
+        wake_one(waiter->queue);
+    else
+        list_del_from(waiter->queue, &waiter->node);
+    pthread_mutex_unlock(waiter->lock);
+}
+
+/* Must be called with @lock held, which is released while waiting and
+ * held again once this returns.  Callers check whatever they were waiting
+ * for again, as something else might have gotten to it first. */
+static void wait_on(struct lwan_request *request,
+                    pthread_mutex_t *lock,
+                    struct list_head *queue)
+{
+    struct lwan_connection *conn = request->conn;
+    struct waiter waiter = {
+        .conn = conn,
+        .lock = lock,
+        .queue = queue,
+    };
+    coro_deferred defer = coro_defer(conn->coro, abandon_wait, &waiter);
+
+    list_add_tail(queue, &waiter.node);
+    pthread_mutex_unlock(lock);
+
+    for (bool keep_events = true;
+         !__atomic_load_n(&waiter.woken, __ATOMIC_ACQUIRE);
+         keep_events = false) {
+        lwan_thread_park_conn(request, keep_events);
+    }
+
+    coro_defer_disarm(conn->coro, defer);
+    pthread_mutex_lock(lock);
+}
+
+struct lwan_mutex *lwan_mutex_new(void)
+{
+    struct lwan_mutex *mutex = malloc(sizeof(*mutex));
+
+    if (!mutex)
+        return NULL;
+
+    pthread_mutex_init(&mutex->lock, NULL);
+    list_head_init(&mutex->waiters);
+    mutex->locked = false;
+
+    return mutex;
+}
+
+void lwan_mutex_free(struct lwan_mutex *mutex)
+{
+    if (!mutex)
+        return;
+
+    assert(list_empty(&mutex->waiters));
+    pthread_mutex_destroy(&mutex->lock);
+    free(mutex);
+}
+
+void lwan_mutex_lock(struct lwan_request *request, struct lwan_mutex *mutex)
+{
+    pthread_mutex_lock(&mutex->lock);
+    while (mutex->locked)
+        wait_on(request, &mutex->lock, &mutex->waiters);
+    mutex->locked = true;
+    pthread_mutex_unlock(&mutex->lock);
+}
+
+bool lwan_mutex_trylock(struct lwan_mutex *mutex)
+{
+    bool locked;
+
+    pthread_mutex_lock(&mutex->lock);
+    locked = !mutex->locked;
+    mutex->locked = true;
+    pthread_mutex_unlock(&mutex->lock);
+
+    return locked;
+}
+
+void lwan_mutex_unlock(struct lwan_mutex *mutex)
+{
+    pthread_mutex_lock(&mutex->lock);
+    assert(mutex->locked);
+    mutex->locked = false;
+    wake_one(&mutex->waiters);
+    pthread_mutex_unlock(&mutex->lock);
+}
+
+struct lwan_wait_group *lwan_wait_group_new(void)
+{
+    struct lwan_wait_group *wg = malloc(sizeof(*wg));
+
+    if (!wg)
+        return NULL;
+
+    pthread_mutex_init(&wg->lock, NULL);
+    list_head_init(&wg->waiters);
+    wg->count = 0;
+
+    return wg;
+}
+
+void lwan_wait_group_free(struct lwan_wait_group *wg)
+{
+    if (!wg)
+        return;
+
+    assert(list_empty(&wg->waiters));
+    pthread_mutex_destroy(&wg->lock);
+    free(wg);
+}
+
+void lwan_wait_group_add(struct lwan_wait_group *wg, unsigned int n)
+{
+    pthread_mutex_lock(&wg->lock);
+    wg->count += n;
+    pthread_mutex_unlock(&wg->lock);
+}
+
+void lwan_wait_group_done(struct lwan_wait_group *wg)
+{
+    pthread_mutex_lock(&wg->lock);
+    assert(wg->count > 0);
+    if (!--wg->count)
+        wake_all(&wg->waiters);
+    pthread_mutex_unlock(&wg->lock);
+}
+
+void lwan_wait_group_wait(struct lwan_request *request,
+                          struct lwan_wait_group *wg)
+{
+    pthread_mutex_lock(&wg->lock);
+    while (wg->count)
+        wait_on(request, &wg->lock, &wg->waiters);
+    pthread_mutex_unlock(&wg->lock);
+}
+
+struct lwan_chan *lwan_chan_new(size_t capacity)
+{
+    struct lwan_chan *chan;
+
+    if (!capacity)
+        capacity = 1;
+
+    chan = malloc(sizeof(*chan) + capacity * sizeof(chan->values[0]));
+    if (!chan)
+        return NULL;
+
+    pthread_mutex_init(&chan->lock, NULL);
+    list_head_init(&chan->senders);
+    list_head_init(&chan->receivers);
+    chan->head = 0;
+    chan->count = 0;
+    chan->capacity = capacity;
+    chan->closed = false;
+
+    return chan;
+}
+
+void lwan_chan_free(struct lwan_chan *chan)
+{
+    if (!chan)
+        return;
+
+    assert(list_empty(&chan->senders));
+    assert(list_empty(&chan->receivers));
+    pthread_mutex_destroy(&chan->lock);
+    free(chan);
+}
+
+void lwan_chan_close(struct lwan_chan *chan)
+{
+    pthread_mutex_lock(&chan->lock);
+    chan->closed = true;
+    wake_all(&chan->senders);
+    wake_all(&chan->receivers);
+    pthread_mutex_unlock(&chan->lock);
+}
+
+/* Both must be called with the lock held, and with room for (or something
+ * to get out of) the queue. */
+static void chan_push(struct lwan_chan *chan, void *value)
+{
+    chan->values[(chan->head + chan->count) % chan->capacity] = value;
+    chan->count++;
+    wake_one(&chan->receivers);
+}
+
+static void *chan_pop(struct lwan_chan *chan)
+{
+    void *value = chan->values[chan->head];
+
+    chan->head = (chan->head + 1) % chan->capacity;
+    chan->count--;
+    wake_one(&chan->senders);
+
+    return value;
+}
+
+bool lwan_chan_send(struct lwan_request *request,
+                    struct lwan_chan *chan,
+                    void *value)
+{
+    bool sent = false;
+
+    pthread_mutex_lock(&chan->lock);
+    while (!chan->closed && chan->count == chan->capacity)
+        wait_on(request, &chan->lock, &chan->senders);
+    if (!chan->closed) {
+        chan_push(chan, value);
+        sent = true;
+    }
+    pthread_mutex_unlock(&chan->lock);
+
+    return sent;
+}
+
+bool lwan_chan_try_send(struct lwan_chan *chan, void *value)
+{
+    bool sent = false;
+
+    pthread_mutex_lock(&chan->lock);
+    if (!chan->closed && chan->count < chan->capacity) {
+        chan_push(chan, value);
+        sent = true;
+    }
+    pthread_mutex_unlock(&chan->lock);
+
+    return sent;
+}
+
+bool lwan_chan_recv(struct lwan_request *request,
+                    struct lwan_chan *chan,
+                    void **value)
+{
+    bool received = false;
+
+    pthread_mutex_lock(&chan->lock);
+    while (!chan->closed && !chan->count)
+        wait_on(request, &chan->lock, &chan->receivers);
+    if (chan->count) {
+        *value = chan_pop(chan);
+        received = true;
+    }
+    pthread_mutex_unlock(&chan->lock);
+
+    return received;
+}
+
+bool lwan_chan_try_recv(struct lwan_chan *chan, void **value)
+{
+    bool received = false;
+
+    pthread_mutex_lock(&chan->lock);
+    if (chan->count) {
+        *value = chan_pop(chan);
+        received = true;
+    }
+    pthread_mutex_unlock(&chan->lock);
+
+    return received;
+}
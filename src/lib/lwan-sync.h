@@ -0,0 +1,73 @@
+/*
+ * lwan - web server
+ * Copyright (c) 2024 L. A. F. Pereira <l@tia.mat.br>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301,
+ * USA.
+ */
+
+#pragma once
+
+#include "lwan.h"
+
+/* Synchronization between request coroutines, whether they're running in
+ * the same I/O thread or not.  Waiting parks the coroutine of the request
+ * without blocking its thread; waking up a coroutine running in the same
+ * thread doesn't need any system call, and one running in another thread
+ * is woken up through an eventfd watched by that thread.  Like any other
+ * coroutine that's waiting for something, a parked one is still subject to
+ * the keep-alive timeout.
+ *
+ * Functions that don't take a request never wait, and can also be called
+ * from threads other than the I/O threads (e.g. a job started with
+ * lwan_job_run_task()). */
+
+struct lwan_mutex;
+struct lwan_wait_group;
+struct lwan_chan;
+
+struct lwan_mutex *lwan_mutex_new(void);
+void lwan_mutex_free(struct lwan_mutex *mutex);
+void lwan_mutex_lock(struct lwan_request *request, struct lwan_mutex *mutex);
+bool lwan_mutex_trylock(struct lwan_mutex *mutex);
+void lwan_mutex_unlock(struct lwan_mutex *mutex);
+
+struct lwan_wait_group *lwan_wait_group_new(void);
+void lwan_wait_group_free(struct lwan_wait_group *wg);
+void lwan_wait_group_add(struct lwan_wait_group *wg, unsigned int n);
+void lwan_wait_group_done(struct lwan_wait_group *wg);
+/* Waits until lwan_wait_group_done() has been called once for every
+ * unit added with lwan_wait_group_add(). */
+void lwan_wait_group_wait(struct lwan_request *request,
+                          struct lwan_wait_group *wg);
+
+/* Channels are bounded queues of pointers; @capacity is at least 1. */
+struct lwan_chan *lwan_chan_new(size_t capacity);
+void lwan_chan_free(struct lwan_chan *chan);
+/* Wakes up everybody waiting on @chan; sending fails from then on, but
+ * whatever is queued can still be received. */
+void lwan_chan_close(struct lwan_chan *chan);
+
+/* Waits while the channel is full.  Returns false if it's been closed. */
+bool lwan_chan_send(struct lwan_request *request,
+                    struct lwan_chan *chan,
+                    void *value);
+/* Waits while the channel is empty.  Returns false if it's been closed
+ * and there's nothing left to receive. */
+bool lwan_chan_recv(struct lwan_request *request,
+                    struct lwan_chan *chan,
+                    void **value);
+bool lwan_chan_try_send(struct lwan_chan *chan, void *value);
+bool lwan_chan_try_recv(struct lwan_chan *chan, void **value);
@@ -126,20 +126,28 @@ LWAN_SELF_TEST(status_codes)
 #undef ASSERT_STATUS
 }
 
-static ALWAYS_INLINE const char *bsearch_mime_type(uint64_t ext)
+static ALWAYS_INLINE const char *lookup_mime_type(uint64_t ext)
 {
-    /* Based on https://orlp.net/blog/bitwise-binary-search/ */
-    int64_t b = ext > mime_extensions[MIME_ENTRIES / 2]
-                    ? MIME_ENTRIES - MIME_ENTRIES_FLOOR
-                    : -1;
-    for (uint64_t bit = MIME_ENTRIES_FLOOR >> 1; bit != 0; bit >>= 1) {
-        if (ext > mime_extensions[b + (int64_t)bit])
-            b += (int64_t)bit;
-    }
-    return mime_types[mime_extensions[b + 1] == ext ? b + 1
+    /* mimegen stores entries in the order given by a minimal perfect hash
+     * function, so a single comparison tells if the extension is known. */
+    const uint32_t index = mime_perfect_hash(ext);
+
+    return mime_types[mime_extensions[index] == ext ? index
                                                     : MIME_ENTRY_FALLBACK];
 }
 
+bool lwan_is_compressible_mime_type(const char *mime_type)
+{
+    if (streq(mime_type, "image/svg+xml"))
+        return true;
+
+    /* Media files are already compressed. */
+    return strncmp(mime_type, "image/", 6) && strncmp(mime_type, "video/", 6) &&
+           strncmp(mime_type, "audio/", 6) &&
+           !streq(mime_type, "application/zip") &&
+           !streq(mime_type, "application/gzip");
+}
+
 const char *lwan_determine_mime_type_for_file_name(const char *file_name)
 {
     const char *last_dot = strrchr(file_name, '.') ?: MIME_EXT_FALLBACK;
@@ -150,11 +158,11 @@ const char *lwan_determine_mime_type_for_file_name(const char *file_name)
     /* Data is stored with NULs on strings up to 7 chars, and
      * no NULs for 8-char strings, because that's implicit.
      * So truncation is intentional here: comparisons in
-     * bsearch_mime_type() always loads keys as uint64_ts. */
+     * lookup_mime_type() always loads keys as uint64_ts. */
     strncpy((char *)&key, last_dot + 1, 8);
 #pragma GCC diagnostic pop
 
-    return bsearch_mime_type(htobe64(key & ~0x2020202020202020ull));
+    return lookup_mime_type(htobe64(key & ~0x2020202020202020ull));
 }
 
 #include "lookup-http-status.h" /* genrated by statuslookupgen */
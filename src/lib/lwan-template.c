@@ -55,6 +55,11 @@
 
 #define LEXEME_MAX_LEN 64
 
+/* When applying a template to a chain, text chunks at least this large
+ * are referenced rather than copied; smaller ones are cheaper to copy than
+ * to send as separate iovecs. */
+#define MIN_BORROWED_CHUNK_SIZE 256
+
 enum action {
     ACTION_APPEND,
     ACTION_APPEND_SMALL,
@@ -871,32 +876,27 @@ static void *parser_text(struct parser *parser, struct lexeme *lexeme)
         return parser_meta;
 
     if (lexeme->type == LEXEME_TEXT) {
-        if (lexeme->value.len > 4 * sizeof(void *)) {
+        if (lexeme->value.len > sizeof(void *)) {
             struct lwan_strbuf *buf = lwan_strbuf_from_lexeme(parser, lexeme);
             if (!buf)
                 return error_lexeme(lexeme, "Out of memory");
 
             emit_chunk(parser, ACTION_APPEND, 0, buf);
         } else {
-            struct lexeme copy = *lexeme;
-
-            while (copy.value.len) {
-                const size_t len = LWAN_MIN(sizeof(void *), copy.value.len);
-                uintptr_t tmp = 0;
+            uintptr_t tmp = 0;
 
+            /* Text that fits in a pointer is stored inline in the chunk;
+             * anything longer goes through a single ACTION_APPEND, so each
+             * run of text costs exactly one dispatch while rendering. */
 #pragma GCC diagnostic push
 #pragma GCC diagnostic ignored "-Wstringop-truncation"
-                /* strnlen(..., sizeof(void*)) is used for APPEND_SMALL,
-                 * so it's fine if no NUL is generated for strings with
-                 * sizeof(void *) characters. */
-                strncpy((char *)&tmp, copy.value.value, len);
+            /* strnlen(..., sizeof(void*)) is used for APPEND_SMALL,
+             * so it's fine if no NUL is generated for strings with
+             * sizeof(void *) characters. */
+            strncpy((char *)&tmp, lexeme->value.value, lexeme->value.len);
 #pragma GCC diagnostic pop
 
-                emit_chunk(parser, ACTION_APPEND_SMALL, 0, (void *)tmp);
-
-                copy.value.len -= len;
-                copy.value.value += len;
-            }
+            emit_chunk(parser, ACTION_APPEND_SMALL, 0, (void *)tmp);
         }
         parser->tpl->minimum_size += lexeme->value.len;
         return parser_text;
@@ -946,21 +946,11 @@ void lwan_append_str_to_strbuf(struct lwan_strbuf *buf, void *ptr)
 }
 
 #if __x86_64__
-#include <emmintrin.h>
+#include <immintrin.h>
 #endif
 
 static ALWAYS_INLINE int escaped_index(char ch)
 {
-#if __x86_64__
-    /* FIXME: instead of calling escaped_index() for each byte that needs to be
-     * escaped, use SIMD to leap through input string until an escapable character
-     * is found. */
-    const __m128i ch_mask = _mm_set1_epi8(ch);
-    const __m128i escapable =
-        _mm_set_epi8(0, 0, 0, 0, 0, 0, 0, 0, 0, 0, '<', '>', '&', '"', '\'', '/');
-
-    return __builtin_ffs(_mm_movemask_epi8(_mm_cmpeq_epi8(ch_mask, escapable)));
-#else
     switch (ch) {
     default:
         return 0;
@@ -977,8 +967,96 @@ static ALWAYS_INLINE int escaped_index(char ch)
     case '<':
         return 6;
     }
+}
+
+static ALWAYS_INLINE const char *find_escapable_portable(const char *p,
+                                                        const char *end)
+{
+    for (; p < end; p++) {
+        if (escaped_index(*p))
+            break;
+    }
+
+    return p;
+}
+
+#if __x86_64__
+static ALWAYS_INLINE int block_mask_escapable_sse2(const char *p)
+{
+    const __m128i block = _mm_loadu_si128((const __m128i *)p);
+    __m128i eq = _mm_cmpeq_epi8(block, _mm_set1_epi8('<'));
+
+    eq = _mm_or_si128(eq, _mm_cmpeq_epi8(block, _mm_set1_epi8('>')));
+    eq = _mm_or_si128(eq, _mm_cmpeq_epi8(block, _mm_set1_epi8('&')));
+    eq = _mm_or_si128(eq, _mm_cmpeq_epi8(block, _mm_set1_epi8('"')));
+    eq = _mm_or_si128(eq, _mm_cmpeq_epi8(block, _mm_set1_epi8('\'')));
+    eq = _mm_or_si128(eq, _mm_cmpeq_epi8(block, _mm_set1_epi8('/')));
+
+    return _mm_movemask_epi8(eq);
+}
+
+static const char *find_escapable_sse2(const char *p, const char *end)
+{
+    for (; end - p >= 16; p += 16) {
+        const int mask = block_mask_escapable_sse2(p);
+
+        if (mask)
+            return p + __builtin_ctz((unsigned int)mask);
+    }
+
+    return find_escapable_portable(p, end);
+}
+
+#if defined(LWAN_HAVE_BUILTIN_CPU_INIT)
+__attribute__((target("avx2"))) static ALWAYS_INLINE uint32_t
+block_mask_escapable_avx2(const char *p)
+{
+    const __m256i block = _mm256_loadu_si256((const __m256i *)p);
+    __m256i eq = _mm256_cmpeq_epi8(block, _mm256_set1_epi8('<'));
+
+    eq = _mm256_or_si256(eq, _mm256_cmpeq_epi8(block, _mm256_set1_epi8('>')));
+    eq = _mm256_or_si256(eq, _mm256_cmpeq_epi8(block, _mm256_set1_epi8('&')));
+    eq = _mm256_or_si256(eq, _mm256_cmpeq_epi8(block, _mm256_set1_epi8('"')));
+    eq = _mm256_or_si256(eq, _mm256_cmpeq_epi8(block, _mm256_set1_epi8('\'')));
+    eq = _mm256_or_si256(eq, _mm256_cmpeq_epi8(block, _mm256_set1_epi8('/')));
+
+    return (uint32_t)_mm256_movemask_epi8(eq);
+}
+
+__attribute__((target("avx2"))) static const char *
+find_escapable_avx2(const char *p, const char *end)
+{
+    for (; end - p >= 32; p += 32) {
+        const uint32_t mask = block_mask_escapable_avx2(p);
+
+        if (mask)
+            return p + __builtin_ctz(mask);
+    }
+
+    return find_escapable_sse2(p, end);
+}
 #endif
+#endif
+
+/* Returns a pointer to the first character between @p and @end that has to
+ * be escaped, or @end if there's none.  Vectorized versions leap through the
+ * input one block at a time, so runs of text that don't need escaping are
+ * appended with a single call. */
+static const char *(*find_escapable)(const char *p, const char *end) =
+#if __x86_64__
+    find_escapable_sse2;
+#else
+    find_escapable_portable;
+#endif
+
+#if __x86_64__ && defined(LWAN_HAVE_BUILTIN_CPU_INIT)
+__attribute__((constructor)) static void select_escape_routines(void)
+{
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        find_escapable = find_escapable_avx2;
 }
+#endif
 
 void lwan_append_str_escaped_to_strbuf(struct lwan_strbuf *buf, void *ptr)
 {
@@ -999,20 +1077,19 @@ void lwan_append_str_escaped_to_strbuf(struct lwan_strbuf *buf, void *ptr)
     if (UNLIKELY(!str))
         return;
 
-    const char *last, *p;
-    for (last = p = str; *p; p++) {
-        int index = escaped_index(*p);
+    const char *end = str + strlen(str);
+    while (true) {
+        const char *p = find_escapable(str, end);
 
-        if (index) {
-            lwan_strbuf_append_str(buf, last, (size_t)(p - last));
-            last = p + 1;
+        if (p != str)
+            lwan_strbuf_append_str(buf, str, (size_t)(p - str));
+        if (p == end)
+            break;
 
-            lwan_strbuf_append_str(buf, escaped[index].value, escaped[index].len);
-        }
+        const int index = escaped_index(*p);
+        lwan_strbuf_append_str(buf, escaped[index].value, escaped[index].len);
+        str = p + 1;
     }
-
-    if (last != p)
-        lwan_strbuf_append_str(buf, last, (size_t)(p - last));
 }
 
 bool lwan_tpl_str_is_empty(void *ptr)
@@ -1492,9 +1569,21 @@ bake_direct_addresses(struct lwan_tpl *tpl,
 }
 
 
+/* Amount of rendered output buffered by lwan_tpl_apply_chunked() before
+ * it's sent to the client as a chunk. */
+#define TPL_CHUNKED_FLUSH_THRESHOLD 16384
+
+struct tpl_flush {
+    void (*callback)(struct lwan_strbuf *buf, void *data);
+    void *data;
+    size_t threshold;
+};
+
 static const struct chunk *apply(struct lwan_tpl *tpl,
                                  const struct chunk *chunks,
                                  struct lwan_strbuf *buf,
+                                 struct lwan_chain *chain,
+                                 const struct tpl_flush *flush,
                                  void *variables,
                                  const void *data)
 {
@@ -1546,6 +1635,15 @@ static const struct chunk *apply(struct lwan_tpl *tpl,
         goto *chunk->instruction;                                              \
     } while (false)
 
+/* When streaming, the buffer is handed over to the flush callback once it
+ * grows past the threshold.  This is only checked between loop iterations,
+ * where output tends to pile up. */
+#define MAYBE_FLUSH()                                                          \
+    do {                                                                       \
+        if (flush && lwan_strbuf_get_length(buf) >= flush->threshold)          \
+            flush->callback(buf, flush->data);                                 \
+    } while (false)
+
 #define DISPATCH_ACTION_FAST() DISPATCH_ACTION(0 &&)
 #define DISPATCH_ACTION_CHECK() DISPATCH_ACTION(1 &&)
 #define DISPATCH_NEXT_ACTION_FAST() DISPATCH_NEXT_ACTION(0 &&)
@@ -1553,10 +1651,19 @@ static const struct chunk *apply(struct lwan_tpl *tpl,
 
     DISPATCH_ACTION_FAST();
 
-action_append:
-    lwan_strbuf_append_str(buf, lwan_strbuf_get_buffer(chunk->data),
-                           lwan_strbuf_get_length(chunk->data));
-    DISPATCH_NEXT_ACTION_FAST();
+action_append: {
+        const char *text = lwan_strbuf_get_buffer(chunk->data);
+        size_t len = lwan_strbuf_get_length(chunk->data);
+
+        if (chain && len >= MIN_BORROWED_CHUNK_SIZE) {
+            if (UNLIKELY(!lwan_chain_append_borrowed(chain, text, len)))
+                return NULL;
+        } else {
+            lwan_strbuf_append_str(buf, text, len);
+        }
+
+        DISPATCH_NEXT_ACTION_FAST();
+    }
 
 action_append_small: {
         uintptr_t val = (uintptr_t)chunk->data;
@@ -1613,7 +1720,8 @@ action_if_variable_not_empty: {
             chunk = cd->chunk;
             DISPATCH_NEXT_ACTION_FAST();
         } else {
-            chunk = apply(tpl, chunk + 1, buf, variables, cd->chunk);
+            chunk = apply(tpl, chunk + 1, buf, chain, flush, variables,
+                          cd->chunk);
             DISPATCH_NEXT_ACTION_CHECK();
         }
     }
@@ -1628,7 +1736,7 @@ action_apply_tpl: {
 
         if (LIKELY(lwan_strbuf_grow_by(buf, inner_tpl->minimum_size))) {
             if (!apply(inner_tpl, chunk_array_get_array(&inner_tpl->chunks),
-                       buf, variables, NULL)) {
+                       buf, chain, flush, variables, NULL)) {
                 lwan_status_warning("Could not apply subtemplate");
                 return NULL;
             }
@@ -1669,7 +1777,14 @@ action_start_iter:
         DISPATCH_NEXT_ACTION_FAST();
     }
 
-    chunk = apply(tpl, chunk + 1, buf, variables, chunk);
+    if (negate) {
+        /* The generator has already returned, and the body of a negated
+         * iteration is applied only once: there's nothing to resume */
+        coro_free(coro);
+        coro = NULL;
+    }
+
+    chunk = apply(tpl, chunk + 1, buf, chain, flush, variables, chunk);
     DISPATCH_ACTION_CHECK();
 
 action_end_iter:
@@ -1684,14 +1799,19 @@ action_end_iter:
         DISPATCH_NEXT_ACTION_FAST();
     }
 
+    /* Long lists shouldn't keep other connections from being served */
+    lwan_yield_if_time_slice_expired();
+
     if (!coro_resume_value(coro, 0)) {
         coro_free(coro);
         coro = NULL;
         DISPATCH_NEXT_ACTION_FAST();
     }
 
-    chunk = apply(tpl, ((struct chunk *)chunk->data) + 1, buf, variables,
-                  chunk->data);
+    MAYBE_FLUSH();
+
+    chunk = apply(tpl, ((struct chunk *)chunk->data) + 1, buf, chain, flush,
+                  variables, chunk->data);
     DISPATCH_ACTION_CHECK();
 
 finalize:
@@ -1703,6 +1823,7 @@ finalize:
 #undef DISPATCH_ACTION_FAST
 #undef DISPATCH_NEXT_ACTION_FAST
 #undef RETURN_IF_NO_CHUNK
+#undef MAYBE_FLUSH
 }
 
 bool lwan_tpl_apply_with_buffer(struct lwan_tpl *tpl,
@@ -1714,9 +1835,68 @@ bool lwan_tpl_apply_with_buffer(struct lwan_tpl *tpl,
     if (UNLIKELY(!lwan_strbuf_grow_to(buf, tpl->minimum_size)))
         return false;
 
-    if (!apply(tpl, tpl->chunks.base.base, buf, variables, NULL))
+    if (!apply(tpl, tpl->chunks.base.base, buf, NULL, NULL, variables, NULL))
+        return false;
+
+    return true;
+}
+
+bool lwan_tpl_apply_with_chain(struct lwan_tpl *tpl,
+                               struct lwan_chain *chain,
+                               void *variables)
+{
+    lwan_strbuf_reset(chain->buffer);
+    lwan_chain_reset(chain);
+
+    return apply(tpl, tpl->chunks.base.base, chain->buffer, chain, NULL,
+                 variables, NULL) != NULL;
+}
+
+bool lwan_tpl_apply_with_flush(struct lwan_tpl *tpl,
+                               struct lwan_strbuf *buf,
+                               void *variables,
+                               size_t threshold,
+                               void (*flush)(struct lwan_strbuf *buf,
+                                             void *data),
+                               void *flush_data)
+{
+    const struct tpl_flush tpl_flush = {
+        .callback = flush,
+        .data = flush_data,
+        .threshold = threshold,
+    };
+
+    lwan_strbuf_reset(buf);
+
+    if (UNLIKELY(!lwan_strbuf_grow_to(buf, LWAN_MIN(tpl->minimum_size,
+                                                    threshold))))
         return false;
 
+    return apply(tpl, tpl->chunks.base.base, buf, NULL, &tpl_flush, variables,
+                 NULL) != NULL;
+}
+
+static void flush_response_chunk(struct lwan_strbuf *buf, void *data)
+{
+    lwan_response_send_chunk_full(data, buf);
+}
+
+bool lwan_tpl_apply_chunked(struct lwan_tpl *tpl,
+                            struct lwan_request *request,
+                            void *variables)
+{
+    struct lwan_strbuf *buf = request->response.buffer;
+
+    if (!lwan_tpl_apply_with_flush(tpl, buf, variables,
+                                   TPL_CHUNKED_FLUSH_THRESHOLD,
+                                   flush_response_chunk, request))
+        return false;
+
+    /* An empty chunk would terminate the response; leave that to
+     * lwan_response(). */
+    if (lwan_strbuf_get_length(buf))
+        lwan_response_send_chunk(request);
+
     return true;
 }
 
@@ -19,10 +19,13 @@
  */
 #pragma once
 
+#include "lwan-chain.h"
 #include "lwan-coro.h"
 #include "lwan-strbuf.h"
 #include <stddef.h>
 
+struct lwan_request;
+
 enum lwan_tpl_flag { LWAN_TPL_FLAG_CONST_TEMPLATE = 1 << 0 };
 
 struct lwan_var_descriptor {
@@ -117,4 +120,29 @@ struct lwan_strbuf *lwan_tpl_apply(struct lwan_tpl *tpl, void *variables);
 bool lwan_tpl_apply_with_buffer(struct lwan_tpl *tpl,
                                 struct lwan_strbuf *buf,
                                 void *variables);
+/* Like lwan_tpl_apply_with_buffer(), but larger text chunks are referenced
+ * by the chain instead of being copied to its buffer.  The template must
+ * outlive the chain. */
+bool lwan_tpl_apply_with_chain(struct lwan_tpl *tpl,
+                               struct lwan_chain *chain,
+                               void *variables);
+/* Like lwan_tpl_apply_with_buffer(), but @flush is called with the buffer
+ * whenever it grows past @threshold bytes while iterating, so memory use
+ * stays bounded for large outputs.  The callback is expected to consume and
+ * reset the buffer; whatever is left in it when this returns has not been
+ * flushed yet. */
+bool lwan_tpl_apply_with_flush(struct lwan_tpl *tpl,
+                               struct lwan_strbuf *buf,
+                               void *variables,
+                               size_t threshold,
+                               void (*flush)(struct lwan_strbuf *buf,
+                                             void *data),
+                               void *flush_data);
+/* Renders the template into a chunked response, sending chunks as the
+ * output accumulates instead of buffering all of it first.  Headers are
+ * sent with HTTP_OK if they haven't been already; the handler should
+ * return HTTP_OK afterwards so the last chunk is sent. */
+bool lwan_tpl_apply_chunked(struct lwan_tpl *tpl,
+                            struct lwan_request *request,
+                            void *variables);
 void lwan_tpl_free(struct lwan_tpl *tpl);
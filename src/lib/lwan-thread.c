@@ -20,13 +20,17 @@
 
 #define _GNU_SOURCE
 #include <assert.h>
+#include <dirent.h>
+#include <endian.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <inttypes.h>
 #include <pthread.h>
 #include <sched.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <sys/ioctl.h>
 #include <sys/socket.h>
 #include <unistd.h>
@@ -39,6 +43,9 @@
 #include <mbedtls/entropy.h>
 #include <mbedtls/error.h>
 #include <mbedtls/gcm.h>
+#if defined(MBEDTLS_CHACHAPOLY_C)
+#include <mbedtls/chachapoly.h>
+#endif
 #include <mbedtls/net_sockets.h>
 #include <mbedtls/ssl_internal.h>
 
@@ -48,7 +55,17 @@
 
 #include "list.h"
 #include "lwan-private.h"
+#include "lwan-io-wrappers.h"
 #include "lwan-tq.h"
+#include "lwan-trace.h"
+
+#if defined(LWAN_HAVE_IO_URING)
+#include "lwan-io-uring.h"
+#endif
+
+/* Maximum number of coroutines each worker thread keeps around after their
+ * connections are closed.  Each one holds a whole coroutine stack. */
+#define CORO_POOL_SIZE 128
 
 static void lwan_strbuf_free_defer(void *data)
 {
@@ -155,50 +172,114 @@ uint64_t lwan_request_get_id(struct lwan_request *request)
 }
 
 #if defined(LWAN_HAVE_MBEDTLS)
+#if defined(TLS_CIPHER_CHACHA20_POLY1305) && defined(MBEDTLS_CHACHAPOLY_C)
+#define LWAN_HAVE_KTLS_CHACHA20_POLY1305
+#endif
+
+static const unsigned char *aes_gcm_key(const mbedtls_cipher_context_t *ctx)
+{
+    const mbedtls_gcm_context *gcm_ctx = ctx->cipher_ctx;
+    const mbedtls_aes_context *aes_ctx = gcm_ctx->cipher_ctx.cipher_ctx;
+
+    /* The first round key is the key itself. */
+    return (const unsigned char *)aes_ctx->rk;
+}
+
 static bool
 lwan_setup_tls_keys(int fd, const mbedtls_ssl_context *ssl, int rx_or_tx)
 {
-    struct tls12_crypto_info_aes_gcm_128 info = {
-        .info = {.version = TLS_1_2_VERSION,
-                 .cipher_type = TLS_CIPHER_AES_GCM_128},
-    };
-    const unsigned char *salt, *iv, *rec_seq;
-    const mbedtls_gcm_context *gcm_ctx;
-    const mbedtls_aes_context *aes_ctx;
+    union {
+        struct tls_crypto_info info;
+        struct tls12_crypto_info_aes_gcm_128 aes_gcm_128;
+        struct tls12_crypto_info_aes_gcm_256 aes_gcm_256;
+#if defined(LWAN_HAVE_KTLS_CHACHA20_POLY1305)
+        struct tls12_crypto_info_chacha20_poly1305 chacha20_poly1305;
+#endif
+    } crypto = {.info = {.version = TLS_1_2_VERSION}};
+    const mbedtls_cipher_context_t *cipher_ctx;
+    const unsigned char *salt, *rec_seq;
+    socklen_t crypto_len;
+    bool retval = false;
 
     switch (rx_or_tx) {
     case TLS_RX:
         salt = ssl->transform->iv_dec;
         rec_seq = ssl->in_ctr;
-        gcm_ctx = ssl->transform->cipher_ctx_dec.cipher_ctx;
+        cipher_ctx = &ssl->transform->cipher_ctx_dec;
         break;
     case TLS_TX:
         salt = ssl->transform->iv_enc;
         rec_seq = ssl->cur_out_ctr;
-        gcm_ctx = ssl->transform->cipher_ctx_enc.cipher_ctx;
+        cipher_ctx = &ssl->transform->cipher_ctx_enc;
         break;
     default:
         __builtin_unreachable();
     }
 
-    iv = salt + 4;
-    aes_ctx = gcm_ctx->cipher_ctx.cipher_ctx;
+    /* For AES-GCM, the 4-byte salt is the implicit part of the nonce, and
+     * is followed by the explicit part (RFC5288).  ChaCha20-Poly1305 uses a
+     * 12-byte implicit nonce, XOR'd with the sequence number (RFC7905). */
+    switch (mbedtls_cipher_get_type(cipher_ctx)) {
+    case MBEDTLS_CIPHER_AES_128_GCM:
+        crypto.info.cipher_type = TLS_CIPHER_AES_GCM_128;
+        memcpy(crypto.aes_gcm_128.iv, salt + TLS_CIPHER_AES_GCM_128_SALT_SIZE,
+               TLS_CIPHER_AES_GCM_128_IV_SIZE);
+        memcpy(crypto.aes_gcm_128.rec_seq, rec_seq,
+               TLS_CIPHER_AES_GCM_128_REC_SEQ_SIZE);
+        memcpy(crypto.aes_gcm_128.key, aes_gcm_key(cipher_ctx),
+               TLS_CIPHER_AES_GCM_128_KEY_SIZE);
+        memcpy(crypto.aes_gcm_128.salt, salt, TLS_CIPHER_AES_GCM_128_SALT_SIZE);
+        crypto_len = sizeof(crypto.aes_gcm_128);
+        break;
+
+    case MBEDTLS_CIPHER_AES_256_GCM:
+        crypto.info.cipher_type = TLS_CIPHER_AES_GCM_256;
+        memcpy(crypto.aes_gcm_256.iv, salt + TLS_CIPHER_AES_GCM_256_SALT_SIZE,
+               TLS_CIPHER_AES_GCM_256_IV_SIZE);
+        memcpy(crypto.aes_gcm_256.rec_seq, rec_seq,
+               TLS_CIPHER_AES_GCM_256_REC_SEQ_SIZE);
+        memcpy(crypto.aes_gcm_256.key, aes_gcm_key(cipher_ctx),
+               TLS_CIPHER_AES_GCM_256_KEY_SIZE);
+        memcpy(crypto.aes_gcm_256.salt, salt, TLS_CIPHER_AES_GCM_256_SALT_SIZE);
+        crypto_len = sizeof(crypto.aes_gcm_256);
+        break;
+
+#if defined(LWAN_HAVE_KTLS_CHACHA20_POLY1305)
+    case MBEDTLS_CIPHER_CHACHA20_POLY1305: {
+        const mbedtls_chachapoly_context *chachapoly = cipher_ctx->cipher_ctx;
+
+        crypto.info.cipher_type = TLS_CIPHER_CHACHA20_POLY1305;
+        memcpy(crypto.chacha20_poly1305.iv, salt,
+               TLS_CIPHER_CHACHA20_POLY1305_IV_SIZE);
+        memcpy(crypto.chacha20_poly1305.rec_seq, rec_seq,
+               TLS_CIPHER_CHACHA20_POLY1305_REC_SEQ_SIZE);
+        /* The key is kept in words 4 to 11 of the ChaCha20 state, which
+         * are loaded as little-endian words. */
+        for (int i = 0; i < 8; i++) {
+            const uint32_t word = htole32(chachapoly->chacha20_ctx.state[4 + i]);
+            memcpy(crypto.chacha20_poly1305.key + i * 4, &word, sizeof(word));
+        }
+        crypto_len = sizeof(crypto.chacha20_poly1305);
+        break;
+    }
+#endif
 
-    memcpy(info.iv, iv, TLS_CIPHER_AES_GCM_128_IV_SIZE);
-    memcpy(info.rec_seq, rec_seq, TLS_CIPHER_AES_GCM_128_REC_SEQ_SIZE);
-    memcpy(info.key, aes_ctx->rk, TLS_CIPHER_AES_GCM_128_KEY_SIZE);
-    memcpy(info.salt, salt, TLS_CIPHER_AES_GCM_128_SALT_SIZE);
+    default:
+        lwan_status_error("Cipher %s not supported by kTLS",
+                          mbedtls_cipher_get_name(cipher_ctx));
+        return false;
+    }
 
-    if (UNLIKELY(setsockopt(fd, SOL_TLS, rx_or_tx, &info, sizeof(info)) < 0)) {
+    if (UNLIKELY(setsockopt(fd, SOL_TLS, rx_or_tx, &crypto, crypto_len) < 0)) {
         lwan_status_perror("Could not set %s kTLS keys for fd %d",
                            rx_or_tx == TLS_TX ? "transmission" : "reception",
                            fd);
-        lwan_always_bzero(&info, sizeof(info));
-        return false;
+    } else {
+        retval = true;
     }
 
-    lwan_always_bzero(&info, sizeof(info));
-    return true;
+    lwan_always_bzero(&crypto, sizeof(crypto));
+    return retval;
 }
 
 __attribute__((format(printf, 2, 3)))
@@ -299,12 +380,38 @@ static int lwan_mbedtls_recv(void *ctx, unsigned char *buf, size_t len)
     return (int)r;
 }
 
+static bool lwan_enable_ktls(struct lwan_connection *conn,
+                             int fd,
+                             const mbedtls_ssl_context *ssl)
+{
+    if (UNLIKELY(setsockopt(fd, SOL_TCP, TCP_ULP, "tls", sizeof("tls")) < 0))
+        return false;
+    if (UNLIKELY(!lwan_setup_tls_keys(fd, ssl, TLS_RX)))
+        return false;
+    if (UNLIKELY(!lwan_setup_tls_keys(fd, ssl, TLS_TX)))
+        return false;
+
+#if defined(MBEDTLS_SSL_ALPN)
+    const char *alpn = mbedtls_ssl_get_alpn_protocol(ssl);
+    if (alpn && streq(alpn, "h2"))
+        conn->flags |= CONN_IS_HTTP2;
+#endif
+
+    return true;
+}
+
+static bool lwan_setup_tls_offloaded(const struct lwan *l,
+                                     struct lwan_connection *conn);
+
 static bool lwan_setup_tls(const struct lwan *l, struct lwan_connection *conn)
 {
     mbedtls_ssl_context ssl;
     bool retval = false;
     int r;
 
+    if (l->tls->handshake_pool)
+        return lwan_setup_tls_offloaded(l, conn);
+
     mbedtls_ssl_init(&ssl);
 
     r = mbedtls_ssl_setup(&ssl, &l->tls->config);
@@ -350,14 +457,7 @@ static bool lwan_setup_tls(const struct lwan *l, struct lwan_connection *conn)
     }
 
 enable_tls_ulp:
-    if (UNLIKELY(setsockopt(fd, SOL_TCP, TCP_ULP, "tls", sizeof("tls")) < 0))
-        goto fail;
-    if (UNLIKELY(!lwan_setup_tls_keys(fd, &ssl, TLS_RX)))
-        goto fail;
-    if (UNLIKELY(!lwan_setup_tls_keys(fd, &ssl, TLS_TX)))
-        goto fail;
-
-    retval = true;
+    retval = lwan_enable_ktls(conn, fd, &ssl);
 
 fail:
     coro_defer_disarm(conn->coro, defer);
@@ -445,6 +545,23 @@ shutdown_and_close:
     close(fd);
 }
 
+static void shrink_request_buffer(void *data)
+{
+    lwan_request_buffer_shrink(data);
+}
+
+/* Memory used by a request (in the coroutine arena and for the response)
+ * is kept between requests in the same connection, and only trimmed down
+ * to the most that was needed every this many requests. */
+#define TRIM_INTERVAL 64
+#define MIN_RESPONSE_BUFFER_SIZE 2048
+
+struct high_water {
+    size_t arena;
+    size_t response;
+    unsigned int requests;
+};
+
 __attribute__((noreturn)) static int process_request_coro(struct coro *coro,
                                                           void *data)
 {
@@ -452,6 +569,7 @@ __attribute__((noreturn)) static int process_request_coro(struct coro *coro,
      * instead.  This ensures the storage for `strbuf` is alive when the
      * coroutine ends and lwan_strbuf_free() is called. */
     char *header_start[N_HEADER_START];
+    uint16_t header_index[N_HEADER_INDEX];
     struct lwan_connection *conn = data;
     struct lwan *lwan = conn->thread->lwan;
     int fd = lwan_connection_get_fd(lwan, conn);
@@ -459,15 +577,22 @@ __attribute__((noreturn)) static int process_request_coro(struct coro *coro,
     const size_t request_buffer_size = lwan->config.request_buffer_size;
     const int error_when_n_packets = lwan_calculate_n_packets(request_buffer_size);
     struct lwan_strbuf strbuf = LWAN_STRBUF_STATIC_INIT;
-    struct lwan_value buffer;
+    struct lwan_strbuf queued_responses = LWAN_STRBUF_STATIC_INIT;
+    struct lwan_request_buffer buffer;
     char *next_request = NULL;
     struct lwan_proxy proxy;
+    struct high_water high_water = {};
+    /* Until the first trim, responses can use as much as they need */
+    size_t response_trim = SIZE_MAX;
     size_t init_gen;
 
     coro_defer(coro, lwan_strbuf_free_defer, &strbuf);
+    coro_defer(coro, lwan_strbuf_free_defer, &queued_responses);
 
 #if defined(LWAN_HAVE_MBEDTLS)
-    if (conn->flags & CONN_TLS) {
+    /* A coroutine spawned for a connection that released its previous one
+     * is past the handshake already. */
+    if ((conn->flags & (CONN_TLS | CONN_RELEASED_CORO)) == CONN_TLS) {
         if (UNLIKELY(!lwan_setup_tls(lwan, conn))) {
             coro_yield(conn->coro, CONN_CORO_ABORT);
             __builtin_unreachable();
@@ -476,43 +601,32 @@ __attribute__((noreturn)) static int process_request_coro(struct coro *coro,
 #else
     assert(!(conn->flags & CONN_TLS));
 #endif
+    conn->flags &= ~CONN_RELEASED_CORO;
 
-    if (request_buffer_size > DEFAULT_BUFFER_SIZE) {
-        buffer = (struct lwan_value){
-            .value = coro_malloc(conn->coro, request_buffer_size),
-            .len = request_buffer_size,
-        };
-
-        if (UNLIKELY(!buffer.value)) {
-            /* If CONN_TLS is set at this point, we can send responses just
-             * fine and they'll be encrypted by the kernel.  However,
-             * send_last_response_without_coro() can't send the response if
-             * this bit is set as it has been designed to be used in cases
-             * where coroutines were not created yet.  */
-            conn->flags &= ~CONN_TLS;
-
-            send_last_response_without_coro(lwan, conn, HTTP_UNAVAILABLE);
-
-            coro_yield(conn->coro, CONN_CORO_ABORT);
-            __builtin_unreachable();
-        }
+    if (conn->flags & CONN_IS_HTTP2) {
+        lwan_h2_serve(conn, flags, NULL, 0);
+        __builtin_unreachable();
+    }
 
-        init_gen = 2;
-    } else {
-        buffer = (struct lwan_value){
-            .value = alloca(DEFAULT_BUFFER_SIZE),
-            .len = DEFAULT_BUFFER_SIZE,
-        };
+    buffer = (struct lwan_request_buffer){
+        .value = {.value = alloca(DEFAULT_BUFFER_SIZE)},
+        .size = DEFAULT_BUFFER_SIZE,
+        .max_size = request_buffer_size,
+    };
+    buffer.stack = buffer.value.value;
+    coro_defer(coro, shrink_request_buffer, &buffer);
 
-        init_gen = 1;
-    }
+    init_gen = coro_deferred_get_generation(coro);
 
     while (true) {
         struct lwan_request_parser_helper helper = {
-            .buffer = &buffer,
+            .buffer = &buffer.value,
+            .request_buffer = &buffer,
             .next_request = next_request,
             .error_when_n_packets = error_when_n_packets,
             .header_start = header_start,
+            .header_index = header_index,
+            .queued_responses = &queued_responses,
         };
         struct lwan_request request = {.conn = conn,
                                        .global_response_headers = &lwan->headers,
@@ -523,34 +637,71 @@ __attribute__((noreturn)) static int process_request_coro(struct coro *coro,
                                        .helper = &helper};
 
         lwan_process_request(lwan, &request);
+        conn->thread->stats.requests++;
+
+        next_request = helper.next_request;
+        const bool pipelined = next_request && *next_request &&
+                               (conn->flags & CONN_IS_KEEP_ALIVE);
+
+        /* Responses are only queued while there are more requests in the
+         * buffer, but make sure nothing is left behind if this was the last
+         * one. */
+        if (!pipelined && UNLIKELY(lwan_flush_queued_responses(&request) < 0))
+            break;
 
         /* Run the deferred instructions now (except those used to initialize
          * the coroutine), so that if the connection is gracefully closed,
          * the storage for ``helper'' is still there. */
         coro_deferred_run(coro, init_gen);
 
+        const size_t arena_high_water = coro_malloc_take_high_water(coro);
+        if (UNLIKELY(arena_high_water > conn->thread->stats.arena_high_water))
+            conn->thread->stats.arena_high_water = arena_high_water;
+
+        high_water.arena = LWAN_MAX(high_water.arena, arena_high_water);
+        high_water.response = LWAN_MAX(high_water.response,
+                                       lwan_strbuf_get_allocated_size(&strbuf));
+        if (UNLIKELY(++high_water.requests == TRIM_INTERVAL)) {
+            coro_malloc_trim(coro, high_water.arena);
+            response_trim =
+                LWAN_MAX(high_water.response, (size_t)MIN_RESPONSE_BUFFER_SIZE);
+            high_water = (struct high_water){};
+        }
+
         if (UNLIKELY(!(conn->flags & CONN_IS_KEEP_ALIVE))) {
             graceful_close(lwan, conn);
             break;
         }
 
-        if (next_request && *next_request) {
+        if (pipelined) {
             conn->flags |= CONN_CORK;
 
             if (!(conn->flags & CONN_EVENTS_WRITE))
                 coro_yield(coro, CONN_CORO_WANT_WRITE);
         } else {
             conn->flags &= ~CONN_CORK;
+
+            /* Nothing is left in the request buffer, so the next request
+             * can just as well be read by a new coroutine.  The PROXY
+             * protocol header, however, is only sent once.  */
+            if (lwan->config.release_idle_coros &&
+                !(request.flags & REQUEST_PROXIED)) {
+                coro_yield(coro, CONN_CORO_RELEASE);
+                __builtin_unreachable();
+            }
+
+            lwan_strbuf_reset_trim(&queued_responses, 2048);
+            lwan_request_buffer_shrink(&buffer);
             coro_yield(coro, CONN_CORO_WANT_READ);
         }
 
         /* Ensure string buffer is reset between requests, and that the backing
-         * store isn't over 2KB. */
-        lwan_strbuf_reset_trim(&strbuf, 2048);
+         * store isn't larger than what recent requests needed. */
+        lwan_strbuf_reset_trim(&strbuf, response_trim);
 
         /* Only allow flags from config. */
-        flags = request.flags & (REQUEST_PROXIED | REQUEST_ALLOW_CORS | REQUEST_WANTS_HSTS_HEADER);
-        next_request = helper.next_request;
+        flags = request.flags & (REQUEST_PROXIED | REQUEST_ALLOW_CORS |
+                                 REQUEST_WANTS_HSTS_HEADER | RESPONSE_COMPRESS);
     }
 
     coro_yield(coro, CONN_CORO_ABORT);
@@ -568,13 +719,132 @@ conn_flags_to_epoll_events(enum lwan_connection_flags flags)
     return EPOLL_EVENTS(flags);
 }
 
+static ALWAYS_INLINE int thread_event_ctl(struct lwan_thread *t,
+                                          int op,
+                                          int fd,
+                                          struct epoll_event *event)
+{
+#if defined(LWAN_HAVE_IO_URING)
+    if (t->io_uring)
+        return lwan_io_uring_ctl(t->io_uring, op, fd, event);
+#endif
+    return epoll_ctl(t->epoll_fd, op, fd, event);
+}
+
+static ALWAYS_INLINE int thread_event_wait(struct lwan_thread *t,
+                                           struct epoll_event *events,
+                                           int max_events,
+                                           int timeout)
+{
+#if defined(LWAN_HAVE_IO_URING)
+    if (t->io_uring)
+        return lwan_io_uring_wait(t->io_uring, events, max_events, timeout);
+#endif
+    return epoll_wait(t->epoll_fd, events, max_events, timeout);
+}
+
+static void thread_event_close(struct lwan_thread *t)
+{
+#if defined(LWAN_HAVE_IO_URING)
+    if (t->io_uring) {
+        lwan_io_uring_close(t->io_uring);
+        return;
+    }
+#endif
+
+    int epoll_fd = t->epoll_fd;
+
+    t->epoll_fd = -1;
+    close(epoll_fd);
+}
+
+void lwan_thread_unwatch_fd(struct lwan_thread *t, int fd)
+{
+#if defined(LWAN_HAVE_IO_URING)
+    /* Pending polls keep a reference to the file, so they have to be
+     * removed explicitly before the file descriptor is closed.  (This is
+     * done automatically by the kernel when using epoll.) */
+    if (t->io_uring)
+        lwan_io_uring_ctl(t->io_uring, EPOLL_CTL_DEL, fd, NULL);
+#else
+    (void)t;
+    (void)fd;
+#endif
+}
+
+#if defined(LWAN_HAVE_CLOSE_RANGE)
+static int compare_fds(const void *a, const void *b)
+{
+    const int fd_a = *(const int *)a;
+    const int fd_b = *(const int *)b;
+
+    return (fd_a > fd_b) - (fd_a < fd_b);
+}
+#endif
+
+void lwan_thread_close_fds(struct lwan_thread *t, int fds[], size_t n_fds)
+{
+    /* These file descriptors must have been unwatched already. */
+#if defined(LWAN_HAVE_IO_URING)
+    if (t->io_uring) {
+        for (size_t i = 0; i < n_fds; i++) {
+            if (UNLIKELY(lwan_io_uring_close_fd(t->io_uring, fds[i]) < 0))
+                close(fds[i]);
+        }
+        return;
+    }
+#else
+    (void)t;
+#endif
+
+#if defined(LWAN_HAVE_CLOSE_RANGE)
+    /* Connections accepted around the same time, which are likely to
+     * expire together, usually have consecutive file descriptors. */
+    qsort(fds, n_fds, sizeof(*fds), compare_fds);
+
+    for (size_t i = 0; i < n_fds;) {
+        size_t run_end = i + 1;
+
+        while (run_end < n_fds && fds[run_end] == fds[run_end - 1] + 1)
+            run_end++;
+
+        if (run_end - i == 1 ||
+            close_range((unsigned int)fds[i], (unsigned int)fds[run_end - 1],
+                        0) < 0) {
+            for (; i < run_end; i++)
+                close(fds[i]);
+        }
+
+        i = run_end;
+    }
+#else
+    for (size_t i = 0; i < n_fds; i++)
+        close(fds[i]);
+#endif
+}
+
+void lwan_thread_unwatch_open_fd(struct lwan_thread *t, int fd)
+{
+    /* Same as above, but for file descriptors that are going to be kept
+     * open after a request is done with them (e.g. pooled connections to
+     * a backend): epoll only forgets about them on close().  Pending
+     * io_uring polls have already been removed by lwan_thread_unwatch_fd().
+     * Failure is fine here, as the fd might never have been awaited.  */
+#if defined(LWAN_HAVE_IO_URING)
+    if (t->io_uring)
+        return;
+#endif
+    epoll_ctl(t->epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+}
+
 static int update_epoll_flags(const struct lwan *lwan,
                               struct lwan_connection *conn,
-                              int epoll_fd,
+                              struct lwan_thread *t,
                               enum lwan_connection_coro_yield yield_result)
 {
     static const enum lwan_connection_flags or_mask[CONN_CORO_MAX] = {
         [CONN_CORO_YIELD] = 0,
+        [CONN_CORO_RESCHEDULE] = 0,
 
         [CONN_CORO_WANT_READ_WRITE] = CONN_EVENTS_READ_WRITE,
         [CONN_CORO_WANT_READ] = CONN_EVENTS_READ,
@@ -597,6 +867,7 @@ static int update_epoll_flags(const struct lwan *lwan,
     };
     static const enum lwan_connection_flags and_mask[CONN_CORO_MAX] = {
         [CONN_CORO_YIELD] = ~0,
+        [CONN_CORO_RESCHEDULE] = ~0,
 
         [CONN_CORO_WANT_READ_WRITE] = ~0,
         [CONN_CORO_WANT_READ] = ~CONN_EVENTS_WRITE,
@@ -619,18 +890,27 @@ static int update_epoll_flags(const struct lwan *lwan,
     struct epoll_event event = {.events = conn_flags_to_epoll_events(conn->flags),
                                 .data.ptr = conn};
     int fd = lwan_connection_get_fd(lwan, conn);
-    return epoll_ctl(epoll_fd, EPOLL_CTL_MOD, fd, &event);
+    return thread_event_ctl(t, EPOLL_CTL_MOD, fd, &event);
 }
 
 static void unasync_await_conn(void *data1, void *data2)
 {
     struct lwan_connection *async_fd_conn = data1;
 
-    async_fd_conn->flags &=
-        ~(CONN_ASYNC_AWAIT | CONN_HUNG_UP | CONN_ASYNC_AWAITV);
+    /* CONN_ASYNC_AWAIT is kept, without a coroutine, so that events for
+     * this file descriptor that were already returned by epoll_wait() in
+     * the same batch as the one resuming this coroutine for the last time
+     * are ignored, rather than treated as a new client connection.  This
+     * happens when the file descriptor is kept open after this (e.g. in a
+     * pool of connections to a backend).  The flags are reset once the
+     * number is reused by an accepted connection, or awaited again.  */
+    async_fd_conn->flags &= ~(CONN_HUNG_UP | CONN_ASYNC_AWAITV);
     assert(async_fd_conn->parent);
     async_fd_conn->parent->flags &= ~CONN_ASYNC_AWAITV;
 
+    lwan_thread_unwatch_fd(
+        async_fd_conn->thread,
+        lwan_connection_get_fd(async_fd_conn->thread->lwan, async_fd_conn));
     async_fd_conn->thread = data2;
 
     /* If this file descriptor number is used again in the future as an HTTP
@@ -649,7 +929,7 @@ static int prepare_await(const struct lwan *l,
                          enum lwan_connection_coro_yield yield_result,
                          int await_fd,
                          struct lwan_connection *conn,
-                         int epoll_fd)
+                         struct lwan_thread *t)
 {
     static const enum lwan_connection_flags to_connection_flags[] = {
         [CONN_CORO_WANT_READ] = CONN_EVENTS_READ,
@@ -666,7 +946,8 @@ static int prepare_await(const struct lwan *l,
     flags = to_connection_flags[yield_result];
 
     struct lwan_connection *await_fd_conn = &l->conns[await_fd];
-    if (LIKELY(await_fd_conn->flags & CONN_ASYNC_AWAIT)) {
+    if (LIKELY(await_fd_conn->flags & CONN_ASYNC_AWAIT) &&
+        LIKELY(await_fd_conn->coro)) {
         if (LIKELY(LWAN_EVENTS(await_fd_conn->flags) == LWAN_EVENTS(flags))) {
             return 0;
         }
@@ -698,7 +979,7 @@ static int prepare_await(const struct lwan *l,
 
     struct epoll_event event = {.events = conn_flags_to_epoll_events(flags),
                                 .data.ptr = await_fd_conn};
-    if (LIKELY(!epoll_ctl(epoll_fd, op, await_fd, &event))) {
+    if (LIKELY(!thread_event_ctl(t, op, await_fd, &event))) {
         await_fd_conn->flags &= ~CONN_EVENTS_MASK;
         await_fd_conn->flags |= flags;
         return 0;
@@ -729,7 +1010,7 @@ static int prepare_awaitv(struct lwan_request *r,
                           va_list ap,
                           struct awaitv_state *state)
 {
-    int epoll_fd = r->conn->thread->epoll_fd;
+    struct lwan_thread *t = r->conn->thread;
 
     *state = (struct awaitv_state){
         .num_awaiting = 0,
@@ -762,7 +1043,7 @@ static int prepare_awaitv(struct lwan_request *r,
             continue;
         }
 
-        int ret = prepare_await(l, events, await_fd, r->conn, epoll_fd);
+        int ret = prepare_await(l, events, await_fd, r->conn, t);
         if (UNLIKELY(ret < 0)) {
             errno = -ret;
             lwan_status_perror("prepare_await(%d)", await_fd);
@@ -773,12 +1054,121 @@ static int prepare_awaitv(struct lwan_request *r,
     return 0;
 }
 
+static timeout_t wheel_now(void)
+{
+    struct timespec now;
+
+    if (UNLIKELY(clock_gettime(monotonic_clock_id, &now) < 0))
+        lwan_status_critical("Could not get monotonic time");
+
+    return (timeout_t)(now.tv_sec * 1000 + now.tv_nsec / 1000000);
+}
+
+void lwan_request_set_deadline(struct lwan_request *request, unsigned int ms)
+{
+    struct lwan_request_parser_helper *helper = request->helper;
+    const uint64_t deadline = wheel_now() + ms;
+
+    /* Rewritten requests might end up in URL maps with shorter deadlines,
+     * but they never get more time than they had already been given */
+    if (!helper->deadline || deadline < helper->deadline)
+        helper->deadline = deadline;
+}
+
+bool lwan_request_deadline_passed(const struct lwan_request *request)
+{
+    return request->helper->deadline &&
+           wheel_now() >= request->helper->deadline;
+}
+
+uint64_t lwan_request_clamp_to_deadline(struct lwan_request *request,
+                                        uint64_t ms)
+{
+    const uint64_t deadline = request->helper->deadline;
+    uint64_t now;
+
+    if (LIKELY(!deadline))
+        return ms;
+
+    now = wheel_now();
+    if (now >= deadline)
+        lwan_request_cancel(request);
+
+    return LWAN_MIN(ms, deadline - now);
+}
+
+void lwan_request_cancel(struct lwan_request *request)
+{
+    struct lwan_connection *conn = request->conn;
+
+    conn->thread->stats.cancelled++;
+    lwan_status_debug("Request %016" PRIx64 " cancelled: past its deadline",
+                      request->helper->request_id);
+
+    if (!(request->flags & RESPONSE_SENT_HEADERS)) {
+        /* Whatever the handler had been doing with the connection (e.g.
+         * the rest of a request body) is left behind */
+        conn->flags &= ~CONN_IS_KEEP_ALIVE;
+        lwan_default_response(request, HTTP_UNAVAILABLE);
+    }
+
+    coro_yield(conn->coro, CONN_CORO_ABORT);
+    __builtin_unreachable();
+}
+
+static void remove_await_timeout(void *data1, void *data2)
+{
+    /* No-op if the timeout has already expired */
+    timeouts_del(data1, data2);
+}
+
+/* Arms the timer of @r to go off after @timeout_ms (0 for no timeout), or
+ * at the deadline of the request, whichever comes first.  When it goes
+ * off, the connection is resumed with itself as the value returned by
+ * coro_yield().  Returns the deferred callback removing the timer, or -1
+ * if there's nothing to wait for. */
+static coro_deferred arm_await_timeout(struct lwan_request *r,
+                                       uint64_t timeout_ms)
+{
+    struct lwan_thread *t = r->conn->thread;
+
+    if (UNLIKELY(r->helper->deadline != 0)) {
+        timeout_ms = lwan_request_clamp_to_deadline(
+            r, timeout_ms ? timeout_ms : UINT64_MAX);
+    }
+    if (!timeout_ms)
+        return -1;
+
+    /* See lwan_request_sleep() for why the wheel is updated here. */
+    timeouts_update(t->wheel, wheel_now());
+
+    r->timeout = (struct timeout){};
+    timeouts_add(t->wheel, &r->timeout, timeout_ms);
+    return coro_defer2(r->conn->coro, remove_await_timeout, t->wheel,
+                       &r->timeout);
+}
+
+/* Whether the coroutine of @r has been resumed because the timer armed by
+ * arm_await_timeout() went off; cancels the request if its deadline has
+ * passed. */
+static bool await_timed_out(struct lwan_request *r, coro_deferred defer)
+{
+    if (LIKELY(defer < 0) || r->timeout.pending)
+        return false;
+
+    lwan_request_check_deadline(r);
+    return true;
+}
+
 int lwan_request_awaitv_any(struct lwan_request *r, ...)
 {
     struct lwan *l = r->conn->thread->lwan;
     struct awaitv_state state;
     va_list ap;
 
+    /* Flushed before anything is registered, as this can itself block */
+    lwan_response_flush_chunks(r);
+
     va_start(ap, r);
     int ret = prepare_awaitv(r, l, ap, &state);
     va_end(ap);
@@ -790,10 +1180,14 @@ int lwan_request_awaitv_any(struct lwan_request *r, ...)
         __builtin_unreachable();
     }
 
+    const coro_deferred defer = arm_await_timeout(r, 0);
+    const uint64_t began = lwan_request_await_began(r);
     while (true) {
         int64_t v = coro_yield(r->conn->coro, state.request_conn_yield);
         struct lwan_connection *conn = (struct lwan_connection *)(uintptr_t)v;
 
+        await_timed_out(r, defer);
+
         if (conn->flags & CONN_ASYNC_AWAITV) {
             /* Ensure flags are unset in case awaitv_any() is called with
              * a different set of file descriptors. */
@@ -801,6 +1195,10 @@ int lwan_request_awaitv_any(struct lwan_request *r, ...)
             clear_awaitv_flags(l->conns, ap);
             va_end(ap);
 
+            lwan_request_await_ended(r, began);
+            if (defer > 0)
+                coro_defer_fire_and_disarm(r->conn->coro, defer);
+
             int fd = lwan_connection_get_fd(l, conn);
             return UNLIKELY(conn->flags & CONN_HUNG_UP) ? -fd : fd;
         }
@@ -813,6 +1211,9 @@ int lwan_request_awaitv_all(struct lwan_request *r, ...)
     struct awaitv_state state;
     va_list ap;
 
+    /* Flushed before anything is registered, as this can itself block */
+    lwan_response_flush_chunks(r);
+
     va_start(ap, r);
     int ret = prepare_awaitv(r, l, ap, &state);
     va_end(ap);
@@ -824,10 +1225,15 @@ int lwan_request_awaitv_all(struct lwan_request *r, ...)
         __builtin_unreachable();
     }
 
+    const coro_deferred defer = arm_await_timeout(r, 0);
+    const uint64_t began = lwan_request_await_began(r);
+    ret = -EISCONN;
     while (state.num_awaiting) {
         int64_t v = coro_yield(r->conn->coro, state.request_conn_yield);
         struct lwan_connection *conn = (struct lwan_connection *)(uintptr_t)v;
 
+        await_timed_out(r, defer);
+
         if (conn->flags & CONN_ASYNC_AWAITV) {
             conn->flags &= ~CONN_ASYNC_AWAITV;
 
@@ -838,37 +1244,130 @@ int lwan_request_awaitv_all(struct lwan_request *r, ...)
                 clear_awaitv_flags(l->conns, ap);
                 va_end(ap);
 
-                return lwan_connection_get_fd(l, conn);
+                ret = lwan_connection_get_fd(l, conn);
+                break;
             }
 
             state.num_awaiting--;
         }
     }
 
-    return -EISCONN;
+    lwan_request_await_ended(r, began);
+    if (defer > 0)
+        coro_defer_fire_and_disarm(r->conn->coro, defer);
+    return ret;
+}
+
+/* Like lwan_request_awaitv_any(), but with the file descriptors in an
+ * array, and with a timeout driven by the timer wheel of this thread
+ * (none if timeout_ms is 0).  Returns the index of the file descriptor
+ * that's ready in @fds, or -ETIMEDOUT.  Whether it hung up is left for
+ * the caller to find out while using it. */
+int lwan_request_await_any_of(struct lwan_request *r,
+                              const struct lwan_await_fd fds[],
+                              size_t n_fds,
+                              uint64_t timeout_ms)
+{
+    struct lwan_connection *conn = r->conn;
+    struct lwan_thread *t = conn->thread;
+    struct lwan *l = t->lwan;
+    coro_deferred defer;
+    int ret = -EINVAL;
+
+    lwan_response_flush_chunks(r);
+
+    for (size_t i = 0; i < n_fds; i++)
+        l->conns[fds[i].fd].flags &= ~CONN_ASYNC_AWAITV;
+
+    for (size_t i = 0; i < n_fds; i++) {
+        if (UNLIKELY(fds[i].fd == r->fd))
+            goto out;
+
+        ret = prepare_await(l, fds[i].events, fds[i].fd, conn, t);
+        if (UNLIKELY(ret < 0))
+            goto out;
+
+        l->conns[fds[i].fd].flags |= CONN_ASYNC_AWAITV;
+    }
+
+    defer = arm_await_timeout(r, timeout_ms);
+
+    const uint64_t began = lwan_request_await_began(r);
+    while (true) {
+        int64_t v = coro_yield(conn->coro, CONN_CORO_SUSPEND);
+        struct lwan_connection *ready = (struct lwan_connection *)(uintptr_t)v;
+
+        if (ready == conn) {
+            if (await_timed_out(r, defer)) {
+                ret = -ETIMEDOUT;
+                break;
+            }
+            continue;
+        }
+
+        if (ready->flags & CONN_ASYNC_AWAITV) {
+            const int fd = lwan_connection_get_fd(l, ready);
+
+            for (size_t i = 0; i < n_fds; i++) {
+                if (fds[i].fd == fd) {
+                    ret = (int)i;
+                    break;
+                }
+            }
+            break;
+        }
+    }
+
+    lwan_request_await_ended(r, began);
+
+    if (defer > 0)
+        coro_defer_fire_and_disarm(conn->coro, defer);
+
+out:
+    for (size_t i = 0; i < n_fds; i++)
+        l->conns[fds[i].fd].flags &= ~CONN_ASYNC_AWAITV;
+
+    return ret;
 }
 
 static inline int async_await_fd(struct lwan_request *request,
                                  int fd,
                                  enum lwan_connection_coro_yield events)
 {
-    struct lwan_thread *thread = request->conn->thread;
+    struct lwan_connection *conn = request->conn;
+    struct lwan_thread *thread = conn->thread;
     struct lwan *lwan = thread->lwan;
     struct lwan_connection *awaited = &lwan->conns[fd];
 
-    if (request->conn != awaited) {
-        int r =
-            prepare_await(lwan, events, fd, request->conn, thread->epoll_fd);
+    if (conn != awaited) {
+        /* Awaiting the client socket itself usually means something is
+         * being sent to it already, so chunks are only flushed when
+         * awaiting others */
+        lwan_response_flush_chunks(request);
+
+        int r = prepare_await(lwan, events, fd, conn, thread);
         if (UNLIKELY(r < 0))
             return r;
 
         events = CONN_CORO_SUSPEND;
+    } else if (events == CONN_CORO_WANT_READ) {
+        /* ...unless the handler is waiting for the client to send
+         * something, in which case the chunk timer resumes it once the
+         * coalesced chunks are due */
+        lwan_response_flush_due_chunks(request);
     }
 
+    const coro_deferred defer = arm_await_timeout(request, 0);
+    const uint64_t began = lwan_request_await_began(request);
     while (true) {
-        int64_t from_coro = coro_yield(request->conn->coro, events);
+        int64_t from_coro = coro_yield(conn->coro, events);
+
+        await_timed_out(request, defer);
 
         if ((struct lwan_connection *)(intptr_t)from_coro == awaited) {
+            lwan_request_await_ended(request, began);
+            if (defer > 0)
+                coro_defer_fire_and_disarm(conn->coro, defer);
             return UNLIKELY(awaited->flags & CONN_HUNG_UP)
                        ? -ECONNRESET
                        : lwan_connection_get_fd(lwan, awaited);
@@ -891,63 +1390,882 @@ int lwan_request_await_read_write(struct lwan_request *r, int fd)
     return async_await_fd(r, fd, CONN_CORO_WANT_READ_WRITE);
 }
 
-static ALWAYS_INLINE void resume_coro(struct timeout_queue *tq,
-                                      struct lwan_connection *conn_to_resume,
-                                      struct lwan_connection *conn_to_yield,
-                                      int epoll_fd)
+#if defined(LWAN_HAVE_IO_URING)
+bool lwan_request_ring_io(struct lwan_request *request,
+                          enum lwan_io_uring_op op,
+                          void *ptr,
+                          size_t len,
+                          int flags,
+                          ssize_t *ret)
 {
-    assert(conn_to_resume->coro);
-    assert(conn_to_yield->coro);
+    struct lwan_connection *conn = request->conn;
+    struct lwan_thread *thread = conn->thread;
+    int fd, res;
 
-    int64_t from_coro = coro_resume_value(conn_to_resume->coro,
-                                          (int64_t)(intptr_t)conn_to_yield);
-    if (UNLIKELY(from_coro == CONN_CORO_ABORT)) {
-        timeout_queue_expire(tq, conn_to_resume);
-        return;
-    }
+    /* With TLS, everything goes through kTLS or mbedTLS, which expect the
+     * socket to be used through system calls. */
+    if (!thread || !thread->io_uring || (conn->flags & CONN_TLS))
+        return false;
 
-    enum lwan_connection_coro_yield yield = (uint32_t)from_coro;
-    int r = update_epoll_flags(tq->lwan, conn_to_resume, epoll_fd, yield);
-    if (LIKELY(!r))
-        timeout_queue_move_to_last(tq, conn_to_resume);
-}
+    fd = lwan_connection_get_fd(thread->lwan, conn);
+    if (UNLIKELY(lwan_io_uring_queue_io(thread->io_uring, fd, op, ptr, len,
+                                        flags) < 0))
+        return false;
 
-static void update_date_cache(struct lwan_thread *thread)
-{
-    time_t now = time(NULL);
+    /* The connection is resumed by the completion, whatever events it's
+     * waiting for, so those are left alone.  If it's closed in the mean
+     * time, this coroutine is never resumed again. */
+    while (!lwan_io_uring_take_io_result(thread->io_uring, fd, &res))
+        coro_yield(conn->coro, CONN_CORO_YIELD);
 
-    lwan_format_rfc_time(now, thread->date.date);
-    lwan_format_rfc_time(now + (time_t)thread->lwan->config.expires,
-                         thread->date.expires);
+    if (res < 0) {
+        errno = -res;
+        *ret = -1;
+    } else {
+        *ret = res;
+    }
+    return true;
 }
+#endif
 
-static ALWAYS_INLINE bool spawn_coro(struct lwan_connection *conn,
-                                     struct coro_switcher *switcher,
-                                     struct timeout_queue *tq)
-{
-    struct lwan_thread *t = conn->thread;
 #if defined(LWAN_HAVE_MBEDTLS)
-    const enum lwan_connection_flags flags_to_keep = conn->flags & CONN_TLS;
-#else
-    const enum lwan_connection_flags flags_to_keep = 0;
-#endif
+/* Handshakes can optionally be performed by a pool of handshake threads,
+ * so that their public key operations don't stall every other connection
+ * served by a worker thread.  Handshake threads never touch the socket:
+ * the coroutine reads whatever the client sent into a buffer, hands the
+ * handshake over to the pool, and waits on an eventfd until mbedTLS needs
+ * more data, sending whatever mbedTLS produced in the mean time.  Once the
+ * handshake is done, kTLS is set up from the coroutine as usual. */
+enum { HANDSHAKE_PENDING, HANDSHAKE_DONE, HANDSHAKE_ABANDONED };
+
+/* Unlike async_await_fd(), there's no request yet while handshaking: no
+ * chunks to flush and no request timeout to arm while waiting. */
+static int handshake_await_fd(struct lwan_connection *conn, int fd)
+{
+    struct lwan_thread *thread = conn->thread;
+    struct lwan *lwan = thread->lwan;
+    struct lwan_connection *awaited = &lwan->conns[fd];
+    int r = prepare_await(lwan, CONN_CORO_WANT_READ, fd, conn, thread);
 
-    assert(!conn->coro);
-    assert(!(conn->flags & (CONN_ASYNC_AWAIT | CONN_HUNG_UP)));
-    assert(!(conn->flags & CONN_LISTENER));
-    assert(t);
-    assert((uintptr_t)t >= (uintptr_t)tq->lwan->thread.threads);
-    assert((uintptr_t)t <
-           (uintptr_t)(tq->lwan->thread.threads + tq->lwan->thread.count));
+    if (UNLIKELY(r < 0))
+        return r;
 
-    *conn = (struct lwan_connection){
-        .coro = coro_new(switcher, process_request_coro, conn),
+    while (true) {
+        int64_t from_coro = coro_yield(conn->coro, CONN_CORO_SUSPEND);
+
+        if ((struct lwan_connection *)(intptr_t)from_coro == awaited) {
+            return UNLIKELY(awaited->flags & CONN_HUNG_UP)
+                       ? -ECONNRESET
+                       : lwan_connection_get_fd(lwan, awaited);
+        }
+    }
+}
+
+struct lwan_tls_handshake_pool {
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    struct list_head queue;
+    bool running;
+    unsigned int n_threads;
+    pthread_t threads[];
+};
+
+struct offloaded_handshake {
+    struct list_node queue;
+    mbedtls_ssl_context ssl;
+    struct lwan_strbuf out;
+    int efd;
+    int refs;
+    int state;
+    int result;
+    struct {
+        size_t len, pos;
+        unsigned char buf[16384];
+    } in;
+};
+
+static void offloaded_handshake_unref(struct offloaded_handshake *hs)
+{
+    if (ATOMIC_DEC(hs->refs))
+        return;
+
+    mbedtls_ssl_free(&hs->ssl);
+    lwan_always_bzero(lwan_strbuf_get_buffer(&hs->out),
+                      lwan_strbuf_get_length(&hs->out));
+    lwan_strbuf_free(&hs->out);
+    close(hs->efd);
+    free(hs);
+}
+
+static void offloaded_handshake_abandon(void *data)
+{
+    struct offloaded_handshake *hs = data;
+
+    /* If a step is still running, it won't signal an eventfd that isn't
+     * being watched anymore, and will drop the last reference itself. */
+    __sync_bool_compare_and_swap(&hs->state, HANDSHAKE_PENDING,
+                                 HANDSHAKE_ABANDONED);
+    offloaded_handshake_unref(hs);
+}
+
+static int
+offloaded_handshake_send(void *ctx, const unsigned char *buf, size_t len)
+{
+    struct offloaded_handshake *hs = ctx;
+
+    if (UNLIKELY((size_t)(int)len != len))
+        return MBEDTLS_ERR_SSL_INTERNAL_ERROR;
+    if (UNLIKELY(!lwan_strbuf_append_str(&hs->out, (const char *)buf, len)))
+        return MBEDTLS_ERR_SSL_ALLOC_FAILED;
+
+    return (int)len;
+}
+
+static int offloaded_handshake_recv(void *ctx, unsigned char *buf, size_t len)
+{
+    struct offloaded_handshake *hs = ctx;
+    size_t available = hs->in.len - hs->in.pos;
+
+    if (!available)
+        return MBEDTLS_ERR_SSL_WANT_READ;
+
+    len = LWAN_MIN(len, available);
+    if (UNLIKELY((size_t)(int)len != len))
+        return MBEDTLS_ERR_SSL_INTERNAL_ERROR;
+
+    memcpy(buf, hs->in.buf + hs->in.pos, len);
+    hs->in.pos += len;
+
+    return (int)len;
+}
+
+static struct offloaded_handshake *
+offloaded_handshake_new(const struct lwan_tls_context *tls)
+{
+    struct offloaded_handshake *hs = malloc(sizeof(*hs));
+    int r;
+
+    if (UNLIKELY(!hs))
+        return NULL;
+
+    hs->efd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (UNLIKELY(hs->efd < 0)) {
+        free(hs);
+        return NULL;
+    }
+
+    hs->refs = 1;
+    hs->state = HANDSHAKE_DONE;
+    hs->in.len = hs->in.pos = 0;
+    lwan_strbuf_init(&hs->out);
+    mbedtls_ssl_init(&hs->ssl);
+
+    r = mbedtls_ssl_setup(&hs->ssl, &tls->config);
+    if (UNLIKELY(r != 0)) {
+        lwan_status_mbedtls_error(r, "Could not setup TLS context");
+        offloaded_handshake_unref(hs);
+        return NULL;
+    }
+
+    mbedtls_ssl_set_bio(&hs->ssl, hs, offloaded_handshake_send,
+                        offloaded_handshake_recv, NULL);
+
+    return hs;
+}
+
+static void offloaded_handshake_step(struct offloaded_handshake *hs)
+{
+    hs->result = mbedtls_ssl_handshake(&hs->ssl);
+
+    if (__sync_bool_compare_and_swap(&hs->state, HANDSHAKE_PENDING,
+                                     HANDSHAKE_DONE)) {
+        if (UNLIKELY(eventfd_write(hs->efd, 1) < 0))
+            lwan_status_perror("eventfd_write");
+    }
+
+    offloaded_handshake_unref(hs);
+}
+
+static void *tls_handshake_thread(void *data)
+{
+    struct lwan_tls_handshake_pool *pool = data;
+
+    lwan_set_thread_name("tls-handshake");
+
+    pthread_mutex_lock(&pool->mutex);
+    while (true) {
+        struct offloaded_handshake *hs =
+            list_pop(&pool->queue, struct offloaded_handshake, queue);
+
+        if (!hs) {
+            /* Pending handshakes are still stepped when shutting down,
+             * so their references are dropped. */
+            if (!pool->running)
+                break;
+
+            pthread_cond_wait(&pool->cond, &pool->mutex);
+            continue;
+        }
+
+        pthread_mutex_unlock(&pool->mutex);
+        offloaded_handshake_step(hs);
+        pthread_mutex_lock(&pool->mutex);
+    }
+    pthread_mutex_unlock(&pool->mutex);
+
+    return NULL;
+}
+
+static struct lwan_tls_handshake_pool *
+tls_handshake_pool_new(unsigned int n_threads)
+{
+    struct lwan_tls_handshake_pool *pool;
+
+    pool = malloc(sizeof(*pool) + n_threads * sizeof(pthread_t));
+    if (!pool)
+        return NULL;
+
+    pthread_mutex_init(&pool->mutex, NULL);
+    pthread_cond_init(&pool->cond, NULL);
+    list_head_init(&pool->queue);
+    pool->running = true;
+    pool->n_threads = 0;
+
+    for (unsigned int i = 0; i < n_threads; i++) {
+        int r = pthread_create(&pool->threads[i], NULL, tls_handshake_thread,
+                               pool);
+
+        if (r) {
+            errno = r;
+            lwan_status_perror("Could not create TLS handshake thread");
+            break;
+        }
+
+        pool->n_threads++;
+    }
+
+    if (!pool->n_threads) {
+        pthread_cond_destroy(&pool->cond);
+        pthread_mutex_destroy(&pool->mutex);
+        free(pool);
+        return NULL;
+    }
+
+    lwan_status_debug("Started %u TLS handshake threads", pool->n_threads);
+
+    return pool;
+}
+
+static void tls_handshake_pool_free(struct lwan_tls_handshake_pool *pool)
+{
+    pthread_mutex_lock(&pool->mutex);
+    pool->running = false;
+    pthread_cond_broadcast(&pool->cond);
+    pthread_mutex_unlock(&pool->mutex);
+
+    for (unsigned int i = 0; i < pool->n_threads; i++) {
+        int r = pthread_join(pool->threads[i], NULL);
+
+        if (r) {
+            errno = r;
+            lwan_status_perror("pthread_join");
+        }
+    }
+
+    pthread_cond_destroy(&pool->cond);
+    pthread_mutex_destroy(&pool->mutex);
+    free(pool);
+}
+
+static bool tls_handshake_pool_queue(struct lwan_tls_handshake_pool *pool,
+                                     struct offloaded_handshake *hs)
+{
+    pthread_mutex_lock(&pool->mutex);
+    if (UNLIKELY(!pool->running)) {
+        pthread_mutex_unlock(&pool->mutex);
+        return false;
+    }
+    list_add_tail(&pool->queue, &hs->queue);
+    pthread_cond_signal(&pool->cond);
+    pthread_mutex_unlock(&pool->mutex);
+
+    return true;
+}
+
+static bool offloaded_handshake_fill(struct lwan_connection *conn,
+                                     int fd,
+                                     struct offloaded_handshake *hs)
+{
+    /* mbedTLS only asks for more data once the buffer has been consumed. */
+    hs->in.len = hs->in.pos = 0;
+
+    while (true) {
+        ssize_t r = recv(fd, hs->in.buf, sizeof(hs->in.buf), 0);
+
+        if (r > 0) {
+            hs->in.len = (size_t)r;
+            return true;
+        }
+        if (r == 0)
+            return false;
+
+        switch (errno) {
+        case EINTR:
+            continue;
+        case EAGAIN:
+            coro_yield(conn->coro, CONN_CORO_WANT_READ);
+            continue;
+        default:
+            return false;
+        }
+    }
+}
+
+static bool offloaded_handshake_flush(struct lwan_connection *conn,
+                                      int fd,
+                                      struct offloaded_handshake *hs)
+{
+    char *buffer = lwan_strbuf_get_buffer(&hs->out);
+    size_t len = lwan_strbuf_get_length(&hs->out);
+    size_t sent = 0;
+
+    while (sent < len) {
+        ssize_t r = send(fd, buffer + sent, len - sent, 0);
+
+        if (r < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN) {
+                coro_yield(conn->coro, CONN_CORO_WANT_WRITE);
+                continue;
+            }
+            break;
+        }
+
+        sent += (size_t)r;
+    }
+
+    /* See the comment in lwan_mbedtls_send(): this might contain key
+     * material, so it can't be left around. */
+    lwan_always_bzero(buffer, len);
+    lwan_strbuf_reset(&hs->out);
+
+    return sent == len;
+}
+
+static bool lwan_setup_tls_offloaded(const struct lwan *l,
+                                     struct lwan_connection *conn)
+{
+    const size_t generation = coro_deferred_get_generation(conn->coro);
+    int fd = lwan_connection_get_fd(l, conn);
+    struct offloaded_handshake *hs;
+    bool retval = false;
+
+    hs = offloaded_handshake_new(l->tls);
+    if (UNLIKELY(!hs))
+        return false;
+
+    /* Deferred callbacks are executed in reverse order, so this is called
+     * after the eventfd is no longer being watched by this thread. */
+    if (UNLIKELY(coro_defer(conn->coro, offloaded_handshake_abandon, hs) <
+                 0)) {
+        offloaded_handshake_unref(hs);
+        return false;
+    }
+
+    while (offloaded_handshake_fill(conn, fd, hs)) {
+        eventfd_t value;
+
+        hs->state = HANDSHAKE_PENDING;
+        ATOMIC_INC(hs->refs);
+        if (UNLIKELY(!tls_handshake_pool_queue(l->tls->handshake_pool, hs))) {
+            offloaded_handshake_unref(hs);
+            break;
+        }
+
+        if (UNLIKELY(handshake_await_fd(conn, hs->efd) < 0))
+            break;
+        if (UNLIKELY(eventfd_read(hs->efd, &value) < 0))
+            lwan_status_perror("eventfd_read");
+
+        if (UNLIKELY(!offloaded_handshake_flush(conn, fd, hs)))
+            break;
+
+        if (hs->result == 0) {
+            retval = lwan_enable_ktls(conn, fd, &hs->ssl);
+            break;
+        }
+        if (hs->result != MBEDTLS_ERR_SSL_WANT_READ)
+            break;
+    }
+
+    /* Stops watching the eventfd and releases the handshake context (or
+     * leaves it for the handshake thread to release, if it's still using
+     * it.) */
+    coro_deferred_run(conn->coro, generation);
+
+    return retval;
+}
+#endif
+
+/* Handing a connection over has a cost of its own (a few epoll_ctl() calls,
+ * and whatever was warm in this CPU's caches), so only do it when this
+ * thread is noticeably busier than the other one.  */
+#define MIGRATION_MIN_IMBALANCE 8
+
+static struct lwan_thread *pick_migration_target(struct lwan_thread *t)
+{
+    const struct lwan *lwan = t->lwan;
+    struct lwan_thread *target;
+
+    /* Dedicated listeners are served by their own threads only */
+    if (lwan->thread.shared_count < 2 || t->dedicated)
+        return NULL;
+
+#if defined(LWAN_HAVE_IO_URING)
+    /* A ring can only be used by the thread that owns it.  */
+    if (t->io_uring)
+        return NULL;
+#endif
+
+    /* Live coroutines are connections either being served or waiting on
+     * something other than a new request, so they're a good enough measure
+     * of how busy a thread is.  Rather than looking at every thread, just
+     * compare against a random one: it's cheaper, and avoids all busy
+     * threads dumping connections into the same idle one.  */
+    target =
+        &lwan->thread.threads[lwan_random_uint64() % lwan->thread.shared_count];
+    if (target == t)
+        return NULL;
+
+    /* Keep the connection, and whatever memory was allocated for it, in
+     * the same NUMA node.  */
+    if (target->numa_node != t->numa_node)
+        return NULL;
+
+    const uint64_t target_coros =
+        __atomic_load_n(&target->stats.coros, __ATOMIC_RELAXED);
+    if (t->stats.coros < target_coros * 2 + MIGRATION_MIN_IMBALANCE)
+        return NULL;
+
+    return target;
+}
+
+static bool migrate_idle_conn(struct timeout_queue *tq,
+                              struct lwan_connection *conn,
+                              struct lwan_thread *target)
+{
+    struct epoll_event event = {
+        .events = conn_flags_to_epoll_events(CONN_EVENTS_READ_WRITE),
+        .data.ptr = conn,
+    };
+    struct lwan_thread *t = conn->thread;
+    int fd = lwan_connection_get_fd(tq->lwan, conn);
+
+    assert(!conn->coro);
+    assert(conn->flags & CONN_RELEASED_CORO);
+
+    if (UNLIKELY(thread_event_ctl(t, EPOLL_CTL_DEL, fd, NULL) < 0))
+        return false;
+
+    timeout_queue_remove(tq, conn);
+    t->stats.migrated++;
+
+    /* Only the target thread can put the connection in its timeout queue.
+     * Since an idle connection can be written to, asking for EPOLLOUT as
+     * well gets the target to do so right away, rather than when (and if)
+     * the next request arrives; see adopt_migrated_conn().  The connection
+     * must not be touched by this thread after it's in the target's epoll
+     * set.  */
+    conn->flags |= CONN_EVENTS_READ_WRITE;
+    conn->thread = target;
+
+    if (UNLIKELY(thread_event_ctl(target, EPOLL_CTL_ADD, fd, &event) < 0)) {
+        lwan_status_perror("Could not hand file descriptor %d over to another "
+                           "thread. Dropping connection",
+                           fd);
+        conn->thread = t;
+        conn->flags = 0;
+        close(fd);
+    }
+
+    return true;
+}
+
+static ALWAYS_INLINE bool conn_is_migrating(const struct lwan_connection *conn)
+{
+    const enum lwan_connection_flags mask = CONN_RELEASED_CORO | CONN_EVENTS_MASK;
+
+    return (conn->flags & mask) ==
+           (CONN_RELEASED_CORO | (CONN_EVENTS_READ_WRITE & CONN_EVENTS_MASK));
+}
+
+static bool adopt_migrated_conn(struct timeout_queue *tq,
+                                struct lwan_connection *conn,
+                                struct lwan_thread *t)
+{
+    struct epoll_event event = {
+        .events = conn_flags_to_epoll_events(CONN_EVENTS_READ),
+        .data.ptr = conn,
+    };
+    int fd = lwan_connection_get_fd(tq->lwan, conn);
+
+    assert(conn->thread == t);
+
+    conn->flags = (conn->flags & ~CONN_EVENTS_READ_WRITE) | CONN_EVENTS_READ;
+    conn->time_to_expire = timeout_queue_next_expiration(tq);
+    timeout_queue_insert(tq, conn);
+
+    if (UNLIKELY(thread_event_ctl(t, EPOLL_CTL_MOD, fd, &event) < 0)) {
+        timeout_queue_expire(tq, conn);
+        return false;
+    }
+
+    return true;
+}
+
+static void release_coro(struct timeout_queue *tq,
+                         struct lwan_connection *conn,
+                         struct lwan_thread *t)
+{
+    if (UNLIKELY(update_epoll_flags(tq->lwan, conn, t, CONN_CORO_WANT_READ))) {
+        timeout_queue_expire(tq, conn);
+        return;
+    }
+
+    /* The connection stays in the timeout queue, so it's still closed if
+     * it's idle for too long; timeout_queue_expire() copes with
+     * connections without a coroutine.  */
+    coro_pool_free(&t->coro_pool, conn->coro);
+    conn->coro = NULL;
+    conn->flags |= CONN_RELEASED_CORO;
+    t->stats.coros--;
+    t->stats.coros_cached = t->coro_pool.n_free;
+
+    if (tq->lwan->config.migrate_idle_conns) {
+        struct lwan_thread *target = pick_migration_target(t);
+
+        if (target && migrate_idle_conn(tq, conn, target))
+            return;
+    }
+
+    timeout_queue_move_to_last(tq, conn);
+}
+
+/* Time slice of the coroutine being resumed by this thread, if any.  The
+ * deadline is only set the first time the coroutine checks it (see
+ * lwan_yield_if_time_slice_expired()), so that most coroutines, which
+ * never run for long enough to get to a check, don't read the clock. */
+static __thread struct {
+    struct lwan_connection *conn;
+    uint64_t deadline_ns;
+    unsigned int checks;
+} time_slice;
+
+static void run_queue_remove(struct lwan_thread *t,
+                             const struct lwan_connection *conn)
+{
+    for (unsigned int i = 0; i < t->run_queue.count; i++) {
+        if (t->run_queue.conns[i] == conn) {
+            t->run_queue.conns[i] = t->run_queue.conns[--t->run_queue.count];
+            return;
+        }
+    }
+}
+
+static ALWAYS_INLINE void resume_coro(struct timeout_queue *tq,
+                                      struct lwan_connection *conn_to_resume,
+                                      struct lwan_connection *conn_to_yield,
+                                      struct lwan_thread *t)
+{
+    assert(conn_to_resume->coro);
+    assert(conn_to_yield->coro);
+
+    /* Whatever resumes a rescheduled coroutine first wins: it must not be
+     * resumed again from the run queue, as it might be waiting for
+     * something else by then. */
+    if (UNLIKELY(t->run_queue.count))
+        run_queue_remove(t, conn_to_resume);
+
+    time_slice.conn = conn_to_resume;
+    time_slice.deadline_ns = 0;
+    time_slice.checks = 0;
+
+    LWAN_TRACE(coro__resume,
+               lwan_connection_get_fd(tq->lwan, conn_to_resume));
+    /* Cycles are only counted if something is collecting them; see
+     * lwan_latency_record() */
+    if (UNLIKELY(lwan_latency_enabled))
+        coro_account_resumed(conn_to_resume->coro, lwan_read_cycle_counter());
+    int64_t from_coro = coro_resume_value(conn_to_resume->coro,
+                                          (int64_t)(intptr_t)conn_to_yield);
+    if (UNLIKELY(lwan_latency_enabled))
+        coro_account_yielded(conn_to_resume->coro, lwan_read_cycle_counter());
+    LWAN_TRACE(coro__yield, lwan_connection_get_fd(tq->lwan, conn_to_resume),
+               from_coro);
+
+    time_slice.conn = NULL;
+
+    if (UNLIKELY(from_coro == CONN_CORO_ABORT)) {
+        timeout_queue_expire(tq, conn_to_resume);
+        return;
+    }
+    if (from_coro == CONN_CORO_RELEASE) {
+        release_coro(tq, conn_to_resume, t);
+        return;
+    }
+    if (UNLIKELY(from_coro == CONN_CORO_RESCHEDULE)) {
+        /* There's always room: lwan_yield_if_time_slice_expired() doesn't
+         * yield otherwise. */
+        assert(t->run_queue.count < N_ELEMENTS(t->run_queue.conns));
+        t->run_queue.conns[t->run_queue.count++] = conn_to_resume;
+    }
+
+    enum lwan_connection_coro_yield yield = (uint32_t)from_coro;
+    int r = update_epoll_flags(tq->lwan, conn_to_resume, t, yield);
+    if (LIKELY(!r))
+        timeout_queue_move_to_last(tq, conn_to_resume);
+}
+
+static ALWAYS_INLINE uint64_t precise_monotonic_ns(void)
+{
+    struct timespec now;
+
+    if (UNLIKELY(clock_gettime(CLOCK_MONOTONIC, &now) < 0))
+        return 0;
+
+    return (uint64_t)now.tv_sec * 1000000000ull + (uint64_t)now.tv_nsec;
+}
+
+/* Like resume_coro(), but also records how long the coroutine waited for
+ * the thread to get to it since epoll_wait() returned, and how long it ran
+ * for.  Events are timed only if something is collecting latencies, in
+ * which case ready_ns is non-zero. */
+static ALWAYS_INLINE void
+resume_coro_timed(struct timeout_queue *tq,
+                  struct lwan_connection *conn_to_resume,
+                  struct lwan_connection *conn_to_yield,
+                  struct lwan_thread *t,
+                  uint64_t ready_ns)
+{
+    uint64_t resumed_ns;
+
+    if (LIKELY(!ready_ns)) {
+        resume_coro(tq, conn_to_resume, conn_to_yield, t);
+        return;
+    }
+
+    resumed_ns = precise_monotonic_ns();
+    resume_coro(tq, conn_to_resume, conn_to_yield, t);
+    lwan_latency_record_resume(t, resumed_ns - ready_ns,
+                               precise_monotonic_ns() - resumed_ns);
+}
+
+bool lwan_yield_if_time_slice_expired(void)
+{
+    struct lwan_connection *conn = time_slice.conn;
+    struct lwan_thread *t;
+    uint64_t now;
+
+    if (!conn)
+        return false;
+
+    t = conn->thread;
+    if (!t->lwan->config.time_slice)
+        return false;
+
+    /* Reading the clock isn't free, so only do so every few calls. */
+    if (time_slice.checks++ % 64)
+        return false;
+
+    now = precise_monotonic_ns();
+    if (!time_slice.deadline_ns) {
+        time_slice.deadline_ns =
+            now + (uint64_t)t->lwan->config.time_slice * 1000000ull;
+        return false;
+    }
+    if (now < time_slice.deadline_ns)
+        return false;
+
+    /* Callers running in a coroutine resumed by the connection coroutine
+     * (e.g. a template generator) can't yield on its behalf; neither can
+     * anybody if there's no room to remember to resume it. */
+    if (!coro_is_running_on_stack(conn->coro) ||
+        t->run_queue.count == N_ELEMENTS(t->run_queue.conns)) {
+        time_slice.deadline_ns = 0;
+        return false;
+    }
+
+    coro_yield(conn->coro, CONN_CORO_RESCHEDULE);
+    return true;
+}
+
+static void resume_rescheduled_coros(struct timeout_queue *tq,
+                                     struct lwan_thread *t)
+{
+    struct lwan_connection *conns[LWAN_RUN_QUEUE_SIZE];
+    const unsigned int count = t->run_queue.count;
+
+    /* Coroutines that keep going over their time slice are rescheduled to
+     * the next iteration of the event loop, not to this one. */
+    memcpy(conns, t->run_queue.conns, count * sizeof(*conns));
+    t->run_queue.count = 0;
+
+    for (unsigned int i = 0; i < count; i++) {
+        struct lwan_connection *conn = conns[i];
+
+        /* Might have been closed (and its fd reused) in the meantime */
+        if (LIKELY(conn->coro && conn->thread == t))
+            resume_coro(tq, conn, conn, t);
+    }
+}
+
+/* Time it took to go through a batch of events is how long the last event
+ * in the batch waited to be handled.  Like CoDel, a thread is considered
+ * overloaded once that has been above the target for a whole interval,
+ * and isn't anymore as soon as it's below the target again.  While
+ * overloaded, new connections are turned away at accept time, so that
+ * keep-alive connections already being served aren't starved.  */
+static void update_overload_state(struct lwan_thread *t, uint64_t batch_ns)
+{
+    const struct lwan_config *config = &t->lwan->config;
+    const uint64_t now = precise_monotonic_ns();
+    const uint64_t target_ns =
+        (uint64_t)config->overload_latency_target * 1000000ull;
+
+    if (now - batch_ns < target_ns) {
+        t->overload.above_target_since_ns = 0;
+        if (UNLIKELY(t->overload.shedding)) {
+            __atomic_store_n(&t->overload.shedding, false, __ATOMIC_RELAXED);
+            t->stats.overloaded = 0;
+        }
+        return;
+    }
+
+    if (!t->overload.above_target_since_ns) {
+        t->overload.above_target_since_ns = now;
+        return;
+    }
+
+    if (!t->overload.shedding &&
+        now - t->overload.above_target_since_ns >=
+            (uint64_t)config->overload_interval * 1000000ull) {
+        __atomic_store_n(&t->overload.shedding, true, __ATOMIC_RELAXED);
+        t->stats.overloaded = 1;
+    }
+}
+
+static ALWAYS_INLINE bool should_shed_new_conn(const struct lwan_thread *t)
+{
+    const unsigned int max_coros = t->lwan->config.overload_max_coros;
+
+    if (ATOMIC_READ(t->overload.shedding))
+        return true;
+
+    return max_coros && ATOMIC_READ(t->stats.coros) >= max_coros;
+}
+
+/* Going to sleep in epoll_wait() and being woken up again costs more than
+ * serving a small request, so threads can poll for a while before blocking.
+ * How long adapts to how often that pays off: the spin budget doubles
+ * whenever events arrive while spinning, and halves whenever they don't,
+ * so threads only burn CPU waiting when requests keep coming in.  */
+#define BUSY_POLL_MIN_SHIFT 4
+
+static int wait_for_events(struct lwan_thread *t,
+                           struct epoll_event *events,
+                           int max_events,
+                           int timeout)
+{
+    const uint64_t max_ns = (uint64_t)t->lwan->config.busy_poll_time * 1000ull;
+    uint64_t budget_ns = t->busy_poll_ns;
+    uint64_t deadline;
+
+    if (!max_ns || !timeout)
+        return thread_event_wait(t, events, max_events, timeout);
+
+    if (timeout > 0) {
+        const uint64_t timeout_ns = (uint64_t)timeout * 1000000;
+
+        budget_ns = LWAN_MIN(budget_ns, timeout_ns);
+    }
+
+    deadline = precise_monotonic_ns() + budget_ns;
+    do {
+        int n_fds = thread_event_wait(t, events, max_events, 0);
+
+        if (n_fds > 0)
+            t->busy_poll_ns = LWAN_MIN(t->busy_poll_ns * 2, max_ns);
+        if (n_fds)
+            return n_fds;
+    } while (precise_monotonic_ns() < deadline);
+
+    t->busy_poll_ns =
+        LWAN_MAX(t->busy_poll_ns / 2, max_ns >> BUSY_POLL_MIN_SHIFT);
+
+    return thread_event_wait(t, events, max_events, timeout);
+}
+
+static void update_date_cache(struct lwan_thread *thread)
+{
+    time_t now = time(NULL);
+
+    if (now == thread->date.last)
+        return;
+
+    thread->date.last = now;
+    lwan_format_rfc_time(now, thread->date.date);
+    lwan_format_rfc_time(now + (time_t)thread->lwan->config.expires,
+                         thread->date.expires);
+}
+
+static ALWAYS_INLINE bool spawn_coro(struct lwan_connection *conn,
+                                     struct coro_switcher *switcher,
+                                     struct timeout_queue *tq)
+{
+    struct lwan_thread *t = conn->thread;
+#if defined(LWAN_HAVE_MBEDTLS)
+    const enum lwan_connection_flags flags_to_keep = conn->flags & CONN_TLS;
+#else
+    const enum lwan_connection_flags flags_to_keep = 0;
+#endif
+
+    assert(!conn->coro);
+    assert(!(conn->flags & (CONN_ASYNC_AWAIT | CONN_HUNG_UP)));
+    assert(!(conn->flags & CONN_LISTENER));
+    assert(t);
+    assert((uintptr_t)t >= (uintptr_t)tq->lwan->thread.threads);
+    assert((uintptr_t)t <
+           (uintptr_t)(tq->lwan->thread.threads + tq->lwan->thread.count));
+
+    if (conn->flags & CONN_RELEASED_CORO) {
+        /* Everything but the coroutine is still in place, including the
+         * entry in the timeout queue (which resume_coro() will bump.) */
+        conn->coro = coro_pool_new(&t->coro_pool, switcher,
+                                   process_request_coro, conn);
+        if (UNLIKELY(!conn->coro)) {
+            lwan_status_error("Couldn't spawn coroutine for file descriptor %d",
+                              lwan_connection_get_fd(tq->lwan, conn));
+            timeout_queue_expire(tq, conn);
+            return false;
+        }
+
+        t->stats.coros++;
+        t->stats.coros_cached = t->coro_pool.n_free;
+        return true;
+    }
+
+    *conn = (struct lwan_connection){
+        .coro = coro_pool_new(&t->coro_pool, switcher, process_request_coro,
+                              conn),
         .flags = CONN_EVENTS_READ | flags_to_keep,
-        .time_to_expire = tq->current_time + tq->move_to_last_bump,
+        .time_to_expire = timeout_queue_next_expiration(tq),
         .thread = t,
     };
     if (LIKELY(conn->coro)) {
         timeout_queue_insert(tq, conn);
+        t->stats.coros++;
+        t->stats.coros_cached = t->coro_pool.n_free;
         return true;
     }
 
@@ -961,9 +2279,27 @@ static ALWAYS_INLINE bool spawn_coro(struct lwan_connection *conn,
     return false;
 }
 
+/* The timeout queue is only looked at when its oldest connection is due,
+ * rather than every second, so threads with idle connections sleep for as
+ * long as the keep-alive timeout instead of waking up for nothing.  It's
+ * never looked at sooner than a second from now, though: connections due
+ * in the current second (e.g. with a keep-alive timeout of 0) would
+ * otherwise be expired a millisecond after they yield, while waiting for
+ * anything at all.  */
+static void arm_timeout_queue(struct timeout_queue *tq, struct lwan_thread *t)
+{
+    const unsigned int expires = timeout_queue_head_expiration(tq);
+    const unsigned int seconds =
+        expires > tq->current_time ? expires - tq->current_time : 0;
+
+    /* The wheel was last turned before this thread went to sleep, which
+     * might have been a while ago; see lwan_request_sleep(). */
+    timeouts_update(t->wheel, wheel_now());
+    timeouts_add(t->wheel, &tq->timeout, LWAN_MAX(seconds, 1u) * 1000u);
+}
+
 static bool process_pending_timers(struct timeout_queue *tq,
-                                   struct lwan_thread *t,
-                                   int epoll_fd)
+                                   struct lwan_thread *t)
 {
     struct timeout *timeout;
     bool should_expire_timers = false;
@@ -975,8 +2311,10 @@ static bool process_pending_timers(struct timeout_queue *tq,
         }
 
         struct lwan_request *request =
-            container_of(timeout, struct lwan_request, timeout);
-        int r = update_epoll_flags(tq->lwan, request->conn, epoll_fd,
+            UNLIKELY(timeout->flags & TIMEOUT_FLUSH_CHUNKS)
+                ? container_of(timeout, struct lwan_chunk_timer, timeout)->request
+                : container_of(timeout, struct lwan_request, timeout);
+        int r = update_epoll_flags(tq->lwan, request->conn, t,
                                    CONN_CORO_RESUME);
         if (UNLIKELY(r < 0)) {
             timeout_queue_expire(tq, request->conn);
@@ -986,12 +2324,8 @@ static bool process_pending_timers(struct timeout_queue *tq,
     if (should_expire_timers) {
         timeout_queue_expire_waiting(tq);
 
-        /* tq timeout expires every 1000ms if there are connections, so
-         * update the date cache at this point as well.  */
-        update_date_cache(t);
-
         if (!timeout_queue_empty(tq)) {
-            timeouts_add(t->wheel, &tq->timeout, 1000);
+            arm_timeout_queue(tq, t);
             return true;
         }
 
@@ -1001,8 +2335,17 @@ static bool process_pending_timers(struct timeout_queue *tq,
     return false;
 }
 
-static int
-turn_timer_wheel(struct timeout_queue *tq, struct lwan_thread *t, int epoll_fd)
+static void update_queue_time(struct timeout_queue *tq)
+{
+    struct timespec now;
+
+    if (UNLIKELY(clock_gettime(monotonic_clock_id, &now) < 0))
+        lwan_status_critical("Could not get monotonic time");
+
+    tq->current_time = (unsigned int)now.tv_sec;
+}
+
+static int turn_timer_wheel(struct timeout_queue *tq, struct lwan_thread *t)
 {
     const int infinite_timeout = -1;
     timeout_t wheel_timeout;
@@ -1013,6 +2356,7 @@ turn_timer_wheel(struct timeout_queue *tq, struct lwan_thread *t, int epoll_fd)
 
     timeouts_update(t->wheel,
                     (timeout_t)(now.tv_sec * 1000 + now.tv_nsec / 1000000));
+    tq->current_time = (unsigned int)now.tv_sec;
 
     /* Check if there's an expired timer. */
     wheel_timeout = timeouts_timeout(t->wheel);
@@ -1024,20 +2368,126 @@ turn_timer_wheel(struct timeout_queue *tq, struct lwan_thread *t, int epoll_fd)
     if (UNLIKELY((int64_t)wheel_timeout < 0))
         return infinite_timeout; /* None found. */
 
-    if (!process_pending_timers(tq, t, epoll_fd))
+    if (!process_pending_timers(tq, t))
         return infinite_timeout; /* No more timers to process. */
 
     /* After processing pending timers, determine when to wake up. */
     return (int)timeouts_timeout(t->wheel);
 }
 
-static bool accept_waiting_clients(const struct lwan_thread *t,
+static ALWAYS_INLINE int
+accept_client(struct lwan_thread *t,
+              int listen_fd,
+              const struct lwan_connection *listen_socket)
+{
+#if defined(LWAN_HAVE_IO_URING)
+    /* Connections have already been accepted by the kernel by the time
+     * the listener event is received; no system calls are needed to
+     * retrieve them, and registering them in the ring is deferred until
+     * the next wait. */
+    if (t->io_uring)
+        return lwan_io_uring_accept(t->io_uring, listen_socket);
+#else
+    (void)t;
+    (void)listen_socket;
+#endif
+    return accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+}
+
+#ifndef SO_INCOMING_NAPI_ID
+#define SO_INCOMING_NAPI_ID 56
+#endif
+
+/* NIC receive queues (identified by the NAPI ID of the connections they
+ * received) seen by listeners with `steer_by_napi_id`, and the thread that
+ * serves them.  Each entry packs the NAPI ID in the upper 32 bits and the
+ * thread index + 1 in the lower 32 bits; 0 marks an empty slot.  Entries
+ * are never removed: NAPI IDs are only reused when network interfaces come
+ * and go, and a stale entry only costs locality. */
+#define NAPI_TABLE_SIZE 256
+static uint64_t napi_table[NAPI_TABLE_SIZE];
+static unsigned int napi_next_thread;
+
+static uint32_t napi_pick_thread(const struct lwan *l, int fd)
+{
+#if defined(LWAN_HAVE_SO_INCOMING_CPU)
+    int cpu;
+    socklen_t len = sizeof(cpu);
+
+    /* Prefer the thread running on the CPU handling this queue's
+     * interrupts, if there's one... */
+    if (!getsockopt(fd, SOL_SOCKET, SO_INCOMING_CPU, &cpu, &len) && cpu >= 0) {
+        for (uint32_t i = 0; i < l->thread.shared_count; i++) {
+            if (l->thread.threads[i].cpu == (unsigned int)cpu)
+                return i;
+        }
+    }
+#endif
+
+    /* ...otherwise, spread the queues over all shared threads. */
+    return __atomic_fetch_add(&napi_next_thread, 1, __ATOMIC_RELAXED) %
+           l->thread.shared_count;
+}
+
+static struct lwan_thread *napi_steer(const struct lwan *l, int fd)
+{
+    unsigned int napi_id;
+    socklen_t len = sizeof(napi_id);
+
+    /* NAPI IDs are 0 for connections that didn't come from a NIC queue
+     * (e.g. loopback), or if the kernel doesn't track them. */
+    if (getsockopt(fd, SOL_SOCKET, SO_INCOMING_NAPI_ID, &napi_id, &len) < 0 ||
+        !napi_id)
+        return NULL;
+
+    for (unsigned int i = 0; i < NAPI_TABLE_SIZE; i++) {
+        uint64_t *slot = &napi_table[(napi_id + i) % NAPI_TABLE_SIZE];
+        uint64_t entry = __atomic_load_n(slot, __ATOMIC_ACQUIRE);
+
+        if (!entry) {
+            const uint64_t new_entry =
+                (uint64_t)napi_id << 32 | (napi_pick_thread(l, fd) + 1);
+
+            /* If another thread took this slot first, |entry| is updated
+             * with whatever it stored there. */
+            if (__atomic_compare_exchange_n(slot, &entry, new_entry, false,
+                                            __ATOMIC_ACQ_REL,
+                                            __ATOMIC_ACQUIRE))
+                entry = new_entry;
+        }
+
+        if ((entry >> 32) == napi_id)
+            return &l->thread.threads[(uint32_t)entry - 1];
+    }
+
+    return NULL;
+}
+
+static ALWAYS_INLINE struct lwan_thread *
+scheduled_thread(const struct lwan *l, int fd)
+{
+    const uint32_t thread_id =
+        l->thread.conn_schedule[(unsigned int)fd % l->thread.shared_count];
+
+    return &l->thread.threads[thread_id];
+}
+
+static bool accept_waiting_clients(struct lwan_thread *t,
                                    const struct lwan_connection *listen_socket)
 {
     const uint32_t read_events = conn_flags_to_epoll_events(CONN_EVENTS_READ);
     struct lwan_connection *conns = t->lwan->conns;
     int listen_fd = (int)(intptr_t)(listen_socket - conns);
     enum lwan_connection_flags new_conn_flags = listen_socket->flags & CONN_TLS;
+    const struct lwan_listener_options *options =
+        (new_conn_flags & CONN_TLS) ? &t->lwan->config.tls_listener_options
+                                    : &t->lwan->config.listener_options;
+    bool steer_by_napi_id = options->steer_by_napi_id && !t->dedicated;
+
+#if defined(LWAN_HAVE_IO_URING)
+    if (t->io_uring)
+        steer_by_napi_id = false;
+#endif
 
 #if !defined(NDEBUG)
 # if defined(LWAN_HAVE_MBEDTLS)
@@ -1051,146 +2501,587 @@ static bool accept_waiting_clients(const struct lwan_thread *t,
 # endif
 #endif
 
+    t->stats.accept_wakeups++;
+
     while (true) {
-        int fd = accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        int fd = accept_client(t, listen_fd, listen_socket);
 
         if (LIKELY(fd >= 0)) {
             struct lwan_connection *conn = &conns[fd];
             struct epoll_event ev = {.data.ptr = conn, .events = read_events};
             int r;
 
-            conn->flags = new_conn_flags;
+            conn->flags = new_conn_flags;
+
+            if (UNLIKELY(!conn->thread))
+                conn->thread = scheduled_thread(t->lwan, fd);
+
+#if defined(LWAN_HAVE_IO_URING)
+            /* A ring can only be used by the thread that owns it, so the
+             * connection can't be handed over to whichever thread it was
+             * pre-scheduled to. */
+            if (t->io_uring)
+                conn->thread = t;
+#endif
+            /* Connections to dedicated listeners stay in their threads;
+             * file descriptors last used by one of them are taken by
+             * whichever thread accepted them next. */
+            if (UNLIKELY(t->dedicated || conn->thread->dedicated))
+                conn->thread = t;
+
+            if (UNLIKELY(steer_by_napi_id)) {
+                struct lwan_thread *napi_thread = napi_steer(t->lwan, fd);
+
+                if (napi_thread)
+                    conn->thread = napi_thread;
+            }
+
+            t->stats.accepted++;
+            LWAN_TRACE(accept, fd, conn->thread->cpu);
+
+            if (UNLIKELY(should_shed_new_conn(conn->thread))) {
+                t->stats.shed++;
+                send_last_response_without_coro(t->lwan, conn, HTTP_UNAVAILABLE);
+                conn->flags = 0;
+                continue;
+            }
+
+            r = thread_event_ctl(conn->thread, EPOLL_CTL_ADD, fd, &ev);
+            if (UNLIKELY(r < 0)) {
+                lwan_status_perror("Could not add file descriptor %d to the "
+                                   "event queue. Dropping connection",
+                                   fd);
+                send_last_response_without_coro(t->lwan, conn, HTTP_UNAVAILABLE);
+                conn->flags = 0;
+            }
+
+            continue;
+        }
+
+        switch (errno) {
+        default:
+            lwan_status_perror("Unexpected error while accepting connections");
+            /* fallthrough */
+
+        case EAGAIN:
+            return true;
+
+        case EBADF:
+        case ECONNABORTED:
+        case EINVAL:
+            lwan_status_info("Listening socket closed");
+            return false;
+        }
+    }
+
+    __builtin_unreachable();
+}
+
+/* Set in each worker process when there's more than one, in which case
+ * reuseport groups have sockets from all of them. */
+static unsigned int worker_processes = 1;
+
+void lwan_set_worker_processes(unsigned int n_processes)
+{
+    worker_processes = n_processes;
+}
+
+static int create_listen_socket(struct lwan_thread *t, int first_fd, bool tls)
+{
+    const struct lwan *lwan = t->lwan;
+    const struct lwan_listener_options *options;
+    const char *listener;
+    uint32_t n_sockets;
+    int listen_fd;
+
+    if (t->dedicated) {
+        listener = t->dedicated->address;
+        options = &t->dedicated->options;
+        n_sockets = t->dedicated->n_threads;
+    } else if (tls) {
+        listener = lwan->config.tls_listener;
+        options = &lwan->config.tls_listener_options;
+        n_sockets = lwan->thread.shared_count;
+    } else {
+        listener = lwan->config.listener;
+        options = &lwan->config.listener_options;
+        n_sockets = lwan->thread.shared_count;
+    }
+
+    listen_fd = lwan_create_listen_socket(lwan, listener, options, first_fd, tls);
+    if (listen_fd < 0)
+        lwan_status_critical("Could not create listen_fd");
+
+    /* Ignore errors here, as this is just a hint */
+#if defined(LWAN_HAVE_SO_ATTACH_REUSEPORT_CBPF)
+    /* FIXME: this doesn't seem to work as expected.  if the program returns
+     * a fixed number, sockets are always accepted by a thread pinned to
+     * that particular CPU; if SKF_AD_CPU is used, sockets are accepted by
+     * random threads as if this BPF script weren't installed at all.  */
+
+    /* From socket(7): "These  options may be set repeatedly at any time on
+     * any socket in the group to replace the current BPF program used by
+     * all sockets in the group." */
+    /* With more than one worker process, the program would only know
+     * about the sockets of the first one, and send every connection to
+     * it (and lock others out of replacing it) */
+    if (first_fd < 0 && options->steer_by_cpu && worker_processes == 1) {
+        /* From socket(7): "The  BPF program must return an index between 0
+         * and N-1 representing the socket which should receive the packet
+         * (where N is the number of sockets in the group)."
+         *
+         * This should work because sockets are created in the same
+         * reuseport group, in the same order as the logical CPU#, and the
+         * worker threads for these sockets are pinned to the same CPU#. The
+         * MOD operation is there for cases where we have more CPUs than
+         * threads (e.g. by setting the "threads" setting in the configuration
+         * file); this isn't strictly necessary as any invalid value returned
+         * by this program will direct the connection to a random socket in
+         * the group.
+         *
+         * Unfortunately, this program doesn't work that way.  Sockets seem
+         * to be delivered to a different thread every time.  Maybe if we
+         * change this to eBPF, we'll be able to fetch the file descriptor
+         * and feed that into our scheduling table. */
+        const uint32_t cpu_ad_cpu = (uint32_t)SKF_AD_OFF + SKF_AD_CPU;
+        struct sock_filter filter[] = {
+            {BPF_LD | BPF_W | BPF_ABS, 0, 0, cpu_ad_cpu}, /* A = current_cpu_idx */
+            {BPF_ALU | BPF_MOD, 0, 0, n_sockets},         /* A %= socket_count */
+            {BPF_RET | BPF_A, 0, 0, 0},                   /* return A */
+        };
+        struct sock_fprog fprog = {.filter = filter, .len = N_ELEMENTS(filter)};
+
+        if (n_sockets > 1 && (n_sockets & (n_sockets - 1)) == 0) {
+            /* Not sure if the kernel will perform strength reduction
+             * on CBPF, so do it here.  This is a common case. */
+            assert(filter[1].code == (BPF_ALU | BPF_MOD));
+            assert(filter[1].k == n_sockets);
+
+            filter[1].code = BPF_ALU | BPF_AND;
+            filter[1].k = n_sockets - 1;
+        }
+
+        (void)setsockopt(listen_fd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF,
+                         &fprog, sizeof(fprog));
+        (void)setsockopt(listen_fd, SOL_SOCKET, SO_LOCK_FILTER, (int[]){1},
+                         sizeof(int));
+    }
+#elif defined(LWAN_HAVE_SO_INCOMING_CPU) && defined(__x86_64__)
+    if (options->steer_by_cpu) {
+        (void)setsockopt(listen_fd, SOL_SOCKET, SO_INCOMING_CPU, &t->cpu,
+                         sizeof(t->cpu));
+    }
+    (void)n_sockets;
+#else
+    (void)n_sockets;
+#endif
+
+#if defined(LWAN_HAVE_IO_URING)
+    if (t->io_uring) {
+        if (lwan_io_uring_watch_listener(t->io_uring, listen_fd,
+                                         &lwan->conns[listen_fd]) < 0)
+            lwan_status_critical_perror("Could not accept on listen socket");
+        return listen_fd;
+    }
+#endif
+
+    struct epoll_event event = {
+        .events = EPOLLIN | EPOLLET | EPOLLERR,
+        .data.ptr = &lwan->conns[listen_fd],
+    };
+    if (thread_event_ctl(t, EPOLL_CTL_ADD, listen_fd, &event) < 0)
+        lwan_status_critical_perror("Could not add socket to epoll");
+
+    return listen_fd;
+}
+
+struct pubsub_resume_ctx {
+    struct timeout_queue *tq;
+    struct lwan_thread *t;
+};
+
+static bool resume_pubsub_subscriber(int fd, void *data)
+{
+    struct pubsub_resume_ctx *ctx = data;
+    struct lwan_connection *conn = &ctx->t->lwan->conns[fd];
+
+    /* Only coroutines blocked in lwan_request_awaitv_*() on this fd can be
+     * resumed as if epoll said it was readable: others might be sleeping or
+     * waiting on something else, and are notified through the fd itself. */
+    if (!(conn->flags & CONN_ASYNC_AWAITV) || conn->thread != ctx->t ||
+        !conn->coro)
+        return false;
+
+    resume_coro(ctx->tq, conn->parent, conn, ctx->t);
+    return true;
+}
+
+static struct lwan_connection *watch_pubsub_waker(struct lwan_thread *t,
+                                                  struct lwan_pubsub_waker *waker)
+{
+    struct lwan *lwan = t->lwan;
+    const int fd = lwan_pubsub_waker_get_fd(waker);
+    struct epoll_event event = {
+        .events = EPOLLIN,
+        .data.ptr = &lwan->conns[fd],
+    };
+
+    if (fd < 0 || (unsigned int)fd >= lwan->thread.max_fd)
+        return NULL;
+    if (thread_event_ctl(t, EPOLL_CTL_ADD, fd, &event) < 0)
+        return NULL;
+
+    /* Events for listeners are rare enough that telling the waker apart
+     * from them doesn't cost anything for regular connections. */
+    lwan->conns[fd].flags = CONN_LISTENER;
+
+    return &lwan->conns[fd];
+}
+
+DEFINE_ARRAY_TYPE(conn_ptr_array, struct lwan_connection *)
+
+struct lwan_thread_doorbell {
+    pthread_mutex_t lock;
+    struct conn_ptr_array conns;
+    int fd;
+};
+
+static struct lwan_thread_doorbell *doorbell_new(void)
+{
+    struct lwan_thread_doorbell *doorbell = malloc(sizeof(*doorbell));
+
+    if (!doorbell)
+        lwan_status_critical("Could not allocate doorbell");
+
+    doorbell->fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (doorbell->fd < 0)
+        lwan_status_critical_perror("Could not create doorbell eventfd");
+
+    pthread_mutex_init(&doorbell->lock, NULL);
+    conn_ptr_array_init(&doorbell->conns);
+
+    return doorbell;
+}
+
+static void doorbell_free(struct lwan_thread_doorbell *doorbell)
+{
+    if (!doorbell)
+        return;
+
+    conn_ptr_array_reset(&doorbell->conns);
+    pthread_mutex_destroy(&doorbell->lock);
+    close(doorbell->fd);
+    free(doorbell);
+}
+
+static struct lwan_connection *watch_doorbell(struct lwan_thread *t)
+{
+    struct lwan *lwan = t->lwan;
+    const int fd = t->doorbell->fd;
+    struct epoll_event event = {
+        .events = EPOLLIN,
+        .data.ptr = &lwan->conns[fd],
+    };
+
+    if ((unsigned int)fd >= lwan->thread.max_fd)
+        lwan_status_critical("Doorbell eventfd %d is out of range", fd);
+    if (thread_event_ctl(t, EPOLL_CTL_ADD, fd, &event) < 0)
+        lwan_status_critical_perror("Could not watch doorbell eventfd");
+
+    lwan->conns[fd].flags = CONN_LISTENER;
+
+    return &lwan->conns[fd];
+}
+
+static void ring_doorbell(struct timeout_queue *tq, struct lwan_thread *t)
+{
+    struct lwan_thread_doorbell *doorbell = t->doorbell;
+    struct lwan_connection **conn;
+    struct conn_ptr_array conns;
+    eventfd_t ignored;
+
+    /* Like lwan_pubsub_waker_deliver(): anything added after the eventfd
+     * has been reset causes another wakeup. */
+    LWAN_NO_DISCARD(eventfd_read(doorbell->fd, &ignored));
+
+    pthread_mutex_lock(&doorbell->lock);
+    conns = doorbell->conns;
+    conn_ptr_array_init(&doorbell->conns);
+    pthread_mutex_unlock(&doorbell->lock);
+
+    LWAN_ARRAY_FOREACH (&conns, conn) {
+        /* Might have been closed (and its fd reused) in the meantime */
+        if (LIKELY((*conn)->coro && (*conn)->thread == t))
+            resume_coro(tq, *conn, *conn, t);
+    }
+
+    conn_ptr_array_reset(&conns);
+}
+
+void lwan_thread_park_conn(struct lwan_request *request, bool keep_events)
+{
+    struct lwan_connection *conn = request->conn;
+
+    /* Nothing is going to be sent while it's parked, which could take
+     * a while, so coalesced chunks go out now.  Sending them might have
+     * waited, and missed a wake up in the mean time, so this returns as
+     * if it were spurious; callers check again anyway.  */
+    if (lwan_response_flush_chunks(request))
+        return;
+
+    /* Yielding without changing the events this connection is waiting for
+     * saves two epoll_ctl() calls (to suspend it, and to resume it
+     * afterwards), but only if these events won't keep resuming it in the
+     * meantime: that's the case if it's waiting to write, and might be the
+     * case if it's waiting to read (e.g. a pipelined request), so callers
+     * only keep the events until a spurious wakeup.  */
+    if (keep_events && !(conn->flags & CONN_EVENTS_MASK & CONN_EVENTS_WRITE))
+        coro_yield(conn->coro, CONN_CORO_YIELD);
+    else
+        coro_yield(conn->coro, CONN_CORO_SUSPEND);
+}
+
+void lwan_thread_wake_conn(struct lwan_connection *conn)
+{
+    struct lwan_thread *t = conn->thread;
+    struct lwan_thread_doorbell *doorbell = t->doorbell;
+    bool needs_ring;
+
+    /* If the coroutine belongs to this thread, it's resumed after the
+     * events of the current iteration of the event loop have been handled,
+     * just like coroutines whose time slice expired. */
+    if (pthread_equal(t->self, pthread_self())) {
+        for (unsigned int i = 0; i < t->run_queue.count; i++) {
+            if (t->run_queue.conns[i] == conn)
+                return;
+        }
+        if (LIKELY(t->run_queue.count < N_ELEMENTS(t->run_queue.conns))) {
+            t->run_queue.conns[t->run_queue.count++] = conn;
+            return;
+        }
+    }
+
+    pthread_mutex_lock(&doorbell->lock);
+    needs_ring = !doorbell->conns.base.elements;
+    struct lwan_connection **slot = conn_ptr_array_append(&doorbell->conns);
+    if (LIKELY(slot))
+        *slot = conn;
+    else
+        lwan_status_error("Could not queue wakeup for a parked coroutine");
+    pthread_mutex_unlock(&doorbell->lock);
+
+    if (needs_ring && UNLIKELY(eventfd_write(doorbell->fd, 1) < 0))
+        lwan_status_perror("write to doorbell eventfd failed, ignoring");
+}
+
+struct fd_watcher {
+    struct lwan_connection *conn;
+    lwan_thread_fd_watcher_cb cb;
+    void *data;
+};
+
+DEFINE_ARRAY_TYPE(fd_watcher_array, struct fd_watcher)
+
+struct lwan_thread_fd_watchers {
+    struct fd_watcher_array array;
+};
+
+static struct fd_watcher *find_fd_watcher(const struct lwan_thread *t,
+                                          const struct lwan_connection *conn)
+{
+    struct fd_watcher *watcher;
+
+    if (!t->fd_watchers)
+        return NULL;
+
+    LWAN_ARRAY_FOREACH (&t->fd_watchers->array, watcher) {
+        if (watcher->conn == conn)
+            return watcher;
+    }
+
+    return NULL;
+}
+
+int lwan_thread_add_fd_watcher(struct lwan_thread *t,
+                               int fd,
+                               uint32_t events,
+                               lwan_thread_fd_watcher_cb cb,
+                               void *data)
+{
+    struct lwan *lwan = t->lwan;
+    struct epoll_event event = {.events = events, .data.ptr = &lwan->conns[fd]};
+    struct fd_watcher *watcher;
+
+    assert(pthread_equal(t->self, pthread_self()));
+
+    if (UNLIKELY((unsigned int)fd >= lwan->thread.max_fd))
+        return -EBADF;
+
+    if (!t->fd_watchers) {
+        t->fd_watchers = malloc(sizeof(*t->fd_watchers));
+        if (!t->fd_watchers)
+            return -ENOMEM;
+        fd_watcher_array_init(&t->fd_watchers->array);
+    }
+
+    watcher = fd_watcher_array_append(&t->fd_watchers->array);
+    if (!watcher)
+        return -ENOMEM;
+
+    if (thread_event_ctl(t, EPOLL_CTL_ADD, fd, &event) < 0) {
+        int r = -errno;
+
+        t->fd_watchers->array.base.elements--;
+        return r;
+    }
+
+    *watcher = (struct fd_watcher){
+        .conn = &lwan->conns[fd],
+        .cb = cb,
+        .data = data,
+    };
+
+    /* Like the pubsub waker and the doorbell, watched file descriptors are
+     * told apart from listeners only when a listener event is received. */
+    lwan->conns[fd].flags = CONN_LISTENER;
+
+    return 0;
+}
+
+int lwan_thread_mod_fd_watcher(struct lwan_thread *t, int fd, uint32_t events)
+{
+    struct epoll_event event = {.events = events,
+                                .data.ptr = &t->lwan->conns[fd]};
+
+    return thread_event_ctl(t, EPOLL_CTL_MOD, fd, &event) < 0 ? -errno : 0;
+}
+
+void lwan_thread_del_fd_watcher(struct lwan_thread *t, int fd)
+{
+    struct lwan_connection *conn = &t->lwan->conns[fd];
+    struct fd_watcher *watcher = find_fd_watcher(t, conn);
+
+    /* Nothing to do if the thread has been shut down already */
+    if (!watcher)
+        return;
+
+    thread_event_ctl(t, EPOLL_CTL_DEL, fd, NULL);
+    conn->flags = 0;
+
+    struct fd_watcher_array *array = &t->fd_watchers->array;
+    *watcher = *fd_watcher_array_get_elem(array, fd_watcher_array_len(array) - 1);
+    array->base.elements--;
+}
+
+static bool dispatch_fd_watcher(struct lwan_thread *t,
+                                struct lwan_connection *conn,
+                                uint32_t events)
+{
+    struct fd_watcher *watcher = find_fd_watcher(t, conn);
 
-            r = epoll_ctl(conn->thread->epoll_fd, EPOLL_CTL_ADD, fd, &ev);
-            if (UNLIKELY(r < 0)) {
-                lwan_status_perror("Could not add file descriptor %d to epoll "
-                                   "set %d. Dropping connection",
-                                   fd, conn->thread->epoll_fd);
-                send_last_response_without_coro(t->lwan, conn, HTTP_UNAVAILABLE);
-                conn->flags = 0;
-            }
+    if (!watcher)
+        return false;
 
-            continue;
-        }
+    watcher->cb(watcher->data, events);
+    return true;
+}
 
-        switch (errno) {
-        default:
-            lwan_status_perror("Unexpected error while accepting connections");
-            /* fallthrough */
+static void fd_watchers_free(struct lwan_thread *t)
+{
+    struct fd_watcher *watcher;
 
-        case EAGAIN:
-            return true;
+    if (!t->fd_watchers)
+        return;
 
-        case EBADF:
-        case ECONNABORTED:
-        case EINVAL:
-            lwan_status_info("Listening socket closed");
-            return false;
-        }
+    LWAN_ARRAY_FOREACH (&t->fd_watchers->array, watcher) {
+        watcher->conn->flags = 0;
+        watcher->cb(watcher->data, 0);
     }
 
-    __builtin_unreachable();
+    fd_watcher_array_reset(&t->fd_watchers->array);
+    free(t->fd_watchers);
+    t->fd_watchers = NULL;
 }
 
-static int create_listen_socket(struct lwan_thread *t,
-                                unsigned int num,
-                                bool tls)
+static struct lwan_connection *watch_drain_fd(struct lwan_thread *t)
 {
-    const struct lwan *lwan = t->lwan;
-    int listen_fd;
+    struct lwan *lwan = t->lwan;
+    const int fd = lwan_upgrade_get_drain_fd();
+    struct epoll_event event = {
+        .events = EPOLLIN,
+        .data.ptr = &lwan->conns[fd],
+    };
 
-    listen_fd = lwan_create_listen_socket(lwan, num == 0, tls);
-    if (listen_fd < 0)
-        lwan_status_critical("Could not create listen_fd");
+    if (fd < 0 || (unsigned int)fd >= lwan->thread.max_fd)
+        return NULL;
+    if (thread_event_ctl(t, EPOLL_CTL_ADD, fd, &event) < 0)
+        return NULL;
 
-    /* Ignore errors here, as this is just a hint */
-#if defined(LWAN_HAVE_SO_ATTACH_REUSEPORT_CBPF)
-    /* FIXME: this doesn't seem to work as expected.  if the program returns
-     * a fixed number, sockets are always accepted by a thread pinned to
-     * that particular CPU; if SKF_AD_CPU is used, sockets are accepted by
-     * random threads as if this BPF script weren't installed at all.  */
+    lwan->conns[fd].flags = CONN_LISTENER;
 
-    /* From socket(7): "These  options may be set repeatedly at any time on
-     * any socket in the group to replace the current BPF program used by
-     * all sockets in the group." */
-    if (num == 0) {
-        /* From socket(7): "The  BPF program must return an index between 0
-         * and N-1 representing the socket which should receive the packet
-         * (where N is the number of sockets in the group)."
-         *
-         * This should work because sockets are created in the same
-         * reuseport group, in the same order as the logical CPU#, and the
-         * worker threads for these sockets are pinned to the same CPU#. The
-         * MOD operation is there for cases where we have more CPUs than
-         * threads (e.g. by setting the "threads" setting in the configuration
-         * file); this isn't strictly necessary as any invalid value returned
-         * by this program will direct the connection to a random socket in
-         * the group.
-         *
-         * Unfortunately, this program doesn't work that way.  Sockets seem
-         * to be delivered to a different thread every time.  Maybe if we
-         * change this to eBPF, we'll be able to fetch the file descriptor
-         * and feed that into our scheduling table. */
-        const uint32_t cpu_ad_cpu = (uint32_t)SKF_AD_OFF + SKF_AD_CPU;
-        const uint32_t n_sockets = lwan->thread.count;
-        struct sock_filter filter[] = {
-            {BPF_LD | BPF_W | BPF_ABS, 0, 0, cpu_ad_cpu}, /* A = current_cpu_idx */
-            {BPF_ALU | BPF_MOD, 0, 0, n_sockets},         /* A %= socket_count */
-            {BPF_RET | BPF_A, 0, 0, 0},                   /* return A */
-        };
-        struct sock_fprog fprog = {.filter = filter, .len = N_ELEMENTS(filter)};
+    return &lwan->conns[fd];
+}
 
-        if (n_sockets > 1 && (n_sockets & (n_sockets - 1)) == 0) {
-            /* Not sure if the kernel will perform strength reduction
-             * on CBPF, so do it here.  This is a common case. */
-            assert(filter[1].code == (BPF_ALU | BPF_MOD));
-            assert(filter[1].k == n_sockets);
+/* Called once the listeners have been handed over to another process:
+ * connections waiting to be accepted are left for it, and the ones this
+ * thread has are closed after their current request (see
+ * lwan_request_parse_headers()) or once they time out. */
+static void stop_accepting(struct lwan_thread *t,
+                           struct lwan_connection *drain_conn)
+{
+    struct lwan *lwan = t->lwan;
+    const int listen_fds[] = {t->listen_fd, t->tls_listen_fd};
 
-            filter[1].code = BPF_ALU | BPF_AND;
-            filter[1].k = n_sockets - 1;
-        }
+    for (size_t i = 0; i < N_ELEMENTS(listen_fds); i++) {
+        const int fd = listen_fds[i];
 
-        (void)setsockopt(listen_fd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF,
-                         &fprog, sizeof(fprog));
-        (void)setsockopt(listen_fd, SOL_SOCKET, SO_LOCK_FILTER, (int[]){1},
-                         sizeof(int));
-    }
-#elif defined(LWAN_HAVE_SO_INCOMING_CPU) && defined(__x86_64__)
-    (void)setsockopt(listen_fd, SOL_SOCKET, SO_INCOMING_CPU, &t->cpu,
-                     sizeof(t->cpu));
-#endif
+        if (fd < 0)
+            continue;
 
-    struct epoll_event event = {
-        .events = EPOLLIN | EPOLLET | EPOLLERR,
-        .data.ptr = &lwan->conns[listen_fd],
-    };
-    if (epoll_ctl(t->epoll_fd, EPOLL_CTL_ADD, listen_fd, &event) < 0)
-        lwan_status_critical_perror("Could not add socket to epoll");
+#if defined(LWAN_HAVE_IO_URING)
+        if (t->io_uring) {
+            if (lwan_io_uring_unwatch_listener(t->io_uring,
+                                               &lwan->conns[fd]) < 0)
+                lwan_status_perror("Could not stop accepting on %d", fd);
+            continue;
+        }
+#endif
+        if (thread_event_ctl(t, EPOLL_CTL_DEL, fd, NULL) < 0)
+            lwan_status_perror("Could not stop accepting on %d", fd);
+    }
 
-    return listen_fd;
+    thread_event_ctl(t, EPOLL_CTL_DEL, (int)(drain_conn - lwan->conns), NULL);
+    t->draining = true;
 }
 
 static void *thread_io_loop(void *data)
 {
     struct lwan_thread *t = data;
-    int epoll_fd = t->epoll_fd;
     const int max_events = LWAN_MIN((int)t->lwan->thread.max_fd, 1024);
     struct lwan *lwan = t->lwan;
     struct epoll_event *events;
     struct coro_switcher switcher;
     struct timeout_queue tq;
+    const bool track_overload = lwan->config.overload_latency_target != 0;
+    int ignore;
 
     if (t->cpu == UINT_MAX) {
         lwan_status_debug("Worker thread #%zd starting",
                           t - t->lwan->thread.threads + 1);
     } else {
-        lwan_status_debug("Worker thread #%zd starting on CPU %d",
+        lwan_status_debug("Worker thread #%zd starting on CPU %d (NUMA node %u)",
                           t - t->lwan->thread.threads + 1,
-                          t->cpu);
+                          t->cpu, t->numa_node);
     }
 
     lwan_set_thread_name("worker");
 
+    /* Created here rather than in create_thread() so that it's allocated
+     * in memory local to this thread (see adjust_thread_affinity().) */
+    t->wheel = timeouts_open(&ignore);
+    if (UNLIKELY(!t->wheel))
+        lwan_status_critical("Could not create timer wheel");
+
     events = calloc((size_t)max_events, sizeof(*events));
     if (UNLIKELY(!events))
         lwan_status_critical("Could not allocate memory for events");
@@ -1198,15 +3089,46 @@ static void *thread_io_loop(void *data)
     update_date_cache(t);
 
     timeout_queue_init(&tq, lwan);
+    coro_pool_init(&t->coro_pool, CORO_POOL_SIZE);
+
+    struct lwan_pubsub_waker *pubsub_waker = lwan_pubsub_waker_new();
+    struct lwan_connection *pubsub_waker_conn = NULL;
+    if (pubsub_waker) {
+        pubsub_waker_conn = watch_pubsub_waker(t, pubsub_waker);
+        if (!pubsub_waker_conn) {
+            lwan_status_warning("Could not watch pubsub waker; subscribers "
+                                "will be notified individually");
+            lwan_pubsub_waker_free(pubsub_waker);
+            pubsub_waker = NULL;
+        }
+    }
+    struct pubsub_resume_ctx pubsub_resume_ctx = {.tq = &tq, .t = t};
+    struct lwan_connection *drain_conn = watch_drain_fd(t);
+    struct lwan_connection *doorbell_conn = watch_doorbell(t);
 
     lwan_random_seed_prng_for_thread(t);
 
     pthread_barrier_wait(&lwan->thread.barrier);
 
     for (;;) {
-        int timeout = turn_timer_wheel(&tq, t, epoll_fd);
-        int n_fds = epoll_wait(epoll_fd, events, max_events, timeout);
+        int timeout = turn_timer_wheel(&tq, t);
+
+        if (UNLIKELY(t->draining)) {
+            if (timeout_queue_empty(&tq))
+                __atomic_store_n(&t->drained, true, __ATOMIC_RELEASE);
+
+            /* Nothing else might wake this thread up once its connections
+             * are gone, and lwan_thread_shutdown() has to be noticed */
+            if (timeout < 0 || timeout > 100)
+                timeout = 100;
+        }
+
+        /* Don't block while there are coroutines waiting to run */
+        int n_fds = wait_for_events(t, events, max_events,
+                                    t->run_queue.count ? 0 : timeout);
         bool created_coros = false;
+        uint64_t batch_ns;
+        uint64_t ready_ns;
 
         if (UNLIKELY(n_fds < 0)) {
             if (errno == EBADF || errno == EINVAL)
@@ -1214,10 +3136,27 @@ static void *thread_io_loop(void *data)
             continue;
         }
 
+        /* Only when there's something to do, as responses need it; the
+         * queue clock as well, as connections are bumped relative to it */
+        update_date_cache(t);
+        update_queue_time(&tq);
+
+        batch_ns = UNLIKELY(lwan_latency_enabled || track_overload)
+                       ? precise_monotonic_ns()
+                       : 0;
+        ready_ns = UNLIKELY(lwan_latency_enabled) ? batch_ns : 0;
+
+        t->stats.wakeups++;
+        t->stats.events += (uint64_t)n_fds;
+
         for (struct epoll_event *event = events; n_fds--; event++) {
             struct lwan_connection *conn = event->data.ptr;
 
             if (conn->flags & CONN_ASYNC_AWAIT) {
+                /* Not awaited by anything anymore; see unasync_await_conn() */
+                if (UNLIKELY(!conn->coro))
+                    continue;
+
                 /* Assert that the connection is part of the conns array,
                  * since the storage for conn->parent is shared with
                  * prev/next. */
@@ -1243,78 +3182,85 @@ static void *thread_io_loop(void *data)
                 if (UNLIKELY(events->events & (EPOLLRDHUP | EPOLLHUP)))
                     conn->flags |= CONN_HUNG_UP;
 
-                resume_coro(&tq, conn->parent, conn, epoll_fd);
+                resume_coro_timed(&tq, conn->parent, conn, t, ready_ns);
 
                 continue;
             }
 
             if (conn->flags & CONN_LISTENER) {
+                if (conn == pubsub_waker_conn) {
+                    lwan_pubsub_waker_deliver(pubsub_waker,
+                                              resume_pubsub_subscriber,
+                                              &pubsub_resume_ctx);
+                    continue;
+                }
+                if (UNLIKELY(conn == drain_conn)) {
+                    stop_accepting(t, drain_conn);
+                    continue;
+                }
+                if (conn == doorbell_conn) {
+                    ring_doorbell(&tq, t);
+                    continue;
+                }
+                if (dispatch_fd_watcher(t, conn, event->events))
+                    continue;
                 if (LIKELY(accept_waiting_clients(t, conn)))
                     continue;
-                close(epoll_fd);
-                epoll_fd = -1;
+                thread_event_close(t);
                 break;
             }
 
+            if (UNLIKELY(conn_is_migrating(conn))) {
+                if (UNLIKELY(!adopt_migrated_conn(&tq, conn, t)))
+                    continue;
+
+                created_coros = true;
+                if (!(event->events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP)))
+                    continue;
+            }
+
             if (UNLIKELY(event->events & (EPOLLRDHUP | EPOLLHUP))) {
                 timeout_queue_expire(&tq, conn);
                 continue;
             }
 
             if (!conn->coro) {
-                if (UNLIKELY(!spawn_coro(conn, &switcher, &tq))) {
-                    send_last_response_without_coro(t->lwan, conn, HTTP_UNAVAILABLE);
+                if (UNLIKELY(!spawn_coro(conn, &switcher, &tq)))
                     continue;
-                }
 
                 created_coros = true;
             }
 
-            resume_coro(&tq, conn, conn, epoll_fd);
+            resume_coro_timed(&tq, conn, conn, t, ready_ns);
         }
 
-        if (created_coros)
-            timeouts_add(t->wheel, &tq.timeout, 1000);
+        if (UNLIKELY(t->run_queue.count))
+            resume_rescheduled_coros(&tq, t);
+
+        if (UNLIKELY(track_overload))
+            update_overload_state(t, batch_ns);
+
+        if (created_coros && !tq.timeout.pending && !timeout_queue_empty(&tq))
+            arm_timeout_queue(&tq, t);
     }
 
     pthread_barrier_wait(&lwan->thread.barrier);
 
     timeout_queue_expire_all(&tq);
+    coro_pool_shutdown(&t->coro_pool);
+    if (pubsub_waker) {
+        /* Subscribers from this thread are gone by now, as they're tied to
+         * the coroutines that expired above. */
+        pubsub_waker_conn->flags = 0;
+        lwan_pubsub_waker_free(pubsub_waker);
+    }
+    doorbell_conn->flags = 0;
+    lwan_strbuf_pool_drain();
     free(events);
 
     return NULL;
 }
 
-static void create_thread(struct lwan *l, struct lwan_thread *thread)
-{
-    int ignore;
-    pthread_attr_t attr;
-
-    thread->lwan = l;
-
-    thread->wheel = timeouts_open(&ignore);
-    if (!thread->wheel)
-        lwan_status_critical("Could not create timer wheel");
-
-    if ((thread->epoll_fd = epoll_create1(EPOLL_CLOEXEC)) < 0)
-        lwan_status_critical_perror("epoll_create");
-
-    if (pthread_attr_init(&attr))
-        lwan_status_critical_perror("pthread_attr_init");
-
-    if (pthread_attr_setscope(&attr, PTHREAD_SCOPE_SYSTEM))
-        lwan_status_critical_perror("pthread_attr_setscope");
-
-    if (pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_JOINABLE))
-        lwan_status_critical_perror("pthread_attr_setdetachstate");
-
-    if (pthread_create(&thread->self, &attr, thread_io_loop, thread))
-        lwan_status_critical_perror("pthread_create");
-
-    if (pthread_attr_destroy(&attr))
-        lwan_status_critical_perror("pthread_attr_destroy");
-}
-
 #if defined(__linux__) && defined(__x86_64__)
 static bool read_cpu_topology(struct lwan *l, uint32_t siblings[])
 {
@@ -1435,27 +3381,163 @@ topology_to_schedtbl(struct lwan *l, uint32_t schedtbl[], uint32_t n_threads)
     }
 
     for (uint32_t i = 0; i < n_threads; i++)
-        schedtbl[i] = (i / 2) % l->thread.count;
+        schedtbl[i] = (i / 2) % n_threads;
 
     free(siblings);
     return false;
 }
 
+static unsigned int read_cpu_numa_node(unsigned int cpu)
+{
+    char path[PATH_MAX];
+    struct dirent *entry;
+    unsigned int node = 0;
+    DIR *dir;
+
+    /* Each CPU directory has a "nodeN" symlink to the node it belongs to,
+     * if the kernel has been built with NUMA support. */
+    snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%u", cpu);
+    dir = opendir(path);
+    if (!dir)
+        return 0;
+
+    while ((entry = readdir(dir))) {
+        if (strncmp(entry->d_name, "node", 4))
+            continue;
+        if (sscanf(entry->d_name + 4, "%u", &node) == 1)
+            break;
+    }
+
+    closedir(dir);
+    return node;
+}
+
 static void
-adjust_thread_affinity(const struct lwan_thread *thread)
+adjust_thread_affinity(pthread_attr_t *attr, const struct lwan_thread *thread)
 {
     cpu_set_t set;
 
     CPU_ZERO(&set);
     CPU_SET(thread->cpu, &set);
 
-    if (pthread_setaffinity_np(thread->self, sizeof(set), &set))
+    /* This is set before the thread is created, rather than once it's
+     * running, so that everything it allocates and touches first (its
+     * stack, timer wheel, coroutines, etc.) is placed by the kernel in the
+     * memory of the NUMA node it's going to run on.  */
+    if (pthread_attr_setaffinity_np(attr, sizeof(set), &set))
         lwan_status_warning("Could not set thread affinity");
 }
 #else
+#define read_cpu_numa_node(...) 0
 #define adjust_thread_affinity(...)
 #endif
 
+/* Threads aren't pinned to these CPUs, but they're still used to steer
+ * connections (see napi_pick_thread()), so they have to be CPUs this
+ * process can run on. */
+static unsigned int nth_allowed_cpu(unsigned int n, unsigned int online_cpus)
+{
+#if defined(__linux__)
+    cpu_set_t set;
+
+    if (!sched_getaffinity(0, sizeof(set), &set) && CPU_COUNT(&set)) {
+        n %= (unsigned int)CPU_COUNT(&set);
+
+        for (unsigned int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+            if (CPU_ISSET(cpu, &set) && !n--)
+                return cpu;
+        }
+    }
+#endif
+
+    return n % online_cpus;
+}
+
+/* Lets epoll_wait() itself busy poll the NIC queues of the sockets it's
+ * watching (Linux 6.9+) before sleeping, like SO_BUSY_POLL does for reads.
+ * Older kernels, and other platforms, only get the spinning done by
+ * wait_for_events(). */
+static void set_epoll_busy_poll(int epoll_fd, unsigned int usecs)
+{
+#if defined(__linux__)
+#ifndef EPIOCSPARAMS
+    struct epoll_params {
+        uint32_t busy_poll_usecs;
+        uint16_t busy_poll_budget;
+        uint8_t prefer_busy_poll;
+        uint8_t __pad;
+    };
+#define EPIOCSPARAMS _IOW(0x8A, 0x01, struct epoll_params)
+#endif
+    struct epoll_params params = {
+        .busy_poll_usecs = usecs,
+        /* Same as the default budget for SO_BUSY_POLL */
+        .busy_poll_budget = 8,
+    };
+
+    if (ioctl(epoll_fd, EPIOCSPARAMS, &params) < 0)
+        lwan_status_debug("Kernel doesn't support busy polling in epoll");
+#else
+    (void)epoll_fd;
+    (void)usecs;
+#endif
+}
+
+static void create_thread(struct lwan *l, struct lwan_thread *thread, bool pin)
+{
+    pthread_attr_t attr;
+
+    thread->lwan = l;
+    thread->busy_poll_ns = (uint64_t)l->config.busy_poll_time * 1000ull;
+    thread->access_log = lwan_access_log_ring_new();
+    thread->tracing = lwan_tracing_ring_new();
+    thread->doorbell = doorbell_new();
+    lwan_latency_thread_init(thread);
+
+#if defined(LWAN_HAVE_IO_URING)
+    if (l->config.io_uring) {
+        const unsigned int max_events = LWAN_MIN(l->thread.max_fd, 1024u);
+
+        thread->io_uring = lwan_io_uring_new(l, max_events);
+        if (thread->io_uring) {
+            thread->epoll_fd = -1;
+            goto event_queue_created;
+        }
+
+        lwan_status_warning("Could not set up io_uring, falling back "
+                            "to epoll");
+    }
+#endif
+
+    if ((thread->epoll_fd = epoll_create1(EPOLL_CLOEXEC)) < 0)
+        lwan_status_critical_perror("epoll_create");
+    if (l->config.busy_poll_time)
+        set_epoll_busy_poll(thread->epoll_fd, l->config.busy_poll_time);
+
+#if defined(LWAN_HAVE_IO_URING)
+event_queue_created:
+#endif
+
+    if (pthread_attr_init(&attr))
+        lwan_status_critical_perror("pthread_attr_init");
+
+    if (pthread_attr_setscope(&attr, PTHREAD_SCOPE_SYSTEM))
+        lwan_status_critical_perror("pthread_attr_setscope");
+
+    if (pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_JOINABLE))
+        lwan_status_critical_perror("pthread_attr_setdetachstate");
+
+    if (pin)
+        adjust_thread_affinity(&attr, thread);
+
+    if (pthread_create(&thread->self, &attr, thread_io_loop, thread))
+        lwan_status_critical_perror("pthread_create");
+
+    if (pthread_attr_destroy(&attr))
+        lwan_status_critical_perror("pthread_attr_destroy");
+}
+
+
 #if defined(LWAN_HAVE_MBEDTLS)
 static bool is_tls_ulp_supported(void)
 {
@@ -1477,17 +3559,28 @@ static bool is_tls_ulp_supported(void)
 
 static bool lwan_init_tls(struct lwan *l)
 {
-    static const int aes128_ciphers[] = {
+    static const int ktls_ciphers[] = {
         /* Only allow Ephemeral Diffie-Hellman key exchange, so Perfect
-         * Forward Secrecy is possible.  */
+         * Forward Secrecy is possible, and only ciphers that can be
+         * offloaded to the kernel by lwan_setup_tls_keys().  The server
+         * preference is used, so AES-128 is picked whenever the client
+         * supports it. */
         MBEDTLS_TLS_ECDHE_RSA_WITH_AES_128_GCM_SHA256,
         MBEDTLS_TLS_ECDHE_ECDSA_WITH_AES_128_GCM_SHA256,
         MBEDTLS_TLS_DHE_RSA_WITH_AES_128_GCM_SHA256,
         MBEDTLS_TLS_DHE_PSK_WITH_AES_128_GCM_SHA256,
 
-        /* FIXME: Other ciphers are supported by kTLS, notably AES256 and
-         * ChaCha20-Poly1305.  Add those here and patch
-         * lwan_setup_tls_keys() to match.  */
+        MBEDTLS_TLS_ECDHE_RSA_WITH_AES_256_GCM_SHA384,
+        MBEDTLS_TLS_ECDHE_ECDSA_WITH_AES_256_GCM_SHA384,
+        MBEDTLS_TLS_DHE_RSA_WITH_AES_256_GCM_SHA384,
+        MBEDTLS_TLS_DHE_PSK_WITH_AES_256_GCM_SHA384,
+
+#if defined(LWAN_HAVE_KTLS_CHACHA20_POLY1305)
+        MBEDTLS_TLS_ECDHE_RSA_WITH_CHACHA20_POLY1305_SHA256,
+        MBEDTLS_TLS_ECDHE_ECDSA_WITH_CHACHA20_POLY1305_SHA256,
+        MBEDTLS_TLS_DHE_RSA_WITH_CHACHA20_POLY1305_SHA256,
+        MBEDTLS_TLS_DHE_PSK_WITH_CHACHA20_POLY1305_SHA256,
+#endif
 
         /* FIXME: Maybe allow this to be user-tunable like other servers do?  */
         0,
@@ -1528,15 +3621,6 @@ static bool lwan_init_tls(struct lwan *l)
         abort();
     }
 
-    /* Even though this points to files that will probably be outside
-     * the reach of the server (if straightjackets are used), wipe this
-     * struct to get rid of the paths to these files. */
-    lwan_always_bzero(l->config.ssl.cert, strlen(l->config.ssl.cert));
-    free(l->config.ssl.cert);
-    lwan_always_bzero(l->config.ssl.key, strlen(l->config.ssl.key));
-    free(l->config.ssl.key);
-    lwan_always_bzero(&l->config.ssl, sizeof(l->config.ssl));
-
     mbedtls_ssl_conf_ca_chain(&l->tls->config, l->tls->server_cert.next, NULL);
     r = mbedtls_ssl_conf_own_cert(&l->tls->config, &l->tls->server_cert,
                                   &l->tls->server_key);
@@ -1562,7 +3646,7 @@ static bool lwan_init_tls(struct lwan *l)
 
     mbedtls_ssl_conf_rng(&l->tls->config, mbedtls_ctr_drbg_random,
                          &l->tls->ctr_drbg);
-    mbedtls_ssl_conf_ciphersuites(&l->tls->config, aes128_ciphers);
+    mbedtls_ssl_conf_ciphersuites(&l->tls->config, ktls_ciphers);
 
     mbedtls_ssl_conf_renegotiation(&l->tls->config,
                                    MBEDTLS_SSL_RENEGOTIATION_DISABLED);
@@ -1571,16 +3655,37 @@ static bool lwan_init_tls(struct lwan *l)
 
 #if defined(MBEDTLS_SSL_ALPN)
     static const char *alpn_protos[] = {"http/1.1", NULL};
-    mbedtls_ssl_conf_alpn_protocols(&l->tls->config, alpn_protos);
+    static const char *alpn_protos_h2[] = {"h2", "http/1.1", NULL};
+    mbedtls_ssl_conf_alpn_protocols(
+        &l->tls->config, l->config.allow_http2 ? alpn_protos_h2 : alpn_protos);
 #endif
 
+    lwan_tls_sessions_init(l);
+
+    if (l->config.ssl.handshake_threads) {
+        l->tls->handshake_pool =
+            tls_handshake_pool_new(l->config.ssl.handshake_threads);
+        if (!l->tls->handshake_pool) {
+            lwan_status_warning("Could not create TLS handshake threads, "
+                                "worker threads will perform handshakes");
+        }
+    }
+
+    /* Even though this points to files that will probably be outside
+     * the reach of the server (if straightjackets are used), wipe this
+     * struct to get rid of the paths to these files. */
+    lwan_always_bzero(l->config.ssl.cert, strlen(l->config.ssl.cert));
+    free(l->config.ssl.cert);
+    lwan_always_bzero(l->config.ssl.key, strlen(l->config.ssl.key));
+    free(l->config.ssl.key);
+    lwan_always_bzero(&l->config.ssl, sizeof(l->config.ssl));
+
     return true;
 }
 #endif
 
 void lwan_thread_init(struct lwan *l)
 {
-    const unsigned int total_conns = l->thread.max_fd * l->thread.count;
 #if defined(LWAN_HAVE_MBEDTLS)
     const bool tls_initialized = lwan_init_tls(l);
 #else
@@ -1589,18 +3694,36 @@ void lwan_thread_init(struct lwan *l)
 
     lwan_status_debug("Initializing threads");
 
-    l->thread.threads =
-        calloc((size_t)l->thread.count, sizeof(struct lwan_thread));
+    /* Aligned so that the statistics of each thread are in their own
+     * cache lines. */
+    l->thread.threads = lwan_aligned_alloc(
+        (size_t)l->thread.count * sizeof(struct lwan_thread), 64);
     if (!l->thread.threads)
         lwan_status_critical("Could not allocate memory for threads");
+    memset(l->thread.threads, 0,
+           (size_t)l->thread.count * sizeof(struct lwan_thread));
 
     for (unsigned int i = 0; i < l->thread.count; i++)
         l->thread.threads[i].cpu = UINT_MAX;
 
+    /* Which thread each file descriptor is scheduled to isn't written to
+     * the connection array up front, as that would touch every page of it;
+     * it's looked up here whenever a file descriptor is accepted without a
+     * thread.  */
+    uint32_t *conn_schedule =
+        calloc(l->thread.shared_count, sizeof(*conn_schedule));
+    if (!conn_schedule)
+        lwan_status_critical("Could not allocate memory for scheduling table");
+    l->thread.conn_schedule = conn_schedule;
+
     uint32_t *schedtbl;
 
 #if defined(__x86_64__) && defined(__linux__)
-    if (l->online_cpus > 1) {
+    /* The topology is only used if threads can run on every CPU, and
+     * there's at least a thread per CPU: the scheduling table maps CPUs
+     * to threads. */
+    if (l->online_cpus > 1 && l->usable_cpus == l->available_cpus &&
+        l->thread.shared_count >= l->available_cpus) {
         static_assert(sizeof(struct lwan_connection) == 32,
                       "Two connections per cache line");
 #ifdef _SC_LEVEL1_DCACHE_LINESIZE
@@ -1618,13 +3741,12 @@ void lwan_thread_init(struct lwan *l)
          * use the CPU topology to group two connections per cache line in such
          * a way that false sharing is avoided.
          */
-        schedtbl = calloc(l->thread.count, sizeof(uint32_t));
-        bool adjust_affinity = topology_to_schedtbl(l, schedtbl, l->thread.count);
+        schedtbl = calloc(l->thread.shared_count, sizeof(uint32_t));
+        bool adjust_affinity =
+            topology_to_schedtbl(l, schedtbl, l->thread.shared_count);
 
-        for (unsigned int i = 0; i < total_conns; i++) {
-            unsigned int thread_id = schedtbl[i % l->thread.count];
-            l->conns[i].thread = &l->thread.threads[thread_id];
-        }
+        memcpy(conn_schedule, schedtbl,
+               l->thread.shared_count * sizeof(uint32_t));
 
         if (!adjust_affinity) {
             free(schedtbl);
@@ -1635,15 +3757,16 @@ void lwan_thread_init(struct lwan *l)
     {
         lwan_status_debug("Using round-robin to preschedule clients");
 
-        for (unsigned int i = 0; i < l->thread.count; i++)
-            l->thread.threads[i].cpu = i % l->online_cpus;
-        for (unsigned int i = 0; i < total_conns; i++)
-            l->conns[i].thread = &l->thread.threads[i % l->thread.count];
+        for (unsigned int i = 0; i < l->thread.shared_count; i++) {
+            l->thread.threads[i].cpu = nth_allowed_cpu(i, l->online_cpus);
+            conn_schedule[i] = i;
+        }
 
         schedtbl = NULL;
     }
 
-    for (unsigned int i = 0; i < l->thread.count; i++) {
+    int first_fd = -1, first_tls_fd = -1;
+    for (unsigned int i = 0; i < l->thread.shared_count; i++) {
         struct lwan_thread *thread;
 
         if (schedtbl) {
@@ -1666,6 +3789,7 @@ void lwan_thread_init(struct lwan *l)
 
             /* FIXME: figure out which CPUs are actually online */
             thread->cpu = i;
+            thread->numa_node = read_cpu_numa_node(i);
         } else {
             thread = &l->thread.threads[i];
         }
@@ -1673,26 +3797,56 @@ void lwan_thread_init(struct lwan *l)
         if (pthread_barrier_init(&l->thread.barrier, NULL, 2))
             lwan_status_critical("Could not create barrier");
 
-        create_thread(l, thread);
+        create_thread(l, thread, schedtbl != NULL);
 
-        if ((thread->listen_fd = create_listen_socket(thread, i, false)) < 0)
+        if ((thread->listen_fd = create_listen_socket(thread, first_fd, false)) < 0)
             lwan_status_critical_perror("Could not create listening socket");
         l->conns[thread->listen_fd].flags |= CONN_LISTENER;
+        if (first_fd < 0)
+            first_fd = thread->listen_fd;
 
         if (tls_initialized) {
-            if ((thread->tls_listen_fd = create_listen_socket(thread, i, true)) < 0)
+            if ((thread->tls_listen_fd = create_listen_socket(thread, first_tls_fd, true)) < 0)
                 lwan_status_critical_perror("Could not create TLS listening socket");
             l->conns[thread->tls_listen_fd].flags |= CONN_LISTENER | CONN_TLS;
+            if (first_tls_fd < 0)
+                first_tls_fd = thread->tls_listen_fd;
         } else {
             thread->tls_listen_fd = -1;
         }
 
-        if (schedtbl)
-            adjust_thread_affinity(thread);
-
         pthread_barrier_wait(&l->thread.barrier);
     }
 
+    /* Threads serving dedicated listeners aren't pinned to any CPU, and
+     * serve every connection they accept themselves (see
+     * accept_waiting_clients()) */
+    struct lwan_thread *thread = &l->thread.threads[l->thread.shared_count];
+    for (size_t i = 0; i < l->config.n_dedicated_listeners; i++) {
+        const struct lwan_dedicated_listener *dedicated =
+            &l->config.dedicated_listeners[i];
+
+        first_fd = -1;
+        for (unsigned int j = 0; j < dedicated->n_threads; j++, thread++) {
+            thread->dedicated = dedicated;
+
+            if (pthread_barrier_init(&l->thread.barrier, NULL, 2))
+                lwan_status_critical("Could not create barrier");
+
+            create_thread(l, thread, false);
+
+            thread->listen_fd = create_listen_socket(thread, first_fd, false);
+            if (thread->listen_fd < 0)
+                lwan_status_critical_perror("Could not create listening socket");
+            l->conns[thread->listen_fd].flags |= CONN_LISTENER;
+            if (first_fd < 0)
+                first_fd = thread->listen_fd;
+            thread->tls_listen_fd = -1;
+
+            pthread_barrier_wait(&l->thread.barrier);
+        }
+    }
+
     lwan_status_debug("Worker threads created and ready to serve");
 
     free(schedtbl);
@@ -1702,14 +3856,18 @@ void lwan_thread_shutdown(struct lwan *l)
 {
     lwan_status_debug("Shutting down threads");
 
+    /* The barrier left by lwan_thread_init() is only meant for two threads;
+     * every worker thread waits on it before exiting. */
+    pthread_barrier_destroy(&l->thread.barrier);
+    if (pthread_barrier_init(&l->thread.barrier, NULL, l->thread.count + 1))
+        lwan_status_critical("Could not create barrier");
+
     for (unsigned int i = 0; i < l->thread.count; i++) {
         struct lwan_thread *t = &l->thread.threads[i];
-        int epoll_fd = t->epoll_fd;
         int listen_fd = t->listen_fd;
 
         t->listen_fd = -1;
-        t->epoll_fd = -1;
-        close(epoll_fd);
+        thread_event_close(t);
         close(listen_fd);
     }
 
@@ -1721,12 +3879,30 @@ void lwan_thread_shutdown(struct lwan *l)
 
         pthread_join(l->thread.threads[i].self, NULL);
         timeouts_close(t->wheel);
+
+        if (t->stats.accept_wakeups) {
+            lwan_status_debug(
+                "Thread #%u accepted %" PRIu64 " connections in %" PRIu64
+                " wakeups (%.1f per wakeup)",
+                i + 1, t->stats.accepted, t->stats.accept_wakeups,
+                (double)t->stats.accepted / (double)t->stats.accept_wakeups);
+        }
+#if defined(LWAN_HAVE_IO_URING)
+        lwan_io_uring_free(t->io_uring);
+#endif
+        lwan_latency_thread_shutdown(t);
+        doorbell_free(t->doorbell);
+        fd_watchers_free(t);
     }
 
     free(l->thread.threads);
+    free(l->thread.conn_schedule);
 
 #if defined(LWAN_HAVE_MBEDTLS)
     if (l->tls) {
+        if (l->tls->handshake_pool)
+            tls_handshake_pool_free(l->tls->handshake_pool);
+        lwan_tls_sessions_shutdown(l);
         mbedtls_ssl_config_free(&l->tls->config);
         mbedtls_x509_crt_free(&l->tls->server_cert);
         mbedtls_pk_free(&l->tls->server_key);
@@ -0,0 +1,445 @@
+/*
+ * lwan - web server
+ * Copyright (c) 2024 L. A. F. Pereira <l@tia.mat.br>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301,
+ * USA.
+ */
+
+/* TLS session resumption, so that reconnecting clients can skip the
+ * expensive part of the handshake.
+ *
+ * Session tickets (RFC5077) are encrypted with AES-256-GCM.  Two keys are
+ * kept: the active one, used to issue new tickets, and the previous one,
+ * which is only used to decrypt tickets issued before the last rotation.
+ * Keys are rotated by the job thread once every session lifetime, so a
+ * ticket is never decryptable for more than twice that; worker threads
+ * only hold the lock long enough to copy a key.
+ *
+ * The optional session cache, for clients that don't support tickets, is
+ * split in one shard per worker thread, each with its own lock.  Clients
+ * rarely reconnect to the same worker thread, so sessions are assigned to
+ * a shard by their ID rather than by the thread that created them. */
+
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "lwan-private.h"
+
+#if defined(LWAN_HAVE_MBEDTLS)
+#include <mbedtls/gcm.h>
+#include <mbedtls/ssl_cache.h>
+
+#if defined(MBEDTLS_SSL_SESSION_TICKETS) && defined(MBEDTLS_GCM_C)
+#define HAVE_SESSION_TICKETS
+#endif
+
+#define TICKET_KEY_NAME_LEN 4
+#define TICKET_KEY_LEN 32
+#define TICKET_IV_LEN 12
+#define TICKET_TAG_LEN 16
+/* Ticket layout: key name, IV, 16-bit length of the encrypted session,
+ * the encrypted session, and the tag.  Everything before the encrypted
+ * session is authenticated as additional data. */
+#define TICKET_AAD_LEN (TICKET_KEY_NAME_LEN + TICKET_IV_LEN + 2)
+
+/* Tickets can't be valid for more than a week (RFC5077). */
+#define MAX_SESSION_LIFETIME (7u * 24u * 60u * 60u)
+
+struct ticket_key {
+    unsigned char name[TICKET_KEY_NAME_LEN];
+    unsigned char key[TICKET_KEY_LEN];
+};
+
+struct session_cache_shard {
+    pthread_mutex_t lock;
+    mbedtls_ssl_cache_context cache;
+} __attribute__((aligned(64)));
+
+struct lwan_tls_sessions {
+    unsigned int lifetime;
+
+    struct {
+        bool enabled;
+        pthread_rwlock_t lock;
+        struct ticket_key keys[2];
+        unsigned int active;
+    } tickets;
+
+    struct {
+        struct session_cache_shard *shards;
+        unsigned int n_shards;
+    } cache;
+};
+
+#if defined(HAVE_SESSION_TICKETS)
+static bool generate_ticket_key(struct ticket_key *key)
+{
+    return lwan_getentropy(key, sizeof(*key), 0) >= 0;
+}
+
+static bool rotate_ticket_keys_job(void *data)
+{
+    struct lwan_tls_sessions *sessions = data;
+    struct ticket_key key;
+
+    if (UNLIKELY(!generate_ticket_key(&key))) {
+        lwan_status_warning("Could not generate TLS session ticket key, "
+                            "will try again later");
+        return false;
+    }
+
+    if (UNLIKELY(pthread_rwlock_wrlock(&sessions->tickets.lock))) {
+        lwan_status_warning("Could not lock TLS session ticket keys");
+        lwan_always_bzero(&key, sizeof(key));
+        return false;
+    }
+
+    /* The previously active key is kept around, so tickets it issued can
+     * still be used; the one before that is overwritten. */
+    sessions->tickets.active ^= 1;
+    sessions->tickets.keys[sessions->tickets.active] = key;
+
+    pthread_rwlock_unlock(&sessions->tickets.lock);
+
+    lwan_always_bzero(&key, sizeof(key));
+    return true;
+}
+
+static bool get_ticket_key(struct lwan_tls_sessions *sessions,
+                           const unsigned char *name,
+                           struct ticket_key *key)
+{
+    bool found = false;
+
+    if (UNLIKELY(pthread_rwlock_rdlock(&sessions->tickets.lock)))
+        return false;
+
+    if (!name) {
+        *key = sessions->tickets.keys[sessions->tickets.active];
+        found = true;
+    } else {
+        for (size_t i = 0; i < N_ELEMENTS(sessions->tickets.keys); i++) {
+            if (!memcmp(sessions->tickets.keys[i].name, name,
+                        TICKET_KEY_NAME_LEN)) {
+                *key = sessions->tickets.keys[i];
+                found = true;
+                break;
+            }
+        }
+    }
+
+    pthread_rwlock_unlock(&sessions->tickets.lock);
+
+    return found;
+}
+
+static int ticket_write(void *data,
+                        const mbedtls_ssl_session *session,
+                        unsigned char *start,
+                        const unsigned char *end,
+                        size_t *tlen,
+                        uint32_t *lifetime)
+{
+    struct lwan_tls_sessions *sessions = data;
+    unsigned char *iv = start + TICKET_KEY_NAME_LEN;
+    unsigned char *state_len = iv + TICKET_IV_LEN;
+    unsigned char *state = state_len + 2;
+    mbedtls_gcm_context gcm;
+    struct ticket_key key;
+    size_t clear_len;
+    int r;
+
+    if (UNLIKELY(end - start < TICKET_AAD_LEN + TICKET_TAG_LEN))
+        return MBEDTLS_ERR_SSL_BUFFER_TOO_SMALL;
+
+    r = mbedtls_ssl_session_save(session, state,
+                                 (size_t)(end - state) - TICKET_TAG_LEN,
+                                 &clear_len);
+    if (UNLIKELY(r))
+        return r;
+    if (UNLIKELY(clear_len > UINT16_MAX))
+        return MBEDTLS_ERR_SSL_BUFFER_TOO_SMALL;
+
+    if (UNLIKELY(lwan_getentropy(iv, TICKET_IV_LEN, 0) < 0))
+        return MBEDTLS_ERR_SSL_INTERNAL_ERROR;
+    if (UNLIKELY(!get_ticket_key(sessions, NULL, &key)))
+        return MBEDTLS_ERR_SSL_INTERNAL_ERROR;
+
+    memcpy(start, key.name, TICKET_KEY_NAME_LEN);
+    state_len[0] = (unsigned char)(clear_len >> 8);
+    state_len[1] = (unsigned char)(clear_len & 0xff);
+
+    mbedtls_gcm_init(&gcm);
+    r = mbedtls_gcm_setkey(&gcm, MBEDTLS_CIPHER_ID_AES, key.key,
+                           TICKET_KEY_LEN * 8);
+    if (LIKELY(!r)) {
+        r = mbedtls_gcm_crypt_and_tag(&gcm, MBEDTLS_GCM_ENCRYPT, clear_len, iv,
+                                      TICKET_IV_LEN, start, TICKET_AAD_LEN,
+                                      state, state, TICKET_TAG_LEN,
+                                      state + clear_len);
+    }
+    mbedtls_gcm_free(&gcm);
+    lwan_always_bzero(&key, sizeof(key));
+
+    if (UNLIKELY(r))
+        return r;
+
+    *tlen = TICKET_AAD_LEN + clear_len + TICKET_TAG_LEN;
+    *lifetime = sessions->lifetime;
+    return 0;
+}
+
+static int ticket_parse(void *data,
+                        mbedtls_ssl_session *session,
+                        unsigned char *buf,
+                        size_t len)
+{
+    struct lwan_tls_sessions *sessions = data;
+    const unsigned char *iv = buf + TICKET_KEY_NAME_LEN;
+    const unsigned char *state_len = iv + TICKET_IV_LEN;
+    unsigned char *state = buf + TICKET_AAD_LEN;
+    mbedtls_gcm_context gcm;
+    struct ticket_key key;
+    size_t enc_len;
+    int r;
+
+    if (UNLIKELY(len < TICKET_AAD_LEN + TICKET_TAG_LEN))
+        return MBEDTLS_ERR_SSL_BAD_INPUT_DATA;
+
+    enc_len = (size_t)state_len[0] << 8 | state_len[1];
+    if (UNLIKELY(len != TICKET_AAD_LEN + enc_len + TICKET_TAG_LEN))
+        return MBEDTLS_ERR_SSL_BAD_INPUT_DATA;
+
+    /* Tickets issued with a key that has been rotated out look the same
+     * as forged ones. */
+    if (!get_ticket_key(sessions, buf, &key))
+        return MBEDTLS_ERR_SSL_INVALID_MAC;
+
+    mbedtls_gcm_init(&gcm);
+    r = mbedtls_gcm_setkey(&gcm, MBEDTLS_CIPHER_ID_AES, key.key,
+                           TICKET_KEY_LEN * 8);
+    if (LIKELY(!r)) {
+        r = mbedtls_gcm_auth_decrypt(&gcm, enc_len, iv, TICKET_IV_LEN, buf,
+                                     TICKET_AAD_LEN, state + enc_len,
+                                     TICKET_TAG_LEN, state, state);
+    }
+    mbedtls_gcm_free(&gcm);
+    lwan_always_bzero(&key, sizeof(key));
+
+    if (r == MBEDTLS_ERR_GCM_AUTH_FAILED)
+        return MBEDTLS_ERR_SSL_INVALID_MAC;
+    if (UNLIKELY(r))
+        return r;
+
+    r = mbedtls_ssl_session_load(session, state, enc_len);
+    lwan_always_bzero(state, enc_len);
+    if (UNLIKELY(r))
+        return r;
+
+#if defined(MBEDTLS_HAVE_TIME)
+    const time_t now = time(NULL);
+    if (now < session->start ||
+        (uint64_t)(now - session->start) > sessions->lifetime)
+        return MBEDTLS_ERR_SSL_SESSION_TICKET_EXPIRED;
+#endif
+
+    return 0;
+}
+
+static bool init_session_tickets(struct lwan_tls_context *tls)
+{
+    struct lwan_tls_sessions *sessions = tls->sessions;
+
+    if (pthread_rwlock_init(&sessions->tickets.lock, NULL))
+        return false;
+
+    /* Both keys are random from the start, so no ticket can be forged
+     * with a known key before the first rotation. */
+    if (!generate_ticket_key(&sessions->tickets.keys[0]) ||
+        !generate_ticket_key(&sessions->tickets.keys[1])) {
+        pthread_rwlock_destroy(&sessions->tickets.lock);
+        return false;
+    }
+
+    mbedtls_ssl_conf_session_tickets_cb(&tls->config, ticket_write,
+                                        ticket_parse, sessions);
+
+    lwan_job_add_full(rotate_ticket_keys_job, sessions,
+                      "tls_ticket_key_rotation", LWAN_JOB_PRIORITY_NORMAL,
+                      sessions->lifetime * 1000, sessions->lifetime * 1000);
+
+    return true;
+}
+#endif
+
+#if defined(MBEDTLS_SSL_CACHE_C)
+static struct session_cache_shard *
+get_cache_shard(struct lwan_tls_sessions *sessions,
+                const mbedtls_ssl_session *session)
+{
+    uint32_t hash;
+
+    /* Session IDs are random, so any part of them is as good as a hash. */
+    if (UNLIKELY(session->id_len < sizeof(hash)))
+        return &sessions->cache.shards[0];
+
+    memcpy(&hash, session->id, sizeof(hash));
+    return &sessions->cache.shards[hash % sessions->cache.n_shards];
+}
+
+static int cache_get(void *data, mbedtls_ssl_session *session)
+{
+    struct session_cache_shard *shard = get_cache_shard(data, session);
+    int r;
+
+    if (UNLIKELY(pthread_mutex_lock(&shard->lock)))
+        return 1;
+    r = mbedtls_ssl_cache_get(&shard->cache, session);
+    pthread_mutex_unlock(&shard->lock);
+
+    return r;
+}
+
+static int cache_set(void *data, const mbedtls_ssl_session *session)
+{
+    struct session_cache_shard *shard = get_cache_shard(data, session);
+    int r;
+
+    if (UNLIKELY(pthread_mutex_lock(&shard->lock)))
+        return 1;
+    r = mbedtls_ssl_cache_set(&shard->cache, session);
+    pthread_mutex_unlock(&shard->lock);
+
+    return r;
+}
+
+static bool init_session_cache(struct lwan_tls_context *tls,
+                               unsigned int n_shards,
+                               unsigned int max_entries)
+{
+    struct lwan_tls_sessions *sessions = tls->sessions;
+    const unsigned int entries_per_shard = LWAN_MAX(max_entries / n_shards, 1u);
+
+    sessions->cache.shards =
+        lwan_aligned_alloc(n_shards * sizeof(*sessions->cache.shards), 64);
+    if (!sessions->cache.shards)
+        return false;
+
+    for (unsigned int i = 0; i < n_shards; i++) {
+        struct session_cache_shard *shard = &sessions->cache.shards[i];
+
+        if (pthread_mutex_init(&shard->lock, NULL)) {
+            while (i--) {
+                pthread_mutex_destroy(&sessions->cache.shards[i].lock);
+                mbedtls_ssl_cache_free(&sessions->cache.shards[i].cache);
+            }
+            free(sessions->cache.shards);
+            sessions->cache.shards = NULL;
+            return false;
+        }
+
+        mbedtls_ssl_cache_init(&shard->cache);
+#if defined(MBEDTLS_HAVE_TIME)
+        mbedtls_ssl_cache_set_timeout(&shard->cache, (int)sessions->lifetime);
+#endif
+        mbedtls_ssl_cache_set_max_entries(&shard->cache,
+                                          (int)entries_per_shard);
+    }
+    sessions->cache.n_shards = n_shards;
+
+    mbedtls_ssl_conf_session_cache(&tls->config, sessions, cache_get,
+                                   cache_set);
+
+    return true;
+}
+#endif
+
+void lwan_tls_sessions_init(struct lwan *l)
+{
+    struct lwan_tls_context *tls = l->tls;
+
+    if (!l->config.ssl.session_tickets && !l->config.ssl.session_cache)
+        return;
+
+    tls->sessions = calloc(1, sizeof(*tls->sessions));
+    if (!tls->sessions)
+        lwan_status_critical("Could not allocate TLS session context");
+
+    tls->sessions->lifetime =
+        LWAN_MIN(LWAN_MAX(l->config.ssl.session_lifetime, 1u),
+                 MAX_SESSION_LIFETIME);
+
+    if (l->config.ssl.session_tickets) {
+#if defined(HAVE_SESSION_TICKETS)
+        tls->sessions->tickets.enabled = init_session_tickets(tls);
+        if (tls->sessions->tickets.enabled) {
+            lwan_status_debug("TLS session tickets enabled, keys rotated "
+                              "every %u seconds",
+                              tls->sessions->lifetime);
+        } else {
+            lwan_status_warning("Could not initialize TLS session tickets");
+        }
+#else
+        lwan_status_warning("mbedTLS has been built without session ticket "
+                            "support, ignoring");
+#endif
+    }
+
+    if (l->config.ssl.session_cache) {
+#if defined(MBEDTLS_SSL_CACHE_C)
+        if (init_session_cache(tls, l->thread.count,
+                               l->config.ssl.session_cache_size)) {
+            lwan_status_debug("TLS session cache enabled, with %u shards",
+                              tls->sessions->cache.n_shards);
+        } else {
+            lwan_status_warning("Could not initialize TLS session cache");
+        }
+#else
+        lwan_status_warning("mbedTLS has been built without session cache "
+                            "support, ignoring");
+#endif
+    }
+}
+
+void lwan_tls_sessions_shutdown(struct lwan *l)
+{
+    struct lwan_tls_sessions *sessions = l->tls->sessions;
+
+    if (!sessions)
+        return;
+
+#if defined(HAVE_SESSION_TICKETS)
+    if (sessions->tickets.enabled) {
+        lwan_job_del(rotate_ticket_keys_job, sessions);
+        pthread_rwlock_destroy(&sessions->tickets.lock);
+    }
+#endif
+
+#if defined(MBEDTLS_SSL_CACHE_C)
+    for (unsigned int i = 0; i < sessions->cache.n_shards; i++) {
+        pthread_mutex_destroy(&sessions->cache.shards[i].lock);
+        mbedtls_ssl_cache_free(&sessions->cache.shards[i].cache);
+    }
+    free(sessions->cache.shards);
+#endif
+
+    lwan_always_bzero(sessions, sizeof(*sessions));
+    free(sessions);
+}
+#endif
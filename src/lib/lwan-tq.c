@@ -22,6 +22,7 @@
 
 #include "lwan-private.h"
 #include "lwan-tq.h"
+#include "lwan-trace.h"
 
 static inline int timeout_queue_node_to_idx(struct timeout_queue *tq,
                                             struct lwan_connection *conn)
@@ -46,8 +47,8 @@ inline void timeout_queue_insert(struct timeout_queue *tq,
     tq->head.prev = prev->next = timeout_queue_node_to_idx(tq, new_node);
 }
 
-static inline void timeout_queue_remove(struct timeout_queue *tq,
-                                        struct lwan_connection *node)
+inline void timeout_queue_remove(struct timeout_queue *tq,
+                                 struct lwan_connection *node)
 {
     struct lwan_connection *prev = timeout_queue_idx_to_node(tq, node->prev);
     struct lwan_connection *next = timeout_queue_idx_to_node(tq, node->next);
@@ -61,13 +62,47 @@ inline bool timeout_queue_empty(struct timeout_queue *tq)
     return tq->head.next < 0;
 }
 
+unsigned int timeout_queue_next_expiration(struct timeout_queue *tq)
+{
+    /* Connections opened (or served) at the same time would otherwise
+     * all expire in the same tick.  With some jitter, the queue isn't
+     * strictly sorted anymore: as expiration stops at the first
+     * connection that's not due, others might be closed up to
+     * move_to_last_jitter ticks late.  */
+    unsigned int jitter = tq->move_to_last_jitter
+                              ? (unsigned int)(lwan_random_uint64() %
+                                               (tq->move_to_last_jitter + 1))
+                              : 0;
+
+    return tq->current_time + tq->move_to_last_bump + jitter;
+}
+
 inline void timeout_queue_move_to_last(struct timeout_queue *tq,
                                        struct lwan_connection *conn)
 {
     /* CONN_IS_KEEP_ALIVE isn't checked here because non-keep-alive connections
      * are closed in the request processing coroutine after they have been
      * served.  In practice, if this is called, it's a keep-alive connection. */
-    conn->time_to_expire = tq->current_time + tq->move_to_last_bump;
+    conn->time_to_expire = timeout_queue_next_expiration(tq);
+
+    timeout_queue_remove(tq, conn);
+    timeout_queue_insert(tq, conn);
+}
+
+/* Websockets opened at the same time would otherwise keep being pinged in
+ * the same tick, as pinging them doesn't move them apart.  Pulling each
+ * next ping in by a random amount of up to a quarter of the keep-alive
+ * timeout makes them drift apart over a few rounds, until their pings are
+ * spread over the whole window.  Like with the jitter, connections behind
+ * them in the queue might be expired a bit late because of that.  */
+static void reschedule_pinged(struct timeout_queue *tq,
+                              struct lwan_connection *conn)
+{
+    const unsigned int spread = tq->move_to_last_bump / 4;
+    const unsigned int early =
+        spread ? (unsigned int)(lwan_random_uint64() % (spread + 1)) : 0;
+
+    conn->time_to_expire = tq->current_time + tq->move_to_last_bump - early;
 
     timeout_queue_remove(tq, conn);
     timeout_queue_insert(tq, conn);
@@ -80,50 +115,86 @@ void timeout_queue_init(struct timeout_queue *tq, const struct lwan *lwan)
         .conns = lwan->conns,
         .current_time = 0,
         .move_to_last_bump = lwan->config.keep_alive_timeout,
+        .move_to_last_jitter = lwan->config.keep_alive_timeout / 8,
         .head.next = -1,
         .head.prev = -1,
         .timeout = (struct timeout){},
     };
 }
 
-void timeout_queue_expire(struct timeout_queue *tq,
-                          struct lwan_connection *conn)
+/* Releases everything associated with an expired connection, but its
+ * file descriptor, which is returned so that it can be closed. */
+static int release_expired(struct timeout_queue *tq,
+                           struct lwan_connection *conn)
 {
     assert(!(conn->flags & (CONN_HUNG_UP | CONN_ASYNC_AWAIT)));
 
     timeout_queue_remove(tq, conn);
 
     if (LIKELY(conn->coro)) {
-        coro_free(conn->coro);
+        struct lwan_thread *t = conn->thread;
+
+        coro_pool_free(&t->coro_pool, conn->coro);
         conn->coro = NULL;
+        t->stats.coros--;
+        t->stats.coros_cached = t->coro_pool.n_free;
     }
 
-    close(lwan_connection_get_fd(tq->lwan, conn));
+    int fd = lwan_connection_get_fd(tq->lwan, conn);
+    LWAN_TRACE(close, fd);
+    lwan_thread_unwatch_fd(conn->thread, fd);
+    return fd;
+}
+
+void timeout_queue_expire(struct timeout_queue *tq,
+                          struct lwan_connection *conn)
+{
+    close(release_expired(tq, conn));
 }
 
 void timeout_queue_expire_waiting(struct timeout_queue *tq)
 {
-    tq->current_time++;
+    /* Sweeps after a burst of connections might expire lots of them at
+     * once, so they're closed in batches; see lwan_thread_close_fds(). */
+    struct lwan_thread *t = NULL;
+    int fds[256];
+    size_t n_fds = 0;
 
     while (!timeout_queue_empty(tq)) {
         struct lwan_connection *conn =
             timeout_queue_idx_to_node(tq, tq->head.next);
 
         if (conn->time_to_expire > tq->current_time)
-            return;
+            goto out;
 
         if (conn->flags & CONN_IS_WEBSOCKET) {
             if (LIKELY(lwan_send_websocket_ping_for_tq(conn))) {
-                timeout_queue_move_to_last(tq, conn);
+                reschedule_pinged(tq, conn);
                 continue;
             }
         }
 
-        timeout_queue_expire(tq, conn);
+        t = conn->thread;
+        fds[n_fds++] = release_expired(tq, conn);
+        if (n_fds == N_ELEMENTS(fds)) {
+            lwan_thread_close_fds(t, fds, n_fds);
+            n_fds = 0;
+        }
     }
 
-    /* Timeout queue exhausted: reset epoch */
-    tq->current_time = 0;
+out:
+    if (n_fds)
+        lwan_thread_close_fds(t, fds, n_fds);
+}
+
+unsigned int timeout_queue_head_expiration(struct timeout_queue *tq)
+{
+    assert(!timeout_queue_empty(tq));
+
+    /* Connections further down the queue might be due a bit earlier,
+     * because of the jitter, but they're only ever expired after this
+     * one anyway */
+    return timeout_queue_idx_to_node(tq, tq->head.next)->time_to_expire;
 }
 
 void timeout_queue_expire_all(struct timeout_queue *tq)
@@ -24,20 +24,29 @@ struct timeout_queue {
     const struct lwan *lwan;
     struct lwan_connection *conns;
     struct lwan_connection head;
+    /* Armed for when the connection at the head is due, rather than
+     * periodically, so idle threads aren't woken up */
     struct timeout timeout;
+    /* In seconds of the monotonic clock; updated by the worker loop */
     unsigned int current_time;
     unsigned int move_to_last_bump;
+    /* Expiration times are spread over this many ticks */
+    unsigned int move_to_last_jitter;
 };
 
 void timeout_queue_init(struct timeout_queue *tq, const struct lwan *l);
 
 void timeout_queue_insert(struct timeout_queue *tq,
                           struct lwan_connection *new_node);
+void timeout_queue_remove(struct timeout_queue *tq,
+                          struct lwan_connection *node);
 void timeout_queue_expire(struct timeout_queue *tq, struct lwan_connection *node);
 void timeout_queue_move_to_last(struct timeout_queue *tq,
                                 struct lwan_connection *conn);
+unsigned int timeout_queue_next_expiration(struct timeout_queue *tq);
 
 void timeout_queue_expire_waiting(struct timeout_queue *tq);
+unsigned int timeout_queue_head_expiration(struct timeout_queue *tq);
 void timeout_queue_expire_all(struct timeout_queue *tq);
 
 bool timeout_queue_empty(struct timeout_queue *tq);
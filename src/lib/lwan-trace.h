@@ -0,0 +1,34 @@
+/*
+ * lwan - web server
+ * Copyright (c) 2024 L. A. F. Pereira <l@tia.mat.br>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301,
+ * USA.
+ */
+
+#pragma once
+
+#include "lwan-build-config.h"
+
+/* USDT probes, under the "lwan" provider.  Each one is a single nop
+ * instruction until a tracer (e.g. bpftrace) attaches to it; arguments
+ * should be cheap to compute, as they're evaluated regardless.  Double
+ * underscores in probe names show up as dashes to tracers. */
+#if defined(LWAN_HAVE_SYS_SDT_H)
+#include <sys/sdt.h>
+#define LWAN_TRACE(name, ...) STAP_PROBEV(lwan, name, ##__VA_ARGS__)
+#else
+#define LWAN_TRACE(name, ...)
+#endif
@@ -0,0 +1,918 @@
+/*
+ * lwan - web server
+ * Copyright (c) 2024 L. A. F. Pereira <l@tia.mat.br>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301,
+ * USA.
+ */
+
+/*
+ * Distributed tracing, exported as OpenTelemetry (OTLP) spans.
+ *
+ * Whether a request is traced is decided once, right after it's been
+ * parsed: requests carrying a W3C traceparent header follow the decision
+ * made upstream, and the others are sampled at random.  Only sampled
+ * requests get a trace context, so everything else along the way costs a
+ * single branch on a NULL pointer.
+ *
+ * Like the access log, spans are written by the I/O threads into rings of
+ * their own (single producer, single consumer, fixed-size records), and
+ * sent in batches by a separate thread; each datagram is a complete
+ * ExportTraceServiceRequest message.  Spans that don't fit in a ring are
+ * dropped, and counted.
+ */
+
+#define _GNU_SOURCE
+#include <assert.h>
+#include <endian.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <math.h>
+#include <netdb.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "lwan-private.h"
+
+#define RING_SIZE 2048 /* In spans; must be a power of two */
+#define FLUSH_INTERVAL_MS 100
+
+/* Datagrams are kept under a typical MTU, so they're never fragmented */
+#define MAX_DATAGRAM_SIZE 1472
+#define MAX_DATAGRAMS_PER_SEND 64
+/* Larger than any span encode_span() can produce */
+#define MAX_ENCODED_SPAN_SIZE 512
+
+#define DEFAULT_SERVICE_NAME "lwan"
+
+struct lwan_trace {
+    uint8_t trace_id[16];
+    uint64_t root_span_id;
+    /* From the traceparent header; 0 if this request started the trace */
+    uint64_t remote_parent_id;
+    /* Parent of spans that begin now; see lwan_tracing_span_begin() */
+    uint64_t current_span_id;
+    uint64_t begin_ns;
+};
+
+struct span_record {
+    uint8_t trace_id[16];
+    uint64_t span_id;
+    uint64_t parent_span_id; /* 0 for the root of a trace */
+    uint64_t begin_ns;       /* CLOCK_MONOTONIC */
+    uint64_t end_ns;
+    uint16_t status; /* HTTP status, or 0 */
+    uint8_t name;    /* enum lwan_trace_span_name */
+    char method[13]; /* NUL-padded; only in request spans */
+    char detail[64]; /* NUL-padded, truncated if too long */
+};
+
+static_assert(sizeof(struct span_record) == 128, "Span records are 128 bytes");
+
+struct lwan_trace_ring {
+    /* Only written to by the tracing thread */
+    uint32_t read __attribute__((aligned(64)));
+
+    /* Only written to by the I/O thread that owns this ring */
+    uint32_t write __attribute__((aligned(64)));
+    uint64_t dropped;
+
+    struct span_record spans[RING_SIZE] __attribute__((aligned(64)));
+};
+
+/* OTLP enums, from opentelemetry/proto/trace/v1/trace.proto */
+enum span_kind {
+    SPAN_KIND_INTERNAL = 1,
+    SPAN_KIND_SERVER = 2,
+    SPAN_KIND_CLIENT = 3,
+};
+
+#define STATUS_CODE_ERROR 2
+
+static const struct {
+    const char *name;
+    enum span_kind kind;
+    /* Key of the attribute holding the detail, if any */
+    const char *detail_key;
+} span_types[] = {
+    [LWAN_SPAN_REQUEST] = {NULL, SPAN_KIND_SERVER, "url.path"},
+    [LWAN_SPAN_PARSE] = {"parse request", SPAN_KIND_INTERNAL, NULL},
+    [LWAN_SPAN_HANDLER] = {"handler", SPAN_KIND_INTERNAL, "http.route"},
+    [LWAN_SPAN_SEND] = {"send response", SPAN_KIND_INTERNAL, NULL},
+    [LWAN_SPAN_PROXY] = {"proxy", SPAN_KIND_CLIENT, "server.address"},
+    [LWAN_SPAN_FASTCGI] = {"fastcgi", SPAN_KIND_CLIENT, "server.address"},
+};
+
+static struct {
+    int fd;
+    char *service_name;
+
+    /* Requests are sampled if a random number is below this */
+    uint64_t sample_threshold;
+    bool sample_all;
+
+    /* Resource and scope of every span, encoded when Lwan starts */
+    uint8_t resource[128];
+    size_t resource_len;
+    uint8_t scope[32];
+    size_t scope_len;
+
+    /* Added to CLOCK_MONOTONIC timestamps to get the Unix time */
+    uint64_t realtime_offset_ns;
+
+    struct lwan_trace_ring *rings[256];
+    unsigned int n_rings;
+    uint64_t dropped_reported;
+
+    pthread_t thread;
+    int wakeup_fd;
+    bool running;
+
+    uint8_t datagrams[MAX_DATAGRAMS_PER_SEND][MAX_DATAGRAM_SIZE];
+} tracing = {
+    .fd = -1,
+    .wakeup_fd = -1,
+};
+
+static bool open_udp(struct config *c, const char *target)
+{
+    struct addrinfo hints = {.ai_socktype = SOCK_DGRAM};
+    struct addrinfo *result, *rp;
+    char *host = strdupa(target);
+    char *port;
+    int ret;
+
+    if (*host == '[') {
+        char *end = strchr(++host, ']');
+
+        if (!end || end[1] != ':')
+            return config_error(c, "Expecting udp://[host]:port");
+
+        *end = '\0';
+        port = end + 2;
+    } else {
+        port = strrchr(host, ':');
+        if (!port)
+            return config_error(c, "Expecting udp://host:port");
+
+        *port++ = '\0';
+    }
+
+    ret = getaddrinfo(host, port, &hints, &result);
+    if (ret)
+        return config_error(c, "Could not resolve %s: %s", target,
+                            gai_strerror(ret));
+
+    for (rp = result; rp; rp = rp->ai_next) {
+        int fd = socket(rp->ai_family, rp->ai_socktype | SOCK_CLOEXEC |
+                                           SOCK_NONBLOCK, rp->ai_protocol);
+
+        if (fd < 0)
+            continue;
+        if (connect(fd, rp->ai_addr, rp->ai_addrlen) == 0) {
+            tracing.fd = fd;
+            break;
+        }
+        close(fd);
+    }
+
+    freeaddrinfo(result);
+
+    if (tracing.fd < 0)
+        return config_error(c, "Could not connect to %s", target);
+
+    return true;
+}
+
+static bool set_sample_rate(struct config *c, const char *value)
+{
+    char *end;
+    double rate;
+
+    errno = 0;
+    rate = strtod(value, &end);
+    if (errno || end == value || *end || !(rate >= 0.0 && rate <= 1.0))
+        return config_error(c, "Sample rate must be between 0 and 1");
+
+    tracing.sample_all = rate >= 1.0;
+    tracing.sample_threshold = (uint64_t)ldexp(rate, 64);
+    return true;
+}
+
+void lwan_tracing_parse_config(struct config *c)
+{
+    const struct config_line *l;
+    char *target = NULL;
+    char *service_name = NULL;
+
+    if (tracing.fd >= 0) {
+        config_error(c, "Tracing already set up");
+        return;
+    }
+
+    tracing.sample_all = true;
+
+    while ((l = config_read_line(c))) {
+        switch (l->type) {
+        case CONFIG_LINE_TYPE_LINE:
+            if (streq(l->key, "target")) {
+                target = strdupa(l->value);
+            } else if (streq(l->key, "sample_rate")) {
+                if (!set_sample_rate(c, l->value))
+                    return;
+            } else if (streq(l->key, "service_name")) {
+                service_name = strdupa(l->value);
+            } else {
+                config_error(c, "Invalid key: %s", l->key);
+                return;
+            }
+            break;
+        case CONFIG_LINE_TYPE_SECTION:
+            config_error(c, "Tracing accepts no sections");
+            return;
+        case CONFIG_LINE_TYPE_SECTION_END:
+            if (!target) {
+                config_error(c, "Tracing target not specified");
+                return;
+            }
+            if (strncmp(target, "udp://", sizeof("udp://") - 1)) {
+                config_error(c, "Spans can only be sent to udp://host:port");
+                return;
+            }
+
+            service_name = service_name ?: DEFAULT_SERVICE_NAME;
+            if (strlen(service_name) > 64) {
+                config_error(c, "Service name is too long");
+                return;
+            }
+            tracing.service_name = strdup(service_name);
+            if (!tracing.service_name) {
+                config_error(c, "Could not allocate memory for service name");
+                return;
+            }
+
+            open_udp(c, target + sizeof("udp://") - 1);
+            return;
+        }
+    }
+
+    config_error(c, "Expecting section end while parsing tracing");
+}
+
+struct lwan_trace_ring *lwan_tracing_ring_new(void)
+{
+    struct lwan_trace_ring *ring;
+
+    if (tracing.fd < 0)
+        return NULL;
+
+    if (tracing.n_rings == N_ELEMENTS(tracing.rings))
+        lwan_status_critical("Too many tracing rings");
+
+    ring = aligned_alloc(64, sizeof(*ring));
+    if (!ring)
+        lwan_status_critical_perror("Could not allocate tracing ring");
+
+    ring->read = ring->write = 0;
+    ring->dropped = 0;
+
+    /* Rings are created before the tracing thread starts, so there's no
+     * need to synchronize with it here. */
+    tracing.rings[tracing.n_rings++] = ring;
+
+    return ring;
+}
+
+/* Protocol Buffers encoding, just enough of it for OTLP.  Field numbers
+ * are all below 16, so tags always take a single byte. */
+enum wire_type {
+    WIRE_VARINT = 0,
+    WIRE_FIXED64 = 1,
+    WIRE_LEN = 2,
+};
+
+static size_t varint_size(uint64_t value)
+{
+    size_t size = 1;
+
+    for (; value >= 0x80; value >>= 7)
+        size++;
+
+    return size;
+}
+
+static uint8_t *put_varint(uint8_t *p, uint64_t value)
+{
+    for (; value >= 0x80; value >>= 7)
+        *p++ = (uint8_t)(value | 0x80);
+    *p++ = (uint8_t)value;
+
+    return p;
+}
+
+static uint8_t *put_tag(uint8_t *p, unsigned int field, enum wire_type type)
+{
+    *p++ = (uint8_t)(field << 3 | type);
+    return p;
+}
+
+static uint8_t *put_len(uint8_t *p, unsigned int field, size_t len)
+{
+    return put_varint(put_tag(p, field, WIRE_LEN), len);
+}
+
+static uint8_t *
+put_bytes(uint8_t *p, unsigned int field, const void *data, size_t len)
+{
+    return mempcpy(put_len(p, field, len), data, len);
+}
+
+static uint8_t *put_fixed64(uint8_t *p, unsigned int field, uint64_t value)
+{
+    value = htole64(value);
+    return mempcpy(put_tag(p, field, WIRE_FIXED64), &value, sizeof(value));
+}
+
+/* Span IDs are written out in big endian, just like in traceparent */
+static uint8_t *put_span_id(uint8_t *p, unsigned int field, uint64_t id)
+{
+    id = htobe64(id);
+    return put_bytes(p, field, &id, sizeof(id));
+}
+
+static size_t bytes_size(size_t len)
+{
+    return 1 + varint_size(len) + len;
+}
+
+/* A KeyValue { key = 1; AnyValue { string_value = 1 } value = 2 } */
+static uint8_t *put_string_attribute(uint8_t *p,
+                                     unsigned int field,
+                                     const char *key,
+                                     const char *value,
+                                     size_t value_len)
+{
+    const size_t key_len = strlen(key);
+    const size_t any_len = bytes_size(value_len);
+
+    p = put_len(p, field, bytes_size(key_len) + bytes_size(any_len));
+    p = put_bytes(p, 1, key, key_len);
+    p = put_len(p, 2, any_len);
+    return put_bytes(p, 1, value, value_len);
+}
+
+/* A KeyValue { key = 1; AnyValue { int_value = 3 } value = 2 } */
+static uint8_t *put_int_attribute(uint8_t *p,
+                                  unsigned int field,
+                                  const char *key,
+                                  uint64_t value)
+{
+    const size_t key_len = strlen(key);
+    const size_t any_len = 1 + varint_size(value);
+
+    p = put_len(p, field, bytes_size(key_len) + bytes_size(any_len));
+    p = put_bytes(p, 1, key, key_len);
+    p = put_len(p, 2, any_len);
+    p = put_tag(p, 3, WIRE_VARINT);
+    return put_varint(p, value);
+}
+
+static void encode_resource_and_scope(void)
+{
+    const size_t name_len = strlen(tracing.service_name);
+    uint8_t attribute[96];
+    uint8_t *p;
+
+    /* ResourceSpans { Resource { attributes = 1 } resource = 1 } */
+    p = put_string_attribute(attribute, 1, "service.name",
+                             tracing.service_name, name_len);
+    p = put_bytes(tracing.resource, 1, attribute, (size_t)(p - attribute));
+    tracing.resource_len = (size_t)(p - tracing.resource);
+
+    /* ScopeSpans { InstrumentationScope { name = 1 } scope = 1 } */
+    p = put_bytes(attribute, 1, "lwan", sizeof("lwan") - 1);
+    p = put_bytes(tracing.scope, 1, attribute, (size_t)(p - attribute));
+    tracing.scope_len = (size_t)(p - tracing.scope);
+}
+
+/* Encodes a Span message, without the tag and length that precede it. */
+static size_t encode_span(uint8_t *buffer, const struct span_record *span)
+{
+    const enum span_kind kind = span_types[span->name].kind;
+    const char *detail_key = span_types[span->name].detail_key;
+    const size_t detail_len = strnlen(span->detail, sizeof(span->detail));
+    uint8_t *p = buffer;
+
+    p = put_bytes(p, 1, span->trace_id, sizeof(span->trace_id));
+    p = put_span_id(p, 2, span->span_id);
+    if (span->parent_span_id)
+        p = put_span_id(p, 4, span->parent_span_id);
+
+    if (span->name == LWAN_SPAN_REQUEST) {
+        /* Named after the method, as there's no route for the request as
+         * a whole */
+        p = put_bytes(p, 5, span->method,
+                      strnlen(span->method, sizeof(span->method)));
+    } else {
+        p = put_bytes(p, 5, span_types[span->name].name,
+                      strlen(span_types[span->name].name));
+    }
+
+    p = put_tag(p, 6, WIRE_VARINT);
+    p = put_varint(p, kind);
+    p = put_fixed64(p, 7, span->begin_ns + tracing.realtime_offset_ns);
+    p = put_fixed64(p, 8, span->end_ns + tracing.realtime_offset_ns);
+
+    if (span->name == LWAN_SPAN_REQUEST) {
+        p = put_string_attribute(
+            p, 9, "http.request.method", span->method,
+            strnlen(span->method, sizeof(span->method)));
+    }
+    if (detail_key && detail_len)
+        p = put_string_attribute(p, 9, detail_key, span->detail, detail_len);
+    if (span->status)
+        p = put_int_attribute(p, 9, "http.response.status_code", span->status);
+
+    /* Clients are expected to handle 4xx responses themselves, so those
+     * are only errors as far as outgoing calls are concerned */
+    if (span->status >= (kind == SPAN_KIND_CLIENT ? 400 : 500)) {
+        /* Status { code = 3 } */
+        p = put_len(p, 15, 2);
+        p = put_tag(p, 3, WIRE_VARINT);
+        p = put_varint(p, STATUS_CODE_ERROR);
+    }
+
+    return (size_t)(p - buffer);
+}
+
+/* Room left before the spans in a datagram for everything that wraps
+ * them, assuming lengths that take at most 2 bytes each */
+static size_t header_room(void)
+{
+    return 1 + 2 + tracing.resource_len + 1 + 2 + tracing.scope_len;
+}
+
+/* Writes the messages wrapping @spans_len bytes of spans, right before
+ * @spans; returns where the datagram begins. */
+static uint8_t *wrap_spans(uint8_t *spans, size_t spans_len)
+{
+    const size_t scope_spans_len = tracing.scope_len + spans_len;
+    const size_t resource_spans_len =
+        tracing.resource_len + bytes_size(scope_spans_len);
+    const size_t header_len = 1 + varint_size(resource_spans_len) +
+                              tracing.resource_len + 1 +
+                              varint_size(scope_spans_len) +
+                              tracing.scope_len;
+    uint8_t *start = spans - header_len;
+    uint8_t *p = start;
+
+    /* ExportTraceServiceRequest { ResourceSpans resource_spans = 1 } */
+    p = put_len(p, 1, resource_spans_len);
+    p = mempcpy(p, tracing.resource, tracing.resource_len);
+    /* ResourceSpans { ScopeSpans scope_spans = 2 } */
+    p = put_len(p, 2, scope_spans_len);
+    p = mempcpy(p, tracing.scope, tracing.scope_len);
+    assert(p == spans);
+
+    return start;
+}
+
+struct batch {
+    struct mmsghdr msgs[MAX_DATAGRAMS_PER_SEND];
+    struct iovec iovs[MAX_DATAGRAMS_PER_SEND];
+    unsigned int n_datagrams;
+
+    /* Where the next span goes in the current datagram */
+    uint8_t *spans;
+    size_t spans_len;
+};
+
+static void send_datagrams(struct batch *batch)
+{
+    if (!batch->n_datagrams)
+        return;
+
+    /* Datagrams that can't be sent right away are lost, just like they
+     * could've been on the way to the collector. */
+    sendmmsg(tracing.fd, batch->msgs, batch->n_datagrams, MSG_DONTWAIT);
+    batch->n_datagrams = 0;
+}
+
+static void start_datagram(struct batch *batch)
+{
+    batch->spans = tracing.datagrams[batch->n_datagrams] + header_room();
+    batch->spans_len = 0;
+}
+
+static void finish_datagram(struct batch *batch)
+{
+    const unsigned int n = batch->n_datagrams;
+    uint8_t *start;
+
+    if (!batch->spans_len)
+        return;
+
+    start = wrap_spans(batch->spans, batch->spans_len);
+    batch->iovs[n] = (struct iovec){
+        .iov_base = start,
+        .iov_len = (size_t)(batch->spans + batch->spans_len - start),
+    };
+    batch->msgs[n] = (struct mmsghdr){
+        .msg_hdr = {.msg_iov = &batch->iovs[n], .msg_iovlen = 1},
+    };
+
+    if (++batch->n_datagrams == MAX_DATAGRAMS_PER_SEND)
+        send_datagrams(batch);
+
+    start_datagram(batch);
+}
+
+static void add_span(struct batch *batch, const struct span_record *span)
+{
+    uint8_t encoded[MAX_ENCODED_SPAN_SIZE];
+    const size_t len = encode_span(encoded, span);
+    /* As a ScopeSpans { Span spans = 2 } */
+    const size_t field_len = bytes_size(len);
+
+    if (header_room() + batch->spans_len + field_len > MAX_DATAGRAM_SIZE)
+        finish_datagram(batch);
+
+    batch->spans_len =
+        (size_t)(put_bytes(batch->spans + batch->spans_len, 2, encoded, len) -
+                 batch->spans);
+}
+
+static void flush_ring(struct batch *batch, struct lwan_trace_ring *ring)
+{
+    const uint32_t write = __atomic_load_n(&ring->write, __ATOMIC_ACQUIRE);
+
+    for (uint32_t read = ring->read; read != write; read++)
+        add_span(batch, &ring->spans[read & (RING_SIZE - 1)]);
+
+    __atomic_store_n(&ring->read, write, __ATOMIC_RELEASE);
+}
+
+static void flush_rings(void)
+{
+    struct batch batch = {.n_datagrams = 0};
+    uint64_t dropped = 0;
+
+    start_datagram(&batch);
+
+    for (unsigned int i = 0; i < tracing.n_rings; i++) {
+        flush_ring(&batch, tracing.rings[i]);
+        dropped += __atomic_load_n(&tracing.rings[i]->dropped,
+                                   __ATOMIC_RELAXED);
+    }
+
+    finish_datagram(&batch);
+    send_datagrams(&batch);
+
+    if (UNLIKELY(dropped != tracing.dropped_reported)) {
+        lwan_status_warning("%" PRIu64 " spans dropped so far", dropped);
+        tracing.dropped_reported = dropped;
+    }
+}
+
+static void *tracing_thread(void *data __attribute__((unused)))
+{
+    struct pollfd pfd = {.fd = tracing.wakeup_fd, .events = POLLIN};
+
+    lwan_set_thread_name("tracing");
+
+    while (ATOMIC_READ(tracing.running)) {
+        if (poll(&pfd, 1, FLUSH_INTERVAL_MS) > 0) {
+            eventfd_t value;
+
+            eventfd_read(tracing.wakeup_fd, &value);
+        }
+
+        flush_rings();
+    }
+
+    return NULL;
+}
+
+static uint64_t timespec_to_ns(const struct timespec *ts)
+{
+    return (uint64_t)ts->tv_sec * 1000000000ull + (uint64_t)ts->tv_nsec;
+}
+
+static uint64_t monotonic_ns(void)
+{
+    struct timespec now;
+
+    if (UNLIKELY(clock_gettime(CLOCK_MONOTONIC, &now) < 0))
+        return 0;
+
+    return timespec_to_ns(&now);
+}
+
+void lwan_tracing_init(void)
+{
+    struct timespec realtime, monotonic;
+
+    if (tracing.fd < 0)
+        return;
+
+    lwan_status_debug("Initializing tracing thread");
+
+    if (clock_gettime(CLOCK_REALTIME, &realtime) < 0 ||
+        clock_gettime(CLOCK_MONOTONIC, &monotonic) < 0)
+        lwan_status_critical_perror("clock_gettime");
+    tracing.realtime_offset_ns =
+        timespec_to_ns(&realtime) - timespec_to_ns(&monotonic);
+
+    encode_resource_and_scope();
+
+    tracing.wakeup_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (tracing.wakeup_fd < 0)
+        lwan_status_critical_perror("eventfd");
+
+    tracing.running = true;
+    if (pthread_create(&tracing.thread, NULL, tracing_thread, NULL))
+        lwan_status_critical_perror("pthread_create");
+}
+
+void lwan_tracing_shutdown(void)
+{
+    if (tracing.fd < 0)
+        return;
+
+    lwan_status_debug("Shutting down tracing thread");
+
+    ATOMIC_READ(tracing.running) = false;
+    eventfd_write(tracing.wakeup_fd, 1);
+    pthread_join(tracing.thread, NULL);
+    close(tracing.wakeup_fd);
+    tracing.wakeup_fd = -1;
+
+    /* I/O threads are gone by now, so whatever they've traced can be
+     * sent. */
+    flush_rings();
+
+    for (unsigned int i = 0; i < tracing.n_rings; i++)
+        free(tracing.rings[i]);
+    tracing.n_rings = 0;
+
+    close(tracing.fd);
+    tracing.fd = -1;
+
+    free(tracing.service_name);
+    tracing.service_name = NULL;
+}
+
+static struct span_record *ring_reserve(struct lwan_trace_ring *ring)
+{
+    const uint32_t read = __atomic_load_n(&ring->read, __ATOMIC_ACQUIRE);
+    const uint32_t write = ring->write;
+
+    if (UNLIKELY(write - read == RING_SIZE)) {
+        __atomic_add_fetch(&ring->dropped, 1, __ATOMIC_RELAXED);
+        return NULL;
+    }
+
+    return &ring->spans[write & (RING_SIZE - 1)];
+}
+
+static void ring_commit(struct lwan_trace_ring *ring)
+{
+    const uint32_t read = __atomic_load_n(&ring->read, __ATOMIC_ACQUIRE);
+    const uint32_t write = ring->write;
+
+    __atomic_store_n(&ring->write, write + 1, __ATOMIC_RELEASE);
+
+    /* Only wake the tracing thread up once per crossing, so that busy
+     * threads don't make a system call per request. */
+    if (UNLIKELY(write + 1 - read == RING_SIZE / 2))
+        eventfd_write(tracing.wakeup_fd, 1);
+}
+
+static void copy_truncated(char *dest, size_t size, const char *src)
+{
+    if (src)
+        strncpy(dest, src, size);
+}
+
+static void record_span(struct lwan_request *request,
+                        const struct lwan_trace *trace,
+                        enum lwan_trace_span_name name,
+                        uint64_t span_id,
+                        uint64_t parent_span_id,
+                        uint64_t begin_ns,
+                        const char *detail,
+                        enum lwan_http_status status)
+{
+    struct lwan_trace_ring *ring = request->conn->thread->tracing;
+    struct span_record *span = ring_reserve(ring);
+
+    if (!span)
+        return;
+
+    *span = (struct span_record){
+        .span_id = span_id,
+        .parent_span_id = parent_span_id,
+        .begin_ns = begin_ns,
+        .end_ns = monotonic_ns(),
+        .status = (uint16_t)status,
+        .name = (uint8_t)name,
+    };
+    memcpy(span->trace_id, trace->trace_id, sizeof(span->trace_id));
+    copy_truncated(span->detail, sizeof(span->detail), detail);
+    if (name == LWAN_SPAN_REQUEST) {
+        copy_truncated(span->method, sizeof(span->method),
+                       lwan_request_get_method_str(request));
+    }
+
+    ring_commit(ring);
+}
+
+static uint64_t new_span_id(void)
+{
+    /* All zeroes is an invalid ID */
+    return lwan_random_uint64() ?: 1;
+}
+
+static int hex_digit(char c)
+{
+    if (c >= '0' && c <= '9')
+        return c - '0';
+    if (c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+    return -1;
+}
+
+static bool parse_hex(const char *hex, uint8_t *bytes, size_t n_bytes)
+{
+    for (size_t i = 0; i < n_bytes; i++) {
+        const int hi = hex_digit(hex[2 * i]);
+        const int lo = hex_digit(hex[2 * i + 1]);
+
+        if (hi < 0 || lo < 0)
+            return false;
+
+        bytes[i] = (uint8_t)(hi << 4 | lo);
+    }
+
+    return true;
+}
+
+/* IDs with all bits set to zero are invalid */
+static bool parse_id(const char *hex, uint8_t *bytes, size_t n_bytes)
+{
+    uint8_t all_bits = 0;
+
+    if (!parse_hex(hex, bytes, n_bytes))
+        return false;
+
+    for (size_t i = 0; i < n_bytes; i++)
+        all_bits |= bytes[i];
+
+    return all_bits != 0;
+}
+
+/* "00-<32 hex digits: trace ID>-<16 hex digits: parent ID>-<2 hex digits:
+ * flags>", as described in the W3C Trace Context recommendation.  Later
+ * versions might add fields after these. */
+static bool parse_traceparent(const char *value,
+                              struct lwan_trace *trace,
+                              bool *sampled)
+{
+    uint8_t version, flags, parent_id[8];
+    const size_t len = strlen(value);
+
+    if (len < 55 || value[2] != '-' || value[35] != '-' || value[52] != '-')
+        return false;
+    if (!parse_hex(value, &version, 1))
+        return false;
+    if (version == 0xff || (version == 0 && len != 55))
+        return false;
+    if (version != 0 && len > 55 && value[55] != '-')
+        return false;
+
+    if (!parse_id(value + 3, trace->trace_id, sizeof(trace->trace_id)) ||
+        !parse_id(value + 36, parent_id, sizeof(parent_id)) ||
+        !parse_hex(value + 53, &flags, 1))
+        return false;
+
+    memcpy(&trace->remote_parent_id, parent_id, sizeof(parent_id));
+    trace->remote_parent_id = be64toh(trace->remote_parent_id);
+    *sampled = flags & 1;
+
+    return true;
+}
+
+void lwan_tracing_begin(struct lwan_request *request,
+                        const struct timespec *begin,
+                        enum lwan_http_status parse_status)
+{
+    struct lwan_trace context = {};
+    struct lwan_trace *trace;
+    const char *traceparent = NULL;
+    bool sampled;
+
+    /* Headers can't be trusted if the request couldn't be parsed */
+    if (parse_status == HTTP_OK)
+        traceparent = lwan_request_get_header(request, "traceparent");
+
+    if (!traceparent || !parse_traceparent(traceparent, &context, &sampled)) {
+        const uint64_t trace_id[] = {lwan_random_uint64(),
+                                     lwan_random_uint64() | 1};
+
+        sampled = tracing.sample_all ||
+                  lwan_random_uint64() < tracing.sample_threshold;
+        memcpy(context.trace_id, trace_id, sizeof(context.trace_id));
+        context.remote_parent_id = 0;
+    }
+
+    if (!sampled)
+        return;
+
+    trace = coro_malloc(request->conn->coro, sizeof(*trace));
+    if (UNLIKELY(!trace))
+        return;
+
+    *trace = context;
+    trace->root_span_id = trace->current_span_id = new_span_id();
+    trace->begin_ns = timespec_to_ns(begin);
+    request->helper->trace = trace;
+
+    record_span(request, trace, LWAN_SPAN_PARSE, new_span_id(),
+                trace->root_span_id, trace->begin_ns, NULL,
+                parse_status == HTTP_OK ? 0 : parse_status);
+}
+
+void lwan_tracing_end(struct lwan_request *request,
+                      enum lwan_http_status status)
+{
+    const struct lwan_trace *trace = request->helper->trace;
+
+    record_span(request, trace, LWAN_SPAN_REQUEST, trace->root_span_id,
+                trace->remote_parent_id, trace->begin_ns,
+                request->original_url.value, status);
+}
+
+void lwan_tracing_span_begin(struct lwan_request *request,
+                             struct lwan_trace_span *span)
+{
+    struct lwan_trace *trace = request->helper->trace;
+
+    span->id = new_span_id();
+    span->parent_id = trace->current_span_id;
+    span->begin_ns = monotonic_ns();
+
+    trace->current_span_id = span->id;
+}
+
+void lwan_tracing_span_end(struct lwan_request *request,
+                           const struct lwan_trace_span *span,
+                           enum lwan_trace_span_name name,
+                           const char *detail,
+                           enum lwan_http_status status)
+{
+    struct lwan_trace *trace = request->helper->trace;
+
+    trace->current_span_id = span->parent_id;
+
+    record_span(request, trace, name, span->id, span->parent_id,
+                span->begin_ns, detail, status);
+}
+
+void lwan_tracing_get_traceparent(const struct lwan_request *request,
+                                  char buffer[static LWAN_TRACEPARENT_SIZE])
+{
+    static const char hex_digits[] = "0123456789abcdef";
+    const struct lwan_trace *trace = request->helper->trace;
+    char *p = buffer;
+
+    p = mempcpy(p, "00-", 3);
+    for (size_t i = 0; i < sizeof(trace->trace_id); i++) {
+        *p++ = hex_digits[trace->trace_id[i] >> 4];
+        *p++ = hex_digits[trace->trace_id[i] & 15];
+    }
+    *p++ = '-';
+    for (int shift = 60; shift >= 0; shift -= 4)
+        *p++ = hex_digits[(trace->current_span_id >> shift) & 15];
+    /* Only sampled requests are traced */
+    strcpy(p, "-01");
+}
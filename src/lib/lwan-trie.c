@@ -35,11 +35,31 @@ struct lwan_trie_leaf {
     struct lwan_trie_leaf *next;
 };
 
+/* The compacted trie is a path-compressed radix tree stored in a single
+ * allocation.  Children of a node are contiguous and sorted by the first
+ * byte of their labels, and the labels of siblings are contiguous as well,
+ * so a lookup touches a few cache lines per path segment rather than one
+ * node per character. */
+struct lwan_trie_compact_node {
+    void *data;
+    uint32_t label;
+    uint32_t first_child;
+    uint16_t label_len;
+    uint16_t n_children;
+};
+
+struct lwan_trie_compact {
+    const char *labels;
+    size_t n_nodes;
+    struct lwan_trie_compact_node nodes[];
+};
+
 bool lwan_trie_init(struct lwan_trie *trie, void (*free_node)(void *data))
 {
     if (!trie)
         return false;
     trie->root = NULL;
+    trie->compact = NULL;
     trie->free_node = free_node;
     return true;
 }
@@ -63,6 +83,19 @@ find_leaf_with_key(struct lwan_trie_node *node, const char *key, size_t len)
     return NULL;
 }
 
+/* Nodes are indexed by the lower 3 bits of each character, so different
+ * keys with the same length can end up in the same node. */
+static struct lwan_trie_leaf *
+find_leaf_with_exact_key(struct lwan_trie_node *node, const char *key)
+{
+    for (struct lwan_trie_leaf *leaf = node->leaf; leaf; leaf = leaf->next) {
+        if (streq(leaf->key, key))
+            return leaf;
+    }
+
+    return NULL;
+}
+
 #define GET_NODE()                                                             \
     do {                                                                       \
         if (!(node = *knode)) {                                                \
@@ -82,6 +115,9 @@ void lwan_trie_add(struct lwan_trie *trie, const char *key, void *data)
     struct lwan_trie_node **knode, *node;
     const char *orig_key = key;
 
+    free(trie->compact);
+    trie->compact = NULL;
+
     /* Traverse the trie, allocating nodes if necessary */
     for (knode = &trie->root; *key; knode = &node->next[(int)(*key++ & 7)])
         GET_NODE();
@@ -89,8 +125,7 @@ void lwan_trie_add(struct lwan_trie *trie, const char *key, void *data)
     /* Get the leaf node (allocate it if necessary) */
     GET_NODE();
 
-    struct lwan_trie_leaf *leaf =
-        find_leaf_with_key(node, orig_key, (size_t)(key - orig_key));
+    struct lwan_trie_leaf *leaf = find_leaf_with_exact_key(node, orig_key);
     bool had_key = leaf;
     if (!leaf) {
         leaf = lwan_aligned_alloc(sizeof(*leaf), 64);
@@ -133,12 +168,56 @@ lookup_node(struct lwan_trie_node *root, const char *key, size_t *prefix_len)
     return previous_node;
 }
 
+static void *compact_lookup_prefix(const struct lwan_trie_compact *compact,
+                                   const char *key)
+{
+    const struct lwan_trie_compact_node *node = &compact->nodes[0];
+    void *data = node->data;
+
+    while (*key && node->n_children) {
+        const struct lwan_trie_compact_node *children =
+            &compact->nodes[node->first_child];
+        const unsigned char c = (unsigned char)*key;
+        size_t lo = 0, hi = node->n_children;
+
+        node = NULL;
+        while (lo < hi) {
+            const size_t mid = lo + (hi - lo) / 2;
+            const unsigned char first =
+                (unsigned char)compact->labels[children[mid].label];
+
+            if (first == c) {
+                node = &children[mid];
+                break;
+            }
+            if (first < c)
+                lo = mid + 1;
+            else
+                hi = mid;
+        }
+
+        /* Labels never contain a NUL byte, so strncmp() stops at the end of
+         * the key if it's shorter than the label. */
+        if (!node || strncmp(compact->labels + node->label, key, node->label_len))
+            break;
+
+        key += node->label_len;
+        if (node->data)
+            data = node->data;
+    }
+
+    return data;
+}
+
 ALWAYS_INLINE void *lwan_trie_lookup_prefix(struct lwan_trie *trie,
                                             const char *key)
 {
     assert(trie);
     assert(key);
 
+    if (trie->compact)
+        return compact_lookup_prefix(trie->compact, key);
+
     size_t prefix_len;
     struct lwan_trie_node *node = lookup_node(trie->root, key, &prefix_len);
 
@@ -183,7 +262,184 @@ static void lwan_trie_node_destroy(struct lwan_trie *trie,
 
 void lwan_trie_destroy(struct lwan_trie *trie)
 {
-    if (!trie || !trie->root)
+    if (!trie)
+        return;
+    free(trie->compact);
+    trie->compact = NULL;
+    if (!trie->root)
         return;
     lwan_trie_node_destroy(trie, trie->root);
 }
+
+struct compact_key {
+    const char *key;
+    void *data;
+};
+
+struct compact_builder {
+    const struct compact_key *keys;
+    struct lwan_trie_compact *compact;
+    char *labels;
+    size_t next_node;
+    size_t next_label;
+};
+
+static size_t collect_keys(const struct lwan_trie_node *node,
+                           struct compact_key *keys,
+                           size_t n_keys)
+{
+    if (!node)
+        return n_keys;
+
+    for (const struct lwan_trie_leaf *leaf = node->leaf; leaf;
+         leaf = leaf->next) {
+        if (keys)
+            keys[n_keys] = (struct compact_key){leaf->key, leaf->data};
+        n_keys++;
+    }
+
+    for (int i = 0; i < 8; i++)
+        n_keys = collect_keys(node->next[i], keys, n_keys);
+
+    return n_keys;
+}
+
+static int compare_keys(const void *a, const void *b)
+{
+    const struct compact_key *ka = a, *kb = b;
+
+    return strcmp(ka->key, kb->key);
+}
+
+static ALWAYS_INLINE size_t end_of_group(const struct compact_key *keys,
+                                         size_t lo,
+                                         size_t hi,
+                                         size_t depth)
+{
+    const char c = keys[lo].key[depth];
+
+    while (++lo < hi && keys[lo].key[depth] == c)
+        ;
+
+    return lo;
+}
+
+/* keys[lo..hi) are sorted, and all of them share the first `depth` bytes,
+ * which are represented by the path to `node_index`. */
+static bool build_compact_node(struct compact_builder *b,
+                               size_t node_index,
+                               size_t lo,
+                               size_t hi,
+                               size_t depth)
+{
+    struct lwan_trie_compact_node *node = &b->compact->nodes[node_index];
+    const struct compact_key *keys = b->keys;
+    size_t n_children = 0;
+
+    if (lo < hi && keys[lo].key[depth] == '\0')
+        node->data = keys[lo++].data;
+
+    for (size_t i = lo; i < hi; i = end_of_group(keys, i, hi, depth))
+        n_children++;
+
+    node->first_child = (uint32_t)b->next_node;
+    node->n_children = (uint16_t)n_children;
+    b->next_node += n_children;
+
+    /* Labels of all children are stored before any of their subtrees. */
+    size_t child = node->first_child;
+    for (size_t i = lo; i < hi; child++) {
+        const size_t j = end_of_group(keys, i, hi, depth);
+        const char *first = keys[i].key + depth;
+        const char *last = keys[j - 1].key + depth;
+        size_t len = 1;
+
+        while (first[len] && first[len] == last[len])
+            len++;
+        if (len > UINT16_MAX)
+            return false;
+
+        memcpy(b->labels + b->next_label, first, len);
+        b->compact->nodes[child].label = (uint32_t)b->next_label;
+        b->compact->nodes[child].label_len = (uint16_t)len;
+        b->next_label += len;
+
+        i = j;
+    }
+
+    child = node->first_child;
+    for (size_t i = lo; i < hi; child++) {
+        const size_t j = end_of_group(keys, i, hi, depth);
+
+        if (!build_compact_node(b, child, i, j,
+                                depth + b->compact->nodes[child].label_len))
+            return false;
+
+        i = j;
+    }
+
+    return true;
+}
+
+bool lwan_trie_compact(struct lwan_trie *trie)
+{
+    struct compact_key *keys;
+    size_t n_keys, n_unique = 0;
+    size_t max_nodes, max_labels = 0;
+    struct lwan_trie_compact *compact;
+
+    if (!trie)
+        return false;
+
+    free(trie->compact);
+    trie->compact = NULL;
+
+    n_keys = collect_keys(trie->root, NULL, 0);
+    keys = calloc(n_keys ? n_keys : 1, sizeof(*keys));
+    if (!keys)
+        return false;
+    collect_keys(trie->root, keys, 0);
+
+    qsort(keys, n_keys, sizeof(*keys), compare_keys);
+    for (size_t i = 0; i < n_keys; i++) {
+        if (n_unique && streq(keys[n_unique - 1].key, keys[i].key))
+            continue;
+        keys[n_unique++] = keys[i];
+        max_labels += strlen(keys[i].key);
+    }
+
+    /* Every key adds at most one leaf and splits at most one edge. */
+    max_nodes = 1 + 2 * n_unique;
+    if (max_nodes > UINT32_MAX || max_labels > UINT32_MAX)
+        goto fail;
+
+    compact = calloc(1, sizeof(*compact) +
+                            max_nodes * sizeof(compact->nodes[0]) + max_labels);
+    if (!compact)
+        goto fail;
+
+    struct compact_builder b = {
+        .keys = keys,
+        .compact = compact,
+        .labels = (char *)&compact->nodes[max_nodes],
+        .next_node = 1,
+    };
+    if (!build_compact_node(&b, 0, 0, n_unique, 0)) {
+        free(compact);
+        goto fail;
+    }
+
+    compact->labels = b.labels;
+    compact->n_nodes = b.next_node;
+    trie->compact = compact;
+
+    lwan_status_debug("Compacted trie: %zu keys, %zu nodes, %zu bytes of labels",
+                      n_unique, b.next_node, b.next_label);
+
+    free(keys);
+    return true;
+
+fail:
+    free(keys);
+    return false;
+}
@@ -24,9 +24,11 @@
 #include <stdint.h>
 
 struct lwan_trie_node;
+struct lwan_trie_compact;
 
 struct lwan_trie {
     struct lwan_trie_node *root;
+    struct lwan_trie_compact *compact;
     void (*free_node)(void *data);
 };
 
@@ -35,4 +37,8 @@ void lwan_trie_destroy(struct lwan_trie *trie);
 
 void lwan_trie_add(struct lwan_trie *trie, const char *key, void *data);
 
+/* Builds a read-only, contiguous copy of the trie that's used for lookups
+ * until the next call to lwan_trie_add().  */
+bool lwan_trie_compact(struct lwan_trie *trie);
+
 void *lwan_trie_lookup_prefix(struct lwan_trie *trie, const char *key);
@@ -0,0 +1,461 @@
+/*
+ * lwan - web server
+ * Copyright (c) 2024 L. A. F. Pereira <l@tia.mat.br>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301,
+ * USA.
+ */
+
+/* Hands listening sockets over to a new lwan process.  A process with an
+ * `upgrade_socket` listens on that Unix socket; when a new process starts
+ * with the same setting, it connects to it before creating its listeners,
+ * and gets the listening sockets of every I/O thread through SCM_RIGHTS.
+ * Once the new process is ready to serve, it tells the old one, which stops
+ * accepting connections, closes the ones it has after their current
+ * request (or once they've been idle for keep_alive_timeout), and makes
+ * lwan_main_loop() return once they're all gone.  As both processes share
+ * the same sockets, connections waiting to be accepted aren't lost. */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "lwan-private.h"
+
+#define HANDOFF_MAGIC "LWUP"
+#define HANDOFF_TIMEOUT_MS 5000
+
+enum handoff_type {
+    HANDOFF_LISTENER = 1,
+    HANDOFF_TLS_LISTENER = 2,
+    HANDOFF_END = 3,
+    HANDOFF_ACK = 4,
+};
+
+struct handoff_msg {
+    char magic[4];
+    uint8_t type;
+};
+
+enum upgrade_state {
+    UPGRADE_IDLE,
+    UPGRADE_LISTENING,
+    UPGRADE_WAITING_ACK,
+    UPGRADE_DRAINING,
+};
+
+static struct {
+    enum upgrade_state state;
+
+    /* Unix socket new processes connect to, and the connection with the
+     * one being handed the listeners */
+    int listen_fd;
+    int peer_fd;
+    struct sockaddr_un addr;
+
+    /* Written to once to wake up every I/O thread, so they can stop
+     * accepting connections; see stop_accepting() in lwan-thread.c */
+    int drain_fd;
+    uint64_t drain_deadline_ms;
+
+    /* Listeners inherited from the previous process, used by
+     * lwan_create_listen_socket() until there are none left */
+    struct {
+        int *fds;
+        size_t n_fds;
+        size_t used;
+    } inherited[2];
+} upgrade = {
+    .listen_fd = -1,
+    .peer_fd = -1,
+    .drain_fd = -1,
+};
+
+static uint64_t monotonic_ms(void)
+{
+    struct timespec now;
+
+    if (UNLIKELY(clock_gettime(CLOCK_MONOTONIC, &now) < 0))
+        return 0;
+
+    return (uint64_t)now.tv_sec * 1000ull + (uint64_t)now.tv_nsec / 1000000ull;
+}
+
+static bool set_timeouts(int fd)
+{
+    const struct timeval tv = {.tv_sec = HANDOFF_TIMEOUT_MS / 1000};
+
+    return !setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) &&
+           !setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+}
+
+static bool send_msg(int fd, enum handoff_type type, int fd_to_send)
+{
+    struct handoff_msg msg = {.magic = HANDOFF_MAGIC, .type = (uint8_t)type};
+    struct iovec iov = {.iov_base = &msg, .iov_len = sizeof(msg)};
+    union {
+        char buf[CMSG_SPACE(sizeof(int))];
+        struct cmsghdr align;
+    } control = {};
+    struct msghdr hdr = {.msg_iov = &iov, .msg_iovlen = 1};
+
+    if (fd_to_send >= 0) {
+        struct cmsghdr *cmsg;
+
+        hdr.msg_control = control.buf;
+        hdr.msg_controllen = sizeof(control.buf);
+
+        cmsg = CMSG_FIRSTHDR(&hdr);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(cmsg), &fd_to_send, sizeof(int));
+    }
+
+    while (true) {
+        ssize_t r = sendmsg(fd, &hdr, MSG_NOSIGNAL);
+
+        if (r == (ssize_t)sizeof(msg))
+            return true;
+        if (r < 0 && errno == EINTR)
+            continue;
+        return false;
+    }
+}
+
+static int recv_msg(int fd, int *received_fd)
+{
+    struct handoff_msg msg;
+    struct iovec iov = {.iov_base = &msg, .iov_len = sizeof(msg)};
+    union {
+        char buf[CMSG_SPACE(sizeof(int))];
+        struct cmsghdr align;
+    } control;
+    struct msghdr hdr = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = control.buf,
+        .msg_controllen = sizeof(control.buf),
+    };
+    ssize_t r;
+
+    *received_fd = -1;
+
+    do {
+        r = recvmsg(fd, &hdr, MSG_CMSG_CLOEXEC);
+    } while (r < 0 && errno == EINTR);
+
+    if (r != (ssize_t)sizeof(msg) || memcmp(msg.magic, HANDOFF_MAGIC, 4))
+        return -1;
+
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&hdr); cmsg;
+         cmsg = CMSG_NXTHDR(&hdr, cmsg)) {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS &&
+            cmsg->cmsg_len == CMSG_LEN(sizeof(int))) {
+            memcpy(received_fd, CMSG_DATA(cmsg), sizeof(int));
+        }
+    }
+
+    return msg.type;
+}
+
+static bool add_inherited(bool tls, int fd)
+{
+    size_t n_fds = upgrade.inherited[tls].n_fds;
+    int *fds = realloc(upgrade.inherited[tls].fds, (n_fds + 1) * sizeof(int));
+
+    if (!fds)
+        return false;
+
+    fds[n_fds] = fd;
+    upgrade.inherited[tls].fds = fds;
+    upgrade.inherited[tls].n_fds = n_fds + 1;
+
+    return true;
+}
+
+static void close_inherited(void)
+{
+    for (size_t tls = 0; tls < N_ELEMENTS(upgrade.inherited); tls++) {
+        for (size_t i = upgrade.inherited[tls].used;
+             i < upgrade.inherited[tls].n_fds; i++)
+            close(upgrade.inherited[tls].fds[i]);
+
+        free(upgrade.inherited[tls].fds);
+        upgrade.inherited[tls].fds = NULL;
+        upgrade.inherited[tls].n_fds = upgrade.inherited[tls].used = 0;
+    }
+}
+
+static void receive_listeners(void)
+{
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+
+    if (fd < 0) {
+        lwan_status_perror("Could not create upgrade socket");
+        return;
+    }
+
+    if (connect(fd, (struct sockaddr *)&upgrade.addr, sizeof(upgrade.addr)) <
+        0) {
+        /* Most likely, there's no other lwan process running */
+        close(fd);
+        return;
+    }
+
+    if (!set_timeouts(fd))
+        goto error;
+
+    while (true) {
+        int received_fd;
+        const int type = recv_msg(fd, &received_fd);
+
+        switch (type) {
+        case HANDOFF_LISTENER:
+        case HANDOFF_TLS_LISTENER:
+            if (received_fd < 0)
+                goto error;
+            if (!add_inherited(type == HANDOFF_TLS_LISTENER, received_fd)) {
+                close(received_fd);
+                goto error;
+            }
+            break;
+        case HANDOFF_END:
+            lwan_status_info("Inherited %zu listeners (%zu TLS) from the "
+                             "previous process",
+                             upgrade.inherited[0].n_fds +
+                                 upgrade.inherited[1].n_fds,
+                             upgrade.inherited[1].n_fds);
+            upgrade.peer_fd = fd;
+            return;
+        default:
+            if (received_fd >= 0)
+                close(received_fd);
+            goto error;
+        }
+    }
+
+error:
+    lwan_status_warning("Could not get listeners from the previous process; "
+                        "creating new ones");
+    close_inherited();
+    close(fd);
+}
+
+void lwan_upgrade_init(struct lwan *l)
+{
+    const char *path = l->config.upgrade_socket;
+
+    if (!path)
+        return;
+
+    if (strlen(path) >= sizeof(upgrade.addr.sun_path)) {
+        lwan_status_critical("Upgrade socket path is too long: %s", path);
+        return;
+    }
+
+    upgrade.addr.sun_family = AF_UNIX;
+    strcpy(upgrade.addr.sun_path, path);
+
+    receive_listeners();
+
+    upgrade.drain_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (upgrade.drain_fd < 0)
+        lwan_status_critical_perror("Could not create drain eventfd");
+}
+
+int lwan_upgrade_take_listener(bool tls)
+{
+    if (upgrade.inherited[tls].used >= upgrade.inherited[tls].n_fds)
+        return -1;
+
+    return upgrade.inherited[tls].fds[upgrade.inherited[tls].used++];
+}
+
+int lwan_upgrade_get_drain_fd(void)
+{
+    return upgrade.drain_fd;
+}
+
+static bool send_listeners(const struct lwan *l, int fd)
+{
+    for (unsigned int i = 0; i < l->thread.count; i++) {
+        const struct lwan_thread *t = &l->thread.threads[i];
+
+        if (!send_msg(fd, HANDOFF_LISTENER, t->listen_fd))
+            return false;
+        if (t->tls_listen_fd >= 0 &&
+            !send_msg(fd, HANDOFF_TLS_LISTENER, t->tls_listen_fd))
+            return false;
+    }
+
+    return send_msg(fd, HANDOFF_END, -1);
+}
+
+static bool all_threads_drained(const struct lwan *l)
+{
+    for (unsigned int i = 0; i < l->thread.count; i++) {
+        if (!ATOMIC_READ(l->thread.threads[i].drained))
+            return false;
+    }
+
+    return true;
+}
+
+static bool upgrade_job(void *data)
+{
+    struct lwan *l = data;
+
+    switch (upgrade.state) {
+    case UPGRADE_IDLE:
+        return false;
+
+    case UPGRADE_LISTENING:
+        upgrade.peer_fd = accept4(upgrade.listen_fd, NULL, NULL, SOCK_CLOEXEC);
+        if (upgrade.peer_fd < 0)
+            return false;
+
+        if (!set_timeouts(upgrade.peer_fd) ||
+            !send_listeners(l, upgrade.peer_fd)) {
+            lwan_status_perror("Could not hand listeners over to new process");
+            close(upgrade.peer_fd);
+            upgrade.peer_fd = -1;
+            return true;
+        }
+
+        lwan_status_info("Handed listeners over to new process, waiting for "
+                         "it to be ready");
+        upgrade.state = UPGRADE_WAITING_ACK;
+        return true;
+
+    case UPGRADE_WAITING_ACK: {
+        struct pollfd pfd = {.fd = upgrade.peer_fd, .events = POLLIN};
+        int received_fd;
+
+        if (poll(&pfd, 1, 0) <= 0)
+            return false;
+
+        if (recv_msg(upgrade.peer_fd, &received_fd) != HANDOFF_ACK) {
+            if (received_fd >= 0)
+                close(received_fd);
+            lwan_status_warning("New process went away before taking over");
+            close(upgrade.peer_fd);
+            upgrade.peer_fd = -1;
+            upgrade.state = UPGRADE_LISTENING;
+            return true;
+        }
+
+        /* The path now belongs to the new process, so don't unlink it */
+        close(upgrade.peer_fd);
+        close(upgrade.listen_fd);
+        upgrade.peer_fd = upgrade.listen_fd = -1;
+
+        lwan_status_info("New process took over; draining connections");
+        if (eventfd_write(upgrade.drain_fd, 1) < 0)
+            lwan_status_perror("Could not tell threads to stop accepting");
+
+        upgrade.drain_deadline_ms =
+            monotonic_ms() + (uint64_t)l->config.upgrade_drain_timeout * 1000;
+        upgrade.state = UPGRADE_DRAINING;
+        return true;
+    }
+
+    case UPGRADE_DRAINING:
+        if (all_threads_drained(l)) {
+            lwan_status_info("All connections drained");
+        } else if (monotonic_ms() >= upgrade.drain_deadline_ms) {
+            lwan_status_warning("Drain timeout expired; closing remaining "
+                                "connections");
+        } else {
+            return false;
+        }
+
+        upgrade.state = UPGRADE_IDLE;
+        lwan_job_thread_stop();
+        return true;
+    }
+
+    return false;
+}
+
+void lwan_upgrade_main_loop(struct lwan *l)
+{
+    size_t unused = 0;
+
+    if (!l->config.upgrade_socket || upgrade.drain_fd < 0)
+        return;
+
+    for (size_t tls = 0; tls < N_ELEMENTS(upgrade.inherited); tls++)
+        unused += upgrade.inherited[tls].n_fds - upgrade.inherited[tls].used;
+    if (unused) {
+        lwan_status_warning("Closing %zu inherited listeners not used by this "
+                            "process; check if thread counts match",
+                            unused);
+    }
+    close_inherited();
+
+    if (upgrade.peer_fd >= 0) {
+        if (!send_msg(upgrade.peer_fd, HANDOFF_ACK, -1))
+            lwan_status_perror("Could not tell previous process to drain");
+        close(upgrade.peer_fd);
+        upgrade.peer_fd = -1;
+    }
+
+    upgrade.listen_fd =
+        socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+    if (upgrade.listen_fd < 0) {
+        lwan_status_perror("Could not create upgrade socket");
+        return;
+    }
+
+    unlink(upgrade.addr.sun_path);
+    if (bind(upgrade.listen_fd, (struct sockaddr *)&upgrade.addr,
+             sizeof(upgrade.addr)) < 0 ||
+        listen(upgrade.listen_fd, 1) < 0) {
+        lwan_status_perror("Could not listen on upgrade socket %s",
+                           upgrade.addr.sun_path);
+        close(upgrade.listen_fd);
+        upgrade.listen_fd = -1;
+        return;
+    }
+
+    upgrade.state = UPGRADE_LISTENING;
+    lwan_job_add_full(upgrade_job, l, "upgrade", LWAN_JOB_PRIORITY_LOW, 100,
+                      1000);
+}
+
+void lwan_upgrade_shutdown(void)
+{
+    if (upgrade.listen_fd >= 0) {
+        close(upgrade.listen_fd);
+        unlink(upgrade.addr.sun_path);
+    }
+    if (upgrade.peer_fd >= 0)
+        close(upgrade.peer_fd);
+    if (upgrade.drain_fd >= 0)
+        close(upgrade.drain_fd);
+
+    upgrade.listen_fd = upgrade.peer_fd = upgrade.drain_fd = -1;
+    upgrade.state = UPGRADE_IDLE;
+
+    close_inherited();
+}
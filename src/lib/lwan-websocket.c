@@ -24,9 +24,12 @@
 #include <errno.h>
 #include <string.h>
 #include <sys/socket.h>
+#include <zlib.h>
 
 #if defined(__x86_64__)
 #include <immintrin.h>
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+#include <arm_neon.h>
 #endif
 
 #include "lwan-io-wrappers.h"
@@ -56,31 +59,79 @@ enum ws_opcode {
 };
 
 #define WS_MASKED 0x80
+#define WS_FIN 0x80
+#define WS_RSV1 0x40
+
+/* Messages shorter than this aren't worth compressing: the deflate block
+ * overhead eats whatever would be saved. */
+#define WS_DEFLATE_MIN_LENGTH 64
+#define WS_DEFLATE_DEFAULT_WINDOW_BITS 11
+#define WS_DEFLATE_MEM_LEVEL 4
+#define WS_INFLATE_CHUNK_SIZE 16384
+#define WS_INFLATE_MAX_LENGTH (16 * 1024 * 1024)
+
+#define WS_SHARED_FRAME_MAGIC 0x77736672 /* "wsfr" */
+
+struct lwan_websocket_deflate {
+    z_stream deflater;
+    z_stream inflater;
+
+    /* Holds compressed messages before they're sent, and received ones
+     * while they're inflated back into the response buffer. */
+    char *scratch;
+    size_t scratch_size;
+
+    int window_bits;            /* Used by our compressor */
+    int max_server_window_bits; /* Largest window the client can inflate */
+    int client_window_bits;     /* Used by the client's compressor */
+
+    bool no_context_takeover;
+    bool deflater_ready;
+    bool inflater_ready;
+};
 
-static ALWAYS_INLINE bool
-write_websocket_frame_full(struct lwan_request *request,
-                           unsigned char header_byte,
-                           char *msg,
-                           size_t len,
-                           bool use_coro)
+/* Shared frames are stored already encoded, header and all, so sending
+ * one is a single write from the shared buffer.  The plain frame comes
+ * right after this header, followed by the compressed frame, if any. */
+struct shared_frame_header {
+    uint32_t magic;
+    uint8_t opcode;
+    uint8_t window_bits;      /* 0 if there's no compressed frame */
+    uint8_t plain_header_len; /* Needed to get to the plain payload */
+    uint64_t plain_len;       /* Both lengths include the frame header */
+    uint64_t deflated_len;
+};
+
+static size_t
+encode_frame_header(uint8_t frame[static 10], unsigned char header_byte, size_t len)
 {
-    uint8_t frame[10] = {header_byte};
-    size_t frame_len;
+    frame[0] = header_byte;
 
     if (len <= 125) {
         frame[1] = (uint8_t)len;
-        frame_len = 2;
-    } else if (len <= 65535) {
+        return 2;
+    }
+    if (len <= 65535) {
         frame[1] = 0x7e;
         memcpy(frame + 2, &(uint16_t){htons((uint16_t)len)}, sizeof(uint16_t));
-        frame_len = 4;
-    } else {
-        frame[1] = 0x7f;
-        memcpy(frame + 2, &(uint64_t){htobe64((uint64_t)len)},
-               sizeof(uint64_t));
-        frame_len = 10;
+        return 4;
     }
 
+    frame[1] = 0x7f;
+    memcpy(frame + 2, &(uint64_t){htobe64((uint64_t)len)}, sizeof(uint64_t));
+    return 10;
+}
+
+static ALWAYS_INLINE bool
+write_websocket_frame_full(struct lwan_request *request,
+                           unsigned char header_byte,
+                           char *msg,
+                           size_t len,
+                           bool use_coro)
+{
+    uint8_t frame[10];
+    size_t frame_len = encode_frame_header(frame, header_byte, len);
+
     struct iovec vec[] = {
         {.iov_base = frame, .iov_len = frame_len},
         {.iov_base = msg, .iov_len = len},
@@ -124,17 +175,138 @@ static bool write_websocket_frame(struct lwan_request *request,
     return write_websocket_frame_full(request, header_byte, msg, len, true);
 }
 
+static bool ensure_scratch(struct lwan_websocket_deflate *ws, size_t size)
+{
+    if (size <= ws->scratch_size)
+        return true;
+
+    char *scratch = realloc(ws->scratch, size);
+    if (UNLIKELY(!scratch))
+        return false;
+
+    ws->scratch = scratch;
+    ws->scratch_size = size;
+    return true;
+}
+
+static void abort_connection(struct lwan_request *request)
+{
+    coro_yield(request->conn->coro, CONN_CORO_ABORT);
+    __builtin_unreachable();
+}
+
+static bool init_deflater(struct lwan_websocket_deflate *ws)
+{
+    if (ws->deflater_ready)
+        return true;
+
+    if (deflateInit2(&ws->deflater, Z_DEFAULT_COMPRESSION, Z_DEFLATED,
+                     -ws->window_bits, WS_DEFLATE_MEM_LEVEL,
+                     Z_DEFAULT_STRATEGY) != Z_OK)
+        return false;
+
+    ws->deflater_ready = true;
+    return true;
+}
+
+/* Compresses @msg into ws->scratch, returning the length of the compressed
+ * data.  The empty block that ends every message is stripped (per RFC7692)
+ * once @last is set.  The compressor state has then seen @msg, so (unless
+ * it's reset after every message) the client must see its compressed form
+ * too, or both ends would disagree on the window contents: failures are
+ * fatal for the connection.  */
+static size_t deflate_piece(struct lwan_request *request,
+                            struct lwan_websocket_deflate *ws,
+                            char *msg,
+                            size_t len,
+                            bool last)
+{
+    z_stream *stream = &ws->deflater;
+    size_t deflated_len = 0;
+
+    if (UNLIKELY(len > UINT_MAX))
+        abort_connection(request);
+
+    stream->next_in = (Bytef *)msg;
+    stream->avail_in = (uInt)len;
+    do {
+        const size_t chunk = deflateBound(stream, stream->avail_in) + 16;
+
+        if (UNLIKELY(!ensure_scratch(ws, deflated_len + chunk)))
+            abort_connection(request);
+
+        stream->next_out = (Bytef *)ws->scratch + deflated_len;
+        stream->avail_out = (uInt)chunk;
+
+        int ret = deflate(stream, Z_SYNC_FLUSH);
+        if (UNLIKELY(ret != Z_OK && ret != Z_BUF_ERROR))
+            abort_connection(request);
+
+        deflated_len += chunk - stream->avail_out;
+    } while (stream->avail_out == 0);
+
+    if (last) {
+        if (LIKELY(deflated_len >= 4 &&
+                   !memcmp(ws->scratch + deflated_len - 4, "\0\0\xff\xff", 4)))
+            deflated_len -= 4;
+
+        if (ws->no_context_takeover)
+            deflateReset(stream);
+    }
+
+    return deflated_len;
+}
+
+/* Returns the length of the compressed message in ws->scratch, or 0 if it
+ * should be sent uncompressed instead.  */
+static size_t deflate_message(struct lwan_request *request,
+                              struct lwan_websocket_deflate *ws,
+                              char *msg,
+                              size_t len)
+{
+    if (len < WS_DEFLATE_MIN_LENGTH || len > UINT_MAX)
+        return 0;
+    if (!init_deflater(ws))
+        return 0;
+
+    size_t deflated_len = deflate_piece(request, ws, msg, len, true);
+    if (ws->no_context_takeover && deflated_len >= len)
+        return 0;
+
+    return deflated_len;
+}
+
+static void write_message(struct lwan_request *request,
+                          unsigned char op,
+                          char *msg,
+                          size_t len)
+{
+    struct lwan_websocket_deflate *ws = request->helper->ws_deflate;
+    unsigned char header = WS_FIN | op;
+
+    if (ws) {
+        size_t deflated_len = deflate_message(request, ws, msg, len);
+
+        if (deflated_len) {
+            write_websocket_frame(request, header | WS_RSV1, ws->scratch,
+                                  deflated_len);
+            return;
+        }
+    }
+
+    write_websocket_frame(request, header, msg, len);
+}
+
 static inline void lwan_response_websocket_write(struct lwan_request *request,
                                                  unsigned char op)
 {
     size_t len = lwan_strbuf_get_length(request->response.buffer);
     char *msg = lwan_strbuf_get_buffer(request->response.buffer);
-    unsigned char header = WS_MASKED | op;
 
     if (!(request->conn->flags & CONN_IS_WEBSOCKET))
         return;
 
-    write_websocket_frame(request, header, msg, len);
+    write_message(request, op, msg, len);
     lwan_strbuf_reset(request->response.buffer);
 }
 
@@ -148,6 +320,191 @@ void lwan_response_websocket_write_binary(struct lwan_request *request)
     lwan_response_websocket_write(request, WS_OPCODE_BINARY);
 }
 
+/* Sends the response buffer as a fragment of a message, which is finished
+ * by the fragment with @last set.  Compression, if negotiated, spans the
+ * whole message, so it's decided on its first fragment.  */
+static void lwan_response_websocket_write_partial(struct lwan_request *request,
+                                                  unsigned char op,
+                                                  bool last)
+{
+    struct lwan_request_parser_helper *helper = request->helper;
+    struct lwan_request_streams *streams;
+    struct lwan_websocket_deflate *ws = helper->ws_deflate;
+    size_t len = lwan_strbuf_get_length(request->response.buffer);
+    char *msg = lwan_strbuf_get_buffer(request->response.buffer);
+    unsigned char header = last ? WS_FIN : 0;
+
+    if (!(request->conn->flags & CONN_IS_WEBSOCKET))
+        return;
+
+    streams = lwan_request_get_streams(request);
+    if (UNLIKELY(!streams))
+        abort_connection(request);
+
+    if (streams->websocket.writing) {
+        header |= WS_OPCODE_CONTINUATION;
+    } else {
+        header |= op;
+        streams->websocket.writing = true;
+        streams->websocket.write_compressed = ws && init_deflater(ws);
+        if (streams->websocket.write_compressed)
+            header |= WS_RSV1;
+    }
+
+    if (streams->websocket.write_compressed) {
+        size_t deflated_len = deflate_piece(request, ws, msg, len, last);
+        write_websocket_frame(request, header, ws->scratch, deflated_len);
+    } else {
+        write_websocket_frame(request, header, msg, len);
+    }
+
+    if (last)
+        streams->websocket.writing = false;
+    lwan_strbuf_reset(request->response.buffer);
+}
+
+void lwan_response_websocket_write_text_partial(struct lwan_request *request,
+                                                bool last)
+{
+    lwan_response_websocket_write_partial(request, WS_OPCODE_TEXT, last);
+}
+
+void lwan_response_websocket_write_binary_partial(struct lwan_request *request,
+                                                  bool last)
+{
+    lwan_response_websocket_write_partial(request, WS_OPCODE_BINARY, last);
+}
+
+static bool append_frame(struct lwan_strbuf *frame,
+                         unsigned char header_byte,
+                         const char *msg,
+                         size_t len,
+                         size_t *frame_len)
+{
+    uint8_t header[10];
+    size_t header_len = encode_frame_header(header, header_byte, len);
+
+    *frame_len = header_len + len;
+    return lwan_strbuf_append_str(frame, (const char *)header, header_len) &&
+           lwan_strbuf_append_str(frame, msg, len);
+}
+
+static bool prepare_shared(struct lwan_strbuf *frame,
+                           unsigned char op,
+                           const char *msg,
+                           size_t len)
+{
+    struct shared_frame_header header = {
+        .magic = WS_SHARED_FRAME_MAGIC,
+        .opcode = op,
+    };
+    z_stream stream = {};
+    char *out = NULL;
+    size_t deflated_len = 0;
+
+    if (len < WS_DEFLATE_MIN_LENGTH || len > UINT_MAX)
+        goto encode;
+
+    /* Shared frames are compressed only once, so use the largest window:
+     * they'll be sent compressed to every client that accepts it.  */
+    if (deflateInit2(&stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -MAX_WBITS,
+                     8, Z_DEFAULT_STRATEGY) != Z_OK)
+        goto encode;
+
+    const size_t bound = deflateBound(&stream, len) + 16;
+    out = malloc(bound);
+    if (UNLIKELY(!out)) {
+        deflateEnd(&stream);
+        goto encode;
+    }
+
+    stream.next_in = (Bytef *)msg;
+    stream.avail_in = (uInt)len;
+    stream.next_out = (Bytef *)out;
+    stream.avail_out = (uInt)bound;
+    if (deflate(&stream, Z_SYNC_FLUSH) == Z_OK && stream.avail_in == 0 &&
+        stream.avail_out > 0) {
+        deflated_len = bound - stream.avail_out;
+
+        if (deflated_len >= 4 &&
+            !memcmp(out + deflated_len - 4, "\0\0\xff\xff", 4))
+            deflated_len -= 4;
+
+        if (deflated_len < len)
+            header.window_bits = MAX_WBITS;
+    }
+    deflateEnd(&stream);
+
+encode:
+    header.plain_header_len =
+        (uint8_t)encode_frame_header((uint8_t[10]){}, 0, len);
+
+    /* The header is written again once both frame lengths are known */
+    bool ret =
+        lwan_strbuf_set(frame, (const char *)&header, sizeof(header)) &&
+        append_frame(frame, WS_MASKED | op, msg, len, &header.plain_len);
+    if (ret && header.window_bits) {
+        ret = append_frame(frame, WS_MASKED | WS_RSV1 | op, out, deflated_len,
+                           &header.deflated_len);
+    }
+    if (ret)
+        memcpy(lwan_strbuf_get_buffer(frame), &header, sizeof(header));
+
+    free(out);
+    return ret;
+}
+
+bool lwan_websocket_prepare_shared_text(struct lwan_strbuf *frame,
+                                        const char *msg,
+                                        size_t len)
+{
+    return prepare_shared(frame, WS_OPCODE_TEXT, msg, len);
+}
+
+bool lwan_websocket_prepare_shared_binary(struct lwan_strbuf *frame,
+                                          const char *msg,
+                                          size_t len)
+{
+    return prepare_shared(frame, WS_OPCODE_BINARY, msg, len);
+}
+
+void lwan_response_websocket_write_shared(struct lwan_request *request,
+                                          const struct lwan_value *frame)
+{
+    struct lwan_websocket_deflate *ws = request->helper->ws_deflate;
+    struct shared_frame_header header;
+
+    if (!(request->conn->flags & CONN_IS_WEBSOCKET))
+        return;
+
+    if (UNLIKELY(frame->len < sizeof(header)))
+        goto invalid;
+    memcpy(&header, frame->value, sizeof(header));
+    if (UNLIKELY(header.magic != WS_SHARED_FRAME_MAGIC))
+        goto invalid;
+    if (UNLIKELY(frame->len - sizeof(header) !=
+                 header.plain_len + header.deflated_len))
+        goto invalid;
+    if (UNLIKELY(header.plain_len < header.plain_header_len))
+        goto invalid;
+
+    char *plain = frame->value + sizeof(header);
+    if (!ws) {
+        lwan_send(request, plain, header.plain_len, 0);
+    } else if (header.window_bits && ws->no_context_takeover &&
+               header.window_bits <= ws->max_server_window_bits) {
+        lwan_send(request, plain + header.plain_len, header.deflated_len, 0);
+    } else {
+        /* This connection's compressor has to see the message */
+        write_message(request, header.opcode, plain + header.plain_header_len,
+                      header.plain_len - header.plain_header_len);
+    }
+    return;
+
+invalid:
+    lwan_status_warning("Not sending invalid shared WebSockets frame");
+}
+
 static size_t get_frame_length(struct lwan_request *request, uint16_t header)
 {
     uint64_t len;
@@ -187,56 +544,10 @@ static size_t get_frame_length(struct lwan_request *request, uint16_t header)
     }
 }
 
-static void unmask(char *msg, size_t msg_len, char mask[static 4])
+static ALWAYS_INLINE void
+unmask_words(char *msg, size_t msg_len, const char mask[static 4])
 {
-    uint32_t mask32;
-
-    /* TODO: handle alignment of `msg` to use (at least) NT loads
-     *       as we're rewriting msg anyway.  (NT writes aren't that
-     *       useful as the unmasked value will be used right after.) */
-
-#if defined(__AVX2__)
-    if (msg_len >= 32) {
-        const __m256i mask256 =
-            _mm256_castps_si256(_mm256_broadcast_ss((const float *)mask));
-        do {
-            const __m256i v = _mm256_lddqu_si256((const __m256i *)msg);
-            _mm256_storeu_si256((__m256i *)msg, _mm256_xor_si256(v, mask256));
-            msg += 32;
-            msg_len -= 32;
-        } while (msg_len >= 32);
-
-        if (msg_len >= 16) {
-            const __m128i mask128 = _mm256_extracti128_si256(mask256, 0);
-            const __m128i v = _mm_lddqu_si128((const __m128i *)msg);
-            _mm_storeu_si128((__m128i *)msg, _mm_xor_si128(v, mask128));
-            msg += 16;
-            msg_len -= 16;
-        }
-
-        mask32 = (uint32_t)_mm256_extract_epi32(mask256, 0);
-    } else {
-        mask32 = string_as_uint32(mask);
-    }
-#elif defined(__SSE3__)
-    if (msg_len >= 16) {
-        const __m128i mask128 =
-            _mm_castps_si128(_mm_load_ps1((const float *)mask));
-
-        do {
-            const __m128i v = _mm_lddqu_si128((const __m128i *)msg);
-            _mm_storeu_si128((__m128i *)msg, _mm_xor_si128(v, mask128));
-            msg += 16;
-            msg_len -= 16;
-        } while (msg_len >= 16);
-
-        mask32 = _mm_extract_epi32(mask128, 0);
-    } else {
-        mask32 = string_as_uint32(mask);
-    }
-#else
-    mask32 = string_as_uint32(mask);
-#endif
+    const uint32_t mask32 = string_as_uint32(mask);
 
 #if __SIZEOF_POINTER__ == 8
     if (msg_len >= 8) {
@@ -268,11 +579,201 @@ static void unmask(char *msg, size_t msg_len, char mask[static 4])
     case 1:
         msg[0] ^= mask[0];
         break;
+    case 0:
+        break;
     default:
         __builtin_unreachable();
     }
 }
 
+/* All the vectorized versions process whole blocks, which are multiples of
+ * the mask length, and leave the rest to unmask_words(). */
+#if defined(__x86_64__)
+static void unmask_sse2(char *msg, size_t msg_len, const char mask[static 4])
+{
+    if (msg_len >= 16) {
+        const __m128i mask128 = _mm_set1_epi32((int)string_as_uint32(mask));
+
+        do {
+            const __m128i v = _mm_loadu_si128((const __m128i *)msg);
+            _mm_storeu_si128((__m128i *)msg, _mm_xor_si128(v, mask128));
+            msg += 16;
+            msg_len -= 16;
+        } while (msg_len >= 16);
+    }
+
+    unmask_words(msg, msg_len, mask);
+}
+
+#if defined(LWAN_HAVE_BUILTIN_CPU_INIT)
+__attribute__((target("avx2"))) static void
+unmask_avx2(char *msg, size_t msg_len, const char mask[static 4])
+{
+    if (msg_len >= 32) {
+        const __m256i mask256 =
+            _mm256_set1_epi32((int)string_as_uint32(mask));
+
+        do {
+            const __m256i v = _mm256_loadu_si256((const __m256i *)msg);
+            _mm256_storeu_si256((__m256i *)msg, _mm256_xor_si256(v, mask256));
+            msg += 32;
+            msg_len -= 32;
+        } while (msg_len >= 32);
+    }
+
+    unmask_sse2(msg, msg_len, mask);
+}
+#endif
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+static void unmask_neon(char *msg, size_t msg_len, const char mask[static 4])
+{
+    if (msg_len >= 16) {
+        const uint8x16_t mask128 =
+            vreinterpretq_u8_u32(vdupq_n_u32(string_as_uint32(mask)));
+
+        do {
+            const uint8x16_t v = vld1q_u8((const uint8_t *)msg);
+            vst1q_u8((uint8_t *)msg, veorq_u8(v, mask128));
+            msg += 16;
+            msg_len -= 16;
+        } while (msg_len >= 16);
+    }
+
+    unmask_words(msg, msg_len, mask);
+}
+#else
+static void unmask_portable(char *msg, size_t msg_len, const char mask[static 4])
+{
+    unmask_words(msg, msg_len, mask);
+}
+#endif
+
+static void (*unmask)(char *msg, size_t msg_len, const char mask[static 4]) =
+#if defined(__x86_64__)
+    unmask_sse2;
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+    unmask_neon;
+#else
+    unmask_portable;
+#endif
+
+#if defined(__x86_64__) && defined(LWAN_HAVE_BUILTIN_CPU_INIT)
+__attribute__((constructor)) static void select_unmask_routine(void)
+{
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        unmask = unmask_avx2;
+}
+#endif
+
+/* Reads @msg_len bytes of the payload of a frame, starting at @offset,
+ * unmasking them as they arrive rather than in a separate pass once all of
+ * it has been read, so they're still in the cache when they're unmasked.
+ * The masking key is read along with the payload if @read_mask is set.  */
+static void read_and_unmask(struct lwan_request *request,
+                            char *msg,
+                            size_t msg_len,
+                            char mask[static 4],
+                            size_t offset,
+                            bool read_mask)
+{
+    const size_t mask_len = read_mask ? 4 : 0;
+    const size_t total = mask_len + msg_len;
+    size_t received = 0;
+    size_t unmasked = 0;
+
+    while (received < total) {
+        struct iovec vec[2];
+        int n_vec = 0;
+
+        if (received < mask_len) {
+            vec[n_vec++] = (struct iovec){.iov_base = mask + received,
+                                          .iov_len = mask_len - received};
+            vec[n_vec++] = (struct iovec){.iov_base = msg, .iov_len = msg_len};
+        } else {
+            const size_t msg_offset = received - mask_len;
+            vec[n_vec++] = (struct iovec){.iov_base = msg + msg_offset,
+                                          .iov_len = msg_len - msg_offset};
+        }
+
+        ssize_t r = lwan_readv_some_fd(request, request->fd, vec, n_vec);
+        if (UNLIKELY(r <= 0)) {
+            coro_yield(request->conn->coro, CONN_CORO_ABORT);
+            __builtin_unreachable();
+        }
+        received += (size_t)r;
+
+        if (received > mask_len) {
+            const size_t available = received - mask_len;
+            char rotated_mask[4];
+
+            /* The mask is applied from the start of the payload, so rotate
+             * it if this chunk doesn't start at a multiple of 4 bytes. */
+            for (size_t i = 0; i < 4; i++)
+                rotated_mask[i] = mask[(offset + unmasked + i) % 4];
+
+            unmask(msg + unmasked, available - unmasked, rotated_mask);
+            unmasked = available;
+        }
+    }
+}
+
+/* Payload of keep-alive pings: when they were sent, so that the round-trip
+ * time can be worked out from the pongs echoing them, without keeping
+ * anything per connection.  The time is scrambled with a key that's the
+ * same for every thread, as idle connections can be migrated, so that the
+ * uptime isn't disclosed.  */
+static uint64_t ws_ping_key;
+
+static uint64_t ping_key(void)
+{
+    uint64_t key = ATOMIC_READ(ws_ping_key);
+
+    if (UNLIKELY(!key)) {
+        const uint64_t new_key = lwan_random_uint64() | 1;
+
+        if (__atomic_compare_exchange_n(&ws_ping_key, &key, new_key, false,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+            key = new_key;
+    }
+
+    return key;
+}
+
+static uint64_t ping_timestamp_ns(void)
+{
+    struct timespec now;
+
+    if (UNLIKELY(clock_gettime(CLOCK_MONOTONIC, &now) < 0))
+        return 0;
+
+    return (uint64_t)now.tv_sec * 1000000000ull + (uint64_t)now.tv_nsec;
+}
+
+static void record_pong(struct lwan_request *request, const char *payload)
+{
+    const uint64_t now = ping_timestamp_ns();
+    uint64_t sent;
+
+    memcpy(&sent, payload, sizeof(sent));
+    sent ^= ping_key();
+
+    /* Unsolicited pongs, or pongs to pings sent by another process
+     * (e.g. before an upgrade), yield nonsense */
+    if (UNLIKELY(!sent || sent > now || now - sent > 60000000000ull))
+        return;
+
+    request->helper->ws_pong_rtt_us = (uint32_t)((now - sent) / 1000);
+    request->conn->thread->stats.ws_pongs++;
+    request->conn->thread->stats.ws_pong_rtt_us +=
+        request->helper->ws_pong_rtt_us;
+}
+
+unsigned int lwan_request_websocket_get_rtt(const struct lwan_request *request)
+{
+    return request->helper->ws_pong_rtt_us;
+}
+
 static void
 ping_pong(struct lwan_request *request, uint16_t header, enum ws_opcode opcode)
 {
@@ -297,24 +798,18 @@ ping_pong(struct lwan_request *request, uint16_t header, enum ws_opcode opcode)
     } else {
         /* From MDN: "You might also get a pong without ever sending a ping;
          * ignore this if it happens." */
+        lwan_recv(request, msg, len + 4, 0);
 
-        /* FIXME: should we care about the contents of PONG packets? */
-        lwan_recv(request, msg, len + 4, MSG_TRUNC);
+        if (len == sizeof(uint64_t)) {
+            unmask(msg + 4, len, msg);
+            record_pong(request, msg + 4);
+        }
     }
 }
 
 bool lwan_send_websocket_ping_for_tq(struct lwan_connection *conn)
 {
-    uint32_t mask32 = (uint32_t)lwan_random_uint64();
-    char mask[sizeof(mask32)];
-    struct timespec payload;
-
-    memcpy(mask, &mask32, sizeof(mask32));
-
-    if (UNLIKELY(clock_gettime(monotonic_clock_id, &payload) < 0))
-        return false;
-
-    unmask((char *)&payload, sizeof(payload), mask);
+    uint64_t payload = ping_timestamp_ns() ^ ping_key();
 
     /* use_coro is set to false here because this function is called outside
      * a connection coroutine and the I/O wrappers might yield, which of course
@@ -327,37 +822,298 @@ bool lwan_send_websocket_ping_for_tq(struct lwan_connection *conn)
                                       (char *)&payload, sizeof(payload), false);
 }
 
-int lwan_response_websocket_read_hint(struct lwan_request *request,
-                                      size_t size_hint)
+/* Inflates the first @len bytes of ws->scratch, appending the result to the
+ * response buffer.  The empty block stripped by the sender is put back at
+ * the end of the message, when @last is set. */
+static void inflate_scratch(struct lwan_request *request,
+                            struct lwan_websocket_deflate *ws,
+                            size_t len,
+                            bool last)
 {
-    enum ws_opcode opcode = WS_OPCODE_INVALID;
-    enum ws_opcode last_opcode;
-    uint16_t header;
-    bool continuation = false;
+    struct lwan_strbuf *buffer = request->response.buffer;
+    z_stream *stream = &ws->inflater;
 
-    if (!(request->conn->flags & CONN_IS_WEBSOCKET))
-        return ENOTCONN;
+    if (!ws->inflater_ready) {
+        if (UNLIKELY(inflateInit2(stream, -ws->client_window_bits) != Z_OK))
+            abort_connection(request);
+        ws->inflater_ready = true;
+    }
 
-    lwan_strbuf_reset_trim(request->response.buffer, size_hint);
+    if (UNLIKELY(len > UINT_MAX - 4 ||
+                 !ensure_scratch(ws, len + 4 + WS_INFLATE_CHUNK_SIZE)))
+        abort_connection(request);
+    if (last) {
+        memcpy(ws->scratch + len, "\0\0\xff\xff", 4);
+        len += 4;
+    }
+
+    char *chunk = ws->scratch + len;
+    stream->next_in = (Bytef *)ws->scratch;
+    stream->avail_in = (uInt)len;
+    do {
+        stream->next_out = (Bytef *)chunk;
+        stream->avail_out = WS_INFLATE_CHUNK_SIZE;
+
+        int ret = inflate(stream, Z_SYNC_FLUSH);
+        if (ret == Z_STREAM_END) {
+            /* Sender finished the deflate stream with this message */
+            inflateReset(stream);
+        } else if (UNLIKELY(ret != Z_OK && ret != Z_BUF_ERROR)) {
+            lwan_status_debug("Could not inflate message, aborting");
+            abort_connection(request);
+        }
+
+        const size_t inflated = WS_INFLATE_CHUNK_SIZE - stream->avail_out;
+        if (UNLIKELY(lwan_strbuf_get_length(buffer) + inflated >
+                     WS_INFLATE_MAX_LENGTH)) {
+            lwan_status_debug("Inflated message is too large, aborting");
+            abort_connection(request);
+        }
+        if (UNLIKELY(!lwan_strbuf_append_str(buffer, chunk, inflated)))
+            abort_connection(request);
+
+        if (ret == Z_STREAM_END)
+            break;
+    } while (stream->avail_out == 0);
+}
+
+static void inflate_message(struct lwan_request *request,
+                            struct lwan_websocket_deflate *ws)
+{
+    struct lwan_strbuf *buffer = request->response.buffer;
+    const size_t len = lwan_strbuf_get_length(buffer);
+
+    /* Move the compressed message to the scratch buffer, so that it can be
+     * inflated straight back into the response buffer. */
+    if (UNLIKELY(!ensure_scratch(ws, len)))
+        abort_connection(request);
+    memcpy(ws->scratch, lwan_strbuf_get_buffer(buffer), len);
+    lwan_strbuf_reset(buffer);
+
+    inflate_scratch(request, ws, len, true);
+}
+
+static void free_websocket_deflate(void *data)
+{
+    struct lwan_websocket_deflate *ws = data;
+
+    if (ws->deflater_ready)
+        deflateEnd(&ws->deflater);
+    if (ws->inflater_ready)
+        inflateEnd(&ws->inflater);
+    free(ws->scratch);
+}
+
+static struct lwan_value trim_value(const char *start, const char *end)
+{
+    while (start < end && lwan_char_isspace(*start))
+        start++;
+    while (end > start && lwan_char_isspace(end[-1]))
+        end--;
+
+    return (struct lwan_value){.value = (char *)start,
+                               .len = (size_t)(end - start)};
+}
+
+static bool value_eq(const struct lwan_value *value, const char *str)
+{
+    const size_t len = strlen(str);
+
+    return value->len == len && !strncasecmp(value->value, str, len);
+}
+
+static bool parse_window_bits(struct lwan_value value, int *bits)
+{
+    if (value.len >= 2 && value.value[0] == '"' &&
+        value.value[value.len - 1] == '"') {
+        value.value++;
+        value.len -= 2;
+    }
+
+    if (value.len == 1 && value.value[0] >= '8' && value.value[0] <= '9') {
+        *bits = value.value[0] - '0';
+        return true;
+    }
+    if (value.len == 2 && value.value[0] == '1' && value.value[1] >= '0' &&
+        value.value[1] <= '5') {
+        *bits = 10 + value.value[1] - '0';
+        return true;
+    }
+
+    return false;
+}
+
+struct deflate_offer {
+    int server_max_window_bits; /* 0 if not present */
+    int client_max_window_bits; /* 0 if not present, -1 if without value */
+    bool server_no_context_takeover;
+    bool client_no_context_takeover;
+};
 
-next_frame:
-    last_opcode = opcode;
+static bool
+parse_deflate_offer(const char *start, const char *end, struct deflate_offer *offer)
+{
+    bool first = true;
+
+    *offer = (struct deflate_offer){};
+
+    for (const char *p = start; p <= end;) {
+        const char *semicolon = memchr(p, ';', (size_t)(end - p));
+        if (!semicolon)
+            semicolon = end;
+
+        struct lwan_value param = trim_value(p, semicolon);
+        p = semicolon + 1;
+
+        if (first) {
+            if (!value_eq(&param, "permessage-deflate"))
+                return false;
+            first = false;
+            continue;
+        }
+
+        const char *equals = memchr(param.value, '=', param.len);
+        struct lwan_value name =
+            equals ? trim_value(param.value, equals) : param;
+        struct lwan_value value =
+            equals ? trim_value(equals + 1, param.value + param.len)
+                   : (struct lwan_value){};
+
+        /* Unknown or repeated parameters make the offer invalid (RFC7692
+         * section 7) */
+        if (value_eq(&name, "server_no_context_takeover")) {
+            if (equals || offer->server_no_context_takeover)
+                return false;
+            offer->server_no_context_takeover = true;
+        } else if (value_eq(&name, "client_no_context_takeover")) {
+            if (equals || offer->client_no_context_takeover)
+                return false;
+            offer->client_no_context_takeover = true;
+        } else if (value_eq(&name, "server_max_window_bits")) {
+            if (offer->server_max_window_bits)
+                return false;
+            if (!parse_window_bits(value, &offer->server_max_window_bits))
+                return false;
+        } else if (value_eq(&name, "client_max_window_bits")) {
+            if (offer->client_max_window_bits)
+                return false;
+            if (!equals)
+                offer->client_max_window_bits = -1;
+            else if (!parse_window_bits(value, &offer->client_max_window_bits))
+                return false;
+        } else {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+bool lwan_websocket_negotiate_deflate(
+    struct lwan_request *request,
+    const struct lwan_websocket_options *options,
+    char *response,
+    size_t response_len)
+{
+    const char *extensions =
+        lwan_request_get_header(request, "Sec-WebSocket-Extensions");
+    struct deflate_offer offer;
+
+    if (!extensions)
+        return false;
+
+    int window_bits = (int)options->window_bits;
+    if (!window_bits)
+        window_bits = WS_DEFLATE_DEFAULT_WINDOW_BITS;
+    else
+        window_bits = LWAN_MIN(LWAN_MAX(window_bits, 9), MAX_WBITS);
+
+    /* Offers are in order of preference; pick the first one we can accept */
+    for (const char *p = extensions; *p;) {
+        const char *comma = strchrnul(p, ',');
+        bool accepted = parse_deflate_offer(p, comma, &offer);
+
+        p = *comma ? comma + 1 : comma;
+
+        /* zlib can't produce raw deflate streams with a 256-byte window */
+        if (accepted && offer.server_max_window_bits == 8)
+            accepted = false;
+        if (!accepted)
+            continue;
+
+        struct lwan_websocket_deflate *ws =
+            coro_malloc_full(request->conn->coro, sizeof(*ws),
+                             free_websocket_deflate);
+        if (UNLIKELY(!ws))
+            return false;
+
+        *ws = (struct lwan_websocket_deflate){
+            .window_bits = window_bits,
+            .max_server_window_bits = MAX_WBITS,
+            .client_window_bits = MAX_WBITS,
+            .no_context_takeover = options->no_context_takeover ||
+                                   offer.server_no_context_takeover,
+        };
+
+        int written = snprintf(
+            response, response_len, "permessage-deflate%s%s",
+            ws->no_context_takeover ? "; server_no_context_takeover" : "",
+            offer.client_no_context_takeover ? "; client_no_context_takeover"
+                                             : "");
+        if (offer.server_max_window_bits) {
+            ws->max_server_window_bits = offer.server_max_window_bits;
+            ws->window_bits = LWAN_MIN(window_bits, offer.server_max_window_bits);
+            written += snprintf(response + written, response_len - (size_t)written,
+                                "; server_max_window_bits=%d",
+                                offer.server_max_window_bits);
+        }
+        if (offer.client_max_window_bits) {
+            /* The client lets us pick the size of its window, so keep it
+             * (and thus the memory used to inflate its messages) small. */
+            int client_bits = offer.client_max_window_bits < 0
+                                  ? window_bits
+                                  : LWAN_MIN(window_bits,
+                                             offer.client_max_window_bits);
+            ws->client_window_bits = LWAN_MAX(client_bits, 9);
+            written += snprintf(response + written, response_len - (size_t)written,
+                                "; client_max_window_bits=%d", client_bits);
+        }
+        if (UNLIKELY((size_t)written >= response_len))
+            return false;
+
+        request->helper->ws_deflate = ws;
+        return true;
+    }
+
+    return false;
+}
+
+struct frame_info {
+    enum ws_opcode opcode;
+    size_t len;
+    bool fin;
+    bool compressed;
+};
 
+/* Reads the header of the next data frame, handling control frames that
+ * might come before it.  Only the first frame of a message can be missing:
+ * once part of a fragmented message has been read, wait for the rest of
+ * it.  */
+static int read_frame_header(struct lwan_request *request,
+                             bool in_message,
+                             struct frame_info *frame)
+{
+    enum ws_opcode opcode;
+    uint16_t header;
+
+next_frame:;
     ssize_t r = lwan_recv(request, &header, sizeof(header),
-                      MSG_DONTWAIT | MSG_NOSIGNAL);
-    if (r < 0) {
+                          in_message ? MSG_NOSIGNAL
+                                     : MSG_DONTWAIT | MSG_NOSIGNAL);
+    if (r < 0)
         return (int)-r;
-    }
     header = htons(header);
-    continuation = false;
 
-    if (UNLIKELY(header & 0x7000)) {
-        lwan_status_debug("RSV1...RSV3 has non-zero value %d, aborting",
-                          header & 0x7000);
-        /* No extensions are supported yet, so fail connection per RFC6455. */
-        coro_yield(request->conn->coro, CONN_CORO_ABORT);
-        __builtin_unreachable();
-    }
     if (UNLIKELY(!(header & WS_MASKED))) {
         lwan_status_debug("Client sent an unmasked WebSockets frame, aborting");
         coro_yield(request->conn->coro, CONN_CORO_ABORT);
@@ -365,19 +1121,41 @@ next_frame:
     }
 
     opcode = (header & 0x0f00) >> 8;
+
+    *frame = (struct frame_info){.opcode = opcode, .fin = header & 0x8000};
+
+    if (UNLIKELY(header & 0x7000)) {
+        /* RSV1 is used by permessage-deflate to mark the first frame of
+         * compressed messages; anything else fails the connection per
+         * RFC6455. */
+        if ((header & 0x7000) != (WS_RSV1 << 8) ||
+            !request->helper->ws_deflate ||
+            (opcode != WS_OPCODE_TEXT && opcode != WS_OPCODE_BINARY)) {
+            lwan_status_debug("RSV1...RSV3 has unexpected value %d, aborting",
+                              header & 0x7000);
+            coro_yield(request->conn->coro, CONN_CORO_ABORT);
+            __builtin_unreachable();
+        }
+
+        frame->compressed = true;
+    }
+
     switch (opcode) {
     case WS_OPCODE_CONTINUATION:
-        if (UNLIKELY(last_opcode > WS_OPCODE_BINARY)) {
+        if (UNLIKELY(!in_message)) {
             /* Continuation frames are only available for opcodes [0..2] */
             coro_yield(request->conn->coro, CONN_CORO_ABORT);
             __builtin_unreachable();
         }
-
-        continuation = true;
         break;
 
     case WS_OPCODE_TEXT:
     case WS_OPCODE_BINARY:
+        if (UNLIKELY(in_message)) {
+            /* Fragments of different messages can't be interleaved */
+            coro_yield(request->conn->coro, CONN_CORO_ABORT);
+            __builtin_unreachable();
+        }
         break;
 
     case WS_OPCODE_CLOSE:
@@ -386,6 +1164,8 @@ next_frame:
 
     case WS_OPCODE_PONG:
     case WS_OPCODE_PING:
+        /* Control frames can be interleaved with the fragments of a
+         * message. */
         ping_pong(request, header, opcode);
         goto next_frame;
 
@@ -398,25 +1178,139 @@ next_frame:
         __builtin_unreachable();
     }
 
-    size_t frame_len = get_frame_length(request, header);
-    char *msg = lwan_strbuf_extend_unsafe(request->response.buffer, frame_len);
-    if (UNLIKELY(!msg)) {
-        coro_yield(request->conn->coro, CONN_CORO_ABORT);
-        __builtin_unreachable();
+    frame->len = get_frame_length(request, header);
+    return 0;
+}
+
+int lwan_response_websocket_read_hint(struct lwan_request *request,
+                                      size_t size_hint)
+{
+    struct frame_info frame;
+    bool in_message = false;
+    bool compressed = false;
+
+    if (!(request->conn->flags & CONN_IS_WEBSOCKET))
+        return ENOTCONN;
+
+    lwan_strbuf_reset_trim(request->response.buffer, size_hint);
+
+    while (true) {
+        int r = read_frame_header(request, in_message, &frame);
+        if (r)
+            return r;
+
+        if (!in_message)
+            compressed = frame.compressed;
+
+        char *msg =
+            lwan_strbuf_extend_unsafe(request->response.buffer, frame.len);
+        if (UNLIKELY(!msg)) {
+            coro_yield(request->conn->coro, CONN_CORO_ABORT);
+            __builtin_unreachable();
+        }
+
+        char mask[4];
+        read_and_unmask(request, msg, frame.len, mask, 0, true);
+
+        if (frame.fin || frame.opcode == WS_OPCODE_CLOSE)
+            break;
+
+        in_message = true;
     }
 
-    char mask[4];
-    struct iovec vec[] = {
-        {.iov_base = mask, .iov_len = sizeof(mask)},
-        {.iov_base = msg, .iov_len = frame_len},
-    };
-    lwan_readv(request, vec, N_ELEMENTS(vec));
-    unmask(msg, frame_len, mask);
+    if (!(request->conn->flags & CONN_IS_WEBSOCKET))
+        return ECONNRESET;
 
-    if (continuation && !(header & 0x8000))
-        goto next_frame;
+    if (compressed)
+        inflate_message(request, request->helper->ws_deflate);
+
+    return 0;
+}
+
+int lwan_response_websocket_read_partial(struct lwan_request *request,
+                                         size_t max_len,
+                                         bool *last)
+{
+    struct lwan_request_parser_helper *helper = request->helper;
+    struct lwan_request_streams *streams;
+    struct lwan_strbuf *buffer = request->response.buffer;
+
+    if (!(request->conn->flags & CONN_IS_WEBSOCKET))
+        return ENOTCONN;
+    if (UNLIKELY(!max_len))
+        return EINVAL;
+
+    streams = lwan_request_get_streams(request);
+    if (UNLIKELY(!streams))
+        return ENOMEM;
+
+    lwan_strbuf_reset_trim(buffer, max_len);
+
+    if (!streams->websocket.in_frame) {
+        struct frame_info frame;
+        int r = read_frame_header(request, streams->websocket.reading, &frame);
+        if (r)
+            return r;
+
+        if (frame.opcode == WS_OPCODE_CLOSE) {
+            /* Control frames have at most 125 bytes, but that's checked by
+             * get_frame_length() only for PING and PONG frames */
+            if (UNLIKELY(frame.len > 125))
+                abort_connection(request);
+
+            char mask[4];
+            char *msg = lwan_strbuf_extend_unsafe(buffer, frame.len);
+            if (UNLIKELY(!msg))
+                abort_connection(request);
+            read_and_unmask(request, msg, frame.len, mask, 0, true);
+
+            streams->websocket.reading = false;
+            return ECONNRESET;
+        }
+
+        if (!streams->websocket.reading) {
+            streams->websocket.reading = true;
+            streams->websocket.read_compressed = frame.compressed;
+        }
+
+        lwan_recv(request, streams->websocket.mask, 4, 0);
+        streams->websocket.in_frame = true;
+        streams->websocket.last_frame = frame.fin;
+        streams->websocket.frame_remaining = frame.len;
+        streams->websocket.frame_offset = 0;
+    }
+
+    const size_t len =
+        LWAN_MIN(max_len, (size_t)streams->websocket.frame_remaining);
+    const bool last_piece =
+        streams->websocket.last_frame && len == streams->websocket.frame_remaining;
+
+    if (streams->websocket.read_compressed) {
+        struct lwan_websocket_deflate *ws = helper->ws_deflate;
+
+        if (UNLIKELY(!ensure_scratch(ws, len)))
+            abort_connection(request);
+        read_and_unmask(request, ws->scratch, len, streams->websocket.mask,
+                        streams->websocket.frame_offset, false);
+        inflate_scratch(request, ws, len, last_piece);
+    } else {
+        char *msg = lwan_strbuf_extend_unsafe(buffer, len);
+        if (UNLIKELY(!msg))
+            abort_connection(request);
+        read_and_unmask(request, msg, len, streams->websocket.mask,
+                        streams->websocket.frame_offset, false);
+    }
+
+    streams->websocket.frame_remaining -= len;
+    streams->websocket.frame_offset += len;
+    if (!streams->websocket.frame_remaining) {
+        streams->websocket.in_frame = false;
+        if (streams->websocket.last_frame)
+            streams->websocket.reading = false;
+    }
 
-    return (request->conn->flags & CONN_IS_WEBSOCKET) ? 0 : ECONNRESET;
+    *last = last_piece;
+    return 0;
 }
 
 inline int lwan_response_websocket_read(struct lwan_request *request)
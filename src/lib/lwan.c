@@ -26,9 +26,11 @@
 #include <fcntl.h>
 #include <libproc.h>
 #include <limits.h>
+#include <pthread.h>
 #include <signal.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <sys/resource.h>
 #include <sys/socket.h>
 #include <sys/types.h>
@@ -36,6 +38,7 @@
 
 #include "lwan-private.h"
 
+#include "lwan-cache.h"
 #include "lwan-config.h"
 #include "lwan-http-authorize.h"
 
@@ -54,10 +57,31 @@ clockid_t monotonic_clock_id = CLOCK_MONOTONIC;
 
 static const struct lwan_config default_config = {
     .listener = "localhost:8080",
+    .listener_options = {
+        .defer_accept = -1,
+        .fastopen_queue = 5,
+        .steer_by_cpu = true,
+        .notsent_lowat = 128 * 1024,
+    },
+    .tls_listener_options = {
+        .defer_accept = -1,
+        .fastopen_queue = 5,
+        .steer_by_cpu = true,
+        .notsent_lowat = 128 * 1024,
+    },
     .keep_alive_timeout = 15,
+    .time_slice = 10,
+    .overload_latency_target = 0,
+    .overload_interval = 100,
+    .overload_max_coros = 0,
+    .busy_poll_time = 0,
+    .slow_request_threshold = 0,
+    .upgrade_drain_timeout = 60,
     .quiet = false,
     .proxy_protocol = false,
     .allow_cors = false,
+    .allow_http2 = false,
+    .compress_responses = false,
     .expires = 1 * ONE_WEEK,
     .n_threads = 0,
     .request_buffer_size = DEFAULT_BUFFER_SIZE,
@@ -66,6 +90,16 @@ static const struct lwan_config default_config = {
     .max_put_data_size = 10 * DEFAULT_BUFFER_SIZE,
     .allow_put_temp_file = false,
     .max_file_descriptors = 524288,
+    .io_uring = false,
+    .release_idle_coros = false,
+    .migrate_idle_conns = false,
+    .ssl = {
+        .session_tickets = true,
+        .session_cache = false,
+        .session_lifetime = 60 * 60,
+        .session_cache_size = 4096,
+        .handshake_threads = 0,
+    },
 };
 
 LWAN_HANDLER_ROUTE(brew_coffee, NULL /* do not autodetect this route */)
@@ -77,18 +111,26 @@ LWAN_HANDLER_ROUTE(brew_coffee, NULL /* do not autodetect this route */)
 }
 
 __attribute__((no_sanitize_address))
-static void *find_handler(const char *name)
+static const struct lwan_handler_info *find_handler(const char *name)
 {
     const struct lwan_handler_info *handler;
 
     LWAN_SECTION_FOREACH(lwan_handler, handler) {
         if (streq(handler->name, name))
-            return handler->handler;
+            return handler;
     }
 
     return NULL;
 }
 
+static enum lwan_handler_flags
+handler_flags(enum lwan_handler_flags flags)
+{
+    /* Handlers streaming the request body read it by themselves, so
+     * that's the only flag they can pick. */
+    return HANDLER_PARSE_MASK | (flags & HANDLER_STREAMS_BODY_DATA);
+}
+
 __attribute__((no_sanitize_address))
 static const struct lwan_module *find_module(const char *name)
 {
@@ -121,6 +163,55 @@ static void destroy_urlmap(void *data)
     free(url_map);
 }
 
+static struct lwan_trie *url_map_trie_new(void)
+{
+    struct lwan_trie *trie = malloc(sizeof(*trie));
+
+    if (UNLIKELY(!trie))
+        return NULL;
+
+    if (UNLIKELY(!lwan_trie_init(trie, destroy_urlmap))) {
+        free(trie);
+        return NULL;
+    }
+
+    return trie;
+}
+
+static void url_map_trie_free(struct lwan_trie *trie)
+{
+    if (trie) {
+        lwan_trie_destroy(trie);
+        free(trie);
+    }
+}
+
+/* Only URL maps that have been read from a configuration file can be
+ * reloaded; see reload_config_job(). */
+static struct {
+    char *config_path;
+
+    /* Previous URL map trie, and the parity of the epoch in which it was
+     * used, until pending requests are done with it */
+    struct lwan_trie *retired_trie;
+    unsigned int retired_epoch;
+    uint64_t access_log_mark;
+} url_maps;
+
+static volatile sig_atomic_t reload_requested;
+
+static void url_maps_config_path_set(const char *path)
+{
+    free(url_maps.config_path);
+    url_maps.config_path = NULL;
+
+    if (path) {
+        url_maps.config_path = realpath(path, NULL);
+        if (!url_maps.config_path)
+            url_maps.config_path = strdup(path);
+    }
+}
+
 static struct lwan_url_map *add_url_map(struct lwan_trie *t, const char *prefix,
                                         const struct lwan_url_map *map)
 {
@@ -136,6 +227,7 @@ static struct lwan_url_map *add_url_map(struct lwan_trie *t, const char *prefix,
         lwan_status_critical_perror("Could not copy URL prefix");
 
     copy->prefix_len = strlen(copy->prefix);
+    copy->latency_id = lwan_latency_url_map_id(copy->prefix);
     lwan_trie_add(t, copy->prefix, copy);
 
     return copy;
@@ -317,16 +409,195 @@ static const char *get_module_name(const struct lwan_module *module)
     return "<unknown>";
 }
 
+/* Module instances declared in a site section are only created after the
+ * whole section has been read: some of them take a while to initialize
+ * (serve_files might precache a directory, Lua and template-based modules
+ * compile their sources), and, as they don't depend on each other, they
+ * can be created in parallel by task threads. */
+struct pending_url_map {
+    struct lwan_url_map url_map;
+    struct hash *hash;
+    struct config *isolated;
+    char *prefix;
+    const char *error;
+};
+
+DEFINE_ARRAY_TYPE(pending_url_map_array, struct pending_url_map)
+
+struct pending_url_map_batch {
+    struct pending_url_map *maps;
+    size_t n_maps;
+    size_t next_map;
+    size_t done_maps;
+    unsigned int refs;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+};
+
+static void create_pending_url_map(struct pending_url_map *pending)
+{
+    const struct lwan_module *module = pending->url_map.module;
+
+    if (!module)
+        return;
+
+    lwan_status_debug("Initializing module %s from config",
+                      get_module_name(module));
+
+    pending->url_map.data =
+        module->create_from_hash(pending->prefix, pending->hash);
+    if (!pending->url_map.data) {
+        pending->error = "Could not create module instance";
+        return;
+    }
+
+    if (module->parse_conf &&
+        !module->parse_conf(pending->url_map.data, pending->isolated)) {
+        const char *msg = config_last_error(pending->isolated);
+
+        pending->error = msg ? msg : "Unknown error from module";
+    }
+}
+
+static void pending_url_map_batch_unref(struct pending_url_map_batch *batch)
+{
+    pthread_mutex_lock(&batch->mutex);
+    bool last = !--batch->refs;
+    pthread_mutex_unlock(&batch->mutex);
+
+    if (last) {
+        pthread_mutex_destroy(&batch->mutex);
+        pthread_cond_destroy(&batch->cond);
+        free(batch);
+    }
+}
+
+static void run_pending_url_map_batch(struct pending_url_map_batch *batch)
+{
+    while (true) {
+        size_t i = __atomic_fetch_add(&batch->next_map, 1, __ATOMIC_RELAXED);
+
+        if (i >= batch->n_maps)
+            break;
+
+        create_pending_url_map(&batch->maps[i]);
+
+        pthread_mutex_lock(&batch->mutex);
+        if (++batch->done_maps == batch->n_maps)
+            pthread_cond_signal(&batch->cond);
+        pthread_mutex_unlock(&batch->mutex);
+    }
+}
+
+static void pending_url_map_batch_task(void *data)
+{
+    struct pending_url_map_batch *batch = data;
+
+    run_pending_url_map_batch(batch);
+    pending_url_map_batch_unref(batch);
+}
+
+static void create_pending_url_maps(struct pending_url_map_array *pending)
+{
+    struct pending_url_map_batch *batch;
+    long n_tasks;
+
+    if (!pending->base.elements)
+        return;
+
+    batch = malloc(sizeof(*batch));
+    if (!batch)
+        lwan_status_critical_perror("Could not allocate URL map batch");
+
+    *batch = (struct pending_url_map_batch){
+        .maps = pending_url_map_array_get_array(pending),
+        .n_maps = pending->base.elements,
+        .refs = 1,
+    };
+    pthread_mutex_init(&batch->mutex, NULL);
+    pthread_cond_init(&batch->cond, NULL);
+
+    /* This thread creates instances too, so it doesn't have to wait for
+     * task threads if they're all busy, including when this is called from
+     * one of them while reloading the configuration.  Tasks that start
+     * after everything has been created will have nothing to do; they hold
+     * a reference to the batch so it's only freed after they're done with
+     * it. */
+    n_tasks = LWAN_MIN(sysconf(_SC_NPROCESSORS_ONLN),
+                       (long)batch->n_maps - 1);
+    for (long i = 0; i < n_tasks; i++) {
+        pthread_mutex_lock(&batch->mutex);
+        batch->refs++;
+        pthread_mutex_unlock(&batch->mutex);
+
+        if (!lwan_job_run_task(pending_url_map_batch_task, batch)) {
+            pending_url_map_batch_unref(batch);
+            break;
+        }
+    }
+
+    run_pending_url_map_batch(batch);
+
+    pthread_mutex_lock(&batch->mutex);
+    while (batch->done_maps < batch->n_maps)
+        pthread_cond_wait(&batch->cond, &batch->mutex);
+    pthread_mutex_unlock(&batch->mutex);
+
+    pending_url_map_batch_unref(batch);
+}
+
+static void discard_pending_url_map(struct pending_url_map *pending)
+{
+    struct lwan_url_map *url_map = &pending->url_map;
+
+    if (url_map->module) {
+        if (url_map->data && url_map->module->destroy)
+            url_map->module->destroy(url_map->data);
+    } else {
+        hash_unref(url_map->data);
+    }
+
+    free(url_map->authorization.realm);
+    free(url_map->authorization.password_file);
+}
+
+static void add_pending_url_maps(struct config *c,
+                                 struct lwan_trie *url_map_trie,
+                                 struct pending_url_map_array *pending,
+                                 bool created)
+{
+    struct pending_url_map *iter;
+
+    LWAN_ARRAY_FOREACH (pending, iter) {
+        if (!created) {
+            discard_pending_url_map(iter);
+        } else if (iter->error) {
+            config_error(c, "Could not initialize module for %s: %s",
+                         iter->prefix, iter->error);
+            discard_pending_url_map(iter);
+        } else {
+            add_url_map(url_map_trie, iter->prefix, &iter->url_map);
+        }
+
+        hash_unref(iter->hash);
+        config_close(iter->isolated);
+        free(iter->prefix);
+    }
+
+    pending_url_map_array_reset(pending);
+}
+
 static void parse_listener_prefix(struct config *c,
                                   const struct config_line *l,
-                                  struct lwan *lwan,
+                                  struct pending_url_map_array *pending_maps,
                                   const struct lwan_module *module,
-                                  void *handler)
+                                  const struct lwan_handler_info *handler)
 {
     struct lwan_url_map url_map = {};
     struct hash *hash = hash_str_new(free, free);
     char *prefix = strdupa(l->value);
     struct config *isolated;
+    struct pending_url_map *pending;
 
     if (!hash)
         lwan_status_critical("Could not allocate hash table");
@@ -372,30 +643,18 @@ static void parse_listener_prefix(struct config *c,
 add_map:
     assert((handler && !module) || (!handler && module));
 
+    url_map.deadline =
+        (unsigned int)LWAN_MAX(parse_long(hash_find(hash, "deadline"), 0), 0l);
+
     if (handler) {
-        url_map.handler = handler;
-        url_map.flags |= HANDLER_PARSE_MASK | HANDLER_DATA_IS_HASH_TABLE;
+        url_map.handler = handler->handler;
+        url_map.flags |=
+            handler_flags(handler->flags) | HANDLER_DATA_IS_HASH_TABLE;
         url_map.data = hash;
         url_map.module = NULL;
 
         hash = NULL;
     } else if (module->create_from_hash && module->handle_request) {
-        lwan_status_debug("Initializing module %s from config",
-                          get_module_name(module));
-
-        url_map.data = module->create_from_hash(prefix, hash);
-        if (!url_map.data) {
-            config_error(c, "Could not create module instance");
-            goto out;
-        }
-
-        if (module->parse_conf && !module->parse_conf(url_map.data, isolated)) {
-            const char *msg = config_last_error(isolated);
-
-            config_error(c, "Error from module: %s", msg ? msg : "Unknown");
-            goto out;
-        }
-
         url_map.handler = module->handle_request;
         url_map.flags |= module->flags;
         url_map.module = module;
@@ -408,7 +667,22 @@ add_map:
         goto out;
     }
 
-    add_url_map(&lwan->url_map_trie, prefix, &url_map);
+    pending = pending_url_map_array_append(pending_maps);
+    if (!pending)
+        lwan_status_critical("Could not allocate pending URL map");
+
+    *pending = (struct pending_url_map){
+        .url_map = url_map,
+        .hash = hash,
+        .isolated = isolated,
+        .prefix = strdup(prefix),
+    };
+    if (!pending->prefix)
+        lwan_status_critical_perror("Could not copy URL prefix");
+
+    /* Both are now owned by the pending URL map */
+    hash = NULL;
+    isolated = NULL;
 
 out:
     hash_unref(hash);
@@ -417,7 +691,7 @@ out:
 
 static void register_url_map(struct lwan *l, const struct lwan_url_map *map)
 {
-    struct lwan_url_map *copy = add_url_map(&l->url_map_trie, NULL, map);
+    struct lwan_url_map *copy = add_url_map(l->url_map_trie, NULL, map);
 
     if (copy->module && copy->module->create) {
         lwan_status_debug("Initializing module %s from struct",
@@ -432,15 +706,17 @@ static void register_url_map(struct lwan *l, const struct lwan_url_map *map)
         copy->flags = copy->module->flags;
         copy->handler = copy->module->handle_request;
     } else {
-        copy->flags = HANDLER_PARSE_MASK;
+        copy->flags = handler_flags(map->flags);
     }
 }
 
 void lwan_set_url_map(struct lwan *l, const struct lwan_url_map *map)
 {
-    lwan_trie_destroy(&l->url_map_trie);
-    if (UNLIKELY(!lwan_trie_init(&l->url_map_trie, destroy_urlmap)))
+    url_map_trie_free(l->url_map_trie);
+    l->url_map_trie = url_map_trie_new();
+    if (UNLIKELY(!l->url_map_trie))
         lwan_status_critical_perror("Could not initialize trie");
+    url_maps_config_path_set(NULL);
 
     for (; map->prefix; map++)
         register_url_map(l, map);
@@ -451,9 +727,11 @@ void lwan_detect_url_map(struct lwan *l)
 {
     const struct lwan_handler_info *iter;
 
-    lwan_trie_destroy(&l->url_map_trie);
-    if (UNLIKELY(!lwan_trie_init(&l->url_map_trie, destroy_urlmap)))
+    url_map_trie_free(l->url_map_trie);
+    l->url_map_trie = url_map_trie_new();
+    if (UNLIKELY(!l->url_map_trie))
         lwan_status_critical_perror("Could not initialize trie");
+    url_maps_config_path_set(NULL);
 
     LWAN_SECTION_FOREACH(lwan_handler, iter) {
         if (!iter->route)
@@ -464,7 +742,7 @@ void lwan_detect_url_map(struct lwan *l)
 
         const struct lwan_url_map map = {.prefix = iter->route,
                                          .handler = iter->handler,
-                                         .flags = HANDLER_PARSE_MASK};
+                                         .flags = iter->flags};
         register_url_map(l, &map);
     }
 }
@@ -489,6 +767,59 @@ out:
     return "lwan.conf";
 }
 
+static bool parse_listener_option(struct config *c,
+                                  const struct config_line *l,
+                                  struct lwan_listener_options *options)
+{
+    if (streq(l->key, "backlog")) {
+        long backlog = parse_long(l->value, 0);
+
+        if (backlog < 0 || backlog > INT_MAX)
+            config_error(c, "Invalid backlog: %ld", backlog);
+        else
+            options->backlog = (unsigned int)backlog;
+    } else if (streq(l->key, "defer_accept")) {
+        options->defer_accept = (int)LWAN_MIN(
+            parse_time_period(l->value, 0), (unsigned int)INT_MAX);
+    } else if (streq(l->key, "fastopen_queue")) {
+        long queue = parse_long(l->value,
+                                default_config.listener_options.fastopen_queue);
+
+        if (queue < 0 || queue > 65535)
+            config_error(c, "Invalid TCP Fast Open queue length: %ld", queue);
+        else
+            options->fastopen_queue = (unsigned int)queue;
+    } else if (streq(l->key, "steer_by_cpu")) {
+        options->steer_by_cpu = parse_bool(
+            l->value, default_config.listener_options.steer_by_cpu);
+    } else if (streq(l->key, "steer_by_napi_id")) {
+        options->steer_by_napi_id = parse_bool(
+            l->value, default_config.listener_options.steer_by_napi_id);
+    } else if (streq(l->key, "busy_poll")) {
+        long usec = parse_long(l->value, 0);
+
+        if (usec < 0 || usec > INT_MAX)
+            config_error(c, "Invalid busy polling timeout: %ld", usec);
+        else
+            options->busy_poll = (unsigned int)usec;
+    } else if (streq(l->key, "prefer_busy_poll")) {
+        options->prefer_busy_poll = parse_bool(
+            l->value, default_config.listener_options.prefer_busy_poll);
+    } else if (streq(l->key, "notsent_lowat")) {
+        long lowat = parse_long(
+            l->value, default_config.listener_options.notsent_lowat);
+
+        if (lowat < 0 || lowat > INT_MAX)
+            config_error(c, "Invalid unsent data low watermark: %ld", lowat);
+        else
+            options->notsent_lowat = (unsigned int)lowat;
+    } else {
+        return false;
+    }
+
+    return true;
+}
+
 static void parse_tls_listener(struct config *conf, const struct config_line *line, struct lwan *lwan)
 {
 #if !defined(LWAN_HAVE_MBEDTLS)
@@ -502,8 +833,7 @@ static void parse_tls_listener(struct config *conf, const struct config_line *li
         return;
     }
 
-    lwan->config.ssl.cert = NULL;
-    lwan->config.ssl.key = NULL;
+    lwan->config.ssl = default_config.ssl;
 
     while ((line = config_read_line(conf))) {
         switch (line->type) {
@@ -529,7 +859,32 @@ static void parse_tls_listener(struct config *conf, const struct config_line *li
                     return lwan_status_critical("Could not copy string");
             } else if (streq(line->key, "hsts")) {
                 lwan->config.ssl.send_hsts_header = parse_bool(line->value, false);
-            } else {
+            } else if (streq(line->key, "session_tickets")) {
+                lwan->config.ssl.session_tickets = parse_bool(
+                    line->value, default_config.ssl.session_tickets);
+            } else if (streq(line->key, "session_cache")) {
+                lwan->config.ssl.session_cache = parse_bool(
+                    line->value, default_config.ssl.session_cache);
+            } else if (streq(line->key, "session_lifetime")) {
+                lwan->config.ssl.session_lifetime = parse_time_period(
+                    line->value, default_config.ssl.session_lifetime);
+            } else if (streq(line->key, "session_cache_size")) {
+                long size = parse_long(line->value,
+                                       default_config.ssl.session_cache_size);
+                if (size <= 0 || size > 1 << 20)
+                    config_error(conf, "Invalid session cache size: %ld", size);
+                else
+                    lwan->config.ssl.session_cache_size = (unsigned int)size;
+            } else if (streq(line->key, "handshake_threads")) {
+                long n_threads = parse_long(
+                    line->value, default_config.ssl.handshake_threads);
+                if (n_threads < 0 || n_threads > 256)
+                    config_error(conf, "Invalid number of handshake threads: %ld",
+                                 n_threads);
+                else
+                    lwan->config.ssl.handshake_threads = (unsigned int)n_threads;
+            } else if (!parse_listener_option(
+                           conf, line, &lwan->config.tls_listener_options)) {
                 config_error(conf, "Unexpected key: %s", line->key);
             }
         }
@@ -538,31 +893,78 @@ static void parse_tls_listener(struct config *conf, const struct config_line *li
     config_error(conf, "Expecting section end while parsing SSL configuration");
 }
 
-static void
-parse_listener(struct config *c, const struct config_line *l, struct lwan *lwan)
+static void parse_listener(struct config *c,
+                           const struct config_line *l,
+                           struct lwan *lwan,
+                           bool *has_listener)
 {
-    lwan->config.listener = strdup(l->value);
-    if (!lwan->config.listener)
+    struct lwan_dedicated_listener listener = {
+        .address = strdup(l->value),
+        .options = default_config.listener_options,
+    };
+
+    if (!listener.address) {
         config_error(c, "Could not allocate memory for listener");
+        return;
+    }
 
     while ((l = config_read_line(c))) {
         switch (l->type) {
         case CONFIG_LINE_TYPE_LINE:
-            config_error(c, "Unexpected key %s", l->key);
-            return;
+            if (streq(l->key, "threads")) {
+                long n_threads = parse_long(l->value, 0);
+
+                if (n_threads <= 0 || n_threads > 256) {
+                    config_error(c, "Invalid number of threads: %ld",
+                                 n_threads);
+                    goto out;
+                }
+                listener.n_threads = (unsigned int)n_threads;
+            } else if (!parse_listener_option(c, l, &listener.options)) {
+                config_error(c, "Unexpected key %s", l->key);
+                goto out;
+            }
+            break;
         case CONFIG_LINE_TYPE_SECTION:
             config_error(c, "Unexpected section %s", l->key);
-            return;
+            goto out;
         case CONFIG_LINE_TYPE_SECTION_END:
+            if (!listener.n_threads) {
+                if (*has_listener) {
+                    config_error(c, "Listener already set up");
+                    goto out;
+                }
+
+                free(lwan->config.listener);
+                lwan->config.listener = listener.address;
+                lwan->config.listener_options = listener.options;
+                *has_listener = true;
+                return;
+            }
+
+            struct lwan_dedicated_listener *listeners =
+                realloc(lwan->config.dedicated_listeners,
+                        (lwan->config.n_dedicated_listeners + 1) *
+                            sizeof(*listeners));
+            if (!listeners) {
+                config_error(c, "Could not allocate memory for listener");
+                goto out;
+            }
+
+            listeners[lwan->config.n_dedicated_listeners++] = listener;
+            lwan->config.dedicated_listeners = listeners;
             return;
         }
     }
 
     config_error(c, "Unexpected EOF while parsing listener");
+out:
+    free(listener.address);
 }
 
-static void
-parse_site(struct config *c, const struct config_line *l, struct lwan *lwan)
+static void parse_site_prefixes(struct config *c,
+                                const struct config_line *l,
+                                struct pending_url_map_array *pending_maps)
 {
     while ((l = config_read_line(c))) {
         switch (l->type) {
@@ -573,9 +975,10 @@ parse_site(struct config *c, const struct config_line *l, struct lwan *lwan)
             /* FIXME: per-site authorization? */
 
             if (l->key[0] == '&') {
-                void *handler = find_handler(l->key + 1);
+                const struct lwan_handler_info *handler =
+                    find_handler(l->key + 1);
                 if (handler) {
-                    parse_listener_prefix(c, l, lwan, NULL, handler);
+                    parse_listener_prefix(c, l, pending_maps, NULL, handler);
                     continue;
                 }
 
@@ -585,7 +988,7 @@ parse_site(struct config *c, const struct config_line *l, struct lwan *lwan)
 
             const struct lwan_module *module = find_module(l->key);
             if (module) {
-                parse_listener_prefix(c, l, lwan, module, NULL);
+                parse_listener_prefix(c, l, pending_maps, module, NULL);
                 continue;
             }
 
@@ -599,6 +1002,23 @@ parse_site(struct config *c, const struct config_line *l, struct lwan *lwan)
     config_error(c, "Expecting section end while parsing listener");
 }
 
+static void parse_site(struct config *c,
+                       const struct config_line *l,
+                       struct lwan_trie *url_map_trie)
+{
+    struct pending_url_map_array pending_maps;
+    bool created = false;
+
+    pending_url_map_array_init(&pending_maps);
+
+    parse_site_prefixes(c, l, &pending_maps);
+    if (!config_last_error(c)) {
+        create_pending_url_maps(&pending_maps);
+        created = true;
+    }
+    add_pending_url_maps(c, url_map_trie, &pending_maps, created);
+}
+
 static bool setup_from_config(struct lwan *lwan, const char *path)
 {
     const struct config_line *line;
@@ -616,8 +1036,11 @@ static bool setup_from_config(struct lwan *lwan, const char *path)
     if (!conf)
         return false;
 
-    if (!lwan_trie_init(&lwan->url_map_trie, destroy_urlmap))
+    lwan->url_map_trie = url_map_trie_new();
+    if (!lwan->url_map_trie) {
+        config_close(conf);
         return false;
+    }
 
     while ((line = config_read_line(conf))) {
         switch (line->type) {
@@ -625,6 +1048,47 @@ static bool setup_from_config(struct lwan *lwan, const char *path)
             if (streq(line->key, "keep_alive_timeout")) {
                 lwan->config.keep_alive_timeout = (unsigned int)parse_long(
                     line->value, default_config.keep_alive_timeout);
+            } else if (streq(line->key, "time_slice")) {
+                long time_slice =
+                    parse_long(line->value, default_config.time_slice);
+                if (time_slice < 0)
+                    config_error(conf, "Invalid time slice: %ld", time_slice);
+                lwan->config.time_slice = (unsigned int)time_slice;
+            } else if (streq(line->key, "overload_latency_target")) {
+                long target = parse_long(
+                    line->value, default_config.overload_latency_target);
+                if (target < 0)
+                    config_error(conf, "Invalid overload latency target: %ld",
+                                 target);
+                lwan->config.overload_latency_target = (unsigned int)target;
+            } else if (streq(line->key, "overload_interval")) {
+                long interval =
+                    parse_long(line->value, default_config.overload_interval);
+                if (interval <= 0)
+                    config_error(conf, "Invalid overload interval: %ld",
+                                 interval);
+                lwan->config.overload_interval = (unsigned int)interval;
+            } else if (streq(line->key, "overload_max_coroutines")) {
+                long max_coros =
+                    parse_long(line->value, default_config.overload_max_coros);
+                if (max_coros < 0)
+                    config_error(conf, "Invalid maximum number of coroutines: "
+                                 "%ld",
+                                 max_coros);
+                lwan->config.overload_max_coros = (unsigned int)max_coros;
+            } else if (streq(line->key, "busy_poll_time")) {
+                long usecs =
+                    parse_long(line->value, default_config.busy_poll_time);
+                if (usecs < 0 || usecs > 1000000)
+                    config_error(conf, "Invalid busy poll time: %ld", usecs);
+                lwan->config.busy_poll_time = (unsigned int)usecs;
+            } else if (streq(line->key, "slow_request_threshold")) {
+                long msecs = parse_long(line->value,
+                                        default_config.slow_request_threshold);
+                if (msecs < 0)
+                    config_error(conf, "Invalid slow request threshold: %ld",
+                                 msecs);
+                lwan->config.slow_request_threshold = (unsigned int)msecs;
             } else if (streq(line->key, "quiet")) {
                 lwan->config.quiet =
                     parse_bool(line->value, default_config.quiet);
@@ -634,12 +1098,42 @@ static bool setup_from_config(struct lwan *lwan, const char *path)
             } else if (streq(line->key, "allow_cors")) {
                 lwan->config.allow_cors =
                     parse_bool(line->value, default_config.allow_cors);
+            } else if (streq(line->key, "allow_http2")) {
+                lwan->config.allow_http2 =
+                    parse_bool(line->value, default_config.allow_http2);
+            } else if (streq(line->key, "compress_responses")) {
+                lwan->config.compress_responses = parse_bool(
+                    line->value, default_config.compress_responses);
+            } else if (streq(line->key, "release_idle_coroutines")) {
+                lwan->config.release_idle_coros = parse_bool(
+                    line->value, default_config.release_idle_coros);
+            } else if (streq(line->key, "migrate_idle_connections")) {
+                lwan->config.migrate_idle_conns = parse_bool(
+                    line->value, default_config.migrate_idle_conns);
+            } else if (streq(line->key, "io_uring")) {
+                lwan->config.io_uring =
+                    parse_bool(line->value, default_config.io_uring);
+#if !defined(LWAN_HAVE_IO_URING)
+                if (lwan->config.io_uring) {
+                    lwan_status_warning("Lwan has been built without io_uring "
+                                        "support; using epoll instead");
+                }
+#endif
             } else if (streq(line->key, "expires")) {
                 lwan->config.expires =
                     parse_time_period(line->value, default_config.expires);
             } else if (streq(line->key, "error_template")) {
                 free(lwan->config.error_template);
                 lwan->config.error_template = strdup(line->value);
+            } else if (streq(line->key, "upgrade_socket")) {
+                free(lwan->config.upgrade_socket);
+                lwan->config.upgrade_socket = strdup(line->value);
+            } else if (streq(line->key, "hot_keys_file")) {
+                free(lwan->config.hot_keys_file);
+                lwan->config.hot_keys_file = strdup(line->value);
+            } else if (streq(line->key, "upgrade_drain_timeout")) {
+                lwan->config.upgrade_drain_timeout = parse_time_period(
+                    line->value, default_config.upgrade_drain_timeout);
             } else if (streq(line->key, "threads")) {
                 long n_threads =
                     parse_long(line->value, default_config.n_threads);
@@ -719,22 +1213,21 @@ static bool setup_from_config(struct lwan *lwan, const char *path)
         case CONFIG_LINE_TYPE_SECTION:
             if (streq(line->key, "site")) {
                 if (!has_site) {
-                    parse_site(conf, line, lwan);
+                    parse_site(conf, line, lwan->url_map_trie);
                     has_site = true;
                 } else {
                     config_error(conf, "Only one site may be configured");
                 }
+            } else if (streq(line->key, "access_log")) {
+                lwan_access_log_parse_config(conf);
+            } else if (streq(line->key, "tracing")) {
+                lwan_tracing_parse_config(conf);
             } else if (streq(line->key, "straitjacket")) {
                 lwan_straitjacket_enforce_from_config(conf);
             } else if (streq(line->key, "headers")) {
                 parse_global_headers(conf, lwan);
             } else if (streq(line->key, "listener")) {
-                if (has_listener) {
-                    config_error(conf, "Listener already set up");
-                } else {
-                    parse_listener(conf, line, lwan);
-                    has_listener = true;
-                }
+                parse_listener(conf, line, lwan, &has_listener);
             } else if (streq(line->key, "tls_listener")) {
                 if (has_tls_listener) {
                     config_error(conf, "TLS Listener already set up");
@@ -754,14 +1247,129 @@ static bool setup_from_config(struct lwan *lwan, const char *path)
     if (config_last_error(conf)) {
         lwan_status_critical("Error on config file \"%s\", line %d: %s", path,
                              config_cur_line(conf), config_last_error(conf));
-        lwan_trie_destroy(&lwan->url_map_trie);
+        url_map_trie_free(lwan->url_map_trie);
+        lwan->url_map_trie = NULL;
+    } else if (has_site) {
+        url_maps_config_path_set(path);
+    }
+
+    config_close(conf);
+
+    return true;
+}
+
+static struct lwan_trie *url_map_trie_from_config(const char *path)
+{
+    const struct config_line *line;
+    struct lwan_trie *trie;
+    struct config *conf;
+    bool has_site = false;
+
+    conf = config_open(path);
+    if (!conf) {
+        lwan_status_perror("Could not open config file: %s", path);
+        return NULL;
+    }
+
+    trie = url_map_trie_new();
+    if (!trie) {
+        config_close(conf);
+        return NULL;
+    }
+
+    /* Other settings are used while setting up threads, sockets, etc.,
+     * so they can't be changed without a restart. */
+    while ((line = config_read_line(conf))) {
+        switch (line->type) {
+        case CONFIG_LINE_TYPE_LINE:
+            break;
+        case CONFIG_LINE_TYPE_SECTION:
+            if (streq(line->key, "site") && !has_site) {
+                parse_site(conf, line, trie);
+                has_site = true;
+            } else if (!config_skip_section(conf, line)) {
+                config_error(conf, "Could not skip section");
+            }
+            break;
+        case CONFIG_LINE_TYPE_SECTION_END:
+            config_error(conf, "Unexpected section end");
+        }
+    }
+
+    if (config_last_error(conf)) {
+        lwan_status_error("Not reloading: error on config file \"%s\", line "
+                          "%d: %s",
+                          path, config_cur_line(conf), config_last_error(conf));
+        url_map_trie_free(trie);
+        trie = NULL;
+    } else if (!lwan_trie_compact(trie)) {
+        lwan_status_warning("Could not compact URL map; using it as is");
     }
 
     config_close(conf);
 
+    return trie;
+}
+
+static bool url_map_refs_drained(const struct lwan *l, unsigned int epoch)
+{
+    for (unsigned int i = 0; i < l->thread.count; i++) {
+        if (__atomic_load_n(&l->thread.threads[i].url_map_refs[epoch & 1],
+                            __ATOMIC_ACQUIRE))
+            return false;
+    }
+
+    return true;
+}
+
+static bool reload_config_job(void *data)
+{
+    struct lwan *l = data;
+    struct lwan_trie *trie;
+
+    if (url_maps.retired_trie) {
+        if (!url_map_refs_drained(l, url_maps.retired_epoch) ||
+            !lwan_access_log_caught_up(&url_maps.access_log_mark))
+            return false;
+
+        lwan_status_debug("Destroying URL maps from previous configuration");
+        url_map_trie_free(url_maps.retired_trie);
+        url_maps.retired_trie = NULL;
+        url_maps.access_log_mark = 0;
+
+        return true;
+    }
+
+    if (!reload_requested)
+        return false;
+    reload_requested = 0;
+
+    lwan_status_info("Reloading site from configuration file: %s",
+                     url_maps.config_path);
+
+    trie = url_map_trie_from_config(url_maps.config_path);
+    if (!trie)
+        return true;
+
+    /* The new trie has to be visible before the epoch changes, so that
+     * requests counted in the new epoch can't see the old trie; see
+     * acquire_url_map_trie() in lwan-request.c. */
+    url_maps.retired_trie = l->url_map_trie;
+    url_maps.retired_epoch = l->url_map_epoch;
+    __atomic_store_n(&l->url_map_trie, trie, __ATOMIC_SEQ_CST);
+    __atomic_store_n(&l->url_map_epoch, l->url_map_epoch + 1,
+                     __ATOMIC_SEQ_CST);
+
+    lwan_status_info("Site reloaded");
+
     return true;
 }
 
+static void request_reload(int signal_number __attribute__((unused)))
+{
+    reload_requested = 1;
+}
+
 static void try_setup_from_config(struct lwan *l,
                                   const struct lwan_config *config)
 {
@@ -777,6 +1385,7 @@ static void try_setup_from_config(struct lwan *l,
     l->config.request_flags =
         (l->config.proxy_protocol ? REQUEST_ALLOW_PROXY_REQS : 0) |
         (l->config.allow_cors ? REQUEST_ALLOW_CORS : 0) |
+        (l->config.compress_responses ? RESPONSE_COMPRESS : 0) |
         (l->config.ssl.send_hsts_header ? REQUEST_WANTS_HSTS_HEADER : 0);
 }
 
@@ -829,11 +1438,16 @@ static void allocate_connections(struct lwan *l, size_t max_open_files)
 {
     const size_t sz = max_open_files * sizeof(struct lwan_connection);
 
-    l->conns = lwan_aligned_alloc(sz, 64);
-    if (UNLIKELY(!l->conns))
-        lwan_status_critical_perror("lwan_alloc_aligned");
+    /* The file descriptor limit can be in the millions, so rather than
+     * clearing the whole array, let the kernel hand out zeroed pages as
+     * file descriptors in their ranges are used.  (Anonymous mappings are
+     * page-aligned, so connections are still cache line-aligned.) */
+    l->conns = mmap(NULL, sz, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (UNLIKELY(l->conns == MAP_FAILED))
+        lwan_status_critical_perror("mmap");
 
-    memset(l->conns, 0, sz);
+    l->n_conns = max_open_files;
 }
 
 static void get_number_of_cpus(struct lwan *l)
@@ -856,6 +1470,8 @@ static void get_number_of_cpus(struct lwan *l)
 
     l->online_cpus = (unsigned int)n_online_cpus;
     l->available_cpus = (unsigned int)n_available_cpus;
+
+    lwan_cpu_quota_init(l);
 }
 
 void lwan_init(struct lwan *l) { lwan_init_with_config(l, &default_config); }
@@ -870,6 +1486,29 @@ static char *dup_or_null(const char *s)
     return s ? strdup(s) : NULL;
 }
 
+static struct lwan_dedicated_listener *
+dup_dedicated_listeners(const struct lwan_dedicated_listener *listeners,
+                        size_t n_listeners)
+{
+    struct lwan_dedicated_listener *copy;
+
+    if (!n_listeners)
+        return NULL;
+
+    copy = calloc(n_listeners, sizeof(*copy));
+    if (!copy)
+        lwan_status_critical("Could not allocate memory for listeners");
+
+    for (size_t i = 0; i < n_listeners; i++) {
+        copy[i] = listeners[i];
+        copy[i].address = strdup(listeners[i].address);
+        if (!copy[i].address)
+            lwan_status_critical("Could not allocate memory for listeners");
+    }
+
+    return copy;
+}
+
 void lwan_init_with_config(struct lwan *l, const struct lwan_config *config)
 {
     /* Load defaults */
@@ -877,8 +1516,11 @@ void lwan_init_with_config(struct lwan *l, const struct lwan_config *config)
     memcpy(&l->config, config, sizeof(*config));
     l->config.listener = dup_or_null(l->config.listener);
     l->config.config_file_path = dup_or_null(l->config.config_file_path);
+    l->config.hot_keys_file = dup_or_null(l->config.hot_keys_file);
     l->config.ssl.key = dup_or_null(l->config.ssl.key);
     l->config.ssl.cert = dup_or_null(l->config.ssl.cert);
+    l->config.dedicated_listeners = dup_dedicated_listeners(
+        config->dedicated_listeners, config->n_dedicated_listeners);
 
     /* Initialize status first, as it is used by other things during
      * their initialization. */
@@ -889,6 +1531,8 @@ void lwan_init_with_config(struct lwan *l, const struct lwan_config *config)
      * respected. */
     lwan_job_thread_init();
     lwan_tables_init();
+    lwan_resolver_init();
+    lwan_memory_pressure_init();
 
     /* Get the number of CPUs here because straightjacket might be active
      * and this will block access to /proc and /sys, which will cause
@@ -897,16 +1541,24 @@ void lwan_init_with_config(struct lwan *l, const struct lwan_config *config)
 
     try_setup_from_config(l, config);
 
+    if (!l->url_map_trie) {
+        /* Filled in later by lwan_set_url_map() or lwan_detect_url_map() */
+        l->url_map_trie = url_map_trie_new();
+        if (!l->url_map_trie)
+            lwan_status_critical("Could not initialize trie");
+    }
+
     if (!l->headers.len)
         build_response_headers(l, config->global_headers);
 
     lwan_response_init(l);
+    lwan_compress_init(l);
 
     /* Continue initialization as normal. */
     lwan_status_debug("Initializing lwan web server");
 
     if (!l->config.n_threads) {
-        l->thread.count = l->online_cpus;
+        l->thread.count = l->usable_cpus;
         if (l->thread.count == 1)
             l->thread.count = 2;
     } else if (l->config.n_threads > 3 * l->online_cpus) {
@@ -925,6 +1577,10 @@ void lwan_init_with_config(struct lwan *l, const struct lwan_config *config)
         l->thread.count = l->config.n_threads;
     }
 
+    l->thread.shared_count = l->thread.count;
+    for (size_t i = 0; i < l->config.n_dedicated_listeners; i++)
+        l->thread.count += l->config.dedicated_listeners[i].n_threads;
+
     rlim_t max_open_files = setup_open_file_count_limits(l);
     allocate_connections(l, (size_t)max_open_files);
 
@@ -935,7 +1591,10 @@ void lwan_init_with_config(struct lwan *l, const struct lwan_config *config)
     signal(SIGPIPE, SIG_IGN);
 
     lwan_readahead_init();
+    lwan_upgrade_init(l);
     lwan_thread_init(l);
+    lwan_access_log_init();
+    lwan_tracing_init();
     lwan_http_authorize_init();
 }
 
@@ -944,24 +1603,51 @@ void lwan_shutdown(struct lwan *l)
     lwan_status_info("Shutting down");
 
     free(l->config.listener);
+    free(l->config.tls_listener);
+    for (size_t i = 0; i < l->config.n_dedicated_listeners; i++)
+        free(l->config.dedicated_listeners[i].address);
+    free(l->config.dedicated_listeners);
     free(l->config.error_template);
     free(l->config.config_file_path);
+    free(l->config.upgrade_socket);
 
-    lwan_always_bzero(l->config.ssl.cert, strlen(l->config.ssl.cert));
-    free(l->config.ssl.cert);
-    lwan_always_bzero(l->config.ssl.key, strlen(l->config.ssl.key));
-    free(l->config.ssl.key);
+    if (l->config.ssl.cert) {
+        lwan_always_bzero(l->config.ssl.cert, strlen(l->config.ssl.cert));
+        free(l->config.ssl.cert);
+    }
+    if (l->config.ssl.key) {
+        lwan_always_bzero(l->config.ssl.key, strlen(l->config.ssl.key));
+        free(l->config.ssl.key);
+    }
 
     lwan_job_thread_shutdown();
+    lwan_memory_pressure_shutdown();
+    lwan_cpu_quota_shutdown(l);
     lwan_thread_shutdown(l);
+    lwan_upgrade_shutdown();
+    lwan_access_log_shutdown();
+    lwan_tracing_shutdown();
+
+    /* Nothing is looked up anymore, and caches are about to go away */
+    if (l->config.hot_keys_file) {
+        cache_hot_keys_save(l->config.hot_keys_file);
+        free(l->config.hot_keys_file);
+    }
 
     lwan_status_debug("Shutting down URL handlers");
-    lwan_trie_destroy(&l->url_map_trie);
+    url_map_trie_free(l->url_map_trie);
+    l->url_map_trie = NULL;
+    url_map_trie_free(url_maps.retired_trie);
+    url_maps.retired_trie = NULL;
+    url_maps_config_path_set(NULL);
 
     free(l->headers.value);
-    free(l->conns);
+    munmap(l->conns, l->n_conns * sizeof(struct lwan_connection));
 
+    lwan_compress_shutdown(l);
     lwan_response_shutdown(l);
+    lwan_resolver_shutdown();
+    lwan_shared_dict_shutdown();
     lwan_tables_shutdown();
     lwan_status_shutdown(l);
     lwan_http_authorize_shutdown();
@@ -970,6 +1656,30 @@ void lwan_shutdown(struct lwan *l)
 
 void lwan_main_loop(struct lwan *l)
 {
+    /* The URL map won't change from now on, unless it's reloaded from the
+     * configuration file, in which case a new trie is built. */
+    if (!lwan_trie_compact(l->url_map_trie))
+        lwan_status_warning("Could not compact URL map; using it as is");
+
+    if (url_maps.config_path) {
+        struct sigaction sa = {.sa_handler = request_reload,
+                               .sa_flags = SA_RESTART};
+
+        sigemptyset(&sa.sa_mask);
+        if (sigaction(SIGHUP, &sa, NULL) < 0) {
+            lwan_status_perror("Could not install SIGHUP handler; "
+                               "configuration can't be reloaded");
+        } else {
+            lwan_job_add_full(reload_config_job, l, "config_reload",
+                              LWAN_JOB_PRIORITY_LOW, 100, 1000);
+        }
+    }
+
+    lwan_upgrade_main_loop(l);
+
+    if (l->config.hot_keys_file)
+        cache_hot_keys_prewarm(l->config.hot_keys_file);
+
     lwan_status_info("Ready to serve");
 
     lwan_job_thread_main_loop();
@@ -27,6 +27,7 @@ extern "C" {
 #include <netinet/in.h>
 #include <pthread.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <string.h>
 #include <sys/epoll.h>
@@ -34,6 +35,7 @@ extern "C" {
 #include "hash.h"
 #include "timeout.h"
 #include "lwan-array.h"
+#include "lwan-chain.h"
 #include "lwan-config.h"
 #include "lwan-coro.h"
 #include "lwan-status.h"
@@ -71,7 +73,7 @@ extern "C" {
 
 #define LWAN_HANDLER_REF(name_) lwan_handler_##name_
 
-#define LWAN_HANDLER_ROUTE(name_, route_)                                      \
+#define LWAN_HANDLER_ROUTE_FLAGS(name_, route_, flags_)                        \
     static enum lwan_http_status lwan_handler_##name_(                         \
         struct lwan_request *, struct lwan_response *, void *);                \
     static const struct lwan_handler_info                                      \
@@ -81,11 +83,16 @@ extern "C" {
             .name = #name_,                                                    \
             .route = route_,                                                   \
             .handler = lwan_handler_##name_,                                   \
+            .flags = flags_,                                                   \
     };                                                                         \
     __attribute__((used)) static enum lwan_http_status lwan_handler_##name_(   \
         struct lwan_request *request __attribute__((unused)),                  \
         struct lwan_response *response __attribute__((unused)),                \
         void *data __attribute__((unused)))
+#define LWAN_HANDLER_ROUTE(name_, route_)                                      \
+    LWAN_HANDLER_ROUTE_FLAGS(name_, route_, 0)
+#define LWAN_HANDLER_FLAGS(name_, flags_)                                      \
+    LWAN_HANDLER_ROUTE_FLAGS(name_, NULL, flags_)
 #define LWAN_HANDLER(name_) LWAN_HANDLER_ROUTE(name_, NULL)
 
 #define ALWAYS_INLINE inline __attribute__((always_inline))
@@ -182,6 +189,9 @@ enum lwan_handler_flags {
     HANDLER_MUST_AUTHORIZE = 1 << 1,
     HANDLER_CAN_REWRITE_URL = 1 << 2,
     HANDLER_DATA_IS_HASH_TABLE = 1 << 3,
+    /* Body isn't read before the handler is called; the handler reads it
+     * with lwan_request_read_body() instead.  */
+    HANDLER_STREAMS_BODY_DATA = 1 << 4,
 
     HANDLER_PARSE_MASK = HANDLER_EXPECTS_BODY_DATA,
 };
@@ -236,6 +246,12 @@ enum lwan_request_flags {
     REQUEST_HAS_QUERY_STRING = 1 << 25,
 
     REQUEST_WANTS_HSTS_HEADER = 1 << 26,
+
+    RESPONSE_COMPRESS = 1 << 27,
+
+    /* Additional headers came from another server (e.g. an upstream in
+     * the proxy module), so they're sent for error responses too. */
+    RESPONSE_UPSTREAM_HEADERS = 1 << 28,
 };
 
 #undef SELECT_MASK
@@ -305,10 +321,22 @@ enum lwan_connection_flags {
      * can deal with this fact.  */
     CONN_HUNG_UP = 1 << 13,
 
-    CONN_FLAG_LAST = CONN_HUNG_UP,
+    /* Set when "h2" has been negotiated with ALPN during the TLS
+     * handshake.  */
+    CONN_IS_HTTP2 = 1 << 14,
+
+    /* Set while a keep-alive connection waits for its next request without
+     * a coroutine (see CONN_CORO_RELEASE), and until the coroutine spawned
+     * once that request arrives starts running.  Such a connection is still
+     * in the keep-alive timeout queue -- unless it's also waiting to be
+     * written to, which means it's being handed over to another thread and
+     * isn't in any timeout queue yet (see migrate_idle_conn()).  */
+    CONN_RELEASED_CORO = 1 << 15,
+
+    CONN_FLAG_LAST = CONN_RELEASED_CORO,
 };
 
-static_assert(CONN_FLAG_LAST < ((1 << 15) - 1),
+static_assert(CONN_FLAG_LAST < (1 << CONN_EPOLL_EVENT_SHIFT),
               "Enough space for epoll events in conn flags");
 
 enum lwan_connection_coro_yield {
@@ -334,6 +362,18 @@ enum lwan_connection_coro_yield {
     CONN_CORO_SUSPEND,
     CONN_CORO_RESUME,
 
+    /* Returns to the event loop, which frees the coroutine while the
+     * connection waits for the next request; a new coroutine is spawned
+     * once there's something to read.  Only used by the request processing
+     * coroutine, between requests.  */
+    CONN_CORO_RELEASE,
+
+    /* Returns to the event loop without changing the epoll event mask,
+     * asking to be resumed again as soon as the events that are already
+     * pending have been handled.  Used by coroutines that ran past their
+     * time slice; see lwan_yield_if_time_slice_expired().  */
+    CONN_CORO_RESCHEDULE,
+
     CONN_CORO_MAX,
 };
 
@@ -342,12 +382,17 @@ struct lwan_key_value {
     char *value;
 };
 
+struct cache;
+struct cache_entry;
 struct lwan_request;
 
 struct lwan_response {
     struct lwan_strbuf *buffer;
     const char *mime_type;
 
+    /* If set, the body is this chain (which includes `buffer`) */
+    struct lwan_chain *chain;
+
     union {
         struct {
             const struct lwan_key_value *headers;
@@ -366,6 +411,14 @@ struct lwan_value {
     size_t len;
 };
 
+/* Same meaning as in lwan_request_get_range(): @from and @to are the first
+ * and last bytes of the range, with @to set to -1 if the range goes up to
+ * the end of the resource.  If @from is -1, it's a suffix range, for the
+ * last @to bytes of the resource. */
+struct lwan_range {
+    off_t from, to;
+};
+
 struct lwan_connection {
     /* This structure is exactly 32-bytes on x86-64. If it is changed,
      * make sure the scheduler (lwan-thread.c) is updated as well. */
@@ -413,21 +466,33 @@ DEFINE_ARRAY_TYPE(lwan_key_value_array, struct lwan_key_value)
 struct lwan_request_parser_helper;
 
 struct lwan_request {
+    /* Used by every request: keep these within the first two cache lines
+     * (see the static_assert()s below). */
     enum lwan_request_flags flags;
     int fd;
     struct lwan_connection *conn;
-    const struct lwan_value *const global_response_headers;
-
     struct lwan_request_parser_helper *helper;
 
     struct lwan_value url;
-    struct lwan_value original_url;
     struct lwan_response response;
 
+    const struct lwan_value *const global_response_headers;
+
+    /* Only used by requests that are rewritten, proxied, or that sleep. */
+    struct lwan_value original_url;
     struct lwan_proxy *proxy;
     struct timeout timeout;
 };
 
+#if defined(__x86_64__)
+static_assert(offsetof(struct lwan_request, global_response_headers) +
+                      sizeof(void *) <=
+                  128,
+              "Fields used by every request fit in two cache lines");
+static_assert(offsetof(struct lwan_request, response) < 64,
+              "Response buffer pointer is in the first cache line");
+#endif
+
 struct lwan_module {
     enum lwan_http_status (*handle_request)(struct lwan_request *request,
                                             struct lwan_response *response,
@@ -460,6 +525,7 @@ struct lwan_handler_info {
                                      struct lwan_response *response,
                                      void *data);
     const char *route;
+    enum lwan_handler_flags flags;
 };
 
 struct lwan_url_map {
@@ -479,20 +545,134 @@ struct lwan_url_map {
         char *realm;
         char *password_file;
     } authorization;
+
+    unsigned int latency_id;
+
+    /* Milliseconds the handler has to give a response; 0 for no limit */
+    unsigned int deadline;
+};
+
+#define LWAN_RUN_QUEUE_SIZE 64
+
+/* Updated without atomics, and only by the thread owning them; readers in
+ * other threads might see slightly out-of-date values. */
+struct lwan_thread_stats {
+    uint64_t accepted;
+    uint64_t accept_wakeups;
+    uint64_t requests;
+    uint64_t bytes_sent;
+    uint64_t writes; /* System calls that sent data to clients */
+    uint64_t pushes; /* Writes after which nothing was held back */
+    uint64_t ws_pongs; /* Answers to websocket keep-alive pings */
+    uint64_t ws_pong_rtt_us; /* Sum of their round-trip times */
+    uint64_t wakeups;
+    uint64_t events;
+    uint64_t coros; /* Each is also an entry in the keep-alive timeout queue */
+    uint64_t coros_cached;
+    uint64_t arena_high_water; /* Largest coroutine arena use by a request */
+    uint64_t migrated; /* Idle connections handed over to other threads */
+    uint64_t shed; /* New connections turned away with a 503 at accept time */
+    uint64_t cancelled; /* Requests cancelled past their deadline */
+    uint64_t overloaded; /* 1 while new connections are being shed */
+} __attribute__((aligned(64)));
+
+struct lwan_listener_options {
+    /* Length of the accept queue; 0 uses net.core.somaxconn */
+    unsigned int backlog;
+    /* TCP_DEFER_ACCEPT timeout, in seconds; negative values use
+     * keep_alive_timeout, and 0 disables it */
+    int defer_accept;
+    /* TCP_FASTOPEN queue length; 0 disables it */
+    unsigned int fastopen_queue;
+    /* Steer connections to the thread running on the CPU that received
+     * them, with a SO_ATTACH_REUSEPORT_CBPF program */
+    bool steer_by_cpu;
+    /* Serve all connections received by a NIC queue (identified by the
+     * SO_INCOMING_NAPI_ID of its connections) in the same thread */
+    bool steer_by_napi_id;
+    /* SO_BUSY_POLL timeout, in microseconds; 0 disables busy polling */
+    unsigned int busy_poll;
+    /* SO_PREFER_BUSY_POLL: defer NIC interrupts while busy polling */
+    bool prefer_busy_poll;
+    /* TCP_NOTSENT_LOWAT, in bytes; 0 leaves the kernel default */
+    unsigned int notsent_lowat;
+};
+
+/* A listener served by its own worker threads, rather than by the ones
+ * serving `listener` and `tls_listener` */
+struct lwan_dedicated_listener {
+    char *address;
+    struct lwan_listener_options options;
+    unsigned int n_threads;
 };
 
 struct lwan_thread {
     struct lwan *lwan;
     struct {
+        /* Formatted when the thread wakes up in a new second */
+        time_t last;
         char date[30];
         char expires[30];
     } date;
     int epoll_fd;
+#if defined(LWAN_HAVE_IO_URING)
+    struct lwan_io_uring *io_uring;
+#endif
     struct timeouts *wheel;
     int listen_fd;
     int tls_listen_fd;
+    /* NULL if this thread serves `listener` and `tls_listener` */
+    const struct lwan_dedicated_listener *dedicated;
     unsigned int cpu;
+    unsigned int numa_node;
     pthread_t self;
+
+    /* Coroutines of closed connections, kept for new connections. */
+    struct coro_pool coro_pool;
+
+    /* Set if an access log has been configured */
+    struct lwan_access_log_ring *access_log;
+    /* Set if tracing has been configured */
+    struct lwan_trace_ring *tracing;
+
+    struct lwan_thread_latency *latency;
+
+    /* Connections whose coroutines yielded with CONN_CORO_RESCHEDULE,
+     * resumed after the events returned by each epoll_wait() call. */
+    struct {
+        struct lwan_connection *conns[LWAN_RUN_QUEUE_SIZE];
+        unsigned int count;
+    } run_queue;
+
+    /* Coroutines parked by lwan-sync.c and woken up by other threads,
+     * resumed once the eventfd in here is signalled; see
+     * lwan_thread_wake_conn() */
+    struct lwan_thread_doorbell *doorbell;
+
+    /* File descriptors handled by callbacks rather than by coroutines;
+     * see lwan_thread_add_fd_watcher() */
+    struct lwan_thread_fd_watchers *fd_watchers;
+
+    /* Requests using the URL map trie, for each parity of
+     * lwan::url_map_epoch */
+    unsigned int url_map_refs[2];
+
+    /* How long to poll for events before blocking; see wait_for_events() */
+    uint64_t busy_poll_ns;
+
+    /* CoDel-style overload detection; see update_overload_state() */
+    struct {
+        uint64_t above_target_since_ns;
+        bool shedding;
+    } overload;
+
+    /* Set once the listeners have been handed over to a new process, and
+     * once all connections have been closed after that; see
+     * lwan-upgrade.c */
+    bool draining;
+    bool drained;
+
+    struct lwan_thread_stats stats;
 };
 
 struct lwan_straitjacket {
@@ -508,13 +688,24 @@ struct lwan_config {
 
     char *listener;
     char *tls_listener;
+    struct lwan_listener_options listener_options;
+    struct lwan_listener_options tls_listener_options;
+    struct lwan_dedicated_listener *dedicated_listeners;
+    size_t n_dedicated_listeners;
     char *error_template;
     char *config_file_path;
+    char *upgrade_socket;
+    char *hot_keys_file;
 
     struct {
         char *cert;
         char *key;
         bool send_hsts_header;
+        bool session_tickets;
+        bool session_cache;
+        unsigned int session_lifetime;
+        unsigned int session_cache_size;
+        unsigned int handshake_threads;
     } ssl;
 
     size_t max_post_data_size;
@@ -522,6 +713,13 @@ struct lwan_config {
     size_t request_buffer_size;
 
     unsigned int keep_alive_timeout;
+    unsigned int time_slice;
+    unsigned int overload_latency_target;
+    unsigned int overload_interval;
+    unsigned int overload_max_coros;
+    unsigned int busy_poll_time;
+    unsigned int slow_request_threshold;
+    unsigned int upgrade_drain_timeout;
     unsigned int expires;
     unsigned int n_threads;
     unsigned int max_file_descriptors;
@@ -529,13 +727,25 @@ struct lwan_config {
     unsigned int quiet : 1;
     unsigned int proxy_protocol : 1;
     unsigned int allow_cors : 1;
+    unsigned int allow_http2 : 1;
+    unsigned int compress_responses : 1;
     unsigned int allow_post_temp_file : 1;
     unsigned int allow_put_temp_file : 1;
+    unsigned int io_uring : 1;
+    unsigned int release_idle_coros : 1;
+    unsigned int migrate_idle_conns : 1;
 };
 
 struct lwan {
-    struct lwan_trie url_map_trie;
+    /* Replaced when the configuration is reloaded; see
+     * acquire_url_map_trie() in lwan-request.c */
+    struct lwan_trie *url_map_trie;
+    unsigned int url_map_epoch;
+
+    /* Indexed by file descriptor.  Pages are only faulted in once a file
+     * descriptor in their range is used. */
     struct lwan_connection *conns;
+    size_t n_conns;
     struct lwan_value headers;
 
 #if defined(LWAN_HAVE_MBEDTLS)
@@ -544,9 +754,15 @@ struct lwan {
 
     struct {
         struct lwan_thread *threads;
+        /* Index in `threads` of the thread new connections are handed to,
+         * for each file descriptor modulo `shared_count` */
+        uint32_t *conn_schedule;
 
         unsigned int max_fd;
+        /* Threads serving `listener` and `tls_listener` come first; the
+         * ones serving dedicated listeners follow, up to `count`. */
         unsigned int count;
+        unsigned int shared_count;
         pthread_barrier_t barrier;
     } thread;
 
@@ -554,6 +770,9 @@ struct lwan {
 
     unsigned int online_cpus;
     unsigned int available_cpus;
+    /* Online CPUs this process can run on, capped by the CPU quota of its
+     * cgroup; updated while running (see lwan-cgroup.c). */
+    unsigned int usable_cpus;
 };
 
 void lwan_set_url_map(struct lwan *l, const struct lwan_url_map *map);
@@ -580,6 +799,13 @@ const char *lwan_request_get_header(struct lwan_request *request,
     __attribute__((warn_unused_result));
 
 void lwan_request_sleep(struct lwan_request *request, uint64_t ms);
+bool lwan_yield_if_time_slice_expired(void);
+
+/* Sends a 103 Early Hints informational response with @headers (usually
+ * Link headers with rel=preload) before the final response.  Returns false
+ * if they couldn't be sent, e.g. for HTTP/1.0 clients. */
+bool lwan_response_send_early_hints(struct lwan_request *request,
+                                    const struct lwan_key_value *headers);
 
 bool lwan_response_set_chunked(struct lwan_request *request,
                                enum lwan_http_status status);
@@ -590,6 +816,13 @@ void lwan_response_send_chunk(struct lwan_request *request);
 void lwan_response_send_chunk_full(struct lwan_request *request,
                                    struct lwan_strbuf *strbuf);
 
+struct lwan_chain *lwan_response_get_chain(struct lwan_request *request);
+bool lwan_response_chain_append_cache_entry(struct lwan_request *request,
+                                            struct cache *cache,
+                                            struct cache_entry *entry,
+                                            const void *data,
+                                            size_t len);
+
 bool lwan_response_set_event_stream(struct lwan_request *request,
                                     enum lwan_http_status status);
 void lwan_response_send_event(struct lwan_request *request, const char *event);
@@ -629,6 +862,15 @@ const char *lwan_request_get_remote_address_and_port(
     char buffer LWAN_ARRAY_PARAM(INET6_ADDRSTRLEN), uint16_t *port)
     __attribute__((warn_unused_result));
 
+/* Credentials of the process on the other end of a connection to a Unix
+ * socket listener, as of when it connected; returns false for other
+ * connections.  Any of the pointers can be NULL. */
+bool lwan_request_get_peer_credentials(const struct lwan_request *request,
+                                       pid_t *pid,
+                                       uid_t *uid,
+                                       gid_t *gid)
+    __attribute__((warn_unused_result));
+
 static inline enum lwan_request_flags
 lwan_request_get_method(const struct lwan_request *request)
 {
@@ -639,10 +881,20 @@ const char *lwan_request_get_method_str(const struct lwan_request *request);
 int lwan_request_get_range(struct lwan_request *request,
                            off_t *from,
                            off_t *to);
+ssize_t lwan_request_get_ranges(struct lwan_request *request,
+                                struct lwan_range ranges[],
+                                size_t max_ranges);
 int lwan_request_get_if_modified_since(struct lwan_request *request,
                                        time_t *value);
 const struct lwan_value *
 lwan_request_get_request_body(struct lwan_request *request);
+ssize_t lwan_request_read_body(struct lwan_request *request,
+                               void *buf,
+                               size_t len);
+int lwan_request_get_body_fd(struct lwan_request *request);
+int lwan_request_link_body(struct lwan_request *request,
+                           int dirfd,
+                           const char *path);
 const struct lwan_value *
 lwan_request_get_content_type(struct lwan_request *request);
 const struct lwan_key_value_array *
@@ -654,19 +906,81 @@ lwan_request_get_post_params(struct lwan_request *request);
 enum lwan_request_flags
 lwan_request_get_accept_encoding(struct lwan_request *request);
 
+struct lwan_websocket_options {
+    /* Negotiate the permessage-deflate extension (RFC 7692) if the client
+     * offers it. */
+    bool permessage_deflate;
+    /* Reset the compressor after every message, trading some compression
+     * ratio for being able to send shared frames (see below) as-is. */
+    bool no_context_takeover;
+    /* Size of the compressor window, as a power of two between 9 and 15;
+     * 0 picks a small default to keep per-connection memory low. */
+    unsigned int window_bits;
+};
+
 enum lwan_http_status
 lwan_request_websocket_upgrade(struct lwan_request *request);
+enum lwan_http_status
+lwan_request_websocket_upgrade_full(struct lwan_request *request,
+                                    const struct lwan_websocket_options *options);
 void lwan_response_websocket_write_text(struct lwan_request *request);
 void lwan_response_websocket_write_binary(struct lwan_request *request);
 int lwan_response_websocket_read(struct lwan_request *request);
 int lwan_response_websocket_read_hint(struct lwan_request *request, size_t size_hint);
 
+/* Round-trip time, in microseconds, measured by the last keep-alive ping
+ * answered by the client; 0 if none has been yet.  Pings are only sent to
+ * idle connections, once they've been quiet for about keep_alive_timeout
+ * seconds.  */
+unsigned int lwan_request_websocket_get_rtt(const struct lwan_request *request);
+
+/* Streaming counterparts of the functions above, so that large messages
+ * don't have to be held in memory all at once.  Reading puts the next piece
+ * of the current message, at most @max_len bytes long (or what they inflate
+ * to, if compressed), in the response buffer, setting @last once the whole
+ * message has been read.  Writing sends the response buffer as a fragment
+ * of a message, the last one having @last set.  Don't mix these with the
+ * functions above in the middle of a message.  */
+int lwan_response_websocket_read_partial(struct lwan_request *request,
+                                         size_t max_len,
+                                         bool *last);
+void lwan_response_websocket_write_text_partial(struct lwan_request *request,
+                                                bool last);
+void lwan_response_websocket_write_binary_partial(struct lwan_request *request,
+                                                  bool last);
+
+/* Shared frames are meant to be broadcast (e.g. through a pubsub topic,
+ * whose messages are refcounted and shared by all subscribers): they're
+ * encoded only once, and sending one is a single write straight from the
+ * shared buffer.  The payload is also compressed once, and the compressed
+ * frame is sent to every connection that negotiated permessage-deflate
+ * without context takeover; other connections that negotiated it compress
+ * the plain payload on their own.  The prepared frame is an opaque blob
+ * written to @frame. */
+bool lwan_websocket_prepare_shared_text(struct lwan_strbuf *frame,
+                                        const char *msg,
+                                        size_t len);
+bool lwan_websocket_prepare_shared_binary(struct lwan_strbuf *frame,
+                                          const char *msg,
+                                          size_t len);
+void lwan_response_websocket_write_shared(struct lwan_request *request,
+                                          const struct lwan_value *frame);
+
 int lwan_request_await_read(struct lwan_request *r, int fd);
 int lwan_request_await_write(struct lwan_request *r, int fd);
 int lwan_request_await_read_write(struct lwan_request *r, int fd);
 int lwan_request_awaitv_any(struct lwan_request *r, ...);
 int lwan_request_awaitv_all(struct lwan_request *r, ...);
 
+struct lwan_await_fd {
+    int fd;
+    enum lwan_connection_coro_yield events;
+};
+int lwan_request_await_any_of(struct lwan_request *r,
+                              const struct lwan_await_fd fds[],
+                              size_t n_fds,
+                              uint64_t timeout_ms);
+
 void lwan_straitjacket_enforce(const struct lwan_straitjacket *sj);
 
 #if defined(__cplusplus)
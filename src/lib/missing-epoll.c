@@ -58,6 +58,43 @@ int epoll_create1(int flags)
 
 static int epoll_no_event_marker;
 
+/* Changes made by a thread to the kqueue it waits on aren't submitted right
+ * away: they're queued here and go in the changelist of the kevent() call
+ * made by the next epoll_wait(), saving a system call for each one of
+ * them.  Changes made to other kqueues (e.g. when a connection is handed
+ * over to another thread) are submitted immediately. */
+#define MAX_PENDING_CHANGES 128
+static __thread struct {
+    int epfd;
+    int n_changes;
+    struct kevent changes[MAX_PENDING_CHANGES];
+} pending = {.epfd = -1};
+
+static void flush_pending_changes(void)
+{
+    if (!pending.n_changes)
+        return;
+
+#if defined(EV_RECEIPT)
+    struct kevent receipts[MAX_PENDING_CHANGES];
+    const struct timespec zero = {};
+
+    /* With EV_RECEIPT, a failed change doesn't prevent the ones after it
+     * from being applied; errors are otherwise ignored, as they would have
+     * been if they were reported by epoll_wait(). */
+    for (int i = 0; i < pending.n_changes; i++)
+        pending.changes[i].flags |= EV_RECEIPT;
+
+    (void)kevent(pending.epfd, pending.changes, pending.n_changes, receipts,
+                 pending.n_changes, &zero);
+#else
+    for (int i = 0; i < pending.n_changes; i++)
+        (void)kevent(pending.epfd, &pending.changes[i], 1, NULL, 0, NULL);
+#endif
+
+    pending.n_changes = 0;
+}
+
 int epoll_ctl(int epfd, int op, int fd, struct epoll_event *event)
 {
     struct kevent ev;
@@ -86,14 +123,29 @@ int epoll_ctl(int epfd, int op, int fd, struct epoll_event *event)
         if (event->events & EPOLLET)
             flags |= EV_CLEAR;
 
-        flags |= EV_ERROR; /* EPOLLERR is always set. */
-        flags |= EV_EOF;   /* EPOLLHUP is always set. */
+        /* EV_ERROR and EV_EOF (EPOLLERR and EPOLLHUP) are output-only
+         * flags, always reported by kqueue, and aren't set here: EV_ERROR
+         * would otherwise be indistinguishable from a failed change. */
+
+        if (epfd == pending.epfd) {
+            if (pending.n_changes == MAX_PENDING_CHANGES)
+                flush_pending_changes();
+
+            EV_SET(&pending.changes[pending.n_changes++], fd, events, flags, 0,
+                   0, udata);
+            return 0;
+        }
 
         EV_SET(&ev, fd, events, flags, 0, 0, udata);
         break;
     }
 
     case EPOLL_CTL_DEL:
+        /* File descriptors are usually closed (and possibly reused) right
+         * after being removed, so apply any queued changes to them first. */
+        if (epfd == pending.epfd)
+            flush_pending_changes();
+
         EV_SET(&ev, fd, 0, EV_DELETE, 0, 0, 0);
         break;
 
@@ -125,32 +177,55 @@ static int kevent_ident_cmp(const void *ptr0, const void *ptr1)
 
 int epoll_wait(int epfd, struct epoll_event *events, int maxevents, int timeout)
 {
-    struct epoll_event *ev = events;
-    struct kevent *evs = alloca(sizeof(*evs) * LWAN_MIN(1024, maxevents));
+    const int nevents = LWAN_MIN(1024, maxevents);
+    struct kevent *evs = alloca(sizeof(*evs) * (size_t)nevents);
+    struct epoll_event *ev = NULL;
     struct timespec tmspec;
+    int n_changes = 0;
     int i, r;
 
-    r = kevent(epfd, NULL, 0, evs, maxevents, to_timespec(&tmspec, timeout));
+    if (epfd == pending.epfd) {
+        n_changes = pending.n_changes;
+        pending.n_changes = 0;
+    } else {
+        /* Only one kqueue is waited on by each thread, so this only happens
+         * the first time a thread calls this function. */
+        flush_pending_changes();
+        pending.epfd = epfd;
+    }
+
+    /* Changes that fail are either reported as events with EV_ERROR set,
+     * which are turned into EPOLLERR for their file descriptors, or, if
+     * there's no room in |evs|, make kevent() fail right away. */
+    r = kevent(epfd, pending.changes, n_changes, evs, nevents,
+               to_timespec(&tmspec, timeout));
     if (UNLIKELY(r < 0)) {
         return -1;
     }
 
     qsort(evs, (size_t)r, sizeof(struct kevent), kevent_ident_cmp);
 
-    uintptr_t last = (uintptr_t)&epoll_no_event_marker;
+    uintptr_t last = 0;
     for (i = 0; i < r; i++) {
         struct kevent *kev = &evs[i];
 
-        if (kev->ident != last) {
-            if (last >= 0)
-                ev++;
+        if (!ev || kev->ident != last) {
+            /* Nothing to report for a file descriptor tracked only because
+             * kqueue needs a filter; if it has other filters, they'll be
+             * reported on their own. */
+            if (kev->udata == &epoll_no_event_marker)
+                continue;
 
+            ev = ev ? ev + 1 : events;
             ev->events = 0;
             ev->data.ptr = kev->udata;
         }
 
         if (kev->flags & EV_ERROR) {
-            ev->events |= EPOLLERR;
+            /* Also set for queued changes that couldn't be applied; a
+             * hangup makes the connection go away as it would if
+             * epoll_ctl() had failed in the first place. */
+            ev->events |= EPOLLERR | EPOLLRDHUP;
         }
         if (kev->flags & EV_EOF) {
             ev->events |= EPOLLRDHUP;
@@ -166,7 +241,7 @@ int epoll_wait(int epfd, struct epoll_event *events, int maxevents, int timeout)
         last = kev->ident;
     }
 
-    return (int)(intptr_t)(ev - events);
+    return ev ? (int)(intptr_t)(ev - events) + 1 : 0;
 }
 #elif !defined(LWAN_HAVE_EPOLL)
 #error epoll() not implemented for this platform
@@ -27,4 +27,8 @@
 #define MAP_HUGETLB 0
 #endif
 
+#ifndef MAP_NORESERVE
+#define MAP_NORESERVE 0
+#endif
+
 #endif /* _MISSING_MMAN_H_ */
@@ -30,6 +30,7 @@
  * Standard library for string operations and pattern-matching
  */
 
+#define _GNU_SOURCE
 #include <sys/types.h>
 #include <ctype.h>
 #include <errno.h>
@@ -37,6 +38,12 @@
 #include <stdlib.h>
 #include <string.h>
 
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
 #include "patterns.h"
 #include "lwan.h"
 
@@ -46,6 +53,23 @@
 #define L_ESC		'%'
 #define SPECIALS	"^$*+?.([%-"
 
+/* Ranges a single character class can be broken into before it's left to
+ * the interpreter; '%p' needs 4, and brackets such as '[%w_.-]' need 6 */
+#define MAX_CLASS_RANGES	8
+
+/*
+ * A pattern item ('.', '%d', '[^/]', a literal character...) as a union of
+ * byte ranges, possibly negated.  Character classes are those of the "C"
+ * locale, which is the only one Lwan runs with.
+ */
+struct byte_class {
+	int nranges;
+	int negated;
+	struct {
+		unsigned char lo, hi;
+	} ranges[MAX_CLASS_RANGES];
+};
+
 struct match_state {
 	int matchdepth;		/* control for recursive depth (to avoid C
 				 * stack overflow) */
@@ -187,6 +211,199 @@ matchbracketclass(int c, const char *p, const char *ec)
 	return !sig;
 }
 
+static int
+add_range(struct byte_class *bc, int lo, int hi)
+{
+	if (bc->nranges == MAX_CLASS_RANGES)
+		return 0;
+	bc->ranges[bc->nranges].lo = (unsigned char)lo;
+	bc->ranges[bc->nranges].hi = (unsigned char)hi;
+	bc->nranges++;
+	return 1;
+}
+
+/* adds the ranges of '%cl' to 'bc'.  Negated classes (e.g. '%D') can only
+ * be handled when they're the whole item, so 'negated' is set for them */
+static int
+add_escaped_class(struct byte_class *bc, int cl, int *negated)
+{
+	int ok;
+
+	*negated = isupper(cl);
+	switch (tolower(cl)) {
+	case 'a':
+		ok = add_range(bc, 'A', 'Z') && add_range(bc, 'a', 'z');
+		break;
+	case 'c':
+		ok = add_range(bc, 0, 31) && add_range(bc, 127, 127);
+		break;
+	case 'd':
+		ok = add_range(bc, '0', '9');
+		break;
+	case 'g':
+		ok = add_range(bc, 33, 126);
+		break;
+	case 'l':
+		ok = add_range(bc, 'a', 'z');
+		break;
+	case 'p':
+		ok = add_range(bc, 33, 47) && add_range(bc, 58, 64) &&
+		    add_range(bc, 91, 96) && add_range(bc, 123, 126);
+		break;
+	case 's':
+		ok = add_range(bc, '\t', '\r') && add_range(bc, ' ', ' ');
+		break;
+	case 'u':
+		ok = add_range(bc, 'A', 'Z');
+		break;
+	case 'w':
+		ok = add_range(bc, '0', '9') && add_range(bc, 'A', 'Z') &&
+		    add_range(bc, 'a', 'z');
+		break;
+	case 'x':
+		ok = add_range(bc, '0', '9') && add_range(bc, 'A', 'F') &&
+		    add_range(bc, 'a', 'f');
+		break;
+	default:
+		*negated = 0;
+		ok = add_range(bc, cl, cl);
+	}
+	return ok;
+}
+
+/*
+ * Turns the pattern item between 'p' and 'ep' into a byte_class.  Returns 0
+ * if it has too many ranges, or negated classes inside brackets (e.g.
+ * '[%D_]'); singlematch() is used for those.
+ */
+static int
+compile_class(struct byte_class *bc, const char *p, const char *ep)
+{
+	int negated;
+
+	bc->nranges = 0;
+	bc->negated = 0;
+
+	switch (*p) {
+	case '.':
+		return add_range(bc, 0, 255);
+	case L_ESC:
+		if (!add_escaped_class(bc, uchar(*(p + 1)), &negated))
+			return 0;
+		bc->negated = negated;
+		return 1;
+	case '[':
+		/* same walk as matchbracketclass() */
+		ep--;
+		if (*(p + 1) == '^') {
+			bc->negated = 1;
+			p++;
+		}
+		while (++p < ep) {
+			if (*p == L_ESC) {
+				p++;
+				if (!add_escaped_class(bc, uchar(*p), &negated) ||
+				    negated)
+					return 0;
+			} else if ((*(p + 1) == '-') && (p + 2 < ep)) {
+				p += 2;
+				/* empty ranges (e.g. '[z-a]') match nothing */
+				if (uchar(*(p - 2)) <= uchar(*p) &&
+				    !add_range(bc, uchar(*(p - 2)), uchar(*p)))
+					return 0;
+			} else if (!add_range(bc, uchar(*p), uchar(*p)))
+				return 0;
+		}
+		return 1;
+	default:
+		return add_range(bc, uchar(*p), uchar(*p));
+	}
+}
+
+static int
+class_has(const struct byte_class *bc, int c)
+{
+	int i;
+
+	for (i = 0; i < bc->nranges; i++) {
+		if (bc->ranges[i].lo <= c && c <= bc->ranges[i].hi)
+			return !bc->negated;
+	}
+	return bc->negated;
+}
+
+/*
+ * Returns a pointer to the first character between 's' and 'end' that
+ * isn't in 'bc', or 'end'.  With SIMD, each range is checked for a whole
+ * block at once: 'c' is within [lo, hi] iff (c - lo) <= (hi - lo), in
+ * unsigned (wrapping) arithmetic.
+ */
+static const char *
+span_class(const struct byte_class *bc, const char *s, const char *end)
+{
+#if defined(__SSE2__)
+	__m128i lo[MAX_CLASS_RANGES], width[MAX_CLASS_RANGES];
+	const unsigned int wanted = bc->negated ? 0 : 0xffff;
+	int i;
+
+	for (i = 0; i < bc->nranges; i++) {
+		lo[i] = _mm_set1_epi8((char)bc->ranges[i].lo);
+		width[i] = _mm_set1_epi8(
+		    (char)(bc->ranges[i].hi - bc->ranges[i].lo));
+	}
+
+	for (; end - s >= 16; s += 16) {
+		const __m128i chunk = _mm_loadu_si128((const __m128i *)s);
+		__m128i in = _mm_setzero_si128();
+		unsigned int mask;
+
+		for (i = 0; i < bc->nranges; i++) {
+			const __m128i off = _mm_sub_epi8(chunk, lo[i]);
+
+			in = _mm_or_si128(in, _mm_cmpeq_epi8(off,
+			    _mm_min_epu8(off, width[i])));
+		}
+
+		mask = (unsigned int)_mm_movemask_epi8(in) ^ wanted;
+		if (mask)
+			return s + __builtin_ctz(mask);
+	}
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+	uint8x16_t lo[MAX_CLASS_RANGES], width[MAX_CLASS_RANGES];
+	int i;
+
+	for (i = 0; i < bc->nranges; i++) {
+		lo[i] = vdupq_n_u8(bc->ranges[i].lo);
+		width[i] = vdupq_n_u8(
+		    (uint8_t)(bc->ranges[i].hi - bc->ranges[i].lo));
+	}
+
+	for (; end - s >= 16; s += 16) {
+		const uint8x16_t chunk = vld1q_u8((const uint8_t *)s);
+		uint8x16_t in = vdupq_n_u8(0);
+		uint64_t mask;
+
+		for (i = 0; i < bc->nranges; i++)
+			in = vorrq_u8(in,
+			    vcleq_u8(vsubq_u8(chunk, lo[i]), width[i]));
+		if (!bc->negated)
+			in = vmvnq_u8(in);
+
+		/* 4 bits per byte */
+		mask = vget_lane_u64(vreinterpret_u64_u8(
+		    vshrn_n_u16(vreinterpretq_u16_u8(in), 4)), 0);
+		if (mask)
+			return s + __builtin_ctzll(mask) / 4;
+	}
+#endif
+
+	for (; s < end; s++) {
+		if (!class_has(bc, uchar(*s)))
+			break;
+	}
+	return s;
+}
+
 static int
 singlematch(struct match_state *ms, const char *s, const char *p,
     const char *ep)
@@ -239,10 +456,16 @@ matchbalance(struct match_state *ms, const char *s, const char *p)
 static const char *
 max_expand(struct match_state *ms, const char *s, const char *p, const char *ep)
 {
+	struct byte_class bc;
 	ptrdiff_t i = 0;
 	/* counts maximum expand for item */
-	while (singlematch(ms, s + i, p, ep))
-		i++;
+	if (compile_class(&bc, p, ep)) {
+		if (s < ms->src_end)
+			i = span_class(&bc, s, ms->src_end) - s;
+	} else {
+		while (singlematch(ms, s + i, p, ep))
+			i++;
+	}
 	/* keeps trying to match with the maximum repetitions */
 	while (i >= 0) {
 		const char *res = match(ms, (s + i), ep + 1);
@@ -476,31 +699,9 @@ match(struct match_state *ms, const char *s, const char *p)
 static const char *
 lmemfind(const char *s1, size_t l1, const char *s2, size_t l2)
 {
-	const char *init;
-
-	if (l2 == 0)
-		return (s1); /* empty strings are everywhere */
-	if (l2 > l1)
-		return (NULL); /* avoids a negative 'l1' */
-        /*
-         * to search for a '*s2' inside 's1'
-         * - 1st char will be checked by 'memchr'
-         * - 's2' cannot be found after that
-         */
-        l2--;
-        l1 = l1 - l2;
-        while (l1 > 0 && (init = (const char *)memchr(s1, *s2, l1)) != NULL) {
-                /* 1st char is already checked */
-                init++;
-                if (memcmp(init, s2 + 1, l2) == 0)
-                        return init - 1;
-
-                /* correct 'l1' and 's1' to try again */
-                l1 -= (size_t)(init - s1);
-                s1 = init;
-        }
-        /* not found */
-        return (NULL);
+	/* memmem() in glibc uses the two-way algorithm, with a vectorized
+	 * search for the first character */
+	return memmem(s1, l1, s2, l2);
 }
 
 static int
@@ -570,7 +771,7 @@ str_find_aux(struct match_state *ms, const char *pattern, const char *string,
 	const char	*s = string;
 	const char	*p = pattern;
 	const char	*s1, *s2;
-	int		 anchor, i;
+	int		 anchor, first, i;
 
 	if (init < 0)
 		init = 0;
@@ -606,8 +807,22 @@ str_find_aux(struct match_state *ms, const char *pattern, const char *string,
 	ms->src_init = s;
 	ms->src_end = s + ls;
 	ms->p_end = p + lp;
+
+	/* if the pattern starts with a literal that must be there, matches can
+	 * only start where it is, and memchr() finds those much faster than
+	 * trying every position (e.g. "/user/(%d+)") */
+	first = -1;
+	if (!anchor && lp > 0 && !strchr(SPECIALS ")", *p) &&
+	    (lp == 1 || !strchr("*?-", p[1])))
+		first = uchar(*p);
+
 	do {
 		const char *res;
+		if (first >= 0) {
+			s1 = memchr(s1, first, (size_t)(ms->src_end - s1));
+			if (s1 == NULL)
+				return (0);
+		}
 		ms->level = 0;
 		if ((res = match(ms, s1, p)) != NULL) {
 			sm->sm_so = 0;
@@ -18,6 +18,12 @@ A million repetitions of "a"
 #include <string.h>
 #include <endian.h>
 
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+#include "lwan-private.h"
+
 #define rol(value, bits) (((value) << (bits)) | ((value) >> (32 - (bits))))
 
 /* blk0() and blk() perform the initial expand. */
@@ -49,7 +55,8 @@ A million repetitions of "a"
 
 #define STATE(i)		state[(index + (i)) % 5]
 
-static void sha1_transform(uint32_t orig_state[5], const unsigned char buffer[64])
+static void sha1_transform_block(uint32_t orig_state[5],
+                                 const unsigned char buffer[64])
 {
     uint32_t state[5];
     uint32_t block[16];
@@ -91,6 +98,106 @@ static void sha1_transform(uint32_t orig_state[5], const unsigned char buffer[64
     __asm__ volatile("" : : "g"(block), "g"(state) : "memory");
 }
 
+static void sha1_transform_portable(uint32_t state[5],
+                                    const unsigned char *data,
+                                    size_t n_blocks)
+{
+    for (; n_blocks; n_blocks--, data += 64)
+        sha1_transform_block(state, data);
+}
+
+#if defined(__x86_64__) && defined(LWAN_HAVE_BUILTIN_CPU_INIT)
+/* Four rounds with the SHA extensions, also moving the message schedule
+ * along: @m has the words for these rounds, and the other three vectors
+ * are partially computed words for the following ones. */
+#define SHANI_ROUNDS4(e, e_next, m, m_next, m_after, m_last, func)             \
+    e = _mm_sha1nexte_epu32(e, m);                                             \
+    e_next = abcd;                                                             \
+    m_next = _mm_sha1msg2_epu32(m_next, m);                                    \
+    abcd = _mm_sha1rnds4_epu32(abcd, e, func);                                 \
+    m_last = _mm_sha1msg1_epu32(m_last, m);                                    \
+    m_after = _mm_xor_si128(m_after, m);
+
+__attribute__((target("sha,sse4.1"))) static void
+sha1_transform_shani(uint32_t state[5], const unsigned char *data, size_t n_blocks)
+{
+    const __m128i bswap =
+        _mm_set_epi64x(0x0001020304050607ULL, 0x08090a0b0c0d0e0fULL);
+    __m128i abcd = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)state),
+                                     0x1b);
+    __m128i e0 = _mm_set_epi32((int)state[4], 0, 0, 0);
+    __m128i e1, m0, m1, m2, m3;
+
+    for (; n_blocks; n_blocks--, data += 64) {
+        const __m128i abcd_save = abcd;
+        const __m128i e0_save = e0;
+
+        /* Rounds 0-15 load the message, so they're written out. */
+        m0 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)data), bswap);
+        e0 = _mm_add_epi32(e0, m0);
+        e1 = abcd;
+        abcd = _mm_sha1rnds4_epu32(abcd, e0, 0);
+
+        m1 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(data + 16)),
+                              bswap);
+        e1 = _mm_sha1nexte_epu32(e1, m1);
+        e0 = abcd;
+        abcd = _mm_sha1rnds4_epu32(abcd, e1, 0);
+        m0 = _mm_sha1msg1_epu32(m0, m1);
+
+        m2 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(data + 32)),
+                              bswap);
+        e0 = _mm_sha1nexte_epu32(e0, m2);
+        e1 = abcd;
+        abcd = _mm_sha1rnds4_epu32(abcd, e0, 0);
+        m1 = _mm_sha1msg1_epu32(m1, m2);
+        m0 = _mm_xor_si128(m0, m2);
+
+        m3 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(data + 48)),
+                              bswap);
+        SHANI_ROUNDS4(e1, e0, m3, m0, m1, m2, 0);
+
+        /* Rounds 16-79.  Words computed by the last few aren't used. */
+        SHANI_ROUNDS4(e0, e1, m0, m1, m2, m3, 0);
+        SHANI_ROUNDS4(e1, e0, m1, m2, m3, m0, 1);
+        SHANI_ROUNDS4(e0, e1, m2, m3, m0, m1, 1);
+        SHANI_ROUNDS4(e1, e0, m3, m0, m1, m2, 1);
+        SHANI_ROUNDS4(e0, e1, m0, m1, m2, m3, 1);
+        SHANI_ROUNDS4(e1, e0, m1, m2, m3, m0, 1);
+        SHANI_ROUNDS4(e0, e1, m2, m3, m0, m1, 2);
+        SHANI_ROUNDS4(e1, e0, m3, m0, m1, m2, 2);
+        SHANI_ROUNDS4(e0, e1, m0, m1, m2, m3, 2);
+        SHANI_ROUNDS4(e1, e0, m1, m2, m3, m0, 2);
+        SHANI_ROUNDS4(e0, e1, m2, m3, m0, m1, 2);
+        SHANI_ROUNDS4(e1, e0, m3, m0, m1, m2, 3);
+        SHANI_ROUNDS4(e0, e1, m0, m1, m2, m3, 3);
+        SHANI_ROUNDS4(e1, e0, m1, m2, m3, m0, 3);
+        SHANI_ROUNDS4(e0, e1, m2, m3, m0, m1, 3);
+        SHANI_ROUNDS4(e1, e0, m3, m0, m1, m2, 3);
+
+        e0 = _mm_sha1nexte_epu32(e0, e0_save);
+        abcd = _mm_add_epi32(abcd, abcd_save);
+    }
+
+    _mm_storeu_si128((__m128i *)state, _mm_shuffle_epi32(abcd, 0x1b));
+    state[4] = (uint32_t)_mm_extract_epi32(e0, 3);
+}
+#undef SHANI_ROUNDS4
+#endif
+
+static void (*sha1_transform)(uint32_t state[5],
+                              const unsigned char *data,
+                              size_t n_blocks) = sha1_transform_portable;
+
+#if defined(__x86_64__) && defined(LWAN_HAVE_BUILTIN_CPU_INIT)
+__attribute__((constructor)) static void select_sha1_routine(void)
+{
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sha") && __builtin_cpu_supports("sse4.1"))
+        sha1_transform = sha1_transform_shani;
+}
+#endif
+
 /* sha1_init - Initialize new context */
 
 void sha1_init(sha1_context *context)
@@ -121,10 +228,11 @@ void sha1_update(sha1_context *context, const unsigned char *data, size_t len)
     if ((j + len) > 63) {
         i = 64 - j;
         memcpy(&context->buffer[j], data, i);
-        sha1_transform(context->state, context->buffer);
+        sha1_transform(context->state, context->buffer, 1);
 
-        for (; i + 63 < len; i += 64)
-            sha1_transform(context->state, &data[i]);
+        const size_t n_blocks = (len - i) / 64;
+        sha1_transform(context->state, &data[i], n_blocks);
+        i += n_blocks * 64;
 
         j = 0;
     } else {
@@ -140,7 +248,7 @@ void sha1_finalize(sha1_context *context, unsigned char digest[20])
 {
     unsigned i;
     unsigned char finalcount[8];
-    unsigned char c;
+    size_t j;
 
     for (i = 0; i < 8; i++) {
         finalcount[i] = (unsigned char)((context->count[(i >= 4 ? 0 : 1)] >>
@@ -148,13 +256,19 @@ void sha1_finalize(sha1_context *context, unsigned char digest[20])
                                         255); /* Endian independent */
     }
 
-    c = 0200;
-    sha1_update(context, &c, 1);
-    while ((context->count[0] & 504) != 448) {
-        c = 0000;
-        sha1_update(context, &c, 1);
+    /* Pad with a 1 bit, then zeros until there are 8 bytes left in the
+     * block for the length; if they don't fit, in the block after it. */
+    j = (context->count[0] >> 3) & 63;
+    context->buffer[j++] = 0200;
+    if (j > 56) {
+        memset(&context->buffer[j], 0, 64 - j);
+        sha1_transform(context->state, context->buffer, 1);
+        j = 0;
     }
-    sha1_update(context, finalcount, 8); /* Should cause a sha1_transform() */
+    memset(&context->buffer[j], 0, 56 - j);
+    memcpy(&context->buffer[56], finalcount, 8);
+    sha1_transform(context->state, context->buffer, 1);
+
     for (i = 0; i < 20; i++) {
         digest[i] =
             (unsigned char)((context->state[i >> 2] >> ((3 - (i & 3)) * 8)) &
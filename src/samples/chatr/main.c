@@ -21,7 +21,7 @@
 #include <pthread.h>
 #include <stdlib.h>
 
-#include "../techempower/json.h"
+#include "json.h"
 #include "hash.h"
 #include "lwan.h"
 #include "ringbuffer.h"
@@ -140,13 +140,6 @@ static const char *subscribe_and_get_conn_id(struct hub *hub)
     }
 }
 
-static int append_to_strbuf(const char *bytes, size_t len, void *data)
-{
-    struct lwan_strbuf *strbuf = data;
-
-    return !lwan_strbuf_append_str(strbuf, bytes, len);
-}
-
 LWAN_HANDLER(negotiate)
 {
     struct hub *hub = data;
@@ -167,9 +160,9 @@ LWAN_HANDLER(negotiate)
     if (!response.connectionId)
         return HTTP_INTERNAL_ERROR;
 
-    if (json_obj_encode_full(negotiate_response_descr,
-                             ARRAY_SIZE(negotiate_response_descr), &response,
-                             append_to_strbuf, response->buffer, false) != 0)
+    if (json_obj_encode_strbuf(negotiate_response_descr,
+                               ARRAY_SIZE(negotiate_response_descr), &response,
+                               response->buffer, false) != 0)
         return HTTP_INTERNAL_ERROR;
 
     response->mime_type = "application/json";
@@ -208,8 +201,8 @@ static int send_json(struct lwan_response *request,
                      size_t descr_len,
                      void *data)
 {
-    int ret = json_obj_encode_full(descr, descr_len, data, append_to_strbuf,
-                                   request->response->buffer, false);
+    int ret = json_obj_encode_strbuf(descr, descr_len, data,
+                                     request->response->buffer, false);
     if (ret == 0) {
         lwan_strbuf_append_char(request->response->buffer, '\x1e');
         lwan_response_websocket_send(request);
@@ -177,8 +177,12 @@ static void end_key(ge_GIF *gif)
     gif->offset = gif->partial = 0;
 }
 
-static void
-put_image(ge_GIF *gif, uint16_t w, uint16_t h, uint16_t x, uint16_t y)
+static void put_image(ge_GIF *gif,
+                      const uint8_t *pixels,
+                      uint16_t w,
+                      uint16_t h,
+                      uint16_t x,
+                      uint16_t y)
 {
     int nkeys, key_size, i, j;
     Node *node, *child, *root;
@@ -197,7 +201,7 @@ put_image(ge_GIF *gif, uint16_t w, uint16_t h, uint16_t x, uint16_t y)
 
     for (i = y; i < y + h; i++) {
         for (j = x; j < x + w; j++) {
-            uint8_t pixel = gif->frame[i * gif->w + j] & (degree - 1);
+            uint8_t pixel = pixels[i * gif->w + j] & (degree - 1);
             child = node->children[pixel];
 
             if (child) {
@@ -285,13 +289,23 @@ void ge_add_frame(ge_GIF *gif, uint16_t delay)
         w = h = 1;
         x = y = 0;
     }
-    put_image(gif, w, h, x, y);
+    put_image(gif, gif->frame, w, h, x, y);
     gif->nframes++;
     tmp = gif->back;
     gif->back = gif->frame;
     gif->frame = tmp;
 }
 
+/* Encodes the last frame added with ge_add_frame() again, as a whole, so
+ * that it can be displayed without the frames that came before it.  The
+ * encoder state isn't changed.  */
+void ge_repeat_frame(ge_GIF *gif, uint16_t delay)
+{
+    if (delay)
+        set_delay(gif, delay);
+    put_image(gif, gif->back, gif->w, gif->h, 0, 0);
+}
+
 struct lwan_strbuf *ge_close_gif(ge_GIF *gif)
 {
     struct lwan_strbuf *buf = gif->buf;
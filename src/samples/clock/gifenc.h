@@ -29,6 +29,7 @@ ge_GIF *ge_new_gif(struct lwan_strbuf *buf,
                    int depth,
                    int loop);
 void ge_add_frame(ge_GIF *gif, uint16_t delay);
+void ge_repeat_frame(ge_GIF *gif, uint16_t delay);
 struct lwan_strbuf *ge_close_gif(ge_GIF *gif);
 
 #endif /* GIFENC_H */
@@ -18,8 +18,10 @@
  * USA.
  */
 
-#include <stdlib.h>
 #include <limits.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <time.h>
 
 #include "lwan.h"
 #include "lwan-template.h"
@@ -50,182 +52,316 @@ static const uint16_t width = 3 * 6 /* 6*3px wide digits */ +
                               3 * 2 /* 2*3px wide minutes+seconds dots */;
 static const uint16_t height = 5;
 
-static void destroy_gif(void *data)
-{
-    ge_GIF *gif = data;
-
-    ge_close_gif(gif);
-}
-
 struct tm* my_localtime(const time_t *t)
 {
     static __thread struct tm result;
     return localtime_r(t, &result);
 }
 
-LWAN_HANDLER(clock)
-{
-    static const uint8_t base_offsets[] = {0, 0, 2, 2, 4, 4};
-    ge_GIF *gif = ge_new_gif(response->buffer, width, height, NULL, 2, -1);
-    uint8_t dot_visible = 0;
-
-    if (!gif)
-        return HTTP_INTERNAL_ERROR;
-
-    coro_defer(request->conn->coro, destroy_gif, gif);
-
-    response->mime_type = "image/gif";
-    response->headers = (struct lwan_key_value *)seriously_do_not_cache;
+/* Every style is animated once, no matter how many clients are watching
+ * it: frames are encoded by whichever client needs one first, and then
+ * the same bytes are sent to all of them.  Frames are encoded as changes
+ * to the previous one; clients that missed a frame get the whole image
+ * instead, which is encoded at most once per frame as well. */
+struct clock_stream {
+    pthread_mutex_t lock;
+    ge_GIF *gif;
+
+    /* Draws the next frame in gif->frame, returning the number of
+     * milliseconds it should be displayed for. */
+    uint64_t (*draw)(struct clock_stream *stream);
+    /* Whether the frame duration is also written to the GIF, rather than
+     * relying on the time frames take to arrive. */
+    bool set_delay;
+
+    struct lwan_strbuf header;
+    struct lwan_strbuf delta;
+    struct lwan_strbuf full;
+    uint64_t frame, full_frame;
+    uint16_t delay;
+    uint64_t next_frame_ms;
+};
 
-    memset(gif->frame, 0, (size_t)(width * height));
+static uint64_t now_ms(void)
+{
+    struct timespec ts;
 
-    for (int frame = 0; frame < 3600 * 2; frame++) {
-        time_t curtime;
-        char digits[8];
-        int digit, line, base;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+}
 
-        curtime = time(NULL);
-        strftime(digits, sizeof(digits), "%H%M%S", my_localtime(&curtime));
+/* Must be called with stream->lock held. */
+static void clock_stream_advance(struct clock_stream *stream, uint64_t now)
+{
+    if (stream->frame && now < stream->next_frame_ms)
+        return;
 
-        for (digit = 0; digit < 6; digit++) {
-            int dig = digits[digit] - '0';
-            uint8_t off = base_offsets[digit];
+    uint64_t timeout = stream->draw(stream);
 
-            for (line = 0, base = digit * 4; line < 5; line++, base += width) {
-                gif->frame[base + 0 + off] = !!(digital_clock_font[dig][line] & 1<<2);
-                gif->frame[base + 1 + off] = !!(digital_clock_font[dig][line] & 1<<1);
-                gif->frame[base + 2 + off] = !!(digital_clock_font[dig][line] & 1<<0);
-            }
-        }
+    stream->delay = stream->set_delay ? (uint16_t)timeout : 0;
+    lwan_strbuf_reset(&stream->delta);
+    stream->gif->buf = &stream->delta;
+    ge_add_frame(stream->gif, stream->delay);
+    stream->frame++;
 
-        gif->frame[8 + width] = dot_visible;
-        gif->frame[18 + width] = dot_visible;
-        gif->frame[8 + width * 3] = dot_visible;
-        gif->frame[18 + width * 3] = dot_visible;
-        dot_visible = dot_visible ? 0 : 3;
+    /* Nobody might have been watching for a while: don't try to catch
+     * up with all the frames that would have been drawn meanwhile. */
+    stream->next_frame_ms += timeout;
+    if (stream->next_frame_ms <= now)
+        stream->next_frame_ms = now + timeout;
+}
 
-        ge_add_frame(gif, 0);
-        lwan_response_send_chunk(request);
-        lwan_request_sleep(request, 500);
+/* Must be called with stream->lock held. */
+static const struct lwan_strbuf *
+clock_stream_get_full_frame(struct clock_stream *stream)
+{
+    if (stream->full_frame != stream->frame) {
+        lwan_strbuf_reset(&stream->full);
+        stream->gif->buf = &stream->full;
+        ge_repeat_frame(stream->gif, stream->delay);
+        stream->full_frame = stream->frame;
     }
 
-    return HTTP_OK;
+    return &stream->full;
 }
 
-static void destroy_xdaliclock(void *data)
+static void append_strbuf(struct lwan_strbuf *buf,
+                          const struct lwan_strbuf *data)
 {
-    struct xdaliclock *xdc = data;
-
-    xdaliclock_free(xdc);
+    lwan_strbuf_append_str(buf, lwan_strbuf_get_buffer(data),
+                           lwan_strbuf_get_length(data));
 }
 
-LWAN_HANDLER(dali)
+static bool clock_stream_init(struct clock_stream *stream,
+                              uint16_t stream_width,
+                              uint16_t stream_height,
+                              int depth,
+                              uint64_t (*draw)(struct clock_stream *stream),
+                              bool set_delay)
 {
-    ge_GIF *gif = ge_new_gif(response->buffer, 320, 64, NULL, 2, -1);
-    struct xdaliclock *xdc;
-    uint32_t one_hour;
+    *stream = (struct clock_stream){
+        .draw = draw,
+        .set_delay = set_delay,
+        .header = LWAN_STRBUF_STATIC_INIT,
+        .delta = LWAN_STRBUF_STATIC_INIT,
+        .full = LWAN_STRBUF_STATIC_INIT,
+    };
 
-    if (!gif)
-        return HTTP_INTERNAL_ERROR;
+    stream->gif = ge_new_gif(&stream->header, stream_width, stream_height,
+                             NULL, depth, -1);
+    if (!stream->gif)
+        return false;
 
-    coro_defer(request->conn->coro, destroy_gif, gif);
+    pthread_mutex_init(&stream->lock, NULL);
 
-    xdc = xdaliclock_new(gif);
-    if (!xdc)
-        return HTTP_INTERNAL_ERROR;
+    return true;
+}
 
-    coro_defer(request->conn->coro, destroy_xdaliclock, xdc);
+static void clock_stream_free(struct clock_stream *stream)
+{
+    ge_close_gif(stream->gif);
+    pthread_mutex_destroy(&stream->lock);
+    lwan_strbuf_free(&stream->header);
+    lwan_strbuf_free(&stream->delta);
+    lwan_strbuf_free(&stream->full);
+}
+
+static enum lwan_http_status stream_clock(struct lwan_request *request,
+                                          struct clock_stream *stream)
+{
+    struct lwan_response *response = &request->response;
+    const uint64_t started = now_ms();
+    uint64_t frame = 0, now = started;
 
     response->mime_type = "image/gif";
     response->headers = seriously_do_not_cache;
 
-    memset(gif->frame, 0, (size_t)(width * height));
+    /* Clients are sent frames for an hour, like they used to be when each
+     * one had its own encoder. */
+    while (now - started <= 3600000) {
+        uint64_t wait, current;
+
+        pthread_mutex_lock(&stream->lock);
+
+        clock_stream_advance(stream, now);
+        if (!frame) {
+            append_strbuf(response->buffer, &stream->header);
+            append_strbuf(response->buffer,
+                          clock_stream_get_full_frame(stream));
+        } else if (stream->frame == frame + 1) {
+            append_strbuf(response->buffer, &stream->delta);
+        } else if (stream->frame != frame) {
+            append_strbuf(response->buffer,
+                          clock_stream_get_full_frame(stream));
+        }
+        current = stream->frame;
+        wait = stream->next_frame_ms - now;
 
-    one_hour = 3600 * 1000 / xdaliclock_get_frame_time(xdc);
-    for (uint32_t frame = 0; frame < one_hour; frame++) {
-        xdaliclock_update(xdc);
+        pthread_mutex_unlock(&stream->lock);
 
-        ge_add_frame(gif, 0);
-        lwan_response_send_chunk(request);
-        lwan_request_sleep(request, xdaliclock_get_frame_time(xdc));
+        /* Sleeping might take a little less than asked for, and sending
+         * an empty chunk would end the response. */
+        if (current != frame) {
+            frame = current;
+            lwan_response_send_chunk(request);
+        }
+        lwan_request_sleep(request, wait);
+
+        now = now_ms();
     }
 
+    lwan_strbuf_append_char(response->buffer, ';');
+
     return HTTP_OK;
 }
 
-LWAN_HANDLER(blocks)
+struct digital_clock {
+    struct clock_stream base;
+    uint8_t dot_visible;
+};
+
+static uint64_t draw_digital_clock(struct clock_stream *stream)
 {
-    ge_GIF *gif = ge_new_gif(response->buffer, 32, 16, NULL, 4, -1);
-    struct blocks blocks;
-    uint64_t total_waited = 0;
-    time_t last = 0;
-    bool odd_second = false;
+    static const uint8_t base_offsets[] = {0, 0, 2, 2, 4, 4};
+    struct digital_clock *clock = (struct digital_clock *)stream;
+    uint8_t *frame = stream->gif->frame;
+    time_t curtime;
+    char digits[8];
+    int digit, line, base;
+
+    curtime = time(NULL);
+    strftime(digits, sizeof(digits), "%H%M%S", my_localtime(&curtime));
+
+    for (digit = 0; digit < 6; digit++) {
+        int dig = digits[digit] - '0';
+        uint8_t off = base_offsets[digit];
+
+        for (line = 0, base = digit * 4; line < 5; line++, base += width) {
+            frame[base + 0 + off] = !!(digital_clock_font[dig][line] & 1<<2);
+            frame[base + 1 + off] = !!(digital_clock_font[dig][line] & 1<<1);
+            frame[base + 2 + off] = !!(digital_clock_font[dig][line] & 1<<0);
+        }
+    }
 
-    if (!gif)
-        return HTTP_INTERNAL_ERROR;
+    frame[8 + width] = clock->dot_visible;
+    frame[18 + width] = clock->dot_visible;
+    frame[8 + width * 3] = clock->dot_visible;
+    frame[18 + width * 3] = clock->dot_visible;
+    clock->dot_visible = clock->dot_visible ? 0 : 3;
 
-    coro_defer(request->conn->coro, destroy_gif, gif);
+    return 500;
+}
 
-    blocks_init(&blocks, gif);
+struct dali_clock {
+    struct clock_stream base;
+    struct xdaliclock *xdc;
+};
 
-    response->mime_type = "image/gif";
-    response->headers = seriously_do_not_cache;
+static uint64_t draw_dali_clock(struct clock_stream *stream)
+{
+    struct dali_clock *clock = (struct dali_clock *)stream;
 
-    while (total_waited <= 3600000) {
-        uint64_t timeout;
-        time_t curtime;
+    xdaliclock_update(clock->xdc);
 
-        curtime = time(NULL);
-        if (curtime != last) {
-            char digits[5];
+    return xdaliclock_get_frame_time(clock->xdc);
+}
 
-            strftime(digits, sizeof(digits), "%H%M", my_localtime(&curtime));
-            last = curtime;
-            odd_second = last & 1;
+struct blocks_clock {
+    struct clock_stream base;
+    struct blocks blocks;
+    time_t last;
+    bool odd_second;
+};
 
-            for (int i = 0; i < 4; i++)
-                blocks.states[i].num_to_draw = digits[i] - '0';
-        }
+static uint64_t draw_blocks_clock(struct clock_stream *stream)
+{
+    struct blocks_clock *clock = (struct blocks_clock *)stream;
+    time_t curtime;
 
-        timeout = blocks_draw(&blocks, odd_second);
-        total_waited += timeout;
+    curtime = time(NULL);
+    if (curtime != clock->last) {
+        char digits[5];
 
-        ge_add_frame(gif, 0);
-        lwan_response_send_chunk(request);
-        lwan_request_sleep(request, timeout);
+        strftime(digits, sizeof(digits), "%H%M", my_localtime(&curtime));
+        clock->last = curtime;
+        clock->odd_second = clock->last & 1;
+
+        for (int i = 0; i < 4; i++)
+            clock->blocks.states[i].num_to_draw = digits[i] - '0';
     }
 
-    return HTTP_OK;
+    return blocks_draw(&clock->blocks, clock->odd_second);
 }
 
-LWAN_HANDLER(pong)
-{
-    ge_GIF *gif = ge_new_gif(response->buffer, 64, 32, NULL, 4, -1);
+struct pong_clock {
+    struct clock_stream base;
     struct pong pong;
-    uint64_t total_waited = 0;
+};
 
-    if (!gif)
-        return HTTP_INTERNAL_ERROR;
+static uint64_t draw_pong_clock(struct clock_stream *stream)
+{
+    struct pong_clock *clock = (struct pong_clock *)stream;
 
-    coro_defer(request->conn->coro, destroy_gif, gif);
+    return pong_draw(&clock->pong);
+}
 
-    pong_init(&pong, gif);
+static struct digital_clock digital_stream;
+static struct dali_clock dali_stream;
+static struct blocks_clock blocks_stream;
+static struct pong_clock pong_stream;
 
-    response->mime_type = "image/gif";
-    response->headers = seriously_do_not_cache;
+static void init_clock_streams(void)
+{
+    if (!clock_stream_init(&digital_stream.base, width, height, 2,
+                           draw_digital_clock, false))
+        lwan_status_critical("Could not create digital clock");
+
+    if (!clock_stream_init(&dali_stream.base, 320, 64, 2, draw_dali_clock,
+                           false))
+        lwan_status_critical("Could not create Dali clock");
+    dali_stream.xdc = xdaliclock_new(dali_stream.base.gif);
+    if (!dali_stream.xdc)
+        lwan_status_critical("Could not create Dali clock");
+
+    if (!clock_stream_init(&blocks_stream.base, 32, 16, 4, draw_blocks_clock,
+                           false))
+        lwan_status_critical("Could not create blocks clock");
+    blocks_init(&blocks_stream.blocks, blocks_stream.base.gif);
+
+    if (!clock_stream_init(&pong_stream.base, 64, 32, 4, draw_pong_clock,
+                           true))
+        lwan_status_critical("Could not create pong clock");
+    pong_init(&pong_stream.pong, pong_stream.base.gif);
+}
 
-    while (total_waited <= 3600000) {
-        uint64_t timeout;
+static void free_clock_streams(void)
+{
+    xdaliclock_free(dali_stream.xdc);
 
-        timeout = pong_draw(&pong);
-        total_waited += timeout;
+    clock_stream_free(&digital_stream.base);
+    clock_stream_free(&dali_stream.base);
+    clock_stream_free(&blocks_stream.base);
+    clock_stream_free(&pong_stream.base);
+}
 
-        ge_add_frame(gif, (uint16_t)timeout);
-        lwan_response_send_chunk(request);
-        lwan_request_sleep(request, timeout);
-    }
+LWAN_HANDLER(clock)
+{
+    return stream_clock(request, &digital_stream.base);
+}
 
-    return HTTP_OK;
+LWAN_HANDLER(dali)
+{
+    return stream_clock(request, &dali_stream.base);
+}
+
+LWAN_HANDLER(blocks)
+{
+    return stream_clock(request, &blocks_stream.base);
+}
+
+LWAN_HANDLER(pong)
+{
+    return stream_clock(request, &pong_stream.base);
 }
 
 struct index {
@@ -315,7 +451,9 @@ __attribute__((constructor)) static void initialize_template(void)
 
 LWAN_HANDLER(templated_index)
 {
-    if (lwan_tpl_apply_with_buffer(index_tpl, response->buffer, data)) {
+    struct lwan_chain *chain = lwan_response_get_chain(request);
+
+    if (chain && lwan_tpl_apply_with_chain(index_tpl, chain, data)) {
         response->mime_type = "text/html";
         return HTTP_OK;
     }
@@ -411,10 +549,14 @@ int main(void)
 
     lwan_init(&l);
 
+    init_clock_streams();
+
     lwan_set_url_map(&l, default_map);
     lwan_main_loop(&l);
 
     lwan_shutdown(&l);
 
+    free_clock_streams();
+
     return 0;
 }
@@ -23,15 +23,21 @@
 
 #define _DEFAULT_SOURCE
 #include <arpa/inet.h>
+#include <fcntl.h>
 #include <sqlite3.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #include "lwan.h"
 #include "lwan-cache.h"
 #include "lwan-mod-serve-files.h"
 #include "lwan-template.h"
 
+#include "ipdb.h"
+
 /* Set to 0 to disable */
 #define QUERIES_PER_HOUR 10000
 
@@ -182,6 +188,18 @@ static struct cache *query_limit;
 static struct cache *cache = NULL;
 static sqlite3 *db = NULL;
 
+/* If an index generated by ipdbgen is available, addresses are looked up
+ * directly in it, and neither the database nor the cache are used. */
+static struct ipdb {
+    void *map;
+    size_t size;
+    const struct ipdb_header *header;
+    const uint32_t *range_start;
+    const uint32_t *range_location;
+    const struct ipdb_location *locations;
+    const char *strings;
+} ipdb;
+
 static bool net_contains_ip(const struct ip_net *net, in_addr_t ip)
 {
     union ip_to_octet _ip = {.ip = ip};
@@ -291,6 +309,179 @@ end_no_finalize:
     return (struct cache_entry *)ip_info;
 }
 
+static bool ipdb_section_is_valid(const struct ipdb *index,
+                                  uint64_t offset,
+                                  uint64_t size)
+{
+    return !(offset % 8) && offset <= index->size &&
+           size <= index->size - offset;
+}
+
+static bool ipdb_string_is_valid(const struct ipdb *index, uint32_t offset)
+{
+    return offset == IPDB_NO_STRING || offset < index->header->strings_size;
+}
+
+static bool ipdb_is_valid(const struct ipdb *index)
+{
+    const struct ipdb_header *header = index->header;
+
+    if (index->size < sizeof(*header))
+        return false;
+    if (memcmp(header->magic, IPDB_MAGIC, sizeof(header->magic)) ||
+        header->version != IPDB_VERSION)
+        return false;
+
+    if (!ipdb_section_is_valid(index, header->range_start_offset,
+                               (uint64_t)header->n_ranges * sizeof(uint32_t)) ||
+        !ipdb_section_is_valid(index, header->range_location_offset,
+                               (uint64_t)header->n_ranges * sizeof(uint32_t)) ||
+        !ipdb_section_is_valid(index, header->locations_offset,
+                               (uint64_t)header->n_locations *
+                                   sizeof(struct ipdb_location)) ||
+        !ipdb_section_is_valid(index, header->strings_offset,
+                               header->strings_size))
+        return false;
+
+    if (header->strings_size &&
+        index->strings[header->strings_size - 1] != '\0')
+        return false;
+
+    /* Check everything once here, so that lookups don't have to. */
+    for (uint32_t i = 0; i < header->n_locations; i++) {
+        const struct ipdb_location *l = &index->locations[i];
+
+        if (!ipdb_string_is_valid(index, l->country_code) ||
+            !ipdb_string_is_valid(index, l->country_name) ||
+            !ipdb_string_is_valid(index, l->region_code) ||
+            !ipdb_string_is_valid(index, l->region_name) ||
+            !ipdb_string_is_valid(index, l->city_name) ||
+            !ipdb_string_is_valid(index, l->zip_code) ||
+            !ipdb_string_is_valid(index, l->metro_code) ||
+            !ipdb_string_is_valid(index, l->area_code))
+            return false;
+    }
+    for (uint32_t i = 0; i < header->n_ranges; i++) {
+        if (index->range_location[i] >= header->n_locations)
+            return false;
+        if (i && index->range_start[i - 1] >= index->range_start[i])
+            return false;
+    }
+
+    return true;
+}
+
+static bool ipdb_open(struct ipdb *index, const char *path)
+{
+    struct stat st;
+    int fd;
+
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return false;
+
+    if (fstat(fd, &st) < 0 || st.st_size <= 0) {
+        close(fd);
+        return false;
+    }
+
+    index->size = (size_t)st.st_size;
+    index->map = mmap(NULL, index->size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (index->map == MAP_FAILED) {
+        index->map = NULL;
+        return false;
+    }
+
+    madvise(index->map, index->size, MADV_WILLNEED);
+
+    const char *base = index->map;
+    index->header = index->map;
+    if (index->size >= sizeof(*index->header)) {
+        index->range_start =
+            (const uint32_t *)(base + index->header->range_start_offset);
+        index->range_location =
+            (const uint32_t *)(base + index->header->range_location_offset);
+        index->locations = (const struct ipdb_location *)(
+            base + index->header->locations_offset);
+        index->strings = base + index->header->strings_offset;
+    }
+
+    if (!ipdb_is_valid(index)) {
+        lwan_status_error("GeoIP index %s is invalid", path);
+        munmap(index->map, index->size);
+        index->map = NULL;
+        return false;
+    }
+
+    return true;
+}
+
+static char *ipdb_string(const struct ipdb *index, uint32_t offset)
+{
+    return offset == IPDB_NO_STRING ? NULL : (char *)index->strings + offset;
+}
+
+/* Finds the range with the largest start that's not greater than @ip. */
+static const struct ipdb_location *ipdb_lookup(const struct ipdb *index,
+                                               uint32_t ip)
+{
+    const uint32_t *base = index->range_start;
+    size_t n = index->header->n_ranges;
+
+    if (UNLIKELY(!n || ip < base[0]))
+        return NULL;
+
+    while (n > 1) {
+        size_t half = n / 2;
+
+        base = (base[half] <= ip) ? base + half : base;
+        n -= half;
+    }
+
+    return &index->locations[index->range_location[base - index->range_start]];
+}
+
+/* Like create_ipinfo(), but without allocating anything: strings in
+ * @ip_info point to the index (or to @query). */
+static bool ipdb_query(const struct ipdb *index,
+                       const char *query,
+                       struct ip_info *ip_info)
+{
+    const struct ipdb_location *location;
+    struct in_addr addr;
+
+    if (UNLIKELY(!inet_aton(query, &addr)))
+        return false;
+
+    if (is_reserved_ip(addr.s_addr)) {
+        *ip_info = (struct ip_info){
+            .country = {.code = "RD", .name = "Reserved"},
+            .ip = (char *)query,
+        };
+        return true;
+    }
+
+    location = ipdb_lookup(index, ntohl(addr.s_addr));
+    if (UNLIKELY(!location))
+        return false;
+
+    *ip_info = (struct ip_info){
+        .country.code = ipdb_string(index, location->country_code),
+        .country.name = ipdb_string(index, location->country_name),
+        .region.code = ipdb_string(index, location->region_code),
+        .region.name = ipdb_string(index, location->region_name),
+        .city.name = ipdb_string(index, location->city_name),
+        .city.zip_code = ipdb_string(index, location->zip_code),
+        .latitude = location->latitude,
+        .longitude = location->longitude,
+        .metro.code = ipdb_string(index, location->metro_code),
+        .metro.area = ipdb_string(index, location->area_code),
+        .ip = (char *)query,
+    };
+    return true;
+}
+
 #if QUERIES_PER_HOUR != 0
 static struct cache_entry *
 create_query_limit(const void *key __attribute__((unused)),
@@ -310,8 +501,9 @@ static void destroy_query_limit(struct cache_entry *entry,
 }
 #endif
 
-static struct ip_info *internal_query(struct lwan_request *request,
-                                      const char *ip_address)
+static bool internal_query(struct lwan_request *request,
+                           const char *ip_address,
+                           struct ip_info *ip_info)
 {
     const char *query;
 
@@ -322,10 +514,19 @@ static struct ip_info *internal_query(struct lwan_request *request,
     else
         query = request->url.value;
     if (UNLIKELY(!query))
-        return NULL;
+        return false;
+
+    if (ipdb.map)
+        return ipdb_query(&ipdb, query, ip_info);
+
+    const struct ip_info *cached =
+        (const struct ip_info *)cache_coro_get_and_ref_entry(
+            cache, request->conn->coro, query);
+    if (UNLIKELY(!cached))
+        return false;
 
-    return (struct ip_info *)cache_coro_get_and_ref_entry(
-        cache, request->conn->coro, query);
+    *ip_info = *cached;
+    return true;
 }
 
 #if QUERIES_PER_HOUR != 0
@@ -351,7 +552,7 @@ LWAN_HANDLER(templated_output)
 {
     const struct template_mime *tm = data;
     const char *ip_address;
-    struct ip_info *info;
+    struct ip_info info;
     char ip_address_buf[INET6_ADDRSTRLEN];
 
     ip_address = lwan_request_get_remote_address(request, ip_address_buf);
@@ -363,16 +564,12 @@ LWAN_HANDLER(templated_output)
         return HTTP_FORBIDDEN;
 #endif
 
-    info = internal_query(request, ip_address);
-    if (UNLIKELY(!info))
+    if (UNLIKELY(!internal_query(request, ip_address, &info)))
         return HTTP_NOT_FOUND;
 
-    const char *callback = lwan_request_get_query_param(request, "callback");
-    struct ip_info info_with_callback = *info;
-    info_with_callback.callback = callback;
+    info.callback = lwan_request_get_query_param(request, "callback");
 
-    if (!lwan_tpl_apply_with_buffer(tm->tpl, response->buffer,
-                                    &info_with_callback)) {
+    if (!lwan_tpl_apply_with_buffer(tm->tpl, response->buffer, &info)) {
         return HTTP_INTERNAL_ERROR;
     }
 
@@ -408,15 +605,21 @@ int main(void)
     struct template_mime xml_tpl =
         compile_template(xml_template_str, "text/plain; charset=UTF-8");
 
-    int result =
-        sqlite3_open_v2("./db/ipdb.sqlite", &db, SQLITE_OPEN_READONLY, NULL);
-    if (result != SQLITE_OK)
-        lwan_status_critical("Could not open database: %s", sqlite3_errmsg(db));
-    cache = cache_create(create_ipinfo, destroy_ipinfo, NULL, 10);
-
-    sqlite3_exec(db, "PRAGMA mmap_size=123217920", NULL, NULL, NULL);
-    sqlite3_exec(db, "PRAGMA journal_mode=OFF", NULL, NULL, NULL);
-    sqlite3_exec(db, "PRAGMA locking_mode=EXCLUSIVE", NULL, NULL, NULL);
+    if (ipdb_open(&ipdb, "./db/ipdb.index")) {
+        lwan_status_info("Using GeoIP index with %u ranges",
+                         ipdb.header->n_ranges);
+    } else {
+        int result = sqlite3_open_v2("./db/ipdb.sqlite", &db,
+                                     SQLITE_OPEN_READONLY, NULL);
+        if (result != SQLITE_OK)
+            lwan_status_critical("Could not open database: %s",
+                                 sqlite3_errmsg(db));
+        cache = cache_create(create_ipinfo, destroy_ipinfo, NULL, 10);
+
+        sqlite3_exec(db, "PRAGMA mmap_size=123217920", NULL, NULL, NULL);
+        sqlite3_exec(db, "PRAGMA journal_mode=OFF", NULL, NULL, NULL);
+        sqlite3_exec(db, "PRAGMA locking_mode=EXCLUSIVE", NULL, NULL, NULL);
+    }
 
 #if QUERIES_PER_HOUR != 0
     lwan_status_info("Limiting to %d queries per hour per client",
@@ -451,8 +654,12 @@ int main(void)
 #if QUERIES_PER_HOUR != 0
     cache_destroy(query_limit);
 #endif
-    cache_destroy(cache);
-    sqlite3_close(db);
+    if (ipdb.map) {
+        munmap(ipdb.map, ipdb.size);
+    } else {
+        cache_destroy(cache);
+        sqlite3_close(db);
+    }
 
     return 0;
 }
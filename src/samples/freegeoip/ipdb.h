@@ -0,0 +1,65 @@
+/*
+ * lwan - web server
+ * Copyright (c) 2024 L. A. F. Pereira <l@tia.mat.br>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301,
+ * USA.
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+/* Layout of the GeoIP index written by ipdbgen and memory-mapped by
+ * freegeoip.  Everything is in host byte order, and every section starts
+ * at an offset that's a multiple of 8 bytes:
+ *
+ *   struct ipdb_header
+ *   uint32_t range_start[n_ranges]      first IPv4 address of each range,
+ *                                       sorted in ascending order
+ *   uint32_t range_location[n_ranges]   index in the location table
+ *   struct ipdb_location[n_locations]
+ *   char strings[strings_size]          NUL-terminated, each one once
+ *
+ * An address belongs to the range with the largest start that's not
+ * greater than it. */
+
+#define IPDB_MAGIC "LWANIPDB"
+#define IPDB_VERSION 1
+
+/* Offset of a string field that was NULL in the database. */
+#define IPDB_NO_STRING UINT32_MAX
+
+struct ipdb_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t n_ranges;
+    uint32_t n_locations;
+    uint32_t strings_size;
+
+    uint64_t range_start_offset;
+    uint64_t range_location_offset;
+    uint64_t locations_offset;
+    uint64_t strings_offset;
+};
+
+/* String fields are offsets in the string table. */
+struct ipdb_location {
+    uint32_t country_code, country_name;
+    uint32_t region_code, region_name;
+    uint32_t city_name, zip_code;
+    uint32_t metro_code, area_code;
+    double latitude, longitude;
+};
@@ -0,0 +1,317 @@
+/*
+ * lwan - web server
+ * Copyright (c) 2024 L. A. F. Pereira <l@tia.mat.br>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301,
+ * USA.
+ */
+
+/* Compiles the freegeoip SQLite database into the index described in
+ * ipdb.h, so that freegeoip can look addresses up without running any
+ * query or allocating any memory.
+ * Usage: ipdbgen /path/to/ipdb.sqlite /path/to/ipdb.index */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <sqlite3.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "hash.h"
+#include "lwan-array.h"
+#include "lwan-strbuf.h"
+
+#include "ipdb.h"
+
+/* Same joins as the query in freegeoip.c, for every block at once. */
+static const char blocks_query[] =
+    "SELECT "
+    "   city_blocks.ip_start,"
+    "   city_location.country_code, country_blocks.country_name,"
+    "   city_location.region_code, region_names.region_name,"
+    "   city_location.city_name, city_location.postal_code,"
+    "   city_location.latitude, city_location.longitude,"
+    "   city_location.metro_code, city_location.area_code "
+    "FROM city_blocks "
+    "   NATURAL JOIN city_location "
+    "   INNER JOIN country_blocks ON "
+    "      city_location.country_code = country_blocks.country_code "
+    "   INNER JOIN region_names ON "
+    "      city_location.country_code = region_names.country_code "
+    "      AND "
+    "      city_location.region_code = region_names.region_code "
+    "ORDER BY city_blocks.ip_start";
+
+DEFINE_ARRAY_TYPE(uint32_array, uint32_t)
+DEFINE_ARRAY_TYPE(location_array, struct ipdb_location)
+
+struct index {
+    struct uint32_array range_start;
+    struct uint32_array range_location;
+    struct location_array locations;
+
+    struct lwan_strbuf strings;
+    /* Both map to offsets (or indices) plus one, as NULL means "not
+     * found". */
+    struct hash *string_offsets;
+    struct hash *location_indices;
+};
+
+static bool intern_string(struct index *index,
+                          sqlite3_stmt *stmt,
+                          int column,
+                          uint32_t *offset)
+{
+    const char *value = (const char *)sqlite3_column_text(stmt, column);
+
+    if (!value) {
+        *offset = IPDB_NO_STRING;
+        return true;
+    }
+
+    uintptr_t found = (uintptr_t)hash_find(index->string_offsets, value);
+    if (found) {
+        *offset = (uint32_t)(found - 1);
+        return true;
+    }
+
+    size_t len = lwan_strbuf_get_length(&index->strings);
+    if (len >= IPDB_NO_STRING - strlen(value) - 1)
+        return false;
+
+    char *key = strdup(value);
+    if (!key)
+        return false;
+    if (hash_add_unique(index->string_offsets, key,
+                        (void *)(uintptr_t)(len + 1))) {
+        free(key);
+        return false;
+    }
+
+    if (!lwan_strbuf_append_str(&index->strings, value, strlen(value) + 1))
+        return false;
+
+    *offset = (uint32_t)len;
+    return true;
+}
+
+static bool intern_location(struct index *index,
+                            const struct ipdb_location *location,
+                            uint32_t *location_index)
+{
+    char key[128];
+
+    snprintf(key, sizeof(key), "%x,%x,%x,%x,%x,%x,%x,%x,%a,%a",
+             location->country_code, location->country_name,
+             location->region_code, location->region_name,
+             location->city_name, location->zip_code, location->metro_code,
+             location->area_code, location->latitude, location->longitude);
+
+    uintptr_t found = (uintptr_t)hash_find(index->location_indices, key);
+    if (found) {
+        *location_index = (uint32_t)(found - 1);
+        return true;
+    }
+
+    size_t n_locations = location_array_len(&index->locations);
+    if (n_locations >= UINT32_MAX)
+        return false;
+
+    struct ipdb_location *l = location_array_append(&index->locations);
+    if (!l)
+        return false;
+    *l = *location;
+
+    char *key_copy = strdup(key);
+    if (!key_copy)
+        return false;
+    if (hash_add_unique(index->location_indices, key_copy,
+                        (void *)(uintptr_t)(n_locations + 1))) {
+        free(key_copy);
+        return false;
+    }
+
+    *location_index = (uint32_t)n_locations;
+    return true;
+}
+
+static bool add_block(struct index *index, sqlite3_stmt *stmt)
+{
+    struct ipdb_location location;
+    sqlite3_int64 ip_start = sqlite3_column_int64(stmt, 0);
+    size_t n_ranges = uint32_array_len(&index->range_start);
+
+    if (ip_start < 0 || ip_start > UINT32_MAX) {
+        fprintf(stderr, "Skipping block with invalid start address %lld\n",
+                (long long)ip_start);
+        return true;
+    }
+    /* The query in freegeoip.c would pick any one of these. */
+    if (n_ranges &&
+        *uint32_array_get_elem(&index->range_start, n_ranges - 1) ==
+            (uint32_t)ip_start)
+        return true;
+
+    if (!intern_string(index, stmt, 1, &location.country_code) ||
+        !intern_string(index, stmt, 2, &location.country_name) ||
+        !intern_string(index, stmt, 3, &location.region_code) ||
+        !intern_string(index, stmt, 4, &location.region_name) ||
+        !intern_string(index, stmt, 5, &location.city_name) ||
+        !intern_string(index, stmt, 6, &location.zip_code) ||
+        !intern_string(index, stmt, 9, &location.metro_code) ||
+        !intern_string(index, stmt, 10, &location.area_code))
+        return false;
+    location.latitude = sqlite3_column_double(stmt, 7);
+    location.longitude = sqlite3_column_double(stmt, 8);
+
+    uint32_t *start = uint32_array_append(&index->range_start);
+    uint32_t *location_index = uint32_array_append(&index->range_location);
+    if (!start || !location_index)
+        return false;
+
+    *start = (uint32_t)ip_start;
+    return intern_location(index, &location, location_index);
+}
+
+static bool write_section(FILE *out, const void *data, size_t size)
+{
+    static const char padding[8];
+
+    if (size && fwrite(data, size, 1, out) != 1)
+        return false;
+
+    size_t pad = (8 - size % 8) % 8;
+    return !pad || fwrite(padding, pad, 1, out) == 1;
+}
+
+static uint64_t align8(uint64_t offset) { return (offset + 7) & ~(uint64_t)7; }
+
+static bool write_index(const struct index *index, FILE *out)
+{
+    const size_t n_ranges = uint32_array_len(&index->range_start);
+    const size_t n_locations = location_array_len(&index->locations);
+    const size_t strings_size = lwan_strbuf_get_length(&index->strings);
+    struct ipdb_header header = {
+        .version = IPDB_VERSION,
+        .n_ranges = (uint32_t)n_ranges,
+        .n_locations = (uint32_t)n_locations,
+        .strings_size = (uint32_t)strings_size,
+    };
+
+    memcpy(header.magic, IPDB_MAGIC, sizeof(header.magic));
+    header.range_start_offset = align8(sizeof(header));
+    header.range_location_offset =
+        align8(header.range_start_offset + n_ranges * sizeof(uint32_t));
+    header.locations_offset =
+        align8(header.range_location_offset + n_ranges * sizeof(uint32_t));
+    header.strings_offset = align8(
+        header.locations_offset + n_locations * sizeof(struct ipdb_location));
+
+    return write_section(out, &header, sizeof(header)) &&
+           write_section(out, index->range_start.base.base,
+                         n_ranges * sizeof(uint32_t)) &&
+           write_section(out, index->range_location.base.base,
+                         n_ranges * sizeof(uint32_t)) &&
+           write_section(out, index->locations.base.base,
+                         n_locations * sizeof(struct ipdb_location)) &&
+           write_section(out, lwan_strbuf_get_buffer(&index->strings),
+                         strings_size);
+}
+
+int main(int argc, char *argv[])
+{
+    struct index index = {
+        .strings = LWAN_STRBUF_STATIC_INIT,
+    };
+    sqlite3_stmt *stmt;
+    sqlite3 *db;
+    int ret = 1;
+    int step;
+
+    if (argc != 3) {
+        fprintf(stderr, "Usage: %s /path/to/ipdb.sqlite /path/to/ipdb.index\n",
+                argv[0]);
+        return 1;
+    }
+
+    if (sqlite3_open_v2(argv[1], &db, SQLITE_OPEN_READONLY, NULL) !=
+        SQLITE_OK) {
+        fprintf(stderr, "Could not open database %s: %s\n", argv[1],
+                sqlite3_errmsg(db));
+        sqlite3_close(db);
+        return 1;
+    }
+
+    if (sqlite3_prepare_v2(db, blocks_query, sizeof(blocks_query) - 1, &stmt,
+                           NULL) != SQLITE_OK) {
+        fprintf(stderr, "Could not prepare query: %s\n", sqlite3_errmsg(db));
+        goto out_close_db;
+    }
+
+    uint32_array_init(&index.range_start);
+    uint32_array_init(&index.range_location);
+    location_array_init(&index.locations);
+    index.string_offsets = hash_str_new(free, NULL);
+    index.location_indices = hash_str_new(free, NULL);
+    if (!index.string_offsets || !index.location_indices) {
+        fprintf(stderr, "Could not allocate hash tables\n");
+        goto out;
+    }
+
+    while ((step = sqlite3_step(stmt)) == SQLITE_ROW) {
+        if (!add_block(&index, stmt)) {
+            fprintf(stderr, "Could not add block to index: %s\n",
+                    strerror(errno));
+            goto out;
+        }
+    }
+    if (step != SQLITE_DONE) {
+        fprintf(stderr, "Could not read blocks: %s\n", sqlite3_errmsg(db));
+        goto out;
+    }
+
+    FILE *out = fopen(argv[2], "we");
+    if (!out) {
+        fprintf(stderr, "Could not open %s: %s\n", argv[2], strerror(errno));
+        goto out;
+    }
+    bool written = write_index(&index, out);
+    if (fclose(out) || !written) {
+        fprintf(stderr, "Could not write %s: %s\n", argv[2], strerror(errno));
+        goto out;
+    }
+
+    printf("%zu ranges, %zu locations, %zu bytes of strings\n",
+           uint32_array_len(&index.range_start),
+           location_array_len(&index.locations),
+           lwan_strbuf_get_length(&index.strings));
+    ret = 0;
+
+out:
+    if (index.string_offsets)
+        hash_unref(index.string_offsets);
+    if (index.location_indices)
+        hash_unref(index.location_indices);
+    uint32_array_reset(&index.range_start);
+    uint32_array_reset(&index.range_location);
+    location_array_reset(&index.locations);
+    lwan_strbuf_free(&index.strings);
+    sqlite3_finalize(stmt);
+out_close_db:
+    sqlite3_close(db);
+
+    return ret;
+}
@@ -20,84 +20,44 @@
 
 #define _GNU_SOURCE
 #include <errno.h>
+#include <inttypes.h>
 #include <stdlib.h>
 #include <string.h>
 
-#include "hash.h"
 #include "int-to-str.h"
 #include "lwan.h"
-#include "lwan-cache.h"
+#include "lwan-io-wrappers.h"
 #include "lwan-private.h"
 
-#define CACHE_FOR_HOURS 2
-
-static struct cache *pastes;
-
-struct paste {
-    struct cache_entry entry;
-    size_t len;
-    char value[];
-};
-
-static struct cache_entry *
-create_paste(const void *key, void *cache_ctx, void *create_ctx)
-{
-    const struct lwan_value *body = create_ctx;
-    size_t alloc_size;
-
-    if (!body)
-        return NULL;
-
-    if (__builtin_add_overflow(sizeof(struct paste), body->len, &alloc_size))
-        return NULL;
-
-    struct paste *paste = malloc(alloc_size);
-    if (paste) {
-        paste->len = body->len;
-        memcpy(paste->value, body->value, body->len);
-    }
+#include "store.h"
 
-    return (struct cache_entry *)paste;
-}
+#define CACHE_FOR_HOURS 2
 
-static void destroy_paste(struct cache_entry *entry, void *context)
-{
-    free(entry);
-}
+static struct paste_store *store;
 
 static enum lwan_http_status post_paste(struct lwan_request *request,
                                         struct lwan_response *response)
 {
     const struct lwan_value *body = lwan_request_get_request_body(request);
+    enum lwan_http_status status;
+    uint64_t key;
 
     if (!body)
         return HTTP_BAD_REQUEST;
 
-    for (int try = 0; try < 10; try++) {
-        void *key;
-
-        do {
-            key = (void *)(uintptr_t)lwan_random_uint64();
-        } while (!key);
-
-        struct cache_entry *paste = cache_coro_get_and_ref_entry_with_ctx(
-            pastes, request->conn->coro, key, (void *)body);
-
-        if (paste) {
-            const char *host_hdr = lwan_request_get_host(request);
-
-            if (!host_hdr)
-                return HTTP_BAD_REQUEST;
+    const char *host_hdr = lwan_request_get_host(request);
+    if (!host_hdr)
+        return HTTP_BAD_REQUEST;
 
-            response->mime_type = "text/plain";
-            lwan_strbuf_printf(response->buffer, "https://%s/p/%zu\n\n",
-                               host_hdr, (uint64_t)(uintptr_t)key);
+    status = store->add(store, request, body, &key);
+    if (status != HTTP_OK)
+        return status;
 
-            return HTTP_OK;
-        }
-    }
+    response->mime_type = "text/plain";
+    lwan_strbuf_printf(response->buffer, "https://%s/p/%" PRIu64 "\n\n",
+                       host_hdr, key);
 
-    return HTTP_UNAVAILABLE;
+    return HTTP_OK;
 }
 
 static enum lwan_http_status doc(struct lwan_request *request,
@@ -123,8 +83,8 @@ static enum lwan_http_status doc(struct lwan_request *request,
         "                    Extension suffixes may be used to provide "
         "response with different MIME-type.\n"
         "\n"
-        "Items are cached for %d hours and are not stored on disk",
-        host_hdr, host_hdr, CACHE_FOR_HOURS);
+        "%s",
+        host_hdr, host_hdr, store->description);
 
     return HTTP_OK;
 }
@@ -160,6 +120,37 @@ static bool parse_uint64(const char *s, uint64_t *out)
     return true;
 }
 
+static enum lwan_http_status send_paste_file(struct lwan_request *request,
+                                             void *data)
+{
+    const struct paste *paste = data;
+    char content_length[INT_TO_STR_BUFFER_SIZE];
+    char headers[DEFAULT_HEADERS_SIZE];
+    size_t header_len;
+    size_t discard;
+
+    header_len = lwan_prepare_response_header_full(
+        request, HTTP_OK, headers, sizeof(headers),
+        (const struct lwan_key_value[]){
+            {
+                .key = "Content-Length",
+                .value = uint_to_string(paste->len, content_length, &discard),
+            },
+            {},
+        });
+    if (UNLIKELY(!header_len))
+        return HTTP_INTERNAL_ERROR;
+
+    if (lwan_request_get_method(request) == REQUEST_METHOD_HEAD) {
+        lwan_send(request, headers, header_len, 0);
+    } else {
+        lwan_sendfile(request, paste->fd, paste->offset, paste->len, headers,
+                      header_len);
+    }
+
+    return HTTP_OK;
+}
+
 LWAN_HANDLER_ROUTE(view_paste, "/p/")
 {
     char *dot = memrchr(request->url.value, '.', request->url.len);
@@ -177,36 +168,53 @@ LWAN_HANDLER_ROUTE(view_paste, "/p/")
     if (!parse_uint64(request->url.value, &key))
         return HTTP_BAD_REQUEST;
 
-    struct paste *paste = (struct paste *)cache_coro_get_and_ref_entry(
-        pastes, request->conn->coro, (void *)(uintptr_t)key);
-
-    if (!paste)
+    struct paste paste;
+    if (!store->get(store, request, key, &paste))
         return HTTP_NOT_FOUND;
 
     response->mime_type = mime_type;
-    lwan_strbuf_set_static(response->buffer, paste->value, paste->len);
+
+    if (paste.value) {
+        lwan_strbuf_set_static(response->buffer, paste.value, paste.len);
+        return HTTP_OK;
+    }
+
+    struct paste *file_paste = coro_memdup(request->conn->coro, &paste,
+                                           sizeof(paste));
+    if (!file_paste)
+        return HTTP_INTERNAL_ERROR;
+
+    response->stream.callback = send_paste_file;
+    response->stream.data = file_paste;
+    request->flags |= RESPONSE_STREAM;
 
     return HTTP_OK;
 }
 
+/* Pastes are kept in the directory named by the PASTEBIN_STORE environment
+ * variable ("pastes" if it's not set), or in memory for a while if it's
+ * set to "memory". */
 int main(void)
 {
+    const char *store_dir = getenv("PASTEBIN_STORE");
     struct lwan l;
 
     lwan_init(&l);
 
     lwan_detect_url_map(&l);
 
-    pastes = cache_create_full(create_paste,
-                               destroy_paste,
-                               hash_int64_new,
-                               NULL,
-                               CACHE_FOR_HOURS * 60 * 60);
-    if (!pastes)
-        lwan_status_critical("Could not create paste cache");
+    if (!store_dir)
+        store_dir = "pastes";
+    if (streq(store_dir, "memory"))
+        store = paste_store_memory_new(CACHE_FOR_HOURS);
+    else
+        store = paste_store_log_new(store_dir);
+    if (!store)
+        lwan_status_critical("Could not create paste store");
 
     lwan_main_loop(&l);
 
+    store->destroy(store);
     lwan_shutdown(&l);
 
     return 0;
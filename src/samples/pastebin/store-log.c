@@ -0,0 +1,545 @@
+/*
+ * lwan - web server
+ * Copyright (c) 2024 L. A. F. Pereira <l@tia.mat.br>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301,
+ * USA.
+ */
+
+/* Keeps pastes in a directory with two files:
+ *
+ *   log     LOG_MAGIC, followed by each paste as a struct log_record and
+ *           its contents.  Pastes are only ever appended.
+ *   index   A memory-mapped open addressing hash table, from the SHA-1 of
+ *           the contents of each paste to where they are in the log.  It
+ *           can be rebuilt from the log, and is brought up to date with it
+ *           when the store is opened.
+ *
+ * Keys are the first 64 bits of the SHA-1, so the same paste is only
+ * stored once.  Everything is in host byte order. */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "lwan-private.h"
+#include "sha1.h"
+
+#include "store.h"
+
+#define LOG_MAGIC "LWANPLOG"
+#define INDEX_MAGIC "LWANPIDX"
+#define INDEX_VERSION 1
+#define INDEX_INITIAL_CAPACITY 1024
+
+#define DIGEST_LEN 20
+
+struct log_record {
+    uint8_t digest[DIGEST_LEN];
+    uint32_t reserved;
+    uint64_t len;
+};
+
+struct index_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t reserved;
+    uint64_t capacity; /* Power of two */
+    uint64_t count;
+    uint64_t log_size; /* Records before this offset are in the index */
+};
+
+struct index_slot {
+    uint8_t digest[DIGEST_LEN];
+    uint32_t reserved;
+    uint64_t offset; /* Of the contents in the log; 0 if the slot is empty */
+    uint64_t len;
+};
+
+struct log_store {
+    struct paste_store base;
+
+    /* Held while appending, which is also the only time the index is
+     * changed. */
+    pthread_mutex_t append_lock;
+    /* Held for writing while changing the index, and for reading while
+     * looking something up. */
+    pthread_rwlock_t index_lock;
+
+    int dir_fd;
+    int log_fd;
+    struct index_header *index;
+    size_t index_size;
+};
+
+static uint64_t digest_key(const uint8_t digest[static DIGEST_LEN])
+{
+    uint64_t key;
+
+    memcpy(&key, digest, sizeof(key));
+    return key;
+}
+
+static size_t index_size(uint64_t capacity)
+{
+    return sizeof(struct index_header) + capacity * sizeof(struct index_slot);
+}
+
+/* Returns the slot with @key, or the empty slot where it would go. */
+static struct index_slot *index_probe(struct index_header *index, uint64_t key)
+{
+    struct index_slot *slots = (struct index_slot *)(index + 1);
+    const uint64_t mask = index->capacity - 1;
+
+    /* The index is never full, so this always finds something. */
+    for (uint64_t i = key & mask;; i = (i + 1) & mask) {
+        struct index_slot *slot = &slots[i];
+
+        if (!slot->offset || digest_key(slot->digest) == key)
+            return slot;
+    }
+}
+
+static struct index_header *
+create_index(int dir_fd, const char *name, uint64_t capacity)
+{
+    const size_t size = index_size(capacity);
+    struct index_header *index;
+    int fd;
+
+    fd = openat(dir_fd, name, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC,
+                S_IRUSR | S_IWUSR);
+    if (fd < 0)
+        return NULL;
+
+    if (ftruncate(fd, (off_t)size) < 0) {
+        close(fd);
+        return NULL;
+    }
+
+    index = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (index == MAP_FAILED)
+        return NULL;
+
+    memcpy(index->magic, INDEX_MAGIC, sizeof(index->magic));
+    index->version = INDEX_VERSION;
+    index->capacity = capacity;
+    index->log_size = sizeof(LOG_MAGIC) - 1;
+
+    return index;
+}
+
+static struct index_header *open_index(int dir_fd, size_t *size)
+{
+    struct index_header *index;
+    struct stat st;
+    int fd;
+
+    fd = openat(dir_fd, "index", O_RDWR | O_CLOEXEC);
+    if (fd < 0)
+        return NULL;
+
+    if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(*index)) {
+        close(fd);
+        return NULL;
+    }
+
+    index = mmap(NULL, (size_t)st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                 fd, 0);
+    close(fd);
+    if (index == MAP_FAILED)
+        return NULL;
+
+    if (memcmp(index->magic, INDEX_MAGIC, sizeof(index->magic)) ||
+        index->version != INDEX_VERSION || !index->capacity ||
+        (index->capacity & (index->capacity - 1)) ||
+        index->capacity > (SIZE_MAX - sizeof(*index)) / sizeof(struct index_slot) ||
+        index_size(index->capacity) != (size_t)st.st_size ||
+        index->count >= index->capacity) {
+        munmap(index, (size_t)st.st_size);
+        return NULL;
+    }
+
+    *size = (size_t)st.st_size;
+    return index;
+}
+
+static bool grow_index(struct log_store *store)
+{
+    const struct index_header *old = store->index;
+    const struct index_slot *slots = (const struct index_slot *)(old + 1);
+    struct index_header *index;
+
+    if (old->capacity > SIZE_MAX / 2 / sizeof(struct index_slot))
+        return false;
+
+    index = create_index(store->dir_fd, "index.new", old->capacity * 2);
+    if (!index)
+        return false;
+
+    for (uint64_t i = 0; i < old->capacity; i++) {
+        if (slots[i].offset)
+            *index_probe(index, digest_key(slots[i].digest)) = slots[i];
+    }
+    index->count = old->count;
+    index->log_size = old->log_size;
+
+    if (renameat(store->dir_fd, "index.new", store->dir_fd, "index") < 0) {
+        munmap(index, index_size(index->capacity));
+        return false;
+    }
+
+    pthread_rwlock_wrlock(&store->index_lock);
+    munmap(store->index, store->index_size);
+    store->index = index;
+    store->index_size = index_size(index->capacity);
+    pthread_rwlock_unlock(&store->index_lock);
+
+    return true;
+}
+
+/* Makes sure there's room for one more paste in the index, keeping it at
+ * most 3/4 full.  Must be called with append_lock held. */
+static bool make_room(struct log_store *store)
+{
+    if ((store->index->count + 1) * 4 <= store->index->capacity * 3)
+        return true;
+
+    return grow_index(store);
+}
+
+static void fill_slot(struct log_store *store,
+                      struct index_slot *slot,
+                      const uint8_t digest[static DIGEST_LEN],
+                      uint64_t offset,
+                      uint64_t len)
+{
+    pthread_rwlock_wrlock(&store->index_lock);
+    memcpy(slot->digest, digest, DIGEST_LEN);
+    slot->len = len;
+    slot->offset = offset;
+    store->index->count++;
+    store->index->log_size = offset + len;
+    pthread_rwlock_unlock(&store->index_lock);
+}
+
+static bool write_at(int fd, const void *buf, size_t len, off_t offset)
+{
+    while (len) {
+        ssize_t r = pwrite(fd, buf, len, offset);
+
+        if (r < 0) {
+            if (errno == EINTR)
+                continue;
+            return false;
+        }
+
+        buf = (const char *)buf + r;
+        len -= (size_t)r;
+        offset += r;
+    }
+
+    return true;
+}
+
+static bool copy_body(struct log_store *store,
+                      struct lwan_request *request,
+                      const struct lwan_value *body,
+                      off_t offset)
+{
+#if defined(LWAN_HAVE_COPY_FILE_RANGE)
+    /* Large bodies have been spliced into a file already, so they're
+     * copied without going through userland (or at all, if the filesystem
+     * can share blocks between files). */
+    int body_fd = lwan_request_get_body_fd(request);
+
+    if (body_fd >= 0) {
+        loff_t in_offset = 0;
+        loff_t out_offset = offset;
+        size_t len = body->len;
+
+        while (len) {
+            ssize_t r = copy_file_range(body_fd, &in_offset, store->log_fd,
+                                        &out_offset, len, 0);
+            if (r <= 0)
+                break;
+            len -= (size_t)r;
+        }
+        if (!len)
+            return true;
+    }
+#endif
+
+    return write_at(store->log_fd, body->value, body->len, offset);
+}
+
+static bool append(struct log_store *store,
+                   struct lwan_request *request,
+                   const struct lwan_value *body,
+                   const uint8_t digest[static DIGEST_LEN],
+                   uint64_t *offset)
+{
+    const uint64_t record_offset = store->index->log_size;
+    struct log_record record = {.len = body->len};
+
+    memcpy(record.digest, digest, DIGEST_LEN);
+
+    if (write_at(store->log_fd, &record, sizeof(record), (off_t)record_offset) &&
+        copy_body(store, request, body,
+                  (off_t)(record_offset + sizeof(record)))) {
+        *offset = record_offset + sizeof(record);
+        return true;
+    }
+
+    /* Don't leave a partial record behind for open_store() to find. */
+    if (ftruncate(store->log_fd, (off_t)record_offset) < 0)
+        lwan_status_perror("Could not truncate paste log");
+
+    return false;
+}
+
+static enum lwan_http_status log_store_add(struct paste_store *base,
+                                           struct lwan_request *request,
+                                           const struct lwan_value *body,
+                                           uint64_t *key)
+{
+    struct log_store *store = (struct log_store *)base;
+    enum lwan_http_status status = HTTP_OK;
+    uint8_t digest[DIGEST_LEN];
+    struct index_slot *slot;
+    sha1_context ctx;
+
+    sha1_init(&ctx);
+    sha1_update(&ctx, (const unsigned char *)body->value, body->len);
+    sha1_finalize(&ctx, digest);
+
+    pthread_mutex_lock(&store->append_lock);
+
+    if (UNLIKELY(!make_room(store))) {
+        status = HTTP_UNAVAILABLE;
+        goto out;
+    }
+
+    slot = index_probe(store->index, digest_key(digest));
+    if (UNLIKELY(slot->offset && memcmp(slot->digest, digest, DIGEST_LEN))) {
+        /* Another paste has the same key. */
+        status = HTTP_UNAVAILABLE;
+    } else if (!slot->offset) {
+        uint64_t offset;
+
+        if (LIKELY(append(store, request, body, digest, &offset)))
+            fill_slot(store, slot, digest, offset, body->len);
+        else
+            status = HTTP_INTERNAL_ERROR;
+    }
+
+out:
+    pthread_mutex_unlock(&store->append_lock);
+
+    *key = digest_key(digest);
+    return status;
+}
+
+static bool log_store_get(struct paste_store *base,
+                          struct lwan_request *request,
+                          uint64_t key,
+                          struct paste *paste)
+{
+    struct log_store *store = (struct log_store *)base;
+    const struct index_slot *slot;
+    bool found;
+
+    pthread_rwlock_rdlock(&store->index_lock);
+    slot = index_probe(store->index, key);
+    found = slot->offset != 0;
+    if (found) {
+        *paste = (struct paste){
+            .fd = store->log_fd,
+            .offset = (off_t)slot->offset,
+            .len = (size_t)slot->len,
+        };
+    }
+    pthread_rwlock_unlock(&store->index_lock);
+
+    return found;
+}
+
+static void log_store_destroy(struct paste_store *base)
+{
+    struct log_store *store = (struct log_store *)base;
+
+    munmap(store->index, store->index_size);
+    close(store->log_fd);
+    close(store->dir_fd);
+    pthread_rwlock_destroy(&store->index_lock);
+    pthread_mutex_destroy(&store->append_lock);
+    free(store);
+}
+
+static bool open_log(struct log_store *store, off_t *log_size)
+{
+    char magic[sizeof(LOG_MAGIC) - 1];
+    struct stat st;
+
+    store->log_fd = openat(store->dir_fd, "log", O_RDWR | O_CREAT | O_CLOEXEC,
+                           S_IRUSR | S_IWUSR);
+    if (store->log_fd < 0)
+        return false;
+
+    if (fstat(store->log_fd, &st) < 0)
+        return false;
+
+    if (!st.st_size) {
+        *log_size = sizeof(magic);
+        return write_at(store->log_fd, LOG_MAGIC, sizeof(magic), 0);
+    }
+
+    if (pread(store->log_fd, magic, sizeof(magic), 0) != sizeof(magic) ||
+        memcmp(magic, LOG_MAGIC, sizeof(magic))) {
+        errno = EINVAL;
+        return false;
+    }
+
+    *log_size = st.st_size;
+    return true;
+}
+
+/* Adds whatever has been appended to the log after the index was last
+ * written to, and drops a record at the end that was only partially
+ * written. */
+static bool catch_up_with_log(struct log_store *store, off_t log_size)
+{
+    uint64_t offset = store->index->log_size;
+    struct log_record record;
+
+    while (offset + sizeof(record) <= (uint64_t)log_size) {
+        const uint64_t contents = offset + sizeof(record);
+        struct index_slot *slot;
+
+        if (pread(store->log_fd, &record, sizeof(record), (off_t)offset) !=
+            sizeof(record))
+            return false;
+        if (record.len > (uint64_t)log_size - contents)
+            break;
+
+        if (!make_room(store))
+            return false;
+
+        slot = index_probe(store->index, digest_key(record.digest));
+        if (!slot->offset) {
+            fill_slot(store, slot, record.digest, contents, record.len);
+        } else if (memcmp(slot->digest, record.digest, DIGEST_LEN)) {
+            lwan_status_warning("Paste at offset %" PRIu64 " has the same key "
+                                "as another one, ignoring",
+                                offset);
+        }
+
+        offset = contents + record.len;
+        store->index->log_size = offset;
+    }
+
+    if (offset < (uint64_t)log_size) {
+        lwan_status_warning("Dropping partially written paste at offset %" PRIu64,
+                            offset);
+        return ftruncate(store->log_fd, (off_t)offset) == 0;
+    }
+
+    return true;
+}
+
+struct paste_store *paste_store_log_new(const char *dir)
+{
+    struct log_store *store = malloc(sizeof(*store));
+    off_t log_size;
+
+    if (!store)
+        return NULL;
+
+    *store = (struct log_store){
+        .base =
+            {
+                .add = log_store_add,
+                .get = log_store_get,
+                .destroy = log_store_destroy,
+                .description = "Items are stored on disk, and the same item "
+                               "is stored only once",
+            },
+        .dir_fd = -1,
+        .log_fd = -1,
+    };
+
+    if (mkdir(dir, S_IRWXU) < 0 && errno != EEXIST) {
+        lwan_status_perror("Could not create %s", dir);
+        goto out;
+    }
+
+    store->dir_fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (store->dir_fd < 0) {
+        lwan_status_perror("Could not open %s", dir);
+        goto out;
+    }
+
+    if (!open_log(store, &log_size)) {
+        lwan_status_perror("Could not open paste log in %s", dir);
+        goto out;
+    }
+
+    store->index = open_index(store->dir_fd, &store->index_size);
+    if (store->index && store->index->log_size > (uint64_t)log_size) {
+        munmap(store->index, store->index_size);
+        store->index = NULL;
+    }
+    if (!store->index) {
+        lwan_status_info("Rebuilding paste index in %s", dir);
+
+        store->index =
+            create_index(store->dir_fd, "index", INDEX_INITIAL_CAPACITY);
+        if (!store->index) {
+            lwan_status_perror("Could not create paste index in %s", dir);
+            goto out;
+        }
+        store->index_size = index_size(INDEX_INITIAL_CAPACITY);
+    }
+
+    pthread_mutex_init(&store->append_lock, NULL);
+    pthread_rwlock_init(&store->index_lock, NULL);
+
+    if (!catch_up_with_log(store, log_size)) {
+        lwan_status_perror("Could not index paste log in %s", dir);
+        log_store_destroy(&store->base);
+        return NULL;
+    }
+
+    lwan_status_info("%" PRIu64 " pastes in %s", store->index->count, dir);
+    return &store->base;
+
+out:
+    if (store->index)
+        munmap(store->index, store->index_size);
+    if (store->log_fd >= 0)
+        close(store->log_fd);
+    if (store->dir_fd >= 0)
+        close(store->dir_fd);
+    free(store);
+    return NULL;
+}
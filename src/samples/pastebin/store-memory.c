@@ -0,0 +1,149 @@
+/*
+ * lwan - web server
+ * Copyright (c) 2022 L. A. F. Pereira <l@tia.mat.br>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301,
+ * USA.
+ */
+
+/* Keeps pastes in a cache, under random keys, until they expire. */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "hash.h"
+#include "lwan-cache.h"
+#include "lwan-private.h"
+
+#include "store.h"
+
+struct memory_store {
+    struct paste_store base;
+    struct cache *pastes;
+    char description[64];
+};
+
+struct memory_paste {
+    struct cache_entry entry;
+    size_t len;
+    char value[];
+};
+
+static struct cache_entry *
+create_paste(const void *key, void *cache_ctx, void *create_ctx)
+{
+    const struct lwan_value *body = create_ctx;
+    size_t alloc_size;
+
+    if (!body)
+        return NULL;
+
+    if (__builtin_add_overflow(sizeof(struct memory_paste), body->len,
+                               &alloc_size))
+        return NULL;
+
+    struct memory_paste *paste = malloc(alloc_size);
+    if (paste) {
+        paste->len = body->len;
+        memcpy(paste->value, body->value, body->len);
+    }
+
+    return (struct cache_entry *)paste;
+}
+
+static void destroy_paste(struct cache_entry *entry, void *context)
+{
+    free(entry);
+}
+
+static enum lwan_http_status memory_store_add(struct paste_store *store,
+                                              struct lwan_request *request,
+                                              const struct lwan_value *body,
+                                              uint64_t *key)
+{
+    struct memory_store *ms = (struct memory_store *)store;
+
+    for (int try = 0; try < 10; try++) {
+        void *k;
+
+        do {
+            k = (void *)(uintptr_t)lwan_random_uint64();
+        } while (!k);
+
+        struct cache_entry *paste = cache_coro_get_and_ref_entry_with_ctx(
+            ms->pastes, request->conn->coro, k, (void *)body);
+
+        if (paste) {
+            *key = (uint64_t)(uintptr_t)k;
+            return HTTP_OK;
+        }
+    }
+
+    return HTTP_UNAVAILABLE;
+}
+
+static bool memory_store_get(struct paste_store *store,
+                             struct lwan_request *request,
+                             uint64_t key,
+                             struct paste *paste)
+{
+    struct memory_store *ms = (struct memory_store *)store;
+    struct memory_paste *mp =
+        (struct memory_paste *)cache_coro_get_and_ref_entry(
+            ms->pastes, request->conn->coro, (void *)(uintptr_t)key);
+
+    if (!mp)
+        return false;
+
+    *paste = (struct paste){.value = mp->value, .fd = -1, .len = mp->len};
+    return true;
+}
+
+static void memory_store_destroy(struct paste_store *store)
+{
+    struct memory_store *ms = (struct memory_store *)store;
+
+    cache_destroy(ms->pastes);
+    free(ms);
+}
+
+struct paste_store *paste_store_memory_new(unsigned int cache_for_hours)
+{
+    struct memory_store *ms = malloc(sizeof(*ms));
+
+    if (!ms)
+        return NULL;
+
+    ms->pastes = cache_create_full(create_paste, destroy_paste, hash_int64_new,
+                                   NULL, cache_for_hours * 60 * 60);
+    if (!ms->pastes) {
+        free(ms);
+        return NULL;
+    }
+
+    snprintf(ms->description, sizeof(ms->description),
+             "Items are cached for %u hours and are not stored on disk",
+             cache_for_hours);
+    ms->base = (struct paste_store){
+        .add = memory_store_add,
+        .get = memory_store_get,
+        .destroy = memory_store_destroy,
+        .description = ms->description,
+    };
+
+    return &ms->base;
+}
@@ -0,0 +1,56 @@
+/*
+ * lwan - web server
+ * Copyright (c) 2024 L. A. F. Pereira <l@tia.mat.br>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301,
+ * USA.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "lwan.h"
+
+/* A paste is either in memory (@value is set) or in a file, in which case
+ * it's @len bytes at @offset in @fd, which stays open while the store is
+ * alive.  Either way, it's valid until the request is over. */
+struct paste {
+    const char *value;
+    int fd;
+    off_t offset;
+    size_t len;
+};
+
+struct paste_store {
+    /* Stores @body and sets @key to the key it can be retrieved with. */
+    enum lwan_http_status (*add)(struct paste_store *store,
+                                 struct lwan_request *request,
+                                 const struct lwan_value *body,
+                                 uint64_t *key);
+    bool (*get)(struct paste_store *store,
+                struct lwan_request *request,
+                uint64_t key,
+                struct paste *paste);
+    void (*destroy)(struct paste_store *store);
+
+    /* Shown in the documentation page. */
+    const char *description;
+};
+
+struct paste_store *paste_store_memory_new(unsigned int cache_for_hours);
+struct paste_store *paste_store_log_new(const char *dir);
@@ -29,7 +29,7 @@
 
 #define ARRAY_SIZE N_ELEMENTS
 
-#include "../techempower/json.h"
+#include "json.h"
 #include "lwan.h"
 
 struct address {
@@ -92,13 +92,6 @@ static const struct json_obj_descr send_money_request_descr[] = {
     JSON_OBJ_DESCR_OBJECT(struct send_money_request, to, account_holder_descr),
 };
 
-static int append_to_strbuf(const char *bytes, size_t len, void *data)
-{
-    struct lwan_strbuf *strbuf = data;
-
-    return !lwan_strbuf_append_str(strbuf, bytes, len);
-}
-
 static inline struct tm *localtime_now(void)
 {
     static __thread struct tm result;
@@ -139,8 +132,8 @@ LWAN_HANDLER_ROUTE(send_money, "/send-money")
         .created_on = formatted_time,
         .amount = smr.amount,
     };
-    if (json_obj_encode_full(receipt_descr, N_ELEMENTS(receipt_descr), &r,
-                             append_to_strbuf, response->buffer, false) != 0) {
+    if (json_obj_encode_strbuf(receipt_descr, N_ELEMENTS(receipt_descr), &r,
+                               response->buffer, false) != 0) {
         return HTTP_INTERNAL_ERROR;
     }
 
@@ -16,7 +16,7 @@ extern "C" {
 // (no compression support, only "store")
 #ifdef HAVE_ZLIB
 #include <zlib.h>
-#else
+#elif !defined(Z_OK)
 #define Z_OK 0
 #define Z_ERRNO -1
 #endif
@@ -24,6 +24,7 @@
 #include <fcntl.h>
 #include <stdlib.h>
 #include <string.h>
+#include <zlib.h>
 
 #include "base64.h"
 #include "hash.h"
@@ -42,6 +43,10 @@
 
 #define CACHE_FOR_MINUTES 15
 
+/* How much memory the members of a site can take once inflated, for
+ * clients that don't accept compressed responses. */
+#define MAX_INFLATED_SIZE (1 << 20)
+
 static struct cache *sites;
 
 struct file {
@@ -49,6 +54,12 @@ struct file {
     size_t size_compressed;
     const char *mime_type;
     bool deflated;
+
+    /* Deflated members are framed as gzip streams when the site is
+     * created, and also inflated if they fit in what's left of
+     * MAX_INFLATED_SIZE, so they're never inflated while serving them. */
+    struct lwan_value gzipped;
+    struct lwan_value inflated;
 };
 
 struct site {
@@ -57,6 +68,7 @@ struct site {
     struct hash *files;
     struct lwan_strbuf qr_code;
     int has_qr_code;
+    size_t inflated_size;
 };
 
 struct iframe_tpl_vars {
@@ -95,6 +107,89 @@ static void calc_hash(struct lwan_value value,
              digest[17], digest[18], digest[19]);
 }
 
+static void free_file(void *data)
+{
+    struct file *file = data;
+
+    free(file->gzipped.value);
+    free(file->inflated.value);
+    free(file);
+}
+
+static void write_le32(unsigned char *p, uint32_t value)
+{
+    p[0] = (unsigned char)value;
+    p[1] = (unsigned char)(value >> 8);
+    p[2] = (unsigned char)(value >> 16);
+    p[3] = (unsigned char)(value >> 24);
+}
+
+/* The raw deflate stream in a ZIP member only needs a header and a trailer
+ * with the CRC-32 and size of the original data, which are both in the
+ * central directory, to become a gzip stream (RFC 1952). */
+static bool frame_as_gzip(struct file *file,
+                          const struct site *site,
+                          const JZFileHeader *header)
+{
+    static const unsigned char gzip_header[10] = {
+        0x1f, 0x8b, 8 /* CM: deflate */, 0 /* FLG */, 0, 0, 0, 0 /* MTIME */,
+        0 /* XFL */, 255 /* OS: unknown */,
+    };
+    const size_t len = sizeof(gzip_header) + file->size_compressed + 8;
+    unsigned char *gzipped = malloc(len);
+
+    if (!gzipped)
+        return false;
+
+    memcpy(gzipped, gzip_header, sizeof(gzip_header));
+    memcpy(gzipped + sizeof(gzip_header),
+           site->zipped.value + file->data_offset, file->size_compressed);
+    write_le32(gzipped + len - 8, header->crc32);
+    write_le32(gzipped + len - 4, header->uncompressedSize);
+
+    file->gzipped = (struct lwan_value){.value = (char *)gzipped, .len = len};
+    return true;
+}
+
+static void inflate_file(struct file *file,
+                         struct site *site,
+                         const JZFileHeader *header)
+{
+    const size_t len = header->uncompressedSize;
+    z_stream strm = {
+        .next_in = (unsigned char *)site->zipped.value + file->data_offset,
+        .avail_in = (unsigned int)file->size_compressed,
+    };
+    unsigned char *inflated;
+
+    if (len > MAX_INFLATED_SIZE - site->inflated_size)
+        return;
+
+    /* The extra byte makes sure the stream ends where the central
+     * directory says it does. */
+    inflated = malloc(len + 1);
+    if (!inflated)
+        return;
+
+    if (inflateInit2(&strm, -MAX_WBITS) != Z_OK) {
+        free(inflated);
+        return;
+    }
+    strm.next_out = inflated;
+    strm.avail_out = (unsigned int)len + 1;
+
+    int ret = inflate(&strm, Z_FINISH);
+    inflateEnd(&strm);
+    if (ret != Z_STREAM_END || strm.total_out != len ||
+        crc32(0, inflated, (unsigned int)len) != header->crc32) {
+        free(inflated);
+        return;
+    }
+
+    site->inflated_size += len;
+    file->inflated = (struct lwan_value){.value = (char *)inflated, .len = len};
+}
+
 static int file_cb(
     JZFile *zip, int idx, JZFileHeader *header, char *filename, void *user_data)
 {
@@ -122,7 +217,7 @@ static int file_cb(
     if (last_data_offset > site->zipped.len)
         return 0;
 
-    struct file *file = malloc(sizeof(*file));
+    struct file *file = calloc(1, sizeof(*file));
     if (!file)
         return 0;
 
@@ -131,6 +226,14 @@ static int file_cb(
     file->size_compressed = local.compressedSize;
     file->mime_type = lwan_determine_mime_type_for_file_name(filename);
 
+    if (file->deflated) {
+        if (!frame_as_gzip(file, site, header)) {
+            free(file);
+            return 0;
+        }
+        inflate_file(file, site, header);
+    }
+
     char *key = strdup(filename);
     if (key) {
         if (!hash_add_unique(site->files, key, file)) {
@@ -140,7 +243,7 @@ static int file_cb(
     }
 
     free(key);
-    free(file);
+    free_file(file);
     return 0;
 }
 
@@ -197,13 +300,8 @@ create_site(const void *key, void *context, void *create_ctx)
     if (!base64_encoded)
         return NULL;
 
-    if (UNLIKELY(!base64_validate((unsigned char *)base64_encoded->value,
-                                  base64_encoded->len))) {
-        return NULL;
-    }
-
-    decoded = base64_decode((unsigned char *)base64_encoded->value,
-                            base64_encoded->len, &decoded_len);
+    decoded = base64_decode_validated((unsigned char *)base64_encoded->value,
+                                      base64_encoded->len, &decoded_len);
     if (UNLIKELY(!decoded))
         return NULL;
 
@@ -232,7 +330,8 @@ create_site(const void *key, void *context, void *create_ctx)
     if (jzReadEndRecord(zip, &end_record))
         goto no_end_record;
 
-    site->files = hash_str_new(free, free);
+    site->inflated_size = 0;
+    site->files = hash_str_new(free, free_file);
     if (!site->files)
         goto no_hash;
 
@@ -350,15 +449,42 @@ LWAN_HANDLER_ROUTE(view_site, "/s/")
     if (!file)
         return HTTP_NOT_FOUND;
 
+    response->mime_type = file->mime_type;
+
     if (file->deflated) {
         enum lwan_request_flags accept =
             lwan_request_get_accept_encoding(request);
 
-        if (!(accept & REQUEST_ACCEPT_DEFLATE))
-            return HTTP_NOT_ACCEPTABLE;
+        if (accept & REQUEST_ACCEPT_GZIP) {
+            static const struct lwan_key_value gzip_headers[] = {
+                {"Content-Encoding", "gzip"},
+                {"Vary", "Accept-Encoding"},
+                {},
+            };
+            response->headers = gzip_headers;
+            lwan_strbuf_set_static(response->buffer, file->gzipped.value,
+                                   file->gzipped.len);
+            return HTTP_OK;
+        }
+
+        if (!(accept & REQUEST_ACCEPT_DEFLATE)) {
+            static const struct lwan_key_value vary_headers[] = {
+                {"Vary", "Accept-Encoding"},
+                {},
+            };
+
+            if (!file->inflated.value)
+                return HTTP_NOT_ACCEPTABLE;
+
+            response->headers = vary_headers;
+            lwan_strbuf_set_static(response->buffer, file->inflated.value,
+                                   file->inflated.len);
+            return HTTP_OK;
+        }
 
         static const struct lwan_key_value deflate_headers[] = {
             {"Content-Encoding", "deflate"},
+            {"Vary", "Accept-Encoding"},
             {},
         };
         response->headers = deflate_headers;
@@ -367,7 +493,6 @@ LWAN_HANDLER_ROUTE(view_site, "/s/")
     lwan_strbuf_set_static(response->buffer,
                            site->zipped.value + file->data_offset,
                            file->size_compressed);
-    response->mime_type = file->mime_type;
 
     return HTTP_OK;
 }
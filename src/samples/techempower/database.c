@@ -18,24 +18,42 @@
  * USA.
  */
 
+
 #include <assert.h>
+#include <errno.h>
 #include <string.h>
 #include <mysql.h>
+#include <poll.h>
 #include <sqlite3.h>
 #include <stddef.h>
 #include <stdlib.h>
 #include <stdarg.h>
+#include <stdio.h>
 
 #include "database.h"
-#include "lwan-status.h"
+#include "lwan-private.h"
+
+/* Statements prepared with the same SQL string are kept around by each
+ * connection, so that preparing them again, once per request, is just a
+ * lookup.  SQL strings are compared by address first, as they're usually
+ * constants. */
+#define DB_STMT_CACHE_SIZE 8
+
+/* Statements used by batches have their number of placeholders rounded up
+ * to a power of two between these, so that only a few of them have to be
+ * cached; longer batches are split in as many statements as needed. */
+#define DB_BATCH_MIN_KEYS 8
+#define DB_BATCH_MAX_KEYS 64
 
 struct db_stmt {
     bool (*bind)(const struct db_stmt *stmt,
                  struct db_row *rows);
     bool (*step)(const struct db_stmt *stmt, va_list ap);
+    void (*reset)(struct db_stmt *stmt);
     void (*finalize)(struct db_stmt *stmt);
     const char *param_signature;
     const char *result_signature;
+    bool cached;
 };
 
 struct db {
@@ -44,6 +62,25 @@ struct db {
                                const char *sql,
                                const char *param_signature,
                                const char *result_signature);
+    /* Returns the socket used to talk to the server, or -1 */
+    int (*get_fd)(const struct db *db);
+
+    /* Set while the connection is taken from a pool: drivers that can
+     * wait for the server without blocking the thread use it to await
+     * on its socket instead. */
+    struct lwan_request *request;
+    /* Set while a driver is waiting for a reply from the server.  If that
+     * request is torn down in the meantime, the connection is in an
+     * unknown state and can't be put back in its pool. */
+    bool waiting;
+
+    struct {
+        const char *sql;
+        struct db_stmt *stmt;
+        /* Set if sql was built at runtime and is owned by the cache. */
+        bool sql_is_copy;
+    } stmt_cache[DB_STMT_CACHE_SIZE];
+    size_t n_cached_stmts;
 };
 
 /* MySQL */
@@ -55,6 +92,7 @@ struct db_mysql {
 
 struct db_stmt_mysql {
     struct db_stmt base;
+    struct db_mysql *db;
     MYSQL_STMT *stmt;
     MYSQL_BIND *param_bind;
     MYSQL_BIND *result_bind;
@@ -63,14 +101,92 @@ struct db_stmt_mysql {
     MYSQL_BIND param_result_bind[];
 };
 
+#if defined(HAVE_MYSQL_NONBLOCKING_API)
+/* Waits for the socket of @db to be ready for what the non-blocking API
+ * asked for in @status, and returns what happened so it can be passed to
+ * the corresponding *_cont() function.  While a request is using the
+ * connection, only its coroutine waits; otherwise (e.g. during startup),
+ * the whole thread does.  */
+static int mysql_wait(struct db_mysql *db, int status)
+{
+    struct lwan_request *request = db->base.request;
+    int fd = mysql_get_socket(db->con);
+
+    if (!request) {
+        struct pollfd pfd = {
+            .fd = fd,
+            .events = (short)(((status & MYSQL_WAIT_READ) ? POLLIN : 0) |
+                              ((status & MYSQL_WAIT_WRITE) ? POLLOUT : 0) |
+                              ((status & MYSQL_WAIT_EXCEPT) ? POLLPRI : 0)),
+        };
+        int timeout = (status & MYSQL_WAIT_TIMEOUT)
+                          ? (int)mysql_get_timeout_value_ms(db->con)
+                          : -1;
+        int ret = poll(&pfd, 1, timeout);
+
+        if (ret <= 0)
+            return MYSQL_WAIT_TIMEOUT;
+
+        return ((pfd.revents & (POLLIN | POLLHUP | POLLERR)) ? MYSQL_WAIT_READ
+                                                             : 0) |
+               ((pfd.revents & POLLOUT) ? MYSQL_WAIT_WRITE : 0) |
+               ((pfd.revents & POLLPRI) ? MYSQL_WAIT_EXCEPT : 0);
+    }
+
+    db->base.waiting = true;
+
+    if ((status & (MYSQL_WAIT_READ | MYSQL_WAIT_WRITE)) == 0) {
+        lwan_request_sleep(request, mysql_get_timeout_value_ms(db->con));
+        status = MYSQL_WAIT_TIMEOUT;
+    } else if ((status & MYSQL_WAIT_READ) && (status & MYSQL_WAIT_WRITE)) {
+        lwan_request_await_read_write(request, fd);
+        status &= MYSQL_WAIT_READ | MYSQL_WAIT_WRITE;
+    } else if (status & MYSQL_WAIT_WRITE) {
+        lwan_request_await_write(request, fd);
+        status = MYSQL_WAIT_WRITE;
+    } else {
+        lwan_request_await_read(request, fd);
+        status = MYSQL_WAIT_READ;
+    }
+
+    db->base.waiting = false;
+
+    return status;
+}
+
+typedef my_bool mysql_bool_t;
+
+/* Calls the non-blocking version of the MySQL function @fn_, storing its
+ * return value in @ret_, and waits as many times as it needs to. */
+#define MYSQL_AWAIT(db_, ret_, fn_, obj_, ...)                                 \
+    do {                                                                       \
+        int status_ = fn_##_start(&(ret_), obj_, ##__VA_ARGS__);               \
+        while (status_)                                                        \
+            status_ = fn_##_cont(&(ret_), obj_, mysql_wait(db_, status_));     \
+    } while (0)
+#else
+/* Newer versions of the MySQL client library dropped my_bool. */
+typedef bool mysql_bool_t;
+
+#define MYSQL_AWAIT(db_, ret_, fn_, obj_, ...)                                 \
+    do {                                                                       \
+        (void)(db_);                                                           \
+        (ret_) = fn_(obj_, ##__VA_ARGS__);                                     \
+    } while (0)
+#endif
+
 static bool db_stmt_bind_mysql(const struct db_stmt *stmt,
                                struct db_row *rows)
 {
     struct db_stmt_mysql *stmt_mysql = (struct db_stmt_mysql *)stmt;
     const char *signature = stmt->param_signature;
+    mysql_bool_t reset_failed;
 
     stmt_mysql->must_execute_again = true;
-    mysql_stmt_reset(stmt_mysql->stmt);
+    MYSQL_AWAIT(stmt_mysql->db, reset_failed, mysql_stmt_reset,
+                stmt_mysql->stmt);
+    if (reset_failed)
+        return false;
 
     for (size_t row = 0; signature[row]; row++) {
         MYSQL_BIND *param = &stmt_mysql->param_bind[row];
@@ -99,11 +215,13 @@ static bool db_stmt_step_mysql(const struct db_stmt *stmt,
                                va_list ap)
 {
     struct db_stmt_mysql *stmt_mysql = (struct db_stmt_mysql *)stmt;
+    int ret;
 
     if (stmt_mysql->must_execute_again) {
         stmt_mysql->must_execute_again = false;
         stmt_mysql->results_are_bound = false;
-        if (mysql_stmt_execute(stmt_mysql->stmt))
+        MYSQL_AWAIT(stmt_mysql->db, ret, mysql_stmt_execute, stmt_mysql->stmt);
+        if (ret)
             return false;
     }
 
@@ -139,13 +257,32 @@ static bool db_stmt_step_mysql(const struct db_stmt *stmt,
             goto out;
     }
 
-    return mysql_stmt_fetch(stmt_mysql->stmt) == 0;
+    MYSQL_AWAIT(stmt_mysql->db, ret, mysql_stmt_fetch, stmt_mysql->stmt);
+    return ret == 0;
 
 out:
     stmt_mysql->results_are_bound = false;
     return false;
 }
 
+static void db_stmt_reset_mysql(struct db_stmt *stmt)
+{
+    struct db_stmt_mysql *stmt_mysql = (struct db_stmt_mysql *)stmt;
+    mysql_bool_t ret;
+
+    /* Rows that haven't been fetched have to be read before the
+     * connection can be used for anything else. */
+    if (!stmt_mysql->must_execute_again) {
+        MYSQL_AWAIT(stmt_mysql->db, ret, mysql_stmt_free_result,
+                    stmt_mysql->stmt);
+        if (ret)
+            lwan_status_warning("Could not free statement results");
+    }
+
+    stmt_mysql->must_execute_again = true;
+    stmt_mysql->results_are_bound = false;
+}
+
 static void db_stmt_finalize_mysql(struct db_stmt *stmt)
 {
     struct db_stmt_mysql *stmt_mysql = (struct db_stmt_mysql *)stmt;
@@ -160,9 +297,10 @@ db_prepare_mysql(const struct db *db,
                  const char *param_signature,
                  const char *result_signature)
 {
-    const struct db_mysql *db_mysql = (const struct db_mysql *)db;
+    struct db_mysql *db_mysql = (struct db_mysql *)db;
     const size_t n_bounds = strlen(param_signature) + strlen(result_signature);
     struct db_stmt_mysql *stmt_mysql = malloc(sizeof(*stmt_mysql) + n_bounds * sizeof(MYSQL_BIND));
+    int ret;
 
     if (!stmt_mysql)
         return NULL;
@@ -171,7 +309,9 @@ db_prepare_mysql(const struct db *db,
     if (!stmt_mysql->stmt)
         goto out_free_stmt;
 
-    if (mysql_stmt_prepare(stmt_mysql->stmt, sql, strlen(sql)))
+    MYSQL_AWAIT(db_mysql, ret, mysql_stmt_prepare, stmt_mysql->stmt, sql,
+                strlen(sql));
+    if (ret)
         goto out_close_stmt;
 
     assert(strlen(param_signature) == mysql_stmt_param_count(stmt_mysql->stmt));
@@ -179,7 +319,9 @@ db_prepare_mysql(const struct db *db,
 
     stmt_mysql->base.bind = db_stmt_bind_mysql;
     stmt_mysql->base.step = db_stmt_step_mysql;
+    stmt_mysql->base.reset = db_stmt_reset_mysql;
     stmt_mysql->base.finalize = db_stmt_finalize_mysql;
+    stmt_mysql->db = db_mysql;
     stmt_mysql->param_bind = &stmt_mysql->param_result_bind[0];
     stmt_mysql->result_bind = &stmt_mysql->param_result_bind[strlen(param_signature)];
     stmt_mysql->must_execute_again = true;
@@ -208,12 +350,21 @@ static void db_disconnect_mysql(struct db *db)
     free(db);
 }
 
+static int db_get_fd_mysql(const struct db *db)
+{
+    const struct db_mysql *db_mysql = (const struct db_mysql *)db;
+
+    return (int)mysql_get_socket(db_mysql->con);
+}
+
 struct db *db_connect_mysql(const char *host,
                             const char *user,
                             const char *pass,
                             const char *database)
 {
-    struct db_mysql *db_mysql = malloc(sizeof(*db_mysql));
+    struct db_mysql *db_mysql = calloc(1, sizeof(*db_mysql));
+    MYSQL *connected;
+    int ret;
 
     if (!db_mysql)
         return NULL;
@@ -224,15 +375,23 @@ struct db *db_connect_mysql(const char *host,
         return NULL;
     }
 
-    if (!mysql_real_connect(db_mysql->con, host, user, pass, database, 0, NULL,
-                            0))
+#if defined(HAVE_MYSQL_NONBLOCKING_API)
+    if (mysql_options(db_mysql->con, MYSQL_OPT_NONBLOCK, 0))
+        goto error;
+#endif
+
+    MYSQL_AWAIT(db_mysql, connected, mysql_real_connect, db_mysql->con, host,
+                user, pass, database, 0, NULL, 0);
+    if (!connected)
         goto error;
 
-    if (mysql_set_character_set(db_mysql->con, "utf8"))
+    MYSQL_AWAIT(db_mysql, ret, mysql_set_character_set, db_mysql->con, "utf8");
+    if (ret)
         goto error;
 
     db_mysql->base.disconnect = db_disconnect_mysql;
     db_mysql->base.prepare = db_prepare_mysql;
+    db_mysql->base.get_fd = db_get_fd_mysql;
 
     return (struct db *)db_mysql;
 
@@ -320,6 +479,13 @@ static bool db_stmt_step_sqlite(const struct db_stmt *stmt,
     return true;
 }
 
+static void db_stmt_reset_sqlite(struct db_stmt *stmt)
+{
+    struct db_stmt_sqlite *stmt_sqlite = (struct db_stmt_sqlite *)stmt;
+
+    sqlite3_reset(stmt_sqlite->sqlite);
+}
+
 static void db_stmt_finalize_sqlite(struct db_stmt *stmt)
 {
     struct db_stmt_sqlite *stmt_sqlite = (struct db_stmt_sqlite *)stmt;
@@ -349,6 +515,7 @@ db_prepare_sqlite(const struct db *db,
 
     stmt_sqlite->base.bind = db_stmt_bind_sqlite;
     stmt_sqlite->base.step = db_stmt_step_sqlite;
+    stmt_sqlite->base.reset = db_stmt_reset_sqlite;
     stmt_sqlite->base.finalize = db_stmt_finalize_sqlite;
 
     stmt_sqlite->base.param_signature = param_signature;
@@ -365,10 +532,15 @@ static void db_disconnect_sqlite(struct db *db)
     free(db);
 }
 
+static int db_get_fd_sqlite(const struct db *db __attribute__((unused)))
+{
+    return -1;
+}
+
 struct db *
 db_connect_sqlite(const char *path, bool read_only, const char *pragmas[])
 {
-    struct db_sqlite *db_sqlite = malloc(sizeof(*db_sqlite));
+    struct db_sqlite *db_sqlite = calloc(1, sizeof(*db_sqlite));
 
     if (!db_sqlite)
         return NULL;
@@ -387,10 +559,108 @@ db_connect_sqlite(const char *path, bool read_only, const char *pragmas[])
 
     db_sqlite->base.disconnect = db_disconnect_sqlite;
     db_sqlite->base.prepare = db_prepare_sqlite;
+    db_sqlite->base.get_fd = db_get_fd_sqlite;
 
     return (struct db *)db_sqlite;
 }
 
+/* Pools */
+
+/* Each I/O thread is supposed to have its own pool, so there's no need
+ * for any locking here. */
+struct db_pool {
+    struct db *(*connect)(void *data);
+    void *data;
+
+    unsigned int n_idle;
+    unsigned int max_idle;
+    struct db *idle[];
+};
+
+struct db_pool *db_pool_new(struct db *(*connect)(void *data),
+                            void *data,
+                            unsigned int max_idle)
+{
+    struct db_pool *pool =
+        malloc(sizeof(*pool) + max_idle * sizeof(struct db *));
+
+    if (!pool)
+        return NULL;
+
+    pool->connect = connect;
+    pool->data = data;
+    pool->n_idle = 0;
+    pool->max_idle = max_idle;
+
+    return pool;
+}
+
+void db_pool_free(struct db_pool *pool)
+{
+    if (!pool)
+        return;
+
+    for (unsigned int i = 0; i < pool->n_idle; i++)
+        db_disconnect(pool->idle[i]);
+    free(pool);
+}
+
+struct db_pool_checkout {
+    struct db_pool *pool;
+    struct db *db;
+    struct lwan_thread *thread;
+};
+
+static void db_pool_release(void *data)
+{
+    struct db_pool_checkout *checkout = data;
+    struct db_pool *pool = checkout->pool;
+    struct db *db = checkout->db;
+
+    db->request = NULL;
+
+    if (db->waiting || pool->n_idle == pool->max_idle) {
+        db_disconnect(db);
+        return;
+    }
+
+    /* This runs after the defers registered by lwan_request_await_*(),
+     * so the socket isn't borrowed by the request's coroutine anymore. */
+    int fd = db->get_fd(db);
+    if (fd >= 0)
+        lwan_thread_unwatch_open_fd(checkout->thread, fd);
+
+    pool->idle[pool->n_idle++] = db;
+}
+
+/* Takes an idle connection from @pool (or creates a new one) for the
+ * duration of @request; it's put back in the pool (or closed, if there
+ * are too many idle ones already) once the request is done with it. */
+struct db *db_pool_get(struct db_pool *pool, struct lwan_request *request)
+{
+    struct coro *coro = request->conn->coro;
+    struct db_pool_checkout *checkout = coro_malloc(coro, sizeof(*checkout));
+    struct db *db;
+
+    if (UNLIKELY(!checkout))
+        return NULL;
+
+    db = pool->n_idle ? pool->idle[--pool->n_idle] : pool->connect(pool->data);
+    if (UNLIKELY(!db))
+        return NULL;
+
+    *checkout = (struct db_pool_checkout){
+        .pool = pool,
+        .db = db,
+        .thread = request->conn->thread,
+    };
+    coro_defer(coro, db_pool_release, checkout);
+
+    db->request = request;
+
+    return db;
+}
+
 /* Generic */
 
 inline bool db_stmt_bind(const struct db_stmt *stmt, struct db_row *rows)
@@ -410,14 +680,182 @@ inline bool db_stmt_step(const struct db_stmt *stmt, ...)
     return ret;
 }
 
-inline void db_stmt_finalize(struct db_stmt *stmt) { stmt->finalize(stmt); }
+inline void db_stmt_finalize(struct db_stmt *stmt)
+{
+    if (stmt->cached)
+        stmt->reset(stmt);
+    else
+        stmt->finalize(stmt);
+}
+
+void db_disconnect(struct db *db)
+{
+    for (size_t i = 0; i < db->n_cached_stmts; i++) {
+        db->stmt_cache[i].stmt->finalize(db->stmt_cache[i].stmt);
+        if (db->stmt_cache[i].sql_is_copy)
+            free((char *)db->stmt_cache[i].sql);
+    }
+
+    db->disconnect(db);
+}
+
+static struct db_stmt *prepare_stmt(struct db *db,
+                                    const char *sql,
+                                    const char *param_signature,
+                                    const char *result_signature,
+                                    bool copy_sql)
+{
+    struct db_stmt *stmt;
+
+    for (size_t i = 0; i < db->n_cached_stmts; i++) {
+        if (db->stmt_cache[i].sql == sql || streq(db->stmt_cache[i].sql, sql))
+            return db->stmt_cache[i].stmt;
+    }
+
+    stmt = db->prepare(db, sql, param_signature, result_signature);
+    if (!stmt)
+        return NULL;
+
+    stmt->cached = false;
+    if (db->n_cached_stmts < DB_STMT_CACHE_SIZE) {
+        const char *cached_sql = copy_sql ? strdup(sql) : sql;
+
+        if (cached_sql) {
+            stmt->cached = true;
+            db->stmt_cache[db->n_cached_stmts].sql = cached_sql;
+            db->stmt_cache[db->n_cached_stmts].stmt = stmt;
+            db->stmt_cache[db->n_cached_stmts].sql_is_copy = copy_sql;
+            db->n_cached_stmts++;
+        }
+    }
+
+    return stmt;
+}
+
+struct db_stmt *db_prepare_stmt(struct db *db,
+                                const char *sql,
+                                const char *param_signature,
+                                const char *result_signature)
+{
+    return prepare_stmt(db, sql, param_signature, result_signature, false);
+}
+
+/* Batches */
+
+#define I8 "iiiiiiii"
+static const char batch_param_signature[] = I8 I8 I8 I8 I8 I8 I8 I8;
+#undef I8
+static_assert(sizeof(batch_param_signature) == DB_BATCH_MAX_KEYS + 1,
+              "One parameter per key in the longest batch");
+
+struct db_batch {
+    struct db *db;
+    const char *sql;
+    const char *result_signature;
+
+    const int *keys;
+    size_t n_keys;
+    size_t next_key;
+
+    struct db_stmt *stmt;
+    /* Bound parameters have to stay around until the statement is
+     * executed, which happens in the first call to step(). */
+    struct db_row rows[DB_BATCH_MAX_KEYS];
+};
+
+struct db_batch *db_batch_new(struct db *db,
+                              const char *sql,
+                              const char *result_signature,
+                              const int *keys,
+                              size_t n_keys)
+{
+    struct db_batch *batch = malloc(sizeof(*batch));
+
+    if (!batch)
+        return NULL;
+
+    batch->db = db;
+    batch->sql = sql;
+    batch->result_signature = result_signature;
+    batch->keys = keys;
+    batch->n_keys = n_keys;
+    batch->next_key = 0;
+    batch->stmt = NULL;
+
+    return batch;
+}
+
+void db_batch_free(struct db_batch *batch)
+{
+    if (!batch)
+        return;
 
-inline void db_disconnect(struct db *db) { db->disconnect(db); }
+    if (batch->stmt)
+        db_stmt_finalize(batch->stmt);
+    free(batch);
+}
 
-inline struct db_stmt *db_prepare_stmt(const struct db *db,
-                                       const char *sql,
-                                       const char *param_signature,
-                                       const char *result_signature)
+/* Prepares and binds the statement for the next keys in @batch.  Unused
+ * placeholders are bound to the last key, which doesn't change what the
+ * query returns. */
+static bool db_batch_bind_next(struct db_batch *batch)
 {
-    return db->prepare(db, sql, param_signature, result_signature);
+    const size_t n_keys =
+        LWAN_MIN(batch->n_keys - batch->next_key, (size_t)DB_BATCH_MAX_KEYS);
+    const int *keys = &batch->keys[batch->next_key];
+    size_t n_params = DB_BATCH_MIN_KEYS;
+    char sql[1024];
+
+    while (n_params < n_keys)
+        n_params <<= 1;
+
+    int len = snprintf(sql, sizeof(sql), "%s (?", batch->sql);
+    if (len < 0 || (size_t)len + 2 * n_params >= sizeof(sql))
+        return false;
+    for (size_t i = 1; i < n_params; i++) {
+        sql[len++] = ',';
+        sql[len++] = '?';
+    }
+    sql[len++] = ')';
+    sql[len] = '\0';
+
+    batch->stmt = prepare_stmt(
+        batch->db, sql,
+        &batch_param_signature[DB_BATCH_MAX_KEYS - n_params],
+        batch->result_signature, true);
+    if (!batch->stmt)
+        return false;
+
+    for (size_t i = 0; i < n_params; i++)
+        batch->rows[i].u.i = keys[LWAN_MIN(i, n_keys - 1)];
+
+    batch->next_key += n_keys;
+
+    return db_stmt_bind(batch->stmt, batch->rows);
+}
+
+bool db_batch_step(struct db_batch *batch, ...)
+{
+    while (true) {
+        if (batch->stmt) {
+            va_list ap;
+            bool ret;
+
+            va_start(ap, batch);
+            ret = batch->stmt->step(batch->stmt, ap);
+            va_end(ap);
+
+            if (ret)
+                return true;
+
+            db_stmt_finalize(batch->stmt);
+            batch->stmt = NULL;
+        }
+
+        if (batch->next_key == batch->n_keys)
+            return false;
+
+        if (!db_batch_bind_next(batch))
+            return false;
+    }
 }
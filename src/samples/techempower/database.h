@@ -21,9 +21,13 @@
 #pragma once
 
 #include <stdbool.h>
+#include <stddef.h>
 
 struct db;
 struct db_stmt;
+struct db_batch;
+struct db_pool;
+struct lwan_request;
 
 struct db_row {
     union {
@@ -34,7 +38,7 @@ struct db_row {
 };
 
 
-struct db_stmt *db_prepare_stmt(const struct db *db,
+struct db_stmt *db_prepare_stmt(struct db *db,
                                 const char *sql,
                                 const char *param_signature,
                                 const char *result_signature);
@@ -43,6 +47,20 @@ void db_stmt_finalize(struct db_stmt *stmt);
 bool db_stmt_bind(const struct db_stmt *stmt, struct db_row *rows);
 bool db_stmt_step(const struct db_stmt *stmt, ...);
 
+/* Fetches the rows for a list of integer keys with as few statements as
+ * possible: @sql is a query ending in "IN", such as "SELECT a, b FROM t
+ * WHERE id IN", to which placeholders for the keys are appended.  @keys
+ * must stay valid until the batch is freed.  Rows are stepped through
+ * with db_batch_step(), like with db_stmt_step(), and come in no
+ * particular order, once per distinct key. */
+struct db_batch *db_batch_new(struct db *db,
+                              const char *sql,
+                              const char *result_signature,
+                              const int *keys,
+                              size_t n_keys);
+bool db_batch_step(struct db_batch *batch, ...);
+void db_batch_free(struct db_batch *batch);
+
 struct db *db_connect_sqlite(const char *path,
                              bool read_only,
                              const char *pragmas[]);
@@ -51,3 +69,9 @@ struct db *db_connect_mysql(const char *host,
                             const char *pass,
                             const char *database);
 void db_disconnect(struct db *db);
+
+struct db_pool *db_pool_new(struct db *(*connect)(void *data),
+                            void *data,
+                            unsigned int max_idle);
+void db_pool_free(struct db_pool *pool);
+struct db *db_pool_get(struct db_pool *pool, struct lwan_request *request);
@@ -28,9 +28,9 @@
 #include "lwan-template.h"
 #include "lwan-mod-lua.h"
 #include "int-to-str.h"
+#include "json.h"
 
 #include "database.h"
-#include "json.h"
 
 enum db_connect_type { DB_CONN_MYSQL, DB_CONN_SQLITE };
 
@@ -55,6 +55,10 @@ static const char random_number_query[] =
     "SELECT randomNumber, id FROM world WHERE id=?";
 static const char cached_random_number_query[] =
     "SELECT randomNumber, id FROM world WHERE id=?";
+static const char random_numbers_query[] =
+    "SELECT randomNumber, id FROM world WHERE id IN";
+
+struct fortune_array;
 
 struct Fortune {
     struct {
@@ -63,6 +67,11 @@ struct Fortune {
         int id;
         char *message;
     } item;
+
+    /* Read from the database before applying the template, as the
+     * generator runs in a coroutine of its own, which can't wait for the
+     * database on behalf of the request. */
+    struct fortune_array *fortunes;
 };
 
 DEFINE_ARRAY_TYPE_INLINEFIRST(fortune_array, struct Fortune)
@@ -126,58 +135,53 @@ static const struct json_obj_descr queries_array_desc =
                              db_json_desc,
                              N_ELEMENTS(db_json_desc));
 
-static struct db *get_db(void)
+static struct json_encoder *hello_world_json_encoder;
+static struct json_encoder *db_json_encoder;
+static struct json_encoder *queries_json_encoder;
+
+/* Each I/O thread keeps up to this many idle database connections. */
+#define DB_POOL_MAX_IDLE 32
+
+static struct db *connect_db(void *data __attribute__((unused)))
 {
-    static __thread struct db *database;
-
-    if (!database) {
-        switch (db_connection_params.type) {
-        case DB_CONN_MYSQL:
-            database = db_connect_mysql(db_connection_params.mysql.hostname,
-                                        db_connection_params.mysql.user,
-                                        db_connection_params.mysql.password,
-                                        db_connection_params.mysql.database);
-            break;
-        case DB_CONN_SQLITE:
-            database = db_connect_sqlite(db_connection_params.sqlite.path, true,
-                                         db_connection_params.sqlite.pragmas);
-            break;
-        }
-        if (!database)
-            lwan_status_critical("Could not connect to the database");
+    struct db *database = NULL;
+
+    switch (db_connection_params.type) {
+    case DB_CONN_MYSQL:
+        database = db_connect_mysql(db_connection_params.mysql.hostname,
+                                    db_connection_params.mysql.user,
+                                    db_connection_params.mysql.password,
+                                    db_connection_params.mysql.database);
+        break;
+    case DB_CONN_SQLITE:
+        database = db_connect_sqlite(db_connection_params.sqlite.path, true,
+                                     db_connection_params.sqlite.pragmas);
+        break;
     }
+    if (!database)
+        lwan_status_error("Could not connect to the database");
 
     return database;
 }
 
-static int append_to_strbuf(const char *bytes, size_t len, void *data)
+static struct db *get_db(struct lwan_request *request)
 {
-    struct lwan_strbuf *strbuf = data;
-
-    return !lwan_strbuf_append_str(strbuf, bytes, len);
-}
+    static __thread struct db_pool *pool;
 
-static enum lwan_http_status
-json_response_obj(struct lwan_response *response,
-                  const struct json_obj_descr *descr,
-                  size_t descr_len,
-                  const void *data)
-{
-    if (json_obj_encode_full(descr, descr_len, data, append_to_strbuf,
-                             response->buffer, false) != 0)
-        return HTTP_INTERNAL_ERROR;
+    if (UNLIKELY(!pool)) {
+        pool = db_pool_new(connect_db, NULL, DB_POOL_MAX_IDLE);
+        if (!pool)
+            lwan_status_critical("Could not create database connection pool");
+    }
 
-    response->mime_type = "application/json";
-    return HTTP_OK;
+    return db_pool_get(pool, request);
 }
 
-static enum lwan_http_status
-json_response_arr(struct lwan_response *response,
-                  const struct json_obj_descr *descr,
-                  const void *data)
+static enum lwan_http_status json_response(struct lwan_response *response,
+                                          const struct json_encoder *encoder,
+                                          const void *data)
 {
-    if (json_arr_encode_full(descr, data, append_to_strbuf, response->buffer,
-                             false) != 0)
+    if (json_encoder_encode_strbuf(encoder, data, response->buffer) != 0)
         return HTTP_INTERNAL_ERROR;
 
     response->mime_type = "application/json";
@@ -190,13 +194,12 @@ LWAN_HANDLER(json)
 
     request->flags |= RESPONSE_NO_EXPIRES;
 
-    return json_response_obj(response, hello_world_json_desc,
-                             N_ELEMENTS(hello_world_json_desc), &j);
+    return json_response(response, hello_world_json_encoder, &j);
 }
 
 static bool db_query_key(struct db_stmt *stmt, struct db_json *out, int key)
 {
-    struct db_row row = {.u.i = key + 1};
+    struct db_row row = {.u.i = key};
     if (UNLIKELY(!db_stmt_bind(stmt, &row)))
         return false;
 
@@ -213,15 +216,19 @@ static bool db_query_key(struct db_stmt *stmt, struct db_json *out, int key)
 
 static inline bool db_query(struct db_stmt *stmt, struct db_json *out)
 {
-    uint64_t random_num = lwan_random_uint64() % 10000ull;
+    uint64_t random_num = 1 + lwan_random_uint64() % 10000ull;
     return db_query_key(stmt, out, (int)random_num);
 }
 
 LWAN_HANDLER(db)
 {
-    struct db_stmt *stmt = db_prepare_stmt(get_db(), random_number_query, "i", "ii");
+    struct db *db = get_db(request);
     struct db_json db_json;
 
+    if (UNLIKELY(!db))
+        return HTTP_INTERNAL_ERROR;
+
+    struct db_stmt *stmt = db_prepare_stmt(db, random_number_query, "i", "ii");
     if (UNLIKELY(!stmt)) {
         lwan_status_debug("preparing stmt failed");
         return HTTP_INTERNAL_ERROR;
@@ -236,8 +243,7 @@ LWAN_HANDLER(db)
 
     request->flags |= RESPONSE_NO_EXPIRES;
 
-    return json_response_obj(response, db_json_desc, N_ELEMENTS(db_json_desc),
-                         &db_json);
+    return json_response(response, db_json_encoder, &db_json);
 }
 
 static long get_number_of_queries(struct lwan_request *request)
@@ -248,20 +254,63 @@ static long get_number_of_queries(struct lwan_request *request)
                : 1;
 }
 
+static int compare_db_json_id(const void *a, const void *b)
+{
+    const struct db_json *ja = a, *jb = b;
+
+    return (ja->id > jb->id) - (ja->id < jb->id);
+}
+
 LWAN_HANDLER(queries)
 {
     enum lwan_http_status ret = HTTP_INTERNAL_ERROR;
     long queries = get_number_of_queries(request);
+    struct db *db = get_db(request);
+    struct queries_json qj = {.queries_len = (size_t)queries};
+    int keys[N_ELEMENTS(qj.queries)];
+    size_t n_keys = 0, n_found = 0;
+    long random_number, id;
 
-    struct db_stmt *stmt = db_prepare_stmt(get_db(), random_number_query, "i", "ii");
-    if (UNLIKELY(!stmt))
+    if (UNLIKELY(!db))
         return HTTP_INTERNAL_ERROR;
 
-    struct queries_json qj = {.queries_len = (size_t)queries};
-    for (long i = 0; i < queries; i++) {
-        if (!db_query(stmt, &qj.queries[i]))
+    /* Rows are fetched in batches, which return a row only once per id,
+     * in no particular order: keep the randomly picked ids sorted, so
+     * that the entries for each row can be found and filled in at once. */
+    for (size_t i = 0; i < qj.queries_len; i++)
+        qj.queries[i].id = 1 + (int)(lwan_random_uint64() % 10000);
+    qsort(qj.queries, qj.queries_len, sizeof(qj.queries[0]),
+          compare_db_json_id);
+    for (size_t i = 0; i < qj.queries_len; i++) {
+        if (!n_keys || keys[n_keys - 1] != qj.queries[i].id)
+            keys[n_keys++] = qj.queries[i].id;
+    }
+
+    struct db_batch *batch =
+        db_batch_new(db, random_numbers_query, "ii", keys, n_keys);
+    if (UNLIKELY(!batch))
+        return HTTP_INTERNAL_ERROR;
+
+    while (db_batch_step(batch, &random_number, &id)) {
+        const struct db_json key = {.id = (int)id};
+        struct db_json *entry =
+            bsearch(&key, qj.queries, qj.queries_len, sizeof(qj.queries[0]),
+                    compare_db_json_id);
+
+        if (UNLIKELY(!entry))
             goto out;
+
+        /* bsearch() may have found any of the entries with this id. */
+        while (entry > qj.queries && entry[-1].id == key.id)
+            entry--;
+        for (; entry < qj.queries + qj.queries_len && entry->id == key.id;
+             entry++)
+            entry->randomNumber = (int)random_number;
+
+        n_found++;
     }
+    if (UNLIKELY(n_found != n_keys))
+        goto out;
 
     /* Avoid reallocations/copies while building response.  Each response
      * has ~32bytes.  500 queries (max) should be less than 16384 bytes,
@@ -270,14 +319,16 @@ LWAN_HANDLER(queries)
 
     request->flags |= RESPONSE_NO_EXPIRES;
 
-    ret = json_response_arr(response, &queries_array_desc, &qj);
+    ret = json_response(response, queries_json_encoder, &qj);
 out:
-    db_stmt_finalize(stmt);
+    db_batch_free(batch);
 
     return ret;
 }
 
 static struct cache *cached_queries_cache;
+/* Only used while the cache is populated, before the server starts. */
+static struct db *cached_queries_db;
 struct db_json_cached {
     struct cache_entry base;
     struct db_json db_json;
@@ -296,7 +347,8 @@ static struct cache_entry *cached_queries_new(const void *keyptr,
     if (UNLIKELY(!entry))
         return NULL;
 
-    stmt = db_prepare_stmt(get_db(), cached_random_number_query, "i", "ii");
+    stmt = db_prepare_stmt(cached_queries_db, cached_random_number_query, "i",
+                           "ii");
     if (UNLIKELY(!stmt)) {
         free(entry);
         return NULL;
@@ -324,7 +376,7 @@ LWAN_HANDLER(cached_queries)
     struct queries_json qj = {.queries_len = (size_t)queries};
     for (long i = 0; i < queries; i++) {
         struct db_json_cached *jc;
-        int key = (int)lwan_random_uint64() % 10000;
+        int key = 1 + (int)(lwan_random_uint64() % 10000);
         int error;
 
         jc = (struct db_json_cached *)cache_get_and_ref_entry(
@@ -342,7 +394,7 @@ LWAN_HANDLER(cached_queries)
     lwan_strbuf_grow_to(response->buffer, (size_t)(32l * queries));
 
     request->flags |= RESPONSE_NO_EXPIRES;
-    return json_response_arr(response, &queries_array_desc, &qj);
+    return json_response(response, queries_json_encoder, &qj);
 }
 
 LWAN_HANDLER(plaintext)
@@ -385,58 +437,78 @@ static bool append_fortune(struct coro *coro,
     return true;
 }
 
-static int fortune_list_generator(struct coro *coro, void *data)
+static bool get_fortunes(struct lwan_request *request,
+                         struct fortune_array *fortunes)
 {
     static const char fortune_query[] = "SELECT * FROM Fortune";
-    struct Fortune *fortune = data;
-    struct fortune_array fortunes;
+    struct coro *coro = request->conn->coro;
+    struct db *db = get_db(request);
     struct db_stmt *stmt;
+    bool ok = false;
 
-    stmt = db_prepare_stmt(get_db(), fortune_query, "", "is");
-    if (UNLIKELY(!stmt))
-        return 0;
+    if (UNLIKELY(!db))
+        return false;
 
-    fortune_array_init(&fortunes);
+    stmt = db_prepare_stmt(db, fortune_query, "", "is");
+    if (UNLIKELY(!stmt))
+        return false;
 
     long id;
     char fortune_buffer[256];
     while (db_stmt_step(stmt, &id, &fortune_buffer, sizeof(fortune_buffer))) {
-        if (!append_fortune(coro, &fortunes, (int)id, fortune_buffer))
+        if (!append_fortune(coro, fortunes, (int)id, fortune_buffer))
             goto out;
     }
 
-    if (!append_fortune(coro, &fortunes, 0,
+    if (!append_fortune(coro, fortunes, 0,
                         "Additional fortune added at request time."))
         goto out;
 
-    fortune_array_sort(&fortunes, fortune_compare);
+    fortune_array_sort(fortunes, fortune_compare);
+    ok = true;
+
+out:
+    db_stmt_finalize(stmt);
+    return ok;
+}
 
+static int fortune_list_generator(struct coro *coro, void *data)
+{
+    struct Fortune *fortune = data;
     struct Fortune *iter;
-    LWAN_ARRAY_FOREACH (&fortunes, iter) {
+
+    LWAN_ARRAY_FOREACH (fortune->fortunes, iter) {
         fortune->item.id = iter->item.id;
         fortune->item.message = iter->item.message;
         coro_yield(coro, 1);
     }
 
-out:
-    fortune_array_reset(&fortunes);
-    db_stmt_finalize(stmt);
     return 0;
 }
 
 LWAN_HANDLER(fortunes)
 {
-    struct Fortune fortune;
+    enum lwan_http_status status = HTTP_INTERNAL_ERROR;
+    struct fortune_array fortunes;
+    struct Fortune fortune = {.fortunes = &fortunes};
+
+    fortune_array_init(&fortunes);
+    if (UNLIKELY(!get_fortunes(request, &fortunes)))
+        goto out;
 
     lwan_strbuf_grow_to(response->buffer, 1500);
 
     if (UNLIKELY(!lwan_tpl_apply_with_buffer(fortune_tpl, response->buffer,
                                              &fortune)))
-        return HTTP_INTERNAL_ERROR;
+        goto out;
 
     request->flags |= RESPONSE_NO_EXPIRES;
     response->mime_type = "text/html; charset=UTF-8";
-    return HTTP_OK;
+    status = HTTP_OK;
+
+out:
+    fortune_array_reset(&fortunes);
+    return status;
 }
 
 LWAN_HANDLER(quit_lwan)
@@ -484,6 +556,14 @@ int main(void)
     if (!fortune_tpl)
         lwan_status_critical("Could not compile fortune templates");
 
+    hello_world_json_encoder = json_obj_encoder_new(
+        hello_world_json_desc, N_ELEMENTS(hello_world_json_desc));
+    db_json_encoder =
+        json_obj_encoder_new(db_json_desc, N_ELEMENTS(db_json_desc));
+    queries_json_encoder = json_arr_encoder_new(&queries_array_desc);
+    if (!hello_world_json_encoder || !db_json_encoder || !queries_json_encoder)
+        lwan_status_critical("Could not create JSON encoders");
+
     cached_queries_cache = cache_create_full(cached_queries_new,
                                              cached_queries_free,
                                              hash_int_new,
@@ -493,16 +573,24 @@ int main(void)
         lwan_status_critical("Could not create cached queries cache");
     /* Pre-populate the cache and make it read-only to avoid locking in the fast
      * path. */
-    for (int i = 0; i < 10000; i++) {
+    cached_queries_db = connect_db(NULL);
+    if (!cached_queries_db)
+        lwan_status_critical("Could not populate cached queries cache");
+    for (int i = 1; i <= 10000; i++) {
         int error;
         (void)cache_get_and_ref_entry(cached_queries_cache, (void *)(intptr_t)i,
                                       &error);
     }
     cache_make_read_only(cached_queries_cache);
+    db_disconnect(cached_queries_db);
+    cached_queries_db = NULL;
 
     lwan_main_loop(&l);
 
     cache_destroy(cached_queries_cache);
+    json_encoder_free(queries_json_encoder);
+    json_encoder_free(db_json_encoder);
+    json_encoder_free(hello_world_json_encoder);
     lwan_tpl_free(fortune_tpl);
     lwan_shutdown(&l);
 
@@ -19,6 +19,7 @@
  */
 
 #include <errno.h>
+#include <stdarg.h>
 #include <stdlib.h>
 
 #include "lwan.h"
@@ -104,23 +105,86 @@ out:
     __builtin_unreachable();
 }
 
+/* Echoes messages back as they're received, in pieces of at most 4KiB, so
+ * arbitrarily large messages can be echoed without buffering them whole. */
+LWAN_HANDLER_ROUTE(ws_stream, "/ws-stream")
+{
+    enum lwan_http_status status = lwan_request_websocket_upgrade_full(
+        request, &(struct lwan_websocket_options){.permessage_deflate = true});
+
+    if (status != HTTP_SWITCHING_PROTOCOLS)
+        return status;
+
+    while (true) {
+        bool last;
+
+        switch (lwan_response_websocket_read_partial(request, 4096, &last)) {
+        case ENOTCONN:   /* read() called before connection is websocket */
+        case ECONNRESET: /* Client closed the connection */
+            goto out;
+
+        case EAGAIN: /* Nothing is available */
+            lwan_request_await_read(request, request->fd);
+            break;
+
+        case 0: /* Got a piece of a message: send it back right away */
+            lwan_response_websocket_write_text_partial(request, last);
+            break;
+        }
+    }
+
+out:
+    /* We abort the coroutine here because there's not much we can do at this
+     * point as this isn't a HTTP connection anymore.  */
+    coro_yield(request->conn->coro, CONN_CORO_ABORT);
+    __builtin_unreachable();
+}
+
 static void unsub_chat(void *data1, void *data2)
 {
     lwan_pubsub_unsubscribe((struct lwan_pubsub_topic *)data1,
                             (struct lwan_pubsub_subscriber *)data2);
 }
 
-static void pub_depart_message(void *data1, void *data2)
+static void chat_msg_done(void *data)
+{
+    lwan_pubsub_msg_done((struct lwan_pubsub_msg *)data);
+}
+
+/* Chat messages are published as shared frames, so that they're compressed
+ * only once regardless of how many users are connected. */
+static void publish_chat(struct lwan_pubsub_topic *topic, const char *fmt, ...)
+    __attribute__((format(printf, 2, 3)));
+static void publish_chat(struct lwan_pubsub_topic *topic, const char *fmt, ...)
 {
-    char buffer[128];
-    int r;
+    struct lwan_strbuf msg, frame;
+    va_list ap;
 
-    r = snprintf(buffer, sizeof(buffer), "*** User%d has departed the chat!\n",
-                 (int)(intptr_t)data2);
-    if (r < 0 || (size_t)r >= sizeof(buffer))
+    if (!lwan_strbuf_init(&msg))
         return;
+    if (!lwan_strbuf_init(&frame))
+        goto out_free_msg;
+
+    va_start(ap, fmt);
+    bool printed = lwan_strbuf_vprintf(&msg, fmt, ap);
+    va_end(ap);
+
+    if (printed && lwan_websocket_prepare_shared_text(
+                       &frame, lwan_strbuf_get_buffer(&msg),
+                       lwan_strbuf_get_length(&msg))) {
+        lwan_pubsub_publish(topic, lwan_strbuf_get_buffer(&frame),
+                            lwan_strbuf_get_length(&frame));
+    }
+
+    lwan_strbuf_free(&frame);
+out_free_msg:
+    lwan_strbuf_free(&msg);
+}
 
-    lwan_pubsub_publish((struct lwan_pubsub_topic *)data1, buffer, (size_t)r);
+static void pub_depart_message(void *data1, void *data2)
+{
+    publish_chat((struct lwan_pubsub_topic *)data1,
+                 "*** User%d has departed the chat!\n", (int)(intptr_t)data2);
 }
 
 LWAN_HANDLER_ROUTE(ws_chat, "/ws-chat")
@@ -136,7 +200,11 @@ LWAN_HANDLER_ROUTE(ws_chat, "/ws-chat")
         return HTTP_INTERNAL_ERROR;
     coro_defer2(request->conn->coro, unsub_chat, chat, sub);
 
-    status = lwan_request_websocket_upgrade(request);
+    status = lwan_request_websocket_upgrade_full(
+        request, &(struct lwan_websocket_options){
+                     .permessage_deflate = true,
+                     .no_context_takeover = true,
+                 });
     if (status != HTTP_SWITCHING_PROTOCOLS)
         return status;
 
@@ -148,7 +216,7 @@ LWAN_HANDLER_ROUTE(ws_chat, "/ws-chat")
 
     coro_defer2(request->conn->coro, pub_depart_message, chat,
                 (void *)(intptr_t)user_id);
-    lwan_pubsub_publishf(chat, "*** User%d has joined the chat!\n", user_id);
+    publish_chat(chat, "*** User%d has joined the chat!\n", user_id);
 
     const int websocket_fd = request->fd;
     const int sub_fd = lwan_pubsub_get_notification_fd(sub);
@@ -158,17 +226,23 @@ LWAN_HANDLER_ROUTE(ws_chat, "/ws-chat")
                                     sub_fd, CONN_CORO_WANT_READ, -1);
 
         if (resumed_fd == sub_fd) {
-            while ((msg = lwan_pubsub_consume(sub))) {
-                const struct lwan_value *value = lwan_pubsub_msg_value(msg);
+            if (lwan_pubsub_is_disconnected(sub)) {
+                lwan_status_debug("User%d is too slow, disconnecting",
+                                  user_id);
+                goto out;
+            }
 
-                lwan_strbuf_set(response->buffer, value->value, value->len);
+            while ((msg = lwan_pubsub_consume(sub))) {
+                /* Messages are sent straight from the buffer shared by all
+                 * subscribers.  Writing can abort the coroutine, so defer
+                 * dropping the reference in case this happens. */
+                coro_deferred done =
+                    coro_defer(request->conn->coro, chat_msg_done, msg);
 
-                /* Mark as done before writing: websocket_write() can abort the
-                 * coroutine and we want to drop the reference before this
-                 * happens. */
-                lwan_pubsub_msg_done(msg);
+                lwan_response_websocket_write_shared(request,
+                                                     lwan_pubsub_msg_value(msg));
 
-                lwan_response_websocket_write_text(request);
+                coro_defer_fire_and_disarm(request->conn->coro, done);
             }
         } else if (resumed_fd == websocket_fd) {
             switch (lwan_response_websocket_read(request)) {
@@ -177,7 +251,7 @@ LWAN_HANDLER_ROUTE(ws_chat, "/ws-chat")
                 goto out;
 
             case 0: /* We got something! Copy it to echo it back */
-                lwan_pubsub_publishf(
+                publish_chat(
                     chat, "User%d: %.*s\n", user_id,
                     (int)lwan_strbuf_get_length(response->buffer),
                     lwan_strbuf_get_buffer(response->buffer));
@@ -210,6 +284,9 @@ LWAN_HANDLER_ROUTE(index, "/")
 int main(void)
 {
     chat = lwan_pubsub_new_topic();
+    /* Don't let a client that can't keep up pin an unbounded amount of
+     * messages. */
+    lwan_pubsub_set_queue_limit(chat, 1024, LWAN_PUBSUB_DISCONNECT);
 
     lwan_main();
 
@@ -0,0 +1,291 @@
+#!/usr/bin/env python3
+
+# Runs the scenarios described in bench-scenarios.json with weighttp,
+# recording throughput and latency percentiles to a JSON file, and compares
+# two of these files to flag regressions between builds.
+#
+#   bench.py run [--scenarios FILE] [--output FILE] [--only NAME,...] BUILD_DIR
+#   bench.py compare [--threshold PERCENT] BASELINE.json CANDIDATE.json
+
+import argparse
+import http.client
+import json
+import os
+import platform
+import shutil
+import statistics
+import subprocess
+import sys
+import time
+
+SCRIPT_DIR = os.path.dirname(os.path.abspath(__file__))
+
+HARNESSES = {
+  'testrunner': {
+    'binary': 'src/bin/testrunner/testrunner',
+    'files': ('src/bin/testrunner/testrunner.conf',
+              'src/bin/testrunner/test.lua'),
+    'probe': '/hello',
+  },
+  'techempower': {
+    'binary': 'src/samples/techempower/techempower',
+    'files': ('src/samples/techempower/techempower.db',
+              'src/samples/techempower/techempower.conf',
+              'src/samples/techempower/json.lua'),
+    'probe': '/json',
+  },
+}
+
+
+def log(msg):
+  sys.stderr.write(msg + '\n')
+
+
+class Harness:
+  def __init__(self, build_dir, name):
+    self.spec = HARNESSES[name]
+    self.name = name
+    self.binary = os.path.join(build_dir, self.spec['binary'])
+    self.copied = []
+    self.process = None
+
+  def available(self):
+    return os.access(self.binary, os.X_OK)
+
+  def _probe(self):
+    try:
+      conn = http.client.HTTPConnection('127.0.0.1', 8080, timeout=1)
+      conn.request('GET', self.spec['probe'])
+      return conn.getresponse().status == 200
+    except OSError:
+      return False
+
+  def __enter__(self):
+    for f in self.spec['files']:
+      if os.path.exists(f):
+        base = os.path.basename(f)
+        shutil.copyfile(f, base)
+        self.copied.append(base)
+
+    try:
+      return self._start()
+    except:
+      self.__exit__()
+      raise
+
+  def _start(self):
+    # Keep this short so connections from a scenario don't linger into
+    # the next one.
+    env = dict(os.environ, KEEP_ALIVE_TIMEOUT='2')
+    self.process = subprocess.Popen([self.binary], env=env,
+                                    stdout=subprocess.DEVNULL,
+                                    stderr=subprocess.STDOUT)
+    for _ in range(50):
+      if self.process.poll() is not None:
+        raise Exception('%s exited while starting up' % self.name)
+      if self._probe():
+        return self
+      time.sleep(0.1)
+
+    raise Exception('Timeout waiting for %s' % self.name)
+
+  def __exit__(self, *args):
+    if self.process and self.process.poll() is None:
+      self.process.terminate()
+      try:
+        self.process.wait(timeout=5)
+      except subprocess.TimeoutExpired:
+        self.process.kill()
+        self.process.wait()
+
+    for f in self.copied:
+      try:
+        os.remove(f)
+      except FileNotFoundError:
+        pass
+
+
+def weighttp(build_dir, scenario):
+  command = [
+    os.path.join(build_dir, 'src/bin/tools/weighttp'),
+    '-q',
+    '-t', str(scenario['threads']),
+    '-c', str(scenario['connections']),
+    '-n', str(scenario['requests']),
+  ]
+  if scenario['keep_alive']:
+    command.append('-k')
+  if scenario['pipeline'] > 1:
+    command.extend(('-K', str(scenario['pipeline'])))
+  if scenario['rate']:
+    command.extend(('-R', str(scenario['rate'])))
+  if scenario['websocket']:
+    command.extend(('-W', str(scenario['websocket'])))
+  command.append('http://127.0.0.1:8080' + scenario['path'])
+
+  output = subprocess.run(command, capture_output=True, check=True)
+  return json.loads(output.stdout)
+
+
+def run_scenario(build_dir, scenario):
+  runs = []
+  for i in range(scenario['repeat']):
+    log('*** %s: run %d of %d' % (scenario['name'], i + 1, scenario['repeat']))
+    runs.append(weighttp(build_dir, scenario))
+
+  # Report the run with the median throughput, so that its latencies
+  # are consistent with the throughput figure.
+  runs.sort(key=lambda r: r['reqs_per_sec'])
+  median = runs[len(runs) // 2]
+  return {
+    'description': scenario.get('description', ''),
+    'harness': scenario['harness'],
+    'path': scenario['path'],
+    'threads': scenario['threads'],
+    'connections': scenario['connections'],
+    'requests': scenario['requests'],
+    'keep_alive': scenario['keep_alive'],
+    'pipeline': scenario['pipeline'],
+    'rate': scenario['rate'],
+    'websocket': scenario['websocket'],
+    'reqs_per_sec': median['reqs_per_sec'],
+    'reqs_per_sec_stdev': statistics.pstdev(r['reqs_per_sec'] for r in runs),
+    'kBps_per_sec': median['kBps_per_sec'],
+    'latency_usec': median['latency_usec'],
+    'status_codes': median['status_codes'],
+    'failed': median['response_counts']['fail'] + median['response_counts']['errs'],
+  }
+
+
+def load_scenarios(path, only):
+  with open(path) as f:
+    spec = json.load(f)
+
+  defaults = spec.get('defaults', {})
+  scenarios = []
+  for s in spec['scenarios']:
+    scenario = dict(defaults, **s)
+    if only and scenario['name'] not in only:
+      continue
+    if scenario['harness'] not in HARNESSES:
+      raise Exception('Unknown harness %s in scenario %s' %
+                      (scenario['harness'], scenario['name']))
+    scenarios.append(scenario)
+
+  return scenarios
+
+
+def cmd_run(args):
+  build_dir = os.path.abspath(args.build_dir)
+  only = set(args.only.split(',')) if args.only else None
+  scenarios = load_scenarios(args.scenarios, only)
+
+  results = {
+    'build_dir': build_dir,
+    'timestamp': int(time.time()),
+    'host': platform.node(),
+    'cpus': os.cpu_count(),
+    'scenarios': {},
+    'skipped': {},
+  }
+
+  for harness_name in HARNESSES:
+    harness_scenarios = [s for s in scenarios if s['harness'] == harness_name]
+    if not harness_scenarios:
+      continue
+
+    harness = Harness(build_dir, harness_name)
+    if not harness.available():
+      for s in harness_scenarios:
+        log('*** %s: skipped, %s not built' % (s['name'], harness_name))
+        results['skipped'][s['name']] = '%s not built' % harness_name
+      continue
+
+    with harness:
+      for s in harness_scenarios:
+        results['scenarios'][s['name']] = run_scenario(build_dir, s)
+
+  with open(args.output, 'w') as f:
+    json.dump(results, f, indent=2)
+    f.write('\n')
+
+  print_results(results)
+  log('*** Results written to %s' % args.output)
+  return 0
+
+
+def print_results(results):
+  print('%-24s %12s %10s %10s %10s %10s' %
+        ('scenario', 'req/s', 'p50 us', 'p99 us', 'p99.9 us', 'failed'))
+  for name, r in results['scenarios'].items():
+    lat = r['latency_usec']
+    print('%-24s %12d %10d %10d %10d %10d' %
+          (name, r['reqs_per_sec'], lat['p50'], lat['p99'], lat['p99.9'],
+           r['failed']))
+
+
+def change(old, new):
+  if not old:
+    return 0.0
+  return (new - old) * 100.0 / old
+
+
+def cmd_compare(args):
+  with open(args.baseline) as f:
+    baseline = json.load(f)
+  with open(args.candidate) as f:
+    candidate = json.load(f)
+
+  regressions = []
+  print('%-24s %-12s %12s %12s %9s' %
+        ('scenario', 'metric', 'baseline', 'candidate', 'change'))
+
+  for name, old in baseline['scenarios'].items():
+    new = candidate['scenarios'].get(name)
+    if new is None:
+      print('%-24s (missing from candidate)' % name)
+      continue
+
+    # Higher is better for throughput, lower is better for latencies.
+    metrics = [('req/s', old['reqs_per_sec'], new['reqs_per_sec'], 1)]
+    for p in ('p50', 'p99', 'p99.9'):
+      metrics.append((p + ' us', old['latency_usec'][p],
+                      new['latency_usec'][p], -1))
+    metrics.append(('failed', old['failed'], new['failed'], -1))
+
+    for metric, o, n, direction in metrics:
+      delta = change(o, n)
+      regressed = (metric == 'failed' and n > o) or \
+                  (metric != 'failed' and -delta * direction > args.threshold)
+      print('%-24s %-12s %12d %12d %+8.1f%%%s' %
+            (name, metric, o, n, delta, '  REGRESSION' if regressed else ''))
+      if regressed:
+        regressions.append((name, metric))
+
+  if regressions:
+    print('\n%d regression(s) beyond %.1f%%' % (len(regressions), args.threshold))
+    return 1
+
+  print('\nNo regressions beyond %.1f%%' % args.threshold)
+  return 0
+
+
+if __name__ == '__main__':
+  parser = argparse.ArgumentParser(description='lwan benchmark scenarios')
+  sub = parser.add_subparsers(dest='command', required=True)
+
+  run = sub.add_parser('run', help='run benchmark scenarios')
+  run.add_argument('--scenarios',
+                   default=os.path.join(SCRIPT_DIR, 'bench-scenarios.json'))
+  run.add_argument('--output', default='bench-results.json')
+  run.add_argument('--only', help='comma-separated list of scenarios to run')
+  run.add_argument('build_dir')
+
+  compare = sub.add_parser('compare', help='compare two result files')
+  compare.add_argument('--threshold', type=float, default=5.0,
+                       help='percentage change considered a regression')
+  compare.add_argument('baseline')
+  compare.add_argument('candidate')
+
+  args = parser.parse_args()
+  sys.exit(cmd_run(args) if args.command == 'run' else cmd_compare(args))
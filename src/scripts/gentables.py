@@ -153,6 +153,17 @@ static inline uint32_t read32be(const void *ptr) {
 
   first_level, next_table_first_level = pad_table(symbols)
 
+  # Used by the encoder, and to build the tables for the decoder in
+  # lwan-h2-huffman.c; codes are right-aligned.
+  print("static const struct h2_huffman_symbol_code {")
+  print("    uint32_t code;")
+  print("    uint8_t num_bits;")
+  print("} symbol_codes[257] = {")
+  for symbol in range(257):
+    code = "".join(symbols[symbol])
+    print(f"    {{0x{int(code, 2):x}, {len(code)}}},")
+  print("};")
+
   print("struct h2_huffman_code {")
   print("   uint8_t symbol;")
   print("   int8_t num_bits;")
@@ -174,6 +185,7 @@ static inline uint32_t read32be(const void *ptr) {
   # far too many ways". Part 2, specifically: https://fgiesen.wordpress.com/2018/02/20/reading-bits-in-far-too-many-ways-part-2/
   print("""struct bit_reader {
     const uint8_t *bitptr;
+    const uint8_t *bitend;
     uint64_t bitbuf;
     int64_t total_bitcount;
     int bitcount;
@@ -182,21 +194,21 @@ static inline uint32_t read32be(const void *ptr) {
 static inline uint8_t peek_byte(struct bit_reader *reader)
 {
     if (reader->bitcount < 8) {
-        if (reader->total_bitcount >= 64) {
+        if (reader->bitend - reader->bitptr >= 8) {
             reader->bitbuf |= read64be(reader->bitptr) >> reader->bitcount;
-            reader->bitptr += (63 - reader->bitcount + (reader->bitcount & 1)) >> 3;
+            reader->bitptr += (63 - reader->bitcount) >> 3;
             reader->bitcount |= 56;
-        } else if (reader->total_bitcount >= 32) {
-            reader->bitbuf |= read32be(reader->bitptr) >> reader->bitcount;
-            reader->bitptr += (31 - reader->bitcount + (reader->bitcount & 1)) >> 3;
-            reader->bitcount |= 24;
         } else {
-            reader->bitbuf |= *reader->bitptr >> reader->bitcount;
-            reader->bitptr += (7 - reader->bitcount + (reader->bitcount & 1)) >> 3;
-            reader->bitcount |= 8;
+            /* Close to the end of the input: refill one byte at a time, so
+             * that nothing past it is read. */
+            while (reader->bitcount <= 56 && reader->bitptr < reader->bitend) {
+                reader->bitbuf |= (uint64_t)*reader->bitptr++
+                                  << (56 - reader->bitcount);
+                reader->bitcount += 8;
+            }
         }
     }
-    return reader->bitbuf >> 56;
+    return (uint8_t)(reader->bitbuf >> 56);
 }
 
 static inline bool consume(struct bit_reader *reader, int count)
@@ -205,7 +217,7 @@ static inline bool consume(struct bit_reader *reader, int count)
     reader->bitbuf <<= count;
     reader->bitcount -= count;
     reader->total_bitcount -= count;
-    return reader->total_bitcount > 0;
+    return reader->total_bitcount >= 0;
 }
 """)
   
@@ -222,6 +234,7 @@ void lwan_h2_huffman_init(struct lwan_h2_huffman_decoder *huff,
 {
     huff->bit_reader = (struct bit_reader){
         .bitptr = input,
+        .bitend = input + input_len,
         .total_bitcount = (int64_t)input_len * 8,
     };
     uint8_ring_buffer_init(&huff->buffer);
@@ -275,8 +288,8 @@ ssize_t lwan_h2_huffman_next(struct lwan_h2_huffman_decoder *huff)
         if (LIKELY(level3)) {
             peeked_byte = peek_byte(reader);
             if (level3[peeked_byte].num_bits < 0) {
-                /* EOS found */
-                goto done;
+                /* EOS can't appear in a string literal (RFC7541 §5.2) */
+                return -1;
             }
             if (LIKELY(level3[peeked_byte].num_bits)) {
                 uint8_ring_buffer_put_copy(buffer, level3[peeked_byte].symbol);
@@ -289,26 +302,25 @@ ssize_t lwan_h2_huffman_next(struct lwan_h2_huffman_decoder *huff)
         return -1;
     }
 
-    /* FIXME: ensure we're not promoting types unnecessarily here */
-    if (reader->total_bitcount) {
+    while (reader->total_bitcount) {
+        /* Less than a byte left: either codes shorter than that, or
+         * padding, which has to be a prefix of EOS (all ones). */
         const uint8_t peeked_byte = peek_byte(reader);
-        const uint8_t eos_prefix = ((1 << bit_reader.total_bitcount) - 1)
-                                   << (8 - bit_reader.total_bitcount);
+        const uint8_t eos_prefix =
+            (uint8_t)(((1u << reader->total_bitcount) - 1u)
+                      << (8u - reader->total_bitcount));
 
         if ((peeked_byte & eos_prefix) == eos_prefix)
             goto done;
 
-        if (level0[peeked_byte].num_bits == (int8_t)reader->total_bitcount) {
-            uint8_ring_buffer_put_copy(buffer, level0[peeked_byte].symbol);
-            goto done;
-        }
+        if (!level0[peeked_byte].num_bits ||
+            level0[peeked_byte].num_bits > reader->total_bitcount)
+            return -1;
 
-        /* If we get here, then the remaining bits are either:
-         *  - Not a prefix of EOS
-         *  - Incomplete sequence
-         *  - Has overlong padding
-         */
-        return -1;
+        if (uint8_ring_buffer_full(buffer))
+            goto done;
+        uint8_ring_buffer_put_copy(buffer, level0[peeked_byte].symbol);
+        consume(reader, level0[peeked_byte].num_bits);
     }
 
 done:
@@ -12,8 +12,10 @@ import shutil
 import signal
 import socket
 import string
+import struct
 import subprocess
 import sys
+import threading
 import time
 import unittest
 import logging
@@ -38,7 +40,8 @@ class LwanTest(unittest.TestCase):
   }
   files_to_copy = {
     'testrunner': ('src/bin/testrunner/testrunner.conf',
-                   'src/bin/testrunner/test.lua'),
+                   'src/bin/testrunner/test.lua',
+                   'src/bin/testrunner/redirects.map'),
     'techempower': ('src/samples/techempower/techempower.db',
                     'src/samples/techempower/techempower.conf',
                     'src/samples/techempower/json.lua'),
@@ -217,6 +220,32 @@ class TestPost(LwanTest):
     except requests.exceptions.ConnectionError:
       pass
 
+  def make_streamed_request(self, data):
+    r = requests.post('http://127.0.0.1:8080/post/stream', data=data)
+
+    self.assertHttpResponseValid(r, 200, 'application/json')
+    return r.json()
+
+  def test_streamed_request(self):
+    random.seed(1234)
+    data = "".join(random.choice(string.printable) for c in range(5000))
+
+    self.assertEqual(self.make_streamed_request(data), {
+      'received': len(data),
+      'sum': sum(ord(b) for b in data)
+    })
+
+  def test_streamed_chunked_request(self):
+    random.seed(4321)
+    chunks = ["".join(random.choice(string.printable) for c in range(size))
+              for size in (1, 10, 1500, 3000, 7)]
+
+    # A generator makes requests use chunked transfer encoding
+    self.assertEqual(self.make_streamed_request(c.encode() for c in chunks), {
+      'received': sum(len(c) for c in chunks),
+      'sum': sum(ord(b) for c in chunks for b in c)
+    })
+
 
 class TestFileServing(LwanTest):
   def test_mime_type_is_correct(self):
@@ -258,10 +287,12 @@ class TestFileServing(LwanTest):
 
     self.assertHttpResponseValid(r, 206, 'application/octet-stream')
 
+    # Both ends of a range are included in it
     self.assertTrue('content-length' in r.headers)
-    self.assertEqual(r.headers['content-length'], '50')
+    self.assertEqual(r.headers['content-length'], '51')
+    self.assertEqual(r.headers['content-range'], 'bytes 0-50/32768')
 
-    self.assertEqual(r.text, '\0' * 50)
+    self.assertEqual(r.text, '\0' * 51)
 
   def test_range_half_inverted(self):
     r = requests.get('http://127.0.0.1:8080/zero',
@@ -274,13 +305,33 @@ class TestFileServing(LwanTest):
     r = requests.get('http://127.0.0.1:8080/zero',
           headers={'Range': 'bytes=50-50'})
 
-    self.assertHttpResponseValid(r, 416, 'text/html')
+    self.assertHttpResponseValid(r, 206, 'application/octet-stream')
+
+    self.assertTrue('content-length' in r.headers)
+    self.assertEqual(r.headers['content-length'], '1')
+    self.assertEqual(r.headers['content-range'], 'bytes 50-50/32768')
+
+    self.assertEqual(r.text, '\0')
 
 
   def test_range_too_big(self):
     r = requests.get('http://127.0.0.1:8080/zero',
           headers={'Range': 'bytes=0-40000'})
 
+    # Ranges ending past the end of the file are cut short
+    self.assertHttpResponseValid(r, 206, 'application/octet-stream')
+
+    self.assertTrue('content-length' in r.headers)
+    self.assertEqual(r.headers['content-length'], '32768')
+    self.assertEqual(r.headers['content-range'], 'bytes 0-32767/32768')
+
+    self.assertEqual(r.text, '\0' * 32768)
+
+
+  def test_range_from_too_big(self):
+    r = requests.get('http://127.0.0.1:8080/zero',
+          headers={'Range': 'bytes=32768-'})
+
     self.assertHttpResponseValid(r, 416, 'text/html')
 
 
@@ -292,6 +343,7 @@ class TestFileServing(LwanTest):
 
     self.assertTrue('content-length' in r.headers)
     self.assertEqual(r.headers['content-length'], '100')
+    self.assertEqual(r.headers['content-range'], 'bytes 32668-32767/32768')
 
     self.assertEqual(r.text, '\0' * 100)
 
@@ -307,6 +359,136 @@ class TestFileServing(LwanTest):
     self.assertEqual(r.text, '\0' * 32718)
 
 
+  def byteranges(self, r):
+    content_type = r.headers['content-type']
+    self.assertTrue(content_type.startswith('multipart/byteranges; boundary='))
+    boundary = content_type.split('boundary=')[1].encode()
+
+    self.assertTrue(r.content.endswith(b'\r\n--' + boundary + b'--\r\n'))
+    self.assertEqual(int(r.headers['content-length']), len(r.content))
+
+    parts = []
+    for part in r.content.split(b'--' + boundary)[1:-1]:
+      headers, body = part.split(b'\r\n\r\n', 1)
+      headers = dict(line.split(b': ', 1) for line in headers.split(b'\r\n')[1:])
+
+      self.assertEqual(headers[b'Content-Type'], b'application/octet-stream')
+      # Every part but the last is followed by the CRLF preceding the
+      # next boundary.
+      parts.append((headers[b'Content-Range'].decode(), body.rstrip(b'\r\n')))
+
+    return parts
+
+
+  def test_range_multiple(self):
+    r = requests.get('http://127.0.0.1:8080/zero',
+          headers={'Range': 'bytes=0-9, 100-119'})
+
+    self.assertEqual(r.status_code, 206)
+    self.assertEqual(self.byteranges(r), [
+      ('bytes 0-9/32768', b'\0' * 10),
+      ('bytes 100-119/32768', b'\0' * 20),
+    ])
+
+
+  def test_range_multiple_overlapping(self):
+    r = requests.get('http://127.0.0.1:8080/zero',
+          headers={'Range': 'bytes=0-99,50-149'})
+
+    self.assertEqual(r.status_code, 206)
+    self.assertEqual(self.byteranges(r), [
+      ('bytes 0-99/32768', b'\0' * 100),
+      ('bytes 50-149/32768', b'\0' * 100),
+    ])
+
+
+  def test_range_multiple_suffix(self):
+    r = requests.get('http://127.0.0.1:8080/zero',
+          headers={'Range': 'bytes=0-0,-10'})
+
+    self.assertEqual(r.status_code, 206)
+    self.assertEqual(self.byteranges(r), [
+      ('bytes 0-0/32768', b'\0'),
+      ('bytes 32758-32767/32768', b'\0' * 10),
+    ])
+
+
+  def test_range_multiple_unsatisfiable_part(self):
+    r = requests.get('http://127.0.0.1:8080/zero',
+          headers={'Range': 'bytes=40000-40010,10-19'})
+
+    self.assertEqual(r.status_code, 206)
+    self.assertEqual(self.byteranges(r), [
+      ('bytes 10-19/32768', b'\0' * 10),
+    ])
+
+
+  def test_range_multiple_all_unsatisfiable(self):
+    r = requests.get('http://127.0.0.1:8080/zero',
+          headers={'Range': 'bytes=40000-40010,50000-'})
+
+    self.assertHttpResponseValid(r, 416, 'text/html')
+
+
+  def test_etag_is_strong(self):
+    r = requests.get('http://127.0.0.1:8080/100.html',
+          headers={'Accept-Encoding': 'foobar'})
+
+    self.assertResponseHtml(r)
+    self.assertTrue('etag' in r.headers)
+    self.assertTrue(r.headers['etag'].startswith('"'))
+    self.assertTrue(r.headers['etag'].endswith('"'))
+
+
+  def test_if_none_match(self):
+    r = requests.get('http://127.0.0.1:8080/100.html',
+          headers={'Accept-Encoding': 'foobar'})
+    etag = r.headers['etag']
+
+    for if_none_match in (etag, 'W/' + etag, '"foo", ' + etag, '*'):
+      r = requests.get('http://127.0.0.1:8080/100.html',
+            headers={'Accept-Encoding': 'foobar',
+                     'If-None-Match': if_none_match})
+
+      self.assertEqual(r.status_code, 304)
+      self.assertEqual(r.headers['etag'], etag)
+      self.assertEqual(r.content, b'')
+
+    r = requests.get('http://127.0.0.1:8080/100.html',
+          headers={'Accept-Encoding': 'foobar', 'If-None-Match': '"foo"'})
+
+    self.assertResponseHtml(r)
+    self.assertEqual(len(r.text), 100)
+
+
+  def test_if_none_match_takes_precedence_over_if_modified_since(self):
+    r = requests.get('http://127.0.0.1:8080/100.html',
+          headers={'Accept-Encoding': 'foobar',
+                   'If-None-Match': '"foo"',
+                   'If-Modified-Since': 'Fri, 01 Jan 2100 00:00:00 GMT'})
+
+    self.assertResponseHtml(r)
+
+
+  def test_if_match(self):
+    r = requests.get('http://127.0.0.1:8080/100.html',
+          headers={'Accept-Encoding': 'foobar'})
+    etag = r.headers['etag']
+
+    for if_match in (etag, '"foo", ' + etag, '*'):
+      r = requests.get('http://127.0.0.1:8080/100.html',
+            headers={'Accept-Encoding': 'foobar', 'If-Match': if_match})
+
+      self.assertResponseHtml(r)
+
+    # If-Match uses the strong comparison: weak tags never match
+    for if_match in ('"foo"', 'W/' + etag):
+      r = requests.get('http://127.0.0.1:8080/100.html',
+            headers={'Accept-Encoding': 'foobar', 'If-Match': if_match})
+
+      self.assertHttpResponseValid(r, 412, 'text/html')
+
+
   def test_slash_slash_slash_does_not_matter_404(self):
     r = requests.get('http://127.0.0.1:8080//////////etc/passwd')
 
@@ -448,6 +630,51 @@ class TestRedirect(LwanTest):
     self.assertTrue('location' in r.headers)
     self.assertEqual(r.headers['location'], 'http://lwan.ws')
 
+  def test_redirect_map(self):
+    table = (
+      ('/legacy/old-page.html', 301, '/hello?name=old-page'),
+      ('/legacy/old-page.html?foo=bar', 301, '/hello?name=old-page'),
+      ('/legacy/moved', 308, 'http://lwan.ws/moved'),
+      ('/legacy/found', 302, '/hello'),
+    )
+
+    for path, code, location in table:
+      r = requests.get('http://127.0.0.1:8080%s' % path, allow_redirects=False)
+
+      self.assertResponseHtml(r, code)
+      self.assertTrue('location' in r.headers)
+      self.assertEqual(r.headers['location'], location)
+
+  def test_redirect_map_unknown_path_yields_404(self):
+    r = requests.get('http://127.0.0.1:8080/legacy/old-page', allow_redirects=False)
+
+    self.assertResponse404(r)
+
+  def test_redirect_map_falls_back_to_to(self):
+    r = requests.get('http://127.0.0.1:8080/legacy-or-home/unknown',
+                     allow_redirects=False)
+
+    self.assertResponseHtml(r, 302)
+    self.assertEqual(r.headers['location'], '/hello')
+
+class TestMetrics(LwanTest):
+  def test_metrics(self):
+    requests.get('http://127.0.0.1:8080/hello')
+    r = requests.get('http://127.0.0.1:8080/metrics')
+
+    self.assertEqual(r.status_code, 200)
+    self.assertTrue(r.headers['content-type'].startswith('text/plain'))
+    self.assertTrue('# TYPE lwan_thread_requests_total counter' in r.text)
+    self.assertTrue('lwan_thread_requests_total{thread="0"}' in r.text)
+
+  def test_cache_metrics(self):
+    requests.get('http://127.0.0.1:8080/100.html')
+    r = requests.get('http://127.0.0.1:8080/metrics')
+
+    self.assertEqual(r.status_code, 200)
+    self.assertTrue('# TYPE lwan_cache_hits_total counter' in r.text)
+    self.assertTrue('lwan_cache_misses_total{cache="serve_files ' in r.text)
+
 class TestRewrite(LwanTest):
   def test_conditional_rewrite_with_cookie(self):
     for key in ('style', 'something-else', ''):
@@ -605,9 +832,15 @@ class TestMalformedRequests(SocketTest):
       self.assertHttpCode(sock, 400)
 
 
+  def test_request_larger_than_default_buffer(self):
+    # request_buffer_size is 1000000 in testrunner.conf
+    r = requests.get('http://127.0.0.1:8080/' + 'X' * 100000)
+
+    self.assertResponse404(r)
+
   def test_request_too_large(self):
     try:
-      r = requests.get('http://127.0.0.1:8080/' + 'X' * 100000)
+      r = requests.get('http://127.0.0.1:8080/' + 'X' * 1100000)
 
       self.assertResponseHtml(r, 413)
     except requests.exceptions.ChunkedEncodingError:
@@ -627,6 +860,248 @@ class TestChunkedEncoding(LwanTest):
       ''.join('*This is chunk %d*\n' % i for i in range(11)) +
       'Last chunk\n')
 
+class TestProxy(LwanTest):
+  class FakeUpstream:
+    # Answers every request, on its own connection, with a canned response,
+    # for what Lwan itself wouldn't send as an upstream.
+    def __init__(self, response, port=8097):
+      self._response = response
+      self._port = port
+      self.requests = 0
+
+    def _serve(self):
+      while not self._done:
+        try:
+          conn, _ = self._sock.accept()
+        except socket.timeout:
+          continue
+        with conn:
+          req = b''
+          while b'\r\n\r\n' not in req:
+            data = conn.recv(4096)
+            if not data:
+              break
+            req += data
+          self.requests += 1
+          conn.sendall(self._response)
+
+    def __enter__(self):
+      self._sock = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+      self._sock.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+      self._sock.bind(('127.0.0.1', self._port))
+      self._sock.listen(16)
+      self._sock.settimeout(0.1)
+      self._done = False
+      self._thread = threading.Thread(target=self._serve)
+      self._thread.start()
+      return self
+
+    def __exit__(self, type, value, traceback):
+      self._done = True
+      self._thread.join()
+      self._sock.close()
+
+  def test_unknown_status(self):
+    response = b'HTTP/1.1 299 Whatever\r\nConnection: close\r\n' \
+               b'Content-Type: text/plain\r\nContent-Length: 2\r\n\r\nok'
+    with TestProxy.FakeUpstream(response):
+      r = requests.get('http://127.0.0.1:8080/fake-upstream/')
+      self.assertHttpResponseValid(r, 299, 'text/plain')
+      self.assertEqual(r.text, 'ok')
+
+  def test_interim_responses_are_skipped(self):
+    response = b'HTTP/1.1 100 Continue\r\n\r\n' \
+               b'HTTP/1.1 103 Early Hints\r\nLink: </style.css>; rel=preload\r\n\r\n' \
+               b'HTTP/1.1 200 OK\r\nConnection: close\r\n' \
+               b'Content-Type: text/plain\r\nContent-Length: 5\r\n\r\nfinal'
+    with TestProxy.FakeUpstream(response):
+      r = requests.get('http://127.0.0.1:8080/fake-upstream/')
+      self.assertHttpResponseValid(r, 200, 'text/plain')
+      self.assertEqual(r.text, 'final')
+
+  def test_error_headers_are_forwarded(self):
+    response = b'HTTP/1.1 404 Not Found\r\nConnection: close\r\n' \
+               b'X-Upstream: fake\r\nLink: </other>; rel=alternate\r\n' \
+               b'Content-Type: text/plain\r\nContent-Length: 4\r\n\r\nnope'
+    with TestProxy.FakeUpstream(response):
+      r = requests.get('http://127.0.0.1:8080/fake-upstream/')
+      self.assertHttpResponseValid(r, 404, 'text/plain')
+      self.assertEqual(r.headers['x-upstream'], 'fake')
+      self.assertEqual(r.headers['link'], '</other>; rel=alternate')
+      self.assertEqual(r.text, 'nope')
+
+  def test_unreachable_upstream_without_health_checks(self):
+    # Nothing is listening on the first upstream yet, so all requests
+    # are served by the other one.
+    for i in range(4):
+      r = requests.get('http://127.0.0.1:8080/fallback-upstream/hello')
+      self.assertResponsePlain(r)
+      self.assertEqual(r.text, 'Hello, world!')
+
+    # There are no health checks to bring it back, so it has to stay in
+    # rotation once it's reachable again.
+    response = b'HTTP/1.1 200 OK\r\nConnection: close\r\n' \
+               b'Content-Type: text/plain\r\nContent-Length: 4\r\n\r\nfake'
+    with TestProxy.FakeUpstream(response) as upstream:
+      for i in range(4):
+        requests.get('http://127.0.0.1:8080/fallback-upstream/hello')
+      self.assertGreater(upstream.requests, 0)
+
+  def test_hello(self):
+    r = requests.get('http://localhost:8080/upstream/hello?name=proxy')
+    self.assertResponsePlain(r)
+    self.assertEqual(r.text, 'Hello, proxy!')
+
+  def test_chunked_encoding(self):
+    r = requests.get('http://localhost:8080/upstream/chunked')
+    self.assertResponsePlain(r)
+    self.assertEqual(r.text,
+      'Testing chunked encoding! First chunk\n' +
+      ''.join('*This is chunk %d*\n' % i for i in range(11)) +
+      'Last chunk\n')
+
+  def test_post(self):
+    r = requests.post('http://127.0.0.1:8080/upstream/post/blend', json={'will-it-blend': True})
+    self.assertHttpResponseValid(r, 200, 'application/json')
+    self.assertEqual(r.json(), {'did-it-blend': 'oh-hell-yeah'})
+
+  def test_not_found(self):
+    r = requests.get('http://localhost:8080/upstream/this-does-not-exist')
+    self.assertEqual(r.status_code, 404)
+
+class TestResponseCache(LwanTest):
+  def get(self, query='', headers={}):
+    r = requests.get('http://127.0.0.1:8080/cached/thing' + query, headers=headers)
+    self.assertResponsePlain(r)
+    return r.text
+
+  def test_hit(self):
+    first = self.get()
+    self.assertEqual(self.get(), first)
+    self.assertNotEqual(self.get('?other=1'), first)
+
+  def test_authorization_is_not_cached(self):
+    first = self.get()
+    self.assertNotEqual(self.get(headers={'Authorization': 'Basic Zm9vOmJhcg=='}), first)
+    self.assertEqual(self.get(), first)
+
+  def test_cache_control(self):
+    for directive in ('no-store', 'no-cache', 'private'):
+      query = '?cc=' + directive
+      self.assertNotEqual(self.get(query), self.get(query))
+
+    query = '?cc=max-age%3D60'
+    self.assertEqual(self.get(query), self.get(query))
+
+  def test_cache_control_max_age(self):
+    query = '?cc=max-age%3D1'
+    first = self.get(query)
+    self.assertEqual(self.get(query), first)
+    time.sleep(2.1)
+    self.assertNotEqual(self.get(query), first)
+
+  def test_vary(self):
+    query = '?vary=X-Flavor'
+    vanilla = self.get(query, {'X-Flavor': 'vanilla'})
+    chocolate = self.get(query, {'X-Flavor': 'chocolate'})
+
+    self.assertTrue(vanilla.endswith('flavor vanilla'))
+    self.assertTrue(chocolate.endswith('flavor chocolate'))
+    self.assertEqual(self.get(query, {'X-Flavor': 'vanilla'}), vanilla)
+    self.assertEqual(self.get(query, {'X-Flavor': 'chocolate'}), chocolate)
+
+  def test_vary_not_in_key(self):
+    # X-Topping isn't in the `vary` setting, so this can't be cached
+    query = '?vary=X-Topping'
+    self.assertNotEqual(self.get(query), self.get(query))
+
+  def test_hit_for_pass(self):
+    # Once a response couldn't be cached, requests for it go straight to
+    # the handler for a while, rather than waiting for each other.
+    query = '?cc=no-store&sleep=500'
+    self.get(query)
+
+    results = []
+    threads = [threading.Thread(target=lambda: results.append(self.get(query)))
+               for i in range(2)]
+    began = time.monotonic()
+    for t in threads:
+      t.start()
+    for t in threads:
+      t.join()
+
+    self.assertLess(time.monotonic() - began, 0.9)
+    self.assertEqual(len(set(results)), 2)
+
+  def test_stale_while_revalidate(self):
+    query = '?cc=max-age%3D1%2C+stale-while-revalidate%3D30&sleep=500'
+    stale = self.get(query)
+    time.sleep(1.1)
+
+    # The first request after the response went stale runs the handler
+    # again, while others get the stale response right away.
+    revalidated = []
+    revalidator = threading.Thread(target=lambda: revalidated.append(self.get(query)))
+    revalidator.start()
+    time.sleep(0.1)
+
+    began = time.monotonic()
+    self.assertEqual(self.get(query), stale)
+    self.assertLess(time.monotonic() - began, 0.3)
+
+    revalidator.join()
+    self.assertNotEqual(revalidated[0], stale)
+    self.assertEqual(self.get(query), revalidated[0])
+
+
+class TestRateLimit(LwanTest):
+  def limited_get(self, session, client):
+    return session.get('http://127.0.0.1:8080/limited',
+                       headers={'X-Client': client})
+
+
+  def test_requests_past_burst_are_limited(self):
+    with requests.Session() as s:
+      for _ in range(3):
+        r = self.limited_get(s, 'burst')
+
+        self.assertResponsePlain(r)
+        self.assertEqual(r.text, 'Hello, world!')
+
+      r = self.limited_get(s, 'burst')
+
+      self.assertEqual(r.status_code, 429)
+      self.assertTrue('retry-after' in r.headers)
+      self.assertGreater(int(r.headers['retry-after']), 0)
+      self.assertLessEqual(int(r.headers['retry-after']), 3600)
+
+
+  def test_clients_have_their_own_buckets(self):
+    with requests.Session() as s:
+      for _ in range(4):
+        self.limited_get(s, 'greedy')
+
+      r = self.limited_get(s, 'greedy')
+      self.assertEqual(r.status_code, 429)
+
+      r = self.limited_get(s, 'frugal')
+      self.assertResponsePlain(r)
+
+
+  def test_clients_that_dont_fit_are_limited(self):
+    # A single connection, so that both requests are handled by the same
+    # shard of buckets.
+    with requests.Session() as s:
+      r = s.get('http://127.0.0.1:8080/limited_keys',
+                headers={'X-Client': 'first'})
+      self.assertResponsePlain(r)
+
+      r = s.get('http://127.0.0.1:8080/limited_keys',
+                headers={'X-Client': 'second'})
+      self.assertEqual(r.status_code, 429)
+      self.assertTrue('retry-after' in r.headers)
+
+
 class TestLua(LwanTest):
   def test_brew_coffee(self):
     r = requests.get('http://127.0.0.1:8080/lua/brew_coffee')
@@ -707,6 +1182,23 @@ class TestAuthentication(LwanTest):
 
       self.assertEqual(r.text, 'Hello, world!')
 
+  # sha512crypt of "test123"
+  password_hash = '$6$lwansalt$zvMADV52a.XfOPTpmbV.BosJjIpS8dkyqq9ObzVUKddbOjWlB8UOwZTTxxarS60GdeecyEKHLpCKRGcg/KWck1'
+
+  def test_valid_creds_with_password_hash(self):
+    with TestAuthentication.TempHtpasswd({'foo': 'bar', 'foobar': self.password_hash}):
+      for _ in range(2):
+        r = requests.get('http://127.0.0.1:8080/admin', auth=requests.auth.HTTPBasicAuth('foobar', 'test123'))
+        self.assertResponsePlain(r)
+        self.assertEqual(r.text, 'Hello, world!')
+
+  def test_invalid_creds_with_password_hash(self):
+    with TestAuthentication.TempHtpasswd({'foo': 'bar', 'foobar': self.password_hash}):
+      # Failures are cached too; make sure they stay failures
+      for _ in range(2):
+        r = requests.get('http://127.0.0.1:8080/admin', auth=requests.auth.HTTPBasicAuth('foobar', 'test124'))
+        self.assertResponseHtml(r, status_code=401)
+
 
 class TestHelloWorld(LwanTest):
   def test_request_id(self):
@@ -793,6 +1285,15 @@ class TestHelloWorld(LwanTest):
     self.assertEqual(r.text, 'Hello, testsuite!')
 
 
+  def test_with_encoded_param(self):
+    r = requests.get('http://127.0.0.1:8080/hello?name=a%2Bb+c%26d%3De&dump_vars=1')
+
+    self.assertResponsePlain(r)
+
+    self.assertTrue(r.text.startswith('Hello, a+b c&d=e!'))
+    self.assertTrue('Key = "name"; Value = "a+b c&d=e"\n' in r.text)
+
+
   def test_with_param_and_fragment(self):
     r = requests.get('http://127.0.0.1:8080/hello?name=testsuite#fragment')
 
@@ -966,12 +1467,130 @@ Accept: text/plain,text/html;q=0.9,application/xhtml+xml;q=0.9,application/xml;q
       responses = responses.replace(s, '')
 
 
+class TestHTTP2(SocketTest):
+  preface = b'PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n'
+
+  def frame(self, frame_type, flags, stream_id, payload=b''):
+    return struct.pack('>I', len(payload))[1:] + \
+      struct.pack('>BBI', frame_type, flags, stream_id) + payload
+
+  def literal(self, name_index, value):
+    # Literal header field without indexing, indexed name, no Huffman
+    return bytes([name_index, len(value)]) + value
+
+  def read_frames(self, sock, stream_id):
+    buf = b''
+    frames = []
+    while True:
+      while len(buf) >= 9:
+        length = int.from_bytes(buf[:3], 'big')
+        if len(buf) < 9 + length:
+          break
+        frame_type, flags, sid = struct.unpack('>BBI', buf[3:9])
+        frames.append((frame_type, flags, sid & 0x7fffffff, buf[9:9 + length]))
+        buf = buf[9 + length:]
+        if sid == stream_id and flags & 0x1 and frame_type in (0x0, 0x1):
+          return frames
+        if frame_type in (0x3, 0x7):
+          return frames
+      data = sock.recv(4096)
+      if not data:
+        return frames
+      buf += data
+
+  def request(self, sock, stream_id, path, end_stream=True):
+    # :method GET, :scheme http, :path, :authority
+    headers = b'\x82\x86' + self.literal(4, path) + \
+      self.literal(1, b'localhost')
+    flags = 0x4 | (0x1 if end_stream else 0)
+    return self.frame(0x1, flags, stream_id, headers)
+
+  def test_prior_knowledge(self):
+    with self.connect() as sock:
+      sock._wrapped_sock.send(self.preface + self.frame(0x4, 0, 0) +
+                              self.request(sock, 1, b'/hello?name=h2'))
+      frames = self.read_frames(sock._wrapped_sock, 1)
+
+    headers = [f for f in frames if f[0] == 0x1 and f[2] == 1]
+    self.assertEqual(len(headers), 1)
+    # Indexed ":status: 200" from the static table
+    self.assertEqual(headers[0][3][0], 0x88)
+
+    data = b''.join(f[3] for f in frames if f[0] == 0x0 and f[2] == 1)
+    self.assertEqual(data, b'Hello, h2!')
+
+  def test_multiple_streams(self):
+    names = [b'stream%d' % i for i in range(1, 16, 2)]
+    with self.connect() as sock:
+      reqs = b''.join(self.request(sock, i, b'/hello?name=' + name)
+                      for i, name in zip(range(1, 16, 2), names))
+      sock._wrapped_sock.send(self.preface + self.frame(0x4, 0, 0) + reqs)
+      frames = self.read_frames(sock._wrapped_sock, 15)
+
+    for i, name in zip(range(1, 16, 2), names):
+      data = b''.join(f[3] for f in frames if f[0] == 0x0 and f[2] == i)
+      self.assertEqual(data, b'Hello, ' + name + b'!')
+
+  def test_headers_before_settings_is_an_error(self):
+    with self.connect() as sock:
+      sock._wrapped_sock.send(self.preface + self.request(sock, 1, b'/hello'))
+      frames = self.read_frames(sock._wrapped_sock, 1)
+
+    goaway = [f for f in frames if f[0] == 0x7]
+    self.assertEqual(len(goaway), 1)
+    # PROTOCOL_ERROR
+    self.assertEqual(goaway[0][3][4:8], b'\x00\x00\x00\x01')
+
+
 class TestArtificialResponse(LwanTest):
   def test_brew_coffee(self):
     r = requests.get('http://127.0.0.1:8080/brew-coffee')
 
     self.assertEqual(r.status_code, 418)
 
+  def test_fixed_body(self):
+    r = requests.get('http://127.0.0.1:8080/fixed-body')
+
+    self.assertResponsePlain(r, 201)
+    self.assertEqual(r.text, 'Fixed response')
+    self.assertEqual(r.headers['content-length'], '14')
+    self.assertTrue('expires' in r.headers)
+
+  def test_prerendered_body(self):
+    with requests.Session() as s:
+      for _ in range(3):
+        r = s.get('http://127.0.0.1:8080/prerendered')
+
+        self.assertResponseHtml(r, 202)
+        self.assertEqual(r.text, '<p>OK</p>')
+        self.assertEqual(r.headers['content-length'], '9')
+        self.assertEqual(r.headers['x-global-header'], 'present')
+        self.assertTrue('date' in r.headers)
+        self.assertFalse('expires' in r.headers)
+
+  def test_prerendered_body_http1_0(self):
+    with socket.create_connection(('127.0.0.1', 8080)) as sock:
+      sock.sendall(b'GET /prerendered HTTP/1.0\r\n\r\n')
+
+      response = b''
+      while True:
+        data = sock.recv(1024)
+        if not data:
+          break
+        response += data
+
+    head, body = response.split(b'\r\n\r\n', 1)
+    self.assertTrue(head.startswith(b'HTTP/1.0 202 Accepted\r\n'))
+    self.assertTrue(b'\r\nConnection: close\r\n' in head)
+    self.assertEqual(body, b'<p>OK</p>')
+
+  def test_prerendered_body_without_date(self):
+    r = requests.get('http://127.0.0.1:8080/prerendered-without-date')
+
+    self.assertResponsePlain(r)
+    self.assertEqual(r.text, 'Fixed response')
+    self.assertFalse('date' in r.headers)
+
 
 class TestSleep(LwanTest):
   def test_sleep(self):